@@ -144,6 +144,24 @@ void aio_set_event_notifier(AioContext *ctx,
     aio_notify(ctx);
 }
 
+void aio_context_setup(AioContext *ctx)
+{
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+}
+
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     static struct timeval tv0;
@@ -25,6 +25,8 @@
 #include "qemu-common.h"
 #include "block/aio.h"
 #include "block/thread-pool.h"
+#include "block/buffer-pool.h"
+#include "block/raw-aio.h"
 #include "qemu/main-loop.h"
 #include "qemu/atomic.h"
 
@@ -234,6 +236,28 @@ aio_ctx_finalize(GSource     *source)
 
     qemu_bh_delete(ctx->notify_dummy_bh);
     thread_pool_free(ctx->thread_pool);
+    buffer_pool_free(ctx->buffer_pool);
+
+#ifdef CONFIG_LINUX_AIO
+    if (ctx->linux_aio) {
+        laio_detach_aio_context(ctx->linux_aio, ctx);
+        laio_cleanup(ctx->linux_aio);
+        ctx->linux_aio = NULL;
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    {
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(ctx->linux_io_uring); i++) {
+            if (ctx->linux_io_uring[i]) {
+                luring_detach_aio_context(ctx->linux_io_uring[i], ctx);
+                luring_cleanup(ctx->linux_io_uring[i]);
+                ctx->linux_io_uring[i] = NULL;
+            }
+        }
+    }
+#endif
 
     qemu_mutex_lock(&ctx->bh_lock);
     while (ctx->first_bh) {
@@ -249,6 +273,7 @@ aio_ctx_finalize(GSource     *source)
 
     aio_set_event_notifier(ctx, &ctx->notifier, NULL);
     event_notifier_cleanup(&ctx->notifier);
+    aio_context_destroy(ctx);
     rfifolock_destroy(&ctx->lock);
     qemu_mutex_destroy(&ctx->bh_lock);
     timerlistgroup_deinit(&ctx->tlg);
@@ -271,10 +296,149 @@ ThreadPool *aio_get_thread_pool(AioContext *ctx)
 {
     if (!ctx->thread_pool) {
         ctx->thread_pool = thread_pool_new(ctx);
+        thread_pool_set_limits(ctx->thread_pool, ctx->thread_pool_min,
+                               ctx->thread_pool_max);
     }
     return ctx->thread_pool;
 }
 
+BufferPool *aio_get_buffer_pool(AioContext *ctx)
+{
+    if (!ctx->buffer_pool) {
+        ctx->buffer_pool = buffer_pool_new();
+    }
+    return ctx->buffer_pool;
+}
+
+void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
+                                        int64_t max, Error **errp)
+{
+    if (max < 1 || max > THREAD_POOL_MAX_WORKERS) {
+        error_setg(errp, "thread pool maximum must be between 1 and %d",
+                   THREAD_POOL_MAX_WORKERS);
+        return;
+    }
+    if (min < 0 || min > max) {
+        error_setg(errp, "thread pool minimum must be between 0 and the "
+                   "maximum (%" PRId64 ")", max);
+        return;
+    }
+
+    ctx->thread_pool_min = min;
+    ctx->thread_pool_max = max;
+    if (ctx->thread_pool) {
+        thread_pool_set_limits(ctx->thread_pool, min, max);
+    }
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    if (max_ns < 0 || grow < 0 || shrink < 0) {
+        error_setg(errp, "polling parameters must not be negative");
+        return;
+    }
+
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
+
+#ifdef CONFIG_LINUX_AIO
+struct qemu_laio_state *aio_get_linux_aio(AioContext *ctx)
+{
+    if (!ctx->linux_aio) {
+        ctx->linux_aio = laio_init();
+        if (ctx->linux_aio) {
+            int i;
+
+            laio_attach_aio_context(ctx->linux_aio, ctx);
+            for (i = 0; i < ctx->io_plugged; i++) {
+                laio_io_plug(NULL, ctx->linux_aio);
+            }
+        }
+    }
+    return ctx->linux_aio;
+}
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+struct qemu_luring_state *aio_get_linux_io_uring(AioContext *ctx, bool sqpoll,
+                                                 Error **errp)
+{
+    if (!ctx->linux_io_uring[sqpoll]) {
+        ctx->linux_io_uring[sqpoll] = luring_init(sqpoll, errp);
+        if (ctx->linux_io_uring[sqpoll]) {
+            int i;
+
+            luring_attach_aio_context(ctx->linux_io_uring[sqpoll], ctx);
+            for (i = 0; i < ctx->io_plugged; i++) {
+                luring_io_plug(NULL, ctx->linux_io_uring[sqpoll]);
+            }
+        }
+    }
+    return ctx->linux_io_uring[sqpoll];
+}
+#endif
+
+void aio_context_io_plug(AioContext *ctx)
+{
+    ctx->io_plugged++;
+#ifdef CONFIG_LINUX_AIO
+    if (ctx->linux_aio) {
+        laio_io_plug(NULL, ctx->linux_aio);
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    {
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(ctx->linux_io_uring); i++) {
+            if (ctx->linux_io_uring[i]) {
+                luring_io_plug(NULL, ctx->linux_io_uring[i]);
+            }
+        }
+    }
+#endif
+}
+
+/* With @unplug false, submit whatever is queued without ending the plug
+ * section, like bdrv_flush_io_queue() does */
+static void aio_context_do_unplug(AioContext *ctx, bool unplug)
+{
+#ifdef CONFIG_LINUX_AIO
+    if (ctx->linux_aio) {
+        laio_io_unplug(NULL, ctx->linux_aio, unplug);
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    {
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(ctx->linux_io_uring); i++) {
+            if (ctx->linux_io_uring[i]) {
+                luring_io_unplug(NULL, ctx->linux_io_uring[i], unplug);
+            }
+        }
+    }
+#endif
+}
+
+void aio_context_io_unplug(AioContext *ctx)
+{
+    assert(ctx->io_plugged > 0);
+    ctx->io_plugged--;
+    aio_context_do_unplug(ctx, true);
+}
+
+void aio_context_io_flush(AioContext *ctx)
+{
+    aio_context_do_unplug(ctx, false);
+}
+
 void aio_notify(AioContext *ctx)
 {
     /* Write e.g. bh->scheduled before reading ctx->notify_me.  Pairs
@@ -321,8 +485,10 @@ AioContext *aio_context_new(Error **errp)
     int ret;
     AioContext *ctx;
     ctx = (AioContext *) g_source_new(&aio_source_funcs, sizeof(AioContext));
+    aio_context_setup(ctx);
     ret = event_notifier_init(&ctx->notifier, false);
     if (ret < 0) {
+        aio_context_destroy(ctx);
         g_source_destroy(&ctx->source);
         error_setg_errno(errp, -ret, "Failed to initialize event notifier");
         return NULL;
@@ -332,6 +498,26 @@ AioContext *aio_context_new(Error **errp)
                            (EventNotifierHandler *)
                            event_notifier_dummy_cb);
     ctx->thread_pool = NULL;
+    ctx->buffer_pool = NULL;
+    ctx->thread_pool_min = THREAD_POOL_DEFAULT_MIN_THREADS;
+    ctx->thread_pool_max = THREAD_POOL_DEFAULT_MAX_THREADS;
+    ctx->poll_ns = 0;
+    ctx->poll_max_ns = 0;
+    ctx->poll_grow = 0;
+    ctx->poll_shrink = 0;
+    ctx->poll_attempts = 0;
+    ctx->poll_successes = 0;
+    ctx->idle_ns = 0;
+    ctx->busy_ns = 0;
+    ctx->wakeups = 0;
+    ctx->dispatched = 0;
+#ifdef CONFIG_LINUX_AIO
+    ctx->linux_aio = NULL;
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    memset(ctx->linux_io_uring, 0, sizeof(ctx->linux_io_uring));
+#endif
+    ctx->io_plugged = 0;
     qemu_mutex_init(&ctx->bh_lock);
     rfifolock_init(&ctx->lock, aio_rfifolock_cb, ctx);
     timerlistgroup_init(&ctx->tlg, aio_timerlist_notify, ctx);
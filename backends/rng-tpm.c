@@ -0,0 +1,381 @@
+/*
+ * QEMU Random Number Generator Backend using a TPM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "sysemu/rng.h"
+#include "sysemu/tpm_backend.h"
+#include "qapi/qmp/qerror.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+
+#define TYPE_RNG_TPM "rng-tpm"
+#define RNG_TPM(obj) OBJECT_CHECK(RngTpm, (obj), TYPE_RNG_TPM)
+
+/* random bytes kept ready for the frontend */
+#define RNG_TPM_BUFFER_SIZE     4096
+
+/* bytes asked for per GetRandom; the TPM may return fewer */
+#define RNG_TPM_CHUNK_SIZE      128
+
+/* delay before asking again after the TPM failed a GetRandom */
+#define RNG_TPM_RETRY_MS        1000
+
+#define RNG_TPM_CMD_SIZE        14
+#define RNG_TPM_RSP_SIZE        (16 + RNG_TPM_CHUNK_SIZE)
+
+typedef struct RngTpmRequest {
+    EntropyReceiveFunc *receive_entropy;
+    void *opaque;
+    size_t size;
+} RngTpmRequest;
+
+typedef struct RngTpm {
+    RngBackend parent;
+
+    char *tpmdev;
+    TPMBackend *tpm;
+    bool tpm_missing;       /* reported that tpmdev does not exist */
+
+    /* requests of the frontend not served yet */
+    GSList *requests;
+
+    /* random bytes from the TPM; only used in the main loop */
+    uint8_t buffer[RNG_TPM_BUFFER_SIZE];
+    size_t head;
+    size_t count;
+
+    /* a GetRandom is queued on the TPM backend; holds a reference */
+    bool refilling;
+    uint8_t cmd[RNG_TPM_CMD_SIZE];
+    uint8_t rsp[RNG_TPM_RSP_SIZE];
+
+    /* result of the GetRandom, passed from the TPM backend's worker */
+    QemuMutex lock;
+    bool done;
+    int ret;
+
+    QEMUBH *bh;
+    QEMUTimer *retry_timer;
+    bool retry_pending;
+} RngTpm;
+
+/**
+ * A backend that gets entropy from the random number generator of a
+ * TPM. Rather than asking for a few bytes whenever the frontend wants
+ * some, it keeps a buffer filled with GetRandom commands of a useful
+ * size. These are queued behind the commands of the guest that owns
+ * the TPM, one at a time, so they do not hold up the guest for long.
+ *
+ * The "tpmdev" property names the TPM backend to use.
+ */
+
+static void rng_tpm_build_cmd(RngTpm *s)
+{
+    uint32_t len;
+
+    if (tpm_backend_get_tpm_version(s->tpm) == TPM_VERSION_2_0) {
+        /* TPM_ST_NO_SESSIONS, TPM2_CC_GetRandom, bytesRequested */
+        len = 12;
+        stw_be_p(&s->cmd[0], 0x8001);
+        stl_be_p(&s->cmd[6], 0x17b);
+        stw_be_p(&s->cmd[10], RNG_TPM_CHUNK_SIZE);
+    } else {
+        /* TPM_TAG_RQU_COMMAND, TPM_ORD_GetRandom, bytesRequested */
+        len = 14;
+        stw_be_p(&s->cmd[0], 0xc1);
+        stl_be_p(&s->cmd[6], 0x46);
+        stl_be_p(&s->cmd[10], RNG_TPM_CHUNK_SIZE);
+    }
+    stl_be_p(&s->cmd[2], len);
+}
+
+/* Returns the random bytes in the response and their number. */
+static const uint8_t *rng_tpm_parse_rsp(RngTpm *s, int len, size_t *size)
+{
+    const uint8_t *data;
+    uint32_t n;
+
+    *size = 0;
+    if (len < 10 || ldl_be_p(&s->rsp[6]) != 0) {
+        return NULL;
+    }
+
+    if (tpm_backend_get_tpm_version(s->tpm) == TPM_VERSION_2_0) {
+        /* TPM2B_DIGEST randomBytes */
+        if (len < 12) {
+            return NULL;
+        }
+        n = lduw_be_p(&s->rsp[10]);
+        data = &s->rsp[12];
+    } else {
+        /* randomBytesSize, randomBytes */
+        if (len < 14) {
+            return NULL;
+        }
+        n = ldl_be_p(&s->rsp[10]);
+        data = &s->rsp[14];
+    }
+
+    if (n > len - (data - s->rsp)) {
+        return NULL;
+    }
+    *size = n;
+
+    return data;
+}
+
+/* Called from the worker of the TPM backend. */
+static void rng_tpm_cmd_done(void *opaque, int ret)
+{
+    RngTpm *s = opaque;
+
+    qemu_mutex_lock(&s->lock);
+    s->done = true;
+    s->ret = ret;
+    qemu_mutex_unlock(&s->lock);
+
+    qemu_bh_schedule(s->bh);
+}
+
+static void rng_tpm_refill(RngTpm *s)
+{
+    int ret;
+
+    if (s->refilling || s->retry_pending ||
+        s->count > RNG_TPM_BUFFER_SIZE - RNG_TPM_CHUNK_SIZE) {
+        return;
+    }
+
+    if (!s->tpm) {
+        s->tpm = qemu_find_tpm(s->tpmdev);
+        if (!s->tpm) {
+            if (!s->tpm_missing) {
+                error_report("rng-tpm: TPM device '%s' not found",
+                             s->tpmdev);
+                s->tpm_missing = true;
+            }
+            return;
+        }
+    }
+
+    rng_tpm_build_cmd(s);
+
+    s->refilling = true;
+    object_ref(OBJECT(s));
+
+    ret = tpm_backend_execute_cmd(s->tpm, 0, s->cmd, ldl_be_p(&s->cmd[2]),
+                                  s->rsp, sizeof(s->rsp),
+                                  rng_tpm_cmd_done, s);
+    if (ret < 0) {
+        s->refilling = false;
+        object_unref(OBJECT(s));
+        if (ret == -ENOTSUP) {
+            error_report("rng-tpm: TPM device '%s' cannot be used as a "
+                         "random number generator", s->tpmdev);
+            return;
+        }
+        /* e.g. the TPM has not been started up yet */
+        s->retry_pending = true;
+        timer_mod(s->retry_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + RNG_TPM_RETRY_MS);
+    }
+}
+
+static void rng_tpm_serve(RngTpm *s)
+{
+    RngTpmRequest *req;
+    size_t len;
+
+    while (s->requests && s->count > 0) {
+        req = s->requests->data;
+        s->requests = g_slist_remove_link(s->requests, s->requests);
+
+        /* do not wrap around, the frontend may be passed less than asked */
+        len = MIN(req->size, s->count);
+        len = MIN(len, RNG_TPM_BUFFER_SIZE - s->head);
+
+        req->receive_entropy(req->opaque, &s->buffer[s->head], len);
+        g_free(req);
+
+        s->head = (s->head + len) % RNG_TPM_BUFFER_SIZE;
+        s->count -= len;
+    }
+}
+
+static void rng_tpm_bh(void *opaque)
+{
+    RngTpm *s = opaque;
+    const uint8_t *data;
+    size_t size, tail, len;
+    bool done;
+    int ret;
+
+    qemu_mutex_lock(&s->lock);
+    done = s->done;
+    ret = s->ret;
+    s->done = false;
+    qemu_mutex_unlock(&s->lock);
+
+    if (done) {
+        data = rng_tpm_parse_rsp(s, ret, &size);
+        if (!data) {
+            s->retry_pending = true;
+            timer_mod(s->retry_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                                      RNG_TPM_RETRY_MS);
+        }
+        size = MIN(size, RNG_TPM_BUFFER_SIZE - s->count);
+        while (size > 0) {
+            tail = (s->head + s->count) % RNG_TPM_BUFFER_SIZE;
+            len = MIN(size, RNG_TPM_BUFFER_SIZE - tail);
+            memcpy(&s->buffer[tail], data, len);
+            s->count += len;
+            data += len;
+            size -= len;
+        }
+        s->refilling = false;
+    }
+
+    rng_tpm_serve(s);
+    rng_tpm_refill(s);
+
+    if (done) {
+        /* may finalize the backend */
+        object_unref(OBJECT(s));
+    }
+}
+
+static void rng_tpm_retry(void *opaque)
+{
+    RngTpm *s = opaque;
+
+    s->retry_pending = false;
+    rng_tpm_refill(s);
+}
+
+static void rng_tpm_request_entropy(RngBackend *b, size_t size,
+                                    EntropyReceiveFunc *receive_entropy,
+                                    void *opaque)
+{
+    RngTpm *s = RNG_TPM(b);
+    RngTpmRequest *req;
+
+    req = g_new(RngTpmRequest, 1);
+    req->receive_entropy = receive_entropy;
+    req->opaque = opaque;
+    req->size = size;
+    s->requests = g_slist_append(s->requests, req);
+
+    /* the frontend does not expect to be called back right away */
+    qemu_bh_schedule(s->bh);
+}
+
+static void rng_tpm_free_requests(RngTpm *s)
+{
+    GSList *i;
+
+    for (i = s->requests; i; i = i->next) {
+        g_free(i->data);
+    }
+
+    g_slist_free(s->requests);
+    s->requests = NULL;
+}
+
+static void rng_tpm_cancel_requests(RngBackend *b)
+{
+    RngTpm *s = RNG_TPM(b);
+
+    rng_tpm_free_requests(s);
+}
+
+static void rng_tpm_opened(RngBackend *b, Error **errp)
+{
+    RngTpm *s = RNG_TPM(b);
+
+    /*
+     * The TPM backends are created after the objects, so it may only be
+     * looked up when the first request comes in.
+     */
+    if (s->tpmdev == NULL) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "tpmdev", "a valid TPM device");
+    }
+}
+
+static char *rng_tpm_get_tpmdev(Object *obj, Error **errp)
+{
+    RngTpm *s = RNG_TPM(obj);
+
+    return g_strdup(s->tpmdev);
+}
+
+static void rng_tpm_set_tpmdev(Object *obj, const char *value, Error **errp)
+{
+    RngBackend *b = RNG_BACKEND(obj);
+    RngTpm *s = RNG_TPM(obj);
+
+    if (b->opened) {
+        error_setg(errp, QERR_PERMISSION_DENIED);
+        return;
+    }
+
+    g_free(s->tpmdev);
+    s->tpmdev = g_strdup(value);
+}
+
+static void rng_tpm_init(Object *obj)
+{
+    RngTpm *s = RNG_TPM(obj);
+
+    object_property_add_str(obj, "tpmdev",
+                            rng_tpm_get_tpmdev, rng_tpm_set_tpmdev,
+                            NULL);
+
+    qemu_mutex_init(&s->lock);
+    s->bh = qemu_bh_new(rng_tpm_bh, s);
+    s->retry_timer = timer_new_ms(QEMU_CLOCK_REALTIME, rng_tpm_retry, s);
+}
+
+static void rng_tpm_finalize(Object *obj)
+{
+    RngTpm *s = RNG_TPM(obj);
+
+    /* a queued GetRandom holds a reference, so none is pending here */
+    timer_del(s->retry_timer);
+    timer_free(s->retry_timer);
+    qemu_bh_delete(s->bh);
+    qemu_mutex_destroy(&s->lock);
+
+    rng_tpm_free_requests(s);
+    g_free(s->tpmdev);
+}
+
+static void rng_tpm_class_init(ObjectClass *klass, void *data)
+{
+    RngBackendClass *rbc = RNG_BACKEND_CLASS(klass);
+
+    rbc->request_entropy = rng_tpm_request_entropy;
+    rbc->cancel_requests = rng_tpm_cancel_requests;
+    rbc->opened = rng_tpm_opened;
+}
+
+static const TypeInfo rng_tpm_info = {
+    .name = TYPE_RNG_TPM,
+    .parent = TYPE_RNG_BACKEND,
+    .instance_size = sizeof(RngTpm),
+    .class_init = rng_tpm_class_init,
+    .instance_init = rng_tpm_init,
+    .instance_finalize = rng_tpm_finalize,
+};
+
+static void register_types(void)
+{
+    type_register_static(&rng_tpm_info);
+}
+
+type_init(register_types);
@@ -16,7 +16,11 @@
 #include "qapi/qmp/qerror.h"
 #include "sysemu/tpm.h"
 #include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+#include "qemu/bswap.h"
 #include "sysemu/tpm_backend_int.h"
+#include "qemu/mem-usage.h"
 
 enum TpmType tpm_backend_get_type(TPMBackend *s)
 {
@@ -65,8 +69,16 @@ bool tpm_backend_had_startup_error(TPMBackend *s)
 size_t tpm_backend_realloc_buffer(TPMBackend *s, TPMSizedBuffer *sb)
 {
     TPMBackendClass *k = TPM_BACKEND_GET_CLASS(s);
-
-    return k->ops->realloc_buffer(sb);
+    uint32_t old_size = sb->buffer ? sb->size : 0;
+    size_t size;
+
+    size = k->ops->realloc_buffer(sb);
+    if (!old_size) {
+        qemu_mem_usage_alloc(MEMORY_USAGE_SUBSYSTEM_TPM, size);
+    } else {
+        qemu_mem_usage_resize(MEMORY_USAGE_SUBSYSTEM_TPM, old_size, size);
+    }
+    return size;
 }
 
 void tpm_backend_deliver_request(TPMBackend *s)
@@ -111,6 +123,172 @@ TPMVersion tpm_backend_get_tpm_version(TPMBackend *s)
     return k->ops->get_tpm_version(s);
 }
 
+uint32_t tpm_backend_get_queue_depth(TPMBackend *s, uint8_t locty)
+{
+    TPMBackendClass *k = TPM_BACKEND_GET_CLASS(s);
+
+    if (!k->ops->get_queue_depth) {
+        return 0;
+    }
+    return k->ops->get_queue_depth(s, locty);
+}
+
+bool tpm_backend_get_cache_stats(TPMBackend *s, uint64_t *hits,
+                                 uint64_t *misses)
+{
+    TPMBackendClass *k = TPM_BACKEND_GET_CLASS(s);
+
+    if (!k->ops->get_cache_stats) {
+        return false;
+    }
+    return k->ops->get_cache_stats(s, hits, misses);
+}
+
+int tpm_backend_execute_cmd(TPMBackend *s, uint8_t locty,
+                            const uint8_t *in, uint32_t in_len,
+                            uint8_t *out, uint32_t out_len,
+                            TPMCmdDoneCB *cb, void *opaque)
+{
+    TPMBackendClass *k = TPM_BACKEND_GET_CLASS(s);
+
+    if (!k->ops->execute_cmd) {
+        return -ENOTSUP;
+    }
+    return k->ops->execute_cmd(s, locty, in, in_len, out, out_len, cb, opaque);
+}
+
+/* statistics */
+
+#define TPM_BACKEND_STATS_BUCKETS 16
+
+typedef struct TPMBackendCmdStats {
+    uint32_t ordinal;
+    uint64_t count;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t queue_hist[TPM_BACKEND_STATS_BUCKETS];
+    uint64_t exec_hist[TPM_BACKEND_STATS_BUCKETS];
+    uint64_t fetch_hist[TPM_BACKEND_STATS_BUCKETS];
+} TPMBackendCmdStats;
+
+/* bucket n holds latencies of [2^n, 2^(n+1)) microseconds */
+static unsigned int tpm_backend_stats_bucket(int64_t ns)
+{
+    uint64_t us = ns > 0 ? ns / 1000 : 0;
+    unsigned int bucket;
+
+    if (us < 2) {
+        return 0;
+    }
+    bucket = 63 - clz64(us);
+
+    return MIN(bucket, TPM_BACKEND_STATS_BUCKETS - 1);
+}
+
+/* Called with the stats_lock held. */
+static TPMBackendCmdStats *tpm_backend_stats_get(TPMBackend *s,
+                                                 uint32_t ordinal)
+{
+    TPMBackendCmdStats *st;
+
+    st = g_hash_table_lookup(s->cmd_stats, GUINT_TO_POINTER(ordinal));
+    if (!st) {
+        st = g_new0(TPMBackendCmdStats, 1);
+        st->ordinal = ordinal;
+        g_hash_table_insert(s->cmd_stats, GUINT_TO_POINTER(ordinal), st);
+    }
+    return st;
+}
+
+uint32_t tpm_backend_get_ordinal(const uint8_t *cmd, uint32_t cmd_len)
+{
+    /* tag (2 bytes), size (4 bytes), ordinal (4 bytes) */
+    if (cmd_len < 10) {
+        return 0;
+    }
+    return ldl_be_p(&cmd[6]);
+}
+
+void tpm_backend_stats_exec(TPMBackend *s, const uint8_t *cmd,
+                            uint32_t cmd_len, uint32_t resp_len,
+                            int64_t queue_ns, int64_t exec_ns)
+{
+    TPMBackendCmdStats *st;
+
+    qemu_mutex_lock(&s->stats_lock);
+    st = tpm_backend_stats_get(s, tpm_backend_get_ordinal(cmd, cmd_len));
+    st->count++;
+    st->bytes_in += cmd_len;
+    st->bytes_out += resp_len;
+    st->queue_hist[tpm_backend_stats_bucket(queue_ns)]++;
+    st->exec_hist[tpm_backend_stats_bucket(exec_ns)]++;
+    qemu_mutex_unlock(&s->stats_lock);
+}
+
+void tpm_backend_stats_fetch(TPMBackend *s, uint32_t ordinal,
+                             int64_t fetch_ns)
+{
+    TPMBackendCmdStats *st;
+
+    qemu_mutex_lock(&s->stats_lock);
+    st = tpm_backend_stats_get(s, ordinal);
+    st->fetch_hist[tpm_backend_stats_bucket(fetch_ns)]++;
+    qemu_mutex_unlock(&s->stats_lock);
+}
+
+static intList *tpm_backend_stats_histogram(const uint64_t *hist)
+{
+    intList *head = NULL, *e;
+    int i;
+
+    for (i = TPM_BACKEND_STATS_BUCKETS - 1; i >= 0; i--) {
+        e = g_new0(intList, 1);
+        e->value = hist[i];
+        e->next = head;
+        head = e;
+    }
+    return head;
+}
+
+static gint tpm_backend_stats_compare(gconstpointer a, gconstpointer b)
+{
+    const TPMBackendCmdStats *sa = a, *sb = b;
+
+    return sa->ordinal < sb->ordinal ? -1 : sa->ordinal > sb->ordinal;
+}
+
+TPMCommandStatsList *tpm_backend_query_stats(TPMBackend *s)
+{
+    TPMCommandStatsList *head = NULL, *e;
+    TPMCommandStats *cs;
+    TPMBackendCmdStats *st;
+    GList *values, *l;
+
+    qemu_mutex_lock(&s->stats_lock);
+    values = g_list_sort(g_hash_table_get_values(s->cmd_stats),
+                         tpm_backend_stats_compare);
+    for (l = g_list_last(values); l; l = l->prev) {
+        st = l->data;
+        cs = g_new0(TPMCommandStats, 1);
+        cs->ordinal = st->ordinal;
+        cs->count = st->count;
+        cs->bytes_in = st->bytes_in;
+        cs->bytes_out = st->bytes_out;
+        cs->queue_histogram = tpm_backend_stats_histogram(st->queue_hist);
+        cs->exec_histogram = tpm_backend_stats_histogram(st->exec_hist);
+        cs->fetch_histogram = tpm_backend_stats_histogram(st->fetch_hist);
+
+        e = g_new0(TPMCommandStatsList, 1);
+        e->value = cs;
+        e->next = head;
+        head = e;
+    }
+    qemu_mutex_unlock(&s->stats_lock);
+    g_list_free(values);
+
+    return head;
+}
+
 static bool tpm_backend_prop_get_opened(Object *obj, Error **errp)
 {
     TPMBackend *s = TPM_BACKEND(obj);
@@ -151,20 +329,66 @@ static void tpm_backend_prop_set_opened(Object *obj, bool value, Error **errp)
 
 static void tpm_backend_instance_init(Object *obj)
 {
+    TPMBackend *s = TPM_BACKEND(obj);
+
     object_property_add_bool(obj, "opened",
                              tpm_backend_prop_get_opened,
                              tpm_backend_prop_set_opened,
                              NULL);
+
+    qemu_mutex_init(&s->stats_lock);
+    s->cmd_stats = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                         NULL, g_free);
+}
+
+void tpm_backend_set_aio_context(TPMBackend *s, AioContext *ctx)
+{
+    s->aio_context = ctx;
+}
+
+static void tpm_backend_thread_bh(void *opaque)
+{
+    TPMBackendThread *tbt = opaque;
+    int pending = atomic_xchg(&tbt->pending, 0);
+
+    /* Requests delivered before the bottom half got to run share one run
+     * of it, but the worker handles one request per PROCESS_CMD, as it
+     * gets them from the pool */
+    while (pending-- > 0) {
+        tbt->func((gpointer)TPM_BACKEND_CMD_PROCESS_CMD, tbt->user_data);
+    }
 }
 
 void tpm_backend_thread_deliver_request(TPMBackendThread *tbt)
 {
-   g_thread_pool_push(tbt->pool, (gpointer)TPM_BACKEND_CMD_PROCESS_CMD, NULL);
+    if (tbt->bh) {
+        atomic_inc(&tbt->pending);
+        qemu_bh_schedule(tbt->bh);
+        return;
+    }
+    g_thread_pool_push(tbt->pool, (gpointer)TPM_BACKEND_CMD_PROCESS_CMD, NULL);
 }
 
+/*
+ * Start the backend worker. If @ctx is given, the worker runs as a
+ * bottom half in that AioContext, otherwise in a thread of its own.
+ */
 void tpm_backend_thread_create(TPMBackendThread *tbt,
-                               GFunc func, gpointer user_data)
+                               GFunc func, gpointer user_data,
+                               AioContext *ctx)
 {
+    if (ctx) {
+        if (!tbt->bh) {
+            tbt->func = func;
+            tbt->user_data = user_data;
+            tbt->ctx = ctx;
+            tbt->pending = 0;
+            tbt->bh = aio_bh_new(ctx, tpm_backend_thread_bh, tbt);
+            func((gpointer)TPM_BACKEND_CMD_INIT, user_data);
+        }
+        return;
+    }
+
     if (!tbt->pool) {
         tbt->pool = g_thread_pool_new(func, user_data, 1, TRUE, NULL);
         g_thread_pool_push(tbt->pool, (gpointer)TPM_BACKEND_CMD_INIT, NULL);
@@ -173,6 +397,16 @@ void tpm_backend_thread_create(TPMBackendThread *tbt,
 
 void tpm_backend_thread_end(TPMBackendThread *tbt)
 {
+    if (tbt->bh) {
+        /* The bottom half runs with the AioContext held, so once we hold
+         * it the worker is idle, and deleting the bottom half keeps it so */
+        aio_context_acquire(tbt->ctx);
+        qemu_bh_delete(tbt->bh);
+        tbt->bh = NULL;
+        tbt->func((gpointer)TPM_BACKEND_CMD_END, tbt->user_data);
+        aio_context_release(tbt->ctx);
+        tbt->ctx = NULL;
+    }
     if (tbt->pool) {
         g_thread_pool_push(tbt->pool, (gpointer)TPM_BACKEND_CMD_END, NULL);
         g_thread_pool_free(tbt->pool, FALSE, TRUE);
@@ -180,11 +414,20 @@ void tpm_backend_thread_end(TPMBackendThread *tbt)
     }
 }
 
+static void tpm_backend_instance_finalize(Object *obj)
+{
+    TPMBackend *s = TPM_BACKEND(obj);
+
+    g_hash_table_destroy(s->cmd_stats);
+    qemu_mutex_destroy(&s->stats_lock);
+}
+
 static const TypeInfo tpm_backend_info = {
     .name = TYPE_TPM_BACKEND,
     .parent = TYPE_OBJECT,
     .instance_size = sizeof(TPMBackend),
     .instance_init = tpm_backend_instance_init,
+    .instance_finalize = tpm_backend_instance_finalize,
     .class_size = sizeof(TPMBackendClass),
     .abstract = true,
 };
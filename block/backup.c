@@ -26,12 +26,18 @@
 #define BACKUP_CLUSTER_SIZE (1 << BACKUP_CLUSTER_BITS)
 #define BACKUP_SECTORS_PER_CLUSTER (BACKUP_CLUSTER_SIZE / BDRV_SECTOR_SIZE)
 
+/* Adjacent clusters are copied with one read and one write of up to 1 MB */
+#define BACKUP_MAX_CLUSTERS 16
+
+#define BACKUP_MAX_WORKERS 64
+
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct CowRequest {
     int64_t start;
     int64_t end;
-    QLIST_ENTRY(CowRequest) list;
+    struct BackupBlockJob *job;
+    IntervalTreeNode node;  /* in job->inflight_reqs, unless empty */
     CoQueue wait_queue; /* coroutines blocked on this request */
 } CowRequest;
 
@@ -47,27 +53,42 @@ typedef struct BackupBlockJob {
     CoRwlock flush_rwlock;
     uint64_t sectors_read;
     HBitmap *bitmap;
-    QLIST_HEAD(, CowRequest) inflight_reqs;
+    IntervalTreeRoot inflight_reqs;
+
+    int max_workers;
+    int in_flight;              /* background copies running */
+    CoQueue worker_done;        /* the job coroutine waits for a copy here */
+    int guest_cows;             /* copies for guest writes running */
+    CoQueue guest_cow_done;     /* background copies let them go first */
+
+    /* First error of a background copy since the job coroutine last looked */
+    int copy_ret;
+    bool copy_error_is_read;
+    int64_t copy_failed_cluster;    /* lowest cluster that failed */
 } BackupBlockJob;
 
+typedef struct BackupCopy {
+    BackupBlockJob *job;
+    int64_t cluster;
+    int nb_clusters;
+} BackupCopy;
+
 /* See if in-flight requests overlap and wait for them to complete */
 static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
                                                        int64_t start,
                                                        int64_t end)
 {
-    CowRequest *req;
-    bool retry;
-
-    do {
-        retry = false;
-        QLIST_FOREACH(req, &job->inflight_reqs, list) {
-            if (end > req->start && start < req->end) {
-                qemu_co_queue_wait(&req->wait_queue);
-                retry = true;
-                break;
-            }
-        }
-    } while (retry);
+    IntervalTreeNode *node;
+
+    if (start >= end) {
+        return;
+    }
+    while ((node = interval_tree_find(&job->inflight_reqs, start, end - 1,
+                                      NULL, NULL))) {
+        CowRequest *req = container_of(node, CowRequest, node);
+
+        qemu_co_queue_wait(&req->wait_queue);
+    }
 }
 
 /* Keep track of an in-flight request */
@@ -76,29 +97,44 @@ static void cow_request_begin(CowRequest *req, BackupBlockJob *job,
 {
     req->start = start;
     req->end = end;
+    req->job = job;
     qemu_co_queue_init(&req->wait_queue);
-    QLIST_INSERT_HEAD(&job->inflight_reqs, req, list);
+    if (start < end) {
+        req->node.start = start;
+        req->node.last = end - 1;
+        interval_tree_insert(&job->inflight_reqs, &req->node);
+    }
 }
 
 /* Forget about a completed request */
 static void cow_request_end(CowRequest *req)
 {
-    QLIST_REMOVE(req, list);
+    if (req->start < req->end) {
+        interval_tree_remove(&req->job->inflight_reqs, &req->node);
+    }
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
 static int coroutine_fn backup_do_cow(BlockDriverState *bs,
                                       int64_t sector_num, int nb_sectors,
-                                      bool *error_is_read)
+                                      bool *error_is_read, bool is_guest)
 {
     BackupBlockJob *job = (BackupBlockJob *)bs->job;
     CowRequest cow_request;
     struct iovec iov;
     QEMUIOVector bounce_qiov;
     void *bounce_buffer = NULL;
+    size_t bounce_size = 0;
     int ret = 0;
     int64_t start, end;
-    int n;
+    int n, sectors;
+
+    if (is_guest) {
+        job->guest_cows++;
+    } else if (job->guest_cows) {
+        /* A guest write is waiting for its copy; let it have the disks */
+        qemu_co_queue_wait(&job->guest_cow_done);
+    }
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
 
@@ -110,26 +146,35 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start++) {
+    for (; start < end; start += n) {
         if (hbitmap_get(job->bitmap, start)) {
             trace_backup_do_cow_skip(job, start);
+            n = 1;
             continue; /* already copied */
         }
 
-        trace_backup_do_cow_process(job, start);
+        /* Copy the clusters that follow too, up to the next copied one */
+        for (n = 1; n < BACKUP_MAX_CLUSTERS && start + n < end &&
+                    !hbitmap_get(job->bitmap, start + n); n++) {
+            /* nothing */
+        }
+
+        trace_backup_do_cow_process(job, start, n);
 
-        n = MIN(BACKUP_SECTORS_PER_CLUSTER,
-                job->common.len / BDRV_SECTOR_SIZE -
-                start * BACKUP_SECTORS_PER_CLUSTER);
+        sectors = MIN(n * BACKUP_SECTORS_PER_CLUSTER,
+                      job->common.len / BDRV_SECTOR_SIZE -
+                      start * BACKUP_SECTORS_PER_CLUSTER);
 
         if (!bounce_buffer) {
-            bounce_buffer = qemu_blockalign(bs, BACKUP_CLUSTER_SIZE);
+            bounce_size = MIN(end - start, BACKUP_MAX_CLUSTERS) *
+                          BACKUP_CLUSTER_SIZE;
+            bounce_buffer = qemu_blockalign_pooled(bs, bounce_size);
         }
         iov.iov_base = bounce_buffer;
-        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        iov.iov_len = sectors * BDRV_SECTOR_SIZE;
         qemu_iovec_init_external(&bounce_qiov, &iov, 1);
 
-        ret = bdrv_co_readv(bs, start * BACKUP_SECTORS_PER_CLUSTER, n,
+        ret = bdrv_co_readv(bs, start * BACKUP_SECTORS_PER_CLUSTER, sectors,
                             &bounce_qiov);
         if (ret < 0) {
             trace_backup_do_cow_read_fail(job, start, ret);
@@ -142,10 +187,10 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
         if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
             ret = bdrv_co_write_zeroes(job->target,
                                        start * BACKUP_SECTORS_PER_CLUSTER,
-                                       n, BDRV_REQ_MAY_UNMAP);
+                                       sectors, BDRV_REQ_MAY_UNMAP);
         } else {
             ret = bdrv_co_writev(job->target,
-                                 start * BACKUP_SECTORS_PER_CLUSTER, n,
+                                 start * BACKUP_SECTORS_PER_CLUSTER, sectors,
                                  &bounce_qiov);
         }
         if (ret < 0) {
@@ -156,19 +201,17 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
             goto out;
         }
 
-        hbitmap_set(job->bitmap, start, 1);
+        hbitmap_set(job->bitmap, start, n);
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
          * offset field is an opaque progress value, it is not a disk offset.
          */
-        job->sectors_read += n;
-        job->common.offset += n * BDRV_SECTOR_SIZE;
+        job->sectors_read += sectors;
+        job->common.offset += sectors * BDRV_SECTOR_SIZE;
     }
 
 out:
-    if (bounce_buffer) {
-        qemu_vfree(bounce_buffer);
-    }
+    qemu_vfree_pooled(bs, bounce_buffer, bounce_size);
 
     cow_request_end(&cow_request);
 
@@ -176,6 +219,11 @@ out:
 
     qemu_co_rwlock_unlock(&job->flush_rwlock);
 
+    if (is_guest) {
+        job->guest_cows--;
+        qemu_co_queue_restart_all(&job->guest_cow_done);
+    }
+
     return ret;
 }
 
@@ -190,7 +238,7 @@ static int coroutine_fn backup_before_write_notify(
     assert((req->offset & (BDRV_SECTOR_SIZE - 1)) == 0);
     assert((req->bytes & (BDRV_SECTOR_SIZE - 1)) == 0);
 
-    return backup_do_cow(req->bs, sector_num, nb_sectors, NULL);
+    return backup_do_cow(req->bs, sector_num, nb_sectors, NULL, true);
 }
 
 static void backup_set_speed(BlockJob *job, int64_t speed, Error **errp)
@@ -270,9 +318,173 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
     return false;
 }
 
-static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
+static void coroutine_fn backup_copy_entry(void *opaque)
 {
+    BackupCopy *copy = opaque;
+    BackupBlockJob *job = copy->job;
     bool error_is_read;
+    int ret;
+
+    ret = backup_do_cow(job->common.bs,
+                        copy->cluster * BACKUP_SECTORS_PER_CLUSTER,
+                        copy->nb_clusters * BACKUP_SECTORS_PER_CLUSTER,
+                        &error_is_read, false);
+    if (ret < 0) {
+        if (!job->copy_ret) {
+            job->copy_ret = ret;
+            job->copy_error_is_read = error_is_read;
+        }
+        job->copy_failed_cluster = MIN(job->copy_failed_cluster,
+                                       copy->cluster);
+    }
+
+    g_free(copy);
+    job->in_flight--;
+    qemu_co_queue_restart_all(&job->worker_done);
+}
+
+/* Copy clusters in the background, once one of the max_workers is free */
+static void coroutine_fn backup_copy(BackupBlockJob *job, int64_t cluster,
+                                     int nb_clusters)
+{
+    BackupCopy *copy;
+    Coroutine *co;
+
+    while (job->in_flight >= job->max_workers) {
+        qemu_co_queue_wait(&job->worker_done);
+    }
+
+    copy = g_new(BackupCopy, 1);
+    copy->job = job;
+    copy->cluster = cluster;
+    copy->nb_clusters = nb_clusters;
+
+    job->in_flight++;
+    co = qemu_coroutine_create(backup_copy_entry);
+    qemu_coroutine_enter(co, copy);
+}
+
+static void coroutine_fn backup_wait_for_copies(BackupBlockJob *job)
+{
+    while (job->in_flight) {
+        qemu_co_queue_wait(&job->worker_done);
+    }
+}
+
+/* Handle the errors of the background copies since the last call.
+ * Returns the error if the job has to stop.  Otherwise the failed clusters
+ * must be copied again, and *restart is lowered to the first of them.
+ */
+static int coroutine_fn backup_handle_copy_error(BackupBlockJob *job,
+                                                 int64_t *restart)
+{
+    int ret = job->copy_ret;
+
+    if (!ret) {
+        return 0;
+    }
+
+    job->copy_ret = 0;
+    if (backup_error_action(job, job->copy_error_is_read, -ret) ==
+        BLOCK_ERROR_ACTION_REPORT) {
+        return ret;
+    }
+
+    *restart = MIN(*restart, job->copy_failed_cluster);
+    job->copy_failed_cluster = INT64_MAX;
+    return 0;
+}
+
+/* Whether the topmost image has data for the cluster */
+static bool backup_cluster_allocated(BlockDriverState *bs, int64_t cluster)
+{
+    int i, n;
+    int alloced = 0;
+
+    for (i = 0; i < BACKUP_SECTORS_PER_CLUSTER;) {
+        /* bdrv_is_allocated() only returns true/false based
+         * on the first set of sectors it comes across that
+         * are are all in the same state.
+         * For that reason we must verify each sector in the
+         * backup cluster length.  We end up copying more than
+         * needed but at some point that is always the case. */
+        alloced =
+            bdrv_is_allocated(bs,
+                    cluster * BACKUP_SECTORS_PER_CLUSTER + i,
+                    BACKUP_SECTORS_PER_CLUSTER - i, &n);
+        i += n;
+
+        if (alloced == 1 || n == 0) {
+            break;
+        }
+    }
+
+    return alloced != 0;
+}
+
+/* Whether the FULL or TOP sync modes must copy the cluster */
+static bool backup_cluster_wanted(BackupBlockJob *job, int64_t cluster)
+{
+    if (hbitmap_get(job->bitmap, cluster)) {
+        return false;
+    }
+
+    /* If the topmost image has no data here, skip this cluster */
+    return job->sync_mode != MIRROR_SYNC_MODE_TOP ||
+           backup_cluster_allocated(job->common.bs, cluster);
+}
+
+static int coroutine_fn backup_run_full(BackupBlockJob *job)
+{
+    int64_t start = 0;
+    int64_t end = DIV_ROUND_UP(job->common.len, BACKUP_CLUSTER_SIZE);
+    int64_t restart;
+    int ret = 0;
+    int n;
+
+    for (;;) {
+        while (start < end) {
+            if (yield_and_check(job)) {
+                goto out;
+            }
+
+            /* Depending on error action, fail now or retry clusters */
+            restart = start;
+            ret = backup_handle_copy_error(job, &restart);
+            if (ret < 0) {
+                goto out;
+            }
+            start = restart;
+
+            if (!backup_cluster_wanted(job, start)) {
+                start++;
+                continue;
+            }
+            for (n = 1; n < BACKUP_MAX_CLUSTERS && start + n < end &&
+                        backup_cluster_wanted(job, start + n); n++) {
+                /* nothing */
+            }
+
+            backup_copy(job, start, n);
+            start += n;
+        }
+
+        backup_wait_for_copies(job);
+        restart = end;
+        ret = backup_handle_copy_error(job, &restart);
+        if (ret < 0 || restart == end) {
+            return ret;
+        }
+        start = restart;
+    }
+
+out:
+    backup_wait_for_copies(job);
+    return ret;
+}
+
+static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
+{
     int ret = 0;
     int clusters_per_iter;
     uint32_t granularity;
@@ -280,54 +492,94 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
     int64_t cluster;
     int64_t end;
     int64_t last_cluster = -1;
-    BlockDriverState *bs = job->common.bs;
+    int64_t nb_clusters = DIV_ROUND_UP(job->common.len, BACKUP_CLUSTER_SIZE);
+    int64_t run_start = 0, run_end = 0;     /* dirty clusters not sent yet */
+    int64_t restart;
     HBitmapIter hbi;
 
     granularity = bdrv_dirty_bitmap_granularity(job->sync_bitmap);
     clusters_per_iter = MAX((granularity / BACKUP_CLUSTER_SIZE), 1);
     bdrv_dirty_iter_init(job->sync_bitmap, &hbi);
 
-    /* Find the next dirty sector(s) */
-    while ((sector = hbitmap_iter_next(&hbi)) != -1) {
-        cluster = sector / BACKUP_SECTORS_PER_CLUSTER;
+    for (;;) {
+        /* Find the next dirty sector(s) */
+        while ((sector = hbitmap_iter_next(&hbi)) != -1) {
+            if (yield_and_check(job)) {
+                goto out;
+            }
 
-        /* Fake progress updates for any clusters we skipped */
-        if (cluster != last_cluster + 1) {
-            job->common.offset += ((cluster - last_cluster - 1) *
-                                   BACKUP_CLUSTER_SIZE);
-        }
+            /* Depending on error action, fail now or retry clusters */
+            restart = INT64_MAX;
+            ret = backup_handle_copy_error(job, &restart);
+            if (ret < 0) {
+                goto out;
+            }
+            if (restart != INT64_MAX) {
+                run_start = run_end = 0;
+                bdrv_set_dirty_iter(&hbi, restart * BACKUP_SECTORS_PER_CLUSTER);
+                last_cluster = restart - 1;
+                continue;
+            }
 
-        for (end = cluster + clusters_per_iter; cluster < end; cluster++) {
-            do {
-                if (yield_and_check(job)) {
-                    return ret;
-                }
-                ret = backup_do_cow(bs, cluster * BACKUP_SECTORS_PER_CLUSTER,
-                                    BACKUP_SECTORS_PER_CLUSTER, &error_is_read);
-                if ((ret < 0) &&
-                    backup_error_action(job, error_is_read, -ret) ==
-                    BLOCK_ERROR_ACTION_REPORT) {
-                    return ret;
+            cluster = sector / BACKUP_SECTORS_PER_CLUSTER;
+
+            /* Fake progress updates for any clusters we skipped */
+            if (cluster != last_cluster + 1) {
+                job->common.offset += ((cluster - last_cluster - 1) *
+                                       BACKUP_CLUSTER_SIZE);
+            }
+
+            /* Coalesce adjacent dirty clusters into runs */
+            end = MIN(cluster + clusters_per_iter, nb_clusters);
+            if (cluster != run_end) {
+                if (run_start < run_end) {
+                    backup_copy(job, run_start, run_end - run_start);
                 }
-            } while (ret < 0);
+                run_start = cluster;
+            }
+            run_end = end;
+            while (run_end - run_start >= BACKUP_MAX_CLUSTERS) {
+                backup_copy(job, run_start, BACKUP_MAX_CLUSTERS);
+                run_start += BACKUP_MAX_CLUSTERS;
+            }
+            cluster = end;
+
+            /* If the bitmap granularity is smaller than the backup
+             * granularity, we need to advance the iterator pointer to the
+             * next cluster. */
+            if (granularity < BACKUP_CLUSTER_SIZE) {
+                bdrv_set_dirty_iter(&hbi, cluster * BACKUP_SECTORS_PER_CLUSTER);
+            }
+
+            last_cluster = cluster - 1;
         }
 
-        /* If the bitmap granularity is smaller than the backup granularity,
-         * we need to advance the iterator pointer to the next cluster. */
-        if (granularity < BACKUP_CLUSTER_SIZE) {
-            bdrv_set_dirty_iter(&hbi, cluster * BACKUP_SECTORS_PER_CLUSTER);
+        if (run_start < run_end) {
+            backup_copy(job, run_start, run_end - run_start);
+            run_start = run_end = 0;
         }
+        backup_wait_for_copies(job);
 
-        last_cluster = cluster - 1;
+        restart = INT64_MAX;
+        ret = backup_handle_copy_error(job, &restart);
+        if (ret < 0 || restart == INT64_MAX) {
+            break;
+        }
+        bdrv_set_dirty_iter(&hbi, restart * BACKUP_SECTORS_PER_CLUSTER);
+        last_cluster = restart - 1;
     }
 
     /* Play some final catchup with the progress meter */
-    end = DIV_ROUND_UP(job->common.len, BACKUP_CLUSTER_SIZE);
-    if (last_cluster + 1 < end) {
-        job->common.offset += ((end - last_cluster - 1) * BACKUP_CLUSTER_SIZE);
+    if (ret == 0 && last_cluster + 1 < nb_clusters) {
+        job->common.offset += ((nb_clusters - last_cluster - 1) *
+                               BACKUP_CLUSTER_SIZE);
     }
 
     return ret;
+
+out:
+    backup_wait_for_copies(job);
+    return ret;
 }
 
 static void coroutine_fn backup_run(void *opaque)
@@ -340,16 +592,16 @@ static void coroutine_fn backup_run(void *opaque)
     NotifierWithReturn before_write = {
         .notify = backup_before_write_notify,
     };
-    int64_t start, end;
     int ret = 0;
 
-    QLIST_INIT(&job->inflight_reqs);
+    job->inflight_reqs.node = NULL;
     qemu_co_rwlock_init(&job->flush_rwlock);
+    qemu_co_queue_init(&job->worker_done);
+    qemu_co_queue_init(&job->guest_cow_done);
+    job->copy_failed_cluster = INT64_MAX;
 
-    start = 0;
-    end = DIV_ROUND_UP(job->common.len, BACKUP_CLUSTER_SIZE);
-
-    job->bitmap = hbitmap_alloc(end, 0);
+    job->bitmap = hbitmap_alloc(DIV_ROUND_UP(job->common.len,
+                                             BACKUP_CLUSTER_SIZE), 0);
 
     bdrv_set_enable_write_cache(target, true);
     bdrv_set_on_error(target, on_target_error, on_target_error);
@@ -369,58 +621,7 @@ static void coroutine_fn backup_run(void *opaque)
         ret = backup_run_incremental(job);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
-            if (yield_and_check(job)) {
-                break;
-            }
-
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < BACKUP_SECTORS_PER_CLUSTER;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * BACKUP_SECTORS_PER_CLUSTER + i,
-                                BACKUP_SECTORS_PER_CLUSTER - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
-                    }
-                }
-
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(bs, start * BACKUP_SECTORS_PER_CLUSTER,
-                    BACKUP_SECTORS_PER_CLUSTER, &error_is_read);
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    start--;
-                    continue;
-                }
-            }
-        }
+        ret = backup_run_full(job);
     }
 
     notifier_with_return_remove(&before_write);
@@ -453,7 +654,7 @@ static void coroutine_fn backup_run(void *opaque)
 
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
-                  BdrvDirtyBitmap *sync_bitmap,
+                  BdrvDirtyBitmap *sync_bitmap, int max_workers,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockCompletionFunc *cb, void *opaque,
@@ -470,6 +671,12 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
         return;
     }
 
+    if (max_workers < 1 || max_workers > BACKUP_MAX_WORKERS) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                   "a value between 1 and " stringify(BACKUP_MAX_WORKERS));
+        return;
+    }
+
     if ((on_source_error == BLOCKDEV_ON_ERROR_STOP ||
          on_source_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
         !bdrv_iostatus_is_enabled(bs)) {
@@ -535,6 +742,7 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
     job->on_target_error = on_target_error;
     job->target = target;
     job->sync_mode = sync_mode;
+    job->max_workers = max_workers;
     job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_INCREMENTAL ?
                        sync_bitmap : NULL;
     job->common.len = len;
@@ -27,6 +27,8 @@ enum {
     COMMIT_BUFFER_SIZE = 512 * 1024, /* in bytes */
 };
 
+#define COMMIT_MAX_WORKERS 64
+
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct CommitBlockJob {
@@ -39,8 +41,22 @@ typedef struct CommitBlockJob {
     int base_flags;
     int orig_overlay_flags;
     char *backing_file_str;
+
+    int max_workers;
+    int in_flight;              /* copies running */
+    CoQueue worker_done;        /* the job coroutine waits for a copy here */
+
+    /* First error since the job coroutine last looked */
+    int copy_ret;
+    int64_t copy_failed_sector;     /* lowest sector that failed */
 } CommitBlockJob;
 
+typedef struct CommitCopy {
+    CommitBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+} CommitCopy;
+
 static int coroutine_fn commit_populate(BlockDriverState *bs,
                                         BlockDriverState *base,
                                         int64_t sector_num, int nb_sectors,
@@ -95,6 +111,95 @@ static void commit_complete(BlockJob *job, void *opaque)
     g_free(data);
 }
 
+/* Record a failed copy or allocation lookup for commit_handle_error() */
+static void commit_set_error(CommitBlockJob *s, int64_t sector_num, int ret)
+{
+    if (!s->copy_ret) {
+        s->copy_ret = ret;
+    }
+    s->copy_failed_sector = MIN(s->copy_failed_sector, sector_num);
+}
+
+static void coroutine_fn commit_copy_entry(void *opaque)
+{
+    CommitCopy *copy = opaque;
+    CommitBlockJob *s = copy->s;
+    size_t size = copy->nb_sectors * BDRV_SECTOR_SIZE;
+    void *buf;
+    int ret = -ENOMEM;
+
+    buf = qemu_try_blockalign_pooled(s->top, size);
+    if (buf) {
+        ret = commit_populate(s->top, s->base, copy->sector_num,
+                              copy->nb_sectors, buf);
+        qemu_vfree_pooled(s->top, buf, size);
+    }
+    if (ret < 0) {
+        commit_set_error(s, copy->sector_num, ret);
+    }
+
+    /* Publish progress; commit_handle_error() takes it back for retries */
+    s->common.offset += size;
+
+    g_free(copy);
+    s->in_flight--;
+    qemu_co_queue_restart_all(&s->worker_done);
+}
+
+/* Copy sectors in the background, once one of the max_workers is free */
+static void coroutine_fn commit_copy(CommitBlockJob *s, int64_t sector_num,
+                                     int nb_sectors)
+{
+    CommitCopy *copy;
+    Coroutine *co;
+
+    while (s->in_flight >= s->max_workers) {
+        qemu_co_queue_wait(&s->worker_done);
+    }
+
+    copy = g_new(CommitCopy, 1);
+    copy->s = s;
+    copy->sector_num = sector_num;
+    copy->nb_sectors = nb_sectors;
+
+    s->in_flight++;
+    co = qemu_coroutine_create(commit_copy_entry);
+    qemu_coroutine_enter(co, copy);
+}
+
+static void coroutine_fn commit_wait_for_copies(CommitBlockJob *s)
+{
+    while (s->in_flight) {
+        qemu_co_queue_wait(&s->worker_done);
+    }
+}
+
+/* Apply on-error once all copies have finished.  Returns the error if the
+ * job has to stop.  Otherwise the failed parts are copied again, and
+ * *sector_num is moved back to the first of them.
+ */
+static int coroutine_fn commit_handle_error(CommitBlockJob *s,
+                                            int64_t *sector_num)
+{
+    int ret;
+
+    commit_wait_for_copies(s);
+
+    ret = s->copy_ret;
+    s->copy_ret = 0;
+    if (s->on_error == BLOCKDEV_ON_ERROR_STOP ||
+        s->on_error == BLOCKDEV_ON_ERROR_REPORT ||
+        (s->on_error == BLOCKDEV_ON_ERROR_ENOSPC && ret == -ENOSPC)) {
+        return ret;
+    }
+
+    /* Everything below the first failure is done and was counted once */
+    *sector_num = s->copy_failed_sector;
+    s->common.offset = *sector_num * BDRV_SECTOR_SIZE;
+    s->copy_failed_sector = INT64_MAX;
+    return 0;
+}
+
 static void coroutine_fn commit_run(void *opaque)
 {
     CommitBlockJob *s = opaque;
@@ -104,8 +209,6 @@ static void coroutine_fn commit_run(void *opaque)
     int64_t sector_num, end;
     int ret = 0;
     int n = 0;
-    void *buf = NULL;
-    int bytes_written = 0;
     int64_t base_len;
 
     ret = s->common.len = bdrv_getlength(top);
@@ -128,12 +231,20 @@ static void coroutine_fn commit_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(top, COMMIT_BUFFER_SIZE);
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
+    sector_num = 0;
+    for (;;) {
         uint64_t delay_ns = 0;
         bool copy;
 
+        if (sector_num == end) {
+            /* The last copies may still fail */
+            commit_wait_for_copies(s);
+            if (!s->copy_ret) {
+                break;
+            }
+        }
+
 wait:
         /* Note that even when no rate limit is applied we need to yield
          * with no pending I/O here so that bdrv_drain_all() returns.
@@ -142,40 +253,49 @@ wait:
         if (block_job_is_cancelled(&s->common)) {
             break;
         }
-        /* Copy if allocated above the base */
+
+        if (s->copy_ret) {
+            ret = commit_handle_error(s, &sector_num);
+            if (ret < 0) {
+                goto out;
+            }
+            continue;
+        }
+
+        /* Copy if allocated above the base.  Look at the whole rest of the
+         * image, so that long runs which need no copying are skipped in one
+         * step */
         ret = bdrv_is_allocated_above(top, base, sector_num,
-                                      COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE,
+                                      MIN(end - sector_num,
+                                          BDRV_REQUEST_MAX_SECTORS),
                                       &n);
         copy = (ret == 1);
         trace_commit_one_iteration(s, sector_num, n, ret);
-        if (copy) {
+        if (ret < 0) {
+            n = MIN(end - sector_num, COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE);
+            commit_set_error(s, sector_num, ret);
+            s->common.offset += n * BDRV_SECTOR_SIZE;
+        } else if (copy) {
+            n = MIN(n, COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE);
+            /* Only data that is actually copied counts against the limit */
             if (s->common.speed) {
                 delay_ns = ratelimit_calculate_delay(&s->limit, n);
                 if (delay_ns > 0) {
                     goto wait;
                 }
             }
-            ret = commit_populate(top, base, sector_num, n, buf);
-            bytes_written += n * BDRV_SECTOR_SIZE;
+            commit_copy(s, sector_num, n);
+        } else {
+            /* Publish progress */
+            s->common.offset += n * BDRV_SECTOR_SIZE;
         }
-        if (ret < 0) {
-            if (s->on_error == BLOCKDEV_ON_ERROR_STOP ||
-                s->on_error == BLOCKDEV_ON_ERROR_REPORT||
-                (s->on_error == BLOCKDEV_ON_ERROR_ENOSPC && ret == -ENOSPC)) {
-                goto out;
-            } else {
-                n = 0;
-                continue;
-            }
-        }
-        /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
+        sector_num += n;
     }
 
     ret = 0;
 
 out:
-    qemu_vfree(buf);
+    commit_wait_for_copies(s);
 
     data = g_malloc(sizeof(*data));
     data->ret = ret;
@@ -200,7 +320,7 @@ static const BlockJobDriver commit_job_driver = {
 };
 
 void commit_start(BlockDriverState *bs, BlockDriverState *base,
-                  BlockDriverState *top, int64_t speed,
+                  BlockDriverState *top, int64_t speed, int max_workers,
                   BlockdevOnError on_error, BlockCompletionFunc *cb,
                   void *opaque, const char *backing_file_str, Error **errp)
 {
@@ -211,6 +331,12 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
     BlockDriverState *overlay_bs;
     Error *local_err = NULL;
 
+    if (max_workers < 1 || max_workers > COMMIT_MAX_WORKERS) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                   "a value between 1 and " stringify(COMMIT_MAX_WORKERS));
+        return;
+    }
+
     if ((on_error == BLOCKDEV_ON_ERROR_STOP ||
          on_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
         !bdrv_iostatus_is_enabled(bs)) {
@@ -266,6 +392,10 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
 
     s->backing_file_str = g_strdup(backing_file_str);
 
+    s->max_workers = max_workers;
+    qemu_co_queue_init(&s->worker_done);
+    s->copy_failed_sector = INT64_MAX;
+
     s->on_error = on_error;
     s->common.co = qemu_coroutine_create(commit_run);
 
@@ -26,7 +26,9 @@
 #include "block/blockjob.h"
 #include "block/block_int.h"
 #include "block/throttle-groups.h"
+#include "block/buffer-pool.h"
 #include "qemu/error-report.h"
+#include "trace/flight-recorder.h"
 
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
@@ -267,6 +269,8 @@ void bdrv_drain_all(void)
     bool busy = true;
     BlockDriverState *bs = NULL;
     GSList *aio_ctxs = NULL, *ctx;
+    int64_t start = get_clock();
+    int64_t ns;
 
     while ((bs = bdrv_next(bs))) {
         AioContext *aio_context = bdrv_get_aio_context(bs);
@@ -321,6 +325,29 @@ void bdrv_drain_all(void)
         aio_context_release(aio_context);
     }
     g_slist_free(aio_ctxs);
+
+    ns = get_clock() - start;
+    trace_bdrv_drain_all(ns);
+    flight_recorder_record(TRACE_BDRV_DRAIN_ALL, ns);
+}
+
+/* Index the overlap range of a request, see wait_serialising_requests() */
+static void tracked_request_index(BdrvTrackedRequest *req)
+{
+    if (req->overlap_bytes) {
+        req->overlap_node.start = req->overlap_offset;
+        req->overlap_node.last = req->overlap_offset + req->overlap_bytes - 1;
+        interval_tree_insert(&req->bs->tracked_requests_tree,
+                             &req->overlap_node);
+    }
+}
+
+static void tracked_request_unindex(BdrvTrackedRequest *req)
+{
+    if (req->overlap_bytes) {
+        interval_tree_remove(&req->bs->tracked_requests_tree,
+                             &req->overlap_node);
+    }
 }
 
 /**
@@ -335,6 +362,7 @@ static void tracked_request_end(BdrvTrackedRequest *req)
     }
 
     QLIST_REMOVE(req, list);
+    tracked_request_unindex(req);
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
@@ -360,6 +388,7 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
     qemu_co_queue_init(&req->wait_queue);
 
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    tracked_request_index(req);
 }
 
 static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
@@ -373,8 +402,15 @@ static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
         req->serialising = true;
     }
 
-    req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
-    req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+    overlap_offset = MIN(req->overlap_offset, overlap_offset);
+    overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+    if (overlap_offset != req->overlap_offset ||
+        overlap_bytes != req->overlap_bytes) {
+        tracked_request_unindex(req);
+        req->overlap_offset = overlap_offset;
+        req->overlap_bytes = overlap_bytes;
+        tracked_request_index(req);
+    }
 }
 
 /**
@@ -411,60 +447,51 @@ static int bdrv_get_cluster_size(BlockDriverState *bs)
     }
 }
 
-static bool tracked_request_overlaps(BdrvTrackedRequest *req,
-                                     int64_t offset, unsigned int bytes)
+/* Does @node belong to a request that @opaque must wait for? */
+static bool tracked_request_conflicts(IntervalTreeNode *node, void *opaque)
 {
-    /*        aaaa   bbbb */
-    if (offset >= req->overlap_offset + req->overlap_bytes) {
-        return false;
-    }
-    /* bbbb   aaaa        */
-    if (req->overlap_offset >= offset + bytes) {
+    BdrvTrackedRequest *self = opaque;
+    BdrvTrackedRequest *req = container_of(node, BdrvTrackedRequest,
+                                           overlap_node);
+
+    if (req == self || (!req->serialising && !self->serialising)) {
         return false;
     }
-    return true;
+
+    /* Hitting this means there was a reentrant request, for
+     * example, a block driver issuing nested requests.  This must
+     * never happen since it means deadlock.
+     */
+    assert(qemu_coroutine_self() != req->co);
+
+    /* If the request is already (indirectly) waiting for us, or
+     * will wait for us as soon as it wakes up, then just go on
+     * (instead of producing a deadlock in the former case). */
+    return !req->waiting_for;
 }
 
 static bool coroutine_fn wait_serialising_requests(BdrvTrackedRequest *self)
 {
     BlockDriverState *bs = self->bs;
-    BdrvTrackedRequest *req;
-    bool retry;
+    IntervalTreeNode *node;
     bool waited = false;
 
-    if (!bs->serialising_in_flight) {
+    if (!bs->serialising_in_flight || !self->overlap_bytes) {
         return false;
     }
 
-    do {
-        retry = false;
-        QLIST_FOREACH(req, &bs->tracked_requests, list) {
-            if (req == self || (!req->serialising && !self->serialising)) {
-                continue;
-            }
-            if (tracked_request_overlaps(req, self->overlap_offset,
-                                         self->overlap_bytes))
-            {
-                /* Hitting this means there was a reentrant request, for
-                 * example, a block driver issuing nested requests.  This must
-                 * never happen since it means deadlock.
-                 */
-                assert(qemu_coroutine_self() != req->co);
-
-                /* If the request is already (indirectly) waiting for us, or
-                 * will wait for us as soon as it wakes up, then just go on
-                 * (instead of producing a deadlock in the former case). */
-                if (!req->waiting_for) {
-                    self->waiting_for = req;
-                    qemu_co_queue_wait(&req->wait_queue);
-                    self->waiting_for = NULL;
-                    retry = true;
-                    waited = true;
-                    break;
-                }
-            }
-        }
-    } while (retry);
+    while ((node = interval_tree_find(&bs->tracked_requests_tree,
+                                      self->overlap_node.start,
+                                      self->overlap_node.last,
+                                      tracked_request_conflicts, self))) {
+        BdrvTrackedRequest *req = container_of(node, BdrvTrackedRequest,
+                                               overlap_node);
+
+        self->waiting_for = req;
+        qemu_co_queue_wait(&req->wait_queue);
+        self->waiting_for = NULL;
+        waited = true;
+    }
 
     return waited;
 }
@@ -772,7 +799,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
                                    cluster_sector_num, cluster_nb_sectors);
 
     iov.iov_len = cluster_nb_sectors * BDRV_SECTOR_SIZE;
-    iov.iov_base = bounce_buffer = qemu_try_blockalign(bs, iov.iov_len);
+    iov.iov_base = bounce_buffer = qemu_try_blockalign_pooled(bs, iov.iov_len);
     if (bounce_buffer == NULL) {
         ret = -ENOMEM;
         goto err;
@@ -811,7 +838,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
                         nb_sectors * BDRV_SECTOR_SIZE);
 
 err:
-    qemu_vfree(bounce_buffer);
+    qemu_vfree_pooled(bs, bounce_buffer, iov.iov_len);
     return ret;
 }
 
@@ -943,7 +970,7 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
 
     /* Align read if necessary by padding qiov */
     if (offset & (align - 1)) {
-        head_buf = qemu_blockalign(bs, align);
+        head_buf = qemu_blockalign_pooled(bs, align);
         qemu_iovec_init(&local_qiov, qiov->niov + 2);
         qemu_iovec_add(&local_qiov, head_buf, offset & (align - 1));
         qemu_iovec_concat(&local_qiov, qiov, 0, qiov->size);
@@ -959,7 +986,7 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
             qemu_iovec_concat(&local_qiov, qiov, 0, qiov->size);
             use_local_qiov = true;
         }
-        tail_buf = qemu_blockalign(bs, align);
+        tail_buf = qemu_blockalign_pooled(bs, align);
         qemu_iovec_add(&local_qiov, tail_buf,
                        align - ((offset + bytes) & (align - 1)));
 
@@ -974,8 +1001,8 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
 
     if (use_local_qiov) {
         qemu_iovec_destroy(&local_qiov);
-        qemu_vfree(head_buf);
-        qemu_vfree(tail_buf);
+        qemu_vfree_pooled(bs, head_buf, align);
+        qemu_vfree_pooled(bs, tail_buf, align);
     }
 
     return ret;
@@ -1113,6 +1140,10 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     assert(req->overlap_offset <= offset);
     assert(offset + bytes <= req->overlap_offset + req->overlap_bytes);
 
+    if (offset == req->offset && bytes == req->bytes) {
+        req->qiov = qiov;
+        req->flags = flags;
+    }
     ret = notifier_with_return_list_notify(&bs->before_write_notifiers, req);
 
     if (!ret && bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF &&
@@ -1141,6 +1172,9 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
 
     bdrv_set_dirty(bs, sector_num, nb_sectors);
 
+    req->ret = ret;
+    notifier_list_notify(&bs->after_write_notifiers, req);
+
     block_acct_highest_sector(&bs->stats, sector_num, nb_sectors);
 
     if (ret >= 0) {
@@ -1169,7 +1203,7 @@ static int coroutine_fn bdrv_co_do_zero_pwritev(BlockDriverState *bs,
 
     assert(flags & BDRV_REQ_ZERO_WRITE);
     if (head_padding_bytes || tail_padding_bytes) {
-        buf = qemu_blockalign(bs, align);
+        buf = qemu_blockalign_pooled(bs, align);
         iov = (struct iovec) {
             .iov_base   = buf,
             .iov_len    = align,
@@ -1233,7 +1267,7 @@ static int coroutine_fn bdrv_co_do_zero_pwritev(BlockDriverState *bs,
                                    &local_qiov, flags & ~BDRV_REQ_ZERO_WRITE);
     }
 fail:
-    qemu_vfree(buf);
+    qemu_vfree_pooled(bs, buf, align);
     return ret;
 
 }
@@ -1285,17 +1319,12 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
 
     if (offset & (align - 1)) {
         QEMUIOVector head_qiov;
-        struct iovec head_iov;
 
         mark_request_serialising(&req, align);
         wait_serialising_requests(&req);
 
-        head_buf = qemu_blockalign(bs, align);
-        head_iov = (struct iovec) {
-            .iov_base   = head_buf,
-            .iov_len    = align,
-        };
-        qemu_iovec_init_external(&head_qiov, &head_iov, 1);
+        head_buf = qemu_blockalign_pooled(bs, align);
+        qemu_iovec_init_buf(&head_qiov, head_buf, align);
 
         BLKDBG_EVENT(bs, BLKDBG_PWRITEV_RMW_HEAD);
         ret = bdrv_aligned_preadv(bs, &req, offset & ~(align - 1), align,
@@ -1316,7 +1345,6 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
 
     if ((offset + bytes) & (align - 1)) {
         QEMUIOVector tail_qiov;
-        struct iovec tail_iov;
         size_t tail_bytes;
         bool waited;
 
@@ -1324,12 +1352,8 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
         waited = wait_serialising_requests(&req);
         assert(!waited || !use_local_qiov);
 
-        tail_buf = qemu_blockalign(bs, align);
-        tail_iov = (struct iovec) {
-            .iov_base   = tail_buf,
-            .iov_len    = align,
-        };
-        qemu_iovec_init_external(&tail_qiov, &tail_iov, 1);
+        tail_buf = qemu_blockalign_pooled(bs, align);
+        qemu_iovec_init_buf(&tail_qiov, tail_buf, align);
 
         BLKDBG_EVENT(bs, BLKDBG_PWRITEV_RMW_TAIL);
         ret = bdrv_aligned_preadv(bs, &req, (offset + bytes) & ~(align - 1), align,
@@ -1360,8 +1384,8 @@ fail:
     if (use_local_qiov) {
         qemu_iovec_destroy(&local_qiov);
     }
-    qemu_vfree(head_buf);
-    qemu_vfree(tail_buf);
+    qemu_vfree_pooled(bs, head_buf, align);
+    qemu_vfree_pooled(bs, tail_buf, align);
 out:
     tracked_request_end(&req);
     return ret;
@@ -2552,6 +2576,25 @@ void *qemu_try_blockalign0(BlockDriverState *bs, size_t size)
     return mem;
 }
 
+void *qemu_try_blockalign_pooled(BlockDriverState *bs, size_t size)
+{
+    BufferPool *pool = aio_get_buffer_pool(bdrv_get_aio_context(bs));
+
+    return buffer_pool_try_get(pool, bdrv_opt_mem_align(bs), size);
+}
+
+void *qemu_blockalign_pooled(BlockDriverState *bs, size_t size)
+{
+    return qemu_oom_check(qemu_try_blockalign_pooled(bs, size));
+}
+
+void qemu_vfree_pooled(BlockDriverState *bs, void *buf, size_t size)
+{
+    BufferPool *pool = aio_get_buffer_pool(bdrv_get_aio_context(bs));
+
+    buffer_pool_put(pool, buf, size);
+}
+
 /*
  * Check if all memory in this vector is sector aligned.
  */
@@ -2578,6 +2621,11 @@ void bdrv_add_before_write_notifier(BlockDriverState *bs,
     notifier_with_return_list_add(&bs->before_write_notifiers, notifier);
 }
 
+void bdrv_add_after_write_notifier(BlockDriverState *bs, Notifier *notifier)
+{
+    notifier_list_add(&bs->after_write_notifiers, notifier);
+}
+
 void bdrv_io_plug(BlockDriverState *bs)
 {
     BlockDriver *drv = bs->drv;
@@ -0,0 +1,406 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "trace.h"
+
+#include <liburing.h>
+
+/*
+ * Ring size (per-AioContext).  Requests that do not fit in the submission ring
+ * wait in a queue of their own, so unlike linux-aio there is no EAGAIN that
+ * the guest could see.
+ */
+#define MAX_ENTRIES 128
+
+/* Delay before io_uring_submit() is retried when the kernel refused new
+ * entries while none of ours were in flight */
+#define SUBMIT_RETRY_MS 1
+
+struct qemu_luringcb {
+    BlockAIOCB common;
+    struct qemu_luring_state *ctx;
+    ssize_t ret;
+    size_t nbytes;
+    QEMUIOVector *qiov;
+    int fd;
+    int type;
+    off_t offset;
+
+    /* Bytes read so far, and the rest of qiov, if a read came back short */
+    size_t total_read;
+    QEMUIOVector resubmit_qiov;
+
+    QSIMPLEQ_ENTRY(qemu_luringcb) next;
+};
+
+typedef struct {
+    int plugged;
+    unsigned int in_flight;
+    QSIMPLEQ_HEAD(, qemu_luringcb) pending;
+} LuringQueue;
+
+struct qemu_luring_state {
+    struct io_uring ring;
+    EventNotifier e;
+
+    /* requests that are not in the submission ring yet */
+    LuringQueue io_q;
+
+    /* I/O completion processing */
+    QEMUBH *completion_bh;
+
+    /* retries io_uring_submit() after -EAGAIN/-EBUSY */
+    QEMUTimer *retry_timer;
+};
+
+static void luring_ioq_submit(struct qemu_luring_state *s);
+
+/*
+ * Completes an AIO request (calls the callback and frees the ACB).
+ */
+static void qemu_luring_process_completion(struct qemu_luring_state *s,
+    struct qemu_luringcb *luringcb)
+{
+    int ret;
+
+    ret = luringcb->ret;
+    if (luringcb->type == QEMU_AIO_FLUSH) {
+        ret = ret < 0 ? ret : 0;
+    } else if (ret >= 0) {
+        size_t done = luringcb->total_read + ret;
+
+        if (done == luringcb->nbytes) {
+            ret = 0;
+        } else if (luringcb->type == QEMU_AIO_READ) {
+            /* Only a read that returned nothing means EOF, see
+             * luring_resubmit_short_read(); pad with zeros. */
+            qemu_iovec_memset(luringcb->qiov, done, 0,
+                luringcb->qiov->size - done);
+            ret = 0;
+        } else {
+            ret = -EINVAL;
+        }
+    }
+    if (luringcb->resubmit_qiov.iov) {
+        qemu_iovec_destroy(&luringcb->resubmit_qiov);
+    }
+    trace_luring_process_completion(s, luringcb, ret);
+    luringcb->common.cb(luringcb->common.opaque, ret);
+
+    qemu_aio_unref(luringcb);
+}
+
+/*
+ * A read can come back short in the middle of a file, e.g. from the page
+ * cache when the file is not opened with O_DIRECT.  Queue the rest of the
+ * request again; it is done once it is complete or a read returns 0.
+ */
+static void luring_resubmit_short_read(struct qemu_luring_state *s,
+                                       struct qemu_luringcb *luringcb,
+                                       int nread)
+{
+    QEMUIOVector *resubmit_qiov = &luringcb->resubmit_qiov;
+
+    trace_luring_resubmit_short_read(s, luringcb, nread);
+
+    luringcb->total_read += nread;
+    if (resubmit_qiov->iov == NULL) {
+        qemu_iovec_init(resubmit_qiov, luringcb->qiov->niov);
+    } else {
+        qemu_iovec_reset(resubmit_qiov);
+    }
+    qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
+                      luringcb->qiov->size - luringcb->total_read);
+
+    QSIMPLEQ_INSERT_HEAD(&s->io_q.pending, luringcb, next);
+}
+
+/* The completion BH reaps the completion ring and invokes the callbacks.
+ *
+ * Like the linux-aio one it supports nested event loops: every completion
+ * is removed from the ring before its callback runs, and the BH reschedules
+ * itself while it is working, so that a nested aio_poll() picks up the
+ * entries that are left.
+ */
+static void qemu_luring_completion_bh(void *opaque)
+{
+    struct qemu_luring_state *s = opaque;
+    struct io_uring_cqe *cqe;
+
+    /* Reschedule so nested event loops see currently pending completions */
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        struct qemu_luringcb *luringcb = io_uring_cqe_get_data(cqe);
+
+        luringcb->ret = cqe->res;
+        io_uring_cqe_seen(&s->ring, cqe);
+        s->io_q.in_flight--;
+
+        if (luringcb->type == QEMU_AIO_READ && luringcb->ret > 0 &&
+            luringcb->total_read + luringcb->ret < luringcb->nbytes) {
+            luring_resubmit_short_read(s, luringcb, luringcb->ret);
+            continue;
+        }
+        qemu_luring_process_completion(s, luringcb);
+    }
+
+    qemu_bh_cancel(s->completion_bh);
+
+    if (!s->io_q.plugged) {
+        luring_ioq_submit(s);
+    }
+}
+
+/* Also called when qemu_luring_poll_cb() found completions, so the
+ * eventfd need not be set yet.
+ */
+static void qemu_luring_completion_cb(EventNotifier *e)
+{
+    struct qemu_luring_state *s = container_of(e, struct qemu_luring_state, e);
+
+    event_notifier_test_and_clear(&s->e);
+    if (io_uring_cq_ready(&s->ring)) {
+        qemu_bh_schedule(s->completion_bh);
+    }
+}
+
+static bool qemu_luring_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    struct qemu_luring_state *s = container_of(e, struct qemu_luring_state, e);
+
+    return io_uring_cq_ready(&s->ring);
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(struct qemu_luringcb),
+};
+
+static void luring_ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->pending);
+    io_q->plugged = 0;
+    io_q->in_flight = 0;
+}
+
+static void luring_prep_sqe(struct qemu_luring_state *s,
+                            struct io_uring_sqe *sqe,
+                            struct qemu_luringcb *luringcb)
+{
+    QEMUIOVector *qiov = luringcb->qiov;
+    int fd = luringcb->fd;
+
+    switch (luringcb->type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqe, fd, qiov->iov, qiov->niov,
+                             luringcb->offset);
+        break;
+    case QEMU_AIO_READ:
+        if (luringcb->total_read) {
+            qiov = &luringcb->resubmit_qiov;
+        }
+        io_uring_prep_readv(sqe, fd, qiov->iov, qiov->niov,
+                            luringcb->offset + luringcb->total_read);
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+        break;
+    default:
+        abort();
+    }
+    io_uring_sqe_set_data(sqe, luringcb);
+}
+
+/*
+ * Moves as many pending requests as fit into the submission ring and hands
+ * them to the kernel with a single io_uring_submit() call.
+ */
+static void luring_ioq_submit(struct qemu_luring_state *s)
+{
+    struct qemu_luringcb *luringcb;
+    struct io_uring_sqe *sqe;
+    int queued = 0;
+    int ret;
+
+    while (s->io_q.in_flight < MAX_ENTRIES &&
+           (luringcb = QSIMPLEQ_FIRST(&s->io_q.pending)) != NULL) {
+        sqe = io_uring_get_sqe(&s->ring);
+        if (!sqe) {
+            break;
+        }
+        luring_prep_sqe(s, sqe, luringcb);
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+        s->io_q.in_flight++;
+        queued++;
+    }
+
+    if (io_uring_sq_ready(&s->ring) == 0) {
+        return;
+    }
+
+    do {
+        ret = io_uring_submit(&s->ring);
+    } while (ret == -EINTR);
+    trace_luring_io_uring_submit(s, queued, ret);
+
+    if (ret < 0 && ret != -EAGAIN && ret != -EBUSY) {
+        abort();
+    }
+    /* With -EAGAIN/-EBUSY the entries stay in the submission ring and go
+     * out with the next io_uring_submit(), after some completions.  If the
+     * kernel has none of our requests, no completion is coming; retry on
+     * a timer then. */
+    if (ret < 0 && s->io_q.in_flight == io_uring_sq_ready(&s->ring)) {
+        timer_mod(s->retry_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + SUBMIT_RETRY_MS);
+    }
+}
+
+static void luring_retry_timer_cb(void *opaque)
+{
+    struct qemu_luring_state *s = opaque;
+
+    if (!s->io_q.plugged) {
+        luring_ioq_submit(s);
+    }
+}
+
+void luring_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_luring_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug)
+{
+    struct qemu_luring_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0 || !unplug);
+
+    if (unplug && --s->io_q.plugged > 0) {
+        return;
+    }
+
+    luring_ioq_submit(s);
+}
+
+BlockAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type)
+{
+    struct qemu_luring_state *s = aio_ctx;
+    struct qemu_luringcb *luringcb;
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+    case QEMU_AIO_READ:
+    case QEMU_AIO_FLUSH:
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        return NULL;
+    }
+
+    luringcb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    luringcb->nbytes = nb_sectors * 512;
+    luringcb->ctx = s;
+    luringcb->ret = -EINPROGRESS;
+    luringcb->type = type;
+    luringcb->qiov = qiov;
+    luringcb->fd = fd;
+    luringcb->offset = sector_num * 512;
+    luringcb->total_read = 0;
+    memset(&luringcb->resubmit_qiov, 0, sizeof(luringcb->resubmit_qiov));
+    trace_luring_submit(s, luringcb, sector_num, nb_sectors, type);
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, luringcb, next);
+    if (!s->io_q.plugged) {
+        luring_ioq_submit(s);
+    }
+    return &luringcb->common;
+}
+
+void luring_detach_aio_context(void *s_, AioContext *old_context)
+{
+    struct qemu_luring_state *s = s_;
+
+    aio_set_event_notifier(old_context, &s->e, NULL);
+    qemu_bh_delete(s->completion_bh);
+    timer_del(s->retry_timer);
+    timer_free(s->retry_timer);
+}
+
+void luring_attach_aio_context(void *s_, AioContext *new_context)
+{
+    struct qemu_luring_state *s = s_;
+
+    s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    s->retry_timer = aio_timer_new(new_context, QEMU_CLOCK_REALTIME, SCALE_MS,
+                                   luring_retry_timer_cb, s);
+    aio_set_event_notifier(new_context, &s->e, qemu_luring_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, qemu_luring_poll_cb);
+}
+
+void *luring_init(bool sqpoll, Error **errp)
+{
+    struct qemu_luring_state *s;
+    struct io_uring_params params = { 0 };
+    int ret;
+
+    s = g_malloc0(sizeof(*s));
+    if (event_notifier_init(&s->e, false) < 0) {
+        error_setg_errno(errp, errno, "failed to create io_uring eventfd");
+        goto out_free_state;
+    }
+
+    if (sqpoll) {
+        /* A kernel thread polls the submission ring, so that submitting
+         * needs no system call while it is busy */
+        params.flags |= IORING_SETUP_SQPOLL;
+    }
+    ret = io_uring_queue_init_params(MAX_ENTRIES, &s->ring, &params);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "failed to create io_uring");
+        goto out_close_efd;
+    }
+
+    ret = io_uring_register_eventfd(&s->ring, event_notifier_get_fd(&s->e));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "failed to register io_uring eventfd");
+        goto out_exit_ring;
+    }
+
+    luring_ioq_init(&s->io_q);
+
+    return s;
+
+out_exit_ring:
+    io_uring_queue_exit(&s->ring);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(void *s_)
+{
+    struct qemu_luring_state *s = s_;
+
+    io_uring_queue_exit(&s->ring);
+    event_notifier_cleanup(&s->e);
+    g_free(s);
+}
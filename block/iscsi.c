@@ -48,14 +48,31 @@
 #include <block/scsi.h>
 #endif
 
+#define ISCSI_MAX_SESSIONS 16
+
+struct IscsiLun;
+
+/* One login to the target, i.e. one TCP connection */
+typedef struct IscsiSession {
+    struct IscsiLun *iscsilun;
+    struct iscsi_context *iscsi;
+    int events;
+    bool request_timed_out;
+} IscsiSession;
+
 typedef struct IscsiLun {
+    /* The first session; everything but the data path goes through it */
     struct iscsi_context *iscsi;
+    /* Reads, writes, flushes, discards and status queries are spread
+     * round robin over all sessions */
+    IscsiSession sessions[ISCSI_MAX_SESSIONS];
+    int num_sessions;
+    unsigned int next_session;
     AioContext *aio_context;
     int lun;
     enum scsi_inquiry_peripheral_device_type type;
     int block_size;
     uint64_t num_blocks;
-    int events;
     QEMUTimer *nop_timer;
     QEMUTimer *event_timer;
     struct scsi_inquiry_logical_block_provisioning lbp;
@@ -70,7 +87,6 @@ typedef struct IscsiLun {
     bool dpofua;
     bool has_write_same;
     bool force_next_flush;
-    bool request_timed_out;
 } IscsiLun;
 
 typedef struct IscsiTask {
@@ -82,6 +98,7 @@ typedef struct IscsiTask {
     Coroutine *co;
     QEMUBH *bh;
     IscsiLun *iscsilun;
+    IscsiSession *session;
     QEMUTimer retry_timer;
     bool force_next_flush;
 } IscsiTask;
@@ -211,7 +228,7 @@ iscsi_co_generic_cb(struct iscsi_context *iscsi, int status,
                     /* make sure the request is rescheduled AFTER the
                      * reconnect is initiated */
                     retry_time = EVENT_INTERVAL * 2;
-                    iTask->iscsilun->request_timed_out = true;
+                    iTask->session->request_timed_out = true;
                 }
                 error_report("iSCSI Busy/TaskSetFull/TimeOut"
                              " (retry #%u in %u ms): %s",
@@ -241,11 +258,17 @@ out:
     }
 }
 
+/* Retries of the task go to the same session */
 static void iscsi_co_init_iscsitask(IscsiLun *iscsilun, struct IscsiTask *iTask)
 {
+    IscsiSession *session;
+
+    session = &iscsilun->sessions[iscsilun->next_session++ %
+                                  iscsilun->num_sessions];
     *iTask = (struct IscsiTask) {
         .co         = qemu_coroutine_self(),
         .iscsilun   = iscsilun,
+        .session    = session,
     };
 }
 
@@ -285,36 +308,41 @@ static void iscsi_process_read(void *arg);
 static void iscsi_process_write(void *arg);
 
 static void
-iscsi_set_events(IscsiLun *iscsilun)
+iscsi_set_events(IscsiSession *session)
 {
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    struct iscsi_context *iscsi = session->iscsi;
     int ev = iscsi_which_events(iscsi);
 
-    if (ev != iscsilun->events) {
-        aio_set_fd_handler(iscsilun->aio_context,
+    if (ev != session->events) {
+        aio_set_fd_handler(session->iscsilun->aio_context,
                            iscsi_get_fd(iscsi),
                            (ev & POLLIN) ? iscsi_process_read : NULL,
                            (ev & POLLOUT) ? iscsi_process_write : NULL,
-                           iscsilun);
-        iscsilun->events = ev;
+                           session);
+        session->events = ev;
     }
 }
 
 static void iscsi_timed_check_events(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
+    int i;
 
-    /* check for timed out requests */
-    iscsi_service(iscsilun->iscsi, 0);
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        IscsiSession *session = &iscsilun->sessions[i];
 
-    if (iscsilun->request_timed_out) {
-        iscsilun->request_timed_out = false;
-        iscsi_reconnect(iscsilun->iscsi);
-    }
+        /* check for timed out requests */
+        iscsi_service(session->iscsi, 0);
+
+        if (session->request_timed_out) {
+            session->request_timed_out = false;
+            iscsi_reconnect(session->iscsi);
+        }
 
-    /* newer versions of libiscsi may return zero events. Ensure we are able
-     * to return to service once this situation changes. */
-    iscsi_set_events(iscsilun);
+        /* newer versions of libiscsi may return zero events. Ensure we are
+         * able to return to service once this situation changes. */
+        iscsi_set_events(session);
+    }
 
     timer_mod(iscsilun->event_timer,
               qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + EVENT_INTERVAL);
@@ -323,21 +351,19 @@ static void iscsi_timed_check_events(void *opaque)
 static void
 iscsi_process_read(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
 
-    iscsi_service(iscsi, POLLIN);
-    iscsi_set_events(iscsilun);
+    iscsi_service(session->iscsi, POLLIN);
+    iscsi_set_events(session);
 }
 
 static void
 iscsi_process_write(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
 
-    iscsi_service(iscsi, POLLOUT);
-    iscsi_set_events(iscsilun);
+    iscsi_service(session->iscsi, POLLOUT);
+    iscsi_set_events(session);
 }
 
 static int64_t sector_lun2qemu(int64_t sector, IscsiLun *iscsilun)
@@ -424,12 +450,14 @@ retry:
     fua = iscsilun->dpofua && !bs->enable_write_cache;
     iTask.force_next_flush = !fua;
     if (iscsilun->use_16_for_rw) {
-        iTask.task = iscsi_write16_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_write16_task(iTask.session->iscsi,
+                                        iscsilun->lun, lba,
                                         NULL, num_sectors * iscsilun->block_size,
                                         iscsilun->block_size, 0, 0, fua, 0, 0,
                                         iscsi_co_generic_cb, &iTask);
     } else {
-        iTask.task = iscsi_write10_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_write10_task(iTask.session->iscsi,
+                                        iscsilun->lun, lba,
                                         NULL, num_sectors * iscsilun->block_size,
                                         iscsilun->block_size, 0, 0, fua, 0, 0,
                                         iscsi_co_generic_cb, &iTask);
@@ -440,7 +468,7 @@ retry:
     scsi_task_set_iov_out(iTask.task, (struct scsi_iovec *) iov->iov,
                           iov->niov);
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -504,7 +532,7 @@ static int64_t coroutine_fn iscsi_co_get_block_status(BlockDriverState *bs,
     }
 
 retry:
-    if (iscsi_get_lba_status_task(iscsilun->iscsi, iscsilun->lun,
+    if (iscsi_get_lba_status_task(iTask.session->iscsi, iscsilun->lun,
                                   sector_qemu2lun(sector_num, iscsilun),
                                   8 + 16, iscsi_co_generic_cb,
                                   &iTask) == NULL) {
@@ -513,7 +541,7 @@ retry:
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -612,12 +640,14 @@ static int coroutine_fn iscsi_co_readv(BlockDriverState *bs,
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 retry:
     if (iscsilun->use_16_for_rw) {
-        iTask.task = iscsi_read16_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_read16_task(iTask.session->iscsi,
+                                       iscsilun->lun, lba,
                                        num_sectors * iscsilun->block_size,
                                        iscsilun->block_size, 0, 0, 0, 0, 0,
                                        iscsi_co_generic_cb, &iTask);
     } else {
-        iTask.task = iscsi_read10_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_read10_task(iTask.session->iscsi,
+                                       iscsilun->lun, lba,
                                        num_sectors * iscsilun->block_size,
                                        iscsilun->block_size,
                                        0, 0, 0, 0, 0,
@@ -629,7 +659,7 @@ retry:
     scsi_task_set_iov_in(iTask.task, (struct scsi_iovec *) iov->iov, iov->niov);
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -662,13 +692,14 @@ static int coroutine_fn iscsi_co_flush(BlockDriverState *bs)
 
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 retry:
-    if (iscsi_synchronizecache10_task(iscsilun->iscsi, iscsilun->lun, 0, 0, 0,
-                                      0, iscsi_co_generic_cb, &iTask) == NULL) {
+    if (iscsi_synchronizecache10_task(iTask.session->iscsi, iscsilun->lun,
+                                      0, 0, 0, 0,
+                                      iscsi_co_generic_cb, &iTask) == NULL) {
         return -ENOMEM;
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -804,7 +835,7 @@ static BlockAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
         }
     }
 
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(&iscsilun->sessions[0]);
 
     return &acb->common;
 }
@@ -877,13 +908,13 @@ coroutine_fn iscsi_co_discard(BlockDriverState *bs, int64_t sector_num,
 
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 retry:
-    if (iscsi_unmap_task(iscsilun->iscsi, iscsilun->lun, 0, 0, &list, 1,
+    if (iscsi_unmap_task(iTask.session->iscsi, iscsilun->lun, 0, 0, &list, 1,
                      iscsi_co_generic_cb, &iTask) == NULL) {
         return -ENOMEM;
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -959,12 +990,14 @@ coroutine_fn iscsi_co_write_zeroes(BlockDriverState *bs, int64_t sector_num,
     iTask.force_next_flush = true;
 retry:
     if (use_16_for_ws) {
-        iTask.task = iscsi_writesame16_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_writesame16_task(iTask.session->iscsi,
+                                            iscsilun->lun, lba,
                                             iscsilun->zeroblock, iscsilun->block_size,
                                             nb_blocks, 0, !!(flags & BDRV_REQ_MAY_UNMAP),
                                             0, 0, iscsi_co_generic_cb, &iTask);
     } else {
-        iTask.task = iscsi_writesame10_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_writesame10_task(iTask.session->iscsi,
+                                            iscsilun->lun, lba,
                                             iscsilun->zeroblock, iscsilun->block_size,
                                             nb_blocks, 0, !!(flags & BDRV_REQ_MAY_UNMAP),
                                             0, 0, iscsi_co_generic_cb, &iTask);
@@ -974,7 +1007,7 @@ retry:
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -1143,20 +1176,52 @@ static int parse_timeout(const char *target)
     return 0;
 }
 
+static int parse_sessions(const char *target, Error **errp)
+{
+    QemuOptsList *list;
+    QemuOpts *opts;
+    uint64_t sessions = 1;
+
+    list = qemu_find_opts("iscsi");
+    if (list) {
+        opts = qemu_opts_find(list, target);
+        if (!opts) {
+            opts = QTAILQ_FIRST(&list->head);
+        }
+        if (opts) {
+            sessions = qemu_opt_get_number(opts, "sessions", 1);
+        }
+    }
+
+    if (sessions < 1 || sessions > ISCSI_MAX_SESSIONS) {
+        error_setg(errp, "iSCSI: sessions must be between 1 and %d",
+                   ISCSI_MAX_SESSIONS);
+        return -1;
+    }
+    return sessions;
+}
+
 static void iscsi_nop_timed_event(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
-
-    if (iscsi_get_nops_in_flight(iscsilun->iscsi) >= MAX_NOP_FAILURES) {
-        error_report("iSCSI: NOP timeout. Reconnecting...");
-        iscsilun->request_timed_out = true;
-    } else if (iscsi_nop_out_async(iscsilun->iscsi, NULL, NULL, 0, NULL) != 0) {
-        error_report("iSCSI: failed to sent NOP-Out. Disabling NOP messages.");
-        return;
+    int i;
+
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        IscsiSession *session = &iscsilun->sessions[i];
+
+        if (iscsi_get_nops_in_flight(session->iscsi) >= MAX_NOP_FAILURES) {
+            error_report("iSCSI: NOP timeout. Reconnecting...");
+            session->request_timed_out = true;
+        } else if (iscsi_nop_out_async(session->iscsi, NULL, NULL, 0,
+                                       NULL) != 0) {
+            error_report("iSCSI: failed to sent NOP-Out. "
+                         "Disabling NOP messages.");
+            return;
+        }
+        iscsi_set_events(session);
     }
 
     timer_mod(iscsilun->nop_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + NOP_INTERVAL);
-    iscsi_set_events(iscsilun);
 }
 
 static void iscsi_readcapacity_sync(IscsiLun *iscsilun, Error **errp)
@@ -1279,11 +1344,14 @@ fail_with_err:
 static void iscsi_detach_aio_context(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
+    int i;
 
-    aio_set_fd_handler(iscsilun->aio_context,
-                       iscsi_get_fd(iscsilun->iscsi),
-                       NULL, NULL, NULL);
-    iscsilun->events = 0;
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        aio_set_fd_handler(iscsilun->aio_context,
+                           iscsi_get_fd(iscsilun->sessions[i].iscsi),
+                           NULL, NULL, NULL);
+        iscsilun->sessions[i].events = 0;
+    }
 
     if (iscsilun->nop_timer) {
         timer_del(iscsilun->nop_timer);
@@ -1301,9 +1369,12 @@ static void iscsi_attach_aio_context(BlockDriverState *bs,
                                      AioContext *new_context)
 {
     IscsiLun *iscsilun = bs->opaque;
+    int i;
 
     iscsilun->aio_context = new_context;
-    iscsi_set_events(iscsilun);
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        iscsi_set_events(&iscsilun->sessions[i]);
+    }
 
     /* Set up a timer for sending out iSCSI NOPs */
     iscsilun->nop_timer = aio_timer_new(iscsilun->aio_context,
@@ -1356,57 +1427,33 @@ out:
     }
 }
 
-/*
- * We support iscsi url's on the form
- * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
- */
-static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
-                      Error **errp)
+static void iscsi_session_close(struct iscsi_context *iscsi)
 {
-    IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = NULL;
-    struct iscsi_url *iscsi_url = NULL;
-    struct scsi_task *task = NULL;
-    struct scsi_inquiry_standard *inq = NULL;
-    struct scsi_inquiry_supported_pages *inq_vpd;
-    char *initiator_name = NULL;
-    QemuOpts *opts;
-    Error *local_err = NULL;
-    const char *filename;
-    int i, ret = 0, timeout = 0;
-
-    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
-    qemu_opts_absorb_qdict(opts, options, &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        ret = -EINVAL;
-        goto out;
-    }
-
-    filename = qemu_opt_get(opts, "filename");
-
-    iscsi_url = iscsi_parse_full_url(iscsi, filename);
-    if (iscsi_url == NULL) {
-        error_setg(errp, "Failed to parse URL : %s", filename);
-        ret = -EINVAL;
-        goto out;
+    if (iscsi_is_logged_in(iscsi)) {
+        iscsi_logout_sync(iscsi);
     }
+    iscsi_destroy_context(iscsi);
+}
 
-    memset(iscsilun, 0, sizeof(IscsiLun));
-
-    initiator_name = parse_initiator_name(iscsi_url->target);
+/* Log into the target of @iscsi_url and connect to the LUN */
+static int iscsi_session_connect(struct iscsi_url *iscsi_url,
+                                 const char *initiator_name,
+                                 struct iscsi_context **piscsi, Error **errp)
+{
+    struct iscsi_context *iscsi;
+    Error *local_err = NULL;
+    int ret, timeout;
 
     iscsi = iscsi_create_context(initiator_name);
     if (iscsi == NULL) {
         error_setg(errp, "iSCSI: Failed to create iSCSI context.");
-        ret = -ENOMEM;
-        goto out;
+        return -ENOMEM;
     }
 
     if (iscsi_set_targetname(iscsi, iscsi_url->target)) {
         error_setg(errp, "iSCSI: Failed to set target name.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_url->user[0] != '\0') {
@@ -1415,7 +1462,7 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
         if (ret != 0) {
             error_setg(errp, "Failed to set initiator username and password");
             ret = -EINVAL;
-            goto out;
+            goto fail;
         }
     }
 
@@ -1424,13 +1471,13 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     if (local_err != NULL) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0) {
         error_setg(errp, "iSCSI: Failed to set session type to normal.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
@@ -1440,7 +1487,7 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     if (local_err != NULL) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     /* timeout handling is broken in libiscsi before 1.15.0 */
@@ -1457,10 +1504,82 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
         error_setg(errp, "iSCSI: Failed to connect to LUN : %s",
             iscsi_get_error(iscsi));
         ret = -EINVAL;
+        goto fail;
+    }
+
+    *piscsi = iscsi;
+    return 0;
+
+fail:
+    iscsi_session_close(iscsi);
+    return ret;
+}
+
+/* Log out of all sessions but the first */
+static void iscsi_close_extra_sessions(IscsiLun *iscsilun)
+{
+    while (iscsilun->num_sessions > 1) {
+        iscsi_session_close(iscsilun->sessions[--iscsilun->num_sessions].iscsi);
+    }
+}
+
+/*
+ * We support iscsi url's on the form
+ * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
+ */
+static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    struct iscsi_context *iscsi = NULL;
+    struct iscsi_url *iscsi_url = NULL;
+    struct scsi_task *task = NULL;
+    struct scsi_inquiry_standard *inq = NULL;
+    struct scsi_inquiry_supported_pages *inq_vpd;
+    char *initiator_name = NULL;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *filename;
+    int i, ret = 0, num_sessions;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    filename = qemu_opt_get(opts, "filename");
+
+    iscsi_url = iscsi_parse_full_url(iscsi, filename);
+    if (iscsi_url == NULL) {
+        error_setg(errp, "Failed to parse URL : %s", filename);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    memset(iscsilun, 0, sizeof(IscsiLun));
+
+    initiator_name = parse_initiator_name(iscsi_url->target);
+
+    num_sessions = parse_sessions(iscsi_url->target, errp);
+    if (num_sessions < 0) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    ret = iscsi_session_connect(iscsi_url, initiator_name, &iscsi, errp);
+    if (ret < 0) {
         goto out;
     }
 
     iscsilun->iscsi = iscsi;
+    iscsilun->sessions[0] = (IscsiSession) {
+        .iscsilun   = iscsilun,
+        .iscsi      = iscsi,
+    };
+    iscsilun->num_sessions = 1;
     iscsilun->aio_context = bdrv_get_aio_context(bs);
     iscsilun->lun   = iscsi_url->lun;
     iscsilun->has_write_same = true;
@@ -1545,6 +1664,19 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     scsi_free_scsi_task(task);
     task = NULL;
 
+    /* The further sessions only carry I/O, which needs no setup */
+    while (iscsilun->num_sessions < num_sessions) {
+        IscsiSession *session = &iscsilun->sessions[iscsilun->num_sessions];
+
+        ret = iscsi_session_connect(iscsi_url, initiator_name,
+                                    &session->iscsi, errp);
+        if (ret < 0) {
+            goto out;
+        }
+        session->iscsilun = iscsilun;
+        iscsilun->num_sessions++;
+    }
+
     iscsi_attach_aio_context(bs, iscsilun->aio_context);
 
     /* Guess the internal cluster (page) size of the iscsi target by the means
@@ -1573,11 +1705,9 @@ out:
     }
 
     if (ret) {
+        iscsi_close_extra_sessions(iscsilun);
         if (iscsi != NULL) {
-            if (iscsi_is_logged_in(iscsi)) {
-                iscsi_logout_sync(iscsi);
-            }
-            iscsi_destroy_context(iscsi);
+            iscsi_session_close(iscsi);
         }
         memset(iscsilun, 0, sizeof(IscsiLun));
     }
@@ -1587,13 +1717,10 @@ out:
 static void iscsi_close(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
 
     iscsi_detach_aio_context(bs);
-    if (iscsi_is_logged_in(iscsi)) {
-        iscsi_logout_sync(iscsi);
-    }
-    iscsi_destroy_context(iscsi);
+    iscsi_close_extra_sessions(iscsilun);
+    iscsi_session_close(iscsilun->iscsi);
     g_free(iscsilun->zeroblock);
     g_free(iscsilun->allocationmap);
     memset(iscsilun, 0, sizeof(IscsiLun));
@@ -1716,6 +1843,7 @@ static int iscsi_create(const char *filename, QemuOpts *opts, Error **errp)
 
     ret = 0;
 out:
+    iscsi_close_extra_sessions(iscsilun);
     if (iscsilun->iscsi != NULL) {
         iscsi_destroy_context(iscsilun->iscsi);
     }
@@ -1805,6 +1933,11 @@ static QemuOptsList qemu_iscsi_opts = {
             .name = "timeout",
             .type = QEMU_OPT_NUMBER,
             .help = "Request timeout in seconds (default 0 = no timeout)",
+        },{
+            .name = "sessions",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of sessions (TCP connections) to use per LUN "
+                    "(default 1)",
         },
         { /* end of list */ }
     },
@@ -16,14 +16,14 @@
 #include <libaio.h>
 
 /*
- * Queue size (per-device).
+ * Queue size (per-AioContext, shared by all of its images).
  *
  * XXX: eventually we need to communicate this to the guest and/or make it
  *      tunable by the guest.  If we get more outstanding requests at a time
  *      than this we will get EAGAIN from io_submit which is communicated to
  *      the guest as an I/O error.
  */
-#define MAX_EVENTS 128
+#define MAX_EVENTS 1024
 
 #define MAX_QUEUED_IO  128
 
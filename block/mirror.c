@@ -19,7 +19,9 @@
 #include "qemu/bitmap.h"
 
 #define SLICE_TIME    100000000ULL /* ns */
-#define MAX_IN_FLIGHT 16
+#define MIN_IN_FLIGHT 4
+#define DEFAULT_IN_FLIGHT 16
+#define MAX_IN_FLIGHT 64
 #define DEFAULT_MIRROR_BUF_SIZE   (10 << 20)
 
 /* The mirroring buffer is a list of granularity-sized chunks.
@@ -29,6 +31,15 @@ typedef struct MirrorBuffer {
     QSIMPLEQ_ENTRY(MirrorBuffer) next;
 } MirrorBuffer;
 
+/* A guest write that is being copied to the target in write-blocking mode */
+typedef struct MirrorActiveWrite {
+    BdrvTrackedRequest *req;
+    int64_t first_chunk;
+    int nb_chunks;
+    bool copied;
+    QLIST_ENTRY(MirrorActiveWrite) next;
+} MirrorActiveWrite;
+
 typedef struct MirrorBlockJob {
     BlockJob common;
     RateLimit limit;
@@ -61,6 +72,20 @@ typedef struct MirrorBlockJob {
     int ret;
     bool unmap;
     bool waiting_for_io;
+
+    /* Adaptive in-flight depth, see mirror_update_in_flight() */
+    int max_in_flight;
+    uint64_t latency_ns;
+    int latency_count;
+    uint64_t best_latency_ns;
+
+    MirrorCopyMode copy_mode;
+    bool write_blocking;
+    NotifierWithReturn before_write;
+    Notifier after_write;
+    QLIST_HEAD(, MirrorActiveWrite) active_writes;
+    CoQueue in_flight_queue;
+    int writers_waiting;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -68,6 +93,7 @@ typedef struct MirrorOp {
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
+    int64_t start_ns;
 } MirrorOp;
 
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
@@ -83,6 +109,55 @@ static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
     }
 }
 
+/* Lets the guest writes and the job coroutine that wait for chunks to be
+ * out of flight look again.  Writers that find their chunks still busy queue
+ * up anew, so only those that were waiting on entry are woken.
+ */
+static void mirror_wake_waiters(MirrorBlockJob *s)
+{
+    int n = s->writers_waiting;
+
+    while (n-- > 0 && qemu_co_enter_next(&s->in_flight_queue)) {
+        /* nothing */
+    }
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+/* Once the copies that completed since the last adjustment make up a full
+ * queue, compare their average latency with the best one seen so far.  Up
+ * to twice the best, the target is not saturated yet and one more request
+ * may be in flight; beyond that, requests mostly wait in queues and the
+ * depth is cut by a quarter.  The best latency creeps up whenever it is
+ * exceeded, so that it follows a device that got slower.
+ */
+static void mirror_update_in_flight(MirrorBlockJob *s, uint64_t latency_ns)
+{
+    uint64_t avg;
+
+    s->latency_ns += latency_ns;
+    if (++s->latency_count < s->max_in_flight) {
+        return;
+    }
+
+    avg = s->latency_ns / s->latency_count;
+    s->latency_ns = 0;
+    s->latency_count = 0;
+    if (!s->best_latency_ns || avg < s->best_latency_ns) {
+        s->best_latency_ns = avg;
+    }
+
+    if (avg <= 2 * s->best_latency_ns) {
+        s->max_in_flight = MIN(s->max_in_flight + 1, MAX_IN_FLIGHT);
+    } else {
+        s->max_in_flight = MAX(s->max_in_flight * 3 / 4, MIN_IN_FLIGHT);
+        s->best_latency_ns += s->best_latency_ns / 8;
+    }
+    trace_mirror_update_in_flight(s, avg, s->best_latency_ns,
+                                  s->max_in_flight);
+}
+
 static void mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -110,14 +185,16 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
             bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
         }
         s->common.offset += (uint64_t)op->nb_sectors * BDRV_SECTOR_SIZE;
+        if (op->start_ns) {
+            mirror_update_in_flight(s, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                       op->start_ns);
+        }
     }
 
     qemu_iovec_destroy(&op->qiov);
     g_slice_free(MirrorOp, op);
 
-    if (s->waiting_for_io) {
-        qemu_coroutine_enter(s->common.co, NULL);
-    }
+    mirror_wake_waiters(s);
 }
 
 static void mirror_write_complete(void *opaque, int ret)
@@ -156,11 +233,84 @@ static void mirror_read_complete(void *opaque, int ret)
                     mirror_write_complete, op);
 }
 
+/* Advance the HBitmapIter past @nb_chunks chunks from @sector_num, that are
+ * about to be copied, so that we do not examine the same sector twice.
+ */
+static void mirror_skip_chunks(MirrorBlockJob *s, int64_t sector_num,
+                               int nb_chunks)
+{
+    BlockDriverState *source = s->common.bs;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t hbitmap_next_sector = s->sector_num;
+
+    while (nb_chunks-- > 0) {
+        if (sector_num > hbitmap_next_sector
+            && bdrv_get_dirty(source, s->dirty_bitmap, sector_num)) {
+            hbitmap_next_sector = hbitmap_iter_next(&s->hbi);
+        }
+        sector_num += sectors_per_chunk;
+    }
+}
+
+/* Send the dirty chunks from @sector_num that read as zeroes, or that are
+ * not allocated, to the target without reading them.  They take no buffer,
+ * so the run is only bounded by @max_sectors, the extent of the block
+ * status; @max_sectors is a multiple of the granularity unless it reaches
+ * the end of the device.
+ */
+static uint64_t mirror_do_zero_or_discard(MirrorBlockJob *s,
+                                          int64_t sector_num, int max_sectors,
+                                          bool is_discard)
+{
+    BlockDriverState *source = s->common.bs;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t chunk_num = sector_num / sectors_per_chunk;
+    int nb_sectors = 0, nb_chunks = 0;
+    uint64_t delay_ns = 0;
+    MirrorOp *op;
+
+    do {
+        nb_sectors += sectors_per_chunk;
+        nb_chunks++;
+    } while (nb_sectors < max_sectors &&
+             bdrv_get_dirty(source, s->dirty_bitmap, sector_num + nb_sectors) &&
+             !test_bit(chunk_num + nb_chunks, s->in_flight_bitmap));
+    nb_sectors = MIN(nb_sectors, max_sectors);
+
+    if (!s->synced && s->common.speed) {
+        delay_ns = ratelimit_calculate_delay(&s->limit, nb_sectors);
+    }
+
+    mirror_skip_chunks(s, sector_num, nb_chunks);
+    bitmap_set(s->in_flight_bitmap, chunk_num, nb_chunks);
+    bdrv_reset_dirty_bitmap(s->dirty_bitmap, sector_num, nb_sectors);
+
+    op = g_slice_new0(MirrorOp);
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    qemu_iovec_init(&op->qiov, 0);
+
+    s->in_flight++;
+    s->sectors_in_flight += nb_sectors;
+    trace_mirror_one_iteration(s, sector_num, nb_sectors);
+
+    if (is_discard) {
+        bdrv_aio_discard(s->target, sector_num, nb_sectors,
+                         mirror_write_complete, op);
+    } else {
+        bdrv_aio_write_zeroes(s->target, sector_num, nb_sectors,
+                              s->unmap ? BDRV_REQ_MAY_UNMAP : 0,
+                              mirror_write_complete, op);
+    }
+    return delay_ns;
+}
+
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->common.bs;
     int nb_sectors, sectors_per_chunk, nb_chunks;
-    int64_t end, sector_num, next_chunk, next_sector, hbitmap_next_sector;
+    int64_t end, sector_num, next_chunk, next_sector;
     uint64_t delay_ns = 0;
     MirrorOp *op;
     int pnum;
@@ -174,7 +324,6 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         assert(s->sector_num >= 0);
     }
 
-    hbitmap_next_sector = s->sector_num;
     sector_num = s->sector_num;
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     end = s->bdev_length / BDRV_SECTOR_SIZE;
@@ -205,6 +354,33 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         s->waiting_for_io = false;
     }
 
+    /* The dirty bitmap may come back to this chunk while a write-blocking
+     * guest write holds it; there is nothing left to copy then.
+     */
+    if (!bdrv_get_dirty(source, s->dirty_bitmap, sector_num)) {
+        return 0;
+    }
+
+    /* Zeroes and unallocated clusters need no buffer, see if this is the
+     * start of such a run.  When the target needs COW, chunks have to be
+     * rounded to its clusters; leave that to the buffered copy below.
+     */
+    if (!s->cow_bitmap) {
+        ret = bdrv_get_block_status_above(source, NULL, sector_num,
+                                          MIN(end - sector_num,
+                                              BDRV_REQUEST_MAX_SECTORS),
+                                          &pnum);
+        if (ret >= 0 && (!(ret & BDRV_BLOCK_DATA) || (ret & BDRV_BLOCK_ZERO))) {
+            if (sector_num + pnum < end) {
+                pnum -= pnum % sectors_per_chunk;
+            }
+            if (pnum > 0) {
+                return mirror_do_zero_or_discard(s, sector_num, pnum,
+                                                 !(ret & BDRV_BLOCK_ZERO));
+            }
+        }
+    }
+
     do {
         int added_sectors, added_chunks;
 
@@ -260,7 +436,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     } while (delay_ns == 0 && next_sector < end);
 
     /* Allocate a MirrorOp that is used as an AIO callback.  */
-    op = g_slice_new(MirrorOp);
+    op = g_slice_new0(MirrorOp);
     op->s = s;
     op->sector_num = sector_num;
     op->nb_sectors = nb_sectors;
@@ -269,7 +445,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
      * from s->buf_free.
      */
     qemu_iovec_init(&op->qiov, nb_chunks);
-    next_sector = sector_num;
+    mirror_skip_chunks(s, sector_num, nb_chunks);
     while (nb_chunks-- > 0) {
         MirrorBuffer *buf = QSIMPLEQ_FIRST(&s->buf_free);
         size_t remaining = (nb_sectors * BDRV_SECTOR_SIZE) - op->qiov.size;
@@ -277,16 +453,6 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         QSIMPLEQ_REMOVE_HEAD(&s->buf_free, next);
         s->buf_free_count--;
         qemu_iovec_add(&op->qiov, buf, MIN(s->granularity, remaining));
-
-        /* Advance the HBitmapIter in parallel, so that we do not examine
-         * the same sector twice.
-         */
-        if (next_sector > hbitmap_next_sector
-            && bdrv_get_dirty(source, s->dirty_bitmap, next_sector)) {
-            hbitmap_next_sector = hbitmap_iter_next(&s->hbi);
-        }
-
-        next_sector += sectors_per_chunk;
     }
 
     bdrv_reset_dirty_bitmap(s->dirty_bitmap, sector_num, nb_sectors);
@@ -300,6 +466,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
                                       nb_sectors, &pnum);
     if (ret < 0 || pnum < nb_sectors ||
             (ret & BDRV_BLOCK_DATA && !(ret & BDRV_BLOCK_ZERO))) {
+        op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
                        mirror_read_complete, op);
     } else if (ret & BDRV_BLOCK_ZERO) {
@@ -314,6 +481,104 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     return delay_ns;
 }
 
+/* In write-blocking mode, guest writes are copied to the target before they
+ * complete, so that a busy guest cannot keep the dirty bitmap from shrinking.
+ * Their chunks stay in flight until the source has the data, too, so that
+ * a background copy of old data cannot overtake them.
+ *
+ * Writes that the block layer pads for alignment are left to the background
+ * copy, as are all writes if the target needs COW: writing part of one of its
+ * clusters would hide the rest of the backing data.
+ */
+static int coroutine_fn mirror_before_write_notify(NotifierWithReturn *notifier,
+                                                   void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, before_write);
+    BdrvTrackedRequest *req = opaque;
+    int64_t sector_num = req->offset >> BDRV_SECTOR_BITS;
+    int nb_sectors = req->bytes >> BDRV_SECTOR_BITS;
+    MirrorActiveWrite *w;
+    int64_t end_chunk;
+    int ret;
+
+    if (s->ret < 0 || s->cow_bitmap ||
+        (!req->qiov && !(req->flags & BDRV_REQ_ZERO_WRITE))) {
+        return 0;
+    }
+
+    w = g_new0(MirrorActiveWrite, 1);
+    w->req = req;
+    w->first_chunk = req->offset / s->granularity;
+    end_chunk = DIV_ROUND_UP(req->offset + req->bytes, s->granularity);
+    w->nb_chunks = end_chunk - w->first_chunk;
+
+    while (find_next_bit(s->in_flight_bitmap, end_chunk, w->first_chunk) <
+           end_chunk) {
+        s->writers_waiting++;
+        qemu_co_queue_wait(&s->in_flight_queue);
+        s->writers_waiting--;
+    }
+    bitmap_set(s->in_flight_bitmap, w->first_chunk, w->nb_chunks);
+    QLIST_INSERT_HEAD(&s->active_writes, w, next);
+
+    trace_mirror_active_write(s, sector_num, nb_sectors);
+    if (req->flags & BDRV_REQ_ZERO_WRITE) {
+        ret = bdrv_co_write_zeroes(s->target, sector_num, nb_sectors,
+                                   req->flags & BDRV_REQ_MAY_UNMAP);
+    } else {
+        ret = bdrv_co_writev(s->target, sector_num, nb_sectors, req->qiov);
+    }
+    if (ret < 0) {
+        if (mirror_error_action(s, false, -ret) == BLOCK_ERROR_ACTION_REPORT &&
+            s->ret >= 0) {
+            s->ret = ret;
+        }
+    } else {
+        w->copied = true;
+    }
+
+    /* The guest write goes ahead even if the target failed; its chunks are
+     * dirty then and the background copy retries them.
+     */
+    return 0;
+}
+
+static void mirror_after_write_notify(Notifier *notifier, void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, after_write);
+    BdrvTrackedRequest *req = opaque;
+    MirrorActiveWrite *w;
+
+    QLIST_FOREACH(w, &s->active_writes, next) {
+        if (w->req == req) {
+            break;
+        }
+    }
+    if (!w) {
+        return;
+    }
+    QLIST_REMOVE(w, next);
+
+    if (w->copied && req->ret >= 0) {
+        /* Only the chunks that the write covers entirely are clean now */
+        int64_t start = ROUND_UP(req->offset, s->granularity);
+        int64_t end = req->offset + req->bytes;
+
+        if (end < s->bdev_length) {
+            end &= ~(s->granularity - 1);
+        }
+        if (end > start) {
+            bdrv_reset_dirty_bitmap(s->dirty_bitmap, start >> BDRV_SECTOR_BITS,
+                                    (end - start) >> BDRV_SECTOR_BITS);
+            s->common.offset += end - start;
+        }
+    }
+
+    bitmap_clear(s->in_flight_bitmap, w->first_chunk, w->nb_chunks);
+    g_free(w);
+    mirror_wake_waiters(s);
+}
+
 static void mirror_free_init(MirrorBlockJob *s)
 {
     int granularity = s->granularity;
@@ -439,7 +704,7 @@ static void coroutine_fn mirror_run(void *opaque)
     }
 
     end = s->bdev_length / BDRV_SECTOR_SIZE;
-    s->buf = qemu_try_blockalign(bs, s->buf_size);
+    s->buf = qemu_try_blockalign_pooled(bs, s->buf_size);
     if (s->buf == NULL) {
         ret = -ENOMEM;
         goto immediate_exit;
@@ -447,6 +712,14 @@ static void coroutine_fn mirror_run(void *opaque)
 
     mirror_free_init(s);
 
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        s->before_write.notify = mirror_before_write_notify;
+        bdrv_add_before_write_notifier(bs, &s->before_write);
+        s->after_write.notify = mirror_after_write_notify;
+        bdrv_add_after_write_notifier(bs, &s->after_write);
+        s->write_blocking = true;
+    }
+
     last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     if (!s->is_none_mode) {
         /* First part, loop on the sectors and initialize the dirty bitmap.  */
@@ -506,7 +779,7 @@ static void coroutine_fn mirror_run(void *opaque)
          */
         if (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - last_pause_ns < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight == MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
                 s->waiting_for_io = true;
@@ -580,6 +853,17 @@ static void coroutine_fn mirror_run(void *opaque)
     }
 
 immediate_exit:
+    if (s->write_blocking) {
+        /* No new writes are copied after this; wait for those that are */
+        notifier_with_return_remove(&s->before_write);
+        while (!QLIST_EMPTY(&s->active_writes) || s->writers_waiting) {
+            s->waiting_for_io = true;
+            qemu_coroutine_yield();
+            s->waiting_for_io = false;
+        }
+        notifier_remove(&s->after_write);
+    }
+
     if (s->in_flight > 0) {
         /* We get here only if something went wrong.  Either the job failed,
          * or it was cancelled prematurely so that we do not guarantee that
@@ -590,7 +874,7 @@ immediate_exit:
     }
 
     assert(s->in_flight == 0);
-    qemu_vfree(s->buf);
+    qemu_vfree_pooled(bs, s->buf, s->buf_size);
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
     bdrv_release_dirty_bitmap(bs, s->dirty_bitmap);
@@ -684,7 +968,7 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
                              int64_t buf_size,
                              BlockdevOnError on_source_error,
                              BlockdevOnError on_target_error,
-                             bool unmap,
+                             bool unmap, MirrorCopyMode copy_mode,
                              BlockCompletionFunc *cb,
                              void *opaque, Error **errp,
                              const BlockJobDriver *driver,
@@ -728,6 +1012,10 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->copy_mode = copy_mode;
+    s->max_in_flight = DEFAULT_IN_FLIGHT;
+    QLIST_INIT(&s->active_writes);
+    qemu_co_queue_init(&s->in_flight_queue);
 
     s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
     if (!s->dirty_bitmap) {
@@ -748,7 +1036,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, uint32_t granularity, int64_t buf_size,
                   MirrorSyncMode mode, BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
-                  bool unmap,
+                  bool unmap, MirrorCopyMode copy_mode,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp)
 {
@@ -763,8 +1051,8 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
     base = mode == MIRROR_SYNC_MODE_TOP ? bs->backing_hd : NULL;
     mirror_start_job(bs, target, replaces,
                      speed, granularity, buf_size,
-                     on_source_error, on_target_error, unmap, cb, opaque, errp,
-                     &mirror_job_driver, is_none_mode, base);
+                     on_source_error, on_target_error, unmap, copy_mode,
+                     cb, opaque, errp, &mirror_job_driver, is_none_mode, base);
 }
 
 void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
@@ -811,7 +1099,8 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
 
     bdrv_ref(base);
     mirror_start_job(bs, base, NULL, speed, 0, 0,
-                     on_error, on_error, false, cb, opaque, &local_err,
+                     on_error, on_error, false, MIRROR_COPY_MODE_BACKGROUND,
+                     cb, opaque, &local_err,
                      &commit_active_job_driver, false, base);
     if (local_err) {
         error_propagate(errp, local_err);
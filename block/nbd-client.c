@@ -29,51 +29,57 @@
 #include "nbd-client.h"
 #include "qemu/sockets.h"
 
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
+#define HANDLE_TO_INDEX(conn, handle) ((handle) ^ ((uint64_t)(intptr_t)conn))
+#define INDEX_TO_HANDLE(conn, index)  ((index)  ^ ((uint64_t)(intptr_t)conn))
 
-static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
+static void nbd_recv_coroutines_enter_all(NbdConnection *conn)
 {
     int i;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i]) {
-            qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+        if (conn->recv_coroutine[i]) {
+            qemu_coroutine_enter(conn->recv_coroutine[i], NULL);
         }
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_connection_detach_aio_context(NbdConnection *conn,
+                                              AioContext *old_context)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
+    if (conn->sock >= 0) {
+        aio_set_fd_handler(old_context, conn->sock, NULL, NULL, NULL);
+    }
+}
 
+/* The other connections stay up; requests only fail once all are gone */
+static void nbd_teardown_connection(NbdConnection *conn)
+{
     /* finish any pending coroutines */
-    shutdown(client->sock, 2);
-    nbd_recv_coroutines_enter_all(client);
+    shutdown(conn->sock, 2);
+    nbd_recv_coroutines_enter_all(conn);
 
-    nbd_client_detach_aio_context(bs);
-    closesocket(client->sock);
-    client->sock = -1;
+    nbd_connection_detach_aio_context(conn, bdrv_get_aio_context(conn->bs));
+    closesocket(conn->sock);
+    conn->sock = -1;
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    NbdClientSession *s = nbd_get_client_session(bs);
+    NbdConnection *conn = opaque;
     uint64_t i;
     int ret;
 
-    if (s->reply.handle == 0) {
+    if (conn->reply.handle == 0) {
         /* No reply already in flight.  Fetch a header.  It is possible
          * that another thread has done the same thing in parallel, so
          * the socket is not readable anymore.
          */
-        ret = nbd_receive_reply(s->sock, &s->reply);
+        ret = nbd_receive_reply(conn->sock, &conn->reply);
         if (ret == -EAGAIN) {
             return;
         }
         if (ret < 0) {
-            s->reply.handle = 0;
+            conn->reply.handle = 0;
             goto fail;
         }
     }
@@ -81,147 +87,314 @@ static void nbd_reply_ready(void *opaque)
     /* There's no need for a mutex on the receive side, because the
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
-    i = HANDLE_TO_INDEX(s, s->reply.handle);
+    i = HANDLE_TO_INDEX(conn, conn->reply.handle);
     if (i >= MAX_NBD_REQUESTS) {
         goto fail;
     }
 
-    if (s->recv_coroutine[i]) {
-        qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+    if (conn->recv_coroutine[i]) {
+        qemu_coroutine_enter(conn->recv_coroutine[i], NULL);
         return;
     }
 
 fail:
-    nbd_teardown_connection(bs);
+    nbd_teardown_connection(conn);
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BlockDriverState *bs = opaque;
+    NbdConnection *conn = opaque;
 
-    qemu_coroutine_enter(nbd_get_client_session(bs)->send_coroutine, NULL);
+    qemu_coroutine_enter(conn->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NbdClientSession *s, NbdConnection *conn,
                                struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
-    NbdClientSession *s = nbd_get_client_session(bs);
     AioContext *aio_context;
     int rc, ret, i;
 
-    qemu_co_mutex_lock(&s->send_mutex);
+    qemu_co_mutex_lock(&conn->send_mutex);
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i] == NULL) {
-            s->recv_coroutine[i] = qemu_coroutine_self();
+        if (conn->recv_coroutine[i] == NULL) {
+            conn->recv_coroutine[i] = qemu_coroutine_self();
             break;
         }
     }
 
     assert(i < MAX_NBD_REQUESTS);
-    request->handle = INDEX_TO_HANDLE(s, i);
-    s->send_coroutine = qemu_coroutine_self();
-    aio_context = bdrv_get_aio_context(bs);
+    request->handle = INDEX_TO_HANDLE(conn, i);
+
+    /* The connection may have gone away while we waited for the lock */
+    if (conn->sock < 0) {
+        qemu_co_mutex_unlock(&conn->send_mutex);
+        return -EIO;
+    }
+
+    conn->send_coroutine = qemu_coroutine_self();
+    aio_context = bdrv_get_aio_context(conn->bs);
 
-    aio_set_fd_handler(aio_context, s->sock,
-                       nbd_reply_ready, nbd_restart_write, bs);
+    aio_set_fd_handler(aio_context, conn->sock,
+                       nbd_reply_ready, nbd_restart_write, conn);
     if (qiov) {
         if (!s->is_unix) {
-            socket_set_cork(s->sock, 1);
+            socket_set_cork(conn->sock, 1);
         }
-        rc = nbd_send_request(s->sock, request);
+        rc = nbd_send_request(conn->sock, request);
         if (rc >= 0) {
-            ret = qemu_co_sendv(s->sock, qiov->iov, qiov->niov,
+            ret = qemu_co_sendv(conn->sock, qiov->iov, qiov->niov,
                                 offset, request->len);
             if (ret != request->len) {
                 rc = -EIO;
             }
         }
         if (!s->is_unix) {
-            socket_set_cork(s->sock, 0);
+            socket_set_cork(conn->sock, 0);
         }
     } else {
-        rc = nbd_send_request(s->sock, request);
+        rc = nbd_send_request(conn->sock, request);
     }
-    aio_set_fd_handler(aio_context, s->sock, nbd_reply_ready, NULL, bs);
-    s->send_coroutine = NULL;
-    qemu_co_mutex_unlock(&s->send_mutex);
+    aio_set_fd_handler(aio_context, conn->sock, nbd_reply_ready, NULL, conn);
+    conn->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&conn->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(NbdClientSession *s,
+static bool nbd_co_read(NbdConnection *conn, void *buf, uint32_t *len,
+                        uint32_t size)
+{
+    if (*len < size) {
+        return false;
+    }
+    *len -= size;
+    return qemu_co_recv(conn->sock, buf, size) == size;
+}
+
+static void nbd_co_drop(NbdConnection *conn, uint32_t len)
+{
+    uint8_t buf[512];
+    uint32_t size;
+
+    while (len) {
+        size = MIN(len, sizeof(buf));
+        if (!nbd_co_read(conn, buf, &len, size)) {
+            return;
+        }
+    }
+}
+
+/* Take the payload of a structured reply chunk for @request.  Data goes
+ * to @qiov from @offset, extents to @extents.
+ *
+ * Returns an errno value, but the payload is consumed in any case.
+ */
+static int nbd_co_receive_chunk(NbdConnection *conn,
+    struct nbd_request *request, struct nbd_reply *chunk,
+    QEMUIOVector *qiov, int offset, NbdExtent *extents, int *nb_extents)
+{
+    uint32_t len = chunk->length;
+    uint8_t buf[8 + 4];
+    uint64_t from;
+    uint32_t size;
+    int ret = EIO;
+    int i;
+
+    switch (chunk->type) {
+    case NBD_REPLY_TYPE_NONE:
+        ret = 0;
+        break;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (!qiov || !nbd_co_read(conn, buf, &len, 8)) {
+            break;
+        }
+        from = be64_to_cpup((uint64_t *)buf);
+        if (chunk->type == NBD_REPLY_TYPE_OFFSET_DATA) {
+            size = len;
+        } else if (len == 4 && nbd_co_read(conn, buf + 8, &len, 4)) {
+            size = be32_to_cpup((uint32_t *)(buf + 8));
+        } else {
+            break;
+        }
+        if (from < request->from ||
+            size > request->from + request->len - from) {
+            break;
+        }
+
+        from -= request->from;
+        if (chunk->type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+            qemu_iovec_memset(qiov, offset + from, 0, size);
+        } else if (qemu_co_recvv(conn->sock, qiov->iov, qiov->niov,
+                                 offset + from, size) == size) {
+            len = 0;
+        } else {
+            /* the connection is broken, do not try to drop the rest */
+            return EIO;
+        }
+        ret = 0;
+        break;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        /* context id, then length and flags of each extent */
+        if (!extents || len < 4 + 8 || (len - 4) % 8 ||
+            !nbd_co_read(conn, buf, &len, 4) ||
+            be32_to_cpup((uint32_t *)buf) != conn->context_id) {
+            break;
+        }
+        for (i = 0; len && i < NBD_MAX_EXTENTS; i++) {
+            if (!nbd_co_read(conn, buf, &len, 8)) {
+                break;
+            }
+            extents[i].length = be32_to_cpup((uint32_t *)buf);
+            extents[i].flags = be32_to_cpup((uint32_t *)(buf + 4));
+        }
+        *nb_extents = i;
+        ret = 0;
+        break;
+
+    default:
+        /* the error, then a message that we ignore */
+        if (NBD_REPLY_TYPE_IS_ERR(chunk->type) &&
+            nbd_co_read(conn, buf, &len, 4)) {
+            ret = nbd_errno_to_system_errno(be32_to_cpup((uint32_t *)buf));
+            ret = ret ? ret : EIO;
+        }
+        break;
+    }
+
+    nbd_co_drop(conn, len);
+    return ret;
+}
+
+static void nbd_co_receive_reply(NbdConnection *conn,
     struct nbd_request *request, struct nbd_reply *reply,
-    QEMUIOVector *qiov, int offset)
+    QEMUIOVector *qiov, int offset, NbdExtent *extents, int *nb_extents)
 {
-    int ret;
+    int ret, error = 0;
+
+    /* A structured reply may come in several chunks, each of them with a
+     * header of its own; the last one is flagged NBD_REPLY_FLAG_DONE.  */
+    do {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        *reply = conn->reply;
+        if (reply->handle != request->handle) {
+            reply->error = EIO;
+            return;
+        }
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
-                                offset, request->len);
-            if (ret != request->len) {
-                reply->error = EIO;
+        if (!reply->structured) {
+            if (qiov && reply->error == 0) {
+                ret = qemu_co_recvv(conn->sock, qiov->iov, qiov->niov,
+                                    offset, request->len);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
             }
+        } else {
+            ret = nbd_co_receive_chunk(conn, request, reply, qiov, offset,
+                                       extents, nb_extents);
+            error = error ? error : ret;
+            reply->error = error;
         }
 
         /* Tell the read handler to read another header.  */
-        s->reply.handle = 0;
-    }
+        conn->reply.handle = 0;
+    } while (reply->structured && !(reply->flags & NBD_REPLY_FLAG_DONE));
 }
 
-static void nbd_coroutine_start(NbdClientSession *s,
+/* Returns the connection that the request goes to, or NULL if they
+ * all have been torn down.
+ */
+static NbdConnection *nbd_coroutine_start(NbdClientSession *s,
    struct nbd_request *request)
 {
+    NbdConnection *conn = NULL;
+    int i;
+
+    /* The least busy connection; the first one if they are all idle,
+     * so that a single stream of requests stays on one socket.  */
+    for (i = 0; i < s->nb_conns; i++) {
+        if (s->conns[i].sock >= 0 &&
+            (!conn || s->conns[i].in_flight < conn->in_flight)) {
+            conn = &s->conns[i];
+        }
+    }
+    if (!conn) {
+        return NULL;
+    }
+
     /* Poor man semaphore.  The free_sema is locked when no other request
      * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
-        qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+    if (conn->in_flight >= MAX_NBD_REQUESTS - 1) {
+        qemu_co_mutex_lock(&conn->free_sema);
+        assert(conn->in_flight < MAX_NBD_REQUESTS);
     }
-    s->in_flight++;
+    conn->in_flight++;
 
-    /* s->recv_coroutine[i] is set as soon as we get the send_lock.  */
+    /* conn->recv_coroutine[i] is set as soon as we get the send_lock.  */
+    return conn;
 }
 
-static void nbd_coroutine_end(NbdClientSession *s,
+static void nbd_coroutine_end(NbdConnection *conn,
     struct nbd_request *request)
 {
-    int i = HANDLE_TO_INDEX(s, request->handle);
-    s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
-        qemu_co_mutex_unlock(&s->free_sema);
+    int i = HANDLE_TO_INDEX(conn, request->handle);
+    conn->recv_coroutine[i] = NULL;
+    if (conn->in_flight-- == MAX_NBD_REQUESTS) {
+        qemu_co_mutex_unlock(&conn->free_sema);
     }
 }
 
-static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
-                          int nb_sectors, QEMUIOVector *qiov,
-                          int offset)
+/* Send @request with the data in @write_qiov, if any, and receive the
+ * reply, with the data into @read_qiov and the extents into @extents,
+ * if any.
+ */
+static int nbd_co_request(BlockDriverState *bs, struct nbd_request *request,
+                          QEMUIOVector *write_qiov, QEMUIOVector *read_qiov,
+                          int offset, NbdExtent *extents, int *nb_extents)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
-    struct nbd_request request = { .type = NBD_CMD_READ };
+    NbdConnection *conn;
     struct nbd_reply reply;
     ssize_t ret;
 
-    request.from = sector_num * 512;
-    request.len = nb_sectors * 512;
-
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    conn = nbd_coroutine_start(client, request);
+    if (!conn) {
+        return -EIO;
+    }
+    ret = nbd_co_send_request(client, conn, request, write_qiov, offset);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov, offset);
+        nbd_co_receive_reply(conn, request, &reply, read_qiov, offset,
+                             extents, nb_extents);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, request);
     return -reply.error;
+}
+
+static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
+                          int nb_sectors, QEMUIOVector *qiov,
+                          int offset)
+{
+    struct nbd_request request = { .type = NBD_CMD_READ };
 
+    request.from = sector_num * 512;
+    request.len = nb_sectors * 512;
+
+    return nbd_co_request(bs, &request, NULL, qiov, offset, NULL, NULL);
+}
+
+/* Called before and after each request that changes the contents */
+static void nbd_invalidate_status(NbdClientSession *client)
+{
+    client->status_generation++;
+    client->nb_status = 0;
 }
 
 static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
@@ -230,8 +403,7 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
 {
     NbdClientSession *client = nbd_get_client_session(bs);
     struct nbd_request request = { .type = NBD_CMD_WRITE };
-    struct nbd_reply reply;
-    ssize_t ret;
+    int ret;
 
     if (!bdrv_enable_write_cache(bs) &&
         (client->nbdflags & NBD_FLAG_SEND_FUA)) {
@@ -241,34 +413,28 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, qiov, offset);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    nbd_invalidate_status(client);
+    ret = nbd_co_request(bs, &request, qiov, NULL, offset, NULL, NULL);
+    nbd_invalidate_status(client);
+    return ret;
 }
 
-/* qemu-nbd has a limit of slightly less than 1M per request.  Try to
- * remain aligned to 4K. */
-#define NBD_MAX_SECTORS 2040
 
 int nbd_client_co_readv(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors, QEMUIOVector *qiov)
 {
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int max_sectors = client->max_sectors;
     int offset = 0;
     int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_readv_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
+    while (nb_sectors > max_sectors) {
+        ret = nbd_co_readv_1(bs, sector_num, max_sectors, qiov, offset);
         if (ret < 0) {
             return ret;
         }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
+        offset += max_sectors * 512;
+        sector_num += max_sectors;
+        nb_sectors -= max_sectors;
     }
     return nbd_co_readv_1(bs, sector_num, nb_sectors, qiov, offset);
 }
@@ -276,26 +442,29 @@ int nbd_client_co_readv(BlockDriverState *bs, int64_t sector_num,
 int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
                          int nb_sectors, QEMUIOVector *qiov)
 {
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int max_sectors = client->max_sectors;
     int offset = 0;
     int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_writev_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
+    while (nb_sectors > max_sectors) {
+        ret = nbd_co_writev_1(bs, sector_num, max_sectors, qiov, offset);
         if (ret < 0) {
             return ret;
         }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
+        offset += max_sectors * 512;
+        sector_num += max_sectors;
+        nb_sectors -= max_sectors;
     }
     return nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, offset);
 }
 
+/* The server has finished every write that it replied to, whatever the
+ * connection it came on, so one flush on any connection covers them all.
+ */
 int nbd_client_co_flush(BlockDriverState *bs)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
     struct nbd_request request = { .type = NBD_CMD_FLUSH };
-    struct nbd_reply reply;
-    ssize_t ret;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
@@ -308,15 +477,7 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return nbd_co_request(bs, &request, NULL, NULL, 0, NULL, NULL);
 }
 
 int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -324,8 +485,7 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
 {
     NbdClientSession *client = nbd_get_client_session(bs);
     struct nbd_request request = { .type = NBD_CMD_TRIM };
-    struct nbd_reply reply;
-    ssize_t ret;
+    int ret;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_TRIM)) {
         return 0;
@@ -333,29 +493,114 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+    nbd_invalidate_status(client);
+    ret = nbd_co_request(bs, &request, NULL, NULL, 0, NULL, NULL);
+    nbd_invalidate_status(client);
+    return ret;
+}
+
+/* Look @from up in the extents of the last NBD_CMD_BLOCK_STATUS */
+static NbdExtent *nbd_find_status(NbdClientSession *client, uint64_t from,
+                                  uint64_t *extent_from)
+{
+    uint64_t pos = client->status_from;
+    int i;
+
+    if (from < pos) {
+        return NULL;
     }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    for (i = 0; i < client->nb_status; i++) {
+        if (from - pos < client->status[i].length) {
+            *extent_from = pos;
+            return &client->status[i];
+        }
+        pos += client->status[i].length;
+    }
+    return NULL;
+}
+
+/* The server describes many extents at once, so the next calls, for the
+ * sectors that follow, are usually answered from the cache.
+ */
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    struct nbd_request request = { .type = NBD_CMD_BLOCK_STATUS };
+    uint64_t from = sector_num * 512, extent_from;
+    NbdExtent *extent, *extents = NULL;
+    uint32_t flags;
+    unsigned generation;
+    int ret, n = 0;
+
+    if (!client->base_allocation) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA;
+    }
+
+    extent = nbd_find_status(client, from, &extent_from);
+    if (!extent) {
+        request.from = from;
+        request.len = MIN((uint64_t)nb_sectors * 512, NBD_MAX_BUFFER_SIZE);
+
+        extents = g_new(NbdExtent, NBD_MAX_EXTENTS);
+        generation = client->status_generation;
+        ret = nbd_co_request(bs, &request, NULL, NULL, 0, extents, &n);
+        if (ret < 0 || n == 0) {
+            g_free(extents);
+            return ret < 0 ? ret : -EIO;
+        }
+        if (generation == client->status_generation) {
+            memcpy(client->status, extents, n * sizeof(*extents));
+            client->nb_status = n;
+            client->status_from = from;
+            extent = client->status;
+        } else {
+            /* a write came in the meanwhile, use it only this once */
+            extent = &extents[0];
+        }
+        extent_from = from;
+    }
+
+    *pnum = MIN((extent->length - (from - extent_from)) / 512, nb_sectors);
+    flags = extent->flags;
+    g_free(extents);
 
+    if (*pnum == 0) {
+        /* not sector aligned, assume data */
+        *pnum = 1;
+        return BDRV_BLOCK_DATA;
+    }
+    return (flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
+           (flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0);
 }
 
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    aio_set_fd_handler(bdrv_get_aio_context(bs),
-                       nbd_get_client_session(bs)->sock, NULL, NULL, NULL);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->nb_conns; i++) {
+        nbd_connection_detach_aio_context(&client->conns[i],
+                                          bdrv_get_aio_context(bs));
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    aio_set_fd_handler(new_context, nbd_get_client_session(bs)->sock,
-                       nbd_reply_ready, NULL, bs);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->nb_conns; i++) {
+        NbdConnection *conn = &client->conns[i];
+
+        if (conn->sock >= 0) {
+            aio_set_fd_handler(new_context, conn->sock,
+                               nbd_reply_ready, NULL, conn);
+        }
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
@@ -366,42 +611,87 @@ void nbd_client_close(BlockDriverState *bs)
         .from = 0,
         .len = 0
     };
+    int i;
 
-    if (client->sock == -1) {
-        return;
-    }
+    for (i = 0; i < client->nb_conns; i++) {
+        NbdConnection *conn = &client->conns[i];
+
+        if (conn->sock == -1) {
+            continue;
+        }
 
-    nbd_send_request(client->sock, &request);
+        nbd_send_request(conn->sock, &request);
 
-    nbd_teardown_connection(bs);
+        nbd_teardown_connection(conn);
+    }
 }
 
-int nbd_client_init(BlockDriverState *bs, int sock, const char *export,
-                    Error **errp)
+/* Negotiate with the server on each of @socks, which must all lead to
+ * the same export.  The sockets are closed on failure.
+ */
+int nbd_client_init(BlockDriverState *bs, int *socks, int nb_socks,
+                    const char *export, int max_sectors, Error **errp)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
-    int ret;
+    NBDNegotiation neg[MAX_NBD_CONNECTIONS];
+    uint32_t nbdflags;
+    off_t size;
+    int i, ret = 0;
+
+    assert(nb_socks > 0 && nb_socks <= MAX_NBD_CONNECTIONS);
 
     /* NBD handshake */
     logout("session init %s\n", export);
-    qemu_set_block(sock);
-    ret = nbd_receive_negotiate(sock, export,
-                                &client->nbdflags, &client->size, errp);
+    for (i = 0; i < nb_socks; i++) {
+        qemu_set_block(socks[i]);
+        neg[i] = (NBDNegotiation) {
+            .structured_reply = true,
+            .base_allocation = true,
+        };
+        ret = nbd_receive_negotiate(socks[i], export, &nbdflags, &size,
+                                    &neg[i], errp);
+        if (ret < 0) {
+            logout("Failed to negotiate with the NBD server\n");
+            break;
+        }
+        if (i == 0) {
+            client->nbdflags = nbdflags;
+            client->size = size;
+        } else if (nbdflags != client->nbdflags || size != client->size ||
+                   neg[i].structured_reply != neg[0].structured_reply ||
+                   neg[i].base_allocation != neg[0].base_allocation) {
+            error_setg(errp, "NBD server gave a different export on "
+                       "connection %d", i);
+            ret = -EINVAL;
+            break;
+        }
+    }
     if (ret < 0) {
-        logout("Failed to negotiate with the NBD server\n");
-        closesocket(sock);
+        for (i = 0; i < nb_socks; i++) {
+            closesocket(socks[i]);
+        }
         return ret;
     }
 
-    qemu_co_mutex_init(&client->send_mutex);
-    qemu_co_mutex_init(&client->free_sema);
-    client->sock = sock;
-
-    /* Now that we're connected, set the socket to be non-blocking and
-     * kick the reply mechanism.  */
-    qemu_set_nonblock(sock);
+    client->max_sectors = max_sectors;
+    client->structured_reply = neg[0].structured_reply;
+    client->base_allocation = neg[0].base_allocation;
+    client->nb_conns = nb_socks;
+    for (i = 0; i < nb_socks; i++) {
+        NbdConnection *conn = &client->conns[i];
+
+        conn->bs = bs;
+        conn->context_id = neg[i].context_id;
+        qemu_co_mutex_init(&conn->send_mutex);
+        qemu_co_mutex_init(&conn->free_sema);
+        conn->sock = socks[i];
+
+        /* Now that we're connected, set the socket to be non-blocking and
+         * kick the reply mechanism.  */
+        qemu_set_nonblock(conn->sock);
+    }
     nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
 
-    logout("Established connection with NBD server\n");
+    logout("Established %d connection(s) with NBD server\n", nb_socks);
     return 0;
 }
@@ -15,11 +15,24 @@
 #endif
 
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
-typedef struct NbdClientSession {
+/* qemu-nbd has a limit of slightly less than 1M per request.  Try to
+ * remain aligned to 4K. */
+#define NBD_MAX_SECTORS 2040
+
+typedef struct NbdExtent {
+    uint32_t length;
+    uint32_t flags;             /* NBD_STATE_* */
+} NbdExtent;
+
+/* Each connection has its own requests in flight and its own reply
+ * handler; requests go to the connection with the fewest of them.
+ */
+typedef struct NbdConnection {
+    BlockDriverState *bs;
     int sock;
-    uint32_t nbdflags;
-    off_t size;
+    uint32_t context_id;        /* of "base:allocation" */
 
     CoMutex send_mutex;
     CoMutex free_sema;
@@ -28,14 +41,33 @@ typedef struct NbdClientSession {
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     struct nbd_reply reply;
+} NbdConnection;
+
+typedef struct NbdClientSession {
+    uint32_t nbdflags;
+    off_t size;
+    int max_sectors;
+
+    NbdConnection conns[MAX_NBD_CONNECTIONS];
+    int nb_conns;
+
+    bool structured_reply;
+    bool base_allocation;
+
+    /* The extents of the last NBD_CMD_BLOCK_STATUS, from @status_from.
+     * Writes and discards bump @status_generation and drop them.  */
+    uint64_t status_from;
+    int nb_status;
+    NbdExtent status[NBD_MAX_EXTENTS];
+    unsigned status_generation;
 
     bool is_unix;
 } NbdClientSession;
 
 NbdClientSession *nbd_get_client_session(BlockDriverState *bs);
 
-int nbd_client_init(BlockDriverState *bs, int sock, const char *export_name,
-                    Error **errp);
+int nbd_client_init(BlockDriverState *bs, int *socks, int nb_socks,
+                    const char *export_name, int max_sectors, Error **errp);
 void nbd_client_close(BlockDriverState *bs);
 
 int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -45,6 +77,9 @@ int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
                          int nb_sectors, QEMUIOVector *qiov);
 int nbd_client_co_readv(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors, QEMUIOVector *qiov);
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum);
 
 void nbd_client_detach_aio_context(BlockDriverState *bs);
 void nbd_client_attach_aio_context(BlockDriverState *bs,
@@ -44,8 +44,28 @@
 typedef struct BDRVNBDState {
     NbdClientSession client;
     QemuOpts *socket_opts;
+    int connections;
+    int max_sectors;
 } BDRVNBDState;
 
+static QemuOptsList runtime_opts = {
+    .name = "nbd",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to the export",
+        },
+        {
+            .name = "max-request-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Largest read or write request sent to the server",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int nbd_parse_uri(const char *filename, QDict *options)
 {
     URI *uri;
@@ -194,6 +214,8 @@ static void nbd_config(BDRVNBDState *s, QDict *options, char **export,
                        Error **errp)
 {
     Error *local_err = NULL;
+    QemuOpts *opts;
+    uint64_t max_request_size;
 
     if (qdict_haskey(options, "path") == qdict_haskey(options, "host")) {
         if (qdict_haskey(options, "path")) {
@@ -223,6 +245,34 @@ static void nbd_config(BDRVNBDState *s, QDict *options, char **export,
     if (*export) {
         qdict_del(options, "export");
     }
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto out;
+    }
+
+    s->connections = qemu_opt_get_number(opts, "connections", 1);
+    if (s->connections < 1 || s->connections > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto out;
+    }
+
+    max_request_size = qemu_opt_get_size(opts, "max-request-size",
+                                         NBD_MAX_SECTORS * BDRV_SECTOR_SIZE);
+    if (max_request_size < BDRV_SECTOR_SIZE ||
+        max_request_size > NBD_MAX_BUFFER_SIZE ||
+        max_request_size % BDRV_SECTOR_SIZE) {
+        error_setg(errp, "max-request-size must be a multiple of 512 "
+                   "between 512 and %d", NBD_MAX_BUFFER_SIZE);
+        goto out;
+    }
+    s->max_sectors = max_request_size >> BDRV_SECTOR_BITS;
+
+out:
+    qemu_opts_del(opts);
 }
 
 NbdClientSession *nbd_get_client_session(BlockDriverState *bs)
@@ -259,7 +309,8 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
 {
     BDRVNBDState *s = bs->opaque;
     char *export = NULL;
-    int result, sock;
+    int socks[MAX_NBD_CONNECTIONS];
+    int result, i;
     Error *local_err = NULL;
 
     /* Pop the config into our state object. Exit if invalid. */
@@ -269,17 +320,24 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         return -EINVAL;
     }
 
-    /* establish TCP connection, return error if it fails
+    /* establish TCP connections, return error if any fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
-    sock = nbd_establish_connection(bs, errp);
-    if (sock < 0) {
-        g_free(export);
-        return sock;
+    for (i = 0; i < s->connections; i++) {
+        socks[i] = nbd_establish_connection(bs, errp);
+        if (socks[i] < 0) {
+            result = socks[i];
+            while (i-- > 0) {
+                closesocket(socks[i]);
+            }
+            g_free(export);
+            return result;
+        }
     }
 
     /* NBD handshake */
-    result = nbd_client_init(bs, sock, export, errp);
+    result = nbd_client_init(bs, socks, s->connections, export,
+                             s->max_sectors, errp);
     g_free(export);
     return result;
 }
@@ -301,6 +359,13 @@ static int nbd_co_flush(BlockDriverState *bs)
     return nbd_client_co_flush(bs);
 }
 
+static int64_t coroutine_fn nbd_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum)
+{
+    return nbd_client_co_get_block_status(bs, sector_num, nb_sectors, pnum);
+}
+
 static void nbd_refresh_limits(BlockDriverState *bs, Error **errp)
 {
     bs->bl.max_discard = UINT32_MAX >> BDRV_SECTOR_BITS;
@@ -346,6 +411,9 @@ static void nbd_refresh_filename(BlockDriverState *bs)
     const char *host   = qdict_get_try_str(bs->options, "host");
     const char *port   = qdict_get_try_str(bs->options, "port");
     const char *export = qdict_get_try_str(bs->options, "export");
+    const char *connections = qdict_get_try_str(bs->options, "connections");
+    const char *max_request_size = qdict_get_try_str(bs->options,
+                                                     "max-request-size");
 
     qdict_put_obj(opts, "driver", QOBJECT(qstring_from_str("nbd")));
 
@@ -380,6 +448,14 @@ static void nbd_refresh_filename(BlockDriverState *bs)
     if (export) {
         qdict_put_obj(opts, "export", QOBJECT(qstring_from_str(export)));
     }
+    if (connections) {
+        qdict_put_obj(opts, "connections",
+                      QOBJECT(qstring_from_str(connections)));
+    }
+    if (max_request_size) {
+        qdict_put_obj(opts, "max-request-size",
+                      QOBJECT(qstring_from_str(max_request_size)));
+    }
 
     bs->full_open_options = opts;
 }
@@ -395,6 +471,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -413,6 +490,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -431,6 +509,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -10,13 +10,45 @@
  * See the COPYING file in the top-level directory.
  */
 
+#include <math.h>
 #include "block/block_int.h"
+#include "qapi/util.h"
 
-#define NULL_OPT_LATENCY "latency-ns"
+#define NULL_OPT_LATENCY            "latency-ns"
+#define NULL_OPT_READ_LATENCY       "read-latency-ns"
+#define NULL_OPT_WRITE_LATENCY      "write-latency-ns"
+#define NULL_OPT_FLUSH_LATENCY      "flush-latency-ns"
+#define NULL_OPT_DISTRIBUTION       "latency-distribution"
+#define NULL_OPT_STDDEV             "latency-stddev-pct"
+#define NULL_OPT_BANDWIDTH          "bandwidth"
+#define NULL_OPT_QUEUE_DEPTH        "max-queue-depth"
+#define NULL_OPT_STORE_DATA         "store-data"
+
+/* Granularity of the in-memory copy of the data for store-data=on */
+#define NULL_CHUNK_SIZE             (64 * 1024)
+
+typedef enum {
+    NULL_OP_READ,
+    NULL_OP_WRITE,
+    NULL_OP_FLUSH,
+    NULL_OP__MAX,
+} NullOp;
 
 typedef struct {
     int64_t length;
-    int64_t latency_ns;
+    int64_t latency_ns[NULL_OP__MAX];
+    NullLatencyDistribution distribution;
+    int64_t stddev_pct;
+    uint64_t bandwidth;
+    int max_queue_depth;
+
+    /* QEMU_CLOCK_REALTIME at which each queue slot and the data transfer
+     * become free again */
+    int64_t *slot_free;
+    int64_t transfer_free;
+
+    /* chunk index -> NULL_CHUNK_SIZE bytes, or NULL for store-data=off */
+    GHashTable *chunks;
 } BDRVNullState;
 
 static QemuOptsList runtime_opts = {
@@ -39,6 +71,50 @@ static QemuOptsList runtime_opts = {
             .help = "nanoseconds (approximated) to wait "
                     "before completing request",
         },
+        {
+            .name = NULL_OPT_READ_LATENCY,
+            .type = QEMU_OPT_NUMBER,
+            .help = "latency of reads (default: latency-ns)",
+        },
+        {
+            .name = NULL_OPT_WRITE_LATENCY,
+            .type = QEMU_OPT_NUMBER,
+            .help = "latency of writes (default: latency-ns)",
+        },
+        {
+            .name = NULL_OPT_FLUSH_LATENCY,
+            .type = QEMU_OPT_NUMBER,
+            .help = "latency of flushes (default: latency-ns)",
+        },
+        {
+            .name = NULL_OPT_DISTRIBUTION,
+            .type = QEMU_OPT_STRING,
+            .help = "distribution of the latency around its mean "
+                    "(fixed, uniform, log-normal)",
+        },
+        {
+            .name = NULL_OPT_STDDEV,
+            .type = QEMU_OPT_NUMBER,
+            .help = "standard deviation of the latency, in percent "
+                    "of the mean (default: 50)",
+        },
+        {
+            .name = NULL_OPT_BANDWIDTH,
+            .type = QEMU_OPT_SIZE,
+            .help = "bytes per second that reads and writes can transfer "
+                    "(default: unlimited)",
+        },
+        {
+            .name = NULL_OPT_QUEUE_DEPTH,
+            .type = QEMU_OPT_NUMBER,
+            .help = "requests that are serviced at the same time; further "
+                    "requests wait for a free slot (default: unlimited)",
+        },
+        {
+            .name = NULL_OPT_STORE_DATA,
+            .type = QEMU_OPT_BOOL,
+            .help = "keep written data in memory and return it on reads",
+        },
         { /* end of list */ }
     },
 };
@@ -48,24 +124,79 @@ static int null_file_open(BlockDriverState *bs, QDict *options, int flags,
 {
     QemuOpts *opts;
     BDRVNullState *s = bs->opaque;
+    Error *local_err = NULL;
+    int64_t latency_ns, queue_depth;
+    const char *buf;
     int ret = 0;
+    int i;
 
     opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
     qemu_opts_absorb_qdict(opts, options, &error_abort);
     s->length =
         qemu_opt_get_size(opts, BLOCK_OPT_SIZE, 1 << 30);
-    s->latency_ns =
+    latency_ns =
         qemu_opt_get_number(opts, NULL_OPT_LATENCY, 0);
-    if (s->latency_ns < 0) {
-        error_setg(errp, "latency-ns is invalid");
+    s->latency_ns[NULL_OP_READ] =
+        qemu_opt_get_number(opts, NULL_OPT_READ_LATENCY, latency_ns);
+    s->latency_ns[NULL_OP_WRITE] =
+        qemu_opt_get_number(opts, NULL_OPT_WRITE_LATENCY, latency_ns);
+    s->latency_ns[NULL_OP_FLUSH] =
+        qemu_opt_get_number(opts, NULL_OPT_FLUSH_LATENCY, latency_ns);
+    for (i = 0; i < NULL_OP__MAX; i++) {
+        if (latency_ns < 0 || s->latency_ns[i] < 0) {
+            error_setg(errp, "latency-ns is invalid");
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
+    buf = qemu_opt_get(opts, NULL_OPT_DISTRIBUTION);
+    s->distribution = qapi_enum_parse(NullLatencyDistribution_lookup, buf,
+                                      NULL_LATENCY_DISTRIBUTION_MAX,
+                                      NULL_LATENCY_DISTRIBUTION_FIXED,
+                                      &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+    s->stddev_pct = qemu_opt_get_number(opts, NULL_OPT_STDDEV, 50);
+    if (s->stddev_pct < 0) {
+        error_setg(errp, "latency-stddev-pct is invalid");
         ret = -EINVAL;
+        goto out;
+    }
+
+    s->bandwidth = qemu_opt_get_size(opts, NULL_OPT_BANDWIDTH, 0);
+    queue_depth = qemu_opt_get_number(opts, NULL_OPT_QUEUE_DEPTH, 0);
+    if (queue_depth < 0 || queue_depth > INT_MAX) {
+        error_setg(errp, "max-queue-depth is invalid");
+        ret = -EINVAL;
+        goto out;
+    }
+    s->max_queue_depth = queue_depth;
+    if (s->max_queue_depth) {
+        s->slot_free = g_new0(int64_t, s->max_queue_depth);
     }
+
+    if (qemu_opt_get_bool(opts, NULL_OPT_STORE_DATA, false)) {
+        s->chunks = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                          g_free, g_free);
+    }
+
+out:
     qemu_opts_del(opts);
     return ret;
 }
 
 static void null_close(BlockDriverState *bs)
 {
+    BDRVNullState *s = bs->opaque;
+
+    g_free(s->slot_free);
+    if (s->chunks) {
+        g_hash_table_destroy(s->chunks);
+    }
 }
 
 static int64_t null_getlength(BlockDriverState *bs)
@@ -74,13 +205,114 @@ static int64_t null_getlength(BlockDriverState *bs)
     return s->length;
 }
 
-static coroutine_fn int null_co_common(BlockDriverState *bs)
+static int64_t null_latency_ns(BDRVNullState *s, NullOp op)
+{
+    double mean = s->latency_ns[op];
+    double stddev = mean * s->stddev_pct / 100;
+    double sigma2, z;
+
+    if (!mean) {
+        return 0;
+    }
+
+    switch (s->distribution) {
+    case NULL_LATENCY_DISTRIBUTION_UNIFORM:
+        /* mean +/- sqrt(3) * stddev has the requested standard deviation */
+        return MAX(0, mean + g_random_double_range(-1, 1) * sqrt(3) * stddev);
+    case NULL_LATENCY_DISTRIBUTION_LOG_NORMAL:
+        /* Pick the parameters of the underlying normal distribution so that
+         * the mean and the standard deviation come out as requested; z is
+         * standard normal (Box-Muller) */
+        sigma2 = log(1 + (stddev * stddev) / (mean * mean));
+        z = sqrt(-2 * log(1 - g_random_double())) *
+            cos(2 * M_PI * g_random_double());
+        return exp(log(mean) - sigma2 / 2 + sqrt(sigma2) * z);
+    default:
+        return mean;
+    }
+}
+
+/*
+ * Returns the nanoseconds until a request that is submitted now completes.
+ * The request waits for the queue slot that becomes free first, then takes
+ * its latency; the data transfer follows the latency and is serialized with
+ * the transfers of the other requests.
+ */
+static int64_t null_delay_ns(BDRVNullState *s, NullOp op, int64_t bytes)
+{
+    int64_t now, start, done;
+    int slot = 0;
+    int i;
+
+    if (!s->latency_ns[op] && !s->max_queue_depth && !s->bandwidth) {
+        return 0;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    start = now;
+    if (s->max_queue_depth) {
+        for (i = 1; i < s->max_queue_depth; i++) {
+            if (s->slot_free[i] < s->slot_free[slot]) {
+                slot = i;
+            }
+        }
+        start = MAX(start, s->slot_free[slot]);
+    }
+
+    done = start + null_latency_ns(s, op);
+    if (s->bandwidth && bytes) {
+        done = MAX(done, s->transfer_free);
+        done += (double)bytes * NANOSECONDS_PER_SECOND / s->bandwidth;
+        s->transfer_free = done;
+    }
+
+    if (s->max_queue_depth) {
+        s->slot_free[slot] = done;
+    }
+    return done - now;
+}
+
+static void null_rw_data(BDRVNullState *s, int64_t sector_num,
+                         QEMUIOVector *qiov, bool is_write)
+{
+    int64_t offset = sector_num * BDRV_SECTOR_SIZE;
+    size_t done = 0;
+
+    if (!s->chunks) {
+        return;
+    }
+
+    while (done < qiov->size) {
+        int64_t index = (offset + done) / NULL_CHUNK_SIZE;
+        size_t chunk_offset = (offset + done) % NULL_CHUNK_SIZE;
+        size_t n = MIN(qiov->size - done, NULL_CHUNK_SIZE - chunk_offset);
+        uint8_t *chunk = g_hash_table_lookup(s->chunks, &index);
+
+        if (is_write) {
+            if (!chunk) {
+                chunk = g_malloc0(NULL_CHUNK_SIZE);
+                g_hash_table_insert(s->chunks, g_memdup(&index, sizeof(index)),
+                                    chunk);
+            }
+            qemu_iovec_to_buf(qiov, done, chunk + chunk_offset, n);
+        } else if (chunk) {
+            qemu_iovec_from_buf(qiov, done, chunk + chunk_offset, n);
+        } else {
+            qemu_iovec_memset(qiov, done, 0, n);
+        }
+        done += n;
+    }
+}
+
+static coroutine_fn int null_co_common(BlockDriverState *bs, NullOp op,
+                                       int64_t bytes)
 {
     BDRVNullState *s = bs->opaque;
+    int64_t delay_ns = null_delay_ns(s, op, bytes);
 
-    if (s->latency_ns) {
+    if (delay_ns > 0) {
         co_aio_sleep_ns(bdrv_get_aio_context(bs), QEMU_CLOCK_REALTIME,
-                        s->latency_ns);
+                        delay_ns);
     }
     return 0;
 }
@@ -89,19 +321,21 @@ static coroutine_fn int null_co_readv(BlockDriverState *bs,
                                       int64_t sector_num, int nb_sectors,
                                       QEMUIOVector *qiov)
 {
-    return null_co_common(bs);
+    null_rw_data(bs->opaque, sector_num, qiov, false);
+    return null_co_common(bs, NULL_OP_READ, qiov->size);
 }
 
 static coroutine_fn int null_co_writev(BlockDriverState *bs,
                                        int64_t sector_num, int nb_sectors,
                                        QEMUIOVector *qiov)
 {
-    return null_co_common(bs);
+    null_rw_data(bs->opaque, sector_num, qiov, true);
+    return null_co_common(bs, NULL_OP_WRITE, qiov->size);
 }
 
 static coroutine_fn int null_co_flush(BlockDriverState *bs)
 {
-    return null_co_common(bs);
+    return null_co_common(bs, NULL_OP_FLUSH, 0);
 }
 
 typedef struct {
@@ -130,21 +364,23 @@ static void null_timer_cb(void *opaque)
     qemu_aio_unref(acb);
 }
 
-static inline BlockAIOCB *null_aio_common(BlockDriverState *bs,
+static inline BlockAIOCB *null_aio_common(BlockDriverState *bs, NullOp op,
+                                          int64_t bytes,
                                           BlockCompletionFunc *cb,
                                           void *opaque)
 {
     NullAIOCB *acb;
     BDRVNullState *s = bs->opaque;
+    int64_t delay_ns = null_delay_ns(s, op, bytes);
 
     acb = qemu_aio_get(&null_aiocb_info, bs, cb, opaque);
     /* Only emulate latency after vcpu is running. */
-    if (s->latency_ns) {
+    if (delay_ns > 0) {
         aio_timer_init(bdrv_get_aio_context(bs), &acb->timer,
                        QEMU_CLOCK_REALTIME, SCALE_NS,
                        null_timer_cb, acb);
         timer_mod_ns(&acb->timer,
-                     qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + s->latency_ns);
+                     qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + delay_ns);
     } else {
         acb->bh = aio_bh_new(bdrv_get_aio_context(bs), null_bh_cb, acb);
         qemu_bh_schedule(acb->bh);
@@ -158,7 +394,8 @@ static BlockAIOCB *null_aio_readv(BlockDriverState *bs,
                                   BlockCompletionFunc *cb,
                                   void *opaque)
 {
-    return null_aio_common(bs, cb, opaque);
+    null_rw_data(bs->opaque, sector_num, qiov, false);
+    return null_aio_common(bs, NULL_OP_READ, qiov->size, cb, opaque);
 }
 
 static BlockAIOCB *null_aio_writev(BlockDriverState *bs,
@@ -167,14 +404,15 @@ static BlockAIOCB *null_aio_writev(BlockDriverState *bs,
                                    BlockCompletionFunc *cb,
                                    void *opaque)
 {
-    return null_aio_common(bs, cb, opaque);
+    null_rw_data(bs->opaque, sector_num, qiov, true);
+    return null_aio_common(bs, NULL_OP_WRITE, qiov->size, cb, opaque);
 }
 
 static BlockAIOCB *null_aio_flush(BlockDriverState *bs,
                                   BlockCompletionFunc *cb,
                                   void *opaque)
 {
-    return null_aio_common(bs, cb, opaque);
+    return null_aio_common(bs, NULL_OP_FLUSH, 0, cb, opaque);
 }
 
 static int null_reopen_prepare(BDRVReopenState *reopen_state,
@@ -326,10 +326,44 @@ static void bdrv_query_info(BlockBackend *blk, BlockInfo **p_info,
     qapi_free_BlockInfo(info);
 }
 
-static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
+static uint64List *uint64_list(uint64_t *list, int size)
+{
+    int i;
+    uint64List *out_list = NULL;
+    uint64List **pout_list = &out_list;
+
+    for (i = 0; i < size; i++) {
+        uint64List *entry = g_new(uint64List, 1);
+        entry->value = list[i];
+        entry->next = NULL;
+        *pout_list = entry;
+        pout_list = &entry->next;
+    }
+
+    return out_list;
+}
+
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_info(BlockAcctStats *stats, enum BlockAcctType type)
+{
+    BlockLatencyHistogram *hist = &stats->latency_histogram[type];
+    BlockLatencyHistogramInfo *info;
+
+    if (!hist->nbins) {
+        return NULL;
+    }
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+    info->boundaries = uint64_list(hist->boundaries, hist->nbins - 1);
+    info->bins = uint64_list(hist->bins, hist->nbins);
+    return info;
+}
+
+static BlockStats *bdrv_query_stats(BlockDriverState *bs,
                                     bool query_backing)
 {
     BlockStats *s;
+    BlockAcctTimedStats *ts;
 
     s = g_malloc0(sizeof(*s));
 
@@ -357,6 +391,54 @@ static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
     s->stats->rd_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_READ];
     s->stats->flush_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_FLUSH];
 
+    s->stats->has_idle_time_ns = bs->stats.last_access_time_ns > 0;
+    if (s->stats->has_idle_time_ns) {
+        s->stats->idle_time_ns = block_acct_idle_time_ns(&bs->stats);
+    }
+
+    ts = NULL;
+    while ((ts = block_acct_interval_next(&bs->stats, ts))) {
+        BlockDeviceTimedStatsList *timed_stats;
+        BlockDeviceTimedStats *t = g_malloc0(sizeof(*t));
+        TimedAverage *rd = &ts->latency[BLOCK_ACCT_READ];
+        TimedAverage *wr = &ts->latency[BLOCK_ACCT_WRITE];
+        TimedAverage *fl = &ts->latency[BLOCK_ACCT_FLUSH];
+
+        t->interval_length = ts->interval_length;
+        t->min_rd_latency_ns = timed_average_min(rd);
+        t->max_rd_latency_ns = timed_average_max(rd);
+        t->avg_rd_latency_ns = timed_average_avg(rd);
+        t->min_wr_latency_ns = timed_average_min(wr);
+        t->max_wr_latency_ns = timed_average_max(wr);
+        t->avg_wr_latency_ns = timed_average_avg(wr);
+        t->min_flush_latency_ns = timed_average_min(fl);
+        t->max_flush_latency_ns = timed_average_max(fl);
+        t->avg_flush_latency_ns = timed_average_avg(fl);
+
+        t->avg_rd_queue_depth = block_acct_queue_depth(ts, BLOCK_ACCT_READ);
+        t->avg_wr_queue_depth = block_acct_queue_depth(ts, BLOCK_ACCT_WRITE);
+        t->avg_flush_queue_depth = block_acct_queue_depth(ts, BLOCK_ACCT_FLUSH);
+
+        timed_stats = g_malloc0(sizeof(*timed_stats));
+        timed_stats->value = t;
+        timed_stats->next = s->stats->timed_stats;
+        s->stats->timed_stats = timed_stats;
+    }
+
+    s->stats->rd_latency_histogram =
+        bdrv_latency_histogram_info(&bs->stats, BLOCK_ACCT_READ);
+    s->stats->has_rd_latency_histogram = !!s->stats->rd_latency_histogram;
+    s->stats->wr_latency_histogram =
+        bdrv_latency_histogram_info(&bs->stats, BLOCK_ACCT_WRITE);
+    s->stats->has_wr_latency_histogram = !!s->stats->wr_latency_histogram;
+    s->stats->flush_latency_histogram =
+        bdrv_latency_histogram_info(&bs->stats, BLOCK_ACCT_FLUSH);
+    s->stats->has_flush_latency_histogram =
+        !!s->stats->flush_latency_histogram;
+
+    s->driver_specific = bdrv_get_specific_stats(bs);
+    s->has_driver_specific = s->driver_specific != NULL;
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(bs->file, query_backing);
@@ -0,0 +1,770 @@
+/*
+ * Persistent dirty bitmaps in qcow2 images
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+
+/* Bitmap directory entry flags */
+#define BME_FLAG_IN_USE         (1U << 0)
+#define BME_FLAG_AUTO           (1U << 1)
+#define BME_RESERVED_FLAGS      (~(BME_FLAG_IN_USE | BME_FLAG_AUTO))
+
+/* Bitmap types */
+#define BT_DIRTY_TRACKING_BITMAP 1
+
+/* Bitmap table entries */
+#define BME_TABLE_ENTRY_OFFSET_MASK     0x00fffffffffffe00ULL
+#define BME_TABLE_ENTRY_FLAG_ALL_ONES   1ULL
+#define BME_TABLE_ENTRY_RESERVED_MASK   0xff000000000001feULL
+
+#define BME_MAX_NAME_SIZE           1023
+#define BME_MIN_GRANULARITY_BITS    9
+#define BME_MAX_GRANULARITY_BITS    31
+#define BME_MAX_TABLE_SIZE          0x8000000
+
+typedef struct Qcow2BitmapDirEntry {
+    uint64_t bitmap_table_offset;
+    uint32_t bitmap_table_size;
+    uint32_t flags;
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint16_t name_size;
+    uint32_t extra_data_size;
+    /* extra data and name follow, padded to a multiple of 8 bytes */
+} QEMU_PACKED Qcow2BitmapDirEntry;
+
+/* A parsed bitmap directory entry */
+typedef struct Qcow2Bitmap {
+    char *name;
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint32_t flags;
+    uint8_t granularity_bits;
+    size_t dir_pos;             /* offset of the entry in the directory */
+} Qcow2Bitmap;
+
+static size_t dir_entry_size(uint32_t extra_data_size, uint16_t name_size)
+{
+    return ROUND_UP(sizeof(Qcow2BitmapDirEntry) + extra_data_size + name_size,
+                    8);
+}
+
+/* Number of sectors whose dirty state is stored in one cluster */
+static uint64_t sectors_per_bitmap_cluster(BDRVQcowState *s,
+                                           int granularity_bits)
+{
+    return ((uint64_t)s->cluster_size * 8) <<
+           (granularity_bits - BDRV_SECTOR_BITS);
+}
+
+static uint64_t bitmap_table_size(BDRVQcowState *s, int64_t sectors,
+                                  int granularity_bits)
+{
+    return DIV_ROUND_UP(sectors,
+                        sectors_per_bitmap_cluster(s, granularity_bits));
+}
+
+static void free_bitmap_list(Qcow2Bitmap *bitmaps, int nb_bitmaps)
+{
+    int i;
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        g_free(bitmaps[i].name);
+    }
+    g_free(bitmaps);
+}
+
+/*
+ * Reads and checks the bitmap directory. On success, returns the number of
+ * bitmaps and stores them in *bitmaps; if @dir is not NULL, the raw directory
+ * is stored there as well. Returns -errno on failure.
+ */
+static int read_bitmap_directory(BlockDriverState *bs, uint8_t **dir,
+                                 Qcow2Bitmap **bitmaps, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *list = NULL;
+    uint8_t *buf;
+    size_t pos = 0;
+    uint32_t i;
+    int ret;
+
+    buf = g_try_malloc(s->bitmap_directory_size);
+    if (buf == NULL) {
+        error_setg(errp, "Could not allocate memory for the bitmap directory");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, s->bitmap_directory_offset, buf,
+                     s->bitmap_directory_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap directory");
+        goto fail;
+    }
+
+    list = g_new0(Qcow2Bitmap, s->nb_bitmaps);
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        Qcow2BitmapDirEntry e;
+        Qcow2Bitmap *bm = &list[i];
+
+        if (s->bitmap_directory_size - pos < sizeof(e)) {
+            error_setg(errp, "Bitmap directory is truncated");
+            ret = -EINVAL;
+            goto fail;
+        }
+        memcpy(&e, buf + pos, sizeof(e));
+        be64_to_cpus(&e.bitmap_table_offset);
+        be32_to_cpus(&e.bitmap_table_size);
+        be32_to_cpus(&e.flags);
+        be16_to_cpus(&e.name_size);
+        be32_to_cpus(&e.extra_data_size);
+
+        if (e.name_size == 0 || e.name_size > BME_MAX_NAME_SIZE ||
+            s->bitmap_directory_size - pos <
+            dir_entry_size(e.extra_data_size, e.name_size))
+        {
+            error_setg(errp, "Bitmap directory entry %" PRIu32 " is invalid",
+                       i);
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        bm->name = g_strndup((char *)buf + pos + sizeof(e) +
+                             e.extra_data_size, e.name_size);
+        bm->table_offset = e.bitmap_table_offset;
+        bm->table_size = e.bitmap_table_size;
+        bm->flags = e.flags;
+        bm->granularity_bits = e.granularity_bits;
+        bm->dir_pos = pos;
+        pos += dir_entry_size(e.extra_data_size, e.name_size);
+
+        if (e.type != BT_DIRTY_TRACKING_BITMAP || e.extra_data_size ||
+            (e.flags & BME_RESERVED_FLAGS))
+        {
+            error_setg(errp, "Bitmap '%s' uses unsupported features",
+                       bm->name);
+            ret = -ENOTSUP;
+            goto fail;
+        }
+        if (e.granularity_bits < BME_MIN_GRANULARITY_BITS ||
+            e.granularity_bits > BME_MAX_GRANULARITY_BITS ||
+            offset_into_cluster(s, e.bitmap_table_offset) ||
+            e.bitmap_table_size > BME_MAX_TABLE_SIZE)
+        {
+            error_setg(errp, "Bitmap '%s' is invalid", bm->name);
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
+    if (pos != s->bitmap_directory_size) {
+        error_setg(errp, "Bitmap directory size does not match its entries");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (dir) {
+        *dir = buf;
+    } else {
+        g_free(buf);
+    }
+    *bitmaps = list;
+    return s->nb_bitmaps;
+
+fail:
+    free_bitmap_list(list, s->nb_bitmaps);
+    g_free(buf);
+    return ret;
+}
+
+static int read_bitmap_table(BlockDriverState *bs, Qcow2Bitmap *bm,
+                             uint64_t **table)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *t;
+    uint32_t i;
+    int ret;
+
+    t = g_try_new(uint64_t, bm->table_size);
+    if (bm->table_size && t == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, bm->table_offset, t,
+                     bm->table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        g_free(t);
+        return ret;
+    }
+
+    for (i = 0; i < bm->table_size; i++) {
+        be64_to_cpus(&t[i]);
+        if ((t[i] & BME_TABLE_ENTRY_RESERVED_MASK) ||
+            offset_into_cluster(s, t[i] & BME_TABLE_ENTRY_OFFSET_MASK))
+        {
+            g_free(t);
+            return -EINVAL;
+        }
+    }
+
+    *table = t;
+    return 0;
+}
+
+static void free_bitmap_clusters(BlockDriverState *bs, Qcow2Bitmap *bm)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *table;
+    uint32_t i;
+    int ret;
+
+    ret = read_bitmap_table(bs, bm, &table);
+    if (ret < 0) {
+        /* The clusters leak, which is harmless */
+        return;
+    }
+
+    for (i = 0; i < bm->table_size; i++) {
+        uint64_t offset = table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+        if (offset) {
+            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                QCOW2_DISCARD_ALWAYS);
+        }
+    }
+    qcow2_free_clusters(bs, bm->table_offset,
+                        bm->table_size * sizeof(uint64_t),
+                        QCOW2_DISCARD_ALWAYS);
+    g_free(table);
+}
+
+static int load_bitmap_data(BlockDriverState *bs, const uint64_t *table,
+                            uint32_t table_size, BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t size = bdrv_dirty_bitmap_size(bitmap);
+    int granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+    uint64_t sectors_per_cluster =
+        sectors_per_bitmap_cluster(s, granularity_bits);
+    uint8_t *buf;
+    uint32_t i;
+    int ret;
+
+    buf = qemu_try_blockalign(bs->file, s->cluster_size);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < table_size; i++) {
+        uint64_t offset = table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+        uint64_t start = i * sectors_per_cluster;
+        uint64_t count = MIN(size - start, sectors_per_cluster);
+
+        if (offset) {
+            ret = bdrv_pread(bs->file, offset, buf, s->cluster_size);
+            if (ret < 0) {
+                goto out;
+            }
+            bdrv_dirty_bitmap_deserialize_part(bitmap, buf, start, count,
+                                               false);
+        } else if (table[i] & BME_TABLE_ENTRY_FLAG_ALL_ONES) {
+            memset(buf, 0xff, s->cluster_size);
+            bdrv_dirty_bitmap_deserialize_part(bitmap, buf, start, count,
+                                               false);
+        } else {
+            bdrv_dirty_bitmap_deserialize_zeroes(bitmap, start, count, false);
+        }
+    }
+    ret = 0;
+
+out:
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+    qemu_vfree(buf);
+    return ret;
+}
+
+/*
+ * Creates the dirty bitmaps stored in the image. Bitmaps that were not stored
+ * properly (because QEMU did not close the image) are dropped, so that they
+ * cannot be used for an incremental backup. If the image is writable, all
+ * bitmaps are marked as in use until qcow2_store_bitmaps() stores them again.
+ */
+int qcow2_load_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bitmaps;
+    BdrvDirtyBitmap **created;
+    int nb_created = 0;
+    uint8_t *dir;
+    int i, n, ret;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    n = read_bitmap_directory(bs, &dir, &bitmaps, errp);
+    if (n < 0) {
+        return n;
+    }
+    created = g_new(BdrvDirtyBitmap *, n);
+
+    for (i = 0; i < n; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+        BdrvDirtyBitmap *bitmap;
+        uint64_t *table;
+
+        if (bm->flags & BME_FLAG_IN_USE) {
+            error_report("Dirty bitmap '%s' of '%s' was not stored properly "
+                         "and is dropped", bm->name, bs->filename);
+            continue;
+        }
+        if (bm->table_size != bitmap_table_size(s, bs->total_sectors,
+                                                bm->granularity_bits)) {
+            error_report("Dirty bitmap '%s' of '%s' does not match the image "
+                         "size and is dropped", bm->name, bs->filename);
+            continue;
+        }
+        if (bdrv_find_dirty_bitmap(bs, bm->name)) {
+            /* Still in memory, e.g. after qcow2_invalidate_cache() */
+            continue;
+        }
+
+        ret = read_bitmap_table(bs, bm, &table);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read table of bitmap '%s'",
+                             bm->name);
+            goto fail;
+        }
+
+        bitmap = bdrv_create_dirty_bitmap(bs, 1U << bm->granularity_bits,
+                                          bm->name, errp);
+        if (bitmap == NULL) {
+            g_free(table);
+            ret = -EINVAL;
+            goto fail;
+        }
+        created[nb_created++] = bitmap;
+
+        ret = load_bitmap_data(bs, table, bm->table_size, bitmap);
+        g_free(table);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read bitmap '%s'",
+                             bm->name);
+            goto fail;
+        }
+
+        bdrv_dirty_bitmap_set_persistence(bitmap, true);
+        if (!(bm->flags & BME_FLAG_AUTO)) {
+            bdrv_disable_dirty_bitmap(bitmap);
+        }
+    }
+
+    if (!bs->read_only && !(s->flags & BDRV_O_INCOMING)) {
+        for (i = 0; i < n; i++) {
+            Qcow2BitmapDirEntry *e =
+                (Qcow2BitmapDirEntry *)(dir + bitmaps[i].dir_pos);
+            e->flags = cpu_to_be32(bitmaps[i].flags | BME_FLAG_IN_USE);
+        }
+        ret = bdrv_pwrite_sync(bs->file, s->bitmap_directory_offset, dir,
+                               s->bitmap_directory_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not mark bitmaps as in use");
+            goto fail;
+        }
+    }
+
+    ret = 0;
+    goto out;
+
+fail:
+    for (i = 0; i < nb_created; i++) {
+        bdrv_release_dirty_bitmap(bs, created[i]);
+    }
+out:
+    free_bitmap_list(bitmaps, n);
+    g_free(created);
+    g_free(dir);
+    return ret;
+}
+
+/*
+ * Writes the data and the table of a bitmap to newly allocated clusters and
+ * fills in @bm accordingly.
+ */
+static int store_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                        Qcow2Bitmap *bm)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t size = bdrv_dirty_bitmap_size(bitmap);
+    int granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+    uint64_t sectors_per_cluster =
+        sectors_per_bitmap_cluster(s, granularity_bits);
+    uint64_t table_size = bitmap_table_size(s, size, granularity_bits);
+    uint64_t *table = NULL;
+    uint8_t *buf = NULL;
+    int64_t table_offset = -1;
+    uint32_t i;
+    int ret;
+
+    if (table_size > BME_MAX_TABLE_SIZE) {
+        return -EFBIG;
+    }
+
+    table = g_try_new0(uint64_t, table_size);
+    buf = qemu_try_blockalign(bs->file, s->cluster_size);
+    if ((table_size && table == NULL) || buf == NULL) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    for (i = 0; i < table_size; i++) {
+        uint64_t start = i * sectors_per_cluster;
+        uint64_t count = MIN(size - start, sectors_per_cluster);
+        uint64_t bytes = bdrv_dirty_bitmap_serialization_size(bitmap, start,
+                                                              count);
+        int64_t offset;
+
+        memset(buf, 0, s->cluster_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, start, count);
+        if (buffer_is_zero(buf, bytes)) {
+            continue;
+        }
+
+        offset = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (offset < 0) {
+            ret = offset;
+            goto fail;
+        }
+        table[i] = offset;
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+        ret = bdrv_pwrite(bs->file, offset, buf, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    table_offset = qcow2_alloc_clusters(bs, table_size * sizeof(uint64_t));
+    if (table_offset < 0) {
+        ret = table_offset;
+        goto fail;
+    }
+    ret = qcow2_pre_write_overlap_check(bs, 0, table_offset,
+                                        table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail;
+    }
+    for (i = 0; i < table_size; i++) {
+        cpu_to_be64s(&table[i]);
+    }
+    ret = bdrv_pwrite(bs->file, table_offset, table,
+                      table_size * sizeof(uint64_t));
+    for (i = 0; i < table_size; i++) {
+        be64_to_cpus(&table[i]);
+    }
+    if (ret < 0) {
+        goto fail;
+    }
+
+    bm->name = g_strdup(bdrv_dirty_bitmap_name(bitmap));
+    bm->table_offset = table_offset;
+    bm->table_size = table_size;
+    bm->granularity_bits = granularity_bits;
+    bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? BME_FLAG_AUTO : 0;
+
+    ret = 0;
+    goto out;
+
+fail:
+    for (i = 0; i < table_size; i++) {
+        if (table[i]) {
+            qcow2_free_clusters(bs, table[i], s->cluster_size,
+                                QCOW2_DISCARD_ALWAYS);
+        }
+    }
+    if (table_offset > 0) {
+        qcow2_free_clusters(bs, table_offset, table_size * sizeof(uint64_t),
+                            QCOW2_DISCARD_ALWAYS);
+    }
+out:
+    g_free(table);
+    qemu_vfree(buf);
+    return ret;
+}
+
+static void append_dir_entry(uint8_t **dir, size_t *dir_size,
+                             const Qcow2Bitmap *bm)
+{
+    size_t name_size = strlen(bm->name);
+    size_t entry_size = dir_entry_size(0, name_size);
+    Qcow2BitmapDirEntry *e;
+
+    *dir = g_realloc(*dir, *dir_size + entry_size);
+    e = (Qcow2BitmapDirEntry *)(*dir + *dir_size);
+    memset(e, 0, entry_size);
+
+    e->bitmap_table_offset = cpu_to_be64(bm->table_offset);
+    e->bitmap_table_size = cpu_to_be32(bm->table_size);
+    e->flags = cpu_to_be32(bm->flags);
+    e->type = BT_DIRTY_TRACKING_BITMAP;
+    e->granularity_bits = bm->granularity_bits;
+    e->name_size = cpu_to_be16(name_size);
+    memcpy(e + 1, bm->name, name_size);
+
+    *dir_size += entry_size;
+}
+
+/*
+ * Stores all persistent dirty bitmaps in the image, replacing the bitmaps
+ * stored so far. Called on close; errors are only reported, the bitmaps that
+ * were in the image stay marked as in use then.
+ */
+void qcow2_store_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2Bitmap *old = NULL, *new = NULL;
+    int nb_old = 0, nb_new = 0, nb_persistent = 0;
+    uint64_t old_dir_offset, old_dir_size, old_autoclear;
+    uint8_t *dir = NULL;
+    size_t dir_size = 0;
+    int64_t dir_offset = 0;
+    Error *local_err = NULL;
+    int i, ret;
+
+    if (bs->read_only || (s->flags & BDRV_O_INCOMING) ||
+        s->qcow_version < 3) {
+        return;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        if (bdrv_dirty_bitmap_get_persistence(bitmap) &&
+            bdrv_dirty_bitmap_name(bitmap)) {
+            nb_persistent++;
+        }
+    }
+    if (nb_persistent == 0 && s->nb_bitmaps == 0) {
+        return;
+    }
+
+    if (s->nb_bitmaps) {
+        nb_old = read_bitmap_directory(bs, NULL, &old, &local_err);
+        if (nb_old < 0) {
+            error_report_err(local_err);
+            nb_old = 0;
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
+    new = g_new0(Qcow2Bitmap, nb_persistent);
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        if (!bdrv_dirty_bitmap_get_persistence(bitmap) ||
+            !bdrv_dirty_bitmap_name(bitmap)) {
+            continue;
+        }
+        ret = store_bitmap(bs, bitmap, &new[nb_new]);
+        if (ret < 0) {
+            goto fail;
+        }
+        append_dir_entry(&dir, &dir_size, &new[nb_new]);
+        nb_new++;
+    }
+
+    if (nb_new) {
+        dir_offset = qcow2_alloc_clusters(bs, dir_size);
+        if (dir_offset < 0) {
+            ret = dir_offset;
+            dir_offset = 0;
+            goto fail;
+        }
+        ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+        if (ret < 0) {
+            goto fail;
+        }
+        ret = bdrv_pwrite(bs->file, dir_offset, dir, dir_size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* The new bitmaps and their refcounts must be on disk before the header
+     * points to them */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    old_dir_offset = s->bitmap_directory_offset;
+    old_dir_size = s->bitmap_directory_size;
+    old_autoclear = s->autoclear_features;
+    s->nb_bitmaps = nb_new;
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+    if (nb_new) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->nb_bitmaps = nb_old;
+        s->bitmap_directory_offset = old_dir_offset;
+        s->bitmap_directory_size = old_dir_size;
+        s->autoclear_features = old_autoclear;
+        goto fail;
+    }
+
+    /* Now the old bitmaps can go */
+    for (i = 0; i < nb_old; i++) {
+        free_bitmap_clusters(bs, &old[i]);
+    }
+    if (old_dir_size) {
+        qcow2_free_clusters(bs, old_dir_offset, old_dir_size,
+                            QCOW2_DISCARD_ALWAYS);
+    }
+    goto out;
+
+fail:
+    error_report("Could not store dirty bitmaps of '%s': %s", bs->filename,
+                 strerror(-ret));
+    for (i = 0; i < nb_new; i++) {
+        free_bitmap_clusters(bs, &new[i]);
+    }
+    if (dir_offset) {
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_ALWAYS);
+    }
+out:
+    free_bitmap_list(old, nb_old);
+    free_bitmap_list(new, nb_new);
+    g_free(dir);
+}
+
+bool qcow2_can_store_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                  uint32_t granularity, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    int nb_bitmaps = 0;
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "Persistent dirty bitmaps require a qcow2 image with "
+                   "at least qemu 1.1 compatibility level");
+        return false;
+    }
+    if (bs->read_only) {
+        error_setg(errp, "Cannot store dirty bitmaps in a read-only image");
+        return false;
+    }
+    if (strlen(name) > BME_MAX_NAME_SIZE) {
+        error_setg(errp, "Bitmap name is longer than %d bytes",
+                   BME_MAX_NAME_SIZE);
+        return false;
+    }
+    if (ctz32(granularity) > BME_MAX_GRANULARITY_BITS) {
+        error_setg(errp, "Granularity is too large");
+        return false;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        nb_bitmaps += bdrv_dirty_bitmap_get_persistence(bitmap);
+    }
+    if (nb_bitmaps >= QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Too many persistent dirty bitmaps");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Accounts for the clusters used by the stored bitmaps in the refcount table
+ * built by qcow2_check_refcounts().
+ */
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bitmaps;
+    Error *local_err = NULL;
+    int i, n, ret;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                   refcount_table_size,
+                                   s->bitmap_directory_offset,
+                                   s->bitmap_directory_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    n = read_bitmap_directory(bs, NULL, &bitmaps, &local_err);
+    if (n < 0) {
+        fprintf(stderr, "ERROR %s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        res->corruptions++;
+        return 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+        uint64_t *table;
+        uint32_t j;
+
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                       refcount_table_size, bm->table_offset,
+                                       bm->table_size * sizeof(uint64_t));
+        if (ret < 0) {
+            goto out;
+        }
+
+        ret = read_bitmap_table(bs, bm, &table);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR bitmap table of '%s' is invalid\n",
+                    bm->name);
+            res->corruptions++;
+            continue;
+        }
+
+        for (j = 0; j < bm->table_size; j++) {
+            uint64_t offset = table[j] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+            if (offset) {
+                ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                               refcount_table_size, offset,
+                                               s->cluster_size);
+                if (ret < 0) {
+                    g_free(table);
+                    goto out;
+                }
+            }
+        }
+        g_free(table);
+    }
+    ret = 0;
+
+out:
+    free_bitmap_list(bitmaps, n);
+    return ret;
+}
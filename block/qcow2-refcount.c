@@ -26,6 +26,7 @@
 #include "block/block_int.h"
 #include "block/qcow2.h"
 #include "qemu/range.h"
+#include "qemu/bitmap.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
@@ -117,9 +118,28 @@ int qcow2_refcount_init(BlockDriverState *bs)
 void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    qcow2_free_index_reset(bs);
     g_free(s->refcount_table);
 }
 
+/*
+ * Drops the free cluster index, so that it is rebuilt from the refcount
+ * blocks when it is needed next. Must be called whenever refcounts are
+ * changed behind the back of update_refcount().
+ */
+void qcow2_free_index_reset(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t i;
+
+    for (i = 0; i < s->free_index_size; i++) {
+        g_free(s->free_index[i].bitmap);
+    }
+    g_free(s->free_index);
+    s->free_index = NULL;
+    s->free_index_size = 0;
+}
+
 
 static uint64_t get_refcount_ro0(const void *refcount_array, uint64_t index)
 {
@@ -270,6 +290,110 @@ int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index,
     return 0;
 }
 
+/*
+ * Returns the free cluster index entry for the refcount block with the given
+ * reftable index in *free_block, building it from the refcount block first if
+ * needed. Returns 0 on success and -errno on failure.
+ */
+static int get_free_block(BlockDriverState *bs, uint64_t refcount_table_index,
+                          Qcow2FreeBlock **free_block)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2FreeBlock *fb;
+    int64_t refcount_block_offset = 0;
+    void *refcount_block;
+    uint64_t i;
+    int ret;
+
+    if (refcount_table_index >= s->free_index_size) {
+        uint64_t new_size = MAX(refcount_table_index + 1,
+                                MAX(s->refcount_table_size,
+                                    s->free_index_size * 2));
+
+        s->free_index = g_renew(Qcow2FreeBlock, s->free_index, new_size);
+        memset(&s->free_index[s->free_index_size], 0,
+               (new_size - s->free_index_size) * sizeof(Qcow2FreeBlock));
+        s->free_index_size = new_size;
+    }
+
+    fb = &s->free_index[refcount_table_index];
+    if (fb->bitmap) {
+        *free_block = fb;
+        return 0;
+    }
+
+    if (refcount_table_index < s->refcount_table_size) {
+        refcount_block_offset =
+            s->refcount_table[refcount_table_index] & REFT_OFFSET_MASK;
+    }
+
+    if (!refcount_block_offset) {
+        /* No refcount block, so all of its clusters are free */
+        fb->bitmap = bitmap_new(s->refcount_block_size);
+        bitmap_set(fb->bitmap, 0, s->refcount_block_size);
+        fb->nb_free = s->refcount_block_size;
+        *free_block = fb;
+        return 0;
+    }
+
+    if (offset_into_cluster(s, refcount_block_offset)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "Refblock offset %#" PRIx64
+                                " unaligned (reftable index: %#" PRIx64 ")",
+                                refcount_block_offset, refcount_table_index);
+        return -EIO;
+    }
+
+    ret = qcow2_cache_get(bs, s->refcount_block_cache, refcount_block_offset,
+                          &refcount_block);
+    if (ret < 0) {
+        return ret;
+    }
+
+    fb->bitmap = bitmap_new(s->refcount_block_size);
+    fb->nb_free = 0;
+    for (i = 0; i < s->refcount_block_size; i++) {
+        if (s->get_refcount(refcount_block, i) == 0) {
+            set_bit(i, fb->bitmap);
+            fb->nb_free++;
+        }
+    }
+
+    qcow2_cache_put(bs, s->refcount_block_cache, &refcount_block);
+
+    *free_block = fb;
+    return 0;
+}
+
+/*
+ * Keeps the free cluster index in sync with a new refcount for the given
+ * cluster. Refcount blocks that the index does not know yet are left alone.
+ */
+static void update_free_index(BDRVQcowState *s, uint64_t cluster_index,
+                              uint64_t refcount)
+{
+    uint64_t refcount_table_index = cluster_index >> s->refcount_block_bits;
+    long block_index = cluster_index & (s->refcount_block_size - 1);
+    Qcow2FreeBlock *fb;
+
+    if (refcount_table_index >= s->free_index_size) {
+        return;
+    }
+    fb = &s->free_index[refcount_table_index];
+    if (!fb->bitmap) {
+        return;
+    }
+
+    if (refcount == 0) {
+        if (!test_and_set_bit(block_index, fb->bitmap)) {
+            fb->nb_free++;
+        }
+    } else {
+        if (test_and_clear_bit(block_index, fb->bitmap)) {
+            fb->nb_free--;
+        }
+    }
+}
+
 /*
  * Rounds the refcount table size up to avoid growing the table for each single
  * refcount block that is allocated.
@@ -394,6 +518,7 @@ static int alloc_refcount_block(BlockDriverState *bs,
         int block_index = (new_block >> s->cluster_bits) &
             (s->refcount_block_size - 1);
         s->set_refcount(*refcount_block, block_index, 1);
+        update_free_index(s, new_block >> s->cluster_bits, 1);
     } else {
         /* Described somewhere else. This can recurse at most twice before we
          * arrive at a block that describes itself. */
@@ -579,6 +704,9 @@ static int alloc_refcount_block(BlockDriverState *bs,
     s->refcount_table_size = table_size;
     s->refcount_table_offset = table_offset;
 
+    /* The new refcount blocks were written directly */
+    qcow2_free_index_reset(bs);
+
     /* Free old table. */
     qcow2_free_clusters(bs, old_table_offset, old_table_size * sizeof(uint64_t),
                         QCOW2_DISCARD_OTHER);
@@ -702,6 +830,8 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
     if (decrease) {
         qcow2_cache_set_dependency(bs, s->refcount_block_cache,
             s->l2_table_cache);
+        /* The clusters may be freed and then reused by compressed data */
+        qcow2_compressed_cache_invalidate(bs);
     }
 
     start = start_of_cluster(s, offset);
@@ -749,6 +879,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
             s->free_cluster_index = cluster_index;
         }
         s->set_refcount(refcount_block, block_index, refcount);
+        update_free_index(s, cluster_index, refcount);
 
         if (refcount == 0 && s->discard_passthrough[type]) {
             update_refcount_discard(bs, cluster_offset, s->cluster_size);
@@ -816,7 +947,7 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs,
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t i, nb_clusters, refcount;
+    uint64_t nb_clusters, cluster_index, run;
     int ret;
 
     /* We can't allocate clusters if they may still be queued for discard. */
@@ -824,18 +955,49 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
         qcow2_process_discards(bs, 0);
     }
 
+    /* Look for the first run of nb_clusters free clusters starting at
+     * free_cluster_index, one refcount block at a time. run is the number of
+     * free clusters found immediately before cluster_index. */
     nb_clusters = size_to_clusters(s, size);
-retry:
-    for(i = 0; i < nb_clusters; i++) {
-        uint64_t next_cluster_index = s->free_cluster_index++;
-        ret = qcow2_get_refcount(bs, next_cluster_index, &refcount);
+    cluster_index = s->free_cluster_index;
+    run = 0;
+    while (run < nb_clusters) {
+        uint64_t refcount_table_index = cluster_index >> s->refcount_block_bits;
+        unsigned long block_index, end;
+        Qcow2FreeBlock *fb;
 
+        if (cluster_index > (INT64_MAX >> s->cluster_bits)) {
+            return -EFBIG;
+        }
+
+        ret = get_free_block(bs, refcount_table_index, &fb);
         if (ret < 0) {
             return ret;
-        } else if (refcount != 0) {
-            goto retry;
+        }
+
+        block_index = cluster_index & (s->refcount_block_size - 1);
+        if (run == 0) {
+            block_index = fb->nb_free == 0 ? s->refcount_block_size :
+                find_next_bit(fb->bitmap, s->refcount_block_size,
+                              block_index);
+            cluster_index = (refcount_table_index << s->refcount_block_bits) +
+                            block_index;
+            if (block_index == s->refcount_block_size) {
+                continue;
+            }
+        }
+
+        end = find_next_zero_bit(fb->bitmap, s->refcount_block_size,
+                                 block_index);
+        if (run + (end - block_index) >= nb_clusters) {
+            cluster_index += nb_clusters - run;
+            run = nb_clusters;
+        } else {
+            cluster_index += end - block_index;
+            run = end < s->refcount_block_size ? 0 : run + (end - block_index);
         }
     }
+    s->free_cluster_index = cluster_index;
 
     /* Make sure that all offsets in the "allocated" range are representable
      * in an int64_t */
@@ -1089,16 +1251,25 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
-
             for(j = 0; j < s->l2_size; j++) {
+                int slice_index = j % s->l2_slice_size;
                 uint64_t cluster_index;
 
-                offset = be64_to_cpu(l2_table[j]);
+                /* load the table one L2 cache entry at a time */
+                if (slice_index == 0) {
+                    if (l2_table) {
+                        qcow2_cache_put(bs, s->l2_table_cache,
+                                        (void **) &l2_table);
+                    }
+                    ret = qcow2_cache_get(bs, s->l2_table_cache,
+                                          l2_offset + j * l2_entry_size(s),
+                                          (void **) &l2_table);
+                    if (ret < 0) {
+                        goto fail;
+                    }
+                }
+
+                offset = get_l2_entry(s, l2_table, slice_index);
                 old_offset = offset;
                 offset &= ~QCOW_OFLAG_COPIED;
 
@@ -1169,7 +1340,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                         qcow2_cache_set_dependency(bs, s->l2_table_cache,
                             s->refcount_block_cache);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
+                    set_l2_entry(s, l2_table, slice_index, offset);
                     qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
                                                  l2_table);
                 }
@@ -1302,11 +1473,10 @@ static int realloc_refcount_array(BDRVQcowState *s, void **array,
  *
  * Modifies the number of errors in res.
  */
-static int inc_refcounts(BlockDriverState *bs,
-                         BdrvCheckResult *res,
-                         void **refcount_table,
-                         int64_t *refcount_table_size,
-                         int64_t offset, int64_t size)
+int qcow2_inc_refcounts_imrt(BlockDriverState *bs, BdrvCheckResult *res,
+                             void **refcount_table,
+                             int64_t *refcount_table_size,
+                             int64_t offset, int64_t size)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t start, last, cluster_offset, k, refcount;
@@ -1367,7 +1537,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     int i, l2_size, nb_csectors, ret;
 
     /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
+    l2_size = s->l2_size * l2_entry_size(s);
     l2_table = g_malloc(l2_size);
 
     ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
@@ -1379,7 +1549,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1396,8 +1566,9 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
             l2_entry &= s->cluster_offset_mask;
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                l2_entry & ~511, nb_csectors * 512);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size,
+                                           l2_entry & ~511, nb_csectors * 512);
             if (ret < 0) {
                 goto fail;
             }
@@ -1435,8 +1606,9 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             }
 
             /* Mark cluster as used */
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                offset, s->cluster_size);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size,
+                                           offset, s->cluster_size);
             if (ret < 0) {
                 goto fail;
             }
@@ -1488,8 +1660,8 @@ static int check_refcounts_l1(BlockDriverState *bs,
     l1_size2 = l1_size * sizeof(uint64_t);
 
     /* Mark L1 table as used */
-    ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                        l1_table_offset, l1_size2);
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, refcount_table_size,
+                                   l1_table_offset, l1_size2);
     if (ret < 0) {
         goto fail;
     }
@@ -1518,8 +1690,9 @@ static int check_refcounts_l1(BlockDriverState *bs,
         if (l2_offset) {
             /* Mark L2 table as used */
             l2_offset &= L1E_OFFSET_MASK;
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                l2_offset, s->cluster_size);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size,
+                                           l2_offset, s->cluster_size);
             if (ret < 0) {
                 goto fail;
             }
@@ -1601,7 +1774,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+                         s->l2_size * l2_entry_size(s));
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1610,7 +1783,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             int cluster_type = qcow2_get_cluster_type(l2_entry);
 
@@ -1630,9 +1803,9 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                                                     "ERROR",
                             l2_entry, refcount);
                     if (fix & BDRV_FIX_ERRORS) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j, refcount == 1
+                                     ? l2_entry |  QCOW_OFLAG_COPIED
+                                     : l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty = true;
                         res->corruptions_fixed++;
                     } else {
@@ -1733,14 +1906,15 @@ static int check_refblocks(BlockDriverState *bs, BdrvCheckResult *res,
                 }
 
                 res->corruptions_fixed++;
-                ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                                    offset, s->cluster_size);
+                ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                               nb_clusters,
+                                               offset, s->cluster_size);
                 if (ret < 0) {
                     return ret;
                 }
                 /* No need to check whether the refcount is now greater than 1:
                  * This area was just allocated and zeroed, so it can only be
-                 * exactly 1 after inc_refcounts() */
+                 * exactly 1 after qcow2_inc_refcounts_imrt() */
                 continue;
 
 resize_fail:
@@ -1755,8 +1929,8 @@ resize_fail:
         }
 
         if (offset != 0) {
-            ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                                offset, s->cluster_size);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                           offset, s->cluster_size);
             if (ret < 0) {
                 return ret;
             }
@@ -1796,8 +1970,8 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     }
 
     /* header */
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        0, s->cluster_size);
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                   0, s->cluster_size);
     if (ret < 0) {
         return ret;
     }
@@ -1818,16 +1992,22 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             return ret;
         }
     }
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        s->snapshots_offset, s->snapshots_size);
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                   s->snapshots_offset, s->snapshots_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* bitmaps */
+    ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
     if (ret < 0) {
         return ret;
     }
 
     /* refcount data */
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        s->refcount_table_offset,
-                        s->refcount_table_size * sizeof(uint64_t));
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                   s->refcount_table_offset,
+                                   s->refcount_table_size * sizeof(uint64_t));
     if (ret < 0) {
         return ret;
     }
@@ -2161,6 +2341,8 @@ write_refblocks:
     s->refcount_table = on_disk_reftable;
     s->refcount_table_offset = reftable_offset;
     s->refcount_table_size = reftable_size;
+    qcow2_free_index_reset(bs);
+    qcow2_compressed_cache_invalidate(bs);
 
     return 0;
 
@@ -41,6 +41,49 @@ void qcow2_free_snapshots(BlockDriverState *bs)
     s->nb_snapshots = 0;
 }
 
+/*
+ * The snapshot table is read in chunks of at least this size and parsed in
+ * memory; reading every field of every snapshot separately makes opening
+ * images with many snapshots slow.
+ */
+#define SNAPSHOT_TABLE_CHUNK (64 * 1024)
+
+/*
+ * Make sure that the first @len bytes of the snapshot table are in *@buf,
+ * which holds *@buf_len bytes so far.
+ */
+static int snapshot_table_fetch(BlockDriverState *bs, uint8_t **buf,
+                                int64_t *buf_len, int64_t len)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t new_len;
+    uint8_t *new_buf;
+    int ret;
+
+    if (len <= *buf_len) {
+        return 0;
+    }
+    if (len > QCOW_MAX_SNAPSHOTS_SIZE) {
+        return -EFBIG;
+    }
+
+    new_len = MAX(len, MAX(*buf_len * 2, SNAPSHOT_TABLE_CHUNK));
+    new_len = MIN(new_len, QCOW_MAX_SNAPSHOTS_SIZE);
+    new_buf = g_try_realloc(*buf, new_len);
+    if (new_buf == NULL) {
+        return -ENOMEM;
+    }
+    *buf = new_buf;
+
+    ret = bdrv_pread(bs->file, s->snapshots_offset + *buf_len,
+                     new_buf + *buf_len, new_len - *buf_len);
+    if (ret < 0) {
+        return ret;
+    }
+    *buf_len = new_len;
+    return 0;
+}
+
 int qcow2_read_snapshots(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
@@ -48,8 +91,10 @@ int qcow2_read_snapshots(BlockDriverState *bs)
     QCowSnapshotExtraData extra;
     QCowSnapshot *sn;
     int i, id_str_size, name_size;
-    int64_t offset;
+    int64_t offset, pos;
     uint32_t extra_data_size;
+    uint8_t *buf = NULL;
+    int64_t buf_len = 0;
     int ret;
 
     if (!s->nb_snapshots) {
@@ -64,10 +109,12 @@ int qcow2_read_snapshots(BlockDriverState *bs)
     for(i = 0; i < s->nb_snapshots; i++) {
         /* Read statically sized part of the snapshot header */
         offset = align_offset(offset, 8);
-        ret = bdrv_pread(bs->file, offset, &h, sizeof(h));
+        pos = offset - s->snapshots_offset;
+        ret = snapshot_table_fetch(bs, &buf, &buf_len, pos + sizeof(h));
         if (ret < 0) {
             goto fail;
         }
+        memcpy(&h, buf + pos, sizeof(h));
 
         offset += sizeof(h);
         sn = s->snapshots + i;
@@ -83,11 +130,13 @@ int qcow2_read_snapshots(BlockDriverState *bs)
         name_size = be16_to_cpu(h.name_size);
 
         /* Read extra data */
-        ret = bdrv_pread(bs->file, offset, &extra,
-                         MIN(sizeof(extra), extra_data_size));
+        pos = offset - s->snapshots_offset;
+        ret = snapshot_table_fetch(bs, &buf, &buf_len,
+                                   pos + MIN(sizeof(extra), extra_data_size));
         if (ret < 0) {
             goto fail;
         }
+        memcpy(&extra, buf + pos, MIN(sizeof(extra), extra_data_size));
         offset += extra_data_size;
 
         if (extra_data_size >= 8) {
@@ -100,23 +149,17 @@ int qcow2_read_snapshots(BlockDriverState *bs)
             sn->disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
         }
 
-        /* Read snapshot ID */
-        sn->id_str = g_malloc(id_str_size + 1);
-        ret = bdrv_pread(bs->file, offset, sn->id_str, id_str_size);
+        /* Read snapshot ID and name, which follow each other */
+        pos = offset - s->snapshots_offset;
+        ret = snapshot_table_fetch(bs, &buf, &buf_len,
+                                   pos + id_str_size + name_size);
         if (ret < 0) {
             goto fail;
         }
+        sn->id_str = g_strndup((char *)buf + pos, id_str_size);
         offset += id_str_size;
-        sn->id_str[id_str_size] = '\0';
-
-        /* Read snapshot name */
-        sn->name = g_malloc(name_size + 1);
-        ret = bdrv_pread(bs->file, offset, sn->name, name_size);
-        if (ret < 0) {
-            goto fail;
-        }
+        sn->name = g_strndup((char *)buf + pos + id_str_size, name_size);
         offset += name_size;
-        sn->name[name_size] = '\0';
 
         if (offset - s->snapshots_offset > QCOW_MAX_SNAPSHOTS_SIZE) {
             ret = -EFBIG;
@@ -126,9 +169,11 @@ int qcow2_read_snapshots(BlockDriverState *bs)
 
     assert(offset - s->snapshots_offset <= INT_MAX);
     s->snapshots_size = offset - s->snapshots_offset;
+    g_free(buf);
     return 0;
 
 fail:
+    g_free(buf);
     qcow2_free_snapshots(bs);
     return ret;
 }
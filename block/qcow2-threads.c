@@ -0,0 +1,223 @@
+/*
+ * qcow2 compression, offloaded to the thread pool
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <zlib.h>
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "qcow2.h"
+
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * The compression functions return the length of the data written to @dest,
+ * -ENOMEM if it does not fit into @dest_size bytes (i.e. the data does not
+ * compress), or -EIO on any other error.
+ *
+ * The decompression functions must fill all of @dest_size bytes; @src may
+ * continue after the compressed data, as compressed clusters are stored in
+ * whole sectors.
+ */
+typedef ssize_t Qcow2CompressFunc(void *dest, size_t dest_size,
+                                  const void *src, size_t src_size);
+
+static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = dest_size - strm.avail_out;
+    } else {
+        ret = (ret == Z_OK ? -ENOMEM : -EIO);
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret = 0;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.next_in = (uint8_t *)src;
+    strm.avail_in = src_size;
+    strm.next_out = dest;
+    strm.avail_out = dest_size;
+
+    ret = inflateInit2(&strm, -12);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    ret = inflate(&strm, Z_FINISH);
+    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || strm.avail_out != 0) {
+        /* Z_BUF_ERROR is fine as long as the whole cluster was inflated: the
+         * input may go on past the compressed data */
+        ret = -EIO;
+    } else {
+        ret = 0;
+    }
+
+    inflateEnd(&strm);
+    return ret;
+}
+
+#ifdef CONFIG_ZSTD
+static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    size_t ret;
+
+    /* Errors mostly mean that @dest is too small; either way the cluster
+     * can still be written uncompressed */
+    ret = ZSTD_compress(dest, dest_size, src, src_size, 3);
+    if (ZSTD_isError(ret)) {
+        return -ENOMEM;
+    }
+    return ret;
+}
+
+static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    ZSTD_outBuffer output = { dest, dest_size, 0 };
+    ZSTD_inBuffer input = { src, src_size, 0 };
+    ZSTD_DCtx *dctx;
+    ssize_t ret = 0;
+
+    dctx = ZSTD_createDCtx();
+    if (!dctx) {
+        return -EIO;
+    }
+
+    /* Stream the data rather than using ZSTD_decompress(), which fails on
+     * the bytes that follow the frame */
+    while (output.pos < output.size) {
+        size_t last_in_pos = input.pos;
+        size_t last_out_pos = output.pos;
+        size_t zstd_ret;
+
+        zstd_ret = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(zstd_ret) ||
+            (zstd_ret == 0 && output.pos < output.size) ||
+            (last_in_pos == input.pos && last_out_pos == output.pos)) {
+            ret = -EIO;
+            break;
+        }
+    }
+
+    ZSTD_freeDCtx(dctx);
+    return ret;
+}
+#endif
+
+bool qcow2_compression_type_supported(Qcow2CompressionType type)
+{
+    switch (type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return true;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+static Qcow2CompressFunc *qcow2_compress_func(BlockDriverState *bs,
+                                              bool decompress)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return decompress ? qcow2_zlib_decompress : qcow2_zlib_compress;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return decompress ? qcow2_zstd_decompress : qcow2_zstd_compress;
+#endif
+    default:
+        /* qcow2_open() refuses images with unsupported compression */
+        abort();
+    }
+}
+
+/*
+ * Compresses @src_size bytes at @src into @dest with the compression type of
+ * the image. Runs in the calling thread; bdrv_write_compressed() is
+ * synchronous anyway.
+ */
+ssize_t qcow2_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                       const void *src, size_t src_size)
+{
+    return qcow2_compress_func(bs, false)(dest, dest_size, src, src_size);
+}
+
+typedef struct Qcow2CompressData {
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    ssize_t ret;
+
+    Qcow2CompressFunc *func;
+} Qcow2CompressData;
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = data->func(data->dest, data->dest_size,
+                           data->src, data->src_size);
+    return 0;
+}
+
+/*
+ * Inflates one compressed cluster in a thread of the pool of the image's
+ * AioContext, so that several clusters can be decompressed at the same time
+ * and the vCPUs and the main loop are not held up meanwhile. Returns 0 on
+ * success and -errno on failure.
+ */
+ssize_t coroutine_fn qcow2_co_decompress(BlockDriverState *bs,
+                                         void *dest, size_t dest_size,
+                                         const void *src, size_t src_size)
+{
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CompressData arg = {
+        .dest       = dest,
+        .dest_size  = dest_size,
+        .src        = src,
+        .src_size   = src_size,
+        .func       = qcow2_compress_func(bs, true),
+    };
+
+    thread_pool_submit_co(pool, qcow2_compress_pool_func, &arg);
+    return arg.ret;
+}
@@ -24,7 +24,6 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
-#include <zlib.h>
 #include "block/qcow2.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
@@ -60,6 +59,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -159,6 +159,57 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_BITMAPS:
+        {
+            Qcow2BitmapHeaderExt bitmaps_ext;
+
+            if (ext.len != sizeof(bitmaps_ext)) {
+                error_setg(errp, "ERROR: ext_bitmaps: Invalid extension "
+                           "length");
+                return -EINVAL;
+            }
+
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+                /* The image was written by a program that does not know
+                 * about bitmaps, so they are probably out of date; drop the
+                 * extension (the clusters leak) */
+                error_report("WARNING: the bitmaps extension of '%s' is out "
+                             "of date; its bitmaps are dropped", bs->filename);
+                break;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &bitmaps_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: ext_bitmaps: "
+                                 "Could not read ext_bitmaps");
+                return ret;
+            }
+            be32_to_cpus(&bitmaps_ext.nb_bitmaps);
+            be32_to_cpus(&bitmaps_ext.reserved32);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_size);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_offset);
+
+            if (bitmaps_ext.reserved32 != 0) {
+                error_setg(errp, "ERROR: ext_bitmaps: Reserved field is not "
+                           "zero");
+                return -EINVAL;
+            }
+            if (bitmaps_ext.nb_bitmaps == 0 ||
+                bitmaps_ext.nb_bitmaps > QCOW2_MAX_BITMAPS ||
+                bitmaps_ext.bitmap_directory_size >
+                QCOW2_MAX_BITMAP_DIRECTORY_SIZE ||
+                offset_into_cluster(s, bitmaps_ext.bitmap_directory_offset)) {
+                error_setg(errp, "ERROR: ext_bitmaps: Invalid bitmap "
+                           "directory");
+                return -EINVAL;
+            }
+
+            s->nb_bitmaps = bitmaps_ext.nb_bitmaps;
+            s->bitmap_directory_size = bitmaps_ext.bitmap_directory_size;
+            s->bitmap_directory_offset = bitmaps_ext.bitmap_directory_offset;
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -462,11 +513,21 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum L2 table cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of each entry in the L2 cache",
+        },
         {
             .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
             .type = QEMU_OPT_SIZE,
             .help = "Maximum refcount block cache size",
         },
+        {
+            .name = QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the cache of decompressed clusters",
+        },
         { /* end of list */ }
     },
 };
@@ -554,7 +615,8 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     uint64_t l1_vm_state_index;
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
-    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    uint64_t compressed_cache_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -615,13 +677,22 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         be32_to_cpus(&header.refcount_order);
         be32_to_cpus(&header.header_length);
 
-        if (header.header_length < 104) {
+        if (header.header_length < QCOW2_HEADER_LENGTH_V3) {
             error_setg(errp, "qcow2 header too short");
             ret = -EINVAL;
             goto fail;
         }
     }
 
+    /* The additional fields must be complete if they are there at all */
+    if (header.header_length <= QCOW2_HEADER_LENGTH_V3) {
+        header.compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    } else if (header.header_length < sizeof(header)) {
+        error_setg(errp, "qcow2 header has incomplete additional fields");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     if (header.header_length > s->cluster_size) {
         error_setg(errp, "qcow2 header exceeds cluster size");
         ret = -EINVAL;
@@ -669,6 +740,22 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    if (!!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION) !=
+        (header.compression_type != QCOW2_COMPRESSION_TYPE_ZLIB)) {
+        error_setg(errp, "qcow2: Compression type %d does not match the "
+                   "compression type bit", header.compression_type);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (header.compression_type >= QCOW2_COMPRESSION_TYPE_MAX ||
+        !qcow2_compression_type_supported(header.compression_type)) {
+        report_unsupported(bs, errp, "compression type %d",
+                           header.compression_type);
+        ret = -ENOTSUP;
+        goto fail;
+    }
+    s->compression_type = header.compression_type;
+
     if (s->incompatible_features & QCOW2_INCOMPAT_CORRUPT) {
         /* Corrupt images may not be written to unless they are being repaired
          */
@@ -708,7 +795,20 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         bs->encrypted = 1;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    if (has_subclusters(s) && s->cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+        error_setg(errp, "Extended L2 entries are only supported with "
+                   "cluster sizes of at least %d bytes",
+                   1 << MIN_EXTL2_CLUSTER_BITS);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->subclusters_per_cluster =
+        has_subclusters(s) ? QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER : 1;
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_bits = ctz32(s->subcluster_size);
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - ctz32(l2_entry_size(s));
     s->l2_size = 1 << s->l2_bits;
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
@@ -819,7 +919,21 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    l2_cache_size /= s->cluster_size;
+    l2_cache_entry_size = qemu_opt_get_size(opts,
+                                            QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+                                            s->cluster_size);
+    if (l2_cache_entry_size < BDRV_SECTOR_SIZE ||
+        l2_cache_entry_size > s->cluster_size ||
+        !is_power_of_2(l2_cache_entry_size)) {
+        error_setg(errp, QCOW2_OPT_L2_CACHE_ENTRY_SIZE " must be a power of "
+                   "two between %d and the cluster size (%d)",
+                   BDRV_SECTOR_SIZE, s->cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
+
+    l2_cache_size /= l2_cache_entry_size;
     if (l2_cache_size < MIN_L2_CACHE_SIZE) {
         l2_cache_size = MIN_L2_CACHE_SIZE;
     }
@@ -840,25 +954,36 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
-    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_entry_size);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 s->cluster_size);
     if (s->l2_table_cache == NULL || s->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
         goto fail;
     }
 
-    s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_try_blockalign(bs->file, QCOW_MAX_CRYPT_CLUSTERS
-                                                    * s->cluster_size + 512);
-    if (s->cluster_data == NULL) {
-        error_setg(errp, "Could not allocate temporary cluster buffer");
-        ret = -ENOMEM;
+    /* the decompressed clusters themselves are allocated as they are read */
+    compressed_cache_size = qemu_opt_get_size(opts,
+                                              QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+                                              DEFAULT_COMPRESSED_CACHE_BYTE_SIZE);
+    compressed_cache_size /= s->cluster_size;
+    if (compressed_cache_size < 1) {
+        compressed_cache_size = 1;
+    }
+    if (compressed_cache_size > INT_MAX / sizeof(Qcow2CompressedCacheEntry)) {
+        error_setg(errp, "Compressed cluster cache size too big");
+        ret = -EINVAL;
         goto fail;
     }
+    s->compressed_cache_size = compressed_cache_size;
+    s->compressed_cache = g_new0(Qcow2CompressedCacheEntry,
+                                 s->compressed_cache_size);
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        s->compressed_cache[i].offset = -1;
+    }
 
-    s->cluster_cache_offset = -1;
     s->flags = flags;
 
     ret = qcow2_refcount_init(bs);
@@ -907,9 +1032,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INCOMING) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    /* Clear unknown autoclear feature bits, and the bitmaps bit if the
+     * extension was dropped */
+    if (!s->nb_bitmaps) {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+    if (!bs->read_only && !(flags & BDRV_O_INCOMING) &&
+        ((s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK) ||
+         header.autoclear_features != s->autoclear_features)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -996,6 +1127,13 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* Must come last, there is no cleanup for the bitmaps in the fail path */
+    ret = qcow2_load_bitmaps(bs, &local_err);
+    if (ret < 0) {
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -1019,8 +1157,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(bs, s->refcount_block_cache);
     }
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_compressed_cache_free(bs);
     return ret;
 }
 
@@ -1028,7 +1165,8 @@ static void qcow2_refresh_limits(BlockDriverState *bs, Error **errp)
 {
     BDRVQcowState *s = bs->opaque;
 
-    bs->bl.write_zeroes_alignment = s->cluster_sectors;
+    /* With subclusters, partial clusters can be zeroed too */
+    bs->bl.write_zeroes_alignment = s->subcluster_size >> BDRV_SECTOR_BITS;
 }
 
 static int qcow2_set_key(BlockDriverState *bs, const char *key)
@@ -1074,6 +1212,9 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
     int ret;
 
     if ((state->flags & BDRV_O_RDWR) == 0) {
+        /* No more writes, so the bitmaps can be stored now */
+        qcow2_store_bitmaps(state->bs);
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             return ret;
@@ -1145,6 +1286,7 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
     uint64_t cluster_offset = 0;
     uint64_t bytes_done = 0;
     QEMUIOVector hd_qiov;
+    QEMUIOVector *cur_qiov;
     uint8_t *cluster_data = NULL;
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
@@ -1168,31 +1310,45 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
 
         index_in_cluster = sector_num & (s->cluster_sectors - 1);
 
-        qemu_iovec_reset(&hd_qiov);
-        qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
-            cur_nr_sectors * 512);
+        if (bytes_done == 0 && cur_nr_sectors * 512 == qiov->size &&
+            !bs->encrypted) {
+            /* The whole request in one go, no need for a partial copy */
+            cur_qiov = qiov;
+        } else {
+            qemu_iovec_reset(&hd_qiov);
+            qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
+                cur_nr_sectors * 512);
+            cur_qiov = &hd_qiov;
+        }
 
         switch (ret) {
         case QCOW2_CLUSTER_UNALLOCATED:
 
             if (bs->backing_hd) {
                 /* read from the base image */
-                n1 = qcow2_backing_read1(bs->backing_hd, &hd_qiov,
+                n1 = qcow2_backing_read1(bs->backing_hd, cur_qiov,
                     sector_num, cur_nr_sectors);
                 if (n1 > 0) {
                     QEMUIOVector local_qiov;
-
-                    qemu_iovec_init(&local_qiov, hd_qiov.niov);
-                    qemu_iovec_concat(&local_qiov, &hd_qiov, 0,
-                                      n1 * BDRV_SECTOR_SIZE);
+                    QEMUIOVector *backing_qiov = cur_qiov;
+
+                    /* Only part of it is within the backing file */
+                    if (n1 < cur_nr_sectors) {
+                        qemu_iovec_init(&local_qiov, cur_qiov->niov);
+                        qemu_iovec_concat(&local_qiov, cur_qiov, 0,
+                                          n1 * BDRV_SECTOR_SIZE);
+                        backing_qiov = &local_qiov;
+                    }
 
                     BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
                     qemu_co_mutex_unlock(&s->lock);
                     ret = bdrv_co_readv(bs->backing_hd, sector_num,
-                                        n1, &local_qiov);
+                                        n1, backing_qiov);
                     qemu_co_mutex_lock(&s->lock);
 
-                    qemu_iovec_destroy(&local_qiov);
+                    if (backing_qiov == &local_qiov) {
+                        qemu_iovec_destroy(&local_qiov);
+                    }
 
                     if (ret < 0) {
                         goto fail;
@@ -1200,24 +1356,21 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                 }
             } else {
                 /* Note: in this case, no need to wait */
-                qemu_iovec_memset(&hd_qiov, 0, 0, 512 * cur_nr_sectors);
+                qemu_iovec_memset(cur_qiov, 0, 0, 512 * cur_nr_sectors);
             }
             break;
 
         case QCOW2_CLUSTER_ZERO:
-            qemu_iovec_memset(&hd_qiov, 0, 0, 512 * cur_nr_sectors);
+            qemu_iovec_memset(cur_qiov, 0, 0, 512 * cur_nr_sectors);
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            ret = qcow2_co_read_compressed(bs, cluster_offset,
+                                           index_in_cluster * 512, cur_qiov,
+                                           512 * cur_nr_sectors);
             if (ret < 0) {
                 goto fail;
             }
-
-            qemu_iovec_from_buf(&hd_qiov, 0,
-                s->cluster_cache + index_in_cluster * 512,
-                512 * cur_nr_sectors);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -1254,7 +1407,7 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             qemu_co_mutex_unlock(&s->lock);
             ret = bdrv_co_readv(bs->file,
                                 (cluster_offset >> 9) + index_in_cluster,
-                                cur_nr_sectors, &hd_qiov);
+                                cur_nr_sectors, cur_qiov);
             qemu_co_mutex_lock(&s->lock);
             if (ret < 0) {
                 goto fail;
@@ -1295,6 +1448,45 @@ fail:
     return ret;
 }
 
+/* Check if it's possible to merge a write request with the writing of
+ * the data from the COW regions */
+static bool merge_cow(uint64_t offset, unsigned bytes,
+                      QEMUIOVector *hd_qiov, QCowL2Meta *l2meta)
+{
+    QCowL2Meta *m;
+
+    for (m = l2meta; m != NULL; m = m->next) {
+        /* If both COW regions are empty then there's nothing to merge */
+        if (m->cow_start.nb_sectors == 0 && m->cow_end.nb_sectors == 0) {
+            continue;
+        }
+
+        /* The data (middle) region must be immediately after the
+         * start region */
+        if (l2meta_cow_start(m) + m->cow_start.nb_sectors * BDRV_SECTOR_SIZE
+            != offset) {
+            continue;
+        }
+
+        /* The end region must be immediately after the data (middle)
+         * region */
+        if (m->offset + m->cow_end.offset != offset + bytes) {
+            continue;
+        }
+
+        /* Make sure that adding both COW regions to the QEMUIOVector
+         * does not exceed IOV_MAX */
+        if (hd_qiov->niov > IOV_MAX - 2) {
+            continue;
+        }
+
+        m->data_qiov = hd_qiov;
+        return true;
+    }
+
+    return false;
+}
+
 static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                            int64_t sector_num,
                            int remaining_sectors,
@@ -1315,8 +1507,6 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-
     qemu_co_mutex_lock(&s->lock);
 
     while (remaining_sectors != 0) {
@@ -1382,16 +1572,23 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             goto fail;
         }
 
-        qemu_co_mutex_unlock(&s->lock);
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
-        trace_qcow2_writev_data(qemu_coroutine_self(),
-                                (cluster_offset >> 9) + index_in_cluster);
-        ret = bdrv_co_writev(bs->file,
-                             (cluster_offset >> 9) + index_in_cluster,
-                             cur_nr_sectors, &hd_qiov);
-        qemu_co_mutex_lock(&s->lock);
-        if (ret < 0) {
-            goto fail;
+        /* If we need to do COW, check if it's possible to merge the
+         * writing of the guest data together with that of the COW regions.
+         * If it's not possible (or not necessary) then write the
+         * guest data now. */
+        if (!merge_cow(sector_num << 9, cur_nr_sectors << 9,
+                       &hd_qiov, l2meta)) {
+            qemu_co_mutex_unlock(&s->lock);
+            BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+            trace_qcow2_writev_data(qemu_coroutine_self(),
+                                    (cluster_offset >> 9) + index_in_cluster);
+            ret = bdrv_co_writev(bs->file,
+                                 (cluster_offset >> 9) + index_in_cluster,
+                                 cur_nr_sectors, &hd_qiov);
+            qemu_co_mutex_lock(&s->lock);
+            if (ret < 0) {
+                goto fail;
+            }
         }
 
         while (l2meta != NULL) {
@@ -1447,6 +1644,9 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    qcow2_store_bitmaps(bs);
+
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -1483,8 +1683,7 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->image_backing_file);
     g_free(s->image_backing_format);
 
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_compressed_cache_free(bs);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -1568,7 +1767,7 @@ int qcow2_update_header(BlockDriverState *bs)
     int ret;
     uint64_t total_size;
     uint32_t refcount_table_clusters;
-    size_t header_length;
+    size_t header_length, v3_header_length;
     Qcow2UnknownHeaderExtension *uext;
 
     buf = qemu_blockalign(bs, buflen);
@@ -1581,7 +1780,15 @@ int qcow2_update_header(BlockDriverState *bs)
         goto fail;
     }
 
-    header_length = sizeof(*header) + s->unknown_header_fields_size;
+    /* Keep the header as short as before unless the additional fields are
+     * needed, or unknown fields come after them */
+    if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB ||
+        s->unknown_header_fields_size) {
+        v3_header_length = sizeof(*header);
+    } else {
+        v3_header_length = QCOW2_HEADER_LENGTH_V3;
+    }
+    header_length = v3_header_length + s->unknown_header_fields_size;
     total_size = bs->total_sectors * BDRV_SECTOR_SIZE;
     refcount_table_clusters = s->refcount_table_size >> (s->cluster_bits - 3);
 
@@ -1607,6 +1814,7 @@ int qcow2_update_header(BlockDriverState *bs)
         .autoclear_features     = cpu_to_be64(s->autoclear_features),
         .refcount_order         = cpu_to_be32(s->refcount_order),
         .header_length          = cpu_to_be32(header_length),
+        .compression_type       = s->compression_type,
     };
 
     /* For older versions, write a shorter header */
@@ -1615,7 +1823,7 @@ int qcow2_update_header(BlockDriverState *bs)
         ret = offsetof(QCowHeader, incompatible_features);
         break;
     case 3:
-        ret = sizeof(*header);
+        ret = v3_header_length;
         break;
     default:
         ret = -EINVAL;
@@ -1664,11 +1872,26 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
             .name = "corrupt bit",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_COMPRESSION_BITNR,
+            .name = "compression type",
+        },
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+            .name = "extended L2 entries",
+        },
         {
             .type = QCOW2_FEAT_TYPE_COMPATIBLE,
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+            .name = "bitmaps",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1679,6 +1902,25 @@ int qcow2_update_header(BlockDriverState *bs)
     buf += ret;
     buflen -= ret;
 
+    /* Bitmap directory */
+    if (s->nb_bitmaps > 0) {
+        Qcow2BitmapHeaderExt bitmaps_header = {
+            .nb_bitmaps = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size =
+                cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                cpu_to_be64(s->bitmap_directory_offset)
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_BITMAPS,
+                             &bitmaps_header, sizeof(bitmaps_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -1810,7 +2052,7 @@ static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
                          int flags, size_t cluster_size, PreallocMode prealloc,
                          QemuOpts *opts, int version, int refcount_order,
-                         Error **errp)
+                         Qcow2CompressionType compression_type, Error **errp)
 {
     /* Calculate cluster_bits */
     int cluster_bits;
@@ -1851,6 +2093,9 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         uint64_t nreftablee, nrefblocke, nl1e, nl2e;
         int64_t aligned_total_size = align_offset(total_size, cluster_size);
         int refblock_bits, refblock_size;
+        /* L2 entry size in bytes */
+        size_t l2es = (flags & BLOCK_FLAG_EXTENDED_L2) ? 2 * sizeof(uint64_t)
+                                                       : sizeof(uint64_t);
         /* refcount entry size in bytes */
         double rces = (1 << refcount_order) / 8.;
 
@@ -1863,11 +2108,11 @@ static int qcow2_create2(const char *filename, int64_t total_size,
 
         /* total size of L2 tables */
         nl2e = aligned_total_size / cluster_size;
-        nl2e = align_offset(nl2e, cluster_size / sizeof(uint64_t));
-        meta_size += nl2e * sizeof(uint64_t);
+        nl2e = align_offset(nl2e, cluster_size / l2es);
+        meta_size += nl2e * l2es;
 
         /* total size of L1 tables */
-        nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+        nl1e = nl2e * l2es / cluster_size;
         nl1e = align_offset(nl1e, cluster_size / sizeof(uint64_t));
         meta_size += nl1e * sizeof(uint64_t);
 
@@ -1931,9 +2176,16 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         .refcount_table_offset      = cpu_to_be64(cluster_size),
         .refcount_table_clusters    = cpu_to_be32(1),
         .refcount_order             = cpu_to_be32(refcount_order),
-        .header_length              = cpu_to_be32(sizeof(*header)),
+        .header_length              = cpu_to_be32(QCOW2_HEADER_LENGTH_V3),
     };
 
+    if (compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        header->header_length = cpu_to_be32(sizeof(*header));
+        header->compression_type = compression_type;
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_COMPRESSION);
+    }
+
     if (flags & BLOCK_FLAG_ENCRYPT) {
         header->crypt_method = cpu_to_be32(QCOW_CRYPT_AES);
     } else {
@@ -1945,6 +2197,11 @@ static int qcow2_create2(const char *filename, int64_t total_size,
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
 
+    if (flags & BLOCK_FLAG_EXTENDED_L2) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+
     ret = bdrv_pwrite(bs, 0, header, cluster_size);
     g_free(header);
     if (ret < 0) {
@@ -2051,6 +2308,7 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
     int version = 3;
     uint64_t refcount_bits = 16;
     int refcount_order;
+    Qcow2CompressionType compression_type;
     Error *local_err = NULL;
     int ret;
 
@@ -2091,6 +2349,10 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
         flags |= BLOCK_FLAG_LAZY_REFCOUNTS;
     }
 
+    if (qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false)) {
+        flags |= BLOCK_FLAG_EXTENDED_L2;
+    }
+
     if (backing_file && prealloc != PREALLOC_MODE_OFF) {
         error_setg(errp, "Backing file and preallocation cannot be used at "
                    "the same time");
@@ -2105,6 +2367,23 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
         goto finish;
     }
 
+    if (flags & BLOCK_FLAG_EXTENDED_L2) {
+        if (version < 3) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "compatibility level 1.1 and above (use compat=1.1 "
+                       "or greater)");
+            ret = -EINVAL;
+            goto finish;
+        }
+        if (cluster_size < (1 << MIN_EXTL2_CLUSTER_BITS)) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "cluster sizes of at least %d bytes",
+                       1 << MIN_EXTL2_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto finish;
+        }
+    }
+
     refcount_bits = qemu_opt_get_number_del(opts, BLOCK_OPT_REFCOUNT_BITS,
                                             refcount_bits);
     if (refcount_bits > 64 || !is_power_of_2(refcount_bits)) {
@@ -2124,9 +2403,34 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
 
     refcount_order = ctz32(refcount_bits);
 
+    g_free(buf);
+    buf = qemu_opt_get_del(opts, BLOCK_OPT_COMPRESSION_TYPE);
+    compression_type = qapi_enum_parse(Qcow2CompressionType_lookup, buf,
+                                       QCOW2_COMPRESSION_TYPE_MAX,
+                                       QCOW2_COMPRESSION_TYPE_ZLIB,
+                                       &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto finish;
+    }
+    if (!qcow2_compression_type_supported(compression_type)) {
+        error_setg(errp, "Compression type '%s' is not supported by this "
+                   "build", Qcow2CompressionType_lookup[compression_type]);
+        ret = -ENOTSUP;
+        goto finish;
+    }
+    if (version < 3 && compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_setg(errp, "Compression types other than zlib require "
+                   "compatibility level 1.1 or above (use compat=1.1 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
     ret = qcow2_create2(filename, size, backing_file, backing_fmt, flags,
                         cluster_size, prealloc, opts, version, refcount_order,
-                        &local_err);
+                        compression_type, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
     }
@@ -2138,21 +2442,104 @@ finish:
     return ret;
 }
 
+/* Whether all of the sectors (clipped to the image size) read as zeros */
+static bool is_zero_sectors(BlockDriverState *bs, int64_t start,
+                            int64_t count)
+{
+    int64_t res;
+    int nr;
+
+    if (start + count > bs->total_sectors) {
+        count = bs->total_sectors - start;
+    }
+    if (count <= 0) {
+        return true;
+    }
+
+    res = bdrv_get_block_status_above(bs, NULL, start, count, &nr);
+    return res >= 0 && (res & BDRV_BLOCK_ZERO) && nr == count;
+}
+
+/*
+ * Whether the sectors are unallocated or zero in the image itself, i.e. they
+ * cannot have been written since is_zero_sectors() looked at them.
+ * Called with s->lock held.
+ */
+static bool is_unallocated_or_zero(BlockDriverState *bs, int64_t start,
+                                   int64_t count)
+{
+    uint64_t cluster_offset;
+    int nr, ret;
+
+    while (count > 0) {
+        nr = MIN(count, INT_MAX);
+        ret = qcow2_get_cluster_offset(bs, start << BDRV_SECTOR_BITS, &nr,
+                                       &cluster_offset);
+        if (ret != QCOW2_CLUSTER_UNALLOCATED && ret != QCOW2_CLUSTER_ZERO) {
+            return false;
+        }
+        start += nr;
+        count -= nr;
+    }
+    return true;
+}
+
 static coroutine_fn int qcow2_co_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors, BdrvRequestFlags flags)
 {
-    int ret;
+    int ret = 0;
     BDRVQcowState *s = bs->opaque;
+    int unit = s->subcluster_size >> BDRV_SECTOR_BITS;
+    int head = sector_num % unit;
+    int tail = (sector_num + nb_sectors) % unit;
+
+    if (head || tail) {
+        int64_t end = sector_num + nb_sectors;
+        int tail_left = tail ? unit - tail : 0;
+
+        /* If the rest of the (sub)clusters already reads as zeros, all of
+         * them can be zeroed; otherwise emulate the misaligned write */
+        if (!is_zero_sectors(bs, sector_num - head, head) ||
+            !is_zero_sectors(bs, end, tail_left)) {
+            return -ENOTSUP;
+        }
 
-    /* Emulate misaligned zero writes */
-    if (sector_num % s->cluster_sectors || nb_sectors % s->cluster_sectors) {
-        return -ENOTSUP;
+        qemu_co_mutex_lock(&s->lock);
+
+        /* There may have been a write after the check */
+        if (!is_unallocated_or_zero(bs, sector_num - head, head) ||
+            !is_unallocated_or_zero(bs, end, tail_left)) {
+            qemu_co_mutex_unlock(&s->lock);
+            return -ENOTSUP;
+        }
+
+        sector_num -= head;
+        nb_sectors += head + tail_left;
+    } else {
+        qemu_co_mutex_lock(&s->lock);
     }
 
-    /* Whatever is left can use real zero clusters */
-    qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
-        nb_sectors);
+    /* Whatever is left can use real zero clusters, or zero subclusters for
+     * the parts of clusters at either end */
+    while (nb_sectors > 0) {
+        int index_in_cluster = sector_num & (s->cluster_sectors - 1);
+        int n;
+
+        if (index_in_cluster == 0 && nb_sectors >= s->cluster_sectors) {
+            n = nb_sectors & ~(s->cluster_sectors - 1);
+            ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS, n);
+        } else {
+            n = MIN(nb_sectors, s->cluster_sectors - index_in_cluster);
+            ret = qcow2_zero_subclusters(bs, sector_num << BDRV_SECTOR_BITS,
+                                         n);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+    }
     qemu_co_mutex_unlock(&s->lock);
 
     return ret;
@@ -2218,8 +2605,8 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    ssize_t out_len;
+    int ret;
     uint8_t *out_buf;
     uint64_t cluster_offset;
 
@@ -2246,39 +2633,20 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
         return ret;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+    out_buf = g_malloc(s->cluster_size);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    /* a compressed cluster must be shorter than an uncompressed one */
+    out_len = qcow2_compress(bs, out_buf, s->cluster_size - 1,
+                             buf, s->cluster_size);
+    if (out_len == -ENOMEM) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
+    } else if (out_len < 0) {
+        ret = -EINVAL;
+        goto fail;
     } else {
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
@@ -2397,6 +2765,8 @@ static int make_completely_empty(BlockDriverState *bs)
     g_free(s->refcount_table);
     s->refcount_table = new_reftable;
     new_reftable = NULL;
+    qcow2_free_index_reset(bs);
+    qcow2_compressed_cache_invalidate(bs);
 
     /* Now the in-memory refcount information again corresponds to the on-disk
      * information (reftable is empty and no refblocks (the refblock cache is
@@ -2415,6 +2785,13 @@ static int make_completely_empty(BlockDriverState *bs)
     }
     s->refcount_table[0] = 2 * s->cluster_size;
 
+    /* The stored bitmaps are gone along with everything else; the bitmaps in
+     * memory are stored again on close */
+    s->nb_bitmaps = 0;
+    s->bitmap_directory_size = 0;
+    s->bitmap_directory_offset = 0;
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+
     s->free_cluster_index = 0;
     assert(3 + l1_clusters <= s->refcount_block_size);
     offset = qcow2_alloc_clusters(bs, 3 * s->cluster_size + l1_size2);
@@ -2555,12 +2932,38 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
                                   QCOW2_INCOMPAT_CORRUPT,
             .has_corrupt        = true,
             .refcount_bits      = s->refcount_bits,
+            .extended_l2        = has_subclusters(s),
+            .has_extended_l2    = true,
+            .compression_type   = s->compression_type,
+            .has_compression_type = true,
         };
     }
 
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    *stats = (BlockStatsSpecific){
+        .kind  = BLOCK_STATS_SPECIFIC_KIND_QCOW2,
+        {
+            .qcow2 = g_new(BlockStatsSpecificQcow2, 1),
+        },
+    };
+    *stats->qcow2 = (BlockStatsSpecificQcow2){
+        .l2_cache           = g_new0(Qcow2CacheStats, 1),
+        .refcount_cache     = g_new0(Qcow2CacheStats, 1),
+    };
+    qcow2_cache_get_stats(s->l2_table_cache, stats->qcow2->l2_cache);
+    qcow2_cache_get_stats(s->refcount_block_cache,
+                          stats->qcow2->refcount_cache);
+
+    return stats;
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -2648,6 +3051,19 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (s->nb_bitmaps) {
+        error_report("qcow2_downgrade: Cannot downgrade an image with "
+                     "persistent dirty bitmaps.");
+        return -ENOTSUP;
+    }
+
+    if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_report("qcow2_downgrade: Cannot downgrade an image with "
+                     "compression type %s.",
+                     Qcow2CompressionType_lookup[s->compression_type]);
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -2751,6 +3167,21 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         } else if (!strcmp(desc->name, BLOCK_OPT_REFCOUNT_BITS)) {
             error_report("Cannot change refcount entry width");
             return -ENOTSUP;
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            if (qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2, has_subclusters(s))
+                != has_subclusters(s)) {
+                error_report("Changing the extended_l2 option is not "
+                             "supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_TYPE)) {
+            const char *type = qemu_opt_get(opts, BLOCK_OPT_COMPRESSION_TYPE);
+            if (type && strcmp(type,
+                    Qcow2CompressionType_lookup[s->compression_type])) {
+                error_report("Changing the compression type is not "
+                             "supported");
+                return -ENOTSUP;
+            }
         } else {
             /* if this assertion fails, this probably means a new option was
              * added without having it covered here */
@@ -2931,6 +3362,20 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Width of a reference count entry in bits",
             .def_value_str = "16"
         },
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Extended L2 tables with allocation and zero bitmaps "
+                    "for 32 subclusters per cluster",
+            .def_value_str = "off"
+        },
+        {
+            .name = BLOCK_OPT_COMPRESSION_TYPE,
+            .type = QEMU_OPT_STRING,
+            .help = "Compression algorithm of compressed clusters "
+                    "(zlib, zstd)",
+            .def_value_str = "zlib"
+        },
         { /* end of list */ }
     }
 };
@@ -2964,6 +3409,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp = qcow2_snapshot_load_tmp,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -2977,6 +3423,7 @@ BlockDriver bdrv_qcow2 = {
     .create_opts         = &qcow2_create_opts,
     .bdrv_check          = qcow2_check,
     .bdrv_amend_options  = qcow2_amend_options,
+    .bdrv_can_store_dirty_bitmap = qcow2_can_store_dirty_bitmap,
 };
 
 static void bdrv_qcow2_init(void)
@@ -59,11 +59,32 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1ULL << 0)
 
+/*
+ * With extended L2 entries every L2 entry is followed by a 64 bit bitmap:
+ * bit X says that subcluster X is allocated, bit 32 + X that it reads as
+ * zeros. A subcluster with neither bit set reads from the backing file.
+ */
+#define QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER 32
+#define QCOW_OFLAG_SUB_ALLOC(X)   (1ULL << (X))
+#define QCOW_OFLAG_SUB_ZERO(X)    (QCOW_OFLAG_SUB_ALLOC(X) << 32)
+/* The bits of subclusters X up to (but not including) Y */
+#define QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC(Y) - QCOW_OFLAG_SUB_ALLOC(X))
+#define QCOW_OFLAG_SUB_ZERO_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) << 32)
+#define QCOW_L2_BITMAP_ALL_ALLOC \
+    QCOW_OFLAG_SUB_ALLOC_RANGE(0, QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER)
+#define QCOW_L2_BITMAP_ALL_ZERO \
+    QCOW_OFLAG_SUB_ZERO_RANGE(0, QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER)
+
+/* Subclusters must not become smaller than a sector */
+#define MIN_EXTL2_CLUSTER_BITS 14
+
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
 /* Must be at least 2 to cover COW */
-#define MIN_L2_CACHE_SIZE 2 /* clusters */
+#define MIN_L2_CACHE_SIZE 2 /* cache entries */
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define MIN_REFCOUNT_CACHE_SIZE 4 /* clusters */
@@ -76,6 +97,9 @@
  * clusters */
 #define DEFAULT_L2_REFCOUNT_SIZE_RATIO 4
 
+/* Decompressed clusters kept for reads of compressed images */
+#define DEFAULT_COMPRESSED_CACHE_BYTE_SIZE 1048576 /* bytes */
+
 #define DEFAULT_CLUSTER_SIZE 65536
 
 
@@ -95,7 +119,9 @@
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_COMPRESSED_CACHE_SIZE "compressed-cache-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -119,8 +145,15 @@ typedef struct QCowHeader {
 
     uint32_t refcount_order;
     uint32_t header_length;
+
+    /* Additional fields, only present if header_length says so */
+    uint8_t compression_type;
+    uint8_t padding[7];
 } QEMU_PACKED QCowHeader;
 
+/* Length of a version 3 header without the additional fields */
+#define QCOW2_HEADER_LENGTH_V3 offsetof(QCowHeader, compression_type)
+
 typedef struct QEMU_PACKED QCowSnapshotHeader {
     /* header is 8 byte aligned */
     uint64_t l1_table_offset;
@@ -179,11 +212,17 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
+    QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
+    QCOW2_INCOMPAT_EXTL2_BITNR   = 4,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_COMPRESSION   = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
+    QCOW2_INCOMPAT_EXTL2         = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
 
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+                                 | QCOW2_INCOMPAT_CORRUPT
+                                 | QCOW2_INCOMPAT_COMPRESSION
+                                 | QCOW2_INCOMPAT_EXTL2,
 };
 
 /* Compatible feature bits */
@@ -194,6 +233,24 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_BITMAPS_BITNR = 0,
+    QCOW2_AUTOCLEAR_BITMAPS       = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK          = QCOW2_AUTOCLEAR_BITMAPS,
+};
+
+#define QCOW2_MAX_BITMAPS 65535
+#define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW2_MAX_BITMAPS)
+
+typedef struct Qcow2BitmapHeaderExt {
+    uint32_t nb_bitmaps;
+    uint32_t reserved32;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+} QEMU_PACKED Qcow2BitmapHeaderExt;
+
 enum qcow2_discard_type {
     QCOW2_DISCARD_NEVER = 0,
     QCOW2_DISCARD_ALWAYS,
@@ -216,6 +273,18 @@ typedef struct Qcow2DiscardRegion {
     QTAILQ_ENTRY(Qcow2DiscardRegion) next;
 } Qcow2DiscardRegion;
 
+/* Free clusters described by one refcount block, one bit per cluster */
+typedef struct Qcow2CompressedCacheEntry {
+    uint64_t offset;        /* of the compressed data, or -1 if unused */
+    uint8_t *data;          /* one decompressed cluster */
+    uint64_t lru_counter;
+} Qcow2CompressedCacheEntry;
+
+typedef struct Qcow2FreeBlock {
+    unsigned long *bitmap;  /* bit set if the refcount is 0; NULL if unknown */
+    uint32_t nb_free;
+} Qcow2FreeBlock;
+
 typedef uint64_t Qcow2GetRefcountFunc(const void *refcount_array,
                                       uint64_t index);
 typedef void Qcow2SetRefcountFunc(void *refcount_array,
@@ -225,8 +294,12 @@ typedef struct BDRVQcowState {
     int cluster_bits;
     int cluster_size;
     int cluster_sectors;
+    int subclusters_per_cluster;
+    int subcluster_bits;
+    int subcluster_size;
     int l2_bits;
     int l2_size;
+    int l2_slice_size;      /* L2 entries per L2 cache entry */
     int l1_size;
     int l1_vm_state_index;
     int refcount_block_bits;
@@ -240,9 +313,14 @@ typedef struct BDRVQcowState {
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
 
-    uint8_t *cluster_cache;
-    uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
+    /* Decompressed clusters, looked up by the offset of the compressed data.
+     * compressed_cache_gen changes whenever the entries are dropped, so that
+     * readers that dropped s->lock know not to add stale data. */
+    Qcow2CompressedCacheEntry *compressed_cache;
+    int compressed_cache_size;
+    uint64_t compressed_cache_lru_counter;
+    uint64_t compressed_cache_gen;
+    Qcow2CompressionType compression_type;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -251,6 +329,11 @@ typedef struct BDRVQcowState {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /* Built lazily from the refcount blocks by the cluster allocator, indexed
+     * like refcount_table (and possibly past its end) */
+    Qcow2FreeBlock *free_index;
+    uint64_t free_index_size;
+
     CoMutex lock;
 
     QCryptoCipher *cipher; /* current cipher, NULL if no key yet */
@@ -260,6 +343,11 @@ typedef struct BDRVQcowState {
     unsigned int nb_snapshots;
     QCowSnapshot *snapshots;
 
+    /* Persistent dirty bitmaps as stored in the image */
+    uint32_t nb_bitmaps;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -344,6 +432,21 @@ typedef struct QCowL2Meta
      */
     Qcow2COWRegion cow_end;
 
+    /**
+     * Whether the clusters at alloc_offset were already allocated to this
+     * guest offset and are only filled in here: this happens with extended
+     * L2 entries when a write hits unallocated subclusters of an allocated
+     * cluster.
+     */
+    bool keep_old_clusters;
+
+    /**
+     * The I/O vector with the data from the actual guest write request.
+     * If non-NULL, this is meant to be merged together with the data
+     * from @cow_start and @cow_end into one single write operation.
+     */
+    QEMUIOVector *data_qiov;
+
     /** Pointer to next L2Meta of the same write request */
     struct QCowL2Meta *next;
 
@@ -412,6 +515,55 @@ static inline int64_t offset_into_cluster(BDRVQcowState *s, int64_t offset)
     return offset & (s->cluster_size - 1);
 }
 
+static inline int offset_to_sc_index(BDRVQcowState *s, int64_t offset)
+{
+    return offset_into_cluster(s, offset) >> s->subcluster_bits;
+}
+
+static inline bool has_subclusters(BDRVQcowState *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+}
+
+/* Size of an L2 entry in bytes, including the subcluster bitmap */
+static inline size_t l2_entry_size(BDRVQcowState *s)
+{
+    return has_subclusters(s) ? 2 * sizeof(uint64_t) : sizeof(uint64_t);
+}
+
+static inline uint64_t get_l2_entry(BDRVQcowState *s, uint64_t *l2_slice,
+                                    int idx)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    return be64_to_cpu(l2_slice[idx]);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcowState *s, uint64_t *l2_slice,
+                                     int idx)
+{
+    if (has_subclusters(s)) {
+        idx *= l2_entry_size(s) / sizeof(uint64_t);
+        return be64_to_cpu(l2_slice[idx + 1]);
+    } else {
+        return 0; /* For convenience only; this value has no meaning. */
+    }
+}
+
+static inline void set_l2_entry(BDRVQcowState *s, uint64_t *l2_slice,
+                                int idx, uint64_t entry)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_slice[idx] = cpu_to_be64(entry);
+}
+
+static inline void set_l2_bitmap(BDRVQcowState *s, uint64_t *l2_slice,
+                                 int idx, uint64_t bitmap)
+{
+    assert(has_subclusters(s));
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_slice[idx + 1] = cpu_to_be64(bitmap);
+}
+
 static inline uint64_t size_to_clusters(BDRVQcowState *s, uint64_t size)
 {
     return (size + (s->cluster_size - 1)) >> s->cluster_bits;
@@ -428,6 +580,11 @@ static inline int offset_to_l2_index(BDRVQcowState *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+static inline int offset_to_l2_slice_index(BDRVQcowState *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -457,6 +614,32 @@ static inline int qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+/*
+ * Returns the type (QCOW2_CLUSTER_*) of subcluster @sc_index of the cluster
+ * described by @l2_entry and @l2_bitmap. Without extended L2 entries, this
+ * is the type of the whole cluster.
+ */
+static inline int qcow2_get_subcluster_type(BDRVQcowState *s,
+                                            uint64_t l2_entry,
+                                            uint64_t l2_bitmap, int sc_index)
+{
+    int type = qcow2_get_cluster_type(l2_entry);
+
+    if (!has_subclusters(s) || type == QCOW2_CLUSTER_COMPRESSED ||
+        type == QCOW2_CLUSTER_ZERO) {
+        return type;
+    }
+
+    if (l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index)) {
+        return QCOW2_CLUSTER_ZERO;
+    } else if (type == QCOW2_CLUSTER_NORMAL &&
+               (l2_bitmap & QCOW_OFLAG_SUB_ALLOC(sc_index))) {
+        return QCOW2_CLUSTER_NORMAL;
+    } else {
+        return QCOW2_CLUSTER_UNALLOCATED;
+    }
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcowState *s)
 {
@@ -497,6 +680,7 @@ void qcow2_signal_corruption(BlockDriverState *bs, bool fatal, int64_t offset,
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
+void qcow2_free_index_reset(BlockDriverState *bs);
 
 int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index,
                        uint64_t *refcount);
@@ -520,6 +704,10 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                           BdrvCheckMode fix);
+int qcow2_inc_refcounts_imrt(BlockDriverState *bs, BdrvCheckResult *res,
+                             void **refcount_table,
+                             int64_t *refcount_table_size,
+                             int64_t offset, int64_t size);
 
 void qcow2_process_discards(BlockDriverState *bs, int ret);
 
@@ -533,7 +721,12 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int coroutine_fn qcow2_co_read_compressed(BlockDriverState *bs,
+                                          uint64_t cluster_offset,
+                                          int offset_in_cluster,
+                                          QEMUIOVector *qiov, size_t bytes);
+void qcow2_compressed_cache_invalidate(BlockDriverState *bs);
+void qcow2_compressed_cache_free(BlockDriverState *bs);
 int qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                           uint8_t *out_buf, const uint8_t *in_buf,
                           int nb_sectors, bool enc, Error **errp);
@@ -550,6 +743,8 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors, enum qcow2_discard_type type, bool full_discard);
 int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors);
+int qcow2_zero_subclusters(BlockDriverState *bs, uint64_t offset,
+                           int nb_sectors);
 
 int qcow2_expand_zero_clusters(BlockDriverState *bs,
                                BlockDriverAmendStatusCB *status_cb);
@@ -570,9 +765,28 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+int qcow2_load_bitmaps(BlockDriverState *bs, Error **errp);
+void qcow2_store_bitmaps(BlockDriverState *bs);
+bool qcow2_can_store_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                  uint32_t granularity, Error **errp);
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size);
+
+/* qcow2-threads.c functions */
+bool qcow2_compression_type_supported(Qcow2CompressionType type);
+ssize_t qcow2_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                       const void *src, size_t src_size);
+ssize_t coroutine_fn qcow2_co_decompress(BlockDriverState *bs,
+                                         void *dest, size_t dest_size,
+                                         const void *src, size_t src_size);
+
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats);
 
 void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
      void *table);
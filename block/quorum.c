@@ -82,6 +82,9 @@ typedef struct BDRVQuorumState {
                             */
 
     QuorumReadPattern read_pattern;
+    int64_t *latency_ns;   /* average read latency of each child, used to
+                            * order the requests in the fastest pattern
+                            */
 } BDRVQuorumState;
 
 typedef struct QuorumAIOCB QuorumAIOCB;
@@ -126,6 +129,9 @@ struct QuorumAIOCB {
     bool is_read;
     int vote_ret;
     int child_iter;             /* which child to read in fifo pattern */
+
+    int64_t start_ns;           /* submission time in fastest pattern */
+    bool done;                  /* fastest pattern: the caller has its data */
 };
 
 static bool quorum_vote(QuorumAIOCB *acb);
@@ -204,6 +210,7 @@ static QuorumAIOCB *quorum_aio_get(BDRVQuorumState *s,
     QLIST_INIT(&acb->votes.vote_list);
     acb->is_read = false;
     acb->vote_ret = 0;
+    acb->done = false;
 
     for (i = 0; i < s->num_children; i++) {
         acb->qcrs[i].buf = NULL;
@@ -276,6 +283,61 @@ static void quorum_copy_qiov(QEMUIOVector *dest, QEMUIOVector *source)
     }
 }
 
+static void quorum_fastest_cb(QuorumChildRequest *sacb, int ret)
+{
+    QuorumAIOCB *acb = sacb->parent;
+    BDRVQuorumState *s = acb->common.bs->opaque;
+    int child = sacb - acb->qcrs;
+    int64_t latency;
+    int i;
+
+    sacb->aiocb = NULL;
+    sacb->ret = ret;
+
+    if (ret == 0) {
+        latency = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - acb->start_ns;
+        if (s->latency_ns[child]) {
+            s->latency_ns[child] = (s->latency_ns[child] * 7 + latency) / 8;
+        } else {
+            s->latency_ns[child] = latency;
+        }
+
+        if (!acb->done) {
+            /* The first successful child completes the request */
+            acb->done = true;
+            quorum_copy_qiov(acb->qiov, &sacb->qiov);
+            acb->common.cb(acb->common.opaque, 0);
+
+            /* This request is not counted yet, so the stragglers cannot free
+             * acb even if they complete during the cancellation */
+            for (i = 0; i < s->num_children; i++) {
+                if (acb->qcrs[i].aiocb) {
+                    bdrv_aio_cancel_async(acb->qcrs[i].aiocb);
+                }
+            }
+        }
+    } else if (ret != -ECANCELED) {
+        quorum_report_bad(acb, s->bs[child]->node_name, ret);
+        acb->vote_ret = ret;
+    }
+
+    if (++acb->count < s->num_children) {
+        return;
+    }
+
+    if (!acb->done) {
+        /* all children failed */
+        acb->common.cb(acb->common.opaque, acb->vote_ret);
+    }
+
+    for (i = 0; i < s->num_children; i++) {
+        qemu_vfree(acb->qcrs[i].buf);
+        qemu_iovec_destroy(&acb->qcrs[i].qiov);
+    }
+    g_free(acb->qcrs);
+    qemu_aio_unref(acb);
+}
+
 static void quorum_aio_cb(void *opaque, int ret)
 {
     QuorumChildRequest *sacb = opaque;
@@ -283,6 +345,11 @@ static void quorum_aio_cb(void *opaque, int ret)
     BDRVQuorumState *s = acb->common.bs->opaque;
     bool rewrite = false;
 
+    if (acb->is_read && s->read_pattern == QUORUM_READ_PATTERN_FASTEST) {
+        quorum_fastest_cb(sacb, ret);
+        return;
+    }
+
     if (acb->is_read && s->read_pattern == QUORUM_READ_PATTERN_FIFO) {
         /* We try to read next child in FIFO order if we fail to read */
         if (ret < 0 && ++acb->child_iter < s->num_children) {
@@ -652,6 +719,39 @@ static BlockAIOCB *read_quorum_children(QuorumAIOCB *acb)
     return &acb->common;
 }
 
+/* Reads from all children, in the order of their average latency, so that
+ * the child that answered fastest so far gets its request first */
+static BlockAIOCB *read_fastest_children(QuorumAIOCB *acb)
+{
+    BDRVQuorumState *s = acb->common.bs->opaque;
+    int *order = g_new(int, s->num_children);
+    int i, j, child;
+
+    for (i = 0; i < s->num_children; i++) {
+        acb->qcrs[i].buf = qemu_blockalign(s->bs[i], acb->qiov->size);
+        qemu_iovec_init(&acb->qcrs[i].qiov, acb->qiov->niov);
+        qemu_iovec_clone(&acb->qcrs[i].qiov, acb->qiov, acb->qcrs[i].buf);
+
+        for (j = i; j > 0 && s->latency_ns[order[j - 1]] > s->latency_ns[i];
+             j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+
+    acb->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    for (i = 0; i < s->num_children; i++) {
+        child = order[i];
+        acb->qcrs[child].aiocb =
+            bdrv_aio_readv(s->bs[child], acb->sector_num,
+                           &acb->qcrs[child].qiov, acb->nb_sectors,
+                           quorum_aio_cb, &acb->qcrs[child]);
+    }
+
+    g_free(order);
+    return &acb->common;
+}
+
 static BlockAIOCB *read_fifo_child(QuorumAIOCB *acb)
 {
     BDRVQuorumState *s = acb->common.bs->opaque;
@@ -683,6 +783,9 @@ static BlockAIOCB *quorum_aio_readv(BlockDriverState *bs,
     if (s->read_pattern == QUORUM_READ_PATTERN_QUORUM) {
         acb->child_iter = s->num_children - 1;
         return read_quorum_children(acb);
+    } else if (s->read_pattern == QUORUM_READ_PATTERN_FASTEST) {
+        acb->child_iter = s->num_children - 1;
+        return read_fastest_children(acb);
     }
 
     acb->child_iter = 0;
@@ -831,7 +934,7 @@ static QemuOptsList quorum_runtime_opts = {
         {
             .name = QUORUM_OPT_READ_PATTERN,
             .type = QEMU_OPT_STRING,
-            .help = "Allowed pattern: quorum, fifo. Quorum is default",
+            .help = "Allowed pattern: quorum, fifo, fastest. Quorum is default",
         },
         { /* end of list */ }
     },
@@ -891,7 +994,8 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
     s->threshold = qemu_opt_get_number(opts, QUORUM_OPT_VOTE_THRESHOLD, 0);
     ret = parse_read_pattern(qemu_opt_get(opts, QUORUM_OPT_READ_PATTERN));
     if (ret < 0) {
-        error_setg(&local_err, "Please set read-pattern as fifo or quorum");
+        error_setg(&local_err, "Please set read-pattern as quorum, fifo or "
+                   "fastest");
         goto exit;
     }
     s->read_pattern = ret;
@@ -924,6 +1028,7 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* allocate the children BlockDriverState array */
     s->bs = g_new0(BlockDriverState *, s->num_children);
+    s->latency_ns = g_new0(int64_t, s->num_children);
     opened = g_new0(bool, s->num_children);
 
     for (i = 0; i < s->num_children; i++) {
@@ -952,6 +1057,7 @@ close_exit:
         bdrv_unref(s->bs[i]);
     }
     g_free(s->bs);
+    g_free(s->latency_ns);
     g_free(opened);
 exit:
     qemu_opts_del(opts);
@@ -972,6 +1078,7 @@ static void quorum_close(BlockDriverState *bs)
     }
 
     g_free(s->bs);
+    g_free(s->latency_ns);
 }
 
 static void quorum_detach_aio_context(BlockDriverState *bs)
@@ -135,6 +135,19 @@ do { \
 
 #define MAX_BLOCKSIZE	4096
 
+#if defined(__linux__)
+/* the sg driver takes at most this many commands at once per descriptor */
+#define RAW_SG_MAX_QUEUE 16
+
+/* An SG_IO request that goes through the write()/read() interface of sg */
+typedef struct RawSgAIOCB {
+    BlockAIOCB common;
+    sg_io_hdr_t *user_hdr;
+    sg_io_hdr_t hdr;
+    QSIMPLEQ_ENTRY(RawSgAIOCB) next;
+} RawSgAIOCB;
+#endif
+
 typedef struct BDRVRawState {
     int fd;
     int type;
@@ -147,10 +160,19 @@ typedef struct BDRVRawState {
     int64_t fd_error_time;
     int fd_got_error;
     int fd_media_changed;
+
+    /* sg devices: SG_IO requests are submitted with write() and their
+     * replies read in the AioContext once the descriptor is readable */
+    bool sg_async;
+    int sg_inflight;
+    QSIMPLEQ_HEAD(, RawSgAIOCB) sg_waiting;
 #endif
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
-    void *aio_ctx;
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_io_uring;
+    bool io_uring_sqpoll;
 #endif
 #ifdef CONFIG_XFS
     bool is_xfs:1;
@@ -168,6 +190,9 @@ typedef struct BDRVRawReopenState {
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_io_uring;
+#endif
 } BDRVRawReopenState;
 
 static int fd_open(BlockDriverState *bs);
@@ -385,34 +410,16 @@ static void raw_parse_flags(int bdrv_flags, int *open_flags)
     }
 }
 
-static void raw_detach_aio_context(BlockDriverState *bs)
-{
 #ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
-
-    if (s->use_aio) {
-        laio_detach_aio_context(s->aio_ctx, bdrv_get_aio_context(bs));
-    }
-#endif
-}
-
-static void raw_attach_aio_context(BlockDriverState *bs,
-                                   AioContext *new_context)
+/* The Linux AIO state belongs to the AioContext, see aio_get_linux_aio() */
+static void *raw_get_laio(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
-
-    if (s->use_aio) {
-        laio_attach_aio_context(s->aio_ctx, new_context);
-    }
-#endif
+    return aio_get_linux_aio(bdrv_get_aio_context(bs));
 }
 
-#ifdef CONFIG_LINUX_AIO
-static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags)
+static int raw_set_aio(BlockDriverState *bs, int *use_aio, int bdrv_flags)
 {
     int ret = -1;
-    assert(aio_ctx != NULL);
     assert(use_aio != NULL);
     /*
      * Currently Linux do AIO only for files opened with O_DIRECT
@@ -420,13 +427,8 @@ static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags)
      */
     if ((bdrv_flags & (BDRV_O_NOCACHE|BDRV_O_NATIVE_AIO)) ==
                       (BDRV_O_NOCACHE|BDRV_O_NATIVE_AIO)) {
-
-        /* if non-NULL, laio_init() has already been run */
-        if (*aio_ctx == NULL) {
-            *aio_ctx = laio_init();
-            if (!*aio_ctx) {
-                goto error;
-            }
+        if (!raw_get_laio(bs)) {
+            goto error;
         }
         *use_aio = 1;
     } else {
@@ -440,6 +442,35 @@ error:
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+static void *raw_get_io_uring(BlockDriverState *bs, Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+
+    return aio_get_linux_io_uring(bdrv_get_aio_context(bs),
+                                  s->io_uring_sqpoll, errp);
+}
+
+/*
+ * Unlike linux-aio, io_uring handles buffered I/O asynchronously as well,
+ * so it does not need cache.direct=on.
+ */
+static int raw_set_io_uring(BlockDriverState *bs, bool *use_io_uring,
+                            int bdrv_flags, Error **errp)
+{
+    *use_io_uring = false;
+    if (!(bdrv_flags & BDRV_O_IO_URING)) {
+        return 0;
+    }
+
+    if (!raw_get_io_uring(bs, errp)) {
+        return -1;
+    }
+    *use_io_uring = true;
+    return 0;
+}
+#endif
+
 static void raw_parse_filename(const char *filename, QDict *options,
                                Error **errp)
 {
@@ -460,6 +491,12 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "File name of the image",
         },
+        {
+            .name = "io-uring-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "Poll the io_uring submission ring from a kernel thread "
+                    "(aio=io_uring only)",
+        },
         { /* end of list */ }
     },
 };
@@ -505,7 +542,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->fd = fd;
 
 #ifdef CONFIG_LINUX_AIO
-    if (raw_set_aio(&s->aio_ctx, &s->use_aio, bdrv_flags)) {
+    if (raw_set_aio(bs, &s->use_aio, bdrv_flags)) {
         qemu_close(fd);
         ret = -errno;
         error_setg_errno(errp, -ret, "Could not set AIO state");
@@ -520,6 +557,21 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
                      bs->filename);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    s->io_uring_sqpoll = qemu_opt_get_bool(opts, "io-uring-sqpoll", false);
+    if (raw_set_io_uring(bs, &s->use_io_uring, bdrv_flags, errp)) {
+        qemu_close(fd);
+        ret = -EINVAL;
+        goto fail;
+    }
+#else
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        qemu_close(fd);
+        error_setg(errp, "aio=io_uring is not supported by this build");
+        ret = -ENOTSUP;
+        goto fail;
+    }
+#endif
 
     s->has_discard = true;
     s->has_write_zeroes = true;
@@ -572,7 +624,6 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif
 
-    raw_attach_aio_context(bs, bdrv_get_aio_context(bs));
 
     ret = 0;
 fail:
@@ -617,14 +668,17 @@ static int raw_reopen_prepare(BDRVReopenState *state,
 #ifdef CONFIG_LINUX_AIO
     raw_s->use_aio = s->use_aio;
 
-    /* we can use s->aio_ctx instead of a copy, because the use_aio flag is
-     * valid in the 'false' condition even if aio_ctx is set, and raw_set_aio()
-     * won't override aio_ctx if aio_ctx is non-NULL */
-    if (raw_set_aio(&s->aio_ctx, &raw_s->use_aio, state->flags)) {
+    if (raw_set_aio(state->bs, &raw_s->use_aio, state->flags)) {
         error_setg(errp, "Could not set AIO state");
         return -1;
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (raw_set_io_uring(state->bs, &raw_s->use_io_uring, state->flags,
+                         errp)) {
+        return -1;
+    }
+#endif
 
     if (s->type == FTYPE_FD || s->type == FTYPE_CD) {
         raw_s->open_flags |= O_NONBLOCK;
@@ -705,6 +759,9 @@ static void raw_reopen_commit(BDRVReopenState *state)
 #ifdef CONFIG_LINUX_AIO
     s->use_aio = raw_s->use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_io_uring = raw_s->use_io_uring;
+#endif
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -1316,6 +1373,19 @@ static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* Misaligned requests need a bounce buffer from the thread pool */
+    if (s->use_io_uring &&
+        (!s->needs_alignment || bdrv_qiov_is_aligned(bs, qiov))) {
+        void *ring = raw_get_io_uring(bs, NULL);
+
+        if (ring) {
+            return luring_submit(bs, ring, s->fd, sector_num, qiov,
+                                 nb_sectors, cb, opaque, type);
+        }
+    }
+#endif
+
     /*
      * Check if the underlying device requires requests to be aligned,
      * and if the request we are trying to submit is aligned or not.
@@ -1326,8 +1396,8 @@ static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
         if (!bdrv_qiov_is_aligned(bs, qiov)) {
             type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_AIO
-        } else if (s->use_aio) {
-            return laio_submit(bs, s->aio_ctx, s->fd, sector_num, qiov,
+        } else if (s->use_aio && raw_get_laio(bs)) {
+            return laio_submit(bs, raw_get_laio(bs), s->fd, sector_num, qiov,
                                nb_sectors, cb, opaque, type);
 #endif
         }
@@ -1337,34 +1407,21 @@ static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
                        cb, opaque, type);
 }
 
+/* Plugging works on the AioContext, so that the requests of all the images
+ * there are submitted together */
 static void raw_aio_plug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
-    if (s->use_aio) {
-        laio_io_plug(bs, s->aio_ctx);
-    }
-#endif
+    aio_context_io_plug(bdrv_get_aio_context(bs));
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
-    if (s->use_aio) {
-        laio_io_unplug(bs, s->aio_ctx, true);
-    }
-#endif
+    aio_context_io_unplug(bdrv_get_aio_context(bs));
 }
 
 static void raw_aio_flush_io_queue(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
-    if (s->use_aio) {
-        laio_io_unplug(bs, s->aio_ctx, false);
-    }
-#endif
+    aio_context_io_flush(bdrv_get_aio_context(bs));
 }
 
 static BlockAIOCB *raw_aio_readv(BlockDriverState *bs,
@@ -1391,6 +1448,17 @@ static BlockAIOCB *raw_aio_flush(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        void *ring = raw_get_io_uring(bs, NULL);
+
+        if (ring) {
+            return luring_submit(bs, ring, s->fd, 0, NULL, 0,
+                                 cb, opaque, QEMU_AIO_FLUSH);
+        }
+    }
+#endif
+
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
@@ -1398,13 +1466,6 @@ static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
-    raw_detach_aio_context(bs);
-
-#ifdef CONFIG_LINUX_AIO
-    if (s->use_aio) {
-        laio_cleanup(s->aio_ctx);
-    }
-#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -1962,8 +2023,6 @@ BlockDriver bdrv_file = {
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
 
-    .bdrv_detach_aio_context = raw_detach_aio_context,
-    .bdrv_attach_aio_context = raw_attach_aio_context,
 
     .create_opts = &raw_create_opts,
 };
@@ -2158,6 +2217,9 @@ static int hdev_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Since this does ioctl the device must be already opened */
     bs->sg = hdev_is_sg(bs);
+#if defined(__linux__)
+    hdev_sg_setup(bs);
+#endif
 
     if (flags & BDRV_O_RDWR) {
         ret = check_hdev_writable(s);
@@ -2220,6 +2282,159 @@ static int hdev_ioctl(BlockDriverState *bs, unsigned long int req, void *buf)
     return ioctl(s->fd, req, buf);
 }
 
+static const AIOCBInfo raw_sg_aiocb_info = {
+    .aiocb_size         = sizeof(RawSgAIOCB),
+};
+
+static int raw_sg_write(BDRVRawState *s, RawSgAIOCB *acb)
+{
+    ssize_t len;
+
+    do {
+        len = write(s->fd, &acb->hdr, sizeof(acb->hdr));
+    } while (len < 0 && errno == EINTR);
+
+    if (len < 0) {
+        return errno == EAGAIN ? -EDOM : -errno;
+    }
+    s->sg_inflight++;
+    return 0;
+}
+
+static void raw_sg_complete(RawSgAIOCB *acb, int ret)
+{
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_unref(acb);
+}
+
+/* Called once replies came back; -EDOM means that the queue of sg is full */
+static void raw_sg_submit_waiting(BDRVRawState *s)
+{
+    RawSgAIOCB *acb;
+    int ret;
+
+    while (s->sg_inflight < RAW_SG_MAX_QUEUE &&
+           (acb = QSIMPLEQ_FIRST(&s->sg_waiting))) {
+        ret = raw_sg_write(s, acb);
+        if (ret == -EDOM && s->sg_inflight) {
+            break;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&s->sg_waiting, next);
+        if (ret < 0) {
+            raw_sg_complete(acb, ret == -EDOM ? -EBUSY : ret);
+        }
+    }
+}
+
+/* Read all the replies that are there, whichever requests they are for */
+static void raw_sg_read_replies(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVRawState *s = bs->opaque;
+    sg_io_hdr_t reply;
+    RawSgAIOCB *acb;
+    ssize_t len;
+    int waiting;
+
+    /* the descriptor is blocking, so never read more than there is */
+    if (ioctl(s->fd, SG_GET_NUM_WAITING, &waiting) < 0) {
+        return;
+    }
+    trace_raw_sg_read_replies(bs, waiting, s->sg_inflight);
+
+    while (waiting-- > 0) {
+        do {
+            len = read(s->fd, &reply, sizeof(reply));
+        } while (len < 0 && errno == EINTR);
+        if (len < 0) {
+            break;
+        }
+
+        /* the reply is the header that was written, with the status set;
+         * data and sense went straight to the buffers of the request */
+        acb = reply.usr_ptr;
+        reply.usr_ptr = acb->user_hdr->usr_ptr;
+        *acb->user_hdr = reply;
+        s->sg_inflight--;
+        raw_sg_complete(acb, 0);
+    }
+
+    raw_sg_submit_waiting(s);
+}
+
+/* Returns NULL if the thread pool should do the request instead */
+static BlockAIOCB *raw_sg_aio_ioctl(BlockDriverState *bs, sg_io_hdr_t *hdr,
+                                    BlockCompletionFunc *cb, void *opaque)
+{
+    BDRVRawState *s = bs->opaque;
+    RawSgAIOCB *acb;
+    int ret = -EDOM;
+
+    acb = qemu_aio_get(&raw_sg_aiocb_info, bs, cb, opaque);
+    acb->user_hdr = hdr;
+    acb->hdr = *hdr;
+    acb->hdr.usr_ptr = acb;
+
+    if (s->sg_inflight < RAW_SG_MAX_QUEUE &&
+        QSIMPLEQ_EMPTY(&s->sg_waiting)) {
+        ret = raw_sg_write(s, acb);
+    }
+    if (ret == -EDOM && (s->sg_inflight || !QSIMPLEQ_EMPTY(&s->sg_waiting))) {
+        /* goes out once a reply for an earlier one came back */
+        QSIMPLEQ_INSERT_TAIL(&s->sg_waiting, acb, next);
+    } else if (ret < 0) {
+        /* the ioctl gets the error right */
+        qemu_aio_unref(acb);
+        return NULL;
+    }
+    return &acb->common;
+}
+
+static void raw_sg_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->sg_async) {
+        aio_set_fd_handler(bdrv_get_aio_context(bs), s->fd, NULL, NULL, NULL);
+    }
+}
+
+static void raw_sg_attach_aio_context(BlockDriverState *bs,
+                                      AioContext *new_context)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->sg_async) {
+        aio_set_fd_handler(new_context, s->fd, raw_sg_read_replies, NULL, bs);
+    }
+}
+
+static void hdev_sg_setup(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    int sg_version;
+
+    /* version 3 of the interface has sg_io_hdr_t and SG_GET_NUM_WAITING */
+    QSIMPLEQ_INIT(&s->sg_waiting);
+    if (bs->sg && !bdrv_ioctl(bs, SG_GET_VERSION_NUM, &sg_version) &&
+        sg_version >= 30000) {
+        s->sg_async = true;
+        raw_sg_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    }
+}
+
+static void hdev_close(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    /* the replies would go to a new descriptor with the same number */
+    while (s->sg_inflight || !QSIMPLEQ_EMPTY(&s->sg_waiting)) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+    raw_sg_detach_aio_context(bs);
+    raw_close(bs);
+}
+
 static BlockAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
         unsigned long int req, void *buf,
         BlockCompletionFunc *cb, void *opaque)
@@ -2231,6 +2446,14 @@ static BlockAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+    if (req == SG_IO && s->sg_async) {
+        BlockAIOCB *sg_acb = raw_sg_aio_ioctl(bs, buf, cb, opaque);
+
+        if (sg_acb) {
+            return sg_acb;
+        }
+    }
+
     acb = g_slice_new(RawPosixAIOData);
     acb->bs = bs;
     acb->aio_type = QEMU_AIO_IOCTL;
@@ -2349,7 +2572,11 @@ static BlockDriver bdrv_host_device = {
     .bdrv_probe_device  = hdev_probe_device,
     .bdrv_parse_filename = hdev_parse_filename,
     .bdrv_file_open     = hdev_open,
+#ifdef __linux__
+    .bdrv_close         = hdev_close,
+#else
     .bdrv_close         = raw_close,
+#endif
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
@@ -2374,13 +2601,13 @@ static BlockDriver bdrv_host_device = {
     .bdrv_probe_blocksizes = hdev_probe_blocksizes,
     .bdrv_probe_geometry = hdev_probe_geometry,
 
-    .bdrv_detach_aio_context = raw_detach_aio_context,
-    .bdrv_attach_aio_context = raw_attach_aio_context,
 
     /* generic scsi device */
 #ifdef __linux__
     .bdrv_ioctl         = hdev_ioctl,
     .bdrv_aio_ioctl     = hdev_aio_ioctl,
+    .bdrv_detach_aio_context = raw_sg_detach_aio_context,
+    .bdrv_attach_aio_context = raw_sg_attach_aio_context,
 #endif
 };
 
@@ -2523,8 +2750,6 @@ static BlockDriver bdrv_host_floppy = {
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
 
-    .bdrv_detach_aio_context = raw_detach_aio_context,
-    .bdrv_attach_aio_context = raw_attach_aio_context,
 
     /* removable device support */
     .bdrv_is_inserted   = floppy_is_inserted,
@@ -2654,8 +2879,6 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
 
-    .bdrv_detach_aio_context = raw_detach_aio_context,
-    .bdrv_attach_aio_context = raw_attach_aio_context,
 
     /* removable device support */
     .bdrv_is_inserted   = cdrom_is_inserted,
@@ -2791,8 +3014,6 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
 
-    .bdrv_detach_aio_context = raw_detach_aio_context,
-    .bdrv_attach_aio_context = raw_attach_aio_context,
 
     /* removable device support */
     .bdrv_is_inserted   = cdrom_is_inserted,
@@ -16,6 +16,8 @@
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "block/block_int.h"
+#include "qemu/event_notifier.h"
+#include "qemu/atomic.h"
 
 #include <rbd/librbd.h>
 
@@ -51,6 +53,11 @@
 #undef LIBRBD_SUPPORTS_DISCARD
 #endif
 
+/* rbd_aio_readv and rbd_aio_writev added in 1.12.0 */
+#if LIBRBD_VERSION_CODE >= LIBRBD_VERSION(1, 12, 0)
+#define LIBRBD_SUPPORTS_IOVEC
+#endif
+
 #define OBJ_MAX_SIZE (1UL << OBJ_DEFAULT_OBJ_ORDER)
 
 #define RBD_MAX_CONF_NAME_SIZE 128
@@ -69,10 +76,9 @@ typedef enum {
 
 typedef struct RBDAIOCB {
     BlockAIOCB common;
-    QEMUBH *bh;
     int64_t ret;
     QEMUIOVector *qiov;
-    char *bounce;
+    char *bounce;           /* NULL if librbd works on qiov directly */
     RBDAIOCmd cmd;
     int error;
     struct BDRVRBDState *s;
@@ -84,6 +90,7 @@ typedef struct RADOSCB {
     int64_t size;
     char *buf;
     int64_t ret;
+    QSLIST_ENTRY(RADOSCB) next;
 } RADOSCB;
 
 typedef struct BDRVRBDState {
@@ -92,6 +99,12 @@ typedef struct BDRVRBDState {
     rbd_image_t image;
     char name[RBD_MAX_IMAGE_NAME_SIZE];
     char *snap;
+
+    /* Requests completed by librbd threads, handed to the AioContext of the
+     * image all at once through completion_notifier */
+    QSLIST_HEAD(, RADOSCB) completed;
+    EventNotifier completion_notifier;
+    bool completion_pending;
 } BDRVRBDState;
 
 static int qemu_rbd_next_tok(char *dst, int dst_len,
@@ -369,9 +382,21 @@ static int qemu_rbd_create(const char *filename, QemuOpts *opts, Error **errp)
     return ret;
 }
 
+/* Zero the data of a read request from @offs on */
+static void qemu_rbd_memset(RADOSCB *rcb, int64_t offs)
+{
+    RBDAIOCB *acb = rcb->acb;
+
+    if (acb->bounce) {
+        memset(rcb->buf + offs, 0, rcb->size - offs);
+    } else {
+        qemu_iovec_memset(acb->qiov, offs, 0, rcb->size - offs);
+    }
+}
+
 /*
- * This aio completion is being called from rbd_finish_bh() and runs in qemu
- * BH context.
+ * This aio completion is being called from qemu_rbd_completion_cb() and
+ * runs in the AioContext of the image.
  */
 static void qemu_rbd_complete_aio(RADOSCB *rcb)
 {
@@ -389,11 +414,11 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
         }
     } else {
         if (r < 0) {
-            memset(rcb->buf, 0, rcb->size);
+            qemu_rbd_memset(rcb, 0);
             acb->ret = r;
             acb->error = 1;
         } else if (r < rcb->size) {
-            memset(rcb->buf + r, 0, rcb->size - r);
+            qemu_rbd_memset(rcb, r);
             if (!acb->error) {
                 acb->ret = rcb->size;
             }
@@ -404,7 +429,7 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
 
     g_free(rcb);
 
-    if (acb->cmd == RBD_AIO_READ) {
+    if (acb->cmd == RBD_AIO_READ && acb->bounce) {
         qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
     }
     qemu_vfree(acb->bounce);
@@ -521,9 +546,20 @@ static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
 
     bs->read_only = (s->snap != NULL);
 
+    r = event_notifier_init(&s->completion_notifier, false);
+    if (r < 0) {
+        error_setg_errno(errp, -r, "failed to create completion notifier");
+        goto failed_notifier;
+    }
+    QSLIST_INIT(&s->completed);
+    s->completion_pending = false;
+    qemu_rbd_attach_aio_context(bs, bdrv_get_aio_context(bs));
+
     qemu_opts_del(opts);
     return 0;
 
+failed_notifier:
+    rbd_close(s->image);
 failed_open:
     rados_ioctx_destroy(s->io_ctx);
 failed_shutdown:
@@ -538,6 +574,8 @@ static void qemu_rbd_close(BlockDriverState *bs)
 {
     BDRVRBDState *s = bs->opaque;
 
+    qemu_rbd_detach_aio_context(bs);
+    event_notifier_cleanup(&s->completion_notifier);
     rbd_close(s->image);
     rados_ioctx_destroy(s->io_ctx);
     g_free(s->snap);
@@ -548,31 +586,74 @@ static const AIOCBInfo rbd_aiocb_info = {
     .aiocb_size = sizeof(RBDAIOCB),
 };
 
-static void rbd_finish_bh(void *opaque)
+/*
+ * Completes all requests that librbd has finished so far; one wakeup of
+ * the event loop covers however many completions came in meanwhile.
+ */
+static void qemu_rbd_completion_cb(EventNotifier *e)
+{
+    BDRVRBDState *s = container_of(e, BDRVRBDState, completion_notifier);
+    QSLIST_HEAD(, RADOSCB) completed;
+    RADOSCB *rcb;
+
+    /* Completions queued after this point notify again */
+    atomic_mb_set(&s->completion_pending, false);
+    event_notifier_test_and_clear(e);
+
+    QSLIST_MOVE_ATOMIC(&completed, &s->completed);
+    while ((rcb = QSLIST_FIRST(&completed)) != NULL) {
+        QSLIST_REMOVE_HEAD(&completed, next);
+        qemu_rbd_complete_aio(rcb);
+    }
+}
+
+static bool qemu_rbd_poll_cb(void *opaque)
 {
-    RADOSCB *rcb = opaque;
-    qemu_bh_delete(rcb->acb->bh);
-    qemu_rbd_complete_aio(rcb);
+    EventNotifier *e = opaque;
+    BDRVRBDState *s = container_of(e, BDRVRBDState, completion_notifier);
+
+    return atomic_read(&s->completed.slh_first) != NULL;
 }
 
 /*
  * This is the callback function for rbd_aio_read and _write
  *
  * Note: this function is being called from a non qemu thread so
- * we need to be careful about what we do here. Generally we only
- * schedule a BH, and do the rest of the io completion handling
- * from rbd_finish_bh() which runs in a qemu context.
+ * we need to be careful about what we do here. We only queue the request
+ * and kick the event loop, unless an earlier completion did that already;
+ * the rest of the io completion handling is done by
+ * qemu_rbd_completion_cb() which runs in a qemu context.
  */
 static void rbd_finish_aiocb(rbd_completion_t c, RADOSCB *rcb)
 {
-    RBDAIOCB *acb = rcb->acb;
+    BDRVRBDState *s = rcb->s;
 
     rcb->ret = rbd_aio_get_return_value(c);
     rbd_aio_release(c);
 
-    acb->bh = aio_bh_new(bdrv_get_aio_context(acb->common.bs),
-                         rbd_finish_bh, rcb);
-    qemu_bh_schedule(acb->bh);
+    QSLIST_INSERT_HEAD_ATOMIC(&s->completed, rcb, next);
+    if (!atomic_xchg(&s->completion_pending, true)) {
+        event_notifier_set(&s->completion_notifier);
+    }
+}
+
+static void qemu_rbd_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVRBDState *s = bs->opaque;
+
+    aio_set_event_notifier(bdrv_get_aio_context(bs),
+                           &s->completion_notifier, NULL);
+}
+
+static void qemu_rbd_attach_aio_context(BlockDriverState *bs,
+                                        AioContext *new_context)
+{
+    BDRVRBDState *s = bs->opaque;
+
+    aio_set_event_notifier(new_context, &s->completion_notifier,
+                           qemu_rbd_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->completion_notifier,
+                                qemu_rbd_poll_cb);
 }
 
 static int rbd_aio_discard_wrapper(rbd_image_t image,
@@ -617,6 +698,10 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
     acb = qemu_aio_get(&rbd_aiocb_info, bs, cb, opaque);
     acb->cmd = cmd;
     acb->qiov = qiov;
+#ifdef LIBRBD_SUPPORTS_IOVEC
+    /* librbd reads and writes the guest memory directly */
+    acb->bounce = NULL;
+#else
     if (cmd == RBD_AIO_DISCARD || cmd == RBD_AIO_FLUSH) {
         acb->bounce = NULL;
     } else {
@@ -625,12 +710,12 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
             goto failed;
         }
     }
+#endif
     acb->ret = 0;
     acb->error = 0;
     acb->s = s;
-    acb->bh = NULL;
 
-    if (cmd == RBD_AIO_WRITE) {
+    if (cmd == RBD_AIO_WRITE && acb->bounce) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
     }
 
@@ -651,10 +736,18 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
 
     switch (cmd) {
     case RBD_AIO_WRITE:
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        r = rbd_aio_writev(s->image, qiov->iov, qiov->niov, off, c);
+#else
         r = rbd_aio_write(s->image, off, size, buf, c);
+#endif
         break;
     case RBD_AIO_READ:
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        r = rbd_aio_readv(s->image, qiov->iov, qiov->niov, off, c);
+#else
         r = rbd_aio_read(s->image, off, size, buf, c);
+#endif
         break;
     case RBD_AIO_DISCARD:
         r = rbd_aio_discard_wrapper(s->image, off, size, c);
@@ -940,6 +1033,9 @@ static BlockDriver bdrv_rbd = {
     .bdrv_aio_readv         = qemu_rbd_aio_readv,
     .bdrv_aio_writev        = qemu_rbd_aio_writev,
 
+    .bdrv_detach_aio_context    = qemu_rbd_detach_aio_context,
+    .bdrv_attach_aio_context    = qemu_rbd_attach_aio_context,
+
 #ifdef LIBRBD_SUPPORTS_AIO_FLUSH
     .bdrv_aio_flush         = qemu_rbd_aio_flush,
 #else
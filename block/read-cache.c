@@ -0,0 +1,914 @@
+/*
+ * Read cache for slow block devices
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "qemu/bswap.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+#include "trace.h"
+
+/*
+ * The read-cache driver sits on top of a slow, typically remote, image and
+ * keeps the clusters that were read from it, in RAM or in a local cache
+ * file, evicting the least recently used ones when the cache is full.
+ * Sequential streams of reads make it prefetch the clusters that follow.
+ * Writes go to the image and drop the clusters they touch from the cache.
+ *
+ * A cache file starts with a header, followed by the table that maps each
+ * slot of the cache to the image cluster it holds, and then by the slots.
+ * The table is only written when the image is closed: the header marks the
+ * cache file as in use while it is open, and a cache file that is still in
+ * use when it is opened, e.g. after a crash, starts empty. Hence a cache
+ * file must not be used by several processes at the same time.
+ *
+ * A cache file only starts with the data cached last time if reuse-cache is
+ * set. The header only records the name and size of the image, so there is
+ * no telling whether the image was changed elsewhere after it was closed,
+ * and only the user can know that it was not.
+ */
+
+#define READ_CACHE_MAGIC        0x5152434143484500ULL   /* "QRCACHE\0" */
+#define READ_CACHE_VERSION      1
+#define READ_CACHE_IN_USE       1
+
+#define DEFAULT_CACHE_SIZE      (64 * 1024 * 1024)
+#define DEFAULT_CLUSTER_SIZE    (64 * 1024)
+#define MIN_CLUSTER_SIZE        4096
+#define MAX_CLUSTER_SIZE        (2 * 1024 * 1024)
+#define DEFAULT_READAHEAD       (1024 * 1024)
+
+/* The most clusters that are read from the image with a single request */
+#define MAX_RUN_CLUSTERS        16
+
+/* Reads that must follow each other before prefetching starts */
+#define SEQUENTIAL_THRESHOLD    2
+
+typedef struct QEMU_PACKED ReadCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t cluster_size;
+    uint32_t nb_slots;
+    uint64_t image_size;
+    uint64_t table_offset;
+    uint64_t data_offset;
+    char image[1024];               /* filename of the cached image */
+} ReadCacheHeader;
+
+typedef struct ReadCacheSlot {
+    int64_t cluster;                /* image cluster held, -1 if free */
+    bool filling;                   /* being read from the image */
+    int refcnt;                     /* hits reading from the cache file */
+    uint8_t *buf;                   /* data, for a RAM cache */
+    CoQueue waiters;                /* reads waiting for the fill */
+    QTAILQ_ENTRY(ReadCacheSlot) lru;
+} ReadCacheSlot;
+
+typedef struct BDRVReadCacheState {
+    BlockDriverState *cache_bs;     /* cache file, NULL for a RAM cache */
+    ReadCacheHeader header;
+    int cluster_size;
+    int cluster_sectors;
+    int nb_slots;
+    ReadCacheSlot *slots;
+    GHashTable *map;                /* image cluster -> slot */
+    QTAILQ_HEAD(, ReadCacheSlot) lru;   /* least recently used first */
+
+    /* A fill that overlaps with a write may cache stale data, so it is
+     * dropped if a write was in flight at any time during the fill */
+    int writes_in_flight;
+    unsigned write_gen;
+
+    /* Sequential prefetch */
+    int readahead;                  /* in clusters, 0 if disabled */
+    int64_t last_end;               /* sector after the previous read */
+    int sequential;                 /* reads in a row that followed */
+    int64_t prefetch_next;          /* next cluster to prefetch */
+    int64_t prefetch_end;           /* cluster after the last to prefetch */
+    Coroutine *prefetch_co;
+} BDRVReadCacheState;
+
+static QemuOptsList runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "cache-file",
+            .type = QEMU_OPT_STRING,
+            .help = "File that holds the cache (default: cache in RAM)",
+        },
+        {
+            .name = "reuse-cache",
+            .type = QEMU_OPT_BOOL,
+            .help = "Keep the data of the cache file from the last time "
+                    "(only if the image did not change since)",
+        },
+        {
+            .name = "cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the cache",
+        },
+        {
+            .name = "cluster-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Unit in which data is cached",
+        },
+        {
+            .name = "readahead",
+            .type = QEMU_OPT_SIZE,
+            .help = "Data to prefetch for sequential reads (0 to disable)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static ReadCacheSlot *read_cache_lookup(BDRVReadCacheState *s,
+                                        int64_t cluster)
+{
+    return g_hash_table_lookup(s->map, &cluster);
+}
+
+static void read_cache_touch(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    QTAILQ_REMOVE(&s->lru, slot, lru);
+    QTAILQ_INSERT_TAIL(&s->lru, slot, lru);
+}
+
+/* Make @slot free and the first one to be reused */
+static void read_cache_drop(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    if (slot->cluster >= 0) {
+        g_hash_table_remove(s->map, &slot->cluster);
+        slot->cluster = -1;
+    }
+    QTAILQ_REMOVE(&s->lru, slot, lru);
+    QTAILQ_INSERT_HEAD(&s->lru, slot, lru);
+}
+
+static void read_cache_insert(BDRVReadCacheState *s, ReadCacheSlot *slot,
+                              int64_t cluster)
+{
+    slot->cluster = cluster;
+    g_hash_table_insert(s->map, &slot->cluster, slot);
+    read_cache_touch(s, slot);
+}
+
+/* Evict the least recently used slot that is not busy, and start filling it
+ * with @cluster. Returns NULL if all the slots are busy. */
+static ReadCacheSlot *read_cache_alloc(BlockDriverState *bs, int64_t cluster)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheSlot *slot;
+
+    QTAILQ_FOREACH(slot, &s->lru, lru) {
+        if (!slot->filling && !slot->refcnt) {
+            break;
+        }
+    }
+    if (!slot) {
+        return NULL;
+    }
+
+    if (!s->cache_bs && !slot->buf) {
+        slot->buf = qemu_try_blockalign(bs, s->cluster_size);
+        if (!slot->buf) {
+            return NULL;
+        }
+    }
+
+    read_cache_drop(s, slot);
+    read_cache_insert(s, slot, cluster);
+    slot->filling = true;
+    return slot;
+}
+
+static int64_t read_cache_slot_sector(BDRVReadCacheState *s,
+                                      ReadCacheSlot *slot)
+{
+    return (be64_to_cpu(s->header.data_offset) >> BDRV_SECTOR_BITS) +
+           (int64_t)(slot - s->slots) * s->cluster_sectors;
+}
+
+/* Read around the cache */
+static int coroutine_fn read_cache_bypass(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov,
+                                          size_t qiov_offset)
+{
+    QEMUIOVector local_qiov;
+    int ret;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_iovec_concat(&local_qiov, qiov, qiov_offset,
+                      nb_sectors * BDRV_SECTOR_SIZE);
+    ret = bdrv_co_readv(bs->file, sector_num, nb_sectors, &local_qiov);
+    qemu_iovec_destroy(&local_qiov);
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_hit(BlockDriverState *bs,
+                                       ReadCacheSlot *slot,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int index = sector_num - slot->cluster * s->cluster_sectors;
+    QEMUIOVector local_qiov;
+    int ret;
+
+    trace_read_cache_hit(s, slot->cluster);
+    read_cache_touch(s, slot);
+
+    if (!s->cache_bs) {
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            slot->buf + index * BDRV_SECTOR_SIZE,
+                            nb_sectors * BDRV_SECTOR_SIZE);
+        return 0;
+    }
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_iovec_concat(&local_qiov, qiov, qiov_offset,
+                      nb_sectors * BDRV_SECTOR_SIZE);
+
+    slot->refcnt++;
+    ret = bdrv_co_readv(s->cache_bs, read_cache_slot_sector(s, slot) + index,
+                        nb_sectors, &local_qiov);
+    slot->refcnt--;
+
+    if (ret < 0) {
+        /* Drop the cluster and fall back to the image */
+        read_cache_drop(s, slot);
+        ret = bdrv_co_readv(bs->file, sector_num, nb_sectors, &local_qiov);
+    }
+
+    qemu_iovec_destroy(&local_qiov);
+    return ret;
+}
+
+/* Read the @nb clusters that start with the one of @slots[0] from the image
+ * into @buf and store them in @slots */
+static int coroutine_fn read_cache_fill(BlockDriverState *bs,
+                                        ReadCacheSlot **slots, int nb,
+                                        uint8_t *buf)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t sector_num = slots[0]->cluster * s->cluster_sectors;
+    int nb_sectors = MIN(nb * s->cluster_sectors,
+                         bs->total_sectors - sector_num);
+    bool valid = s->writes_in_flight == 0;
+    unsigned write_gen = s->write_gen;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int i, ret;
+
+    trace_read_cache_fill(s, slots[0]->cluster, nb);
+
+    iov.iov_base = buf;
+    iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = bdrv_co_readv(bs->file, sector_num, nb_sectors, &qiov);
+
+    /* The last cluster of the image may be partial */
+    memset(buf + iov.iov_len, 0, nb * s->cluster_size - iov.iov_len);
+
+    for (i = 0; i < nb; i++) {
+        ReadCacheSlot *slot = slots[i];
+        uint8_t *data = buf + i * s->cluster_size;
+        bool slot_valid = ret >= 0 && valid;
+
+        if (slot_valid && s->cache_bs) {
+            iov.iov_base = data;
+            iov.iov_len = s->cluster_size;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            slot_valid = bdrv_co_writev(s->cache_bs,
+                                        read_cache_slot_sector(s, slot),
+                                        s->cluster_sectors, &qiov) >= 0;
+        } else if (slot_valid) {
+            memcpy(slot->buf, data, s->cluster_size);
+        }
+
+        slot->filling = false;
+        if (!slot_valid || s->write_gen != write_gen) {
+            read_cache_drop(s, slot);
+        }
+        qemu_co_queue_restart_all(&slot->waiters);
+    }
+
+    return ret;
+}
+
+/* Fill the clusters from @sector_num on that are not cached, up to the end
+ * of the request or the next cached cluster, and copy them to @qiov.
+ * Returns the number of sectors read or -errno. */
+static int coroutine_fn read_cache_miss(BlockDriverState *bs,
+                                        int64_t sector_num, int nb_sectors,
+                                        QEMUIOVector *qiov,
+                                        size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t cluster = sector_num / s->cluster_sectors;
+    int64_t end_cluster = DIV_ROUND_UP(sector_num + nb_sectors,
+                                       s->cluster_sectors);
+    int index = sector_num - cluster * s->cluster_sectors;
+    ReadCacheSlot *slots[MAX_RUN_CLUSTERS];
+    uint8_t *buf;
+    int i, n, nb = 0;
+    int ret;
+
+    while (nb < MAX_RUN_CLUSTERS && cluster + nb < end_cluster &&
+           !read_cache_lookup(s, cluster + nb)) {
+        slots[nb] = read_cache_alloc(bs, cluster + nb);
+        if (!slots[nb]) {
+            break;
+        }
+        nb++;
+    }
+
+    trace_read_cache_miss(s, cluster, nb);
+
+    if (nb == 0) {
+        /* All the slots are busy */
+        n = MIN(nb_sectors, s->cluster_sectors - index);
+        ret = read_cache_bypass(bs, sector_num, n, qiov, qiov_offset);
+        return ret < 0 ? ret : n;
+    }
+
+    n = MIN(nb_sectors, nb * s->cluster_sectors - index);
+    buf = qemu_try_blockalign(bs->file, nb * s->cluster_size);
+    if (!buf) {
+        for (i = 0; i < nb; i++) {
+            slots[i]->filling = false;
+            read_cache_drop(s, slots[i]);
+            qemu_co_queue_restart_all(&slots[i]->waiters);
+        }
+        ret = read_cache_bypass(bs, sector_num, n, qiov, qiov_offset);
+        return ret < 0 ? ret : n;
+    }
+
+    ret = read_cache_fill(bs, slots, nb, buf);
+    if (ret >= 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset, buf + index * BDRV_SECTOR_SIZE,
+                            n * BDRV_SECTOR_SIZE);
+        ret = n;
+    }
+    qemu_vfree(buf);
+
+    return ret;
+}
+
+/* Read the clusters from prefetch_next to prefetch_end that are not cached
+ * yet. The reads go through bs itself so that they are tracked requests,
+ * which bdrv_drain() waits for. */
+static void coroutine_fn read_cache_prefetch_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t nb_clusters = DIV_ROUND_UP(bs->total_sectors, s->cluster_sectors);
+    uint8_t *buf;
+
+    buf = qemu_try_blockalign(bs, MAX_RUN_CLUSTERS * s->cluster_size);
+
+    while (buf && s->prefetch_next < MIN(s->prefetch_end, nb_clusters)) {
+        int64_t cluster = s->prefetch_next;
+        int64_t sector_num = cluster * s->cluster_sectors;
+        struct iovec iov;
+        QEMUIOVector qiov;
+        int n = 0;
+
+        while (n < MAX_RUN_CLUSTERS &&
+               cluster + n < MIN(s->prefetch_end, nb_clusters) &&
+               !read_cache_lookup(s, cluster + n)) {
+            n++;
+        }
+        if (n == 0) {
+            s->prefetch_next++;
+            continue;
+        }
+        s->prefetch_next = cluster + n;
+
+        trace_read_cache_prefetch(s, cluster, n);
+        iov.iov_base = buf;
+        iov.iov_len = MIN(n * s->cluster_sectors,
+                          bs->total_sectors - sector_num) * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        if (bdrv_co_readv(bs, sector_num, iov.iov_len >> BDRV_SECTOR_BITS,
+                          &qiov) < 0) {
+            break;
+        }
+    }
+
+    qemu_vfree(buf);
+    s->prefetch_co = NULL;
+}
+
+/* Detect sequential streams of reads and prefetch what follows them */
+static void read_cache_stream(BlockDriverState *bs, int64_t sector_num,
+                              int nb_sectors)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t end = sector_num + nb_sectors;
+    int64_t next;
+
+    if (sector_num == s->last_end) {
+        s->sequential++;
+    } else {
+        s->sequential = 0;
+    }
+    s->last_end = end;
+
+    if (!s->readahead || s->sequential < SEQUENTIAL_THRESHOLD) {
+        return;
+    }
+
+    /* Start over if the stream is not where the prefetch is */
+    next = DIV_ROUND_UP(end, s->cluster_sectors);
+    if (next > s->prefetch_next || next + s->readahead < s->prefetch_next) {
+        s->prefetch_next = next;
+    }
+    s->prefetch_end = next + s->readahead;
+
+    if (!s->prefetch_co) {
+        s->prefetch_co = qemu_coroutine_create(read_cache_prefetch_entry);
+        qemu_coroutine_enter(s->prefetch_co, bs);
+    }
+}
+
+static int coroutine_fn read_cache_co_readv(BlockDriverState *bs,
+                                            int64_t sector_num, int nb_sectors,
+                                            QEMUIOVector *qiov)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    size_t qiov_offset = 0;
+    int ret;
+
+    if (qemu_coroutine_self() != s->prefetch_co) {
+        read_cache_stream(bs, sector_num, nb_sectors);
+    }
+
+    while (nb_sectors > 0) {
+        int64_t cluster = sector_num / s->cluster_sectors;
+        ReadCacheSlot *slot = read_cache_lookup(s, cluster);
+        int n;
+
+        if (slot && slot->filling) {
+            qemu_co_queue_wait(&slot->waiters);
+            continue;
+        }
+
+        if (slot) {
+            n = MIN(nb_sectors, (cluster + 1) * s->cluster_sectors -
+                                sector_num);
+            ret = read_cache_hit(bs, slot, sector_num, n, qiov, qiov_offset);
+        } else {
+            ret = read_cache_miss(bs, sector_num, nb_sectors, qiov,
+                                  qiov_offset);
+            n = ret;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        qiov_offset += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+/* Drop the clusters that a write changes */
+static void read_cache_invalidate(BlockDriverState *bs, int64_t sector_num,
+                                  int nb_sectors)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t first = sector_num / s->cluster_sectors;
+    int64_t last = (sector_num + nb_sectors - 1) / s->cluster_sectors;
+    ReadCacheSlot *slot;
+    int64_t cluster;
+    int i;
+
+    s->write_gen++;
+
+    if (nb_sectors <= 0) {
+        return;
+    }
+
+    if (last - first >= s->nb_slots) {
+        for (i = 0; i < s->nb_slots; i++) {
+            slot = &s->slots[i];
+            if (slot->cluster >= first && slot->cluster <= last &&
+                !slot->filling) {
+                read_cache_drop(s, slot);
+            }
+        }
+        return;
+    }
+
+    for (cluster = first; cluster <= last; cluster++) {
+        slot = read_cache_lookup(s, cluster);
+        if (slot && !slot->filling) {
+            read_cache_drop(s, slot);
+        }
+    }
+}
+
+static int coroutine_fn read_cache_co_writev(BlockDriverState *bs,
+                                             int64_t sector_num,
+                                             int nb_sectors,
+                                             QEMUIOVector *qiov)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    s->writes_in_flight++;
+    read_cache_invalidate(bs, sector_num, nb_sectors);
+    ret = bdrv_co_writev(bs->file, sector_num, nb_sectors, qiov);
+    s->writes_in_flight--;
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_write_zeroes(BlockDriverState *bs,
+                                                   int64_t sector_num,
+                                                   int nb_sectors,
+                                                   BdrvRequestFlags flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    s->writes_in_flight++;
+    read_cache_invalidate(bs, sector_num, nb_sectors);
+    ret = bdrv_co_write_zeroes(bs->file, sector_num, nb_sectors, flags);
+    s->writes_in_flight--;
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_discard(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    s->writes_in_flight++;
+    read_cache_invalidate(bs, sector_num, nb_sectors);
+    ret = bdrv_co_discard(bs->file, sector_num, nb_sectors);
+    s->writes_in_flight--;
+
+    return ret;
+}
+
+static int64_t coroutine_fn read_cache_co_get_block_status(
+    BlockDriverState *bs, int64_t sector_num, int nb_sectors, int *pnum)
+{
+    *pnum = nb_sectors;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID |
+           (sector_num << BDRV_SECTOR_BITS);
+}
+
+static int read_cache_open_file(BlockDriverState *bs, const char *filename,
+                                bool reuse_cache, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader *header = &s->header;
+    ReadCacheHeader disk_header;
+    Error *local_err = NULL;
+    int64_t image_size, table_offset, table_size, data_offset, length;
+    int64_t nb_clusters;
+    uint64_t *table = NULL;
+    bool reuse;
+    int i, ret;
+
+    image_size = bdrv_getlength(bs->file);
+    if (image_size < 0) {
+        error_setg_errno(errp, -image_size, "Could not get the image size");
+        return image_size;
+    }
+    nb_clusters = DIV_ROUND_UP(image_size, s->cluster_size);
+
+    table_offset = ROUND_UP(sizeof(ReadCacheHeader), s->cluster_size);
+    table_size = ROUND_UP((int64_t)s->nb_slots * sizeof(uint64_t),
+                          s->cluster_size);
+    data_offset = table_offset + table_size;
+
+    *header = (ReadCacheHeader) {
+        .magic          = cpu_to_be64(READ_CACHE_MAGIC),
+        .version        = cpu_to_be32(READ_CACHE_VERSION),
+        .cluster_size   = cpu_to_be32(s->cluster_size),
+        .nb_slots       = cpu_to_be32(s->nb_slots),
+        .image_size     = cpu_to_be64(image_size),
+        .table_offset   = cpu_to_be64(table_offset),
+        .data_offset    = cpu_to_be64(data_offset),
+    };
+    pstrcpy(header->image, sizeof(header->image), bs->file->filename);
+
+    ret = bdrv_open(&s->cache_bs, filename, NULL, NULL,
+                    BDRV_O_RDWR | BDRV_O_PROTOCOL | BDRV_O_CACHE_WB, NULL,
+                    &local_err);
+    if (ret < 0) {
+        error_propagate(errp, local_err);
+        return ret;
+    }
+
+    /* Keep what the cache file has if asked to, and if it was closed
+     * cleanly and caches the same image with the same geometry */
+    reuse = false;
+    if (reuse_cache) {
+        ret = bdrv_pread(s->cache_bs, 0, &disk_header, sizeof(disk_header));
+        reuse = ret == sizeof(disk_header) &&
+                !memcmp(&disk_header, header, sizeof(disk_header));
+    }
+
+    if (reuse) {
+        table = g_try_malloc(table_size);
+        if (table == NULL ||
+            bdrv_pread(s->cache_bs, table_offset, table, table_size) < 0) {
+            reuse = false;
+        }
+    }
+
+    for (i = 0; reuse && i < s->nb_slots; i++) {
+        uint64_t entry = be64_to_cpu(table[i]);
+
+        if (entry == 0 || entry > nb_clusters ||
+            read_cache_lookup(s, entry - 1)) {
+            continue;
+        }
+        read_cache_insert(s, &s->slots[i], entry - 1);
+    }
+    g_free(table);
+
+    trace_read_cache_open_file(s, filename, reuse);
+
+    /* The table on disk is out of date until the cache file is closed */
+    header->flags = cpu_to_be32(READ_CACHE_IN_USE);
+    ret = bdrv_pwrite_sync(s->cache_bs, 0, header, sizeof(*header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write to the cache file");
+        return ret;
+    }
+
+    length = bdrv_getlength(s->cache_bs);
+    if (length >= 0 && length < data_offset +
+                                (int64_t)s->nb_slots * s->cluster_size) {
+        ret = bdrv_truncate(s->cache_bs,
+                            data_offset + (int64_t)s->nb_slots *
+                                          s->cluster_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not resize the cache file");
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/* Write the table and mark the cache file as closed cleanly. On error the
+ * cache file is left in use, so it starts empty next time. */
+static void read_cache_close_file(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t table_offset = be64_to_cpu(s->header.table_offset);
+    uint64_t *table;
+    int i, ret;
+
+    table = g_try_new0(uint64_t, s->nb_slots);
+    if (table == NULL) {
+        return;
+    }
+
+    for (i = 0; i < s->nb_slots; i++) {
+        ReadCacheSlot *slot = &s->slots[i];
+
+        if (slot->cluster >= 0 && !slot->filling) {
+            table[i] = cpu_to_be64(slot->cluster + 1);
+        }
+    }
+
+    ret = bdrv_pwrite(s->cache_bs, table_offset, table,
+                      s->nb_slots * sizeof(uint64_t));
+    g_free(table);
+    if (ret < 0 || bdrv_flush(s->cache_bs) < 0) {
+        return;
+    }
+
+    s->header.flags = 0;
+    bdrv_pwrite_sync(s->cache_bs, 0, &s->header, sizeof(s->header));
+}
+
+static void read_cache_free(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int i;
+
+    if (s->cache_bs) {
+        bdrv_unref(s->cache_bs);
+        s->cache_bs = NULL;
+    }
+    for (i = 0; s->slots && i < s->nb_slots; i++) {
+        qemu_vfree(s->slots[i].buf);
+    }
+    g_free(s->slots);
+    if (s->map) {
+        g_hash_table_destroy(s->map);
+    }
+}
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *cache_file;
+    uint64_t cache_size, cluster_size, readahead;
+    int i, ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    cluster_size = qemu_opt_get_size(opts, "cluster-size",
+                                     DEFAULT_CLUSTER_SIZE);
+    if (cluster_size < MIN_CLUSTER_SIZE || cluster_size > MAX_CLUSTER_SIZE ||
+        !is_power_of_2(cluster_size)) {
+        error_setg(errp, "Cluster size must be a power of two between %d "
+                   "and %d", MIN_CLUSTER_SIZE, MAX_CLUSTER_SIZE);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    cache_size = qemu_opt_get_size(opts, "cache-size", DEFAULT_CACHE_SIZE);
+    if (cache_size < cluster_size || cache_size / cluster_size > INT_MAX) {
+        error_setg(errp, "Cache size must be between one cluster and %d "
+                   "clusters", INT_MAX);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    readahead = qemu_opt_get_size(opts, "readahead", DEFAULT_READAHEAD);
+
+    /* Open the image */
+    assert(bs->file == NULL);
+    ret = bdrv_open_image(&bs->file, NULL, options, "image", bs, &child_file,
+                          false, &local_err);
+    if (ret < 0) {
+        error_propagate(errp, local_err);
+        goto out;
+    }
+
+    s->cluster_size = cluster_size;
+    s->cluster_sectors = cluster_size >> BDRV_SECTOR_BITS;
+    s->nb_slots = cache_size / cluster_size;
+    /* Prefetching never takes more than half of the cache */
+    s->readahead = MIN(readahead / cluster_size, s->nb_slots / 2);
+    s->last_end = -1;
+
+    s->map = g_hash_table_new(g_int64_hash, g_int64_equal);
+    s->slots = g_try_new0(ReadCacheSlot, s->nb_slots);
+    if (s->slots == NULL) {
+        error_setg(errp, "Could not allocate the cache");
+        ret = -ENOMEM;
+        goto fail;
+    }
+    QTAILQ_INIT(&s->lru);
+    for (i = 0; i < s->nb_slots; i++) {
+        s->slots[i].cluster = -1;
+        qemu_co_queue_init(&s->slots[i].waiters);
+        QTAILQ_INSERT_TAIL(&s->lru, &s->slots[i], lru);
+    }
+
+    cache_file = qemu_opt_get(opts, "cache-file");
+    if (cache_file) {
+        ret = read_cache_open_file(bs, cache_file,
+                                   qemu_opt_get_bool(opts, "reuse-cache",
+                                                     false),
+                                   errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    ret = 0;
+    goto out;
+
+fail:
+    read_cache_free(bs);
+    bdrv_unref(bs->file);
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    /* bdrv_close() has drained the requests, including those of the
+     * prefetch, so the prefetch coroutine is done */
+    assert(s->prefetch_co == NULL);
+
+    if (s->cache_bs) {
+        read_cache_close_file(bs);
+    }
+    read_cache_free(bs);
+}
+
+static int64_t read_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file);
+}
+
+static bool read_cache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                   BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file, candidate);
+}
+
+/* Propagate AioContext changes to the cache file */
+static void read_cache_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    if (s->cache_bs) {
+        bdrv_detach_aio_context(s->cache_bs);
+    }
+}
+
+static void read_cache_attach_aio_context(BlockDriverState *bs,
+                                          AioContext *new_context)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    if (s->cache_bs) {
+        bdrv_attach_aio_context(s->cache_bs, new_context);
+    }
+}
+
+static void read_cache_refresh_filename(BlockDriverState *bs)
+{
+    QDict *opts;
+    const QDictEntry *e;
+
+    if (!bs->file->full_open_options) {
+        return;
+    }
+
+    opts = qdict_new();
+    qdict_put_obj(opts, "driver", QOBJECT(qstring_from_str("read-cache")));
+
+    QINCREF(bs->file->full_open_options);
+    qdict_put_obj(opts, "image", QOBJECT(bs->file->full_open_options));
+
+    for (e = qdict_first(bs->options); e; e = qdict_next(bs->options, e)) {
+        if (strcmp(qdict_entry_key(e), "image") &&
+            strncmp(qdict_entry_key(e), "image.", strlen("image.")))
+        {
+            qobject_incref(qdict_entry_value(e));
+            qdict_put_obj(opts, qdict_entry_key(e), qdict_entry_value(e));
+        }
+    }
+
+    bs->full_open_options = opts;
+}
+
+static BlockDriver bdrv_read_cache = {
+    .format_name                      = "read-cache",
+    .protocol_name                    = "read-cache",
+    .instance_size                    = sizeof(BDRVReadCacheState),
+
+    .bdrv_file_open                   = read_cache_open,
+    .bdrv_close                       = read_cache_close,
+    .bdrv_getlength                   = read_cache_getlength,
+    .bdrv_refresh_filename            = read_cache_refresh_filename,
+
+    .bdrv_co_readv                    = read_cache_co_readv,
+    .bdrv_co_writev                   = read_cache_co_writev,
+    .bdrv_co_write_zeroes             = read_cache_co_write_zeroes,
+    .bdrv_co_discard                  = read_cache_co_discard,
+    .bdrv_co_get_block_status         = read_cache_co_get_block_status,
+
+    .bdrv_attach_aio_context          = read_cache_attach_aio_context,
+    .bdrv_detach_aio_context          = read_cache_detach_aio_context,
+
+    .is_filter                        = true,
+    .bdrv_recurse_is_first_non_filter = read_cache_recurse_is_first_non_filter,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
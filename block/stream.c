@@ -26,6 +26,8 @@ enum {
     STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
 };
 
+#define STREAM_MAX_WORKERS 64
+
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct StreamBlockJob {
@@ -34,8 +36,22 @@ typedef struct StreamBlockJob {
     BlockDriverState *base;
     BlockdevOnError on_error;
     char *backing_file_str;
+
+    int max_workers;
+    int in_flight;              /* copies running */
+    CoQueue worker_done;        /* the job coroutine waits for a copy here */
+
+    /* First error since the job coroutine last looked */
+    int copy_ret;
+    int64_t copy_failed_sector;     /* lowest sector that failed */
 } StreamBlockJob;
 
+typedef struct StreamCopy {
+    StreamBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+} StreamCopy;
+
 static int coroutine_fn stream_populate(BlockDriverState *bs,
                                         int64_t sector_num, int nb_sectors,
                                         void *buf)
@@ -109,6 +125,97 @@ static void stream_complete(BlockJob *job, void *opaque)
     g_free(data);
 }
 
+/* Record a failed copy or allocation lookup for stream_handle_error() */
+static void stream_set_error(StreamBlockJob *s, int64_t sector_num, int ret)
+{
+    if (!s->copy_ret) {
+        s->copy_ret = ret;
+    }
+    s->copy_failed_sector = MIN(s->copy_failed_sector, sector_num);
+}
+
+static void coroutine_fn stream_copy_entry(void *opaque)
+{
+    StreamCopy *copy = opaque;
+    StreamBlockJob *s = copy->s;
+    BlockDriverState *bs = s->common.bs;
+    size_t size = copy->nb_sectors * BDRV_SECTOR_SIZE;
+    void *buf;
+    int ret = -ENOMEM;
+
+    buf = qemu_try_blockalign_pooled(bs, size);
+    if (buf) {
+        ret = stream_populate(bs, copy->sector_num, copy->nb_sectors, buf);
+        qemu_vfree_pooled(bs, buf, size);
+    }
+    if (ret < 0) {
+        stream_set_error(s, copy->sector_num, ret);
+    }
+
+    /* Publish progress; stream_handle_error() takes it back for retries */
+    s->common.offset += size;
+
+    g_free(copy);
+    s->in_flight--;
+    qemu_co_queue_restart_all(&s->worker_done);
+}
+
+/* Copy sectors in the background, once one of the max_workers is free */
+static void coroutine_fn stream_copy(StreamBlockJob *s, int64_t sector_num,
+                                     int nb_sectors)
+{
+    StreamCopy *copy;
+    Coroutine *co;
+
+    while (s->in_flight >= s->max_workers) {
+        qemu_co_queue_wait(&s->worker_done);
+    }
+
+    copy = g_new(StreamCopy, 1);
+    copy->s = s;
+    copy->sector_num = sector_num;
+    copy->nb_sectors = nb_sectors;
+
+    s->in_flight++;
+    co = qemu_coroutine_create(stream_copy_entry);
+    qemu_coroutine_enter(co, copy);
+}
+
+static void coroutine_fn stream_wait_for_copies(StreamBlockJob *s)
+{
+    while (s->in_flight) {
+        qemu_co_queue_wait(&s->worker_done);
+    }
+}
+
+/* Apply on-error once all copies have finished.  Returns true if the job has
+ * to stop.  If the failed parts must be copied again, *sector_num is moved
+ * back to the first of them; ignored errors are stored in *error.
+ */
+static bool coroutine_fn stream_handle_error(StreamBlockJob *s,
+                                             int64_t *sector_num, int *error)
+{
+    BlockErrorAction action;
+    int ret;
+
+    stream_wait_for_copies(s);
+
+    ret = s->copy_ret;
+    s->copy_ret = 0;
+    action = block_job_error_action(&s->common, s->common.bs, s->on_error,
+                                    true, -ret);
+    if (action == BLOCK_ERROR_ACTION_STOP) {
+        /* Everything below the first failure is done and was counted once */
+        *sector_num = s->copy_failed_sector;
+        s->common.offset = *sector_num * BDRV_SECTOR_SIZE;
+    } else if (*error == 0) {
+        *error = ret;
+    }
+    s->copy_failed_sector = INT64_MAX;
+
+    return action == BLOCK_ERROR_ACTION_REPORT;
+}
+
 static void coroutine_fn stream_run(void *opaque)
 {
     StreamBlockJob *s = opaque;
@@ -119,7 +226,6 @@ static void coroutine_fn stream_run(void *opaque)
     int error = 0;
     int ret = 0;
     int n = 0;
-    void *buf;
 
     if (!bs->backing_hd) {
         block_job_completed(&s->common, 0);
@@ -133,7 +239,6 @@ static void coroutine_fn stream_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
@@ -144,10 +249,19 @@ static void coroutine_fn stream_run(void *opaque)
         bdrv_enable_copy_on_read(bs);
     }
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
+    sector_num = 0;
+    for (;;) {
         uint64_t delay_ns = 0;
         bool copy;
 
+        if (sector_num == end) {
+            /* The last copies may still fail */
+            stream_wait_for_copies(s);
+            if (!s->copy_ret) {
+                break;
+            }
+        }
+
 wait:
         /* Note that even when no rate limit is applied we need to yield
          * with no pending I/O here so that bdrv_drain_all() returns.
@@ -157,10 +271,20 @@ wait:
             break;
         }
 
+        if (s->copy_ret) {
+            if (stream_handle_error(s, &sector_num, &error)) {
+                break;
+            }
+            continue;
+        }
+
         copy = false;
 
+        /* Look at the whole rest of the image, so that long runs which need
+         * no copying are skipped in one step */
         ret = bdrv_is_allocated(bs, sector_num,
-                                STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
+                                MIN(end - sector_num, BDRV_REQUEST_MAX_SECTORS),
+                                &n);
         if (ret == 1) {
             /* Allocated in the top, no need to copy.  */
         } else if (ret >= 0) {
@@ -177,36 +301,29 @@ wait:
             copy = (ret == 1);
         }
         trace_stream_one_iteration(s, sector_num, n, ret);
-        if (copy) {
+        if (ret < 0) {
+            n = MIN(end - sector_num, STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE);
+            stream_set_error(s, sector_num, ret);
+            s->common.offset += n * BDRV_SECTOR_SIZE;
+        } else if (copy) {
+            n = MIN(n, STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE);
+            /* Only data that is actually copied counts against the limit */
             if (s->common.speed) {
                 delay_ns = ratelimit_calculate_delay(&s->limit, n);
                 if (delay_ns > 0) {
                     goto wait;
                 }
             }
-            ret = stream_populate(bs, sector_num, n, buf);
-        }
-        if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, s->common.bs, s->on_error,
-                                       true, -ret);
-            if (action == BLOCK_ERROR_ACTION_STOP) {
-                n = 0;
-                continue;
-            }
-            if (error == 0) {
-                error = ret;
-            }
-            if (action == BLOCK_ERROR_ACTION_REPORT) {
-                break;
-            }
+            stream_copy(s, sector_num, n);
+        } else {
+            /* Publish progress */
+            s->common.offset += n * BDRV_SECTOR_SIZE;
         }
-        ret = 0;
-
-        /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
+        sector_num += n;
     }
 
+    stream_wait_for_copies(s);
+
     if (!base) {
         bdrv_disable_copy_on_read(bs);
     }
@@ -214,8 +331,6 @@ wait:
     /* Do not remove the backing file if an error was there but ignored.  */
     ret = error;
 
-    qemu_vfree(buf);
-
     /* Modify backing chain and close BDSes in main loop */
     data = g_malloc(sizeof(*data));
     data->ret = ret;
@@ -242,12 +357,18 @@ static const BlockJobDriver stream_job_driver = {
 
 void stream_start(BlockDriverState *bs, BlockDriverState *base,
                   const char *backing_file_str, int64_t speed,
-                  BlockdevOnError on_error,
+                  int max_workers, BlockdevOnError on_error,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp)
 {
     StreamBlockJob *s;
 
+    if (max_workers < 1 || max_workers > STREAM_MAX_WORKERS) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                   "a value between 1 and " stringify(STREAM_MAX_WORKERS));
+        return;
+    }
+
     if ((on_error == BLOCKDEV_ON_ERROR_STOP ||
          on_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
         !bdrv_iostatus_is_enabled(bs)) {
@@ -263,6 +384,10 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
     s->base = base;
     s->backing_file_str = g_strdup(backing_file_str);
 
+    s->max_workers = max_workers;
+    qemu_co_queue_init(&s->worker_done);
+    s->copy_failed_sector = INT64_MAX;
+
     s->on_error = on_error;
     s->common.co = qemu_coroutine_create(stream_run);
     trace_stream_start(bs, base, s, s->common.co, opaque);
@@ -51,16 +51,26 @@
  * bdrv_set_aio_context()). Therefore in this file a thread will
  * access some other BDS's timers only after verifying that that BDS
  * has throttled requests in the queue.
+ *
+ * So that the members of a group do not take the lock for every request,
+ * each of them gets some credit whenever it does take it, as long as the
+ * group is far from its limits.  The credit is accounted right away, and
+ * then spent without the lock by the AioContext of the BDS.  Changing the
+ * configuration bumps the generation, which voids all the credit.
  */
 typedef struct ThrottleGroup {
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following five fields */
     ThrottleState ts;
     QLIST_HEAD(, BlockDriverState) head;
+    unsigned nr_members;
     BlockDriverState *tokens[2];
     bool any_timer_armed[2];
 
+    /* Written with lock held, read with atomic_read() */
+    unsigned generation;
+
     /* These two are protected by the global throttle_groups_lock */
     unsigned refcount;
     QTAILQ_ENTRY(ThrottleGroup) list;
@@ -271,6 +281,59 @@ static void schedule_next_request(BlockDriverState *bs, bool is_write)
     }
 }
 
+/* Each member takes at most this part of the room left in the group,
+ * divided by the number of members, as credit.
+ */
+#define THROTTLE_CREDIT_SHARE 0.25
+
+/* Let an I/O request through on the credit of its BDS, if it has enough
+ * and no earlier request of the same type is queued.
+ *
+ * @bs:        the current BlockDriverState
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ * @ret:       whether the I/O request can go through
+ */
+static bool throttle_group_use_credit(BlockDriverState *bs,
+                                      unsigned int bytes,
+                                      bool is_write)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+
+    /* Only this BDS changes its own pending_reqs */
+    if (bs->pending_reqs[is_write] ||
+        bs->throttle_credit_generation != atomic_read(&tg->generation)) {
+        return false;
+    }
+    return throttle_use_credit(&bs->throttle_credit[is_write], bytes);
+}
+
+/* Give the BDS its share of the room left in the group.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @bs:        the current BlockDriverState
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_take_credit(BlockDriverState *bs, bool is_write)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+
+    if (bs->throttle_credit_generation != tg->generation) {
+        memset(bs->throttle_credit, 0, sizeof(bs->throttle_credit));
+        bs->throttle_credit_generation = tg->generation;
+    }
+
+    /* Nobody else may go while requests are waiting for the timers */
+    if (tg->any_timer_armed[is_write]) {
+        return;
+    }
+
+    throttle_take_credit(&tg->ts, is_write,
+                         THROTTLE_CREDIT_SHARE / tg->nr_members,
+                         &bs->throttle_credit[is_write]);
+}
+
 /* Check if an I/O request needs to be throttled, wait and set a timer
  * if necessary, and schedule the next request using a round robin
  * algorithm.
@@ -287,6 +350,11 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
     BlockDriverState *token;
 
     ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+
+    if (throttle_group_use_credit(bs, bytes, is_write)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
     /* First we check if this I/O has to be throttled. */
@@ -308,6 +376,9 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
     /* Schedule the next request */
     schedule_next_request(bs, is_write);
 
+    /* Make the next requests cheaper, if the group has room for them */
+    throttle_group_take_credit(bs, is_write);
+
     qemu_mutex_unlock(&tg->lock);
 }
 
@@ -332,6 +403,7 @@ void throttle_group_config(BlockDriverState *bs, ThrottleConfig *cfg)
         tg->any_timer_armed[1] = false;
     }
     throttle_config(ts, tt, cfg);
+    atomic_set(&tg->generation, tg->generation + 1);
     qemu_mutex_unlock(&tg->lock);
 }
 
@@ -420,6 +492,9 @@ void throttle_group_register_bs(BlockDriverState *bs, const char *groupname)
     }
 
     QLIST_INSERT_HEAD(&tg->head, bs, round_robin);
+    tg->nr_members++;
+    memset(bs->throttle_credit, 0, sizeof(bs->throttle_credit));
+    bs->throttle_credit_generation = tg->generation;
 
     throttle_timers_init(&bs->throttle_timers,
                          bdrv_get_aio_context(bs),
@@ -458,6 +533,7 @@ void throttle_group_unregister_bs(BlockDriverState *bs)
 
     /* remove the current bs from the list */
     QLIST_REMOVE(bs, round_robin);
+    tg->nr_members--;
     throttle_timers_destroy(&bs->throttle_timers);
     qemu_mutex_unlock(&tg->lock);
 
@@ -1403,23 +1403,35 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/*
+ * Only the grain table lookup (and the L2 cache it goes through) needs
+ * s->lock; the data itself is read with the lock dropped, so that readers,
+ * e.g. of a read-only base image, can have several requests in flight.
+ */
+static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
+                                     uint8_t *buf, int nb_sectors)
 {
     BDRVVmdkState *s = bs->opaque;
     int ret;
     uint64_t n, index_in_cluster;
     VmdkExtent *extent = NULL;
     uint64_t cluster_offset;
+    bool cid_valid = true;
 
     while (nb_sectors > 0) {
         extent = find_extent(s, sector_num, extent);
         if (!extent) {
             return -EIO;
         }
+        qemu_co_mutex_lock(&s->lock);
         ret = get_cluster_offset(bs, extent, NULL,
                                  sector_num << 9, false, &cluster_offset,
                                  0, 0);
+        if (ret != VMDK_OK && ret != VMDK_ZEROED && bs->backing_hd) {
+            cid_valid = vmdk_is_cid_valid(bs);
+        }
+        qemu_co_mutex_unlock(&s->lock);
+
         index_in_cluster = vmdk_find_index_in_cluster(extent, sector_num);
         n = extent->cluster_sectors - index_in_cluster;
         if (n > nb_sectors) {
@@ -1428,7 +1440,7 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
         if (ret != VMDK_OK) {
             /* if not allocated, try to read from parent image, if exist */
             if (bs->backing_hd && ret != VMDK_ZEROED) {
-                if (!vmdk_is_cid_valid(bs)) {
+                if (!cid_valid) {
                     return -EINVAL;
                 }
                 ret = bdrv_read(bs->backing_hd, sector_num, buf, n);
@@ -1453,17 +1465,6 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
     return 0;
 }
 
-static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
-                                     uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
-}
-
 /**
  * vmdk_write:
  * @zeroed:       buf is ignored (data is zero), use zeroed_grain GTE feature
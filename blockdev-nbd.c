@@ -72,11 +72,12 @@ static void nbd_close_notifier(Notifier *n, void *data)
 }
 
 void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
-                        Error **errp)
+                        bool has_bitmap, const char *bitmap, Error **errp)
 {
     BlockBackend *blk;
     NBDExport *exp;
     NBDCloseNotifier *n;
+    Error *local_err = NULL;
 
     if (server_fd == -1) {
         error_setg(errp, "NBD server not running");
@@ -112,6 +113,15 @@ void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
         return;
     }
 
+    if (has_bitmap) {
+        nbd_export_set_bitmap(exp, bitmap, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            nbd_export_put(exp);
+            return;
+        }
+    }
+
     nbd_export_set_name(exp, device);
 
     n = g_new0(NBDCloseNotifier, 1);
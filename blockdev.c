@@ -361,6 +361,10 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     bool has_driver_specific_opts;
     BlockdevDetectZeroesOptions detect_zeroes;
     const char *throttling_group;
+    const char *stats_intervals;
+    unsigned *intervals = NULL;
+    int n_intervals = 0;
+    int i;
 
     /* Check common options by copying from bs_opts to opts, all other options
      * stay in bs_opts for processing by bdrv_open(). */
@@ -405,10 +409,12 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         bdrv_flags |= BDRV_O_NO_FLUSH;
     }
 
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     if ((buf = qemu_opt_get(opts, "aio")) != NULL) {
         if (!strcmp(buf, "native")) {
             bdrv_flags |= BDRV_O_NATIVE_AIO;
+        } else if (!strcmp(buf, "io_uring")) {
+            bdrv_flags |= BDRV_O_IO_URING;
         } else if (!strcmp(buf, "threads")) {
             /* this is the default */
         } else {
@@ -465,6 +471,36 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
 
     throttling_group = qemu_opt_get(opts, "throttling.group");
 
+    stats_intervals = qemu_opt_get(opts, "stats-intervals");
+    if (stats_intervals) {
+        char **lengths = g_strsplit(stats_intervals, ":", 0);
+
+        if (*stats_intervals == '\0') {
+            error_setg(&error, "stats-intervals can't have an empty value");
+        }
+
+        intervals = g_new(unsigned, g_strv_length(lengths));
+        for (i = 0; !error && lengths[i] != NULL; i++) {
+            unsigned long long val;
+            char *end;
+
+            errno = 0;
+            val = strtoull(lengths[i], &end, 10);
+            if (errno || *end || val == 0 || val > UINT_MAX) {
+                error_setg(&error, "Invalid interval length: '%s'",
+                           lengths[i]);
+                break;
+            }
+            intervals[n_intervals++] = val;
+        }
+        g_strfreev(lengths);
+
+        if (error) {
+            error_propagate(errp, error);
+            goto early_err;
+        }
+    }
+
     if (!check_throttle_config(&cfg, &error)) {
         error_propagate(errp, error);
         goto early_err;
@@ -549,6 +585,10 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
 
     bs->detect_zeroes = detect_zeroes;
 
+    for (i = 0; i < n_intervals; i++) {
+        block_acct_add_interval(bdrv_get_stats(bs), intervals[i]);
+    }
+
     bdrv_set_on_error(bs, on_read_error, on_write_error);
 
     /* disk I/O throttling */
@@ -566,10 +606,12 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
 
 err_no_bs_opts:
     qemu_opts_del(opts);
+    g_free(intervals);
     return blk;
 
 early_err:
     qemu_opts_del(opts);
+    g_free(intervals);
 err_no_opts:
     QDECREF(bs_opts);
     return NULL;
@@ -1602,6 +1644,7 @@ static void drive_backup_prepare(BlkTransactionState *common, Error **errp)
                      backup->has_bitmap, backup->bitmap,
                      backup->has_on_source_error, backup->on_source_error,
                      backup->has_on_target_error, backup->on_target_error,
+                     backup->has_max_workers, backup->max_workers,
                      &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -1678,6 +1721,7 @@ static void blockdev_backup_prepare(BlkTransactionState *common, Error **errp)
                         backup->has_speed, backup->speed,
                         backup->has_on_source_error, backup->on_source_error,
                         backup->has_on_target_error, backup->on_target_error,
+                        backup->has_max_workers, backup->max_workers,
                         &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -2041,12 +2085,72 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
     aio_context_release(aio_context);
 }
 
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     Error **errp)
+{
+    BlockDriverState *bs;
+    BlockAcctStats *stats;
+    AioContext *aio_context;
+
+    bs = bdrv_lookup_bs(device, device, errp);
+    if (!bs) {
+        return;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+    stats = bdrv_get_stats(bs);
+
+    if (!has_boundaries && !has_boundaries_read && !has_boundaries_write &&
+        !has_boundaries_flush) {
+        block_latency_histograms_clear(stats);
+        goto out;
+    }
+
+    if (has_boundaries || has_boundaries_read) {
+        if (block_latency_histogram_set(stats, BLOCK_ACCT_READ,
+                has_boundaries_read ? boundaries_read : boundaries) < 0) {
+            error_setg(errp, "Device '%s': invalid read boundaries", device);
+            goto out;
+        }
+    }
+
+    if (has_boundaries || has_boundaries_write) {
+        if (block_latency_histogram_set(stats, BLOCK_ACCT_WRITE,
+                has_boundaries_write ? boundaries_write : boundaries) < 0) {
+            error_setg(errp, "Device '%s': invalid write boundaries", device);
+            goto out;
+        }
+    }
+
+    if (has_boundaries || has_boundaries_flush) {
+        if (block_latency_histogram_set(stats, BLOCK_ACCT_FLUSH,
+                has_boundaries_flush ? boundaries_flush : boundaries) < 0) {
+            error_setg(errp, "Device '%s': invalid flush boundaries", device);
+            goto out;
+        }
+    }
+
+out:
+    aio_context_release(aio_context);
+}
+
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
                                 Error **errp)
 {
     AioContext *aio_context;
     BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
 
     if (!name || name[0] == '\0') {
         error_setg(errp, "Bitmap name cannot be empty");
@@ -2072,7 +2176,15 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         granularity = bdrv_get_default_bitmap_granularity(bs);
     }
 
-    bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (has_persistent && persistent &&
+        !bdrv_can_store_dirty_bitmap(bs, name, granularity, errp)) {
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap && has_persistent) {
+        bdrv_dirty_bitmap_set_persistence(bitmap, persistent);
+    }
 
  out:
     aio_context_release(aio_context);
@@ -2281,6 +2393,7 @@ void qmp_block_stream(const char *device,
                       bool has_backing_file, const char *backing_file,
                       bool has_speed, int64_t speed,
                       bool has_on_error, BlockdevOnError on_error,
+                      bool has_max_workers, int64_t max_workers,
                       Error **errp)
 {
     BlockBackend *blk;
@@ -2293,6 +2406,9 @@ void qmp_block_stream(const char *device,
     if (!has_on_error) {
         on_error = BLOCKDEV_ON_ERROR_REPORT;
     }
+    if (!has_max_workers) {
+        max_workers = 1;
+    }
 
     blk = blk_by_name(device);
     if (!blk) {
@@ -2330,7 +2446,7 @@ void qmp_block_stream(const char *device,
     /* backing_file string overrides base bs filename */
     base_name = has_backing_file ? backing_file : base_name;
 
-    stream_start(bs, base_bs, base_name, has_speed ? speed : 0,
+    stream_start(bs, base_bs, base_name, has_speed ? speed : 0, max_workers,
                  on_error, block_job_cb, bs, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -2348,6 +2464,7 @@ void qmp_block_commit(const char *device,
                       bool has_top, const char *top,
                       bool has_backing_file, const char *backing_file,
                       bool has_speed, int64_t speed,
+                      bool has_max_workers, int64_t max_workers,
                       Error **errp)
 {
     BlockBackend *blk;
@@ -2363,6 +2480,9 @@ void qmp_block_commit(const char *device,
     if (!has_speed) {
         speed = 0;
     }
+    if (!has_max_workers) {
+        max_workers = 1;
+    }
 
     /* Important Note:
      *  libvirt relies on the DeviceNotFound error class in order to probe for
@@ -2429,10 +2549,16 @@ void qmp_block_commit(const char *device,
                              " but 'top' is the active layer");
             goto out;
         }
+        if (has_max_workers) {
+            error_setg(errp, "'max-workers' specified,"
+                             " but 'top' is the active layer");
+            goto out;
+        }
         commit_active_start(bs, base_bs, speed, on_error, block_job_cb,
                             bs, &local_err);
     } else {
-        commit_start(bs, base_bs, top_bs, speed, on_error, block_job_cb, bs,
+        commit_start(bs, base_bs, top_bs, speed, max_workers, on_error,
+                     block_job_cb, bs,
                      has_backing_file ? backing_file : NULL, &local_err);
     }
     if (local_err != NULL) {
@@ -2452,6 +2578,7 @@ void qmp_drive_backup(const char *device, const char *target,
                       bool has_bitmap, const char *bitmap,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_max_workers, int64_t max_workers,
                       Error **errp)
 {
     BlockBackend *blk;
@@ -2478,6 +2605,9 @@ void qmp_drive_backup(const char *device, const char *target,
     if (!has_mode) {
         mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
     }
+    if (!has_max_workers) {
+        max_workers = 1;
+    }
 
     blk = blk_by_name(device);
     if (!blk) {
@@ -2567,7 +2697,7 @@ void qmp_drive_backup(const char *device, const char *target,
         }
     }
 
-    backup_start(bs, target_bs, speed, sync, bmap,
+    backup_start(bs, target_bs, speed, sync, bmap, max_workers,
                  on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
@@ -2592,6 +2722,7 @@ void qmp_blockdev_backup(const char *device, const char *target,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_max_workers, int64_t max_workers,
                          Error **errp)
 {
     BlockBackend *blk;
@@ -2603,6 +2734,9 @@ void qmp_blockdev_backup(const char *device, const char *target,
     if (!has_speed) {
         speed = 0;
     }
+    if (!has_max_workers) {
+        max_workers = 1;
+    }
     if (!has_on_source_error) {
         on_source_error = BLOCKDEV_ON_ERROR_REPORT;
     }
@@ -2629,8 +2763,9 @@ void qmp_blockdev_backup(const char *device, const char *target,
 
     bdrv_ref(target_bs);
     bdrv_set_aio_context(target_bs, aio_context);
-    backup_start(bs, target_bs, speed, sync, NULL, on_source_error,
-                 on_target_error, block_job_cb, bs, &local_err);
+    backup_start(bs, target_bs, speed, sync, NULL, max_workers,
+                 on_source_error, on_target_error, block_job_cb, bs,
+                 &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
         error_propagate(errp, local_err);
@@ -2651,6 +2786,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
                       bool has_unmap, bool unmap,
+                      bool has_copy_mode, MirrorCopyMode copy_mode,
                       Error **errp)
 {
     BlockBackend *blk;
@@ -2685,6 +2821,9 @@ void qmp_drive_mirror(const char *device, const char *target,
     if (!has_unmap) {
         unmap = true;
     }
+    if (!has_copy_mode) {
+        copy_mode = MIRROR_COPY_MODE_BACKGROUND;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
@@ -2826,7 +2965,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                  has_replaces ? replaces : NULL,
                  speed, granularity, buf_size, sync,
                  on_source_error, on_target_error,
-                 unmap,
+                 unmap, copy_mode,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
@@ -3146,7 +3285,7 @@ QemuOptsList qemu_common_drive_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = "format",
             .type = QEMU_OPT_STRING,
@@ -3227,6 +3366,11 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "detect-zeroes",
             .type = QEMU_OPT_STRING,
             .help = "try to optimize zero writes (off, on, unmap)",
+        },{
+            .name = "stats-intervals",
+            .type = QEMU_OPT_STRING,
+            .help = "colon-separated list of intervals "
+                    "for collecting I/O statistics, in seconds",
         },
         { /* end of list */ }
     },
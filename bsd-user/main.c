@@ -35,6 +35,8 @@
 #include "qemu/envlist.h"
 
 int singlestep;
+int tcg_perfmap;
+int tcg_tb_stats;
 #if defined(CONFIG_USE_GUEST_BASE)
 unsigned long mmap_min_addr;
 unsigned long guest_base;
@@ -693,6 +695,7 @@ static void usage(void)
            "-D logfile        write logs to 'logfile' (default stderr)\n"
            "-p pagesize       set the host page size to 'pagesize'\n"
            "-singlestep       always run in singlestep mode\n"
+           "-perfmap          write /tmp/perf-<pid>.map for perf\n"
            "-strace           log system calls\n"
            "\n"
            "Environment variables:\n"
@@ -850,6 +853,8 @@ int main(int argc, char **argv)
             optind++;
         } else if (!strcmp(r, "singlestep")) {
             singlestep = 1;
+        } else if (!strcmp(r, "perfmap")) {
+            tcg_perfmap = 1;
         } else if (!strcmp(r, "strace")) {
             do_strace = 1;
         } else
@@ -0,0 +1,112 @@
+/*
+ * Pool of aligned I/O buffers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "qemu/host-utils.h"
+#include "block/buffer-pool.h"
+#include "trace.h"
+
+#define BUFFER_POOL_MIN_SHIFT   12
+#define BUFFER_POOL_MAX_SHIFT   21
+#define BUFFER_POOL_NB_SIZES    (BUFFER_POOL_MAX_SHIFT - \
+                                 BUFFER_POOL_MIN_SHIFT + 1)
+
+QEMU_BUILD_BUG_ON((1 << BUFFER_POOL_MIN_SHIFT) != BUFFER_POOL_MIN_SIZE);
+QEMU_BUILD_BUG_ON((1 << BUFFER_POOL_MAX_SHIFT) != BUFFER_POOL_MAX_SIZE);
+
+typedef struct BufferPoolSize {
+    void *free[BUFFER_POOL_MAX_FREE];
+    int nb_free;
+    int max_free;
+} BufferPoolSize;
+
+struct BufferPool {
+    BufferPoolSize sizes[BUFFER_POOL_NB_SIZES];
+};
+
+BufferPool *buffer_pool_new(void)
+{
+    BufferPool *pool = g_new0(BufferPool, 1);
+    int i;
+
+    for (i = 0; i < BUFFER_POOL_NB_SIZES; i++) {
+        size_t size = (size_t)BUFFER_POOL_MIN_SIZE << i;
+        pool->sizes[i].max_free = MIN(BUFFER_POOL_MAX_FREE,
+                                      BUFFER_POOL_MAX_FREE_BYTES / size);
+    }
+    return pool;
+}
+
+void buffer_pool_free(BufferPool *pool)
+{
+    int i, j;
+
+    if (!pool) {
+        return;
+    }
+
+    for (i = 0; i < BUFFER_POOL_NB_SIZES; i++) {
+        for (j = 0; j < pool->sizes[i].nb_free; j++) {
+            qemu_vfree(pool->sizes[i].free[j]);
+        }
+    }
+    g_free(pool);
+}
+
+/* Index into pool->sizes, or -1 if buffers of @size are not pooled */
+static int buffer_pool_size_index(size_t size)
+{
+    if (size > BUFFER_POOL_MAX_SIZE) {
+        return -1;
+    }
+    if (size <= BUFFER_POOL_MIN_SIZE) {
+        return 0;
+    }
+    return 64 - clz64(size - 1) - BUFFER_POOL_MIN_SHIFT;
+}
+
+void *buffer_pool_try_get(BufferPool *pool, size_t align, size_t size)
+{
+    BufferPoolSize *ps;
+    void *buf;
+    int i;
+
+    i = buffer_pool_size_index(size);
+    if (i < 0) {
+        return qemu_try_memalign(align, size);
+    }
+
+    ps = &pool->sizes[i];
+    size = (size_t)BUFFER_POOL_MIN_SIZE << i;
+    if (ps->nb_free && align <= BUFFER_POOL_MIN_SIZE) {
+        buf = ps->free[--ps->nb_free];
+        trace_buffer_pool_get(pool, buf, size, true);
+        return buf;
+    }
+
+    /* Page aligned at least, so it fits any later request of this size */
+    buf = qemu_try_memalign(MAX(align, BUFFER_POOL_MIN_SIZE), size);
+    if (buf) {
+        memset(buf, 0, size);
+    }
+    trace_buffer_pool_get(pool, buf, size, false);
+    return buf;
+}
+
+void buffer_pool_put(BufferPool *pool, void *buf, size_t size)
+{
+    BufferPoolSize *ps;
+    int i;
+
+    i = buffer_pool_size_index(size);
+    if (!buf || i < 0 || pool->sizes[i].nb_free == pool->sizes[i].max_free) {
+        qemu_vfree(buf);
+        return;
+    }
+
+    ps = &pool->sizes[i];
+    ps->free[ps->nb_free++] = buf;
+}
@@ -32,6 +32,7 @@
 #include <signal.h>
 #include "qemu-common.h"
 #include "block/coroutine_int.h"
+#include "qemu/mem-usage.h"
 
 typedef struct {
     Coroutine base;
@@ -146,7 +147,7 @@ static void coroutine_trampoline(int signal)
 
 Coroutine *qemu_coroutine_new(void)
 {
-    const size_t stack_size = 1 << 20;
+    const size_t stack_size = COROUTINE_STACK_SIZE;
     CoroutineUContext *co;
     CoroutineThreadState *coTS;
     struct sigaction sa;
@@ -168,6 +169,8 @@ Coroutine *qemu_coroutine_new(void)
 
     co = g_malloc0(sizeof(*co));
     co->stack = g_malloc(stack_size);
+    qemu_mem_usage_alloc(MEMORY_USAGE_SUBSYSTEM_COROUTINE_STACK,
+                         stack_size);
     co->base.entry_arg = &old_env; /* stash away our jmp_buf */
 
     coTS = coroutine_get_thread_state();
@@ -256,6 +259,8 @@ void qemu_coroutine_delete(Coroutine *co_)
 {
     CoroutineUContext *co = DO_UPCAST(CoroutineUContext, base, co_);
 
+    qemu_mem_usage_free(MEMORY_USAGE_SUBSYSTEM_COROUTINE_STACK,
+                        COROUTINE_STACK_SIZE);
     g_free(co->stack);
     g_free(co);
 }
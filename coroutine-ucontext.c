@@ -28,6 +28,7 @@
 #include <ucontext.h>
 #include "qemu-common.h"
 #include "block/coroutine_int.h"
+#include "qemu/mem-usage.h"
 
 #ifdef CONFIG_VALGRIND_H
 #include <valgrind/valgrind.h>
@@ -84,7 +85,7 @@ static void coroutine_trampoline(int i0, int i1)
 
 Coroutine *qemu_coroutine_new(void)
 {
-    const size_t stack_size = 1 << 20;
+    const size_t stack_size = COROUTINE_STACK_SIZE;
     CoroutineUContext *co;
     ucontext_t old_uc, uc;
     sigjmp_buf old_env;
@@ -104,6 +105,8 @@ Coroutine *qemu_coroutine_new(void)
 
     co = g_malloc0(sizeof(*co));
     co->stack = g_malloc(stack_size);
+    qemu_mem_usage_alloc(MEMORY_USAGE_SUBSYSTEM_COROUTINE_STACK,
+                         stack_size);
     co->base.entry_arg = &old_env; /* stash away our jmp_buf */
 
     uc.uc_link = &old_uc;
@@ -151,6 +154,8 @@ void qemu_coroutine_delete(Coroutine *co_)
     valgrind_stack_deregister(co);
 #endif
 
+    qemu_mem_usage_free(MEMORY_USAGE_SUBSYSTEM_COROUTINE_STACK,
+                        COROUTINE_STACK_SIZE);
     g_free(co->stack);
     g_free(co);
 }
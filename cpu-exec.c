@@ -28,6 +28,7 @@
 #include "exec/memory-internal.h"
 #include "qemu/rcu.h"
 #include "exec/tb-hash.h"
+#include "exec/helper-proto.h"
 
 /* -icount align implementation. */
 
@@ -259,8 +260,9 @@ static TranslationBlock *tb_find_slow(CPUState *cpu,
                                       uint64_t flags)
 {
     CPUArchState *env = (CPUArchState *)cpu->env_ptr;
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
+    TranslationBlock *tb;
+    TBHashTable *ht;
+    uint32_t h;
     tb_page_addr_t phys_pc, phys_page1;
     target_ulong virt_page2;
 
@@ -269,12 +271,10 @@ static TranslationBlock *tb_find_slow(CPUState *cpu,
     /* find translated block using physical mappings */
     phys_pc = get_page_addr_code(env, pc);
     phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
+    ht = atomic_rcu_read(&tcg_ctx.tb_ctx.tb_phys_hash);
+    h = tb_phys_hash_func(phys_pc, pc, flags) & ((1 << ht->bits) - 1);
+    for (tb = atomic_rcu_read(&ht->buckets[h]); tb != NULL;
+         tb = atomic_rcu_read(&tb->phys_hash_next[ht->chain])) {
         if (tb->pc == pc &&
             tb->page_addr[0] == phys_page1 &&
             tb->cs_base == cs_base &&
@@ -292,24 +292,37 @@ static TranslationBlock *tb_find_slow(CPUState *cpu,
                 goto found;
             }
         }
-        ptb1 = &tb->phys_hash_next;
     }
- not_found:
-   /* if no translated code available, then translate it now */
+
+    /* if no translated code available, then translate it now */
     tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
 
  found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tcg_ctx.tb_ctx.tb_phys_hash[h];
-        tcg_ctx.tb_ctx.tb_phys_hash[h] = tb;
-    }
     /* we add the TB in the virtual pc hash table */
     cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
     return tb;
 }
 
+/* Called from generated code at the end of a TB whose successor is only
+   known at run time.  Return the host code of the next TB if it is in the
+   jump cache, or else the epilogue, which returns to cpu_exec() as
+   exit_tb(0) does. */
+void *HELPER(lookup_tb_ptr)(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (likely(tb && tb->pc == pc && tb->cs_base == cs_base &&
+               tb->flags == flags)) {
+        return tb->tc_ptr;
+    }
+    return tcg_ctx.code_gen_epilogue;
+}
+
 static inline TranslationBlock *tb_find_fast(CPUState *cpu)
 {
     CPUArchState *env = (CPUArchState *)cpu->env_ptr;
@@ -371,6 +384,11 @@ int cpu_exec(CPUState *cpu)
         cpu->halted = 0;
     }
 
+#if !defined(CONFIG_USER_ONLY)
+    /* A reset of the CPU may have cleared the TLB pointers in env */
+    tlb_dyn_sync(cpu);
+#endif
+
     current_cpu = cpu;
 
     /* As long as current_cpu is null, up to the assignment just above,
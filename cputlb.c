@@ -29,12 +29,175 @@
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
 #include "tcg/tcg.h"
+#include "qemu/timer.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
 
 /* statistics */
 int tlb_flush_count;
+uint64_t tlb_miss_count;
+uint64_t tlb_victim_hit_count;
+
+#define ALL_MMUIDX_BITS ((1 << NB_MMU_MODES) - 1)
+
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
+{
+    return te->addr_read == -1 && te->addr_write == -1 && te->addr_code == -1;
+}
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* Resizing happens at flush time, over windows of this length, and looks at
+ * the highest number of entries that were in use in the window.
+ */
+#define TLB_WINDOW_NS (100 * 1000 * 1000)
+
+static void tlb_window_reset(CPUTLBDesc *desc, int64_t ns, size_t max_entries)
+{
+    desc->window_begin_ns = ns;
+    desc->window_max_entries = max_entries;
+}
+
+static void tlb_alloc(CPUArchState *env, int mmu_idx, size_t n_entries)
+{
+    CPUTLBDyn *d = ENV_GET_CPU(env)->tlb_dyn;
+
+    d->mask[mmu_idx] = (n_entries - 1) << CPU_TLB_ENTRY_BITS;
+    d->table[mmu_idx] = g_new(CPUTLBEntry, n_entries);
+    d->iotlb[mmu_idx] = g_new(CPUIOTLBEntry, n_entries);
+    env->tlb_mask[mmu_idx] = d->mask[mmu_idx];
+    env->tlb_table[mmu_idx] = d->table[mmu_idx];
+    env->iotlb[mmu_idx] = d->iotlb[mmu_idx];
+}
+
+/* Double the TLB of @mmu_idx when more than 70% of it was in use during
+ * the current window, shrink it when less than 30% was used during a whole
+ * window.  The new size is a power of two the last window's peak would
+ * fill to at most 70%.  The caller must flush the TLB afterwards.
+ */
+static void tlb_mmu_resize(CPUArchState *env, int mmu_idx)
+{
+    CPUTLBDyn *d = ENV_GET_CPU(env)->tlb_dyn;
+    CPUTLBDesc *desc = &d->desc[mmu_idx];
+    size_t old_size = tlb_n_entries(env, mmu_idx);
+    size_t new_size = old_size;
+    int64_t now = get_clock_realtime();
+    bool window_expired = now > desc->window_begin_ns + TLB_WINDOW_NS;
+    size_t rate;
+
+    if (desc->n_used_entries > desc->window_max_entries) {
+        desc->window_max_entries = desc->n_used_entries;
+    }
+    rate = desc->window_max_entries * 100 / old_size;
+
+    if (rate > 70) {
+        new_size = MIN(old_size << 1, 1 << CPU_TLB_DYN_MAX_BITS);
+    } else if (rate < 30 && window_expired) {
+        size_t ceil = 1 << CPU_TLB_DYN_MIN_BITS;
+
+        while (ceil < desc->window_max_entries * 100 / 70) {
+            ceil <<= 1;
+        }
+        new_size = MIN(ceil, old_size);
+    }
+
+    if (new_size == old_size) {
+        if (window_expired) {
+            tlb_window_reset(desc, now, desc->n_used_entries);
+        }
+        return;
+    }
+
+    g_free(d->table[mmu_idx]);
+    g_free(d->iotlb[mmu_idx]);
+    tlb_window_reset(desc, now, 0);
+    tlb_alloc(env, mmu_idx, new_size);
+}
+#endif
+
+/* Target reset handlers clear env from its start up to some field of their
+ * own, and that includes the copies of the dynamic TLB state that env holds
+ * for the generated code.  Restore them from cpu->tlb_dyn; this is called on
+ * entry to cpu_exec() and to every cputlb function that uses them.
+ */
+void tlb_dyn_sync(CPUState *cpu)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBDyn *d = cpu->tlb_dyn;
+
+    if (likely(env->tlb_table[0] == d->table[0])) {
+        return;
+    }
+    memcpy(env->tlb_mask, d->mask, sizeof(env->tlb_mask));
+    memcpy(env->tlb_table, d->table, sizeof(env->tlb_table));
+    memcpy(env->iotlb, d->iotlb, sizeof(env->iotlb));
+#endif
+}
+
+static inline void tlb_n_used_entries_inc(CPUArchState *env, int mmu_idx)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    ENV_GET_CPU(env)->tlb_dyn->desc[mmu_idx].n_used_entries++;
+#endif
+}
+
+static inline void tlb_n_used_entries_dec(CPUArchState *env, int mmu_idx)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    ENV_GET_CPU(env)->tlb_dyn->desc[mmu_idx].n_used_entries--;
+#endif
+}
+
+/* Allocate the TLBs of @cpu if they are not part of env. */
+void tlb_init(CPUState *cpu)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    CPUArchState *env = cpu->env_ptr;
+    int64_t now = get_clock_realtime();
+    int mmu_idx;
+
+    cpu->tlb_dyn = g_new0(CPUTLBDyn, 1);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        size_t n_entries = 1 << CPU_TLB_DYN_DEFAULT_BITS;
+
+        tlb_window_reset(&cpu->tlb_dyn->desc[mmu_idx], now, 0);
+        tlb_alloc(env, mmu_idx, n_entries);
+        memset(env->tlb_table[mmu_idx], -1, n_entries * sizeof(CPUTLBEntry));
+    }
+#endif
+}
+
+void tlb_destroy(CPUState *cpu)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
+
+    if (!cpu->tlb_dyn) {
+        return;
+    }
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        g_free(cpu->tlb_dyn->table[mmu_idx]);
+        g_free(cpu->tlb_dyn->iotlb[mmu_idx]);
+        env->tlb_table[mmu_idx] = NULL;
+        env->iotlb[mmu_idx] = NULL;
+    }
+    g_free(cpu->tlb_dyn);
+    cpu->tlb_dyn = NULL;
+#endif
+}
+
+static void tlb_flush_one_mmuidx(CPUArchState *env, int mmu_idx)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    tlb_mmu_resize(env, mmu_idx);
+    ENV_GET_CPU(env)->tlb_dyn->desc[mmu_idx].n_used_entries = 0;
+#endif
+    memset(env->tlb_table[mmu_idx], -1,
+           tlb_n_entries(env, mmu_idx) * sizeof(CPUTLBEntry));
+    memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+}
 
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
@@ -51,16 +214,19 @@ int tlb_flush_count;
 void tlb_flush(CPUState *cpu, int flush_global)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
 #endif
+    tlb_dyn_sync(cpu);
     /* must reset current TB so that interrupts cannot modify the
        links while we are modifying them */
     cpu->current_tb = NULL;
 
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
-    memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_flush_one_mmuidx(env, mmu_idx);
+    }
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
 
     env->vtlb_index = 0;
@@ -69,7 +235,33 @@ void tlb_flush(CPUState *cpu, int flush_global)
     tlb_flush_count++;
 }
 
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
+/* Flush the TLBs of the MMU modes whose bit is set in @idxmap only.
+ * Unlike tlb_flush() this keeps the large page tracking, as other MMU
+ * modes may still hold large pages.
+ */
+void tlb_flush_by_mmuidx(CPUState *cpu, uint16_t idxmap)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
+
+#if defined(DEBUG_TLB)
+    printf("tlb_flush_by_mmuidx: %" PRIx16 "\n", idxmap);
+#endif
+    tlb_dyn_sync(cpu);
+    /* must reset current TB so that interrupts cannot modify the
+       links while we are modifying them */
+    cpu->current_tb = NULL;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (idxmap & (1 << mmu_idx)) {
+            tlb_flush_one_mmuidx(env, mmu_idx);
+        }
+    }
+    memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+}
+
+/* Returns true if the entry was flushed. */
+static inline bool tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
@@ -78,26 +270,142 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
         addr == (tlb_entry->addr_code &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
     }
+    return false;
 }
 
-void tlb_flush_page(CPUState *cpu, target_ulong addr)
+/* Like tlb_flush_entry(), for any page in [addr, addr + len).  Entries
+ * that are already invalid may match too, which is harmless.
+ */
+static inline bool tlb_hit_range(target_ulong tlb_addr, target_ulong addr,
+                                 target_ulong len)
+{
+    return (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) - addr < len;
+}
+
+static inline bool tlb_flush_entry_range(CPUTLBEntry *tlb_entry,
+                                         target_ulong addr, target_ulong len)
+{
+    if (!tlb_entry_is_empty(tlb_entry) &&
+        (tlb_hit_range(tlb_entry->addr_read, addr, len) ||
+         tlb_hit_range(tlb_entry->addr_write, addr, len) ||
+         tlb_hit_range(tlb_entry->addr_code, addr, len))) {
+        memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
+    }
+    return false;
+}
+
+static void tlb_flush_page_locked(CPUArchState *env, int mmu_idx,
+                                  target_ulong addr)
+{
+    CPUTLBEntry *te = &env->tlb_table[mmu_idx][tlb_index(env, mmu_idx, addr)];
+    int k;
+
+    if (tlb_flush_entry(te, addr)) {
+        tlb_n_used_entries_dec(env, mmu_idx);
+    }
+
+    /* check whether there are entries that need to be flushed in the vtlb */
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+    }
+}
+
+/* Flush the pages in [addr, addr + len) from the MMU modes in @idxmap.
+ * Small ranges are flushed page by page; ranges that cover at least as
+ * many pages as the TLB has entries (e.g. a 2MB large page) scan the TLB
+ * once instead.  Either way the rest of the TLB survives.
+ */
+void tlb_flush_range_by_mmuidx(CPUState *cpu, target_ulong addr,
+                               target_ulong len, uint16_t idxmap)
+{
+    CPUArchState *env = cpu->env_ptr;
+    target_ulong npages, page;
+    int mmu_idx;
+
+#if defined(DEBUG_TLB)
+    printf("tlb_flush_range: " TARGET_FMT_lx "+" TARGET_FMT_lx "\n",
+           addr, len);
+#endif
+    if (len == 0) {
+        return;
+    }
+    tlb_dyn_sync(cpu);
+    len += addr & ~TARGET_PAGE_MASK;
+    addr &= TARGET_PAGE_MASK;
+    npages = (len - 1) / TARGET_PAGE_SIZE + 1;
+    len = npages * TARGET_PAGE_SIZE;
+
+    /* must reset current TB so that interrupts cannot modify the
+       links while we are modifying them */
+    cpu->current_tb = NULL;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        size_t n_entries = tlb_n_entries(env, mmu_idx);
+        size_t k;
+
+        if (!(idxmap & (1 << mmu_idx))) {
+            continue;
+        }
+        if (npages < n_entries) {
+            for (page = 0; page < npages; page++) {
+                tlb_flush_page_locked(env, mmu_idx,
+                                      addr + page * TARGET_PAGE_SIZE);
+            }
+            continue;
+        }
+        for (k = 0; k < n_entries; k++) {
+            if (tlb_flush_entry_range(&env->tlb_table[mmu_idx][k],
+                                      addr, len)) {
+                tlb_n_used_entries_dec(env, mmu_idx);
+            }
+        }
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry_range(&env->tlb_v_table[mmu_idx][k], addr, len);
+        }
+    }
+
+    if (npages <= TB_JMP_CACHE_SIZE / TB_JMP_PAGE_SIZE / 2) {
+        for (page = 0; page < npages; page++) {
+            tb_flush_jmp_cache(cpu, addr + page * TARGET_PAGE_SIZE);
+        }
+    } else {
+        memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    }
+}
+
+void tlb_flush_range(CPUState *cpu, target_ulong addr, target_ulong len)
+{
+    tlb_flush_range_by_mmuidx(cpu, addr, len, ALL_MMUIDX_BITS);
+}
+
+void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr,
+                              uint16_t idxmap)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i;
     int mmu_idx;
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
 #endif
-    /* Check if we need to flush due to large pages.  */
+    tlb_dyn_sync(cpu);
+    /* Check if we need to flush due to large pages.  Only the region that
+       tlb_add_large_page() tracked has to go, not the whole TLB.  */
     if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
 #if defined(DEBUG_TLB)
-        printf("tlb_flush_page: forced full flush ("
+        printf("tlb_flush_page: large page flush ("
                TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                env->tlb_flush_addr, env->tlb_flush_mask);
 #endif
-        tlb_flush(cpu, 1);
+        if (env->tlb_flush_mask == 0) {
+            /* the tracked region grew to cover the whole address space */
+            tlb_flush_by_mmuidx(cpu, idxmap);
+        } else {
+            tlb_flush_range_by_mmuidx(cpu, env->tlb_flush_addr,
+                                      -env->tlb_flush_mask, idxmap);
+        }
         return;
     }
     /* must reset current TB so that interrupts cannot modify the
@@ -105,20 +413,127 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     cpu->current_tb = NULL;
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        if (idxmap & (1 << mmu_idx)) {
+            tlb_flush_page_locked(env, mmu_idx, addr);
+        }
     }
+    tb_flush_jmp_cache(cpu, addr);
+}
 
-    /* check whether there are entries that need to be flushed in the vtlb */
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        int k;
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
-            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
-        }
+void tlb_flush_page(CPUState *cpu, target_ulong addr)
+{
+    tlb_flush_page_by_mmuidx(cpu, addr, ALL_MMUIDX_BITS);
+}
+
+typedef struct TLBFlushWork {
+    CPUState *cpu;
+    bool page;
+    int flush_global;
+    uint16_t idxmap;
+    target_ulong addr;
+} TLBFlushWork;
+
+static void tlb_flush_work(void *opaque)
+{
+    TLBFlushWork *w = opaque;
+
+    if (w->page) {
+        tlb_flush_page_by_mmuidx(w->cpu, w->addr, w->idxmap);
+    } else if (w->idxmap != ALL_MMUIDX_BITS) {
+        tlb_flush_by_mmuidx(w->cpu, w->idxmap);
+    } else {
+        tlb_flush(w->cpu, w->flush_global);
     }
+    g_free(w);
+}
 
-    tb_flush_jmp_cache(cpu, addr);
+/*
+ * Ask every vCPU to perform the flush described by @tmpl.  A vCPU must not
+ * modify the TLB of another vCPU while that one may be executing code, so
+ * the flush is queued with async_run_on_cpu(); that runs it right away for
+ * the calling vCPU and for all vCPUs that share a thread with it.
+ */
+static void tlb_flush_all_cpus_common(const TLBFlushWork *tmpl)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        TLBFlushWork *w = g_memdup(tmpl, sizeof(*tmpl));
+
+        w->cpu = cpu;
+        async_run_on_cpu(cpu, tlb_flush_work, w);
+    }
+}
+
+/* Broadcast variant of tlb_flush(), e.g. for inner-shareable operations. */
+void tlb_flush_all_cpus(int flush_global)
+{
+    TLBFlushWork tmpl = {
+        .page = false,
+        .flush_global = flush_global,
+        .idxmap = ALL_MMUIDX_BITS,
+    };
+
+    tlb_flush_all_cpus_common(&tmpl);
+}
+
+/* Broadcast variant of tlb_flush_page(). */
+void tlb_flush_page_all_cpus(target_ulong addr)
+{
+    TLBFlushWork tmpl = {
+        .page = true,
+        .idxmap = ALL_MMUIDX_BITS,
+        .addr = addr,
+    };
+
+    tlb_flush_all_cpus_common(&tmpl);
+}
+
+/* Broadcast variant of tlb_flush_by_mmuidx(). */
+void tlb_flush_by_mmuidx_all_cpus(uint16_t idxmap)
+{
+    TLBFlushWork tmpl = {
+        .page = false,
+        .flush_global = 1,
+        .idxmap = idxmap,
+    };
+
+    tlb_flush_all_cpus_common(&tmpl);
+}
+
+/* Broadcast variant of tlb_flush_page_by_mmuidx(). */
+void tlb_flush_page_by_mmuidx_all_cpus(target_ulong addr, uint16_t idxmap)
+{
+    TLBFlushWork tmpl = {
+        .page = true,
+        .idxmap = idxmap,
+        .addr = addr,
+    };
+
+    tlb_flush_all_cpus_common(&tmpl);
+}
+
+void tlb_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    CPUState *cpu;
+
+    cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TLB miss count      %" PRIu64 " (%" PRIu64
+                "%% victim TLB hits)\n", tlb_miss_count,
+                tlb_miss_count ? tlb_victim_hit_count * 100 / tlb_miss_count
+                               : 0);
+    CPU_FOREACH(cpu) {
+        CPUArchState *env = cpu->env_ptr;
+        int mmu_idx;
+
+        tlb_dyn_sync(cpu);
+        cpu_fprintf(f, "TLB entries CPU#%-3d", cpu->cpu_index);
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            cpu_fprintf(f, " %zu", tlb_n_entries(env, mmu_idx));
+        }
+        cpu_fprintf(f, "\n");
+    }
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
@@ -174,10 +589,11 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
         int mmu_idx;
 
         env = cpu->env_ptr;
+        tlb_dyn_sync(cpu);
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
             unsigned int i;
 
-            for (i = 0; i < CPU_TLB_SIZE; i++) {
+            for (i = 0; i < tlb_n_entries(env, mmu_idx); i++) {
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
@@ -201,12 +617,13 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
    so that it is no longer dirty */
 void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
 {
-    int i;
     int mmu_idx;
 
+    tlb_dyn_sync(ENV_GET_CPU(env));
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int i = tlb_index(env, mmu_idx, vaddr);
+
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
     }
 
@@ -263,6 +680,7 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     unsigned vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
 
     assert(size >= TARGET_PAGE_SIZE);
+    tlb_dyn_sync(cpu);
     if (size != TARGET_PAGE_SIZE) {
         tlb_add_large_page(env, vaddr, size);
     }
@@ -292,8 +710,11 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     iotlb = memory_region_section_get_iotlb(cpu, section, vaddr, paddr, xlat,
                                             prot, &address);
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = tlb_index(env, mmu_idx, vaddr);
     te = &env->tlb_table[mmu_idx][index];
+    if (tlb_entry_is_empty(te)) {
+        tlb_n_used_entries_inc(env, mmu_idx);
+    }
 
     /* do not discard the translation in te, evict it into a victim tlb */
     env->tlb_v_table[mmu_idx][vidx] = *te;
@@ -354,11 +775,13 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     MemoryRegion *mr;
     CPUState *cpu = ENV_GET_CPU(env1);
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    tlb_dyn_sync(cpu);
     mmu_idx = cpu_mmu_index(env1);
+    page_index = tlb_index(env1, mmu_idx, addr);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
         cpu_ldub_code(env1, addr);
+        page_index = tlb_index(env1, mmu_idx, addr);
     }
     pd = env1->iotlb[mmu_idx][page_index].addr & ~TARGET_PAGE_MASK;
     mr = iotlb_to_region(cpu, pd);
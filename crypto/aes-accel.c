@@ -0,0 +1,324 @@
+/*
+ * AES using the host's AES instructions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The x86 AES-NI and the ARMv8 Crypto Extensions both do a whole AES round
+ * in one instruction, but with a latency of several cycles.  ECB and CBC
+ * decryption therefore work on AES_ACCEL_LANES independent blocks at once,
+ * which keeps the AES unit busy; CBC encryption is a chain and can only go
+ * one block at a time.
+ */
+
+#include "crypto/aes-accel.h"
+
+#define AES_ACCEL_LANES 4
+
+#if defined(CONFIG_AESNI_OPT)
+#pragma GCC push_options
+#pragma GCC target("aes")
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+typedef __m128i AESVec;
+
+#define AES_VEC_LOAD(p)         _mm_loadu_si128((const __m128i *)(p))
+#define AES_VEC_STORE(p, v)     _mm_storeu_si128((__m128i *)(p), v)
+#define AES_VEC_XOR(a, b)       _mm_xor_si128(a, b)
+
+static inline void aes_accel_encrypt_vec(const AESVec *k, int nr,
+                                         AESVec *s, int n)
+{
+    int r, i;
+
+    for (i = 0; i < n; i++) {
+        s[i] = _mm_xor_si128(s[i], k[0]);
+    }
+    for (r = 1; r < nr; r++) {
+        for (i = 0; i < n; i++) {
+            s[i] = _mm_aesenc_si128(s[i], k[r]);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        s[i] = _mm_aesenclast_si128(s[i], k[nr]);
+    }
+}
+
+static inline void aes_accel_decrypt_vec(const AESVec *k, int nr,
+                                         AESVec *s, int n)
+{
+    int r, i;
+
+    for (i = 0; i < n; i++) {
+        s[i] = _mm_xor_si128(s[i], k[0]);
+    }
+    for (r = 1; r < nr; r++) {
+        for (i = 0; i < n; i++) {
+            s[i] = _mm_aesdec_si128(s[i], k[r]);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        s[i] = _mm_aesdeclast_si128(s[i], k[nr]);
+    }
+}
+
+static bool aes_accel_host_supported(void)
+{
+    unsigned int a, b, c, d;
+
+    return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_AES);
+}
+#define AES_ACCEL_OPT
+
+#elif defined(CONFIG_ARM_AES_OPT)
+#pragma GCC push_options
+#pragma GCC target("+crypto")
+#include <arm_neon.h>
+#include "elf.h"
+
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+
+typedef uint8x16_t AESVec;
+
+#define AES_VEC_LOAD(p)         vld1q_u8(p)
+#define AES_VEC_STORE(p, v)     vst1q_u8(p, v)
+#define AES_VEC_XOR(a, b)       veorq_u8(a, b)
+
+/* AESE and AESD add the round key first, and leave (Inv)MixColumns to a
+ * separate instruction */
+static inline void aes_accel_encrypt_vec(const AESVec *k, int nr,
+                                         AESVec *s, int n)
+{
+    int r, i;
+
+    for (r = 0; r < nr - 1; r++) {
+        for (i = 0; i < n; i++) {
+            s[i] = vaesmcq_u8(vaeseq_u8(s[i], k[r]));
+        }
+    }
+    for (i = 0; i < n; i++) {
+        s[i] = veorq_u8(vaeseq_u8(s[i], k[nr - 1]), k[nr]);
+    }
+}
+
+static inline void aes_accel_decrypt_vec(const AESVec *k, int nr,
+                                         AESVec *s, int n)
+{
+    int r, i;
+
+    for (r = 0; r < nr - 1; r++) {
+        for (i = 0; i < n; i++) {
+            s[i] = vaesimcq_u8(vaesdq_u8(s[i], k[r]));
+        }
+    }
+    for (i = 0; i < n; i++) {
+        s[i] = veorq_u8(vaesdq_u8(s[i], k[nr - 1]), k[nr]);
+    }
+}
+
+static bool aes_accel_host_supported(void)
+{
+    return (qemu_getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+}
+#define AES_ACCEL_OPT
+#endif
+
+#ifdef AES_ACCEL_OPT
+static void aes_accel_load_keys(AESVec *k, const uint8_t (*rk)[AES_BLOCK_SIZE],
+                                int nr)
+{
+    int r;
+
+    for (r = 0; r <= nr; r++) {
+        k[r] = AES_VEC_LOAD(rk[r]);
+    }
+}
+
+void qcrypto_aes_accel_ecb_encrypt(const QCryptoAESAccelKey *key,
+                                   const uint8_t *in, uint8_t *out,
+                                   size_t nblocks)
+{
+    AESVec k[AES_MAXNR + 1], s[AES_ACCEL_LANES];
+    int nr = key->rounds;
+    int i;
+
+    aes_accel_load_keys(k, key->ek, nr);
+    for (; nblocks >= AES_ACCEL_LANES; nblocks -= AES_ACCEL_LANES) {
+        for (i = 0; i < AES_ACCEL_LANES; i++) {
+            s[i] = AES_VEC_LOAD(in + i * AES_BLOCK_SIZE);
+        }
+        aes_accel_encrypt_vec(k, nr, s, AES_ACCEL_LANES);
+        for (i = 0; i < AES_ACCEL_LANES; i++) {
+            AES_VEC_STORE(out + i * AES_BLOCK_SIZE, s[i]);
+        }
+        in += AES_ACCEL_LANES * AES_BLOCK_SIZE;
+        out += AES_ACCEL_LANES * AES_BLOCK_SIZE;
+    }
+    for (; nblocks; nblocks--) {
+        s[0] = AES_VEC_LOAD(in);
+        aes_accel_encrypt_vec(k, nr, s, 1);
+        AES_VEC_STORE(out, s[0]);
+        in += AES_BLOCK_SIZE;
+        out += AES_BLOCK_SIZE;
+    }
+}
+
+void qcrypto_aes_accel_ecb_decrypt(const QCryptoAESAccelKey *key,
+                                   const uint8_t *in, uint8_t *out,
+                                   size_t nblocks)
+{
+    AESVec k[AES_MAXNR + 1], s[AES_ACCEL_LANES];
+    int nr = key->rounds;
+    int i;
+
+    aes_accel_load_keys(k, key->dk, nr);
+    for (; nblocks >= AES_ACCEL_LANES; nblocks -= AES_ACCEL_LANES) {
+        for (i = 0; i < AES_ACCEL_LANES; i++) {
+            s[i] = AES_VEC_LOAD(in + i * AES_BLOCK_SIZE);
+        }
+        aes_accel_decrypt_vec(k, nr, s, AES_ACCEL_LANES);
+        for (i = 0; i < AES_ACCEL_LANES; i++) {
+            AES_VEC_STORE(out + i * AES_BLOCK_SIZE, s[i]);
+        }
+        in += AES_ACCEL_LANES * AES_BLOCK_SIZE;
+        out += AES_ACCEL_LANES * AES_BLOCK_SIZE;
+    }
+    for (; nblocks; nblocks--) {
+        s[0] = AES_VEC_LOAD(in);
+        aes_accel_decrypt_vec(k, nr, s, 1);
+        AES_VEC_STORE(out, s[0]);
+        in += AES_BLOCK_SIZE;
+        out += AES_BLOCK_SIZE;
+    }
+}
+
+void qcrypto_aes_accel_cbc_encrypt(const QCryptoAESAccelKey *key,
+                                   const uint8_t *in, uint8_t *out,
+                                   size_t nblocks, uint8_t *iv)
+{
+    AESVec k[AES_MAXNR + 1], s;
+    int nr = key->rounds;
+
+    aes_accel_load_keys(k, key->ek, nr);
+    s = AES_VEC_LOAD(iv);
+    for (; nblocks; nblocks--) {
+        s = AES_VEC_XOR(s, AES_VEC_LOAD(in));
+        aes_accel_encrypt_vec(k, nr, &s, 1);
+        AES_VEC_STORE(out, s);
+        in += AES_BLOCK_SIZE;
+        out += AES_BLOCK_SIZE;
+    }
+    AES_VEC_STORE(iv, s);
+}
+
+void qcrypto_aes_accel_cbc_decrypt(const QCryptoAESAccelKey *key,
+                                   const uint8_t *in, uint8_t *out,
+                                   size_t nblocks, uint8_t *iv)
+{
+    AESVec k[AES_MAXNR + 1], c[AES_ACCEL_LANES], s[AES_ACCEL_LANES];
+    AESVec prev;
+    int nr = key->rounds;
+    int i;
+
+    aes_accel_load_keys(k, key->dk, nr);
+    prev = AES_VEC_LOAD(iv);
+    for (; nblocks >= AES_ACCEL_LANES; nblocks -= AES_ACCEL_LANES) {
+        /* all of the ciphertext is read before @out is written, in case
+         * they are the same buffer */
+        for (i = 0; i < AES_ACCEL_LANES; i++) {
+            s[i] = c[i] = AES_VEC_LOAD(in + i * AES_BLOCK_SIZE);
+        }
+        aes_accel_decrypt_vec(k, nr, s, AES_ACCEL_LANES);
+        AES_VEC_STORE(out, AES_VEC_XOR(s[0], prev));
+        for (i = 1; i < AES_ACCEL_LANES; i++) {
+            AES_VEC_STORE(out + i * AES_BLOCK_SIZE,
+                          AES_VEC_XOR(s[i], c[i - 1]));
+        }
+        prev = c[AES_ACCEL_LANES - 1];
+        in += AES_ACCEL_LANES * AES_BLOCK_SIZE;
+        out += AES_ACCEL_LANES * AES_BLOCK_SIZE;
+    }
+    for (; nblocks; nblocks--) {
+        s[0] = c[0] = AES_VEC_LOAD(in);
+        aes_accel_decrypt_vec(k, nr, s, 1);
+        AES_VEC_STORE(out, AES_VEC_XOR(s[0], prev));
+        prev = c[0];
+        in += AES_BLOCK_SIZE;
+        out += AES_BLOCK_SIZE;
+    }
+    AES_VEC_STORE(iv, prev);
+}
+#pragma GCC pop_options
+
+static bool aes_accel_enabled;
+
+static void __attribute__((constructor)) init_aes_accel(void)
+{
+    aes_accel_enabled = aes_accel_host_supported();
+}
+
+/* The AES_KEY words hold the key bytes big-endian */
+static void aes_accel_convert_key(uint8_t (*rk)[AES_BLOCK_SIZE],
+                                  const AES_KEY *aes_key)
+{
+    int i;
+
+    for (i = 0; i < 4 * (aes_key->rounds + 1); i++) {
+        stl_be_p(&rk[i / 4][(i % 4) * 4], aes_key->rd_key[i]);
+    }
+}
+
+bool qcrypto_aes_accel_init(QCryptoAESAccelKey *key,
+                            const AES_KEY *encrypt_key,
+                            const AES_KEY *decrypt_key)
+{
+    if (!aes_accel_enabled) {
+        return false;
+    }
+
+    aes_accel_convert_key(key->ek, encrypt_key);
+    aes_accel_convert_key(key->dk, decrypt_key);
+    key->rounds = encrypt_key->rounds;
+    return true;
+}
+
+#else
+
+bool qcrypto_aes_accel_init(QCryptoAESAccelKey *key,
+                            const AES_KEY *encrypt_key,
+                            const AES_KEY *decrypt_key)
+{
+    return false;
+}
+
+void qcrypto_aes_accel_ecb_encrypt(const QCryptoAESAccelKey *key,
+                                   const uint8_t *in, uint8_t *out,
+                                   size_t nblocks)
+{
+    abort();
+}
+
+void qcrypto_aes_accel_ecb_decrypt(const QCryptoAESAccelKey *key,
+                                   const uint8_t *in, uint8_t *out,
+                                   size_t nblocks)
+{
+    abort();
+}
+
+void qcrypto_aes_accel_cbc_encrypt(const QCryptoAESAccelKey *key,
+                                   const uint8_t *in, uint8_t *out,
+                                   size_t nblocks, uint8_t *iv)
+{
+    abort();
+}
+
+void qcrypto_aes_accel_cbc_decrypt(const QCryptoAESAccelKey *key,
+                                   const uint8_t *in, uint8_t *out,
+                                   size_t nblocks, uint8_t *iv)
+{
+    abort();
+}
+#endif
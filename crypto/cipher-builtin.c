@@ -19,12 +19,16 @@
  */
 
 #include "crypto/aes.h"
+#include "crypto/aes-accel.h"
 #include "crypto/desrfb.h"
 
 typedef struct QCryptoCipherBuiltinAES QCryptoCipherBuiltinAES;
 struct QCryptoCipherBuiltinAES {
     AES_KEY encrypt_key;
     AES_KEY decrypt_key;
+    /* only valid if use_accel is set */
+    QCryptoAESAccelKey accel_key;
+    bool use_accel;
     uint8_t *iv;
     size_t niv;
 };
@@ -67,6 +71,47 @@ static void qcrypto_cipher_free_aes(QCryptoCipher *cipher)
 }
 
 
+/*
+ * Does the whole blocks at the start of the buffer with the AES
+ * instructions of the host, if it has them, and advances @in, @out and
+ * @len past them.
+ */
+static void qcrypto_cipher_aes_accel(QCryptoCipher *cipher,
+                                     const void **in, void **out,
+                                     size_t *len, bool encrypt)
+{
+    QCryptoCipherBuiltinAES *aes = &((QCryptoCipherBuiltin *)
+                                     cipher->opaque)->state.aes;
+    size_t nblocks = *len / AES_BLOCK_SIZE;
+
+    if (!aes->use_accel || !nblocks) {
+        return;
+    }
+
+    if (cipher->mode == QCRYPTO_CIPHER_MODE_ECB) {
+        if (encrypt) {
+            qcrypto_aes_accel_ecb_encrypt(&aes->accel_key, *in, *out,
+                                          nblocks);
+        } else {
+            qcrypto_aes_accel_ecb_decrypt(&aes->accel_key, *in, *out,
+                                          nblocks);
+        }
+    } else {
+        if (encrypt) {
+            qcrypto_aes_accel_cbc_encrypt(&aes->accel_key, *in, *out,
+                                          nblocks, aes->iv);
+        } else {
+            qcrypto_aes_accel_cbc_decrypt(&aes->accel_key, *in, *out,
+                                          nblocks, aes->iv);
+        }
+    }
+
+    *in += nblocks * AES_BLOCK_SIZE;
+    *out += nblocks * AES_BLOCK_SIZE;
+    *len -= nblocks * AES_BLOCK_SIZE;
+}
+
+
 static int qcrypto_cipher_encrypt_aes(QCryptoCipher *cipher,
                                       const void *in,
                                       void *out,
@@ -75,6 +120,11 @@ static int qcrypto_cipher_encrypt_aes(QCryptoCipher *cipher,
 {
     QCryptoCipherBuiltin *ctxt = cipher->opaque;
 
+    qcrypto_cipher_aes_accel(cipher, &in, &out, &len, true);
+    if (!len) {
+        return 0;
+    }
+
     if (cipher->mode == QCRYPTO_CIPHER_MODE_ECB) {
         const uint8_t *inptr = in;
         uint8_t *outptr = out;
@@ -112,6 +162,11 @@ static int qcrypto_cipher_decrypt_aes(QCryptoCipher *cipher,
 {
     QCryptoCipherBuiltin *ctxt = cipher->opaque;
 
+    qcrypto_cipher_aes_accel(cipher, &in, &out, &len, false);
+    if (!len) {
+        return 0;
+    }
+
     if (cipher->mode == QCRYPTO_CIPHER_MODE_ECB) {
         const uint8_t *inptr = in;
         uint8_t *outptr = out;
@@ -185,6 +240,11 @@ static int qcrypto_cipher_init_aes(QCryptoCipher *cipher,
         goto error;
     }
 
+    ctxt->state.aes.use_accel =
+        qcrypto_aes_accel_init(&ctxt->state.aes.accel_key,
+                               &ctxt->state.aes.encrypt_key,
+                               &ctxt->state.aes.decrypt_key);
+
     ctxt->free = qcrypto_cipher_free_aes;
     ctxt->setiv = qcrypto_cipher_setiv_aes;
     ctxt->encrypt = qcrypto_cipher_encrypt_aes;
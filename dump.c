@@ -25,6 +25,8 @@
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
 #include "qmp-commands.h"
+#include "qapi-event.h"
+#include "qemu/atomic.h"
 
 #include <zlib.h>
 #ifdef CONFIG_LZO
@@ -70,13 +72,26 @@ uint64_t cpu_to_dump64(DumpState *s, uint64_t val)
     return val;
 }
 
+static DumpState dump_state_global = { .status = DUMP_STATUS_NONE };
+
+bool dump_in_progress(void)
+{
+    return atomic_read(&dump_state_global.status) == DUMP_STATUS_ACTIVE;
+}
+
 static int dump_cleanup(DumpState *s)
 {
     guest_phys_blocks_free(&s->guest_phys_blocks);
     memory_mapping_list_free(&s->list);
     close(s->fd);
     if (s->resume) {
+        if (s->detached) {
+            qemu_mutex_lock_iothread();
+        }
         vm_start();
+        if (s->detached) {
+            qemu_mutex_unlock_iothread();
+        }
     }
 
     return 0;
@@ -364,6 +379,8 @@ static void write_memory(DumpState *s, GuestPhysBlock *block, ram_addr_t start,
             return;
         }
     }
+
+    s->written_size += size;
 }
 
 /* get the memory's offset and size in the vmcore */
@@ -1170,20 +1187,110 @@ static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
     return buffer_is_zero(buf, page_size);
 }
 
+/*
+ * The pages are compressed in batches of DUMP_BATCH_PAGES, on up to
+ * DUMP_COMPRESS_THREADS threads at once, and then written in order by the
+ * dumping thread.
+ */
+#define DUMP_BATCH_PAGES        1024
+#define DUMP_JOB_PAGES          64
+#define DUMP_BATCH_JOBS         (DUMP_BATCH_PAGES / DUMP_JOB_PAGES)
+#define DUMP_COMPRESS_THREADS   8
+
+typedef struct DumpPage {
+    uint8_t *buf;               /* the guest page */
+    uint32_t flags;             /* the compression format, 0 if none */
+    size_t size;                /* the size of the data, 0 for zero pages */
+} DumpPage;
+
+typedef struct DumpBatch {
+    DumpState *s;
+    DumpPage pages[DUMP_BATCH_PAGES];
+    int npages;
+    uint8_t *buf_out;           /* DUMP_BATCH_PAGES * len_buf_out bytes */
+    size_t len_buf_out;
+#ifdef CONFIG_LZO
+    lzo_bytep wrkmem[DUMP_BATCH_JOBS];
+#endif
+} DumpBatch;
+
+/*
+ * Compresses one page into @buf_out.  Only one compression format is used,
+ * as s->flag_compress has a single bit set; pages that do not compress are
+ * saved in plaintext.
+ */
+static size_t dump_compress_page(DumpState *s, const uint8_t *buf,
+                                 uint8_t *buf_out, size_t len_buf_out,
+                                 void *wrkmem, uint32_t *flags)
+{
+    size_t size_out = len_buf_out;
+
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
+        (compress2(buf_out, (uLongf *)&size_out, buf,
+                   TARGET_PAGE_SIZE, Z_BEST_SPEED) == Z_OK) &&
+        (size_out < TARGET_PAGE_SIZE)) {
+        *flags = DUMP_DH_COMPRESSED_ZLIB;
+        return size_out;
+    }
+#ifdef CONFIG_LZO
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
+        (lzo1x_1_compress(buf, TARGET_PAGE_SIZE, buf_out,
+                          (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
+        (size_out < TARGET_PAGE_SIZE)) {
+        *flags = DUMP_DH_COMPRESSED_LZO;
+        return size_out;
+    }
+#endif
+#ifdef CONFIG_SNAPPY
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
+        (snappy_compress((char *)buf, TARGET_PAGE_SIZE,
+                         (char *)buf_out, &size_out) == SNAPPY_OK) &&
+        (size_out < TARGET_PAGE_SIZE)) {
+        *flags = DUMP_DH_COMPRESSED_SNAPPY;
+        return size_out;
+    }
+#endif
+    *flags = 0;
+    return TARGET_PAGE_SIZE;
+}
+
+static void dump_compress_job(void *opaque, int index)
+{
+    DumpBatch *batch = opaque;
+    int i = index * DUMP_JOB_PAGES;
+    int end = MIN(i + DUMP_JOB_PAGES, batch->npages);
+    void *wrkmem = NULL;
+
+#ifdef CONFIG_LZO
+    wrkmem = batch->wrkmem[index];
+#endif
+    for (; i < end; i++) {
+        DumpPage *page = &batch->pages[i];
+
+        if (is_zero_page(page->buf, TARGET_PAGE_SIZE)) {
+            page->size = 0;
+            continue;
+        }
+        page->size = dump_compress_page(batch->s, page->buf,
+                                        batch->buf_out +
+                                        i * batch->len_buf_out,
+                                        batch->len_buf_out, wrkmem,
+                                        &page->flags);
+    }
+}
+
 static void write_dump_pages(DumpState *s, Error **errp)
 {
     int ret = 0;
     DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
-#ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
-#endif
-    uint8_t *buf_out = NULL;
+    DumpBatch *batch;
     off_t offset_desc, offset_data;
     PageDescriptor pd, pd_zero;
     uint8_t *buf;
     GuestPhysBlock *block_iter = NULL;
     uint64_t pfn_iter;
+    bool more = true;
+    int i;
 
     /* get offset of page_desc and page_data in dump file */
     offset_desc = s->offset_page;
@@ -1192,16 +1299,19 @@ static void write_dump_pages(DumpState *s, Error **errp)
     prepare_data_cache(&page_desc, s, offset_desc);
     prepare_data_cache(&page_data, s, offset_data);
 
-    /* prepare buffer to store compressed data */
-    len_buf_out = get_len_buf_out(TARGET_PAGE_SIZE, s->flag_compress);
-    assert(len_buf_out != 0);
+    /* prepare buffers to store compressed data */
+    batch = g_new0(DumpBatch, 1);
+    batch->s = s;
+    batch->len_buf_out = get_len_buf_out(TARGET_PAGE_SIZE, s->flag_compress);
+    assert(batch->len_buf_out != 0);
+    batch->buf_out = g_malloc(DUMP_BATCH_PAGES * batch->len_buf_out);
 
 #ifdef CONFIG_LZO
-    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+    for (i = 0; i < DUMP_BATCH_JOBS; i++) {
+        batch->wrkmem[i] = g_malloc(LZO1X_1_MEM_COMPRESS);
+    }
 #endif
 
-    buf_out = g_malloc(len_buf_out);
-
     /*
      * init zero page's page_desc and page_data, because every zero page
      * uses the same page_data
@@ -1224,88 +1334,52 @@ static void write_dump_pages(DumpState *s, Error **errp)
      * dump memory to vmcore page by page. zero page will all be resided in the
      * first page of page section
      */
-    while (get_next_page(&block_iter, &pfn_iter, &buf, s)) {
-        /* check zero page */
-        if (is_zero_page(buf, TARGET_PAGE_SIZE)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
-            if (ret < 0) {
-                dump_error(s, "dump: failed to write page desc", errp);
-                goto out;
+    while (more) {
+        batch->npages = 0;
+        while (batch->npages < DUMP_BATCH_PAGES &&
+               (more = get_next_page(&block_iter, &pfn_iter, &buf, s))) {
+            batch->pages[batch->npages++].buf = buf;
+        }
+        parallel_for(DIV_ROUND_UP(batch->npages, DUMP_JOB_PAGES),
+                     DUMP_COMPRESS_THREADS, dump_compress_job, batch);
+
+        for (i = 0; i < batch->npages; i++) {
+            DumpPage *page = &batch->pages[i];
+
+            /* check zero page */
+            if (page->size == 0) {
+                ret = write_cache(&page_desc, &pd_zero,
+                                  sizeof(PageDescriptor), false);
+                if (ret < 0) {
+                    dump_error(s, "dump: failed to write page desc", errp);
+                    goto out;
+                }
+                continue;
             }
-        } else {
+
             /*
              * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
-             *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
+             * 1. write the compressed page, or the page itself if it did
+             *    not compress, into the cache of page_data
+             * 2. get page desc of the page and write it into the cache of
+             *    page_desc
              */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               TARGET_PAGE_SIZE, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < TARGET_PAGE_SIZE)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    dump_error(s, "dump: failed to write page data", errp);
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, TARGET_PAGE_SIZE, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < TARGET_PAGE_SIZE)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    dump_error(s, "dump: failed to write page data", errp);
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, TARGET_PAGE_SIZE,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < TARGET_PAGE_SIZE)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    dump_error(s, "dump: failed to write page data", errp);
-                    goto out;
-                }
-#endif
-            } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned TARGET_PAGE_SIZE
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = TARGET_PAGE_SIZE;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf, TARGET_PAGE_SIZE, false);
-                if (ret < 0) {
-                    dump_error(s, "dump: failed to write page data", errp);
-                    goto out;
-                }
+            pd.flags = cpu_to_dump32(s, page->flags);
+            pd.size = cpu_to_dump32(s, page->size);
+            ret = write_cache(&page_data,
+                              page->flags ? batch->buf_out +
+                                            i * batch->len_buf_out
+                                          : page->buf,
+                              page->size, false);
+            if (ret < 0) {
+                dump_error(s, "dump: failed to write page data", errp);
+                goto out;
             }
 
             /* get and write page desc here */
             pd.page_flags = cpu_to_dump64(s, 0);
             pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
+            offset_data += page->size;
 
             ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
             if (ret < 0) {
@@ -1313,6 +1387,7 @@ static void write_dump_pages(DumpState *s, Error **errp)
                 goto out;
             }
         }
+        s->written_size += (int64_t)batch->npages * TARGET_PAGE_SIZE;
     }
 
     ret = write_cache(&page_desc, NULL, 0, true);
@@ -1331,10 +1406,13 @@ out:
     free_data_cache(&page_data);
 
 #ifdef CONFIG_LZO
-    g_free(wrkmem);
+    for (i = 0; i < DUMP_BATCH_JOBS; i++) {
+        g_free(batch->wrkmem[i]);
+    }
 #endif
 
-    g_free(buf_out);
+    g_free(batch->buf_out);
+    g_free(batch);
 }
 
 static void create_kdump_vmcore(DumpState *s, Error **errp)
@@ -1433,6 +1511,28 @@ static void get_max_mapnr(DumpState *s)
     s->max_mapnr = paddr_to_pfn(last_block->target_end);
 }
 
+/* The amount of guest memory that the dump will write, for query-dump */
+static int64_t dump_calculate_size(DumpState *s)
+{
+    GuestPhysBlock *block;
+    int64_t total = 0;
+    int64_t left, right;
+
+    QTAILQ_FOREACH(block, &s->guest_phys_blocks.head, next) {
+        left = block->target_start;
+        right = block->target_end;
+        if (s->has_filter) {
+            left = MAX(left, s->begin);
+            right = MIN(right, s->begin + s->length);
+        }
+        if (right > left) {
+            total += right - left;
+        }
+    }
+
+    return total;
+}
+
 static void dump_init(DumpState *s, int fd, bool has_format,
                       DumpGuestMemoryFormat format, bool paging, bool has_filter,
                       int64_t begin, int64_t length, Error **errp)
@@ -1478,6 +1578,7 @@ static void dump_init(DumpState *s, int fd, bool has_format,
         error_setg(errp, QERR_INVALID_PARAMETER, "begin");
         goto cleanup;
     }
+    s->total_size = dump_calculate_size(s);
 
     /* get dump info: endian, class and architecture.
      * If the target architecture is not supported, cpu_get_dump_info() will
@@ -1595,8 +1696,47 @@ cleanup:
     dump_cleanup(s);
 }
 
-void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
-                           int64_t begin, bool has_length,
+/* Writes the vmcore; when detached, this runs in dump_thread() */
+static void dump_process(DumpState *s, Error **errp)
+{
+    Error *local_err = NULL;
+    DumpQueryResult *result;
+
+    if (s->kdump) {
+        create_kdump_vmcore(s, &local_err);
+    } else {
+        create_vmcore(s, &local_err);
+    }
+
+    if (s->detached) {
+        qemu_mutex_lock_iothread();
+    }
+    atomic_set(&s->status,
+               local_err ? DUMP_STATUS_FAILED : DUMP_STATUS_COMPLETED);
+    if (s->detached) {
+        result = qmp_query_dump(&error_abort);
+        qapi_event_send_dump_completed(result, !!local_err,
+                                       local_err ?
+                                       error_get_pretty(local_err) : NULL,
+                                       &error_abort);
+        qapi_free_DumpQueryResult(result);
+        qemu_mutex_unlock_iothread();
+    }
+
+    error_propagate(errp, local_err);
+}
+
+static void *dump_thread(void *opaque)
+{
+    DumpState *s = opaque;
+
+    dump_process(s, NULL);
+    return NULL;
+}
+
+void qmp_dump_guest_memory(bool paging, const char *file,
+                           bool has_detach, bool detach,
+                           bool has_begin, int64_t begin, bool has_length,
                            int64_t length, bool has_format,
                            DumpGuestMemoryFormat format, Error **errp)
 {
@@ -1605,6 +1745,13 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
     DumpState *s;
     Error *local_err = NULL;
 
+    /* the guest must stay stopped, and dump_state_global busy, until the
+     * running dump has finished */
+    if (dump_in_progress()) {
+        error_setg(errp, "There is a dump in process, please wait");
+        return;
+    }
+
     /*
      * kdump-compressed format need the whole memory dumped, so paging or
      * filter is not supported here.
@@ -1661,23 +1808,38 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         return;
     }
 
-    s = g_malloc0(sizeof(DumpState));
+    s = &dump_state_global;
+    memset(s, 0, sizeof(*s));
+    atomic_set(&s->status, DUMP_STATUS_ACTIVE);
 
     dump_init(s, fd, has_format, format, paging, has_begin,
               begin, length, &local_err);
     if (local_err) {
-        g_free(s);
+        atomic_set(&s->status, DUMP_STATUS_FAILED);
         error_propagate(errp, local_err);
         return;
     }
 
-    if (has_format && format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
-        create_kdump_vmcore(s, errp);
+    s->kdump = has_format && format != DUMP_GUEST_MEMORY_FORMAT_ELF;
+    if (has_detach && detach) {
+        s->detached = true;
+        qemu_thread_create(&s->dump_thread, "dump_thread", dump_thread, s,
+                           QEMU_THREAD_DETACHED);
     } else {
-        create_vmcore(s, errp);
+        dump_process(s, errp);
     }
+}
 
-    g_free(s);
+DumpQueryResult *qmp_query_dump(Error **errp)
+{
+    DumpQueryResult *result = g_new(DumpQueryResult, 1);
+    DumpState *s = &dump_state_global;
+
+    /* written_size is only a progress hint, so it is read without locking */
+    result->status = atomic_read(&s->status);
+    result->completed = s->written_size;
+    result->total = s->total_size;
+    return result;
 }
 
 DumpGuestMemoryCapability *qmp_query_dump_guest_memory_capability(Error **errp)
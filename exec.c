@@ -56,6 +56,7 @@
 #include "exec/ram_addr.h"
 
 #include "qemu/range.h"
+#include "qemu/mem-usage.h"
 
 //#define DEBUG_SUBPAGE
 
@@ -139,6 +140,11 @@ struct AddressSpaceDispatch {
     PhysPageEntry phys_map;
     PhysPageMap map;
     AddressSpace *as;
+
+    /* The section of the last lookup, which for MMIO is most likely the
+     * same register again.  Points into map.sections.
+     */
+    MemoryRegionSection *mru_section;
 };
 
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
@@ -328,11 +334,27 @@ static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
     MemoryRegionSection *section;
     subpage_t *subpage;
 
+    /* Only the lookups that resolve subpages use the cache, so that a
+     * cached section never stands for the subpage container.
+     */
+    if (resolve_subpage) {
+        section = atomic_read(&d->mru_section);
+        if (section && (section->size.hi ||
+                        range_covers_byte(section->offset_within_address_space,
+                                          section->size.lo, addr))) {
+            return section;
+        }
+    }
+
     section = phys_page_find(d->phys_map, addr, d->map.nodes, d->map.sections);
     if (resolve_subpage && section->mr->subpage) {
         subpage = container_of(section->mr, subpage_t, iomem);
         section = &d->map.sections[subpage->sub_section[SUBPAGE_IDX(addr)]];
     }
+    if (resolve_subpage &&
+        section != &d->map.sections[PHYS_SECTION_UNASSIGNED]) {
+        atomic_set(&d->mru_section, section);
+    }
     return section;
 }
 
@@ -545,6 +567,8 @@ static int cpu_get_free_index(Error **errp)
 
 void cpu_exec_exit(CPUState *cpu)
 {
+    tlb_destroy(cpu);
+
     if (cpu->cpu_index == -1) {
         /* cpu_index was never allocated by this @cpu or was already freed. */
         return;
@@ -581,6 +605,7 @@ void cpu_exec_init(CPUState *cpu, Error **errp)
     cpu->as = &address_space_memory;
     cpu->thread_id = qemu_get_thread_id();
     cpu_reload_memory_map(cpu);
+    tlb_init(cpu);
 #endif
 
 #if defined(CONFIG_USER_ONLY)
@@ -853,6 +878,126 @@ void cpu_abort(CPUState *cpu, const char *fmt, ...)
 }
 
 #if !defined(CONFIG_USER_ONLY)
+/* The blocks of ram_list sorted by ram_addr_t offset and, for those that
+ * are mapped, by host address, so that lookups are O(log n).  Rebuilt and
+ * published with RCU whenever ram_list.blocks changes.
+ */
+typedef struct RAMBlockIndex {
+    struct rcu_head rcu;
+    unsigned nr;
+    unsigned nr_host;
+    RAMBlock **by_offset;
+    RAMBlock **by_host;
+    RAMBlock *blocks[];
+} RAMBlockIndex;
+
+static RAMBlockIndex *ram_block_index;
+
+static int ram_block_cmp_offset(const void *a, const void *b)
+{
+    const RAMBlock *ba = *(RAMBlock * const *)a;
+    const RAMBlock *bb = *(RAMBlock * const *)b;
+
+    return ba->offset < bb->offset ? -1 : ba->offset > bb->offset;
+}
+
+static int ram_block_cmp_host(const void *a, const void *b)
+{
+    const RAMBlock *ba = *(RAMBlock * const *)a;
+    const RAMBlock *bb = *(RAMBlock * const *)b;
+
+    return ba->host < bb->host ? -1 : ba->host > bb->host;
+}
+
+/* Called with the ramlist lock held */
+static void ram_block_index_update(void)
+{
+    RAMBlockIndex *old = ram_block_index;
+    RAMBlockIndex *index;
+    RAMBlock *block;
+    unsigned nr = 0;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        nr++;
+    }
+
+    index = g_malloc(sizeof(*index) + 2 * nr * sizeof(RAMBlock *));
+    index->nr = 0;
+    index->nr_host = 0;
+    index->by_offset = index->blocks;
+    index->by_host = index->blocks + nr;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        index->by_offset[index->nr++] = block;
+        if (block->host) {
+            index->by_host[index->nr_host++] = block;
+        }
+    }
+    qsort(index->by_offset, index->nr, sizeof(RAMBlock *),
+          ram_block_cmp_offset);
+    qsort(index->by_host, index->nr_host, sizeof(RAMBlock *),
+          ram_block_cmp_host);
+
+    atomic_rcu_set(&ram_block_index, index);
+    if (old) {
+        g_free_rcu(old, rcu);
+    }
+}
+
+/* Called from RCU critical section */
+static RAMBlock *ram_block_index_find_offset(ram_addr_t addr)
+{
+    RAMBlockIndex *index = atomic_rcu_read(&ram_block_index);
+    RAMBlock *block;
+    unsigned lo = 0, hi, mid;
+
+    if (!index) {
+        return NULL;
+    }
+
+    /* Find the last block that starts at or below addr */
+    hi = index->nr;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (index->by_offset[mid]->offset <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return NULL;
+    }
+    block = index->by_offset[lo - 1];
+    return addr - block->offset < block->max_length ? block : NULL;
+}
+
+/* Called from RCU critical section */
+static RAMBlock *ram_block_index_find_host(uint8_t *host)
+{
+    RAMBlockIndex *index = atomic_rcu_read(&ram_block_index);
+    RAMBlock *block;
+    unsigned lo = 0, hi, mid;
+
+    if (!index) {
+        return NULL;
+    }
+
+    hi = index->nr_host;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (index->by_host[mid]->host <= host) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return NULL;
+    }
+    block = index->by_host[lo - 1];
+    return host - block->host < block->max_length ? block : NULL;
+}
+
 /* Called from RCU critical section */
 static RAMBlock *qemu_get_ram_block(ram_addr_t addr)
 {
@@ -862,10 +1007,9 @@ static RAMBlock *qemu_get_ram_block(ram_addr_t addr)
     if (block && addr - block->offset < block->max_length) {
         goto found;
     }
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        if (addr - block->offset < block->max_length) {
-            goto found;
-        }
+    block = ram_block_index_find_offset(addr);
+    if (block) {
+        goto found;
     }
 
     fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
@@ -933,6 +1077,76 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
     return dirty;
 }
 
+/* The pages from @start to @end, in whole bitmap words */
+struct DirtyBitmapSnapshot {
+    ram_addr_t start;
+    ram_addr_t end;
+    unsigned long dirty[];
+};
+
+/* Note: start and end must be within the same ram block.  */
+DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
+     (ram_addr_t start, ram_addr_t length, unsigned client)
+{
+    ram_addr_t align = (ram_addr_t)BITS_PER_LONG << TARGET_PAGE_BITS;
+    ram_addr_t first = QEMU_ALIGN_DOWN(start, align);
+    ram_addr_t last = QEMU_ALIGN_UP(start + length, align);
+    unsigned long *map = ram_list.dirty_memory[client];
+    unsigned long page, end, word, mask;
+    DirtyBitmapSnapshot *snap;
+    unsigned long *dest;
+    bool dirty = false;
+
+    snap = g_malloc0(sizeof(*snap) +
+                     ((last - first) >> (TARGET_PAGE_BITS + 3)));
+    snap->start = first;
+    snap->end = last;
+    if (length == 0) {
+        return snap;
+    }
+
+    page = start >> TARGET_PAGE_BITS;
+    end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    dest = snap->dirty + (BIT_WORD(page) - BIT_WORD(first >> TARGET_PAGE_BITS));
+
+    /* the partial words at either end hold pages of others; leave them be */
+    for (word = BIT_WORD(page); word <= BIT_WORD(end - 1); word++) {
+        mask = ~0UL;
+        if (word == BIT_WORD(page)) {
+            mask &= BITMAP_FIRST_WORD_MASK(page);
+        }
+        if (word == BIT_WORD(end - 1)) {
+            mask &= BITMAP_LAST_WORD_MASK(end);
+        }
+        if (mask == ~0UL) {
+            *dest = atomic_xchg(&map[word], 0);
+        } else {
+            *dest = atomic_fetch_and(&map[word], ~mask) & mask;
+        }
+        dirty |= *dest++ != 0;
+    }
+
+    if (dirty && tcg_enabled()) {
+        tlb_reset_dirty_range_all(start, length);
+    }
+
+    return snap;
+}
+
+bool cpu_physical_memory_snapshot_get_dirty(DirtyBitmapSnapshot *snap,
+                                            ram_addr_t start,
+                                            ram_addr_t length)
+{
+    unsigned long page, end;
+
+    assert(start >= snap->start);
+    assert(start + length <= snap->end);
+
+    end = TARGET_PAGE_ALIGN(start + length - snap->start) >> TARGET_PAGE_BITS;
+    page = (start - snap->start) >> TARGET_PAGE_BITS;
+    return find_next_bit(snap->dirty, end, page) < end;
+}
+
 /* Called from RCU critical section */
 hwaddr memory_region_section_get_iotlb(CPUState *cpu,
                                        MemoryRegionSection *section,
@@ -1119,6 +1333,20 @@ void qemu_flush_coalesced_mmio_buffer(void)
         kvm_flush_coalesced_mmio_buffer();
 }
 
+void qemu_coalesced_mmio_drain_ref(void)
+{
+    if (kvm_enabled()) {
+        kvm_coalesced_mmio_drain_ref();
+    }
+}
+
+void qemu_coalesced_mmio_drain_unref(void)
+{
+    if (kvm_enabled()) {
+        kvm_coalesced_mmio_drain_unref();
+    }
+}
+
 void qemu_mutex_lock_ramlist(void)
 {
     qemu_mutex_lock(&ram_list.mutex);
@@ -1233,7 +1461,7 @@ static void *file_ram_alloc(RAMBlock *block,
     }
 
     if (mem_prealloc) {
-        os_mem_prealloc(fd, area, memory);
+        os_mem_prealloc(fd, area, memory, smp_cpus);
     }
 
     block->fd = fd;
@@ -1484,6 +1712,7 @@ static ram_addr_t ram_block_add(RAMBlock *new_block, Error **errp)
         QLIST_INSERT_HEAD_RCU(&ram_list.blocks, new_block, next);
     }
     ram_list.mru_block = NULL;
+    ram_block_index_update();
 
     /* Write list before version */
     smp_wmb();
@@ -1632,6 +1861,7 @@ void qemu_ram_free_from_ptr(ram_addr_t addr)
         if (addr == block->offset) {
             QLIST_REMOVE_RCU(block, next);
             ram_list.mru_block = NULL;
+            ram_block_index_update();
             /* Write list before version */
             smp_wmb();
             ram_list.version++;
@@ -1656,6 +1886,7 @@ static void reclaim_ramblock(RAMBlock *block)
     } else {
         qemu_anon_ram_free(block->host, block->max_length);
     }
+    g_free(block->clear_bmap);
     g_free(block);
 }
 
@@ -1668,6 +1899,7 @@ void qemu_ram_free(ram_addr_t addr)
         if (addr == block->offset) {
             QLIST_REMOVE_RCU(block, next);
             ram_list.mru_block = NULL;
+            ram_block_index_update();
             /* Write list before version */
             smp_wmb();
             ram_list.version++;
@@ -1725,8 +1957,67 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
         }
     }
 }
+
+/*
+ * Replace the used part of @block with a copy-on-write mapping of @fd from
+ * @fd_offset on, e.g. of a memory snapshot that several guests then share
+ * until they write to it.  The old contents of the block are gone, even if
+ * this fails.
+ */
+int qemu_ram_map_private(RAMBlock *block, int fd, uint64_t fd_offset,
+                         Error **errp)
+{
+    uintptr_t align = getpagesize() - 1;
+    void *area;
+
+    if ((block->flags & (RAM_PREALLOC | RAM_SHARED)) || xen_enabled()) {
+        error_setg(errp, "RAM block %s is not private to QEMU", block->idstr);
+        return -EINVAL;
+    }
+#ifdef __linux__
+    if (block->fd >= 0) {
+        struct statfs fs;
+
+        if (fstatfs(block->fd, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC) {
+            error_setg(errp, "RAM block %s is on hugetlbfs", block->idstr);
+            return -EINVAL;
+        }
+    }
+#endif
+    if (((uintptr_t)block->host | fd_offset | block->used_length) & align) {
+        error_setg(errp, "RAM block %s is not aligned to host pages",
+                   block->idstr);
+        return -EINVAL;
+    }
+
+    area = mmap(block->host, block->used_length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, fd, fd_offset);
+    if (area == MAP_FAILED) {
+        int ret = -errno;
+
+        error_setg_errno(errp, -ret, "cannot map RAM block %s", block->idstr);
+        return ret;
+    }
+    memory_try_enable_merging(area, block->used_length);
+    qemu_ram_setup_dump(area, block->used_length);
+    return 0;
+}
+#else
+int qemu_ram_map_private(RAMBlock *block, int fd, uint64_t fd_offset,
+                         Error **errp)
+{
+    error_setg(errp, "copy-on-write RAM is not supported on this host");
+    return -ENOTSUP;
+}
 #endif /* !_WIN32 */
 
+/* True if @block is a file mapped with MAP_SHARED, which another process
+ * can map as well */
+bool qemu_ram_is_shared(RAMBlock *block)
+{
+    return (block->flags & RAM_SHARED) && block->fd >= 0;
+}
+
 int qemu_get_ram_fd(ram_addr_t addr)
 {
     RAMBlock *block;
@@ -1809,18 +2100,13 @@ static void *qemu_ram_ptr_length(ram_addr_t addr, hwaddr *size)
     } else {
         RAMBlock *block;
         rcu_read_lock();
-        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-            if (addr - block->offset < block->max_length) {
-                if (addr - block->offset + *size > block->max_length)
-                    *size = block->max_length - addr + block->offset;
-                ptr = ramblock_ptr(block, addr - block->offset);
-                rcu_read_unlock();
-                return ptr;
-            }
+        block = qemu_get_ram_block(addr);
+        if (addr - block->offset + *size > block->max_length) {
+            *size = block->max_length - addr + block->offset;
         }
-
-        fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-        abort();
+        ptr = ramblock_ptr(block, addr - block->offset);
+        rcu_read_unlock();
+        return ptr;
     }
 }
 
@@ -1853,19 +2139,13 @@ MemoryRegion *qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr)
         goto found;
     }
 
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        /* This case append when the block is not mapped. */
-        if (block->host == NULL) {
-            continue;
-        }
-        if (host - block->host < block->max_length) {
-            goto found;
-        }
+    /* Blocks that are not mapped are not in the index */
+    block = ram_block_index_find_host(host);
+    if (!block) {
+        rcu_read_unlock();
+        return NULL;
     }
 
-    rcu_read_unlock();
-    return NULL;
-
 found:
     *ram_addr = block->offset + (host - block->host);
     mr = block->mr;
@@ -1873,10 +2153,28 @@ found:
     return mr;
 }
 
+/* Whether storing @val leaves the @size bytes at @ptr as they are */
+static bool notdirty_store_is_silent(void *ptr, uint64_t val, unsigned size)
+{
+    switch (size) {
+    case 1:
+        return ldub_p(ptr) == (uint8_t)val;
+    case 2:
+        return lduw_p(ptr) == (uint16_t)val;
+    case 4:
+        return ldl_p(ptr) == (uint32_t)val;
+    default:
+        abort();
+    }
+}
+
 static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
                                uint64_t val, unsigned size)
 {
-    if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
+    /* JITs often rewrite code with the bytes it already has, e.g. when
+     * patching a jump target; that needs no retranslation */
+    if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE) &&
+        !notdirty_store_is_silent(qemu_get_ram_ptr(ram_addr), val, size)) {
         tb_invalidate_phys_page_fast(ram_addr, size);
     }
     switch (size) {
@@ -2737,6 +3035,7 @@ void *address_space_map(AddressSpace *as,
         bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
         bounce.addr = addr;
         bounce.len = l;
+        qemu_mem_usage_alloc(MEMORY_USAGE_SUBSYSTEM_BOUNCE_BUFFER, l);
 
         memory_region_ref(mr);
         bounce.mr = mr;
@@ -2800,6 +3099,7 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         address_space_write(as, bounce.addr, MEMTXATTRS_UNSPECIFIED,
                             bounce.buffer, access_len);
     }
+    qemu_mem_usage_free(MEMORY_USAGE_SUBSYSTEM_BOUNCE_BUFFER, bounce.len);
     qemu_vfree(bounce.buffer);
     bounce.buffer = NULL;
     memory_region_unref(bounce.mr);
@@ -80,14 +80,19 @@ this code that are retained.
  */
 
 /* softfloat (and in particular the code in softfloat-specialize.h) is
- * target-dependent and needs the TARGET_* macros.
+ * target-dependent and needs the TARGET_* macros.  tests/test-softfloat.c
+ * builds it without a target, with the default NaN rules.
  */
+#ifndef SOFTFLOAT_NO_TARGET
 #include "config.h"
+#endif
 
 #include "fpu/softfloat.h"
 
 /* We only need stdlib for abort() */
 #include <stdlib.h>
+#include <float.h>
+#include <stdbool.h>
 
 /*----------------------------------------------------------------------------
 | Primitive arithmetic functions, including multi-word arithmetic, and
@@ -2159,7 +2164,8 @@ static float32 subFloat32Sigs(float32 a, float32 b, flag zSign,
 | Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_add(float32 a, float32 b, float_status *status)
+static float32 soft_float32_add(float32 a, float32 b,
+                                float_status *status)
 {
     flag aSign, bSign;
     a = float32_squash_input_denormal(a, status);
@@ -2182,7 +2188,8 @@ float32 float32_add(float32 a, float32 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_sub(float32 a, float32 b, float_status *status)
+static float32 soft_float32_sub(float32 a, float32 b,
+                                float_status *status)
 {
     flag aSign, bSign;
     a = float32_squash_input_denormal(a, status);
@@ -2205,7 +2212,8 @@ float32 float32_sub(float32 a, float32 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_mul(float32 a, float32 b, float_status *status)
+static float32 soft_float32_mul(float32 a, float32 b,
+                                float_status *status)
 {
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
@@ -2270,7 +2278,8 @@ float32 float32_mul(float32 a, float32 b, float_status *status)
 | IEC/IEEE Standard for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_div(float32 a, float32 b, float_status *status)
+static float32 soft_float32_div(float32 a, float32 b,
+                                float_status *status)
 {
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
@@ -3945,7 +3954,8 @@ static float64 subFloat64Sigs(float64 a, float64 b, flag zSign,
 | Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_add(float64 a, float64 b, float_status *status)
+static float64 soft_float64_add(float64 a, float64 b,
+                                float_status *status)
 {
     flag aSign, bSign;
     a = float64_squash_input_denormal(a, status);
@@ -3968,7 +3978,8 @@ float64 float64_add(float64 a, float64 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_sub(float64 a, float64 b, float_status *status)
+static float64 soft_float64_sub(float64 a, float64 b,
+                                float_status *status)
 {
     flag aSign, bSign;
     a = float64_squash_input_denormal(a, status);
@@ -3991,7 +4002,8 @@ float64 float64_sub(float64 a, float64 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_mul(float64 a, float64 b, float_status *status)
+static float64 soft_float64_mul(float64 a, float64 b,
+                                float_status *status)
 {
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
@@ -4054,7 +4066,8 @@ float64 float64_mul(float64 a, float64 b, float_status *status)
 | the IEC/IEEE Standard for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_div(float64 a, float64 b, float_status *status)
+static float64 soft_float64_div(float64 a, float64 b,
+                                float_status *status)
 {
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
@@ -4126,6 +4139,193 @@ float64 float64_div(float64 a, float64 b, float_status *status)
 
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path for the basic single and double precision operations.
+|
+| When the rounding mode is nearest-even and the inexact flag is already set,
+| the only thing the soft code adds over the host FPU is the detection of
+| special cases.  So if both inputs are zero or normal, and the host result
+| is neither infinite (overflow) nor tiny (underflow, flush-to-zero and the
+| tininess mode of the target), the host result is bit-exact and no flag
+| would change.  Everything else goes through the soft code.  Hosts that
+| evaluate floating-point expressions in extended precision (x87) would round
+| twice and always use the soft code.
+*----------------------------------------------------------------------------*/
+
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0 && \
+    !defined(SOFTFLOAT_FORCE_SOFT)
+#define SOFTFLOAT_USE_HOST_FPU 1
+#else
+#define SOFTFLOAT_USE_HOST_FPU 0
+#endif
+
+typedef union {
+    float32 s;
+    float h;
+} union_float32;
+
+typedef union {
+    float64 s;
+    double h;
+} union_float64;
+
+static inline bool can_use_host_fpu(const float_status *s)
+{
+    return SOFTFLOAT_USE_HOST_FPU &&
+           (s->float_exception_flags & float_flag_inexact) &&
+           s->float_rounding_mode == float_round_nearest_even;
+}
+
+static inline bool float32_is_zero_or_normal(float32 a)
+{
+    int exp = extractFloat32Exp(a);
+
+    return (exp != 0 && exp != 0xff) || float32_is_zero(a);
+}
+
+static inline bool float64_is_zero_or_normal(float64 a)
+{
+    int exp = extractFloat64Exp(a);
+
+    return (exp != 0 && exp != 0x7ff) || float64_is_zero(a);
+}
+
+/* Return true if the host result @r can be used as is; @exact_zero tells
+ * whether the inputs make a zero result exact. */
+static inline bool float32_host_ok(float r, bool exact_zero)
+{
+    float abs_r = r < 0 ? -r : r;
+
+    if (unlikely(abs_r <= FLT_MIN)) {
+        return exact_zero && r == 0;
+    }
+    return abs_r <= FLT_MAX;
+}
+
+static inline bool float64_host_ok(double r, bool exact_zero)
+{
+    double abs_r = r < 0 ? -r : r;
+
+    if (unlikely(abs_r <= DBL_MIN)) {
+        return exact_zero && r == 0;
+    }
+    return abs_r <= DBL_MAX;
+}
+
+float32 float32_add(float32 a, float32 b, float_status *status)
+{
+    union_float32 ua = { .s = a }, ub = { .s = b }, ur;
+
+    if (can_use_host_fpu(status) &&
+        float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b)) {
+        ur.h = ua.h + ub.h;
+        if (float32_host_ok(ur.h, float32_is_zero(a) && float32_is_zero(b))) {
+            return ur.s;
+        }
+    }
+    return soft_float32_add(a, b, status);
+}
+
+float32 float32_sub(float32 a, float32 b, float_status *status)
+{
+    union_float32 ua = { .s = a }, ub = { .s = b }, ur;
+
+    if (can_use_host_fpu(status) &&
+        float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b)) {
+        ur.h = ua.h - ub.h;
+        if (float32_host_ok(ur.h, float32_is_zero(a) && float32_is_zero(b))) {
+            return ur.s;
+        }
+    }
+    return soft_float32_sub(a, b, status);
+}
+
+float32 float32_mul(float32 a, float32 b, float_status *status)
+{
+    union_float32 ua = { .s = a }, ub = { .s = b }, ur;
+
+    if (can_use_host_fpu(status) &&
+        float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b)) {
+        ur.h = ua.h * ub.h;
+        if (float32_host_ok(ur.h, float32_is_zero(a) || float32_is_zero(b))) {
+            return ur.s;
+        }
+    }
+    return soft_float32_mul(a, b, status);
+}
+
+float32 float32_div(float32 a, float32 b, float_status *status)
+{
+    union_float32 ua = { .s = a }, ub = { .s = b }, ur;
+
+    if (can_use_host_fpu(status) &&
+        float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b) &&
+        !float32_is_zero(b)) {
+        ur.h = ua.h / ub.h;
+        if (float32_host_ok(ur.h, float32_is_zero(a))) {
+            return ur.s;
+        }
+    }
+    return soft_float32_div(a, b, status);
+}
+
+float64 float64_add(float64 a, float64 b, float_status *status)
+{
+    union_float64 ua = { .s = a }, ub = { .s = b }, ur;
+
+    if (can_use_host_fpu(status) &&
+        float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b)) {
+        ur.h = ua.h + ub.h;
+        if (float64_host_ok(ur.h, float64_is_zero(a) && float64_is_zero(b))) {
+            return ur.s;
+        }
+    }
+    return soft_float64_add(a, b, status);
+}
+
+float64 float64_sub(float64 a, float64 b, float_status *status)
+{
+    union_float64 ua = { .s = a }, ub = { .s = b }, ur;
+
+    if (can_use_host_fpu(status) &&
+        float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b)) {
+        ur.h = ua.h - ub.h;
+        if (float64_host_ok(ur.h, float64_is_zero(a) && float64_is_zero(b))) {
+            return ur.s;
+        }
+    }
+    return soft_float64_sub(a, b, status);
+}
+
+float64 float64_mul(float64 a, float64 b, float_status *status)
+{
+    union_float64 ua = { .s = a }, ub = { .s = b }, ur;
+
+    if (can_use_host_fpu(status) &&
+        float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b)) {
+        ur.h = ua.h * ub.h;
+        if (float64_host_ok(ur.h, float64_is_zero(a) || float64_is_zero(b))) {
+            return ur.s;
+        }
+    }
+    return soft_float64_mul(a, b, status);
+}
+
+float64 float64_div(float64 a, float64 b, float_status *status)
+{
+    union_float64 ua = { .s = a }, ub = { .s = b }, ur;
+
+    if (can_use_host_fpu(status) &&
+        float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b) &&
+        !float64_is_zero(b)) {
+        ur.h = ua.h / ub.h;
+        if (float64_host_ok(ur.h, float64_is_zero(a))) {
+            return ur.s;
+        }
+    }
+    return soft_float64_div(a, b, status);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the remainder of the double-precision floating-point value `a'
 | with respect to the corresponding value `b'.  The operation is performed
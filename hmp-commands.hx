@@ -295,6 +295,22 @@ Open, close, or flush the trace file.  If no argument is given, the status of th
 ETEXI
 #endif
 
+    {
+        .name       = "sync-profile",
+        .args_type  = "op:s?",
+        .params     = "[on|off|reset]",
+        .help       = "enable, disable or reset synchronization profiling",
+        .mhandler.cmd = hmp_sync_profile,
+    },
+
+STEXI
+@item sync-profile [on|off|reset]
+@findex sync-profile
+Enable, disable or reset the synchronization profiler, which records how
+long QemuMutexes and the BQL are waited for and held at each call site.  If
+no argument is given, the status of the profiler is displayed.
+ETEXI
+
     {
         .name       = "log",
         .args_type  = "items:s",
@@ -909,6 +925,22 @@ STEXI
 @findex migrate_cancel
 Cancel the current VM migration.
 
+ETEXI
+
+    {
+        .name       = "migrate_start_postcopy",
+        .args_type  = "",
+        .params     = "",
+        .help       = "Switch the current migration to postcopy mode",
+        .mhandler.cmd = hmp_migrate_start_postcopy,
+    },
+
+STEXI
+@item migrate_start_postcopy
+@findex migrate_start_postcopy
+Switch the current migration to postcopy mode; the x-postcopy-ram
+capability must have been set before starting it.
+
 ETEXI
 
     {
@@ -992,7 +1024,7 @@ ETEXI
 
     {
         .name       = "migrate_set_parameter",
-        .args_type  = "parameter:s,value:i",
+        .args_type  = "parameter:s,value:s",
         .params     = "parameter value",
         .help       = "Set the parameter for migration",
         .mhandler.cmd = hmp_migrate_set_parameter,
@@ -1002,7 +1034,8 @@ ETEXI
 STEXI
 @item migrate_set_parameter @var{parameter} @var{value}
 @findex migrate_set_parameter
-Set the parameter @var{parameter} for migration.
+Set the parameter @var{parameter} for migration. @var{value} is an integer,
+or for compress-method one of zlib, lz4 or zstd.
 ETEXI
 
     {
@@ -1023,10 +1056,11 @@ ETEXI
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:-p,zlib:-z,lzo:-l,snappy:-s,filename:F,begin:i?,length:i?",
-        .params     = "[-p] [-z|-l|-s] filename [begin length]",
+        .args_type  = "paging:-p,detach:-d,zlib:-z,lzo:-l,snappy:-s,filename:F,begin:i?,length:i?",
+        .params     = "[-p] [-d] [-z|-l|-s] filename [begin length]",
         .help       = "dump guest memory into file 'filename'.\n\t\t\t"
                       "-p: do paging to get guest's memory mapping.\n\t\t\t"
+                      "-d: return immediately (do not wait for completion).\n\t\t\t"
                       "-z: dump in kdump-compressed format, with zlib compression.\n\t\t\t"
                       "-l: dump in kdump-compressed format, with lzo compression.\n\t\t\t"
                       "-s: dump in kdump-compressed format, with snappy compression.\n\t\t\t"
@@ -1037,12 +1071,14 @@ ETEXI
 
 
 STEXI
-@item dump-guest-memory [-p] @var{filename} @var{begin} @var{length}
-@item dump-guest-memory [-z|-l|-s] @var{filename}
+@item dump-guest-memory [-p] [-d] @var{filename} @var{begin} @var{length}
+@item dump-guest-memory [-d] [-z|-l|-s] @var{filename}
 @findex dump-guest-memory
 Dump guest memory to @var{protocol}. The file can be processed with crash or
 gdb. Without -z|-l|-s, the dump format is ELF.
         -p: do paging to get guest's memory mapping.
+        -d: return immediately; the guest stays stopped until the dump is
+            written.
         -z: dump in kdump-compressed format, with zlib compression.
         -l: dump in kdump-compressed format, with lzo compression.
         -s: dump in kdump-compressed format, with snappy compression.
@@ -1740,6 +1776,12 @@ show virtual to physical memory mappings (i386, SH4, SPARC, PPC, and Xtensa only
 show the active virtual memory mappings (i386 only)
 @item info jit
 show dynamic compiler info
+@item info tbs [@var{count}]
+show the @var{count} (default 10) most executed translation blocks; needs
+@option{-tb-stats}
+@item info sync-profile [@var{max}]
+show the @var{max} (default 10) lock call sites with the longest wait time;
+needs @code{sync-profile on}
 @item info numa
 show NUMA information
 @item info kvm
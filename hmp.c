@@ -27,6 +27,7 @@
 #include "qapi/opts-visitor.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/string-output-visitor.h"
+#include "qapi/util.h"
 #include "qapi-visit.h"
 #include "ui/console.h"
 #include "block/qapi.h"
@@ -181,6 +182,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "setup: %" PRIu64 " milliseconds\n",
                            info->setup_time);
         }
+        if (info->has_cpu_throttle_percentage) {
+            monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                           info->cpu_throttle_percentage);
+        }
     }
 
     if (info->has_ram) {
@@ -202,6 +207,13 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync time: log %" PRId64
+                       " us, merge %" PRId64 " us\n",
+                       info->ram->dirty_sync_log_time,
+                       info->ram->dirty_sync_merge_time);
+        monitor_printf(mon, "redirtied: %" PRIu64 " pages, %" PRIu64
+                       " hot\n",
+                       info->ram->redirtied_pages, info->ram->hot_pages);
         if (info->ram->dirty_pages_rate) {
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
@@ -230,6 +242,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle overflow pages: %" PRIu64 "\n",
+                       info->xbzrle_cache->overflow_pages);
     }
 
     qapi_free_MigrationInfo(info);
@@ -272,6 +286,18 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: %" PRId64,
             MigrationParameter_lookup[MIGRATION_PARAMETER_DECOMPRESS_THREADS],
             params->decompress_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_MULTIFD_CHANNELS],
+            params->multifd_channels);
+        monitor_printf(mon, " %s: %s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_METHOD],
+            MigrationCompressMethod_lookup[params->compress_method]);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_CPU_THROTTLE_INITIAL],
+            params->cpu_throttle_initial);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_CPU_THROTTLE_INCREMENT],
+            params->cpu_throttle_increment);
         monitor_printf(mon, "\n");
     }
 
@@ -806,12 +832,24 @@ void hmp_info_block_jobs(Monitor *mon, const QDict *qdict)
     qapi_free_BlockJobInfoList(list);
 }
 
+static void hmp_info_tpm_histogram(Monitor *mon, const char *name,
+                                   intList *hist)
+{
+    monitor_printf(mon, "     %s (log2 us):", name);
+    for (; hist; hist = hist->next) {
+        monitor_printf(mon, " %" PRId64, hist->value);
+    }
+    monitor_printf(mon, "\n");
+}
+
 void hmp_info_tpm(Monitor *mon, const QDict *qdict)
 {
     TPMInfoList *info_list, *info;
     Error *err = NULL;
     unsigned int c = 0;
     TPMPassthroughOptions *tpo;
+    intList *depth;
+    TPMCommandStatsList *cmd;
 
     info_list = qmp_query_tpm(&err);
     if (err) {
@@ -847,10 +885,37 @@ void hmp_info_tpm(Monitor *mon, const QDict *qdict)
                            tpo->has_path ? ",path=" : "",
                            tpo->has_path ? tpo->path : "");
             break;
+        case TPM_TYPE_OPTIONS_KIND_MUX:
+            monitor_printf(mon, ",path=%s,vm-id=%s",
+                           ti->options->mux->path, ti->options->mux->vm_id);
+            break;
         case TPM_TYPE_OPTIONS_KIND_MAX:
             break;
         }
         monitor_printf(mon, "\n");
+        if (ti->has_queue_depth) {
+            monitor_printf(mon, "  \\ queue depth:");
+            for (depth = ti->queue_depth; depth; depth = depth->next) {
+                monitor_printf(mon, " %" PRId64, depth->value);
+            }
+            monitor_printf(mon, "\n");
+        }
+        if (ti->has_cache_hits && ti->has_cache_misses) {
+            monitor_printf(mon, "  \\ response cache: hits=%" PRId64
+                           " misses=%" PRId64 "\n",
+                           ti->cache_hits, ti->cache_misses);
+        }
+        for (cmd = ti->commands; cmd; cmd = cmd->next) {
+            TPMCommandStats *cs = cmd->value;
+
+            monitor_printf(mon, "  \\ ordinal 0x%08" PRIx32 ": count=%" PRId64
+                           " bytes-in=%" PRId64 " bytes-out=%" PRId64 "\n",
+                           cs->ordinal, cs->count, cs->bytes_in,
+                           cs->bytes_out);
+            hmp_info_tpm_histogram(mon, "queue", cs->queue_histogram);
+            hmp_info_tpm_histogram(mon, "exec", cs->exec_histogram);
+            hmp_info_tpm_histogram(mon, "fetch", cs->fetch_histogram);
+        }
         c++;
     }
     qapi_free_TPMInfoList(info_list);
@@ -1067,7 +1132,7 @@ void hmp_drive_mirror(Monitor *mon, const QDict *qdict)
                      false, NULL, false, NULL,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
                      true, mode, false, 0, false, 0, false, 0,
-                     false, 0, false, 0, false, true, &err);
+                     false, 0, false, 0, false, true, false, 0, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -1096,7 +1161,7 @@ void hmp_drive_backup(Monitor *mon, const QDict *qdict)
     qmp_drive_backup(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
                      true, mode, false, 0, false, NULL,
-                     false, 0, false, 0, &err);
+                     false, 0, false, 0, false, 0, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -1152,6 +1217,14 @@ void hmp_migrate_cancel(Monitor *mon, const QDict *qdict)
     qmp_migrate_cancel(NULL);
 }
 
+void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_migrate_start_postcopy(&err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_incoming(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
@@ -1222,15 +1295,36 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
 void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
 {
     const char *param = qdict_get_str(qdict, "parameter");
-    int value = qdict_get_int(qdict, "value");
+    const char *valuestr = qdict_get_str(qdict, "value");
+    int value = 0;
+    char *endp;
     Error *err = NULL;
     bool has_compress_level = false;
     bool has_compress_threads = false;
     bool has_decompress_threads = false;
+    bool has_multifd_channels = false;
+    bool has_compress_method = false;
+    bool has_cpu_throttle_initial = false;
+    bool has_cpu_throttle_increment = false;
     int i;
 
     for (i = 0; i < MIGRATION_PARAMETER_MAX; i++) {
         if (strcmp(param, MigrationParameter_lookup[i]) == 0) {
+            if (i == MIGRATION_PARAMETER_COMPRESS_METHOD) {
+                value = qapi_enum_parse(MigrationCompressMethod_lookup,
+                                        valuestr,
+                                        MIGRATION_COMPRESS_METHOD_MAX, -1,
+                                        &err);
+            } else {
+                value = strtol(valuestr, &endp, 0);
+                if (*valuestr == '\0' || *endp != '\0') {
+                    error_setg(&err, QERR_INVALID_PARAMETER_VALUE, param,
+                               "an integer");
+                }
+            }
+            if (err) {
+                break;
+            }
             switch (i) {
             case MIGRATION_PARAMETER_COMPRESS_LEVEL:
                 has_compress_level = true;
@@ -1241,10 +1335,26 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_DECOMPRESS_THREADS:
                 has_decompress_threads = true;
                 break;
+            case MIGRATION_PARAMETER_MULTIFD_CHANNELS:
+                has_multifd_channels = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_METHOD:
+                has_compress_method = true;
+                break;
+            case MIGRATION_PARAMETER_CPU_THROTTLE_INITIAL:
+                has_cpu_throttle_initial = true;
+                break;
+            case MIGRATION_PARAMETER_CPU_THROTTLE_INCREMENT:
+                has_cpu_throttle_increment = true;
+                break;
             }
             qmp_migrate_set_parameters(has_compress_level, value,
                                        has_compress_threads, value,
                                        has_decompress_threads, value,
+                                       has_multifd_channels, value,
+                                       has_compress_method, value,
+                                       has_cpu_throttle_initial, value,
+                                       has_cpu_throttle_increment, value,
                                        &err);
             break;
         }
@@ -1381,7 +1491,7 @@ void hmp_block_stream(Monitor *mon, const QDict *qdict)
 
     qmp_block_stream(device, base != NULL, base, false, NULL,
                      qdict_haskey(qdict, "speed"), speed,
-                     true, BLOCKDEV_ON_ERROR_REPORT, &error);
+                     true, BLOCKDEV_ON_ERROR_REPORT, false, 0, &error);
 
     hmp_handle_error(mon, &error);
 }
@@ -1452,6 +1562,7 @@ static void hmp_migrate_status_cb(void *opaque)
 
     info = qmp_query_migrate(NULL);
     if (!info->has_status || info->status == MIGRATION_STATUS_ACTIVE ||
+        info->status == MIGRATION_STATUS_POSTCOPY_ACTIVE ||
         info->status == MIGRATION_STATUS_SETUP) {
         if (info->has_disk) {
             int progress;
@@ -1533,6 +1644,7 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
     bool paging = qdict_get_try_bool(qdict, "paging", false);
+    bool detach = qdict_get_try_bool(qdict, "detach", false);
     bool zlib = qdict_get_try_bool(qdict, "zlib", false);
     bool lzo = qdict_get_try_bool(qdict, "lzo", false);
     bool snappy = qdict_get_try_bool(qdict, "snappy", false);
@@ -1571,8 +1683,8 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
 
     prot = g_strconcat("file:", file, NULL);
 
-    qmp_dump_guest_memory(paging, prot, has_begin, begin, has_length, length,
-                          true, dump_format, &err);
+    qmp_dump_guest_memory(paging, prot, true, detach, has_begin, begin,
+                          has_length, length, true, dump_format, &err);
     hmp_handle_error(mon, &err);
     g_free(prot);
 }
@@ -1798,7 +1910,8 @@ void hmp_nbd_server_start(Monitor *mon, const QDict *qdict)
             continue;
         }
 
-        qmp_nbd_server_add(info->value->device, true, writable, &local_err);
+        qmp_nbd_server_add(info->value->device, true, writable, false, NULL,
+                           &local_err);
 
         if (local_err != NULL) {
             qmp_nbd_server_stop(NULL);
@@ -1818,7 +1931,7 @@ void hmp_nbd_server_add(Monitor *mon, const QDict *qdict)
     bool writable = qdict_get_try_bool(qdict, "writable", false);
     Error *local_err = NULL;
 
-    qmp_nbd_server_add(device, true, writable, &local_err);
+    qmp_nbd_server_add(device, true, writable, false, NULL, &local_err);
 
     if (local_err != NULL) {
         hmp_handle_error(mon, &local_err);
@@ -36,9 +36,100 @@ int v9fs_co_readdir_r(V9fsPDU *pdu, V9fsFidState *fidp, struct dirent *dent,
                 err = 0;
             }
         });
+    fidp->dir_pos = -1;
     return err;
 }
 
+/*
+ * Runs in the worker thread.  Reads entries until the next one would take
+ * the reply past @maxsize bytes, and leaves the stream right after the last
+ * entry that fits.
+ */
+static int do_readdir_many(V9fsPDU *pdu, V9fsFidState *fidp,
+                           V9fsDirEnt **entries, off_t offset,
+                           int32_t maxsize)
+{
+    V9fsState *s = pdu->s;
+    V9fsDirEnt **tail = entries;
+    struct dirent *dent, *result;
+    int32_t size = 0;
+    size_t dsize;
+    int err = 0;
+
+    /* a continued listing finds the stream where the last one left it */
+    if (offset == 0) {
+        s->ops->rewinddir(&s->ctx, &fidp->fs);
+    } else if (offset != fidp->dir_pos) {
+        s->ops->seekdir(&s->ctx, &fidp->fs, offset);
+    }
+    fidp->dir_pos = offset;
+
+    while (true) {
+        dent = g_malloc(sizeof(struct dirent));
+        errno = 0;
+        s->ops->readdir_r(&s->ctx, &fidp->fs, dent, &result);
+        if (!result) {
+            g_free(dent);
+            if (errno) {
+                err = -errno;
+                fidp->dir_pos = -1;
+            }
+            break;
+        }
+
+        dsize = v9fs_readdir_response_size(dent->d_name);
+        if (size + dsize > maxsize) {
+            g_free(dent);
+            s->ops->seekdir(&s->ctx, &fidp->fs, fidp->dir_pos);
+            break;
+        }
+        size += dsize;
+        fidp->dir_pos = dent->d_off;
+
+        *tail = g_new0(V9fsDirEnt, 1);
+        (*tail)->dent = dent;
+        tail = &(*tail)->next;
+    }
+
+    return err ? err : size;
+}
+
+/*
+ * Reads as many entries of the directory @fidp, starting after @offset, as
+ * fit into @maxsize bytes of a Treaddir reply.  This takes a single trip to
+ * the worker threads, however many entries there are.  The caller frees
+ * @entries with v9fs_free_dirents(), even on error.  Returns the size of the
+ * entries on the wire, or -errno.
+ */
+int v9fs_co_readdir_many(V9fsPDU *pdu, V9fsFidState *fidp,
+                         V9fsDirEnt **entries, off_t offset, int32_t maxsize)
+{
+    int err;
+
+    *entries = NULL;
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    qemu_co_mutex_lock(&fidp->readdir_lock);
+    v9fs_co_run_in_worker(
+        {
+            err = do_readdir_many(pdu, fidp, entries, offset, maxsize);
+        });
+    qemu_co_mutex_unlock(&fidp->readdir_lock);
+    return err;
+}
+
+void v9fs_free_dirents(V9fsDirEnt *e)
+{
+    V9fsDirEnt *next;
+
+    for (; e; e = next) {
+        next = e->next;
+        g_free(e->dent);
+        g_free(e);
+    }
+}
+
 off_t v9fs_co_telldir(V9fsPDU *pdu, V9fsFidState *fidp)
 {
     off_t err;
@@ -67,6 +158,7 @@ void v9fs_co_seekdir(V9fsPDU *pdu, V9fsFidState *fidp, off_t offset)
         {
             s->ops->seekdir(&s->ctx, &fidp->fs, offset);
         });
+    fidp->dir_pos = -1;
 }
 
 void v9fs_co_rewinddir(V9fsPDU *pdu, V9fsFidState *fidp)
@@ -79,6 +171,7 @@ void v9fs_co_rewinddir(V9fsPDU *pdu, V9fsFidState *fidp)
         {
             s->ops->rewinddir(&s->ctx, &fidp->fs);
         });
+    fidp->dir_pos = -1;
 }
 
 int v9fs_co_mkdir(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name,
@@ -137,6 +230,8 @@ int v9fs_co_opendir(V9fsPDU *pdu, V9fsFidState *fidp)
             }
         });
     v9fs_path_unlock(s);
+    /* the stream of a reopened fid starts over */
+    fidp->dir_pos = -1;
     if (!err) {
         total_open_fd++;
         if (total_open_fd > open_fd_hw) {
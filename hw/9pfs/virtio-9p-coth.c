@@ -15,6 +15,7 @@
 #include "fsdev/qemu-fsdev.h"
 #include "qemu/thread.h"
 #include "qemu/event_notifier.h"
+#include "qemu/atomic.h"
 #include "block/coroutine.h"
 #include "virtio-9p-coth.h"
 
@@ -32,6 +33,8 @@ static void v9fs_qemu_process_req_done(EventNotifier *e)
     Coroutine *co;
 
     event_notifier_test_and_clear(e);
+    /* completions queued from now on need a new notification */
+    atomic_mb_set(&v9fs_pool.notified, false);
 
     while ((co = g_async_queue_try_pop(v9fs_pool.completed)) != NULL) {
         qemu_coroutine_enter(co, NULL);
@@ -46,7 +49,9 @@ static void v9fs_thread_routine(gpointer data, gpointer user_data)
 
     g_async_queue_push(v9fs_pool.completed, co);
 
-    event_notifier_set(&v9fs_pool.e);
+    if (!atomic_xchg(&v9fs_pool.notified, true)) {
+        event_notifier_set(&v9fs_pool.e);
+    }
 }
 
 int v9fs_init_worker_threads(void)
@@ -25,6 +25,9 @@ typedef struct V9fsThPool {
 
     GThreadPool *pool;
     GAsyncQueue *completed;
+    /* set while @e is signalled and the QEMU thread has yet to drain
+     * @completed, so that the workers write the eventfd once per batch */
+    bool notified;
 } V9fsThPool;
 
 /*
@@ -62,6 +65,9 @@ extern int v9fs_co_readdir_r(V9fsPDU *, V9fsFidState *,
 extern off_t v9fs_co_telldir(V9fsPDU *, V9fsFidState *);
 extern void v9fs_co_seekdir(V9fsPDU *, V9fsFidState *, off_t);
 extern void v9fs_co_rewinddir(V9fsPDU *, V9fsFidState *);
+extern int v9fs_co_readdir_many(V9fsPDU *, V9fsFidState *, V9fsDirEnt **,
+                                off_t, int32_t);
+extern void v9fs_free_dirents(V9fsDirEnt *);
 extern int v9fs_co_statfs(V9fsPDU *, V9fsPath *, struct statfs *);
 extern int v9fs_co_lstat(V9fsPDU *, V9fsPath *, struct stat *);
 extern int v9fs_co_chmod(V9fsPDU *, V9fsPath *, mode_t);
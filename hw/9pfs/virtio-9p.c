@@ -262,6 +262,8 @@ static V9fsFidState *alloc_fid(V9fsState *s, int32_t fid)
     f->fid = fid;
     f->fid_type = P9_FID_NONE;
     f->ref = 1;
+    f->dir_pos = -1;
+    qemu_co_mutex_init(&f->readdir_lock);
     /*
      * Mark the fid as referenced so that the LRU
      * reclaim won't close the file descriptor
@@ -1764,48 +1766,30 @@ out_nofid:
     complete_pdu(s, pdu, err);
 }
 
-static size_t v9fs_readdir_data_size(V9fsString *name)
-{
-    /*
-     * Size of each dirent on the wire: size of qid (13) + size of offset (8)
-     * size of type (1) + size of name.size (2) + strlen(name.data)
-     */
-    return 24 + v9fs_string_size(name);
-}
-
-static int v9fs_do_readdir(V9fsPDU *pdu,
-                           V9fsFidState *fidp, int32_t max_count)
+/*
+ * The entries are read by a single v9fs_co_readdir_many() call, which fills
+ * up to @max_count bytes, and then marshalled here in the QEMU thread.
+ */
+static int v9fs_do_readdir(V9fsPDU *pdu, V9fsFidState *fidp,
+                           off_t offset, int32_t max_count)
 {
     size_t size;
     V9fsQID qid;
     V9fsString name;
     int len, err = 0;
     int32_t count = 0;
-    off_t saved_dir_pos;
-    struct dirent *dent, *result;
+    V9fsDirEnt *entries, *e;
+    struct dirent *dent;
 
-    /* save the directory position */
-    saved_dir_pos = v9fs_co_telldir(pdu, fidp);
-    if (saved_dir_pos < 0) {
-        return saved_dir_pos;
+    err = v9fs_co_readdir_many(pdu, fidp, &entries, offset, max_count);
+    if (err < 0) {
+        goto out;
     }
 
-    dent = g_malloc(sizeof(struct dirent));
-
-    while (1) {
-        err = v9fs_co_readdir_r(pdu, fidp, dent, &result);
-        if (err || !result) {
-            break;
-        }
+    for (e = entries; e; e = e->next) {
+        dent = e->dent;
         v9fs_string_init(&name);
         v9fs_string_sprintf(&name, "%s", dent->d_name);
-        if ((count + v9fs_readdir_data_size(&name)) > max_count) {
-            /* Ran out of buffer. Set dir back to old position and return */
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            g_free(dent);
-            return count;
-        }
         /*
          * Fill up just the path field of qid because the client uses
          * only that. To fill the entire qid structure we will have
@@ -1821,21 +1805,20 @@ static int v9fs_do_readdir(V9fsPDU *pdu,
         len = pdu_marshal(pdu, 11 + count, "Qqbs",
                           &qid, dent->d_off,
                           dent->d_type, &name);
+        v9fs_string_free(&name);
         if (len < 0) {
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            g_free(dent);
-            return len;
+            /* the stream went past what the guest will see */
+            fidp->dir_pos = -1;
+            err = len;
+            goto out;
         }
         count += len;
-        v9fs_string_free(&name);
-        saved_dir_pos = dent->d_off;
-    }
-    g_free(dent);
-    if (err < 0) {
-        return err;
     }
-    return count;
+    err = count;
+
+out:
+    v9fs_free_dirents(entries);
+    return err;
 }
 
 static void v9fs_readdir(void *opaque)
@@ -1866,12 +1849,11 @@ static void v9fs_readdir(void *opaque)
         retval = -EINVAL;
         goto out;
     }
-    if (initial_offset == 0) {
-        v9fs_co_rewinddir(pdu, fidp);
-    } else {
-        v9fs_co_seekdir(pdu, fidp, initial_offset);
+    /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
+    if (max_count > s->msize - 11) {
+        max_count = s->msize - 11;
     }
-    count = v9fs_do_readdir(pdu, fidp, max_count);
+    count = v9fs_do_readdir(pdu, fidp, initial_offset, max_count);
     if (count < 0) {
         retval = count;
         goto out;
@@ -195,8 +195,27 @@ struct V9fsFidState
     int clunked;
     V9fsFidState *next;
     V9fsFidState *rclm_lst;
+    /* serializes Treaddir, which moves the directory stream in a worker */
+    CoMutex readdir_lock;
+    /* d_off of the last entry read from the stream, -1 if unknown */
+    off_t dir_pos;
 };
 
+/* Directory entries read in one go by v9fs_co_readdir_many() */
+typedef struct V9fsDirEnt {
+    struct dirent *dent;
+    struct V9fsDirEnt *next;
+} V9fsDirEnt;
+
+/*
+ * Size of a 9P2000.L dirent on the wire: size of qid (13) + size of
+ * offset (8) + size of type (1) + size of name.size (2) + strlen(name)
+ */
+static inline size_t v9fs_readdir_response_size(const char *name)
+{
+    return 24 + strlen(name);
+}
+
 typedef struct V9fsState
 {
     VirtIODevice parent_obj;
@@ -27,10 +27,32 @@
 #include "sysemu/sysemu.h"
 #include "qapi/visitor.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
+#include "sysemu/kvm.h"
+#include "qemu/bitmap.h"
 
 #include "nvme.h"
 
 static void nvme_process_sq(void *opaque);
+static void nvme_admin_process_sq(void *opaque);
+static void nvme_admin_post_cqes(void *opaque);
+
+/* With an iothread, the I/O queues are processed there; whatever touches
+ * them from elsewhere runs under its AioContext lock, taken after the BQL.
+ */
+static void nvme_lock(NvmeCtrl *n)
+{
+    if (n->iothread) {
+        aio_context_acquire(n->ctx);
+    }
+}
+
+static void nvme_unlock(NvmeCtrl *n)
+{
+    if (n->iothread) {
+        aio_context_release(n->ctx);
+    }
+}
 
 static int nvme_check_sqid(NvmeCtrl *n, uint16_t sqid)
 {
@@ -68,13 +90,125 @@ static uint8_t nvme_sq_empty(NvmeSQueue *sq)
 
 static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
 {
-    if (cq->irq_enabled) {
-        if (msix_enabled(&(n->parent_obj))) {
-            msix_notify(&(n->parent_obj), cq->vector);
-        } else {
-            pci_irq_pulse(&n->parent_obj);
+    if (!cq->irq_enabled) {
+        return;
+    }
+
+    /* The iothread does not take the BQL, so its interrupts are raised
+     * from a bottom half in the main loop */
+    if (n->iothread && cq->cqid) {
+        set_bit_atomic(cq->cqid, n->irq_pending);
+        qemu_bh_schedule(n->irq_bh);
+        return;
+    }
+
+    if (msix_enabled(&(n->parent_obj))) {
+        msix_notify(&(n->parent_obj), cq->vector);
+    } else {
+        pci_irq_pulse(&n->parent_obj);
+    }
+}
+
+static void nvme_irq_bh(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    unsigned long pending;
+    unsigned long bit;
+    int i;
+
+    nvme_lock(n);
+    for (i = 0; i < BITS_TO_LONGS(n->num_queues); i++) {
+        pending = atomic_xchg(&n->irq_pending[i], 0);
+        for (bit = find_first_bit(&pending, BITS_PER_LONG);
+             bit < BITS_PER_LONG;
+             bit = find_next_bit(&pending, BITS_PER_LONG, bit + 1)) {
+            NvmeCQueue *cq = n->cq[i * BITS_PER_LONG + bit];
+
+            if (cq && cq->irq_enabled) {
+                if (msix_enabled(&(n->parent_obj))) {
+                    msix_notify(&(n->parent_obj), cq->vector);
+                } else {
+                    pci_irq_pulse(&n->parent_obj);
+                }
+            }
         }
     }
+    nvme_unlock(n);
+}
+
+/* Interrupt coalescing applies to the I/O completion queues whose vector
+ * has not opted out of it with Coalescing Disable. @posted completions
+ * were just added to @cq.
+ */
+static void nvme_cq_notify(NvmeCtrl *n, NvmeCQueue *cq, int posted)
+{
+    uint32_t thr = NVME_INTC_THR(n->features.int_coalescing) + 1;
+    uint32_t time = NVME_INTC_TIME(n->features.int_coalescing);
+
+    if (!cq->vector || !time ||
+        NVME_INTVC_CD(n->features.int_vector_config[cq->vector])) {
+        nvme_isr_notify(n, cq);
+        return;
+    }
+
+    cq->irq_pending += posted;
+    if (cq->irq_pending >= thr) {
+        cq->irq_pending = 0;
+        timer_del(cq->irq_timer);
+        nvme_isr_notify(n, cq);
+    } else if (cq->irq_pending && !timer_pending(cq->irq_timer)) {
+        /* the aggregation time is in 100 microsecond units */
+        timer_mod(cq->irq_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + time * 100000);
+    }
+}
+
+static void nvme_cq_irq_timer(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    cq->irq_pending = 0;
+    nvme_isr_notify(cq->ctrl, cq);
+}
+
+/* Shadow doorbells: the host keeps the doorbell values of the I/O queues
+ * in memory, and only writes the real doorbell when the value passes the
+ * EventIdx that the controller publishes.
+ */
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t v;
+
+    pci_dma_read(&sq->ctrl->parent_obj, sq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (v < sq->size) {
+        sq->tail = v;
+    }
+}
+
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    pci_dma_write(&sq->ctrl->parent_obj, sq->ei_addr, &v, sizeof(v));
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    uint32_t v;
+
+    pci_dma_read(&cq->ctrl->parent_obj, cq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (v < cq->size) {
+        cq->head = v;
+    }
+}
+
+static void nvme_update_cq_eventidx(NvmeCQueue *cq)
+{
+    uint32_t v = cpu_to_le32(cq->head);
+
+    pci_dma_write(&cq->ctrl->parent_obj, cq->ei_addr, &v, sizeof(v));
 }
 
 static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
@@ -163,11 +297,22 @@ static void nvme_post_cqes(void *opaque)
     NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
+    int posted = 0;
+
+    if (cq->db_addr) {
+        nvme_update_cq_head(cq);
+    }
 
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
         hwaddr addr;
 
+        if (nvme_cq_full(cq) && cq->db_addr) {
+            /* ask for a doorbell write once the host makes room */
+            nvme_update_cq_eventidx(cq);
+            smp_mb();
+            nvme_update_cq_head(cq);
+        }
         if (nvme_cq_full(cq)) {
             break;
         }
@@ -182,8 +327,9 @@ static void nvme_post_cqes(void *opaque)
         pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
             sizeof(req->cqe));
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+        posted++;
     }
-    nvme_isr_notify(n, cq);
+    nvme_cq_notify(n, cq, posted);
 }
 
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
@@ -278,9 +424,62 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     }
 }
 
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_process_sq(sq);
+    }
+}
+
+/* A doorbell write that goes to an eventfd loses its value, so this is
+ * only done for queues whose tail can be read from the shadow doorbell.
+ */
+static void nvme_init_sq_ioeventfd(NvmeSQueue *sq, NvmeCtrl *n)
+{
+    if (!n->ioeventfd || !kvm_eventfds_enabled() || sq->ioeventfd_enabled) {
+        return;
+    }
+    if (event_notifier_init(&sq->notifier, 0) < 0) {
+        return;
+    }
+
+    aio_set_event_notifier(n->ctx, &sq->notifier, nvme_sq_notifier);
+    memory_region_add_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4,
+                              false, 0, &sq->notifier);
+    sq->ioeventfd_enabled = true;
+}
+
+static void nvme_init_sq_dbbuf(NvmeSQueue *sq, NvmeCtrl *n)
+{
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    pci_dma_write(&n->parent_obj, sq->db_addr, &v, sizeof(v));
+    nvme_init_sq_ioeventfd(sq, n);
+}
+
+static void nvme_init_cq_dbbuf(NvmeCQueue *cq, NvmeCtrl *n)
+{
+    uint32_t v = cpu_to_le32(cq->head);
+
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+    pci_dma_write(&n->parent_obj, cq->db_addr, &v, sizeof(v));
+}
+
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     n->sq[sq->sqid] = NULL;
+    if (sq->ioeventfd_enabled) {
+        memory_region_del_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4,
+                                  false, 0, &sq->notifier);
+        aio_set_event_notifier(n->ctx, &sq->notifier, NULL);
+        event_notifier_cleanup(&sq->notifier);
+        sq->ioeventfd_enabled = false;
+    }
     timer_del(sq->timer);
     timer_free(sq->timer);
     g_free(sq->io_req);
@@ -336,6 +535,7 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     sq->size = size;
     sq->cqid = cqid;
     sq->head = sq->tail = 0;
+    sq->db_addr = sq->ei_addr = 0;
     sq->io_req = g_new(NvmeRequest, sq->size);
 
     QTAILQ_INIT(&sq->req_list);
@@ -344,12 +544,22 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    if (sqid) {
+        sq->timer = aio_timer_new(n->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                  nvme_process_sq, sq);
+    } else {
+        sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_admin_process_sq,
+                                 sq);
+    }
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+
+    if (sqid && n->dbbuf_enabled) {
+        nvme_init_sq_dbbuf(sq, n);
+    }
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -388,6 +598,11 @@ static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
     n->cq[cq->cqid] = NULL;
     timer_del(cq->timer);
     timer_free(cq->timer);
+    if (cq->irq_timer) {
+        timer_del(cq->irq_timer);
+        timer_free(cq->irq_timer);
+        cq->irq_timer = NULL;
+    }
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
@@ -423,11 +638,25 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
     cq->head = cq->tail = 0;
+    cq->db_addr = cq->ei_addr = 0;
+    cq->irq_pending = 0;
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    if (cqid) {
+        cq->timer = aio_timer_new(n->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                  nvme_post_cqes, cq);
+        cq->irq_timer = aio_timer_new(n->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                      nvme_cq_irq_timer, cq);
+        if (n->dbbuf_enabled) {
+            nvme_init_cq_dbbuf(cq, n);
+        }
+    } else {
+        cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_admin_post_cqes,
+                                 cq);
+        cq->irq_timer = NULL;
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -449,7 +678,7 @@ static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
     if (!prp1) {
         return NVME_INVALID_FIELD | NVME_DNR;
     }
-    if (vector > n->num_queues) {
+    if (vector >= n->num_queues) {
         return NVME_INVALID_IRQ_VECTOR | NVME_DNR;
     }
     if (!(NVME_CQ_FLAGS_PC(qflags))) {
@@ -487,6 +716,7 @@ static uint16_t nvme_identify(NvmeCtrl *n, NvmeCmd *cmd)
 static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
     uint32_t result;
 
     switch (dw10) {
@@ -496,6 +726,16 @@ static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     case NVME_NUMBER_OF_QUEUES:
         result = cpu_to_le32((n->num_queues - 1) | ((n->num_queues - 1) << 16));
         break;
+    case NVME_INTERRUPT_COALESCING:
+        result = cpu_to_le32(n->features.int_coalescing);
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        if (NVME_INTVC_IV(dw11) >= n->num_queues) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        result = n->features.int_vector_config[NVME_INTVC_IV(dw11)];
+        result = cpu_to_le32(result);
+        break;
     default:
         return NVME_INVALID_FIELD | NVME_DNR;
     }
@@ -517,12 +757,48 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         req->cqe.result =
             cpu_to_le32((n->num_queues - 1) | ((n->num_queues - 1) << 16));
         break;
+    case NVME_INTERRUPT_COALESCING:
+        n->features.int_coalescing = dw11 & 0xffff;
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        if (NVME_INTVC_IV(dw11) >= n->num_queues) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        n->features.int_vector_config[NVME_INTVC_IV(dw11)] = dw11 & 0x1ffff;
+        break;
     default:
         return NVME_INVALID_FIELD | NVME_DNR;
     }
     return NVME_SUCCESS;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    if (!dbs_addr || !eis_addr || dbs_addr & (n->page_size - 1) ||
+        eis_addr & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+
+    /* the admin queue keeps using the real doorbells */
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->cq[i]) {
+            nvme_init_cq_dbbuf(n->cq[i], n);
+        }
+        if (n->sq[i]) {
+            nvme_init_sq_dbbuf(n->sq[i], n);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -540,6 +816,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
@@ -556,6 +834,10 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
+    if (sq->db_addr) {
+        nvme_update_sq_tail(sq);
+    }
+
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
         pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
@@ -573,9 +855,36 @@ static void nvme_process_sq(void *opaque)
             req->status = status;
             nvme_enqueue_req_completion(cq, req);
         }
+
+        if (sq->db_addr) {
+            nvme_update_sq_eventidx(sq);
+            smp_mb();
+            nvme_update_sq_tail(sq);
+        }
     }
 }
 
+/* The admin queue is processed in the main loop */
+static void nvme_admin_process_sq(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+    NvmeCtrl *n = sq->ctrl;
+
+    nvme_lock(n);
+    nvme_process_sq(sq);
+    nvme_unlock(n);
+}
+
+static void nvme_admin_post_cqes(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+    NvmeCtrl *n = cq->ctrl;
+
+    nvme_lock(n);
+    nvme_post_cqes(cq);
+    nvme_unlock(n);
+}
+
 static void nvme_clear_ctrl(NvmeCtrl *n)
 {
     int i;
@@ -592,6 +901,8 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
     }
 
     blk_flush(n->conf.blk);
+    n->dbbuf_enabled = false;
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
     n->bar.cc = 0;
 }
 
@@ -756,11 +1067,14 @@ static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
     unsigned size)
 {
     NvmeCtrl *n = (NvmeCtrl *)opaque;
+
+    nvme_lock(n);
     if (addr < sizeof(n->bar)) {
         nvme_write_bar(n, addr, data, size);
     } else if (addr >= 0x1000) {
         nvme_process_db(n, addr, data);
     }
+    nvme_unlock(n);
 }
 
 static const MemoryRegionOps nvme_mmio_ops = {
@@ -797,6 +1111,10 @@ static int nvme_init(PCIDevice *pci_dev)
     }
     blkconf_blocksizes(&n->conf);
 
+    if (n->num_queues < 2 || n->num_queues > 2048) {
+        return -1;
+    }
+
     pci_conf = pci_dev->config;
     pci_conf[PCI_INTERRUPT_PIN] = 1;
     pci_config_set_prog_interface(pci_dev->config, 0x2);
@@ -804,13 +1122,30 @@ static int nvme_init(PCIDevice *pci_dev)
     pcie_endpoint_cap_init(&n->parent_obj, 0x80);
 
     n->num_namespaces = 1;
-    n->num_queues = 64;
     n->reg_size = 1 << qemu_fls(0x1004 + 2 * (n->num_queues + 1) * 4);
     n->ns_size = bs_size / (uint64_t)n->num_namespaces;
 
     n->namespaces = g_new0(NvmeNamespace, n->num_namespaces);
     n->sq = g_new0(NvmeSQueue *, n->num_queues);
     n->cq = g_new0(NvmeCQueue *, n->num_queues);
+    n->irq_pending = bitmap_new(n->num_queues);
+    n->irq_bh = qemu_bh_new(nvme_irq_bh, n);
+
+    n->features.int_coalescing = n->aggr_threshold | (n->aggr_time << 8);
+    n->features.int_vector_config = g_new0(uint32_t, n->num_queues);
+    for (i = 0; i < n->num_queues; i++) {
+        n->features.int_vector_config[i] = i;
+    }
+
+    if (n->iothread) {
+        object_ref(OBJECT(n->iothread));
+        n->ctx = iothread_get_aio_context(n->iothread);
+        aio_context_acquire(n->ctx);
+        blk_set_aio_context(n->conf.blk, n->ctx);
+        aio_context_release(n->ctx);
+    } else {
+        n->ctx = qemu_get_aio_context();
+    }
 
     memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n,
                           "nvme", n->reg_size);
@@ -828,7 +1163,7 @@ static int nvme_init(PCIDevice *pci_dev)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
@@ -873,7 +1208,19 @@ static void nvme_exit(PCIDevice *pci_dev)
 {
     NvmeCtrl *n = NVME(pci_dev);
 
+    nvme_lock(n);
     nvme_clear_ctrl(n);
+    if (n->iothread) {
+        blk_set_aio_context(n->conf.blk, qemu_get_aio_context());
+    }
+    nvme_unlock(n);
+    if (n->iothread) {
+        object_unref(OBJECT(n->iothread));
+    }
+
+    qemu_bh_delete(n->irq_bh);
+    g_free(n->irq_pending);
+    g_free(n->features.int_vector_config);
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
@@ -883,6 +1230,10 @@ static void nvme_exit(PCIDevice *pci_dev)
 static Property nvme_props[] = {
     DEFINE_BLOCK_PROPERTIES(NvmeCtrl, conf),
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
+    DEFINE_PROP_UINT32("num_queues", NvmeCtrl, num_queues, 64),
+    DEFINE_PROP_BOOL("ioeventfd", NvmeCtrl, ioeventfd, true),
+    DEFINE_PROP_UINT8("aggr_time", NvmeCtrl, aggr_time, 0),
+    DEFINE_PROP_UINT8("aggr_threshold", NvmeCtrl, aggr_threshold, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -945,6 +1296,12 @@ out:
 
 static void nvme_instance_init(Object *obj)
 {
+    NvmeCtrl *n = NVME(obj);
+
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&n->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
     object_property_add(obj, "bootindex", "int32",
                         nvme_get_bootindex,
                         nvme_set_bootindex, NULL, NULL, NULL);
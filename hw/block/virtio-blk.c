@@ -22,16 +22,20 @@
 #include "dataplane/virtio-blk.h"
 #include "migration/migration.h"
 #include "block/scsi.h"
+#include "block/coroutine.h"
 #ifdef __linux__
 # include <scsi/sg.h>
 #endif
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 
-VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
+#define VIRTIO_BLK_QUEUE_SIZE 128
+
+VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req = g_slice_new(VirtIOBlockReq);
+    VirtIOBlockReq *req = virtio_req_pool_get(s->req_pool);
     req->dev = s;
+    req->vq = vq;
     req->qiov.size = 0;
     req->in_len = 0;
     req->next = NULL;
@@ -42,21 +46,19 @@ VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
 void virtio_blk_free_request(VirtIOBlockReq *req)
 {
     if (req) {
-        g_slice_free(VirtIOBlockReq, req);
+        virtio_req_pool_put(req->dev->req_pool, req);
     }
 }
 
 static void virtio_blk_complete_request(VirtIOBlockReq *req,
                                         unsigned char status)
 {
-    VirtIOBlock *s = req->dev;
-    VirtIODevice *vdev = VIRTIO_DEVICE(s);
-
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->in_len);
-    virtio_notify(vdev, s->vq);
+    /* requests that complete together, e.g. merged ones, are published with
+     * one used index update and one interrupt */
+    virtqueue_push_deferred(req->vq, &req->elem, req->in_len);
 }
 
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
@@ -122,6 +124,40 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
     }
 }
 
+typedef struct {
+    VirtIOBlockReq *req;
+    int pending;
+    int ret;
+} VirtIOBlockDwzReq;
+
+/* Called once for each range of the request, and once after submitting */
+static void virtio_blk_dwz_complete(void *opaque, int ret)
+{
+    VirtIOBlockDwzReq *dwz_req = opaque;
+    VirtIOBlockReq *req = dwz_req->req;
+
+    if (ret && !dwz_req->ret) {
+        dwz_req->ret = ret;
+    }
+    if (--dwz_req->pending) {
+        return;
+    }
+
+    ret = dwz_req->ret;
+    g_free(dwz_req);
+    trace_virtio_blk_dwz_complete(req, ret);
+
+    /* on BLOCK_ERROR_ACTION_STOP the whole request is submitted again,
+     * which does no harm: both commands can be repeated */
+    if (ret && virtio_blk_handle_rw_error(req, -ret, false)) {
+        return;
+    }
+
+    virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
+    block_acct_done(blk_get_stats(req->dev->blk), &req->acct);
+    virtio_blk_free_request(req);
+}
+
 static void virtio_blk_flush_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *req = opaque;
@@ -187,11 +223,11 @@ out:
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+    VirtIOBlockReq *req = virtio_blk_alloc_request(s, vq);
 
-    if (!virtqueue_pop(s->vq, &req->elem)) {
+    if (!virtqueue_pop(vq, &req->elem)) {
         virtio_blk_free_request(req);
         return NULL;
     }
@@ -478,6 +514,101 @@ static bool virtio_blk_sect_range_ok(VirtIOBlock *dev,
     return true;
 }
 
+/*
+ * Check the ranges of a discard or write zeroes request; returns the
+ * VIRTIO_BLK_S_* status to fail it with, or VIRTIO_BLK_S_OK.
+ */
+static int virtio_blk_check_dwz(VirtIOBlock *s, struct iovec *iov,
+                                unsigned out_num, bool is_write_zeroes,
+                                unsigned *nsegs, uint64_t *bytes)
+{
+    struct virtio_blk_discard_write_zeroes seg;
+    size_t size = iov_size(iov, out_num);
+    uint32_t max_sectors = is_write_zeroes ? s->conf.max_write_zeroes_sectors :
+                                             s->conf.max_discard_sectors;
+    uint32_t valid_flags = is_write_zeroes ?
+                           VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP : 0;
+    uint64_t sector;
+    uint32_t num_sectors, flags;
+    unsigned i;
+
+    *nsegs = size / sizeof(seg);
+    *bytes = 0;
+    if (size % sizeof(seg) || !*nsegs || *nsegs > VIRTIO_BLK_MAX_DWZ_SEGS) {
+        return VIRTIO_BLK_S_UNSUPP;
+    }
+
+    for (i = 0; i < *nsegs; i++) {
+        iov_to_buf(iov, out_num, i * sizeof(seg), &seg, sizeof(seg));
+        sector = ldq_le_p(&seg.sector);
+        num_sectors = ldl_le_p(&seg.num_sectors);
+        flags = ldl_le_p(&seg.flags);
+
+        if (flags & ~valid_flags) {
+            return VIRTIO_BLK_S_UNSUPP;
+        }
+        if (num_sectors > max_sectors ||
+            !virtio_blk_sect_range_ok(s, sector,
+                                      (uint64_t)num_sectors <<
+                                      BDRV_SECTOR_BITS)) {
+            return VIRTIO_BLK_S_IOERR;
+        }
+        *bytes += (uint64_t)num_sectors << BDRV_SECTOR_BITS;
+    }
+    return VIRTIO_BLK_S_OK;
+}
+
+static void virtio_blk_handle_dwz(VirtIOBlockReq *req, struct iovec *iov,
+                                  unsigned out_num, bool is_write_zeroes)
+{
+    VirtIOBlock *s = req->dev;
+    struct virtio_blk_discard_write_zeroes seg;
+    VirtIOBlockDwzReq *dwz_req;
+    uint64_t sector, bytes;
+    uint32_t num_sectors, flags;
+    unsigned i, nsegs;
+    int status;
+
+    if (!(is_write_zeroes ? s->conf.write_zeroes : s->conf.discard)) {
+        status = VIRTIO_BLK_S_UNSUPP;
+    } else {
+        status = virtio_blk_check_dwz(s, iov, out_num, is_write_zeroes,
+                                      &nsegs, &bytes);
+    }
+    if (status != VIRTIO_BLK_S_OK) {
+        virtio_blk_req_complete(req, status);
+        virtio_blk_free_request(req);
+        return;
+    }
+
+    trace_virtio_blk_handle_dwz(req, is_write_zeroes, nsegs);
+    block_acct_start(blk_get_stats(s->blk), &req->acct, bytes,
+                     BLOCK_ACCT_WRITE);
+
+    dwz_req = g_new(VirtIOBlockDwzReq, 1);
+    dwz_req->req = req;
+    dwz_req->pending = nsegs + 1;
+    dwz_req->ret = 0;
+
+    for (i = 0; i < nsegs; i++) {
+        iov_to_buf(iov, out_num, i * sizeof(seg), &seg, sizeof(seg));
+        sector = ldq_le_p(&seg.sector);
+        num_sectors = ldl_le_p(&seg.num_sectors);
+        flags = ldl_le_p(&seg.flags);
+
+        if (is_write_zeroes) {
+            blk_aio_write_zeroes(s->blk, sector, num_sectors,
+                                 flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP ?
+                                 BDRV_REQ_MAY_UNMAP : 0,
+                                 virtio_blk_dwz_complete, dwz_req);
+        } else {
+            blk_aio_discard(s->blk, sector, num_sectors,
+                            virtio_blk_dwz_complete, dwz_req);
+        }
+    }
+    virtio_blk_dwz_complete(dwz_req, 0);
+}
+
 void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     uint32_t type;
@@ -563,6 +694,13 @@ void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     case VIRTIO_BLK_T_SCSI_CMD:
         virtio_blk_handle_scsi(req);
         break;
+    /* the low bit of both is VIRTIO_BLK_T_OUT, which the switch masks */
+    case VIRTIO_BLK_T_DISCARD & ~VIRTIO_BLK_T_OUT:
+        virtio_blk_handle_dwz(req, iov, out_num, false);
+        break;
+    case VIRTIO_BLK_T_WRITE_ZEROES & ~VIRTIO_BLK_T_OUT:
+        virtio_blk_handle_dwz(req, iov, out_num, true);
+        break;
     case VIRTIO_BLK_T_GET_ID:
     {
         VirtIOBlock *s = req->dev;
@@ -600,7 +738,7 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
         return;
     }
 
-    while ((req = virtio_blk_get_request(s))) {
+    while ((req = virtio_blk_get_request(s, vq))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
@@ -686,6 +824,7 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     virtio_stl_p(vdev, &blkcfg.blk_size, blk_size);
     virtio_stw_p(vdev, &blkcfg.min_io_size, conf->min_io_size / blk_size);
     virtio_stw_p(vdev, &blkcfg.opt_io_size, conf->opt_io_size / blk_size);
+    virtio_stw_p(vdev, &blkcfg.num_queues, s->conf.num_queues);
     blkcfg.geometry.heads = conf->heads;
     /*
      * We must ensure that the block device capacity is a multiple of
@@ -707,7 +846,21 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     blkcfg.physical_block_exp = get_physical_block_exp(conf);
     blkcfg.alignment_offset = 0;
     blkcfg.wce = blk_enable_write_cache(s->blk);
-    memcpy(config, &blkcfg, sizeof(struct virtio_blk_config));
+    if (s->conf.discard) {
+        virtio_stl_p(vdev, &blkcfg.max_discard_sectors,
+                     s->conf.max_discard_sectors);
+        virtio_stl_p(vdev, &blkcfg.max_discard_seg, VIRTIO_BLK_MAX_DWZ_SEGS);
+        virtio_stl_p(vdev, &blkcfg.discard_sector_alignment,
+                     blk_size >> BDRV_SECTOR_BITS);
+    }
+    if (s->conf.write_zeroes) {
+        virtio_stl_p(vdev, &blkcfg.max_write_zeroes_sectors,
+                     s->conf.max_write_zeroes_sectors);
+        virtio_stl_p(vdev, &blkcfg.max_write_zeroes_seg,
+                     VIRTIO_BLK_MAX_DWZ_SEGS);
+        blkcfg.write_zeroes_may_unmap = 1;
+    }
+    memcpy(config, &blkcfg, s->config_size);
 }
 
 static void virtio_blk_set_config(VirtIODevice *vdev, const uint8_t *config)
@@ -715,7 +868,7 @@ static void virtio_blk_set_config(VirtIODevice *vdev, const uint8_t *config)
     VirtIOBlock *s = VIRTIO_BLK(vdev);
     struct virtio_blk_config blkcfg;
 
-    memcpy(&blkcfg, config, sizeof(blkcfg));
+    memcpy(&blkcfg, config, s->config_size);
 
     aio_context_acquire(blk_get_aio_context(s->blk));
     blk_set_enable_write_cache(s->blk, blkcfg.wce != 0);
@@ -731,6 +884,9 @@ static uint64_t virtio_blk_get_features(VirtIODevice *vdev, uint64_t features,
     virtio_add_feature(&features, VIRTIO_BLK_F_GEOMETRY);
     virtio_add_feature(&features, VIRTIO_BLK_F_TOPOLOGY);
     virtio_add_feature(&features, VIRTIO_BLK_F_BLK_SIZE);
+    if (s->conf.num_queues > 1) {
+        virtio_add_feature(&features, VIRTIO_BLK_F_MQ);
+    }
     if (virtio_has_feature(features, VIRTIO_F_VERSION_1)) {
         if (s->conf.scsi) {
             error_setg(errp, "Please set scsi=off for virtio-blk devices in order to use virtio 1.0");
@@ -750,6 +906,16 @@ static uint64_t virtio_blk_get_features(VirtIODevice *vdev, uint64_t features,
     if (blk_is_read_only(s->blk)) {
         virtio_add_feature(&features, VIRTIO_BLK_F_RO);
     }
+    if (s->conf.discard) {
+        virtio_add_feature(&features, VIRTIO_BLK_F_DISCARD);
+    }
+    if (s->conf.write_zeroes) {
+        virtio_add_feature(&features, VIRTIO_BLK_F_WRITE_ZEROES);
+    }
+    /* dataplane has its own vring code, which only knows the split ring */
+    if (s->conf.data_plane || s->conf.iothread) {
+        virtio_clear_feature(&features, VIRTIO_F_RING_PACKED);
+    }
 
     return features;
 }
@@ -810,6 +976,10 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
 
     while (req) {
         qemu_put_sbyte(f, 1);
+        /* the stream of a single-queue device stays as it was */
+        if (s->conf.num_queues > 1) {
+            qemu_put_be32(f, virtio_get_queue_index(req->vq));
+        }
         qemu_put_buffer(f, (unsigned char *)&req->elem,
                         sizeof(VirtQueueElement));
         req = req->next;
@@ -834,7 +1004,19 @@ static int virtio_blk_load_device(VirtIODevice *vdev, QEMUFile *f,
     VirtIOBlock *s = VIRTIO_BLK(vdev);
 
     while (qemu_get_sbyte(f)) {
-        VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+        unsigned nvq = 0;
+        VirtIOBlockReq *req;
+
+        if (s->conf.num_queues > 1) {
+            nvq = qemu_get_be32(f);
+            if (nvq >= s->conf.num_queues) {
+                error_report("Invalid virtqueue index in request list: %#x",
+                             nvq);
+                return -EINVAL;
+            }
+        }
+
+        req = virtio_blk_alloc_request(s, virtio_get_queue(vdev, nvq));
         qemu_get_buffer(f, (unsigned char *)&req->elem,
                         sizeof(VirtQueueElement));
         req->next = s->rq;
@@ -897,6 +1079,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     VirtIOBlkConf *conf = &s->conf;
     Error *err = NULL;
     static int virtio_blk_id;
+    unsigned i;
 
     if (!conf->conf.blk) {
         error_setg(errp, "drive property not set");
@@ -916,21 +1099,53 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     }
     blkconf_blocksizes(&conf->conf);
 
-    virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK,
-                sizeof(struct virtio_blk_config));
+    if (!conf->num_queues || conf->num_queues > VIRTIO_QUEUE_MAX) {
+        error_setg(errp, "num-queues must be between 1 and %d",
+                   VIRTIO_QUEUE_MAX);
+        return;
+    }
+
+    if (!conf->max_discard_sectors ||
+        conf->max_discard_sectors > BDRV_REQUEST_MAX_SECTORS) {
+        error_setg(errp, "max-discard-sectors must be between 1 and %zu",
+                   BDRV_REQUEST_MAX_SECTORS);
+        return;
+    }
+    if (!conf->max_write_zeroes_sectors ||
+        conf->max_write_zeroes_sectors > BDRV_REQUEST_MAX_SECTORS) {
+        error_setg(errp, "max-write-zeroes-sectors must be between 1 and %zu",
+                   BDRV_REQUEST_MAX_SECTORS);
+        return;
+    }
+
+    /* without the new fields, for the migration from older QEMUs */
+    if (conf->discard || conf->write_zeroes) {
+        s->config_size = sizeof(struct virtio_blk_config);
+    } else {
+        s->config_size = offsetof(struct virtio_blk_config,
+                                  max_discard_sectors);
+    }
+    virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK, s->config_size);
 
     s->blk = conf->conf.blk;
     s->rq = NULL;
+    s->req_pool = virtio_req_pool_new(sizeof(VirtIOBlockReq));
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
-    s->vq = virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    for (i = 0; i < conf->num_queues; i++) {
+        virtio_add_queue(vdev, VIRTIO_BLK_QUEUE_SIZE, virtio_blk_handle_output);
+    }
     s->complete_request = virtio_blk_complete_request;
     virtio_blk_data_plane_create(vdev, conf, &s->dataplane, &err);
     if (err != NULL) {
         error_propagate(errp, err);
+        virtio_req_pool_free(s->req_pool);
         virtio_cleanup(vdev);
         return;
     }
+    /* Each request needs a coroutine in the block layer */
+    qemu_coroutine_increase_pool_batch_size(conf->num_queues *
+                                            VIRTIO_BLK_QUEUE_SIZE / 2);
     s->migration_state_notifier.notify = virtio_blk_migration_state_changed;
     add_migration_state_change_notifier(&s->migration_state_notifier);
 
@@ -948,12 +1163,16 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBlock *s = VIRTIO_BLK(dev);
 
+    qemu_coroutine_decrease_pool_batch_size(s->conf.num_queues *
+                                            VIRTIO_BLK_QUEUE_SIZE / 2);
     remove_migration_state_change_notifier(&s->migration_state_notifier);
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
     qemu_del_vm_change_state_handler(s->change);
     unregister_savevm(dev, "virtio-blk", s);
     blockdev_mark_auto_del(s->blk);
+    virtio_req_pool_free(s->req_pool);
+    s->req_pool = NULL;
     virtio_cleanup(vdev);
 }
 
@@ -981,6 +1200,14 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BIT("request-merging", VirtIOBlock, conf.request_merging, 0,
                     true),
     DEFINE_PROP_BIT("x-data-plane", VirtIOBlock, conf.data_plane, 0, false),
+    DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
+    DEFINE_PROP_BIT("discard", VirtIOBlock, conf.discard, 0, true),
+    DEFINE_PROP_BIT("write-zeroes", VirtIOBlock, conf.write_zeroes, 0, true),
+    DEFINE_PROP_UINT32("max-discard-sectors", VirtIOBlock,
+                       conf.max_discard_sectors, BDRV_REQUEST_MAX_SECTORS),
+    DEFINE_PROP_UINT32("max-write-zeroes-sectors", VirtIOBlock,
+                       conf.max_write_zeroes_sectors,
+                       BDRV_REQUEST_MAX_SECTORS),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -12,6 +12,7 @@
 
 #include "sysemu/char.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "trace.h"
 #include "hw/virtio/virtio-serial.h"
 #include "qapi-event.h"
@@ -43,9 +44,10 @@ static gboolean chr_write_unblocked(GIOChannel *chan, GIOCondition cond,
 
 /* Callback function that's called when the guest sends us data */
 static ssize_t flush_buf(VirtIOSerialPort *port,
-                         const uint8_t *buf, ssize_t len)
+                         const struct iovec *iov, int iovcnt)
 {
     VirtConsole *vcon = VIRTIO_CONSOLE(port);
+    ssize_t len = iov_size(iov, iovcnt);
     ssize_t ret;
 
     if (!vcon->chr) {
@@ -53,7 +55,7 @@ static ssize_t flush_buf(VirtIOSerialPort *port,
         return len;
     }
 
-    ret = qemu_chr_fe_write(vcon->chr, buf, len);
+    ret = qemu_chr_fe_writev(vcon->chr, iov, iovcnt);
     trace_virtio_console_flush_buf(port->id, len, ret);
 
     if (ret < len) {
@@ -134,7 +134,8 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
     vsc = VIRTIO_SERIAL_PORT_GET_CLASS(port);
 
     while (!port->throttled) {
-        unsigned int i;
+        struct iovec *sg, first;
+        ssize_t ret;
 
         /* Pop an elem only if we haven't left off a previous one mid-way */
         if (!port->elem.out_num) {
@@ -145,31 +146,41 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
             port->iov_offset = 0;
         }
 
-        for (i = port->iov_idx; i < port->elem.out_num; i++) {
-            size_t buf_size;
-            ssize_t ret;
+        if (port->iov_idx < port->elem.out_num) {
+            /*
+             * Everything that is left of the element goes to the port at
+             * once.  The first segment is trimmed in place for the call:
+             * the element must keep the mapped addresses for the push.
+             */
+            sg = &port->elem.out_sg[port->iov_idx];
+            first = sg[0];
+            sg[0].iov_base += port->iov_offset;
+            sg[0].iov_len -= port->iov_offset;
+            ret = vsc->have_data(port, sg,
+                                 port->elem.out_num - port->iov_idx);
+            sg[0] = first;
 
-            buf_size = port->elem.out_sg[i].iov_len - port->iov_offset;
-            ret = vsc->have_data(port,
-                                  port->elem.out_sg[i].iov_base
-                                  + port->iov_offset,
-                                  buf_size);
             if (port->throttled) {
-                port->iov_idx = i;
-                if (ret > 0) {
-                    port->iov_offset += ret;
+                while (ret > 0 && port->iov_idx < port->elem.out_num) {
+                    size_t left = port->elem.out_sg[port->iov_idx].iov_len
+                                  - port->iov_offset;
+
+                    if (ret < left) {
+                        port->iov_offset += ret;
+                        break;
+                    }
+                    ret -= left;
+                    port->iov_idx++;
+                    port->iov_offset = 0;
                 }
                 break;
             }
-            port->iov_offset = 0;
         }
-        if (port->throttled) {
-            break;
-        }
-        virtqueue_push(vq, &port->elem, 0);
+        /* the used index and the interrupt go out once for the batch */
+        virtqueue_push_deferred(vq, &port->elem, 0);
         port->elem.out_num = 0;
     }
-    virtio_notify(vdev, vq);
+    virtqueue_flush_deferred(vq);
 }
 
 static void flush_queued_data(VirtIOSerialPort *port)
@@ -274,7 +285,8 @@ size_t virtio_serial_guest_ready(VirtIOSerialPort *port)
     if (use_multiport(port->vser) && !port->guest_connected) {
         return 0;
     }
-    virtqueue_get_avail_bytes(vq, &bytes, NULL, 4096, 0);
+    /* Enough to take the big reads of the stream backends in one go */
+    virtqueue_get_avail_bytes(vq, &bytes, NULL, 64 * 1024, 0);
     return bytes;
 }
 
@@ -53,6 +53,9 @@
 #include "exec/address-spaces.h"
 
 #include <zlib.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 bool option_rom_has_mr = false;
 bool rom_file_has_mr = true;
@@ -696,6 +699,8 @@ struct Rom {
     size_t datasize;
 
     uint8_t *data;
+    /* "data" is a private mapping of the file rather than allocated */
+    bool data_mapped;
     MemoryRegion *mr;
     int isrom;
     char *fw_dir;
@@ -726,6 +731,59 @@ static void rom_insert(Rom *rom)
     QTAILQ_INSERT_TAIL(&roms, rom, next);
 }
 
+/*
+ * Map the file instead of reading it into a buffer.  Until they are written
+ * to, the pages stay shared with the page cache, and so with every other VM
+ * that uses the same firmware.
+ *
+ * Changes to the file would show through the mapping, and truncating it
+ * raises SIGBUS, so the mapping is only kept while the machine is set up:
+ * see rom_add_file() and rom_check_and_register_reset().
+ */
+static bool rom_map_file(Rom *rom, int fd)
+{
+#ifndef _WIN32
+    void *data;
+
+    if (!rom->datasize) {
+        return false;
+    }
+    data = mmap(NULL, rom->datasize, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                fd, 0);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    rom->data = data;
+    rom->data_mapped = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void rom_free_data(Rom *rom)
+{
+#ifndef _WIN32
+    if (rom->data_mapped) {
+        munmap(rom->data, rom->datasize);
+    } else
+#endif
+    {
+        g_free(rom->data);
+    }
+    rom->data = NULL;
+    rom->data_mapped = false;
+}
+
+/* Replace a mapping of the file by a copy, for data that is kept around */
+static void rom_unmap_file(Rom *rom)
+{
+    uint8_t *data = g_memdup(rom->data, rom->datasize);
+
+    rom_free_data(rom);
+    rom->data = data;
+}
+
 static void fw_cfg_resized(const char *id, uint64_t length, void *host)
 {
     if (fw_cfg) {
@@ -758,6 +816,7 @@ int rom_add_file(const char *file, const char *fw_dir,
     Rom *rom;
     int rc, fd = -1;
     char devpath[100];
+    bool use_mr = (!option_rom || option_rom_has_mr) && rom_file_has_mr;
 
     rom = g_malloc0(sizeof(*rom));
     rom->name = g_strdup(file);
@@ -786,13 +845,18 @@ int rom_add_file(const char *file, const char *fw_dir,
     }
 
     rom->datasize = rom->romsize;
-    rom->data     = g_malloc0(rom->datasize);
-    lseek(fd, 0, SEEK_SET);
-    rc = read(fd, rom->data, rom->datasize);
-    if (rc != rom->datasize) {
-        fprintf(stderr, "rom: file %-20s: read error: rc=%d (expected %zd)\n",
-                rom->name, rc, rom->datasize);
-        goto err;
+    /* Without a memory region, fw_cfg serves the data for as long as the VM
+     * runs; don't leave that to a mapping of the file. */
+    if ((rom->fw_file && fw_cfg && !use_mr) || !rom_map_file(rom, fd)) {
+        rom->data = g_malloc0(rom->datasize);
+        lseek(fd, 0, SEEK_SET);
+        rc = read(fd, rom->data, rom->datasize);
+        if (rc != rom->datasize) {
+            fprintf(stderr,
+                    "rom: file %-20s: read error: rc=%d (expected %zd)\n",
+                    rom->name, rc, rom->datasize);
+            goto err;
+        }
     }
     close(fd);
     rom_insert(rom);
@@ -811,8 +875,11 @@ int rom_add_file(const char *file, const char *fw_dir,
                  basename);
         snprintf(devpath, sizeof(devpath), "/rom@%s", fw_file_name);
 
-        if ((!option_rom || option_rom_has_mr) && rom_file_has_mr) {
+        if (use_mr) {
             data = rom_set_mr(rom, OBJECT(fw_cfg), devpath);
+            /* fw_cfg files are not reloaded at reset, the memory region
+             * has the only copy that is needed from now on */
+            rom_free_data(rom);
         } else {
             data = rom->data;
         }
@@ -828,7 +895,7 @@ int rom_add_file(const char *file, const char *fw_dir,
 err:
     if (fd != -1)
         close(fd);
-    g_free(rom->data);
+    rom_free_data(rom);
     g_free(rom->path);
     g_free(rom->name);
     g_free(rom);
@@ -911,6 +978,16 @@ static void rom_reset(void *unused)
         if (rom->data == NULL) {
             continue;
         }
+        /*
+         * All of RAM comes from the migration stream, or with ignore-shared
+         * from a file that the guest on the source still runs from.
+         */
+        if (runstate_check(RUN_STATE_INMIGRATE)) {
+            if (rom->isrom) {
+                rom_free_data(rom);
+            }
+            continue;
+        }
         if (rom->mr) {
             void *host = memory_region_get_ram_ptr(rom->mr);
             memcpy(host, rom->data, rom->datasize);
@@ -920,8 +997,7 @@ static void rom_reset(void *unused)
         }
         if (rom->isrom) {
             /* rom needs to be written only once */
-            g_free(rom->data);
-            rom->data = NULL;
+            rom_free_data(rom);
         }
         /*
          * The rom loader is really on the same level as firmware in the guest
@@ -955,6 +1031,11 @@ int rom_check_and_register_reset(void)
         section = memory_region_find(get_system_memory(), rom->addr, 1);
         rom->isrom = int128_nz(section.size) && memory_region_is_rom(section.mr);
         memory_region_unref(section.mr);
+        /* Only ROMs are written once and freed at the first reset; RAM is
+         * reloaded from rom->data at every reset. */
+        if (!rom->isrom && rom->data_mapped) {
+            rom_unmap_file(rom);
+        }
     }
     qemu_register_reset(rom_reset, NULL);
     roms_loaded = 1;
@@ -211,6 +211,20 @@ static void machine_set_mem_merge(Object *obj, bool value, Error **errp)
     ms->mem_merge = value;
 }
 
+static bool machine_get_numa_pin(Object *obj, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    return ms->numa_pin;
+}
+
+static void machine_set_numa_pin(Object *obj, bool value, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    ms->numa_pin = value;
+}
+
 static bool machine_get_usb(Object *obj, Error **errp)
 {
     MachineState *ms = MACHINE(obj);
@@ -382,6 +396,13 @@ static void machine_initfn(Object *obj)
     object_property_set_description(obj, "mem-merge",
                                     "Enable/disable memory merge support",
                                     NULL);
+    object_property_add_bool(obj, "numa-pin",
+                             machine_get_numa_pin,
+                             machine_set_numa_pin, NULL);
+    object_property_set_description(obj, "numa-pin",
+                                    "Bind the threads of each NUMA node to "
+                                    "the host CPUs of its memory",
+                                    NULL);
     object_property_add_bool(obj, "usb",
                              machine_get_usb,
                              machine_set_usb, NULL);
@@ -466,6 +487,11 @@ bool machine_mem_merge(MachineState *machine)
     return machine->mem_merge;
 }
 
+bool machine_numa_pin(MachineState *machine)
+{
+    return machine->numa_pin;
+}
+
 static const TypeInfo machine_info = {
     .name = TYPE_MACHINE,
     .parent = TYPE_OBJECT,
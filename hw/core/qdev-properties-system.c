@@ -258,6 +258,13 @@ static void set_netdev(Object *obj, Visitor *v, void *opaque,
             goto out;
         }
 
+        if (peers[i]->ctx && !object_property_find(obj, "iothread", NULL)) {
+            error_setg(errp, "netdev '%s' runs in an I/O thread, which "
+                       "device '%s' does not support", str,
+                       object_get_typename(obj));
+            goto out;
+        }
+
         ncs[i] = peers[i];
         ncs[i]->queue_index = i;
     }
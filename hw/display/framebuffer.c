@@ -74,6 +74,7 @@ void framebuffer_update_display(
     int i;
     ram_addr_t addr;
     MemoryRegion *mem;
+    DirtyBitmapSnapshot *snap;
 
     i = *first_row;
     *first_row = -1;
@@ -97,13 +98,15 @@ void framebuffer_update_display(
     }
     first = -1;
 
+    snap = memory_region_snapshot_and_clear_dirty(mem, addr, src_len,
+                                                  DIRTY_MEMORY_VGA);
+
     addr += i * src_width;
     src += i * src_width;
     dest += i * dest_row_pitch;
 
     for (; i < rows; i++) {
-        dirty = memory_region_get_dirty(mem, addr, src_width,
-                                             DIRTY_MEMORY_VGA);
+        dirty = memory_region_snapshot_get_dirty(mem, snap, addr, src_width);
         if (dirty || invalidate) {
             fn(opaque, dest, src, cols, dest_col_pitch);
             if (first == -1)
@@ -114,11 +117,10 @@ void framebuffer_update_display(
         src += src_width;
         dest += dest_row_pitch;
     }
+    g_free(snap);
     if (first < 0) {
         return;
     }
-    memory_region_reset_dirty(mem, mem_section->offset_within_region, src_len,
-                              DIRTY_MEMORY_VGA);
     *first_row = first;
     *last_row = last;
 }
@@ -304,6 +304,104 @@ static void virtio_gpu_resource_unref(VirtIOGPU *g,
     virtio_gpu_resource_destroy(g, res);
 }
 
+/*
+ * Shared backing
+ *
+ * With shared-backing=on, a resource whose backing is one contiguous range
+ * of host memory is displayed straight from guest memory: res->image and
+ * the scanout surfaces point into the backing, and transfers that keep the
+ * layout of the image copy nothing.  The display backends then read the
+ * guest's pages themselves, like they do for the framebuffers of the
+ * emulated VGA devices.
+ */
+
+/* Points the surfaces of the scanouts that show @res at its current image */
+static void virtio_gpu_update_scanouts(VirtIOGPU *g,
+                                       struct virtio_gpu_simple_resource *res)
+{
+    pixman_format_code_t format = pixman_image_get_format(res->image);
+    int bpp = (PIXMAN_FORMAT_BPP(format) + 7) / 8;
+    uint32_t stride = pixman_image_get_stride(res->image);
+    uint8_t *data = (uint8_t *)pixman_image_get_data(res->image);
+    int i;
+
+    for (i = 0; i < g->conf.max_outputs; i++) {
+        struct virtio_gpu_scanout *scanout = &g->scanout[i];
+
+        if (!(res->scanout_bitmask & (1 << i))) {
+            continue;
+        }
+        scanout->ds = qemu_create_displaysurface_from
+            (scanout->width, scanout->height, format, stride,
+             data + scanout->x * bpp + scanout->y * stride);
+        dpy_gfx_replace_surface(scanout->con, scanout->ds);
+    }
+}
+
+static void virtio_gpu_replace_image(VirtIOGPU *g,
+                                     struct virtio_gpu_simple_resource *res,
+                                     pixman_image_t *image, bool shared)
+{
+    pixman_image_t *old = res->image;
+
+    /* the old surfaces go before the image they point into */
+    res->image = image;
+    res->shared = shared;
+    virtio_gpu_update_scanouts(g, res);
+    pixman_image_unref(old);
+    trace_virtio_gpu_res_shared(res->resource_id, shared);
+}
+
+static void virtio_gpu_share_backing(VirtIOGPU *g,
+                                     struct virtio_gpu_simple_resource *res)
+{
+    pixman_format_code_t format = pixman_image_get_format(res->image);
+    uint32_t stride = pixman_image_get_stride(res->image);
+    size_t size = (size_t)stride * res->height;
+    uint8_t *base = res->iov[0].iov_base;
+    size_t len = 0;
+    pixman_image_t *image;
+    int i;
+
+    /* ranges of guest RAM that are adjacent in the guest are usually
+     * adjacent in QEMU's mapping, too */
+    for (i = 0; i < res->iov_cnt && len < size; i++) {
+        if (res->iov[i].iov_base != base + len) {
+            return;
+        }
+        len += res->iov[i].iov_len;
+    }
+    if (len < size || ((uintptr_t)base & 3)) {
+        return;
+    }
+
+    image = pixman_image_create_bits(format, res->width, res->height,
+                                     (uint32_t *)base, stride);
+    if (image) {
+        virtio_gpu_replace_image(g, res, image, true);
+    }
+}
+
+/*
+ * Gives @res an image of its own again, with the current contents of the
+ * backing.  Returns false if there is no memory for it.
+ */
+static bool virtio_gpu_unshare_backing(VirtIOGPU *g,
+                                       struct virtio_gpu_simple_resource *res)
+{
+    pixman_image_t *image;
+
+    image = pixman_image_create_bits(pixman_image_get_format(res->image),
+                                     res->width, res->height, NULL, 0);
+    if (!image) {
+        return false;
+    }
+    memcpy(pixman_image_get_data(image), pixman_image_get_data(res->image),
+           (size_t)pixman_image_get_stride(res->image) * res->height);
+    virtio_gpu_replace_image(g, res, image, false);
+    return true;
+}
+
 static void virtio_gpu_transfer_to_host_2d(VirtIOGPU *g,
                                            struct virtio_gpu_ctrl_command *cmd)
 {
@@ -343,6 +441,18 @@ static void virtio_gpu_transfer_to_host_2d(VirtIOGPU *g,
     bpp = (PIXMAN_FORMAT_BPP(format) + 7) / 8;
     stride = pixman_image_get_stride(res->image);
 
+    if (res->shared) {
+        if (t2d.offset == t2d.r.y * stride + t2d.r.x * bpp) {
+            /* the data is already where it is displayed from */
+            return;
+        }
+        /* the guest moves data around in the backing */
+        if (!virtio_gpu_unshare_backing(g, res)) {
+            cmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+            return;
+        }
+    }
+
     if (t2d.offset || t2d.r.x || t2d.r.y ||
         t2d.r.width != pixman_image_get_width(res->image)) {
         void *img_data = pixman_image_get_data(res->image);
@@ -616,6 +726,10 @@ virtio_gpu_resource_attach_backing(VirtIOGPU *g,
     }
 
     res->iov_cnt = ab.nr_entries;
+
+    if (virtio_gpu_shared_backing_enabled(g->conf) && res->iov_cnt) {
+        virtio_gpu_share_backing(g, res);
+    }
 }
 
 static void
@@ -635,6 +749,10 @@ virtio_gpu_resource_detach_backing(VirtIOGPU *g,
         cmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
         return;
     }
+    if (res->shared && !virtio_gpu_unshare_backing(g, res)) {
+        cmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+        return;
+    }
     virtio_gpu_cleanup_mapping(res);
 }
 
@@ -873,6 +991,8 @@ static void virtio_gpu_reset(VirtIODevice *vdev)
 
 static Property virtio_gpu_properties[] = {
     DEFINE_PROP_UINT32("max_outputs", VirtIOGPU, conf.max_outputs, 1),
+    DEFINE_PROP_BIT("shared-backing", VirtIOGPU, conf.flags,
+                    VIRTIO_GPU_FLAG_SHARED_BACKING_ENABLED, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1126,7 +1126,7 @@ static void vmsvga_update_display(void *opaque)
      */
     if (memory_region_is_logging(&s->vga.vram, DIRTY_MEMORY_VGA)) {
         vga_sync_dirty_bitmap(&s->vga);
-        dirty = memory_region_get_dirty(&s->vga.vram, 0,
+        dirty = memory_region_test_and_clear_dirty(&s->vga.vram, 0,
             surface_stride(surface) * surface_height(surface),
             DIRTY_MEMORY_VGA);
     }
@@ -1135,11 +1135,6 @@ static void vmsvga_update_display(void *opaque)
         dpy_gfx_update(s->vga.con, 0, 0,
                    surface_width(surface), surface_height(surface));
     }
-    if (dirty) {
-        memory_region_reset_dirty(&s->vga.vram, 0,
-            surface_stride(surface) * surface_height(surface),
-            DIRTY_MEMORY_VGA);
-    }
 }
 
 static void vmsvga_reset(DeviceState *dev)
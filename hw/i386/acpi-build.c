@@ -108,6 +108,7 @@ typedef struct AcpiPmInfo {
 typedef struct AcpiMiscInfo {
     bool has_hpet;
     TPMVersion tpm_version;
+    bool tpm_crb;
     const unsigned char *dsdt_code;
     unsigned dsdt_size;
     uint16_t pvpanic_port;
@@ -236,6 +237,7 @@ static void acpi_get_misc_info(AcpiMiscInfo *info)
 {
     info->has_hpet = hpet_find();
     info->tpm_version = tpm_get_version();
+    info->tpm_crb = tpm_is_crb();
     info->pvpanic_port = pvpanic_port();
     info->applesmc_io_base = applesmc_port();
 }
@@ -1326,7 +1328,16 @@ build_ssdt(GArray *table_data, GArray *linker,
                 /* Scan all PCI buses. Generate tables to support hotplug. */
                 build_append_pci_bus_devices(scope, bus, pm->pcihp_bridge_en);
 
-                if (misc->tpm_version != TPM_VERSION_UNSPEC) {
+                if (misc->tpm_version != TPM_VERSION_UNSPEC && misc->tpm_crb) {
+                    dev = aml_device("ISA.TPM");
+                    aml_append(dev, aml_name_decl("_HID", aml_string("MSFT0101")));
+                    aml_append(dev, aml_name_decl("_STA", aml_int(0xF)));
+                    crs = aml_resource_template();
+                    aml_append(crs, aml_memory32_fixed(TPM_CRB_ADDR_BASE,
+                               TPM_CRB_ADDR_SIZE, AML_READ_WRITE));
+                    aml_append(dev, aml_name_decl("_CRS", crs));
+                    aml_append(scope, dev);
+                } else if (misc->tpm_version != TPM_VERSION_UNSPEC) {
                     dev = aml_device("ISA.TPM");
                     aml_append(dev, aml_name_decl("_HID", aml_eisaid("PNP0C31")));
                     aml_append(dev, aml_name_decl("_STA", aml_int(0xF)));
@@ -1393,15 +1404,20 @@ build_tpm_tcpa(GArray *table_data, GArray *linker, GArray *tcpalog)
 }
 
 static void
-build_tpm2(GArray *table_data, GArray *linker)
+build_tpm2(GArray *table_data, GArray *linker, bool tpm_crb)
 {
     Acpi20TPM2 *tpm2_ptr;
 
     tpm2_ptr = acpi_data_push(table_data, sizeof *tpm2_ptr);
 
     tpm2_ptr->platform_class = cpu_to_le16(TPM2_ACPI_CLASS_CLIENT);
-    tpm2_ptr->control_area_address = cpu_to_le64(0);
-    tpm2_ptr->start_method = cpu_to_le32(TPM2_START_METHOD_MMIO);
+    if (tpm_crb) {
+        tpm2_ptr->control_area_address = cpu_to_le64(TPM_CRB_ADDR_CTRL);
+        tpm2_ptr->start_method = cpu_to_le32(TPM2_START_METHOD_CRB);
+    } else {
+        tpm2_ptr->control_area_address = cpu_to_le64(0);
+        tpm2_ptr->start_method = cpu_to_le32(TPM2_START_METHOD_MMIO);
+    }
 
     build_header(linker, table_data,
                  (void *)tpm2_ptr, "TPM2", sizeof(*tpm2_ptr), 4);
@@ -1725,7 +1741,7 @@ void acpi_build(PcGuestInfo *guest_info, AcpiBuildTables *tables)
 
         if (misc.tpm_version == TPM_VERSION_2_0) {
             acpi_add_table(table_offsets, tables_blob);
-            build_tpm2(tables_blob, tables->linker);
+            build_tpm2(tables_blob, tables->linker, misc.tpm_crb);
         }
     }
     if (guest_info->numa_nodes) {
@@ -580,7 +580,8 @@ static void ahci_reset_port(AHCIState *s, int port)
         return;
     }
 
-    /* reset ncq queue */
+    /* reset ncq queue; the completions that blk_aio_cancel() runs must not
+     * be reported once the port is back up, so drop their SDB too */
     for (i = 0; i < AHCI_MAX_CMDS; i++) {
         NCQTransferState *ncq_tfs = &s->dev[port].ncq_tfs[i];
         ncq_tfs->halt = false;
@@ -601,6 +602,8 @@ static void ahci_reset_port(AHCIState *s, int port)
         qemu_sglist_destroy(&ncq_tfs->sglist);
         ncq_tfs->used = 0;
     }
+    qemu_bh_cancel(d->sdb_bh);
+    d->finished = 0;
 
     s->dev[port].port_state = STATE_RUN;
     if (!ide_state->blk) {
@@ -668,9 +671,8 @@ static void ahci_unmap_clb_address(AHCIDevice *ad)
     ad->lst = NULL;
 }
 
-static void ahci_write_fis_sdb(AHCIState *s, NCQTransferState *ncq_tfs)
+static void ahci_write_fis_sdb(AHCIState *s, AHCIDevice *ad)
 {
-    AHCIDevice *ad = ncq_tfs->drive;
     AHCIPortRegs *pr = &ad->port_regs;
     IDEState *ide_state;
     SDBFIS *sdb_fis;
@@ -899,17 +901,32 @@ static void ncq_err(NCQTransferState *ncq_tfs)
     ncq_tfs->drive->port_regs.scr_err |= (1 << ncq_tfs->tag);
 }
 
+static void ahci_sdb_bh(void *opaque)
+{
+    AHCIDevice *ad = opaque;
+
+    ahci_write_fis_sdb(ad->hba, ad);
+}
+
 static void ncq_finish(NCQTransferState *ncq_tfs)
 {
+    AHCIDevice *ad = ncq_tfs->drive;
+
     /* If we didn't error out, set our finished bit. Errored commands
      * do not get a bit set for the SDB FIS ACT register, nor do they
-     * clear the outstanding bit in scr_act (PxSACT). */
-    if (!(ncq_tfs->drive->port_regs.scr_err & (1 << ncq_tfs->tag))) {
-        ncq_tfs->drive->finished |= (1 << ncq_tfs->tag);
+     * clear the outstanding bit in scr_act (PxSACT).
+     *
+     * Successful commands that complete together are reported in a single
+     * SDB FIS, and a single interrupt, from ahci_sdb_bh().  Errors go out
+     * at once, while the shadow registers still describe them. */
+    if (!(ad->port_regs.scr_err & (1 << ncq_tfs->tag))) {
+        ad->finished |= (1 << ncq_tfs->tag);
+        qemu_bh_schedule(ad->sdb_bh);
+    } else {
+        qemu_bh_cancel(ad->sdb_bh);
+        ahci_write_fis_sdb(ad->hba, ad);
     }
 
-    ahci_write_fis_sdb(ncq_tfs->drive->hba, ncq_tfs);
-
     DPRINTF(ncq_tfs->drive->port_no, "NCQ transfer tag %d finished\n",
             ncq_tfs->tag);
 
@@ -1448,12 +1465,18 @@ void ahci_init(AHCIState *s, DeviceState *qdev, AddressSpace *as, int ports)
         ad->port_no = i;
         ad->port.dma = &ad->dma;
         ad->port.dma->ops = &ahci_dma_ops;
+        ad->sdb_bh = qemu_bh_new(ahci_sdb_bh, ad);
         ide_register_restart_cb(&ad->port);
     }
 }
 
 void ahci_uninit(AHCIState *s)
 {
+    int i;
+
+    for (i = 0; i < s->ports; i++) {
+        qemu_bh_delete(s->dev[i].sdb_bh);
+    }
     g_free(s->dev);
 }
 
@@ -1584,6 +1607,11 @@ static int ahci_state_post_load(void *opaque, int version_id)
          * In the case where no error was present, busy_slot will be -1,
          * and we should check to see if there are additional commands waiting.
          */
+        if (ad->finished) {
+            /* completions that were still waiting for their SDB FIS */
+            qemu_bh_schedule(ad->sdb_bh);
+        }
+
         if (ad->busy_slot == -1) {
             check_cmd(s, i);
         } else {
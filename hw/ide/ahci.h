@@ -275,6 +275,7 @@ struct AHCIDevice {
     AHCIPortRegs port_regs;
     struct AHCIState *hba;
     QEMUBH *check_bh;
+    QEMUBH *sdb_bh;         /* reports @finished in one SDB FIS */
     uint8_t *lst;
     uint8_t *res_fis;
     bool done_atapi_packet;
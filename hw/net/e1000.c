@@ -29,6 +29,7 @@
 #include "hw/pci/pci.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/tap.h"
 #include "hw/loader.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/dma.h"
@@ -115,8 +116,12 @@ typedef struct E1000State_st {
         int8_t ip;
         int8_t tcp;
         char cptse;     // current packet tse bit
+        bool gso;       /* current TSO frame is segmented by the peer */
     } tx;
 
+    /* The peer takes and gives a struct virtio_net_hdr with every packet */
+    bool has_vnet;
+
     struct {
         uint32_t val_in;	// shifted in from guest driver
         uint16_t bitnum_in;
@@ -599,14 +604,38 @@ fcs_len(E1000State *s)
     return (s->mac_reg[RCTL] & E1000_RCTL_SECRC) ? 0 : 4;
 }
 
+/* TCP TSO frames go to a peer with vnet headers whole, so that it (e.g.
+ * the host kernel behind tap) cuts them into segments, rather than one
+ * MSS at a time from here. */
+static bool
+e1000_can_gso(E1000State *s)
+{
+    struct e1000_tx *tp = &s->tx;
+
+    return s->has_vnet && tp->tcp && tp->mss && tp->paylen > tp->mss &&
+           tp->hdr_len + tp->paylen < sizeof(tp->data) &&
+           (tp->sum_needed & E1000_TXD_POPTS_TXSM) &&
+           !(s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK);
+}
+
 static void
-e1000_send_packet(E1000State *s, const uint8_t *buf, int size)
+e1000_send_packet(E1000State *s, const struct virtio_net_hdr *vhdr,
+                  const uint8_t *buf, int size)
 {
     NetClientState *nc = qemu_get_queue(s->nic);
+    struct virtio_net_hdr no_gso = { .gso_type = VIRTIO_NET_HDR_GSO_NONE };
+    struct iovec iov[2] = {
+        { .iov_base = (void *)(vhdr ? vhdr : &no_gso),
+          .iov_len = sizeof(struct virtio_net_hdr) },
+        { .iov_base = (void *)buf, .iov_len = size },
+    };
+    int iovcnt = s->has_vnet ? 2 : 1;
+    struct iovec *sg = s->has_vnet ? iov : &iov[1];
+
     if (s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK) {
-        nc->info->receive(nc, buf, size);
+        nc->info->receive_iov(nc, sg, iovcnt);
     } else {
-        qemu_send_packet(nc, buf, size);
+        qemu_sendv_packet(nc, sg, iovcnt);
     }
 }
 
@@ -614,8 +643,9 @@ static void
 xmit_seg(E1000State *s)
 {
     uint16_t len, *sp;
-    unsigned int frames = s->tx.tso_frames, css, sofar, n;
+    unsigned int frames = s->tx.tso_frames, css, sofar, n, segs;
     struct e1000_tx *tp = &s->tx;
+    struct virtio_net_hdr vhdr;
 
     if (tp->tse && tp->cptse) {
         css = tp->ipcss;
@@ -625,15 +655,15 @@ xmit_seg(E1000State *s)
             stw_be_p(tp->data+css+2, tp->size - css);
             stw_be_p(tp->data+css+4,
                           be16_to_cpup((uint16_t *)(tp->data+css+4))+frames);
-        } else			// IPv6
-            stw_be_p(tp->data+css+4, tp->size - css);
+        } else			// IPv6: payload length, without the header
+            stw_be_p(tp->data+css+4, tp->size - css - 40);
         css = tp->tucss;
         len = tp->size - css;
         DBGOUT(TXSUM, "tcp %d tucss %d len %d\n", tp->tcp, css, len);
         if (tp->tcp) {
             sofar = frames * tp->mss;
             stl_be_p(tp->data+css+4, ldl_be_p(tp->data+css+4)+sofar); /* seq */
-            if (tp->paylen - sofar > tp->mss)
+            if (!tp->gso && tp->paylen - sofar > tp->mss)
                 tp->data[css + 13] &= ~9;		// PSH, FIN
         } else	// UDP
             stw_be_p(tp->data+css+4, len);
@@ -648,7 +678,19 @@ xmit_seg(E1000State *s)
         tp->tso_frames++;
     }
 
-    if (tp->sum_needed & E1000_TXD_POPTS_TXSM)
+    if (tp->gso) {
+        /* The TCP checksum field now holds the pseudo-header sum, which is
+         * what the peer expects of a partially checksummed packet. */
+        unsigned int vlan_len = tp->vlan_needed ? 4 : 0;
+
+        vhdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vhdr.gso_type = tp->ip ? VIRTIO_NET_HDR_GSO_TCPV4
+                               : VIRTIO_NET_HDR_GSO_TCPV6;
+        vhdr.hdr_len = tp->hdr_len + vlan_len;
+        vhdr.gso_size = tp->mss;
+        vhdr.csum_start = tp->tucss + vlan_len;
+        vhdr.csum_offset = tp->tucso - tp->tucss;
+    } else if (tp->sum_needed & E1000_TXD_POPTS_TXSM)
         putsum(tp->data, tp->size, tp->tucso, tp->tucss, tp->tucse);
     if (tp->sum_needed & E1000_TXD_POPTS_IXSM)
         putsum(tp->data, tp->size, tp->ipcso, tp->ipcss, tp->ipcse);
@@ -656,13 +698,18 @@ xmit_seg(E1000State *s)
         memmove(tp->vlan, tp->data, 4);
         memmove(tp->data, tp->data + 4, 8);
         memcpy(tp->data + 8, tp->vlan_header, 4);
-        e1000_send_packet(s, tp->vlan, tp->size + 4);
+        e1000_send_packet(s, tp->gso ? &vhdr : NULL, tp->vlan, tp->size + 4);
     } else
-        e1000_send_packet(s, tp->data, tp->size);
-    s->mac_reg[TPT]++;
-    s->mac_reg[GPTC]++;
+        e1000_send_packet(s, tp->gso ? &vhdr : NULL, tp->data, tp->size);
+    /* count what goes on the wire, also when the peer segments */
+    segs = 1;
+    if (tp->gso && tp->size > tp->hdr_len) {
+        segs = DIV_ROUND_UP(tp->size - tp->hdr_len, tp->mss);
+    }
+    s->mac_reg[TPT] += segs;
+    s->mac_reg[GPTC] += segs;
     n = s->mac_reg[TOTL];
-    if ((s->mac_reg[TOTL] += s->tx.size) < n)
+    if ((s->mac_reg[TOTL] += s->tx.size + (segs - 1) * tp->hdr_len) < n)
         s->mac_reg[TOTH]++;
 }
 
@@ -720,7 +767,10 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     }
         
     addr = le64_to_cpu(dp->buffer_addr);
-    if (tp->tse && tp->cptse) {
+    if (tp->tse && tp->cptse && tp->size == 0) {
+        tp->gso = e1000_can_gso(s);
+    }
+    if (tp->tse && tp->cptse && !tp->gso) {
         msh = tp->hdr_len + tp->mss;
         do {
             bytes = split_size;
@@ -757,6 +807,7 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
         xmit_seg(s);
     }
     tp->tso_frames = 0;
+    tp->gso = false;
     tp->sum_needed = 0;
     tp->vlan_needed = 0;
     tp->size = 0;
@@ -954,7 +1005,8 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
     uint8_t vlan_status = 0;
     uint8_t min_buf[MIN_BUF_SIZE];
     struct iovec min_iov;
-    uint8_t *filter_buf = iov->iov_base;
+    struct iovec frame_iov[64];
+    uint8_t *filter_buf;
     size_t size = iov_size(iov, iovcnt);
     size_t iov_ofs = 0;
     size_t desc_offset;
@@ -969,6 +1021,21 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
         return -1;
     }
 
+    if (s->has_vnet) {
+        /* No receive offloads are enabled in the peer, so the header
+         * carries nothing of interest */
+        size_t hdr_len = sizeof(struct virtio_net_hdr);
+
+        if (size < hdr_len) {
+            return size;
+        }
+        iovcnt = iov_copy(frame_iov, ARRAY_SIZE(frame_iov), iov, iovcnt,
+                          hdr_len, size - hdr_len);
+        iov = frame_iov;
+        size -= hdr_len;
+    }
+    filter_buf = iov->iov_base;
+
     /* Pad to minimum Ethernet frame length */
     if (size < sizeof(min_buf)) {
         iov_to_buf(iov, iovcnt, 0, min_buf, size);
@@ -1500,6 +1567,8 @@ e1000_mmio_setup(E1000State *d)
     for (i = 0; excluded_regs[i] != PNPMMIO_SIZE; i++)
         memory_region_add_coalescing(&d->mmio, excluded_regs[i] + 4,
                                      excluded_regs[i+1] - excluded_regs[i] - 4);
+    /* RDT is coalesced, and receiving stalls until it is written */
+    memory_region_set_coalescing_drain(&d->mmio);
     memory_region_init_io(&d->io, OBJECT(d), &e1000_io_ops, d, "e1000-io", IOPORT_SIZE);
 }
 
@@ -1578,6 +1647,13 @@ static void pci_e1000_realize(PCIDevice *pci_dev, Error **errp)
     d->nic = qemu_new_nic(&net_e1000_info, &d->conf,
                           object_get_typename(OBJECT(d)), dev->id, d);
 
+    d->has_vnet = qemu_has_vnet_hdr(qemu_get_queue(d->nic)->peer);
+    if (d->has_vnet) {
+        qemu_set_vnet_hdr_len(qemu_get_queue(d->nic)->peer,
+                              sizeof(struct virtio_net_hdr));
+        qemu_using_vnet_hdr(qemu_get_queue(d->nic)->peer, true);
+    }
+
     qemu_format_nic_info_str(qemu_get_queue(d->nic), macaddr);
 
     d->autoneg_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, e1000_autoneg_timer, d);
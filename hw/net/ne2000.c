@@ -646,7 +646,7 @@ const VMStateDescription vmstate_ne2000 = {
         VMSTATE_UINT8(curpag, NE2000State),
         VMSTATE_BUFFER(mult, NE2000State),
         VMSTATE_UNUSED(4), /* was irq */
-        VMSTATE_BUFFER(mem, NE2000State),
+        VMSTATE_BUFFER_LIVE(mem, NE2000State),
         VMSTATE_END_OF_LIST()
     }
 };
@@ -56,6 +56,7 @@
 #include "sysemu/dma.h"
 #include "qemu/timer.h"
 #include "net/net.h"
+#include "net/checksum.h"
 #include "hw/loader.h"
 #include "sysemu/sysemu.h"
 #include "qemu/iov.h"
@@ -2281,9 +2282,19 @@ static int rtl8139_cplus_transmit_one(RTL8139State *s)
                         "packet with %d bytes data\n", tcp_hlen +
                         chunk_size);
 
+                    /* move the payload of this frame behind the header,
+                       summing it up on the way */
+                    uint8_t *tcp_payload = (uint8_t *)p_tcp_hdr + tcp_hlen;
+                    uint32_t payload_sum;
+
                     if (tcp_send_offset)
                     {
-                        memcpy((uint8_t*)p_tcp_hdr + tcp_hlen, (uint8_t*)p_tcp_hdr + tcp_hlen + tcp_send_offset, chunk_size);
+                        payload_sum = net_checksum_add_copy(tcp_payload,
+                            tcp_payload + tcp_send_offset, chunk_size);
+                    }
+                    else
+                    {
+                        payload_sum = net_checksum_add(chunk_size, tcp_payload);
                     }
 
                     /* keep PUSH and FIN flags only for the last frame */
@@ -2300,11 +2311,13 @@ static int rtl8139_cplus_transmit_one(RTL8139State *s)
 
                     p_tcp_hdr->th_sum = 0;
 
-                    int tcp_checksum = ip_checksum(data_to_checksum, tcp_hlen + chunk_size + 12);
+                    uint16_t tcp_checksum = net_checksum_finish(
+                        net_checksum_add(tcp_hlen + 12, data_to_checksum) +
+                        payload_sum);
                     DPRINTF("+++ C+ mode TSO TCP checksum %04x\n",
                         tcp_checksum);
 
-                    p_tcp_hdr->th_sum = tcp_checksum;
+                    p_tcp_hdr->th_sum = cpu_to_be16(tcp_checksum);
 
                     /* restore IP header */
                     memcpy(eth_payload_data, saved_ip_header, hlen);
@@ -15,6 +15,7 @@
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/eth.h"
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
@@ -28,6 +29,8 @@
 #define VIRTIO_NET_VM_VERSION    11
 
 #define MAC_TABLE_ENTRIES    64
+#define MAC_HASH_BITS        7
+#define MAC_HASH_SIZE        (1 << MAC_HASH_BITS)
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
 /*
@@ -38,17 +41,19 @@
     (offsetof(container, field) + sizeof(((container *)0)->field))
 
 typedef struct VirtIOFeature {
-    uint32_t flags;
+    uint64_t flags;
     size_t end;
 } VirtIOFeature;
 
 static VirtIOFeature feature_sizes[] = {
-    {.flags = 1 << VIRTIO_NET_F_MAC,
+    {.flags = 1ULL << VIRTIO_NET_F_MAC,
      .end = endof(struct virtio_net_config, mac)},
-    {.flags = 1 << VIRTIO_NET_F_STATUS,
+    {.flags = 1ULL << VIRTIO_NET_F_STATUS,
      .end = endof(struct virtio_net_config, status)},
-    {.flags = 1 << VIRTIO_NET_F_MQ,
+    {.flags = 1ULL << VIRTIO_NET_F_MQ,
      .end = endof(struct virtio_net_config, max_virtqueue_pairs)},
+    {.flags = 1ULL << VIRTIO_NET_F_RSS,
+     .end = endof(struct virtio_net_config, supported_hash_types)},
     {}
 };
 
@@ -64,6 +69,15 @@ static int vq2q(int queue_index)
     return queue_index / 2;
 }
 
+/* The _EX hash types, which look into IPv6 extension headers for the
+ * addresses, are not supported. */
+#define VIRTIO_NET_RSS_SUPPORTED_HASHES (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv6)
+
 /* TODO
  * - we could suppress RX interrupt if we were so inclined.
  */
@@ -71,14 +85,116 @@ static int vq2q(int queue_index)
 static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
-    struct virtio_net_config netcfg;
+    struct virtio_net_config netcfg = {};
 
     virtio_stw_p(vdev, &netcfg.status, n->status);
     virtio_stw_p(vdev, &netcfg.max_virtqueue_pairs, n->max_queues);
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
+    netcfg.rss_max_key_size = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    virtio_stw_p(vdev, &netcfg.rss_max_indirection_table_length,
+                 VIRTIO_NET_RSS_MAX_TABLE_LEN);
+    virtio_stl_p(vdev, &netcfg.supported_hash_types,
+                 VIRTIO_NET_RSS_SUPPORTED_HASHES);
     memcpy(config, &netcfg, n->config_size);
 }
 
+static unsigned virtio_net_mac_hash(const uint8_t *mac)
+{
+    uint64_t v = ((uint64_t)ldl_be_p(mac) << 16) | lduw_be_p(mac + 4);
+
+    return (v * 0x9e3779b97f4a7c15ULL) >> (64 - MAC_HASH_BITS);
+}
+
+static void virtio_net_rebuild_mac_hash(VirtIONet *n)
+{
+    int i;
+
+    QEMU_BUILD_BUG_ON(MAC_HASH_SIZE < 2 * MAC_TABLE_ENTRIES);
+
+    memset(n->mac_table.hash, 0, MAC_HASH_SIZE);
+    for (i = 0; i < n->mac_table.in_use; i++) {
+        unsigned h = virtio_net_mac_hash(&n->mac_table.macs[i * ETH_ALEN]);
+
+        while (n->mac_table.hash[h]) {
+            h = (h + 1) & (MAC_HASH_SIZE - 1);
+        }
+        n->mac_table.hash[h] = i + 1;
+    }
+}
+
+/* Whether @mac is among the MAC table entries from @first to @last - 1 */
+static bool virtio_net_mac_table_find(VirtIONet *n, const uint8_t *mac,
+                                      int first, int last)
+{
+    unsigned h = virtio_net_mac_hash(mac);
+    int idx;
+
+    while ((idx = n->mac_table.hash[h]) != 0) {
+        idx--;
+        if (idx >= first && idx < last &&
+            !memcmp(mac, &n->mac_table.macs[idx * ETH_ALEN], ETH_ALEN)) {
+            return true;
+        }
+        h = (h + 1) & (MAC_HASH_SIZE - 1);
+    }
+    return false;
+}
+
+/*
+ * Passes the receive filter down to the backend, so that a tap device
+ * drops most unwanted frames before they are even read.  The host filter
+ * only has to let through a superset of what receive_filter() accepts:
+ * whenever the guest wants more than a list of addresses, it is turned
+ * off.
+ */
+static void virtio_net_update_host_filter(VirtIONet *n)
+{
+    static const uint8_t bcast[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    uint8_t *macs, *p;
+    bool allmulti = false;
+    int i;
+
+    if (!n->host_rx_filter) {
+        return;
+    }
+
+    p = macs = g_malloc((MAC_TABLE_ENTRIES + 2) * ETH_ALEN);
+    if (!n->promisc && !n->alluni && !n->mac_table.uni_overflow) {
+        /* the exact part of the host filter is short: unicast goes first */
+        if (!n->nouni) {
+            memcpy(p, n->mac, ETH_ALEN);
+            p += ETH_ALEN;
+            memcpy(p, n->mac_table.macs, n->mac_table.first_multi * ETH_ALEN);
+            p += n->mac_table.first_multi * ETH_ALEN;
+        }
+        if (!n->nobcast) {
+            memcpy(p, bcast, ETH_ALEN);
+            p += ETH_ALEN;
+        }
+        if (!n->nomulti) {
+            i = n->mac_table.in_use - n->mac_table.first_multi;
+            memcpy(p, &n->mac_table.macs[n->mac_table.first_multi * ETH_ALEN],
+                   i * ETH_ALEN);
+            p += i * ETH_ALEN;
+            allmulti = n->allmulti || n->mac_table.multi_overflow;
+        }
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        qemu_set_rx_filter(qemu_get_subqueue(n->nic, i)->peer, macs,
+                           (p - macs) / ETH_ALEN, allmulti);
+    }
+    g_free(macs);
+}
+
+/* To be called whenever the MAC address, the MAC table or the rx mode
+ * changes */
+static void virtio_net_rx_filter_changed(VirtIONet *n)
+{
+    virtio_net_rebuild_mac_hash(n);
+    virtio_net_update_host_filter(n);
+}
+
 static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -91,6 +207,7 @@ static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
         memcmp(netcfg.mac, n->mac, ETH_ALEN)) {
         memcpy(n->mac, netcfg.mac, ETH_ALEN);
         qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
+        virtio_net_rx_filter_changed(n);
     }
 }
 
@@ -152,7 +269,132 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
 }
 
-static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
+static void virtio_net_acquire(VirtIONet *n)
+{
+    if (n->ctx) {
+        aio_context_acquire(n->ctx);
+    }
+}
+
+static void virtio_net_release(VirtIONet *n)
+{
+    if (n->ctx) {
+        aio_context_release(n->ctx);
+    }
+}
+
+/* The rx and tx queues; the control queue stays in the main loop */
+static int virtio_net_dataplane_nvqs(VirtIONet *n)
+{
+    return (n->multiqueue ? n->max_queues : 1) * 2;
+}
+
+static int virtio_net_dataplane_start(VirtIONet *n)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(n)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int nvqs = virtio_net_dataplane_nvqs(n);
+    int i, r;
+
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r < 0) {
+        return r;
+    }
+
+    for (i = 0; i < nvqs; i++) {
+        r = k->set_host_notifier(qbus->parent, i, true);
+        if (r < 0) {
+            while (i--) {
+                k->set_host_notifier(qbus->parent, i, false);
+            }
+            k->set_guest_notifiers(qbus->parent, nvqs, false);
+            return r;
+        }
+    }
+
+    aio_context_acquire(n->ctx);
+    for (i = 0; i < nvqs; i++) {
+        VirtQueue *vq = virtio_get_queue(vdev, i);
+
+        virtio_queue_set_aio_context(vq, n->ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, n->ctx, true, true);
+        /* process what the guest queued before the handler was there */
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
+    n->dataplane_started = true;
+    aio_context_release(n->ctx);
+    return 0;
+}
+
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(n)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int nvqs = virtio_net_dataplane_nvqs(n);
+    int i;
+
+    aio_context_acquire(n->ctx);
+    for (i = 0; i < nvqs; i++) {
+        virtio_queue_aio_set_host_notifier_handler(virtio_get_queue(vdev, i),
+                                                   n->ctx, false, false);
+    }
+    /* Complete the packets the netdev still holds while the interrupts
+     * still go through the guest notifiers */
+    for (i = 0; i < nvqs / 2; i++) {
+        NetClientState *qnc = qemu_get_subqueue(n->nic, i);
+
+        qemu_net_queue_purge(qnc->peer->incoming_queue, qnc);
+    }
+    for (i = 0; i < nvqs; i++) {
+        virtio_queue_set_aio_context(virtio_get_queue(vdev, i), NULL);
+    }
+    n->dataplane_started = false;
+    aio_context_release(n->ctx);
+
+    for (i = 0; i < nvqs; i++) {
+        k->set_host_notifier(qbus->parent, i, false);
+    }
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+}
+
+static void virtio_net_dataplane_status(VirtIONet *n, uint8_t status)
+{
+    bool started = virtio_net_started(n, status);
+    int r;
+
+    if (!n->ctx) {
+        return;
+    }
+
+    if (!started) {
+        /* try again the next time the driver starts the device */
+        n->dataplane_disabled = false;
+        if (n->dataplane_started) {
+            virtio_net_dataplane_stop(n);
+        }
+        return;
+    }
+
+    if (n->dataplane_started || n->dataplane_disabled) {
+        return;
+    }
+    r = virtio_net_dataplane_start(n);
+    if (r < 0) {
+        error_report("virtio-net: unable to start I/O thread processing: %d",
+                     -r);
+        n->dataplane_disabled = true;
+    }
+}
+
+/* Without the notifiers set up, the queues in an I/O thread cannot work */
+static bool virtio_net_dataplane_stopped(VirtIONet *n)
+{
+    return n->ctx && !n->dataplane_started;
+}
+
+static void virtio_net_do_set_status(VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q;
@@ -160,6 +402,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     uint8_t queue_status;
 
     virtio_net_vhost_status(n, status);
+    virtio_net_dataplane_status(n, status);
 
     for (i = 0; i < n->max_queues; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
@@ -172,7 +415,8 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             queue_status = status;
         }
         queue_started =
-            virtio_net_started(n, queue_status) && !n->vhost_started;
+            virtio_net_started(n, queue_status) && !n->vhost_started &&
+            !virtio_net_dataplane_stopped(n);
 
         if (queue_started) {
             qemu_flush_queued_packets(ncs);
@@ -199,6 +443,15 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     }
 }
 
+static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+
+    virtio_net_acquire(n);
+    virtio_net_do_set_status(vdev, status);
+    virtio_net_release(n);
+}
+
 static void virtio_net_set_link_status(NetClientState *nc)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
@@ -322,6 +575,7 @@ static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
 
+    virtio_net_acquire(n);
     /* Reset back to compatibility mode */
     n->promisc = 1;
     n->allmulti = 0;
@@ -343,7 +597,10 @@ static void virtio_net_reset(VirtIODevice *vdev)
     memset(n->mac_table.macs, 0, MAC_TABLE_ENTRIES * ETH_ALEN);
     memcpy(&n->mac[0], &n->nic->conf->macaddr, sizeof(n->mac));
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
+    virtio_net_rx_filter_changed(n);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+    memset(&n->rss_data, 0, sizeof(n->rss_data));
+    virtio_net_release(n);
 }
 
 static void peer_test_vnet_hdr(VirtIONet *n)
@@ -406,6 +663,12 @@ static int peer_attach(VirtIONet *n, int index)
         return 0;
     }
 
+    if (nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        /* A failure means the slave is gone; the setting is applied again
+         * when it comes back. */
+        vhost_set_vring_enable(nc->peer, 1);
+    }
+
     if (nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
         return 0;
     }
@@ -421,6 +684,10 @@ static int peer_detach(VirtIONet *n, int index)
         return 0;
     }
 
+    if (nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        vhost_set_vring_enable(nc->peer, 0);
+    }
+
     if (nc->peer->info->type !=  NET_CLIENT_OPTIONS_KIND_TAP) {
         return 0;
     }
@@ -474,9 +741,17 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_UFO);
     }
 
+    /* RSS is configured through the control queue */
+    if (!virtio_has_feature(features, VIRTIO_NET_F_CTRL_VQ)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+    }
+
     if (!get_vhost_net(nc->peer)) {
         return features;
     }
+
+    /* vhost backends pick the receive queue themselves */
+    virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
     return vhost_net_get_features(get_vhost_net(nc->peer), features);
 }
 
@@ -587,6 +862,7 @@ static int virtio_net_handle_rx_mode(VirtIONet *n, uint8_t cmd,
         return VIRTIO_NET_ERR;
     }
 
+    virtio_net_rx_filter_changed(n);
     rxfilter_notify(nc);
 
     return VIRTIO_NET_OK;
@@ -644,6 +920,7 @@ static int virtio_net_handle_mac(VirtIONet *n, uint8_t cmd,
         s = iov_to_buf(iov, iov_cnt, 0, &n->mac, sizeof(n->mac));
         assert(s == sizeof(n->mac));
         qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
+        virtio_net_rx_filter_changed(n);
         rxfilter_notify(nc);
 
         return VIRTIO_NET_OK;
@@ -716,6 +993,7 @@ static int virtio_net_handle_mac(VirtIONet *n, uint8_t cmd,
     n->mac_table.multi_overflow = multi_overflow;
     memcpy(n->mac_table.macs, macs, MAC_TABLE_ENTRIES * ETH_ALEN);
     g_free(macs);
+    virtio_net_rx_filter_changed(n);
     rxfilter_notify(nc);
 
     return VIRTIO_NET_OK;
@@ -771,6 +1049,103 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+static void virtio_net_set_curr_queues(VirtIONet *n, uint16_t queues)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    n->curr_queues = queues;
+    /* stop the backend before changing the number of queues to avoid handling a
+     * disabled queue */
+    virtio_net_set_status(vdev, vdev->status);
+    virtio_net_set_queues(n);
+}
+
+static int virtio_net_handle_rss(VirtIONet *n, struct iovec *iov,
+                                 unsigned int iov_cnt)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    struct {
+        uint32_t hash_types;
+        uint16_t indirection_table_mask;
+        uint16_t unclassified_queue;
+    } QEMU_PACKED cfg;
+    struct {
+        uint16_t max_tx_vq;
+        uint8_t hash_key_length;
+    } QEMU_PACKED tail;
+    uint16_t indirections[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE] = {};
+    uint16_t queues, default_queue;
+    size_t s, offset = 0;
+    unsigned int i, len;
+
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_NET_F_RSS)) {
+        return VIRTIO_NET_ERR;
+    }
+
+    s = iov_to_buf(iov, iov_cnt, offset, &cfg, sizeof(cfg));
+    if (s != sizeof(cfg)) {
+        return VIRTIO_NET_ERR;
+    }
+    offset += s;
+
+    len = virtio_lduw_p(vdev, &cfg.indirection_table_mask) + 1;
+    if (len > VIRTIO_NET_RSS_MAX_TABLE_LEN || (len & (len - 1))) {
+        return VIRTIO_NET_ERR;
+    }
+    s = iov_to_buf(iov, iov_cnt, offset, indirections,
+                   len * sizeof(indirections[0]));
+    if (s != len * sizeof(indirections[0])) {
+        return VIRTIO_NET_ERR;
+    }
+    offset += s;
+
+    s = iov_to_buf(iov, iov_cnt, offset, &tail, sizeof(tail));
+    if (s != sizeof(tail)) {
+        return VIRTIO_NET_ERR;
+    }
+    offset += s;
+
+    queues = virtio_lduw_p(vdev, &tail.max_tx_vq);
+    if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+        queues > (n->multiqueue ? n->max_queues : 1)) {
+        return VIRTIO_NET_ERR;
+    }
+
+    default_queue = virtio_lduw_p(vdev, &cfg.unclassified_queue);
+    if (default_queue >= queues) {
+        return VIRTIO_NET_ERR;
+    }
+    for (i = 0; i < len; i++) {
+        indirections[i] = virtio_lduw_p(vdev, &indirections[i]);
+        if (indirections[i] >= queues) {
+            return VIRTIO_NET_ERR;
+        }
+    }
+
+    if (tail.hash_key_length > VIRTIO_NET_RSS_MAX_KEY_SIZE) {
+        return VIRTIO_NET_ERR;
+    }
+    s = iov_to_buf(iov, iov_cnt, offset, key, tail.hash_key_length);
+    if (s != tail.hash_key_length) {
+        return VIRTIO_NET_ERR;
+    }
+
+    n->rss_data.enabled = true;
+    n->rss_data.hash_types = virtio_ldl_p(vdev, &cfg.hash_types);
+    n->rss_data.default_queue = default_queue;
+    n->rss_data.indirections_len = len;
+    memcpy(n->rss_data.indirections, indirections,
+           len * sizeof(indirections[0]));
+    memcpy(n->rss_data.key, key, sizeof(key));
+
+    if (queues != n->curr_queues) {
+        virtio_net_set_curr_queues(n, queues);
+    }
+
+    return VIRTIO_NET_OK;
+}
+
 static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
                                 struct iovec *iov, unsigned int iov_cnt)
 {
@@ -779,6 +1154,10 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     size_t s;
     uint16_t queues;
 
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG) {
+        return virtio_net_handle_rss(n, iov, iov_cnt);
+    }
+
     s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
     if (s != sizeof(mq)) {
         return VIRTIO_NET_ERR;
@@ -797,11 +1176,9 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
         return VIRTIO_NET_ERR;
     }
 
-    n->curr_queues = queues;
-    /* stop the backend before changing the number of queues to avoid handling a
-     * disabled queue */
-    virtio_net_set_status(vdev, vdev->status);
-    virtio_net_set_queues(n);
+    /* back to steering by the queue the packet came from */
+    n->rss_data.enabled = false;
+    virtio_net_set_curr_queues(n, queues);
 
     return VIRTIO_NET_OK;
 }
@@ -815,6 +1192,8 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
 
+    /* the commands change state that the I/O thread uses */
+    virtio_net_acquire(n);
     while (virtqueue_pop(vq, &elem)) {
         if (iov_size(elem.in_sg, elem.in_num) < sizeof(status) ||
             iov_size(elem.out_sg, elem.out_num) < sizeof(ctrl)) {
@@ -845,10 +1224,11 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         s = iov_from_buf(elem.in_sg, elem.in_num, 0, &status, sizeof(status));
         assert(s == sizeof(status));
 
-        virtqueue_push(vq, &elem, sizeof(status));
-        virtio_notify(vdev, vq);
+        virtqueue_push_deferred(vq, &elem, sizeof(status));
         g_free(iov2);
     }
+    virtqueue_flush_deferred(vq);
+    virtio_net_release(n);
 }
 
 /* RX */
@@ -857,8 +1237,19 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    int i;
 
-    qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+    virtio_net_acquire(n);
+    if (!n->rss_data.enabled) {
+        qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+    } else {
+        /* With RSS, the packets waiting for this queue may have been queued
+         * on the net client of any other queue. */
+        for (i = 0; i < n->curr_queues; i++) {
+            qemu_flush_queued_packets(qemu_get_subqueue(n->nic, i));
+        }
+    }
+    virtio_net_release(n);
 }
 
 static int virtio_net_can_receive(NetClientState *nc)
@@ -867,7 +1258,7 @@ static int virtio_net_can_receive(NetClientState *nc)
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
 
-    if (!vdev->vm_running) {
+    if (!vdev->vm_running || virtio_net_dataplane_stopped(n)) {
         return 0;
     }
 
@@ -965,7 +1356,6 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     static const uint8_t bcast[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
     static const uint8_t vlan[] = {0x81, 0x00};
     uint8_t *ptr = (uint8_t *)buf;
-    int i;
 
     if (n->promisc)
         return 1;
@@ -987,10 +1377,9 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
             return 1;
         }
 
-        for (i = n->mac_table.first_multi; i < n->mac_table.in_use; i++) {
-            if (!memcmp(ptr, &n->mac_table.macs[i * ETH_ALEN], ETH_ALEN)) {
-                return 1;
-            }
+        if (virtio_net_mac_table_find(n, ptr, n->mac_table.first_multi,
+                                      n->mac_table.in_use)) {
+            return 1;
         }
     } else { // unicast
         if (n->nouni) {
@@ -1001,39 +1390,50 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
             return 1;
         }
 
-        for (i = 0; i < n->mac_table.first_multi; i++) {
-            if (!memcmp(ptr, &n->mac_table.macs[i * ETH_ALEN], ETH_ALEN)) {
-                return 1;
-            }
+        if (virtio_net_mac_table_find(n, ptr, 0, n->mac_table.first_multi)) {
+            return 1;
         }
     }
 
     return 0;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
+                                     size_t size)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     struct iovec mhdr_sg[VIRTQUEUE_MAX_SIZE];
     struct virtio_net_hdr_mrg_rxbuf mhdr;
-    unsigned mhdr_cnt = 0;
+    unsigned mhdr_cnt;
     size_t offset, i, guest_offset;
+    /* hdr_len refers to the header we supply to the guest */
+    size_t bufsize = size + n->guest_hdr_len - n->host_hdr_len;
+    /*
+     * Counting the mergeable buffers up front walks the same descriptor
+     * chains that virtqueue_pop() walks right afterwards, and updates the
+     * notification state for every packet.  On split rings, just pop what
+     * the packet needs; should the ring run dry halfway, the buffers are
+     * given back and the packet takes the careful path.
+     */
+    bool optimistic = n->mergeable_rx_bufs &&
+                      !virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED);
 
     if (!virtio_net_can_receive(nc)) {
         return -1;
     }
 
-    /* hdr_len refers to the header we supply to the guest */
-    if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - n->host_hdr_len)) {
+    if (!optimistic && !virtio_net_has_buffers(q, bufsize)) {
         return 0;
     }
 
     if (!receive_filter(n, buf, size))
         return size;
 
+retry:
     offset = i = 0;
+    mhdr_cnt = 0;
 
     while (offset < size) {
         VirtQueueElement elem;
@@ -1043,6 +1443,14 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         total = 0;
 
         if (virtqueue_pop(q->rx_vq, &elem) == 0) {
+            if (optimistic) {
+                virtqueue_unpop_deferred(q->rx_vq, i);
+                optimistic = false;
+                if (!virtio_net_has_buffers(q, bufsize)) {
+                    return 0;
+                }
+                goto retry;
+            }
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -1091,7 +1499,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, &elem, total, i++);
+        virtqueue_fill_deferred(q->rx_vq, &elem, total, i++);
     }
 
     if (mhdr_cnt) {
@@ -1101,12 +1509,143 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (optimistic && virtio_queue_get_notification(q->rx_vq)) {
+        /* the guest refilled the ring after it ran dry */
+        virtio_queue_set_notification(q->rx_vq, 0);
+    }
+
+    /* Backends such as tap deliver a burst of packets from one wakeup;
+     * the guest learns about all of them with a single used index update
+     * and interrupt, once the burst is over. */
+    virtqueue_flush_later(q->rx_vq, i);
 
     return size;
 }
 
+/*
+ * Copies the source and destination addresses, followed by the source and
+ * destination ports if the hash types of the packet cover them, into
+ * @input.  Returns the length of the hash input, or 0 if the packet goes
+ * to the unclassified queue.
+ */
+static size_t virtio_net_rss_input(VirtIONet *n, const uint8_t *buf,
+                                   size_t size, uint8_t *input)
+{
+    uint32_t types = n->rss_data.hash_types;
+    uint32_t ip_type, tcp_type, udp_type;
+    size_t l3off, l4off, addr_len;
+    bool has_ports = true;
+    uint8_t l4proto;
+
+    if (size < ETH_MAX_L2_HDR_LEN) {
+        return 0;
+    }
+    l3off = eth_get_l2_hdr_length(buf);
+
+    switch (lduw_be_p(buf + l3off - 2)) {
+    case ETH_P_IP: {
+        const struct ip_header *ip = (const struct ip_header *)(buf + l3off);
+
+        if (size < l3off + sizeof(*ip) ||
+            IP_HDR_GET_LEN(ip) < sizeof(*ip)) {
+            return 0;
+        }
+        ip_type = VIRTIO_NET_RSS_HASH_TYPE_IPv4;
+        tcp_type = VIRTIO_NET_RSS_HASH_TYPE_TCPv4;
+        udp_type = VIRTIO_NET_RSS_HASH_TYPE_UDPv4;
+        addr_len = 2 * sizeof(ip->ip_src);
+        memcpy(input, &ip->ip_src, addr_len);
+
+        l4proto = ip->ip_p;
+        l4off = l3off + IP_HDR_GET_LEN(ip);
+        if (lduw_be_p(&ip->ip_off) & (IP_MF | IP_OFFMASK)) {
+            has_ports = false;
+        }
+        break;
+    }
+    case ETH_P_IPV6: {
+        const struct ip6_header *ip6 =
+            (const struct ip6_header *)(buf + l3off);
+
+        if (size < l3off + sizeof(*ip6)) {
+            return 0;
+        }
+        ip_type = VIRTIO_NET_RSS_HASH_TYPE_IPv6;
+        tcp_type = VIRTIO_NET_RSS_HASH_TYPE_TCPv6;
+        udp_type = VIRTIO_NET_RSS_HASH_TYPE_UDPv6;
+        addr_len = 2 * sizeof(ip6->ip6_src);
+        memcpy(input, &ip6->ip6_src, addr_len);
+
+        l4proto = ip6->ip6_nxt;
+        l4off = l3off + sizeof(*ip6);
+        while (has_ports) {
+            if (l4proto == IP6_HOP_BY_HOP || l4proto == IP6_ROUTING ||
+                l4proto == IP6_DESTINATON) {
+                if (size < l4off + sizeof(struct ip6_ext_hdr)) {
+                    has_ports = false;
+                    break;
+                }
+                l4proto = buf[l4off];
+                l4off += (buf[l4off + 1] + 1) * IP6_EXT_GRANULARITY;
+            } else if (l4proto == IP6_FRAGMENT) {
+                /* only unfragmented packets carry the ports in each packet
+                 * of the flow */
+                has_ports = false;
+            } else {
+                break;
+            }
+        }
+        break;
+    }
+    default:
+        return 0;
+    }
+
+    /* both TCP and UDP headers start with the source and destination port */
+    if (has_ports && size >= l4off + 4 &&
+        ((l4proto == IP_PROTO_TCP && (types & tcp_type)) ||
+         (l4proto == IP_PROTO_UDP && (types & udp_type)))) {
+        memcpy(input + addr_len, buf + l4off, 4);
+        return addr_len + 4;
+    }
+
+    return (types & ip_type) ? addr_len : 0;
+}
+
+static int virtio_net_rss_queue(VirtIONet *n, const uint8_t *buf, size_t size)
+{
+    /* two IPv6 addresses and two ports */
+    uint8_t input[VIRTIO_NET_RSS_MAX_KEY_SIZE - 4];
+    uint32_t hash;
+    size_t len;
+
+    len = virtio_net_rss_input(n, buf + n->host_hdr_len,
+                               size - n->host_hdr_len, input);
+    if (!len) {
+        return n->rss_data.default_queue;
+    }
+
+    hash = net_toeplitz_hash(n->rss_data.key, input, len);
+    return n->rss_data.indirections[hash & (n->rss_data.indirections_len - 1)];
+}
+
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+
+    if (n->rss_data.enabled && size > n->host_hdr_len) {
+        int index = virtio_net_rss_queue(n, buf, size);
+
+        /* the queues may have been cut down since the configuration */
+        if (index != nc->queue_index && index < n->curr_queues) {
+            nc = qemu_get_subqueue(n->nic, index);
+        }
+    }
+
+    return virtio_net_do_receive(nc, buf, size);
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -1196,20 +1735,22 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
                                       out_sg, out_num, virtio_net_tx_complete);
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
+            virtqueue_element_copy(&q->async_tx.elem, &elem);
             q->async_tx.len  = len;
+            virtqueue_flush_deferred(q->tx_vq);
             return -EBUSY;
         }
 
         len += ret;
 drop:
-        virtqueue_push(q->tx_vq, &elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        /* the whole burst is published at once, below */
+        virtqueue_push_deferred(q->tx_vq, &elem, 0);
 
         if (++num_packets >= n->tx_burst) {
             break;
         }
     }
+    virtqueue_flush_deferred(q->tx_vq);
     return num_packets;
 }
 
@@ -1219,7 +1760,7 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
     /* This happens when device was stopped but VCPU wasn't. */
-    if (!vdev->vm_running) {
+    if (!vdev->vm_running || virtio_net_dataplane_stopped(n)) {
         q->tx_waiting = 1;
         return;
     }
@@ -1247,7 +1788,7 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
     }
     q->tx_waiting = 1;
     /* This happens when device was stopped but VCPU wasn't. */
-    if (!vdev->vm_running) {
+    if (!vdev->vm_running || virtio_net_dataplane_stopped(n)) {
         return;
     }
     virtio_queue_set_notification(vq, 0);
@@ -1260,7 +1801,7 @@ static void virtio_net_tx_timer(void *opaque)
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     /* This happens when device was stopped but BH wasn't. */
-    if (!vdev->vm_running) {
+    if (!vdev->vm_running || virtio_net_dataplane_stopped(n)) {
         /* Make sure tx waiting is set, so we'll run when restarted. */
         assert(q->tx_waiting);
         return;
@@ -1285,7 +1826,7 @@ static void virtio_net_tx_bh(void *opaque)
     int32_t ret;
 
     /* This happens when device was stopped but BH wasn't. */
-    if (!vdev->vm_running) {
+    if (!vdev->vm_running || virtio_net_dataplane_stopped(n)) {
         /* Make sure tx waiting is set, so we'll run when restarted. */
         assert(q->tx_waiting);
         return;
@@ -1325,18 +1866,20 @@ static void virtio_net_tx_bh(void *opaque)
 static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    AioContext *ctx = n->ctx ?: qemu_get_aio_context();
 
     n->vqs[index].rx_vq = virtio_add_queue(vdev, 256, virtio_net_handle_rx);
     if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
         n->vqs[index].tx_vq =
             virtio_add_queue(vdev, 256, virtio_net_handle_tx_timer);
-        n->vqs[index].tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
-                                              virtio_net_tx_timer,
-                                              &n->vqs[index]);
+        n->vqs[index].tx_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL,
+                                               SCALE_NS, virtio_net_tx_timer,
+                                               &n->vqs[index]);
     } else {
         n->vqs[index].tx_vq =
             virtio_add_queue(vdev, 256, virtio_net_handle_tx_bh);
-        n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
+        n->vqs[index].tx_bh = aio_bh_new(ctx, virtio_net_tx_bh,
+                                         &n->vqs[index]);
     }
 
     n->vqs[index].tx_waiting = 0;
@@ -1447,6 +1990,17 @@ static void virtio_net_save_device(VirtIODevice *vdev, QEMUFile *f)
         }
     }
 
+    if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS)) {
+        qemu_put_byte(f, n->rss_data.enabled);
+        qemu_put_be32(f, n->rss_data.hash_types);
+        qemu_put_be16(f, n->rss_data.default_queue);
+        qemu_put_be16(f, n->rss_data.indirections_len);
+        for (i = 0; i < n->rss_data.indirections_len; i++) {
+            qemu_put_be16(f, n->rss_data.indirections[i]);
+        }
+        qemu_put_buffer(f, n->rss_data.key, VIRTIO_NET_RSS_MAX_KEY_SIZE);
+    }
+
     if (virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_GUEST_OFFLOADS)) {
         qemu_put_be64(f, n->curr_guest_offloads);
     }
@@ -1579,6 +2133,36 @@ static int virtio_net_load_device(VirtIODevice *vdev, QEMUFile *f,
         }
     }
 
+    if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS)) {
+        unsigned int len;
+
+        n->rss_data.enabled = qemu_get_byte(f);
+        n->rss_data.hash_types = qemu_get_be32(f);
+        n->rss_data.default_queue = qemu_get_be16(f);
+        len = qemu_get_be16(f);
+        if (len > VIRTIO_NET_RSS_MAX_TABLE_LEN || (len & (len - 1)) ||
+            (n->rss_data.enabled && !len)) {
+            error_report("virtio-net: invalid RSS indirection table size %u",
+                         len);
+            return -1;
+        }
+        n->rss_data.indirections_len = len;
+        for (i = 0; i < len; i++) {
+            n->rss_data.indirections[i] = qemu_get_be16(f);
+            if (n->rss_data.indirections[i] >= n->max_queues) {
+                error_report("virtio-net: invalid RSS queue %u",
+                             n->rss_data.indirections[i]);
+                return -1;
+            }
+        }
+        if (n->rss_data.default_queue >= n->max_queues) {
+            error_report("virtio-net: invalid RSS queue %u",
+                         n->rss_data.default_queue);
+            return -1;
+        }
+        qemu_get_buffer(f, n->rss_data.key, VIRTIO_NET_RSS_MAX_KEY_SIZE);
+    }
+
     virtio_net_set_queues(n);
 
     /* Find the first multicast entry in the saved MAC filter */
@@ -1588,6 +2172,7 @@ static int virtio_net_load_device(VirtIODevice *vdev, QEMUFile *f,
         }
     }
     n->mac_table.first_multi = i;
+    virtio_net_rx_filter_changed(n);
 
     /* nc.link_down can't be migrated, so infer link_down according
      * to link status bit in n->status */
@@ -1659,6 +2244,29 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     NetClientState *nc;
     int i;
 
+    if (n->iothread) {
+        BusState *qbus = BUS(qdev_get_parent_bus(dev));
+        VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+
+        if (!k->set_guest_notifiers || !k->set_host_notifier) {
+            error_setg(errp, "device is incompatible with iothread "
+                       "(transport does not support notifiers)");
+            return;
+        }
+        n->ctx = iothread_get_aio_context(n->iothread);
+    }
+    /* The netdev and the device must run their halves of the packet path
+     * in the same thread */
+    for (i = 0; i < n->nic_conf.peers.queues; i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+        if (peer && peer->ctx != n->ctx) {
+            error_setg(errp, "netdev '%s' must use the same iothread as "
+                       "the device", peer->name);
+            return;
+        }
+    }
+
     virtio_net_set_config_size(n, n->host_features);
     virtio_init(vdev, "virtio-net", VIRTIO_ID_NET, n->config_size);
 
@@ -1722,6 +2330,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     n->promisc = 1; /* for compatibility */
 
     n->mac_table.macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
+    n->mac_table.hash = g_malloc0(MAC_HASH_SIZE);
 
     n->vlans = g_malloc0(MAX_VLAN >> 3);
 
@@ -1749,7 +2358,16 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     g_free(n->netclient_type);
     n->netclient_type = NULL;
 
+    if (n->host_rx_filter) {
+        /* do not leave a filter behind on a persistent tap */
+        for (i = 0; i < n->max_queues; i++) {
+            qemu_set_rx_filter(qemu_get_subqueue(n->nic, i)->peer, NULL, 0,
+                               false);
+        }
+    }
+
     g_free(n->mac_table.macs);
+    g_free(n->mac_table.hash);
     g_free(n->vlans);
 
     max_queues = n->multiqueue ? n->max_queues : 1;
@@ -1773,56 +2391,63 @@ static void virtio_net_instance_init(Object *obj)
      * Can be overriden with virtio_net_set_config_size.
      */
     n->config_size = sizeof(struct virtio_net_config);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&n->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
     device_add_bootindex_property(obj, &n->nic_conf.bootindex,
                                   "bootindex", "/ethernet-phy@0",
                                   DEVICE(n), NULL);
 }
 
 static Property virtio_net_properties[] = {
-    DEFINE_PROP_BIT("csum", VirtIONet, host_features, VIRTIO_NET_F_CSUM, true),
-    DEFINE_PROP_BIT("guest_csum", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_CSUM, true),
-    DEFINE_PROP_BIT("gso", VirtIONet, host_features, VIRTIO_NET_F_GSO, true),
-    DEFINE_PROP_BIT("guest_tso4", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_TSO4, true),
-    DEFINE_PROP_BIT("guest_tso6", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_TSO6, true),
-    DEFINE_PROP_BIT("guest_ecn", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_ECN, true),
-    DEFINE_PROP_BIT("guest_ufo", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_UFO, true),
-    DEFINE_PROP_BIT("guest_announce", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_ANNOUNCE, true),
-    DEFINE_PROP_BIT("host_tso4", VirtIONet, host_features,
-                    VIRTIO_NET_F_HOST_TSO4, true),
-    DEFINE_PROP_BIT("host_tso6", VirtIONet, host_features,
-                    VIRTIO_NET_F_HOST_TSO6, true),
-    DEFINE_PROP_BIT("host_ecn", VirtIONet, host_features,
-                    VIRTIO_NET_F_HOST_ECN, true),
-    DEFINE_PROP_BIT("host_ufo", VirtIONet, host_features,
-                    VIRTIO_NET_F_HOST_UFO, true),
-    DEFINE_PROP_BIT("mrg_rxbuf", VirtIONet, host_features,
-                    VIRTIO_NET_F_MRG_RXBUF, true),
-    DEFINE_PROP_BIT("status", VirtIONet, host_features,
-                    VIRTIO_NET_F_STATUS, true),
-    DEFINE_PROP_BIT("ctrl_vq", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_VQ, true),
-    DEFINE_PROP_BIT("ctrl_rx", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_RX, true),
-    DEFINE_PROP_BIT("ctrl_vlan", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_VLAN, true),
-    DEFINE_PROP_BIT("ctrl_rx_extra", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_RX_EXTRA, true),
-    DEFINE_PROP_BIT("ctrl_mac_addr", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_MAC_ADDR, true),
-    DEFINE_PROP_BIT("ctrl_guest_offloads", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, true),
-    DEFINE_PROP_BIT("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("csum", VirtIONet, host_features,
+                      VIRTIO_NET_F_CSUM, true),
+    DEFINE_PROP_BIT64("guest_csum", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_CSUM, true),
+    DEFINE_PROP_BIT64("gso", VirtIONet, host_features, VIRTIO_NET_F_GSO, true),
+    DEFINE_PROP_BIT64("guest_tso4", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_TSO4, true),
+    DEFINE_PROP_BIT64("guest_tso6", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_TSO6, true),
+    DEFINE_PROP_BIT64("guest_ecn", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_ECN, true),
+    DEFINE_PROP_BIT64("guest_ufo", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_UFO, true),
+    DEFINE_PROP_BIT64("guest_announce", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_ANNOUNCE, true),
+    DEFINE_PROP_BIT64("host_tso4", VirtIONet, host_features,
+                      VIRTIO_NET_F_HOST_TSO4, true),
+    DEFINE_PROP_BIT64("host_tso6", VirtIONet, host_features,
+                      VIRTIO_NET_F_HOST_TSO6, true),
+    DEFINE_PROP_BIT64("host_ecn", VirtIONet, host_features,
+                      VIRTIO_NET_F_HOST_ECN, true),
+    DEFINE_PROP_BIT64("host_ufo", VirtIONet, host_features,
+                      VIRTIO_NET_F_HOST_UFO, true),
+    DEFINE_PROP_BIT64("mrg_rxbuf", VirtIONet, host_features,
+                      VIRTIO_NET_F_MRG_RXBUF, true),
+    DEFINE_PROP_BIT64("status", VirtIONet, host_features,
+                      VIRTIO_NET_F_STATUS, true),
+    DEFINE_PROP_BIT64("ctrl_vq", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_VQ, true),
+    DEFINE_PROP_BIT64("ctrl_rx", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_RX, true),
+    DEFINE_PROP_BIT64("ctrl_vlan", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_VLAN, true),
+    DEFINE_PROP_BIT64("ctrl_rx_extra", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_RX_EXTRA, true),
+    DEFINE_PROP_BIT64("ctrl_mac_addr", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_MAC_ADDR, true),
+    DEFINE_PROP_BIT64("ctrl_guest_offloads", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, true),
+    DEFINE_PROP_BIT64("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("rss", VirtIONet, host_features, VIRTIO_NET_F_RSS, false),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                        TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_BOOL("host_rx_filter", VirtIONet, host_rx_filter, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -674,6 +674,15 @@ vmxnet3_pop_next_tx_descr(VMXNET3State *s,
     return false;
 }
 
+/*
+ * The guest queues are spread over the queues of the backend, so that each
+ * queue pair of a multiqueue tap carries its own flows.
+ */
+static inline int vmxnet3_nic_queues(VMXNET3State *s)
+{
+    return MAX(1, s->conf.peers.queues);
+}
+
 static bool
 vmxnet3_send_packet(VMXNET3State *s, uint32_t qidx)
 {
@@ -688,7 +697,8 @@ vmxnet3_send_packet(VMXNET3State *s, uint32_t qidx)
     vmxnet3_dump_virt_hdr(vmxnet_tx_pkt_get_vhdr(s->tx_pkt));
     vmxnet_tx_pkt_dump(s->tx_pkt);
 
-    if (!vmxnet_tx_pkt_send(s->tx_pkt, qemu_get_queue(s->nic))) {
+    if (!vmxnet_tx_pkt_send(s->tx_pkt,
+            qemu_get_subqueue(s->nic, qidx % vmxnet3_nic_queues(s)))) {
         status = VMXNET3_PKT_STATUS_DISCARD;
         goto func_exit;
     }
@@ -792,23 +802,22 @@ vmxnet3_revert_rxc_descr(VMXNET3State *s, int qidx)
     vmxnet3_dec_rx_completion_counter(s, qidx);
 }
 
-#define RXQ_IDX      (0)
 #define RX_HEAD_BODY_RING (0)
 #define RX_BODY_ONLY_RING (1)
 
 static bool
-vmxnet3_get_next_head_rx_descr(VMXNET3State *s,
+vmxnet3_get_next_head_rx_descr(VMXNET3State *s, int qidx,
                                struct Vmxnet3_RxDesc *descr_buf,
                                uint32_t *descr_idx,
                                uint32_t *ridx)
 {
     for (;;) {
         uint32_t ring_gen;
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING,
+        vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING,
                                    descr_buf, descr_idx);
 
         /* If no more free descriptors - return */
-        ring_gen = vmxnet3_get_rx_ring_gen(s, RXQ_IDX, RX_HEAD_BODY_RING);
+        ring_gen = vmxnet3_get_rx_ring_gen(s, qidx, RX_HEAD_BODY_RING);
         if (descr_buf->gen != ring_gen) {
             return false;
         }
@@ -816,11 +825,11 @@ vmxnet3_get_next_head_rx_descr(VMXNET3State *s,
         /* Only read after generation field verification */
         smp_rmb();
         /* Re-read to be sure we got the latest version */
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING,
+        vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING,
                                    descr_buf, descr_idx);
 
         /* Mark current descriptor as used/skipped */
-        vmxnet3_inc_rx_consumption_counter(s, RXQ_IDX, RX_HEAD_BODY_RING);
+        vmxnet3_inc_rx_consumption_counter(s, qidx, RX_HEAD_BODY_RING);
 
         /* If this is what we are looking for - return */
         if (descr_buf->btype == VMXNET3_RXD_BTYPE_HEAD) {
@@ -831,21 +840,21 @@ vmxnet3_get_next_head_rx_descr(VMXNET3State *s,
 }
 
 static bool
-vmxnet3_get_next_body_rx_descr(VMXNET3State *s,
+vmxnet3_get_next_body_rx_descr(VMXNET3State *s, int qidx,
                                struct Vmxnet3_RxDesc *d,
                                uint32_t *didx,
                                uint32_t *ridx)
 {
-    vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING, d, didx);
+    vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING, d, didx);
 
     /* Try to find corresponding descriptor in head/body ring */
-    if (d->gen == vmxnet3_get_rx_ring_gen(s, RXQ_IDX, RX_HEAD_BODY_RING)) {
+    if (d->gen == vmxnet3_get_rx_ring_gen(s, qidx, RX_HEAD_BODY_RING)) {
         /* Only read after generation field verification */
         smp_rmb();
         /* Re-read to be sure we got the latest version */
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING, d, didx);
+        vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING, d, didx);
         if (d->btype == VMXNET3_RXD_BTYPE_BODY) {
-            vmxnet3_inc_rx_consumption_counter(s, RXQ_IDX, RX_HEAD_BODY_RING);
+            vmxnet3_inc_rx_consumption_counter(s, qidx, RX_HEAD_BODY_RING);
             *ridx = RX_HEAD_BODY_RING;
             return true;
         }
@@ -855,17 +864,17 @@ vmxnet3_get_next_body_rx_descr(VMXNET3State *s,
      * If there is no free descriptors on head/body ring or next free
      * descriptor is a head descriptor switch to body only ring
      */
-    vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_BODY_ONLY_RING, d, didx);
+    vmxnet3_read_next_rx_descr(s, qidx, RX_BODY_ONLY_RING, d, didx);
 
     /* If no more free descriptors - return */
-    if (d->gen == vmxnet3_get_rx_ring_gen(s, RXQ_IDX, RX_BODY_ONLY_RING)) {
+    if (d->gen == vmxnet3_get_rx_ring_gen(s, qidx, RX_BODY_ONLY_RING)) {
         /* Only read after generation field verification */
         smp_rmb();
         /* Re-read to be sure we got the latest version */
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_BODY_ONLY_RING, d, didx);
+        vmxnet3_read_next_rx_descr(s, qidx, RX_BODY_ONLY_RING, d, didx);
         assert(d->btype == VMXNET3_RXD_BTYPE_BODY);
         *ridx = RX_BODY_ONLY_RING;
-        vmxnet3_inc_rx_consumption_counter(s, RXQ_IDX, RX_BODY_ONLY_RING);
+        vmxnet3_inc_rx_consumption_counter(s, qidx, RX_BODY_ONLY_RING);
         return true;
     }
 
@@ -873,15 +882,17 @@ vmxnet3_get_next_body_rx_descr(VMXNET3State *s,
 }
 
 static inline bool
-vmxnet3_get_next_rx_descr(VMXNET3State *s, bool is_head,
+vmxnet3_get_next_rx_descr(VMXNET3State *s, int qidx, bool is_head,
                           struct Vmxnet3_RxDesc *descr_buf,
                           uint32_t *descr_idx,
                           uint32_t *ridx)
 {
     if (is_head || !s->rx_packets_compound) {
-        return vmxnet3_get_next_head_rx_descr(s, descr_buf, descr_idx, ridx);
+        return vmxnet3_get_next_head_rx_descr(s, qidx, descr_buf, descr_idx,
+                                              ridx);
     } else {
-        return vmxnet3_get_next_body_rx_descr(s, descr_buf, descr_idx, ridx);
+        return vmxnet3_get_next_body_rx_descr(s, qidx, descr_buf, descr_idx,
+                                              ridx);
     }
 }
 
@@ -1024,7 +1035,7 @@ vmxnet3_physical_memory_writev(const struct iovec *iov,
 }
 
 static bool
-vmxnet3_indicate_packet(VMXNET3State *s)
+vmxnet3_indicate_packet(VMXNET3State *s, int qidx)
 {
     struct Vmxnet3_RxDesc rxd;
     bool is_head = true;
@@ -1050,12 +1061,13 @@ vmxnet3_indicate_packet(VMXNET3State *s)
             break;
         }
 
-        new_rxcd_pa = vmxnet3_pop_rxc_descr(s, RXQ_IDX, &new_rxcd_gen);
+        new_rxcd_pa = vmxnet3_pop_rxc_descr(s, qidx, &new_rxcd_gen);
         if (!new_rxcd_pa) {
             break;
         }
 
-        if (!vmxnet3_get_next_rx_descr(s, is_head, &rxd, &rxd_idx, &rx_ridx)) {
+        if (!vmxnet3_get_next_rx_descr(s, qidx, is_head,
+                                       &rxd, &rxd_idx, &rx_ridx)) {
             break;
         }
 
@@ -1076,7 +1088,7 @@ vmxnet3_indicate_packet(VMXNET3State *s)
         rxcd.len = chunk_size;
         rxcd.sop = is_head;
         rxcd.gen = new_rxcd_gen;
-        rxcd.rqID = RXQ_IDX + rx_ridx * s->rxq_num;
+        rxcd.rqID = qidx + rx_ridx * s->rxq_num;
 
         if (bytes_left == 0) {
             vmxnet3_rx_update_descr(s->rx_pkt, &rxcd);
@@ -1106,19 +1118,19 @@ vmxnet3_indicate_packet(VMXNET3State *s)
     }
 
     if (new_rxcd_pa != 0) {
-        vmxnet3_revert_rxc_descr(s, RXQ_IDX);
+        vmxnet3_revert_rxc_descr(s, qidx);
     }
 
-    vmxnet3_trigger_interrupt(s, s->rxq_descr[RXQ_IDX].intr_idx);
+    vmxnet3_trigger_interrupt(s, s->rxq_descr[qidx].intr_idx);
 
     if (bytes_left == 0) {
-        vmxnet3_on_rx_done_update_stats(s, RXQ_IDX, VMXNET3_PKT_STATUS_OK);
+        vmxnet3_on_rx_done_update_stats(s, qidx, VMXNET3_PKT_STATUS_OK);
         return true;
     } else if (num_frags == s->max_rx_frags) {
-        vmxnet3_on_rx_done_update_stats(s, RXQ_IDX, VMXNET3_PKT_STATUS_ERROR);
+        vmxnet3_on_rx_done_update_stats(s, qidx, VMXNET3_PKT_STATUS_ERROR);
         return false;
     } else {
-        vmxnet3_on_rx_done_update_stats(s, RXQ_IDX,
+        vmxnet3_on_rx_done_update_stats(s, qidx,
                                         VMXNET3_PKT_STATUS_OUT_OF_BUF);
         return false;
     }
@@ -1351,12 +1363,16 @@ static void vmxnet3_update_features(VMXNET3State *s)
               s->lro_supported, rxcso_supported,
               s->rx_vlan_stripping);
     if (s->peer_has_vhdr) {
-        qemu_set_offload(qemu_get_queue(s->nic)->peer,
-                         rxcso_supported,
-                         s->lro_supported,
-                         s->lro_supported,
-                         0,
-                         0);
+        int i;
+
+        for (i = 0; i < vmxnet3_nic_queues(s); i++) {
+            qemu_set_offload(qemu_get_subqueue(s->nic, i)->peer,
+                             rxcso_supported,
+                             s->lro_supported,
+                             s->lro_supported,
+                             0,
+                             0);
+        }
     }
 }
 
@@ -1928,6 +1944,7 @@ static ssize_t
 vmxnet3_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     VMXNET3State *s = qemu_get_nic_opaque(nc);
+    int qidx;
     size_t bytes_indicated;
     uint8_t min_buf[MIN_BUF_SIZE];
 
@@ -1936,6 +1953,10 @@ vmxnet3_receive(NetClientState *nc, const uint8_t *buf, size_t size)
         return -1;
     }
 
+    /* Each backend queue feeds one RX queue, so that the flows that the
+     * backend keeps apart are also kept apart in the guest */
+    qidx = s->rxq_num ? nc->queue_index % s->rxq_num : 0;
+
     if (s->peer_has_vhdr) {
         vmxnet_rx_pkt_set_vhdr(s->rx_pkt, (struct virtio_net_hdr *)buf);
         buf += sizeof(struct virtio_net_hdr);
@@ -1957,7 +1978,7 @@ vmxnet3_receive(NetClientState *nc, const uint8_t *buf, size_t size)
         vmxnet_rx_pkt_set_protocols(s->rx_pkt, buf, size);
         vmxnet3_rx_need_csum_calculate(s->rx_pkt, buf, size);
         vmxnet_rx_pkt_attach_data(s->rx_pkt, buf, size, s->rx_vlan_stripping);
-        bytes_indicated = vmxnet3_indicate_packet(s) ? size : -1;
+        bytes_indicated = vmxnet3_indicate_packet(s, qidx) ? size : -1;
         if (bytes_indicated < size) {
             VMW_PKPRN("RX: %lu of %lu bytes indicated", bytes_indicated, size);
         }
@@ -2044,10 +2065,14 @@ static void vmxnet3_net_init(VMXNET3State *s)
     s->lro_supported = false;
 
     if (s->peer_has_vhdr) {
-        qemu_set_vnet_hdr_len(qemu_get_queue(s->nic)->peer,
-            sizeof(struct virtio_net_hdr));
+        int i;
+
+        for (i = 0; i < vmxnet3_nic_queues(s); i++) {
+            NetClientState *peer = qemu_get_subqueue(s->nic, i)->peer;
 
-        qemu_using_vnet_hdr(qemu_get_queue(s->nic)->peer, 1);
+            qemu_set_vnet_hdr_len(peer, sizeof(struct virtio_net_hdr));
+            qemu_using_vnet_hdr(peer, 1);
+        }
     }
 
     qemu_format_nic_info_str(qemu_get_queue(s->nic), s->conf.macaddr.a);
@@ -37,6 +37,7 @@ do { printf("scsi-disk: " fmt , ## __VA_ARGS__); } while (0)
 #include "sysemu/blockdev.h"
 #include "hw/block/block.h"
 #include "sysemu/dma.h"
+#include "sysemu/iothread.h"
 
 #ifdef __linux
 #include <scsi/sg.h>
@@ -88,6 +89,8 @@ struct SCSIDiskState
     char *product;
     bool tray_open;
     bool tray_locked;
+    /* preferred IOThread, for HBAs that run their LUNs in several */
+    IOThread *iothread;
 };
 
 static int scsi_handle_rw_error(SCSIDiskReq *r, int error);
@@ -2661,10 +2664,21 @@ static void scsi_hd_class_initfn(ObjectClass *klass, void *data)
     dc->vmsd  = &vmstate_scsi_disk_state;
 }
 
+static void scsi_disk_instance_init(Object *obj)
+{
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, SCSI_DEVICE(obj));
+
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&s->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, &error_abort);
+}
+
 static const TypeInfo scsi_hd_info = {
     .name          = "scsi-hd",
     .parent        = TYPE_SCSI_DEVICE,
     .instance_size = sizeof(SCSIDiskState),
+    .instance_init = scsi_disk_instance_init,
     .class_init    = scsi_hd_class_initfn,
 };
 
@@ -2697,6 +2711,7 @@ static const TypeInfo scsi_cd_info = {
     .name          = "scsi-cd",
     .parent        = TYPE_SCSI_DEVICE,
     .instance_size = sizeof(SCSIDiskState),
+    .instance_init = scsi_disk_instance_init,
     .class_init    = scsi_cd_class_initfn,
 };
 
@@ -2725,6 +2740,7 @@ static const TypeInfo scsi_block_info = {
     .name          = "scsi-block",
     .parent        = TYPE_SCSI_DEVICE,
     .instance_size = sizeof(SCSIDiskState),
+    .instance_init = scsi_disk_instance_init,
     .class_init    = scsi_block_class_initfn,
 };
 #endif
@@ -2764,6 +2780,7 @@ static const TypeInfo scsi_disk_info = {
     .name          = "scsi-disk",
     .parent        = TYPE_SCSI_DEVICE,
     .instance_size = sizeof(SCSIDiskState),
+    .instance_init = scsi_disk_instance_init,
     .class_init    = scsi_disk_class_initfn,
 };
 
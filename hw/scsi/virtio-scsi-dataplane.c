@@ -20,15 +20,19 @@
 #include "hw/virtio/virtio-access.h"
 #include "stdio.h"
 
+static void virtio_scsi_ctrl_bh(void *opaque);
+static void virtio_scsi_ctx_bh(void *opaque);
+
 /* Context: QEMU global mutex held */
-void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread)
+void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread, Error **errp)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    IOThread **iothreads;
+    unsigned i, j, n;
 
     assert(!s->ctx);
-    s->ctx = iothread_get_aio_context(vs->conf.iothread);
 
     /* Don't try if transport does not support notifiers. */
     if (!k->set_guest_notifiers || !k->set_host_notifier) {
@@ -36,12 +40,120 @@ void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread)
                    "(transport does not support notifiers)");
         exit(1);
     }
+
+    n = 1 + vs->conf.num_iothreads;
+    iothreads = g_new(IOThread *, n);
+    iothreads[0] = iothread;
+    for (i = 1; i < n; i++) {
+        const char *id = vs->conf.iothread_ids[i - 1];
+        Object *obj = NULL;
+
+        if (id) {
+            obj = object_resolve_path_component(object_get_objects_root(),
+                                                id);
+        }
+        if (!obj || !object_dynamic_cast(obj, TYPE_IOTHREAD)) {
+            error_setg(errp, "iothread '%s' not found", id ? id : "");
+            g_free(iothreads);
+            return;
+        }
+        iothreads[i] = IOTHREAD(obj);
+        for (j = 0; j < i; j++) {
+            if (iothreads[j] == iothreads[i]) {
+                error_setg(errp, "iothread '%s' is given twice", id);
+                g_free(iothreads);
+                return;
+            }
+        }
+    }
+
+    s->nr_ctxs = n;
+    s->ctxs = g_new0(VirtIOSCSIContext, n);
+    for (i = 0; i < n; i++) {
+        VirtIOSCSIContext *c = &s->ctxs[i];
+
+        object_ref(OBJECT(iothreads[i]));
+        c->parent = s;
+        c->iothread = iothreads[i];
+        c->ctx = iothread_get_aio_context(iothreads[i]);
+        c->bh = aio_bh_new(c->ctx, virtio_scsi_ctx_bh, c);
+        qemu_mutex_init(&c->lock);
+        QTAILQ_INIT(&c->reqs);
+    }
+    g_free(iothreads);
+    s->ctx = s->ctxs[0].ctx;
+
+    qemu_mutex_init(&s->ctrl_lock);
+    QTAILQ_INIT(&s->ctrl_reqs);
+    s->ctrl_bh = qemu_bh_new(virtio_scsi_ctrl_bh, s);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_clear_iothreads(VirtIOSCSI *s)
+{
+    unsigned i;
+
+    if (!s->ctxs) {
+        return;
+    }
+
+    for (i = 0; i < s->nr_ctxs; i++) {
+        VirtIOSCSIContext *c = &s->ctxs[i];
+
+        assert(QTAILQ_EMPTY(&c->reqs));
+        qemu_bh_delete(c->bh);
+        qemu_mutex_destroy(&c->lock);
+        object_unref(OBJECT(c->iothread));
+    }
+    g_free(s->ctxs);
+    s->ctxs = NULL;
+    s->nr_ctxs = 0;
+    s->ctx = NULL;
+
+    qemu_bh_delete(s->ctrl_bh);
+    qemu_mutex_destroy(&s->ctrl_lock);
+}
+
+VirtIOSCSIContext *virtio_scsi_find_ctx(VirtIOSCSI *s, AioContext *ctx)
+{
+    unsigned i;
+
+    for (i = 0; i < s->nr_ctxs; i++) {
+        if (s->ctxs[i].ctx == ctx) {
+            return &s->ctxs[i];
+        }
+    }
+    return NULL;
+}
+
+/* Pick the AioContext of a new LUN: the one of its own "iothread", which
+ * must be one of ours, or else the next of ours in turn.
+ *
+ * Context: QEMU global mutex held
+ */
+AioContext *virtio_scsi_lun_ctx(VirtIOSCSI *s, SCSIDevice *sd, Error **errp)
+{
+    Object *obj = object_property_get_link(OBJECT(sd), "iothread", NULL);
+    AioContext *ctx;
+
+    if (obj) {
+        ctx = iothread_get_aio_context(IOTHREAD(obj));
+        if (!virtio_scsi_find_ctx(s, ctx)) {
+            error_setg(errp, "the iothread of the SCSI device is not one of "
+                       "the iothreads of its virtio-scsi controller");
+            return NULL;
+        }
+        return ctx;
+    }
+
+    return s->ctxs[s->next_ctx++ % s->nr_ctxs].ctx;
 }
 
+/* Context: QEMU global mutex and @ctx held */
 static VirtIOSCSIVring *virtio_scsi_vring_init(VirtIOSCSI *s,
                                                VirtQueue *vq,
                                                EventNotifierHandler *handler,
-                                               int n)
+                                               int n, AioContext *ctx)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
@@ -58,9 +170,11 @@ static VirtIOSCSIVring *virtio_scsi_vring_init(VirtIOSCSI *s,
     }
 
     r = g_slice_new(VirtIOSCSIVring);
+    r->ctx = ctx;
+    qemu_mutex_init(&r->lock);
     r->host_notifier = *virtio_queue_get_host_notifier(vq);
     r->guest_notifier = *virtio_queue_get_guest_notifier(vq);
-    aio_set_event_notifier(s->ctx, &r->host_notifier, handler);
+    aio_set_event_notifier(ctx, &r->host_notifier, handler);
 
     r->parent = s;
 
@@ -71,8 +185,9 @@ static VirtIOSCSIVring *virtio_scsi_vring_init(VirtIOSCSI *s,
     return r;
 
 fail_vring:
-    aio_set_event_notifier(s->ctx, &r->host_notifier, NULL);
+    aio_set_event_notifier(ctx, &r->host_notifier, NULL);
     k->set_host_notifier(qbus->parent, n, false);
+    qemu_mutex_destroy(&r->lock);
     g_slice_free(VirtIOSCSIVring, r);
     return NULL;
 }
@@ -84,7 +199,9 @@ VirtIOSCSIReq *virtio_scsi_pop_req_vring(VirtIOSCSI *s,
     int r;
 
     req->vring = vring;
+    qemu_mutex_lock(&vring->lock);
     r = vring_pop((VirtIODevice *)s, &vring->vring, &req->elem);
+    qemu_mutex_unlock(&vring->lock);
     if (r < 0) {
         virtio_scsi_free_req(req);
         req = NULL;
@@ -96,12 +213,15 @@ void virtio_scsi_vring_push_notify(VirtIOSCSIReq *req)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(req->vring->parent);
 
+    /* the LUN of the request may be in another IOThread than its vring */
+    qemu_mutex_lock(&req->vring->lock);
     vring_push(vdev, &req->vring->vring, &req->elem,
                req->qsgl.size + req->resp_iov.size);
 
     if (vring_should_notify(vdev, &req->vring->vring)) {
         event_notifier_set(&req->vring->guest_notifier);
     }
+    qemu_mutex_unlock(&req->vring->lock);
 }
 
 static void virtio_scsi_iothread_handle_ctrl(EventNotifier *notifier)
@@ -113,8 +233,81 @@ static void virtio_scsi_iothread_handle_ctrl(EventNotifier *notifier)
 
     event_notifier_test_and_clear(notifier);
     while ((req = virtio_scsi_pop_req_vring(s, vring))) {
+        if (s->nr_ctxs > 1) {
+            qemu_mutex_lock(&s->ctrl_lock);
+            QTAILQ_INSERT_TAIL(&s->ctrl_reqs, req, next);
+            qemu_mutex_unlock(&s->ctrl_lock);
+            qemu_bh_schedule(s->ctrl_bh);
+        } else {
+            virtio_scsi_handle_ctrl_req(s, req);
+        }
+    }
+}
+
+/* A TMF can reset every LUN of a target, whatever their IOThreads, so
+ * all of them are locked; only the main loop holds more than one of these
+ * locks at a time.
+ *
+ * Context: QEMU global mutex held
+ */
+static void virtio_scsi_ctrl_bh(void *opaque)
+{
+    VirtIOSCSI *s = opaque;
+    QTAILQ_HEAD(, VirtIOSCSIReq) reqs = QTAILQ_HEAD_INITIALIZER(reqs);
+    VirtIOSCSIReq *req;
+    unsigned i;
+
+    qemu_mutex_lock(&s->ctrl_lock);
+    while ((req = QTAILQ_FIRST(&s->ctrl_reqs))) {
+        QTAILQ_REMOVE(&s->ctrl_reqs, req, next);
+        QTAILQ_INSERT_TAIL(&reqs, req, next);
+    }
+    qemu_mutex_unlock(&s->ctrl_lock);
+
+    if (QTAILQ_EMPTY(&reqs)) {
+        return;
+    }
+
+    for (i = 0; i < s->nr_ctxs; i++) {
+        aio_context_acquire(s->ctxs[i].ctx);
+    }
+    while ((req = QTAILQ_FIRST(&reqs))) {
+        QTAILQ_REMOVE(&reqs, req, next);
         virtio_scsi_handle_ctrl_req(s, req);
     }
+    for (i = s->nr_ctxs; i-- > 0; ) {
+        aio_context_release(s->ctxs[i].ctx);
+    }
+}
+
+/* Prepare and submit the command requests that other IOThreads queued
+ * for the LUNs of this one.
+ */
+static void virtio_scsi_ctx_bh(void *opaque)
+{
+    VirtIOSCSIContext *c = opaque;
+    VirtIOSCSI *s = c->parent;
+    QTAILQ_HEAD(, VirtIOSCSIReq) pending = QTAILQ_HEAD_INITIALIZER(pending);
+    QTAILQ_HEAD(, VirtIOSCSIReq) reqs = QTAILQ_HEAD_INITIALIZER(reqs);
+    VirtIOSCSIReq *req, *next;
+
+    qemu_mutex_lock(&c->lock);
+    while ((req = QTAILQ_FIRST(&c->reqs))) {
+        QTAILQ_REMOVE(&c->reqs, req, next);
+        QTAILQ_INSERT_TAIL(&pending, req, next);
+    }
+    qemu_mutex_unlock(&c->lock);
+
+    while ((req = QTAILQ_FIRST(&pending))) {
+        QTAILQ_REMOVE(&pending, req, next);
+        if (virtio_scsi_handle_cmd_req_prepare(s, req)) {
+            QTAILQ_INSERT_TAIL(&reqs, req, next);
+        }
+    }
+
+    QTAILQ_FOREACH_SAFE(req, &reqs, next, next) {
+        virtio_scsi_handle_cmd_req_submit(s, req);
+    }
 }
 
 static void virtio_scsi_iothread_handle_event(EventNotifier *notifier)
@@ -145,7 +338,22 @@ static void virtio_scsi_iothread_handle_cmd(EventNotifier *notifier)
 
     event_notifier_test_and_clear(notifier);
     while ((req = virtio_scsi_pop_req_vring(s, vring))) {
-        if (virtio_scsi_handle_cmd_req_prepare(s, req)) {
+        VirtIOSCSIContext *c = NULL;
+        AioContext *ctx;
+
+        if (s->nr_ctxs > 1) {
+            ctx = virtio_scsi_cmd_req_ctx(s, req);
+            if (ctx && ctx != vring->ctx) {
+                c = virtio_scsi_find_ctx(s, ctx);
+            }
+        }
+        if (c) {
+            /* hand it over to the IOThread of its LUN */
+            qemu_mutex_lock(&c->lock);
+            QTAILQ_INSERT_TAIL(&c->reqs, req, next);
+            qemu_mutex_unlock(&c->lock);
+            qemu_bh_schedule(c->bh);
+        } else if (virtio_scsi_handle_cmd_req_prepare(s, req)) {
             QTAILQ_INSERT_TAIL(&reqs, req, next);
         }
     }
@@ -155,25 +363,38 @@ static void virtio_scsi_iothread_handle_cmd(EventNotifier *notifier)
     }
 }
 
-/* assumes s->ctx held */
+static void virtio_scsi_vring_clear_aio(VirtIOSCSIVring *r)
+{
+    aio_context_acquire(r->ctx);
+    aio_set_event_notifier(r->ctx, &r->host_notifier, NULL);
+    aio_context_release(r->ctx);
+}
+
+/* Context: QEMU global mutex held */
 static void virtio_scsi_clear_aio(VirtIOSCSI *s)
 {
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
     int i;
 
     if (s->ctrl_vring) {
-        aio_set_event_notifier(s->ctx, &s->ctrl_vring->host_notifier, NULL);
+        virtio_scsi_vring_clear_aio(s->ctrl_vring);
     }
     if (s->event_vring) {
-        aio_set_event_notifier(s->ctx, &s->event_vring->host_notifier, NULL);
+        virtio_scsi_vring_clear_aio(s->event_vring);
     }
     if (s->cmd_vrings) {
         for (i = 0; i < vs->conf.num_queues && s->cmd_vrings[i]; i++) {
-            aio_set_event_notifier(s->ctx, &s->cmd_vrings[i]->host_notifier, NULL);
+            virtio_scsi_vring_clear_aio(s->cmd_vrings[i]);
         }
     }
 }
 
+static void virtio_scsi_vring_free(VirtIOSCSIVring *r)
+{
+    qemu_mutex_destroy(&r->lock);
+    g_slice_free(VirtIOSCSIVring, r);
+}
+
 static void virtio_scsi_vring_teardown(VirtIOSCSI *s)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
@@ -182,18 +403,18 @@ static void virtio_scsi_vring_teardown(VirtIOSCSI *s)
 
     if (s->ctrl_vring) {
         vring_teardown(&s->ctrl_vring->vring, vdev, 0);
-        g_slice_free(VirtIOSCSIVring, s->ctrl_vring);
+        virtio_scsi_vring_free(s->ctrl_vring);
         s->ctrl_vring = NULL;
     }
     if (s->event_vring) {
         vring_teardown(&s->event_vring->vring, vdev, 1);
-        g_slice_free(VirtIOSCSIVring, s->event_vring);
+        virtio_scsi_vring_free(s->event_vring);
         s->event_vring = NULL;
     }
     if (s->cmd_vrings) {
         for (i = 0; i < vs->conf.num_queues && s->cmd_vrings[i]; i++) {
             vring_teardown(&s->cmd_vrings[i]->vring, vdev, 2 + i);
-            g_slice_free(VirtIOSCSIVring, s->cmd_vrings[i]);
+            virtio_scsi_vring_free(s->cmd_vrings[i]);
             s->cmd_vrings[i] = NULL;
         }
         free(s->cmd_vrings);
@@ -231,22 +452,27 @@ void virtio_scsi_dataplane_start(VirtIOSCSI *s)
     aio_context_acquire(s->ctx);
     s->ctrl_vring = virtio_scsi_vring_init(s, vs->ctrl_vq,
                                            virtio_scsi_iothread_handle_ctrl,
-                                           0);
+                                           0, s->ctx);
     if (!s->ctrl_vring) {
         goto fail_vrings;
     }
     s->event_vring = virtio_scsi_vring_init(s, vs->event_vq,
                                             virtio_scsi_iothread_handle_event,
-                                            1);
+                                            1, s->ctx);
     if (!s->event_vring) {
         goto fail_vrings;
     }
-    s->cmd_vrings = g_new(VirtIOSCSIVring *, vs->conf.num_queues);
+    s->cmd_vrings = g_new0(VirtIOSCSIVring *, vs->conf.num_queues);
     for (i = 0; i < vs->conf.num_queues; i++) {
+        /* the command queues are spread over the iothreads in turn */
+        AioContext *ctx = s->ctxs[i % s->nr_ctxs].ctx;
+
+        aio_context_acquire(ctx);
         s->cmd_vrings[i] =
             virtio_scsi_vring_init(s, vs->cmd_vqs[i],
                                    virtio_scsi_iothread_handle_cmd,
-                                   i + 2);
+                                   i + 2, ctx);
+        aio_context_release(ctx);
         if (!s->cmd_vrings[i]) {
             goto fail_vrings;
         }
@@ -258,8 +484,8 @@ void virtio_scsi_dataplane_start(VirtIOSCSI *s)
     return;
 
 fail_vrings:
-    virtio_scsi_clear_aio(s);
     aio_context_release(s->ctx);
+    virtio_scsi_clear_aio(s);
     virtio_scsi_vring_teardown(s);
     for (i = 0; i < vs->conf.num_queues + 2; i++) {
         k->set_host_notifier(qbus->parent, i, false);
@@ -288,14 +514,19 @@ void virtio_scsi_dataplane_stop(VirtIOSCSI *s)
     s->dataplane_stopping = true;
     assert(s->ctx == iothread_get_aio_context(vs->conf.iothread));
 
-    aio_context_acquire(s->ctx);
+    /* Stop notifications for new requests from guest */
+    virtio_scsi_clear_aio(s);
 
-    aio_set_event_notifier(s->ctx, &s->ctrl_vring->host_notifier, NULL);
-    aio_set_event_notifier(s->ctx, &s->event_vring->host_notifier, NULL);
-    for (i = 0; i < vs->conf.num_queues; i++) {
-        aio_set_event_notifier(s->ctx, &s->cmd_vrings[i]->host_notifier, NULL);
+    /* Submit what was handed over between IOThreads in the meanwhile */
+    virtio_scsi_ctrl_bh(s);
+    for (i = 0; i < s->nr_ctxs; i++) {
+        aio_context_acquire(s->ctxs[i].ctx);
+        virtio_scsi_ctx_bh(&s->ctxs[i]);
+        aio_context_release(s->ctxs[i].ctx);
     }
 
+    aio_context_acquire(s->ctx);
+
     blk_drain_all(); /* ensure there are no in-flight requests */
 
     aio_context_release(s->ctx);
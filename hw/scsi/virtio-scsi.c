@@ -40,14 +40,31 @@ static inline SCSIDevice *virtio_scsi_device_find(VirtIOSCSI *s, uint8_t *lun)
     return scsi_device_find(&s->bus, 0, lun[1], virtio_scsi_get_lun(lun));
 }
 
+/* The AioContext of the LUN that a command request is for, peeked at
+ * before the request is parsed; NULL if there is no such LUN.
+ */
+AioContext *virtio_scsi_cmd_req_ctx(VirtIOSCSI *s, VirtIOSCSIReq *req)
+{
+    uint8_t lun[8];
+    SCSIDevice *d;
+
+    if (iov_to_buf(req->elem.out_sg, req->elem.out_num,
+                   offsetof(VirtIOSCSICmdReq, lun), lun,
+                   sizeof(lun)) < sizeof(lun)) {
+        return NULL;
+    }
+
+    d = virtio_scsi_device_find(s, lun);
+    return d ? blk_get_aio_context(d->conf.blk) : NULL;
+}
+
 VirtIOSCSIReq *virtio_scsi_init_req(VirtIOSCSI *s, VirtQueue *vq)
 {
     VirtIOSCSIReq *req;
-    VirtIOSCSICommon *vs = (VirtIOSCSICommon *)s;
     const size_t zero_skip = offsetof(VirtIOSCSIReq, elem)
                              + sizeof(VirtQueueElement);
 
-    req = g_slice_alloc(sizeof(*req) + vs->cdb_size);
+    req = virtio_req_pool_get(s->req_pool);
     req->vq = vq;
     req->dev = s;
     qemu_sglist_init(&req->qsgl, DEVICE(s), 8, &address_space_memory);
@@ -58,26 +75,22 @@ VirtIOSCSIReq *virtio_scsi_init_req(VirtIOSCSI *s, VirtQueue *vq)
 
 void virtio_scsi_free_req(VirtIOSCSIReq *req)
 {
-    VirtIOSCSICommon *vs = (VirtIOSCSICommon *)req->dev;
-
     qemu_iovec_destroy(&req->resp_iov);
     qemu_sglist_destroy(&req->qsgl);
-    g_slice_free1(sizeof(*req) + vs->cdb_size, req);
+    virtio_req_pool_put(req->dev->req_pool, req);
 }
 
 static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
 {
-    VirtIOSCSI *s = req->dev;
     VirtQueue *vq = req->vq;
-    VirtIODevice *vdev = VIRTIO_DEVICE(s);
 
     qemu_iovec_from_buf(&req->resp_iov, 0, &req->resp, req->resp_size);
     if (req->vring) {
         assert(req->vq == NULL);
         virtio_scsi_vring_push_notify(req);
     } else {
-        virtqueue_push(vq, &req->elem, req->qsgl.size + req->resp_iov.size);
-        virtio_notify(vdev, vq);
+        virtqueue_push_deferred(vq, &req->elem,
+                                req->qsgl.size + req->resp_iov.size);
     }
 
     if (req->sreq) {
@@ -259,8 +272,8 @@ static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
     int target;
     int ret = 0;
 
-    if (s->dataplane_started) {
-        assert(blk_get_aio_context(d->conf.blk) == s->ctx);
+    if (s->dataplane_started && d) {
+        assert(virtio_scsi_find_ctx(s, blk_get_aio_context(d->conf.blk)));
     }
     /* Here VIRTIO_SCSI_S_OK means "FUNCTION COMPLETE".  */
     req->resp.tmf.response = VIRTIO_SCSI_S_OK;
@@ -544,7 +557,7 @@ bool virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req)
         return false;
     }
     if (s->dataplane_started) {
-        assert(blk_get_aio_context(d->conf.blk) == s->ctx);
+        assert(virtio_scsi_find_ctx(s, blk_get_aio_context(d->conf.blk)));
     }
     req->sreq = scsi_req_new(d, req->req.cmd.tag,
                              virtio_scsi_get_lun(req->req.cmd.lun),
@@ -636,6 +649,10 @@ static uint64_t virtio_scsi_get_features(VirtIODevice *vdev,
 
     /* Firstly sync all virtio-scsi possible supported features */
     requested_features |= s->host_features;
+    /* dataplane has its own vring code, which only knows the split ring */
+    if (VIRTIO_SCSI_COMMON(vdev)->conf.iothread) {
+        virtio_clear_feature(&requested_features, VIRTIO_F_RING_PACKED);
+    }
     return requested_features;
 }
 
@@ -774,13 +791,19 @@ static void virtio_scsi_hotplug(HotplugHandler *hotplug_dev, DeviceState *dev,
     SCSIDevice *sd = SCSI_DEVICE(dev);
 
     if (s->ctx && !s->dataplane_disabled) {
+        AioContext *ctx;
+
         if (blk_op_is_blocked(sd->conf.blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
             return;
         }
+        ctx = virtio_scsi_lun_ctx(s, sd, errp);
+        if (!ctx) {
+            return;
+        }
         blk_op_block_all(sd->conf.blk, s->blocker);
-        aio_context_acquire(s->ctx);
-        blk_set_aio_context(sd->conf.blk, s->ctx);
-        aio_context_release(s->ctx);
+        aio_context_acquire(ctx);
+        blk_set_aio_context(sd->conf.blk, ctx);
+        aio_context_release(ctx);
     }
 
     if (virtio_vdev_has_feature(vdev, VIRTIO_SCSI_F_HOTPLUG)) {
@@ -856,8 +879,20 @@ void virtio_scsi_common_realize(DeviceState *dev, Error **errp,
                                          cmd);
     }
 
+    if (s->conf.num_iothreads && !s->conf.iothread) {
+        error_setg(errp, "iothreads needs iothread to be set");
+        virtio_cleanup(vdev);
+        return;
+    }
     if (s->conf.iothread) {
-        virtio_scsi_set_iothread(VIRTIO_SCSI(s), s->conf.iothread);
+        Error *err = NULL;
+
+        virtio_scsi_set_iothread(VIRTIO_SCSI(s), s->conf.iothread, &err);
+        if (err) {
+            error_propagate(errp, err);
+            virtio_cleanup(vdev);
+            return;
+        }
     }
 }
 
@@ -901,6 +936,10 @@ static void virtio_scsi_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    /* The guest can change cdb_size at any time, so make room for the
+     * largest one that virtio_scsi_set_config() accepts */
+    s->req_pool = virtio_req_pool_new(sizeof(VirtIOSCSIReq) + 255);
+
     scsi_bus_new(&s->bus, sizeof(s->bus), dev,
                  &virtio_scsi_scsi_info, vdev->bus_name);
     /* override default SCSI bus hotplug-handler, with virtio-scsi's one */
@@ -910,6 +949,8 @@ static void virtio_scsi_device_realize(DeviceState *dev, Error **errp)
         scsi_bus_legacy_handle_cmdline(&s->bus, &err);
         if (err != NULL) {
             error_propagate(errp, err);
+            virtio_req_pool_free(s->req_pool);
+            s->req_pool = NULL;
             return;
         }
     }
@@ -932,6 +973,14 @@ static void virtio_scsi_instance_init(Object *obj)
                              OBJ_PROP_LINK_UNREF_ON_RELEASE, &error_abort);
 }
 
+static void virtio_scsi_instance_finalize(Object *obj)
+{
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(obj);
+
+    /* the strings themselves went away with the array properties */
+    g_free(vs->conf.iothread_ids);
+}
+
 void virtio_scsi_common_unrealize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -946,11 +995,14 @@ static void virtio_scsi_device_unrealize(DeviceState *dev, Error **errp)
     VirtIOSCSI *s = VIRTIO_SCSI(dev);
 
     error_free(s->blocker);
+    virtio_scsi_clear_iothreads(s);
 
     unregister_savevm(dev, "virtio-scsi", s);
     remove_migration_state_change_notifier(&s->migration_state_notifier);
 
     virtio_scsi_common_unrealize(dev, errp);
+    virtio_req_pool_free(s->req_pool);
+    s->req_pool = NULL;
 }
 
 static Property virtio_scsi_properties[] = {
@@ -963,6 +1015,8 @@ static Property virtio_scsi_properties[] = {
                                            VIRTIO_SCSI_F_HOTPLUG, true),
     DEFINE_PROP_BIT("param_change", VirtIOSCSI, host_features,
                                                 VIRTIO_SCSI_F_CHANGE, true),
+    DEFINE_PROP_ARRAY("iothreads", VirtIOSCSI, parent_obj.conf.num_iothreads,
+                      parent_obj.conf.iothread_ids, qdev_prop_string, char *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1005,6 +1059,7 @@ static const TypeInfo virtio_scsi_info = {
     .parent = TYPE_VIRTIO_SCSI_COMMON,
     .instance_size = sizeof(VirtIOSCSI),
     .instance_init = virtio_scsi_instance_init,
+    .instance_finalize = virtio_scsi_instance_finalize,
     .class_init = virtio_scsi_class_init,
     .interfaces = (InterfaceInfo[]) {
         { TYPE_HOTPLUG_HANDLER },
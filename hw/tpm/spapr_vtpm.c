@@ -67,10 +67,18 @@
 #define VIO_SPAPR_VTPM_DEVICE(obj) \
      OBJECT_CHECK(SPAPRvTPMState, (obj), TYPE_VIO_SPAPR_VTPM_DEVICE)
 
+/* number of TPM command CRQs that may wait behind the executing one */
+#define SPAPR_VTPM_MAX_PENDING 8
+
 typedef struct {
     VIOsPAPRDevice vdev;
 
-    spapr_vtpm_crq crq; /* track single TPM command */
+    spapr_vtpm_crq crq; /* track the executing TPM command */
+
+    /* TPM command CRQs received while a command was executing */
+    spapr_vtpm_crq pending[SPAPR_VTPM_MAX_PENDING];
+    unsigned int pending_head;
+    unsigned int pending_count;
 
     union {
         /*
@@ -145,13 +153,26 @@ static void spapr_vtpm_got_payload(SPAPRvTPMState *s, spapr_vtpm_crq *crq)
 {
     TPMTISEmuState *tis = &s->s.tis;
     uint8_t locty = 0;
+    uint32_t len;
 
     DPRINTF("vtpm_got_payload: crq->s.data = 0x%x  crq->s.len = %d\n",
             crq->s.data, crq->s.len);
+
+    /*
+     * Only transfer the request itself rather than the whole buffer. The
+     * DMA goes straight from guest memory into the transfer buffer; it is
+     * not handed to the backend mapped since the guest could then modify
+     * the command while the backend parses it.
+     */
+    len = MIN(crq->s.len, tis->loc[locty].w_buffer.size);
+    if (len < sizeof(struct tpm_req_hdr)) {
+        len = tis->loc[locty].w_buffer.size;
+    }
+    memset(tis->loc[locty].w_buffer.buffer, 0, sizeof(struct tpm_req_hdr));
+
     /* XXX Handle failure differently ? */
     if (spapr_vio_dma_read(&s->vdev, crq->s.data,
-                           tis->loc[locty].w_buffer.buffer,
-                           tis->loc[locty].w_buffer.size)) {
+                           tis->loc[locty].w_buffer.buffer, len)) {
         fprintf(stderr, "vtpm_got_payload: DMA read failure !\n");
         return;
     }
@@ -160,13 +181,62 @@ static void spapr_vtpm_got_payload(SPAPRvTPMState *s, spapr_vtpm_crq *crq)
     spapr_vtpm_tpm_send(s, locty);
 }
 
+/*
+ * Start processing a TPM command CRQ; the CRQ is tracked until the
+ * response has been sent.
+ */
+static void spapr_vtpm_start_crq(SPAPRvTPMState *s, const uint8_t *crq_data)
+{
+    spapr_vtpm_crq *crq = &s->crq;
+
+    memcpy(crq->raw, crq_data, sizeof(crq->raw));
+    crq->s.valid = be16_to_cpu(0);
+    crq->s.len = be16_to_cpu(crq->s.len);
+    crq->s.data = be32_to_cpu(crq->s.data);
+    spapr_vtpm_got_payload(s, crq);
+}
+
+/*
+ * Queue a TPM command CRQ behind the executing one.
+ * Returns false if the queue is full.
+ */
+static bool spapr_vtpm_queue_crq(SPAPRvTPMState *s, const uint8_t *crq_data)
+{
+    unsigned int idx;
+
+    if (s->pending_count == SPAPR_VTPM_MAX_PENDING) {
+        return false;
+    }
+    idx = (s->pending_head + s->pending_count) % SPAPR_VTPM_MAX_PENDING;
+    memcpy(s->pending[idx].raw, crq_data, sizeof(s->pending[idx].raw));
+    s->pending_count++;
+
+    return true;
+}
+
+/*
+ * Start the next queued TPM command CRQ, if any.
+ */
+static void spapr_vtpm_next_crq(SPAPRvTPMState *s)
+{
+    spapr_vtpm_crq next;
+
+    if (!s->pending_count) {
+        return;
+    }
+    next = s->pending[s->pending_head];
+    s->pending_head = (s->pending_head + 1) % SPAPR_VTPM_MAX_PENDING;
+    s->pending_count--;
+
+    spapr_vtpm_start_crq(s, next.raw);
+}
+
 static int spapr_vtpm_do_crq(struct VIOsPAPRDevice *dev, uint8_t *crq_data)
 {
     SPAPRvTPMState *s = VIO_SPAPR_VTPM_DEVICE(dev);
     TPMTISEmuState *tis = &s->s.tis;
     uint8_t locty = 0;
     spapr_vtpm_crq local_crq;
-    spapr_vtpm_crq *crq = &s->crq; /* use for TPM requests only */
 
     memcpy(&local_crq.raw, crq_data, sizeof(local_crq.raw));
 
@@ -200,14 +270,14 @@ static int spapr_vtpm_do_crq(struct VIOsPAPRDevice *dev, uint8_t *crq_data)
         switch (local_crq.s.msg) {
         case SPAPR_VTPM_TPM_COMMAND:
             DPRINTF("vtpm_do_crq: got TPM command payload!\n");
-            if (tis->loc[locty].state == TPM_TIS_STATE_EXECUTION)
-                return H_BUSY;
-            /* this crq is tracked */
-            memcpy(crq->raw, crq_data, sizeof(crq->raw));
-            crq->s.valid = be16_to_cpu(0);
-            crq->s.len = be16_to_cpu(crq->s.len);
-            crq->s.data = be32_to_cpu(crq->s.data);
-            spapr_vtpm_got_payload(s, crq);
+            if (tis->loc[locty].state == TPM_TIS_STATE_EXECUTION) {
+                /* the response to the executing command starts the next */
+                if (!spapr_vtpm_queue_crq(s, crq_data)) {
+                    return H_BUSY;
+                }
+                break;
+            }
+            spapr_vtpm_start_crq(s, crq_data);
             break;
 
         case SPAPR_VTPM_GET_RTCE_BUFFER_SIZE:
@@ -244,7 +314,7 @@ static int spapr_vtpm_do_crq(struct VIOsPAPRDevice *dev, uint8_t *crq_data)
 
         default:
             fprintf(stderr, "vtpm_do_crq: Unknown message type %02x\n",
-                    crq->s.msg);
+                    local_crq.s.msg);
         }
         break;
     default:
@@ -298,6 +368,8 @@ static void spapr_vtpm_receive_bh(void *opaque)
     /* notify of completed command */
     qemu_cond_signal(&s->cmd_complete);
     qemu_mutex_unlock(&s->state_lock);
+
+    spapr_vtpm_next_crq(s);
 }
 
 /*
@@ -344,6 +416,9 @@ static void spapr_vtpm_reset(VIOsPAPRDevice *dev)
 
     tpm_backend_reset(s->be_driver);
 
+    s->pending_head = 0;
+    s->pending_count = 0;
+
     for (c = 0; c < SPAPR_VTPM_NUM_LOCALITIES; c++) {
         tis->loc[c].w_offset = 0;
         tpm_backend_realloc_buffer(s->be_driver, &tis->loc[c].w_buffer);
@@ -369,7 +444,7 @@ void spapr_vtpm_create(VIOsPAPRBus *bus)
 
 static void spapr_vtpm_pre_save(void *opaque)
 {
-    TPMState *s = opaque;
+    SPAPRvTPMState *s = opaque;
     TPMTISEmuState *tis = &s->s.tis;
     uint8_t locty = 0;
 
@@ -378,8 +453,11 @@ static void spapr_vtpm_pre_save(void *opaque)
 
     qemu_mutex_lock(&s->state_lock);
 
-    /* wait for outstanding request to complete */
-    if (tis->loc[locty].state == TPM_TIS_STATE_EXECUTION) {
+    /*
+     * wait for outstanding requests to complete; completing one starts
+     * the next queued one
+     */
+    while (tis->loc[locty].state == TPM_TIS_STATE_EXECUTION) {
         /*
          * If we get here when the bh is scheduled but did not run,
          * we won't get notified...
@@ -419,7 +497,7 @@ static void spapr_vtpm_pre_save(void *opaque)
 static int spapr_vtpm_post_load(void *opaque,
                                 int version_id __attribute__((unused)))
 {
-    TPMState *s = opaque;
+    SPAPRvTPMState *s = opaque;
     TPMTISEmuState *tis = &s->s.tis;
     uint8_t locty = 0;
 
@@ -461,7 +539,8 @@ static const VMStateDescription vmstate_spapr_vtpm = {
     .fields = (VMStateField[]) {
         VMSTATE_SPAPR_VIO(vdev, SPAPRvTPMState),
 
-        VMSTATE_STRUCT_ARRAY(s.tis.loc, TPMState, TPM_TIS_NUM_LOCALITIES, 1,
+        VMSTATE_STRUCT_ARRAY(s.tis.loc, SPAPRvTPMState,
+                             TPM_TIS_NUM_LOCALITIES, 1,
                              vmstate_locty, TPMLocality),
 
         VMSTATE_END_OF_LIST()
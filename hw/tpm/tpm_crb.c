@@ -0,0 +1,512 @@
+/*
+ * tpm_crb.c - QEMU's TPM CRB interface emulator
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Implementation of the CRB (Command Response Buffer) interface following
+ * the TCG PC Client Platform TPM Profile (PTP) Specification, Family 2.0,
+ * Revision 00.43.
+ *
+ * Unlike the TIS interface, which moves command and response bytes through
+ * a FIFO register one trapped access at a time, the CRB interface exposes
+ * the whole data buffer as guest RAM. The guest fills in the command
+ * without exiting and a single write to the CTRL_START register hands it
+ * to the TPM backend. The buffer gets the page after the registers rather
+ * than their page, where the specification puts it at offset 0x80,
+ * because KVM can only map whole pages as guest RAM.
+ */
+
+#include "sysemu/tpm_backend.h"
+#include "tpm_int.h"
+#include "exec/address-spaces.h"
+#include "hw/hw.h"
+#include "hw/i386/pc.h"
+#include "hw/pci/pci_ids.h"
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "trace.h"
+
+#define DEBUG_CRB 0
+
+#define DPRINTF(fmt, ...) do { \
+    if (DEBUG_CRB) { \
+        printf(fmt, ## __VA_ARGS__); \
+    } \
+} while (0);
+
+#define TPM_CRB(obj) OBJECT_CHECK(TPMCRBState, (obj), TYPE_TPM_CRB)
+
+/* crb registers */
+#define TPM_CRB_REG_LOC_STATE             0x00
+#define TPM_CRB_REG_LOC_CTRL              0x08
+#define TPM_CRB_REG_LOC_STS               0x0c
+#define TPM_CRB_REG_INTF_ID               0x30
+#define TPM_CRB_REG_INTF_ID2              0x34
+#define TPM_CRB_REG_CTRL_EXT              0x38
+#define TPM_CRB_REG_CTRL_REQ              0x40
+#define TPM_CRB_REG_CTRL_STS              0x44
+#define TPM_CRB_REG_CTRL_CANCEL           0x48
+#define TPM_CRB_REG_CTRL_START            0x4c
+#define TPM_CRB_REG_INT_ENABLED           0x50
+#define TPM_CRB_REG_INT_STS               0x54
+#define TPM_CRB_REG_CTRL_CMD_SIZE         0x58
+#define TPM_CRB_REG_CTRL_CMD_LADDR        0x5c
+#define TPM_CRB_REG_CTRL_CMD_HADDR        0x60
+#define TPM_CRB_REG_CTRL_RSP_SIZE         0x64
+#define TPM_CRB_REG_CTRL_RSP_ADDR         0x68
+#define TPM_CRB_REG_DATA_BUFFER           0x80
+
+#define TPM_CRB_NUM_REGS                  (TPM_CRB_REG_DATA_BUFFER / 4)
+
+#define TPM_CRB_LOC_STATE_TPM_ESTABLISHED (1 << 0)
+#define TPM_CRB_LOC_STATE_LOC_ASSIGNED    (1 << 1)
+#define TPM_CRB_LOC_STATE_ACTIVE_LOCALITY_SHIFT 2
+#define TPM_CRB_LOC_STATE_TPM_REG_VALID_STS (1 << 7)
+
+#define TPM_CRB_LOC_CTRL_REQUEST_ACCESS   (1 << 0)
+#define TPM_CRB_LOC_CTRL_RELINQUISH       (1 << 1)
+#define TPM_CRB_LOC_CTRL_SEIZE            (1 << 2)
+
+#define TPM_CRB_LOC_STS_GRANTED           (1 << 0)
+#define TPM_CRB_LOC_STS_BEEN_SEIZED       (1 << 1)
+
+#define TPM_CRB_INTF_ID_TYPE_CRB          (0x1)
+#define TPM_CRB_INTF_ID_VERSION_CRB       (0x1 << 4)
+#define TPM_CRB_INTF_ID_CAP_DATA_XFER_64B (0x3 << 11)
+#define TPM_CRB_INTF_ID_CAP_CRB           (1 << 14)
+#define TPM_CRB_INTF_ID_SEL_CRB           (1 << 17)
+#define TPM_CRB_INTF_ID_RID_SHIFT         24
+
+#define TPM_CRB_CTRL_REQ_CMD_READY        (1 << 0)
+#define TPM_CRB_CTRL_REQ_GO_IDLE          (1 << 1)
+
+#define TPM_CRB_CTRL_STS_TPM_STS          (1 << 0)
+#define TPM_CRB_CTRL_STS_TPM_IDLE         (1 << 1)
+
+#define TPM_CRB_CTRL_CANCEL_CMD           (1 << 0)
+
+#define TPM_CRB_CTRL_START_CMD            (1 << 0)
+
+#define TPM_CRB_DATA_BUFFER_OFFSET        0x1000
+#define TPM_CRB_CTRL_CMD_SIZE  (TPM_CRB_ADDR_SIZE - TPM_CRB_DATA_BUFFER_OFFSET)
+
+#define TPM_CRB_TPM_DID       0x0001
+#define TPM_CRB_TPM_VID       PCI_VENDOR_ID_IBM
+#define TPM_CRB_TPM_RID       0x0001
+
+typedef struct TPMCRBState {
+    ISADevice busdev;
+    MemoryRegion mmio;
+    MemoryRegion cmdmem;
+
+    uint32_t regs[TPM_CRB_NUM_REGS];
+
+    QEMUBH *bh;
+    bool bh_scheduled; /* bh scheduled but did not run yet */
+
+    /*
+     * The backends expect TIS related data structures; we only ever
+     * use a single locality as transfer buffer.
+     */
+    TPMLocality loc;
+
+    uint8_t     locty_number;
+    TPMLocality *locty_data;
+
+    char *backend;
+    TPMBackend *be_driver;
+    TPMVersion be_tpm_version;
+
+    QemuMutex state_lock;
+    QemuCond cmd_complete;
+} TPMCRBState;
+
+#define CRB_REG(s, reg) ((s)->regs[(reg) / 4])
+
+static uint32_t tpm_crb_get_size_from_buffer(const uint8_t *buf)
+{
+    return be32_to_cpu(*(uint32_t *)&buf[2]);
+}
+
+static bool tpm_crb_is_busy(TPMCRBState *s)
+{
+    return CRB_REG(s, TPM_CRB_REG_CTRL_START) & TPM_CRB_CTRL_START_CMD;
+}
+
+/*
+ * Copy the command from the data buffer in guest memory into the
+ * backend's transfer buffer and send it to the TPM.
+ */
+static void tpm_crb_tpm_send(TPMCRBState *s, uint8_t locty)
+{
+    uint8_t *cmd = memory_region_get_ram_ptr(&s->cmdmem);
+    uint32_t len = tpm_crb_get_size_from_buffer(cmd);
+
+    len = MIN(len, MIN(TPM_CRB_CTRL_CMD_SIZE, s->loc.w_buffer.size));
+    memcpy(s->loc.w_buffer.buffer, cmd, len);
+
+    s->locty_number = locty;
+    s->locty_data = &s->loc;
+
+    /* w_offset serves as length indicator for length of data */
+    s->loc.w_offset = len;
+    s->loc.state = TPM_TIS_STATE_EXECUTION;
+
+    tpm_backend_deliver_request(s->be_driver);
+}
+
+static void tpm_crb_receive_bh(void *opaque)
+{
+    TPMCRBState *s = opaque;
+    uint8_t *rsp = memory_region_get_ram_ptr(&s->cmdmem);
+    uint32_t len;
+
+    s->bh_scheduled = false;
+
+    qemu_mutex_lock(&s->state_lock);
+
+    len = tpm_crb_get_size_from_buffer(s->loc.r_buffer.buffer);
+    memcpy(rsp, s->loc.r_buffer.buffer,
+           MIN(len, MIN(TPM_CRB_CTRL_CMD_SIZE, s->loc.r_buffer.size)));
+    memory_region_set_dirty(&s->cmdmem, 0, TPM_CRB_CTRL_CMD_SIZE);
+
+    s->loc.state = TPM_TIS_STATE_COMPLETION;
+    s->loc.w_offset = 0;
+    s->loc.complete_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    CRB_REG(s, TPM_CRB_REG_CTRL_START) &= ~TPM_CRB_CTRL_START_CMD;
+
+    /* notify of completed command */
+    qemu_cond_signal(&s->cmd_complete);
+    qemu_mutex_unlock(&s->state_lock);
+}
+
+/*
+ * Callback from the TPM to indicate that the response was received.
+ */
+static void tpm_crb_receive_cb(void *opaque, uint8_t locty,
+                               bool is_selftest_done)
+{
+    TPMCRBState *s = opaque;
+
+    assert(s->locty_number == locty);
+
+    qemu_mutex_lock(&s->state_lock);
+    /* notify of completed command */
+    qemu_cond_signal(&s->cmd_complete);
+    qemu_mutex_unlock(&s->state_lock);
+
+    qemu_bh_schedule(s->bh);
+
+    s->bh_scheduled = true;
+}
+
+/*
+ * Read a register of the CRB interface
+ */
+static uint64_t tpm_crb_mmio_read(void *opaque, hwaddr addr,
+                                  unsigned size)
+{
+    TPMCRBState *s = opaque;
+    uint32_t val = 0xffffffff;
+    uint8_t shift = (addr & 0x3) * 8;
+    int64_t fetch_ns;
+
+    if (tpm_backend_had_startup_error(s->be_driver)) {
+        return val;
+    }
+
+    val = CRB_REG(s, addr & ~0x3);
+
+    switch (addr & ~0x3) {
+    case TPM_CRB_REG_LOC_STATE:
+        if (!tpm_backend_get_tpm_established_flag(s->be_driver)) {
+            val |= TPM_CRB_LOC_STATE_TPM_ESTABLISHED;
+        }
+        break;
+    case TPM_CRB_REG_CTRL_START:
+        /*
+         * The response is already in the data buffer, so the guest has
+         * it as soon as it sees that the command completed.
+         */
+        if (s->loc.complete_ns) {
+            fetch_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                       s->loc.complete_ns;
+            s->loc.complete_ns = 0;
+            tpm_backend_stats_fetch(s->be_driver,
+                                    tpm_backend_get_ordinal(
+                                        s->loc.w_buffer.buffer,
+                                        s->loc.w_buffer.size),
+                                    fetch_ns);
+            trace_tpm_crb_fetch_done(fetch_ns);
+        }
+        break;
+    }
+
+    val >>= shift;
+
+    DPRINTF("tpm_crb:  read.%u(%08x) = %08x\n", size, (int)addr, (int)val);
+
+    return val;
+}
+
+/*
+ * Write a value to a register of the CRB interface
+ */
+static void tpm_crb_mmio_write(void *opaque, hwaddr addr,
+                               uint64_t val, unsigned size)
+{
+    TPMCRBState *s = opaque;
+    uint8_t locty = 0; /* only locality 0 is implemented */
+
+    DPRINTF("tpm_crb: write.%u(%08x) = %08x\n", size, (int)addr, (int)val);
+
+    if (tpm_backend_had_startup_error(s->be_driver)) {
+        return;
+    }
+
+    switch (addr) {
+    case TPM_CRB_REG_LOC_CTRL:
+        if (val & TPM_CRB_LOC_CTRL_RELINQUISH) {
+            CRB_REG(s, TPM_CRB_REG_LOC_STATE) &=
+                ~TPM_CRB_LOC_STATE_LOC_ASSIGNED;
+            CRB_REG(s, TPM_CRB_REG_LOC_STS) &= ~TPM_CRB_LOC_STS_GRANTED;
+        } else if (val & TPM_CRB_LOC_CTRL_REQUEST_ACCESS) {
+            CRB_REG(s, TPM_CRB_REG_LOC_STATE) =
+                TPM_CRB_LOC_STATE_TPM_REG_VALID_STS |
+                TPM_CRB_LOC_STATE_LOC_ASSIGNED |
+                (locty << TPM_CRB_LOC_STATE_ACTIVE_LOCALITY_SHIFT);
+            CRB_REG(s, TPM_CRB_REG_LOC_STS) |= TPM_CRB_LOC_STS_GRANTED;
+        }
+        break;
+    case TPM_CRB_REG_CTRL_REQ:
+        switch (val) {
+        case TPM_CRB_CTRL_REQ_CMD_READY:
+            CRB_REG(s, TPM_CRB_REG_CTRL_STS) &= ~TPM_CRB_CTRL_STS_TPM_IDLE;
+            break;
+        case TPM_CRB_CTRL_REQ_GO_IDLE:
+            CRB_REG(s, TPM_CRB_REG_CTRL_STS) |= TPM_CRB_CTRL_STS_TPM_IDLE;
+            break;
+        }
+        break;
+    case TPM_CRB_REG_CTRL_CANCEL:
+        if (val == TPM_CRB_CTRL_CANCEL_CMD && tpm_crb_is_busy(s)) {
+            /*
+             * request the backend to cancel. Some backends may not
+             * support it
+             */
+            tpm_backend_cancel_cmd(s->be_driver);
+        }
+        break;
+    case TPM_CRB_REG_CTRL_START:
+        if (val == TPM_CRB_CTRL_START_CMD && !tpm_crb_is_busy(s) &&
+            (CRB_REG(s, TPM_CRB_REG_LOC_STATE) &
+             TPM_CRB_LOC_STATE_LOC_ASSIGNED) &&
+            !(CRB_REG(s, TPM_CRB_REG_CTRL_STS) & TPM_CRB_CTRL_STS_TPM_IDLE)) {
+            CRB_REG(s, TPM_CRB_REG_CTRL_START) |= TPM_CRB_CTRL_START_CMD;
+            tpm_crb_tpm_send(s, locty);
+        }
+        break;
+    }
+}
+
+static const MemoryRegionOps tpm_crb_memory_ops = {
+    .read = tpm_crb_mmio_read,
+    .write = tpm_crb_mmio_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .valid = {
+        .min_access_size = 1,
+        .max_access_size = 4,
+    },
+};
+
+/*
+ * Get the TPMVersion of the backend device being used
+ */
+TPMVersion tpm_crb_get_tpm_version(Object *obj)
+{
+    TPMCRBState *s = TPM_CRB(obj);
+
+    return tpm_backend_get_tpm_version(s->be_driver);
+}
+
+/*
+ * This function is called when the machine starts, resets or due to
+ * S3 resume.
+ */
+static void tpm_crb_reset(DeviceState *dev)
+{
+    TPMCRBState *s = TPM_CRB(dev);
+
+    s->be_tpm_version = tpm_backend_get_tpm_version(s->be_driver);
+
+    /* does not wait for a command in processing; its response is dropped */
+    tpm_backend_reset(s->be_driver);
+    qemu_bh_cancel(s->bh);
+    s->bh_scheduled = false;
+    s->loc.complete_ns = 0;
+
+    memset(s->regs, 0, sizeof(s->regs));
+
+    CRB_REG(s, TPM_CRB_REG_LOC_STATE) = TPM_CRB_LOC_STATE_TPM_REG_VALID_STS;
+    CRB_REG(s, TPM_CRB_REG_CTRL_STS) = TPM_CRB_CTRL_STS_TPM_IDLE;
+    CRB_REG(s, TPM_CRB_REG_INTF_ID) =
+        TPM_CRB_INTF_ID_TYPE_CRB |
+        TPM_CRB_INTF_ID_VERSION_CRB |
+        TPM_CRB_INTF_ID_CAP_DATA_XFER_64B |
+        TPM_CRB_INTF_ID_CAP_CRB |
+        TPM_CRB_INTF_ID_SEL_CRB |
+        (TPM_CRB_TPM_RID << TPM_CRB_INTF_ID_RID_SHIFT);
+    CRB_REG(s, TPM_CRB_REG_INTF_ID2) =
+        (TPM_CRB_TPM_DID << 16) | TPM_CRB_TPM_VID;
+    CRB_REG(s, TPM_CRB_REG_CTRL_CMD_SIZE) = TPM_CRB_CTRL_CMD_SIZE;
+    CRB_REG(s, TPM_CRB_REG_CTRL_CMD_LADDR) =
+        TPM_CRB_ADDR_BASE + TPM_CRB_DATA_BUFFER_OFFSET;
+    CRB_REG(s, TPM_CRB_REG_CTRL_RSP_SIZE) = TPM_CRB_CTRL_CMD_SIZE;
+    CRB_REG(s, TPM_CRB_REG_CTRL_RSP_ADDR) =
+        TPM_CRB_ADDR_BASE + TPM_CRB_DATA_BUFFER_OFFSET;
+
+    s->loc.state = TPM_TIS_STATE_IDLE;
+    s->loc.w_offset = 0;
+    tpm_backend_realloc_buffer(s->be_driver, &s->loc.w_buffer);
+    s->loc.r_offset = 0;
+    tpm_backend_realloc_buffer(s->be_driver, &s->loc.r_buffer);
+
+    tpm_backend_startup_tpm(s->be_driver);
+}
+
+/* persistent state handling */
+
+static void tpm_crb_pre_save(void *opaque)
+{
+    TPMCRBState *s = opaque;
+
+    qemu_mutex_lock(&s->state_lock);
+
+    /* wait for outstanding request to complete */
+    if (s->loc.state == TPM_TIS_STATE_EXECUTION) {
+        /*
+         * If we get here when the bh is scheduled but did not run,
+         * we won't get notified...
+         */
+        if (!s->bh_scheduled) {
+            /* backend thread to notify us */
+            qemu_cond_wait(&s->cmd_complete, &s->state_lock);
+        }
+        if (s->loc.state == TPM_TIS_STATE_EXECUTION) {
+            /* bottom half did not run - run its function */
+            qemu_mutex_unlock(&s->state_lock);
+            tpm_crb_receive_bh(opaque);
+            qemu_mutex_lock(&s->state_lock);
+        }
+    }
+
+    qemu_mutex_unlock(&s->state_lock);
+}
+
+static const VMStateDescription vmstate_tpm_crb = {
+    .name = "tpm-crb",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save  = tpm_crb_pre_save,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(regs, TPMCRBState, TPM_CRB_NUM_REGS),
+        VMSTATE_UINT32(loc.state, TPMCRBState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property tpm_crb_properties[] = {
+    DEFINE_PROP_STRING("tpmdev", TPMCRBState, backend),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void tpm_crb_realizefn(DeviceState *dev, Error **errp)
+{
+    TPMCRBState *s = TPM_CRB(dev);
+    Error *local_err = NULL;
+
+    /* TPM_CRB_ADDR_BASE is TPM_TIS_ADDR_BASE */
+    if (object_resolve_path_type("", TYPE_TPM_TIS, NULL)) {
+        error_setg(errp, "tpm_crb: cannot be used together with tpm-tis, "
+                   "both use address 0x%x", TPM_CRB_ADDR_BASE);
+        return;
+    }
+
+    s->be_driver = qemu_find_tpm(s->backend);
+    if (!s->be_driver) {
+        error_setg(errp, "tpm_crb: backend driver with id %s could not be "
+                   "found", s->backend);
+        return;
+    }
+
+    if (tpm_backend_get_tpm_version(s->be_driver) != TPM_VERSION_2_0) {
+        error_setg(errp, "tpm_crb: backend driver with id %s does not "
+                   "provide a TPM 2", s->backend);
+        return;
+    }
+
+    s->be_driver->fe_model = TPM_MODEL_TPM_CRB;
+
+    if (tpm_backend_init(s->be_driver, s,
+                         &s->locty_number, &s->locty_data,
+                         tpm_crb_receive_cb)) {
+        error_setg(errp, "tpm_crb: backend driver with id %s could not be "
+                   "initialized", s->backend);
+        return;
+    }
+
+    memory_region_init_ram(&s->cmdmem, OBJECT(s), "tpm-crb-cmd",
+                           TPM_CRB_CTRL_CMD_SIZE, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    vmstate_register_ram(&s->cmdmem, dev);
+
+    s->bh = qemu_bh_new(tpm_crb_receive_bh, s);
+
+    memory_region_add_subregion(isa_address_space(ISA_DEVICE(dev)),
+                                TPM_CRB_ADDR_BASE, &s->mmio);
+    memory_region_add_subregion(isa_address_space(ISA_DEVICE(dev)),
+                                TPM_CRB_ADDR_BASE + TPM_CRB_DATA_BUFFER_OFFSET,
+                                &s->cmdmem);
+}
+
+static void tpm_crb_initfn(Object *obj)
+{
+    TPMCRBState *s = TPM_CRB(obj);
+
+    memory_region_init_io(&s->mmio, OBJECT(s), &tpm_crb_memory_ops,
+                          s, "tpm-crb-mmio", TPM_CRB_REG_DATA_BUFFER);
+
+    qemu_mutex_init(&s->state_lock);
+    qemu_cond_init(&s->cmd_complete);
+}
+
+static void tpm_crb_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = tpm_crb_realizefn;
+    dc->props = tpm_crb_properties;
+    dc->reset = tpm_crb_reset;
+    dc->vmsd  = &vmstate_tpm_crb;
+}
+
+static const TypeInfo tpm_crb_info = {
+    .name = TYPE_TPM_CRB,
+    .parent = TYPE_ISA_DEVICE,
+    .instance_size = sizeof(TPMCRBState),
+    .instance_init = tpm_crb_initfn,
+    .class_init  = tpm_crb_class_init,
+};
+
+static void tpm_crb_register(void)
+{
+    type_register_static(&tpm_crb_info);
+    tpm_register_model(TPM_MODEL_TPM_CRB);
+}
+
+type_init(tpm_crb_register)
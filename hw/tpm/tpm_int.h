@@ -67,13 +67,27 @@ struct tpm_resp_hdr {
 #define TPM_SUCCESS               0
 #define TPM_FAIL                  9
 
+#define TPM_ORD_PcrRead           0x15
+#define TPM_ORD_GetRandom         0x46
 #define TPM_ORD_ContinueSelfTest  0x53
+#define TPM_ORD_GetCapability     0x65
 #define TPM_ORD_GetTicks          0xf1
 
 
 /* TPM2 defines */
 #define TPM2_ST_NO_SESSIONS       0x8001
 
+#define TPM2_CC_GetCapability     0x0000017a
+#define TPM2_CC_GetRandom         0x0000017b
+#define TPM2_CC_PCR_Read          0x0000017e
 #define TPM2_CC_ReadClock         0x00000181
+#define TPM2_CC_PCR_Extend        0x00000182
+
+/* QEMU vendor command, see docs/specs/tpm-batch.txt */
+#define TPM2_CC_QEMU_BatchExtend  0x20000100
+
+#define TPM2_RC_SUCCESS           0x000
+#define TPM2_RC_COMMAND_SIZE      0x142
+#define TPM2_RC_COMMAND_CODE      0x143
 
 #endif /* TPM_TPM_INT_H */
@@ -0,0 +1,1086 @@
+/*
+ * multiplexed TPM service driver
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The TPMs of many VMs are provided by one service on the host that QEMU
+ * talks to over a UNIX socket. Every message carries a tag, so that the
+ * main loop, the worker thread and migration can each have a transaction
+ * in flight on the one connection; whichever thread waits for a response
+ * reads the next message from the socket and hands it to the transaction
+ * it belongs to. The protocol is described in docs/specs/tpm-mux.txt.
+ */
+
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/sockets.h"
+#include "qemu/timer.h"
+#include "sysemu/tpm_backend.h"
+#include "tpm_int.h"
+#include "hw/hw.h"
+#include "sysemu/tpm_backend_int.h"
+#include "tpm_tis.h"
+#include "tpm_ioctl.h"
+#include "migration/migration.h"
+
+#define DEBUG_TPM 0
+
+#define DPRINTF(fmt, ...) do { \
+    if (DEBUG_TPM) { \
+        fprintf(stderr, fmt, ## __VA_ARGS__); \
+    } \
+} while (0);
+
+#define TYPE_TPM_MUX "tpm-mux"
+#define TPM_MUX(obj) \
+    OBJECT_CHECK(TPMMuxState, (obj), TYPE_TPM_MUX)
+
+static const TPMDriverOps tpm_mux_driver;
+static const VMStateDescription vmstate_tpm_mux;
+
+/* protocol */
+#define TPM_MUX_PROTOCOL_VERSION        1
+
+#define TPM_MUX_MSG_HELLO               1
+#define TPM_MUX_MSG_COMMAND             2
+#define TPM_MUX_MSG_CANCEL              3
+#define TPM_MUX_MSG_INIT                4
+#define TPM_MUX_MSG_SHUTDOWN            5
+#define TPM_MUX_MSG_GET_ESTABLISHED     6
+#define TPM_MUX_MSG_RESET_ESTABLISHED   7
+#define TPM_MUX_MSG_GET_STATE           8
+#define TPM_MUX_MSG_SET_STATE           9
+#define TPM_MUX_MSG_RESPONSE            0x80000000
+
+#define TPM_MUX_INIT_FLAG_RESUME        (1 << 0)
+
+/* message header; all fields are big endian */
+typedef struct TPMMuxHdr {
+    uint32_t type;
+    uint32_t tag;
+    uint32_t len;       /* length of the payload following the header */
+} QEMU_PACKED TPMMuxHdr;
+
+/* a transaction waiting for its response */
+typedef struct TPMMuxXfer {
+    uint32_t type;
+    uint32_t tag;
+    bool done;
+    int ret;            /* 0 or a negative errno */
+
+    uint8_t *resp;      /* buffer for the response payload */
+    uint32_t resp_size; /* size of resp; allocated if resp is NULL */
+    uint32_t resp_len;  /* length of the response payload */
+
+    QLIST_ENTRY(TPMMuxXfer) next;
+} TPMMuxXfer;
+
+/* data structures */
+typedef struct TPMMuxThreadParams {
+    void *tpm_state;
+
+    uint8_t *locty_number;
+    TPMLocality **locty_data;
+
+    TPMRecvDataCB *recv_data_callback;
+    TPMBackend *tb;
+} TPMMuxThreadParams;
+
+/* a request queued for the worker thread */
+typedef struct TPMMuxRequest {
+    uint8_t locty;
+    TPMLocality *locty_data;
+    int64_t queued_ns;      /* QEMU_CLOCK_REALTIME when delivered */
+    uint32_t reset_gen;     /* reset_gen when delivered */
+} TPMMuxRequest;
+
+struct TPMMuxState {
+    TPMBackend parent;
+
+    TPMBackendThread tbt;
+
+    TPMMuxThreadParams tpm_thread_params;
+
+    char *vm_id;
+    int sock_fd;
+    bool had_startup_error;
+    bool init_pending;      /* INIT deferred until the TPM is used */
+    TPMVersion tpm_version;
+
+    /* the connection; protects writing to the socket and the fields below */
+    QemuMutex xfer_lock;
+    QemuCond xfer_cond;     /* signaled when a transaction completes */
+    uint32_t next_tag;
+    bool reader_active;     /* a thread is reading from the socket */
+    bool broken;            /* the connection failed */
+    uint32_t exec_tag;      /* tag of the executing command or 0 */
+    QLIST_HEAD(, TPMMuxXfer) xfers;
+
+    QemuMutex state_lock;
+    QemuCond cmd_complete;  /* signaled once tpm_busy is false */
+    bool tpm_busy;          /* requests are queued or in processing */
+    GQueue requests;        /* of TPMMuxRequest */
+    uint32_t queue_depth[TPM_BACKEND_NUM_LOCALITIES];
+    bool req_in_flight;     /* the worker thread is processing a request */
+    uint32_t reset_gen;     /* incremented by every reset */
+
+    TPMBlobBuffers tpm_blobs;
+};
+
+typedef struct TPMMuxState TPMMuxState;
+
+/* functions */
+
+static uint32_t tpm_mux_get_size_from_buffer(const uint8_t *buf)
+{
+    struct tpm_resp_hdr *resp = (struct tpm_resp_hdr *)buf;
+
+    return be32_to_cpu(resp->len);
+}
+
+/*
+ * Write an error message in the given output buffer.
+ */
+static void tpm_mux_write_fatal_error_response(uint8_t *out, uint32_t out_len)
+{
+    if (out_len >= sizeof(struct tpm_resp_hdr)) {
+        struct tpm_resp_hdr *resp = (struct tpm_resp_hdr *)out;
+
+        resp->tag = cpu_to_be16(TPM_TAG_RSP_COMMAND);
+        resp->len = cpu_to_be32(sizeof(struct tpm_resp_hdr));
+        resp->errcode = cpu_to_be32(TPM_FAIL);
+    }
+}
+
+static bool tpm_mux_is_selftest(const uint8_t *in, uint32_t in_len)
+{
+    struct tpm_req_hdr *hdr = (struct tpm_req_hdr *)in;
+
+    if (in_len >= sizeof(*hdr)) {
+        return (be32_to_cpu(hdr->ordinal) == TPM_ORD_ContinueSelfTest);
+    }
+
+    return false;
+}
+
+/*
+ * Send a message. Called with the xfer_lock held.
+ */
+static int tpm_mux_send(TPMMuxState *tpm_mux, uint32_t type, uint32_t tag,
+                        const struct iovec *iov, int iovcnt)
+{
+    TPMMuxHdr hdr;
+    uint32_t len = 0;
+    int i;
+
+    if (tpm_mux->broken) {
+        return -EIO;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+
+    hdr.type = cpu_to_be32(type);
+    hdr.tag = cpu_to_be32(tag);
+    hdr.len = cpu_to_be32(len);
+
+    if (send_all(tpm_mux->sock_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        goto err_exit;
+    }
+    for (i = 0; i < iovcnt; i++) {
+        if (send_all(tpm_mux->sock_fd, iov[i].iov_base,
+                     iov[i].iov_len) != iov[i].iov_len) {
+            goto err_exit;
+        }
+    }
+
+    return 0;
+
+err_exit:
+    error_report("tpm_mux: error sending to the TPM service: %s",
+                 strerror(errno));
+    tpm_mux->broken = true;
+
+    return -EIO;
+}
+
+/*
+ * Fail all transactions; the connection is not usable anymore. Called
+ * with the xfer_lock held.
+ */
+static void tpm_mux_fail_xfers(TPMMuxState *tpm_mux, int ret)
+{
+    TPMMuxXfer *xfer;
+
+    tpm_mux->broken = true;
+    QLIST_FOREACH(xfer, &tpm_mux->xfers, next) {
+        if (!xfer->done) {
+            xfer->ret = ret;
+            xfer->done = true;
+        }
+    }
+}
+
+static int tpm_mux_discard(TPMMuxState *tpm_mux, uint32_t len)
+{
+    uint8_t buf[256];
+    uint32_t n;
+
+    while (len > 0) {
+        n = MIN(len, sizeof(buf));
+        if (recv_all(tpm_mux->sock_fd, buf, n, false) != n) {
+            return -EIO;
+        }
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Read one message from the socket and complete the transaction it
+ * answers. Called without the xfer_lock held by the thread that is the
+ * reader.
+ */
+static int tpm_mux_read_msg(TPMMuxState *tpm_mux)
+{
+    TPMMuxHdr hdr;
+    TPMMuxXfer *xfer;
+    uint32_t len, n;
+
+    if (recv_all(tpm_mux->sock_fd, &hdr, sizeof(hdr), false) != sizeof(hdr)) {
+        error_report("tpm_mux: error receiving from the TPM service");
+        return -EIO;
+    }
+    hdr.type = be32_to_cpu(hdr.type);
+    hdr.tag = be32_to_cpu(hdr.tag);
+    len = be32_to_cpu(hdr.len);
+
+    qemu_mutex_lock(&tpm_mux->xfer_lock);
+    QLIST_FOREACH(xfer, &tpm_mux->xfers, next) {
+        if (xfer->tag == hdr.tag && !xfer->done &&
+            (xfer->type | TPM_MUX_MSG_RESPONSE) == hdr.type) {
+            break;
+        }
+    }
+    qemu_mutex_unlock(&tpm_mux->xfer_lock);
+
+    if (!xfer) {
+        DPRINTF("tpm_mux: dropping message 0x%x with tag %u\n",
+                hdr.type, hdr.tag);
+        return tpm_mux_discard(tpm_mux, len);
+    }
+
+    /* the transaction stays around until it is done */
+    if (!xfer->resp) {
+        xfer->resp = g_malloc(len);
+        xfer->resp_size = len;
+    }
+    n = MIN(len, xfer->resp_size);
+    if (recv_all(tpm_mux->sock_fd, xfer->resp, n, false) != n ||
+        tpm_mux_discard(tpm_mux, len - n)) {
+        return -EIO;
+    }
+
+    qemu_mutex_lock(&tpm_mux->xfer_lock);
+    xfer->resp_len = n;
+    xfer->ret = 0;
+    xfer->done = true;
+    qemu_mutex_unlock(&tpm_mux->xfer_lock);
+
+    return 0;
+}
+
+/*
+ * Send a message and wait for its response. The response payload is
+ * stored in xfer->resp, which is allocated if it is NULL.
+ *
+ * Returns 0 on success or a negative errno.
+ */
+static int tpm_mux_transact(TPMMuxState *tpm_mux, TPMMuxXfer *xfer,
+                            uint32_t type, const struct iovec *iov,
+                            int iovcnt)
+{
+    int ret;
+
+    qemu_mutex_lock(&tpm_mux->xfer_lock);
+
+    xfer->type = type;
+    /* tag 0 means no command is executing */
+    if (++tpm_mux->next_tag == 0) {
+        tpm_mux->next_tag = 1;
+    }
+    xfer->tag = tpm_mux->next_tag;
+    xfer->done = false;
+    xfer->resp_len = 0;
+    QLIST_INSERT_HEAD(&tpm_mux->xfers, xfer, next);
+
+    if (type == TPM_MUX_MSG_COMMAND) {
+        tpm_mux->exec_tag = xfer->tag;
+    }
+
+    ret = tpm_mux_send(tpm_mux, type, xfer->tag, iov, iovcnt);
+    if (ret < 0) {
+        xfer->ret = ret;
+        xfer->done = true;
+    }
+
+    while (!xfer->done) {
+        if (tpm_mux->reader_active) {
+            qemu_cond_wait(&tpm_mux->xfer_cond, &tpm_mux->xfer_lock);
+            continue;
+        }
+        tpm_mux->reader_active = true;
+        qemu_mutex_unlock(&tpm_mux->xfer_lock);
+
+        ret = tpm_mux_read_msg(tpm_mux);
+
+        qemu_mutex_lock(&tpm_mux->xfer_lock);
+        tpm_mux->reader_active = false;
+        if (ret < 0) {
+            tpm_mux_fail_xfers(tpm_mux, ret);
+        }
+        qemu_cond_broadcast(&tpm_mux->xfer_cond);
+    }
+
+    QLIST_REMOVE(xfer, next);
+    if (type == TPM_MUX_MSG_COMMAND) {
+        tpm_mux->exec_tag = 0;
+    }
+
+    qemu_mutex_unlock(&tpm_mux->xfer_lock);
+
+    return xfer->ret;
+}
+
+/*
+ * Run a control transaction whose response starts with a result code,
+ * storing the following words of the response in out.
+ *
+ * Returns 0 on success, a negative errno or the positive result code
+ * from the service.
+ */
+static int tpm_mux_control(TPMMuxState *tpm_mux, uint32_t type,
+                           const struct iovec *iov, int iovcnt,
+                           uint32_t *out, unsigned int out_words)
+{
+    uint32_t resp[4];
+    TPMMuxXfer xfer = {
+        .resp = (uint8_t *)resp,
+        .resp_size = sizeof(resp),
+    };
+    unsigned int i;
+    int ret;
+
+    assert(out_words < ARRAY_SIZE(resp));
+
+    ret = tpm_mux_transact(tpm_mux, &xfer, type, iov, iovcnt);
+    if (ret < 0) {
+        return ret;
+    }
+    if (xfer.resp_len < (1 + out_words) * sizeof(uint32_t)) {
+        error_report("tpm_mux: short response 0x%x from the TPM service",
+                     type | TPM_MUX_MSG_RESPONSE);
+        return -EIO;
+    }
+    for (i = 0; i < out_words; i++) {
+        out[i] = be32_to_cpu(resp[i + 1]);
+    }
+
+    return be32_to_cpu(resp[0]);
+}
+
+static int tpm_mux_hello(TPMMuxState *tpm_mux)
+{
+    uint32_t version = cpu_to_be32(TPM_MUX_PROTOCOL_VERSION);
+    struct iovec iov[] = {
+        { .iov_base = &version, .iov_len = sizeof(version) },
+        { .iov_base = tpm_mux->vm_id, .iov_len = strlen(tpm_mux->vm_id) },
+    };
+    uint32_t tpm_version;
+    int ret;
+
+    ret = tpm_mux_control(tpm_mux, TPM_MUX_MSG_HELLO, iov, ARRAY_SIZE(iov),
+                          &tpm_version, 1);
+    if (ret) {
+        error_report("tpm_mux: the TPM service did not accept VM '%s' (%d)",
+                     tpm_mux->vm_id, ret);
+        return -1;
+    }
+
+    switch (tpm_version) {
+    case 1:
+        tpm_mux->tpm_version = TPM_VERSION_1_2;
+        break;
+    case 2:
+        tpm_mux->tpm_version = TPM_VERSION_2_0;
+        break;
+    default:
+        error_report("tpm_mux: unsupported TPM version %u", tpm_version);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Power on the TPM of the VM; after migration resume from the state that
+ * was set before.
+ */
+static int tpm_mux_init_tpm(TPMMuxState *tpm_mux, bool is_resume)
+{
+    uint32_t flags = cpu_to_be32(is_resume ? TPM_MUX_INIT_FLAG_RESUME : 0);
+    struct iovec iov = { .iov_base = &flags, .iov_len = sizeof(flags) };
+    int ret;
+
+    ret = tpm_mux_control(tpm_mux, TPM_MUX_MSG_INIT, &iov, 1, NULL, 0);
+    if (ret) {
+        error_report("tpm_mux: could not initialize the TPM (%d)", ret);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Send the INIT that was deferred when the TPM was started up, so that
+ * a reset does not wait for a command of before the reset to complete.
+ */
+static void tpm_mux_init_pending(TPMMuxState *tpm_mux)
+{
+    bool pending;
+
+    qemu_mutex_lock(&tpm_mux->state_lock);
+    pending = tpm_mux->init_pending;
+    tpm_mux->init_pending = false;
+    qemu_mutex_unlock(&tpm_mux->state_lock);
+
+    if (pending && tpm_mux_init_tpm(tpm_mux, false)) {
+        tpm_mux->had_startup_error = true;
+    }
+}
+
+static int tpm_mux_unix_transfer(TPMMuxState *tpm_mux,
+                                 uint8_t locality_number,
+                                 const TPMLocality *locty_data,
+                                 bool *selftest_done)
+{
+    const uint8_t *in = locty_data->w_buffer.buffer;
+    uint32_t in_len = locty_data->w_offset;
+    uint8_t *out = locty_data->r_buffer.buffer;
+    uint32_t out_len = locty_data->r_buffer.size;
+    struct iovec iov[] = {
+        { .iov_base = &locality_number, .iov_len = 1 },
+        { .iov_base = (void *)in, .iov_len = in_len },
+    };
+    TPMMuxXfer xfer = {
+        .resp = out,
+        .resp_size = out_len,
+    };
+    const struct tpm_resp_hdr *hdr;
+    int ret;
+
+    *selftest_done = false;
+
+    ret = tpm_mux_transact(tpm_mux, &xfer, TPM_MUX_MSG_COMMAND, iov,
+                           ARRAY_SIZE(iov));
+    if (ret < 0 || xfer.resp_len < sizeof(struct tpm_resp_hdr) ||
+        tpm_mux_get_size_from_buffer(out) != xfer.resp_len) {
+        if (ret == 0) {
+            error_report("tpm_mux: received invalid response packet "
+                         "from the TPM service");
+        }
+        tpm_mux_write_fatal_error_response(out, out_len);
+        return -1;
+    }
+
+    if (tpm_mux_is_selftest(in, in_len)) {
+        hdr = (struct tpm_resp_hdr *)out;
+        *selftest_done = (be32_to_cpu(hdr->errcode) == 0);
+    }
+
+    return xfer.resp_len;
+}
+
+static void tpm_mux_worker_thread(gpointer data,
+                                  gpointer user_data)
+{
+    TPMMuxThreadParams *thr_parms = user_data;
+    TPMMuxState *tpm_mux = TPM_MUX(thr_parms->tb);
+    TPMBackendCmd cmd = (TPMBackendCmd)data;
+    TPMMuxRequest *req;
+    bool selftest_done = false;
+    int64_t start_ns;
+    uint32_t in_len;
+    bool stale;
+
+    DPRINTF("tpm_mux: processing command type %d\n", cmd);
+
+    switch (cmd) {
+    case TPM_BACKEND_CMD_PROCESS_CMD:
+        qemu_mutex_lock(&tpm_mux->state_lock);
+        req = g_queue_pop_head(&tpm_mux->requests);
+        tpm_mux->req_in_flight = (req != NULL);
+        qemu_mutex_unlock(&tpm_mux->state_lock);
+        if (!req) {
+            break;
+        }
+
+        tpm_mux_init_pending(tpm_mux);
+
+        start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        tpm_mux_unix_transfer(tpm_mux, req->locty, req->locty_data,
+                              &selftest_done);
+
+        in_len = req->locty_data->w_offset;
+        tpm_backend_stats_exec(thr_parms->tb,
+                               req->locty_data->w_buffer.buffer, in_len,
+                               tpm_mux_get_size_from_buffer(
+                                   req->locty_data->r_buffer.buffer),
+                               start_ns - req->queued_ns,
+                               qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                   start_ns);
+
+        /* the response to a request from before a reset goes nowhere */
+        qemu_mutex_lock(&tpm_mux->state_lock);
+        stale = (req->reset_gen != tpm_mux->reset_gen);
+        qemu_mutex_unlock(&tpm_mux->state_lock);
+
+        if (!stale) {
+            thr_parms->recv_data_callback(thr_parms->tpm_state,
+                                          req->locty,
+                                          selftest_done);
+        }
+        /* result delivered */
+        qemu_mutex_lock(&tpm_mux->state_lock);
+        if (!stale) {
+            tpm_mux->queue_depth[req->locty]--;
+        }
+        tpm_mux->req_in_flight = false;
+        tpm_mux->tpm_busy = !g_queue_is_empty(&tpm_mux->requests);
+        if (!tpm_mux->tpm_busy) {
+            qemu_cond_signal(&tpm_mux->cmd_complete);
+        }
+        qemu_mutex_unlock(&tpm_mux->state_lock);
+        g_free(req);
+        break;
+    case TPM_BACKEND_CMD_INIT:
+    case TPM_BACKEND_CMD_END:
+    case TPM_BACKEND_CMD_TPM_RESET:
+        /* nothing to do */
+        break;
+    }
+}
+
+/*
+ * Start the TPM (thread). If it had been started before, then terminate
+ * and start it again.
+ */
+static int tpm_mux_startup_tpm(TPMBackend *tb)
+{
+    TPMMuxState *tpm_mux = TPM_MUX(tb);
+
+    /* the worker thread survives resets; it is only created once */
+    tpm_backend_thread_create(&tpm_mux->tbt,
+                              tpm_mux_worker_thread,
+                              &tpm_mux->tpm_thread_params,
+                              tb->aio_context);
+
+    qemu_mutex_lock(&tpm_mux->state_lock);
+    tpm_mux->init_pending = true;
+    qemu_mutex_unlock(&tpm_mux->state_lock);
+
+    return 0;
+}
+
+/*
+ * Drop all requests the worker thread did not get to anymore. The response
+ * to a request that is being processed is not delivered to the frontend.
+ */
+static void tpm_mux_drop_requests(TPMMuxState *tpm_mux)
+{
+    TPMMuxRequest *req;
+
+    qemu_mutex_lock(&tpm_mux->state_lock);
+    while ((req = g_queue_pop_head(&tpm_mux->requests)) != NULL) {
+        g_free(req);
+    }
+    memset(tpm_mux->queue_depth, 0, sizeof(tpm_mux->queue_depth));
+    tpm_mux->reset_gen++;
+    tpm_mux->tpm_busy = tpm_mux->req_in_flight;
+    qemu_mutex_unlock(&tpm_mux->state_lock);
+}
+
+static void tpm_mux_cancel_cmd(TPMBackend *tb)
+{
+    TPMMuxState *tpm_mux = TPM_MUX(tb);
+    uint32_t tag;
+    struct iovec iov = { .iov_base = &tag, .iov_len = sizeof(tag) };
+
+    /* the service does not respond to a cancellation */
+    qemu_mutex_lock(&tpm_mux->xfer_lock);
+    if (tpm_mux->exec_tag) {
+        tag = cpu_to_be32(tpm_mux->exec_tag);
+        tpm_mux_send(tpm_mux, TPM_MUX_MSG_CANCEL, 0, &iov, 1);
+    }
+    qemu_mutex_unlock(&tpm_mux->xfer_lock);
+}
+
+static void tpm_mux_reset(TPMBackend *tb)
+{
+    TPMMuxState *tpm_mux = TPM_MUX(tb);
+
+    DPRINTF("tpm_mux: CALL TO TPM_RESET!\n");
+
+    /*
+     * Do not wait for the command being processed; it is canceled and
+     * its response dropped. Requests after the reset queue up behind it.
+     */
+    tpm_mux_drop_requests(tpm_mux);
+    tpm_mux_cancel_cmd(tb);
+
+    tpm_mux->had_startup_error = tpm_mux->broken;
+}
+
+static int tpm_mux_init(TPMBackend *tb, void *tpm_state,
+                        uint8_t *locty_number, TPMLocality **locty_data,
+                        TPMRecvDataCB *recv_data_cb)
+{
+    TPMMuxState *tpm_mux = TPM_MUX(tb);
+
+    tpm_mux->tpm_thread_params.tpm_state = tpm_state;
+    tpm_mux->tpm_thread_params.locty_number = locty_number;
+    tpm_mux->tpm_thread_params.locty_data = locty_data;
+    tpm_mux->tpm_thread_params.recv_data_callback = recv_data_cb;
+    tpm_mux->tpm_thread_params.tb = tb;
+
+    return 0;
+}
+
+static bool tpm_mux_get_tpm_established_flag(TPMBackend *tb)
+{
+    TPMMuxState *tpm_mux = TPM_MUX(tb);
+    uint32_t bit;
+
+    if (tpm_mux_control(tpm_mux, TPM_MUX_MSG_GET_ESTABLISHED, NULL, 0,
+                        &bit, 1)) {
+        error_report("tpm_mux: Could not get the TPM established flag");
+        return false;
+    }
+    return bit != 0;
+}
+
+static int tpm_mux_reset_tpm_established_flag(TPMBackend *tb,
+                                              uint8_t locty)
+{
+    TPMMuxState *tpm_mux = TPM_MUX(tb);
+    uint32_t loc = cpu_to_be32(locty);
+    struct iovec iov = { .iov_base = &loc, .iov_len = sizeof(loc) };
+
+    /* only a TPM 2.0 will support this */
+    if (tpm_mux->tpm_version != TPM_VERSION_2_0) {
+        return 0;
+    }
+
+    if (tpm_mux_control(tpm_mux, TPM_MUX_MSG_RESET_ESTABLISHED, &iov, 1,
+                        NULL, 0)) {
+        error_report("tpm_mux: Could not reset the establishment bit");
+        return -1;
+    }
+    return 0;
+}
+
+static int tpm_mux_get_state_blob(TPMMuxState *tpm_mux, uint32_t type,
+                                  TPMSizedBuffer *tsb, uint32_t *flags)
+{
+    uint32_t req[2] = { cpu_to_be32(type), cpu_to_be32(1) /* decrypted */ };
+    struct iovec iov = { .iov_base = req, .iov_len = sizeof(req) };
+    TPMMuxXfer xfer = { .resp = NULL };
+    uint32_t hdr_len = 2 * sizeof(uint32_t);
+    int ret;
+
+    ret = tpm_mux_transact(tpm_mux, &xfer, TPM_MUX_MSG_GET_STATE, &iov, 1);
+    if (ret < 0) {
+        goto err_exit;
+    }
+    if (xfer.resp_len < hdr_len || ldl_be_p(xfer.resp) != 0) {
+        ret = -EIO;
+        goto err_exit;
+    }
+
+    *flags = ldl_be_p(xfer.resp + sizeof(uint32_t));
+    tsb->size = xfer.resp_len - hdr_len;
+    tsb->buffer = g_realloc(tsb->buffer, tsb->size);
+    memcpy(tsb->buffer, xfer.resp + hdr_len, tsb->size);
+
+err_exit:
+    if (ret) {
+        error_report("tpm_mux: could not get state blob type %d", type);
+    }
+    g_free(xfer.resp);
+
+    return ret;
+}
+
+static int tpm_mux_set_state_blob(TPMMuxState *tpm_mux, uint32_t type,
+                                  TPMSizedBuffer *tsb, uint32_t flags)
+{
+    uint32_t req[2] = { cpu_to_be32(type), cpu_to_be32(flags) };
+    struct iovec iov[] = {
+        { .iov_base = req, .iov_len = sizeof(req) },
+        { .iov_base = tsb->buffer, .iov_len = tsb->size },
+    };
+
+    if (tpm_mux_control(tpm_mux, TPM_MUX_MSG_SET_STATE, iov, ARRAY_SIZE(iov),
+                        NULL, 0)) {
+        error_report("tpm_mux: could not set state blob type %d", type);
+        return 1;
+    }
+    return 0;
+}
+
+static int tpm_mux_get_state_blobs(TPMBackend *tb,
+                                   TPMBlobBuffers *tpm_blobs)
+{
+    TPMMuxState *tpm_mux = TPM_MUX(tb);
+
+    if (tpm_mux_get_state_blob(tpm_mux, PTM_BLOB_TYPE_PERMANENT,
+                               &tpm_blobs->permanent,
+                               &tpm_blobs->permanent_flags) ||
+        tpm_mux_get_state_blob(tpm_mux, PTM_BLOB_TYPE_VOLATILE,
+                               &tpm_blobs->volatil,
+                               &tpm_blobs->volatil_flags) ||
+        tpm_mux_get_state_blob(tpm_mux, PTM_BLOB_TYPE_SAVESTATE,
+                               &tpm_blobs->savestate,
+                               &tpm_blobs->savestate_flags)) {
+        return 1;
+    }
+    return 0;
+}
+
+static int tpm_mux_set_state_blobs(TPMBackend *tb,
+                                   TPMBlobBuffers *tpm_blobs)
+{
+    TPMMuxState *tpm_mux = TPM_MUX(tb);
+
+    if (tpm_mux_set_state_blob(tpm_mux, PTM_BLOB_TYPE_PERMANENT,
+                               &tpm_blobs->permanent,
+                               tpm_blobs->permanent_flags) ||
+        tpm_mux_set_state_blob(tpm_mux, PTM_BLOB_TYPE_VOLATILE,
+                               &tpm_blobs->volatil,
+                               tpm_blobs->volatil_flags) ||
+        tpm_mux_set_state_blob(tpm_mux, PTM_BLOB_TYPE_SAVESTATE,
+                               &tpm_blobs->savestate,
+                               tpm_blobs->savestate_flags)) {
+        return 1;
+    }
+
+    /* the state just set replaces a pending power-on */
+    qemu_mutex_lock(&tpm_mux->state_lock);
+    tpm_mux->init_pending = false;
+    qemu_mutex_unlock(&tpm_mux->state_lock);
+
+    return tpm_mux_init_tpm(tpm_mux, true);
+}
+
+static bool tpm_mux_get_startup_error(TPMBackend *tb)
+{
+    TPMMuxState *tpm_mux = TPM_MUX(tb);
+
+    return tpm_mux->had_startup_error;
+}
+
+static size_t tpm_mux_realloc_buffer(TPMSizedBuffer *sb)
+{
+    size_t wanted_size = 4096; /* Linux tpm.c buffer size */
+
+    if (sb->size != wanted_size) {
+        sb->buffer = g_realloc(sb->buffer, wanted_size);
+        sb->size = wanted_size;
+    }
+    return sb->size;
+}
+
+static void tpm_mux_deliver_request(TPMBackend *tb)
+{
+    TPMMuxState *tpm_mux = TPM_MUX(tb);
+    TPMMuxThreadParams *thr_parms = &tpm_mux->tpm_thread_params;
+    TPMMuxRequest *req = g_new(TPMMuxRequest, 1);
+
+    req->locty = *thr_parms->locty_number;
+    req->locty_data = *thr_parms->locty_data;
+    req->queued_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    assert(req->locty < TPM_BACKEND_NUM_LOCALITIES);
+
+    /* TPM considered busy once TPM request scheduled for processing */
+    qemu_mutex_lock(&tpm_mux->state_lock);
+    req->reset_gen = tpm_mux->reset_gen;
+    g_queue_push_tail(&tpm_mux->requests, req);
+    tpm_mux->queue_depth[req->locty]++;
+    tpm_mux->tpm_busy = true;
+    qemu_mutex_unlock(&tpm_mux->state_lock);
+
+    tpm_backend_thread_deliver_request(&tpm_mux->tbt);
+}
+
+static uint32_t tpm_mux_get_queue_depth(TPMBackend *tb, uint8_t locty)
+{
+    TPMMuxState *tpm_mux = TPM_MUX(tb);
+    uint32_t depth;
+
+    qemu_mutex_lock(&tpm_mux->state_lock);
+    depth = tpm_mux->queue_depth[locty];
+    qemu_mutex_unlock(&tpm_mux->state_lock);
+
+    return depth;
+}
+
+static const char *tpm_mux_create_desc(void)
+{
+    return "Multiplexed TPM service backend driver";
+}
+
+static TPMVersion tpm_mux_get_tpm_version(TPMBackend *tb)
+{
+    TPMMuxState *tpm_mux = TPM_MUX(tb);
+
+    return tpm_mux->tpm_version;
+}
+
+static int tpm_mux_handle_device_opts(QemuOpts *opts, TPMBackend *tb)
+{
+    TPMMuxState *tpm_mux = TPM_MUX(tb);
+    const char *value;
+    Error *err = NULL;
+
+    value = qemu_opt_get(opts, "path");
+    if (!value) {
+        error_report("Missing path to the socket of the TPM service");
+        return 1;
+    }
+    tb->path = g_strdup(value);
+
+    value = qemu_opt_get(opts, "vm-id");
+    if (!value || !*value) {
+        error_report("Missing vm-id identifying the VM to the TPM service");
+        goto err_free_parameters;
+    }
+    tpm_mux->vm_id = g_strdup(value);
+
+    tpm_mux->sock_fd = unix_connect(tb->path, &err);
+    if (tpm_mux->sock_fd < 0) {
+        error_report_err(err);
+        goto err_free_parameters;
+    }
+
+    if (tpm_mux_hello(tpm_mux)) {
+        goto err_close_sock;
+    }
+
+    return 0;
+
+ err_close_sock:
+    closesocket(tpm_mux->sock_fd);
+    tpm_mux->sock_fd = -1;
+
+ err_free_parameters:
+    g_free(tb->path);
+    tb->path = NULL;
+
+    g_free(tpm_mux->vm_id);
+    tpm_mux->vm_id = NULL;
+
+    return 1;
+}
+
+static TPMBackend *tpm_mux_create(QemuOpts *opts, const char *id)
+{
+    Object *obj = object_new(TYPE_TPM_MUX);
+    TPMBackend *tb = TPM_BACKEND(obj);
+
+    tb->id = g_strdup(id);
+    /* let frontend set the fe_model to proper value */
+    tb->fe_model = -1;
+
+    tb->ops = &tpm_mux_driver;
+
+    if (tpm_mux_handle_device_opts(opts, tb)) {
+        goto err_exit;
+    }
+
+    return tb;
+
+err_exit:
+    g_free(tb->id);
+
+    return NULL;
+}
+
+static void tpm_mux_destroy(TPMBackend *tb)
+{
+    TPMMuxState *tpm_mux = TPM_MUX(tb);
+
+    tpm_mux_cancel_cmd(tb);
+
+    tpm_backend_thread_end(&tpm_mux->tbt);
+
+    tpm_mux_drop_requests(tpm_mux);
+
+    /* let the service save the state of the TPM */
+    if (tpm_mux_control(tpm_mux, TPM_MUX_MSG_SHUTDOWN, NULL, 0, NULL, 0)) {
+        error_report("tpm_mux: Could not cleanly shut down the TPM");
+    }
+
+    closesocket(tpm_mux->sock_fd);
+
+    g_free(tb->id);
+    g_free(tb->path);
+    g_free(tpm_mux->vm_id);
+}
+
+static const QemuOptDesc tpm_mux_cmdline_opts[] = {
+    TPM_STANDARD_CMDLINE_OPTS,
+    {
+        .name = "path",
+        .type = QEMU_OPT_STRING,
+        .help = "Path to the UNIX socket of the TPM service",
+    },
+    {
+        .name = "vm-id",
+        .type = QEMU_OPT_STRING,
+        .help = "Identity of the VM towards the TPM service",
+    },
+    { /* end of list */ },
+};
+
+static const TPMDriverOps tpm_mux_driver = {
+    .type                     = TPM_TYPE_MUX,
+    .opts                     = tpm_mux_cmdline_opts,
+    .desc                     = tpm_mux_create_desc,
+    .create                   = tpm_mux_create,
+    .destroy                  = tpm_mux_destroy,
+    .init                     = tpm_mux_init,
+    .startup_tpm              = tpm_mux_startup_tpm,
+    .realloc_buffer           = tpm_mux_realloc_buffer,
+    .reset                    = tpm_mux_reset,
+    .had_startup_error        = tpm_mux_get_startup_error,
+    .deliver_request          = tpm_mux_deliver_request,
+    .cancel_cmd               = tpm_mux_cancel_cmd,
+    .get_tpm_established_flag = tpm_mux_get_tpm_established_flag,
+    .reset_tpm_established_flag = tpm_mux_reset_tpm_established_flag,
+    .get_tpm_version          = tpm_mux_get_tpm_version,
+    .get_queue_depth          = tpm_mux_get_queue_depth,
+};
+
+/* migration */
+
+static void tpm_mux_pre_save(void *opaque)
+{
+    TPMMuxState *tpm_mux = opaque;
+
+    tpm_mux_init_pending(tpm_mux);
+
+    qemu_mutex_lock(&tpm_mux->state_lock);
+    /* wait for TPM to finish processing all queued requests */
+    while (tpm_mux->tpm_busy) {
+        qemu_cond_wait(&tpm_mux->cmd_complete, &tpm_mux->state_lock);
+    }
+    qemu_mutex_unlock(&tpm_mux->state_lock);
+
+    /* get the decrypted state blobs from the TPM */
+    tpm_mux_get_state_blobs(&tpm_mux->parent, &tpm_mux->tpm_blobs);
+}
+
+static int tpm_mux_post_load(void *opaque,
+                             int version_id __attribute__((unused)))
+{
+    TPMMuxState *tpm_mux = opaque;
+
+    return tpm_mux_set_state_blobs(&tpm_mux->parent, &tpm_mux->tpm_blobs);
+}
+
+static const VMStateDescription vmstate_tpm_mux = {
+    .name = "tpm-mux",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save  = tpm_mux_pre_save,
+    .post_load = tpm_mux_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(tpm_blobs.permanent_flags, TPMMuxState),
+        VMSTATE_UINT32(tpm_blobs.permanent.size, TPMMuxState),
+        VMSTATE_VBUFFER_ALLOC_UINT32(tpm_blobs.permanent.buffer, TPMMuxState,
+                                     1, NULL, 0,
+                                     tpm_blobs.permanent.size),
+
+        VMSTATE_UINT32(tpm_blobs.volatil_flags, TPMMuxState),
+        VMSTATE_UINT32(tpm_blobs.volatil.size, TPMMuxState),
+        VMSTATE_VBUFFER_ALLOC_UINT32(tpm_blobs.volatil.buffer, TPMMuxState,
+                                     1, NULL, 0,
+                                     tpm_blobs.volatil.size),
+
+        VMSTATE_UINT32(tpm_blobs.savestate_flags, TPMMuxState),
+        VMSTATE_UINT32(tpm_blobs.savestate.size, TPMMuxState),
+        VMSTATE_VBUFFER_ALLOC_UINT32(tpm_blobs.savestate.buffer, TPMMuxState,
+                                     1, NULL, 0,
+                                     tpm_blobs.savestate.size),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static char *tpm_mux_get_vm_id(Object *obj, Error **errp)
+{
+    TPMMuxState *tpm_mux = TPM_MUX(obj);
+
+    return g_strdup(tpm_mux->vm_id);
+}
+
+static void tpm_mux_inst_init(Object *obj)
+{
+    TPMMuxState *tpm_mux = TPM_MUX(obj);
+
+    tpm_mux->sock_fd = -1;
+
+    qemu_mutex_init(&tpm_mux->xfer_lock);
+    qemu_cond_init(&tpm_mux->xfer_cond);
+    QLIST_INIT(&tpm_mux->xfers);
+
+    qemu_mutex_init(&tpm_mux->state_lock);
+    qemu_cond_init(&tpm_mux->cmd_complete);
+    g_queue_init(&tpm_mux->requests);
+
+    object_property_add_str(obj, "vm-id", tpm_mux_get_vm_id, NULL, NULL);
+
+    vmstate_register(NULL, -1, &vmstate_tpm_mux, obj);
+}
+
+static void tpm_mux_inst_finalize(Object *obj)
+{
+    vmstate_unregister(NULL, &vmstate_tpm_mux, obj);
+}
+
+static void tpm_mux_class_init(ObjectClass *klass, void *data)
+{
+    TPMBackendClass *tbc = TPM_BACKEND_CLASS(klass);
+
+    tbc->ops = &tpm_mux_driver;
+}
+
+static const TypeInfo tpm_mux_info = {
+    .name = TYPE_TPM_MUX,
+    .parent = TYPE_TPM_BACKEND,
+    .instance_size = sizeof(TPMMuxState),
+    .class_init = tpm_mux_class_init,
+    .instance_init = tpm_mux_inst_init,
+    .instance_finalize = tpm_mux_inst_finalize,
+};
+
+static void tpm_mux_register(void)
+{
+    type_register_static(&tpm_mux_info);
+    tpm_register_driver(&tpm_mux_driver);
+}
+
+type_init(tpm_mux_register)
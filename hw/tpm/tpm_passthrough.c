@@ -37,6 +37,10 @@
 #include "tpm_util.h"
 #include "tpm_ioctl.h"
 #include "migration/migration.h"
+#include "monitor/monitor.h"
+#include "qemu/timer.h"
+#include "trace.h"
+#include "trace/flight-recorder.h"
 
 #define DEBUG_TPM 0
 
@@ -53,6 +57,7 @@
 
 static const TPMDriverOps tpm_passthrough_driver;
 static const VMStateDescription vmstate_tpm_cuse;
+static SaveVMHandlers savevm_tpm_cuse_live_handlers;
 
 /* data structures */
 typedef struct TPMPassthruThreadParams {
@@ -65,6 +70,33 @@ typedef struct TPMPassthruThreadParams {
     TPMBackend *tb;
 } TPMPassthruThreadParams;
 
+#define TPM_PASSTHROUGH_CACHE_ENTRIES 8
+
+/* a response cached for a request */
+typedef struct TPMPassthruCacheEntry {
+    uint8_t locty;
+    uint32_t req_len;
+    uint8_t *req;
+    uint32_t resp_len;
+    uint8_t *resp;
+} TPMPassthruCacheEntry;
+
+/* a request queued for the worker thread */
+typedef struct TPMPassthruRequest {
+    uint8_t locty;
+    TPMLocality *locty_data;
+    int64_t queued_ns;      /* QEMU_CLOCK_REALTIME when delivered */
+    uint32_t reset_gen;     /* reset_gen when delivered */
+
+    /* a command of QEMU itself if done is set; locty_data is unused then */
+    const uint8_t *in;
+    uint32_t in_len;
+    uint8_t *out;
+    uint32_t out_len;
+    TPMCmdDoneCB *done;
+    void *opaque;
+} TPMPassthruRequest;
+
 struct TPMPassthruState {
     TPMBackend parent;
 
@@ -78,6 +110,7 @@ struct TPMPassthruState {
     bool tpm_op_canceled;
     int cancel_fd;
     bool had_startup_error;
+    bool init_pending;      /* PTM_INIT deferred until the TPM is used */
 
     TPMVersion tpm_version;
     ptm_cap cuse_cap; /* capabilities of the CUSE TPM */
@@ -85,11 +118,30 @@ struct TPMPassthruState {
 
     QemuMutex state_lock;
     QemuCond cmd_complete;  /* singnaled once tpm_busy is false */
-    bool tpm_busy;
+    bool tpm_busy;          /* requests are queued or in processing */
+    GQueue requests;        /* of TPMPassthruRequest */
+    uint32_t queue_depth[TPM_BACKEND_NUM_LOCALITIES];
+    bool req_in_flight;     /* the worker thread is processing a request */
+    uint32_t reset_gen;     /* incremented by every reset */
 
     Error *migration_blocker;
 
     TPMBlobBuffers tpm_blobs;
+
+    /* responses to read-only commands; only used by the worker thread */
+    bool cache_enabled;
+    TPMPassthruCacheEntry cache[TPM_PASSTHROUGH_CACHE_ENTRIES];
+    unsigned int cache_next; /* entry to replace next */
+    uint32_t cache_gen;      /* reset_gen the entries are valid for */
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+
+    /* handle TPM2_CC_QEMU_BatchExtend rather than passing it on */
+    bool batch_extend;
+
+    /* send the permanent state during the live phase of migration */
+    bool live_migration;
+    bool permanent_dirty; /* changed since it was last sent */
 };
 
 typedef struct TPMPassthruState TPMPassthruState;
@@ -103,6 +155,7 @@ typedef struct TPMPassthruState TPMPassthruState;
 /* functions */
 
 static void tpm_passthrough_cancel_cmd(TPMBackend *tb);
+static int tpm_passthrough_cuse_init_pending(TPMPassthruState *tpm_pt);
 
 static int tpm_passthrough_unix_write(int fd, const uint8_t *buf, uint32_t len)
 {
@@ -135,6 +188,114 @@ static void tpm_write_fatal_error_response(uint8_t *out, uint32_t out_len)
     }
 }
 
+/*
+ * Whether the command is known not to modify the permanent state of
+ * the TPM.
+ */
+static bool tpm_passthrough_is_readonly_cmd(const uint8_t *in, uint32_t in_len)
+{
+    struct tpm_req_hdr *hdr = (struct tpm_req_hdr *)in;
+
+    if (in_len < sizeof(*hdr)) {
+        return true;
+    }
+
+    switch (be32_to_cpu(hdr->ordinal)) {
+    case TPM_ORD_PcrRead:
+    case TPM_ORD_GetRandom:
+    case TPM_ORD_GetCapability:
+    case TPM_ORD_GetTicks:
+    case TPM2_CC_GetCapability:
+    case TPM2_CC_GetRandom:
+    case TPM2_CC_PCR_Read:
+    case TPM2_CC_ReadClock:
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Whether the response to the command may be cached. The response to a
+ * command without sessions that only reads PCRs or capabilities does not
+ * change as long as no other command is run.
+ */
+static bool tpm_passthrough_is_cacheable_cmd(const uint8_t *in,
+                                             uint32_t in_len)
+{
+    struct tpm_req_hdr *hdr = (struct tpm_req_hdr *)in;
+
+    if (in_len < sizeof(*hdr)) {
+        return false;
+    }
+
+    switch (be16_to_cpu(hdr->tag)) {
+    case TPM_TAG_RQU_COMMAND:
+    case TPM2_ST_NO_SESSIONS:
+        break;
+    default:
+        return false;
+    }
+
+    switch (be32_to_cpu(hdr->ordinal)) {
+    case TPM_ORD_PcrRead:
+    case TPM_ORD_GetCapability:
+    case TPM2_CC_GetCapability:
+    case TPM2_CC_PCR_Read:
+        return true;
+    }
+
+    return false;
+}
+
+static void tpm_passthrough_cache_flush(TPMPassthruState *tpm_pt)
+{
+    unsigned int i;
+
+    for (i = 0; i < TPM_PASSTHROUGH_CACHE_ENTRIES; i++) {
+        g_free(tpm_pt->cache[i].req);
+        g_free(tpm_pt->cache[i].resp);
+    }
+    memset(tpm_pt->cache, 0, sizeof(tpm_pt->cache));
+    tpm_pt->cache_next = 0;
+}
+
+static TPMPassthruCacheEntry *
+tpm_passthrough_cache_lookup(TPMPassthruState *tpm_pt, uint8_t locty,
+                             const uint8_t *in, uint32_t in_len)
+{
+    TPMPassthruCacheEntry *e;
+    unsigned int i;
+
+    for (i = 0; i < TPM_PASSTHROUGH_CACHE_ENTRIES; i++) {
+        e = &tpm_pt->cache[i];
+        if (e->req && e->locty == locty && e->req_len == in_len &&
+            !memcmp(e->req, in, in_len)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void tpm_passthrough_cache_insert(TPMPassthruState *tpm_pt,
+                                         uint8_t locty,
+                                         const uint8_t *in, uint32_t in_len,
+                                         const uint8_t *out, uint32_t out_len)
+{
+    TPMPassthruCacheEntry *e = &tpm_pt->cache[tpm_pt->cache_next];
+
+    g_free(e->req);
+    g_free(e->resp);
+    e->locty = locty;
+    e->req_len = in_len;
+    e->req = g_memdup(in, in_len);
+    e->resp_len = out_len;
+    e->resp = g_memdup(out, out_len);
+
+    tpm_pt->cache_next = (tpm_pt->cache_next + 1) %
+                         TPM_PASSTHROUGH_CACHE_ENTRIES;
+}
+
 static bool tpm_passthrough_is_selftest(const uint8_t *in, uint32_t in_len)
 {
     struct tpm_req_hdr *hdr = (struct tpm_req_hdr *)in;
@@ -244,31 +405,269 @@ static int tpm_passthrough_unix_transfer(TPMPassthruState *tpm_pt,
                                         selftest_done);
 }
 
+static bool tpm_passthrough_is_batch_extend(TPMPassthruState *tpm_pt,
+                                            const uint8_t *in,
+                                            uint32_t in_len)
+{
+    struct tpm_req_hdr *hdr = (struct tpm_req_hdr *)in;
+
+    return tpm_pt->batch_extend &&
+           tpm_pt->tpm_version == TPM_VERSION_2_0 &&
+           in_len >= sizeof(*hdr) &&
+           be32_to_cpu(hdr->ordinal) == TPM2_CC_QEMU_BatchExtend;
+}
+
+/*
+ * Run the TPM2_PCR_Extend commands contained in a TPM2_CC_QEMU_BatchExtend
+ * one after the other, stopping at the first one that fails. The response
+ * carries the response code of the last command run and the number of
+ * commands run.
+ */
+static void tpm_passthrough_batch_extend(TPMPassthruState *tpm_pt,
+                                         TPMPassthruRequest *req,
+                                         bool *selftest_done)
+{
+    TPMLocality *locty_data = req->locty_data;
+    const uint8_t *in = locty_data->w_buffer.buffer;
+    uint32_t in_len = locty_data->w_offset;
+    uint8_t *out = locty_data->r_buffer.buffer;
+    uint32_t out_len = locty_data->r_buffer.size;
+    const struct tpm_req_hdr *cmd;
+    struct tpm_resp_hdr *resp = (struct tpm_resp_hdr *)out;
+    uint32_t off = sizeof(*cmd), cmd_len, count = 0, rc = TPM2_RC_SUCCESS;
+
+    while (off < in_len) {
+        cmd = (const struct tpm_req_hdr *)&in[off];
+        if (in_len - off < sizeof(*cmd)) {
+            rc = TPM2_RC_COMMAND_SIZE;
+            break;
+        }
+        cmd_len = be32_to_cpu(cmd->len);
+        if (cmd_len < sizeof(*cmd) || cmd_len > in_len - off) {
+            rc = TPM2_RC_COMMAND_SIZE;
+            break;
+        }
+        if (be32_to_cpu(cmd->ordinal) != TPM2_CC_PCR_Extend) {
+            rc = TPM2_RC_COMMAND_CODE;
+            break;
+        }
+
+        count++;
+        /* on failure this leaves an error response in out */
+        tpm_passthrough_unix_tx_bufs(tpm_pt, req->locty, &in[off], cmd_len,
+                                     out, out_len, selftest_done);
+        rc = be32_to_cpu(resp->errcode);
+        if (rc != TPM2_RC_SUCCESS) {
+            break;
+        }
+        off += cmd_len;
+    }
+
+    resp->tag = cpu_to_be16(TPM2_ST_NO_SESSIONS);
+    resp->len = cpu_to_be32(sizeof(*resp) + sizeof(count));
+    resp->errcode = cpu_to_be32(rc);
+    stl_be_p(&out[sizeof(*resp)], count);
+}
+
+/*
+ * Process a request, answering it from the response cache if possible.
+ * Any command that is not cacheable may change what the cached commands
+ * return, so it empties the cache.
+ */
+static void tpm_passthrough_process_request(TPMPassthruState *tpm_pt,
+                                            TPMPassthruRequest *req,
+                                            bool *selftest_done)
+{
+    TPMLocality *locty_data = req->locty_data;
+    const uint8_t *in = locty_data->w_buffer.buffer;
+    uint32_t in_len = locty_data->w_offset;
+    TPMPassthruCacheEntry *e;
+    const struct tpm_resp_hdr *hdr;
+    int ret;
+
+    /* a reset invalidates the cache */
+    if (req->reset_gen != tpm_pt->cache_gen) {
+        tpm_passthrough_cache_flush(tpm_pt);
+        tpm_pt->cache_gen = req->reset_gen;
+    }
+
+    if (tpm_passthrough_is_batch_extend(tpm_pt, in, in_len)) {
+        tpm_passthrough_cache_flush(tpm_pt);
+        tpm_passthrough_batch_extend(tpm_pt, req, selftest_done);
+        return;
+    }
+
+    if (!tpm_pt->cache_enabled) {
+        tpm_passthrough_unix_transfer(tpm_pt, req->locty, locty_data,
+                                      selftest_done);
+        return;
+    }
+
+    if (!tpm_passthrough_is_cacheable_cmd(in, in_len)) {
+        tpm_passthrough_cache_flush(tpm_pt);
+        tpm_passthrough_unix_transfer(tpm_pt, req->locty, locty_data,
+                                      selftest_done);
+        return;
+    }
+
+    e = tpm_passthrough_cache_lookup(tpm_pt, req->locty, in, in_len);
+    if (e && e->resp_len <= locty_data->r_buffer.size) {
+        memcpy(locty_data->r_buffer.buffer, e->resp, e->resp_len);
+        *selftest_done = false;
+        qemu_mutex_lock(&tpm_pt->state_lock);
+        tpm_pt->cache_hits++;
+        qemu_mutex_unlock(&tpm_pt->state_lock);
+        return;
+    }
+
+    qemu_mutex_lock(&tpm_pt->state_lock);
+    tpm_pt->cache_misses++;
+    qemu_mutex_unlock(&tpm_pt->state_lock);
+
+    ret = tpm_passthrough_unix_transfer(tpm_pt, req->locty, locty_data,
+                                        selftest_done);
+    if (ret >= (int)sizeof(*hdr)) {
+        hdr = (struct tpm_resp_hdr *)locty_data->r_buffer.buffer;
+        if (be32_to_cpu(hdr->errcode) == TPM_SUCCESS) {
+            tpm_passthrough_cache_insert(tpm_pt, req->locty, in, in_len,
+                                         locty_data->r_buffer.buffer, ret);
+        }
+    }
+}
+
+/*
+ * Run a command of QEMU itself. It bypasses the response cache, but
+ * it empties it unless the command leaves the TPM state alone.
+ */
+static int tpm_passthrough_process_internal(TPMPassthruState *tpm_pt,
+                                            TPMPassthruRequest *req)
+{
+    bool selftest_done;
+    int64_t start_ns, exec_ns;
+    int ret;
+
+    if (!tpm_passthrough_is_readonly_cmd(req->in, req->in_len)) {
+        tpm_passthrough_cache_flush(tpm_pt);
+        qemu_mutex_lock(&tpm_pt->state_lock);
+        tpm_pt->permanent_dirty = true;
+        qemu_mutex_unlock(&tpm_pt->state_lock);
+    }
+
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    ret = tpm_passthrough_unix_tx_bufs(tpm_pt, req->locty,
+                                       req->in, req->in_len,
+                                       req->out, req->out_len,
+                                       &selftest_done);
+    exec_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns;
+
+    tpm_backend_stats_exec(TPM_BACKEND(tpm_pt), req->in, req->in_len,
+                           ret < 0 ? 0 : ret, start_ns - req->queued_ns,
+                           exec_ns);
+
+    return ret < 0 ? -EIO : ret;
+}
+
 static void tpm_passthrough_worker_thread(gpointer data,
                                           gpointer user_data)
 {
     TPMPassthruThreadParams *thr_parms = user_data;
     TPMPassthruState *tpm_pt = TPM_PASSTHROUGH(thr_parms->tb);
     TPMBackendCmd cmd = (TPMBackendCmd)data;
+    TPMPassthruRequest *req;
     bool selftest_done = false;
+    int64_t start_ns, queue_ns, exec_ns;
+    uint32_t in_len, out_len;
+    bool stale, readonly;
+    int ret;
 
     DPRINTF("tpm_passthrough: processing command type %d\n", cmd);
 
     switch (cmd) {
     case TPM_BACKEND_CMD_PROCESS_CMD:
-        tpm_passthrough_unix_transfer(tpm_pt,
-                                      *thr_parms->locty_number,
-                                      *thr_parms->locty_data,
-                                      &selftest_done);
+        qemu_mutex_lock(&tpm_pt->state_lock);
+        req = g_queue_pop_head(&tpm_pt->requests);
+        tpm_pt->req_in_flight = (req != NULL);
+        qemu_mutex_unlock(&tpm_pt->state_lock);
+        if (!req) {
+            break;
+        }
 
-        thr_parms->recv_data_callback(thr_parms->tpm_state,
-                                      *thr_parms->locty_number,
-                                      selftest_done);
+        tpm_passthrough_cuse_init_pending(tpm_pt);
+
+        if (req->done) {
+            ret = tpm_passthrough_process_internal(tpm_pt, req);
+
+            qemu_mutex_lock(&tpm_pt->state_lock);
+            tpm_pt->req_in_flight = false;
+            tpm_pt->tpm_busy = !g_queue_is_empty(&tpm_pt->requests);
+            if (!tpm_pt->tpm_busy) {
+                qemu_cond_signal(&tpm_pt->cmd_complete);
+            }
+            qemu_mutex_unlock(&tpm_pt->state_lock);
+
+            req->done(req->opaque, ret);
+            g_free(req);
+            break;
+        }
+
+        /*
+         * Classify the command while it is still in w_buffer: once the
+         * response is delivered, the frontend resets w_offset and may
+         * reuse the buffer for the next command.
+         */
+        readonly = tpm_passthrough_is_readonly_cmd(
+                                        req->locty_data->w_buffer.buffer,
+                                        req->locty_data->w_offset);
+
+        /*
+         * The locality is only switched on the CUSE TPM if it differs
+         * from the one of the previous request.
+         */
+        start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        tpm_passthrough_process_request(tpm_pt, req, &selftest_done);
+        exec_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns;
+        queue_ns = start_ns - req->queued_ns;
+
+        in_len = req->locty_data->w_offset;
+        out_len = tpm_passthrough_get_size_from_buffer(
+                                        req->locty_data->r_buffer.buffer);
+        tpm_backend_stats_exec(thr_parms->tb,
+                               req->locty_data->w_buffer.buffer, in_len,
+                               out_len, queue_ns, exec_ns);
+        trace_tpm_passthrough_exec(req->locty,
+                    tpm_backend_get_ordinal(req->locty_data->w_buffer.buffer,
+                                            in_len),
+                    in_len, out_len, queue_ns, exec_ns);
+        flight_recorder_record(TRACE_TPM_PASSTHROUGH_EXEC, exec_ns);
+
+        /*
+         * The frontend forgot about the request if it was reset while
+         * the request was processed; the response goes nowhere then.
+         */
+        qemu_mutex_lock(&tpm_pt->state_lock);
+        stale = (req->reset_gen != tpm_pt->reset_gen);
+        qemu_mutex_unlock(&tpm_pt->state_lock);
+
+        if (!stale) {
+            thr_parms->recv_data_callback(thr_parms->tpm_state,
+                                          req->locty,
+                                          selftest_done);
+        }
         /* result delivered */
         qemu_mutex_lock(&tpm_pt->state_lock);
-        tpm_pt->tpm_busy = false;
-        qemu_cond_signal(&tpm_pt->cmd_complete);
+        if (!readonly) {
+            tpm_pt->permanent_dirty = true;
+        }
+        if (!stale) {
+            tpm_pt->queue_depth[req->locty]--;
+        }
+        tpm_pt->req_in_flight = false;
+        tpm_pt->tpm_busy = !g_queue_is_empty(&tpm_pt->requests);
+        if (!tpm_pt->tpm_busy) {
+            qemu_cond_signal(&tpm_pt->cmd_complete);
+        }
         qemu_mutex_unlock(&tpm_pt->state_lock);
+        g_free(req);
         break;
     case TPM_BACKEND_CMD_INIT:
     case TPM_BACKEND_CMD_END:
@@ -371,6 +770,24 @@ static int tpm_passthrough_cuse_init(TPMPassthruState *tpm_pt,
     return rc;
 }
 
+/*
+ * Send the PTM_INIT that was deferred when the TPM was started up. Must
+ * be called before the CUSE TPM is used.
+ */
+static int tpm_passthrough_cuse_init_pending(TPMPassthruState *tpm_pt)
+{
+    int rc = 0;
+
+    qemu_mutex_lock(&tpm_pt->state_lock);
+    if (tpm_pt->init_pending) {
+        tpm_pt->init_pending = false;
+        rc = tpm_passthrough_cuse_init(tpm_pt, false);
+    }
+    qemu_mutex_unlock(&tpm_pt->state_lock);
+
+    return rc;
+}
+
 /*
  * Start the TPM (thread). If it had been started before, then terminate
  * and start it again.
@@ -379,30 +796,66 @@ static int tpm_passthrough_startup_tpm(TPMBackend *tb)
 {
     TPMPassthruState *tpm_pt = TPM_PASSTHROUGH(tb);
 
-    /* terminate a running TPM */
-    tpm_backend_thread_end(&tpm_pt->tbt);
-
+    /*
+     * The worker thread survives resets so that they do not wait for
+     * the command it may be processing; it is only created once.
+     */
     tpm_backend_thread_create(&tpm_pt->tbt,
                               tpm_passthrough_worker_thread,
-                              &tpm_pt->tpm_thread_params);
+                              &tpm_pt->tpm_thread_params,
+                              tb->aio_context);
 
-    tpm_passthrough_cuse_init(tpm_pt, false);
+    /*
+     * Initializing the CUSE TPM is left to its first use, so that machine
+     * startup does not wait for it.
+     */
+    qemu_mutex_lock(&tpm_pt->state_lock);
+    tpm_pt->init_pending = TPM_PASSTHROUGH_USES_CUSE_TPM(tpm_pt);
+    qemu_mutex_unlock(&tpm_pt->state_lock);
 
     return 0;
 }
 
+/*
+ * Drop all requests of the frontend the worker thread did not get to
+ * anymore. The response to a request that is being processed is not
+ * delivered to the frontend. Commands of QEMU itself are kept.
+ */
+static void tpm_passthrough_drop_requests(TPMPassthruState *tpm_pt)
+{
+    TPMPassthruRequest *req;
+    GQueue internal = G_QUEUE_INIT;
+
+    qemu_mutex_lock(&tpm_pt->state_lock);
+    while ((req = g_queue_pop_head(&tpm_pt->requests)) != NULL) {
+        if (req->done) {
+            g_queue_push_tail(&internal, req);
+        } else {
+            g_free(req);
+        }
+    }
+    tpm_pt->requests = internal;
+    memset(tpm_pt->queue_depth, 0, sizeof(tpm_pt->queue_depth));
+    tpm_pt->reset_gen++;
+    tpm_pt->tpm_busy = tpm_pt->req_in_flight ||
+                       !g_queue_is_empty(&tpm_pt->requests);
+    qemu_mutex_unlock(&tpm_pt->state_lock);
+}
+
 static void tpm_passthrough_reset(TPMBackend *tb)
 {
     TPMPassthruState *tpm_pt = TPM_PASSTHROUGH(tb);
 
     DPRINTF("tpm_passthrough: CALL TO TPM_RESET!\n");
 
+    /*
+     * Do not wait for the command being processed; it is canceled and
+     * its response dropped. Requests after the reset queue up behind it.
+     */
+    tpm_passthrough_drop_requests(tpm_pt);
     tpm_passthrough_cancel_cmd(tb);
 
-    tpm_backend_thread_end(&tpm_pt->tbt);
-
     tpm_pt->had_startup_error = false;
-    tpm_pt->tpm_busy = false;
 }
 
 static int tpm_passthrough_init(TPMBackend *tb, void *tpm_state,
@@ -426,6 +879,7 @@ static bool tpm_passthrough_get_tpm_established_flag(TPMBackend *tb)
     ptm_est est;
 
     if (TPM_PASSTHROUGH_USES_CUSE_TPM(tpm_pt)) {
+        tpm_passthrough_cuse_init_pending(tpm_pt);
         if (ioctl(tpm_pt->tpm_fd, PTM_GET_TPMESTABLISHED, &est) < 0) {
             error_report("tpm_cuse: Could not get the TPM established "
                          "flag from the CUSE TPM: %s",
@@ -447,6 +901,7 @@ static int tpm_passthrough_reset_tpm_established_flag(TPMBackend *tb,
     /* only a TPM 2.0 will support this */
     if (tpm_pt->tpm_version == TPM_VERSION_2_0) {
         if (TPM_PASSTHROUGH_USES_CUSE_TPM(tpm_pt)) {
+            tpm_passthrough_cuse_init_pending(tpm_pt);
             ptmreset_est.u.req.loc = tpm_pt->cur_locty_number;
 
             if (ioctl(tpm_pt->tpm_fd, PTM_RESET_TPMESTABLISHED,
@@ -484,6 +939,13 @@ static int tpm_cuse_set_state_blobs(TPMBackend *tb,
         return 1;
     }
 
+    tpm_passthrough_cache_flush(tpm_pt);
+
+    /* the state just set replaces a pending power-on */
+    qemu_mutex_lock(&tpm_pt->state_lock);
+    tpm_pt->init_pending = false;
+    qemu_mutex_unlock(&tpm_pt->state_lock);
+
     return tpm_passthrough_cuse_init(tpm_pt, true);
 }
 
@@ -505,18 +967,98 @@ static size_t tpm_passthrough_realloc_buffer(TPMSizedBuffer *sb)
     return sb->size;
 }
 
+/*
+ * Queue the request of the frontend's current locality. The locality and
+ * its buffers are recorded now so that the frontend may go on to submit
+ * a request for another locality before this one has been processed.
+ */
 static void tpm_passthrough_deliver_request(TPMBackend *tb)
 {
     TPMPassthruState *tpm_pt = TPM_PASSTHROUGH(tb);
+    TPMPassthruThreadParams *thr_parms = &tpm_pt->tpm_thread_params;
+    TPMPassthruRequest *req = g_new0(TPMPassthruRequest, 1);
+
+    req->locty = *thr_parms->locty_number;
+    req->locty_data = *thr_parms->locty_data;
+    req->queued_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    assert(req->locty < TPM_BACKEND_NUM_LOCALITIES);
 
     /* TPM considered busy once TPM request scheduled for processing */
     qemu_mutex_lock(&tpm_pt->state_lock);
+    req->reset_gen = tpm_pt->reset_gen;
+    g_queue_push_tail(&tpm_pt->requests, req);
+    tpm_pt->queue_depth[req->locty]++;
     tpm_pt->tpm_busy = true;
     qemu_mutex_unlock(&tpm_pt->state_lock);
 
     tpm_backend_thread_deliver_request(&tpm_pt->tbt);
 }
 
+static int tpm_passthrough_execute_cmd(TPMBackend *tb, uint8_t locty,
+                                       const uint8_t *in, uint32_t in_len,
+                                       uint8_t *out, uint32_t out_len,
+                                       TPMCmdDoneCB *cb, void *opaque)
+{
+    TPMPassthruState *tpm_pt = TPM_PASSTHROUGH(tb);
+    TPMPassthruRequest *req;
+
+    if (tpm_pt->had_startup_error) {
+        return -EIO;
+    }
+    if (!tpm_pt->tbt.pool && !tpm_pt->tbt.bh) {
+        return -EAGAIN;
+    }
+
+    req = g_new0(TPMPassthruRequest, 1);
+    req->locty = locty;
+    req->queued_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    req->in = in;
+    req->in_len = in_len;
+    req->out = out;
+    req->out_len = out_len;
+    req->done = cb;
+    req->opaque = opaque;
+
+    qemu_mutex_lock(&tpm_pt->state_lock);
+    req->reset_gen = tpm_pt->reset_gen;
+    g_queue_push_tail(&tpm_pt->requests, req);
+    tpm_pt->tpm_busy = true;
+    qemu_mutex_unlock(&tpm_pt->state_lock);
+
+    tpm_backend_thread_deliver_request(&tpm_pt->tbt);
+
+    return 0;
+}
+
+static bool tpm_passthrough_get_cache_stats(TPMBackend *tb, uint64_t *hits,
+                                            uint64_t *misses)
+{
+    TPMPassthruState *tpm_pt = TPM_PASSTHROUGH(tb);
+
+    if (!tpm_pt->cache_enabled) {
+        return false;
+    }
+
+    qemu_mutex_lock(&tpm_pt->state_lock);
+    *hits = tpm_pt->cache_hits;
+    *misses = tpm_pt->cache_misses;
+    qemu_mutex_unlock(&tpm_pt->state_lock);
+
+    return true;
+}
+
+static uint32_t tpm_passthrough_get_queue_depth(TPMBackend *tb, uint8_t locty)
+{
+    TPMPassthruState *tpm_pt = TPM_PASSTHROUGH(tb);
+    uint32_t depth;
+
+    qemu_mutex_lock(&tpm_pt->state_lock);
+    depth = tpm_pt->queue_depth[locty];
+    qemu_mutex_unlock(&tpm_pt->state_lock);
+
+    return depth;
+}
+
 static void tpm_passthrough_cancel_cmd(TPMBackend *tb)
 {
     TPMPassthruState *tpm_pt = TPM_PASSTHROUGH(tb);
@@ -646,6 +1188,7 @@ static int tpm_passthrough_handle_device_opts(QemuOpts *opts, TPMBackend *tb)
     TPMPassthruState *tpm_pt = TPM_PASSTHROUGH(tb);
     const char *value;
     bool have_cuse = false;
+    Error *err = NULL;
 
     value = qemu_opt_get(opts, "type");
     if (value != NULL && !strcmp("cuse-tpm", value)) {
@@ -655,24 +1198,54 @@ static int tpm_passthrough_handle_device_opts(QemuOpts *opts, TPMBackend *tb)
     value = qemu_opt_get(opts, "cancel-path");
     tb->cancel_path = g_strdup(value);
 
-    value = qemu_opt_get(opts, "path");
-    if (!value) {
-        if (have_cuse) {
-            error_report("Missing path to access CUSE TPM");
+    tpm_pt->cache_enabled = qemu_opt_get_bool(opts, "response-cache", false);
+    tpm_pt->batch_extend = qemu_opt_get_bool(opts, "batch-extend", false);
+
+    tpm_pt->live_migration = qemu_opt_get_bool(opts, "live-migration", false);
+    if (tpm_pt->live_migration && !have_cuse) {
+        error_report("live-migration is only supported by the CUSE TPM");
+        goto err_free_parameters;
+    }
+
+    value = qemu_opt_get(opts, "fd");
+    if (value) {
+        if (!have_cuse) {
+            error_report("fd is only supported by the CUSE TPM");
             goto err_free_parameters;
         }
-        value = TPM_PASSTHROUGH_DEFAULT_DEVICE;
-    }
+        if (qemu_opt_get(opts, "path")) {
+            error_report("path and fd are mutually exclusive");
+            goto err_free_parameters;
+        }
+        tpm_pt->tpm_fd = monitor_fd_param(cur_mon, value, &err);
+        if (tpm_pt->tpm_fd < 0) {
+            error_report_err(err);
+            goto err_free_parameters;
+        }
+        tpm_pt->tpm_dev = g_strdup_printf("fd=%s", value);
 
-    tpm_pt->tpm_dev = g_strdup(value);
+        /* for query-tpm; the CUSE TPM is Linux only */
+        tb->path = g_strdup_printf("/proc/self/fd/%d", tpm_pt->tpm_fd);
+    } else {
+        value = qemu_opt_get(opts, "path");
+        if (!value) {
+            if (have_cuse) {
+                error_report("Missing path to access CUSE TPM");
+                goto err_free_parameters;
+            }
+            value = TPM_PASSTHROUGH_DEFAULT_DEVICE;
+        }
 
-    tb->path = g_strdup(tpm_pt->tpm_dev);
+        tpm_pt->tpm_dev = g_strdup(value);
 
-    tpm_pt->tpm_fd = qemu_open(tpm_pt->tpm_dev, O_RDWR);
-    if (tpm_pt->tpm_fd < 0) {
-        error_report("Cannot access TPM device using '%s': %s",
-                     tpm_pt->tpm_dev, strerror(errno));
-        goto err_free_parameters;
+        tb->path = g_strdup(tpm_pt->tpm_dev);
+
+        tpm_pt->tpm_fd = qemu_open(tpm_pt->tpm_dev, O_RDWR);
+        if (tpm_pt->tpm_fd < 0) {
+            error_report("Cannot access TPM device using '%s': %s",
+                         tpm_pt->tpm_dev, strerror(errno));
+            goto err_free_parameters;
+        }
     }
 
     tpm_pt->cur_locty_number = ~0;
@@ -681,8 +1254,12 @@ static int tpm_passthrough_handle_device_opts(QemuOpts *opts, TPMBackend *tb)
         if (tpm_passthrough_cuse_probe(tpm_pt)) {
             goto err_close_tpmdev;
         }
-        /* init TPM for probing */
-        if (tpm_passthrough_cuse_init(tpm_pt, false)) {
+        /*
+         * init TPM for probing, unless it was handed to us already
+         * initialized
+         */
+        if (!qemu_opt_get(opts, "fd") &&
+            tpm_passthrough_cuse_init(tpm_pt, false)) {
             goto err_close_tpmdev;
         }
     }
@@ -701,6 +1278,11 @@ static int tpm_passthrough_handle_device_opts(QemuOpts *opts, TPMBackend *tb)
 
     tpm_passthrough_block_migration(tpm_pt);
 
+    if (tpm_pt->live_migration) {
+        register_savevm_live(NULL, "cuse-tpm-live", -1, 1,
+                             &savevm_tpm_cuse_live_handlers, tpm_pt);
+    }
+
     return 0;
 
  err_close_tpmdev:
@@ -751,11 +1333,23 @@ err_exit:
 static void tpm_passthrough_destroy(TPMBackend *tb)
 {
     TPMPassthruState *tpm_pt = TPM_PASSTHROUGH(tb);
+    TPMPassthruRequest *req;
 
     tpm_passthrough_cancel_cmd(tb);
 
     tpm_backend_thread_end(&tpm_pt->tbt);
 
+    tpm_passthrough_drop_requests(tpm_pt);
+    while ((req = g_queue_pop_head(&tpm_pt->requests)) != NULL) {
+        req->done(req->opaque, -ECANCELED);
+        g_free(req);
+    }
+    tpm_passthrough_cache_flush(tpm_pt);
+
+    if (tpm_pt->live_migration) {
+        unregister_savevm(NULL, "cuse-tpm-live", tpm_pt);
+    }
+
     tpm_passthrough_shutdown(tpm_pt);
 
     qemu_close(tpm_pt->tpm_fd);
@@ -779,6 +1373,26 @@ static const QemuOptDesc tpm_passthrough_cmdline_opts[] = {
         .type = QEMU_OPT_STRING,
         .help = "Path to TPM device on the host",
     },
+    {
+        .name = "fd",
+        .type = QEMU_OPT_STRING,
+        .help = "File descriptor of an initialized CUSE TPM",
+    },
+    {
+        .name = "response-cache",
+        .type = QEMU_OPT_BOOL,
+        .help = "Answer repeated PCR and capability reads from a cache",
+    },
+    {
+        .name = "batch-extend",
+        .type = QEMU_OPT_BOOL,
+        .help = "Accept batches of TPM2_PCR_Extend commands",
+    },
+    {
+        .name = "live-migration",
+        .type = QEMU_OPT_BOOL,
+        .help = "Send the permanent state of a CUSE TPM while the VM runs",
+    },
     { /* end of list */ },
 };
 
@@ -798,6 +1412,9 @@ static const TPMDriverOps tpm_passthrough_driver = {
     .get_tpm_established_flag = tpm_passthrough_get_tpm_established_flag,
     .reset_tpm_established_flag = tpm_passthrough_reset_tpm_established_flag,
     .get_tpm_version          = tpm_passthrough_get_tpm_version,
+    .get_queue_depth          = tpm_passthrough_get_queue_depth,
+    .get_cache_stats          = tpm_passthrough_get_cache_stats,
+    .execute_cmd              = tpm_passthrough_execute_cmd,
 };
 
 static void tpm_passthrough_inst_init(Object *obj)
@@ -807,6 +1424,7 @@ static void tpm_passthrough_inst_init(Object *obj)
 
     qemu_mutex_init(&tpm_pt->state_lock);
     qemu_cond_init(&tpm_pt->cmd_complete);
+    g_queue_init(&tpm_pt->requests);
 
     vmstate_register(NULL, -1, &vmstate_tpm_cuse, obj);
 }
@@ -851,17 +1469,37 @@ static void tpm_cuse_pre_save(void *opaque)
     TPMPassthruState *tpm_pt = opaque;
     TPMBackend *tb = &tpm_pt->parent;
 
-     qemu_mutex_lock(&tpm_pt->state_lock);
-     /* wait for TPM to finish processing */
-     if (tpm_pt->tpm_busy) {
+    tpm_passthrough_cuse_init_pending(tpm_pt);
+
+    qemu_mutex_lock(&tpm_pt->state_lock);
+    /* wait for TPM to finish processing all queued requests */
+    while (tpm_pt->tpm_busy) {
         qemu_cond_wait(&tpm_pt->cmd_complete, &tpm_pt->state_lock);
-     }
-     qemu_mutex_unlock(&tpm_pt->state_lock);
+    }
+    qemu_mutex_unlock(&tpm_pt->state_lock);
+
+    if (tpm_pt->live_migration) {
+        /* the permanent state went with the live section */
+        tpm_util_cuse_get_state_blob(tpm_pt->tpm_fd, PTM_BLOB_TYPE_VOLATILE,
+                                     TRUE, &tpm_pt->tpm_blobs.volatil,
+                                     &tpm_pt->tpm_blobs.volatil_flags);
+        tpm_util_cuse_get_state_blob(tpm_pt->tpm_fd, PTM_BLOB_TYPE_SAVESTATE,
+                                     TRUE, &tpm_pt->tpm_blobs.savestate,
+                                     &tpm_pt->tpm_blobs.savestate_flags);
+        return;
+    }
 
     /* get the decrypted state blobs from the TPM */
     tpm_cuse_get_state_blobs(tb, TRUE, &tpm_pt->tpm_blobs);
 }
 
+static bool tpm_cuse_permanent_needed(void *opaque, int version_id)
+{
+    TPMPassthruState *tpm_pt = opaque;
+
+    return !tpm_pt->live_migration;
+}
+
 static int tpm_cuse_post_load(void *opaque,
                               int version_id __attribute__((unused)))
 {
@@ -871,6 +1509,41 @@ static int tpm_cuse_post_load(void *opaque,
     return tpm_cuse_set_state_blobs(tb, &tpm_pt->tpm_blobs);
 }
 
+/*
+ * The TPM state blobs are large and stay untouched until the next
+ * pre_save, so they are handed to the migration stream as they are
+ * rather than copied into its buffer. The stream format is the same as
+ * that of a VMSTATE_VBUFFER_ALLOC_UINT32.
+ */
+static int get_tpm_blob(QEMUFile *f, void *pv, size_t size)
+{
+    qemu_get_buffer(f, pv, size);
+    return 0;
+}
+
+static void put_tpm_blob(QEMUFile *f, void *pv, size_t size)
+{
+    qemu_put_buffer_async(f, pv, size);
+}
+
+static const VMStateInfo vmstate_info_tpm_blob = {
+    .name = "tpm-blob",
+    .get  = get_tpm_blob,
+    .put  = put_tpm_blob,
+};
+
+#define VMSTATE_TPM_BLOB_TEST(_field, _state, _test, _field_size) {     \
+    .name         = (stringify(_field)),                                \
+    .field_exists = (_test),                                            \
+    .size_offset  = vmstate_offset_value(_state, _field_size, uint32_t),\
+    .info         = &vmstate_info_tpm_blob,                             \
+    .flags        = VMS_VBUFFER|VMS_POINTER|VMS_ALLOC,                  \
+    .offset       = offsetof(_state, _field),                           \
+}
+
+#define VMSTATE_TPM_BLOB(_field, _state, _field_size)                   \
+    VMSTATE_TPM_BLOB_TEST(_field, _state, NULL, _field_size)
+
 static const VMStateDescription vmstate_tpm_cuse = {
     .name = "cuse-tpm",
     .version_id = 1,
@@ -879,27 +1552,142 @@ static const VMStateDescription vmstate_tpm_cuse = {
     .pre_save  = tpm_cuse_pre_save,
     .post_load = tpm_cuse_post_load,
     .fields = (VMStateField[]) {
-        VMSTATE_UINT32(tpm_blobs.permanent_flags, TPMPassthruState),
-        VMSTATE_UINT32(tpm_blobs.permanent.size, TPMPassthruState),
-        VMSTATE_VBUFFER_ALLOC_UINT32(tpm_blobs.permanent.buffer,
-                                     TPMPassthruState, 1, NULL, 0,
-                                     tpm_blobs.permanent.size),
+        VMSTATE_UINT32_TEST(tpm_blobs.permanent_flags, TPMPassthruState,
+                            tpm_cuse_permanent_needed),
+        VMSTATE_UINT32_TEST(tpm_blobs.permanent.size, TPMPassthruState,
+                            tpm_cuse_permanent_needed),
+        VMSTATE_TPM_BLOB_TEST(tpm_blobs.permanent.buffer, TPMPassthruState,
+                              tpm_cuse_permanent_needed,
+                              tpm_blobs.permanent.size),
 
         VMSTATE_UINT32(tpm_blobs.volatil_flags, TPMPassthruState),
         VMSTATE_UINT32(tpm_blobs.volatil.size, TPMPassthruState),
-        VMSTATE_VBUFFER_ALLOC_UINT32(tpm_blobs.volatil.buffer,
-                                     TPMPassthruState, 1, NULL, 0,
-                                     tpm_blobs.volatil.size),
+        VMSTATE_TPM_BLOB(tpm_blobs.volatil.buffer, TPMPassthruState,
+                         tpm_blobs.volatil.size),
 
         VMSTATE_UINT32(tpm_blobs.savestate_flags, TPMPassthruState),
         VMSTATE_UINT32(tpm_blobs.savestate.size, TPMPassthruState),
-        VMSTATE_VBUFFER_ALLOC_UINT32(tpm_blobs.savestate.buffer,
-                                     TPMPassthruState, 1, NULL, 0,
-                                     tpm_blobs.savestate.size),
+        VMSTATE_TPM_BLOB(tpm_blobs.savestate.buffer, TPMPassthruState,
+                         tpm_blobs.savestate.size),
         VMSTATE_END_OF_LIST()
     }
 };
 
+/*
+ * Live migration of the permanent state
+ *
+ * The permanent state of the TPM rarely changes, so it is sent while the
+ * VM is still running and only sent again during downtime if a command
+ * that may have modified it ran in the meantime.
+ */
+#define TPM_CUSE_LIVE_PERMANENT   1
+#define TPM_CUSE_LIVE_EOS         0
+
+/* Called with the state_lock held and no request being processed. */
+static int tpm_cuse_live_put_permanent(QEMUFile *f, TPMPassthruState *tpm_pt)
+{
+    TPMBlobBuffers *blobs = &tpm_pt->tpm_blobs;
+
+    if (tpm_util_cuse_get_state_blob(tpm_pt->tpm_fd, PTM_BLOB_TYPE_PERMANENT,
+                                     TRUE, &blobs->permanent,
+                                     &blobs->permanent_flags)) {
+        return -EIO;
+    }
+    tpm_pt->permanent_dirty = false;
+
+    qemu_put_byte(f, TPM_CUSE_LIVE_PERMANENT);
+    qemu_put_be32(f, blobs->permanent_flags);
+    qemu_put_be32(f, blobs->permanent.size);
+    /* the buffer may be refilled before the stream is flushed; copy it */
+    qemu_put_buffer(f, blobs->permanent.buffer, blobs->permanent.size);
+
+    return 0;
+}
+
+static int tpm_cuse_live_save(QEMUFile *f, TPMPassthruState *tpm_pt,
+                              bool force)
+{
+    int ret = 0;
+
+    tpm_passthrough_cuse_init_pending(tpm_pt);
+
+    qemu_mutex_lock(&tpm_pt->state_lock);
+    while (tpm_pt->tpm_busy) {
+        qemu_cond_wait(&tpm_pt->cmd_complete, &tpm_pt->state_lock);
+    }
+    if (force || tpm_pt->permanent_dirty) {
+        ret = tpm_cuse_live_put_permanent(f, tpm_pt);
+    }
+    qemu_mutex_unlock(&tpm_pt->state_lock);
+
+    qemu_put_byte(f, TPM_CUSE_LIVE_EOS);
+
+    return ret;
+}
+
+static int tpm_cuse_live_save_setup(QEMUFile *f, void *opaque)
+{
+    return tpm_cuse_live_save(f, opaque, true);
+}
+
+static int tpm_cuse_live_save_iterate(QEMUFile *f, void *opaque)
+{
+    int ret = tpm_cuse_live_save(f, opaque, false);
+
+    return ret < 0 ? ret : 1;
+}
+
+static int tpm_cuse_live_save_complete(QEMUFile *f, void *opaque)
+{
+    return tpm_cuse_live_save(f, opaque, false);
+}
+
+static uint64_t tpm_cuse_live_save_pending(QEMUFile *f, void *opaque,
+                                           uint64_t max_size)
+{
+    TPMPassthruState *tpm_pt = opaque;
+
+    return tpm_pt->permanent_dirty ? tpm_pt->tpm_blobs.permanent.size : 0;
+}
+
+static int tpm_cuse_live_load(QEMUFile *f, void *opaque, int version_id)
+{
+    TPMPassthruState *tpm_pt = opaque;
+    TPMBlobBuffers *blobs = &tpm_pt->tpm_blobs;
+    uint8_t type;
+
+    while ((type = qemu_get_byte(f)) != TPM_CUSE_LIVE_EOS) {
+        if (type != TPM_CUSE_LIVE_PERMANENT) {
+            error_report("tpm_cuse: unknown record %d in live TPM state",
+                         type);
+            return -EINVAL;
+        }
+        blobs->permanent_flags = qemu_get_be32(f);
+        blobs->permanent.size = qemu_get_be32(f);
+        blobs->permanent.buffer = g_realloc(blobs->permanent.buffer,
+                                            blobs->permanent.size);
+        qemu_get_buffer(f, blobs->permanent.buffer, blobs->permanent.size);
+    }
+
+    return qemu_file_get_error(f);
+}
+
+static bool tpm_cuse_live_is_active(void *opaque)
+{
+    TPMPassthruState *tpm_pt = opaque;
+
+    return TPM_PASSTHROUGH_USES_CUSE_TPM(tpm_pt);
+}
+
+static SaveVMHandlers savevm_tpm_cuse_live_handlers = {
+    .save_live_setup = tpm_cuse_live_save_setup,
+    .save_live_iterate = tpm_cuse_live_save_iterate,
+    .save_live_complete = tpm_cuse_live_save_complete,
+    .save_live_pending = tpm_cuse_live_save_pending,
+    .is_active = tpm_cuse_live_is_active,
+    .load_state = tpm_cuse_live_load,
+};
+
 static const TPMDriverOps tpm_cuse_driver = {
     .type                     = TPM_TYPE_CUSE_TPM,
     .opts                     = tpm_passthrough_cmdline_opts,
@@ -916,6 +1704,9 @@ static const TPMDriverOps tpm_cuse_driver = {
     .get_tpm_established_flag = tpm_passthrough_get_tpm_established_flag,
     .reset_tpm_established_flag = tpm_passthrough_reset_tpm_established_flag,
     .get_tpm_version          = tpm_passthrough_get_tpm_version,
+    .get_queue_depth          = tpm_passthrough_get_queue_depth,
+    .get_cache_stats          = tpm_passthrough_get_cache_stats,
+    .execute_cmd              = tpm_passthrough_execute_cmd,
 };
 
 static const TypeInfo tpm_cuse_info = {
@@ -32,7 +32,11 @@
 #include "tpm_tis.h"
 #include "qemu-common.h"
 #include "qemu/main-loop.h"
+#include "qemu/atomic.h"
 #include "sysemu/tpm_backend.h"
+#include "sysemu/kvm.h"
+#include "qemu/timer.h"
+#include "trace.h"
 
 #define DEBUG_TIS 0
 
@@ -158,8 +162,8 @@
 
 /* local prototypes */
 
-static uint64_t tpm_tis_mmio_read(void *opaque, hwaddr addr,
-                                  unsigned size);
+static uint64_t tpm_tis_mmio_read_intern(void *opaque, hwaddr addr,
+                                         unsigned size);
 
 /* utility functions */
 
@@ -242,7 +246,11 @@ static void tpm_tis_raise_irq(TPMState *s, uint8_t locty, uint32_t irqmask)
     if ((tis->loc[locty].inte & TPM_TIS_INT_ENABLED) &&
         (tis->loc[locty].inte & irqmask)) {
         DPRINTF("tpm_tis: Raising IRQ for flag %08x\n", irqmask);
-        qemu_irq_raise(s->s.tis.irq);
+        if (tis->use_eventfds) {
+            event_notifier_set(&tis->irq_notifier);
+        } else {
+            qemu_irq_raise(s->s.tis.irq);
+        }
         tis->loc[locty].ints |= irqmask;
     }
 }
@@ -360,21 +368,45 @@ static void tpm_tis_prep_abort(TPMState *s, uint8_t locty, uint8_t newlocty)
     tpm_tis_abort(s, locty);
 }
 
-static void tpm_tis_receive_bh(void *opaque)
+/*
+ * Asking the backend may be an ioctl into another process, which is too
+ * slow for a register that the guest polls.  The flag only changes with
+ * a command, a write to STS, or a reset of the TPM, so it is cached until
+ * one of these happens.  The invalidation may come from the IOThread.
+ */
+static bool tpm_tis_get_established_flag(TPMState *s)
 {
-    TPMState *s = opaque;
     TPMTISEmuState *tis = &s->s.tis;
-    uint8_t locty = s->locty_number;
 
-    tis->bh_scheduled = false;
+    if (!atomic_read(&tis->established_flag_cached)) {
+        atomic_mb_set(&tis->established_flag_cached, true);
+        tis->established_flag =
+            tpm_backend_get_tpm_established_flag(s->be_driver);
+    }
+    return tis->established_flag;
+}
 
-    qemu_mutex_lock(&s->state_lock);
+static void tpm_tis_invalidate_established_flag(TPMState *s)
+{
+    atomic_mb_set(&s->s.tis.established_flag_cached, false);
+}
+
+/*
+ * Make the response of the command just executed available to the
+ * guest. Called with the state_lock held.
+ */
+static void tpm_tis_complete(TPMState *s, uint8_t locty)
+{
+    TPMTISEmuState *tis = &s->s.tis;
 
+    tpm_tis_invalidate_established_flag(s);
     tpm_tis_sts_set(&tis->loc[locty],
                     TPM_TIS_STS_VALID | TPM_TIS_STS_DATA_AVAILABLE);
     tis->loc[locty].state = TPM_TIS_STATE_COMPLETION;
     tis->loc[locty].r_offset = 0;
     tis->loc[locty].w_offset = 0;
+    tis->loc[locty].complete_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    trace_tpm_tis_complete(locty);
 
     if (TPM_TIS_IS_VALID_LOCTY(tis->next_locty)) {
         tpm_tis_abort(s, locty);
@@ -389,6 +421,17 @@ static void tpm_tis_receive_bh(void *opaque)
 
     /* notify of completed command */
     qemu_cond_signal(&s->cmd_complete);
+}
+
+static void tpm_tis_receive_bh(void *opaque)
+{
+    TPMState *s = opaque;
+    TPMTISEmuState *tis = &s->s.tis;
+
+    tis->bh_scheduled = false;
+
+    qemu_mutex_lock(&s->state_lock);
+    tpm_tis_complete(s, s->locty_number);
     qemu_mutex_unlock(&s->state_lock);
 }
 
@@ -410,6 +453,14 @@ static void tpm_tis_receive_cb(void *opaque, uint8_t locty,
         }
     }
 
+    if (tis->use_eventfds) {
+        /* we're in the IOThread; the irqfd needs no BQL */
+        qemu_mutex_lock(&s->state_lock);
+        tpm_tis_complete(s, locty);
+        qemu_mutex_unlock(&s->state_lock);
+        return;
+    }
+
     qemu_mutex_lock(&s->state_lock);
     /* notify of completed command */
     qemu_cond_signal(&s->cmd_complete);
@@ -421,32 +472,78 @@ static void tpm_tis_receive_cb(void *opaque, uint8_t locty,
 }
 
 /*
- * Read a byte of response data
+ * Read up to 4 bytes of response data in one go; bytes beyond the end
+ * of the response read as TPM_TIS_NO_DATA_BYTE.
  */
-static uint32_t tpm_tis_data_read(TPMState *s, uint8_t locty)
+static uint32_t tpm_tis_data_read(TPMState *s, uint8_t locty, unsigned size)
 {
     TPMTISEmuState *tis = &s->s.tis;
-    uint32_t ret = TPM_TIS_NO_DATA_BYTE;
+    uint32_t ret = 0xffffffff;
     uint16_t len;
+    unsigned n;
+    int64_t fetch_ns;
 
     if ((tis->loc[locty].sts & TPM_TIS_STS_DATA_AVAILABLE)) {
         len = tpm_tis_get_size_from_buffer(&tis->loc[locty].r_buffer);
+        len = MIN(len, tis->loc[locty].r_buffer.size);
+
+        n = MIN(size, len - tis->loc[locty].r_offset);
+        memcpy(&ret,
+               &tis->loc[locty].r_buffer.buffer[tis->loc[locty].r_offset], n);
+        ret = le32_to_cpu(ret);
+        tis->loc[locty].r_offset += n;
 
-        ret = tis->loc[locty].r_buffer.buffer[tis->loc[locty].r_offset++];
         if (tis->loc[locty].r_offset >= len) {
             /* got last byte */
             tpm_tis_sts_set(&tis->loc[locty], TPM_TIS_STS_VALID);
 #ifdef RAISE_STS_IRQ
             tpm_tis_raise_irq(s, locty, TPM_TIS_INT_STS_VALID);
 #endif
+            if (tis->loc[locty].complete_ns) {
+                fetch_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                           tis->loc[locty].complete_ns;
+                tis->loc[locty].complete_ns = 0;
+                /* the command is still in the write buffer */
+                tpm_backend_stats_fetch(s->be_driver,
+                    tpm_backend_get_ordinal(tis->loc[locty].w_buffer.buffer,
+                                            tis->loc[locty].w_buffer.size),
+                    fetch_ns);
+                trace_tpm_tis_fetch_done(locty, fetch_ns);
+            }
         }
-        DPRINTF("tpm_tis: tpm_tis_data_read byte 0x%02x   [%d]\n",
-                ret, tis->loc[locty].r_offset-1);
+        DPRINTF("tpm_tis: tpm_tis_data_read %u bytes 0x%08x   [%d]\n",
+                n, ret, tis->loc[locty].r_offset - n);
     }
 
     return ret;
 }
 
+/*
+ * Compute the burst count to advertise in the STS register.
+ *
+ * Without large-burst, byte-sized reads are capped to 0xff so that a
+ * guest reading a single byte does not see 0x00 for 0x100 available
+ * bytes. With large-burst, the full count is advertised for all access
+ * sizes; a count with a low byte of zero is reduced by one instead, so
+ * byte-wise readers still see a non-zero value.
+ */
+static uint32_t tpm_tis_burst_count(TPMState *s, uint32_t avail,
+                                    unsigned size)
+{
+    if (!s->s.tis.large_burst) {
+        if (size == 1 && avail > 0xff) {
+            avail = 0xff;
+        }
+        return avail;
+    }
+
+    avail = MIN(avail, 0xffff);
+    if (avail > 0xff && (avail & 0xff) == 0) {
+        avail--;
+    }
+    return avail;
+}
+
 #ifdef DEBUG_TIS
 static void tpm_tis_dump_state(void *opaque, hwaddr addr)
 {
@@ -474,7 +571,7 @@ static void tpm_tis_dump_state(void *opaque, hwaddr addr)
 
     for (idx = 0; regs[idx] != 0xfff; idx++) {
         DPRINTF("tpm_tis: 0x%04x : 0x%08x\n", regs[idx],
-                (int)tpm_tis_mmio_read(opaque, base + regs[idx], 4));
+                (int)tpm_tis_mmio_read_intern(opaque, base + regs[idx], 4));
     }
 
     DPRINTF("tpm_tis: read offset   : %d\n"
@@ -508,8 +605,8 @@ static void tpm_tis_dump_state(void *opaque, hwaddr addr)
  * Read a register of the TIS interface
  * See specs pages 33-63 for description of the registers
  */
-static uint64_t tpm_tis_mmio_read(void *opaque, hwaddr addr,
-                                  unsigned size)
+static uint64_t tpm_tis_mmio_read_intern(void *opaque, hwaddr addr,
+                                         unsigned size)
 {
     TPMState *s = opaque;
     TPMTISEmuState *tis = &s->s.tis;
@@ -518,7 +615,6 @@ static uint64_t tpm_tis_mmio_read(void *opaque, hwaddr addr,
     uint32_t val = 0xffffffff;
     uint8_t locty = tpm_tis_locality_from_addr(addr);
     uint32_t avail;
-    uint8_t v;
 
     if (tpm_backend_had_startup_error(s->be_driver)) {
         return val;
@@ -532,7 +628,7 @@ static uint64_t tpm_tis_mmio_read(void *opaque, hwaddr addr,
         if (tpm_tis_check_request_use_except(s, locty)) {
             val |= TPM_TIS_ACCESS_PENDING_REQUEST;
         }
-        val |= !tpm_backend_get_tpm_established_flag(s->be_driver);
+        val |= !tpm_tis_get_established_flag(s);
         break;
     case TPM_TIS_REG_INT_ENABLE:
         val = tis->loc[locty].inte;
@@ -565,14 +661,8 @@ static uint64_t tpm_tis_mmio_read(void *opaque, hwaddr addr,
             } else {
                 avail = tis->loc[locty].w_buffer.size
                         - tis->loc[locty].w_offset;
-                /*
-                 * byte-sized reads should not return 0x00 for 0x100
-                 * available bytes.
-                 */
-                if (size == 1 && avail > 0xff) {
-                    avail = 0xff;
-                }
-                val = TPM_TIS_BURST_COUNT(avail) | tis->loc[locty].sts;
+                val = TPM_TIS_BURST_COUNT(tpm_tis_burst_count(s, avail, size))
+                      | tis->loc[locty].sts;
             }
         }
         break;
@@ -583,20 +673,16 @@ static uint64_t tpm_tis_mmio_read(void *opaque, hwaddr addr,
                 /* prevent access beyond FIFO */
                 size = 4 - (addr & 0x3);
             }
-            val = 0;
-            shift = 0;
-            while (size > 0) {
-                switch (tis->loc[locty].state) {
-                case TPM_TIS_STATE_COMPLETION:
-                    v = tpm_tis_data_read(s, locty);
-                    break;
-                default:
-                    v = TPM_TIS_NO_DATA_BYTE;
-                    break;
-                }
-                val |= (v << shift);
-                shift += 8;
-                size--;
+            switch (tis->loc[locty].state) {
+            case TPM_TIS_STATE_COMPLETION:
+                val = tpm_tis_data_read(s, locty, size);
+                break;
+            default:
+                /* all bytes read as TPM_TIS_NO_DATA_BYTE */
+                break;
+            }
+            if (size < 4) {
+                val &= (1U << (size * 8)) - 1;
             }
             shift = 0; /* no more adjustments */
         }
@@ -626,6 +712,27 @@ static uint64_t tpm_tis_mmio_read(void *opaque, hwaddr addr,
     return val;
 }
 
+/*
+ * In IOThread mode the doorbell and the completion are handled outside
+ * of the BQL, so register accesses are serialized by the state_lock.
+ */
+static uint64_t tpm_tis_mmio_read(void *opaque, hwaddr addr,
+                                  unsigned size)
+{
+    TPMState *s = opaque;
+    uint64_t val;
+
+    if (!s->s.tis.use_eventfds) {
+        return tpm_tis_mmio_read_intern(opaque, addr, size);
+    }
+
+    qemu_mutex_lock(&s->state_lock);
+    val = tpm_tis_mmio_read_intern(opaque, addr, size);
+    qemu_mutex_unlock(&s->state_lock);
+
+    return val;
+}
+
 /*
  * Write a value to a register of the TIS interface
  * See specs pages 33-63 for description of the registers
@@ -642,6 +749,7 @@ static void tpm_tis_mmio_write_intern(void *opaque, hwaddr addr,
     uint8_t active_locty, l;
     int c, set_new_locty = 1;
     uint16_t len;
+    uint32_t n, le_val;
     uint32_t mask = (size == 1) ? 0xff : ((size == 2) ? 0xffff : ~0);
 
     DPRINTF("tpm_tis: write.%u(%08x) = %08x\n", size, (int)addr, (int)val);
@@ -792,7 +900,9 @@ static void tpm_tis_mmio_write_intern(void *opaque, hwaddr addr,
         if (((val & TPM_TIS_INTERRUPTS_SUPPORTED)) &&
             (tis->loc[locty].ints & TPM_TIS_INTERRUPTS_SUPPORTED)) {
             tis->loc[locty].ints &= ~val;
-            if (tis->loc[locty].ints == 0) {
+            /* With the irqfd, KVM lowers the line when the guest
+             * acknowledges the interrupt; see tpm_tis_irq_resample() */
+            if (tis->loc[locty].ints == 0 && !tis->use_eventfds) {
                 qemu_irq_lower(tis->irq);
                 DPRINTF("tpm_tis: Lowering IRQ\n");
             }
@@ -819,6 +929,7 @@ static void tpm_tis_mmio_write_intern(void *opaque, hwaddr addr,
             if (val & TPM_TIS_STS_RESET_ESTABLISHMENT_BIT) {
                 if (locty == 3 || locty == 4) {
                     tpm_backend_reset_tpm_established_flag(s->be_driver, locty);
+                    tpm_tis_invalidate_established_flag(s);
                 }
             }
         }
@@ -913,13 +1024,16 @@ static void tpm_tis_mmio_write_intern(void *opaque, hwaddr addr,
                 size = 4 - (addr & 0x3);
             }
 
-            while ((tis->loc[locty].sts & TPM_TIS_STS_EXPECT) && size > 0) {
-                if (tis->loc[locty].w_offset < tis->loc[locty].w_buffer.size) {
-                    tis->loc[locty].w_buffer.
-                        buffer[tis->loc[locty].w_offset++] = (uint8_t)val;
-                    val >>= 8;
-                    size--;
-                } else {
+            if ((tis->loc[locty].sts & TPM_TIS_STS_EXPECT)) {
+                /* copy all bytes of the access in one go */
+                n = MIN(size, tis->loc[locty].w_buffer.size -
+                              tis->loc[locty].w_offset);
+                le_val = cpu_to_le32(val);
+                memcpy(&tis->loc[locty].w_buffer.
+                           buffer[tis->loc[locty].w_offset], &le_val, n);
+                tis->loc[locty].w_offset += n;
+                if (n < size) {
+                    /* buffer overflow */
                     tpm_tis_sts_set(&tis->loc[locty], TPM_TIS_STS_VALID);
                 }
             }
@@ -960,7 +1074,64 @@ static void tpm_tis_mmio_write_intern(void *opaque, hwaddr addr,
 static void tpm_tis_mmio_write(void *opaque, hwaddr addr,
                                uint64_t val, unsigned size)
 {
+    TPMState *s = opaque;
+
+    if (!s->s.tis.use_eventfds) {
+        tpm_tis_mmio_write_intern(opaque, addr, val, size, false);
+        return;
+    }
+
+    qemu_mutex_lock(&s->state_lock);
     tpm_tis_mmio_write_intern(opaque, addr, val, size, false);
+    qemu_mutex_unlock(&s->state_lock);
+}
+
+/*
+ * A TPM_GO written to the STS register of a locality; runs in the
+ * IOThread without the BQL.
+ */
+static void tpm_tis_go_notify(EventNotifier *e)
+{
+    TPMTISGoNotifier *n = container_of(e, TPMTISGoNotifier, e);
+    TPMState *s = n->s;
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->state_lock);
+    tpm_tis_mmio_write_intern(s,
+                              (n->locty << TPM_TIS_LOCALITY_SHIFT) +
+                              TPM_TIS_REG_STS,
+                              TPM_TIS_STS_TPM_GO, 1, false);
+    qemu_mutex_unlock(&s->state_lock);
+}
+
+/*
+ * The guest acknowledged the interrupt injected through the irqfd, and
+ * KVM lowered the line; raise it again if an interrupt is still pending.
+ * Runs in the IOThread without the BQL.
+ */
+static void tpm_tis_irq_resample(EventNotifier *e)
+{
+    TPMTISEmuState *tis = container_of(e, TPMTISEmuState,
+                                       irq_resample_notifier);
+    TPMState *s = container_of(tis, TPMState, s.tis);
+    uint8_t l;
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->state_lock);
+    for (l = 0; l < TPM_TIS_NUM_LOCALITIES; l++) {
+        if (tis->loc[l].ints) {
+            DPRINTF("tpm_tis: IRQ still pending for locality %d\n", l);
+            event_notifier_set(&tis->irq_notifier);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&s->state_lock);
 }
 
 static const MemoryRegionOps tpm_tis_memory_ops = {
@@ -1000,7 +1171,10 @@ static void tpm_tis_reset(DeviceState *dev)
 
     s->be_tpm_version = tpm_backend_get_tpm_version(s->be_driver);
 
+    /* does not wait for a command in processing; its response is dropped */
     tpm_backend_reset(s->be_driver);
+    qemu_bh_cancel(tis->bh);
+    tis->bh_scheduled = false;
 
     tis->active_locty = TPM_TIS_NO_LOCALITY;
     tis->next_locty = TPM_TIS_NO_LOCALITY;
@@ -1023,6 +1197,7 @@ static void tpm_tis_reset(DeviceState *dev)
         tis->loc[c].inte = TPM_TIS_INT_POLARITY_LOW_LEVEL;
         tis->loc[c].ints = 0;
         tis->loc[c].state = TPM_TIS_STATE_IDLE;
+        tis->loc[c].complete_ns = 0;
 
         tis->loc[c].w_offset = 0;
         tpm_backend_realloc_buffer(s->be_driver, &tis->loc[c].w_buffer);
@@ -1031,6 +1206,7 @@ static void tpm_tis_reset(DeviceState *dev)
     }
 
     tpm_tis_do_startup_tpm(s);
+    tpm_tis_invalidate_established_flag(s);
 }
 
 
@@ -1051,8 +1227,14 @@ static void tpm_tis_pre_save(void *opaque)
     qemu_mutex_lock(&s->state_lock);
 
     /* wait for outstanding request to complete */
-    if (TPM_TIS_IS_VALID_LOCTY(locty) &&
-        tis->loc[locty].state == TPM_TIS_STATE_EXECUTION) {
+    if (tis->use_eventfds) {
+        /* the IOThread completes the request on its own */
+        while (TPM_TIS_IS_VALID_LOCTY(locty) &&
+               tis->loc[locty].state == TPM_TIS_STATE_EXECUTION) {
+            qemu_cond_wait(&s->cmd_complete, &s->state_lock);
+        }
+    } else if (TPM_TIS_IS_VALID_LOCTY(locty) &&
+               tis->loc[locty].state == TPM_TIS_STATE_EXECUTION) {
         /*
          * If we get here when the bh is scheduled but did not run,
          * we won't get notified...
@@ -1105,6 +1287,9 @@ static int tpm_tis_post_load(void *opaque,
 
     uint8_t locty = tis->active_locty;
 
+    /* the flag of the TPM on this side may differ from the source's */
+    tpm_tis_invalidate_established_flag(s);
+
     if (TPM_TIS_IS_VALID_LOCTY(locty)) {
         switch (tis->loc[locty].state) {
         case TPM_TIS_STATE_RECEPTION:
@@ -1173,14 +1358,80 @@ static Property tpm_tis_properties[] = {
     DEFINE_PROP_UINT32("irq", TPMState,
                        s.tis.irq_num, TPM_TIS_IRQ),
     DEFINE_PROP_STRING("tpmdev", TPMState, backend),
+    DEFINE_PROP_BOOL("large-burst", TPMState, s.tis.large_burst, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
+/*
+ * Wire the TPM_GO doorbell of each locality to an ioeventfd handled in
+ * the IOThread and inject the interrupt through an irqfd, so that
+ * neither submission nor completion of a command needs the BQL. The
+ * irqfd uses a resamplefd, so that the level-triggered line goes down
+ * once the guest acknowledged the interrupt. Without KVM support for
+ * these the device stays on the main loop and only the backend worker
+ * runs in the IOThread.
+ */
+static void tpm_tis_setup_eventfds(TPMState *s)
+{
+    TPMTISEmuState *tis = &s->s.tis;
+    AioContext *ctx = iothread_get_aio_context(tis->iothread);
+    TPMTISGoNotifier *n;
+    uint8_t l;
+
+    if (!kvm_eventfds_enabled() || !kvm_irqfds_enabled() ||
+        !kvm_resamplefds_enabled()) {
+        return;
+    }
+
+    if (event_notifier_init(&tis->irq_notifier, 0) < 0) {
+        return;
+    }
+    if (event_notifier_init(&tis->irq_resample_notifier, 0) < 0) {
+        event_notifier_cleanup(&tis->irq_notifier);
+        return;
+    }
+    if (kvm_irqchip_add_irqfd_notifier_gsi(kvm_state, &tis->irq_notifier,
+                                           &tis->irq_resample_notifier,
+                                           tis->irq_num) < 0) {
+        event_notifier_cleanup(&tis->irq_resample_notifier);
+        event_notifier_cleanup(&tis->irq_notifier);
+        return;
+    }
+
+    aio_context_acquire(ctx);
+    aio_set_event_notifier(ctx, &tis->irq_resample_notifier,
+                           tpm_tis_irq_resample);
+    /* locality 4 is not accessible to software */
+    for (l = 0; l < TPM_TIS_NUM_LOCALITIES - 1; l++) {
+        n = &tis->go_notifier[l];
+        n->s = s;
+        n->locty = l;
+        if (event_notifier_init(&n->e, 0) < 0) {
+            break;
+        }
+        memory_region_add_eventfd(&s->mmio,
+                                  (l << TPM_TIS_LOCALITY_SHIFT) +
+                                  TPM_TIS_REG_STS,
+                                  1, true, TPM_TIS_STS_TPM_GO, &n->e);
+        aio_set_event_notifier(ctx, &n->e, tpm_tis_go_notify);
+    }
+    aio_context_release(ctx);
+
+    tis->use_eventfds = true;
+}
+
 static void tpm_tis_realizefn(DeviceState *dev, Error **errp)
 {
     TPMState *s = TPM(dev);
     TPMTISEmuState *tis = &s->s.tis;
 
+    /* TPM_TIS_ADDR_BASE is TPM_CRB_ADDR_BASE */
+    if (object_resolve_path_type("", TYPE_TPM_CRB, NULL)) {
+        error_setg(errp, "tpm_tis: cannot be used together with tpm-crb, "
+                   "both use address 0x%x", TPM_TIS_ADDR_BASE);
+        return;
+    }
+
     s->be_driver = qemu_find_tpm(s->backend);
     if (!s->be_driver) {
         error_setg(errp, "tpm_tis: backend driver with id %s could not be "
@@ -1190,6 +1441,11 @@ static void tpm_tis_realizefn(DeviceState *dev, Error **errp)
 
     s->be_driver->fe_model = TPM_MODEL_TPM_TIS;
 
+    if (tis->iothread) {
+        tpm_backend_set_aio_context(s->be_driver,
+                                    iothread_get_aio_context(tis->iothread));
+    }
+
     if (tpm_backend_init(s->be_driver, s,
                          &s->locty_number, &s->locty_data,
                          tpm_tis_receive_cb)) {
@@ -1208,6 +1464,10 @@ static void tpm_tis_realizefn(DeviceState *dev, Error **errp)
 
     isa_init_irq(&s->busdev, &tis->irq, tis->irq_num);
 
+    if (tis->iothread) {
+        tpm_tis_setup_eventfds(s);
+    }
+
     memory_region_add_subregion(isa_address_space(ISA_DEVICE(dev)),
                                 TPM_TIS_ADDR_BASE, &s->mmio);
 }
@@ -1222,6 +1482,11 @@ static void tpm_tis_initfn(Object *obj)
 
     qemu_mutex_init(&s->state_lock);
     qemu_cond_init(&s->cmd_complete);
+
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&s->s.tis.iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
 }
 
 static void tpm_tis_class_init(ObjectClass *klass, void *data)
@@ -20,6 +20,8 @@
 #include "hw/isa/isa.h"
 #include "hw/acpi/tpm.h"
 #include "qemu-common.h"
+#include "qemu/event_notifier.h"
+#include "sysemu/iothread.h"
 
 #define TPM_TIS_NUM_LOCALITIES      5     /* per spec */
 #define TPM_TIS_LOCALITY_SHIFT      12
@@ -37,7 +39,7 @@ typedef enum {
     TPM_TIS_STATE_RECEPTION,
 } TPMTISState;
 
-/* locality data  -- all fields are persisted */
+/* locality data  -- all fields but complete_ns are persisted */
 typedef struct TPMLocality {
     TPMTISState state;
     uint8_t access;
@@ -50,8 +52,18 @@ typedef struct TPMLocality {
     uint16_t r_offset;
     TPMSizedBuffer w_buffer;
     TPMSizedBuffer r_buffer;
+
+    /* QEMU_CLOCK_REALTIME when the response became available, or 0 */
+    int64_t complete_ns;
 } TPMLocality;
 
+/* ioeventfd for the TPM_GO doorbell of one locality */
+typedef struct TPMTISGoNotifier {
+    EventNotifier e;
+    struct TPMState *s;
+    uint8_t locty;
+} TPMTISGoNotifier;
+
 typedef struct TPMTISEmuState {
     QEMUBH *bh;
     bool bh_scheduled; /* bh scheduled but did not run yet */
@@ -67,6 +79,23 @@ typedef struct TPMTISEmuState {
 
     qemu_irq irq;
     uint32_t irq_num;
+
+    bool large_burst; /* advertise the full burst count to the guest */
+
+    /*
+     * The backend's TPM established flag, which the guest polls through
+     * TPM_ACCESS; fetched again only after something that may change it
+     */
+    bool established_flag;
+    bool established_flag_cached;
+
+    /* IOThread mode: doorbell via ioeventfd, completion via irqfd */
+    IOThread *iothread;
+    bool use_eventfds;
+    TPMTISGoNotifier go_notifier[TPM_TIS_NUM_LOCALITIES];
+    EventNotifier irq_notifier;
+    /* set by KVM when the guest acknowledged the interrupt */
+    EventNotifier irq_resample_notifier;
 } TPMTISEmuState;
 
 #endif /* TPM_TPM_TIS_H */
@@ -152,23 +152,20 @@ static void tpm_sized_buffer_reset(TPMSizedBuffer *tsb)
  * @tsb: the TPMSizeBuffer to fill with the blob
  * @flags: the flags to return to the caller
  */
-static int tpm_util_cuse_get_state_blob(int fd,
-                                        uint8_t type,
-                                        bool decrypted_blob,
-                                        TPMSizedBuffer *tsb,
-                                        uint32_t *flags)
+int tpm_util_cuse_get_state_blob(int fd,
+                                 uint8_t type,
+                                 bool decrypted_blob,
+                                 TPMSizedBuffer *tsb,
+                                 uint32_t *flags)
 {
     ptm_getstate pgs;
-    uint16_t offset = 0;
     ptm_res res;
     ssize_t n;
     size_t to_read;
 
-    tpm_sized_buffer_reset(tsb);
-
     pgs.u.req.state_flags = (decrypted_blob) ? PTM_STATE_FLAG_DECRYPTED : 0;
     pgs.u.req.type = type;
-    pgs.u.req.offset = offset;
+    pgs.u.req.offset = 0;
 
     if (ioctl(fd, PTM_GET_STATEBLOB, &pgs) < 0) {
         error_report("CUSE TPM PTM_GET_STATEBLOB ioctl failed: %s",
@@ -184,11 +181,20 @@ static int tpm_util_cuse_get_state_blob(int fd,
 
     *flags = pgs.u.resp.state_flags;
 
-    tsb->buffer = g_malloc(pgs.u.resp.totlength);
+    /*
+     * The blob is read into the buffer of the previous transfer, which
+     * usually has the right size already.
+     */
+    if (tsb->size != pgs.u.resp.totlength) {
+        tsb->buffer = g_realloc(tsb->buffer, pgs.u.resp.totlength);
+    }
     memcpy(tsb->buffer, pgs.u.resp.data, pgs.u.resp.length);
     tsb->size = pgs.u.resp.length;
 
-    /* if there are bytes left to get use read() interface */
+    /*
+     * Get the bytes left with as few read()s as the CUSE TPM allows,
+     * rather than in PTM_STATE_BLOB_SIZE sized ioctl()s.
+     */
     while (tsb->size < pgs.u.resp.totlength) {
         to_read = pgs.u.resp.totlength - tsb->size;
         if (unlikely(to_read > SSIZE_MAX)) {
@@ -196,12 +202,15 @@ static int tpm_util_cuse_get_state_blob(int fd,
         }
 
         n = read(fd, &tsb->buffer[tsb->size], to_read);
-        if (n != to_read) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
             error_report("Could not read stateblob (type %d) : %s",
-                         type, strerror(errno));
+                         type, n < 0 ? strerror(errno) : "short read");
             goto err_exit;
         }
-        tsb->size += to_read;
+        tsb->size += n;
     }
 
     DPRINTF("tpm_util: got state blob type %d, %d bytes, flags 0x%08x, "
@@ -299,12 +308,15 @@ static int tpm_util_cuse_set_state_blob(int fd,
         }
 
         n = write(fd, &tsb->buffer[offset], to_write);
-        if (n != to_write) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
             error_report("Writing the stateblob (type %d) failed: %s",
-                         type, strerror(errno));
+                         type, n < 0 ? strerror(errno) : "short write");
             goto err_exit;
         }
-        offset += to_write;
+        offset += n;
     }
 
     /* inidicate that the transfer is finished */
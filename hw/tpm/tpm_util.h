@@ -25,6 +25,12 @@
 
 int tpm_util_test_tpmdev(int tpm_fd, TPMVersion *tpm_version);
 
+int tpm_util_cuse_get_state_blob(int fd,
+                                 uint8_t type,
+                                 bool decrypted_blob,
+                                 TPMSizedBuffer *tsb,
+                                 uint32_t *flags);
+
 int tpm_util_cuse_get_state_blobs(int tpm_fd,
                                   bool decrypted_blobs,
                                   TPMBlobBuffers *tpm_blobs);
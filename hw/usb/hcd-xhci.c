@@ -135,6 +135,8 @@
 #define IMAN_IP         (1<<0)
 #define IMAN_IE         (1<<1)
 
+#define IMOD_IMODI_MASK 0xffff
+
 #define ERDP_EHB        (1<<3)
 
 #define TRB_SIZE 16
@@ -330,6 +332,14 @@ typedef struct XHCIRing {
     bool ccs;
 } XHCIRing;
 
+#define XHCI_TRB_CACHE_SIZE 16
+
+typedef struct XHCITRBCache {
+    dma_addr_t addr;
+    bool valid;
+    uint8_t buf[XHCI_TRB_CACHE_SIZE * TRB_SIZE];
+} XHCITRBCache;
+
 typedef struct XHCIPort {
     XHCIState *xhci;
     uint32_t portsc;
@@ -439,6 +449,9 @@ typedef struct XHCIInterrupter {
     unsigned int ev_buffer_put;
     unsigned int ev_buffer_get;
 
+    /* interrupt moderation: no interrupt is sent before imod_next */
+    bool imod_pending;
+    int64_t imod_next;
 } XHCIInterrupter;
 
 struct XHCIState {
@@ -479,6 +492,7 @@ struct XHCIState {
     /* Runtime Registers */
     int64_t mfindex_start;
     QEMUTimer *mfwrap_timer;
+    QEMUTimer *imod_timer;
     XHCIInterrupter intr[MAXINTRS];
 
     XHCIRing cmd_ring;
@@ -816,6 +830,73 @@ static void xhci_intr_raise(XHCIState *xhci, int v)
     }
 }
 
+static void xhci_imod_timer_update(XHCIState *xhci)
+{
+    int64_t deadline = INT64_MAX;
+    int v;
+
+    for (v = 0; v < xhci->numintrs; v++) {
+        if (xhci->intr[v].imod_pending) {
+            deadline = MIN(deadline, xhci->intr[v].imod_next);
+        }
+    }
+
+    if (deadline == INT64_MAX) {
+        timer_del(xhci->imod_timer);
+    } else {
+        timer_mod(xhci->imod_timer, deadline);
+    }
+}
+
+static void xhci_intr_send(XHCIState *xhci, int v, int64_t now)
+{
+    XHCIInterrupter *intr = &xhci->intr[v];
+
+    /* IMODI counts in units of 250ns */
+    intr->imod_next = now + (intr->imod & IMOD_IMODI_MASK) * 250;
+    xhci_intr_raise(xhci, v);
+}
+
+static void xhci_imod_timer(void *opaque)
+{
+    XHCIState *xhci = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int v;
+
+    for (v = 0; v < xhci->numintrs; v++) {
+        XHCIInterrupter *intr = &xhci->intr[v];
+
+        if (intr->imod_pending && intr->imod_next <= now) {
+            intr->imod_pending = false;
+            xhci_intr_send(xhci, v, now);
+        }
+    }
+    xhci_imod_timer_update(xhci);
+}
+
+/* Events were written to the ring of interrupter @v.  Honour the interval
+ * that the guest programmed into IMOD, so that a burst of completions
+ * results in one interrupt instead of one per event.
+ */
+static void xhci_intr_event(XHCIState *xhci, int v)
+{
+    XHCIInterrupter *intr = &xhci->intr[v];
+    int64_t now;
+
+    if (intr->imod_pending) {
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    if (!(intr->imod & IMOD_IMODI_MASK) || intr->imod_next <= now) {
+        xhci_intr_send(xhci, v, now);
+        return;
+    }
+
+    intr->imod_pending = true;
+    xhci_imod_timer_update(xhci);
+}
+
 static inline int xhci_running(XHCIState *xhci)
 {
     return !(xhci->usbsts & USBSTS_HCH) && !xhci->intr[0].er_full;
@@ -916,7 +997,7 @@ static void xhci_events_update(XHCIState *xhci, int v)
     }
 
     if (do_irq) {
-        xhci_intr_raise(xhci, v);
+        xhci_intr_event(xhci, v);
     }
 
     if (intr->er_full && intr->ev_buffer_put == intr->ev_buffer_get) {
@@ -982,7 +1063,7 @@ static void xhci_event(XHCIState *xhci, XHCIEvent *event, int v)
         xhci_write_event(xhci, event, v);
     }
 
-    xhci_intr_raise(xhci, v);
+    xhci_intr_event(xhci, v);
 }
 
 static void xhci_ring_init(XHCIState *xhci, XHCIRing *ring,
@@ -992,14 +1073,35 @@ static void xhci_ring_init(XHCIState *xhci, XHCIRing *ring,
     ring->ccs = 1;
 }
 
-static TRBType xhci_ring_fetch(XHCIState *xhci, XHCIRing *ring, XHCITRB *trb,
-                               dma_addr_t *addr)
+/* Read a TRB from the ring at @addr.  The guest memory is read one block of
+ * XHCI_TRB_CACHE_SIZE TRBs at a time, rather than with a DMA access per TRB.
+ * The blocks are aligned on their size, so that a read never crosses into
+ * the page that follows the link TRB at the end of a segment.
+ *
+ * The cache lives only as long as one pass over the ring;
+ * the guest may add TRBs to the ring at any time.
+ */
+static void xhci_trb_read(XHCIState *xhci, XHCITRBCache *cache,
+                          dma_addr_t addr, XHCITRB *trb)
 {
     PCIDevice *pci_dev = PCI_DEVICE(xhci);
+    dma_addr_t base = addr & ~(dma_addr_t)(sizeof(cache->buf) - 1);
 
+    if (!cache->valid || cache->addr != base) {
+        pci_dma_read(pci_dev, base, cache->buf, sizeof(cache->buf));
+        cache->addr = base;
+        cache->valid = true;
+    }
+    memcpy(trb, cache->buf + (addr - base), TRB_SIZE);
+}
+
+static TRBType xhci_ring_fetch(XHCIState *xhci, XHCIRing *ring,
+                               XHCITRBCache *cache, XHCITRB *trb,
+                               dma_addr_t *addr)
+{
     while (1) {
         TRBType type;
-        pci_dma_read(pci_dev, ring->dequeue, trb, TRB_SIZE);
+        xhci_trb_read(xhci, cache, ring->dequeue, trb);
         trb->addr = ring->dequeue;
         trb->ccs = ring->ccs;
         le64_to_cpus(&trb->parameter);
@@ -1030,9 +1132,9 @@ static TRBType xhci_ring_fetch(XHCIState *xhci, XHCIRing *ring, XHCITRB *trb,
     }
 }
 
-static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring)
+static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring,
+                                  XHCITRBCache *cache)
 {
-    PCIDevice *pci_dev = PCI_DEVICE(xhci);
     XHCITRB trb;
     int length = 0;
     dma_addr_t dequeue = ring->dequeue;
@@ -1042,7 +1144,7 @@ static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring)
 
     while (1) {
         TRBType type;
-        pci_dma_read(pci_dev, dequeue, &trb, TRB_SIZE);
+        xhci_trb_read(xhci, cache, dequeue, &trb);
         le64_to_cpus(&trb.parameter);
         le32_to_cpus(&trb.status);
         le32_to_cpus(&trb.control);
@@ -2085,6 +2187,7 @@ static void xhci_kick_ep(XHCIState *xhci, unsigned int slotid,
     XHCIStreamContext *stctx;
     XHCIEPContext *epctx;
     XHCIRing *ring;
+    XHCITRBCache cache;
     USBEndpoint *ep = NULL;
     uint64_t mfindex;
     int length;
@@ -2172,12 +2275,13 @@ static void xhci_kick_ep(XHCIState *xhci, unsigned int slotid,
     }
     assert(ring->dequeue != 0);
 
+    cache.valid = false;
     while (1) {
         XHCITransfer *xfer = &epctx->transfers[epctx->next_xfer];
         if (xfer->running_async || xfer->running_retry) {
             break;
         }
-        length = xhci_ring_chain_length(xhci, ring);
+        length = xhci_ring_chain_length(xhci, ring, &cache);
         if (length < 0) {
             break;
         } else if (length == 0) {
@@ -2196,7 +2300,8 @@ static void xhci_kick_ep(XHCIState *xhci, unsigned int slotid,
         xfer->trb_count = length;
 
         for (i = 0; i < length; i++) {
-            assert(xhci_ring_fetch(xhci, ring, &xfer->trbs[i], NULL));
+            assert(xhci_ring_fetch(xhci, ring, &cache, &xfer->trbs[i],
+                                   NULL));
         }
         xfer->streamid = streamid;
 
@@ -2691,6 +2796,7 @@ static void xhci_via_challenge(XHCIState *xhci, uint64_t addr)
 static void xhci_process_commands(XHCIState *xhci)
 {
     XHCITRB trb;
+    XHCITRBCache cache;
     TRBType type;
     XHCIEvent event = {ER_COMMAND_COMPLETE, CC_SUCCESS};
     dma_addr_t addr;
@@ -2704,7 +2810,9 @@ static void xhci_process_commands(XHCIState *xhci)
 
     xhci->crcr_low |= CRCR_CRR;
 
-    while ((type = xhci_ring_fetch(xhci, &xhci->cmd_ring, &trb, &addr))) {
+    cache.valid = false;
+    while ((type = xhci_ring_fetch(xhci, &xhci->cmd_ring, &cache,
+                                   &trb, &addr))) {
         event.ptr = addr;
         switch (type) {
         case CR_ENABLE_SLOT:
@@ -2941,7 +3049,10 @@ static void xhci_reset(DeviceState *dev)
         xhci->intr[i].er_full = 0;
         xhci->intr[i].ev_buffer_put = 0;
         xhci->intr[i].ev_buffer_get = 0;
+        xhci->intr[i].imod_pending = false;
+        xhci->intr[i].imod_next = 0;
     }
+    timer_del(xhci->imod_timer);
 
     xhci->mfindex_start = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
     xhci_mfwrap_update(xhci);
@@ -3609,6 +3720,7 @@ static void usb_xhci_realize(struct PCIDevice *dev, Error **errp)
     }
 
     xhci->mfwrap_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, xhci_mfwrap_timer, xhci);
+    xhci->imod_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, xhci_imod_timer, xhci);
 
     memory_region_init(&xhci->mem, OBJECT(xhci), "xhci", LEN_REGS);
     memory_region_init_io(&xhci->mem_cap, OBJECT(xhci), &xhci_cap_ops, xhci,
@@ -3672,6 +3784,12 @@ static void usb_xhci_exit(PCIDevice *dev)
         xhci->mfwrap_timer = NULL;
     }
 
+    if (xhci->imod_timer) {
+        timer_del(xhci->imod_timer);
+        timer_free(xhci->imod_timer);
+        xhci->imod_timer = NULL;
+    }
+
     memory_region_del_subregion(&xhci->mem, &xhci->mem_cap);
     memory_region_del_subregion(&xhci->mem, &xhci->mem_oper);
     memory_region_del_subregion(&xhci->mem, &xhci->mem_runtime);
@@ -3747,6 +3865,7 @@ static int usb_xhci_post_load(void *opaque, int version_id)
             msix_vector_unuse(pci_dev, intr);
         }
     }
+    xhci_imod_timer_update(xhci);
 
     return 0;
 }
@@ -3801,6 +3920,24 @@ static bool xhci_er_full(void *opaque, int version_id)
     return intr->er_full;
 }
 
+static bool xhci_intr_imod_needed(void *opaque)
+{
+    XHCIInterrupter *intr = opaque;
+    return intr->imod_pending;
+}
+
+static const VMStateDescription vmstate_xhci_intr_imod = {
+    .name = "xhci-intr/imod",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = xhci_intr_imod_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(imod_pending,    XHCIInterrupter),
+        VMSTATE_INT64(imod_next,      XHCIInterrupter),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_xhci_intr = {
     .name = "xhci-intr",
     .version_id = 1,
@@ -3830,6 +3967,10 @@ static const VMStateDescription vmstate_xhci_intr = {
                                   vmstate_xhci_event, XHCIEvent),
 
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription*[]) {
+        &vmstate_xhci_intr_imod,
+        NULL
     }
 };
 
@@ -168,6 +168,7 @@ typedef struct VFIOPCIDevice {
     bool has_flr;
     bool has_pm_reset;
     bool rom_read_failed;
+    bool defer_msix_vectors;
 } VFIOPCIDevice;
 
 typedef struct VFIORomBlacklistEntry {
@@ -659,6 +660,12 @@ static int vfio_msix_vector_do_use(PCIDevice *pdev, unsigned int nr,
         vfio_add_kvm_msi_virq(vector, msg, true);
     }
 
+    /* vfio_enable_msix() sets up all vectors at once when it is done */
+    if (vdev->defer_msix_vectors) {
+        vdev->nr_vectors = MAX(vdev->nr_vectors, nr + 1);
+        return 0;
+    }
+
     /*
      * We don't want to have the host allocate all possible MSI vectors
      * for a device if they're not in use, so we shutdown and incrementally
@@ -750,6 +757,9 @@ static void vfio_msix_vector_release(PCIDevice *pdev, unsigned int nr)
 
 static void vfio_enable_msix(VFIOPCIDevice *vdev)
 {
+    bool kvm_routes = kvm_irqchip_in_kernel();
+    int nr_vectors, ret;
+
     vfio_disable_interrupts(vdev);
 
     vdev->msi_vectors = g_malloc0(vdev->msix->entries * sizeof(VFIOMSIVector));
@@ -772,16 +782,43 @@ static void vfio_enable_msix(VFIOPCIDevice *vdev)
     vfio_msix_vector_do_use(&vdev->pdev, 0, NULL, NULL);
     vfio_msix_vector_release(&vdev->pdev, 0);
 
+    /*
+     * A guest that unmasks its vectors before setting the enable bit gets
+     * a vector_use callback for each of them right here.  Done one by one,
+     * each would commit the KVM routing table, and most would disable and
+     * re-enable MSI-X on the host to grow the number of vectors.  Set up
+     * the routes and the host vectors once for all of them instead.
+     */
+    nr_vectors = vdev->nr_vectors;
+    if (kvm_routes) {
+        kvm_irqchip_begin_route_changes(kvm_state);
+    }
+    vdev->defer_msix_vectors = true;
+
     if (msix_set_vector_notifiers(&vdev->pdev, vfio_msix_vector_use,
                                   vfio_msix_vector_release, NULL)) {
         error_report("vfio: msix_set_vector_notifiers failed");
     }
 
+    vdev->defer_msix_vectors = false;
+    if (kvm_routes) {
+        kvm_irqchip_end_route_changes(kvm_state);
+    }
+
+    if (vdev->nr_vectors > nr_vectors) {
+        vfio_disable_irqindex(&vdev->vbasedev, VFIO_PCI_MSIX_IRQ_INDEX);
+    }
+    ret = vfio_enable_vectors(vdev, true);
+    if (ret) {
+        error_report("vfio: failed to enable vectors, %d", ret);
+    }
+
     trace_vfio_enable_msix(vdev->vbasedev.name);
 }
 
 static void vfio_enable_msi(VFIOPCIDevice *vdev)
 {
+    bool kvm_routes = kvm_irqchip_in_kernel();
     int ret, i;
 
     vfio_disable_interrupts(vdev);
@@ -790,6 +827,10 @@ static void vfio_enable_msi(VFIOPCIDevice *vdev)
 retry:
     vdev->msi_vectors = g_malloc0(vdev->nr_vectors * sizeof(VFIOMSIVector));
 
+    /* The vectors are not triggered before vfio_enable_vectors() */
+    if (kvm_routes) {
+        kvm_irqchip_begin_route_changes(kvm_state);
+    }
     for (i = 0; i < vdev->nr_vectors; i++) {
         VFIOMSIVector *vector = &vdev->msi_vectors[i];
         MSIMessage msg = msi_get_message(&vdev->pdev, i);
@@ -811,6 +852,9 @@ retry:
          */
         vfio_add_kvm_msi_virq(vector, &msg, false);
     }
+    if (kvm_routes) {
+        kvm_irqchip_end_route_changes(kvm_state);
+    }
 
     /* Set interrupt type prior to possible interrupts */
     vdev->interrupt = VFIO_INT_MSI;
@@ -72,6 +72,10 @@ bool vring_setup(Vring *vring, VirtIODevice *vdev, int n)
     hwaddr size;
     void *ptr;
 
+    /* The used ring is ours from now on, publish what the generic code
+     * still holds back */
+    virtqueue_flush_deferred(virtio_get_queue(vdev, n));
+
     vring->broken = false;
     vr->num = virtio_queue_get_num(vdev, n);
 
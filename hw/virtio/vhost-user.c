@@ -24,6 +24,14 @@
 #include <linux/vhost.h>
 
 #define VHOST_MEMORY_MAX_NREGIONS    8
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+
+#define VHOST_USER_PROTOCOL_F_MQ    0
+#define VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS 15
+
+#define VHOST_USER_PROTOCOL_FEATURE_MASK \
+    ((1ULL << VHOST_USER_PROTOCOL_F_MQ) | \
+     (1ULL << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS))
 
 typedef enum VhostUserRequest {
     VHOST_USER_NONE = 0,
@@ -41,6 +49,13 @@ typedef enum VhostUserRequest {
     VHOST_USER_SET_VRING_KICK = 12,
     VHOST_USER_SET_VRING_CALL = 13,
     VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
+    /* numbered like in the other implementations of the protocol */
+    VHOST_USER_ADD_MEM_REG = 37,
+    VHOST_USER_REM_MEM_REG = 38,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -57,6 +72,11 @@ typedef struct VhostUserMemory {
     VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
 } VhostUserMemory;
 
+typedef struct VhostUserMemRegMsg {
+    uint64_t padding;
+    VhostUserMemoryRegion region;
+} VhostUserMemRegMsg;
+
 typedef struct VhostUserMsg {
     VhostUserRequest request;
 
@@ -71,6 +91,7 @@ typedef struct VhostUserMsg {
         struct vhost_vring_state state;
         struct vhost_vring_addr addr;
         VhostUserMemory memory;
+        VhostUserMemRegMsg mem_reg;
     };
 } QEMU_PACKED VhostUserMsg;
 
@@ -104,7 +125,12 @@ static unsigned long int ioctl_to_vhost_user_request[VHOST_USER_MAX] = {
     VHOST_GET_VRING_BASE,   /* VHOST_USER_GET_VRING_BASE */
     VHOST_SET_VRING_KICK,   /* VHOST_USER_SET_VRING_KICK */
     VHOST_SET_VRING_CALL,   /* VHOST_USER_SET_VRING_CALL */
-    VHOST_SET_VRING_ERR     /* VHOST_USER_SET_VRING_ERR */
+    VHOST_SET_VRING_ERR,    /* VHOST_USER_SET_VRING_ERR */
+    -1,                     /* VHOST_USER_GET_PROTOCOL_FEATURES */
+    -1,                     /* VHOST_USER_SET_PROTOCOL_FEATURES */
+    -1,                     /* VHOST_USER_GET_QUEUE_NUM */
+    -1                      /* VHOST_USER_SET_VRING_ENABLE */
+    /* the requests in the gap and after it have no ioctl either */
 };
 
 static VhostUserRequest vhost_user_request_translate(unsigned long int request)
@@ -180,6 +206,74 @@ static int vhost_user_write(struct vhost_dev *dev, VhostUserMsg *msg,
             0 : -1;
 }
 
+static int vhost_user_get_u64(struct vhost_dev *dev, VhostUserRequest request,
+                              uint64_t *u64)
+{
+    VhostUserMsg msg = {
+        .request = request,
+        .flags = VHOST_USER_VERSION,
+    };
+
+    if (vhost_user_write(dev, &msg, NULL, 0) < 0 ||
+        vhost_user_read(dev, &msg) < 0) {
+        return -1;
+    }
+
+    if (msg.request != request) {
+        error_report("Received unexpected msg type. Expected %d received %d",
+                     request, msg.request);
+        return -1;
+    }
+
+    if (msg.size != sizeof(m.u64)) {
+        error_report("Received bad msg size.");
+        return -1;
+    }
+
+    *u64 = msg.u64;
+    return 0;
+}
+
+static int vhost_user_set_u64(struct vhost_dev *dev, VhostUserRequest request,
+                              uint64_t u64)
+{
+    VhostUserMsg msg = {
+        .request = request,
+        .flags = VHOST_USER_VERSION,
+        .u64 = u64,
+        .size = sizeof(m.u64),
+    };
+
+    return vhost_user_write(dev, &msg, NULL, 0);
+}
+
+/* Returns the fd of the RAM block behind @reg, filling in the offset of
+ * the region in it, or -1 if the memory cannot be shared */
+static int vhost_user_region_fd(struct vhost_memory_region *reg,
+                                VhostUserMemoryRegion *msg_reg)
+{
+    ram_addr_t ram_addr;
+    int fd;
+
+    assert((uintptr_t)reg->userspace_addr == reg->userspace_addr);
+    msg_reg->userspace_addr = reg->userspace_addr;
+    msg_reg->memory_size = reg->memory_size;
+    msg_reg->guest_phys_addr = reg->guest_phys_addr;
+    msg_reg->mmap_offset = 0;
+
+    if (!qemu_ram_addr_from_host((void *)(uintptr_t)reg->userspace_addr,
+                                 &ram_addr)) {
+        return -1;
+    }
+    fd = qemu_get_ram_fd(ram_addr);
+    if (fd <= 0) {
+        return -1;
+    }
+    msg_reg->mmap_offset = reg->userspace_addr -
+        (uintptr_t)qemu_get_ram_block_host_ptr(ram_addr);
+    return fd;
+}
+
 static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
         void *arg)
 {
@@ -215,19 +309,12 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
 
     case VHOST_SET_MEM_TABLE:
         for (i = 0; i < dev->mem->nregions; ++i) {
-            struct vhost_memory_region *reg = dev->mem->regions + i;
-            ram_addr_t ram_addr;
-
-            assert((uintptr_t)reg->userspace_addr == reg->userspace_addr);
-            qemu_ram_addr_from_host((void *)(uintptr_t)reg->userspace_addr, &ram_addr);
-            fd = qemu_get_ram_fd(ram_addr);
-            if (fd > 0) {
-                msg.memory.regions[fd_num].userspace_addr = reg->userspace_addr;
-                msg.memory.regions[fd_num].memory_size  = reg->memory_size;
-                msg.memory.regions[fd_num].guest_phys_addr = reg->guest_phys_addr;
-                msg.memory.regions[fd_num].mmap_offset = reg->userspace_addr -
-                    (uintptr_t) qemu_get_ram_block_host_ptr(ram_addr);
+            VhostUserMemoryRegion msg_reg;
+
+            fd = vhost_user_region_fd(dev->mem->regions + i, &msg_reg);
+            if (fd >= 0) {
                 assert(fd_num < VHOST_MEMORY_MAX_NREGIONS);
+                msg.memory.regions[fd_num] = msg_reg;
                 fds[fd_num++] = fd;
             }
         }
@@ -250,20 +337,27 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
         fds[fd_num++] = *((int *) arg);
         break;
 
+    /* A kernel vhost device serves a single queue pair, but the slave sees
+     * all the queues of a device over one connection: the vring messages
+     * carry the index within the whole device.
+     */
     case VHOST_SET_VRING_NUM:
     case VHOST_SET_VRING_BASE:
         memcpy(&msg.state, arg, sizeof(struct vhost_vring_state));
+        msg.state.index += dev->vq_index;
         msg.size = sizeof(m.state);
         break;
 
     case VHOST_GET_VRING_BASE:
         memcpy(&msg.state, arg, sizeof(struct vhost_vring_state));
+        msg.state.index += dev->vq_index;
         msg.size = sizeof(m.state);
         need_reply = 1;
         break;
 
     case VHOST_SET_VRING_ADDR:
         memcpy(&msg.addr, arg, sizeof(struct vhost_vring_addr));
+        msg.addr.index += dev->vq_index;
         msg.size = sizeof(m.addr);
         break;
 
@@ -271,7 +365,7 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
     case VHOST_SET_VRING_CALL:
     case VHOST_SET_VRING_ERR:
         file = arg;
-        msg.u64 = file->index & VHOST_USER_VRING_IDX_MASK;
+        msg.u64 = (file->index + dev->vq_index) & VHOST_USER_VRING_IDX_MASK;
         msg.size = sizeof(m.u64);
         if (ioeventfd_enabled() && file->fd > 0) {
             fds[fd_num++] = file->fd;
@@ -285,13 +379,16 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
         break;
     }
 
+    /* Failures mean that the slave went away; vhost_virtqueue_stop()
+     * relies on seeing them to recover the ring state by itself.
+     */
     if (vhost_user_write(dev, &msg, fds, fd_num) < 0) {
-        return 0;
+        return -1;
     }
 
     if (need_reply) {
         if (vhost_user_read(dev, &msg) < 0) {
-            return 0;
+            return -1;
         }
 
         if (msg_request != msg.request) {
@@ -313,6 +410,7 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
                 error_report("Received bad msg size.");
                 return -1;
             }
+            msg.state.index -= dev->vq_index;
             memcpy(arg, &msg.state, sizeof(struct vhost_vring_state));
             break;
         default:
@@ -327,13 +425,155 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
 
 static int vhost_user_init(struct vhost_dev *dev, void *opaque)
 {
+    uint64_t features, protocol_features;
+    int err;
+
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
 
     dev->opaque = opaque;
+    dev->protocol_features = 0;
+    dev->max_queues = 1;
+
+    err = vhost_user_get_u64(dev, VHOST_USER_GET_FEATURES, &features);
+    if (err < 0) {
+        return err;
+    }
+
+    if (features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) {
+        dev->backend_features |= 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+
+        err = vhost_user_get_u64(dev, VHOST_USER_GET_PROTOCOL_FEATURES,
+                                 &protocol_features);
+        if (err < 0) {
+            return err;
+        }
+
+        dev->protocol_features =
+            protocol_features & VHOST_USER_PROTOCOL_FEATURE_MASK;
+        err = vhost_user_set_u64(dev, VHOST_USER_SET_PROTOCOL_FEATURES,
+                                 dev->protocol_features);
+        if (err < 0) {
+            return err;
+        }
+
+        if (dev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_MQ)) {
+            err = vhost_user_get_u64(dev, VHOST_USER_GET_QUEUE_NUM,
+                                     &dev->max_queues);
+            if (err < 0) {
+                return err;
+            }
+        }
+    }
 
     return 0;
 }
 
+/* Only meaningful once VHOST_USER_F_PROTOCOL_FEATURES has been negotiated;
+ * without it the slave keeps all rings enabled.
+ */
+static int vhost_user_set_vring_enable(struct vhost_dev *dev, int enable)
+{
+    VhostUserMsg msg = {
+        .request = VHOST_USER_SET_VRING_ENABLE,
+        .flags = VHOST_USER_VERSION,
+        .size = sizeof(m.state),
+    };
+    int i;
+
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    if (!(dev->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))) {
+        return 0;
+    }
+
+    for (i = 0; i < dev->nvqs; i++) {
+        msg.state.index = dev->vq_index + i;
+        msg.state.num = enable;
+        if (vhost_user_write(dev, &msg, NULL, 0) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Sends @request for each region of @from that @to does not have; both
+ * tables are sorted by guest address. */
+static int vhost_user_send_mem_regions(struct vhost_dev *dev,
+                                       VhostUserRequest request,
+                                       struct vhost_memory *from,
+                                       struct vhost_memory *to)
+{
+    int i, j = 0;
+
+    for (i = 0; i < from->nregions; i++) {
+        struct vhost_memory_region *reg = from->regions + i;
+        VhostUserMsg msg = {
+            .request = request,
+            .flags = VHOST_USER_VERSION,
+            .size = sizeof(m.mem_reg),
+        };
+        int fd;
+
+        while (j < to->nregions &&
+               to->regions[j].guest_phys_addr < reg->guest_phys_addr) {
+            j++;
+        }
+        if (j < to->nregions && !memcmp(to->regions + j, reg, sizeof(*reg))) {
+            continue;
+        }
+
+        fd = vhost_user_region_fd(reg, &msg.mem_reg.region);
+        if (request == VHOST_USER_ADD_MEM_REG) {
+            if (fd < 0) {
+                /* not in the table either, see VHOST_SET_MEM_TABLE */
+                continue;
+            }
+            if (vhost_user_write(dev, &msg, &fd, 1) < 0) {
+                return -1;
+            }
+        } else if (vhost_user_write(dev, &msg, NULL, 0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* With VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS, only the regions that
+ * changed are sent, so that the slave keeps the mappings of the others.
+ */
+static int vhost_user_update_mem_table(struct vhost_dev *dev,
+                                       struct vhost_memory *old_mem)
+{
+    VhostUserMemoryRegion msg_reg;
+    int i, nregions = 0;
+
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    if (!(dev->protocol_features &
+          (1ULL << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS))) {
+        return -ENOTSUP;
+    }
+
+    for (i = 0; i < dev->mem->nregions; i++) {
+        nregions += vhost_user_region_fd(dev->mem->regions + i, &msg_reg) >= 0;
+    }
+    if (nregions > VHOST_MEMORY_MAX_NREGIONS) {
+        error_report("vhost-user memory map has more than %d regions",
+                     VHOST_MEMORY_MAX_NREGIONS);
+        return -1;
+    }
+
+    /* Removals first, the new regions may overlap the old ones */
+    if (vhost_user_send_mem_regions(dev, VHOST_USER_REM_MEM_REG,
+                                    old_mem, dev->mem) < 0 ||
+        vhost_user_send_mem_regions(dev, VHOST_USER_ADD_MEM_REG,
+                                    dev->mem, old_mem) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
 static int vhost_user_cleanup(struct vhost_dev *dev)
 {
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
@@ -347,5 +587,7 @@ const VhostOps user_ops = {
         .backend_type = VHOST_BACKEND_TYPE_USER,
         .vhost_call = vhost_user_call,
         .vhost_backend_init = vhost_user_init,
-        .vhost_backend_cleanup = vhost_user_cleanup
+        .vhost_backend_cleanup = vhost_user_cleanup,
+        .vhost_backend_set_vring_enable = vhost_user_set_vring_enable,
+        .vhost_backend_update_mem_table = vhost_user_update_mem_table,
         };
@@ -23,9 +23,41 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 #include "migration/migration.h"
+#include "exec/ram_addr.h"
 
 static struct vhost_log *vhost_log;
 
+/* Marks dirty the pages whose bit is set in @log, the bits of the chunk
+ * at guest address @addr that fall into @section */
+static void vhost_dev_set_dirty(MemoryRegionSection *section, uint64_t addr,
+                                vhost_log_chunk_t log)
+{
+    MemoryRegion *mr = section->mr;
+    hwaddr mr_offset;
+    int bit;
+
+    if (TARGET_PAGE_SIZE == VHOST_LOG_PAGE) {
+        /* bit 0 must be within the section */
+        bit = ctz64(log);
+        addr += bit * VHOST_LOG_PAGE;
+        mr_offset = addr - section->offset_within_address_space +
+                    section->offset_within_region;
+        cpu_physical_memory_set_dirty_word(memory_region_get_ram_addr(mr) +
+                                           mr_offset, log >> bit,
+                                           memory_region_get_dirty_log_mask(mr));
+        return;
+    }
+
+    while (log) {
+        bit = ctz64(log);
+        mr_offset = addr + bit * VHOST_LOG_PAGE -
+                    section->offset_within_address_space +
+                    section->offset_within_region;
+        memory_region_set_dirty(mr, mr_offset, VHOST_LOG_PAGE);
+        log &= ~(0x1ull << bit);
+    }
+}
+
 static void vhost_dev_sync_region(struct vhost_dev *dev,
                                   MemoryRegionSection *section,
                                   uint64_t mfirst, uint64_t mlast,
@@ -45,29 +77,36 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
     assert(end / VHOST_LOG_CHUNK < dev->log_size);
     assert(start / VHOST_LOG_CHUNK < dev->log_size);
 
-    for (;from < to; ++from) {
+    for (; from < to; ++from, addr += VHOST_LOG_CHUNK) {
+        vhost_log_chunk_t mask = ~(vhost_log_chunk_t)0;
         vhost_log_chunk_t log;
+
         /* We first check with non-atomic: much cheaper,
          * and we expect non-dirty to be the common case. */
         if (!*from) {
-            addr += VHOST_LOG_CHUNK;
             continue;
         }
+
+        /* Only take the pages in the range, the others in the chunk may
+         * belong to another section */
+        if (addr < start) {
+            mask &= mask << ((start - addr) / VHOST_LOG_PAGE);
+        }
+        if (end - addr < VHOST_LOG_CHUNK - 1) {
+            mask &= ~(vhost_log_chunk_t)0 >>
+                    (VHOST_LOG_BITS - 1 - (end - addr) / VHOST_LOG_PAGE);
+        }
+
         /* Data must be read atomically. We don't really need barrier semantics
          * but it's easier to use atomic_* than roll our own. */
-        log = atomic_xchg(from, 0);
-        while (log) {
-            int bit = ctzl(log);
-            hwaddr page_addr;
-            hwaddr section_offset;
-            hwaddr mr_offset;
-            page_addr = addr + bit * VHOST_LOG_PAGE;
-            section_offset = page_addr - section->offset_within_address_space;
-            mr_offset = section_offset + section->offset_within_region;
-            memory_region_set_dirty(section->mr, mr_offset, VHOST_LOG_PAGE);
-            log &= ~(0x1ull << bit);
+        if (mask == ~(vhost_log_chunk_t)0) {
+            log = atomic_xchg(from, 0);
+        } else {
+            log = atomic_fetch_and(from, ~mask) & mask;
+        }
+        if (log) {
+            vhost_dev_set_dirty(section, addr, log);
         }
-        addr += VHOST_LOG_CHUNK;
     }
 }
 
@@ -122,46 +161,46 @@ static void vhost_log_sync_range(struct vhost_dev *dev,
     }
 }
 
-/* Assign/unassign. Keep an unsorted array of non-overlapping
- * memory regions in dev->mem. */
+/* Assign/unassign. Keep an array of non-overlapping memory regions in
+ * dev->mem, sorted by guest address. */
+
+/* Index of the first region that ends at or after @addr */
+static int vhost_dev_find_first(struct vhost_dev *dev, uint64_t addr)
+{
+    int lo = 0, hi = dev->mem->nregions;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        struct vhost_memory_region *reg = dev->mem->regions + mid;
+
+        if (range_get_last(reg->guest_phys_addr, reg->memory_size) < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
 static void vhost_dev_unassign_memory(struct vhost_dev *dev,
                                       uint64_t start_addr,
                                       uint64_t size)
 {
-    int from, to, n = dev->mem->nregions;
-    /* Track overlapping/split regions for sanity checking. */
-    int overlap_start = 0, overlap_end = 0, overlap_middle = 0, split = 0;
+    struct vhost_memory *mem = dev->mem;
+    uint64_t memlast = range_get_last(start_addr, size);
+    int i = vhost_dev_find_first(dev, start_addr);
 
-    for (from = 0, to = 0; from < n; ++from, ++to) {
-        struct vhost_memory_region *reg = dev->mem->regions + to;
+    while (i < mem->nregions && mem->regions[i].guest_phys_addr <= memlast) {
+        struct vhost_memory_region *reg = mem->regions + i;
         uint64_t reglast;
-        uint64_t memlast;
         uint64_t change;
 
-        /* clone old region */
-        if (to != from) {
-            memcpy(reg, dev->mem->regions + from, sizeof *reg);
-        }
-
-        /* No overlap is simple */
-        if (!ranges_overlap(reg->guest_phys_addr, reg->memory_size,
-                            start_addr, size)) {
-            continue;
-        }
-
-        /* Split only happens if supplied region
-         * is in the middle of an existing one. Thus it can not
-         * overlap with any other existing region. */
-        assert(!split);
-
         reglast = range_get_last(reg->guest_phys_addr, reg->memory_size);
-        memlast = range_get_last(start_addr, size);
 
         /* Remove whole region */
         if (start_addr <= reg->guest_phys_addr && memlast >= reglast) {
-            --dev->mem->nregions;
-            --to;
-            ++overlap_middle;
+            memmove(reg, reg + 1, (mem->nregions - i - 1) * sizeof *reg);
+            --mem->nregions;
             continue;
         }
 
@@ -169,104 +208,86 @@ static void vhost_dev_unassign_memory(struct vhost_dev *dev,
         if (memlast >= reglast) {
             reg->memory_size = start_addr - reg->guest_phys_addr;
             assert(reg->memory_size);
-            assert(!overlap_end);
-            ++overlap_end;
+            ++i;
             continue;
         }
 
-        /* Shift region */
+        /* Shift region; the ones after it start past the range */
         if (start_addr <= reg->guest_phys_addr) {
             change = memlast + 1 - reg->guest_phys_addr;
             reg->memory_size -= change;
             reg->guest_phys_addr += change;
             reg->userspace_addr += change;
             assert(reg->memory_size);
-            assert(!overlap_start);
-            ++overlap_start;
-            continue;
+            break;
         }
 
-        /* This only happens if supplied region
-         * is in the middle of an existing one. Thus it can not
-         * overlap with any other existing region. */
-        assert(!overlap_start);
-        assert(!overlap_end);
-        assert(!overlap_middle);
-        /* Split region: shrink first part, shift second part. */
-        memcpy(dev->mem->regions + n, reg, sizeof *reg);
+        /* The range is in the middle of this region, so it can not
+         * overlap with any other existing region.
+         * Split region: shrink first part, shift second part. */
+        memmove(reg + 2, reg + 1, (mem->nregions - i - 1) * sizeof *reg);
+        reg[1] = reg[0];
         reg->memory_size = start_addr - reg->guest_phys_addr;
         assert(reg->memory_size);
+        reg++;
         change = memlast + 1 - reg->guest_phys_addr;
-        reg = dev->mem->regions + n;
         reg->memory_size -= change;
         assert(reg->memory_size);
         reg->guest_phys_addr += change;
         reg->userspace_addr += change;
-        /* Never add more than 1 region */
-        assert(dev->mem->nregions == n);
-        ++dev->mem->nregions;
-        ++split;
+        ++mem->nregions;
+        break;
     }
 }
 
-/* Called after unassign, so no regions overlap the given range. */
+/* Called after unassign, so no regions overlap the given range; it can
+ * only be merged with its neighbours in the sorted array. */
 static void vhost_dev_assign_memory(struct vhost_dev *dev,
                                     uint64_t start_addr,
                                     uint64_t size,
                                     uint64_t uaddr)
 {
-    int from, to;
-    struct vhost_memory_region *merged = NULL;
-    for (from = 0, to = 0; from < dev->mem->nregions; ++from, ++to) {
-        struct vhost_memory_region *reg = dev->mem->regions + to;
-        uint64_t prlast, urlast;
-        uint64_t pmlast, umlast;
-        uint64_t s, e, u;
-
-        /* clone old region */
-        if (to != from) {
-            memcpy(reg, dev->mem->regions + from, sizeof *reg);
-        }
-        prlast = range_get_last(reg->guest_phys_addr, reg->memory_size);
-        pmlast = range_get_last(start_addr, size);
-        urlast = range_get_last(reg->userspace_addr, reg->memory_size);
-        umlast = range_get_last(uaddr, size);
-
-        /* check for overlapping regions: should never happen. */
-        assert(prlast < start_addr || pmlast < reg->guest_phys_addr);
-        /* Not an adjacent or overlapping region - do not merge. */
-        if ((prlast + 1 != start_addr || urlast + 1 != uaddr) &&
-            (pmlast + 1 != reg->guest_phys_addr ||
-             umlast + 1 != reg->userspace_addr)) {
-            continue;
+    struct vhost_memory *mem = dev->mem;
+    int i = vhost_dev_find_first(dev, start_addr);
+    struct vhost_memory_region *prev = i > 0 ? mem->regions + i - 1 : NULL;
+    struct vhost_memory_region *next = i < mem->nregions ?
+                                       mem->regions + i : NULL;
+    struct vhost_memory_region *reg;
+    bool merge_next;
+
+    /* check for overlapping regions: should never happen. */
+    assert(!next ||
+           next->guest_phys_addr > range_get_last(start_addr, size));
+
+    merge_next = next && start_addr + size == next->guest_phys_addr &&
+                 uaddr + size == next->userspace_addr;
+
+    if (prev && prev->guest_phys_addr + prev->memory_size == start_addr &&
+        prev->userspace_addr + prev->memory_size == uaddr) {
+        prev->memory_size += size;
+        if (merge_next) {
+            prev->memory_size += next->memory_size;
+            memmove(next, next + 1, (mem->nregions - i - 1) * sizeof *next);
+            --mem->nregions;
         }
+        return;
+    }
 
-        if (merged) {
-            --to;
-            assert(to >= 0);
-        } else {
-            merged = reg;
-        }
-        u = MIN(uaddr, reg->userspace_addr);
-        s = MIN(start_addr, reg->guest_phys_addr);
-        e = MAX(pmlast, prlast);
-        uaddr = merged->userspace_addr = u;
-        start_addr = merged->guest_phys_addr = s;
-        size = merged->memory_size = e - s + 1;
-        assert(merged->memory_size);
-    }
-
-    if (!merged) {
-        struct vhost_memory_region *reg = dev->mem->regions + to;
-        memset(reg, 0, sizeof *reg);
-        reg->memory_size = size;
-        assert(reg->memory_size);
-        reg->guest_phys_addr = start_addr;
-        reg->userspace_addr = uaddr;
-        ++to;
+    if (merge_next) {
+        next->guest_phys_addr = start_addr;
+        next->userspace_addr = uaddr;
+        next->memory_size += size;
+        return;
     }
-    assert(to <= dev->mem->nregions + 1);
-    dev->mem->nregions = to;
+
+    reg = mem->regions + i;
+    memmove(reg + 1, reg, (mem->nregions - i) * sizeof *reg);
+    memset(reg, 0, sizeof *reg);
+    reg->memory_size = size;
+    assert(reg->memory_size);
+    reg->guest_phys_addr = start_addr;
+    reg->userspace_addr = uaddr;
+    ++mem->nregions;
 }
 
 static uint64_t vhost_get_log_size(struct vhost_dev *dev)
@@ -371,17 +392,17 @@ static int vhost_verify_ring_mappings(struct vhost_dev *dev,
     return r;
 }
 
+/* Returns the lowest region that overlaps the range, if any */
 static struct vhost_memory_region *vhost_dev_find_reg(struct vhost_dev *dev,
-						      uint64_t start_addr,
-						      uint64_t size)
+                                                      uint64_t start_addr,
+                                                      uint64_t size)
 {
-    int i, n = dev->mem->nregions;
-    for (i = 0; i < n; ++i) {
-        struct vhost_memory_region *reg = dev->mem->regions + i;
-        if (ranges_overlap(reg->guest_phys_addr, reg->memory_size,
-                           start_addr, size)) {
-            return reg;
-        }
+    int i = vhost_dev_find_first(dev, start_addr);
+
+    if (i < dev->mem->nregions &&
+        dev->mem->regions[i].guest_phys_addr <=
+        range_get_last(start_addr, size)) {
+        return dev->mem->regions + i;
     }
     return NULL;
 }
@@ -420,8 +441,9 @@ static void vhost_set_memory(MemoryListener *listener,
     ram_addr_t size = int128_get64(section->size);
     bool log_dirty =
         memory_region_get_dirty_log_mask(section->mr) & ~(1 << DIRTY_MEMORY_MIGRATION);
+    /* a split and a new region at most */
     int s = offsetof(struct vhost_memory, regions) +
-        (dev->mem->nregions + 1) * sizeof dev->mem->regions[0];
+        (dev->mem->nregions + 2) * sizeof dev->mem->regions[0];
     void *ram;
 
     dev->mem = g_realloc(dev->mem, s);
@@ -459,6 +481,44 @@ static void vhost_set_memory(MemoryListener *listener,
     dev->memory_changed = true;
 }
 
+static size_t vhost_memory_size(struct vhost_memory *mem)
+{
+    return offsetof(struct vhost_memory, regions) +
+        mem->nregions * sizeof mem->regions[0];
+}
+
+/* Whether the backend already has the table; typically a BAR or ROM that
+ * went away and came back within one transaction */
+static bool vhost_dev_mem_unchanged(struct vhost_dev *dev)
+{
+    return dev->mem_sent &&
+        dev->mem_sent->nregions == dev->mem->nregions &&
+        !memcmp(dev->mem_sent->regions, dev->mem->regions,
+                dev->mem->nregions * sizeof dev->mem->regions[0]);
+}
+
+/* Sends dev->mem to the backend, as a delta from the table it has if
+ * the backend can take that. */
+static int vhost_dev_set_mem_table(struct vhost_dev *dev)
+{
+    int r = -ENOTSUP;
+
+    if (dev->mem_sent && dev->vhost_ops->vhost_backend_update_mem_table) {
+        r = dev->vhost_ops->vhost_backend_update_mem_table(dev,
+                                                           dev->mem_sent);
+    }
+    if (r == -ENOTSUP) {
+        r = dev->vhost_ops->vhost_call(dev, VHOST_SET_MEM_TABLE, dev->mem);
+    }
+    if (r < 0) {
+        return r;
+    }
+
+    g_free(dev->mem_sent);
+    dev->mem_sent = g_memdup(dev->mem, vhost_memory_size(dev->mem));
+    return r;
+}
+
 static bool vhost_section(MemoryRegionSection *section)
 {
     return memory_region_is_ram(section->mr);
@@ -490,6 +550,10 @@ static void vhost_commit(MemoryListener *listener)
     if (dev->mem_changed_start_addr > dev->mem_changed_end_addr) {
         return;
     }
+    if (vhost_dev_mem_unchanged(dev)) {
+        dev->memory_changed = false;
+        return;
+    }
 
     if (dev->started) {
         start_addr = dev->mem_changed_start_addr;
@@ -500,7 +564,7 @@ static void vhost_commit(MemoryListener *listener)
     }
 
     if (!dev->log_enabled) {
-        r = dev->vhost_ops->vhost_call(dev, VHOST_SET_MEM_TABLE, dev->mem);
+        r = vhost_dev_set_mem_table(dev);
         assert(r >= 0);
         dev->memory_changed = false;
         return;
@@ -513,7 +577,7 @@ static void vhost_commit(MemoryListener *listener)
     if (dev->log_size < log_size) {
         vhost_dev_log_resize(dev, log_size + VHOST_LOG_BUFFER);
     }
-    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_MEM_TABLE, dev->mem);
+    r = vhost_dev_set_mem_table(dev);
     assert(r >= 0);
     /* To log less, can only decrease log size after table update. */
     if (dev->log_size > log_size + VHOST_LOG_BUFFER) {
@@ -730,6 +794,10 @@ static int vhost_virtqueue_start(struct vhost_dev *dev,
 
     assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
 
+    /* Completions that QEMU still holds back must reach the guest before
+     * vhost takes over the used ring */
+    virtqueue_flush_deferred(vvq);
+
     vq->num = state.num = virtio_queue_get_num(vdev, idx);
     r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_NUM, &state);
     if (r) {
@@ -830,10 +898,17 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
     assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
     r = dev->vhost_ops->vhost_call(dev, VHOST_GET_VRING_BASE, &state);
     if (r < 0) {
-        fprintf(stderr, "vhost VQ %d ring restore failed: %d\n", idx, r);
-        fflush(stderr);
+        /* The backend is gone (e.g. a vhost-user slave that exited); pick
+         * up from what it left in the used ring, so that a new backend can
+         * continue without a guest reset.
+         */
+        error_report("vhost VQ %d ring restore failed: %d, "
+                     "using the used index", idx, r);
+        virtio_queue_restore_last_avail_idx(vdev, idx);
+        r = 0;
+    } else {
+        virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     }
-    virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     virtio_queue_invalidate_signalled_used(vdev, idx);
 
     /* In the cross-endian case, we need to reset the vring endianness to
@@ -911,9 +986,12 @@ int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
         return -1;
     }
 
-    if (hdev->vhost_ops->vhost_backend_init(hdev, opaque) < 0) {
-        close((uintptr_t)opaque);
-        return -errno;
+    r = hdev->vhost_ops->vhost_backend_init(hdev, opaque);
+    if (r < 0) {
+        if (backend_type == VHOST_BACKEND_TYPE_KERNEL) {
+            close((uintptr_t)opaque);
+        }
+        return r;
     }
 
     r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_OWNER, NULL);
@@ -956,6 +1034,7 @@ int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
         migrate_add_blocker(hdev->migration_blocker);
     }
     hdev->mem = g_malloc0(offsetof(struct vhost_memory, regions));
+    hdev->mem_sent = NULL;
     hdev->n_mem_sections = 0;
     hdev->mem_sections = NULL;
     hdev->log = NULL;
@@ -987,6 +1066,7 @@ void vhost_dev_cleanup(struct vhost_dev *hdev)
         error_free(hdev->migration_blocker);
     }
     g_free(hdev->mem);
+    g_free(hdev->mem_sent);
     g_free(hdev->mem_sections);
     hdev->vhost_ops->vhost_backend_cleanup(hdev);
 }
@@ -1078,7 +1158,11 @@ void vhost_virtqueue_mask(struct vhost_dev *hdev, VirtIODevice *vdev, int n,
         file.fd = event_notifier_get_fd(virtio_queue_get_guest_notifier(vvq));
     }
     r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_VRING_CALL, &file);
-    assert(r >= 0);
+    if (r < 0) {
+        /* only a vhost-user backend can go away under our feet */
+        assert(hdev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+        error_report("vhost VQ %d notifier update failed", n);
+    }
 }
 
 uint64_t vhost_get_features(struct vhost_dev *hdev, const int *feature_bits,
@@ -1119,7 +1203,10 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
     if (r < 0) {
         goto fail_features;
     }
-    r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_MEM_TABLE, hdev->mem);
+    /* The whole table: the backend may have lost what it had */
+    g_free(hdev->mem_sent);
+    hdev->mem_sent = NULL;
+    r = vhost_dev_set_mem_table(hdev);
     if (r < 0) {
         r = -errno;
         goto fail_mem;
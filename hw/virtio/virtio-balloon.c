@@ -23,6 +23,7 @@
 #include "hw/virtio/virtio-balloon.h"
 #include "sysemu/kvm.h"
 #include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
 #include "qapi/visitor.h"
 #include "qapi-event.h"
 #include "trace.h"
@@ -43,6 +44,15 @@ static void balloon_page(void *addr, int deflate)
 #endif
 }
 
+static void balloon_discard_range(void *addr, size_t len)
+{
+#if defined(__linux__)
+    if (!kvm_enabled() || kvm_has_sync_mmu()) {
+        qemu_madvise(addr, len, QEMU_MADV_DONTNEED);
+    }
+#endif
+}
+
 static const char *balloon_stat_names[] = {
    [VIRTIO_BALLOON_S_SWAP_IN] = "stat-swap-in",
    [VIRTIO_BALLOON_S_SWAP_OUT] = "stat-swap-out",
@@ -238,6 +248,54 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     }
 }
 
+/*
+ * The guest hands over free memory as device-writable buffers, each one a
+ * range of whole pages.  The device never writes to them: it discards each
+ * range with a single madvise(), and drops its migration dirty bits, as
+ * the contents of free pages need not reach the destination.
+ */
+static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtQueueElement elem;
+
+    while (virtqueue_pop(vq, &elem)) {
+        unsigned int i;
+
+        for (i = 0; i < elem.in_num; i++) {
+            hwaddr pa = elem.in_addr[i];
+            size_t len = elem.in_sg[i].iov_len;
+            MemoryRegionSection section;
+            ram_addr_t offset;
+
+            if (!QEMU_IS_ALIGNED(pa | len, TARGET_PAGE_SIZE)) {
+                continue;
+            }
+
+            /* FIXME: remove get_system_memory(), but how? */
+            section = memory_region_find(get_system_memory(), pa, len);
+            if (!section.mr) {
+                continue;
+            }
+            if (int128_get64(section.size) == len &&
+                memory_region_is_ram(section.mr) && !section.readonly) {
+                offset = section.offset_within_region;
+                trace_virtio_balloon_handle_report(
+                    memory_region_name(section.mr), pa, len);
+                balloon_discard_range(
+                    memory_region_get_ram_ptr(section.mr) + offset, len);
+                cpu_physical_memory_test_and_clear_dirty(
+                    memory_region_get_ram_addr(section.mr) + offset, len,
+                    DIRTY_MEMORY_MIGRATION);
+            }
+            memory_region_unref(section.mr);
+        }
+
+        /* Nothing was written, so the buffers are not marked dirty */
+        virtqueue_push(vq, &elem, 0);
+        virtio_notify(vdev, vq);
+    }
+}
+
 static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
@@ -394,6 +452,10 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     s->ivq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->dvq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(vdev, 128, virtio_balloon_receive_stats);
+    if (virtio_has_feature(s->host_features, VIRTIO_BALLOON_F_REPORTING)) {
+        s->reporting_vq = virtio_add_queue(vdev, 32,
+                                           virtio_balloon_handle_report);
+    }
 
     reset_stats(s);
 
@@ -428,6 +490,8 @@ static void virtio_balloon_instance_init(Object *obj)
 static Property virtio_balloon_properties[] = {
     DEFINE_PROP_BIT("deflate-on-oom", VirtIOBalloon, host_features,
                     VIRTIO_BALLOON_F_DEFLATE_ON_OOM, false),
+    DEFINE_PROP_BIT("free-page-reporting", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_REPORTING, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
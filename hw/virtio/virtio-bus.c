@@ -56,6 +56,10 @@ void virtio_bus_device_plugged(VirtIODevice *vdev, Error **errp)
     assert(vdc->get_features != NULL);
     vdev->host_features = vdc->get_features(vdev, vdev->host_features,
                                             errp);
+    /* The packed ring layout is only defined for virtio 1 */
+    if (!virtio_host_has_feature(vdev, VIRTIO_F_VERSION_1)) {
+        virtio_clear_feature(&vdev->host_features, VIRTIO_F_RING_PACKED);
+    }
 }
 
 /* Reset the virtio_bus */
@@ -21,6 +21,10 @@
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 #include "hw/virtio/virtio-access.h"
+#include "hw/xen/xen.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "qemu/mem-usage.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -57,6 +61,38 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+typedef struct VRingPackedDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+typedef struct VRingPackedDescEvent {
+    uint16_t off_wrap;
+    uint16_t flags;
+} VRingPackedDescEvent;
+
+/*
+ * Host mapping of one area of a vring, so that accessing it does not take a
+ * walk of the memory map each time.  ptr is NULL if the area is not in plain
+ * RAM; those areas use the slow path.
+ */
+typedef struct VRingMemoryCache {
+    hwaddr pa;
+    hwaddr len;
+    uint8_t *ptr;
+    MemoryRegion *mr;   /* referenced while ptr is set */
+    hwaddr xlat;        /* offset of the area in mr */
+} VRingMemoryCache;
+
+enum {
+    VRING_CACHE_DESC,
+    VRING_CACHE_AVAIL,
+    VRING_CACHE_USED,
+    VRING_CACHE_NUM,
+};
+
 typedef struct VRing
 {
     unsigned int num;
@@ -70,6 +106,9 @@ struct VirtQueue
 {
     VRing vring;
     uint16_t last_avail_idx;
+    /* Last avail->idx read from the guest; the heads before it can be
+     * popped without reading the index again */
+    uint16_t shadow_avail_idx;
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
 
@@ -83,6 +122,33 @@ struct VirtQueue
 
     int inuse;
 
+    /* Elements filled in by virtqueue_push_deferred() and not published */
+    unsigned int deferred;
+    QEMUBH *deferred_bh;
+
+    /* Set while the queue is processed in an I/O thread: the bottom half
+     * runs there, and the guest is notified through guest_notifier */
+    AioContext *ctx;
+
+    /* Packed ring only.  last_avail_idx and used_idx count descriptors, and
+     * the wrap counters flip whenever they go round the ring. */
+    bool last_avail_wrap_counter;
+    uint16_t used_idx;
+    bool used_wrap_counter;
+
+    /* Packed ring only: elements given to virtqueue_fill() since the last
+     * virtqueue_flush().  The first used descriptor makes the whole batch
+     * visible to the guest, so it is only written by virtqueue_flush(). */
+    unsigned int used_batch;
+    uint16_t used_batch_descs;
+    uint16_t used_head_id;
+    uint32_t used_head_len;
+
+    /* Filled in on first access, dropped when the rings move or the memory
+     * map changes */
+    bool cache_valid;
+    VRingMemoryCache cache[VRING_CACHE_NUM];
+
     uint16_t vector;
     void (*handle_output)(VirtIODevice *vdev, VirtQueue *vq);
     VirtIODevice *vdev;
@@ -91,11 +157,205 @@ struct VirtQueue
     QLIST_ENTRY(VirtQueue) node;
 };
 
+/*
+ * For the packed ring, VirtQueueElement.index holds the buffer id and, above
+ * it, the number of ring descriptors that the buffer took.  Devices migrate
+ * in-flight elements as they are, so this keeps the element layout.
+ */
+#define VIRTQUEUE_PACKED_INDEX(id, ndescs)  ((id) | ((ndescs) << 16))
+#define VIRTQUEUE_PACKED_ID(index)          ((index) & 0xffff)
+#define VIRTQUEUE_PACKED_NDESCS(index)      ((index) >> 16)
+
+static inline bool virtio_queue_packed(VirtQueue *vq)
+{
+    return virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+}
+
+static void vring_cache_map(VRingMemoryCache *cache, hwaddr pa, hwaddr len)
+{
+    MemoryRegion *mr;
+    hwaddr xlat, l = len;
+
+    cache->pa = pa;
+    cache->len = len;
+    /* The Xen map cache only gives out single pages */
+    if (!pa || !len || xen_enabled()) {
+        return;
+    }
+
+    rcu_read_lock();
+    mr = address_space_translate(&address_space_memory, pa, &xlat, &l, true);
+    if (l == len && memory_region_is_ram(mr) && !mr->readonly) {
+        memory_region_ref(mr);
+        cache->mr = mr;
+        cache->xlat = xlat;
+        cache->ptr = (uint8_t *)memory_region_get_ram_ptr(mr) + xlat;
+    }
+    rcu_read_unlock();
+}
+
+static void virtio_queue_cache_init(VirtQueue *vq)
+{
+    unsigned int num = vq->vring.num;
+    hwaddr desc_size, avail_size, used_size;
+
+    if (virtio_queue_packed(vq)) {
+        desc_size = sizeof(VRingPackedDesc) * num;
+        avail_size = used_size = sizeof(VRingPackedDescEvent);
+    } else {
+        desc_size = sizeof(VRingDesc) * num;
+        /* each ring ends with the event index for the other side */
+        avail_size = offsetof(VRingAvail, ring[num]) + sizeof(uint16_t);
+        used_size = offsetof(VRingUsed, ring[num]) + sizeof(uint16_t);
+    }
+
+    vring_cache_map(&vq->cache[VRING_CACHE_DESC], vq->vring.desc, desc_size);
+    vring_cache_map(&vq->cache[VRING_CACHE_AVAIL], vq->vring.avail,
+                    avail_size);
+    vring_cache_map(&vq->cache[VRING_CACHE_USED], vq->vring.used, used_size);
+    vq->cache_valid = true;
+}
+
+static void virtio_queue_invalidate_cache(VirtQueue *vq)
+{
+    int i;
+
+    for (i = 0; i < VRING_CACHE_NUM; i++) {
+        VRingMemoryCache *cache = &vq->cache[i];
+
+        if (cache->ptr) {
+            memory_region_unref(cache->mr);
+        }
+        memset(cache, 0, sizeof(*cache));
+    }
+    vq->cache_valid = false;
+}
+
+static void virtio_invalidate_caches(VirtIODevice *vdev)
+{
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].cache_valid) {
+            virtio_queue_invalidate_cache(&vdev->vq[i]);
+        }
+    }
+}
+
+static inline VRingMemoryCache *vring_cache_find(VirtQueue *vq, hwaddr pa,
+                                                 hwaddr len)
+{
+    int i;
+
+    if (unlikely(!vq->cache_valid)) {
+        virtio_queue_cache_init(vq);
+    }
+    for (i = 0; i < VRING_CACHE_NUM; i++) {
+        VRingMemoryCache *cache = &vq->cache[i];
+
+        if (cache->ptr && pa >= cache->pa &&
+            pa + len <= cache->pa + cache->len) {
+            return cache;
+        }
+    }
+    return NULL;
+}
+
+static inline uint16_t vring_lduw(VirtQueue *vq, hwaddr pa)
+{
+    VRingMemoryCache *cache = vring_cache_find(vq, pa, 2);
+
+    if (likely(cache)) {
+        return virtio_lduw_p(vq->vdev, cache->ptr + (pa - cache->pa));
+    }
+    return virtio_lduw_phys(vq->vdev, pa);
+}
+
+static inline uint32_t vring_ldl(VirtQueue *vq, hwaddr pa)
+{
+    VRingMemoryCache *cache = vring_cache_find(vq, pa, 4);
+
+    if (likely(cache)) {
+        return virtio_ldl_p(vq->vdev, cache->ptr + (pa - cache->pa));
+    }
+    return virtio_ldl_phys(vq->vdev, pa);
+}
+
+static inline uint64_t vring_ldq(VirtQueue *vq, hwaddr pa)
+{
+    VRingMemoryCache *cache = vring_cache_find(vq, pa, 8);
+
+    if (likely(cache)) {
+        return virtio_ldq_p(vq->vdev, cache->ptr + (pa - cache->pa));
+    }
+    return virtio_ldq_phys(vq->vdev, pa);
+}
+
+static inline void vring_read(VirtQueue *vq, hwaddr pa, void *buf, hwaddr len)
+{
+    VRingMemoryCache *cache = vring_cache_find(vq, pa, len);
+
+    if (likely(cache)) {
+        memcpy(buf, cache->ptr + (pa - cache->pa), len);
+        return;
+    }
+    address_space_read(&address_space_memory, pa, MEMTXATTRS_UNSPECIFIED,
+                       buf, len);
+}
+
+/* Stores that hit the cache must still show up in the dirty log */
+static inline void vring_stw(VirtQueue *vq, hwaddr pa, uint16_t val)
+{
+    VRingMemoryCache *cache = vring_cache_find(vq, pa, 2);
+
+    if (likely(cache)) {
+        virtio_stw_p(vq->vdev, cache->ptr + (pa - cache->pa), val);
+        memory_region_set_dirty(cache->mr, cache->xlat + (pa - cache->pa), 2);
+        return;
+    }
+    virtio_stw_phys(vq->vdev, pa, val);
+}
+
+static inline void vring_stl(VirtQueue *vq, hwaddr pa, uint32_t val)
+{
+    VRingMemoryCache *cache = vring_cache_find(vq, pa, 4);
+
+    if (likely(cache)) {
+        virtio_stl_p(vq->vdev, cache->ptr + (pa - cache->pa), val);
+        memory_region_set_dirty(cache->mr, cache->xlat + (pa - cache->pa), 4);
+        return;
+    }
+    virtio_stl_phys(vq->vdev, pa, val);
+}
+
+static void virtio_memory_listener_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+
+        if (!vq->cache_valid) {
+            continue;
+        }
+        if (vq->ctx) {
+            /* keep the I/O thread off the cache meanwhile */
+            aio_context_acquire(vq->ctx);
+            virtio_queue_invalidate_cache(vq);
+            aio_context_release(vq->ctx);
+        } else {
+            virtio_queue_invalidate_cache(vq);
+        }
+    }
+}
+
 /* virt queue functions */
 void virtio_queue_update_rings(VirtIODevice *vdev, int n)
 {
     VRing *vring = &vdev->vq[n].vring;
 
+    virtio_queue_invalidate_cache(&vdev->vq[n]);
     if (!vring->desc) {
         /* not yet setup -> nothing to do */
         return;
@@ -106,56 +366,60 @@ void virtio_queue_update_rings(VirtIODevice *vdev, int n)
                               vring->align);
 }
 
-static inline uint64_t vring_desc_addr(VirtIODevice *vdev, hwaddr desc_pa,
+static inline uint64_t vring_desc_addr(VirtQueue *vq, hwaddr desc_pa,
                                        int i)
 {
     hwaddr pa;
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return virtio_ldq_phys(vdev, pa);
+    return vring_ldq(vq, pa);
 }
 
-static inline uint32_t vring_desc_len(VirtIODevice *vdev, hwaddr desc_pa, int i)
+static inline uint32_t vring_desc_len(VirtQueue *vq, hwaddr desc_pa, int i)
 {
     hwaddr pa;
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return virtio_ldl_phys(vdev, pa);
+    return vring_ldl(vq, pa);
 }
 
-static inline uint16_t vring_desc_flags(VirtIODevice *vdev, hwaddr desc_pa,
+static inline uint16_t vring_desc_flags(VirtQueue *vq, hwaddr desc_pa,
                                         int i)
 {
     hwaddr pa;
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return virtio_lduw_phys(vdev, pa);
+    return vring_lduw(vq, pa);
 }
 
-static inline uint16_t vring_desc_next(VirtIODevice *vdev, hwaddr desc_pa,
+static inline uint16_t vring_desc_next(VirtQueue *vq, hwaddr desc_pa,
                                        int i)
 {
     hwaddr pa;
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return virtio_lduw_phys(vdev, pa);
+    return vring_lduw(vq, pa);
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
     hwaddr pa;
     pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq, pa);
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
     hwaddr pa;
     pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    vq->shadow_avail_idx = vring_lduw(vq, pa);
+    /* Descriptors up to the shadow index may be read from now on, make sure
+     * that these reads do not bypass the index read. */
+    smp_rmb();
+    return vq->shadow_avail_idx;
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
     hwaddr pa;
     pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq, pa);
 }
 
 static inline uint16_t vring_get_used_event(VirtQueue *vq)
@@ -167,44 +431,42 @@ static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
     hwaddr pa;
     pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    virtio_stl_phys(vq->vdev, pa, val);
+    vring_stl(vq, pa, val);
 }
 
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
     hwaddr pa;
     pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    virtio_stl_phys(vq->vdev, pa, val);
+    vring_stl(vq, pa, val);
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
     hwaddr pa;
     pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq, pa);
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
     hwaddr pa;
     pa = vq->vring.used + offsetof(VRingUsed, idx);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_stw(vq, pa, val);
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
     hwaddr pa;
     pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
+    vring_stw(vq, pa, vring_lduw(vq, pa) | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
     hwaddr pa;
     pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    vring_stw(vq, pa, vring_lduw(vq, pa) & ~mask);
 }
 
 static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
@@ -214,13 +476,111 @@ static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
         return;
     }
     pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_stw(vq, pa, val);
+}
+
+static inline uint16_t vring_packed_desc_flags(VirtQueue *vq, int i)
+{
+    hwaddr pa;
+    pa = vq->vring.desc + sizeof(VRingPackedDesc) * i +
+         offsetof(VRingPackedDesc, flags);
+    return vring_lduw(vq, pa);
+}
+
+/* The whole descriptor sits in one cache line, so read it in one go rather
+ * than with a load per field */
+static void vring_packed_desc_read(VirtQueue *vq, VRingPackedDesc *desc,
+                                   hwaddr desc_pa, int i)
+{
+    VirtIODevice *vdev = vq->vdev;
+
+    vring_read(vq, desc_pa + sizeof(VRingPackedDesc) * i, desc, sizeof(*desc));
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->id);
+    virtio_tswap16s(vdev, &desc->flags);
+}
+
+static bool vring_packed_desc_is_avail(VirtQueue *vq, int i, bool wrap_counter)
+{
+    uint16_t flags = vring_packed_desc_flags(vq, i);
+    bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+
+    return avail != used && avail == wrap_counter;
+}
+
+/* Write a used descriptor @offset slots after vq->used_idx.  The guest takes
+ * it once its flags change, so for the first descriptor of a batch these go
+ * out after everything else. */
+static void vring_packed_used_write(VirtQueue *vq, unsigned int offset,
+                                    uint16_t id, uint32_t len, bool first)
+{
+    unsigned int head = vq->used_idx + offset;
+    bool wrap_counter = vq->used_wrap_counter;
+    uint16_t flags = 0;
+    hwaddr pa;
+
+    if (head >= vq->vring.num) {
+        head -= vq->vring.num;
+        wrap_counter = !wrap_counter;
+    }
+    if (wrap_counter) {
+        flags = (1 << VRING_PACKED_DESC_F_AVAIL) |
+                (1 << VRING_PACKED_DESC_F_USED);
+    }
+
+    pa = vq->vring.desc + sizeof(VRingPackedDesc) * head;
+    vring_stw(vq, pa + offsetof(VRingPackedDesc, id), id);
+    vring_stl(vq, pa + offsetof(VRingPackedDesc, len), len);
+    if (first) {
+        /* Make sure buffers and descriptors are written before the flags. */
+        smp_wmb();
+    }
+    vring_stw(vq, pa + offsetof(VRingPackedDesc, flags), flags);
+}
+
+/* Ask for a kick once the guest makes the next descriptor available */
+static void vring_packed_set_avail_event(VirtQueue *vq)
+{
+    hwaddr pa;
+    uint16_t off_wrap;
+
+    if (!vq->notification) {
+        return;
+    }
+    off_wrap = vq->last_avail_idx |
+               (vq->last_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR);
+    pa = vq->vring.used + offsetof(VRingPackedDescEvent, off_wrap);
+    vring_stw(vq, pa, off_wrap);
+}
+
+static void virtio_queue_packed_set_notification(VirtQueue *vq, int enable)
+{
+    VirtIODevice *vdev = vq->vdev;
+    uint16_t flags;
+    hwaddr pa;
+
+    if (!enable) {
+        flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    } else if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(vq);
+        /* The offset must be there when the guest sees the flags. */
+        smp_wmb();
+        flags = VRING_PACKED_EVENT_FLAG_DESC;
+    } else {
+        flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+    pa = vq->vring.used + offsetof(VRingPackedDescEvent, flags);
+    vring_stw(vq, pa, flags);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
     vq->notification = enable;
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (virtio_queue_packed(vq)) {
+        virtio_queue_packed_set_notification(vq, enable);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
@@ -233,6 +593,11 @@ void virtio_queue_set_notification(VirtQueue *vq, int enable)
     }
 }
 
+int virtio_queue_get_notification(VirtQueue *vq)
+{
+    return vq->notification;
+}
+
 int virtio_queue_ready(VirtQueue *vq)
 {
     return vq->vring.avail != 0;
@@ -240,6 +605,13 @@ int virtio_queue_ready(VirtQueue *vq)
 
 int virtio_queue_empty(VirtQueue *vq)
 {
+    if (virtio_queue_packed(vq)) {
+        return !vring_packed_desc_is_avail(vq, vq->last_avail_idx,
+                                           vq->last_avail_wrap_counter);
+    }
+    if (vq->shadow_avail_idx != vq->last_avail_idx) {
+        return 0;
+    }
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
@@ -269,10 +641,60 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
                        unsigned int len)
 {
-    vq->last_avail_idx--;
+    if (virtio_queue_packed(vq)) {
+        unsigned int ndescs = VIRTQUEUE_PACKED_NDESCS(elem->index);
+
+        if (vq->last_avail_idx < ndescs) {
+            vq->last_avail_idx += vq->vring.num;
+            vq->last_avail_wrap_counter = !vq->last_avail_wrap_counter;
+        }
+        vq->last_avail_idx -= ndescs;
+    } else {
+        vq->last_avail_idx--;
+    }
+    vq->inuse--;
     virtqueue_unmap_sg(vq, elem, len);
 }
 
+/* Used descriptors are not indexed by their buffer: each one goes to the
+ * slot after the ring descriptors of the buffers before it, so elements have
+ * to come in order. */
+static void virtqueue_packed_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                  unsigned int len, unsigned int idx)
+{
+    uint16_t id = VIRTQUEUE_PACKED_ID(elem->index);
+
+    assert(idx == vq->used_batch);
+    if (idx == 0) {
+        vq->used_head_id = id;
+        vq->used_head_len = len;
+    } else {
+        vring_packed_used_write(vq, vq->used_batch_descs, id, len, false);
+    }
+    vq->used_batch++;
+    vq->used_batch_descs += VIRTQUEUE_PACKED_NDESCS(elem->index);
+}
+
+static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
+{
+    assert(count == vq->used_batch);
+    if (!count) {
+        return;
+    }
+
+    vring_packed_used_write(vq, 0, vq->used_head_id, vq->used_head_len, true);
+    vq->used_idx += vq->used_batch_descs;
+    if (vq->used_idx >= vq->vring.num) {
+        vq->used_idx -= vq->vring.num;
+        vq->used_wrap_counter = !vq->used_wrap_counter;
+        /* signalled_used is from the previous lap, it cannot be compared */
+        vq->signalled_used_valid = false;
+    }
+    vq->inuse -= count;
+    vq->used_batch = 0;
+    vq->used_batch_descs = 0;
+}
+
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx)
 {
@@ -280,6 +702,11 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 
     virtqueue_unmap_sg(vq, elem, len);
 
+    if (virtio_queue_packed(vq)) {
+        virtqueue_packed_fill(vq, elem, len, idx);
+        return;
+    }
+
     idx = (idx + vring_used_idx(vq)) % vq->vring.num;
 
     /* Get a pointer to the next entry in the used ring. */
@@ -290,6 +717,13 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
     uint16_t old, new;
+
+    if (virtio_queue_packed(vq)) {
+        trace_virtqueue_flush(vq, count);
+        virtqueue_packed_flush(vq, count);
+        return;
+    }
+
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
@@ -304,25 +738,88 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len)
 {
-    virtqueue_fill(vq, elem, len, 0);
-    virtqueue_flush(vq, 1);
+    /* Deferred completions go out with this one */
+    unsigned int idx = vq->deferred;
+
+    vq->deferred = 0;
+    virtqueue_fill(vq, elem, len, idx);
+    virtqueue_flush(vq, idx + 1);
+}
+
+void virtqueue_flush_deferred(VirtQueue *vq)
+{
+    unsigned int count = vq->deferred;
+
+    if (!count) {
+        return;
+    }
+    vq->deferred = 0;
+    virtqueue_flush(vq, count);
+    virtio_notify(vq->vdev, vq);
+}
+
+static void virtqueue_deferred_bh(void *opaque)
+{
+    virtqueue_flush_deferred(opaque);
+}
+
+void virtqueue_fill_deferred(VirtQueue *vq, const VirtQueueElement *elem,
+                             unsigned int len, unsigned int idx)
+{
+    virtqueue_fill(vq, elem, len, vq->deferred + idx);
+}
+
+void virtqueue_unpop_deferred(VirtQueue *vq, unsigned int count)
+{
+    /* The used slots are simply filled again by the next elements; their
+     * buffers were unmapped by virtqueue_fill() already. */
+    assert(!virtio_queue_packed(vq));
+    vq->last_avail_idx -= count;
+    vq->inuse -= count;
+}
+
+void virtqueue_flush_later(VirtQueue *vq, unsigned int count)
+{
+    vq->deferred += count;
+
+    /* Nothing may be left behind once the VM stopped, migration is about
+     * to send the rings */
+    if (!vq->vdev->vm_running) {
+        virtqueue_flush_deferred(vq);
+        return;
+    }
+
+    if (vq->deferred == count) {
+        if (!vq->deferred_bh) {
+            vq->deferred_bh = aio_bh_new(vq->ctx ?: qemu_get_aio_context(),
+                                         virtqueue_deferred_bh, vq);
+        }
+        qemu_bh_schedule(vq->deferred_bh);
+    }
+}
+
+void virtqueue_push_deferred(VirtQueue *vq, const VirtQueueElement *elem,
+                             unsigned int len)
+{
+    virtqueue_fill_deferred(vq, elem, len, 0);
+    virtqueue_flush_later(vq, 1);
 }
 
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
-    uint16_t num_heads = vring_avail_idx(vq) - idx;
+    uint16_t num_heads = vq->shadow_avail_idx - idx;
+
+    /* Only read the index again once the heads it gave are used up */
+    if (!num_heads) {
+        num_heads = vring_avail_idx(vq) - idx;
+    }
 
     /* Check it isn't doing very strange things with descriptor numbers. */
     if (num_heads > vq->vring.num) {
         error_report("Guest moved used index from %u to %u",
-                     idx, vring_avail_idx(vq));
+                     idx, vq->shadow_avail_idx);
         exit(1);
     }
-    /* On success, callers read a descriptor at vq->last_avail_idx.
-     * Make sure descriptor read does not bypass avail index read. */
-    if (num_heads) {
-        smp_rmb();
-    }
 
     return num_heads;
 }
@@ -344,18 +841,18 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
+static unsigned virtqueue_next_desc(VirtQueue *vq, hwaddr desc_pa,
                                     unsigned int i, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_NEXT)) {
+    if (!(vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_NEXT)) {
         return max;
     }
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(vdev, desc_pa, i);
+    next = vring_desc_next(vq, desc_pa, i);
     /* Make sure compiler knows to grab that: we don't want it changing! */
     smp_wmb();
 
@@ -367,6 +864,93 @@ static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
     return next;
 }
 
+static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
+                                             unsigned int *in_bytes,
+                                             unsigned int *out_bytes,
+                                             unsigned max_in_bytes,
+                                             unsigned max_out_bytes)
+{
+    unsigned int idx = vq->last_avail_idx;
+    bool wrap_counter = vq->last_avail_wrap_counter;
+    unsigned int total_descs, in_total, out_total;
+
+    total_descs = in_total = out_total = 0;
+    while (total_descs < vq->vring.num &&
+           vring_packed_desc_is_avail(vq, idx, wrap_counter)) {
+        VRingPackedDesc desc;
+        hwaddr desc_pa = vq->vring.desc;
+        unsigned int i = idx, max = vq->vring.num;
+        unsigned int num_bufs = 0, ndescs = 0;
+        bool indirect = false;
+
+        /* Read the descriptor after its flags said it is there. */
+        smp_rmb();
+        vring_packed_desc_read(vq, &desc, desc_pa, i);
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (!desc.len || desc.len % sizeof(VRingPackedDesc)) {
+                error_report("Invalid size for indirect buffer table");
+                exit(1);
+            }
+
+            /* loop over the indirect descriptor table */
+            indirect = true;
+            ndescs = 1;
+            max = desc.len / sizeof(VRingPackedDesc);
+            desc_pa = desc.addr;
+            i = 0;
+            vring_packed_desc_read(vq, &desc, desc_pa, i);
+        }
+
+        for (;;) {
+            /* If we've got too many, that implies a descriptor loop. */
+            if (++num_bufs > max) {
+                error_report("Looped descriptor");
+                exit(1);
+            }
+
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
+            } else {
+                out_total += desc.len;
+            }
+            if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                goto done;
+            }
+
+            if (indirect) {
+                /* the whole table is one buffer */
+                if (++i == max) {
+                    break;
+                }
+            } else {
+                ndescs++;
+                if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                    break;
+                }
+                if (++i == vq->vring.num) {
+                    i = 0;
+                }
+            }
+            vring_packed_desc_read(vq, &desc, desc_pa, i);
+        }
+
+        total_descs += ndescs;
+        idx += ndescs;
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap_counter = !wrap_counter;
+        }
+    }
+done:
+    if (in_bytes) {
+        *in_bytes = in_total;
+    }
+    if (out_bytes) {
+        *out_bytes = out_total;
+    }
+}
+
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                                unsigned int *out_bytes,
                                unsigned max_in_bytes, unsigned max_out_bytes)
@@ -374,11 +958,16 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     unsigned int idx;
     unsigned int total_bufs, in_total, out_total;
 
+    if (virtio_queue_packed(vq)) {
+        virtqueue_packed_get_avail_bytes(vq, in_bytes, out_bytes,
+                                         max_in_bytes, max_out_bytes);
+        return;
+    }
+
     idx = vq->last_avail_idx;
 
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
-        VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
         hwaddr desc_pa;
         int i;
@@ -388,8 +977,8 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+        if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_INDIRECT) {
+            if (vring_desc_len(vq, desc_pa, i) % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -402,8 +991,8 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-            desc_pa = vring_desc_addr(vdev, desc_pa, i);
+            max = vring_desc_len(vq, desc_pa, i) / sizeof(VRingDesc);
+            desc_pa = vring_desc_addr(vq, desc_pa, i);
             num_bufs = i = 0;
         }
 
@@ -414,15 +1003,15 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 exit(1);
             }
 
-            if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(vdev, desc_pa, i);
+            if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_WRITE) {
+                in_total += vring_desc_len(vq, desc_pa, i);
             } else {
-                out_total += vring_desc_len(vdev, desc_pa, i);
+                out_total += vring_desc_len(vq, desc_pa, i);
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+        } while ((i = virtqueue_next_desc(vq, desc_pa, i, max)) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -447,6 +1036,23 @@ int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
     return in_bytes <= in_total && out_bytes <= out_total;
 }
 
+/*
+ * Copies only the used part of @src.  Elements are large, and most of it is
+ * never touched for requests with few descriptors.
+ */
+void virtqueue_element_copy(VirtQueueElement *dst,
+                            const VirtQueueElement *src)
+{
+    dst->index = src->index;
+    dst->in_num = src->in_num;
+    dst->out_num = src->out_num;
+    memcpy(dst->in_addr, src->in_addr, src->in_num * sizeof(src->in_addr[0]));
+    memcpy(dst->out_addr, src->out_addr,
+           src->out_num * sizeof(src->out_addr[0]));
+    memcpy(dst->in_sg, src->in_sg, src->in_num * sizeof(src->in_sg[0]));
+    memcpy(dst->out_sg, src->out_sg, src->out_num * sizeof(src->out_sg[0]));
+}
+
 void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     size_t num_sg, int is_write)
 {
@@ -469,12 +1075,129 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     }
 }
 
+static void virtqueue_elem_add_desc(VirtQueueElement *elem, hwaddr addr,
+                                    uint32_t len, bool is_write)
+{
+    struct iovec *sg;
+
+    if (is_write) {
+        if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
+            error_report("Too many write descriptors in indirect table");
+            exit(1);
+        }
+        elem->in_addr[elem->in_num] = addr;
+        sg = &elem->in_sg[elem->in_num++];
+    } else {
+        if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
+            error_report("Too many read descriptors in indirect table");
+            exit(1);
+        }
+        elem->out_addr[elem->out_num] = addr;
+        sg = &elem->out_sg[elem->out_num++];
+    }
+    sg->iov_len = len;
+}
+
+static int virtqueue_packed_pop(VirtQueue *vq, VirtQueueElement *elem)
+{
+    VirtIODevice *vdev = vq->vdev;
+    hwaddr desc_pa = vq->vring.desc;
+    unsigned int i, max, ndescs = 0;
+    bool indirect = false;
+    VRingPackedDesc desc;
+    uint16_t id;
+
+    if (virtio_queue_empty(vq)) {
+        return 0;
+    }
+    /* Make sure the descriptor is read after its flags said it is there. */
+    smp_rmb();
+
+    /* When we start there are none of either input nor output. */
+    elem->out_num = elem->in_num = 0;
+
+    max = vq->vring.num;
+    i = vq->last_avail_idx;
+    vring_packed_desc_read(vq, &desc, desc_pa, i);
+    id = desc.id;
+
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (!desc.len || desc.len % sizeof(VRingPackedDesc)) {
+            error_report("Invalid size for indirect buffer table");
+            exit(1);
+        }
+
+        /* loop over the indirect descriptor table */
+        indirect = true;
+        ndescs = 1;
+        max = desc.len / sizeof(VRingPackedDesc);
+        desc_pa = desc.addr;
+        i = 0;
+        vring_packed_desc_read(vq, &desc, desc_pa, i);
+    }
+
+    /* Collect all the descriptors.  A chain takes consecutive slots of the
+     * ring, and the buffer id is in its last descriptor. */
+    for (;;) {
+        virtqueue_elem_add_desc(elem, desc.addr, desc.len,
+                                desc.flags & VRING_DESC_F_WRITE);
+
+        /* If we've got too many, that implies a descriptor loop. */
+        if ((elem->in_num + elem->out_num) > max) {
+            error_report("Looped descriptor");
+            exit(1);
+        }
+
+        if (indirect) {
+            if (++i == max) {
+                break;
+            }
+        } else {
+            ndescs++;
+            if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            if (++i == vq->vring.num) {
+                i = 0;
+            }
+        }
+        vring_packed_desc_read(vq, &desc, desc_pa, i);
+        if (!indirect) {
+            id = desc.id;
+        }
+    }
+
+    /* Now map what we have collected */
+    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+
+    elem->index = VIRTQUEUE_PACKED_INDEX(id, ndescs);
+
+    vq->last_avail_idx += ndescs;
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->last_avail_wrap_counter = !vq->last_avail_wrap_counter;
+    }
+    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(vq);
+    }
+
+    vq->inuse++;
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+    return elem->in_num + elem->out_num;
+}
+
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 {
     unsigned int i, head, max;
     hwaddr desc_pa = vq->vring.desc;
     VirtIODevice *vdev = vq->vdev;
 
+    if (virtio_queue_packed(vq)) {
+        return virtqueue_packed_pop(vq, elem);
+    }
+
     if (!virtqueue_num_heads(vq, vq->last_avail_idx))
         return 0;
 
@@ -488,46 +1211,31 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
         vring_set_avail_event(vq, vq->last_avail_idx);
     }
 
-    if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+    if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_INDIRECT) {
+        if (vring_desc_len(vq, desc_pa, i) % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(vdev, desc_pa, i);
+        max = vring_desc_len(vq, desc_pa, i) / sizeof(VRingDesc);
+        desc_pa = vring_desc_addr(vq, desc_pa, i);
         i = 0;
     }
 
     /* Collect all the descriptors */
     do {
-        struct iovec *sg;
-
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-            if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
-                error_report("Too many write descriptors in indirect table");
-                exit(1);
-            }
-            elem->in_addr[elem->in_num] = vring_desc_addr(vdev, desc_pa, i);
-            sg = &elem->in_sg[elem->in_num++];
-        } else {
-            if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
-                error_report("Too many read descriptors in indirect table");
-                exit(1);
-            }
-            elem->out_addr[elem->out_num] = vring_desc_addr(vdev, desc_pa, i);
-            sg = &elem->out_sg[elem->out_num++];
-        }
-
-        sg->iov_len = vring_desc_len(vdev, desc_pa, i);
+        virtqueue_elem_add_desc(elem, vring_desc_addr(vq, desc_pa, i),
+                                vring_desc_len(vq, desc_pa, i),
+                                vring_desc_flags(vq, desc_pa, i) &
+                                VRING_DESC_F_WRITE);
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+    } while ((i = virtqueue_next_desc(vq, desc_pa, i, max)) != max);
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
@@ -642,6 +1350,14 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
+        vdev->vq[i].shadow_avail_idx = 0;
+        vdev->vq[i].deferred = 0;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].used_idx = 0;
+        vdev->vq[i].used_wrap_counter = true;
+        vdev->vq[i].used_batch = 0;
+        vdev->vq[i].used_batch_descs = 0;
+        virtio_queue_invalidate_cache(&vdev->vq[i]);
         virtio_queue_set_vector(vdev, i, VIRTIO_NO_VECTOR);
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
@@ -855,6 +1571,7 @@ void virtio_queue_set_rings(VirtIODevice *vdev, int n, hwaddr desc,
     vdev->vq[n].vring.desc = desc;
     vdev->vq[n].vring.avail = avail;
     vdev->vq[n].vring.used = used;
+    virtio_queue_invalidate_cache(&vdev->vq[n]);
 }
 
 void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
@@ -868,6 +1585,7 @@ void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
         return;
     }
     vdev->vq[n].vring.num = num;
+    virtio_queue_invalidate_cache(&vdev->vq[n]);
 }
 
 VirtQueue *virtio_vector_first_queue(VirtIODevice *vdev, uint16_t vector)
@@ -990,6 +1708,7 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
     }
 
     vdev->vq[n].vring.num = 0;
+    virtio_queue_invalidate_cache(&vdev->vq[n]);
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -999,6 +1718,45 @@ void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
+static bool vring_packed_need_event(VirtQueue *vq, uint16_t off_wrap,
+                                    uint16_t new, uint16_t old)
+{
+    int off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+    /* A requested event on the previous lap of the ring */
+    if (vq->used_wrap_counter != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+        off -= vq->vring.num;
+    }
+    return vring_need_event(off, new, old);
+}
+
+static bool vring_packed_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VRingPackedDescEvent e;
+    uint16_t old, new;
+    hwaddr pa;
+    bool v;
+
+    pa = vq->vring.avail;
+    e.flags = vring_lduw(vq, pa + offsetof(VRingPackedDescEvent, flags));
+    if (e.flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    } else if (e.flags == VRING_PACKED_EVENT_FLAG_ENABLE ||
+               !virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        return true;
+    }
+
+    /* Make sure the offset is read after the flags. */
+    smp_rmb();
+    e.off_wrap = vring_lduw(vq, pa + offsetof(VRingPackedDescEvent, off_wrap));
+
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+    return !v || vring_packed_need_event(vq, e.off_wrap, new, old);
+}
+
 static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     uint16_t old, new;
@@ -1007,10 +1765,14 @@ static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
     smp_mb();
     /* Always notify when queue is empty (when feature acknowledge) */
     if (virtio_vdev_has_feature(vdev, VIRTIO_F_NOTIFY_ON_EMPTY) &&
-        !vq->inuse && vring_avail_idx(vq) == vq->last_avail_idx) {
+        !vq->inuse && virtio_queue_empty(vq)) {
         return true;
     }
 
+    if (virtio_queue_packed(vq)) {
+        return vring_packed_notify(vdev, vq);
+    }
+
     if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
     }
@@ -1029,6 +1791,12 @@ void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
     }
 
     trace_virtio_notify(vdev, vq);
+    if (vq->ctx) {
+        /* Outside the main loop; the interrupt is raised by irqfd, or by
+         * virtio_queue_guest_notifier_read() in the main loop */
+        event_notifier_set(&vq->guest_notifier);
+        return;
+    }
     vdev->isr |= 0x01;
     virtio_notify_vector(vdev, vq->vector);
 }
@@ -1069,6 +1837,13 @@ static bool virtio_virtqueue_needed(void *opaque)
     return virtio_host_has_feature(vdev, VIRTIO_F_VERSION_1);
 }
 
+static bool virtio_packed_virtqueue_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED);
+}
+
 static void put_virtqueue_state(QEMUFile *f, void *pv, size_t size)
 {
     VirtIODevice *vdev = pv;
@@ -1098,6 +1873,59 @@ static VMStateInfo vmstate_info_virtqueue = {
     .put = put_virtqueue_state,
 };
 
+static void put_packed_virtqueue_state(QEMUFile *f, void *pv, size_t size)
+{
+    VirtIODevice *vdev = pv;
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        qemu_put_byte(f, vdev->vq[i].last_avail_wrap_counter);
+        qemu_put_be16(f, vdev->vq[i].used_idx);
+        qemu_put_byte(f, vdev->vq[i].used_wrap_counter);
+    }
+}
+
+static int get_packed_virtqueue_state(QEMUFile *f, void *pv, size_t size)
+{
+    VirtIODevice *vdev = pv;
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        vdev->vq[i].last_avail_wrap_counter = qemu_get_byte(f);
+        vdev->vq[i].used_idx = qemu_get_be16(f);
+        vdev->vq[i].used_wrap_counter = qemu_get_byte(f);
+        if (vdev->vq[i].used_idx >= VIRTQUEUE_MAX_SIZE) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static VMStateInfo vmstate_info_packed_virtqueue = {
+    .name = "packed_virtqueue_state",
+    .get = get_packed_virtqueue_state,
+    .put = put_packed_virtqueue_state,
+};
+
+static const VMStateDescription vmstate_virtio_packed_virtqueues = {
+    .name = "virtio/packed_virtqueues",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_packed_virtqueue_needed,
+    .fields = (VMStateField[]) {
+        {
+            .name         = "packed_virtqueues",
+            .version_id   = 0,
+            .field_exists = NULL,
+            .size         = 0,
+            .info         = &vmstate_info_packed_virtqueue,
+            .flags        = VMS_SINGLE,
+            .offset       = 0,
+        },
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_virtio_virtqueues = {
     .name = "virtio/virtqueues",
     .version_id = 1,
@@ -1151,6 +1979,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_device_endian,
         &vmstate_virtio_64bit_features,
         &vmstate_virtio_virtqueues,
+        &vmstate_virtio_packed_virtqueues,
         NULL
     }
 };
@@ -1215,6 +2044,8 @@ static int virtio_set_features_nocheck(VirtIODevice *vdev, uint64_t val)
         k->set_features(vdev, val);
     }
     vdev->guest_features = val;
+    /* the ring layout may have changed */
+    virtio_invalidate_caches(vdev);
     return bad ? -1 : 0;
 }
 
@@ -1288,8 +2119,12 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
         }
         vdev->vq[i].vring.desc = qemu_get_be64(f);
         qemu_get_be16s(f, &vdev->vq[i].last_avail_idx);
+        vdev->vq[i].shadow_avail_idx = vdev->vq[i].last_avail_idx;
         vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].notification = true;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].used_idx = 0;
+        vdev->vq[i].used_wrap_counter = true;
 
         if (vdev->vq[i].vring.desc) {
             /* XXX virtio-1 devices */
@@ -1349,7 +2184,17 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
     }
 
     for (i = 0; i < num; i++) {
-        if (vdev->vq[i].vring.desc) {
+        if (vdev->vq[i].vring.desc && virtio_queue_packed(&vdev->vq[i])) {
+            /* There is no avail index to check against */
+            if (vdev->vq[i].last_avail_idx >= vdev->vq[i].vring.num ||
+                vdev->vq[i].used_idx >= vdev->vq[i].vring.num) {
+                error_report("VQ %d size 0x%x inconsistent with packed ring "
+                             "indexes 0x%x/0x%x", i, vdev->vq[i].vring.num,
+                             vdev->vq[i].last_avail_idx,
+                             vdev->vq[i].used_idx);
+                return -1;
+            }
+        } else if (vdev->vq[i].vring.desc) {
             uint16_t nheads;
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing strange things with descriptor numbers. */
@@ -1369,6 +2214,13 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].deferred_bh) {
+            qemu_bh_delete(vdev->vq[i].deferred_bh);
+        }
+    }
     qemu_del_vm_change_state_handler(vdev->vmstate);
     g_free(vdev->config);
     g_free(vdev->vq);
@@ -1381,7 +2233,14 @@ static void virtio_vmstate_change(void *opaque, int running, RunState state)
     BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     bool backend_run = running && (vdev->status & VIRTIO_CONFIG_S_DRIVER_OK);
+    int i;
+
     vdev->vm_running = running;
+    if (!running) {
+        for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+            virtqueue_flush_deferred(&vdev->vq[i]);
+        }
+    }
 
     if (backend_run) {
         virtio_set_status(vdev, vdev->status);
@@ -1472,12 +2331,18 @@ hwaddr virtio_queue_get_desc_size(VirtIODevice *vdev, int n)
 
 hwaddr virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_queue_packed(&vdev->vq[n])) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingAvail, ring) +
         sizeof(uint64_t) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_queue_packed(&vdev->vq[n])) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingUsed, ring) +
         sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
 }
@@ -1488,14 +2353,54 @@ hwaddr virtio_queue_get_ring_size(VirtIODevice *vdev, int n)
 	    virtio_queue_get_used_size(vdev, n);
 }
 
-uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
+/*
+ * For the packed ring, the low 16 bits are the avail index and the high 16
+ * bits the used index, each with its wrap counter in the top bit.
+ */
+unsigned int virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
 {
-    return vdev->vq[n].last_avail_idx;
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (virtio_queue_packed(vq)) {
+        return vq->last_avail_idx |
+               ((unsigned int)vq->last_avail_wrap_counter << 15) |
+               ((unsigned int)vq->used_idx << 16) |
+               ((unsigned int)vq->used_wrap_counter << 31);
+    }
+    return vq->last_avail_idx;
 }
 
-void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
+void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n,
+                                     unsigned int idx)
 {
-    vdev->vq[n].last_avail_idx = idx;
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (virtio_queue_packed(vq)) {
+        vq->last_avail_idx = idx & 0x7fff;
+        vq->last_avail_wrap_counter = !!(idx & 0x8000);
+        vq->used_idx = (idx >> 16) & 0x7fff;
+        vq->used_wrap_counter = !!(idx & 0x80000000);
+        return;
+    }
+    vq->last_avail_idx = idx;
+    vq->shadow_avail_idx = idx;
+}
+
+/*
+ * Used when a vhost backend went away before it could say where it stopped:
+ * everything up to the used index has been completed, anything after it is
+ * processed again.  Packed rings have no such index in guest memory, so
+ * they keep the position they had when the backend was started.
+ */
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (!vq->vring.desc || virtio_queue_packed(vq)) {
+        return;
+    }
+    vq->last_avail_idx = vring_used_idx(vq);
+    vq->shadow_avail_idx = vq->last_avail_idx;
 }
 
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
@@ -1566,6 +2471,34 @@ void virtio_queue_set_host_notifier_fd_handler(VirtQueue *vq, bool assign,
     }
 }
 
+void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq,
+                                                AioContext *ctx,
+                                                bool assign, bool set_handler)
+{
+    if (assign && set_handler) {
+        aio_set_event_notifier(ctx, &vq->host_notifier,
+                               virtio_queue_host_notifier_read);
+    } else {
+        aio_set_event_notifier(ctx, &vq->host_notifier, NULL);
+    }
+    if (!assign) {
+        /* Test and clear notifier before after disabling event,
+         * in case poll callback didn't have time to run. */
+        virtio_queue_host_notifier_read(&vq->host_notifier);
+    }
+}
+
+void virtio_queue_set_aio_context(VirtQueue *vq, AioContext *ctx)
+{
+    /* what was completed so far goes out from the old context */
+    virtqueue_flush_deferred(vq);
+    if (vq->deferred_bh) {
+        qemu_bh_delete(vq->deferred_bh);
+        vq->deferred_bh = NULL;
+    }
+    vq->ctx = ctx;
+}
+
 EventNotifier *virtio_queue_get_host_notifier(VirtQueue *vq)
 {
     return &vq->host_notifier;
@@ -1596,6 +2529,11 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
         error_propagate(errp, err);
         return;
     }
+
+    vdev->listener = (MemoryListener) {
+        .commit = virtio_memory_listener_commit,
+    };
+    memory_listener_register(&vdev->listener, &address_space_memory);
 }
 
 static void virtio_device_unrealize(DeviceState *dev, Error **errp)
@@ -1604,6 +2542,8 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
     VirtioDeviceClass *vdc = VIRTIO_DEVICE_GET_CLASS(dev);
     Error *err = NULL;
 
+    memory_listener_unregister(&vdev->listener);
+    virtio_invalidate_caches(vdev);
     virtio_bus_device_unplugged(vdev);
 
     if (vdc->unrealize != NULL) {
@@ -1643,6 +2583,75 @@ static const TypeInfo virtio_device_info = {
     .class_size = sizeof(VirtioDeviceClass),
 };
 
+/* A freed request stays in the pool while there are fewer than this */
+#define VIRTIO_REQ_POOL_MAX     64
+/* Requests start on a cache line of their own */
+#define VIRTIO_REQ_POOL_ALIGN   64
+
+struct VirtIOReqPool {
+    QemuMutex lock;
+    size_t size;
+    unsigned int nb_free;
+    void *free[VIRTIO_REQ_POOL_MAX];
+};
+
+VirtIOReqPool *virtio_req_pool_new(size_t size)
+{
+    VirtIOReqPool *pool = g_new0(VirtIOReqPool, 1);
+
+    qemu_mutex_init(&pool->lock);
+    pool->size = size;
+    return pool;
+}
+
+void virtio_req_pool_free(VirtIOReqPool *pool)
+{
+    unsigned int i;
+
+    if (!pool) {
+        return;
+    }
+    for (i = 0; i < pool->nb_free; i++) {
+        qemu_mem_usage_free(MEMORY_USAGE_SUBSYSTEM_VIRTIO_REQUEST, pool->size);
+        qemu_vfree(pool->free[i]);
+    }
+    qemu_mutex_destroy(&pool->lock);
+    g_free(pool);
+}
+
+void *virtio_req_pool_get(VirtIOReqPool *pool)
+{
+    void *req = NULL;
+
+    qemu_mutex_lock(&pool->lock);
+    if (pool->nb_free) {
+        req = pool->free[--pool->nb_free];
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    if (!req) {
+        req = qemu_memalign(VIRTIO_REQ_POOL_ALIGN, pool->size);
+        qemu_mem_usage_alloc(MEMORY_USAGE_SUBSYSTEM_VIRTIO_REQUEST,
+                             pool->size);
+    }
+    return req;
+}
+
+void virtio_req_pool_put(VirtIOReqPool *pool, void *req)
+{
+    qemu_mutex_lock(&pool->lock);
+    if (pool->nb_free < VIRTIO_REQ_POOL_MAX) {
+        pool->free[pool->nb_free++] = req;
+        req = NULL;
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    if (req) {
+        qemu_mem_usage_free(MEMORY_USAGE_SUBSYSTEM_VIRTIO_REQUEST, pool->size);
+        qemu_vfree(req);
+    }
+}
+
 static void virtio_register_types(void)
 {
     type_register_static(&virtio_device_info);
@@ -47,6 +47,7 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -119,9 +120,54 @@ struct AioContext {
 
     /* Thread pool for performing work and receiving completion callbacks */
     struct ThreadPool *thread_pool;
+    /* Size limits applied to thread_pool */
+    int thread_pool_min;
+    int thread_pool_max;
+
+    /* Aligned buffers for the block layer, see aio_get_buffer_pool() */
+    struct BufferPool *buffer_pool;
+
+#ifdef CONFIG_LINUX_AIO
+    /* Native AIO state, shared by all the images in this AioContext so
+     * that one plugged section submits all their requests at once */
+    struct qemu_laio_state *linux_aio;
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    /* The same for io_uring, without and with submission queue polling */
+    struct qemu_luring_state *linux_io_uring[2];
+#endif
+    /* Nesting depth of aio_context_io_plug(), for the states above that
+     * are set up inside a plugged section */
+    int io_plugged;
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
+
+    /* Adaptive polling, see aio_context_set_poll_params().  poll_ns is
+     * the current polling window, which moves between 0 and poll_max_ns.
+     */
+    int64_t poll_ns;
+    int64_t poll_max_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* Polling windows run, and those that found a handler ready */
+    uint64_t poll_attempts;
+    uint64_t poll_successes;
+
+    /* Load statistics of aio_poll(): the time it spent sleeping in poll()
+     * and the rest of its time, the sleeps that ended because of an event,
+     * and the fd handlers it called.  Only kept on POSIX hosts.
+     */
+    uint64_t idle_ns;
+    uint64_t busy_ns;
+    uint64_t wakeups;
+    uint64_t dispatched;
+
+    /* epoll(7) state used when there are many fds, see aio-posix.c */
+    int epollfd;
+    bool epoll_enabled;
+    bool epoll_available;
 };
 
 /**
@@ -133,6 +179,24 @@ struct AioContext {
  */
 AioContext *aio_context_new(Error **errp);
 
+/**
+ * aio_context_setup:
+ * @ctx: the aio context
+ *
+ * Initialize the aio context, with the parts that depend on the host
+ * (the epoll file descriptor on Linux).
+ */
+void aio_context_setup(AioContext *ctx);
+
+/**
+ * aio_context_destroy:
+ * @ctx: the aio context
+ *
+ * Release what aio_context_setup() set up, once all the fd handlers are
+ * gone.
+ */
+void aio_context_destroy(AioContext *ctx);
+
 /**
  * aio_context_ref:
  * @ctx: The AioContext to operate on.
@@ -314,6 +378,40 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read);
 
+/* Set a cheap "is there work?" callback for a file descriptor that is
+ * already registered with aio_set_fd_handler().  While polling is enabled
+ * for @ctx, aio_poll() calls @io_poll with the opaque of that registration
+ * for a while before it sleeps, and dispatches the read handler as soon as
+ * @io_poll returns true; the read handler may thus run without the file
+ * descriptor being readable.  @io_poll runs with @ctx acquired and must not
+ * change the handlers.  The callback goes away with the fd handler.
+ *
+ * Polling is not implemented on Windows, where this does nothing.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll);
+
+/* The same for an event notifier registered with aio_set_event_notifier().
+ * @io_poll is passed the notifier.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to poll at most before sleeping, 0 to disable polling
+ * @grow: factor by which the polling window grows, 0 for the default
+ * @shrink: divisor by which the polling window shrinks, 0 for the default
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * The polling window starts at 0 and tunes itself: it grows while events
+ * keep arriving a little after it ended, and shrinks when the event loop
+ * had to sleep for longer than @max_ns anyway.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -322,6 +420,68 @@ GSource *aio_get_g_source(AioContext *ctx);
 /* Return the ThreadPool bound to this AioContext */
 struct ThreadPool *aio_get_thread_pool(AioContext *ctx);
 
+/* Return the pool of aligned I/O buffers bound to this AioContext */
+struct BufferPool *aio_get_buffer_pool(AioContext *ctx);
+
+/**
+ * aio_context_set_thread_pool_params:
+ * @ctx: the aio context
+ * @min: number of worker threads kept even when idle
+ * @max: largest number of worker threads
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Set the size limits of the thread pool of @ctx, now if it exists or
+ * else when it is created.
+ */
+void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
+                                        int64_t max, Error **errp);
+
+#ifdef CONFIG_LINUX_AIO
+/* Return the Linux AIO state bound to this AioContext, or NULL if it
+ * cannot be set up */
+struct qemu_laio_state *aio_get_linux_aio(AioContext *ctx);
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+/* Return the io_uring state bound to this AioContext, or NULL with @errp
+ * set if it cannot be set up */
+struct qemu_luring_state *aio_get_linux_io_uring(AioContext *ctx, bool sqpoll,
+                                                 Error **errp);
+#endif
+
+/**
+ * aio_context_io_plug:
+ * @ctx: the aio context
+ *
+ * Start a plugged section for all of the native AIO and io_uring requests
+ * in @ctx: the requests are queued until the matching
+ * aio_context_io_unplug() and then submitted with a single system call,
+ * whatever image they belong to. Plugged sections nest, also with the
+ * ones of bdrv_io_plug().
+ *
+ * aio_dispatch() runs the handlers of an event loop iteration in one such
+ * section.
+ */
+void aio_context_io_plug(AioContext *ctx);
+
+/**
+ * aio_context_io_unplug:
+ * @ctx: the aio context
+ *
+ * End a plugged section opened with aio_context_io_plug().
+ */
+void aio_context_io_unplug(AioContext *ctx);
+
+/**
+ * aio_context_io_flush:
+ * @ctx: the aio context
+ *
+ * Submit the requests queued in @ctx without ending its plugged sections.
+ * aio_poll() calls this before it waits, so that a nested event loop does
+ * not wait for requests that are still queued.
+ */
+void aio_context_io_flush(AioContext *ctx);
+
 /**
  * aio_timer_new:
  * @ctx: the aio context
@@ -0,0 +1,39 @@
+/*
+ * Pool of aligned I/O buffers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_BUFFER_POOL_H
+#define QEMU_BUFFER_POOL_H 1
+
+#include "qemu-common.h"
+
+typedef struct BufferPool BufferPool;
+
+/* Buffers of up to this many bytes are kept for reuse */
+#define BUFFER_POOL_MIN_SIZE        4096
+#define BUFFER_POOL_MAX_SIZE        (2 * 1024 * 1024)
+
+/* ... but no more than this many per size, or this many bytes per size */
+#define BUFFER_POOL_MAX_FREE        16
+#define BUFFER_POOL_MAX_FREE_BYTES  (4 * 1024 * 1024)
+
+/* A pool is not thread-safe; the AioContext one is used under its lock. */
+BufferPool *buffer_pool_new(void);
+void buffer_pool_free(BufferPool *pool);
+
+/* Return a buffer of at least @size bytes aligned to @align, or NULL if
+ * memory is short.  Pooled buffers come in powers of two and are faulted in
+ * when they are allocated, so that reusing them costs neither a
+ * posix_memalign() nor page faults.
+ */
+void *buffer_pool_try_get(BufferPool *pool, size_t align, size_t size);
+
+/* Give back @buf (which may be NULL) of @size bytes, as passed to
+ * buffer_pool_try_get().
+ */
+void buffer_pool_put(BufferPool *pool, void *buf, size_t size);
+
+#endif
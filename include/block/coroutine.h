@@ -96,6 +96,21 @@ Coroutine *coroutine_fn qemu_coroutine_self(void);
  */
 bool qemu_in_coroutine(void);
 
+/**
+ * Grow the coroutine pool
+ *
+ * Devices that keep many requests in flight call this when they are
+ * realized, so that the pool holds enough coroutines for their queues and
+ * creating a coroutine does not have to allocate a new stack.
+ */
+void qemu_coroutine_increase_pool_batch_size(unsigned int additional_pool_size);
+
+/**
+ * Shrink the coroutine pool by what qemu_coroutine_increase_pool_batch_size()
+ * added, when the device goes away
+ */
+void qemu_coroutine_decrease_pool_batch_size(unsigned int removing_pool_size);
+
 
 
 /**
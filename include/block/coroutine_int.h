@@ -34,6 +34,9 @@ typedef enum {
     COROUTINE_ENTER = 3,
 } CoroutineAction;
 
+/* The stack size of the backends that allocate stacks of their own */
+#define COROUTINE_STACK_SIZE (1 << 20)
+
 struct Coroutine {
     CoroutineEntry *entry;
     void *entry_arg;
@@ -36,8 +36,23 @@ struct nbd_reply {
     uint32_t magic;
     uint32_t error;
     uint64_t handle;
+
+    /* Only for structured reply chunks; @error is 0 for them */
+    bool structured;
+    uint16_t flags;
+    uint16_t type;
+    uint32_t length;
 } QEMU_PACKED;
 
+/* Options that the client may negotiate before the export name.
+ * On input the desired features; on output what the server agreed to.
+ */
+typedef struct NBDNegotiation {
+    bool structured_reply;
+    bool base_allocation;
+    uint32_t context_id;        /* of "base:allocation" */
+} NBDNegotiation;
+
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
 #define NBD_FLAG_READ_ONLY      (1 << 1)        /* Device is read-only */
 #define NBD_FLAG_SEND_FLUSH     (1 << 2)        /* Send FLUSH */
@@ -51,12 +66,47 @@ struct nbd_reply {
 /* New-style client flags. */
 #define NBD_FLAG_C_FIXED_NEWSTYLE   (1 << 0)    /* Fixed newstyle protocol. */
 
+/* Options. */
+#define NBD_OPT_EXPORT_NAME     (1)
+#define NBD_OPT_ABORT           (2)
+#define NBD_OPT_LIST            (3)
+#define NBD_OPT_STRUCTURED_REPLY (8)
+#define NBD_OPT_SET_META_CONTEXT (10)
+
 /* Reply types. */
 #define NBD_REP_ACK             (1)             /* Data sending finished. */
 #define NBD_REP_SERVER          (2)             /* Export description. */
+#define NBD_REP_META_CONTEXT    (4)             /* Meta context id. */
 #define NBD_REP_ERR_UNSUP       ((UINT32_C(1) << 31) | 1) /* Unknown option. */
 #define NBD_REP_ERR_INVALID     ((UINT32_C(1) << 31) | 3) /* Invalid length. */
 
+#define NBD_REP_IS_ERR(type)    (!!((type) & (UINT32_C(1) << 31)))
+
+/* Structured reply chunks. */
+#define NBD_REPLY_FLAG_DONE         (1 << 0)    /* Last chunk of the reply. */
+
+#define NBD_REPLY_TYPE_NONE         (0)
+#define NBD_REPLY_TYPE_OFFSET_DATA  (1)
+#define NBD_REPLY_TYPE_OFFSET_HOLE  (2)
+#define NBD_REPLY_TYPE_BLOCK_STATUS (5)
+#define NBD_REPLY_TYPE_ERROR        ((1 << 15) | 1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET ((1 << 15) | 2)
+
+#define NBD_REPLY_TYPE_IS_ERR(type) (!!((type) & (1 << 15)))
+
+/* Extent flags of the "base:allocation" meta context. */
+#define NBD_META_BASE_ALLOCATION    "base:allocation"
+#define NBD_STATE_HOLE              (1 << 0)    /* Not allocated. */
+#define NBD_STATE_ZERO              (1 << 1)    /* Reads as zeroes. */
+
+/* Prefix of the meta context that exports a dirty bitmap, followed by the
+ * bitmap's name. */
+#define NBD_META_QEMU_DIRTY_BITMAP  "qemu:dirty-bitmap:"
+#define NBD_STATE_DIRTY             (1 << 0)    /* Dirty in the bitmap. */
+
+/* Most extents in a NBD_REPLY_TYPE_BLOCK_STATUS chunk from qemu-nbd. */
+#define NBD_MAX_EXTENTS             (512)
+
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
 
@@ -65,7 +115,8 @@ enum {
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2,
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+    NBD_CMD_BLOCK_STATUS = 7
 };
 
 #define NBD_DEFAULT_PORT	10809
@@ -75,10 +126,11 @@ enum {
 
 ssize_t nbd_wr_sync(int fd, void *buffer, size_t size, bool do_read);
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, Error **errp);
+                          off_t *size, NBDNegotiation *neg, Error **errp);
 int nbd_init(int fd, int csock, uint32_t flags, off_t size);
 ssize_t nbd_send_request(int csock, struct nbd_request *request);
 ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply);
+int nbd_errno_to_system_errno(int err);
 int nbd_client(int fd);
 int nbd_disconnect(int fd);
 
@@ -88,6 +140,8 @@ typedef struct NBDClient NBDClient;
 NBDExport *nbd_export_new(BlockBackend *blk, off_t dev_offset, off_t size,
                           uint32_t nbdflags, void (*close)(NBDExport *),
                           Error **errp);
+void nbd_export_set_bitmap(NBDExport *exp, const char *bitmap,
+                           Error **errp);
 void nbd_export_close(NBDExport *exp);
 void nbd_export_get(NBDExport *exp);
 void nbd_export_put(NBDExport *exp);
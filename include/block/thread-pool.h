@@ -24,9 +24,20 @@ typedef int ThreadPoolFunc(void *opaque);
 
 typedef struct ThreadPool ThreadPool;
 
+#define THREAD_POOL_MAX_WORKERS             256
+#define THREAD_POOL_DEFAULT_MIN_THREADS     0
+#define THREAD_POOL_DEFAULT_MAX_THREADS     64
+
 ThreadPool *thread_pool_new(struct AioContext *ctx);
 void thread_pool_free(ThreadPool *pool);
 
+/* Keep at least @min_threads worker threads around, starting them now if
+ * needed, and never run more than @max_threads at a time.  Requires
+ * 0 <= @min_threads <= @max_threads and 0 < @max_threads <=
+ * THREAD_POOL_MAX_WORKERS.
+ */
+void thread_pool_set_limits(ThreadPool *pool, int min_threads, int max_threads);
+
 BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg,
         BlockCompletionFunc *cb, void *opaque);
@@ -0,0 +1,54 @@
+/*
+ * AES using the host's AES instructions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QCRYPTO_AES_ACCEL_H
+#define QCRYPTO_AES_ACCEL_H
+
+#include "qemu-common.h"
+#include "crypto/aes.h"
+
+/*
+ * Round keys in memory order, as loaded by the AES instructions.  @dk is the
+ * schedule of the equivalent inverse cipher, as made by AES_set_decrypt_key().
+ */
+typedef struct QCryptoAESAccelKey {
+    uint8_t ek[AES_MAXNR + 1][AES_BLOCK_SIZE];
+    uint8_t dk[AES_MAXNR + 1][AES_BLOCK_SIZE];
+    int rounds;
+} QCryptoAESAccelKey;
+
+/**
+ * qcrypto_aes_accel_init:
+ * @key: the key to fill in
+ * @encrypt_key: the key schedule from AES_set_encrypt_key()
+ * @decrypt_key: the key schedule from AES_set_decrypt_key()
+ *
+ * Returns: false if the host has no AES instructions that QEMU can use,
+ * in which case the AES_*() functions must be used instead.
+ */
+bool qcrypto_aes_accel_init(QCryptoAESAccelKey *key,
+                            const AES_KEY *encrypt_key,
+                            const AES_KEY *decrypt_key);
+
+/*
+ * These work on @nblocks whole blocks.  The CBC functions leave the last
+ * ciphertext block in @iv, so that the next call continues the chain.
+ */
+void qcrypto_aes_accel_ecb_encrypt(const QCryptoAESAccelKey *key,
+                                   const uint8_t *in, uint8_t *out,
+                                   size_t nblocks);
+void qcrypto_aes_accel_ecb_decrypt(const QCryptoAESAccelKey *key,
+                                   const uint8_t *in, uint8_t *out,
+                                   size_t nblocks);
+void qcrypto_aes_accel_cbc_encrypt(const QCryptoAESAccelKey *key,
+                                   const uint8_t *in, uint8_t *out,
+                                   size_t nblocks, uint8_t *iv);
+void qcrypto_aes_accel_cbc_decrypt(const QCryptoAESAccelKey *key,
+                                   const uint8_t *in, uint8_t *out,
+                                   size_t nblocks, uint8_t *iv);
+
+#endif
@@ -291,6 +291,16 @@ struct RAMBlock {
     /* RCU-enabled, writes protected by the ramlist lock */
     QLIST_ENTRY(RAMBlock) next;
     int fd;
+    /* mapped-ram migration: where the block is in the file, and which of
+     * its pages are there rather than zero; used by the migration thread
+     */
+    unsigned long *file_bmap;
+    /* chunks of the block whose dirty log has not been cleared since the
+     * last bitmap sync, see migration_clear_memory_region_dirty_log()
+     */
+    unsigned long *clear_bmap;
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
 };
 
 static inline void *ramblock_ptr(RAMBlock *block, ram_addr_t offset)
@@ -323,6 +333,7 @@ extern RAMList ram_list;
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf);
 void dump_opcount_info(FILE *f, fprintf_function cpu_fprintf);
+void dump_tb_stats(FILE *f, fprintf_function cpu_fprintf, int count);
 ram_addr_t last_ram_offset(void);
 void qemu_mutex_lock_ramlist(void);
 void qemu_mutex_unlock_ramlist(void);
@@ -96,6 +96,12 @@ bool cpu_physical_memory_is_io(hwaddr phys_addr);
  */
 void qemu_flush_coalesced_mmio_buffer(void);
 
+/* While referenced, pending coalesced writes are also delivered
+ * periodically from the main loop.
+ */
+void qemu_coalesced_mmio_drain_ref(void);
+void qemu_coalesced_mmio_drain_unref(void);
+
 uint32_t ldub_phys(AddressSpace *as, hwaddr addr);
 uint32_t lduw_le_phys(AddressSpace *as, hwaddr addr);
 uint32_t lduw_be_phys(AddressSpace *as, hwaddr addr);
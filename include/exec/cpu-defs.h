@@ -98,6 +98,22 @@ typedef uint64_t target_ulong;
 
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
 
+/* TCG backends that define TCG_TARGET_IMPLEMENTS_DYN_TLB load the size of
+ * the TLB of each MMU mode from env instead of using CPU_TLB_SIZE, so that
+ * cputlb.c can resize it at flush time according to how much of it was in
+ * use.  These TLBs are allocated separately, which also lifts the limit
+ * that TCG_TARGET_TLB_DISPLACEMENT_BITS puts on their size.
+ */
+#ifndef TCG_TARGET_IMPLEMENTS_DYN_TLB
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB 0
+#endif
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+#define CPU_TLB_DYN_MIN_BITS 6
+#define CPU_TLB_DYN_DEFAULT_BITS 8
+#define CPU_TLB_DYN_MAX_BITS 16
+#endif
+
 typedef struct CPUTLBEntry {
     /* bit TARGET_LONG_BITS to TARGET_PAGE_BITS : virtual address
        bit TARGET_PAGE_BITS-1..4  : Nonzero for accesses that should not
@@ -130,12 +146,46 @@ typedef struct CPUIOTLBEntry {
     MemTxAttrs attrs;
 } CPUIOTLBEntry;
 
-#define CPU_COMMON_TLB \
-    /* The meaning of the MMU modes is defined in the target code. */   \
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* Use of a dynamically sized TLB, see tlb_mmu_resize() in cputlb.c.
+ * The window tracks the highest number of entries in use between flushes.
+ */
+typedef struct CPUTLBDesc {
+    int64_t window_begin_ns;
+    size_t window_max_entries;
+    size_t n_used_entries;
+} CPUTLBDesc;
+
+/* The dynamic TLB state is owned by CPUState::tlb_dyn, because the reset
+ * handlers of most targets clear env from its start up to some field; env
+ * only holds copies of @mask, @table and @iotlb for the generated code,
+ * which tlb_dyn_sync() restores after such a reset.
+ */
+typedef struct CPUTLBDyn {
+    CPUTLBDesc desc[NB_MMU_MODES];
+    uintptr_t mask[NB_MMU_MODES];
+    CPUTLBEntry *table[NB_MMU_MODES];
+    CPUIOTLBEntry *iotlb[NB_MMU_MODES];
+} CPUTLBDyn;
+
+#define CPU_COMMON_TLB_TABLES                                           \
+    /* (number of entries - 1) << CPU_TLB_ENTRY_BITS */                 \
+    uintptr_t tlb_mask[NB_MMU_MODES];                                   \
+    CPUTLBEntry *tlb_table[NB_MMU_MODES];                               \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    CPUIOTLBEntry *iotlb[NB_MMU_MODES];                                 \
+    CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];
+#else
+#define CPU_COMMON_TLB_TABLES                                           \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
     CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                    \
-    CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                 \
+    CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];
+#endif
+
+#define CPU_COMMON_TLB \
+    /* The meaning of the MMU modes is defined in the target code. */   \
+    CPU_COMMON_TLB_TABLES                                               \
     target_ulong tlb_flush_addr;                                        \
     target_ulong tlb_flush_mask;                                        \
     target_ulong vtlb_index;                                            \
@@ -28,6 +28,9 @@ void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
 void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length);
 void tlb_set_dirty(CPUArchState *env, target_ulong vaddr);
 extern int tlb_flush_count;
+extern uint64_t tlb_miss_count;
+extern uint64_t tlb_victim_hit_count;
+void tlb_dump_info(FILE *f, fprintf_function cpu_fprintf);
 
 /* exec.c */
 void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr);
@@ -71,6 +71,7 @@ typedef struct TranslationBlock TranslationBlock;
 #define OPPARAM_BUF_SIZE (OPC_BUF_SIZE * MAX_OPC_PARAM)
 
 #include "qemu/log.h"
+#include "qemu/rcu.h"
 
 void gen_intermediate_code(CPUArchState *env, struct TranslationBlock *tb);
 void gen_intermediate_code_pc(CPUArchState *env, struct TranslationBlock *tb);
@@ -96,8 +97,21 @@ bool qemu_in_vcpu_thread(void);
 void cpu_reload_memory_map(CPUState *cpu);
 void tcg_cpu_address_space_init(CPUState *cpu, AddressSpace *as);
 /* cputlb.c */
+void tlb_init(CPUState *cpu);
+void tlb_destroy(CPUState *cpu);
+void tlb_dyn_sync(CPUState *cpu);
 void tlb_flush_page(CPUState *cpu, target_ulong addr);
 void tlb_flush(CPUState *cpu, int flush_global);
+void tlb_flush_page_all_cpus(target_ulong addr);
+void tlb_flush_all_cpus(int flush_global);
+void tlb_flush_by_mmuidx(CPUState *cpu, uint16_t idxmap);
+void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr,
+                              uint16_t idxmap);
+void tlb_flush_range(CPUState *cpu, target_ulong addr, target_ulong len);
+void tlb_flush_range_by_mmuidx(CPUState *cpu, target_ulong addr,
+                               target_ulong len, uint16_t idxmap);
+void tlb_flush_by_mmuidx_all_cpus(uint16_t idxmap);
+void tlb_flush_page_by_mmuidx_all_cpus(target_ulong addr, uint16_t idxmap);
 void tlb_set_page(CPUState *cpu, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
@@ -115,12 +129,49 @@ static inline void tlb_flush_page(CPUState *cpu, target_ulong addr)
 static inline void tlb_flush(CPUState *cpu, int flush_global)
 {
 }
+
+static inline void tlb_flush_page_all_cpus(target_ulong addr)
+{
+}
+
+static inline void tlb_flush_all_cpus(int flush_global)
+{
+}
+
+static inline void tlb_flush_by_mmuidx(CPUState *cpu, uint16_t idxmap)
+{
+}
+
+static inline void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr,
+                                            uint16_t idxmap)
+{
+}
+
+static inline void tlb_flush_range(CPUState *cpu, target_ulong addr,
+                                   target_ulong len)
+{
+}
+
+static inline void tlb_flush_range_by_mmuidx(CPUState *cpu, target_ulong addr,
+                                             target_ulong len, uint16_t idxmap)
+{
+}
+
+static inline void tlb_flush_by_mmuidx_all_cpus(uint16_t idxmap)
+{
+}
+
+static inline void tlb_flush_page_by_mmuidx_all_cpus(target_ulong addr,
+                                                     uint16_t idxmap)
+{
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
+/* initial and maximum size of the physical TB hash table */
 #define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+#define CODE_GEN_PHYS_HASH_MAX_BITS 22
 
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
@@ -151,10 +202,13 @@ struct TranslationBlock {
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
+#define CF_INVALID     0x40000 /* Removed by tb_phys_invalidate() */
 
     void *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
+    /* next tb in the same bucket of the physical hash table; the table
+       picks one of the two, so that it can be rebuilt while readers
+       still walk the old one. */
+    struct TranslationBlock *phys_hash_next[2];
     /* first and second physical page containing code. The lower bit
        of the pointer tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
@@ -174,23 +228,40 @@ struct TranslationBlock {
        jmp_first */
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
+
+    /* with -tb-stats: number of times the TB was entered, and the time
+       it took to translate it */
+    uint64_t exec_count;
+    uint32_t gen_time_ns;
 };
 
 #include "exec/spinlock.h"
 
+typedef struct TBHashTable {
+    struct rcu_head rcu;
+    unsigned int bits;
+    int chain;          /* index into TranslationBlock.phys_hash_next */
+    TranslationBlock *buckets[];
+} TBHashTable;
+
 typedef struct TBContext TBContext;
 
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+    /* lookups only need rcu_read_lock(); changes take tb_lock */
+    TBHashTable *tb_phys_hash;
+    int nb_phys_hash;
+    bool tb_phys_hash_resizing;
     int nb_tbs;
     /* any access to the tbs or the page table must use this lock */
     spinlock_t tb_lock;
 
     /* statistics */
     int tb_flush_count;
+    int tb_region_evict_count;
     int tb_phys_invalidate_count;
+    int64_t tb_gen_time_ns;     /* with -tb-stats */
 
     int tb_invalidated_flag;
 };
@@ -336,6 +407,8 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr);
 
 /* vl.c */
 extern int singlestep;
+extern int tcg_perfmap;
+extern int tcg_tb_stats;
 
 /* cpu-exec.c */
 extern volatile sig_atomic_t exit_request;
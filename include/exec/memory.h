@@ -44,6 +44,7 @@
 
 typedef struct MemoryRegionOps MemoryRegionOps;
 typedef struct MemoryRegionMmio MemoryRegionMmio;
+typedef struct DirtyBitmapSnapshot DirtyBitmapSnapshot;
 
 struct MemoryRegionMmio {
     CPUReadMemoryFunc *read[3];
@@ -163,6 +164,7 @@ struct MemoryRegion {
     const MemoryRegionOps *ops;
     const MemoryRegionIOMMUOps *iommu_ops;
     void *opaque;
+    uint8_t direct_access_sizes;    /* bit N: 1 << N bytes need no adjusting */
     MemoryRegion *container;
     Int128 size;
     hwaddr addr;
@@ -179,10 +181,12 @@ struct MemoryRegion {
     bool rom_device;
     bool warning_printed; /* For reservations */
     bool flush_coalesced_mmio;
+    bool coalescing_drain;
     bool global_locking;
     uint8_t vga_logging_count;
     MemoryRegion *alias;
     hwaddr alias_offset;
+    unsigned alias_count;   /* number of aliases created to this region */
     int32_t priority;
     bool may_overlap;
     QTAILQ_HEAD(subregions, MemoryRegion) subregions;
@@ -212,6 +216,7 @@ struct MemoryListener {
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section,
                      int old, int new);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
+    void (*log_clear)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_global_start)(MemoryListener *listener);
     void (*log_global_stop)(MemoryListener *listener);
     void (*eventfd_add)(MemoryListener *listener, MemoryRegionSection *section,
@@ -239,6 +244,7 @@ struct AddressSpace {
 
     /* Accessed via RCU.  */
     struct FlatView *current_map;
+    bool current_map_changed;   /* by the transaction being committed */
 
     int ioeventfd_nb;
     struct MemoryRegionIoeventfd *ioeventfds;
@@ -712,6 +718,41 @@ void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
  */
 bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
                                         hwaddr size, unsigned client);
+
+/**
+ * memory_region_snapshot_and_clear_dirty: Get a snapshot of the dirty
+ *                                         bitmap and clear it.
+ *
+ * Creates a snapshot of the dirty bitmap for a range of the region, and
+ * clears the range in the global bitmap, a word at a time.  Display devices
+ * take one such snapshot per frame and look up each scanline in it with
+ * memory_region_snapshot_get_dirty(), rather than querying and resetting
+ * the global bitmap; pages written while the frame is drawn stay dirty for
+ * the next one.  The snapshot must be freed with g_free().
+ *
+ * @mr: the memory region being queried.
+ * @addr: the address (relative to the start of the region) being queried.
+ * @size: the size of the range being queried.
+ * @client: the user of the logging information; typically %DIRTY_MEMORY_VGA.
+ */
+DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
+                                                            hwaddr addr,
+                                                            hwaddr size,
+                                                            unsigned client);
+
+/**
+ * memory_region_snapshot_get_dirty: Check whether a range of bytes is dirty
+ *                                   in the specified dirty bitmap snapshot.
+ *
+ * @mr: the memory region being queried.
+ * @snap: the dirty bitmap snapshot, as taken of @mr.
+ * @addr: the address (relative to the start of the region) being queried;
+ *        the range must be within the one that the snapshot was taken of.
+ * @size: the size of the range being queried.
+ */
+bool memory_region_snapshot_get_dirty(MemoryRegion *mr,
+                                      DirtyBitmapSnapshot *snap,
+                                      hwaddr addr, hwaddr size);
 /**
  * memory_region_sync_dirty_bitmap: Synchronize a region's dirty bitmap with
  *                                  any external TLBs (e.g. kvm)
@@ -723,6 +764,26 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
  */
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr);
 
+/**
+ * memory_region_clear_dirty_log: Let accelerators forget the dirty state
+ *                                of a range
+ *
+ * Accelerators that support it (KVM with manual dirty log protection) keep
+ * reporting pages as dirty on every sync, and keep them writable, until
+ * they are told to clear them.  Pages that were written after the last
+ * sync are not affected.  Used by migration right before it sends a range,
+ * so that write protection is restored a bit at a time and only for the
+ * pages about to be sent.
+ *
+ * Can be called outside the iothread lock, within an RCU critical section.
+ *
+ * @mr: the region being cleared.
+ * @start: the start of the range, relative to the start of the region.
+ * @size: the size of the range.
+ */
+void memory_region_clear_dirty_log(MemoryRegion *mr, hwaddr start,
+                                   hwaddr size);
+
 /**
  * memory_region_reset_dirty: Mark a range of pages as clean, for a specified
  *                            client.
@@ -800,6 +861,21 @@ void memory_region_add_coalescing(MemoryRegion *mr,
  */
 void memory_region_clear_coalescing(MemoryRegion *mr);
 
+/**
+ * memory_region_set_coalescing_drain: Deliver coalesced writes to the region
+ *                                     in bounded time.
+ *
+ * Coalesced writes normally wait until some region with flushing enabled is
+ * accessed, which may not happen for a long time.  For doorbell-style
+ * registers, whose writes must reach the device even if the guest does
+ * nothing else, this makes the main loop drain the coalesced writes
+ * periodically, so that they are delivered in batches without a userspace
+ * exit each.  Undone by memory_region_clear_coalescing().
+ *
+ * @mr: the memory region to be updated.
+ */
+void memory_region_set_coalescing_drain(MemoryRegion *mr);
+
 /**
  * memory_region_set_flush_coalesced: Enforce memory coalescing flush before
  *                                    accesses.
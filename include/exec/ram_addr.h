@@ -34,12 +34,15 @@ ram_addr_t qemu_ram_alloc_resizeable(ram_addr_t size, ram_addr_t max_size,
                                                      void *host),
                                      MemoryRegion *mr, Error **errp);
 int qemu_get_ram_fd(ram_addr_t addr);
+bool qemu_ram_is_shared(RAMBlock *block);
 void *qemu_get_ram_block_host_ptr(ram_addr_t addr);
 void *qemu_get_ram_ptr(ram_addr_t addr);
 void qemu_ram_free(ram_addr_t addr);
 void qemu_ram_free_from_ptr(ram_addr_t addr);
 
 int qemu_ram_resize(ram_addr_t base, ram_addr_t newsize, Error **errp);
+int qemu_ram_map_private(RAMBlock *block, int fd, uint64_t fd_offset,
+                         Error **errp);
 
 #define DIRTY_CLIENTS_ALL     ((1 << DIRTY_MEMORY_NUM) - 1)
 #define DIRTY_CLIENTS_NOCODE  (DIRTY_CLIENTS_ALL & ~(1 << DIRTY_MEMORY_CODE))
@@ -138,6 +141,49 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
     xen_modified_memory(start, length);
 }
 
+/*
+ * Sets the dirty bits of up to 64 pages with a few word-sized atomic ORs
+ * per client: bit i of @bits stands for the target page at
+ * @start + i * TARGET_PAGE_SIZE.
+ */
+static inline void cpu_physical_memory_set_dirty_word(ram_addr_t start,
+                                                      uint64_t bits,
+                                                      uint8_t mask)
+{
+    unsigned long **d = ram_list.dirty_memory;
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    int first, last, i, client;
+
+    if (!bits) {
+        return;
+    }
+
+    for (i = 0; i < 64; i += BITS_PER_LONG) {
+        unsigned long w = bits >> i;
+        unsigned long idx = BIT_WORD(page + i);
+        unsigned int shift = (page + i) % BITS_PER_LONG;
+        unsigned long lo = w << shift;
+        unsigned long hi = shift ? w >> (BITS_PER_LONG - shift) : 0;
+
+        for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+            if (!(mask & (1 << client))) {
+                continue;
+            }
+            if (lo) {
+                atomic_or(&d[client][idx], lo);
+            }
+            if (hi) {
+                atomic_or(&d[client][idx + 1], hi);
+            }
+        }
+    }
+
+    first = ctz64(bits);
+    last = 63 - clz64(bits);
+    xen_modified_memory(start + ((ram_addr_t)first << TARGET_PAGE_BITS),
+                        (ram_addr_t)(last - first + 1) << TARGET_PAGE_BITS);
+}
+
 #if !defined(_WIN32)
 static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
                                                           ram_addr_t start,
@@ -198,6 +244,13 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
                                               ram_addr_t length,
                                               unsigned client);
 
+DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
+    (ram_addr_t start, ram_addr_t length, unsigned client);
+
+bool cpu_physical_memory_snapshot_get_dirty(DirtyBitmapSnapshot *snap,
+                                            ram_addr_t start,
+                                            ram_addr_t length);
+
 static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
                                                          ram_addr_t length)
 {
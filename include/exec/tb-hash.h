@@ -43,9 +43,20 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
            | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+/* The bucket is taken from the low bits, so mix everything into them. */
+static inline uint32_t tb_phys_hash_func(tb_page_addr_t phys_pc,
+                                         target_ulong pc, uint64_t flags)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t vpc = pc;
+    uint64_t h = (uint64_t)phys_pc ^ (vpc << 32 | vpc >> 32);
+
+    h ^= flags * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
 }
 
 #endif
@@ -60,6 +60,7 @@ int machine_kvm_shadow_mem(MachineState *machine);
 int machine_phandle_start(MachineState *machine);
 bool machine_dump_guest_core(MachineState *machine);
 bool machine_mem_merge(MachineState *machine);
+bool machine_numa_pin(MachineState *machine);
 
 /**
  * MachineClass:
@@ -134,6 +135,7 @@ struct MachineState {
     char *dt_compatible;
     bool dump_guest_core;
     bool mem_merge;
+    bool numa_pin;
     bool usb;
     bool usb_disabled;
     char *firmware;
@@ -1,6 +1,29 @@
 #ifndef HW_COMPAT_H
 #define HW_COMPAT_H
 
+#define HW_COMPAT_2_4 \
+        {\
+            .driver   = "tpm-tis",\
+            .property = "large-burst",\
+            .value    = "off",\
+        },{\
+            .driver   = "virtio-blk-device",\
+            .property = "discard",\
+            .value    = "off",\
+        },{\
+            .driver   = "virtio-blk-device",\
+            .property = "write-zeroes",\
+            .value    = "off",\
+        },{\
+            .driver   = "fw_cfg_mem",\
+            .property = "dma_enabled",\
+            .value    = "off",\
+        },{\
+            .driver   = "fw_cfg_io",\
+            .property = "dma_enabled",\
+            .value    = "off",\
+        },
+
 #define HW_COMPAT_2_3 \
         {\
             .driver   = "virtio-blk-pci",\
@@ -19,17 +19,26 @@ typedef enum VhostBackendType {
 } VhostBackendType;
 
 struct vhost_dev;
+struct vhost_memory;
 
 typedef int (*vhost_call)(struct vhost_dev *dev, unsigned long int request,
              void *arg);
 typedef int (*vhost_backend_init)(struct vhost_dev *dev, void *opaque);
 typedef int (*vhost_backend_cleanup)(struct vhost_dev *dev);
+typedef int (*vhost_backend_set_vring_enable)(struct vhost_dev *dev,
+                                              int enable);
+/* Sends the changes from @old_mem to dev->mem; -ENOTSUP makes the caller
+ * send the whole table instead */
+typedef int (*vhost_backend_update_mem_table)(struct vhost_dev *dev,
+                                              struct vhost_memory *old_mem);
 
 typedef struct VhostOps {
     VhostBackendType backend_type;
     vhost_call vhost_call;
     vhost_backend_init vhost_backend_init;
     vhost_backend_cleanup vhost_backend_cleanup;
+    vhost_backend_set_vring_enable vhost_backend_set_vring_enable;
+    vhost_backend_update_mem_table vhost_backend_update_mem_table;
 } VhostOps;
 
 extern const VhostOps user_ops;
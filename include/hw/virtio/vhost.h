@@ -38,6 +38,8 @@ struct vhost_memory;
 struct vhost_dev {
     MemoryListener memory_listener;
     struct vhost_memory *mem;
+    /* the table the backend has, sorted like mem; NULL if unknown */
+    struct vhost_memory *mem_sent;
     int n_mem_sections;
     MemoryRegionSection *mem_sections;
     struct vhost_virtqueue *vqs;
@@ -47,6 +49,9 @@ struct vhost_dev {
     unsigned long long features;
     unsigned long long acked_features;
     unsigned long long backend_features;
+    /* vhost-user protocol extensions agreed on with the slave */
+    uint64_t protocol_features;
+    uint64_t max_queues;
     bool started;
     bool log_enabled;
     unsigned long long log_size;
@@ -39,6 +39,11 @@ struct VirtIOBlkConf
     uint32_t config_wce;
     uint32_t data_plane;
     uint32_t request_merging;
+    uint16_t num_queues;
+    uint32_t discard;
+    uint32_t write_zeroes;
+    uint32_t max_discard_sectors;
+    uint32_t max_write_zeroes_sectors;
 };
 
 struct VirtIOBlockDataPlane;
@@ -47,10 +52,10 @@ struct VirtIOBlockReq;
 typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
-    VirtQueue *vq;
     void *rq;
     QEMUBH *bh;
     VirtIOBlkConf conf;
+    size_t config_size;
     unsigned short sector_mask;
     bool original_wce;
     VMChangeStateEntry *change;
@@ -58,12 +63,13 @@ typedef struct VirtIOBlock {
     void (*complete_request)(struct VirtIOBlockReq *req, unsigned char status);
     Notifier migration_state_notifier;
     struct VirtIOBlockDataPlane *dataplane;
+    VirtIOReqPool *req_pool;
 } VirtIOBlock;
 
 typedef struct VirtIOBlockReq {
     int64_t sector_num;
     VirtIOBlock *dev;
-    VirtQueueElement elem;
+    VirtQueue *vq;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr out;
     QEMUIOVector qiov;
@@ -71,17 +77,22 @@ typedef struct VirtIOBlockReq {
     struct VirtIOBlockReq *next;
     struct VirtIOBlockReq *mr_next;
     BlockAcctCookie acct;
+    /* last, so that the fields above share the first cache lines */
+    VirtQueueElement elem;
 } VirtIOBlockReq;
 
 #define VIRTIO_BLK_MAX_MERGE_REQS 32
 
+/* ranges in one discard or write zeroes request */
+#define VIRTIO_BLK_MAX_DWZ_SEGS 32
+
 typedef struct MultiReqBuffer {
     VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
     unsigned int num_reqs;
     bool is_write;
 } MultiReqBuffer;
 
-VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s);
+VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s, VirtQueue *vq);
 
 void virtio_blk_free_request(VirtIOBlockReq *req);
 
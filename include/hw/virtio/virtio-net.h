@@ -16,6 +16,7 @@
 
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -40,6 +41,11 @@ typedef struct virtio_net_conf
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 << 10))
 
+/* Receive-side scaling limits, see VIRTIO_NET_F_RSS.  A 40 byte key covers
+ * the 36 bytes of addresses and ports that are hashed for TCP over IPv6. */
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE     40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN    128
+
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
@@ -65,7 +71,7 @@ typedef struct VirtIONet {
     uint32_t has_vnet_hdr;
     size_t host_hdr_len;
     size_t guest_hdr_len;
-    uint32_t host_features;
+    uint64_t host_features;
     uint8_t has_ufo;
     int mergeable_rx_bufs;
     uint8_t promisc;
@@ -75,12 +81,15 @@ typedef struct VirtIONet {
     uint8_t nouni;
     uint8_t nobcast;
     uint8_t vhost_started;
+    bool host_rx_filter;
     struct {
         uint32_t in_use;
         uint32_t first_multi;
         uint8_t multi_overflow;
         uint8_t uni_overflow;
         uint8_t *macs;
+        /* open addressing over macs: entry index + 1, or 0 if free */
+        uint8_t *hash;
     } mac_table;
     uint32_t *vlans;
     virtio_net_conf net_conf;
@@ -95,6 +104,20 @@ typedef struct VirtIONet {
     uint64_t curr_guest_offloads;
     QEMUTimer *announce_timer;
     int announce_counter;
+    struct {
+        bool enabled;
+        uint32_t hash_types;
+        uint16_t default_queue;
+        uint16_t indirections_len;
+        uint16_t indirections[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+        uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    } rss_data;
+    /* With an iothread, the rx and tx queues are processed there while the
+     * driver is running, together with the netdev */
+    IOThread *iothread;
+    AioContext *ctx;
+    bool dataplane_started;
+    bool dataplane_disabled;
 } VirtIONet;
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
@@ -54,17 +54,36 @@ struct VirtIOSCSIConf {
     char *wwpn;
     uint32_t boot_tpgt;
     IOThread *iothread;
+    /* more IOThreads to spread the command queues and LUNs over */
+    uint32_t num_iothreads;
+    char **iothread_ids;
 };
 
 struct VirtIOSCSI;
+struct VirtIOSCSIReq;
 
 typedef struct {
     struct VirtIOSCSI *parent;
     Vring vring;
+    AioContext *ctx;            /* where the host notifier is handled */
+    QemuMutex lock;             /* serializes vring_pop and vring_push */
     EventNotifier host_notifier;
     EventNotifier guest_notifier;
 } VirtIOSCSIVring;
 
+/* One of the IOThreads of a dataplane device. Command requests for a LUN
+ * that lives in another IOThread are queued here, then prepared and
+ * submitted by @bh in @ctx.
+ */
+typedef struct {
+    struct VirtIOSCSI *parent;
+    IOThread *iothread;
+    AioContext *ctx;
+    QEMUBH *bh;
+    QemuMutex lock;             /* protects @reqs */
+    QTAILQ_HEAD(, VirtIOSCSIReq) reqs;
+} VirtIOSCSIContext;
+
 typedef struct VirtIOSCSICommon {
     VirtIODevice parent_obj;
     VirtIOSCSIConf conf;
@@ -82,9 +101,19 @@ typedef struct VirtIOSCSI {
     SCSIBus bus;
     int resetting;
     bool events_dropped;
+    VirtIOReqPool *req_pool;    /* of VirtIOSCSIReq with the largest CDB */
 
     /* Fields for dataplane below */
-    AioContext *ctx; /* one iothread per virtio-scsi-pci for now */
+    AioContext *ctx; /* of the first iothread, for the ctrl and event vqs */
+    VirtIOSCSIContext *ctxs;
+    unsigned nr_ctxs;
+    unsigned next_ctx;          /* for LUNs without an iothread of their own */
+
+    /* With several iothreads, control requests are handled in the main
+     * loop, the only place that takes more than one of their locks. */
+    QEMUBH *ctrl_bh;
+    QemuMutex ctrl_lock;        /* protects @ctrl_reqs */
+    QTAILQ_HEAD(, VirtIOSCSIReq) ctrl_reqs;
 
     /* Vring is used instead of vq in dataplane code, because of the underlying
      * memory layer thread safety */
@@ -156,7 +185,12 @@ void virtio_scsi_free_req(VirtIOSCSIReq *req);
 void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
                             uint32_t event, uint32_t reason);
 
-void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread);
+AioContext *virtio_scsi_cmd_req_ctx(VirtIOSCSI *s, VirtIOSCSIReq *req);
+
+void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread, Error **errp);
+void virtio_scsi_clear_iothreads(VirtIOSCSI *s);
+VirtIOSCSIContext *virtio_scsi_find_ctx(VirtIOSCSI *s, AioContext *ctx);
+AioContext *virtio_scsi_lun_ctx(VirtIOSCSI *s, SCSIDevice *sd, Error **errp);
 void virtio_scsi_dataplane_start(VirtIOSCSI *s);
 void virtio_scsi_dataplane_stop(VirtIOSCSI *s);
 void virtio_scsi_vring_push_notify(VirtIOSCSIReq *req);
@@ -73,11 +73,13 @@ typedef struct VirtIOSerialPortClass {
 
     /*
      * Guest wrote some data to the port. This data is handed over to
-     * the app via this callback.  The app can return a size less than
-     * 'len'.  In this case, throttling will be enabled for this port.
+     * the app via this callback, all of a guest buffer at once.  The
+     * app can return a size less than the size of 'iov'.  In this case,
+     * it should enable throttling for this port, and the rest of the
+     * data is handed over again once the port is unthrottled.
      */
-    ssize_t (*have_data)(VirtIOSerialPort *port, const uint8_t *buf,
-                         ssize_t len);
+    ssize_t (*have_data)(VirtIOSerialPort *port, const struct iovec *iov,
+                         int iovcnt);
 } VirtIOSerialPortClass;
 
 /*
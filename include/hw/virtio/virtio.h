@@ -91,6 +91,8 @@ struct VirtIODevice
     char *bus_name;
     uint8_t device_endian;
     QLIST_HEAD(, VirtQueue) *vector_queues;
+    /* drops the vring mappings when the memory map changes */
+    MemoryListener listener;
 };
 
 typedef struct VirtioDeviceClass {
@@ -146,11 +148,36 @@ void virtio_del_queue(VirtIODevice *vdev, int n);
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len);
 void virtqueue_flush(VirtQueue *vq, unsigned int count);
+/*
+ * Completes @elem like virtqueue_push() followed by virtio_notify(), except
+ * that the used index and the notification wait for a bottom half, or for
+ * virtqueue_flush_deferred(), so that elements completed together are
+ * published at once.  Do not mix with virtqueue_fill() on the same queue.
+ */
+void virtqueue_push_deferred(VirtQueue *vq, const VirtQueueElement *elem,
+                             unsigned int len);
+/*
+ * The same for elements completed together, e.g. the buffers of a
+ * mergeable packet: fill them with @idx counting from 0, then hand all of
+ * them to virtqueue_flush_later().
+ */
+void virtqueue_fill_deferred(VirtQueue *vq, const VirtQueueElement *elem,
+                             unsigned int len, unsigned int idx);
+void virtqueue_flush_later(VirtQueue *vq, unsigned int count);
+/*
+ * Gives back the last @count elements popped and filled with
+ * virtqueue_fill_deferred(), as long as they were not flushed: the guest
+ * sees their buffers as available again.  Split rings only.
+ */
+void virtqueue_unpop_deferred(VirtQueue *vq, unsigned int count);
+void virtqueue_flush_deferred(VirtQueue *vq);
 void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
                        unsigned int len);
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx);
 
+void virtqueue_element_copy(VirtQueueElement *dst,
+                            const VirtQueueElement *src);
 void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     size_t num_sg, int is_write);
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem);
@@ -162,6 +189,18 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq);
 
+/*
+ * Pool of device requests, which embed a VirtQueueElement.  Freed requests
+ * are kept for reuse instead of going back to malloc, and each one starts on
+ * a cache line.  The pool can be used from several threads.
+ */
+typedef struct VirtIOReqPool VirtIOReqPool;
+
+VirtIOReqPool *virtio_req_pool_new(size_t size);
+void virtio_req_pool_free(VirtIOReqPool *pool);
+void *virtio_req_pool_get(VirtIOReqPool *pool);
+void virtio_req_pool_put(VirtIOReqPool *pool, void *req);
+
 void virtio_save(VirtIODevice *vdev, QEMUFile *f);
 
 int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id);
@@ -169,6 +208,7 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id);
 void virtio_notify_config(VirtIODevice *vdev);
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable);
+int virtio_queue_get_notification(VirtQueue *vq);
 
 int virtio_queue_ready(VirtQueue *vq);
 
@@ -224,7 +264,9 @@ typedef struct VirtIORNGConf VirtIORNGConf;
     DEFINE_PROP_BIT64("notify_on_empty", _state, _field,  \
                       VIRTIO_F_NOTIFY_ON_EMPTY, true), \
     DEFINE_PROP_BIT64("any_layout", _state, _field, \
-                      VIRTIO_F_ANY_LAYOUT, true)
+                      VIRTIO_F_ANY_LAYOUT, true), \
+    DEFINE_PROP_BIT64("packed", _state, _field, \
+                      VIRTIO_F_RING_PACKED, false)
 
 hwaddr virtio_queue_get_desc_addr(VirtIODevice *vdev, int n);
 hwaddr virtio_queue_get_avail_addr(VirtIODevice *vdev, int n);
@@ -234,8 +276,10 @@ hwaddr virtio_queue_get_desc_size(VirtIODevice *vdev, int n);
 hwaddr virtio_queue_get_avail_size(VirtIODevice *vdev, int n);
 hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n);
 hwaddr virtio_queue_get_ring_size(VirtIODevice *vdev, int n);
-uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n);
-void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx);
+unsigned int virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n);
+void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n,
+                                     unsigned int idx);
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n);
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n);
 VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n);
 uint16_t virtio_get_queue_index(VirtQueue *vq);
@@ -246,6 +290,16 @@ void virtio_queue_set_guest_notifier_fd_handler(VirtQueue *vq, bool assign,
 EventNotifier *virtio_queue_get_host_notifier(VirtQueue *vq);
 void virtio_queue_set_host_notifier_fd_handler(VirtQueue *vq, bool assign,
                                                bool set_handler);
+void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq,
+                                                AioContext *ctx,
+                                                bool assign, bool set_handler);
+/*
+ * Moves the completion bottom half of @vq to @ctx, and makes
+ * virtio_notify() signal the guest notifier instead of raising the
+ * interrupt itself; NULL goes back to the main loop.  Guest notifiers must
+ * be set up while a context is set.
+ */
+void virtio_queue_set_aio_context(VirtQueue *vq, AioContext *ctx);
 void virtio_queue_notify_vq(VirtQueue *vq);
 void virtio_irq(VirtQueue *vq);
 VirtQueue *virtio_vector_first_queue(VirtIODevice *vdev, uint16_t vector);
@@ -35,6 +35,7 @@
 #define QEMU_VM_SUBSECTION           0x05
 #define QEMU_VM_VMDESCRIPTION        0x06
 #define QEMU_VM_CONFIGURATION        0x07
+#define QEMU_VM_COMMAND              0x08
 #define QEMU_VM_SECTION_FOOTER       0x7e
 
 struct MigrationParams {
@@ -44,19 +45,53 @@ struct MigrationParams {
 
 typedef struct MigrationState MigrationState;
 
+/* Messages sent on the return path from destination to source */
+enum mig_rp_message_type {
+    MIG_RP_MSG_INVALID = 0,  /* Must be 0 */
+    MIG_RP_MSG_SHUT,         /* sibling will not send any more RP messages */
+    MIG_RP_MSG_REQ_PAGES_ID, /* data (start: be64, len: be32, id: string) */
+    MIG_RP_MSG_REQ_PAGES,    /* data (start: be64, len: be32) */
+
+    MIG_RP_MSG_MAX
+};
+
 typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntry_Head;
 
+/* The incoming postcopy states */
+typedef enum {
+    POSTCOPY_INCOMING_NONE = 0,  /* Initial state - no postcopy */
+    POSTCOPY_INCOMING_ADVISE,
+    POSTCOPY_INCOMING_LISTENING,
+    POSTCOPY_INCOMING_RUNNING,
+    POSTCOPY_INCOMING_END
+} PostcopyState;
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *file;
 
     /* See savevm.c */
     LoadStateEntry_Head loadvm_handlers;
+
+    /* to the source; written from the fault and listen threads */
+    QEMUFile *to_src_file;
+    QemuMutex rp_mutex;
+
+    /* See postcopy-ram.c */
+    bool have_fault_thread;
+    QemuThread fault_thread;
+    int userfault_fd;
+    /* written to stop the fault thread */
+    int userfault_quit_fd;
+    QemuThread listen_thread;
+    void *postcopy_tmp_page;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
 MigrationIncomingState *migration_incoming_state_new(QEMUFile *f);
 void migration_incoming_state_destroy(void);
+int migration_incoming_start_vm(void);
+void migration_incoming_postcopy_complete(void);
 
 struct MigrationState
 {
@@ -80,6 +115,19 @@ struct MigrationState
     int64_t xbzrle_cache_size;
     int64_t setup_time;
     int64_t dirty_sync_count;
+
+    /* where to open the multifd connections to; NULL if not over tcp */
+    char *multifd_address;
+
+    /* the destination's page requests in postcopy */
+    struct {
+        QEMUFile *from_dst_file;
+        QemuThread rp_thread;
+        bool error;
+    } rp_state;
+
+    /* set by migrate-start-postcopy */
+    bool start_postcopy;
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -96,6 +144,15 @@ void tcp_start_incoming_migration(const char *host_port, Error **errp);
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp);
 
+/* Most connections a multifd migration may have besides the main one */
+#define MULTIFD_MAX_CHANNELS 64
+
+int tcp_multifd_connect(MigrationState *s, Error **errp);
+
+int tcp_multifd_accept(Error **errp);
+
+void tcp_multifd_close_listener(void);
+
 void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
@@ -104,6 +161,13 @@ void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *path, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp);
+
+int file_migration_open(bool writable, bool direct, Error **errp);
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
@@ -119,16 +183,24 @@ void remove_migration_state_change_notifier(Notifier *notify);
 bool migration_in_setup(MigrationState *);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
+bool migration_in_postcopy(MigrationState *);
 MigrationState *migrate_get_current(void);
 
 void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
+void migrate_multifd_save_shutdown(void);
+void migrate_multifd_save_cleanup(void);
+void migrate_multifd_load_cleanup(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
 void free_xbzrle_decoded_buf(void);
+bool ram_first_pass_done(void);
+int ram_save_queue_pages(const char *rbname, ram_addr_t start,
+                         ram_addr_t len);
+int ram_postcopy_send_discard_bitmap(MigrationState *ms);
 
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
 
@@ -141,6 +213,11 @@ uint64_t norm_mig_pages_transferred(void);
 uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
+uint64_t xbzrle_mig_overflow_pages(void);
+int64_t dirty_sync_log_time(void);
+int64_t dirty_sync_merge_time(void);
+uint64_t redirtied_mig_pages(void);
+uint64_t hot_mig_pages(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
 
@@ -168,6 +245,18 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 
+bool compress_method_supported(MigrationCompressMethod method);
+size_t compress_bound(MigrationCompressMethod method, size_t size);
+size_t compress_bound_max(size_t size);
+CompressContext *compress_context_new(void);
+void compress_context_free(CompressContext *ctx);
+ssize_t compress_buffer(CompressContext *ctx, MigrationCompressMethod method,
+                        int level, uint8_t *dst, size_t dst_size,
+                        const uint8_t *src, size_t size);
+ssize_t decompress_buffer(CompressContext *ctx, MigrationCompressMethod method,
+                          uint8_t *dst, size_t dst_size,
+                          const uint8_t *src, size_t size);
+
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
 
@@ -175,9 +264,25 @@ int64_t xbzrle_cache_resize(int64_t new_size);
 
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
+MigrationCompressMethod migrate_compress_method(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
+bool migrate_use_multifd(void);
+bool migrate_use_zerocopy(void);
+bool migrate_use_recv_readahead(void);
+bool migrate_use_mapped_ram(void);
+bool migrate_use_mapped_ram_cow(void);
+bool migrate_use_ignore_shared(void);
+bool migrate_use_live_vmstate(void);
+int migrate_cpu_throttle_initial(void);
+int migrate_cpu_throttle_increment(void);
+int migrate_multifd_channels(void);
+bool migrate_postcopy_ram(void);
+
+void migrate_send_rp_shut(MigrationIncomingState *mis, uint32_t value);
+void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                               ram_addr_t start, size_t len);
 
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_after_iterate(QEMUFile *f, uint64_t flags);
@@ -198,6 +303,8 @@ size_t ram_control_save_page(QEMUFile *f, ram_addr_t block_offset,
                              uint64_t *bytes_sent);
 
 void ram_mig_init(void);
+void live_vmstate_mig_init(void);
+void live_vmstate_cleanup(void);
 void savevm_skip_section_footers(void);
 void register_global_state(void);
 void global_state_set_optional(void);
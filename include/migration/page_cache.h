@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is base on a hash of the page address, and set associative
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -72,6 +72,17 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age);
 
+/**
+ * cache_mark_overflow: note that XBZRLE could not encode the cached page,
+ * which makes it the first to be replaced in its set
+ *
+ * Returns %true if the page had not overflowed since it was cached
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page address
+ */
+bool cache_mark_overflow(PageCache *cache, uint64_t addr);
+
 /**
  * cache_resize: resize the page cache. In case of size reduction the extra
  * pages will be freed
@@ -0,0 +1,54 @@
+/*
+ * Postcopy migration for RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_POSTCOPY_RAM_H
+#define QEMU_POSTCOPY_RAM_H
+
+#include "migration/migration.h"
+
+/* Return true if the host supports everything we need to do postcopy-ram */
+bool postcopy_ram_supported_by_host(void);
+
+/*
+ * Check that RAM can be postcopied and prepare it, after it was advised
+ * that it may be.
+ */
+int postcopy_ram_incoming_init(MigrationIncomingState *mis);
+
+/*
+ * Make the missing pages of RAM fault, and request each faulting page
+ * from the source on the return path.
+ */
+int postcopy_ram_enable_notify(MigrationIncomingState *mis);
+
+/* Undo postcopy_ram_incoming_init and postcopy_ram_enable_notify */
+void postcopy_ram_incoming_cleanup(MigrationIncomingState *mis);
+
+/*
+ * Drop the destination's copy of @length bytes at @start of a RAM block,
+ * which is out of date.
+ */
+int postcopy_ram_discard_range(MigrationIncomingState *mis,
+                               const char *block_name,
+                               uint64_t start, uint64_t length);
+
+/*
+ * Place the page at @from at @host atomically, waking up the threads
+ * that wait for it.
+ */
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from);
+
+/* Like postcopy_place_page, for a page full of zeroes */
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host);
+
+/* A page to assemble the contents of a page in before placing it */
+void *postcopy_get_tmp_page(MigrationIncomingState *mis);
+
+PostcopyState postcopy_state_get(void);
+void postcopy_state_set(PostcopyState state);
+
+#endif
@@ -96,6 +96,38 @@ typedef size_t (QEMURamSaveFunc)(QEMUFile *f, void *opaque,
  */
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
 
+/*
+ * Return a QEMUFile for comms in the opposite direction
+ */
+typedef QEMUFile *(QEMUFileGetReturnPathFunc)(void *opaque);
+
+/*
+ * Make writev_buffer send from the buffers it is passed instead of
+ * copying them, so that they stay in use after it returned.
+ * Returns 0 on success, -err if the transport cannot do it
+ */
+typedef int (QEMUFileSetZerocopyFunc)(void *opaque, bool enable);
+
+/*
+ * Wait until the buffers of all the data written from before stream
+ * position 'pos' are no longer in use.
+ * Returns 0 on success, -err if a write failed
+ */
+typedef int (QEMUFileZerocopyWaitFunc)(void *opaque, int64_t pos);
+
+/*
+ * Have a thread of the transport read ahead of get_buffer, so that the
+ * network reads overlap with the parsing of what has arrived.
+ * Returns 0 on success, -err if the transport cannot do it
+ */
+typedef int (QEMUFileStartReadaheadFunc)(void *opaque);
+
+/*
+ * Move the offset of the underlying file as lseek() does.
+ * Returns the new offset, or -err if the file cannot seek
+ */
+typedef int64_t (QEMUFileSeekFunc)(void *opaque, int64_t offset, int whence);
+
 typedef struct QEMUFileOps {
     QEMUFilePutBufferFunc *put_buffer;
     QEMUFileGetBufferFunc *get_buffer;
@@ -107,6 +139,11 @@ typedef struct QEMUFileOps {
     QEMURamHookFunc *hook_ram_load;
     QEMURamSaveFunc *save_page;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFileGetReturnPathFunc *get_return_path;
+    QEMUFileSetZerocopyFunc *set_zerocopy;
+    QEMUFileZerocopyWaitFunc *zerocopy_wait;
+    QEMUFileStartReadaheadFunc *start_readahead;
+    QEMUFileSeekFunc *seek;
 } QEMUFileOps;
 
 struct QEMUSizedBuffer {
@@ -123,6 +160,10 @@ QEMUFile *qemu_fopen_socket(int fd, const char *mode);
 QEMUFile *qemu_popen_cmd(const char *command, const char *mode);
 QEMUFile *qemu_bufopen(const char *mode, QEMUSizedBuffer *input);
 int qemu_get_fd(QEMUFile *f);
+int qemu_file_set_zerocopy(QEMUFile *f, bool enable);
+int qemu_file_start_readahead(QEMUFile *f);
+int64_t qemu_file_get_offset(QEMUFile *f);
+int qemu_file_set_offset(QEMUFile *f, int64_t offset);
 int qemu_fclose(QEMUFile *f);
 int64_t qemu_ftell(QEMUFile *f);
 int64_t qemu_ftell_fast(QEMUFile *f);
@@ -163,8 +204,9 @@ void qemu_put_be32(QEMUFile *f, unsigned int v);
 void qemu_put_be64(QEMUFile *f, uint64_t v);
 int qemu_peek_buffer(QEMUFile *f, uint8_t **buf, int size, size_t offset);
 int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size);
-ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level);
+ssize_t qemu_put_compression_data(QEMUFile *f, CompressContext *ctx,
+                                  const uint8_t *p, size_t size,
+                                  int method, int level);
 int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src);
 /*
  * Note that you can only peek continuous bytes from where the current pointer
@@ -189,11 +231,13 @@ uint64_t qemu_get_be64(QEMUFile *f);
 
 int qemu_file_rate_limit(QEMUFile *f);
 void qemu_file_reset_rate_limit(QEMUFile *f);
+void qemu_file_credit_transfer(QEMUFile *f, size_t size);
 void qemu_file_set_rate_limit(QEMUFile *f, int64_t new_rate);
 int64_t qemu_file_get_rate_limit(QEMUFile *f);
 int qemu_file_get_error(QEMUFile *f);
 void qemu_file_set_error(QEMUFile *f, int ret);
 int qemu_file_shutdown(QEMUFile *f);
+QEMUFile *qemu_file_get_return_path(QEMUFile *f);
 void qemu_fflush(QEMUFile *f);
 
 static inline void qemu_put_be64s(QEMUFile *f, const uint64_t *pv)
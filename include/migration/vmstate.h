@@ -52,6 +52,11 @@ typedef struct SaveVMHandlers {
      */
     int (*save_live_iterate)(QEMUFile *f, void *opaque);
 
+    /* This runs inside the iothread lock, once the destination runs
+     * the VM.  Without it, save_live_complete is called before.
+     */
+    int (*save_live_complete_postcopy)(QEMUFile *f, void *opaque);
+
     /* This runs outside the iothread lock!  */
     int (*save_live_setup)(QEMUFile *f, void *opaque);
     uint64_t (*save_live_pending)(QEMUFile *f, void *opaque, uint64_t max_size);
@@ -100,6 +105,7 @@ enum VMStateFlags {
     VMS_VARRAY_UINT32    = 0x800,  /* Array with size in uint32_t field*/
     VMS_MUST_EXIST       = 0x1000, /* Field must exist in input */
     VMS_ALLOC            = 0x2000, /* Alloc a buffer on the destination */
+    VMS_LIVE             = 0x4000, /* Buffer may be sent while the VM runs */
 };
 
 typedef struct {
@@ -775,6 +781,17 @@ extern const VMStateInfo vmstate_info_bitmap;
 #define VMSTATE_BUFFER(_f, _s)                                        \
     VMSTATE_BUFFER_V(_f, _s, 0)
 
+/* A buffer that the live-vmstate capability sends while the VM still runs,
+ * and again only in the parts that changed once it stops.
+ */
+#define VMSTATE_BUFFER_LIVE(_f, _s) {                                 \
+    .name       = (stringify(_f)),                                    \
+    .size       = sizeof(typeof_field(_s, _f)),                       \
+    .info       = &vmstate_info_buffer,                               \
+    .flags      = VMS_BUFFER | VMS_LIVE,                              \
+    .offset     = vmstate_offset_buffer(_s, _f),                      \
+}
+
 #define VMSTATE_PARTIAL_BUFFER(_f, _s, _size)                         \
     VMSTATE_STATIC_BUFFER(_f, _s, 0, NULL, 0, _size)
 
@@ -819,6 +836,20 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
 
 bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque);
 
+typedef void VMStateLiveFunc(const char *name, void *ptr, size_t size,
+                             void *opaque);
+
+/* Calls @func for each VMSTATE_BUFFER_LIVE field of @vmsd, including those
+ * of the structs it embeds, with the field named by its path like "a/b".
+ */
+void vmstate_foreach_live_field(const VMStateDescription *vmsd, void *opaque,
+                                VMStateLiveFunc *func, void *func_opaque);
+/* The live buffer at @ptr is part of the live device state of the current
+ * migration, so that saving and loading the device leaves it out.
+ */
+void vmstate_live_mark(void *ptr, bool live);
+void vmstate_live_reset(void);
+
 int vmstate_register_with_alias_id(DeviceState *dev, int instance_id,
                                    const VMStateDescription *vmsd,
                                    void *base, int alias_id,
@@ -39,6 +39,17 @@ net_raw_checksum(uint8_t *data, int length)
     return net_checksum_finish(net_checksum_add(length, data));
 }
 
+/**
+ * net_checksum_add_copy: copy and checksum in a single pass
+ *
+ * @dest: destination buffer, must not overlap @src
+ * @src: data to be copied and checksummed
+ * @len: length of @src
+ *
+ * Returns the same partial sum as net_checksum_add(@len, @src).
+ */
+uint32_t net_checksum_add_copy(void *dest, const void *src, int len);
+
 /**
  * net_checksum_add_iov: scatter-gather vector checksumming
  *
@@ -51,4 +62,13 @@ uint32_t net_checksum_add_iov(const struct iovec *iov,
                               const unsigned int iov_cnt,
                               uint32_t iov_off, uint32_t size);
 
+/**
+ * net_toeplitz_hash: Toeplitz hash, as used by receive-side scaling
+ *
+ * @key: secret key, at least @len + 4 bytes long
+ * @input: the header fields to hash, in network byte order
+ * @len: length of @input
+ */
+uint32_t net_toeplitz_hash(const uint8_t *key, const uint8_t *input, int len);
+
 #endif /* QEMU_NET_CHECKSUM_H */
@@ -14,8 +14,7 @@
 #ifndef QEMU_JSON_LEXER_H
 #define QEMU_JSON_LEXER_H
 
-#include "qapi/qmp/qstring.h"
-#include "qapi/qmp/qlist.h"
+#include "glib-compat.h"
 
 typedef enum json_token_type {
     JSON_OPERATOR = 100,
@@ -28,15 +27,25 @@ typedef enum json_token_type {
     JSON_ERROR,
 } JSONTokenType;
 
+/* A token as collected by the JSONMessageParser, in one allocation */
+typedef struct JSONToken {
+    JSONTokenType type;
+    int x;
+    int y;
+    char str[];
+} JSONToken;
+
 typedef struct JSONLexer JSONLexer;
 
-typedef void (JSONLexerEmitter)(JSONLexer *, QString *, JSONTokenType, int x, int y);
+/* @token is reused for the next token once the emitter returns */
+typedef void (JSONLexerEmitter)(JSONLexer *, GString *token,
+                                JSONTokenType, int x, int y);
 
 struct JSONLexer
 {
     JSONLexerEmitter *emit;
     int state;
-    QString *token;
+    GString *token;
     int x, y;
 };
 
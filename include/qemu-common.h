@@ -426,15 +426,24 @@ ssize_t qemu_co_send_recv(int sockfd, void *buf, size_t bytes, bool do_send);
 #define qemu_co_send(sockfd, buf, bytes) \
   qemu_co_send_recv(sockfd, buf, bytes, true)
 
+/* Vectors of up to this many elements are kept in the QEMUIOVector */
+#define QEMU_IOVEC_INLINE 4
+
+/*
+ * iov may point to inline_iov, so a QEMUIOVector must not be copied or
+ * moved once it has been initialized.
+ */
 typedef struct QEMUIOVector {
     struct iovec *iov;
     int niov;
     int nalloc;
     size_t size;
+    struct iovec inline_iov[QEMU_IOVEC_INLINE];
 } QEMUIOVector;
 
 void qemu_iovec_init(QEMUIOVector *qiov, int alloc_hint);
 void qemu_iovec_init_external(QEMUIOVector *qiov, struct iovec *iov, int niov);
+void qemu_iovec_init_buf(QEMUIOVector *qiov, void *buf, size_t len);
 void qemu_iovec_add(QEMUIOVector *qiov, void *base, size_t len);
 void qemu_iovec_concat(QEMUIOVector *dst,
                        QEMUIOVector *src, size_t soffset, size_t sbytes);
@@ -575,6 +584,14 @@ void qemu_hexdump(const char *buf, FILE *fp, const char *prefix, size_t size);
 #define SPLAT(p)       _mm_set1_epi8(*(p))
 #define ALL_EQ(v1, v2) (_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) == 0xFFFF)
 #define VEC_OR(v1, v2) (_mm_or_si128(v1, v2))
+#elif defined __aarch64__
+#include "arm_neon.h"
+#define VECTYPE        uint64x2_t
+#define SPLAT(p)       vreinterpretq_u64_u8(vdupq_n_u8(*(p)))
+#define ALL_EQ(v1, v2) \
+        ((vgetq_lane_u64(v1, 0) == vgetq_lane_u64(v2, 0)) && \
+         (vgetq_lane_u64(v1, 1) == vgetq_lane_u64(v2, 1)))
+#define VEC_OR(v1, v2) ((v1) | (v2))
 #else
 #define VECTYPE        unsigned long
 #define SPLAT(p)       (*(p) * (~0UL / 255))
@@ -119,6 +119,15 @@
 #endif
 #endif
 
+/* Orders the loads and stores before it against the stores after it */
+#ifndef smp_mb_release
+#ifdef __ATOMIC_RELEASE
+#define smp_mb_release()    ({ barrier(); __atomic_thread_fence(__ATOMIC_RELEASE); barrier(); })
+#else
+#define smp_mb_release()    __sync_synchronize()
+#endif
+#endif
+
 #ifndef smp_read_barrier_depends
 #ifdef __ATOMIC_CONSUME
 #define smp_read_barrier_depends()   ({ barrier(); __atomic_thread_fence(__ATOMIC_CONSUME); barrier(); })
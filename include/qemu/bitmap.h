@@ -61,6 +61,7 @@
  * find_next_bit(addr, nbits, bit)	Position next set bit in *addr >= bit
  */
 
+#define BITMAP_FIRST_WORD_MASK(start) (~0UL << ((start) % BITS_PER_LONG))
 #define BITMAP_LAST_WORD_MASK(nbits)                                    \
     (                                                                   \
         ((nbits) % BITS_PER_LONG) ?                                     \
@@ -87,6 +87,78 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size);
  */
 bool hbitmap_merge(HBitmap *a, const HBitmap *b);
 
+/**
+ * hbitmap_serialization_granularity:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of bitmap elements that one unit of serialized data
+ * covers.  The @start and @count arguments of the serialization functions
+ * must be multiples of it, except that a part may end at the end of the
+ * bitmap.
+ */
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb);
+
+/**
+ * hbitmap_serialization_size:
+ * @hb: HBitmap to operate on.
+ * @start: First element of the part.
+ * @count: Number of elements in the part.
+ *
+ * Return the number of bytes that hbitmap_serialize_part() writes for
+ * the given part of the bitmap.
+ */
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_serialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer of hbitmap_serialization_size() bytes for the data.
+ * @start: First element of the part.
+ * @count: Number of elements in the part.
+ *
+ * Copy a part of the bitmap to @buf, in a format that does not depend on
+ * the host: little-endian 64-bit words, one bit per group of elements.
+ */
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Data written by hbitmap_serialize_part().
+ * @start: First element of the part.
+ * @count: Number of elements in the part.
+ * @finish: Whether to call hbitmap_deserialize_finish() afterwards.
+ *
+ * Overwrite a part of the bitmap with data from @buf.  The bitmap is not
+ * consistent until hbitmap_deserialize_finish() has been called, so it may
+ * not be used in between; passing @finish=false saves the work when many
+ * parts are loaded.
+ */
+void hbitmap_deserialize_part(HBitmap *hb, const uint8_t *buf,
+                              uint64_t start, uint64_t count, bool finish);
+
+/**
+ * hbitmap_deserialize_zeroes:
+ * @hb: HBitmap to operate on.
+ * @start: First element of the part.
+ * @count: Number of elements in the part.
+ * @finish: Whether to call hbitmap_deserialize_finish() afterwards.
+ *
+ * Like hbitmap_deserialize_part() for a part with no bits set.
+ */
+void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
+                                bool finish);
+
+/**
+ * hbitmap_deserialize_finish:
+ * @hb: HBitmap to operate on.
+ *
+ * Rebuild the upper levels and the count after the last level was loaded.
+ */
+void hbitmap_deserialize_finish(HBitmap *hb);
+
 /**
  * hbitmap_empty:
  * @hb: HBitmap to operate on.
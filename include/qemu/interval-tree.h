@@ -0,0 +1,59 @@
+/*
+ * Interval tree of byte ranges
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* The nodes are embedded in the structures they track, which set start
+ * and last before they insert them.  Several nodes may share a range.
+ */
+typedef struct IntervalTreeNode {
+    uint64_t start;                     /* first byte */
+    uint64_t last;                      /* last byte, inclusive */
+
+    /* Private */
+    uint64_t subtree_last;
+    struct IntervalTreeNode *left, *right;
+    int height;
+} IntervalTreeNode;
+
+typedef struct IntervalTreeRoot {
+    IntervalTreeNode *node;
+} IntervalTreeRoot;
+
+typedef bool IntervalTreeMatchFunc(IntervalTreeNode *node, void *opaque);
+
+static inline bool interval_tree_empty(IntervalTreeRoot *root)
+{
+    return !root->node;
+}
+
+/* O(log n) */
+void interval_tree_insert(IntervalTreeRoot *root, IntervalTreeNode *node);
+void interval_tree_remove(IntervalTreeRoot *root, IntervalTreeNode *node);
+
+/**
+ * interval_tree_find:
+ * @root: the tree
+ * @start, @last: the byte range to look up, inclusive
+ * @match: filter for the nodes overlapping the range, or NULL for all
+ * @opaque: passed to @match
+ *
+ * Returns the overlapping node with the lowest start for which @match
+ * returns true, or NULL.  This costs O(log n) plus one call of @match
+ * for each overlapping node that it rejects.  @match must not change
+ * the tree.
+ */
+IntervalTreeNode *interval_tree_find(IntervalTreeRoot *root,
+                                     uint64_t start, uint64_t last,
+                                     IntervalTreeMatchFunc *match,
+                                     void *opaque);
+
+#endif
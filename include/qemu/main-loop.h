@@ -245,7 +245,9 @@ bool qemu_mutex_iothread_locked(void);
  * NOTE: tools currently are single-threaded and qemu_mutex_lock_iothread
  * is a no-op there.
  */
-void qemu_mutex_lock_iothread(void);
+void qemu_mutex_lock_iothread_impl(const char *file, int line);
+#define qemu_mutex_lock_iothread() \
+    qemu_mutex_lock_iothread_impl(__FILE__, __LINE__)
 
 /**
  * qemu_mutex_unlock_iothread: Unlock the main loop mutex.
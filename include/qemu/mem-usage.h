@@ -0,0 +1,52 @@
+/*
+ * Memory accounting per subsystem
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MEM_USAGE_H
+#define QEMU_MEM_USAGE_H
+
+#include <stddef.h>
+#include "qapi-types.h"
+#include "qemu/atomic.h"
+
+/*
+ * The big allocations of some subsystems are counted, so that the memory
+ * footprint of a VM can be broken down with query-memory-usage.  Callers
+ * report each allocation and each free with its size; the counters are
+ * updated atomically and cost no more than that.
+ */
+typedef struct QemuMemUsage {
+    size_t bytes;
+    size_t allocations;
+} QemuMemUsage;
+
+extern QemuMemUsage qemu_mem_usage[MEMORY_USAGE_SUBSYSTEM_MAX];
+
+static inline void qemu_mem_usage_alloc(MemoryUsageSubsystem subsys,
+                                        size_t size)
+{
+    atomic_add(&qemu_mem_usage[subsys].bytes, size);
+    atomic_inc(&qemu_mem_usage[subsys].allocations);
+}
+
+static inline void qemu_mem_usage_free(MemoryUsageSubsystem subsys,
+                                       size_t size)
+{
+    atomic_sub(&qemu_mem_usage[subsys].bytes, size);
+    atomic_dec(&qemu_mem_usage[subsys].allocations);
+}
+
+/* For allocations that grow or shrink in place, e.g. with g_realloc() */
+static inline void qemu_mem_usage_resize(MemoryUsageSubsystem subsys,
+                                         size_t old_size, size_t new_size)
+{
+    atomic_add(&qemu_mem_usage[subsys].bytes, new_size - old_size);
+}
+
+/* Returns the counters of all subsystems, in the order of the enum */
+MemoryUsageInfoList *qemu_mem_usage_query(void);
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * Spreading a loop over worker threads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_PARALLEL_H
+#define QEMU_PARALLEL_H
+
+/* The most threads, including the caller, that parallel_for() uses */
+#define PARALLEL_MAX_THREADS 32
+
+typedef void ParallelFunc(void *opaque, int index);
+
+/**
+ * parallel_for: call @func(@opaque, i) for every i from 0 to @n - 1
+ *
+ * The calls are spread, in no particular order, over the calling thread
+ * and up to @threads - 1 worker threads, but no more threads than there
+ * are online CPUs. It returns once all of them are done.
+ *
+ * The worker threads are started when first needed and then kept for
+ * the next loops. They are shared by all the callers, one at a time; a
+ * loop that finds them busy, e.g. a parallel_for() inside @func, runs
+ * in the calling thread alone.
+ *
+ * @func runs with the locks of the caller held, in threads that are not
+ * registered with RCU, so it may neither take those locks nor use
+ * rcu_read_lock(). It is meant for splitting up plain loops over memory.
+ */
+void parallel_for(int n, int threads, ParallelFunc *func, void *opaque);
+
+#endif /* QEMU_PARALLEL_H */
@@ -0,0 +1,40 @@
+/*
+ * QEMU synchronization profiler
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_QSP_H
+#define QEMU_QSP_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "qemu/fprintf-fn.h"
+#include "qemu/thread.h"
+
+/*
+ * The profiler counts, for each lock and call site, how often the lock was
+ * taken, how long the callers waited for it and how long they held it.
+ * Locks are told apart by the expression passed to qemu_mutex_lock(), so
+ * e.g. all "&s->lock" taken at the same line are accounted together; the
+ * BQL is reported as "BQL".
+ *
+ * While the profiler is disabled, locking only pays for reading
+ * qsp_enabled.
+ */
+extern bool qsp_enabled;
+
+void qsp_enable(void);
+void qsp_disable(void);
+void qsp_reset(void);
+void qsp_report(FILE *f, fprintf_function cpu_fprintf, size_t max);
+
+/* Internal interfaces for the QemuMutex implementation */
+int64_t qsp_clock(void);
+void qsp_mutex_acquired(QemuMutex *mutex, const char *name,
+                        const char *file, int line, int64_t start);
+void qsp_mutex_reacquired(QemuMutex *mutex, void *entry);
+void qsp_mutex_released(QemuMutex *mutex);
+
+#endif
@@ -35,6 +35,7 @@
 #include "qemu/thread.h"
 #include "qemu/queue.h"
 #include "qemu/atomic.h"
+#include "qemu/sys_membarrier.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -87,7 +88,14 @@ static inline void rcu_read_lock(void)
     }
 
     ctr = atomic_read(&rcu_gp_ctr);
-    atomic_xchg(&p_rcu_reader->ctr, ctr);
+    atomic_set(&p_rcu_reader->ctr, ctr);
+
+    /* Write p_rcu_reader->ctr before reading RCU-protected pointers and
+     * p_rcu_reader->waiting.  Pairs with smp_mb_global() in
+     * synchronize_rcu(), so that no barrier is needed here if the host
+     * has membarrier(2).
+     */
+    smp_mb_placeholder();
     if (atomic_read(&p_rcu_reader->waiting)) {
         atomic_set(&p_rcu_reader->waiting, false);
         qemu_event_set(&rcu_gp_event);
@@ -103,7 +111,13 @@ static inline void rcu_read_unlock(void)
         return;
     }
 
-    atomic_xchg(&p_rcu_reader->ctr, 0);
+    /* Finish the critical section before it is seen to be over, then
+     * order the store against the read of p_rcu_reader->waiting; this
+     * pairs with smp_mb_global() as above.
+     */
+    smp_mb_release();
+    atomic_set(&p_rcu_reader->ctr, 0);
+    smp_mb_placeholder();
     if (atomic_read(&p_rcu_reader->waiting)) {
         atomic_set(&p_rcu_reader->waiting, false);
         qemu_event_set(&rcu_gp_event);
@@ -112,6 +126,13 @@ static inline void rcu_read_unlock(void)
 
 extern void synchronize_rcu(void);
 
+/*
+ * Waits until the callbacks that were queued with call_rcu() before have
+ * run.  The call_rcu thread stops batching them meanwhile.  Releases the
+ * iothread lock while it waits, if the caller holds it.
+ */
+extern void drain_call_rcu(void);
+
 /*
  * Reader thread registration.
  */
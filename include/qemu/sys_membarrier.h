@@ -0,0 +1,36 @@
+/*
+ * Process-wide memory barriers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_SYS_MEMBARRIER_H
+#define QEMU_SYS_MEMBARRIER_H
+
+#include <stdbool.h>
+#include "qemu/atomic.h"
+
+/*
+ * smp_mb_global() runs a full memory barrier on every thread of the
+ * process, with the membarrier(2) system call when the host has it.  A
+ * fast path can then pair an smp_mb_placeholder() with it, which is only
+ * a compiler barrier in that case: the cost of the barrier moves from the
+ * (frequent) reader to the (rare) writer.  Without membarrier(2) both are
+ * plain smp_mb().
+ */
+extern bool have_sys_membarrier;
+
+static inline void smp_mb_placeholder(void)
+{
+    if (have_sys_membarrier) {
+        barrier();
+    } else {
+        smp_mb();
+    }
+}
+
+void smp_mb_global(void);
+void smp_mb_global_init(void);
+
+#endif
@@ -5,6 +5,9 @@
 
 struct QemuMutex {
     pthread_mutex_t lock;
+    /* for the synchronization profiler, while held */
+    void *qsp_entry;
+    int64_t qsp_locked_at;
 };
 
 struct QemuCond {
@@ -21,10 +21,19 @@ typedef struct QemuThread QemuThread;
 
 void qemu_mutex_init(QemuMutex *mutex);
 void qemu_mutex_destroy(QemuMutex *mutex);
-void qemu_mutex_lock(QemuMutex *mutex);
-int qemu_mutex_trylock(QemuMutex *mutex);
+void qemu_mutex_lock_impl(QemuMutex *mutex, const char *name,
+                          const char *file, int line);
+int qemu_mutex_trylock_impl(QemuMutex *mutex, const char *name,
+                            const char *file, int line);
 void qemu_mutex_unlock(QemuMutex *mutex);
 
+/* The call site and the lock expression are recorded by the
+ * synchronization profiler, see qemu/qsp.h.
+ */
+#define qemu_mutex_lock(m) qemu_mutex_lock_impl(m, #m, __FILE__, __LINE__)
+#define qemu_mutex_trylock(m) \
+    qemu_mutex_trylock_impl(m, #m, __FILE__, __LINE__)
+
 void qemu_cond_init(QemuCond *cond);
 void qemu_cond_destroy(QemuCond *cond);
 
@@ -55,6 +64,13 @@ void qemu_thread_create(QemuThread *thread, const char *name,
 void *qemu_thread_join(QemuThread *thread);
 void qemu_thread_get_self(QemuThread *thread);
 bool qemu_thread_is_self(QemuThread *thread);
+/* Binds @thread to the set bits of @host_cpus; returns 0 or -errno */
+int qemu_thread_set_affinity(QemuThread *thread,
+                             const unsigned long *host_cpus,
+                             unsigned long nbits);
+/* Runs @thread under SCHED_FIFO at @priority, or normally if @priority is
+ * 0; returns 0 or -errno */
+int qemu_thread_set_realtime(QemuThread *thread, int priority);
 void qemu_thread_exit(void *retval);
 void qemu_thread_naming(bool enable);
 
@@ -67,6 +67,13 @@ typedef struct ThrottleState {
     int64_t previous_leak;    /* timestamp of the last leak done */
 } ThrottleState;
 
+/* I/O that was accounted in advance, see throttle_take_credit() */
+typedef struct ThrottleCredit {
+    double bytes;
+    double ops;
+    uint64_t op_size;         /* cfg.op_size when the credit was taken */
+} ThrottleCredit;
+
 typedef struct ThrottleTimers {
     QEMUTimer *timers[2];     /* timers used to do the throttling */
     QEMUClockType clock_type; /* the clock used */
@@ -127,4 +134,9 @@ bool throttle_schedule_timer(ThrottleState *ts,
 
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
 
+void throttle_take_credit(ThrottleState *ts, bool is_write, double share,
+                          ThrottleCredit *credit);
+
+bool throttle_use_credit(ThrottleCredit *credit, uint64_t size);
+
 #endif
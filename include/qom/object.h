@@ -406,6 +406,7 @@ struct Object
     ObjectClass *class;
     ObjectFree *free;
     QTAILQ_HEAD(, ObjectProperty) properties;
+    GHashTable *property_table;
     uint32_t ref;
     Object *parent;
 };
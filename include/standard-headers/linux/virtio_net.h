@@ -55,6 +55,7 @@
 #define VIRTIO_NET_F_MQ	22	/* Device supports Receive Flow
 					 * Steering */
 #define VIRTIO_NET_F_CTRL_MAC_ADDR 23	/* Set MAC address */
+#define VIRTIO_NET_F_RSS	60	/* Supports RSS RX steering */
 
 #ifndef VIRTIO_NET_NO_LEGACY
 #define VIRTIO_NET_F_GSO	6	/* Host handles pkts w/ any GSO type */
@@ -73,8 +74,33 @@ struct virtio_net_config {
 	 * Legal values are between 1 and 0x8000
 	 */
 	uint16_t max_virtqueue_pairs;
+	/* Default maximum transmit unit advice */
+	uint16_t mtu;
+	/* Speed, in units of 1Mb; duplex, see DUPLEX_* */
+	uint32_t speed;
+	uint8_t duplex;
+	/* maximum size of RSS key; see VIRTIO_NET_F_RSS */
+	uint8_t rss_max_key_size;
+	/* maximum number of indirection table entries */
+	uint16_t rss_max_indirection_table_length;
+	/* bitmask of supported VIRTIO_NET_RSS_HASH_TYPE_* */
+	uint32_t supported_hash_types;
 } QEMU_PACKED;
 
+/*
+ * This is the bit mask of the hash types that the device can use to
+ * compute the hash of received packets; see VIRTIO_NET_F_RSS.
+ */
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv4          (1 << 0)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv4         (1 << 1)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv4         (1 << 2)
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv6          (1 << 3)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv6         (1 << 4)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv6         (1 << 5)
+#define VIRTIO_NET_RSS_HASH_TYPE_IP_EX         (1 << 6)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCP_EX        (1 << 7)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDP_EX        (1 << 8)
+
 /*
  * This header comes first in the scatter-gather list.  If you don't
  * specify GSO or CSUM features, you can simply ignore the header.
@@ -227,6 +253,25 @@ struct virtio_net_ctrl_mq {
  #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN        1
  #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX        0x8000
 
+/*
+ * The command VIRTIO_NET_CTRL_MQ_RSS_CONFIG has the same effect as
+ * VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET (with max_tx_vq as the number of queue
+ * pairs) and, in addition, makes the device steer every received packet
+ * to the receive queue selected by the Toeplitz hash of its headers.
+ * Available with the VIRTIO_NET_F_RSS feature bit.
+ *
+ * The command data is laid out as follows; all fields are little endian:
+ *
+ *   le32 hash_types;
+ *   le16 indirection_table_mask;
+ *   le16 unclassified_queue;
+ *   le16 indirection_table[indirection_table_mask + 1];
+ *   le16 max_tx_vq;
+ *   u8 hash_key_length;
+ *   u8 hash_key_data[hash_key_length];
+ */
+ #define VIRTIO_NET_CTRL_MQ_RSS_CONFIG          1
+
 /*
  * Control network offloads
  *
@@ -57,6 +57,8 @@ struct CharDriverState {
     QemuMutex chr_write_lock;
     void (*init)(struct CharDriverState *s);
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
+    int (*chr_writev)(struct CharDriverState *s, const struct iovec *iov,
+                      int iovcnt);
     int (*chr_sync_read)(struct CharDriverState *s,
                          const uint8_t *buf, int len);
     GSource *(*chr_add_watch)(struct CharDriverState *s, GIOCondition cond);
@@ -84,6 +86,7 @@ struct CharDriverState {
     int avail_connections;
     int is_mux;
     guint fd_in_tag;
+    GMainContext *context;      /* of fd_in_tag, NULL for the main loop */
     QemuOpts *opts;
     QTAILQ_ENTRY(CharDriverState) next;
 };
@@ -188,6 +191,22 @@ int qemu_chr_fe_add_watch(CharDriverState *s, GIOCondition cond,
  */
 int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_fe_writev:
+ *
+ * Like @qemu_chr_fe_write, but gathers the data from an I/O vector.
+ * Back ends that can do so write it with a single system call; a short
+ * count means that the back end is full, and the caller should wait on
+ * @qemu_chr_fe_add_watch rather than retry.  This function is thread-safe.
+ *
+ * @iov the data
+ * @iovcnt the number of elements in @iov
+ *
+ * Returns: the number of bytes consumed, or -1 if none could be
+ */
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov,
+                       int iovcnt);
+
 /**
  * @qemu_chr_fe_write_all:
  *
@@ -336,6 +355,20 @@ void qemu_chr_add_handlers(CharDriverState *s,
                            IOEventHandler *fd_event,
                            void *opaque);
 
+/**
+ * @qemu_chr_add_handlers_full:
+ *
+ * Like qemu_chr_add_handlers(), but the handlers run from @context rather
+ * than from the main loop.  Only the fd, pty, udp and socket back ends
+ * support other contexts; the others keep using the main loop.
+ */
+void qemu_chr_add_handlers_full(CharDriverState *s,
+                                IOCanReadHandler *fd_can_read,
+                                IOReadHandler *fd_read,
+                                IOEventHandler *fd_event,
+                                void *opaque,
+                                GMainContext *context);
+
 void qemu_chr_be_generic_open(CharDriverState *s);
 void qemu_chr_accept_input(CharDriverState *s);
 int qemu_chr_add_client(CharDriverState *s, int fd);
@@ -25,4 +25,7 @@ int cpu_get_dump_info(ArchDumpInfo *info,
                       const struct GuestPhysBlockList *guest_phys_blocks);
 ssize_t cpu_get_note_size(int class, int machine, int nr_cpus);
 
+/* Whether a detached dump-guest-memory is still writing the guest's RAM */
+bool dump_in_progress(void);
+
 #endif
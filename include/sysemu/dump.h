@@ -45,6 +45,8 @@
 
 #include "sysemu/dump-arch.h"
 #include "sysemu/memory_mapping.h"
+#include "qemu/thread.h"
+#include "qapi-types.h"
 
 typedef struct QEMU_PACKED MakedumpfileHeader {
     char signature[16];     /* = "makedumpfile" */
@@ -183,6 +185,13 @@ typedef struct DumpState {
     off_t offset_page;          /* offset of page part in vmcore */
     size_t num_dumpable;        /* number of page that can be dumped */
     uint32_t flag_compress;     /* indicate the compression format */
+
+    bool kdump;                 /* write the kdump-compressed format */
+    bool detached;              /* the dump runs in dump_thread */
+    QemuThread dump_thread;
+    DumpStatus status;          /* only changes under the iothread lock */
+    int64_t total_size;         /* bytes of guest memory to dump */
+    int64_t written_size;       /* bytes of guest memory dumped so far */
 } DumpState;
 
 uint16_t cpu_to_dump16(DumpState *s, uint16_t val);
@@ -16,9 +16,12 @@
 
 #include "block/aio.h"
 #include "qemu/thread.h"
+#include "qemu/bitmap.h"
 
 #define TYPE_IOTHREAD "iothread"
 
+#define IOTHREAD_MAX_HOST_CPUS 1024
+
 typedef struct {
     Object parent_obj;
 
@@ -28,6 +31,23 @@ typedef struct {
     QemuCond init_done_cond;    /* is thread initialization done? */
     bool stopping;
     int thread_id;
+
+    /* AioContext poll parameters */
+    int64_t poll_max_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* AioContext thread pool parameters */
+    int64_t thread_pool_min;
+    int64_t thread_pool_max;
+
+    /* Host CPUs that the thread runs on; if empty, it is not bound */
+    DECLARE_BITMAP(host_cpus, IOTHREAD_MAX_HOST_CPUS);
+    /* An IOThreadSchedPolicy, and the priority for the real-time one */
+    int sched_policy;
+    int64_t sched_priority;
+    /* Guest NUMA node for -machine numa-pin, or -1 */
+    int64_t node;
 } IOThread;
 
 #define IOTHREAD(obj) \
@@ -35,5 +55,7 @@ typedef struct {
 
 char *iothread_get_id(IOThread *iothread);
 AioContext *iothread_get_aio_context(IOThread *iothread);
+/* Returns the IOThread object created with -object iothread,id=@id, or NULL */
+IOThread *iothread_by_id(const char *id);
 
 #endif /* IOTHREAD_H */
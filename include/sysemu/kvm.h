@@ -196,6 +196,8 @@ int kvm_cpu_exec(CPUState *cpu);
 
 void kvm_setup_guest_memory(void *start, size_t size);
 void kvm_flush_coalesced_mmio_buffer(void);
+void kvm_coalesced_mmio_drain_ref(void);
+void kvm_coalesced_mmio_drain_unref(void);
 
 int kvm_insert_breakpoint(CPUState *cpu, target_ulong addr,
                           target_ulong len, int type);
@@ -416,6 +418,15 @@ int kvm_irqchip_add_msi_route(KVMState *s, MSIMessage msg);
 int kvm_irqchip_update_msi_route(KVMState *s, int virq, MSIMessage msg);
 void kvm_irqchip_release_virq(KVMState *s, int virq);
 
+/*
+ * Routes that are added or updated between these two calls are passed to
+ * KVM with a single KVM_SET_GSI_ROUTING, when the outermost
+ * kvm_irqchip_end_route_changes() is called.  The new routes must not be
+ * used to inject interrupts before that.
+ */
+void kvm_irqchip_begin_route_changes(KVMState *s);
+void kvm_irqchip_end_route_changes(KVMState *s);
+
 int kvm_irqchip_add_adapter_route(KVMState *s, AdapterInfo *adapter);
 
 int kvm_irqchip_add_irqfd_notifier_gsi(KVMState *s, EventNotifier *n,
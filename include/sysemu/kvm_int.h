@@ -20,6 +20,10 @@ typedef struct KVMSlot
     void *ram;
     int slot;
     int flags;
+    /* With manual dirty log protection: the log returned by the last
+     * KVM_GET_DIRTY_LOG, minus the pages cleared since
+     */
+    unsigned long *dirty_bmap;
 } KVMSlot;
 
 typedef struct KVMMemoryListener {
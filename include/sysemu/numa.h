@@ -10,6 +10,8 @@
 
 extern int nb_numa_nodes;   /* Number of NUMA nodes */
 
+#define NUMA_MAX_HOST_CPUS 1024
+
 struct numa_addr_range {
     ram_addr_t mem_start;
     ram_addr_t mem_end;
@@ -32,5 +34,7 @@ extern QemuOptsList qemu_numa_opts;
 void numa_set_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node);
 void numa_unset_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node);
 uint32_t numa_get_node(ram_addr_t addr, Error **errp);
+/* With -machine numa-pin=on, bind the vCPU's thread to its node's host CPUs */
+void numa_pin_vcpu(CPUState *cpu);
 
 #endif
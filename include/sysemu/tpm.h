@@ -28,8 +28,10 @@ typedef enum  TPMVersion {
 
 TPMVersion tpm_tis_get_tpm_version(Object *obj);
 TPMVersion spapr_vtpm_get_tpm_version(Object *obj);
+TPMVersion tpm_crb_get_tpm_version(Object *obj);
 
 #define TYPE_TPM_TIS                "tpm-tis"
+#define TYPE_TPM_CRB                "tpm-crb"
 
 static inline TPMVersion tpm_get_version(void)
 {
@@ -39,8 +41,25 @@ static inline TPMVersion tpm_get_version(void)
     if (obj) {
         return tpm_tis_get_tpm_version(obj);
     }
+
+    obj = object_resolve_path_type("", TYPE_TPM_CRB, NULL);
+    if (obj) {
+        return tpm_crb_get_tpm_version(obj);
+    }
 #endif
     return TPM_VERSION_UNSPEC;
 }
 
+/*
+ * Returns true if the TPM frontend in use is the CRB interface.
+ */
+static inline bool tpm_is_crb(void)
+{
+#ifdef CONFIG_TPM
+    return object_resolve_path_type("", TYPE_TPM_CRB, NULL) != NULL;
+#else
+    return false;
+#endif
+}
+
 #endif /* QEMU_TPM_H */
@@ -18,6 +18,7 @@
 #include "qapi/error.h"
 #include "qapi-types.h"
 #include "qemu/option.h"
+#include "qemu/thread.h"
 #include "sysemu/tpm.h"
 
 #define TYPE_TPM_BACKEND "tpm-backend"
@@ -35,6 +36,9 @@ typedef struct TPMDriverOps TPMDriverOps;
 
 typedef struct TPMLocality TPMLocality;
 
+/* number of localities a frontend may submit requests from */
+#define TPM_BACKEND_NUM_LOCALITIES 5
+
 struct TPMBackendClass {
     ObjectClass parent_class;
 
@@ -55,11 +59,21 @@ struct TPMBackend {
     char *cancel_path;
     const TPMDriverOps *ops;
 
+    /* AioContext to run the backend worker in; NULL for a thread pool */
+    AioContext *aio_context;
+
+    /* per-ordinal command statistics */
+    QemuMutex stats_lock;
+    GHashTable *cmd_stats;
+
     QLIST_ENTRY(TPMBackend) list;
 };
 
 typedef void (TPMRecvDataCB)(void *, uint8_t locty, bool selftest_done);
 
+/* called with the size of the response or a negative errno value */
+typedef void (TPMCmdDoneCB)(void *opaque, int ret);
+
 typedef struct TPMSizedBuffer {
     uint32_t size;
     uint8_t  *buffer;
@@ -108,6 +122,18 @@ struct TPMDriverOps {
     int (*reset_tpm_established_flag)(TPMBackend *t, uint8_t locty);
 
     TPMVersion (*get_tpm_version)(TPMBackend *t);
+
+    /* number of requests of a locality waiting for or in processing */
+    uint32_t (*get_queue_depth)(TPMBackend *t, uint8_t locty);
+
+    /* hits and misses of the response cache; false if there is none */
+    bool (*get_cache_stats)(TPMBackend *t, uint64_t *hits, uint64_t *misses);
+
+    /* queue a command of QEMU itself rather than of the frontend */
+    int (*execute_cmd)(TPMBackend *t, uint8_t locty,
+                       const uint8_t *in, uint32_t in_len,
+                       uint8_t *out, uint32_t out_len,
+                       TPMCmdDoneCB *cb, void *opaque);
 };
 
 
@@ -191,7 +217,8 @@ void tpm_backend_deliver_request(TPMBackend *s);
  * @s: the backend to reset
  *
  * Reset the backend into a well defined state with all previous errors
- * reset.
+ * reset. The reset does not wait for a request that is being processed;
+ * the request is canceled and the frontend is not called back for it.
  */
 void tpm_backend_reset(TPMBackend *s);
 
@@ -243,6 +270,114 @@ void tpm_backend_open(TPMBackend *s, Error **errp);
  */
 TPMVersion tpm_backend_get_tpm_version(TPMBackend *s);
 
+/**
+ * tpm_backend_get_queue_depth:
+ * @s: the backend to call into
+ * @locty: the locality
+ *
+ * Get the number of requests of the given locality that have been
+ * delivered to the backend and whose response has not been passed
+ * to the frontend yet.
+ *
+ * Returns the number of requests; 0 if the backend does not queue.
+ */
+uint32_t tpm_backend_get_queue_depth(TPMBackend *s, uint8_t locty);
+
+/**
+ * tpm_backend_get_cache_stats:
+ * @s: the backend to call into
+ * @hits: the number of requests answered from the response cache
+ * @misses: the number of cacheable requests sent to the TPM
+ *
+ * Get the statistics of the backend's response cache.
+ *
+ * Returns true if the backend has a response cache enabled.
+ */
+bool tpm_backend_get_cache_stats(TPMBackend *s, uint64_t *hits,
+                                 uint64_t *misses);
+
+/**
+ * tpm_backend_execute_cmd:
+ * @s: the backend
+ * @locty: the locality to run the command in
+ * @in: the command
+ * @in_len: the length of the command
+ * @out: the buffer for the response
+ * @out_len: the size of @out
+ * @cb: the function to call once the response is in @out
+ * @opaque: data to pass to @cb
+ *
+ * Queue a command that QEMU issues itself, e.g. to get random numbers,
+ * behind the requests of the frontend. @cb is invoked from the worker of
+ * the backend; @in and @out must stay valid until then. The command is
+ * not dropped when the frontend resets the backend.
+ *
+ * Returns 0 if the command was queued, -ENOTSUP if the backend does not
+ * support this and -EAGAIN if the TPM has not been started up yet.
+ */
+int tpm_backend_execute_cmd(TPMBackend *s, uint8_t locty,
+                            const uint8_t *in, uint32_t in_len,
+                            uint8_t *out, uint32_t out_len,
+                            TPMCmdDoneCB *cb, void *opaque);
+
+/**
+ * tpm_backend_get_ordinal:
+ * @cmd: a TPM command
+ * @cmd_len: the length of the command
+ *
+ * Returns the ordinal (command code) of the command or 0 if the command
+ * is too short to have one.
+ */
+uint32_t tpm_backend_get_ordinal(const uint8_t *cmd, uint32_t cmd_len);
+
+/**
+ * tpm_backend_stats_exec:
+ * @s: the backend
+ * @cmd: the command that was executed
+ * @cmd_len: the length of the command
+ * @resp_len: the length of the response
+ * @queue_ns: the time the command waited in the backend, in nanoseconds
+ * @exec_ns: the time the TPM took to execute the command, in nanoseconds
+ *
+ * Account a command that was executed by the backend in the statistics
+ * reported by query-tpm.
+ */
+void tpm_backend_stats_exec(TPMBackend *s, const uint8_t *cmd,
+                            uint32_t cmd_len, uint32_t resp_len,
+                            int64_t queue_ns, int64_t exec_ns);
+
+/**
+ * tpm_backend_stats_fetch:
+ * @s: the backend
+ * @ordinal: the ordinal of the command
+ * @fetch_ns: the time from the response becoming available to the guest
+ *            having fetched it, in nanoseconds
+ *
+ * Account the time a guest took to fetch a response from the frontend.
+ */
+void tpm_backend_stats_fetch(TPMBackend *s, uint32_t ordinal,
+                             int64_t fetch_ns);
+
+/**
+ * tpm_backend_query_stats:
+ * @s: the backend
+ *
+ * Returns the per-ordinal command statistics, sorted by ordinal.
+ */
+TPMCommandStatsList *tpm_backend_query_stats(TPMBackend *s);
+
+/**
+ * tpm_backend_set_aio_context:
+ * @s: the backend
+ * @ctx: the AioContext to process requests in
+ *
+ * Have the backend process requests as a bottom half in the given
+ * AioContext instead of in a thread of its own. The TPMRecvDataCB is
+ * then invoked from @ctx as well. Must be called before the TPM is
+ * started up.
+ */
+void tpm_backend_set_aio_context(TPMBackend *s, AioContext *ctx);
+
 TPMBackend *qemu_find_tpm(const char *id);
 
 const TPMDriverOps *tpm_get_backend_driver(const char *type);
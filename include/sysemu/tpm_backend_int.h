@@ -23,14 +23,23 @@
 #define TPM_TPM_BACKEND_H
 
 #include <glib.h>
+#include "block/aio.h"
 
 typedef struct TPMBackendThread {
     GThreadPool *pool;
+
+    /* used instead of the pool when the worker runs in an AioContext */
+    AioContext *ctx;
+    QEMUBH *bh;
+    GFunc func;
+    gpointer user_data;
+    int pending;    /* requests delivered to the bottom half */
 } TPMBackendThread;
 
 void tpm_backend_thread_deliver_request(TPMBackendThread *tbt);
 void tpm_backend_thread_create(TPMBackendThread *tbt,
-                               GFunc func, gpointer user_data);
+                               GFunc func, gpointer user_data,
+                               AioContext *ctx);
 void tpm_backend_thread_end(TPMBackendThread *tbt);
 
 typedef enum TPMBackendCmd {
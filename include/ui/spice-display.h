@@ -94,6 +94,12 @@ struct SimpleSpiceDisplay {
     QemuMutex lock;
     QTAILQ_HEAD(, SimpleSpiceUpdate) updates;
 
+    /* released updates, kept for reuse; protected by pool_lock, as they
+     * may be released with the lock above held */
+    QemuMutex pool_lock;
+    QTAILQ_HEAD(, SimpleSpiceUpdate) pool;
+    int pool_size;
+
     /* cursor (without qxl): displaychangelistener -> spice server */
     SimpleSpiceCursor *ptr_define;
     SimpleSpiceCursor *ptr_move;
@@ -111,6 +117,7 @@ struct SimpleSpiceUpdate {
     QXLImage image;
     QXLCommandExt ext;
     uint8_t *bitmap;
+    size_t bitmap_size;
     QTAILQ_ENTRY(SimpleSpiceUpdate) next;
 };
 
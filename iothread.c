@@ -16,9 +16,13 @@
 #include "qemu/module.h"
 #include "block/aio.h"
 #include "sysemu/iothread.h"
+#include "sysemu/sysemu.h"
 #include "qmp-commands.h"
 #include "qemu/error-report.h"
 #include "qemu/rcu.h"
+#include "qapi/visitor.h"
+#include "qapi-visit.h"
+#include "block/thread-pool.h"
 
 typedef ObjectClass IOThreadClass;
 
@@ -53,6 +57,308 @@ static void *iothread_run(void *opaque)
     return NULL;
 }
 
+typedef struct {
+    const char *name;
+    ptrdiff_t offset; /* field's byte offset in IOThread struct */
+} IOThreadParamInfo;
+
+static IOThreadParamInfo poll_max_ns_info = {
+    "poll-max-ns", offsetof(IOThread, poll_max_ns),
+};
+static IOThreadParamInfo poll_grow_info = {
+    "poll-grow", offsetof(IOThread, poll_grow),
+};
+static IOThreadParamInfo poll_shrink_info = {
+    "poll-shrink", offsetof(IOThread, poll_shrink),
+};
+static IOThreadParamInfo thread_pool_min_info = {
+    "thread-pool-min", offsetof(IOThread, thread_pool_min),
+};
+static IOThreadParamInfo thread_pool_max_info = {
+    "thread-pool-max", offsetof(IOThread, thread_pool_max),
+};
+
+/* Unlike the main loop, iothreads poll by default */
+#define IOTHREAD_POLL_MAX_NS_DEFAULT 32768ULL
+
+/* Pass the parameters on to the AioContext, which must be acquired */
+static void iothread_set_aio_context_params(IOThread *iothread, Error **errp)
+{
+    Error *local_err = NULL;
+
+    aio_context_set_poll_params(iothread->ctx, iothread->poll_max_ns,
+                                iothread->poll_grow, iothread->poll_shrink,
+                                &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    aio_context_set_thread_pool_params(iothread->ctx,
+                                       iothread->thread_pool_min,
+                                       iothread->thread_pool_max, errp);
+}
+
+static void iothread_get_param(Object *obj, Visitor *v, void *opaque,
+                               const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IOThreadParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+
+    visit_type_int64(v, field, name, errp);
+}
+
+static void iothread_set_param(Object *obj, Visitor *v, void *opaque,
+                               const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IOThreadParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+    Error *local_err = NULL;
+    int64_t value, old;
+
+    visit_type_int64(v, &value, name, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    old = *field;
+    *field = value;
+    if (iothread->ctx) {
+        aio_context_acquire(iothread->ctx);
+        iothread_set_aio_context_params(iothread, &local_err);
+        if (local_err) {
+            *field = old;
+            iothread_set_aio_context_params(iothread, &error_abort);
+        }
+        aio_context_release(iothread->ctx);
+    }
+out:
+    error_propagate(errp, local_err);
+}
+
+static void iothread_add_param(Object *obj, IOThreadParamInfo *info)
+{
+    object_property_add(obj, info->name, "int",
+                        iothread_get_param, iothread_set_param,
+                        NULL, info, NULL);
+}
+
+/* Apply the CPU affinity and the scheduling policy to the running thread.
+ * @initial is true when it has just been created with the defaults, which
+ * need not be set again.
+ */
+static void iothread_set_thread_params(IOThread *iothread, bool initial,
+                                       Error **errp)
+{
+    DECLARE_BITMAP(all_cpus, IOTHREAD_MAX_HOST_CPUS);
+    const unsigned long *host_cpus = iothread->host_cpus;
+    int priority = 0;
+    int ret;
+
+    if (bitmap_empty(iothread->host_cpus, IOTHREAD_MAX_HOST_CPUS)) {
+        bitmap_fill(all_cpus, IOTHREAD_MAX_HOST_CPUS);
+        host_cpus = all_cpus;
+    }
+    if (!initial || host_cpus != all_cpus) {
+        ret = qemu_thread_set_affinity(&iothread->thread, host_cpus,
+                                       IOTHREAD_MAX_HOST_CPUS);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret,
+                             "Cannot set the CPU affinity of the iothread");
+            return;
+        }
+    }
+
+    if (iothread->sched_policy == IOTHREAD_SCHED_POLICY_FIFO) {
+        priority = iothread->sched_priority;
+        if (priority <= 0) {
+            error_setg(errp, "sched-priority must be positive for the "
+                       "'fifo' sched-policy");
+            return;
+        }
+    }
+    if (!initial || priority) {
+        ret = qemu_thread_set_realtime(&iothread->thread, priority);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret,
+                             "Cannot set the scheduling policy of the "
+                             "iothread");
+        }
+    }
+}
+
+static void iothread_get_host_cpus(Object *obj, Visitor *v, void *opaque,
+                                   const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    uint16List *host_cpus = NULL;
+    uint16List **cpu = &host_cpus;
+    unsigned long value;
+
+    value = find_first_bit(iothread->host_cpus, IOTHREAD_MAX_HOST_CPUS);
+    while (value < IOTHREAD_MAX_HOST_CPUS) {
+        *cpu = g_malloc0(sizeof(**cpu));
+        (*cpu)->value = value;
+        cpu = &(*cpu)->next;
+        value = find_next_bit(iothread->host_cpus, IOTHREAD_MAX_HOST_CPUS,
+                              value + 1);
+    }
+
+    visit_type_uint16List(v, &host_cpus, name, errp);
+    qapi_free_uint16List(host_cpus);
+}
+
+static void iothread_set_host_cpus(Object *obj, Visitor *v, void *opaque,
+                                   const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    DECLARE_BITMAP(old, IOTHREAD_MAX_HOST_CPUS);
+    uint16List *host_cpus = NULL, *l;
+    Error *local_err = NULL;
+
+    visit_type_uint16List(v, &host_cpus, name, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    for (l = host_cpus; l; l = l->next) {
+        if (l->value >= IOTHREAD_MAX_HOST_CPUS) {
+            error_setg(&local_err, "Host CPU %d is out of range, the maximum "
+                       "is %d", l->value, IOTHREAD_MAX_HOST_CPUS - 1);
+            goto out;
+        }
+    }
+
+    bitmap_copy(old, iothread->host_cpus, IOTHREAD_MAX_HOST_CPUS);
+    bitmap_zero(iothread->host_cpus, IOTHREAD_MAX_HOST_CPUS);
+    for (l = host_cpus; l; l = l->next) {
+        set_bit(l->value, iothread->host_cpus);
+    }
+    if (iothread->ctx) {
+        iothread_set_thread_params(iothread, false, &local_err);
+        if (local_err) {
+            bitmap_copy(iothread->host_cpus, old, IOTHREAD_MAX_HOST_CPUS);
+        }
+    }
+out:
+    qapi_free_uint16List(host_cpus);
+    error_propagate(errp, local_err);
+}
+
+static int iothread_get_sched_policy(Object *obj, Error **errp)
+{
+    return IOTHREAD(obj)->sched_policy;
+}
+
+static void iothread_set_sched_policy(Object *obj, int value, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    Error *local_err = NULL;
+    int old = iothread->sched_policy;
+
+    iothread->sched_policy = value;
+    if (iothread->ctx) {
+        iothread_set_thread_params(iothread, false, &local_err);
+        if (local_err) {
+            iothread->sched_policy = old;
+            error_propagate(errp, local_err);
+        }
+    }
+}
+
+static void iothread_get_sched_priority(Object *obj, Visitor *v, void *opaque,
+                                        const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    visit_type_int64(v, &iothread->sched_priority, name, errp);
+}
+
+static void iothread_set_sched_priority(Object *obj, Visitor *v, void *opaque,
+                                        const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    Error *local_err = NULL;
+    int64_t value, old;
+
+    visit_type_int64(v, &value, name, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    old = iothread->sched_priority;
+    iothread->sched_priority = value;
+    if (iothread->ctx &&
+        iothread->sched_policy == IOTHREAD_SCHED_POLICY_FIFO) {
+        iothread_set_thread_params(iothread, false, &local_err);
+        if (local_err) {
+            iothread->sched_priority = old;
+        }
+    }
+out:
+    error_propagate(errp, local_err);
+}
+
+static void iothread_get_node(Object *obj, Visitor *v, void *opaque,
+                              const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    visit_type_int64(v, &iothread->node, name, errp);
+}
+
+static void iothread_set_node(Object *obj, Visitor *v, void *opaque,
+                              const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int64(v, &value, name, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (value < -1 || value >= MAX_NODES) {
+        error_setg(&local_err, "node must be between 0 and %d",
+                   MAX_NODES - 1);
+        goto out;
+    }
+    iothread->node = value;
+out:
+    error_propagate(errp, local_err);
+}
+
+static void iothread_instance_init(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    iothread->thread_pool_min = THREAD_POOL_DEFAULT_MIN_THREADS;
+    iothread->thread_pool_max = THREAD_POOL_DEFAULT_MAX_THREADS;
+    iothread->node = -1;
+
+    iothread_add_param(obj, &poll_max_ns_info);
+    iothread_add_param(obj, &poll_grow_info);
+    iothread_add_param(obj, &poll_shrink_info);
+    iothread_add_param(obj, &thread_pool_min_info);
+    iothread_add_param(obj, &thread_pool_max_info);
+
+    object_property_add(obj, "host-cpus", "int",
+                        iothread_get_host_cpus, iothread_set_host_cpus,
+                        NULL, NULL, NULL);
+    object_property_add_enum(obj, "sched-policy", "IOThreadSchedPolicy",
+                             IOThreadSchedPolicy_lookup,
+                             iothread_get_sched_policy,
+                             iothread_set_sched_policy, NULL);
+    object_property_add(obj, "sched-priority", "int",
+                        iothread_get_sched_priority,
+                        iothread_set_sched_priority, NULL, NULL, NULL);
+    object_property_add(obj, "node", "int",
+                        iothread_get_node, iothread_set_node,
+                        NULL, NULL, NULL);
+}
+
 static void iothread_instance_finalize(Object *obj)
 {
     IOThread *iothread = IOTHREAD(obj);
@@ -81,11 +387,19 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
         return;
     }
 
+    iothread_set_aio_context_params(iothread, &local_error);
+    if (local_error) {
+        error_propagate(errp, local_error);
+        aio_context_unref(iothread->ctx);
+        iothread->ctx = NULL;
+        return;
+    }
+
     qemu_mutex_init(&iothread->init_done_lock);
     qemu_cond_init(&iothread->init_done_cond);
 
-    /* This assumes we are called from a thread with useful CPU affinity for us
-     * to inherit.
+    /* Unless host-cpus is set, this assumes we are called from a thread
+     * with useful CPU affinity for us to inherit.
      */
     qemu_thread_create(&iothread->thread, "iothread", iothread_run,
                        iothread, QEMU_THREAD_JOINABLE);
@@ -97,6 +411,9 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
                        &iothread->init_done_lock);
     }
     qemu_mutex_unlock(&iothread->init_done_lock);
+
+    /* On failure, finalizing the object stops the thread again */
+    iothread_set_thread_params(iothread, true, errp);
 }
 
 static void iothread_class_init(ObjectClass *klass, void *class_data)
@@ -110,6 +427,7 @@ static const TypeInfo iothread_info = {
     .parent = TYPE_OBJECT,
     .class_init = iothread_class_init,
     .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
     .instance_finalize = iothread_instance_finalize,
     .interfaces = (InterfaceInfo[]) {
         {TYPE_USER_CREATABLE},
@@ -134,6 +452,14 @@ AioContext *iothread_get_aio_context(IOThread *iothread)
     return iothread->ctx;
 }
 
+IOThread *iothread_by_id(const char *id)
+{
+    return (IOThread *)
+        object_dynamic_cast(object_resolve_path_component(
+                                object_get_objects_root(), id),
+                            TYPE_IOTHREAD);
+}
+
 static int query_one_iothread(Object *object, void *opaque)
 {
     IOThreadInfoList ***prev = opaque;
@@ -149,6 +475,15 @@ static int query_one_iothread(Object *object, void *opaque)
     info = g_new0(IOThreadInfo, 1);
     info->id = iothread_get_id(iothread);
     info->thread_id = iothread->thread_id;
+    info->poll_max_ns = iothread->poll_max_ns;
+    info->poll_grow = iothread->poll_grow;
+    info->poll_shrink = iothread->poll_shrink;
+    info->poll_attempts = atomic_read(&iothread->ctx->poll_attempts);
+    info->poll_successes = atomic_read(&iothread->ctx->poll_successes);
+    info->idle_ns = atomic_read(&iothread->ctx->idle_ns);
+    info->busy_ns = atomic_read(&iothread->ctx->busy_ns);
+    info->wakeups = atomic_read(&iothread->ctx->wakeups);
+    info->dispatched = atomic_read(&iothread->ctx->dispatched);
 
     elem = g_new0(IOThreadInfoList, 1);
     elem->value = info;
@@ -34,6 +34,9 @@
 #include "exec/ram_addr.h"
 #include "exec/address-spaces.h"
 #include "qemu/event_notifier.h"
+#include "qemu/timer.h"
+#include "qemu/parallel.h"
+#include "qemu/thread.h"
 #include "trace.h"
 #include "hw/irq.h"
 
@@ -68,6 +71,8 @@ struct KVMState
     int vmfd;
     int coalesced_mmio;
     struct kvm_coalesced_mmio_ring *coalesced_mmio_ring;
+    /* KVM_GET_DIRTY_LOG leaves pages writable until KVM_CLEAR_DIRTY_LOG */
+    bool manual_dirty_log_protect;
     bool coalesced_flush_in_progress;
     int broken_set_mem_region;
     int vcpu_events;
@@ -93,6 +98,8 @@ struct KVMState
     unsigned int gsi_count;
     QTAILQ_HEAD(msi_hashtab, KVMMSIRoute) msi_hashtab[KVM_MSI_HASHTAB_SIZE];
     bool direct_msi;
+    int irq_route_changes;
+    bool irq_routes_dirty;
 #endif
     KVMMemoryListener memory_listener;
 };
@@ -106,6 +113,12 @@ bool kvm_irqfds_allowed;
 bool kvm_resamplefds_allowed;
 bool kvm_msi_via_irqfd_allowed;
 bool kvm_gsi_routing_allowed;
+
+/*
+ * Protects the slots of all KVMMemoryListeners, and their dirty_bmap:
+ * log_clear is called by the migration thread outside the BQL.
+ */
+static QemuMutex kml_slots_lock;
 bool kvm_gsi_direct_mapping;
 bool kvm_allowed;
 bool kvm_readonly_mem_allowed;
@@ -337,7 +350,9 @@ static void kvm_log_start(MemoryListener *listener,
         return;
     }
 
+    qemu_mutex_lock(&kml_slots_lock);
     r = kvm_section_update_flags(kml, section);
+    qemu_mutex_unlock(&kml_slots_lock);
     if (r < 0) {
         abort();
     }
@@ -354,31 +369,114 @@ static void kvm_log_stop(MemoryListener *listener,
         return;
     }
 
+    qemu_mutex_lock(&kml_slots_lock);
     r = kvm_section_update_flags(kml, section);
+    qemu_mutex_unlock(&kml_slots_lock);
     if (r < 0) {
         abort();
     }
 }
 
 /* get kvm's dirty pages bitmap and update qemu's */
+/*
+ * The dirty log of a slot is merged by up to KVM_DIRTY_LOG_THREADS
+ * threads, KVM_DIRTY_LOG_CHUNK host pages at a time. The dirty memory
+ * bitmaps are updated atomically, so the chunks only need to start on a
+ * word of the log.
+ */
+#define KVM_DIRTY_LOG_THREADS   8
+#define KVM_DIRTY_LOG_CHUNK     (1 << 18)
+
+typedef struct KVMDirtyLog {
+    unsigned long *bitmap;
+    ram_addr_t start;
+    ram_addr_t pages;
+} KVMDirtyLog;
+
+static void kvm_dirty_log_merge(void *opaque, int index)
+{
+    KVMDirtyLog *log = opaque;
+    ram_addr_t first = (ram_addr_t)index * KVM_DIRTY_LOG_CHUNK;
+
+    cpu_physical_memory_set_dirty_lebitmap(log->bitmap + first / HOST_LONG_BITS,
+                                           log->start + first * getpagesize(),
+                                           MIN(KVM_DIRTY_LOG_CHUNK,
+                                               log->pages - first));
+}
+
 static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
                                          unsigned long *bitmap)
 {
-    ram_addr_t start = section->offset_within_region + section->mr->ram_addr;
-    ram_addr_t pages = int128_get64(section->size) / getpagesize();
+    KVMDirtyLog log = {
+        .bitmap = bitmap,
+        .start = section->offset_within_region + section->mr->ram_addr,
+        .pages = int128_get64(section->size) / getpagesize(),
+    };
 
-    cpu_physical_memory_set_dirty_lebitmap(bitmap, start, pages);
+    parallel_for(DIV_ROUND_UP(log.pages, KVM_DIRTY_LOG_CHUNK),
+                 KVM_DIRTY_LOG_THREADS, kvm_dirty_log_merge, &log);
     return 0;
 }
 
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
+/*
+ * Re-protects the pages in [@first, @first + @count) of @mem, counted from
+ * the start of the slot, that were dirty in the last KVM_GET_DIRTY_LOG and
+ * have not been cleared since.  The kernel wants the range to start on a
+ * multiple of 64 pages, so the bitmap passed to it is built from
+ * mem->dirty_bmap, with the bits outside the range left clear.
+ */
+static int kvm_slot_clear_dirty(KVMMemoryListener *kml, KVMSlot *mem,
+                                uint64_t first, uint64_t count)
+{
+    uint64_t slot_pages = mem->memory_size >> TARGET_PAGE_BITS;
+    uint64_t start = first & ~63ULL;
+    uint64_t end = MIN(ROUND_UP(first + count, 64), slot_pages);
+    struct kvm_clear_dirty_log d = {};
+    uint8_t *bitmap;
+    bool found = false;
+    uint64_t i;
+    int ret = 0;
+
+    if (!mem->dirty_bmap || first >= end) {
+        return 0;
+    }
+
+    /* KVM's bitmaps are little endian arrays of 64-bit words */
+    bitmap = g_malloc0(ALIGN(end - start, 64) / 8);
+    for (i = first; i < MIN(first + count, slot_pages); i++) {
+        if (test_and_clear_bit(i, mem->dirty_bmap)) {
+            bitmap[(i - start) / 8] |= 1 << ((i - start) % 8);
+            found = true;
+        }
+    }
+
+    if (found) {
+        d.slot = mem->slot | (kml->as_id << 16);
+        d.first_page = start;
+        d.num_pages = end - start;
+        d.dirty_bitmap = bitmap;
+        if (kvm_vm_ioctl(kvm_state, KVM_CLEAR_DIRTY_LOG, &d) < 0) {
+            DPRINTF("KVM_CLEAR_DIRTY_LOG failed %d\n", errno);
+            ret = -1;
+        }
+    }
+    g_free(bitmap);
+    return ret;
+}
+
 /**
  * kvm_physical_sync_dirty_bitmap - Grab dirty bitmap from kernel space
  * This function updates qemu's dirty bitmap using
  * memory_region_set_dirty().  This means all bits are set
  * to dirty.
  *
+ * With manual dirty log protection the pages stay writable, and the bitmap
+ * is kept in the slot until memory_region_clear_dirty_log() re-protects
+ * them.  Regions that are not being migrated have no one to clear them,
+ * so their slots are cleared right away.
+ *
  * @start_add: start of logged region.
  * @end_addr: end of logged region.
  */
@@ -386,14 +484,13 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
                                           MemoryRegionSection *section)
 {
     KVMState *s = kvm_state;
-    unsigned long size, allocated_size = 0;
+    unsigned long size;
     struct kvm_dirty_log d = {};
     KVMSlot *mem;
     int ret = 0;
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + int128_get64(section->size);
 
-    d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(kml, start_addr, end_addr);
         if (mem == NULL) {
@@ -414,14 +511,12 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
          */
         size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
                      /*HOST_LONG_BITS*/ 64) / 8;
-        if (!d.dirty_bitmap) {
-            d.dirty_bitmap = g_malloc(size);
-        } else if (size > allocated_size) {
-            d.dirty_bitmap = g_realloc(d.dirty_bitmap, size);
+        if (!mem->dirty_bmap) {
+            mem->dirty_bmap = g_malloc(size);
         }
-        allocated_size = size;
-        memset(d.dirty_bitmap, 0, allocated_size);
+        memset(mem->dirty_bmap, 0, size);
 
+        d.dirty_bitmap = mem->dirty_bmap;
         d.slot = mem->slot | (kml->as_id << 16);
         if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
             DPRINTF("ioctl failed %d\n", errno);
@@ -430,9 +525,14 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
         }
 
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
+
+        if (s->manual_dirty_log_protect &&
+            !memory_region_is_logging(section->mr, DIRTY_MEMORY_MIGRATION)) {
+            kvm_slot_clear_dirty(kml, mem, 0,
+                                 mem->memory_size >> TARGET_PAGE_BITS);
+        }
         start_addr = mem->start_addr + mem->memory_size;
     }
-    g_free(d.dirty_bitmap);
 
     return ret;
 }
@@ -688,6 +788,8 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
 
         /* unregister the overlapping slot */
         mem->memory_size = 0;
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
         err = kvm_set_user_memory_region(kml, mem);
         if (err) {
             fprintf(stderr, "%s: error unregistering overlapping slot: %s\n",
@@ -792,7 +894,9 @@ static void kvm_region_add(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
     memory_region_ref(section->mr);
+    qemu_mutex_lock(&kml_slots_lock);
     kvm_set_phys_mem(kml, section, true);
+    qemu_mutex_unlock(&kml_slots_lock);
 }
 
 static void kvm_region_del(MemoryListener *listener,
@@ -800,7 +904,9 @@ static void kvm_region_del(MemoryListener *listener,
 {
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
+    qemu_mutex_lock(&kml_slots_lock);
     kvm_set_phys_mem(kml, section, false);
+    qemu_mutex_unlock(&kml_slots_lock);
     memory_region_unref(section->mr);
 }
 
@@ -810,7 +916,45 @@ static void kvm_log_sync(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
     int r;
 
+    qemu_mutex_lock(&kml_slots_lock);
     r = kvm_physical_sync_dirty_bitmap(kml, section);
+    qemu_mutex_unlock(&kml_slots_lock);
+    if (r < 0) {
+        abort();
+    }
+}
+
+static void kvm_log_clear(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
+    hwaddr start_addr = section->offset_within_address_space;
+    hwaddr end_addr = start_addr + int128_get64(section->size);
+    KVMSlot *mem;
+    int r = 0;
+
+    qemu_mutex_lock(&kml_slots_lock);
+    while (start_addr < end_addr) {
+        hwaddr slot_end;
+
+        mem = kvm_lookup_overlapping_slot(kml, start_addr, end_addr);
+        if (mem == NULL) {
+            break;
+        }
+
+        start_addr = MAX(start_addr, mem->start_addr);
+        slot_end = MIN(end_addr, mem->start_addr + mem->memory_size);
+        r = kvm_slot_clear_dirty(kml, mem,
+                                 (start_addr - mem->start_addr)
+                                 >> TARGET_PAGE_BITS,
+                                 DIV_ROUND_UP(slot_end - start_addr,
+                                              TARGET_PAGE_SIZE));
+        if (r < 0) {
+            break;
+        }
+        start_addr = mem->start_addr + mem->memory_size;
+    }
+    qemu_mutex_unlock(&kml_slots_lock);
     if (r < 0) {
         abort();
     }
@@ -902,6 +1046,9 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
     kml->listener.log_sync = kvm_log_sync;
+    if (s->manual_dirty_log_protect) {
+        kml->listener.log_clear = kvm_log_clear;
+    }
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -987,15 +1134,38 @@ void kvm_init_irq_routing(KVMState *s)
     kvm_arch_init_irq_routing(s);
 }
 
-void kvm_irqchip_commit_routes(KVMState *s)
+static void kvm_irqchip_set_gsi_routing(KVMState *s)
 {
     int ret;
 
+    s->irq_routes_dirty = false;
     s->irq_routes->flags = 0;
     ret = kvm_vm_ioctl(s, KVM_SET_GSI_ROUTING, s->irq_routes);
     assert(ret == 0);
 }
 
+void kvm_irqchip_commit_routes(KVMState *s)
+{
+    if (s->irq_route_changes) {
+        s->irq_routes_dirty = true;
+        return;
+    }
+    kvm_irqchip_set_gsi_routing(s);
+}
+
+void kvm_irqchip_begin_route_changes(KVMState *s)
+{
+    s->irq_route_changes++;
+}
+
+void kvm_irqchip_end_route_changes(KVMState *s)
+{
+    assert(s->irq_route_changes > 0);
+    if (--s->irq_route_changes == 0 && s->irq_routes_dirty) {
+        kvm_irqchip_set_gsi_routing(s);
+    }
+}
+
 static void kvm_add_routing_entry(KVMState *s,
                                   struct kvm_irq_routing_entry *entry)
 {
@@ -1176,8 +1346,10 @@ int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
         route->kroute.u.msi.address_hi = msg.address >> 32;
         route->kroute.u.msi.data = le32_to_cpu(msg.data);
 
+        /* the route is used right below, so it cannot wait for the end
+         * of a batch of route changes */
         kvm_add_routing_entry(s, &route->kroute);
-        kvm_irqchip_commit_routes(s);
+        kvm_irqchip_set_gsi_routing(s);
 
         QTAILQ_INSERT_TAIL(&s->msi_hashtab[kvm_hash_msi(msg.data)], route,
                            entry);
@@ -1332,6 +1504,14 @@ int kvm_irqchip_update_msi_route(KVMState *s, int virq, MSIMessage msg)
 {
     return -ENOSYS;
 }
+
+void kvm_irqchip_begin_route_changes(KVMState *s)
+{
+}
+
+void kvm_irqchip_end_route_changes(KVMState *s)
+{
+}
 #endif /* !KVM_CAP_IRQ_ROUTING */
 
 int kvm_irqchip_add_irqfd_notifier_gsi(KVMState *s, EventNotifier *n,
@@ -1568,6 +1748,14 @@ static int kvm_init(MachineState *ms)
 
     s->coalesced_mmio = kvm_check_extension(s, KVM_CAP_COALESCED_MMIO);
 
+    qemu_mutex_init(&kml_slots_lock);
+    s->manual_dirty_log_protect =
+        kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2) > 0;
+    if (s->manual_dirty_log_protect &&
+        kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0, 1) < 0) {
+        s->manual_dirty_log_protect = false;
+    }
+
     s->broken_set_mem_region = 1;
     ret = kvm_check_extension(s, KVM_CAP_JOIN_MEMORY_REGIONS_WORKS);
     if (ret > 0) {
@@ -1736,6 +1924,62 @@ void kvm_flush_coalesced_mmio_buffer(void)
     s->coalesced_flush_in_progress = false;
 }
 
+/* Coalesced writes are only delivered when a region that needs the buffer
+ * flushed is accessed.  While a region asks for it, the main loop also
+ * drains the buffer every KVM_COALESCED_DRAIN_MIN_NS, backing off up to
+ * KVM_COALESCED_DRAIN_MAX_NS while it stays empty, so that writes to
+ * doorbell registers reach the device in batches but in bounded time.
+ */
+#define KVM_COALESCED_DRAIN_MIN_NS  (100 * SCALE_US)
+#define KVM_COALESCED_DRAIN_MAX_NS  (10 * SCALE_MS)
+
+static QEMUTimer *coalesced_drain_timer;
+static int64_t coalesced_drain_ns;
+static unsigned coalesced_drain_users;
+
+static void kvm_coalesced_mmio_drain(void *opaque)
+{
+    struct kvm_coalesced_mmio_ring *ring = kvm_state->coalesced_mmio_ring;
+
+    if (ring && ring->first != ring->last) {
+        kvm_flush_coalesced_mmio_buffer();
+        coalesced_drain_ns = KVM_COALESCED_DRAIN_MIN_NS;
+    } else {
+        coalesced_drain_ns = MIN(coalesced_drain_ns * 2,
+                                 KVM_COALESCED_DRAIN_MAX_NS);
+    }
+    timer_mod(coalesced_drain_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + coalesced_drain_ns);
+}
+
+void kvm_coalesced_mmio_drain_ref(void)
+{
+    if (!kvm_state->coalesced_mmio || coalesced_drain_users++) {
+        return;
+    }
+
+    coalesced_drain_timer = timer_new_ns(QEMU_CLOCK_REALTIME,
+                                         kvm_coalesced_mmio_drain, NULL);
+    coalesced_drain_ns = KVM_COALESCED_DRAIN_MIN_NS;
+    timer_mod(coalesced_drain_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + coalesced_drain_ns);
+}
+
+void kvm_coalesced_mmio_drain_unref(void)
+{
+    if (!kvm_state->coalesced_mmio) {
+        return;
+    }
+
+    assert(coalesced_drain_users);
+    if (--coalesced_drain_users) {
+        return;
+    }
+    timer_del(coalesced_drain_timer);
+    timer_free(coalesced_drain_timer);
+    coalesced_drain_timer = NULL;
+}
+
 static void do_kvm_cpu_synchronize_state(void *arg)
 {
     CPUState *cpu = arg;
@@ -40,6 +40,14 @@ void kvm_flush_coalesced_mmio_buffer(void)
 {
 }
 
+void kvm_coalesced_mmio_drain_ref(void)
+{
+}
+
+void kvm_coalesced_mmio_drain_unref(void)
+{
+}
+
 void kvm_cpu_synchronize_state(CPUState *cpu)
 {
 }
@@ -133,6 +141,14 @@ int kvm_irqchip_update_msi_route(KVMState *s, int virq, MSIMessage msg)
     return -ENOSYS;
 }
 
+void kvm_irqchip_begin_route_changes(KVMState *s)
+{
+}
+
+void kvm_irqchip_end_route_changes(KVMState *s)
+{
+}
+
 int kvm_irqchip_add_adapter_route(KVMState *s, AdapterInfo *adapter)
 {
     return -ENOSYS;
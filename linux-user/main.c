@@ -31,12 +31,15 @@
 #include "cpu.h"
 #include "tcg.h"
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
 #include "qemu/envlist.h"
 #include "elf.h"
 
 char *exec_path;
 
 int singlestep;
+int tcg_perfmap;
+int tcg_tb_stats;
 const char *filename;
 const char *argv0;
 int gdbstub_port;
@@ -446,6 +449,38 @@ void cpu_loop(CPUX86State *env)
     })
 
 #ifdef TARGET_ABI32
+/*
+ * Compare-and-swap of the 1 << @size bytes at @addr, with a host atomic
+ * so that the other guest threads need not be stopped as with
+ * start_exclusive().  @cmp and @val are what the memory holds, i.e. in
+ * guest byte order.
+ *
+ * Returns 0 if @val was stored, 1 if the memory did not hold @cmp, and
+ * -1 if @addr is not writable.
+ */
+static int arm_cmpxchg(abi_ulong addr, int size, uint64_t cmp, uint64_t val)
+{
+    void *p;
+
+    if (!access_ok(VERIFY_WRITE, addr, 1 << size)) {
+        return -1;
+    }
+    p = g2h(addr);
+
+    switch (size) {
+    case 0:
+        return atomic_cmpxchg((uint8_t *)p, cmp, val) != (uint8_t)cmp;
+    case 1:
+        return atomic_cmpxchg((uint16_t *)p, cmp, val) != (uint16_t)cmp;
+    case 2:
+        return atomic_cmpxchg((uint32_t *)p, cmp, val) != (uint32_t)cmp;
+    case 3:
+        return atomic_cmpxchg((uint64_t *)p, cmp, val) != cmp;
+    default:
+        abort();
+    }
+}
+
 /* Commpage handling -- there is no commpage for AArch64 */
 
 /*
@@ -464,17 +499,13 @@ void cpu_loop(CPUX86State *env)
  */
 static void arm_kernel_cmpxchg64_helper(CPUARMState *env)
 {
-    uint64_t oldval, newval, val;
+    uint64_t oldval, newval;
     uint32_t addr, cpsr;
     target_siginfo_t info;
+    int ret;
 
     /* Based on the 32 bit code in do_kernel_trap */
 
-    /* XXX: This only works between threads, not between processes.
-       It's probably possible to implement this with native host
-       operations. However things like ldrex/strex are much harder so
-       there's not much point trying.  */
-    start_exclusive();
     cpsr = cpsr_read(env);
     addr = env->regs[2];
 
@@ -488,19 +519,13 @@ static void arm_kernel_cmpxchg64_helper(CPUARMState *env)
         goto segv;
     };
 
-    if (get_user_u64(val, addr)) {
+    ret = arm_cmpxchg(addr, 3, tswap64(oldval), tswap64(newval));
+    if (ret < 0) {
         env->exception.vaddress = addr;
         goto segv;
     }
 
-    if (val == oldval) {
-        val = newval;
-
-        if (put_user_u64(val, addr)) {
-            env->exception.vaddress = addr;
-            goto segv;
-        };
-
+    if (ret == 0) {
         env->regs[0] = 0;
         cpsr |= CPSR_C;
     } else {
@@ -508,11 +533,9 @@ static void arm_kernel_cmpxchg64_helper(CPUARMState *env)
         cpsr &= ~CPSR_C;
     }
     cpsr_write(env, cpsr, CPSR_C);
-    end_exclusive();
     return;
 
 segv:
-    end_exclusive();
     /* We get the PC of the entry address - which is as good as anything,
        on a real kernel what you get depends on which mode it uses. */
     info.si_signo = TARGET_SIGSEGV;
@@ -529,27 +552,17 @@ do_kernel_trap(CPUARMState *env)
 {
     uint32_t addr;
     uint32_t cpsr;
-    uint32_t val;
 
     switch (env->regs[15]) {
     case 0xffff0fa0: /* __kernel_memory_barrier */
-        /* ??? No-op. Will need to do better for SMP.  */
+        smp_mb();
         break;
     case 0xffff0fc0: /* __kernel_cmpxchg */
-         /* XXX: This only works between threads, not between processes.
-            It's probably possible to implement this with native host
-            operations. However things like ldrex/strex are much harder so
-            there's not much point trying.  */
-        start_exclusive();
         cpsr = cpsr_read(env);
         addr = env->regs[2];
         /* FIXME: This should SEGV if the access fails.  */
-        if (get_user_u32(val, addr))
-            val = ~env->regs[0];
-        if (val == env->regs[0]) {
-            val = env->regs[1];
-            /* FIXME: Check for segfaults.  */
-            put_user_u32(val, addr);
+        if (arm_cmpxchg(addr, 2, tswap32(env->regs[0]),
+                        tswap32(env->regs[1])) == 0) {
             env->regs[0] = 0;
             cpsr |= CPSR_C;
         } else {
@@ -557,7 +570,6 @@ do_kernel_trap(CPUARMState *env)
             cpsr &= ~CPSR_C;
         }
         cpsr_write(env, cpsr, CPSR_C);
-        end_exclusive();
         break;
     case 0xffff0fe0: /* __kernel_get_tls */
         env->regs[0] = cpu_get_tls(env);
@@ -580,15 +592,22 @@ do_kernel_trap(CPUARMState *env)
     return 0;
 }
 
-/* Store exclusive handling for AArch32 */
+/* Store exclusive handling for AArch32
+ *
+ * The store is done with a compare-and-swap against the value that the
+ * load exclusive returned, so the other threads keep running meanwhile.
+ * Unlike a real monitor this misses a store of that same value in
+ * between, which guest code cannot rely on anyway.
+ */
 static int do_strex(CPUARMState *env)
 {
-    uint64_t val;
+    uint64_t cmp, val;
+    uint32_t pair[2];
     int size;
     int rc = 1;
     int segv = 0;
     uint32_t addr;
-    start_exclusive();
+
     if (env->exclusive_addr != env->exclusive_test) {
         goto fail;
     }
@@ -599,68 +618,42 @@ static int do_strex(CPUARMState *env)
     assert(extract64(env->exclusive_addr, 32, 32) == 0);
     addr = env->exclusive_addr;
     size = env->exclusive_info & 0xf;
+    val = env->regs[(env->exclusive_info >> 8) & 0xf];
     switch (size) {
     case 0:
-        segv = get_user_u8(val, addr);
+        cmp = env->exclusive_val;
         break;
     case 1:
-        segv = get_user_u16(val, addr);
+        cmp = tswap16(env->exclusive_val);
+        val = tswap16(val);
         break;
     case 2:
+        cmp = tswap32(env->exclusive_val);
+        val = tswap32(val);
+        break;
     case 3:
-        segv = get_user_u32(val, addr);
+        /* two words, each in guest order, the low one first */
+        pair[0] = tswap32(env->exclusive_val);
+        pair[1] = tswap32(env->exclusive_val >> 32);
+        memcpy(&cmp, pair, sizeof(cmp));
+        pair[0] = tswap32(val);
+        pair[1] = tswap32(env->regs[(env->exclusive_info >> 12) & 0xf]);
+        memcpy(&val, pair, sizeof(val));
         break;
     default:
         abort();
     }
-    if (segv) {
-        env->exception.vaddress = addr;
-        goto done;
-    }
-    if (size == 3) {
-        uint32_t valhi;
-        segv = get_user_u32(valhi, addr + 4);
-        if (segv) {
-            env->exception.vaddress = addr + 4;
-            goto done;
-        }
-        val = deposit64(val, 32, 32, valhi);
-    }
-    if (val != env->exclusive_val) {
-        goto fail;
-    }
 
-    val = env->regs[(env->exclusive_info >> 8) & 0xf];
-    switch (size) {
-    case 0:
-        segv = put_user_u8(val, addr);
-        break;
-    case 1:
-        segv = put_user_u16(val, addr);
-        break;
-    case 2:
-    case 3:
-        segv = put_user_u32(val, addr);
-        break;
-    }
-    if (segv) {
+    rc = arm_cmpxchg(addr, size, cmp, val);
+    if (rc < 0) {
         env->exception.vaddress = addr;
+        segv = 1;
         goto done;
     }
-    if (size == 3) {
-        val = env->regs[(env->exclusive_info >> 12) & 0xf];
-        segv = put_user_u32(val, addr + 4);
-        if (segv) {
-            env->exception.vaddress = addr + 4;
-            goto done;
-        }
-    }
-    rc = 0;
 fail:
     env->regs[15] += 4;
     env->regs[(env->exclusive_info >> 4) & 0xf] = rc;
 done:
-    end_exclusive();
     return segv;
 }
 
@@ -3633,6 +3626,11 @@ static void handle_arg_singlestep(const char *arg)
     singlestep = 1;
 }
 
+static void handle_arg_perfmap(const char *arg)
+{
+    tcg_perfmap = 1;
+}
+
 static void handle_arg_strace(const char *arg)
 {
     do_strace = 1;
@@ -3688,6 +3686,8 @@ static const struct qemu_argument arg_table[] = {
      "pagesize",   "set the host page size to 'pagesize'"},
     {"singlestep", "QEMU_SINGLESTEP",  false, handle_arg_singlestep,
      "",           "run in singlestep mode"},
+    {"perfmap",    "QEMU_PERFMAP",     false, handle_arg_perfmap,
+     "",           "write /tmp/perf-<pid>.map for perf"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
     {"seed",       "QEMU_RAND_SEED",   true,  handle_arg_randseed,
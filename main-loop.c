@@ -33,6 +33,8 @@
 #ifndef _WIN32
 
 #include "qemu/compatfd.h"
+#include "trace.h"
+#include "trace/flight-recorder.h"
 
 /* If we have signalfd, we mask out the signals we want to handle and then
  * use signalfd to listen for them.  We rely on whatever the current signal
@@ -166,6 +168,27 @@ int qemu_init_main_loop(Error **errp)
 
 static int max_priority;
 
+/* When the previous poll returned, or 0 before the first one */
+static int64_t main_loop_busy_since;
+
+/* Records how long the main loop was busy since the previous poll */
+static void main_loop_poll_begin(void)
+{
+    int64_t ns;
+
+    if (main_loop_busy_since) {
+        ns = get_clock() - main_loop_busy_since;
+        trace_main_loop_busy(ns);
+        flight_recorder_record(TRACE_MAIN_LOOP_BUSY, ns);
+        flight_recorder_check(FLIGHT_RECORDER_TRIGGER_MAIN_LOOP, ns);
+    }
+}
+
+static void main_loop_poll_end(void)
+{
+    main_loop_busy_since = get_clock();
+}
+
 #ifndef _WIN32
 static int glib_pollfds_idx;
 static int glib_n_poll_fds;
@@ -237,6 +260,7 @@ static int os_host_main_loop_wait(int64_t timeout)
         timeout = SCALE_MS;
     }
 
+    main_loop_poll_begin();
     if (timeout) {
         spin_counter = 0;
         qemu_mutex_unlock_iothread();
@@ -249,6 +273,7 @@ static int os_host_main_loop_wait(int64_t timeout)
     if (timeout) {
         qemu_mutex_lock_iothread();
     }
+    main_loop_poll_end();
 
     glib_pollfds_poll();
     return ret;
@@ -448,10 +473,12 @@ static int os_host_main_loop_wait(int64_t timeout)
 
     poll_timeout_ns = qemu_soonest_timeout(poll_timeout_ns, timeout);
 
+    main_loop_poll_begin();
     qemu_mutex_unlock_iothread();
     g_poll_ret = qemu_poll_ns(poll_fds, n_poll_fds + w->num, poll_timeout_ns);
 
     qemu_mutex_lock_iothread();
+    main_loop_poll_end();
     if (g_poll_ret > 0) {
         for (i = 0; i < w->num; i++) {
             w->revents[i] = poll_fds[n_poll_fds + i].revents;
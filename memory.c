@@ -41,6 +41,12 @@ static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
 static QTAILQ_HEAD(, AddressSpace) address_spaces
     = QTAILQ_HEAD_INITIALIZER(address_spaces);
 
+/* The FlatViews built by the last transaction, keyed by the (simplified)
+ * root they were rendered from.  Address spaces with the same root share
+ * one view, and a view stays valid until a region below its root changes.
+ */
+static GHashTable *flat_views;
+
 typedef struct AddrRange AddrRange;
 
 /*
@@ -292,11 +298,48 @@ static void flatview_ref(FlatView *view)
     atomic_inc(&view->ref);
 }
 
+/* For readers under RCU, which may find a view whose last reference is
+ * being dropped.
+ */
+static bool flatview_tryref(FlatView *view)
+{
+    unsigned ref = atomic_read(&view->ref);
+    unsigned old;
+
+    while (ref) {
+        old = atomic_cmpxchg(&view->ref, ref, ref + 1);
+        if (old == ref) {
+            return true;
+        }
+        ref = old;
+    }
+    return false;
+}
+
+/* A view can be shared by several address spaces, so the RCU grace period
+ * starts only when the last of them lets go of it.
+ */
 static void flatview_unref(FlatView *view)
 {
     if (atomic_fetch_dec(&view->ref) == 1) {
-        flatview_destroy(view);
+        call_rcu(view, flatview_destroy, rcu);
+    }
+}
+
+static bool flatview_equal(FlatView *a, FlatView *b)
+{
+    unsigned i;
+
+    if (a->nr != b->nr) {
+        return false;
     }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i])
+            || a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
 }
 
 static bool can_merge(FlatRange *r1, FlatRange *r2)
@@ -683,8 +726,9 @@ static FlatView *address_space_get_flatview(AddressSpace *as)
     FlatView *view;
 
     rcu_read_lock();
-    view = atomic_rcu_read(&as->current_map);
-    flatview_ref(view);
+    do {
+        view = atomic_rcu_read(&as->current_map);
+    } while (!flatview_tryref(view));
     rcu_read_unlock();
     return view;
 }
@@ -791,17 +835,180 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
+/* Strip containers and aliases that just pass a single region through
+ * unchanged, so that e.g. the bus master address spaces of all PCI devices
+ * end up with the same root as the bus address space and share its view.
+ * Returns NULL if nothing at all would be rendered.
+ */
+static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
+{
+    MemoryRegion *child, *next;
+    unsigned found;
+
+    while (mr && mr->enabled) {
+        if (mr->addr || mr->readonly) {
+            return mr;
+        }
+        if (mr->alias) {
+            if (mr->alias_offset || mr->alias->addr
+                || int128_lt(mr->size, mr->alias->size)) {
+                return mr;
+            }
+            mr = mr->alias;
+            continue;
+        }
+        if (mr->terminates) {
+            return mr;
+        }
+
+        found = 0;
+        next = NULL;
+        QTAILQ_FOREACH(child, &mr->subregions, subregions_link) {
+            if (child->enabled) {
+                found++;
+                next = child;
+            }
+        }
+        if (!found) {
+            return NULL;
+        }
+        if (found > 1 || next->addr || int128_lt(mr->size, next->size)) {
+            return mr;
+        }
+        mr = next;
+    }
+    return NULL;
+}
+
+static void flat_views_key_unref(gpointer key)
+{
+    if (key) {
+        memory_region_unref(key);
+    }
+}
+
+static void flat_views_value_unref(gpointer value)
+{
+    flatview_unref(value);
+}
+
+/* Called whenever the rendering of @mr may have changed (NULL: anything
+ * may have changed).  Drops the views of every root that @mr is found
+ * under.  Regions below an alias can show up under any root, so changing
+ * them throws away everything.
+ */
+static void flat_views_invalidate(MemoryRegion *mr)
+{
+    if (!flat_views) {
+        return;
+    }
+    while (mr && !mr->alias_count) {
+        g_hash_table_remove(flat_views, mr);
+        if (!mr->container) {
+            return;
+        }
+        mr = mr->container;
+    }
+    g_hash_table_remove_all(flat_views);
+}
+
+static FlatView *address_space_get_next_flatview(AddressSpace *as)
+{
+    MemoryRegion *root = memory_region_get_flatview_root(as->root);
+
+    return g_hash_table_lookup(flat_views, root);
+}
+
+/* Renders the views of the roots that were invalidated since the last
+ * transaction, once per root, and drops those no address space uses
+ * anymore.  A view that renders the same as an address space's current
+ * one is replaced by the latter, so that the address space can skip the
+ * listener replay.
+ */
+static void flat_views_reset(void)
+{
+    GHashTable *old_views = flat_views;
+    AddressSpace *as;
+
+    flat_views = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                       flat_views_key_unref,
+                                       flat_views_value_unref);
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        MemoryRegion *root = memory_region_get_flatview_root(as->root);
+        FlatView *view;
+
+        if (g_hash_table_lookup_extended(flat_views, root, NULL, NULL)) {
+            continue;
+        }
+        view = old_views ? g_hash_table_lookup(old_views, root) : NULL;
+        if (view) {
+            flatview_ref(view);
+        } else {
+            view = generate_memory_topology(root);
+            if (flatview_equal(view, as->current_map)) {
+                flatview_unref(view);
+                view = as->current_map;
+                flatview_ref(view);
+            }
+        }
+        if (root) {
+            memory_region_ref(root);
+        }
+        g_hash_table_insert(flat_views, root, view);
+    }
+
+    if (old_views) {
+        g_hash_table_destroy(old_views);
+    }
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        as->current_map_changed =
+            address_space_get_next_flatview(as) != as->current_map;
+    }
+}
+
+/* Listeners that follow a single address space need not hear about the
+ * transaction if the view of that address space is unchanged.
+ */
+static void memory_listeners_call_topology(bool begin)
+{
+    MemoryListener *listener;
+    AddressSpace *as;
+
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        as = listener->address_space_filter;
+        if (as && !as->current_map_changed) {
+            continue;
+        }
+        if (begin && listener->begin) {
+            listener->begin(listener);
+        } else if (!begin && listener->commit) {
+            listener->commit(listener);
+        }
+    }
+}
+
 static void address_space_update_topology(AddressSpace *as)
 {
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    FlatView *new_view = address_space_get_next_flatview(as);
+
+    if (!as->current_map_changed) {
+        flatview_unref(old_view);
+        if (ioeventfd_update_pending) {
+            address_space_update_ioeventfds(as);
+        }
+        return;
+    }
+    flatview_ref(new_view);
 
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
 
     /* Writes are protected by the BQL.  */
     atomic_rcu_set(&as->current_map, new_view);
-    call_rcu(old_view, flatview_unref, rcu);
+    flatview_unref(old_view);
 
     /* Note that all the old MemoryRegions are still alive up to this
      * point.  This relieves most MemoryListeners from the need to
@@ -834,13 +1041,14 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
-            MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
+            flat_views_reset();
+            memory_listeners_call_topology(true);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_topology(as);
             }
 
-            MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+            memory_listeners_call_topology(false);
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -1123,6 +1331,32 @@ static MemTxResult memory_region_dispatch_read1(MemoryRegion *mr,
     }
 }
 
+/* Accesses that the device implements as is (without a validity callback,
+ * splitting or widening) go straight to ops->read and ops->write.  This is
+ * the common case for doorbell-style registers.
+ */
+static void memory_region_update_direct_access(MemoryRegion *mr)
+{
+    const MemoryRegionOps *ops = mr->ops;
+    unsigned min = ops->impl.min_access_size ? : 1;
+    unsigned max = ops->impl.max_access_size ? : 4;
+    unsigned size;
+
+    mr->direct_access_sizes = 0;
+    if (!ops->read || !ops->write || ops->valid.accepts) {
+        return;
+    }
+    for (size = min; size <= max && size <= 8; size <<= 1) {
+        mr->direct_access_sizes |= size;
+    }
+}
+
+static inline bool memory_region_access_direct(MemoryRegion *mr,
+                                               hwaddr addr, unsigned size)
+{
+    return (mr->direct_access_sizes & size) && !(addr & (size - 1));
+}
+
 MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
                                         hwaddr addr,
                                         uint64_t *pval,
@@ -1131,6 +1365,15 @@ MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
 {
     MemTxResult r;
 
+    if (memory_region_access_direct(mr, addr, size)) {
+        uint64_t tmp = mr->ops->read(mr->opaque, addr, size);
+
+        trace_memory_region_ops_read(mr, addr, tmp, size);
+        *pval = tmp & (-1ULL >> (64 - size * 8));
+        adjust_endianness(mr, pval, size);
+        return MEMTX_OK;
+    }
+
     if (!memory_region_access_valid(mr, addr, size, false)) {
         *pval = unassigned_mem_read(mr, addr, size);
         return MEMTX_DECODE_ERROR;
@@ -1147,6 +1390,14 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
                                          unsigned size,
                                          MemTxAttrs attrs)
 {
+    if (memory_region_access_direct(mr, addr, size)) {
+        adjust_endianness(mr, &data, size);
+        data &= -1ULL >> (64 - size * 8);
+        trace_memory_region_ops_write(mr, addr, data, size);
+        mr->ops->write(mr->opaque, addr, data, size);
+        return MEMTX_OK;
+    }
+
     if (!memory_region_access_valid(mr, addr, size, true)) {
         unassigned_mem_write(mr, addr, data, size);
         return MEMTX_DECODE_ERROR;
@@ -1185,6 +1436,7 @@ void memory_region_init_io(MemoryRegion *mr,
     mr->ops = ops;
     mr->opaque = opaque;
     mr->terminates = true;
+    memory_region_update_direct_access(mr);
 }
 
 void memory_region_init_ram(MemoryRegion *mr,
@@ -1269,6 +1521,7 @@ void memory_region_init_alias(MemoryRegion *mr,
     memory_region_init(mr, owner, name, size);
     mr->alias = orig;
     mr->alias_offset = offset;
+    orig->alias_count++;
 }
 
 void memory_region_init_rom_device(MemoryRegion *mr,
@@ -1284,6 +1537,7 @@ void memory_region_init_rom_device(MemoryRegion *mr,
     mr->opaque = opaque;
     mr->terminates = true;
     mr->rom_device = true;
+    memory_region_update_direct_access(mr);
     mr->destructor = memory_region_destructor_rom_device;
     mr->ram_addr = qemu_ram_alloc(size, mr, errp);
 }
@@ -1321,6 +1575,7 @@ static void memory_region_finalize(Object *obj)
      * and cause an infinite loop.
      */
     mr->enabled = false;
+    flat_views_invalidate(mr);
     memory_region_transaction_begin();
     while (!QTAILQ_EMPTY(&mr->subregions)) {
         MemoryRegion *subregion = QTAILQ_FIRST(&mr->subregions);
@@ -1452,6 +1707,7 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
+    flat_views_invalidate(mr);
     memory_region_update_pending |= mr->enabled;
     memory_region_transaction_commit();
 }
@@ -1479,6 +1735,25 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
                                                     size, client);
 }
 
+DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
+                                                            hwaddr addr,
+                                                            hwaddr size,
+                                                            unsigned client)
+{
+    assert(mr->ram_addr != RAM_ADDR_INVALID);
+    return cpu_physical_memory_snapshot_and_clear_dirty(mr->ram_addr + addr,
+                                                        size, client);
+}
+
+bool memory_region_snapshot_get_dirty(MemoryRegion *mr,
+                                      DirtyBitmapSnapshot *snap,
+                                      hwaddr addr, hwaddr size)
+{
+    assert(mr->ram_addr != RAM_ADDR_INVALID);
+    return cpu_physical_memory_snapshot_get_dirty(snap, mr->ram_addr + addr,
+                                                  size);
+}
+
 
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
 {
@@ -1496,11 +1771,52 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_dirty_log(MemoryRegion *mr, hwaddr start,
+                                   hwaddr size)
+{
+    MemoryListener *listener;
+    AddressSpace *as;
+    FlatView *view;
+    FlatRange *fr;
+
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        as = listener->address_space_filter;
+        if (!listener->log_clear || !as) {
+            continue;
+        }
+
+        view = address_space_get_flatview(as);
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            hwaddr fr_start = fr->offset_in_region;
+            hwaddr fr_end = fr_start + int128_get64(fr->addr.size);
+            hwaddr clear_start = MAX(start, fr_start);
+            hwaddr clear_end = MIN(start + size, fr_end);
+            MemoryRegionSection section;
+
+            if (fr->mr != mr || clear_start >= clear_end) {
+                continue;
+            }
+            section = (MemoryRegionSection) {
+                .mr = mr,
+                .address_space = as,
+                .offset_within_region = clear_start,
+                .size = int128_make64(clear_end - clear_start),
+                .offset_within_address_space =
+                    int128_get64(fr->addr.start) + (clear_start - fr_start),
+                .readonly = fr->readonly,
+            };
+            listener->log_clear(listener, &section);
+        }
+        flatview_unref(view);
+    }
+}
+
 void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
 {
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
+        flat_views_invalidate(mr);
         memory_region_update_pending |= mr->enabled;
         memory_region_transaction_commit();
     }
@@ -1511,6 +1827,7 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
+        flat_views_invalidate(mr);
         memory_region_update_pending |= mr->enabled;
         memory_region_transaction_commit();
     }
@@ -1624,6 +1941,10 @@ void memory_region_clear_coalescing(MemoryRegion *mr)
 
     qemu_flush_coalesced_mmio_buffer();
     mr->flush_coalesced_mmio = false;
+    if (mr->coalescing_drain) {
+        mr->coalescing_drain = false;
+        qemu_coalesced_mmio_drain_unref();
+    }
 
     while (!QTAILQ_EMPTY(&mr->coalesced)) {
         cmr = QTAILQ_FIRST(&mr->coalesced);
@@ -1637,6 +1958,14 @@ void memory_region_clear_coalescing(MemoryRegion *mr)
     }
 }
 
+void memory_region_set_coalescing_drain(MemoryRegion *mr)
+{
+    if (!mr->coalescing_drain) {
+        mr->coalescing_drain = true;
+        qemu_coalesced_mmio_drain_ref();
+    }
+}
+
 void memory_region_set_flush_coalesced(MemoryRegion *mr)
 {
     mr->flush_coalesced_mmio = true;
@@ -1764,6 +2093,7 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
+    flat_views_invalidate(mr);
     memory_region_update_pending |= mr->enabled && subregion->enabled;
     memory_region_transaction_commit();
 }
@@ -1805,6 +2135,7 @@ void memory_region_del_subregion(MemoryRegion *mr,
     subregion->container = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
     memory_region_unref(subregion);
+    flat_views_invalidate(mr);
     memory_region_update_pending |= mr->enabled && subregion->enabled;
     memory_region_transaction_commit();
 }
@@ -1816,6 +2147,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
+    flat_views_invalidate(mr);
     memory_region_update_pending = true;
     memory_region_transaction_commit();
 }
@@ -1832,6 +2164,7 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
     }
     memory_region_transaction_begin();
     mr->size = s;
+    flat_views_invalidate(mr);
     memory_region_update_pending = true;
     memory_region_transaction_commit();
 }
@@ -1869,6 +2202,7 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
+    flat_views_invalidate(mr);
     memory_region_update_pending |= mr->enabled;
     memory_region_transaction_commit();
 }
@@ -1997,6 +2331,7 @@ void memory_global_dirty_log_start(void)
 
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
     memory_region_transaction_begin();
+    flat_views_invalidate(NULL);
     memory_region_update_pending = true;
     memory_region_transaction_commit();
 }
@@ -2007,6 +2342,7 @@ void memory_global_dirty_log_stop(void)
 
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
     memory_region_transaction_begin();
+    flat_views_invalidate(NULL);
     memory_region_update_pending = true;
     memory_region_transaction_commit();
 
@@ -35,6 +35,7 @@
 #define BLK_MIG_FLAG_ZERO_BLOCK         0x08
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
+#define MAX_ZERO_SEARCH         (1 << 21)
 
 //#define DEBUG_BLK_MIGRATION
 
@@ -118,9 +119,23 @@ static void blk_mig_unlock(void)
  * or the VM will stall.
  */
 
-static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+static void blk_send_header(QEMUFile *f, BlkMigDevState *bmds,
+                            int64_t sector, uint64_t flags)
 {
     int len;
+
+    /* sector number and flags */
+    qemu_put_be64(f, (sector << BDRV_SECTOR_BITS)
+                     | flags);
+
+    /* device name */
+    len = strlen(bdrv_get_device_name(bmds->bs));
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (uint8_t *)bdrv_get_device_name(bmds->bs), len);
+}
+
+static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+{
     uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
 
     if (block_mig_state.zero_blocks &&
@@ -128,14 +143,7 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
         flags |= BLK_MIG_FLAG_ZERO_BLOCK;
     }
 
-    /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | flags);
-
-    /* device name */
-    len = strlen(bdrv_get_device_name(blk->bmds->bs));
-    qemu_put_byte(f, len);
-    qemu_put_buffer(f, (uint8_t *)bdrv_get_device_name(blk->bmds->bs), len);
+    blk_send_header(f, blk->bmds, blk->sector, flags);
 
     /* if a block is zero we need to flush here since the network
      * bandwidth is now a lot higher than the storage device bandwidth.
@@ -250,6 +258,28 @@ static void blk_mig_read_cb(void *opaque, int ret)
     blk_mig_unlock();
 }
 
+/* Called with iothread lock taken.  Returns the number of sectors from the
+ * chunk-aligned @sector on that read as zeroes, in whole chunks except at
+ * the end of the device.
+ */
+
+static int64_t bmds_zero_sectors(BlkMigDevState *bmds, int64_t sector)
+{
+    int64_t count = MIN(bmds->total_sectors - sector, MAX_ZERO_SEARCH);
+    int64_t ret;
+    int pnum;
+
+    /* the whole backing chain, since the destination has none of it */
+    ret = bdrv_get_block_status_above(bmds->bs, NULL, sector, count, &pnum);
+    if (ret < 0 || !(ret & BDRV_BLOCK_ZERO)) {
+        return 0;
+    }
+    if (pnum == count && sector + count == bmds->total_sectors) {
+        return pnum;
+    }
+    return pnum & ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+}
+
 /* Called with no lock taken.  */
 
 static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
@@ -258,6 +288,7 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     int64_t cur_sector = bmds->cur_sector;
     BlockDriverState *bs = bmds->bs;
     BlkMigBlock *blk;
+    int64_t zero_sectors, sector;
     int nr_sectors;
 
     if (bmds->shared_base) {
@@ -286,12 +317,47 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
         nr_sectors = total_sectors - cur_sector;
     }
 
+    /* Chunks that read as zeroes are not read from disk.  With the
+     * zero-blocks capability only their headers are sent, so a whole run of
+     * them goes out at once; otherwise a zeroed buffer stands in for the
+     * read.
+     */
+    qemu_mutex_lock_iothread();
+    zero_sectors = bmds_zero_sectors(bmds, cur_sector);
+    if (zero_sectors && block_mig_state.zero_blocks) {
+        bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, cur_sector, zero_sectors);
+        qemu_mutex_unlock_iothread();
+
+        for (sector = cur_sector; sector < cur_sector + zero_sectors;
+             sector += BDRV_SECTORS_PER_DIRTY_CHUNK) {
+            blk_send_header(f, bmds, sector, BLK_MIG_FLAG_DEVICE_BLOCK |
+                                             BLK_MIG_FLAG_ZERO_BLOCK);
+        }
+        bmds->cur_sector = cur_sector + zero_sectors;
+        return (bmds->cur_sector >= total_sectors);
+    }
+
     blk = g_new(BlkMigBlock, 1);
-    blk->buf = g_malloc(BLOCK_SIZE);
     blk->bmds = bmds;
     blk->sector = cur_sector;
     blk->nr_sectors = nr_sectors;
 
+    if (zero_sectors) {
+        blk->buf = g_malloc0(BLOCK_SIZE);
+        blk->ret = 0;
+        bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, cur_sector, nr_sectors);
+        qemu_mutex_unlock_iothread();
+
+        blk_mig_lock();
+        QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
+        block_mig_state.read_done++;
+        blk_mig_unlock();
+
+        bmds->cur_sector = cur_sector + nr_sectors;
+        return (bmds->cur_sector >= total_sectors);
+    }
+
+    blk->buf = g_malloc(BLOCK_SIZE);
     blk->iov.iov_base = blk->buf;
     blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
     qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
@@ -300,7 +366,6 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     block_mig_state.submitted++;
     blk_mig_unlock();
 
-    qemu_mutex_lock_iothread();
     blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
                                 nr_sectors, blk_mig_read_cb, blk);
 
@@ -394,7 +459,11 @@ static void init_blk_migration(QEMUFile *f)
     }
 }
 
-/* Called with no lock taken.  */
+/* Called with no lock taken.
+ *
+ * Every device that is still in its bulk phase gets a chunk submitted, so
+ * that all of them are read in parallel rather than one after the other.
+ */
 
 static int blk_mig_save_bulked_block(QEMUFile *f)
 {
@@ -408,13 +477,11 @@ static int blk_mig_save_bulked_block(QEMUFile *f)
             if (mig_save_device_bulk(f, bmds) == 1) {
                 /* completed bulk section for this device */
                 bmds->bulk_completed = 1;
+            } else {
+                ret = 1;
             }
-            completed_sector_sum += bmds->completed_sectors;
-            ret = 1;
-            break;
-        } else {
-            completed_sector_sum += bmds->completed_sectors;
         }
+        completed_sector_sum += bmds->completed_sectors;
     }
 
     if (block_mig_state.total_sector_sum != 0) {
@@ -670,7 +737,8 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
     blk_mig_lock();
     while ((block_mig_state.submitted +
             block_mig_state.read_done) * BLOCK_SIZE <
-           qemu_file_get_rate_limit(f)) {
+           qemu_file_get_rate_limit(f) &&
+           !qemu_file_rate_limit(f)) {
         blk_mig_unlock();
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
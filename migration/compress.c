@@ -0,0 +1,262 @@
+/*
+ * Page compression for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <zlib.h>
+#include "qemu-common.h"
+#include "migration/migration.h"
+
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * The state of the compressors, kept from one page to the next so that
+ * it is not set up again for every page. It is allocated when a method
+ * is first used, as the destination only learns of the method from the
+ * stream.
+ */
+struct CompressContext {
+    z_stream deflate;
+    bool deflate_ready;
+    int deflate_level;
+    z_stream inflate;
+    bool inflate_ready;
+#ifdef CONFIG_LZ4
+    void *lz4_state;
+#endif
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zstd_cctx;
+    ZSTD_DCtx *zstd_dctx;
+#endif
+};
+
+bool compress_method_supported(MigrationCompressMethod method)
+{
+    switch (method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        return true;
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        return true;
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+/* The largest the compressed data of @size bytes can be, 0 if unsupported */
+size_t compress_bound(MigrationCompressMethod method, size_t size)
+{
+    switch (method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        return compressBound(size);
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        return LZ4_compressBound(size);
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        return ZSTD_compressBound(size);
+#endif
+    default:
+        return 0;
+    }
+}
+
+/* The largest compress_bound() of all the supported methods */
+size_t compress_bound_max(size_t size)
+{
+    size_t bound = 0;
+    int i;
+
+    for (i = 0; i < MIGRATION_COMPRESS_METHOD_MAX; i++) {
+        bound = MAX(bound, compress_bound(i, size));
+    }
+    return bound;
+}
+
+CompressContext *compress_context_new(void)
+{
+    return g_new0(CompressContext, 1);
+}
+
+void compress_context_free(CompressContext *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+    if (ctx->deflate_ready) {
+        deflateEnd(&ctx->deflate);
+    }
+    if (ctx->inflate_ready) {
+        inflateEnd(&ctx->inflate);
+    }
+#ifdef CONFIG_LZ4
+    g_free(ctx->lz4_state);
+#endif
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCCtx(ctx->zstd_cctx);
+    ZSTD_freeDCtx(ctx->zstd_dctx);
+#endif
+    g_free(ctx);
+}
+
+/* The same zlib stream as compress2() makes, without its setup per page */
+static ssize_t compress_zlib(CompressContext *ctx, int level,
+                             uint8_t *dst, size_t dst_size,
+                             const uint8_t *src, size_t size)
+{
+    z_stream *zs = &ctx->deflate;
+    ssize_t ret = -1;
+
+    if (!ctx->deflate_ready) {
+        if (deflateInit(zs, level) != Z_OK) {
+            return -1;
+        }
+        ctx->deflate_ready = true;
+        ctx->deflate_level = level;
+    } else if (ctx->deflate_level != level) {
+        if (deflateParams(zs, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return -1;
+        }
+        ctx->deflate_level = level;
+    }
+
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = size;
+    zs->next_out = dst;
+    zs->avail_out = dst_size;
+    if (deflate(zs, Z_FINISH) == Z_STREAM_END) {
+        ret = dst_size - zs->avail_out;
+    }
+    deflateReset(zs);
+
+    return ret;
+}
+
+static ssize_t decompress_zlib(CompressContext *ctx,
+                               uint8_t *dst, size_t dst_size,
+                               const uint8_t *src, size_t size)
+{
+    z_stream *zs = &ctx->inflate;
+    ssize_t ret = -1;
+
+    if (!ctx->inflate_ready) {
+        if (inflateInit(zs) != Z_OK) {
+            return -1;
+        }
+        ctx->inflate_ready = true;
+    }
+
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = size;
+    zs->next_out = dst;
+    zs->avail_out = dst_size;
+    if (inflate(zs, Z_FINISH) == Z_STREAM_END) {
+        ret = dst_size - zs->avail_out;
+    }
+    inflateReset(zs);
+
+    return ret;
+}
+
+/**
+ * compress_buffer: compress @size bytes at @src into @dst
+ *
+ * Returns the size of the compressed data, or -1 if it does not fit in
+ * @dst_size bytes or the method failed.
+ *
+ * @ctx: the state of the calling thread
+ * @level: 0 to 9 as for zlib; taken as at least 1 by zstd and ignored
+ *         by lz4
+ */
+ssize_t compress_buffer(CompressContext *ctx, MigrationCompressMethod method,
+                        int level, uint8_t *dst, size_t dst_size,
+                        const uint8_t *src, size_t size)
+{
+    switch (method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        return compress_zlib(ctx, level, dst, dst_size, src, size);
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4: {
+        int ret;
+
+        if (!ctx->lz4_state) {
+            ctx->lz4_state = g_malloc(LZ4_sizeofState());
+        }
+        ret = LZ4_compress_fast_extState(ctx->lz4_state, (const char *)src,
+                                         (char *)dst, size, dst_size, 1);
+        return ret > 0 ? ret : -1;
+    }
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD: {
+        size_t ret;
+
+        if (!ctx->zstd_cctx) {
+            ctx->zstd_cctx = ZSTD_createCCtx();
+            if (!ctx->zstd_cctx) {
+                return -1;
+            }
+        }
+        ret = ZSTD_compressCCtx(ctx->zstd_cctx, dst, dst_size, src, size,
+                                MAX(level, 1));
+        return ZSTD_isError(ret) ? -1 : ret;
+    }
+#endif
+    default:
+        return -1;
+    }
+}
+
+/**
+ * decompress_buffer: decompress @size bytes at @src into @dst
+ *
+ * Returns the size of the decompressed data, or -1 if it is corrupt or
+ * larger than @dst_size bytes.
+ */
+ssize_t decompress_buffer(CompressContext *ctx, MigrationCompressMethod method,
+                          uint8_t *dst, size_t dst_size,
+                          const uint8_t *src, size_t size)
+{
+    switch (method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        return decompress_zlib(ctx, dst, dst_size, src, size);
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4: {
+        int ret;
+
+        ret = LZ4_decompress_safe((const char *)src, (char *)dst, size,
+                                  dst_size);
+        return ret >= 0 ? ret : -1;
+    }
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD: {
+        size_t ret;
+
+        if (!ctx->zstd_dctx) {
+            ctx->zstd_dctx = ZSTD_createDCtx();
+            if (!ctx->zstd_dctx) {
+                return -1;
+            }
+        }
+        ret = ZSTD_decompressDCtx(ctx->zstd_dctx, dst, dst_size, src, size);
+        return ZSTD_isError(ret) ? -1 : ret;
+    }
+#endif
+    default:
+        return -1;
+    }
+}
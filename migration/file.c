@@ -0,0 +1,97 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "trace.h"
+
+/* kept so that the RAM pages can be accessed through a file of their own */
+static char *outgoing_path;
+static char *incoming_path;
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp)
+{
+    int fd;
+
+    fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+
+    g_free(outgoing_path);
+    outgoing_path = g_strdup(path);
+    s->file = qemu_fdopen(fd, "wb");
+
+    migrate_fd_connect(s);
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_set_fd_handler(qemu_get_fd(f), NULL, NULL, NULL);
+    process_incoming_migration(f);
+}
+
+void file_start_incoming_migration(const char *path, Error **errp)
+{
+    QEMUFile *f;
+    int fd;
+
+    fd = qemu_open(path, O_RDONLY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+
+    g_free(incoming_path);
+    incoming_path = g_strdup(path);
+    f = qemu_fdopen(fd, "rb");
+
+    qemu_set_fd_handler(fd, file_accept_incoming_migration, NULL, f);
+}
+
+/*
+ * Open the file of the current outgoing (@writable) or incoming file:
+ * migration once more, with O_DIRECT if @direct and the file system
+ * supports it. Returns the descriptor, or -1 if it is not a file:
+ * migration or the file cannot be opened.
+ */
+int file_migration_open(bool writable, bool direct, Error **errp)
+{
+    const char *path = writable ? outgoing_path : incoming_path;
+    int flags = writable ? O_WRONLY : O_RDONLY;
+    int fd = -1;
+
+    if (!path) {
+        error_setg(errp, "not a file migration");
+        return -1;
+    }
+
+#ifdef O_DIRECT
+    if (direct) {
+        fd = qemu_open(path, flags | O_DIRECT);
+        if (fd < 0 && errno != EINVAL) {
+            error_setg_errno(errp, errno, "failed to open '%s'", path);
+            return -1;
+        }
+    }
+#endif
+    if (fd < 0) {
+        trace_file_migration_open_buffered(path, direct);
+        fd = qemu_open(path, flags);
+        if (fd < 0) {
+            error_setg_errno(errp, errno, "failed to open '%s'", path);
+        }
+    }
+    return fd;
+}
@@ -18,6 +18,7 @@
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
+#include "migration/postcopy-ram.h"
 #include "sysemu/sysemu.h"
 #include "block/block.h"
 #include "qapi/qmp/qerror.h"
@@ -29,6 +30,7 @@
 #include "trace.h"
 #include "qapi/util.h"
 #include "qapi-event.h"
+#include "qom/cpu.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
 
@@ -45,6 +47,13 @@
 /*0: means nocompress, 1: best speed, ... 9: best compress ratio */
 #define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
 
+/* Default number of multifd connections */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+
+/* Default throttling of auto-converge, in percent */
+#define DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL 20
+#define DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT 10
+
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
@@ -71,6 +80,14 @@ MigrationState *migrate_get_current(void)
                 DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT,
         .parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
                 DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
+        .parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS] =
+                DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_METHOD] =
+                MIGRATION_COMPRESS_METHOD_ZLIB,
+        .parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INITIAL] =
+                DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL,
+        .parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INCREMENT] =
+                DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT,
     };
 
     return &current_migration;
@@ -89,17 +106,85 @@ MigrationIncomingState *migration_incoming_state_new(QEMUFile* f)
     mis_current = g_malloc0(sizeof(MigrationIncomingState));
     mis_current->file = f;
     QLIST_INIT(&mis_current->loadvm_handlers);
+    qemu_mutex_init(&mis_current->rp_mutex);
+    postcopy_state_set(POSTCOPY_INCOMING_NONE);
 
     return mis_current;
 }
 
 void migration_incoming_state_destroy(void)
 {
+    postcopy_ram_incoming_cleanup(mis_current);
+    if (mis_current->to_src_file) {
+        qemu_fclose(mis_current->to_src_file);
+    }
+    qemu_mutex_destroy(&mis_current->rp_mutex);
     loadvm_free_handlers(mis_current);
     g_free(mis_current);
     mis_current = NULL;
 }
 
+/*
+ * Send a message on the return channel back to the source
+ * of the migration.
+ */
+static void migrate_send_rp_message(MigrationIncomingState *mis,
+                                    enum mig_rp_message_type message_type,
+                                    uint16_t len, void *data)
+{
+    trace_migrate_send_rp_message((int)message_type, len);
+    qemu_mutex_lock(&mis->rp_mutex);
+    qemu_put_be16(mis->to_src_file, (unsigned int)message_type);
+    qemu_put_be16(mis->to_src_file, len);
+    qemu_put_buffer(mis->to_src_file, data, len);
+    qemu_fflush(mis->to_src_file);
+    qemu_mutex_unlock(&mis->rp_mutex);
+}
+
+/*
+ * Send a 'SHUT' message on the return channel with the given value
+ * to indicate that we've finished with the RP.  Non-0 value indicates
+ * error.
+ */
+void migrate_send_rp_shut(MigrationIncomingState *mis,
+                          uint32_t value)
+{
+    uint32_t buf;
+
+    buf = cpu_to_be32(value);
+    migrate_send_rp_message(mis, MIG_RP_MSG_SHUT, sizeof(buf), &buf);
+}
+
+/*
+ * Request a range of pages from the source VM at the given
+ * start address.
+ *   rbname: Name of the RAMBlock to request the page in, if NULL it's the same
+ *           as the last request (a name must have been given previously)
+ *   start: Address offset within the RB
+ *   len: Length in bytes required - must be a multiple of pagesize
+ */
+void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                               ram_addr_t start, size_t len)
+{
+    uint8_t bufc[12 + 1 + 255]; /* start (8), len (4), rbname up to 256 */
+    size_t msglen = 12; /* start + len */
+
+    *(uint64_t *)bufc = cpu_to_be64((uint64_t)start);
+    *(uint32_t *)(bufc + 8) = cpu_to_be32((uint32_t)len);
+
+    if (rbname) {
+        int rbname_len = strlen(rbname);
+        assert(rbname_len < 256);
+
+        bufc[msglen++] = rbname_len;
+        memcpy(bufc + msglen, rbname, rbname_len);
+        msglen += rbname_len;
+        migrate_send_rp_message(mis, MIG_RP_MSG_REQ_PAGES_ID, msglen, bufc);
+    } else {
+        migrate_send_rp_message(mis, MIG_RP_MSG_REQ_PAGES, msglen, bufc);
+    }
+}
+
 
 typedef struct {
     bool optional;
@@ -260,41 +345,29 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
 #endif
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
 }
 
-static void process_incoming_migration_co(void *opaque)
+/*
+ * Start the VM on the destination once the state of its devices has
+ * been loaded; for postcopy, that is before the rest of RAM.
+ */
+int migration_incoming_start_vm(void)
 {
-    QEMUFile *f = opaque;
     Error *local_err = NULL;
-    int ret;
-
-    migration_incoming_state_new(f);
-    migrate_generate_event(MIGRATION_STATUS_ACTIVE);
-    ret = qemu_loadvm_state(f);
-
-    qemu_fclose(f);
-    free_xbzrle_decoded_buf();
-    migration_incoming_state_destroy();
 
-    if (ret < 0) {
-        migrate_generate_event(MIGRATION_STATUS_FAILED);
-        error_report("load of migration failed: %s", strerror(-ret));
-        migrate_decompress_threads_join();
-        exit(EXIT_FAILURE);
-    }
     qemu_announce_self();
 
     /* Make sure all file formats flush their mutable metadata */
     bdrv_invalidate_cache_all(&local_err);
     if (local_err) {
-        migrate_generate_event(MIGRATION_STATUS_FAILED);
         error_report_err(local_err);
-        migrate_decompress_threads_join();
-        exit(EXIT_FAILURE);
+        return -EINVAL;
     }
 
     /* If global state section was not received or we are in running
@@ -311,6 +384,46 @@ static void process_incoming_migration_co(void *opaque)
     } else {
         runstate_set(global_state_get_runstate());
     }
+
+    return 0;
+}
+
+static void process_incoming_migration_co(void *opaque)
+{
+    QEMUFile *f = opaque;
+    MigrationIncomingState *mis;
+    int ret;
+
+    mis = migration_incoming_state_new(f);
+    migrate_generate_event(MIGRATION_STATUS_ACTIVE);
+    ret = qemu_loadvm_state(f);
+
+    if (!ret && postcopy_state_get() >= POSTCOPY_INCOMING_LISTENING) {
+        /*
+         * The VM runs already; the postcopy listen thread loads the rest
+         * of RAM and completes the migration.
+         */
+        return;
+    }
+
+    if (mis->to_src_file) {
+        migrate_send_rp_shut(mis, ret < 0);
+    }
+    qemu_fclose(f);
+    free_xbzrle_decoded_buf();
+    migration_incoming_state_destroy();
+
+    if (!ret) {
+        ret = migration_incoming_start_vm();
+    } else {
+        error_report("load of migration failed: %s", strerror(-ret));
+    }
+    if (ret < 0) {
+        migrate_generate_event(MIGRATION_STATUS_FAILED);
+        migrate_decompress_threads_join();
+        exit(EXIT_FAILURE);
+    }
+    migrate_multifd_load_cleanup();
     migrate_decompress_threads_join();
     /*
      * This must happen after any state changes since as soon as an external
@@ -320,6 +433,25 @@ static void process_incoming_migration_co(void *opaque)
     migrate_generate_event(MIGRATION_STATUS_COMPLETED);
 }
 
+/*
+ * Called from the postcopy listen thread with the iothread lock held,
+ * once all of RAM has been loaded.
+ */
+void migration_incoming_postcopy_complete(void)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    migrate_send_rp_shut(mis, 0);
+    qemu_fclose(mis->file);
+    free_xbzrle_decoded_buf();
+    live_vmstate_cleanup();
+    migration_incoming_state_destroy();
+
+    migrate_multifd_load_cleanup();
+    migrate_decompress_threads_join();
+    migrate_generate_event(MIGRATION_STATUS_COMPLETED);
+}
+
 void process_incoming_migration(QEMUFile *f)
 {
     Coroutine *co = qemu_coroutine_create(process_incoming_migration_co);
@@ -328,6 +460,10 @@ void process_incoming_migration(QEMUFile *f)
     assert(fd != -1);
     migrate_decompress_threads_create();
     qemu_set_nonblock(fd);
+    if (migrate_use_recv_readahead() && qemu_file_start_readahead(f) < 0) {
+        error_report("Read-ahead is not supported by this transport, "
+                     "the stream is read as it is parsed");
+    }
     qemu_coroutine_enter(co, f);
 }
 
@@ -378,6 +514,14 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
             s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
     params->decompress_threads =
             s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+    params->multifd_channels =
+            s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS];
+    params->compress_method =
+            s->parameters[MIGRATION_PARAMETER_COMPRESS_METHOD];
+    params->cpu_throttle_initial =
+            s->parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INITIAL];
+    params->cpu_throttle_increment =
+            s->parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INCREMENT];
 
     return params;
 }
@@ -393,6 +537,7 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+        info->xbzrle_cache->overflow_pages = xbzrle_mig_overflow_pages();
     }
 }
 
@@ -410,6 +555,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->has_total_time = false;
         break;
     case MIGRATION_STATUS_ACTIVE:
+    case MIGRATION_STATUS_POSTCOPY_ACTIVE:
     case MIGRATION_STATUS_CANCELLING:
         info->has_status = true;
         info->has_total_time = true;
@@ -432,6 +578,15 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->dirty_sync_log_time = dirty_sync_log_time();
+        info->ram->dirty_sync_merge_time = dirty_sync_merge_time();
+        info->ram->redirtied_pages = redirtied_mig_pages();
+        info->ram->hot_pages = hot_mig_pages();
+
+        if (cpu_throttle_active()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+        }
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -465,6 +620,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->dirty_sync_log_time = dirty_sync_log_time();
+        info->ram->dirty_sync_merge_time = dirty_sync_merge_time();
+        info->ram->redirtied_pages = redirtied_mig_pages();
+        info->ram->hot_pages = hot_mig_pages();
         break;
     case MIGRATION_STATUS_FAILED:
         info->has_status = true;
@@ -485,6 +644,7 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     MigrationCapabilityStatusList *cap;
 
     if (s->state == MIGRATION_STATUS_ACTIVE ||
+        s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE ||
         s->state == MIGRATION_STATUS_SETUP) {
         error_setg(errp, QERR_MIGRATION_ACTIVE);
         return;
@@ -500,7 +660,16 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 bool has_compress_threads,
                                 int64_t compress_threads,
                                 bool has_decompress_threads,
-                                int64_t decompress_threads, Error **errp)
+                                int64_t decompress_threads,
+                                bool has_multifd_channels,
+                                int64_t multifd_channels,
+                                bool has_compress_method,
+                                MigrationCompressMethod compress_method,
+                                bool has_cpu_throttle_initial,
+                                int64_t cpu_throttle_initial,
+                                bool has_cpu_throttle_increment,
+                                int64_t cpu_throttle_increment,
+                                Error **errp)
 {
     MigrationState *s = migrate_get_current();
 
@@ -524,6 +693,34 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         return;
     }
 
+    if (has_multifd_channels &&
+            (multifd_channels < 1 || multifd_channels > 64)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "multifd_channels",
+                   "is invalid, it should be in the range of 1 to 64");
+        return;
+    }
+    if (has_compress_method && !compress_method_supported(compress_method)) {
+        error_setg(errp, "Compression method '%s' is not supported by "
+                   "this build",
+                   MigrationCompressMethod_lookup[compress_method]);
+        return;
+    }
+    if (has_cpu_throttle_initial &&
+            (cpu_throttle_initial < 1 || cpu_throttle_initial > 99)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "cpu_throttle_initial",
+                   "is invalid, it should be in the range of 1 to 99");
+        return;
+    }
+    if (has_cpu_throttle_increment &&
+            (cpu_throttle_increment < 1 || cpu_throttle_increment > 99)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "cpu_throttle_increment",
+                   "is invalid, it should be in the range of 1 to 99");
+        return;
+    }
+
     if (has_compress_level) {
         s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
     }
@@ -534,6 +731,42 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
                                                     decompress_threads;
     }
+    if (has_multifd_channels) {
+        s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS] = multifd_channels;
+    }
+    if (has_compress_method) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_METHOD] = compress_method;
+    }
+    if (has_cpu_throttle_initial) {
+        s->parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INITIAL] =
+                                                    cpu_throttle_initial;
+    }
+    if (has_cpu_throttle_increment) {
+        s->parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INCREMENT] =
+                                                    cpu_throttle_increment;
+    }
+}
+
+void qmp_migrate_start_postcopy(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_postcopy_ram()) {
+        error_setg(errp, "Enable postcopy with migrate_set_capability before"
+                         " the start of migration");
+        return;
+    }
+
+    if (s->state == MIGRATION_STATUS_NONE) {
+        error_setg(errp, "Postcopy must be started after migration has been"
+                         " started");
+        return;
+    }
+    /*
+     * we don't error if migration has finished since that would be racy
+     * with issuing this command.
+     */
+    atomic_set(&s->start_postcopy, true);
 }
 
 /* shared migration helpers */
@@ -560,11 +793,19 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_mutex_lock_iothread();
 
         migrate_compress_threads_join();
+        migrate_multifd_save_cleanup();
+        cpu_throttle_stop();
+        if (s->rp_state.from_dst_file) {
+            /* the migration thread has joined the rp thread */
+            qemu_fclose(s->rp_state.from_dst_file);
+            s->rp_state.from_dst_file = NULL;
+        }
         qemu_fclose(s->file);
         s->file = NULL;
     }
 
-    assert(s->state != MIGRATION_STATUS_ACTIVE);
+    assert((s->state != MIGRATION_STATUS_ACTIVE) &&
+           (s->state != MIGRATION_STATUS_POSTCOPY_ACTIVE));
 
     if (s->state != MIGRATION_STATUS_COMPLETED) {
         qemu_savevm_state_cancel();
@@ -594,7 +835,8 @@ static void migrate_fd_cancel(MigrationState *s)
     do {
         old_state = s->state;
         if (old_state != MIGRATION_STATUS_SETUP &&
-            old_state != MIGRATION_STATUS_ACTIVE) {
+            old_state != MIGRATION_STATUS_ACTIVE &&
+            old_state != MIGRATION_STATUS_POSTCOPY_ACTIVE) {
             break;
         }
         migrate_set_state(s, old_state, MIGRATION_STATUS_CANCELLING);
@@ -609,6 +851,11 @@ static void migrate_fd_cancel(MigrationState *s)
      */
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
+        migrate_multifd_save_shutdown();
+        if (s->rp_state.from_dst_file) {
+            /* shutdown the rp socket, so causing the rp thread to shutdown */
+            qemu_file_shutdown(s->rp_state.from_dst_file);
+        }
     }
 }
 
@@ -638,6 +885,11 @@ bool migration_has_failed(MigrationState *s)
             s->state == MIGRATION_STATUS_FAILED);
 }
 
+bool migration_in_postcopy(MigrationState *s)
+{
+    return (s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE);
+}
+
 static MigrationState *migrate_init(const MigrationParams *params)
 {
     MigrationState *s = migrate_get_current();
@@ -649,10 +901,17 @@ static MigrationState *migrate_init(const MigrationParams *params)
             s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
     int decompress_thread_count =
             s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+    int multifd_channels = s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS];
+    int compress_method = s->parameters[MIGRATION_PARAMETER_COMPRESS_METHOD];
+    int cpu_throttle_initial =
+            s->parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INITIAL];
+    int cpu_throttle_increment =
+            s->parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INCREMENT];
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
 
+    g_free(s->multifd_address);
     memset(s, 0, sizeof(*s));
     s->params = *params;
     memcpy(s->enabled_capabilities, enabled_capabilities,
@@ -664,6 +923,12 @@ static MigrationState *migrate_init(const MigrationParams *params)
                compress_thread_count;
     s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
                decompress_thread_count;
+    s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS] = multifd_channels;
+    s->parameters[MIGRATION_PARAMETER_COMPRESS_METHOD] = compress_method;
+    s->parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INITIAL] =
+               cpu_throttle_initial;
+    s->parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INCREMENT] =
+               cpu_throttle_increment;
     s->bandwidth_limit = bandwidth_limit;
     migrate_set_state(s, MIGRATION_STATUS_NONE, MIGRATION_STATUS_SETUP);
 
@@ -719,6 +984,7 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     params.shared = has_inc && inc;
 
     if (s->state == MIGRATION_STATUS_ACTIVE ||
+        s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE ||
         s->state == MIGRATION_STATUS_SETUP ||
         s->state == MIGRATION_STATUS_CANCELLING) {
         error_setg(errp, QERR_MIGRATION_ACTIVE);
@@ -738,6 +1004,44 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_mapped_ram()) {
+        /* the pages are written in place, in their plain encoding */
+        if (!strstart(uri, "file:", NULL)) {
+            error_setg(errp, "mapped-ram is only supported for file migration");
+            return;
+        }
+        if (migrate_use_xbzrle() || migrate_use_compression() ||
+            migrate_postcopy_ram()) {
+            error_setg(errp, "mapped-ram is not compatible with the xbzrle,"
+                             " compress and x-postcopy-ram capabilities");
+            return;
+        }
+    }
+
+    if (migrate_use_ignore_shared() &&
+        (migrate_use_mapped_ram() || migrate_postcopy_ram())) {
+        error_setg(errp, "ignore-shared is not compatible with the"
+                         " mapped-ram and x-postcopy-ram capabilities");
+        return;
+    }
+
+    if (migrate_postcopy_ram()) {
+        /* only RAM can be postcopied, and only in its plain encoding */
+        if (params.blk || params.shared) {
+            error_setg(errp, "Postcopy is not compatible with block migration");
+            return;
+        }
+        if (migrate_use_compression() || migrate_use_multifd()) {
+            error_setg(errp, "Postcopy is not compatible with the compress"
+                             " and multifd capabilities");
+            return;
+        }
+        if (strstart(uri, "rdma:", NULL)) {
+            error_setg(errp, "Postcopy is not supported with RDMA");
+            return;
+        }
+    }
+
     /* We are starting a new migration, so we want to start in a clean
        state.  This change is only needed if previous migration
        failed/was cancelled.  We don't use migrate_set_state() because
@@ -759,6 +1063,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
@@ -874,6 +1180,15 @@ int migrate_compress_level(void)
     return s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
 }
 
+MigrationCompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_METHOD];
+}
+
 int migrate_compress_threads(void)
 {
     MigrationState *s;
@@ -892,6 +1207,105 @@ int migrate_decompress_threads(void)
     return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
+}
+
+int migrate_cpu_throttle_initial(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INITIAL];
+}
+
+int migrate_cpu_throttle_increment(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INCREMENT];
+}
+
+bool migrate_use_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
+bool migrate_use_live_vmstate(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_LIVE_VMSTATE];
+}
+
+bool migrate_use_recv_readahead(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_RECV_READAHEAD];
+}
+
+bool migrate_use_mapped_ram_cow(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM_COW];
+}
+
+bool migrate_use_ignore_shared(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_IGNORE_SHARED];
+}
+
+bool migrate_use_zerocopy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS];
+}
+
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_POSTCOPY_RAM];
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
@@ -919,6 +1333,253 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+/* return path support */
+
+/*
+ * Something bad happened to the RP stream, mark an error
+ * The caller shall print or trace something to indicate why
+ */
+static void mark_source_rp_bad(MigrationState *s)
+{
+    s->rp_state.error = true;
+}
+
+static struct rp_cmd_args {
+    ssize_t     len; /* -1 = variable */
+    const char *name;
+} rp_cmd_args[] = {
+    [MIG_RP_MSG_INVALID]        = { .len = -1, .name = "INVALID" },
+    [MIG_RP_MSG_SHUT]           = { .len =  4, .name = "SHUT" },
+    [MIG_RP_MSG_REQ_PAGES_ID]   = { .len = -1, .name = "REQ_PAGES_ID" },
+    [MIG_RP_MSG_REQ_PAGES]      = { .len = 12, .name = "REQ_PAGES" },
+    [MIG_RP_MSG_MAX]            = { .len = -1, .name = "MAX" },
+};
+
+/*
+ * Process a request for pages received on the return path,
+ * we don't need to send pages that have already been sent.
+ */
+static void migrate_handle_rp_req_pages(MigrationState *ms, const char* rbname,
+                                       ram_addr_t start, size_t len)
+{
+    trace_migrate_handle_rp_req_pages(rbname, start, len);
+
+    if (ram_save_queue_pages(rbname, start, len)) {
+        mark_source_rp_bad(ms);
+    }
+}
+
+/*
+ * Handles messages sent on the return path towards the source VM
+ *
+ */
+static void *source_return_path_thread(void *opaque)
+{
+    MigrationState *ms = opaque;
+    QEMUFile *rp = ms->rp_state.from_dst_file;
+    uint16_t header_len, header_type;
+    uint8_t buf[512];
+    uint32_t tmp32, sibling_error;
+    ram_addr_t start = 0; /* =0 to silence warning */
+    size_t  len = 0, expected_len;
+    int res;
+
+    trace_source_return_path_thread_entry();
+    while (!ms->rp_state.error && !qemu_file_get_error(rp)) {
+        header_type = qemu_get_be16(rp);
+        header_len = qemu_get_be16(rp);
+        if (qemu_file_get_error(rp)) {
+            break;
+        }
+
+        if (header_type >= MIG_RP_MSG_MAX ||
+            header_type == MIG_RP_MSG_INVALID) {
+            error_report("RP: Received invalid message 0x%04x length 0x%04x",
+                    header_type, header_len);
+            mark_source_rp_bad(ms);
+            goto out;
+        }
+
+        if ((rp_cmd_args[header_type].len != -1 &&
+            header_len != rp_cmd_args[header_type].len) ||
+            header_len > sizeof(buf)) {
+            error_report("RP: Received '%s' message (0x%04x) with"
+                    "incorrect length %d expecting %zu",
+                    rp_cmd_args[header_type].name, header_type, header_len,
+                    (size_t)rp_cmd_args[header_type].len);
+            mark_source_rp_bad(ms);
+            goto out;
+        }
+
+        /* We know we've got a valid header by this point */
+        res = qemu_get_buffer(rp, buf, header_len);
+        if (res != header_len) {
+            error_report("RP: Failed reading data for message 0x%04x"
+                         " read %d expected %d",
+                         header_type, res, header_len);
+            mark_source_rp_bad(ms);
+            goto out;
+        }
+
+        /* OK, we have the message and the data */
+        switch (header_type) {
+        case MIG_RP_MSG_SHUT:
+            sibling_error = be32_to_cpup((uint32_t *)buf);
+            trace_source_return_path_thread_shut(sibling_error);
+            if (sibling_error) {
+                error_report("RP: Sibling indicated error %d", sibling_error);
+                mark_source_rp_bad(ms);
+            }
+            /*
+             * We'll let the migration thread deal with closing the RP;
+             * the destination does not send anything after this.
+             */
+            goto out;
+
+        case MIG_RP_MSG_REQ_PAGES:
+            start = be64_to_cpup((uint64_t *)buf);
+            len = be32_to_cpup((uint32_t *)(buf + 8));
+            migrate_handle_rp_req_pages(ms, NULL, start, len);
+            break;
+
+        case MIG_RP_MSG_REQ_PAGES_ID:
+            expected_len = 12 + 1; /* header + termination */
+
+            if (header_len >= expected_len) {
+                start = be64_to_cpup((uint64_t *)buf);
+                len = be32_to_cpup((uint32_t *)(buf + 8));
+                /* Now we expect an idstr */
+                tmp32 = buf[12]; /* Length of the following idstr */
+                buf[13 + tmp32] = '\0';
+                expected_len += tmp32;
+            }
+            if (header_len != expected_len) {
+                error_report("RP: Req_Page_id with length %d expecting %zd",
+                        header_len, expected_len);
+                mark_source_rp_bad(ms);
+                goto out;
+            }
+            migrate_handle_rp_req_pages(ms, (char *)&buf[13], start, len);
+            break;
+
+        default:
+            break;
+        }
+    }
+    if (qemu_file_get_error(rp)) {
+        trace_source_return_path_thread_bad_end();
+        mark_source_rp_bad(ms);
+    }
+
+out:
+    trace_source_return_path_thread_end();
+    return NULL;
+}
+
+static int open_return_path_on_source(MigrationState *ms)
+{
+    ms->rp_state.from_dst_file = qemu_file_get_return_path(ms->file);
+    if (!ms->rp_state.from_dst_file) {
+        return -1;
+    }
+
+    qemu_thread_create(&ms->rp_state.rp_thread, "return path",
+                       source_return_path_thread, ms, QEMU_THREAD_JOINABLE);
+
+    return 0;
+}
+
+/*
+ * Wait for the destination to finish with the return path; returns 0 if
+ * it was ok.  Unless @fail, the destination is expected to send SHUT.
+ */
+static int await_return_path_close_on_source(MigrationState *ms, bool fail)
+{
+    if (fail) {
+        /* shutdown the rp socket, so causing the rp thread to shutdown */
+        qemu_file_shutdown(ms->rp_state.from_dst_file);
+    }
+    qemu_thread_join(&ms->rp_state.rp_thread);
+    return ms->rp_state.error;
+}
+
+/*
+ * Switch from precopy to postcopy: stop the VM, tell the destination
+ * which of the pages it has are out of date, and send it the state of
+ * the devices so that it can run the VM.
+ */
+static int postcopy_start(MigrationState *ms, bool *old_vm_running)
+{
+    int64_t time_at_stop = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    const QEMUSizedBuffer *qsb;
+    QEMUFile *fb;
+    int ret;
+
+    migrate_set_state(ms, MIGRATION_STATUS_ACTIVE,
+                      MIGRATION_STATUS_POSTCOPY_ACTIVE);
+
+    trace_postcopy_start();
+    qemu_mutex_lock_iothread();
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    *old_vm_running = runstate_is_running();
+
+    ret = global_state_store();
+    if (!ret) {
+        ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    }
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = ram_postcopy_send_discard_bitmap(ms);
+    if (ret < 0) {
+        error_report("postcopy_start: Failed to send discard bitmap");
+        goto fail;
+    }
+
+    /* the destination is waiting for every page from now on */
+    qemu_file_set_rate_limit(ms->file, INT64_MAX);
+
+    /*
+     * The destination reads the state of the devices as a whole before
+     * loading it, so that meanwhile it can go on reading the pages the
+     * devices touch from the main stream.  Things that do postcopy notice
+     * the POSTCOPY_ACTIVE state and are not wrapped up here.
+     */
+    fb = qemu_bufopen("w", NULL);
+    if (!fb) {
+        error_report("Failed to create buffered file");
+        goto fail;
+    }
+    qemu_savevm_send_postcopy_listen(fb);
+    qemu_savevm_state_complete(fb);
+    qemu_savevm_send_postcopy_run(fb);
+
+    qsb = qemu_buf_get(fb);
+    ret = qemu_savevm_send_packaged(ms->file, qsb);
+    qemu_fclose(fb);
+    if (ret < 0) {
+        goto fail;
+    }
+    ms->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - time_at_stop;
+
+    qemu_mutex_unlock_iothread();
+
+    ret = qemu_file_get_error(ms->file);
+    if (ret) {
+        error_report("postcopy_start: Migration stream errored");
+        migrate_set_state(ms, MIGRATION_STATUS_POSTCOPY_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+    }
+    return ret;
+
+fail:
+    migrate_set_state(ms, MIGRATION_STATUS_POSTCOPY_ACTIVE,
+                      MIGRATION_STATUS_FAILED);
+    qemu_mutex_unlock_iothread();
+    return -1;
+}
+
 /* migration thread support */
 
 static void *migration_thread(void *opaque)
@@ -930,16 +1591,37 @@ static void *migration_thread(void *opaque)
     int64_t max_size = 0;
     int64_t start_time = initial_time;
     bool old_vm_running = false;
+    bool entered_postcopy = false;
+    bool rp_closed = true;
+    /* The active state we expect to be in; ACTIVE or POSTCOPY_ACTIVE */
+    int current_active_state = MIGRATION_STATUS_ACTIVE;
 
     rcu_register_thread();
 
     qemu_savevm_state_header(s->file);
+
+    if (migrate_postcopy_ram()) {
+        /* the destination asks for the pages it misses on the return path */
+        if (open_return_path_on_source(s)) {
+            error_report("Unable to open return-path for postcopy");
+            migrate_set_state(s, MIGRATION_STATUS_SETUP,
+                              MIGRATION_STATUS_FAILED);
+            goto out;
+        }
+        rp_closed = false;
+
+        /* Now tell the dest that it should open its end so it can reply */
+        qemu_savevm_send_open_return_path(s->file);
+        qemu_savevm_send_postcopy_advise(s->file);
+    }
+
     qemu_savevm_state_begin(s->file, &s->params);
 
     s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
     migrate_set_state(s, MIGRATION_STATUS_SETUP, MIGRATION_STATUS_ACTIVE);
 
-    while (s->state == MIGRATION_STATUS_ACTIVE) {
+    while (s->state == MIGRATION_STATUS_ACTIVE ||
+           s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
         int64_t current_time;
         uint64_t pending_size;
 
@@ -947,41 +1629,70 @@ static void *migration_thread(void *opaque)
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             trace_migrate_pending(pending_size, max_size);
             if (pending_size && pending_size >= max_size) {
+                /*
+                 * Rather than iterate over a RAM that is dirtied faster
+                 * than it can be sent, let the destination run with what
+                 * it has and fetch the rest.
+                 */
+                if (migrate_postcopy_ram() &&
+                    s->state != MIGRATION_STATUS_POSTCOPY_ACTIVE &&
+                    (atomic_read(&s->start_postcopy) ||
+                     ram_first_pass_done())) {
+                    if (!postcopy_start(s, &old_vm_running)) {
+                        current_active_state = MIGRATION_STATUS_POSTCOPY_ACTIVE;
+                        entered_postcopy = true;
+                    }
+                    continue;
+                }
                 qemu_savevm_state_iterate(s->file);
             } else {
-                int ret;
+                int ret = 0;
 
                 qemu_mutex_lock_iothread();
-                start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-                qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
-                old_vm_running = runstate_is_running();
-
-                ret = global_state_store();
-                if (!ret) {
-                    ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
-                    if (ret >= 0) {
-                        qemu_file_set_rate_limit(s->file, INT64_MAX);
-                        qemu_savevm_state_complete(s->file);
+                if (!entered_postcopy) {
+                    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+                    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+                    old_vm_running = runstate_is_running();
+
+                    ret = global_state_store();
+                    if (!ret) {
+                        ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+                        if (ret >= 0) {
+                            qemu_file_set_rate_limit(s->file, INT64_MAX);
+                            qemu_savevm_state_complete(s->file);
+                        }
                     }
+                } else {
+                    /* the VM has been stopped since postcopy started */
+                    qemu_savevm_state_complete_postcopy(s->file);
                 }
                 qemu_mutex_unlock_iothread();
 
                 if (ret < 0) {
-                    migrate_set_state(s, MIGRATION_STATUS_ACTIVE,
+                    migrate_set_state(s, current_active_state,
                                       MIGRATION_STATUS_FAILED);
                     break;
                 }
 
                 if (!qemu_file_get_error(s->file)) {
-                    migrate_set_state(s, MIGRATION_STATUS_ACTIVE,
+                    /* the destination tells when it has loaded it all */
+                    if (!rp_closed) {
+                        rp_closed = true;
+                        if (await_return_path_close_on_source(s, false)) {
+                            migrate_set_state(s, current_active_state,
+                                              MIGRATION_STATUS_FAILED);
+                            break;
+                        }
+                    }
+                    migrate_set_state(s, current_active_state,
                                       MIGRATION_STATUS_COMPLETED);
                     break;
                 }
             }
         }
 
-        if (qemu_file_get_error(s->file)) {
-            migrate_set_state(s, MIGRATION_STATUS_ACTIVE,
+        if (qemu_file_get_error(s->file) || s->rp_state.error) {
+            migrate_set_state(s, current_active_state,
                               MIGRATION_STATUS_FAILED);
             break;
         }
@@ -1013,19 +1724,28 @@ static void *migration_thread(void *opaque)
         }
     }
 
+    if (!rp_closed) {
+        await_return_path_close_on_source(s, true);
+    }
+
+out:
     qemu_mutex_lock_iothread();
     if (s->state == MIGRATION_STATUS_COMPLETED) {
         int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         uint64_t transferred_bytes = qemu_ftell(s->file);
         s->total_time = end_time - s->total_time;
-        s->downtime = end_time - start_time;
+        if (!entered_postcopy) {
+            /* for postcopy, it was measured when the destination started */
+            s->downtime = end_time - start_time;
+        }
         if (s->total_time) {
             s->mbps = (((double) transferred_bytes * 8.0) /
                        ((double) s->total_time)) / 1000;
         }
         runstate_set(RUN_STATE_POSTMIGRATE);
     } else {
-        if (old_vm_running) {
+        /* once the destination may have run the VM, it must not run here */
+        if (old_vm_running && !entered_postcopy) {
             vm_start();
         }
     }
@@ -1045,6 +1765,11 @@ void migrate_fd_connect(MigrationState *s)
     qemu_file_set_rate_limit(s->file,
                              s->bandwidth_limit / XFER_LIMIT_RATIO);
 
+    if (migrate_use_zerocopy() && qemu_file_set_zerocopy(s->file, true) < 0) {
+        error_report("Zero copy send is not supported by this transport, "
+                     "pages are copied");
+    }
+
     /* Notify before starting migration thread */
     notifier_list_notify(&migration_state_notifiers, s);
 
@@ -29,7 +29,10 @@
 #include "qemu/iov.h"
 
 #define IO_BUF_SIZE 32768
-#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
+#define MAX_IOV_SIZE MIN(IOV_MAX, 1024)
+
+/* buffers that take turns while the ones sent before may be in use */
+#define ZEROCOPY_BUFS 8
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -42,11 +45,17 @@ struct QEMUFile {
                     when reading */
     int buf_index;
     int buf_size; /* 0 when writing */
-    uint8_t buf[IO_BUF_SIZE];
+    uint8_t *buf; /* io_buf, or one of zerocopy_bufs */
+    uint8_t io_buf[IO_BUF_SIZE];
 
     struct iovec iov[MAX_IOV_SIZE];
     unsigned int iovcnt;
 
+    /* with zerocopy, each buffer with the stream position after its data */
+    uint8_t *zerocopy_bufs;
+    int64_t zerocopy_end[ZEROCOPY_BUFS];
+    int zerocopy_index;
+
     int last_error;
 };
 
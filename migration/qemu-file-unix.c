@@ -25,14 +25,209 @@
 #include "qemu/iov.h"
 #include "qemu/sockets.h"
 #include "block/coroutine.h"
+#include "qemu/event_notifier.h"
+#include "qemu/thread.h"
 #include "migration/qemu-file.h"
 #include "migration/qemu-file-internal.h"
+#include "trace.h"
+
+#ifdef CONFIG_MSG_ZEROCOPY
+#include <poll.h>
+#include <linux/errqueue.h>
+
+/* The most MSG_ZEROCOPY sends that may be waiting for their completion */
+#define ZEROCOPY_MAX_PENDING 256
+#endif
+
+#ifndef _WIN32
+#include <poll.h>
+
+/* The ring of buffers that a thread fills ahead of socket_get_buffer */
+#define READAHEAD_BUFS          16
+#define READAHEAD_BUF_SIZE      (1024 * 1024)
+
+typedef struct SocketReadahead {
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond buf_free_cond;
+    EventNotifier data_ready;
+
+    /*
+     * Buffers 'head' to 'tail' (modulo READAHEAD_BUFS) hold the data
+     * received, and 'head_offset' bytes of buffer 'head' have been
+     * consumed. The thread stops at the end of the stream and then sets
+     * 'error' to 0 or -errno.
+     */
+    uint8_t *bufs;
+    int len[READAHEAD_BUFS];
+    unsigned head;
+    unsigned tail;
+    int head_offset;
+    bool done;
+    int error;
+    bool quit;
+} SocketReadahead;
+#endif
 
 typedef struct QEMUFileSocket {
     int fd;
     QEMUFile *file;
+#ifndef _WIN32
+    SocketReadahead *readahead;
+#endif
+#ifdef CONFIG_MSG_ZEROCOPY
+    /*
+     * The MSG_ZEROCOPY sends are numbered by the kernel from 0 on; those
+     * from zerocopy_done up to zerocopy_sent are still pending, and each
+     * one's first stream position is kept in zerocopy_start.
+     */
+    bool zerocopy;
+    bool zerocopy_copied;
+    uint32_t zerocopy_sent;
+    uint32_t zerocopy_done;
+    int64_t zerocopy_start[ZEROCOPY_MAX_PENDING];
+#endif
 } QEMUFileSocket;
 
+#ifdef CONFIG_MSG_ZEROCOPY
+/*
+ * Collect the completions of MSG_ZEROCOPY sends from the error queue,
+ * waiting for at least one if 'wait'. TCP completes the sends in order,
+ * so each one just tells how many of them are done.
+ */
+static int socket_zerocopy_reap(QEMUFileSocket *s, bool wait)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct msghdr msg = { 0 };
+    struct sock_extended_err *serr;
+    struct cmsghdr *cm;
+    struct pollfd pfd = { .fd = s->fd };
+
+    for (;;) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(s->fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN || !wait) {
+                return errno == EAGAIN ? 0 : -errno;
+            }
+            /* POLLERR is always polled for */
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                return -errno;
+            }
+            continue;
+        }
+
+        cm = CMSG_FIRSTHDR(&msg);
+        if (!cm) {
+            return -EIO;
+        }
+        serr = (struct sock_extended_err *)CMSG_DATA(cm);
+        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno) {
+            return serr->ee_errno ? -serr->ee_errno : -EIO;
+        }
+
+        /* sends numbered ee_info to ee_data are complete */
+        if ((int32_t)(serr->ee_data + 1 - s->zerocopy_done) > 0) {
+            s->zerocopy_done = serr->ee_data + 1;
+        }
+        if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) &&
+            !s->zerocopy_copied) {
+            /* e.g. over loopback; it works, but is no faster */
+            trace_qemu_file_zerocopy_copied(s->fd);
+            s->zerocopy_copied = true;
+        }
+        wait = false;
+    }
+}
+
+static ssize_t socket_writev_zerocopy(QEMUFileSocket *s, struct iovec *iov,
+                                      int iovcnt, int64_t pos)
+{
+    struct iovec *local = NULL;
+    struct msghdr msg = { 0 };
+    ssize_t size = iov_size(iov, iovcnt);
+    ssize_t done = 0, len;
+    int flags, ret;
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    while (done < size) {
+        if (s->zerocopy_sent - s->zerocopy_done == ZEROCOPY_MAX_PENDING) {
+            ret = socket_zerocopy_reap(s, true);
+            if (ret < 0) {
+                done = ret;
+                break;
+            }
+        }
+
+        flags = MSG_ZEROCOPY;
+        do {
+            len = sendmsg(s->fd, &msg, flags);
+            if (len < 0 && errno == ENOBUFS && flags) {
+                /* out of memory to pin pages with; copy this one */
+                flags = 0;
+                len = sendmsg(s->fd, &msg, flags);
+            }
+        } while (len < 0 && errno == EINTR);
+        if (len < 0) {
+            done = -errno;
+            break;
+        }
+        if (flags) {
+            s->zerocopy_start[s->zerocopy_sent % ZEROCOPY_MAX_PENDING] =
+                pos + done;
+            s->zerocopy_sent++;
+        }
+        done += len;
+
+        if (done < size) {
+            /* short write; send the rest from where it stopped */
+            if (!local) {
+                local = g_new(struct iovec, iovcnt);
+            }
+            msg.msg_iov = local;
+            msg.msg_iovlen = iov_copy(local, iovcnt, iov, iovcnt, done,
+                                      size - done);
+        }
+    }
+
+    g_free(local);
+    /* keep the error queue short */
+    ret = socket_zerocopy_reap(s, false);
+    return ret < 0 ? ret : done;
+}
+
+static int socket_set_zerocopy(void *opaque, bool enable)
+{
+    QEMUFileSocket *s = opaque;
+    int val = enable;
+
+    if (setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val)) < 0) {
+        return -errno;
+    }
+    s->zerocopy = enable;
+    return 0;
+}
+
+static int socket_zerocopy_wait(void *opaque, int64_t pos)
+{
+    QEMUFileSocket *s = opaque;
+    int ret;
+
+    while (s->zerocopy_done != s->zerocopy_sent &&
+           s->zerocopy_start[s->zerocopy_done % ZEROCOPY_MAX_PENDING] < pos) {
+        ret = socket_zerocopy_reap(s, true);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+#endif
+
 static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
                                     int64_t pos)
 {
@@ -40,6 +235,12 @@ static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
     ssize_t len;
     ssize_t size = iov_size(iov, iovcnt);
 
+#ifdef CONFIG_MSG_ZEROCOPY
+    if (s->zerocopy) {
+        return socket_writev_zerocopy(s, iov, iovcnt, pos);
+    }
+#endif
+
     len = iov_send(s->fd, iov, iovcnt, 0, size);
     if (len < size) {
         len = -socket_error();
@@ -59,6 +260,12 @@ static int socket_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
     QEMUFileSocket *s = opaque;
     ssize_t len;
 
+#ifndef _WIN32
+    if (s->readahead) {
+        return socket_readahead_get_buffer(s->readahead, buf, size);
+    }
+#endif
+
     for (;;) {
         len = qemu_recv(s->fd, buf, size, 0);
         if (len != -1) {
@@ -77,9 +284,163 @@ static int socket_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
     return len;
 }
 
+#ifndef _WIN32
+static void *socket_readahead_thread(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    SocketReadahead *ra = s->readahead;
+    struct pollfd pfd = { .fd = s->fd, .events = POLLIN };
+    uint8_t *buf;
+    ssize_t len;
+    int err = 0;
+
+    for (;;) {
+        qemu_mutex_lock(&ra->lock);
+        while (ra->tail - ra->head == READAHEAD_BUFS && !ra->quit) {
+            qemu_cond_wait(&ra->buf_free_cond, &ra->lock);
+        }
+        if (ra->quit) {
+            qemu_mutex_unlock(&ra->lock);
+            break;
+        }
+        buf = ra->bufs + (ra->tail % READAHEAD_BUFS) * READAHEAD_BUF_SIZE;
+        qemu_mutex_unlock(&ra->lock);
+
+        /* the descriptor may be in non-blocking mode for the coroutine */
+        for (;;) {
+            len = recv(s->fd, buf, READAHEAD_BUF_SIZE, 0);
+            if (len >= 0 || (errno != EAGAIN && errno != EINTR)) {
+                break;
+            }
+            if (errno == EAGAIN && poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                break;
+            }
+        }
+        err = len < 0 ? -errno : 0;
+
+        qemu_mutex_lock(&ra->lock);
+        if (len > 0) {
+            ra->len[ra->tail % READAHEAD_BUFS] = len;
+            ra->tail++;
+        } else {
+            ra->done = true;
+            ra->error = err;
+        }
+        qemu_mutex_unlock(&ra->lock);
+        event_notifier_set(&ra->data_ready);
+
+        if (len <= 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int socket_start_readahead(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    SocketReadahead *ra;
+
+    if (s->readahead) {
+        return 0;
+    }
+
+    ra = g_new0(SocketReadahead, 1);
+    if (event_notifier_init(&ra->data_ready, false) < 0) {
+        g_free(ra);
+        return -errno;
+    }
+    qemu_mutex_init(&ra->lock);
+    qemu_cond_init(&ra->buf_free_cond);
+    ra->bufs = g_malloc(READAHEAD_BUFS * READAHEAD_BUF_SIZE);
+    s->readahead = ra;
+
+    trace_qemu_file_readahead_start(s->fd);
+    qemu_thread_create(&ra->thread, "migration/recv", socket_readahead_thread,
+                       s, QEMU_THREAD_JOINABLE);
+    return 0;
+}
+
+static void socket_stop_readahead(QEMUFileSocket *s)
+{
+    SocketReadahead *ra = s->readahead;
+
+    qemu_mutex_lock(&ra->lock);
+    ra->quit = true;
+    qemu_cond_signal(&ra->buf_free_cond);
+    qemu_mutex_unlock(&ra->lock);
+
+    /* get the thread out of recv() or poll() */
+    shutdown(s->fd, SHUT_RD);
+    qemu_thread_join(&ra->thread);
+
+    event_notifier_cleanup(&ra->data_ready);
+    qemu_cond_destroy(&ra->buf_free_cond);
+    qemu_mutex_destroy(&ra->lock);
+    g_free(ra->bufs);
+    g_free(ra);
+    s->readahead = NULL;
+}
+
+/*
+ * Copies what the thread has received; waits for it if there is nothing,
+ * yielding when in the incoming migration coroutine. The postcopy listen
+ * thread reads without a coroutine, and blocks instead.
+ */
+static int socket_readahead_get_buffer(SocketReadahead *ra, uint8_t *buf,
+                                       int size)
+{
+    int fd = event_notifier_get_fd(&ra->data_ready);
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int done = 0;
+    bool ready;
+    int n;
+
+    for (;;) {
+        event_notifier_test_and_clear(&ra->data_ready);
+
+        qemu_mutex_lock(&ra->lock);
+        while (done < size && ra->head != ra->tail) {
+            int idx = ra->head % READAHEAD_BUFS;
+
+            n = MIN(size - done, ra->len[idx] - ra->head_offset);
+            memcpy(buf + done,
+                   ra->bufs + idx * READAHEAD_BUF_SIZE + ra->head_offset, n);
+            done += n;
+            ra->head_offset += n;
+            if (ra->head_offset == ra->len[idx]) {
+                ra->head++;
+                ra->head_offset = 0;
+                qemu_cond_signal(&ra->buf_free_cond);
+            }
+        }
+        ready = done || ra->done;
+        if (!done && ra->done) {
+            done = ra->error;
+        }
+        qemu_mutex_unlock(&ra->lock);
+
+        if (ready) {
+            return done;
+        }
+        if (qemu_in_coroutine()) {
+            yield_until_fd_readable(fd);
+        } else if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            return -errno;
+        }
+    }
+}
+#endif
+
 static int socket_close(void *opaque)
 {
     QEMUFileSocket *s = opaque;
+
+#ifndef _WIN32
+    if (s->readahead) {
+        socket_stop_readahead(s);
+    }
+#endif
     closesocket(s->fd);
     g_free(s);
     return 0;
@@ -96,6 +457,44 @@ static int socket_shutdown(void *opaque, bool rd, bool wr)
     }
 }
 
+static const QEMUFileOps socket_read_ops;
+static const QEMUFileOps socket_write_ops;
+
+/*
+ * The return path uses a duplicate of the descriptor, so that either
+ * QEMUFile may be closed first.
+ */
+static QEMUFile *socket_get_return_path(void *opaque)
+{
+    QEMUFileSocket *forward = opaque;
+    QEMUFileSocket *reverse;
+    int fd;
+
+    if (qemu_file_get_error(forward->file)) {
+        /* If the forward file is in error, don't try and open a return */
+        return NULL;
+    }
+
+#ifdef _WIN32
+    return NULL;
+#else
+    fd = dup(forward->fd);
+    if (fd < 0) {
+        return NULL;
+    }
+    qemu_set_cloexec(fd);
+#endif
+
+    reverse = g_malloc0(sizeof(QEMUFileSocket));
+    reverse->fd = fd;
+    if (qemu_file_is_writable(forward->file)) {
+        reverse->file = qemu_fopen_ops(reverse, &socket_read_ops);
+    } else {
+        reverse->file = qemu_fopen_ops(reverse, &socket_write_ops);
+    }
+    return reverse->file;
+}
+
 static ssize_t unix_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
                                   int64_t pos)
 {
@@ -161,6 +560,18 @@ static int unix_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
     return len;
 }
 
+static int64_t unix_seek(void *opaque, int64_t offset, int whence)
+{
+    QEMUFileSocket *s = opaque;
+    off_t ret;
+
+    ret = lseek(s->fd, offset, whence);
+    if (ret == (off_t)-1) {
+        return -errno;
+    }
+    return ret;
+}
+
 static int unix_close(void *opaque)
 {
     QEMUFileSocket *s = opaque;
@@ -172,13 +583,15 @@ static int unix_close(void *opaque)
 static const QEMUFileOps unix_read_ops = {
     .get_fd =     socket_get_fd,
     .get_buffer = unix_get_buffer,
-    .close =      unix_close
+    .close =      unix_close,
+    .seek =       unix_seek
 };
 
 static const QEMUFileOps unix_write_ops = {
     .get_fd =     socket_get_fd,
     .writev_buffer = unix_writev_buffer,
-    .close =      unix_close
+    .close =      unix_close,
+    .seek =       unix_seek
 };
 
 QEMUFile *qemu_fdopen(int fd, const char *mode)
@@ -207,15 +620,23 @@ static const QEMUFileOps socket_read_ops = {
     .get_fd     = socket_get_fd,
     .get_buffer = socket_get_buffer,
     .close      = socket_close,
-    .shut_down  = socket_shutdown
-
+    .shut_down  = socket_shutdown,
+    .get_return_path = socket_get_return_path,
+#ifndef _WIN32
+    .start_readahead = socket_start_readahead,
+#endif
 };
 
 static const QEMUFileOps socket_write_ops = {
     .get_fd        = socket_get_fd,
     .writev_buffer = socket_writev_buffer,
     .close         = socket_close,
-    .shut_down     = socket_shutdown
+    .shut_down     = socket_shutdown,
+    .get_return_path = socket_get_return_path,
+#ifdef CONFIG_MSG_ZEROCOPY
+    .set_zerocopy  = socket_set_zerocopy,
+    .zerocopy_wait = socket_zerocopy_wait,
+#endif
 };
 
 QEMUFile *qemu_fopen_socket(int fd, const char *mode)
@@ -21,7 +21,6 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
-#include <zlib.h>
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
@@ -44,6 +43,18 @@ int qemu_file_shutdown(QEMUFile *f)
     return f->ops->shut_down(f->opaque, true, true);
 }
 
+/*
+ * Result: QEMUFile* for a 'return path' for comms in the opposite direction
+ *         NULL if not available
+ */
+QEMUFile *qemu_file_get_return_path(QEMUFile *f)
+{
+    if (!f->ops->get_return_path) {
+        return NULL;
+    }
+    return f->ops->get_return_path(f->opaque);
+}
+
 bool qemu_file_mode_is_not_valid(const char *mode)
 {
     if (mode == NULL ||
@@ -64,6 +75,7 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 
     f->opaque = opaque;
     f->ops = ops;
+    f->buf = f->io_buf;
     return f;
 }
 
@@ -91,6 +103,27 @@ bool qemu_file_is_writable(QEMUFile *f)
     return f->ops->writev_buffer || f->ops->put_buffer;
 }
 
+/*
+ * With zerocopy, the data just written may still be read from f->buf by
+ * the transport. Move on to the next buffer, waiting for the transport
+ * to be done with it if needed.
+ */
+static void qemu_file_next_zerocopy_buf(QEMUFile *f)
+{
+    int64_t end;
+    int ret;
+
+    f->zerocopy_end[f->zerocopy_index] = f->pos;
+    f->zerocopy_index = (f->zerocopy_index + 1) % ZEROCOPY_BUFS;
+    f->buf = f->zerocopy_bufs + f->zerocopy_index * IO_BUF_SIZE;
+
+    end = f->zerocopy_end[f->zerocopy_index];
+    ret = f->ops->zerocopy_wait(f->opaque, end);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+}
+
 /**
  * Flushes QEMUFile buffer
  *
@@ -116,6 +149,9 @@ void qemu_fflush(QEMUFile *f)
     }
     if (ret >= 0) {
         f->pos += ret;
+        if (f->zerocopy_bufs && f->buf_index > 0) {
+            qemu_file_next_zerocopy_buf(f);
+        }
     }
     f->buf_index = 0;
     f->iovcnt = 0;
@@ -234,6 +270,116 @@ int qemu_get_fd(QEMUFile *f)
     return -1;
 }
 
+/*
+ * Have the transport send the data of qemu_put_buffer_async() from
+ * where it is, rather than copying it. Returns -ENOTSUP if it cannot.
+ */
+int qemu_file_set_zerocopy(QEMUFile *f, bool enable)
+{
+    int ret;
+
+    if (!f->ops->set_zerocopy) {
+        return -ENOTSUP;
+    }
+
+    qemu_fflush(f);
+    if (!enable && f->zerocopy_bufs) {
+        ret = f->ops->zerocopy_wait(f->opaque, f->pos);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = f->ops->set_zerocopy(f->opaque, enable);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (enable && !f->zerocopy_bufs) {
+        f->zerocopy_bufs = g_malloc(ZEROCOPY_BUFS * IO_BUF_SIZE);
+        memset(f->zerocopy_end, 0, sizeof(f->zerocopy_end));
+        f->zerocopy_index = 0;
+        f->buf = f->zerocopy_bufs;
+    } else if (!enable && f->zerocopy_bufs) {
+        g_free(f->zerocopy_bufs);
+        f->zerocopy_bufs = NULL;
+        f->buf = f->io_buf;
+    }
+    return 0;
+}
+
+/*
+ * Have the transport read the stream ahead in a thread of its own.
+ * Returns -ENOTSUP if it cannot.
+ */
+int qemu_file_start_readahead(QEMUFile *f)
+{
+    assert(!qemu_file_is_writable(f));
+
+    if (!f->ops->start_readahead) {
+        return -ENOTSUP;
+    }
+    return f->ops->start_readahead(f->opaque);
+}
+
+/*
+ * The offset in the underlying file of the next byte written to or read
+ * from f, or -ENOTSUP if the file cannot seek. f->pos is not it, as it also
+ * counts data sent on behalf of f by other means.
+ */
+int64_t qemu_file_get_offset(QEMUFile *f)
+{
+    int64_t offset;
+
+    if (!f->ops->seek) {
+        return -ENOTSUP;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+        if (qemu_file_get_error(f)) {
+            return qemu_file_get_error(f);
+        }
+    }
+    offset = f->ops->seek(f->opaque, 0, SEEK_CUR);
+    if (offset >= 0 && !qemu_file_is_writable(f)) {
+        /* what has been read ahead is still to come */
+        offset -= f->buf_size - f->buf_index;
+    }
+    return offset;
+}
+
+/*
+ * Go on writing or reading f at @offset in the underlying file, e.g. to
+ * skip over data that is accessed by other means. Returns 0 on success,
+ * -err on failure.
+ */
+int qemu_file_set_offset(QEMUFile *f, int64_t offset)
+{
+    int64_t ret;
+
+    if (!f->ops->seek) {
+        return -ENOTSUP;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+
+    ret = f->ops->seek(f->opaque, offset, SEEK_SET);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    return 0;
+}
+
 void qemu_update_position(QEMUFile *f, size_t size)
 {
     f->pos += size;
@@ -253,6 +399,14 @@ int qemu_fclose(QEMUFile *f)
     qemu_fflush(f);
     ret = qemu_file_get_error(f);
 
+    /*
+     * The transport may still be reading the buffers after the close;
+     * that only matters if the stream is still good.
+     */
+    if (f->zerocopy_bufs && ret == 0) {
+        ret = f->ops->zerocopy_wait(f->opaque, f->pos);
+    }
+
     if (f->ops->close) {
         int ret2 = f->ops->close(f->opaque);
         if (ret >= 0) {
@@ -265,6 +419,7 @@ int qemu_fclose(QEMUFile *f)
     if (f->last_error) {
         ret = f->last_error;
     }
+    g_free(f->zerocopy_bufs);
     g_free(f);
     trace_qemu_file_fclose();
     return ret;
@@ -511,24 +666,39 @@ void qemu_file_reset_rate_limit(QEMUFile *f)
     f->bytes_xfer = 0;
 }
 
+/*
+ * Account data that was sent on behalf of f by other means, e.g. over
+ * another connection, for the rate limit and the position of f.
+ */
+void qemu_file_credit_transfer(QEMUFile *f, size_t size)
+{
+    f->bytes_xfer += size;
+    f->pos += size;
+}
+
+/* These go into the buffer in one piece rather than byte by byte */
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
-    qemu_put_byte(f, v >> 8);
-    qemu_put_byte(f, v);
+    uint8_t buf[2];
+
+    stw_be_p(buf, v);
+    qemu_put_buffer(f, buf, sizeof(buf));
 }
 
 void qemu_put_be32(QEMUFile *f, unsigned int v)
 {
-    qemu_put_byte(f, v >> 24);
-    qemu_put_byte(f, v >> 16);
-    qemu_put_byte(f, v >> 8);
-    qemu_put_byte(f, v);
+    uint8_t buf[4];
+
+    stl_be_p(buf, v);
+    qemu_put_buffer(f, buf, sizeof(buf));
 }
 
 void qemu_put_be64(QEMUFile *f, uint64_t v)
 {
-    qemu_put_be32(f, v >> 32);
-    qemu_put_be32(f, v);
+    uint8_t buf[8];
+
+    stq_be_p(buf, v);
+    qemu_put_buffer(f, buf, sizeof(buf));
 }
 
 unsigned int qemu_get_be16(QEMUFile *f)
@@ -558,24 +728,34 @@ uint64_t qemu_get_be64(QEMUFile *f)
 }
 
 /* compress size bytes of data start at p with specific compression
- * level and store the compressed data to the buffer of f.
+ * method and level and store the compressed data to the buffer of f.
  */
 
-ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level)
+ssize_t qemu_put_compression_data(QEMUFile *f, CompressContext *ctx,
+                                  const uint8_t *p, size_t size,
+                                  int method, int level)
 {
     ssize_t blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
 
-    if (blen < compressBound(size)) {
+    if (blen < (ssize_t)compress_bound(method, size)) {
         return 0;
     }
-    if (compress2(f->buf + f->buf_index + sizeof(int32_t), (uLongf *)&blen,
-                  (Bytef *)p, size, level) != Z_OK) {
+    blen = compress_buffer(ctx, method, level,
+                           f->buf + f->buf_index + sizeof(int32_t), blen,
+                           p, size);
+    if (blen < 0) {
         error_report("Compress Failed!");
         return 0;
     }
     qemu_put_be32(f, blen);
     f->buf_index += blen;
+    f->bytes_xfer += blen;
+    if (f->ops->writev_buffer) {
+        add_to_iovec(f, f->buf + f->buf_index - blen, blen);
+    }
+    if (f->buf_index == IO_BUF_SIZE) {
+        qemu_fflush(f);
+    }
     return blen + sizeof(int32_t);
 }
 
@@ -26,18 +26,19 @@
  * THE SOFTWARE.
  */
 #include <stdint.h>
-#include <zlib.h>
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/timer.h"
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "exec/address-spaces.h"
 #include "migration/page_cache.h"
 #include "qemu/error-report.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/parallel.h"
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -47,9 +48,7 @@
     do { } while (0)
 #endif
 
-static bool mig_throttle_on;
 static int dirty_rate_high_cnt;
-static void check_guest_throttling(void);
 
 static uint64_t bitmap_sync_count;
 
@@ -65,6 +64,23 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/* multifd: number of connections in the setup stage, sync point after it */
+#define RAM_SAVE_FLAG_MULTIFD          0x200
+/* setup stage: the compression method if not zlib; no room for more flags
+ * with 1K target pages, so it is a combination that is not used otherwise
+ */
+#define RAM_SAVE_FLAG_COMPRESS_METHOD  (RAM_SAVE_FLAG_COMPRESS_PAGE | \
+                                        RAM_SAVE_FLAG_MEM_SIZE)
+/* setup stage, before the list of blocks: the pages are in place, see
+ * mapped-ram below
+ */
+#define RAM_SAVE_FLAG_MAPPED_RAM       (RAM_SAVE_FLAG_MULTIFD | \
+                                        RAM_SAVE_FLAG_MEM_SIZE)
+/* setup stage, before the list of blocks: shared blocks may be left out,
+ * see ignore-shared below
+ */
+#define RAM_SAVE_FLAG_IGNORE_SHARED    (RAM_SAVE_FLAG_MULTIFD | \
+                                        RAM_SAVE_FLAG_XBZRLE)
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
@@ -151,6 +167,11 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
+    uint64_t xbzrle_overflow_pages;
+    int64_t dirty_sync_log_time;
+    int64_t dirty_sync_merge_time;
+    uint64_t redirtied_pages;
+    uint64_t hot_pages;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -215,6 +236,31 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+uint64_t xbzrle_mig_overflow_pages(void)
+{
+    return acct_info.xbzrle_overflow_pages;
+}
+
+int64_t dirty_sync_log_time(void)
+{
+    return acct_info.dirty_sync_log_time;
+}
+
+int64_t dirty_sync_merge_time(void)
+{
+    return acct_info.dirty_sync_merge_time;
+}
+
+uint64_t redirtied_mig_pages(void)
+{
+    return acct_info.redirtied_pages;
+}
+
+uint64_t hot_mig_pages(void)
+{
+    return acct_info.hot_pages;
+}
+
 /* This is the last block that we have visited serching for dirty pages
  */
 static RAMBlock *last_seen_block;
@@ -223,14 +269,51 @@ static RAMBlock *last_sent_block;
 static ram_addr_t last_offset;
 static unsigned long *migration_bitmap;
 static QemuMutex migration_bitmap_mutex;
+
+/*
+ * Pages that the guest wrote again after they were sent are "hot": they
+ * are likely to be written again soon, so each round sends the other
+ * dirty pages first and the hot ones last, just before the next sync.
+ * @sent has the pages sent since the last sync; a page stays hot for as
+ * long as every sync finds it dirty again.  Same layout as
+ * migration_bitmap, and protected the same way.
+ */
+typedef struct HotPageBitmaps {
+    unsigned long *sent;
+    unsigned long *hot;
+    unsigned long size;
+} HotPageBitmaps;
+
+static HotPageBitmaps *hot_pages;
+/* the scan is in its first pass of the round, which skips hot pages */
+static bool hot_pages_deferred;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
 
+/* Pages the destination asked for in postcopy, to send before the others */
+typedef struct RAMSrcPageRequest {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    ram_addr_t len;
+
+    QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
+} RAMSrcPageRequest;
+
+static QemuMutex src_page_req_mutex;
+static QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(src_page_requests);
+/* only used by the return path thread */
+static RAMBlock *last_requested_block;
+
+/* discards sent in a single MIG_CMD_POSTCOPY_RAM_DISCARD */
+#define MAX_DISCARDS_PER_COMMAND 256
+
 struct CompressParam {
     bool start;
     bool done;
     QEMUFile *file;
+    CompressContext *ctx;
     QemuMutex mutex;
     QemuCond cond;
     RAMBlock *block;
@@ -238,13 +321,29 @@ struct CompressParam {
 };
 typedef struct CompressParam CompressParam;
 
-struct DecompressParam {
-    bool start;
-    QemuMutex mutex;
-    QemuCond cond;
+/* Pages queued on one decompression thread at most; a power of two */
+#define DECOMP_RING_SIZE 16
+/* Another thread is started once every running one has this many queued */
+#define DECOMP_GROW_BACKLOG 4
+
+typedef struct DecompressSlot {
     void *des;
-    uint8 *compbuf;
+    uint8_t *compbuf;
     int len;
+} DecompressSlot;
+
+/*
+ * A ring of pages with a single producer, the loading thread, which
+ * advances @head, and a single consumer, the decompression thread,
+ * which advances @tail.
+ */
+struct DecompressParam {
+    QemuThread thread;
+    CompressContext *ctx;
+    QemuEvent ready;            /* set after @head moves */
+    unsigned head;
+    unsigned tail;
+    DecompressSlot slots[DECOMP_RING_SIZE];
 };
 typedef struct DecompressParam DecompressParam;
 
@@ -263,8 +362,14 @@ static bool compression_switch;
 static bool quit_comp_thread;
 static bool quit_decomp_thread;
 static DecompressParam *decomp_param;
-static QemuThread *decompress_threads;
-static uint8_t *compressed_data_buf;
+/* decompression threads started, out of decomp_max_threads */
+static int decomp_running;
+static int decomp_max_threads;
+/* set after the @tail of any of them moves */
+static QemuEvent decomp_space;
+/* fixed for the whole migration, as the destination is told once */
+static MigrationCompressMethod compress_method;
+static MigrationCompressMethod decompress_method;
 
 static int do_compress_ram_page(CompressParam *param);
 
@@ -323,6 +428,7 @@ void migrate_compress_threads_join(void)
     for (i = 0; i < thread_count; i++) {
         qemu_thread_join(compress_threads + i);
         qemu_fclose(comp_param[i].file);
+        compress_context_free(comp_param[i].ctx);
         qemu_mutex_destroy(&comp_param[i].mutex);
         qemu_cond_destroy(&comp_param[i].cond);
     }
@@ -359,6 +465,7 @@ void migrate_compress_threads_create(void)
          * it's ops to empty.
          */
         comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
+        comp_param[i].ctx = compress_context_new();
         comp_param[i].done = true;
         qemu_mutex_init(&comp_param[i].mutex);
         qemu_cond_init(&comp_param[i].cond);
@@ -382,20 +489,570 @@ void migrate_compress_threads_create(void)
  */
 static size_t save_page_header(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
 {
+    uint8_t buf[8 + 1 + sizeof(block->idstr)];
     size_t size, len;
 
-    qemu_put_be64(f, offset);
+    /* assembled here so that it goes into f in one piece */
+    stq_be_p(buf, offset);
     size = 8;
 
     if (!(offset & RAM_SAVE_FLAG_CONTINUE)) {
         len = strlen(block->idstr);
-        qemu_put_byte(f, len);
-        qemu_put_buffer(f, (uint8_t *)block->idstr, len);
-        size += 1 + len;
+        buf[size++] = len;
+        memcpy(buf + size, block->idstr, len);
+        size += len;
     }
+    qemu_put_buffer(f, buf, size);
     return size;
 }
 
+/* mapped-ram
+ *
+ * With a file: migration, the setup stage reserves room in the file for
+ * every RAM block: a bitmap of the pages that are not zero, followed by
+ * all of its pages at fixed offsets. The pages are written there by the
+ * migration thread, or by the multifd channels if there are any, so a
+ * page that is sent again overwrites its older copy. The bitmaps are
+ * written once everything has been sent.
+ *
+ * In the stream, RAM_SAVE_FLAG_MAPPED_RAM comes before the list of blocks,
+ * and every block in the list is followed by the offsets of its bitmap
+ * and of its pages. The stream goes on after the pages of the block. In
+ * the file, bit i of a bitmap is bit i % 8 of byte i / 8.
+ */
+
+#define MAPPED_RAM_ALIGN            (1 << 20)
+/* the largest logical block size that O_DIRECT may need alignment to */
+#define MAPPED_RAM_DIRECT_ALIGN     4096
+/* the most pages written at once */
+#define MAPPED_RAM_RUN_PAGES        64
+#define MAPPED_RAM_LOAD_CHUNK_PAGES ((64 << 20) >> TARGET_PAGE_BITS)
+#define MAPPED_RAM_LOAD_THREADS     8
+
+/* consecutive pages of a block that are still to be written */
+typedef struct MappedRamRun {
+    RAMBlock *block;
+    ram_addr_t offset;
+    ram_addr_t len;
+} MappedRamRun;
+
+static bool mapped_ram;
+static int mapped_ram_fd = -1;
+static MappedRamRun mapped_ram_run;
+
+/* The size of the bitmap of @pages pages in the file */
+static size_t mapped_ram_bitmap_size(uint64_t pages)
+{
+    return DIV_ROUND_UP(pages, 64) * 8;
+}
+
+/* Convert a bitmap between host order and file order, in place */
+static void mapped_ram_bitmap_le(unsigned long *bmap, size_t size)
+{
+#ifdef HOST_WORDS_BIGENDIAN
+    size_t i;
+
+    for (i = 0; i < size / sizeof(unsigned long); i++) {
+#if HOST_LONG_BITS == 64
+        bmap[i] = bswap64(bmap[i]);
+#else
+        bmap[i] = bswap32(bmap[i]);
+#endif
+    }
+#endif
+}
+
+/* pwrite() or pread() all of @size bytes; returns 0 or -errno */
+static int mapped_ram_io(int fd, bool write, uint8_t *buf, size_t size,
+                         uint64_t offset)
+{
+    ssize_t len;
+
+    while (size) {
+        if (write) {
+            len = pwrite(fd, buf, size, offset);
+        } else {
+            len = pread(fd, buf, size, offset);
+        }
+        if (len < 0 && errno == EINTR) {
+            continue;
+        } else if (len < 0) {
+            return -errno;
+        } else if (len == 0) {
+            return -EIO;
+        }
+        buf += len;
+        size -= len;
+        offset += len;
+    }
+    return 0;
+}
+
+static int mapped_ram_flush(MappedRamRun *run)
+{
+    int ret = 0;
+
+    if (run->len) {
+        ret = mapped_ram_io(mapped_ram_fd, true,
+                            memory_region_get_ram_ptr(run->block->mr) +
+                            run->offset, run->len,
+                            run->block->pages_offset + run->offset);
+        run->len = 0;
+    }
+    return ret;
+}
+
+/* Write the page at @offset of @block, together with the next ones if
+ * they follow it; until then, the page may change and still be sent with
+ * its latest content, which is fine as it is dirty again then.
+ */
+static int mapped_ram_write_page(MappedRamRun *run, RAMBlock *block,
+                                 ram_addr_t offset)
+{
+    int ret = 0;
+
+    if (run->len && (block != run->block ||
+                     offset != run->offset + run->len ||
+                     run->len == MAPPED_RAM_RUN_PAGES * TARGET_PAGE_SIZE)) {
+        ret = mapped_ram_flush(run);
+    }
+    if (!run->len) {
+        run->block = block;
+        run->offset = offset;
+    }
+    run->len += TARGET_PAGE_SIZE;
+    return ret;
+}
+
+/* Reserve the room of @block in the file and skip over it in the stream */
+static int mapped_ram_setup_block(QEMUFile *f, RAMBlock *block)
+{
+    uint64_t pages = block->used_length >> TARGET_PAGE_BITS;
+    int64_t offset;
+
+    offset = qemu_file_get_offset(f);
+    if (offset < 0) {
+        error_report("mapped-ram: cannot seek in the migration file: %s",
+                     strerror(-offset));
+        return offset;
+    }
+
+    /* the two offsets go first */
+    block->bitmap_offset = offset + 16;
+    block->pages_offset = ROUND_UP(block->bitmap_offset +
+                                   mapped_ram_bitmap_size(pages),
+                                   MAPPED_RAM_ALIGN);
+    block->file_bmap = bitmap_new(ROUND_UP(pages, 64));
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+    trace_mapped_ram_setup_block(block->idstr, block->bitmap_offset,
+                                 block->pages_offset);
+
+    return qemu_file_set_offset(f, block->pages_offset + block->used_length);
+}
+
+static void mapped_ram_save_bitmaps(QEMUFile *f)
+{
+    RAMBlock *block;
+    size_t size;
+    int ret;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!block->file_bmap) {
+            continue;
+        }
+        size = mapped_ram_bitmap_size(block->used_length >> TARGET_PAGE_BITS);
+        mapped_ram_bitmap_le(block->file_bmap, size);
+        ret = mapped_ram_io(qemu_get_fd(f), true,
+                            (uint8_t *)block->file_bmap, size,
+                            block->bitmap_offset);
+        mapped_ram_bitmap_le(block->file_bmap, size);
+        if (ret < 0) {
+            error_report("mapped-ram: failed to write the bitmap of %s: %s",
+                         block->idstr, strerror(-ret));
+            qemu_file_set_error(f, ret);
+            return;
+        }
+    }
+}
+
+static void mapped_ram_save_cleanup(void)
+{
+    RAMBlock *block;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
+    rcu_read_unlock();
+    mapped_ram_run.len = 0;
+}
+
+/* ignore-shared
+ *
+ * RAM blocks that are files mapped with MAP_SHARED are not sent: the
+ * destination maps the same files, and sees everything the guest wrote
+ * once the source has stopped. Their pages are never dirty in the
+ * migration bitmap, and their dirty log is not synced.
+ *
+ * In the stream, RAM_SAVE_FLAG_IGNORE_SHARED comes before the list of
+ * blocks, and every block in the list is followed by a byte that says
+ * whether it is left out; if so, the device and inode numbers of its file
+ * follow, so that the destination can check that it maps the same one.
+ */
+
+static bool ignore_shared;
+static bool ignore_shared_stream;
+
+static bool ramblock_is_ignored(RAMBlock *block)
+{
+    return ignore_shared && qemu_ram_is_shared(block);
+}
+
+static int ignore_shared_setup_block(QEMUFile *f, RAMBlock *block)
+{
+    struct stat st;
+
+    if (!ramblock_is_ignored(block)) {
+        qemu_put_byte(f, 0);
+        return 0;
+    }
+    if (fstat(block->fd, &st) < 0) {
+        error_report("ignore-shared: cannot stat the file of %s: %s",
+                     block->idstr, strerror(errno));
+        return -errno;
+    }
+    trace_ram_ignore_shared_block(block->idstr, st.st_dev, st.st_ino);
+    qemu_put_byte(f, 1);
+    qemu_put_be64(f, st.st_dev);
+    qemu_put_be64(f, st.st_ino);
+    return 0;
+}
+
+static int ignore_shared_load_block(QEMUFile *f, RAMBlock *block)
+{
+    uint64_t dev, ino;
+    struct stat st;
+
+    if (!qemu_get_byte(f)) {
+        return 0;
+    }
+    dev = qemu_get_be64(f);
+    ino = qemu_get_be64(f);
+    trace_ram_ignore_shared_block(block->idstr, dev, ino);
+
+    if (!qemu_ram_is_shared(block) || fstat(block->fd, &st) < 0 ||
+        st.st_dev != dev || st.st_ino != ino) {
+        error_report("RAM block %s was not sent, and it is not the same "
+                     "shared file here", block->idstr);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* multifd
+ *
+ * The migration thread hands pages to a thread per additional connection,
+ * which checks them for zero, compresses them if compression is on and
+ * sends them with the same headers as on the main stream. A page always
+ * goes to the same connection, in runs of MULTIFD_SHARD_PAGES pages.
+ *
+ * At the end of every round on the main stream the connections are
+ * drained and a sync point is sent on each of them and on the main
+ * stream. The destination does not go on with the main stream past a
+ * sync point before it has loaded everything up to the sync point of
+ * every connection, so resent pages are never overwritten with older
+ * data.
+ *
+ * A connection starts with MULTIFD_MAGIC and its index and ends with
+ * RAM_SAVE_FLAG_EOS.
+ *
+ * With mapped-ram, the channels have no connection of their own but write
+ * the pages to their place in the file, and only a sync point without any
+ * connection to wait for is put on the main stream.
+ */
+
+#define MULTIFD_MAGIC           0x5145464d
+#define MULTIFD_QUEUE_LEN       256
+#define MULTIFD_SHARD_PAGES     64
+
+/* a page, or a sync point or the end if flags say so */
+typedef struct MultiFDItem {
+    RAMBlock *block;
+    ram_addr_t offset;
+    int flags;
+} MultiFDItem;
+
+typedef struct MultiFDSendParams {
+    int id;
+    QemuThread thread;
+    QEMUFile *file;     /* NULL with mapped-ram */
+    QemuMutex mutex;
+    QemuCond cond;      /* signaled whenever the queue changes */
+    MultiFDItem queue[MULTIFD_QUEUE_LEN];
+    unsigned int head;
+    unsigned int count; /* items queued or being sent */
+    int error;
+} MultiFDSendParams;
+
+typedef struct MultiFDRecvParams {
+    int id;
+    QemuThread thread;
+    QEMUFile *file;
+    /* protected by multifd_recv_lock */
+    uint64_t synced;    /* sync points loaded */
+    bool done;
+    int error;
+} MultiFDRecvParams;
+
+static MultiFDSendParams *multifd_send;
+static int multifd_send_count;
+static MultiFDRecvParams *multifd_recv;
+static int multifd_recv_count;
+static uint64_t multifd_recv_syncs;
+static bool multifd_recv_quit;
+static QemuMutex multifd_recv_lock;
+static QemuCond multifd_recv_cond;
+
+static void multifd_send_page(QEMUFile *f, CompressContext *ctx,
+                              RAMBlock *block, ram_addr_t offset,
+                              RAMBlock **last_block)
+{
+    uint8_t *p = memory_region_get_ram_ptr(block->mr) + offset;
+
+    if (block == *last_block) {
+        offset |= RAM_SAVE_FLAG_CONTINUE;
+    }
+    *last_block = block;
+
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        save_page_header(f, block, offset | RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+    } else if (migrate_use_compression()) {
+        save_page_header(f, block, offset | RAM_SAVE_FLAG_COMPRESS_PAGE);
+        if (!qemu_put_compression_data(f, ctx, p, TARGET_PAGE_SIZE,
+                                       compress_method,
+                                       migrate_compress_level())) {
+            /* make room in the buffer */
+            qemu_fflush(f);
+            if (!qemu_put_compression_data(f, ctx, p, TARGET_PAGE_SIZE,
+                                           compress_method,
+                                           migrate_compress_level())) {
+                qemu_file_set_error(f, -EIO);
+            }
+        }
+    } else {
+        save_page_header(f, block, offset | RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+    }
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    CompressContext *ctx = compress_context_new();
+    RAMBlock *last_block = NULL;
+    MappedRamRun run = {};
+    MultiFDItem item;
+    int ret;
+
+    if (p->file) {
+        qemu_put_be32(p->file, MULTIFD_MAGIC);
+        qemu_put_be32(p->file, p->id);
+        qemu_fflush(p->file);
+    }
+
+    do {
+        qemu_mutex_lock(&p->mutex);
+        while (!p->count) {
+            qemu_cond_wait(&p->cond, &p->mutex);
+        }
+        item = p->queue[p->head];
+        qemu_mutex_unlock(&p->mutex);
+
+        if (!p->file) {
+            if (item.flags == RAM_SAVE_FLAG_PAGE) {
+                ret = mapped_ram_write_page(&run, item.block, item.offset);
+            } else {
+                ret = mapped_ram_flush(&run);
+            }
+        } else if (item.flags == RAM_SAVE_FLAG_PAGE) {
+            multifd_send_page(p->file, ctx, item.block, item.offset,
+                              &last_block);
+            ret = qemu_file_get_error(p->file);
+        } else {
+            qemu_put_be64(p->file, item.flags);
+            qemu_fflush(p->file);
+            ret = qemu_file_get_error(p->file);
+        }
+
+        qemu_mutex_lock(&p->mutex);
+        p->head = (p->head + 1) % MULTIFD_QUEUE_LEN;
+        p->count--;
+        if (ret < 0) {
+            p->error = ret;
+        }
+        qemu_cond_broadcast(&p->cond);
+        qemu_mutex_unlock(&p->mutex);
+    } while (ret == 0 && item.flags != RAM_SAVE_FLAG_EOS);
+
+    compress_context_free(ctx);
+
+    return NULL;
+}
+
+/* Wait for room in the queue; returns the error of the channel if any. */
+static int multifd_queue(MultiFDSendParams *p, RAMBlock *block,
+                         ram_addr_t offset, int flags)
+{
+    MultiFDItem *item;
+    int ret;
+
+    qemu_mutex_lock(&p->mutex);
+    while (p->count == MULTIFD_QUEUE_LEN && !p->error) {
+        qemu_cond_wait(&p->cond, &p->mutex);
+    }
+    ret = p->error;
+    if (!ret) {
+        item = &p->queue[(p->head + p->count) % MULTIFD_QUEUE_LEN];
+        item->block = block;
+        item->offset = offset;
+        item->flags = flags;
+        p->count++;
+        qemu_cond_broadcast(&p->cond);
+    }
+    qemu_mutex_unlock(&p->mutex);
+
+    return ret;
+}
+
+static int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                              uint64_t *bytes_transferred)
+{
+    ram_addr_t page = (block->offset + offset) >> TARGET_PAGE_BITS;
+    int idx = (page / MULTIFD_SHARD_PAGES) % multifd_send_count;
+    int ret;
+
+    ret = multifd_queue(&multifd_send[idx], block, offset,
+                        RAM_SAVE_FLAG_PAGE);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+
+    acct_info.norm_pages++;
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    qemu_file_credit_transfer(f, TARGET_PAGE_SIZE);
+
+    return 1;
+}
+
+/* Drain all connections and put a sync point on them and on f. */
+static void multifd_send_sync(QEMUFile *f)
+{
+    MultiFDSendParams *p;
+    int i, ret = 0;
+
+    for (i = 0; i < multifd_send_count && !ret; i++) {
+        ret = multifd_queue(&multifd_send[i], NULL, 0, RAM_SAVE_FLAG_MULTIFD);
+    }
+    for (i = 0; i < multifd_send_count && !ret; i++) {
+        p = &multifd_send[i];
+        qemu_mutex_lock(&p->mutex);
+        while (p->count && !p->error) {
+            qemu_cond_wait(&p->cond, &p->mutex);
+        }
+        ret = p->error;
+        qemu_mutex_unlock(&p->mutex);
+    }
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD);
+}
+
+static int multifd_save_setup(void)
+{
+    MigrationState *s = migrate_get_current();
+    int i, fd, channels = migrate_multifd_channels();
+    Error *local_err = NULL;
+    MultiFDSendParams *p;
+
+    multifd_send = g_new0(MultiFDSendParams, channels);
+    for (i = 0; i < channels; i++) {
+        p = &multifd_send[i];
+        p->id = i;
+        if (!mapped_ram) {
+            fd = tcp_multifd_connect(s, &local_err);
+            if (fd < 0) {
+                error_report_err(local_err);
+                migrate_multifd_save_cleanup();
+                return -1;
+            }
+            p->file = qemu_fopen_socket(fd, "wb");
+            if (migrate_use_zerocopy()) {
+                /* if it fails, that was already reported for the stream */
+                qemu_file_set_zerocopy(p->file, true);
+            }
+        }
+        qemu_mutex_init(&p->mutex);
+        qemu_cond_init(&p->cond);
+        qemu_thread_create(&p->thread, "multifd-send", multifd_send_thread, p,
+                           QEMU_THREAD_JOINABLE);
+        /* the channel may be shut down by a cancel from now on */
+        atomic_mb_set(&multifd_send_count, i + 1);
+    }
+
+    return 0;
+}
+
+/* Make the channels fail if they are stuck sending; used on cancel. */
+void migrate_multifd_save_shutdown(void)
+{
+    int i;
+
+    for (i = 0; i < atomic_mb_read(&multifd_send_count); i++) {
+        if (multifd_send[i].file) {
+            qemu_file_shutdown(multifd_send[i].file);
+        }
+    }
+}
+
+void migrate_multifd_save_cleanup(void)
+{
+    MigrationState *s = migrate_get_current();
+    MultiFDSendParams *p;
+    int i;
+
+    for (i = 0; i < multifd_send_count; i++) {
+        p = &multifd_send[i];
+        if (s->state != MIGRATION_STATUS_COMPLETED && p->file) {
+            qemu_file_shutdown(p->file);
+        }
+        multifd_queue(p, NULL, 0, RAM_SAVE_FLAG_EOS);
+    }
+    for (i = 0; i < multifd_send_count; i++) {
+        p = &multifd_send[i];
+        qemu_thread_join(&p->thread);
+        if (p->file) {
+            qemu_fclose(p->file);
+        }
+        qemu_mutex_destroy(&p->mutex);
+        qemu_cond_destroy(&p->cond);
+    }
+    g_free(multifd_send);
+    multifd_send = NULL;
+    atomic_mb_set(&multifd_send_count, 0);
+
+    /* the channels that wrote to it are gone */
+    if (mapped_ram_fd >= 0) {
+        close(mapped_ram_fd);
+        mapped_ram_fd = -1;
+    }
+}
+
 /* Update the xbzrle cache to reflect a page that's been sent as all 0.
  * The important thing is that a stale (not-yet-0'd) page be replaced
  * by the new data.
@@ -467,8 +1124,11 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
         DPRINTF("Skipping unmodified page\n");
         return 0;
     } else if (encoded_len == -1) {
-        DPRINTF("Overflow\n");
         acct_info.xbzrle_overflows++;
+        if (cache_mark_overflow(XBZRLE.cache, current_addr)) {
+            acct_info.xbzrle_overflow_pages++;
+        }
+        trace_save_xbzrle_page_overflow(block->idstr, offset);
         /* update data in the cache */
         if (!last_stage) {
             memcpy(prev_cached_page, *current_data, TARGET_PAGE_SIZE);
@@ -495,6 +1155,71 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     return 1;
 }
 
+static HotPageBitmaps *hot_pages_new(unsigned long size)
+{
+    HotPageBitmaps *hp = g_new(HotPageBitmaps, 1);
+
+    hp->sent = bitmap_new(size);
+    hp->hot = bitmap_new(size);
+    hp->size = size;
+    return hp;
+}
+
+static void hot_pages_free(HotPageBitmaps *hp)
+{
+    if (hp) {
+        g_free(hp->sent);
+        g_free(hp->hot);
+        g_free(hp);
+    }
+}
+
+/* Like find_next_bit(), but skips the pages that are set in @hot */
+static unsigned long find_next_cold_bit(const unsigned long *bitmap,
+                                        const unsigned long *hot,
+                                        unsigned long size,
+                                        unsigned long nr)
+{
+    unsigned long i, word;
+
+    if (nr >= size) {
+        return size;
+    }
+    i = BIT_WORD(nr);
+    word = bitmap[i] & ~hot[i] & BITMAP_FIRST_WORD_MASK(nr);
+    while (!word) {
+        if (++i >= BITS_TO_LONGS(size)) {
+            return size;
+        }
+        word = bitmap[i] & ~hot[i];
+    }
+    return MIN(i * BITS_PER_LONG + ctzl(word), size);
+}
+
+/*
+ * Called with rcu_read_lock() and migration_bitmap_mutex held, after new
+ * dirty pages were merged into migration_bitmap
+ */
+static void hot_pages_sync(void)
+{
+    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap);
+    HotPageBitmaps *hp = atomic_rcu_read(&hot_pages);
+    uint64_t redirtied = 0, hot = 0;
+    unsigned long i;
+
+    for (i = 0; i < BITS_TO_LONGS(hp->size); i++) {
+        redirtied += ctpopl(bitmap[i] & hp->sent[i]);
+        hp->hot[i] = bitmap[i] & (hp->sent[i] | hp->hot[i]);
+        hot += ctpopl(hp->hot[i]);
+        hp->sent[i] = 0;
+    }
+
+    acct_info.redirtied_pages += redirtied;
+    acct_info.hot_pages = hot;
+    hot_pages_deferred = hot != 0;
+    trace_migration_hot_pages(redirtied, hot);
+}
+
 /* Called with rcu_read_lock() to protect migration_bitmap */
 static inline
 ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
@@ -511,6 +1236,9 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     bitmap = atomic_rcu_read(&migration_bitmap);
     if (ram_bulk_stage && nr > base) {
         next = nr + 1;
+    } else if (hot_pages_deferred) {
+        next = find_next_cold_bit(bitmap, atomic_rcu_read(&hot_pages)->hot,
+                                  size, nr);
     } else {
         next = find_next_bit(bitmap, size, nr);
     }
@@ -522,15 +1250,136 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     return (next - base) << TARGET_PAGE_BITS;
 }
 
-/* Called with rcu_read_lock() to protect migration_bitmap */
-static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
-{
+/*
+ * Called with rcu_read_lock() to protect migration_bitmap
+ * Returns whether the page at @addr was dirty
+ */
+static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
+{
+    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap);
+
+    if (test_and_clear_bit(addr >> TARGET_PAGE_BITS, bitmap)) {
+        migration_dirty_pages--;
+        return true;
+    }
+    return false;
+}
+
+/* Called with rcu_read_lock() to protect migration_bitmap */
+static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
+{
     unsigned long *bitmap;
     bitmap = atomic_rcu_read(&migration_bitmap);
     migration_dirty_pages +=
         cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
 }
 
+/*
+ * The whole words of the dirty bitmaps are merged by up to
+ * DIRTY_SYNC_THREADS threads, a gigabyte of guest RAM at a time;
+ * smaller guests are not worth waking them up for.
+ */
+#define DIRTY_SYNC_THREADS      8
+#define DIRTY_SYNC_CHUNK        (1ULL << 30)
+#define DIRTY_SYNC_WORD         ((ram_addr_t)BITS_PER_LONG << TARGET_PAGE_BITS)
+
+typedef struct DirtySyncJob {
+    ram_addr_t start;
+    ram_addr_t length;
+    uint64_t num_dirty;
+} DirtySyncJob;
+
+typedef struct DirtySyncState {
+    unsigned long *bitmap;
+    DirtySyncJob *jobs;
+    int njobs;
+} DirtySyncState;
+
+static void migration_bitmap_sync_job(void *opaque, int index)
+{
+    DirtySyncState *ds = opaque;
+    DirtySyncJob *job = &ds->jobs[index];
+
+    job->num_dirty = cpu_physical_memory_sync_dirty_bitmap(ds->bitmap,
+                                                           job->start,
+                                                           job->length);
+}
+
+/*
+ * Each block is split into the bits before its first whole word of the
+ * bitmaps, the whole words, and the bits after the last one. The whole
+ * words are updated with plain stores, so no two threads may share one;
+ * the partial words at either end, which a block may share with the one
+ * next to it, are left to this thread.
+ *
+ * Called with rcu_read_lock() to protect migration_bitmap
+ */
+static void migration_bitmap_sync_blocks(void)
+{
+    DirtySyncState ds = { .bitmap = atomic_rcu_read(&migration_bitmap) };
+    RAMBlock *block;
+    ram_addr_t start, end, first, last, addr;
+    int i, n = 0;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        n += DIV_ROUND_UP(block->used_length, DIRTY_SYNC_CHUNK);
+    }
+    ds.jobs = g_new(DirtySyncJob, n);
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (ramblock_is_ignored(block)) {
+            continue;
+        }
+        start = block->mr->ram_addr;
+        end = start + block->used_length;
+        first = QEMU_ALIGN_UP(start, DIRTY_SYNC_WORD);
+        last = QEMU_ALIGN_DOWN(end, DIRTY_SYNC_WORD);
+        if (first >= last) {
+            migration_bitmap_sync_range(start, block->used_length);
+            continue;
+        }
+        migration_bitmap_sync_range(start, first - start);
+        migration_bitmap_sync_range(last, end - last);
+        for (addr = first; addr < last; addr += DIRTY_SYNC_CHUNK) {
+            ds.jobs[ds.njobs].start = addr;
+            ds.jobs[ds.njobs].length = MIN(DIRTY_SYNC_CHUNK, last - addr);
+            ds.njobs++;
+        }
+    }
+
+    parallel_for(ds.njobs, DIRTY_SYNC_THREADS, migration_bitmap_sync_job,
+                 &ds);
+
+    for (i = 0; i < ds.njobs; i++) {
+        migration_dirty_pages += ds.jobs[i].num_dirty;
+    }
+    g_free(ds.jobs);
+}
+
+
+/*
+ * To reduce the dirty rate, keep the vCPUs out of the guest for part of
+ * the time; the workload slows down accordingly. The dirty rate is taken
+ * to scale with the time the vCPUs run, so aim for the share of running
+ * time at which the guest would dirty half as much as was sent. Move
+ * there by at most cpu-throttle-increment points a round, so that one
+ * noisy measurement does not stall the guest, and start at no more than
+ * cpu-throttle-initial.
+ */
+static void mig_throttle_guest_down(uint64_t bytes_dirty, uint64_t bytes_xfer)
+{
+    int pct = cpu_throttle_get_percentage();
+    int target;
+
+    target = 100 - (100 - pct) * bytes_xfer / 2 / bytes_dirty;
+    if (!cpu_throttle_active()) {
+        pct = MIN(target, migrate_cpu_throttle_initial());
+    } else {
+        pct += MIN(MAX(target - pct, 1), migrate_cpu_throttle_increment());
+    }
+    trace_migration_throttle(pct, target);
+    cpu_throttle_set(pct);
+}
 
 /* Fix me: there are too many global variables used in migration process. */
 static int64_t start_time;
@@ -548,14 +1397,65 @@ static void migration_bitmap_sync_init(void)
     iterations_prev = 0;
 }
 
+/*
+ * The dirty log is re-protected in chunks of 1 << CLEAR_BITMAP_SHIFT pages
+ * (1 GiB with 4 KiB pages), just before the first page of a chunk is sent,
+ * rather than for the whole of guest memory when the log is synced.  Pages
+ * the guest writes in the meantime need no second fault, and sending a
+ * chunk is what makes it worth tracking it again.
+ */
+#define CLEAR_BITMAP_SHIFT  18
+
+static void migration_clear_bitmap_fill(void)
+{
+    RAMBlock *block;
+    unsigned long chunks;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (ramblock_is_ignored(block)) {
+            continue;
+        }
+        chunks = DIV_ROUND_UP(block->max_length >> TARGET_PAGE_BITS,
+                              1UL << CLEAR_BITMAP_SHIFT);
+        if (!block->clear_bmap) {
+            block->clear_bmap = bitmap_new(chunks);
+        }
+        bitmap_set(block->clear_bmap, 0, chunks);
+    }
+}
+
+/*
+ * Called by the migration thread before sending the page at @offset of
+ * @block: clears the dirty log of its chunk, unless that already happened
+ * since the last sync.  Done before the page is read, so that a write
+ * racing with the send is logged again.
+ */
+static void migration_clear_memory_region_dirty_log(RAMBlock *block,
+                                                    ram_addr_t offset)
+{
+    unsigned long chunk = offset >> (TARGET_PAGE_BITS + CLEAR_BITMAP_SHIFT);
+    hwaddr start, size;
+
+    if (!block->clear_bmap ||
+        !test_and_clear_bit(chunk, block->clear_bmap)) {
+        return;
+    }
+
+    start = (hwaddr)chunk << (TARGET_PAGE_BITS + CLEAR_BITMAP_SHIFT);
+    size = MIN((hwaddr)1 << (TARGET_PAGE_BITS + CLEAR_BITMAP_SHIFT),
+               block->used_length - start);
+    memory_region_clear_dirty_log(block->mr, start, size);
+}
+
 /* Called with iothread lock held, to protect ram_list.dirty_memory[] */
 static void migration_bitmap_sync(void)
 {
-    RAMBlock *block;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
+    int64_t sync_time, log_time, merge_time;
     int64_t end_time;
     int64_t bytes_xfer_now;
+    uint64_t bytes_dirty_period, bytes_xfer_period, downtime;
 
     bitmap_sync_count++;
 
@@ -568,41 +1468,56 @@ static void migration_bitmap_sync(void)
     }
 
     trace_migration_bitmap_sync_start();
+    sync_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     address_space_sync_dirty_bitmap(&address_space_memory);
+    log_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     qemu_mutex_lock(&migration_bitmap_mutex);
     rcu_read_lock();
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->mr->ram_addr, block->used_length);
-    }
+    migration_bitmap_sync_blocks();
+    migration_clear_bitmap_fill();
+    hot_pages_sync();
     rcu_read_unlock();
     qemu_mutex_unlock(&migration_bitmap_mutex);
 
+    merge_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    acct_info.dirty_sync_log_time = log_time - sync_time;
+    acct_info.dirty_sync_merge_time = merge_time - log_time;
+
     trace_migration_bitmap_sync_end(migration_dirty_pages
-                                    - num_dirty_pages_init);
+                                    - num_dirty_pages_init,
+                                    acct_info.dirty_sync_log_time,
+                                    acct_info.dirty_sync_merge_time);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
         if (migrate_auto_converge()) {
-            /* The following detection logic can be refined later. For now:
-               Check to see if the dirtied bytes is 50% more than the approx.
-               amount of bytes that just got transferred since the last time we
-               were in this routine. If that happens >N times (for now N==4)
-               we turn on the throttle down logic */
+            /* Throttle the guest when it dirties more than half of what
+               got sent in the same time, and what is left to send after
+               this round would take longer than the allowed downtime at
+               the current bandwidth. Wait for two such rounds before the
+               first throttling, then adjust it every round. */
             bytes_xfer_now = ram_bytes_transferred();
+            bytes_dirty_period = num_dirty_pages_period * TARGET_PAGE_SIZE;
+            bytes_xfer_period = MAX(bytes_xfer_now - bytes_xfer_prev, 1);
+            downtime = (double)migration_dirty_pages * TARGET_PAGE_SIZE *
+                       (end_time - start_time) * 1000000 / bytes_xfer_period;
             if (s->dirty_pages_rate &&
-               (num_dirty_pages_period * TARGET_PAGE_SIZE >
-                   (bytes_xfer_now - bytes_xfer_prev)/2) &&
-               (dirty_rate_high_cnt++ > 4)) {
-                    trace_migration_throttle();
-                    mig_throttle_on = true;
+                bytes_dirty_period > bytes_xfer_period / 2 &&
+                downtime > migrate_max_downtime()) {
+                if (cpu_throttle_active() || ++dirty_rate_high_cnt >= 2) {
+                    mig_throttle_guest_down(bytes_dirty_period,
+                                            bytes_xfer_period);
                     dirty_rate_high_cnt = 0;
-             }
-             bytes_xfer_prev = bytes_xfer_now;
-        } else {
-             mig_throttle_on = false;
+                }
+            } else {
+                dirty_rate_high_cnt = 0;
+            }
+            bytes_xfer_prev = bytes_xfer_now;
+        } else if (cpu_throttle_active()) {
+            cpu_throttle_stop();
         }
         if (migrate_use_xbzrle()) {
             if (iterations_prev != acct_info.iterations) {
@@ -651,6 +1566,54 @@ static int save_zero_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
     return pages;
 }
 
+/**
+ * mapped_ram_save_page: Write the given page to its place in the file
+ *
+ * Returns: Number of pages written.
+ *
+ * @f: QEMUFile where to account for the data
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int mapped_ram_save_page(QEMUFile *f, RAMBlock *block,
+                                ram_addr_t offset,
+                                uint64_t *bytes_transferred)
+{
+    uint8_t *p = memory_region_get_ram_ptr(block->mr) + offset;
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+    int ret;
+
+    if (!block->file_bmap) {
+        error_report("mapped-ram: RAM block %s was added during migration",
+                     block->idstr);
+        qemu_file_set_error(f, -EINVAL);
+        return 1;
+    }
+
+    /* the destination starts out with zeroes; just forget older copies */
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        clear_bit(page, block->file_bmap);
+        acct_info.dup_pages++;
+        return 1;
+    }
+
+    set_bit(page, block->file_bmap);
+    if (multifd_send_count) {
+        return multifd_queue_page(f, block, offset, bytes_transferred);
+    }
+
+    ret = mapped_ram_write_page(&mapped_ram_run, block, offset);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+    acct_info.norm_pages++;
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    qemu_file_credit_transfer(f, TARGET_PAGE_SIZE);
+
+    return 1;
+}
+
 /**
  * ram_save_page: Send the given page to the stream
  *
@@ -673,6 +1636,10 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
     int ret;
     bool send_async = true;
 
+    if (mapped_ram) {
+        return mapped_ram_save_page(f, block, offset, bytes_transferred);
+    }
+
     p = memory_region_get_ram_ptr(mr) + offset;
 
     /* In doubt sent page as normal */
@@ -684,11 +1651,21 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
         pages = 1;
     }
 
+    /*
+     * The xbzrle cache must see zero pages, so only hand over the check
+     * for them to the multifd channel if the cache is not in use yet.
+     */
+    if (ret == RAM_SAVE_CONTROL_NOT_SUPP && multifd_send_count &&
+        (ram_bulk_stage || !migrate_use_xbzrle())) {
+        return multifd_queue_page(f, block, offset, bytes_transferred);
+    }
+
     XBZRLE_cache_lock();
 
     current_addr = block->offset + offset;
 
-    if (block == last_sent_block) {
+    /* with multifd, the last block on f need not be the last one sent */
+    if (block == last_sent_block && !multifd_send_count) {
         offset |= RAM_SAVE_FLAG_CONTINUE;
     }
     if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
@@ -706,7 +1683,9 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
              * page would be stale
              */
             xbzrle_cache_zero_page(current_addr);
-        } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
+        } else if (!ram_bulk_stage && migrate_use_xbzrle() &&
+                   !migration_in_postcopy(migrate_get_current())) {
+            /* in postcopy, the destination places whole pages */
             pages = save_xbzrle_page(f, &p, current_addr, block,
                                      offset, last_stage, bytes_transferred);
             if (!last_stage) {
@@ -718,8 +1697,11 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
         }
     }
 
-    /* XBZRLE overflow or normal page */
-    if (pages == -1) {
+    /* XBZRLE overflow or normal page; keep cached data on f */
+    if (pages == -1 && send_async && multifd_send_count) {
+        pages = multifd_queue_page(f, block, offset & TARGET_PAGE_MASK,
+                                   bytes_transferred);
+    } else if (pages == -1) {
         *bytes_transferred += save_page_header(f, block,
                                                offset | RAM_SAVE_FLAG_PAGE);
         if (send_async) {
@@ -748,7 +1730,8 @@ static int do_compress_ram_page(CompressParam *param)
 
     bytes_sent = save_page_header(param->file, block, offset |
                                   RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(param->file, p, TARGET_PAGE_SIZE,
+    blen = qemu_put_compression_data(param->file, param->ctx, p,
+                                     TARGET_PAGE_SIZE, compress_method,
                                      migrate_compress_level());
     bytes_sent += blen;
 
@@ -764,14 +1747,6 @@ static inline void start_compression(CompressParam *param)
     qemu_mutex_unlock(&param->mutex);
 }
 
-static inline void start_decompression(DecompressParam *param)
-{
-    qemu_mutex_lock(&param->mutex);
-    param->start = true;
-    qemu_cond_signal(&param->cond);
-    qemu_mutex_unlock(&param->mutex);
-}
-
 static uint64_t bytes_transferred;
 
 static void flush_compressed_data(QEMUFile *f)
@@ -909,6 +1884,133 @@ static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
     return pages;
 }
 
+/*
+ * Called within an RCU critical section.
+ *
+ * Sends the first page the destination asked for that is still dirty,
+ * and drops the requests for pages that were sent in the meantime.
+ *
+ * Returns: The number of pages written, 0 if no request was pending
+ */
+static int ram_save_queued_pages(QEMUFile *f, uint64_t *bytes_transferred)
+{
+    RAMSrcPageRequest *entry;
+    RAMBlock *block;
+    ram_addr_t offset;
+    bool dirty;
+    int pages = 0;
+
+    while (!pages) {
+        qemu_mutex_lock(&src_page_req_mutex);
+        entry = QSIMPLEQ_FIRST(&src_page_requests);
+        if (!entry) {
+            qemu_mutex_unlock(&src_page_req_mutex);
+            break;
+        }
+        block = entry->rb;
+        offset = entry->offset;
+        if (entry->len > TARGET_PAGE_SIZE) {
+            entry->len -= TARGET_PAGE_SIZE;
+            entry->offset += TARGET_PAGE_SIZE;
+        } else {
+            /* the block stays around in the RCU critical section */
+            memory_region_unref(block->mr);
+            QSIMPLEQ_REMOVE_HEAD(&src_page_requests, next_req);
+            g_free(entry);
+        }
+        qemu_mutex_unlock(&src_page_req_mutex);
+
+        dirty = migration_bitmap_clear_dirty(block->offset + offset);
+        trace_ram_save_queued_page(block->idstr, (uint64_t)offset, dirty);
+        if (dirty) {
+            migration_clear_memory_region_dirty_log(block, offset);
+            pages = ram_save_page(f, block, offset, false, bytes_transferred);
+            last_sent_block = block;
+            /* the destination is waiting for it */
+            qemu_fflush(f);
+        }
+    }
+
+    return pages;
+}
+
+/* Drop the requests for pages not served at the end of migration */
+static void ram_flush_queued_pages(void)
+{
+    RAMSrcPageRequest *entry, *next;
+
+    qemu_mutex_lock(&src_page_req_mutex);
+    QSIMPLEQ_FOREACH_SAFE(entry, &src_page_requests, next_req, next) {
+        memory_region_unref(entry->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&src_page_requests, next_req);
+        g_free(entry);
+    }
+    qemu_mutex_unlock(&src_page_req_mutex);
+}
+
+/**
+ * ram_save_queue_pages: Queue pages the destination asked for in postcopy
+ *
+ * Called from the return path thread.
+ *
+ * Returns: 0 on success, -1 if the request makes no sense
+ *
+ * @rbname: Name of the RAMBlock; NULL for the same as the last request
+ * @start: Offset of the first page within the RAMBlock
+ * @len: Length in bytes of the pages
+ */
+int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
+{
+    RAMSrcPageRequest *new_entry;
+    RAMBlock *block = NULL;
+
+    rcu_read_lock();
+    if (!rbname) {
+        block = last_requested_block;
+        if (!block) {
+            error_report("ram_save_queue_pages no previous block");
+            goto err;
+        }
+    } else {
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            if (!strcmp(rbname, block->idstr)) {
+                break;
+            }
+        }
+        if (!block) {
+            error_report("ram_save_queue_pages no block '%s'", rbname);
+            goto err;
+        }
+        last_requested_block = block;
+    }
+    trace_ram_save_queue_pages(block->idstr, (uint64_t)start, (uint64_t)len);
+
+    if ((start & ~TARGET_PAGE_MASK) || !len ||
+        start + len > block->used_length || start + len < start) {
+        error_report("%s request overrun start=" RAM_ADDR_FMT " len="
+                     RAM_ADDR_FMT " blocklen=" RAM_ADDR_FMT,
+                     __func__, start, len, block->used_length);
+        goto err;
+    }
+
+    new_entry = g_new0(RAMSrcPageRequest, 1);
+    new_entry->rb = block;
+    new_entry->offset = start;
+    new_entry->len = len;
+
+    memory_region_ref(block->mr);
+    qemu_mutex_lock(&src_page_req_mutex);
+    QSIMPLEQ_INSERT_TAIL(&src_page_requests, new_entry, next_req);
+    qemu_mutex_unlock(&src_page_req_mutex);
+    rcu_read_unlock();
+
+    return 0;
+
+err:
+    rcu_read_unlock();
+    return -1;
+}
+
 /**
  * ram_find_and_save_block: Finds a dirty page and sends it to f
  *
@@ -931,6 +2033,13 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
     int pages = 0;
     MemoryRegion *mr;
 
+    if (migration_in_postcopy(migrate_get_current())) {
+        pages = ram_save_queued_pages(f, bytes_transferred);
+        if (pages) {
+            return pages;
+        }
+    }
+
     if (!block)
         block = QLIST_FIRST_RCU(&ram_list.blocks);
 
@@ -939,7 +2048,14 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
         offset = migration_bitmap_find_and_reset_dirty(mr, offset);
         if (complete_round && block == last_seen_block &&
             offset >= last_offset) {
-            break;
+            if (!hot_pages_deferred) {
+                break;
+            }
+            /* only hot pages are left; go round again for them */
+            hot_pages_deferred = false;
+            complete_round = false;
+            offset = last_offset;
+            continue;
         }
         if (offset >= block->used_length) {
             offset = 0;
@@ -957,7 +2073,9 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
                 }
             }
         } else {
-            if (compression_switch && migrate_use_compression()) {
+            migration_clear_memory_region_dirty_log(block, offset);
+            if (compression_switch && migrate_use_compression() &&
+                !multifd_send_count) {
                 pages = ram_save_compressed_page(f, block, offset, last_stage,
                                                  bytes_transferred);
             } else {
@@ -967,6 +2085,8 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
 
             /* if page is unmodified, continue to the next */
             if (pages > 0) {
+                set_bit((mr->ram_addr + offset) >> TARGET_PAGE_BITS,
+                        atomic_rcu_read(&hot_pages)->sent);
                 last_sent_block = block;
                 break;
             }
@@ -1024,17 +2144,33 @@ void free_xbzrle_decoded_buf(void)
     xbzrle_decoded_buf = NULL;
 }
 
+static void migration_clear_bitmap_cleanup(void)
+{
+    RAMBlock *block;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        g_free(block->clear_bmap);
+        block->clear_bmap = NULL;
+    }
+    rcu_read_unlock();
+}
+
 static void migration_end(void)
 {
     /* caller have hold iothread lock or is in a bh, so there is
      * no writing race against this migration_bitmap
      */
     unsigned long *bitmap = migration_bitmap;
+    HotPageBitmaps *hp = hot_pages;
+
     atomic_rcu_set(&migration_bitmap, NULL);
+    atomic_rcu_set(&hot_pages, NULL);
     if (bitmap) {
         memory_global_dirty_log_stop();
         synchronize_rcu();
         g_free(bitmap);
+        hot_pages_free(hp);
     }
 
     XBZRLE_cache_lock();
@@ -1047,6 +2183,10 @@ static void migration_end(void)
         XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
+
+    ram_flush_queued_pages();
+    mapped_ram_save_cleanup();
+    migration_clear_bitmap_cleanup();
 }
 
 static void ram_migration_cancel(void *opaque)
@@ -1054,6 +2194,77 @@ static void ram_migration_cancel(void *opaque)
     migration_end();
 }
 
+/**
+ * ram_postcopy_send_discard_bitmap: Tell the destination which pages to drop
+ *
+ * Called with the iothread lock held, once the VM is stopped to switch to
+ * postcopy.  The pages still dirty are the ones the destination has an
+ * out of date copy of, or none at all; it drops its copy so that it
+ * asks for them when they are accessed.
+ *
+ * Returns: 0 on success, negative on error of the stream
+ *
+ * @ms: current migration state
+ */
+int ram_postcopy_send_discard_bitmap(MigrationState *ms)
+{
+    uint64_t start_list[MAX_DISCARDS_PER_COMMAND];
+    uint64_t length_list[MAX_DISCARDS_PER_COMMAND];
+    unsigned long *bitmap;
+    RAMBlock *block;
+
+    rcu_read_lock();
+
+    /* the pages dirtied since the last pass */
+    migration_bitmap_sync();
+    bitmap = atomic_rcu_read(&migration_bitmap);
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        unsigned long last = first + (block->used_length >> TARGET_PAGE_BITS);
+        unsigned long run_start, run_end;
+        unsigned int n = 0;
+
+        run_start = find_next_bit(bitmap, last, first);
+        while (run_start < last) {
+            run_end = find_next_zero_bit(bitmap, last, run_start + 1);
+            start_list[n] = (uint64_t)(run_start - first) << TARGET_PAGE_BITS;
+            length_list[n] = (uint64_t)(run_end - run_start) << TARGET_PAGE_BITS;
+            if (++n == MAX_DISCARDS_PER_COMMAND) {
+                qemu_savevm_send_postcopy_ram_discard(ms->file, block->idstr,
+                                                      n, start_list,
+                                                      length_list);
+                n = 0;
+            }
+            run_start = find_next_bit(bitmap, last, run_end + 1);
+        }
+        if (n) {
+            qemu_savevm_send_postcopy_ram_discard(ms->file, block->idstr,
+                                                  n, start_list, length_list);
+        }
+        trace_ram_postcopy_send_discard_bitmap(block->idstr);
+    }
+
+    /*
+     * The rest is sent in a single pass over the bitmap; no page is
+     * assumed dirty any more.
+     */
+    ram_bulk_stage = false;
+    last_seen_block = NULL;
+    last_sent_block = NULL;
+    last_offset = 0;
+
+    rcu_read_unlock();
+
+    return qemu_file_get_error(ms->file);
+}
+
+/* Whether all of RAM has been sent once, i.e. postcopy may start */
+bool ram_first_pass_done(void)
+{
+    return !ram_bulk_stage;
+}
+
 static void reset_ram_globals(void)
 {
     last_seen_block = NULL;
@@ -1072,7 +2283,10 @@ void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
      */
     if (migration_bitmap) {
         unsigned long *old_bitmap = migration_bitmap, *bitmap;
+        HotPageBitmaps *old_hp = hot_pages, *hp;
+
         bitmap = bitmap_new(new);
+        hp = hot_pages_new(new);
 
         /* prevent migration_bitmap content from being set bit
          * by migration_bitmap_sync_range() at the same time.
@@ -1082,11 +2296,17 @@ void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
         qemu_mutex_lock(&migration_bitmap_mutex);
         bitmap_copy(bitmap, old_bitmap, old);
         bitmap_set(bitmap, old, new - old);
+        /* a page that is sent meanwhile may miss its bit in hp->sent,
+         * which only costs it its place in the order */
+        bitmap_copy(hp->sent, old_hp->sent, old);
+        bitmap_copy(hp->hot, old_hp->hot, old);
         atomic_rcu_set(&migration_bitmap, bitmap);
+        atomic_rcu_set(&hot_pages, hp);
         qemu_mutex_unlock(&migration_bitmap_mutex);
         migration_dirty_pages += new - old;
         synchronize_rcu();
         g_free(old_bitmap);
+        hot_pages_free(old_hp);
     }
 }
 
@@ -1100,10 +2320,33 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMBlock *block;
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
+    Error *local_err = NULL;
+
+    compress_method = migrate_compress_method();
+
+    /* not for savevm */
+    mapped_ram = migrate_use_mapped_ram() &&
+                 f == migrate_get_current()->file;
+    if (mapped_ram) {
+        mapped_ram_fd = file_migration_open(true, TARGET_PAGE_SIZE %
+                                            MAPPED_RAM_DIRECT_ALIGN == 0,
+                                            &local_err);
+        if (mapped_ram_fd < 0) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+    ignore_shared = migrate_use_ignore_shared() &&
+                    f == migrate_get_current()->file;
+    if (migrate_use_multifd() && f == migrate_get_current()->file) {
+        if (multifd_save_setup() < 0) {
+            return -1;
+        }
+    }
 
-    mig_throttle_on = false;
     dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
+    last_requested_block = NULL;
     migration_bitmap_sync_init();
     qemu_mutex_init(&migration_bitmap_mutex);
 
@@ -1147,6 +2390,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
     migration_bitmap = bitmap_new(ram_bitmap_pages);
     bitmap_set(migration_bitmap, 0, ram_bitmap_pages);
+    hot_pages = hot_pages_new(ram_bitmap_pages);
+    hot_pages_deferred = false;
+    acct_info.redirtied_pages = 0;
+    acct_info.hot_pages = 0;
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -1154,17 +2401,49 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
      */
     migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
 
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (ramblock_is_ignored(block)) {
+            bitmap_clear(migration_bitmap,
+                         block->mr->ram_addr >> TARGET_PAGE_BITS,
+                         block->used_length >> TARGET_PAGE_BITS);
+            migration_dirty_pages -= block->used_length >> TARGET_PAGE_BITS;
+        }
+    }
+
     memory_global_dirty_log_start();
     migration_bitmap_sync();
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
 
+    if (mapped_ram) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_MAPPED_RAM);
+    }
+    if (ignore_shared) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_IGNORE_SHARED);
+    }
     qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
 
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->used_length);
+        if ((mapped_ram && mapped_ram_setup_block(f, block) < 0) ||
+            (ignore_shared && ignore_shared_setup_block(f, block) < 0)) {
+            rcu_read_unlock();
+            return -1;
+        }
+    }
+
+    /* before the multifd connections start loading pages */
+    if (migrate_use_compression() &&
+        compress_method != MIGRATION_COMPRESS_METHOD_ZLIB) {
+        qemu_put_be64(f, ((uint64_t)compress_method << TARGET_PAGE_BITS) |
+                         RAM_SAVE_FLAG_COMPRESS_METHOD);
+    }
+
+    if (multifd_send_count && !mapped_ram) {
+        qemu_put_be64(f, ((uint64_t)multifd_send_count << TARGET_PAGE_BITS) |
+                         RAM_SAVE_FLAG_MULTIFD);
     }
 
     rcu_read_unlock();
@@ -1206,7 +2485,6 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         pages_sent += pages;
         acct_info.iterations++;
-        check_guest_throttling();
         /* we want to check in the 1st loop, just in case it was the 1st time
            and we had to sync the dirty bitmap.
            qemu_get_clock_ns() is a bit expensive, so we only check each some
@@ -1223,6 +2501,17 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    if (mapped_ram) {
+        ret = mapped_ram_flush(&mapped_ram_run);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+    if (multifd_send_count) {
+        /* the channels may still refer to the blocks */
+        multifd_send_sync(f);
+        bytes_transferred += 8;
+    }
     rcu_read_unlock();
 
     /*
@@ -1245,9 +2534,14 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 /* Called with iothread lock */
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
+    int ret;
+
     rcu_read_lock();
 
-    migration_bitmap_sync();
+    /* in postcopy, the VM has been stopped since the last sync */
+    if (!migration_in_postcopy(migrate_get_current())) {
+        migration_bitmap_sync();
+    }
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
@@ -1265,6 +2559,19 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    if (mapped_ram) {
+        ret = mapped_ram_flush(&mapped_ram_run);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+    if (multifd_send_count) {
+        multifd_send_sync(f);
+    }
+    if (mapped_ram && !qemu_file_get_error(f)) {
+        /* all the pages are in the file now */
+        mapped_ram_save_bitmaps(f);
+    }
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
@@ -1281,7 +2588,8 @@ static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
 
     remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
 
-    if (remaining_size < max_size) {
+    if (!migration_in_postcopy(migrate_get_current()) &&
+        remaining_size < max_size) {
         qemu_mutex_lock_iothread();
         rcu_read_lock();
         migration_bitmap_sync();
@@ -1329,12 +2637,14 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
 
 /* Must be called from within a rcu critical section.
  * Returns a pointer from within the RCU-protected ram_list.
+ * @last_block is the block of the previous page of the stream.
  */
-static inline void *host_from_stream_offset(QEMUFile *f,
-                                            ram_addr_t offset,
-                                            int flags)
+static void *host_from_stream_offset_block(QEMUFile *f,
+                                           ram_addr_t offset,
+                                           int flags,
+                                           RAMBlock **last_block)
 {
-    static RAMBlock *block = NULL;
+    RAMBlock *block = *last_block;
     char id[256];
     uint8_t len;
 
@@ -1354,14 +2664,25 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         if (!strncmp(id, block->idstr, sizeof(id)) &&
             block->max_length > offset) {
+            *last_block = block;
             return memory_region_get_ram_ptr(block->mr) + offset;
         }
     }
 
+    *last_block = NULL;
     error_report("Can't find block %s!", id);
     return NULL;
 }
 
+static inline void *host_from_stream_offset(QEMUFile *f,
+                                            ram_addr_t offset,
+                                            int flags)
+{
+    static RAMBlock *block = NULL;
+
+    return host_from_stream_offset_block(f, offset, flags, &block);
+}
+
 /*
  * If a page (or a whole RDMA chunk) has been
  * determined to be zero, then zap it.
@@ -1376,25 +2697,29 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
-    unsigned long pagesize;
+    DecompressSlot *slot;
+    unsigned tail = param->tail;
 
-    while (!quit_decomp_thread) {
-        qemu_mutex_lock(&param->mutex);
-        while (!param->start && !quit_decomp_thread) {
-            qemu_cond_wait(&param->cond, &param->mutex);
-            pagesize = TARGET_PAGE_SIZE;
-            if (!quit_decomp_thread) {
-                /* uncompress() will return failed in some case, especially
-                 * when the page is dirted when doing the compression, it's
-                 * not a problem because the dirty page will be retransferred
-                 * and uncompress() won't break the data in other pages.
-                 */
-                uncompress((Bytef *)param->des, &pagesize,
-                           (const Bytef *)param->compbuf, param->len);
+    for (;;) {
+        qemu_event_reset(&param->ready);
+        if (atomic_mb_read(&param->head) == tail) {
+            if (atomic_mb_read(&quit_decomp_thread)) {
+                break;
             }
-            param->start = false;
+            qemu_event_wait(&param->ready);
+            continue;
         }
-        qemu_mutex_unlock(&param->mutex);
+
+        slot = &param->slots[tail % DECOMP_RING_SIZE];
+        /* decompression will fail in some case, especially
+         * when the page is dirted when doing the compression, it's
+         * not a problem because the dirty page will be retransferred
+         * and the failure won't break the data in other pages.
+         */
+        decompress_buffer(param->ctx, decompress_method, slot->des,
+                          TARGET_PAGE_SIZE, slot->compbuf, slot->len);
+        atomic_mb_set(&param->tail, ++tail);
+        qemu_event_set(&decomp_space);
     }
 
     return NULL;
@@ -1402,68 +2727,450 @@ static void *do_data_decompress(void *opaque)
 
 void migrate_decompress_threads_create(void)
 {
-    int i, thread_count;
-
-    thread_count = migrate_decompress_threads();
-    decompress_threads = g_new0(QemuThread, thread_count);
-    decomp_param = g_new0(DecompressParam, thread_count);
-    compressed_data_buf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+    /* the threads are only started as compressed pages come in */
+    decomp_max_threads = migrate_decompress_threads();
+    decomp_param = g_new0(DecompressParam, decomp_max_threads);
+    decomp_running = 0;
+    qemu_event_init(&decomp_space, false);
     quit_decomp_thread = false;
-    for (i = 0; i < thread_count; i++) {
-        qemu_mutex_init(&decomp_param[i].mutex);
-        qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
-        qemu_thread_create(decompress_threads + i, "decompress",
-                           do_data_decompress, decomp_param + i,
-                           QEMU_THREAD_JOINABLE);
-    }
+    decompress_method = MIGRATION_COMPRESS_METHOD_ZLIB;
 }
 
 void migrate_decompress_threads_join(void)
 {
-    int i, thread_count;
+    DecompressParam *param;
+    int i, j;
 
-    quit_decomp_thread = true;
-    thread_count = migrate_decompress_threads();
-    for (i = 0; i < thread_count; i++) {
-        qemu_mutex_lock(&decomp_param[i].mutex);
-        qemu_cond_signal(&decomp_param[i].cond);
-        qemu_mutex_unlock(&decomp_param[i].mutex);
+    atomic_mb_set(&quit_decomp_thread, true);
+    for (i = 0; i < decomp_running; i++) {
+        qemu_event_set(&decomp_param[i].ready);
     }
-    for (i = 0; i < thread_count; i++) {
-        qemu_thread_join(decompress_threads + i);
-        qemu_mutex_destroy(&decomp_param[i].mutex);
-        qemu_cond_destroy(&decomp_param[i].cond);
-        g_free(decomp_param[i].compbuf);
+    for (i = 0; i < decomp_running; i++) {
+        param = &decomp_param[i];
+        qemu_thread_join(&param->thread);
+        qemu_event_destroy(&param->ready);
+        for (j = 0; j < DECOMP_RING_SIZE; j++) {
+            g_free(param->slots[j].compbuf);
+        }
+        compress_context_free(param->ctx);
     }
-    g_free(decompress_threads);
+    qemu_event_destroy(&decomp_space);
     g_free(decomp_param);
-    g_free(compressed_data_buf);
-    decompress_threads = NULL;
     decomp_param = NULL;
-    compressed_data_buf = NULL;
+    decomp_running = 0;
+}
+
+static DecompressParam *decompress_thread_start(void)
+{
+    DecompressParam *param = &decomp_param[decomp_running];
+    int i;
+
+    trace_decompress_thread_start(decomp_running);
+
+    /* the method is only known once the stream is being loaded */
+    for (i = 0; i < DECOMP_RING_SIZE; i++) {
+        param->slots[i].compbuf =
+            g_malloc(compress_bound_max(TARGET_PAGE_SIZE));
+    }
+    param->ctx = compress_context_new();
+    qemu_event_init(&param->ready, false);
+    qemu_thread_create(&param->thread, "decompress",
+                       do_data_decompress, param, QEMU_THREAD_JOINABLE);
+    decomp_running++;
+    return param;
+}
+
+/*
+ * The decompression thread with the fewest pages queued, a new one if
+ * all of them are falling behind, or NULL if all their rings are full.
+ */
+static DecompressParam *decompress_pick_thread(void)
+{
+    DecompressParam *best = NULL;
+    unsigned queued, best_queued = DECOMP_RING_SIZE;
+    int i;
+
+    for (i = 0; i < decomp_running; i++) {
+        queued = decomp_param[i].head - atomic_mb_read(&decomp_param[i].tail);
+        if (queued < best_queued) {
+            best = &decomp_param[i];
+            best_queued = queued;
+        }
+    }
+
+    if (best_queued >= DECOMP_GROW_BACKLOG &&
+        decomp_running < decomp_max_threads) {
+        return decompress_thread_start();
+    }
+    return best;
 }
 
-static void decompress_data_with_multi_threads(uint8_t *compbuf,
+/* Queues the page on a decompression thread, reading its data into the ring */
+static void decompress_data_with_multi_threads(QEMUFile *f,
                                                void *host, int len)
 {
-    int idx, thread_count;
+    DecompressParam *param;
+    DecompressSlot *slot;
 
-    thread_count = migrate_decompress_threads();
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (!decomp_param[idx].start) {
-                memcpy(decomp_param[idx].compbuf, compbuf, len);
-                decomp_param[idx].des = host;
-                decomp_param[idx].len = len;
-                start_decompression(&decomp_param[idx]);
+    for (;;) {
+        qemu_event_reset(&decomp_space);
+        param = decompress_pick_thread();
+        if (param) {
+            break;
+        }
+        qemu_event_wait(&decomp_space);
+    }
+
+    slot = &param->slots[param->head % DECOMP_RING_SIZE];
+    qemu_get_buffer(f, slot->compbuf, len);
+    slot->des = host;
+    slot->len = len;
+    atomic_mb_set(&param->head, param->head + 1);
+    qemu_event_set(&param->ready);
+}
+
+/* The pages queued so far must be in guest memory before it runs */
+static void wait_for_decompress_done(void)
+{
+    int i;
+
+    for (i = 0; i < decomp_running; i++) {
+        for (;;) {
+            qemu_event_reset(&decomp_space);
+            if (atomic_mb_read(&decomp_param[i].tail) ==
+                decomp_param[i].head) {
                 break;
             }
+            qemu_event_wait(&decomp_space);
+        }
+    }
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    QEMUFile *f = p->file;
+    RAMBlock *block = NULL;
+    CompressContext *ctx = compress_context_new();
+    size_t compbuf_size = compress_bound(decompress_method, TARGET_PAGE_SIZE);
+    uint8_t *compbuf = g_malloc(compbuf_size);
+    ram_addr_t addr;
+    void *host;
+    int flags, len, ret = 0;
+
+    rcu_register_thread();
+
+    if (qemu_get_be32(f) != MULTIFD_MAGIC) {
+        error_report("multifd connection %d: bad magic", p->id);
+        ret = -EINVAL;
+    }
+    qemu_get_be32(f);
+
+    /* the RAM blocks do not change during an incoming migration */
+    rcu_read_lock();
+    while (!ret) {
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        ret = qemu_file_get_error(f);
+        if (ret < 0 || flags == RAM_SAVE_FLAG_EOS) {
+            break;
+        }
+        if (flags == RAM_SAVE_FLAG_MULTIFD) {
+            qemu_mutex_lock(&multifd_recv_lock);
+            p->synced++;
+            qemu_cond_broadcast(&multifd_recv_cond);
+            qemu_mutex_unlock(&multifd_recv_lock);
+            continue;
+        }
+
+        host = host_from_stream_offset_block(f, addr, flags, &block);
+        if (!host) {
+            error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+            ret = -EINVAL;
+            break;
+        }
+
+        switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
+        case RAM_SAVE_FLAG_COMPRESS:
+            ram_handle_compressed(host, qemu_get_byte(f), TARGET_PAGE_SIZE);
+            break;
+        case RAM_SAVE_FLAG_PAGE:
+            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            break;
+        case RAM_SAVE_FLAG_COMPRESS_PAGE:
+            len = qemu_get_be32(f);
+            if (len < 0 || len > compbuf_size) {
+                error_report("Invalid compressed data length: %d", len);
+                ret = -EINVAL;
+                break;
+            }
+            qemu_get_buffer(f, compbuf, len);
+            /* may fail for a page dirtied while it was compressed, which
+             * is sent again anyway; see do_data_decompress()
+             */
+            decompress_buffer(ctx, decompress_method, host, TARGET_PAGE_SIZE,
+                              compbuf, len);
+            break;
+        default:
+            error_report("Unknown combination of multifd flags: %#x", flags);
+            ret = -EINVAL;
+        }
+        if (!ret) {
+            ret = qemu_file_get_error(f);
+        }
+    }
+    rcu_read_unlock();
+
+    if (ret < 0 && !atomic_mb_read(&multifd_recv_quit)) {
+        error_report("multifd connection %d failed: %s", p->id,
+                     strerror(-ret));
+    }
+
+    qemu_mutex_lock(&multifd_recv_lock);
+    p->done = true;
+    p->error = ret;
+    qemu_cond_broadcast(&multifd_recv_cond);
+    qemu_mutex_unlock(&multifd_recv_lock);
+
+    g_free(compbuf);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static int multifd_load_setup(int channels)
+{
+    Error *local_err = NULL;
+    MultiFDRecvParams *p;
+    int i, fd;
+
+    if (multifd_recv_count || channels < 1 ||
+        channels > MULTIFD_MAX_CHANNELS) {
+        error_report("Invalid number of multifd connections: %d", channels);
+        return -EINVAL;
+    }
+
+    multifd_recv = g_new0(MultiFDRecvParams, channels);
+    multifd_recv_syncs = 0;
+    multifd_recv_quit = false;
+    for (i = 0; i < channels; i++) {
+        /* the source connected all of them before sending this, but the
+         * last ones may not have been accepted yet */
+        fd = tcp_multifd_accept(&local_err);
+        if (fd < 0) {
+            error_report_err(local_err);
+            return -EIO;
+        }
+        p = &multifd_recv[i];
+        p->id = i;
+        p->file = qemu_fopen_socket(fd, "rb");
+        qemu_thread_create(&p->thread, "multifd-recv", multifd_recv_thread, p,
+                           QEMU_THREAD_JOINABLE);
+        multifd_recv_count = i + 1;
+    }
+
+    return 0;
+}
+
+/* Wait for every connection to reach the sync point of the main stream. */
+static int multifd_load_sync(void)
+{
+    MultiFDRecvParams *p;
+    int i, ret = 0;
+
+    multifd_recv_syncs++;
+
+    qemu_mutex_lock(&multifd_recv_lock);
+    for (i = 0; i < multifd_recv_count && !ret; i++) {
+        p = &multifd_recv[i];
+        while (p->synced < multifd_recv_syncs && !p->done) {
+            qemu_cond_wait(&multifd_recv_cond, &multifd_recv_lock);
+        }
+        if (p->synced < multifd_recv_syncs) {
+            ret = p->error < 0 ? p->error : -EIO;
+        }
+    }
+    qemu_mutex_unlock(&multifd_recv_lock);
+
+    return ret;
+}
+
+void migrate_multifd_load_cleanup(void)
+{
+    int i;
+
+    tcp_multifd_close_listener();
+
+    /* everything has been loaded; stop the threads waiting for the end */
+    atomic_mb_set(&multifd_recv_quit, true);
+    for (i = 0; i < multifd_recv_count; i++) {
+        qemu_file_shutdown(multifd_recv[i].file);
+    }
+    for (i = 0; i < multifd_recv_count; i++) {
+        qemu_thread_join(&multifd_recv[i].thread);
+        qemu_fclose(multifd_recv[i].file);
+    }
+    g_free(multifd_recv);
+    multifd_recv = NULL;
+    multifd_recv_count = 0;
+}
+
+/* The pages of a RAM block in a mapped-ram file, loaded in chunks */
+typedef struct MappedRamLoad {
+    uint8_t *host;
+    unsigned long *bmap;
+    uint64_t pages;
+    uint64_t pages_offset;
+    int error;
+} MappedRamLoad;
+
+static void mapped_ram_load_chunk(void *opaque, int index)
+{
+    MappedRamLoad *load = opaque;
+    uint64_t start = (uint64_t)index * MAPPED_RAM_LOAD_CHUNK_PAGES;
+    uint64_t end = MIN(start + MAPPED_RAM_LOAD_CHUNK_PAGES, load->pages);
+    uint64_t first, last;
+    int ret;
+
+    first = find_next_bit(load->bmap, end, start);
+    while (first < end) {
+        last = find_next_zero_bit(load->bmap, end, first);
+        ret = mapped_ram_io(mapped_ram_fd, false,
+                            load->host + (first << TARGET_PAGE_BITS),
+                            (last - first) << TARGET_PAGE_BITS,
+                            load->pages_offset + (first << TARGET_PAGE_BITS));
+        if (ret < 0) {
+            atomic_set(&load->error, ret);
+            return;
+        }
+        first = find_next_bit(load->bmap, end, last);
+    }
+}
+
+/*
+ * A page that became zero after it had been written keeps its old copy in
+ * the file; clear the pages from @first to @last, which are not in the file,
+ * wherever the file has data for them.
+ */
+static void mapped_ram_zero_stale(MappedRamLoad *load,
+                                  uint64_t first, uint64_t last)
+{
+    off_t start = load->pages_offset + (first << TARGET_PAGE_BITS);
+    off_t end = load->pages_offset + (last << TARGET_PAGE_BITS);
+
+    while (start < end) {
+        off_t data = start, hole = end;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+        data = lseek(mapped_ram_fd, start, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) {
+            /* only holes up to the end of the file */
+            break;
+        } else if (data < 0) {
+            data = start;
+        } else {
+            hole = lseek(mapped_ram_fd, data, SEEK_HOLE);
+            if (hole < 0) {
+                hole = end;
+            }
         }
-        if (idx < thread_count) {
+#endif
+        if (data >= end) {
             break;
         }
+        data &= TARGET_PAGE_MASK;
+        hole = MIN(ROUND_UP(hole, TARGET_PAGE_SIZE), end);
+        memset(load->host + (data - load->pages_offset), 0, hole - data);
+        start = hole;
+    }
+}
+
+/* Map the pages of @block from the file copy-on-write */
+static int mapped_ram_map_block(RAMBlock *block, MappedRamLoad *load)
+{
+    Error *local_err = NULL;
+    uint64_t first, last;
+    struct stat st;
+
+    /* pages past the end of the file would fault with SIGBUS */
+    if (fstat(mapped_ram_fd, &st) < 0) {
+        return -errno;
+    }
+    if (st.st_size < load->pages_offset + block->used_length) {
+        error_report("mapped-ram: the file ends within %s", block->idstr);
+        return -EINVAL;
+    }
+
+    trace_mapped_ram_map_block(block->idstr, load->pages);
+    if (qemu_ram_map_private(block, mapped_ram_fd, load->pages_offset,
+                             &local_err) < 0) {
+        error_report_err(local_err);
+        return -EINVAL;
+    }
+
+    first = find_first_zero_bit(load->bmap, load->pages);
+    while (first < load->pages) {
+        last = find_next_bit(load->bmap, load->pages, first);
+        mapped_ram_zero_stale(load, first, last);
+        first = find_next_zero_bit(load->bmap, load->pages, last);
+    }
+    return 0;
+}
+
+/* Read the pages of @block from the file, in parallel, or map them */
+static int mapped_ram_load_block(QEMUFile *f, RAMBlock *block)
+{
+    MappedRamLoad load;
+    uint64_t bitmap_offset;
+    size_t size;
+    int ret;
+
+    bitmap_offset = qemu_get_be64(f);
+    load.pages_offset = qemu_get_be64(f);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    load.host = memory_region_get_ram_ptr(block->mr);
+    load.pages = block->used_length >> TARGET_PAGE_BITS;
+    load.error = 0;
+    size = mapped_ram_bitmap_size(load.pages);
+    load.bmap = bitmap_new(ROUND_UP(load.pages, 64));
+
+    ret = mapped_ram_io(qemu_get_fd(f), false, (uint8_t *)load.bmap, size,
+                        bitmap_offset);
+    if (ret < 0) {
+        error_report("mapped-ram: failed to read the bitmap of %s: %s",
+                     block->idstr, strerror(-ret));
+        goto out;
+    }
+    mapped_ram_bitmap_le(load.bmap, size);
+
+    if (migrate_use_mapped_ram_cow()) {
+        ret = mapped_ram_map_block(block, &load);
+        if (ret < 0) {
+            goto out;
+        }
+    } else {
+        trace_mapped_ram_load_block(block->idstr, load.pages);
+        parallel_for(DIV_ROUND_UP(load.pages, MAPPED_RAM_LOAD_CHUNK_PAGES),
+                     MAPPED_RAM_LOAD_THREADS, mapped_ram_load_chunk, &load);
+        ret = load.error;
+        if (ret < 0) {
+            error_report("mapped-ram: failed to load %s: %s",
+                         block->idstr, strerror(-ret));
+            goto out;
+        }
     }
+
+    ret = qemu_file_set_offset(f, load.pages_offset + block->used_length);
+
+out:
+    g_free(load.bmap);
+    return ret;
 }
 
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
@@ -1471,9 +3178,21 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     int flags = 0, ret = 0;
     static uint64_t seq_iter;
     int len = 0;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    /*
+     * While the VM runs on the destination, the missing pages must be
+     * placed atomically, as a whole.
+     */
+    bool postcopy_running = postcopy_state_get() >=
+                            POSTCOPY_INCOMING_LISTENING;
+    void *postcopy_host_page = NULL;
 
     seq_iter++;
 
+    if (postcopy_running) {
+        postcopy_host_page = postcopy_get_tmp_page(mis);
+    }
+
     if (version_id != 4) {
         ret = -EINVAL;
     }
@@ -1527,11 +3246,40 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                     error_report("Unknown ramblock \"%s\", cannot "
                                  "accept migration", id);
                     ret = -EINVAL;
+                } else if (!ret && mapped_ram_fd >= 0) {
+                    ret = mapped_ram_load_block(f, block);
+                } else if (!ret && ignore_shared_stream) {
+                    ret = ignore_shared_load_block(f, block);
                 }
 
                 total_ram_bytes -= length;
             }
+            if (mapped_ram_fd >= 0) {
+                close(mapped_ram_fd);
+                mapped_ram_fd = -1;
+            }
+            ignore_shared_stream = false;
+            break;
+        case RAM_SAVE_FLAG_IGNORE_SHARED:
+            ignore_shared_stream = true;
             break;
+        case RAM_SAVE_FLAG_MAPPED_RAM: {
+            Error *local_err = NULL;
+
+            /* the page cache is what copy-on-write clones share */
+            mapped_ram_fd = file_migration_open(false,
+                                                !migrate_use_mapped_ram_cow()
+                                                && TARGET_PAGE_SIZE %
+                                                MAPPED_RAM_DIRECT_ALIGN == 0,
+                                                &local_err);
+            if (mapped_ram_fd < 0) {
+                error_report("mapped-ram stream: %s",
+                             error_get_pretty(local_err));
+                error_free(local_err);
+                ret = -EINVAL;
+            }
+            break;
+        }
         case RAM_SAVE_FLAG_COMPRESS:
             host = host_from_stream_offset(f, addr, flags);
             if (!host) {
@@ -1540,7 +3288,14 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             ch = qemu_get_byte(f);
-            ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            if (!postcopy_running) {
+                ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            } else if (ch == 0) {
+                ret = postcopy_place_page_zero(mis, host);
+            } else {
+                memset(postcopy_host_page, ch, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(mis, host, postcopy_host_page);
+            }
             break;
         case RAM_SAVE_FLAG_PAGE:
             host = host_from_stream_offset(f, addr, flags);
@@ -1549,9 +3304,19 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 break;
             }
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            if (!postcopy_running) {
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            } else {
+                qemu_get_buffer(f, postcopy_host_page, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(mis, host, postcopy_host_page);
+            }
             break;
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
+            if (postcopy_running) {
+                error_report("Compressed page in postcopy");
+                ret = -EINVAL;
+                break;
+            }
             host = host_from_stream_offset(f, addr, flags);
             if (!host) {
                 error_report("Invalid RAM offset " RAM_ADDR_FMT, addr);
@@ -1560,15 +3325,30 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
 
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 || len > compress_bound(decompress_method,
+                                                TARGET_PAGE_SIZE)) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
             }
-            qemu_get_buffer(f, compressed_data_buf, len);
-            decompress_data_with_multi_threads(compressed_data_buf, host, len);
+            decompress_data_with_multi_threads(f, host, len);
+            break;
+        case RAM_SAVE_FLAG_COMPRESS_METHOD:
+            if (addr >> TARGET_PAGE_BITS >= MIGRATION_COMPRESS_METHOD_MAX ||
+                !compress_method_supported(addr >> TARGET_PAGE_BITS)) {
+                error_report("Unsupported compression method %" PRIu64,
+                             (uint64_t)(addr >> TARGET_PAGE_BITS));
+                ret = -EINVAL;
+                break;
+            }
+            decompress_method = addr >> TARGET_PAGE_BITS;
             break;
         case RAM_SAVE_FLAG_XBZRLE:
+            if (postcopy_running) {
+                error_report("XBZRLE page in postcopy");
+                ret = -EINVAL;
+                break;
+            }
             host = host_from_stream_offset(f, addr, flags);
             if (!host) {
                 error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
@@ -1582,6 +3362,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD:
+            if (addr) {
+                ret = multifd_load_setup(addr >> TARGET_PAGE_BITS);
+            } else {
+                ret = multifd_load_sync();
+            }
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -1599,6 +3386,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    wait_for_decompress_done();
     rcu_read_unlock();
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
@@ -1608,6 +3396,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 static SaveVMHandlers savevm_ram_handlers = {
     .save_live_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
+    .save_live_complete_postcopy = ram_save_complete,
     .save_live_complete = ram_save_complete,
     .save_live_pending = ram_save_pending,
     .load_state = ram_load,
@@ -1617,54 +3406,8 @@ static SaveVMHandlers savevm_ram_handlers = {
 void ram_mig_init(void)
 {
     qemu_mutex_init(&XBZRLE.lock);
+    qemu_mutex_init(&src_page_req_mutex);
+    qemu_mutex_init(&multifd_recv_lock);
+    qemu_cond_init(&multifd_recv_cond);
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 }
-/* Stub function that's gets run on the vcpu when its brought out of the
-   VM to run inside qemu via async_run_on_cpu()*/
-
-static void mig_sleep_cpu(void *opq)
-{
-    qemu_mutex_unlock_iothread();
-    g_usleep(30*1000);
-    qemu_mutex_lock_iothread();
-}
-
-/* To reduce the dirty rate explicitly disallow the VCPUs from spending
-   much time in the VM. The migration thread will try to catchup.
-   Workload will experience a performance drop.
-*/
-static void mig_throttle_guest_down(void)
-{
-    CPUState *cpu;
-
-    qemu_mutex_lock_iothread();
-    CPU_FOREACH(cpu) {
-        async_run_on_cpu(cpu, mig_sleep_cpu, NULL);
-    }
-    qemu_mutex_unlock_iothread();
-}
-
-static void check_guest_throttling(void)
-{
-    static int64_t t0;
-    int64_t        t1;
-
-    if (!mig_throttle_on) {
-        return;
-    }
-
-    if (!t0)  {
-        t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-        return;
-    }
-
-    t1 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-
-    /* If it has been more than 40 ms since the last time the guest
-     * was throttled then do it again.
-     */
-    if (40 < (t1-t0)/1000000) {
-        mig_throttle_guest_down();
-        t0 = t1;
-    }
-}
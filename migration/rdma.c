@@ -48,6 +48,16 @@
 
 #define RDMA_REG_CHUNK_SHIFT 20 /* 1 MB */
 
+/*
+ * With dynamic registration, the chunks after the one being written are
+ * registered together with it, as far ahead as this, so that the bulk
+ * stage does not wait for a registration round trip on every chunk.
+ */
+#define RDMA_REG_PREFETCH_CHUNKS 64
+
+/* Writes in flight to the same chunk at most */
+#define RDMA_TRANSIT_MAX 64
+
 /*
  * This is only for non-live state being migrated.
  * Instead of RDMA_WRITE messages, we use RDMA_SEND
@@ -67,12 +77,15 @@
  * Capabilities for negotiation.
  */
 #define RDMA_CAPABILITY_PIN_ALL 0x01
+/* the dest answers a registration request of several chunks in full */
+#define RDMA_CAPABILITY_REG_BATCH 0x02
 
 /*
  * Add the other flags above to this list of known capabilities
  * as they are introduced.
  */
-static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL;
+static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL |
+                                     RDMA_CAPABILITY_REG_BATCH;
 
 #define CHECK_ERROR_STATE() \
     do { \
@@ -228,7 +241,7 @@ typedef struct RDMALocalBlock {
     unsigned int   src_index;       /* (Only used on dest) */
     bool           is_ram_block;
     int            nb_chunks;
-    unsigned long *transit_bitmap;
+    uint8_t       *transit;         /* writes in flight, per chunk */
     unsigned long *unregister_bitmap;
 } RDMALocalBlock;
 
@@ -322,6 +335,15 @@ typedef struct RDMAContext {
     int current_chunk;
 
     bool pin_all;
+    /* the dest supports RDMA_CAPABILITY_REG_BATCH */
+    bool reg_batch;
+
+    /* chunks of a registration request that the source registers while
+     * it waits for the dest to do the same
+     */
+    RDMALocalBlock *prefetch_block;
+    uint64_t prefetch_chunks[RDMA_REG_PREFETCH_CHUNKS];
+    int nb_prefetch;
 
     /*
      * infiniband-specific variables for opening the device
@@ -568,8 +590,7 @@ static int rdma_add_block(RDMAContext *rdma, const char *block_name,
     block->index = local->nb_blocks;
     block->src_index = ~0U; /* Filled in by the receipt of the block list */
     block->nb_chunks = ram_chunk_index(host_addr, host_addr + length) + 1UL;
-    block->transit_bitmap = bitmap_new(block->nb_chunks);
-    bitmap_clear(block->transit_bitmap, 0, block->nb_chunks);
+    block->transit = g_malloc0(block->nb_chunks);
     block->unregister_bitmap = bitmap_new(block->nb_chunks);
     bitmap_clear(block->unregister_bitmap, 0, block->nb_chunks);
     block->remote_keys = g_malloc0(block->nb_chunks * sizeof(uint32_t));
@@ -656,8 +677,8 @@ static int rdma_delete_block(RDMAContext *rdma, RDMALocalBlock *block)
         block->mr = NULL;
     }
 
-    g_free(block->transit_bitmap);
-    block->transit_bitmap = NULL;
+    g_free(block->transit);
+    block->transit = NULL;
 
     g_free(block->unregister_bitmap);
     block->unregister_bitmap = NULL;
@@ -1305,7 +1326,7 @@ static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
          */
         clear_bit(chunk, block->unregister_bitmap);
 
-        if (test_bit(chunk, block->transit_bitmap)) {
+        if (block->transit[chunk]) {
             trace_qemu_rdma_unregister_waiting_inflight(chunk);
             continue;
         }
@@ -1427,7 +1448,9 @@ static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out,
                                    index, chunk, block->local_host_addr,
                                    (void *)(uintptr_t)block->remote_host_addr);
 
-        clear_bit(chunk, block->transit_bitmap);
+        if (block->transit[chunk] > 0) {
+            block->transit[chunk]--;
+        }
 
         if (rdma->nb_sent > 0) {
             rdma->nb_sent--;
@@ -1843,6 +1866,103 @@ static int qemu_rdma_exchange_recv(RDMAContext *rdma, RDMAControlHeader *head,
     return 0;
 }
 
+/*
+ * Register the chunks of the pending prefetch request on our side, while
+ * the destination registers them on its own.
+ */
+static int qemu_rdma_register_prefetched(RDMAContext *rdma)
+{
+    RDMALocalBlock *block = rdma->prefetch_block;
+    int i;
+
+    for (i = 0; i < rdma->nb_prefetch; i++) {
+        uint64_t chunk = rdma->prefetch_chunks[i];
+        uint8_t *chunk_start = ram_chunk_start(block, chunk);
+
+        if (qemu_rdma_register_and_get_keys(rdma, block,
+                                            (uintptr_t)chunk_start,
+                                            NULL, NULL, chunk, chunk_start,
+                                            ram_chunk_end(block, chunk))) {
+            error_report("cannot get lkey");
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Ask the destination to register @chunk of the RAM block together with
+ * the chunks after it that are not registered yet and are not all zero,
+ * up to RDMA_REG_PREFETCH_CHUNKS of them in a single request.
+ */
+static int qemu_rdma_register_prefetch(RDMAContext *rdma, int current_index,
+                                       uint64_t chunk)
+{
+    RDMALocalBlock *block = &(rdma->local_ram_blocks.block[current_index]);
+    RDMARegister regs[RDMA_REG_PREFETCH_CHUNKS];
+    RDMARegisterResult *results;
+    RDMAControlHeader resp = { .type = RDMA_CONTROL_REGISTER_RESULT };
+    RDMAControlHeader head = { .type = RDMA_CONTROL_REGISTER_REQUEST };
+    int reg_result_idx, ret, i, n = 0;
+    uint64_t next;
+
+    for (next = chunk; next < block->nb_chunks &&
+                       n < RDMA_REG_PREFETCH_CHUNKS; next++) {
+        uint8_t *start = ram_chunk_start(block, next);
+        uint64_t len = ram_chunk_end(block, next) - start;
+
+        if (next != chunk) {
+            if (block->remote_keys[next]) {
+                continue;
+            }
+            /* left for a compress message when it gets written */
+            if (can_use_buffer_find_nonzero_offset(start, len) &&
+                buffer_find_nonzero_offset(start, len) == len) {
+                continue;
+            }
+        }
+
+        rdma->prefetch_chunks[n] = next;
+        regs[n].current_index = current_index;
+        regs[n].key.current_addr = block->offset +
+                                   (start - block->local_host_addr);
+        regs[n].chunks = 0;
+        register_to_network(rdma, &regs[n]);
+        n++;
+    }
+
+    trace_qemu_rdma_register_prefetch(current_index, chunk, n);
+
+    rdma->prefetch_block = block;
+    rdma->nb_prefetch = n;
+    head.len = n * sizeof(RDMARegister);
+    head.repeat = n;
+
+    ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) regs,
+                                  &resp, &reg_result_idx,
+                                  qemu_rdma_register_prefetched);
+    rdma->nb_prefetch = 0;
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (resp.len != n * sizeof(RDMARegisterResult)) {
+        error_report("rdma migration: got %" PRIu32 " bytes of registration"
+                     " results for %d chunks", resp.len, n);
+        return -EINVAL;
+    }
+
+    results = (RDMARegisterResult *)
+            rdma->wr_data[reg_result_idx].control_curr;
+
+    for (i = 0; i < n; i++) {
+        network_to_result(&results[i]);
+        block->remote_keys[rdma->prefetch_chunks[i]] = results[i].rkey;
+        block->remote_host_addr = results[i].host_addr;
+    }
+    return 0;
+}
+
 /*
  * Write an actual chunk of memory using RDMA.
  *
@@ -1903,7 +2023,7 @@ retry:
 #endif
     }
 
-    while (test_bit(chunk, block->transit_bitmap)) {
+    while (block->transit[chunk] >= RDMA_TRANSIT_MAX) {
         (void)count;
         trace_qemu_rdma_write_one_block(count++, current_index, chunk,
                 sge.addr, length, rdma->nb_sent, block->nb_chunks);
@@ -1958,44 +2078,60 @@ retry:
             }
 
             /*
-             * Otherwise, tell other side to register.
+             * With a batching destination, register the chunks ahead too.
              */
-            reg.current_index = current_index;
-            if (block->is_ram_block) {
-                reg.key.current_addr = current_addr;
+            if (block->is_ram_block && !chunks && rdma->reg_batch) {
+                ret = qemu_rdma_register_prefetch(rdma, current_index, chunk);
+                if (ret < 0) {
+                    return ret;
+                }
+                if (qemu_rdma_register_and_get_keys(rdma, block, sge.addr,
+                                                    &sge.lkey, NULL, chunk,
+                                                    chunk_start, chunk_end)) {
+                    error_report("cannot get lkey");
+                    return -EINVAL;
+                }
             } else {
-                reg.key.chunk = chunk;
-            }
-            reg.chunks = chunks;
+                /*
+                 * Otherwise, tell other side to register.
+                 */
+                reg.current_index = current_index;
+                if (block->is_ram_block) {
+                    reg.key.current_addr = current_addr;
+                } else {
+                    reg.key.chunk = chunk;
+                }
+                reg.chunks = chunks;
 
-            trace_qemu_rdma_write_one_sendreg(chunk, sge.length, current_index,
-                                              current_addr);
+                trace_qemu_rdma_write_one_sendreg(chunk, sge.length,
+                                                  current_index, current_addr);
 
-            register_to_network(rdma, &reg);
-            ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &reg,
-                                    &resp, &reg_result_idx, NULL);
-            if (ret < 0) {
-                return ret;
-            }
+                register_to_network(rdma, &reg);
+                ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &reg,
+                                        &resp, &reg_result_idx, NULL);
+                if (ret < 0) {
+                    return ret;
+                }
 
-            /* try to overlap this single registration with the one we sent. */
-            if (qemu_rdma_register_and_get_keys(rdma, block, sge.addr,
-                                                &sge.lkey, NULL, chunk,
-                                                chunk_start, chunk_end)) {
-                error_report("cannot get lkey");
-                return -EINVAL;
-            }
+                /* try to overlap this registration with the one we sent. */
+                if (qemu_rdma_register_and_get_keys(rdma, block, sge.addr,
+                                                    &sge.lkey, NULL, chunk,
+                                                    chunk_start, chunk_end)) {
+                    error_report("cannot get lkey");
+                    return -EINVAL;
+                }
 
-            reg_result = (RDMARegisterResult *)
-                    rdma->wr_data[reg_result_idx].control_curr;
+                reg_result = (RDMARegisterResult *)
+                        rdma->wr_data[reg_result_idx].control_curr;
 
-            network_to_result(reg_result);
+                network_to_result(reg_result);
 
-            trace_qemu_rdma_write_one_recvregres(block->remote_keys[chunk],
-                                                 reg_result->rkey, chunk);
+                trace_qemu_rdma_write_one_recvregres(block->remote_keys[chunk],
+                                                     reg_result->rkey, chunk);
 
-            block->remote_keys[chunk] = reg_result->rkey;
-            block->remote_host_addr = reg_result->host_addr;
+                block->remote_keys[chunk] = reg_result->rkey;
+                block->remote_host_addr = reg_result->host_addr;
+            }
         } else {
             /* already registered before */
             if (qemu_rdma_register_and_get_keys(rdma, block, sge.addr,
@@ -2059,7 +2195,7 @@ retry:
         return -ret;
     }
 
-    set_bit(chunk, block->transit_bitmap);
+    block->transit[chunk]++;
     acct_update_position(f, sge.length, false);
     rdma->total_writes++;
 
@@ -2352,6 +2488,7 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
         trace_qemu_rdma_connect_pin_all_requested();
         cap.flags |= RDMA_CAPABILITY_PIN_ALL;
     }
+    cap.flags |= RDMA_CAPABILITY_REG_BATCH;
 
     caps_to_network(&cap);
 
@@ -2393,6 +2530,9 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
 
     trace_qemu_rdma_connect_pin_all_outcome(rdma->pin_all);
 
+    /* older destinations only ever answer the first entry of a request */
+    rdma->reg_batch = !!(cap.flags & RDMA_CAPABILITY_REG_BATCH);
+
     rdma_ack_cm_event(cm_event);
 
     ret = qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY);
@@ -3073,6 +3213,7 @@ static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque)
             trace_qemu_rdma_registration_handle_register(head.repeat);
 
             reg_resp.repeat = head.repeat;
+            reg_resp.len = head.repeat * sizeof(RDMARegisterResult);
             registers = (RDMARegister *) rdma->wr_data[idx].control_curr;
 
             for (count = 0; count < head.repeat; count++) {
@@ -37,6 +37,7 @@
 #include "qemu/timer.h"
 #include "audio/audio.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "qapi/qmp/qerror.h"
 #include "qemu/error-report.h"
 #include "qemu/sockets.h"
@@ -46,6 +47,7 @@
 #include "qmp-commands.h"
 #include "trace.h"
 #include "qemu/iov.h"
+#include "qemu/bitmap.h"
 #include "block/snapshot.h"
 #include "block/qapi.h"
 
@@ -59,6 +61,21 @@
 
 static bool skip_section_footers;
 
+static struct mig_cmd_args {
+    ssize_t     len; /* -1 = variable */
+    const char *name;
+} mig_cmd_args[] = {
+    [MIG_CMD_INVALID]          = { .len = -1, .name = "INVALID" },
+    [MIG_CMD_OPEN_RETURN_PATH] = { .len =  0, .name = "OPEN_RETURN_PATH" },
+    [MIG_CMD_POSTCOPY_ADVISE]  = { .len = 16, .name = "POSTCOPY_ADVISE" },
+    [MIG_CMD_POSTCOPY_LISTEN]  = { .len =  0, .name = "POSTCOPY_LISTEN" },
+    [MIG_CMD_POSTCOPY_RUN]     = { .len =  0, .name = "POSTCOPY_RUN" },
+    [MIG_CMD_POSTCOPY_RAM_DISCARD] = {
+                                   .len = -1, .name = "POSTCOPY_RAM_DISCARD" },
+    [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
+    [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
+};
+
 static int announce_self_create(uint8_t *buf,
                                 uint8_t *mac_addr)
 {
@@ -604,6 +621,8 @@ int vmstate_register_with_alias_id(DeviceState *dev, int instance_id,
     return 0;
 }
 
+static void live_vmstate_unregister(SaveStateEntry *se);
+
 void vmstate_unregister(DeviceState *dev, const VMStateDescription *vmsd,
                         void *opaque)
 {
@@ -612,6 +631,7 @@ void vmstate_unregister(DeviceState *dev, const VMStateDescription *vmsd,
     QTAILQ_FOREACH_SAFE(se, &savevm_state.handlers, entry, new_se) {
         if (se->vmsd == vmsd && se->opaque == opaque) {
             QTAILQ_REMOVE(&savevm_state.handlers, se, entry);
+            live_vmstate_unregister(se);
             if (se->compat) {
                 g_free(se->compat);
             }
@@ -757,6 +777,145 @@ void qemu_savevm_state_begin(QEMUFile *f,
     }
 }
 
+/**
+ * qemu_savevm_command_send: Send a 'QEMU_VM_COMMAND' type element with the
+ *                           command and associated data.
+ *
+ * @f: File to send command on
+ * @command: Command type to send
+ * @len: Length of associated data
+ * @data: Data associated with command.
+ */
+void qemu_savevm_command_send(QEMUFile *f,
+                              enum qemu_vm_cmd command,
+                              uint16_t len,
+                              uint8_t *data)
+{
+    trace_savevm_command_send(command, len);
+    qemu_put_byte(f, QEMU_VM_COMMAND);
+    qemu_put_be16(f, (uint16_t)command);
+    qemu_put_be16(f, len);
+    qemu_put_buffer(f, data, len);
+    qemu_fflush(f);
+}
+
+void qemu_savevm_send_open_return_path(QEMUFile *f)
+{
+    qemu_savevm_command_send(f, MIG_CMD_OPEN_RETURN_PATH, 0, NULL);
+}
+
+/* We have a buffer of data to send; we don't want that all to be loaded
+ * by the command itself, so the command contains just the length of the
+ * extra buffer that we then send straight after it.
+ *
+ * Returns:
+ *    0 on success
+ *    -ve on error
+ */
+int qemu_savevm_send_packaged(QEMUFile *f, const QEMUSizedBuffer *qsb)
+{
+    size_t cur_iov;
+    size_t len = qsb_get_length(qsb);
+    uint32_t tmp;
+
+    if (len > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("%s: Unreasonably large packaged state: %zu",
+                     __func__, len);
+        return -1;
+    }
+
+    tmp = cpu_to_be32(len);
+
+    trace_qemu_savevm_send_packaged();
+    qemu_savevm_command_send(f, MIG_CMD_PACKAGED, 4, (uint8_t *)&tmp);
+
+    /* all the data follows (concatenating the iov's) */
+    for (cur_iov = 0; cur_iov < qsb->n_iov; cur_iov++) {
+        /* The iov entries are partially filled */
+        size_t towrite = MIN(qsb->iov[cur_iov].iov_len, len);
+        len -= towrite;
+
+        if (!towrite) {
+            break;
+        }
+
+        qemu_put_buffer(f, qsb->iov[cur_iov].iov_base, towrite);
+    }
+
+    return 0;
+}
+
+/* Send prior to any postcopy transfer */
+void qemu_savevm_send_postcopy_advise(QEMUFile *f)
+{
+    uint64_t tmp[2];
+    tmp[0] = cpu_to_be64(getpagesize());
+    tmp[1] = cpu_to_be64(TARGET_PAGE_SIZE);
+
+    trace_qemu_savevm_send_postcopy_advise();
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_ADVISE, 16, (uint8_t *)tmp);
+}
+
+/* Sent prior to starting the destination running in postcopy, discard pages
+ * that have already been sent but redirtied on the source.
+ * CMD_POSTCOPY_RAM_DISCARD consist of:
+ *      byte   version (0)
+ *      byte   Length of name field (not including 0)
+ *  n x byte   RAM block name
+ *      byte   0 terminator (just for safety)
+ *  n x        Byte ranges within the named RAMBlock
+ *      be64   Start of the range
+ *      be64   Length
+ *
+ *  name:  RAMBlock name that these entries are part of
+ *  len: Number of page entries
+ *  start_list: 'len' addresses
+ *  length_list: 'len' addresses
+ *
+ */
+void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *name,
+                                           uint16_t len,
+                                           uint64_t *start_list,
+                                           uint64_t *length_list)
+{
+    uint8_t *buf;
+    uint16_t tmplen;
+    uint16_t t;
+    size_t name_len = strlen(name);
+
+    trace_qemu_savevm_send_postcopy_ram_discard(name, len);
+    assert(name_len < 256);
+    buf = g_malloc0(1 + 1 + name_len + 1 + (8 + 8) * len);
+    buf[0] = 0; /* Version */
+    buf[1] = name_len;
+    memcpy(buf + 2, name, name_len);
+    tmplen = 2 + name_len;
+    buf[tmplen++] = '\0';
+
+    for (t = 0; t < len; t++) {
+        cpu_to_be64w((uint64_t *)(buf + tmplen), start_list[t]);
+        tmplen += 8;
+        cpu_to_be64w((uint64_t *)(buf + tmplen), length_list[t]);
+        tmplen += 8;
+    }
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RAM_DISCARD, tmplen, buf);
+    g_free(buf);
+}
+
+/* Get the destination into a state where it can receive postcopy data. */
+void qemu_savevm_send_postcopy_listen(QEMUFile *f)
+{
+    trace_savevm_send_postcopy_listen();
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_LISTEN, 0, NULL);
+}
+
+/* Kick the destination into running */
+void qemu_savevm_send_postcopy_run(QEMUFile *f)
+{
+    trace_savevm_send_postcopy_run();
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RUN, 0, NULL);
+}
+
 /*
  * this function has three return values:
  *   negative: there was one error, and we have -errno.
@@ -809,12 +968,51 @@ static bool should_send_vmdesc(void)
     return !machine->suppress_vmdesc;
 }
 
+/*
+ * Calls the save_live_complete_postcopy methods
+ * causing the last few pages to be sent immediately and doing any associated
+ * cleanup.
+ * Note postcopy also calls qemu_savevm_state_complete to complete
+ * the other devices.
+ */
+void qemu_savevm_state_complete_postcopy(QEMUFile *f)
+{
+    SaveStateEntry *se;
+    int ret;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (!se->ops || !se->ops->save_live_complete_postcopy) {
+            continue;
+        }
+        if (se->ops && se->ops->is_active) {
+            if (!se->ops->is_active(se->opaque)) {
+                continue;
+            }
+        }
+        trace_savevm_section_start(se->idstr, se->section_id);
+        /* Section type */
+        save_section_header(f, se, QEMU_VM_SECTION_END);
+
+        ret = se->ops->save_live_complete_postcopy(f, se->opaque);
+        trace_savevm_section_end(se->idstr, se->section_id, ret);
+        save_section_footer(f, se);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+            return;
+        }
+    }
+
+    qemu_put_byte(f, QEMU_VM_EOF);
+    qemu_fflush(f);
+}
+
 void qemu_savevm_state_complete(QEMUFile *f)
 {
     QJSON *vmdesc;
     int vmdesc_len;
     SaveStateEntry *se;
     int ret;
+    bool in_postcopy = migration_in_postcopy(migrate_get_current());
 
     trace_savevm_state_complete();
 
@@ -824,6 +1022,10 @@ void qemu_savevm_state_complete(QEMUFile *f)
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
         }
+        /* those are completed by qemu_savevm_state_complete_postcopy */
+        if (in_postcopy && se->ops->save_live_complete_postcopy) {
+            continue;
+        }
         if (se->ops && se->ops->is_active) {
             if (!se->ops->is_active(se->opaque)) {
                 continue;
@@ -870,6 +1072,15 @@ void qemu_savevm_state_complete(QEMUFile *f)
         save_section_footer(f, se);
     }
 
+    live_vmstate_cleanup();
+
+    if (in_postcopy) {
+        /* the rest of the stream follows the package of this state */
+        object_unref(OBJECT(vmdesc));
+        qemu_fflush(f);
+        return;
+    }
+
     qemu_put_byte(f, QEMU_VM_EOF);
 
     json_end_array(vmdesc);
@@ -1004,6 +1215,377 @@ static SaveStateEntry *find_se(const char *idstr, int instance_id)
     return NULL;
 }
 
+/*
+ * Live device state
+ *
+ * The VMSTATE_BUFFER_LIVE fields of all devices are sent by the
+ * "vmstate-live" section: first a list of them, then their contents in
+ * chunks, again and again while the VM runs, but only the chunks that
+ * changed since they were last sent.  Its end, once the VM has stopped,
+ * brings the destination up to date before the device sections, which
+ * leave those fields out.  This is what both sides go by, so only the
+ * source needs the capability.
+ */
+#define LIVE_VMSTATE_CHUNK 4096
+/* A new pass over the buffers starts no more often than this */
+#define LIVE_VMSTATE_PASS_MS 100
+
+enum {
+    LIVE_VMSTATE_EOS,
+    LIVE_VMSTATE_FIELDS,
+    LIVE_VMSTATE_DATA,
+};
+
+typedef struct LiveVMStateField {
+    SaveStateEntry *se;         /* NULL once the device is gone */
+    char *name;
+    uint8_t *ptr;
+    uint32_t size;
+    uint8_t *sent;              /* what the destination has, source only */
+    unsigned long *unsent;      /* chunks never sent, source only */
+} LiveVMStateField;
+
+static struct {
+    GPtrArray *fields;
+    /* where the current pass of the source is */
+    int cur_field;
+    uint32_t cur_offset;
+    int64_t pass_start;
+    uint64_t pass_bytes;
+    uint64_t dirty_bytes;       /* sent by the last full pass */
+} live_vmstate;
+
+void live_vmstate_cleanup(void)
+{
+    LiveVMStateField *lf;
+    int i;
+
+    if (live_vmstate.fields) {
+        for (i = 0; i < live_vmstate.fields->len; i++) {
+            lf = g_ptr_array_index(live_vmstate.fields, i);
+            g_free(lf->name);
+            g_free(lf->sent);
+            g_free(lf->unsent);
+            g_free(lf);
+        }
+        g_ptr_array_free(live_vmstate.fields, true);
+    }
+    memset(&live_vmstate, 0, sizeof(live_vmstate));
+    vmstate_live_reset();
+}
+
+static void live_vmstate_unregister(SaveStateEntry *se)
+{
+    LiveVMStateField *lf;
+    int i;
+
+    for (i = 0; live_vmstate.fields && i < live_vmstate.fields->len; i++) {
+        lf = g_ptr_array_index(live_vmstate.fields, i);
+        if (lf->se == se) {
+            vmstate_live_mark(lf->ptr, false);
+            lf->se = NULL;
+        }
+    }
+}
+
+static LiveVMStateField *live_vmstate_add(SaveStateEntry *se,
+                                          const char *name,
+                                          void *ptr, size_t size)
+{
+    LiveVMStateField *lf = g_new0(LiveVMStateField, 1);
+
+    lf->se = se;
+    lf->name = g_strdup(name);
+    lf->ptr = ptr;
+    lf->size = size;
+    g_ptr_array_add(live_vmstate.fields, lf);
+    vmstate_live_mark(ptr, true);
+    return lf;
+}
+
+static void live_vmstate_add_source(const char *name, void *ptr, size_t size,
+                                    void *opaque)
+{
+    LiveVMStateField *lf;
+
+    if (strlen(name) > 255) {
+        return;
+    }
+    lf = live_vmstate_add(opaque, name, ptr, size);
+    lf->sent = g_malloc(size);
+    lf->unsent = bitmap_new(DIV_ROUND_UP(size, LIVE_VMSTATE_CHUNK));
+    bitmap_set(lf->unsent, 0, DIV_ROUND_UP(size, LIVE_VMSTATE_CHUNK));
+    live_vmstate.dirty_bytes += size;
+}
+
+static bool live_vmstate_is_active(void *opaque)
+{
+    return migrate_use_live_vmstate();
+}
+
+static int live_vmstate_save_setup(QEMUFile *f, void *opaque)
+{
+    SaveStateEntry *se;
+    LiveVMStateField *lf;
+    int i, len;
+
+    qemu_mutex_lock_iothread();
+    live_vmstate_cleanup();
+    live_vmstate.fields = g_ptr_array_new();
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (se->vmsd) {
+            vmstate_foreach_live_field(se->vmsd, se->opaque,
+                                       live_vmstate_add_source, se);
+        }
+    }
+    trace_live_vmstate_setup(live_vmstate.fields->len,
+                             live_vmstate.dirty_bytes);
+
+    qemu_put_byte(f, LIVE_VMSTATE_FIELDS);
+    qemu_put_be32(f, live_vmstate.fields->len);
+    for (i = 0; i < live_vmstate.fields->len; i++) {
+        lf = g_ptr_array_index(live_vmstate.fields, i);
+        len = strlen(lf->se->idstr);
+        qemu_put_byte(f, len);
+        qemu_put_buffer(f, (uint8_t *)lf->se->idstr, len);
+        qemu_put_be32(f, lf->se->instance_id);
+        len = strlen(lf->name);
+        qemu_put_byte(f, len);
+        qemu_put_buffer(f, (uint8_t *)lf->name, len);
+        qemu_put_be32(f, lf->size);
+    }
+    qemu_mutex_unlock_iothread();
+
+    qemu_put_byte(f, LIVE_VMSTATE_EOS);
+    return 0;
+}
+
+/*
+ * Sends the chunks of field @index from @offset on that are not what the
+ * destination has, until the rate limit if @limit; returns the offset it
+ * stopped at.
+ */
+static uint32_t live_vmstate_send(QEMUFile *f, int index, uint32_t offset,
+                                  bool limit)
+{
+    LiveVMStateField *lf = g_ptr_array_index(live_vmstate.fields, index);
+    uint32_t len;
+
+    while (offset < lf->size) {
+        len = MIN(LIVE_VMSTATE_CHUNK, lf->size - offset);
+        if (test_and_clear_bit(offset / LIVE_VMSTATE_CHUNK, lf->unsent) ||
+            memcmp(lf->sent + offset, lf->ptr + offset, len)) {
+            memcpy(lf->sent + offset, lf->ptr + offset, len);
+            qemu_put_byte(f, LIVE_VMSTATE_DATA);
+            qemu_put_be32(f, index);
+            qemu_put_be32(f, offset);
+            qemu_put_be32(f, len);
+            qemu_put_buffer(f, lf->sent + offset, len);
+            live_vmstate.pass_bytes += len;
+        }
+        offset += len;
+        if (limit && qemu_file_rate_limit(f)) {
+            break;
+        }
+    }
+    return offset;
+}
+
+static int live_vmstate_save_iterate(QEMUFile *f, void *opaque)
+{
+    GPtrArray *fields = live_vmstate.fields;
+    LiveVMStateField *lf;
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int ret = 1;
+
+    if (live_vmstate.cur_field == 0 && live_vmstate.cur_offset == 0) {
+        if (now - live_vmstate.pass_start < LIVE_VMSTATE_PASS_MS) {
+            qemu_put_byte(f, LIVE_VMSTATE_EOS);
+            return 1;
+        }
+        live_vmstate.pass_start = now;
+    }
+
+    /* the devices change their buffers with the iothread lock held */
+    qemu_mutex_lock_iothread();
+    while (live_vmstate.cur_field < fields->len) {
+        lf = g_ptr_array_index(fields, live_vmstate.cur_field);
+        if (lf->se) {
+            live_vmstate.cur_offset = live_vmstate_send(f,
+                                                        live_vmstate.cur_field,
+                                                        live_vmstate.cur_offset,
+                                                        true);
+        }
+        if (!lf->se || live_vmstate.cur_offset >= lf->size) {
+            live_vmstate.cur_field++;
+            live_vmstate.cur_offset = 0;
+        }
+        if (qemu_file_rate_limit(f)) {
+            ret = 0;
+            break;
+        }
+    }
+    if (live_vmstate.cur_field == fields->len) {
+        live_vmstate.dirty_bytes = live_vmstate.pass_bytes;
+        live_vmstate.pass_bytes = 0;
+        live_vmstate.cur_field = 0;
+    }
+    qemu_mutex_unlock_iothread();
+
+    qemu_put_byte(f, LIVE_VMSTATE_EOS);
+    return ret;
+}
+
+static uint64_t live_vmstate_save_pending(QEMUFile *f, void *opaque,
+                                          uint64_t max_size)
+{
+    return live_vmstate.dirty_bytes;
+}
+
+/* The device sections that follow need the fields, so they stay */
+static int live_vmstate_save_complete(QEMUFile *f, void *opaque)
+{
+    LiveVMStateField *lf;
+    int i;
+
+    live_vmstate.pass_bytes = 0;
+    for (i = 0; i < live_vmstate.fields->len; i++) {
+        lf = g_ptr_array_index(live_vmstate.fields, i);
+        if (lf->se) {
+            live_vmstate_send(f, i, 0, false);
+        }
+    }
+    trace_live_vmstate_complete(live_vmstate.pass_bytes);
+
+    qemu_put_byte(f, LIVE_VMSTATE_EOS);
+    return 0;
+}
+
+static void live_vmstate_cancel(void *opaque)
+{
+    live_vmstate_cleanup();
+}
+
+typedef struct LiveVMStateFind {
+    const char *name;
+    void *ptr;
+    size_t size;
+} LiveVMStateFind;
+
+static void live_vmstate_find(const char *name, void *ptr, size_t size,
+                              void *opaque)
+{
+    LiveVMStateFind *find = opaque;
+
+    if (!strcmp(name, find->name)) {
+        find->ptr = ptr;
+        find->size = size;
+    }
+}
+
+static int live_vmstate_load_fields(QEMUFile *f)
+{
+    char idstr[256], name[256];
+    LiveVMStateFind find = { .name = name };
+    SaveStateEntry *se;
+    uint32_t count, instance_id, size;
+    int i, len;
+
+    live_vmstate_cleanup();
+    live_vmstate.fields = g_ptr_array_new();
+
+    count = qemu_get_be32(f);
+    for (i = 0; i < count; i++) {
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)idstr, len);
+        idstr[len] = 0;
+        instance_id = qemu_get_be32(f);
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)name, len);
+        name[len] = 0;
+        size = qemu_get_be32(f);
+        if (qemu_file_get_error(f)) {
+            return qemu_file_get_error(f);
+        }
+
+        se = find_se(idstr, instance_id);
+        find.ptr = NULL;
+        if (se && se->vmsd) {
+            vmstate_foreach_live_field(se->vmsd, se->opaque,
+                                       live_vmstate_find, &find);
+        }
+        if (!find.ptr || find.size != size) {
+            error_report("Unknown live device state %s/%s (instance %"
+                         PRIu32 ", %" PRIu32 " bytes)",
+                         idstr, name, instance_id, size);
+            return -EINVAL;
+        }
+        trace_live_vmstate_load_field(idstr, instance_id, name, size);
+        live_vmstate_add(se, name, find.ptr, size);
+    }
+    return 0;
+}
+
+static int live_vmstate_load(QEMUFile *f, void *opaque, int version_id)
+{
+    LiveVMStateField *lf;
+    uint32_t index, offset, len;
+    int ret;
+
+    for (;;) {
+        switch (qemu_get_byte(f)) {
+        case LIVE_VMSTATE_EOS:
+            return qemu_file_get_error(f);
+        case LIVE_VMSTATE_FIELDS:
+            ret = live_vmstate_load_fields(f);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+        case LIVE_VMSTATE_DATA:
+            index = qemu_get_be32(f);
+            offset = qemu_get_be32(f);
+            len = qemu_get_be32(f);
+            if (!live_vmstate.fields || index >= live_vmstate.fields->len) {
+                error_report("Live device state %" PRIu32 " not announced",
+                             index);
+                return -EINVAL;
+            }
+            lf = g_ptr_array_index(live_vmstate.fields, index);
+            if ((uint64_t)offset + len > lf->size) {
+                error_report("Live device state %s: %" PRIu32 " bytes at %"
+                             PRIu32 " out of range", lf->name, len, offset);
+                return -EINVAL;
+            }
+            qemu_get_buffer(f, lf->ptr + offset, len);
+            break;
+        default:
+            error_report("Unknown live device state record");
+            return -EINVAL;
+        }
+        ret = qemu_file_get_error(f);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+}
+
+static SaveVMHandlers savevm_live_vmstate_handlers = {
+    .save_live_setup = live_vmstate_save_setup,
+    .save_live_iterate = live_vmstate_save_iterate,
+    .save_live_complete = live_vmstate_save_complete,
+    .save_live_pending = live_vmstate_save_pending,
+    .load_state = live_vmstate_load,
+    .cancel = live_vmstate_cancel,
+    .is_active = live_vmstate_is_active,
+};
+
+void live_vmstate_mig_init(void)
+{
+    register_savevm_live(NULL, "vmstate-live", 0, 1,
+                         &savevm_live_vmstate_handlers, NULL);
+}
+
 struct LoadStateEntry {
     QLIST_ENTRY(LoadStateEntry) entry;
     SaveStateEntry *se;
@@ -1056,52 +1638,369 @@ void loadvm_free_handlers(MigrationIncomingState *mis)
     }
 }
 
-int qemu_loadvm_state(QEMUFile *f)
+/* Return value of the command handlers to stop reading the stream */
+#define LOADVM_QUIT     1
+
+static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis);
+
+/*
+ * Thread run on the destination while postcopy is listening; it loads
+ * the rest of the stream, i.e. the pages of RAM, while the VM runs.
+ */
+static void *postcopy_ram_listen_thread(void *opaque)
 {
+    QEMUFile *f = opaque;
     MigrationIncomingState *mis = migration_incoming_get_current();
-    Error *local_err = NULL;
-    uint8_t section_type;
-    unsigned int v;
-    int ret;
-    int file_error_after_eof = -1;
+    int load_res;
 
-    if (qemu_savevm_state_blocked(&local_err)) {
-        error_report_err(local_err);
-        return -EINVAL;
+    rcu_register_thread();
+    trace_postcopy_ram_listen_thread_start();
+
+    load_res = qemu_loadvm_state_main(f, mis);
+    if (load_res >= 0) {
+        load_res = qemu_file_get_error(f);
     }
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC) {
-        error_report("Not a migration stream");
-        return -EINVAL;
+    trace_postcopy_ram_listen_thread_exit();
+    if (load_res < 0) {
+        /*
+         * The VM runs already, so there is no source to fall back to,
+         * and no way to carry on without the missing pages.
+         */
+        error_report("%s: loadvm failed: %d", __func__, load_res);
+        migrate_send_rp_shut(mis, 1);
+        exit(EXIT_FAILURE);
     }
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        error_report("SaveVM v2 format is obsolete and don't work anymore");
-        return -ENOTSUP;
+    postcopy_state_set(POSTCOPY_INCOMING_END);
+
+    qemu_mutex_lock_iothread();
+    migration_incoming_postcopy_complete();
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Handle the source's OPEN_RETURN_PATH command */
+static int loadvm_process_open_return_path(MigrationIncomingState *mis,
+                                           QEMUFile *f)
+{
+    if (mis->to_src_file) {
+        error_report("CMD_OPEN_RETURN_PATH called when RP already open");
+        /* Not really a problem, so don't give up */
+        return 0;
     }
-    if (v != QEMU_VM_FILE_VERSION) {
-        error_report("Unsupported migration stream version");
-        return -ENOTSUP;
+    mis->to_src_file = qemu_file_get_return_path(f);
+    if (!mis->to_src_file) {
+        error_report("CMD_OPEN_RETURN_PATH failed");
+        return -1;
     }
+    return 0;
+}
 
-    if (!savevm_state.skip_configuration) {
-        if (qemu_get_byte(f) != QEMU_VM_CONFIGURATION) {
-            error_report("Configuration section missing");
-            return -EINVAL;
-        }
-        ret = vmstate_load_state(f, &vmstate_configuration, &savevm_state, 0);
+/* The source may want to postcopy; check that we can do it */
+static int loadvm_postcopy_handle_advise(MigrationIncomingState *mis,
+                                         QEMUFile *f)
+{
+    uint64_t remote_hps, remote_tps;
+
+    trace_loadvm_postcopy_handle_advise();
+    if (postcopy_state_get() != POSTCOPY_INCOMING_NONE) {
+        error_report("CMD_POSTCOPY_ADVISE in wrong postcopy state (%d)",
+                     postcopy_state_get());
+        return -1;
+    }
+
+    if (!postcopy_ram_supported_by_host()) {
+        return -1;
+    }
+
+    remote_hps = qemu_get_be64(f);
+    if (remote_hps != getpagesize())  {
+        /*
+         * Some combinations of mismatch are probably possible but it gets
+         * a bit more complicated.  In particular we need to place whole
+         * host pages on the dest at once, and we need to ensure that we
+         * handle dirtying to make sure we never end up sending part of
+         * a hostpage on it's own.
+         */
+        error_report("Postcopy needs matching host page sizes (s=%d d=%d)",
+                     (int)remote_hps, getpagesize());
+        return -1;
+    }
+
+    remote_tps = qemu_get_be64(f);
+    if (remote_tps != TARGET_PAGE_SIZE) {
+        /*
+         * Again, some differences could be dealt with, but for now keep it
+         * simple.
+         */
+        error_report("Postcopy needs matching target page sizes (s=%d d=%d)",
+                     (int)remote_tps, TARGET_PAGE_SIZE);
+        return -1;
+    }
+
+    if (postcopy_ram_incoming_init(mis)) {
+        return -1;
+    }
+
+    postcopy_state_set(POSTCOPY_INCOMING_ADVISE);
+
+    return 0;
+}
 
+/* After postcopy we will be told to throw some pages away since they're
+ * dirty and will have to be demand fetched.  Must happen before CPU is
+ * started.
+ * There can be 0..many of these messages, each encoding multiple pages.
+ */
+static int loadvm_postcopy_ram_handle_discard(MigrationIncomingState *mis,
+                                              uint16_t len)
+{
+    int tmp, ret;
+    char ramid[256];
+
+    if (postcopy_state_get() != POSTCOPY_INCOMING_ADVISE) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD in wrong postcopy state (%d)",
+                     postcopy_state_get());
+        return -1;
+    }
+    /* We're expecting a
+     *    Version (0)
+     *    a RAM ID string (length byte, name, 0 term)
+     *    then at least 1 16 byte chunk
+    */
+    if (len < (1 + 1 + 1 + 1 + 2 * 8)) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid length (%d)", len);
+        return -1;
+    }
+
+    tmp = qemu_get_byte(mis->file);
+    if (tmp != 0) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid version (%d)", tmp);
+        return -1;
+    }
+
+    if (!qemu_get_counted_string(mis->file, ramid)) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD Failed to read RAMBlock ID");
+        return -1;
+    }
+    tmp = qemu_get_byte(mis->file);
+    if (tmp != 0) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD missing nil (%d)", tmp);
+        return -1;
+    }
+
+    if (len < 3 + strlen(ramid)) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid length (%d)", len);
+        return -1;
+    }
+    len -= 3 + strlen(ramid);
+    if (len % 16) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid length (%d)", len);
+        return -1;
+    }
+    trace_loadvm_postcopy_ram_handle_discard_header(ramid, len);
+    while (len) {
+        uint64_t start_addr, block_length;
+        start_addr = qemu_get_be64(mis->file);
+        block_length = qemu_get_be64(mis->file);
+
+        len -= 16;
+        ret = postcopy_ram_discard_range(mis, ramid, start_addr,
+                                         block_length);
         if (ret) {
             return ret;
         }
     }
 
+    return 0;
+}
+
+/* After this message we must be able to immediately receive postcopy data */
+static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis,
+                                         QEMUFile *f)
+{
+    trace_loadvm_postcopy_handle_listen();
+    if (postcopy_state_get() != POSTCOPY_INCOMING_ADVISE) {
+        error_report("CMD_POSTCOPY_LISTEN in wrong postcopy state (%d)",
+                     postcopy_state_get());
+        return -1;
+    }
+    if (f == mis->file) {
+        /* the main stream must not be read by two threads at once */
+        error_report("CMD_POSTCOPY_LISTEN outside of a package");
+        return -1;
+    }
+
+    /*
+     * Sensitise RAM - can now generate requests for blocks that don't exist
+     * However, at this point the CPU shouldn't be running, and the IO
+     * shouldn't be doing anything yet so don't actually expect requests
+     */
+    if (postcopy_ram_enable_notify(mis)) {
+        return -1;
+    }
+
+    /* the listen thread reads the stream without the coroutine */
+    qemu_set_block(qemu_get_fd(mis->file));
+    postcopy_state_set(POSTCOPY_INCOMING_LISTENING);
+
+    qemu_thread_create(&mis->listen_thread, "postcopy/listen",
+                       postcopy_ram_listen_thread, mis->file,
+                       QEMU_THREAD_DETACHED);
+
+    return 0;
+}
+
+/* After all discards we can start running and asking for pages */
+static int loadvm_postcopy_handle_run(MigrationIncomingState *mis)
+{
+    trace_loadvm_postcopy_handle_run();
+    if (postcopy_state_get() != POSTCOPY_INCOMING_LISTENING) {
+        error_report("CMD_POSTCOPY_RUN in wrong postcopy state (%d)",
+                     postcopy_state_get());
+        return -1;
+    }
+    postcopy_state_set(POSTCOPY_INCOMING_RUNNING);
+
+    /* TODO we should move all of this lot into postcopy_ram.c or a shared code
+     * in migration.c
+     */
+    cpu_synchronize_all_post_init();
+
+    if (migration_incoming_start_vm()) {
+        return -1;
+    }
+
+    /* We need to finish reading the stream from the package
+     * and also stop reading anything more from the stream that loaded the
+     * package (since it's now being read by the listener thread).
+     * LOADVM_QUIT will quit all the layers of nested loadvm loops.
+     */
+    return LOADVM_QUIT;
+}
+
+/*
+ * Immediately following this command is a blob of data containing an embedded
+ * chunk of migration stream; read it and load it.
+ *
+ * @mis: Incoming state
+ * @length: Length of packaged data to read
+ *
+ * Returns: Negative values on error
+ *
+ */
+static int loadvm_handle_cmd_packaged(MigrationIncomingState *mis)
+{
+    int ret;
+    uint8_t *buffer;
+    uint32_t length;
+    QEMUSizedBuffer *qsb;
+    QEMUFile *packf;
+
+    length = qemu_get_be32(mis->file);
+    trace_loadvm_handle_cmd_packaged(length);
+
+    if (length > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("Unreasonably large packaged state: %u", length);
+        return -1;
+    }
+    buffer = g_malloc0(length);
+    ret = qemu_get_buffer(mis->file, buffer, (int)length);
+    if (ret != length) {
+        g_free(buffer);
+        error_report("CMD_PACKAGED: Buffer receive fail ret=%d length=%d",
+                ret, length);
+        return (ret < 0) ? ret : -EAGAIN;
+    }
+    trace_loadvm_handle_cmd_packaged_received(ret);
+
+    /* Setup a dummy QEMUFile that actually reads from the buffer */
+    qsb = qsb_create(buffer, length);
+    g_free(buffer); /* Because qsb_create copies */
+    if (!qsb) {
+        error_report("Unable to create qsb");
+        return -1;
+    }
+    packf = qemu_bufopen("r", qsb);
+
+    ret = qemu_loadvm_state_main(packf, mis);
+    trace_loadvm_handle_cmd_packaged_main(ret);
+    qemu_fclose(packf);
+    qsb_free(qsb);
+
+    if (ret >= 0 && postcopy_state_get() == POSTCOPY_INCOMING_LISTENING) {
+        /* the listen thread owns the stream, and nothing runs the VM */
+        error_report("CMD_PACKAGED: listening without running");
+        return -1;
+    }
+
+    return ret;
+}
+
+/*
+ * Process an incoming 'QEMU_VM_COMMAND'
+ * 0           just a normal return
+ * LOADVM_QUIT All good, but exit the loop
+ * <0          Error
+ */
+static int loadvm_process_command(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    uint16_t cmd;
+    uint16_t len;
+
+    cmd = qemu_get_be16(f);
+    len = qemu_get_be16(f);
+
+    trace_loadvm_process_command(cmd, len);
+    if (cmd >= MIG_CMD_MAX || cmd == MIG_CMD_INVALID) {
+        error_report("MIG_CMD 0x%x unknown (len 0x%x)", cmd, len);
+        return -EINVAL;
+    }
+
+    if (mig_cmd_args[cmd].len != -1 && mig_cmd_args[cmd].len != len) {
+        error_report("%s received with bad length - expecting %zu, got %d",
+                     mig_cmd_args[cmd].name,
+                     (size_t)mig_cmd_args[cmd].len, len);
+        return -ERANGE;
+    }
+
+    switch (cmd) {
+    case MIG_CMD_OPEN_RETURN_PATH:
+        return loadvm_process_open_return_path(mis, f);
+
+    case MIG_CMD_PACKAGED:
+        return loadvm_handle_cmd_packaged(mis);
+
+    case MIG_CMD_POSTCOPY_ADVISE:
+        return loadvm_postcopy_handle_advise(mis, f);
+
+    case MIG_CMD_POSTCOPY_LISTEN:
+        return loadvm_postcopy_handle_listen(mis, f);
+
+    case MIG_CMD_POSTCOPY_RUN:
+        return loadvm_postcopy_handle_run(mis);
+
+    case MIG_CMD_POSTCOPY_RAM_DISCARD:
+        return loadvm_postcopy_ram_handle_discard(mis, len);
+    }
+
+    return 0;
+}
+
+static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
+{
+    uint8_t section_type;
+    int ret;
+
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
         SaveStateEntry *se;
         LoadStateEntry *le;
+        LoadStateEntry full_le;
         char idstr[256];
 
         trace_qemu_loadvm_state_section(section_type);
@@ -1125,35 +2024,42 @@ int qemu_loadvm_state(QEMUFile *f)
             if (se == NULL) {
                 error_report("Unknown savevm section or instance '%s' %d",
                              idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 error_report("savevm: unsupported version %d for '%s' v%d",
                              version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
-            /* Add entry */
-            le = g_malloc0(sizeof(*le));
+            /*
+             * Only the sections that are continued need to be looked up
+             * later; in postcopy, the list is walked by the listen thread
+             * while the state of the devices is loaded.
+             */
+            if (section_type == QEMU_VM_SECTION_START) {
+                le = g_malloc0(sizeof(*le));
+            } else {
+                le = &full_le;
+            }
 
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&mis->loadvm_handlers, le, entry);
+            if (section_type == QEMU_VM_SECTION_START) {
+                QLIST_INSERT_HEAD(&mis->loadvm_handlers, le, entry);
+            }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 error_report("error while loading state for instance 0x%x of"
                              " device '%s'", instance_id, idstr);
-                goto out;
+                return ret;
             }
             if (!check_section_footer(f, le)) {
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
             break;
         case QEMU_VM_SECTION_PART:
@@ -1168,28 +2074,89 @@ int qemu_loadvm_state(QEMUFile *f)
             }
             if (le == NULL) {
                 error_report("Unknown savevm section %d", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 error_report("error while loading state section id %d(%s)",
                              section_id, le->se->idstr);
-                goto out;
+                return ret;
             }
             if (!check_section_footer(f, le)) {
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
+            }
+            break;
+        case QEMU_VM_COMMAND:
+            ret = loadvm_process_command(f);
+            trace_qemu_loadvm_state_section_command(ret);
+            if ((ret < 0) || (ret & LOADVM_QUIT)) {
+                return ret;
             }
             break;
         default:
             error_report("Unknown savevm section type %d", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
+    return 0;
+}
+
+int qemu_loadvm_state(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    Error *local_err = NULL;
+    uint8_t section_type;
+    unsigned int v;
+    int ret;
+    int file_error_after_eof = -1;
+
+    if (qemu_savevm_state_blocked(&local_err)) {
+        error_report_err(local_err);
+        return -EINVAL;
+    }
+
+    live_vmstate_cleanup();
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC) {
+        error_report("Not a migration stream");
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        error_report("SaveVM v2 format is obsolete and don't work anymore");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION) {
+        error_report("Unsupported migration stream version");
+        return -ENOTSUP;
+    }
+
+    if (!savevm_state.skip_configuration) {
+        if (qemu_get_byte(f) != QEMU_VM_CONFIGURATION) {
+            error_report("Configuration section missing");
+            return -EINVAL;
+        }
+        ret = vmstate_load_state(f, &vmstate_configuration, &savevm_state, 0);
+
+        if (ret) {
+            return ret;
+        }
+    }
+
+    ret = qemu_loadvm_state_main(f, mis);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (postcopy_state_get() >= POSTCOPY_INCOMING_LISTENING) {
+        /* the listen thread loads the rest and completes the migration */
+        return 0;
+    }
+
     file_error_after_eof = qemu_file_get_error(f);
 
     /*
@@ -1232,6 +2199,7 @@ int qemu_loadvm_state(QEMUFile *f)
     ret = 0;
 
 out:
+    live_vmstate_cleanup();
     if (ret == 0) {
         /* We may not have a VMDESC section, so ignore relative errors */
         ret = file_error_after_eof;
@@ -21,6 +21,7 @@
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "block/block.h"
+#include "block/coroutine.h"
 #include "qemu/main-loop.h"
 
 //#define DEBUG_MIGRATION_TCP
@@ -50,9 +51,96 @@ static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    s->multifd_address = g_strdup(host_port);
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
+/* Open one more connection to the destination; called by the migration
+ * thread, so it may block.  The destination accepts the connections as
+ * they come in, before it reads their number from the main stream.
+ */
+int tcp_multifd_connect(MigrationState *s, Error **errp)
+{
+    if (!s->multifd_address) {
+        error_setg(errp, "multifd is only supported for tcp migration");
+        return -1;
+    }
+    return inet_connect(s->multifd_address, errp);
+}
+
+/* The listening socket is kept open after the main connection has been
+ * accepted, and the multifd connections are accepted from the main loop
+ * as soon as they come in.  They wait in incoming_multifd_fds until the
+ * main stream asks for them.
+ */
+static int incoming_listen_fd = -1;
+static int incoming_accept_err;
+static GQueue incoming_multifd_fds = G_QUEUE_INIT;
+static Coroutine *incoming_multifd_co;
+
+static void tcp_accept_multifd(void *opaque)
+{
+    Coroutine *co = incoming_multifd_co;
+    int c, err;
+
+    do {
+        c = qemu_accept(incoming_listen_fd, NULL, NULL);
+        err = socket_error();
+    } while (c < 0 && err == EINTR);
+
+    if (c < 0) {
+        if (err == EAGAIN || err == EWOULDBLOCK) {
+            return;
+        }
+        incoming_accept_err = err;
+        tcp_multifd_close_listener();
+    } else {
+        DPRINTF("accepted multifd connection\n");
+        g_queue_push_tail(&incoming_multifd_fds, GINT_TO_POINTER(c));
+    }
+
+    if (co) {
+        incoming_multifd_co = NULL;
+        qemu_coroutine_enter(co, NULL);
+    }
+}
+
+/* Called from the incoming migration coroutine, which yields until a
+ * multifd connection has been accepted.
+ */
+int tcp_multifd_accept(Error **errp)
+{
+    while (g_queue_is_empty(&incoming_multifd_fds)) {
+        if (incoming_listen_fd < 0) {
+            if (incoming_accept_err) {
+                error_setg_errno(errp, incoming_accept_err,
+                                 "could not accept multifd connection");
+            } else {
+                error_setg(errp,
+                           "multifd is only supported for tcp migration");
+            }
+            return -1;
+        }
+        assert(qemu_in_coroutine());
+        incoming_multifd_co = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+
+    return GPOINTER_TO_INT(g_queue_pop_head(&incoming_multifd_fds));
+}
+
+void tcp_multifd_close_listener(void)
+{
+    if (incoming_listen_fd >= 0) {
+        qemu_set_fd_handler(incoming_listen_fd, NULL, NULL, NULL);
+        closesocket(incoming_listen_fd);
+        incoming_listen_fd = -1;
+    }
+    while (!g_queue_is_empty(&incoming_multifd_fds)) {
+        closesocket(GPOINTER_TO_INT(g_queue_pop_head(&incoming_multifd_fds)));
+    }
+}
+
 static void tcp_accept_incoming_migration(void *opaque)
 {
     struct sockaddr_in addr;
@@ -66,11 +154,11 @@ static void tcp_accept_incoming_migration(void *opaque)
         err = socket_error();
     } while (c < 0 && err == EINTR);
     qemu_set_fd_handler(s, NULL, NULL, NULL);
-    closesocket(s);
 
     DPRINTF("accepted migration\n");
 
     if (c < 0) {
+        closesocket(s);
         error_report("could not accept migration connection (%s)",
                      strerror(err));
         return;
@@ -82,11 +170,20 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
+    /* The source may open all multifd connections at once, while the
+     * main loop is busy loading the main stream */
+    listen(s, MULTIFD_MAX_CHANNELS);
+    qemu_set_nonblock(s);
+    incoming_listen_fd = s;
+    incoming_accept_err = 0;
+    qemu_set_fd_handler(s, tcp_accept_multifd, NULL, NULL);
+
     process_incoming_migration(f);
     return;
 
 out:
     closesocket(c);
+    closesocket(s);
 }
 
 void tcp_start_incoming_migration(const char *host_port, Error **errp)
@@ -45,6 +45,66 @@ static int vmstate_size(void *opaque, VMStateField *field)
     return size;
 }
 
+/* Live buffers carried by the "vmstate-live" section of this migration */
+static GHashTable *live_fields;
+
+void vmstate_live_mark(void *ptr, bool live)
+{
+    if (!live_fields) {
+        live_fields = g_hash_table_new(NULL, NULL);
+    }
+    if (live) {
+        g_hash_table_insert(live_fields, ptr, ptr);
+    } else {
+        g_hash_table_remove(live_fields, ptr);
+    }
+}
+
+void vmstate_live_reset(void)
+{
+    if (live_fields) {
+        g_hash_table_destroy(live_fields);
+        live_fields = NULL;
+    }
+}
+
+static bool vmstate_live_sent(void *opaque, VMStateField *field)
+{
+    return (field->flags & VMS_LIVE) && live_fields &&
+           g_hash_table_lookup(live_fields, opaque + field->offset);
+}
+
+static void vmstate_foreach_live_field_prefix(const VMStateDescription *vmsd,
+                                              void *opaque, const char *prefix,
+                                              VMStateLiveFunc *func,
+                                              void *func_opaque)
+{
+    VMStateField *field;
+    char *name;
+
+    for (field = vmsd->fields; field->name; field++) {
+        if (field->field_exists || field->version_id > vmsd->version_id) {
+            continue;
+        }
+        name = prefix ? g_strdup_printf("%s/%s", prefix, field->name)
+                      : g_strdup(field->name);
+        if (field->flags == (VMS_BUFFER | VMS_LIVE)) {
+            func(name, opaque + field->offset, field->size, func_opaque);
+        } else if (field->flags == VMS_STRUCT) {
+            vmstate_foreach_live_field_prefix(field->vmsd,
+                                              opaque + field->offset, name,
+                                              func, func_opaque);
+        }
+        g_free(name);
+    }
+}
+
+void vmstate_foreach_live_field(const VMStateDescription *vmsd, void *opaque,
+                                VMStateLiveFunc *func, void *func_opaque)
+{
+    vmstate_foreach_live_field_prefix(vmsd, opaque, NULL, func, func_opaque);
+}
+
 static void *vmstate_base_addr(void *opaque, VMStateField *field, bool alloc)
 {
     void *base_addr = opaque + field->offset;
@@ -99,7 +159,9 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
     }
     while (field->name) {
         trace_vmstate_load_state_field(vmsd->name, field->name);
-        if ((field->field_exists &&
+        if (vmstate_live_sent(opaque, field)) {
+            trace_vmstate_live_skip(vmsd->name, field->name);
+        } else if ((field->field_exists &&
              field->field_exists(opaque, version_id)) ||
             (!field->field_exists &&
              field->version_id <= version_id)) {
@@ -303,8 +365,10 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
     }
 
     while (field->name) {
-        if (!field->field_exists ||
-            field->field_exists(opaque, vmsd->version_id)) {
+        if (vmstate_live_sent(opaque, field)) {
+            trace_vmstate_live_skip(vmsd->name, field->name);
+        } else if (!field->field_exists ||
+                   field->field_exists(opaque, vmsd->version_id)) {
             void *base_addr = vmstate_base_addr(opaque, field, false);
             int i, n_elems = vmstate_n_elems(opaque, field);
             int size = vmstate_size(opaque, field);
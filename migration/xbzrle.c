@@ -13,6 +13,10 @@
 #include "qemu-common.h"
 #include "include/migration/migration.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -23,12 +27,118 @@
 
   length = uleb128 encoded integer
  */
+/*
+ * Returns the length of the run of equal bytes at @i, which can be
+ * found a vector at a time. The buffers are aligned to sizeof(long).
+ */
+static int find_zrun(const uint8_t *old_buf, const uint8_t *new_buf,
+                     int i, int slen)
+{
+    int start = i;
+
+    /* not aligned to sizeof(long) */
+    while (i < slen && i % sizeof(long) && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+
+#ifdef __SSE2__
+    /* long zero runs are the common case, check 64 bytes at a time */
+    for (; i + 64 <= slen; i += 64) {
+        const __m128i *o = (const __m128i *)(old_buf + i);
+        const __m128i *n = (const __m128i *)(new_buf + i);
+        __m128i eq01 = _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128(o), _mm_loadu_si128(n)),
+            _mm_cmpeq_epi8(_mm_loadu_si128(o + 1), _mm_loadu_si128(n + 1)));
+        __m128i eq23 = _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128(o + 2), _mm_loadu_si128(n + 2)),
+            _mm_cmpeq_epi8(_mm_loadu_si128(o + 3), _mm_loadu_si128(n + 3)));
+
+        if (_mm_movemask_epi8(_mm_and_si128(eq01, eq23)) != 0xffff) {
+            break;
+        }
+    }
+
+    /* 16 bytes at a time, the first difference tells where the run ends */
+    for (; i + 16 <= slen; i += 16) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        unsigned int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n));
+
+        if (eq != 0xffff) {
+            return i + ctz32(~eq) - start;
+        }
+    }
+#endif
+
+    /* word at a time for speed */
+    if (!(i % sizeof(long))) {
+        while (i + sizeof(long) <= slen &&
+               *(long *)(old_buf + i) == *(long *)(new_buf + i)) {
+            i += sizeof(long);
+        }
+    }
+
+    /* go over the rest */
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+
+    return i - start;
+}
+
+/* Returns the length of the run of different bytes at @i. */
+static int find_nzrun(const uint8_t *old_buf, const uint8_t *new_buf,
+                      int i, int slen)
+{
+    int start = i;
+
+    /* not aligned to sizeof(long) */
+    while (i < slen && i % sizeof(long) && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+
+#ifdef __SSE2__
+    /* 16 bytes at a time, the first equal byte tells where the run ends */
+    for (; i + 16 <= slen; i += 16) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        unsigned int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n));
+
+        if (eq) {
+            return i + ctz32(eq) - start;
+        }
+    }
+#endif
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!(i % sizeof(long))) {
+        /* truncation to 32-bit long okay */
+        unsigned long mask = (unsigned long)0x0101010101010101ULL;
+        while (i + sizeof(long) <= slen) {
+            unsigned long xor;
+            xor = *(unsigned long *)(old_buf + i)
+                ^ *(unsigned long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                break;
+            }
+            i += sizeof(long);
+        }
+    }
+
+    /* go over the rest */
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+
+    return i - start;
+}
+
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
-    long res;
     uint8_t *nzrun_start = NULL;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
@@ -40,28 +150,8 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        zrun_len = find_zrun(old_buf, new_buf, i, slen);
+        i += zrun_len;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -75,42 +165,15 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
         nzrun_start = new_buf + i;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        nzrun_len = find_nzrun(old_buf, new_buf, i, slen);
+        i += nzrun_len;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
@@ -119,7 +182,6 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
         memcpy(dst + d, nzrun_start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;
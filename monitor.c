@@ -71,6 +71,7 @@
 #include "qmp-commands.h"
 #include "hmp.h"
 #include "qemu/thread.h"
+#include "qemu/qsp.h"
 #include "block/qapi.h"
 #include "qapi/qmp-event.h"
 #include "qapi-event.h"
@@ -131,6 +132,11 @@ typedef struct mon_cmd_t {
      */
     struct mon_cmd_t *sub_table;
     void (*command_completion)(ReadLineState *rs, int nb_args, const char *str);
+    /* QMP only: the command needs neither the BQL nor cur_mon's state
+     * other than in_command_mode, so monitors with out-of-band execution
+     * run it in the monitor I/O thread right away.
+     */
+    bool allow_oob;
 } mon_cmd_t;
 
 /* file descriptors passed via SCM_RIGHTS */
@@ -159,8 +165,14 @@ struct MonFdset {
     QLIST_ENTRY(MonFdset) next;
 };
 
-typedef struct {
+typedef struct QMPRequest {
+    const mon_cmd_t *cmd;
+    QDict *args;
     QObject *id;
+    QSIMPLEQ_ENTRY(QMPRequest) entry;
+} QMPRequest;
+
+typedef struct {
     JSONMessageParser parser;
     /*
      * When a client connects, we're in capabilities negotiation mode.
@@ -168,8 +180,24 @@ typedef struct {
      * mode.
      */
     bool in_command_mode;       /* are we in command mode? */
+
+    /*
+     * With out-of-band execution, the monitor I/O thread reads and parses
+     * the commands.  It runs those that allow it right away and queues
+     * the others for qmp_dispatch_bh, which runs them in order under the
+     * BQL.
+     */
+    bool use_oob;
+    QemuMutex qmp_queue_lock;
+    QSIMPLEQ_HEAD(, QMPRequest) qmp_requests;
+    unsigned int qmp_requests_len;
+    QEMUBH *qmp_dispatch_bh;
+    bool dispatching;
 } MonitorQMP;
 
+/* Stop reading commands while this many wait for the main loop */
+#define QMP_REQ_QUEUE_LEN_MAX 8
+
 /*
  * To prevent flooding clients, events can be throttled. The
  * throttling is calculated globally, rather than per-Monitor
@@ -222,7 +250,14 @@ static mon_cmd_t info_cmds[];
 
 static const mon_cmd_t qmp_cmds[];
 
-Monitor *cur_mon;
+__thread Monitor *cur_mon;
+
+/* Runs the I/O of the monitors with out-of-band execution */
+static struct {
+    QemuThread thread;
+    GMainContext *context;
+    GMainLoop *loop;
+} mon_iothread;
 
 static void monitor_command_cb(void *opaque, const char *cmdline,
                                void *readline_opaque);
@@ -402,8 +437,9 @@ static QDict *build_qmp_error_dict(Error *err)
     return qobject_to_qdict(obj);
 }
 
-static void monitor_protocol_emitter(Monitor *mon, QObject *data,
-                                     Error *err)
+/* Sends the response to a command; takes over the reference to @id */
+static void monitor_protocol_emitter(Monitor *mon, QObject *id,
+                                     QObject *data, Error *err)
 {
     QDict *qmp;
 
@@ -424,9 +460,8 @@ static void monitor_protocol_emitter(Monitor *mon, QObject *data,
         qmp = build_qmp_error_dict(err);
     }
 
-    if (mon->qmp.id) {
-        qdict_put_obj(qmp, "id", mon->qmp.id);
-        mon->qmp.id = NULL;
+    if (id) {
+        qdict_put_obj(qmp, "id", id);
     }
 
     monitor_json_emitter(mon, QOBJECT(qmp));
@@ -583,6 +618,10 @@ static void monitor_data_destroy(Monitor *mon)
 {
     QDECREF(mon->outbuf);
     qemu_mutex_destroy(&mon->out_lock);
+    if (mon->qmp.use_oob) {
+        qemu_mutex_destroy(&mon->qmp.qmp_queue_lock);
+        qemu_bh_delete(mon->qmp.qmp_dispatch_bh);
+    }
 }
 
 char *qmp_human_monitor_command(const char *command_line, bool has_cpu_index,
@@ -883,6 +922,25 @@ static void hmp_trace_file(Monitor *mon, const QDict *qdict)
 }
 #endif
 
+static void hmp_sync_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *op = qdict_get_try_str(qdict, "op");
+
+    if (!op) {
+        monitor_printf(mon, "sync-profile is %s\n",
+                       qsp_enabled ? "on" : "off");
+    } else if (!strcmp(op, "on")) {
+        qsp_enable();
+    } else if (!strcmp(op, "off")) {
+        qsp_disable();
+    } else if (!strcmp(op, "reset")) {
+        qsp_reset();
+    } else {
+        monitor_printf(mon, "unexpected argument \"%s\"\n", op);
+        help_cmd(mon, "sync-profile");
+    }
+}
+
 static void hmp_info_help(Monitor *mon, const QDict *qdict)
 {
     help_cmd(mon, "info");
@@ -967,6 +1025,18 @@ static void hmp_info_jit(Monitor *mon, const QDict *qdict)
     dump_drift_info((FILE *)mon, monitor_fprintf);
 }
 
+static void hmp_info_sync_profile(Monitor *mon, const QDict *qdict)
+{
+    qsp_report((FILE *)mon, monitor_fprintf,
+               qdict_get_try_int(qdict, "max", 10));
+}
+
+static void hmp_info_tbs(Monitor *mon, const QDict *qdict)
+{
+    dump_tb_stats((FILE *)mon, monitor_fprintf,
+                  qdict_get_try_int(qdict, "count", 10));
+}
+
 static void hmp_info_opcount(Monitor *mon, const QDict *qdict)
 {
     dump_opcount_info((FILE *)mon, monitor_fprintf);
@@ -2642,6 +2712,21 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.cmd = hmp_info_jit,
     },
+    {
+        .name       = "tbs",
+        .args_type  = "count:i?",
+        .params     = "[count]",
+        .help       = "show the most executed translation blocks",
+        .mhandler.cmd = hmp_info_tbs,
+    },
+    {
+        .name       = "sync-profile",
+        .args_type  = "max:i?",
+        .params     = "[max]",
+        .help       = "show the locks that were waited for longest "
+                      "(default max 10)",
+        .mhandler.cmd = hmp_info_sync_profile,
+    },
     {
         .name       = "opcount",
         .args_type  = "",
@@ -4710,6 +4795,17 @@ static int monitor_can_read(void *opaque)
     return (mon->suspend_cnt == 0) ? 1 : 0;
 }
 
+static int monitor_qmp_can_read(void *opaque)
+{
+    Monitor *mon = opaque;
+
+    if (mon->qmp.use_oob &&
+        atomic_read(&mon->qmp.qmp_requests_len) >= QMP_REQ_QUEUE_LEN_MAX) {
+        return 0;
+    }
+    return monitor_can_read(opaque);
+}
+
 static bool invalid_qmp_mode(const Monitor *mon, const mon_cmd_t *cmd,
                              Error **errp)
 {
@@ -4979,17 +5075,84 @@ static QDict *qmp_check_input_obj(QObject *input_obj, Error **errp)
     return input_dict;
 }
 
-static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
+static void qmp_call_cmd(Monitor *mon, const mon_cmd_t *cmd, QDict *args,
+                         QObject *id)
+{
+    Error *local_err = NULL;
+    QObject *data = NULL;
+    Monitor *old_mon = cur_mon;
+
+    cur_mon = mon;
+    cmd->mhandler.cmd_new(args, &data, &local_err);
+    cur_mon = old_mon;
+
+    monitor_protocol_emitter(mon, id, data, local_err);
+    qobject_decref(data);
+    error_free(local_err);
+}
+
+/* Runs the queued commands of a monitor with out-of-band execution */
+static void monitor_qmp_dispatch_bh(void *opaque)
+{
+    Monitor *mon = opaque;
+    QMPRequest *req;
+
+    /* a command that runs a nested event loop must not start the next */
+    if (mon->qmp.dispatching) {
+        return;
+    }
+    mon->qmp.dispatching = true;
+
+    for (;;) {
+        qemu_mutex_lock(&mon->qmp.qmp_queue_lock);
+        req = QSIMPLEQ_FIRST(&mon->qmp.qmp_requests);
+        if (req) {
+            QSIMPLEQ_REMOVE_HEAD(&mon->qmp.qmp_requests, entry);
+            atomic_dec(&mon->qmp.qmp_requests_len);
+        }
+        qemu_mutex_unlock(&mon->qmp.qmp_queue_lock);
+        if (!req) {
+            break;
+        }
+
+        qmp_call_cmd(mon, req->cmd, req->args, req->id);
+        QDECREF(req->args);
+        g_free(req);
+
+        /* there is room in the queue again */
+        g_main_context_wakeup(mon_iothread.context);
+    }
+
+    mon->qmp.dispatching = false;
+}
+
+static void monitor_qmp_queue_request(Monitor *mon, const mon_cmd_t *cmd,
+                                      QDict *args, QObject *id)
+{
+    QMPRequest *req = g_new0(QMPRequest, 1);
+
+    req->cmd = cmd;
+    req->args = args;
+    req->id = id;
+
+    qemu_mutex_lock(&mon->qmp.qmp_queue_lock);
+    QSIMPLEQ_INSERT_TAIL(&mon->qmp.qmp_requests, req, entry);
+    atomic_inc(&mon->qmp.qmp_requests_len);
+    qemu_mutex_unlock(&mon->qmp.qmp_queue_lock);
+
+    qemu_bh_schedule(mon->qmp.qmp_dispatch_bh);
+}
+
+static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
 {
     Error *local_err = NULL;
-    QObject *obj, *data;
+    QObject *obj, *id = NULL;
     QDict *input, *args;
     const mon_cmd_t *cmd;
     const char *cmd_name;
-    Monitor *mon = cur_mon;
+    Monitor *mon = container_of(parser, Monitor, qmp.parser);
 
     args = input = NULL;
-    data = NULL;
 
     obj = json_parser_parse(tokens, NULL);
     if (!obj) {
@@ -5004,8 +5167,8 @@ static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
         goto err_out;
     }
 
-    mon->qmp.id = qdict_get(input, "id");
-    qobject_incref(mon->qmp.id);
+    id = qdict_get(input, "id");
+    qobject_incref(id);
 
     cmd_name = qdict_get_str(input, "execute");
     trace_handle_qmp_command(mon, cmd_name);
@@ -5032,24 +5195,29 @@ static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
         goto err_out;
     }
 
-    cmd->mhandler.cmd_new(args, &data, &local_err);
+    if (mon->qmp.use_oob && !cmd->allow_oob) {
+        monitor_qmp_queue_request(mon, cmd, args, id);
+        QDECREF(input);
+        return;
+    }
+
+    qmp_call_cmd(mon, cmd, args, id);
+    QDECREF(input);
+    QDECREF(args);
+    return;
 
 err_out:
-    monitor_protocol_emitter(mon, data, local_err);
-    qobject_decref(data);
+    monitor_protocol_emitter(mon, id, NULL, local_err);
+    error_free(local_err);
     QDECREF(input);
     QDECREF(args);
 }
 
 static void monitor_qmp_read(void *opaque, const uint8_t *buf, int size)
 {
-    Monitor *old_mon = cur_mon;
-
-    cur_mon = opaque;
-
-    json_message_parser_feed(&cur_mon->qmp.parser, (const char *) buf, size);
+    Monitor *mon = opaque;
 
-    cur_mon = old_mon;
+    json_message_parser_feed(&mon->qmp.parser, (const char *) buf, size);
 }
 
 static void monitor_read(void *opaque, const uint8_t *buf, int size)
@@ -5098,11 +5266,15 @@ void monitor_resume(Monitor *mon)
         readline_show_prompt(mon->rs);
 }
 
-static QObject *get_qmp_greeting(void)
+static QObject *get_qmp_greeting(Monitor *mon)
 {
     QObject *ver = NULL;
 
     qmp_marshal_input_query_version(NULL, &ver, NULL);
+    if (mon->qmp.use_oob) {
+        return qobject_from_jsonf("{'QMP':{'version': %p,"
+                                  "'capabilities': ['oob']}}", ver);
+    }
     return qobject_from_jsonf("{'QMP':{'version': %p,'capabilities': []}}",ver);
 }
 
@@ -5110,24 +5282,55 @@ static void monitor_qmp_event(void *opaque, int event)
 {
     QObject *data;
     Monitor *mon = opaque;
+    /* out-of-band monitors get their events in the monitor I/O thread */
+    bool need_bql = !qemu_mutex_iothread_locked();
 
     switch (event) {
     case CHR_EVENT_OPENED:
         mon->qmp.in_command_mode = false;
-        data = get_qmp_greeting();
+        data = get_qmp_greeting(mon);
         monitor_json_emitter(mon, data);
         qobject_decref(data);
+        if (need_bql) {
+            qemu_mutex_lock_iothread();
+        }
         mon_refcount++;
+        if (need_bql) {
+            qemu_mutex_unlock_iothread();
+        }
         break;
     case CHR_EVENT_CLOSED:
         json_message_parser_destroy(&mon->qmp.parser);
         json_message_parser_init(&mon->qmp.parser, handle_qmp_command);
+        if (need_bql) {
+            qemu_mutex_lock_iothread();
+        }
         mon_refcount--;
         monitor_fdsets_cleanup();
+        if (need_bql) {
+            qemu_mutex_unlock_iothread();
+        }
         break;
     }
 }
 
+static void *monitor_iothread_run(void *opaque)
+{
+    g_main_loop_run(mon_iothread.loop);
+    return NULL;
+}
+
+static void monitor_iothread_init(void)
+{
+    if (mon_iothread.context) {
+        return;
+    }
+    mon_iothread.context = g_main_context_new();
+    mon_iothread.loop = g_main_loop_new(mon_iothread.context, FALSE);
+    qemu_thread_create(&mon_iothread.thread, "mon_iothread",
+                       monitor_iothread_run, NULL, QEMU_THREAD_DETACHED);
+}
+
 static void monitor_event(void *opaque, int event)
 {
     Monitor *mon = opaque;
@@ -5254,10 +5457,22 @@ void monitor_init(CharDriverState *chr, int flags)
     }
 
     if (monitor_is_qmp(mon)) {
-        qemu_chr_add_handlers(chr, monitor_can_read, monitor_qmp_read,
-                              monitor_qmp_event, mon);
-        qemu_chr_fe_set_echo(chr, true);
+        GMainContext *context = NULL;
+
+        if (flags & MONITOR_USE_OOB) {
+            monitor_iothread_init();
+            context = mon_iothread.context;
+            mon->qmp.use_oob = true;
+            qemu_mutex_init(&mon->qmp.qmp_queue_lock);
+            QSIMPLEQ_INIT(&mon->qmp.qmp_requests);
+            mon->qmp.qmp_dispatch_bh = qemu_bh_new(monitor_qmp_dispatch_bh,
+                                                   mon);
+        }
         json_message_parser_init(&mon->qmp.parser, handle_qmp_command);
+        qemu_chr_fe_set_echo(chr, true);
+        qemu_chr_add_handlers_full(chr, monitor_qmp_can_read,
+                                   monitor_qmp_read, monitor_qmp_event, mon,
+                                   context);
     } else {
         qemu_chr_add_handlers(chr, monitor_can_read, monitor_read,
                               monitor_event, mon);
@@ -5350,6 +5565,9 @@ QemuOptsList qemu_mon_opts = {
         },{
             .name = "pretty",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "oob",
+            .type = QEMU_OPT_BOOL,
         },
         { /* end of list */ }
     },
@@ -64,8 +64,10 @@
 
 #define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
 #define NBD_REPLY_SIZE          (4 + 4 + 8)
+#define NBD_CHUNK_SIZE          (4 + 2 + 2 + 8 + 4)
 #define NBD_REQUEST_MAGIC       0x25609513
 #define NBD_REPLY_MAGIC         0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
 #define NBD_OPTS_MAGIC          0x49484156454F5054LL
 #define NBD_CLIENT_MAGIC        0x0000420281861253LL
 #define NBD_REP_MAGIC           0x3e889045565a9LL
@@ -82,10 +84,6 @@
 #define NBD_SET_TIMEOUT         _IO(0xab, 9)
 #define NBD_SET_FLAGS           _IO(0xab, 10)
 
-#define NBD_OPT_EXPORT_NAME     (1)
-#define NBD_OPT_ABORT           (2)
-#define NBD_OPT_LIST            (3)
-
 /* NBD errors are based on errno numbers, so there is a 1:1 mapping,
  * but only a limited set of errno values is specified in the protocol.
  * Everything else is squashed to EINVAL.
@@ -120,7 +118,7 @@ static int system_errno_to_nbd_errno(int err)
     }
 }
 
-static int nbd_errno_to_system_errno(int err)
+int nbd_errno_to_system_errno(int err)
 {
     switch (err) {
     case NBD_SUCCESS:
@@ -162,6 +160,12 @@ struct NBDExport {
     QTAILQ_ENTRY(NBDExport) next;
 
     AioContext *ctx;
+
+    /* Dirty bitmap of the device exported as the meta context
+     * @bitmap_context, or NULL.  It is looked up by name for each request,
+     * so that it can be removed while the export exists. */
+    char *bitmap;
+    char *bitmap_context;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -180,6 +184,11 @@ struct NBDClient {
 
     bool can_read;
 
+    /* Negotiated with NBD_OPT_STRUCTURED_REPLY and NBD_OPT_SET_META_CONTEXT */
+    bool structured_reply;
+    bool base_allocation;
+    bool export_bitmap;
+
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
@@ -303,10 +312,14 @@ static ssize_t write_sync(int fd, void *buffer, size_t size)
 
 */
 
-static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
+/* The ids of "base:allocation" and of the exported dirty bitmap */
+#define NBD_META_ID_BASE_ALLOCATION 0
+#define NBD_META_ID_DIRTY_BITMAP    1
+
+static int nbd_send_rep_len(int csock, uint32_t type, uint32_t opt,
+                            uint32_t len)
 {
     uint64_t magic;
-    uint32_t len;
 
     magic = cpu_to_be64(NBD_REP_MAGIC);
     if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -323,7 +336,7 @@ static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
         LOG("write failed (rep type)");
         return -EINVAL;
     }
-    len = cpu_to_be32(0);
+    len = cpu_to_be32(len);
     if (write_sync(csock, &len, sizeof(len)) != sizeof(len)) {
         LOG("write failed (rep data length)");
         return -EINVAL;
@@ -331,6 +344,11 @@ static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
     return 0;
 }
 
+static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
+{
+    return nbd_send_rep_len(csock, type, opt, 0);
+}
+
 static int nbd_send_rep_list(int csock, NBDExport *exp)
 {
     uint64_t magic, name_len;
@@ -424,6 +442,147 @@ fail:
     return rc;
 }
 
+static int nbd_handle_structured_reply(NBDClient *client, uint32_t length)
+{
+    int csock = client->sock;
+
+    if (length) {
+        if (drop_sync(csock, length) != length) {
+            return -EIO;
+        }
+        return nbd_send_rep(csock, NBD_REP_ERR_INVALID,
+                            NBD_OPT_STRUCTURED_REPLY);
+    }
+
+    client->structured_reply = true;
+    return nbd_send_rep(csock, NBD_REP_ACK, NBD_OPT_STRUCTURED_REPLY);
+}
+
+static int nbd_send_rep_meta_context(int csock, uint32_t id, const char *name)
+{
+    uint32_t len = strlen(name);
+
+    if (nbd_send_rep_len(csock, NBD_REP_META_CONTEXT,
+                         NBD_OPT_SET_META_CONTEXT, sizeof(id) + len) < 0) {
+        return -EINVAL;
+    }
+    id = cpu_to_be32(id);
+    if (write_sync(csock, &id, sizeof(id)) != sizeof(id)) {
+        LOG("write failed (context id)");
+        return -EINVAL;
+    }
+    if (write_sync(csock, (char *)name, len) != len) {
+        LOG("write failed (context name)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Take a string of the option data in @buf, @pos and @length, with its
+ * 32-bit length in front.  @str is not NUL-terminated.
+ */
+static bool nbd_opt_get_string(uint8_t *buf, uint32_t *pos, uint32_t length,
+                               const char **str, uint32_t *len)
+{
+    if (length - *pos < sizeof(*len)) {
+        return false;
+    }
+    *len = be32_to_cpup((uint32_t *)(buf + *pos));
+    *pos += sizeof(*len);
+    if (length - *pos < *len) {
+        return false;
+    }
+    *str = (const char *)buf + *pos;
+    *pos += *len;
+    return true;
+}
+
+static int nbd_handle_set_meta_context(NBDClient *client, uint32_t length)
+{
+    int csock = client->sock;
+    uint8_t *buf;
+    const char *str;
+    uint32_t pos = 0, len, queries;
+    NBDExport *exp;
+    char *name;
+    int ret = -EIO;
+
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx .. +3]    number of queries
+        ...           for each query, its length and the query
+     */
+    if (!client->structured_reply || length > 65536) {
+        if (drop_sync(csock, length) != length) {
+            return -EIO;
+        }
+        return nbd_send_rep(csock, NBD_REP_ERR_INVALID,
+                            NBD_OPT_SET_META_CONTEXT);
+    }
+
+    buf = g_malloc(length);
+    if (read_sync(csock, buf, length) != length) {
+        LOG("read failed");
+        goto out;
+    }
+
+    /* A new list of contexts replaces the previous one */
+    client->base_allocation = false;
+    client->export_bitmap = false;
+
+    if (!nbd_opt_get_string(buf, &pos, length, &str, &len) ||
+        length - pos < sizeof(queries)) {
+        ret = nbd_send_rep(csock, NBD_REP_ERR_INVALID,
+                           NBD_OPT_SET_META_CONTEXT);
+        goto out;
+    }
+    name = g_strndup(str, len);
+    exp = nbd_export_find(name);
+    if (!exp) {
+        g_free(name);
+        ret = nbd_send_rep(csock, NBD_REP_ERR_INVALID,
+                           NBD_OPT_SET_META_CONTEXT);
+        goto out;
+    }
+    g_free(name);
+
+    queries = be32_to_cpup((uint32_t *)(buf + pos));
+    pos += sizeof(queries);
+    while (queries--) {
+        if (!nbd_opt_get_string(buf, &pos, length, &str, &len)) {
+            client->base_allocation = false;
+            client->export_bitmap = false;
+            ret = nbd_send_rep(csock, NBD_REP_ERR_INVALID,
+                               NBD_OPT_SET_META_CONTEXT);
+            goto out;
+        }
+        if (len == strlen(NBD_META_BASE_ALLOCATION) &&
+            !memcmp(str, NBD_META_BASE_ALLOCATION, len) &&
+            !client->base_allocation) {
+            client->base_allocation = true;
+            if (nbd_send_rep_meta_context(csock, NBD_META_ID_BASE_ALLOCATION,
+                                          NBD_META_BASE_ALLOCATION) < 0) {
+                goto out;
+            }
+        } else if (exp->bitmap_context &&
+                   len == strlen(exp->bitmap_context) &&
+                   !memcmp(str, exp->bitmap_context, len) &&
+                   !client->export_bitmap) {
+            client->export_bitmap = true;
+            if (nbd_send_rep_meta_context(csock, NBD_META_ID_DIRTY_BITMAP,
+                                          exp->bitmap_context) < 0) {
+                goto out;
+            }
+        }
+    }
+    ret = nbd_send_rep(csock, NBD_REP_ACK, NBD_OPT_SET_META_CONTEXT);
+
+out:
+    g_free(buf);
+    return ret;
+}
+
 static int nbd_receive_options(NBDClient *client)
 {
     int csock = client->sock;
@@ -495,11 +654,36 @@ static int nbd_receive_options(NBDClient *client)
         case NBD_OPT_EXPORT_NAME:
             return nbd_handle_export_name(client, length);
 
+        case NBD_OPT_STRUCTURED_REPLY:
+            ret = nbd_handle_structured_reply(client, length);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+
+        case NBD_OPT_SET_META_CONTEXT:
+            ret = nbd_handle_set_meta_context(client, length);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+
         default:
             tmp = be32_to_cpu(tmp);
             LOG("Unsupported option 0x%x", tmp);
-            nbd_send_rep(client->sock, NBD_REP_ERR_UNSUP, tmp);
-            return -EINVAL;
+            if (flags != NBD_FLAG_C_FIXED_NEWSTYLE) {
+                nbd_send_rep(client->sock, NBD_REP_ERR_UNSUP, tmp);
+                return -EINVAL;
+            }
+            /* With fixed newstyle the client can try something else */
+            if (drop_sync(csock, length) != length) {
+                return -EIO;
+            }
+            ret = nbd_send_rep(client->sock, NBD_REP_ERR_UNSUP, tmp);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
         }
     }
 }
@@ -579,16 +763,165 @@ fail:
     return rc;
 }
 
+static int nbd_send_option(int csock, uint32_t opt, uint32_t len,
+                           const void *data, Error **errp)
+{
+    uint64_t magic = cpu_to_be64(NBD_OPTS_MAGIC);
+    uint32_t tmp;
+
+    if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "Failed to send option magic");
+        return -EINVAL;
+    }
+    tmp = cpu_to_be32(opt);
+    if (write_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
+        error_setg(errp, "Failed to send option number");
+        return -EINVAL;
+    }
+    tmp = cpu_to_be32(len);
+    if (write_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
+        error_setg(errp, "Failed to send option length");
+        return -EINVAL;
+    }
+    if (len && write_sync(csock, (void *)data, len) != len) {
+        error_setg(errp, "Failed to send option data");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int nbd_receive_option_reply(int csock, uint32_t opt, uint32_t *type,
+                                    uint32_t *len, Error **errp)
+{
+    uint64_t magic;
+    uint32_t tmp;
+
+    /* Server sends:
+        [ 0 ..   7]   NBD_REP_MAGIC
+        [ 8 ..  11]   NBD option
+        [12 ..  15]   reply type
+        [16 ..  19]   data length
+        ...           data
+     */
+    if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic) ||
+        read_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp) ||
+        read_sync(csock, type, sizeof(*type)) != sizeof(*type) ||
+        read_sync(csock, len, sizeof(*len)) != sizeof(*len)) {
+        error_setg(errp, "Failed to read option reply");
+        return -EINVAL;
+    }
+    if (be64_to_cpu(magic) != NBD_REP_MAGIC || be32_to_cpu(tmp) != opt) {
+        error_setg(errp, "Bad option reply received");
+        return -EINVAL;
+    }
+    *type = be32_to_cpu(*type);
+    *len = be32_to_cpu(*len);
+    return 0;
+}
+
+/* Ask for structured replies and the "base:allocation" context of @name,
+ * as far as @want says, and record in @neg what the server agreed to.
+ */
+static int nbd_negotiate_options(int csock, const char *name,
+                                 NBDNegotiation *want, NBDNegotiation *neg,
+                                 Error **errp)
+{
+    const char *query = NBD_META_BASE_ALLOCATION;
+    uint32_t type, len, id;
+    char buf[256];
+    uint8_t *data;
+    size_t name_len = strlen(name), query_len = strlen(query), data_len;
+
+    if (!want->structured_reply) {
+        return 0;
+    }
+
+    if (nbd_send_option(csock, NBD_OPT_STRUCTURED_REPLY, 0, NULL, errp) < 0 ||
+        nbd_receive_option_reply(csock, NBD_OPT_STRUCTURED_REPLY, &type,
+                                 &len, errp) < 0) {
+        return -EINVAL;
+    }
+    if (drop_sync(csock, len) != len) {
+        error_setg(errp, "Failed to read option reply data");
+        return -EINVAL;
+    }
+    if (type != NBD_REP_ACK) {
+        TRACE("Server does not support structured replies (0x%x)", type);
+        return 0;
+    }
+    neg->structured_reply = true;
+
+    if (!want->base_allocation) {
+        return 0;
+    }
+
+    /* export name, then a single query */
+    data_len = 4 + name_len + 4 + 4 + query_len;
+    data = g_malloc(data_len);
+    cpu_to_be32w((uint32_t *)data, name_len);
+    memcpy(data + 4, name, name_len);
+    cpu_to_be32w((uint32_t *)(data + 4 + name_len), 1);
+    cpu_to_be32w((uint32_t *)(data + 8 + name_len), query_len);
+    memcpy(data + 12 + name_len, query, query_len);
+    if (nbd_send_option(csock, NBD_OPT_SET_META_CONTEXT, data_len, data,
+                        errp) < 0) {
+        g_free(data);
+        return -EINVAL;
+    }
+    g_free(data);
+
+    for (;;) {
+        if (nbd_receive_option_reply(csock, NBD_OPT_SET_META_CONTEXT, &type,
+                                     &len, errp) < 0) {
+            return -EINVAL;
+        }
+        if (type != NBD_REP_META_CONTEXT) {
+            break;
+        }
+        if (len < sizeof(id) || len - sizeof(id) >= sizeof(buf) ||
+            read_sync(csock, &id, sizeof(id)) != sizeof(id) ||
+            read_sync(csock, buf, len - sizeof(id)) != len - sizeof(id)) {
+            error_setg(errp, "Failed to read meta context");
+            return -EINVAL;
+        }
+        buf[len - sizeof(id)] = '\0';
+        if (!strcmp(buf, query)) {
+            neg->base_allocation = true;
+            neg->context_id = be32_to_cpu(id);
+        }
+    }
+
+    if (drop_sync(csock, len) != len) {
+        error_setg(errp, "Failed to read option reply data");
+        return -EINVAL;
+    }
+    if (type != NBD_REP_ACK) {
+        TRACE("Server does not support meta contexts (0x%x)", type);
+        if (!NBD_REP_IS_ERR(type)) {
+            error_setg(errp, "Bad meta context reply received");
+            return -EINVAL;
+        }
+        neg->base_allocation = false;
+    }
+    return 0;
+}
+
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, Error **errp)
+                          off_t *size, NBDNegotiation *neg, Error **errp)
 {
     char buf[256];
     uint64_t magic, s;
     uint16_t tmp;
+    NBDNegotiation want = { 0 };
     int rc;
 
     TRACE("Receiving negotiation.");
 
+    if (neg) {
+        want = *neg;
+        memset(neg, 0, sizeof(*neg));
+    }
+
     rc = -EINVAL;
 
     if (read_sync(csock, buf, 8) != 8) {
@@ -643,12 +976,19 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             goto fail;
         }
         *flags = be16_to_cpu(tmp) << 16;
-        /* reserved for future use */
+        /* client flags; other options need the fixed newstyle */
+        if (neg && (*flags & (NBD_FLAG_FIXED_NEWSTYLE << 16))) {
+            reserved = cpu_to_be32(NBD_FLAG_C_FIXED_NEWSTYLE);
+        }
         if (write_sync(csock, &reserved, sizeof(reserved)) !=
             sizeof(reserved)) {
             error_setg(errp, "Failed to read reserved field");
             goto fail;
         }
+        if (reserved &&
+            nbd_negotiate_options(csock, name, &want, neg, errp) < 0) {
+            goto fail;
+        }
         /* write the export name */
         magic = cpu_to_be64(magic);
         if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -885,27 +1225,60 @@ static ssize_t nbd_receive_request(int csock, struct nbd_request *request)
 
 ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_CHUNK_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(csock, buf, sizeof(buf));
+    ret = read_sync(csock, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
 
+    magic = be32_to_cpup((uint32_t*)buf);
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* Structured reply chunk
+           [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+           [ 4 ..  5]    flags
+           [ 6 ..  7]    type
+           [ 8 .. 15]    handle
+           [16 .. 19]    length of the payload
+         */
+        do {
+            /* The header is sent as a whole, the rest is on its way */
+            ret = read_sync(csock, buf + NBD_REPLY_SIZE,
+                            NBD_CHUNK_SIZE - NBD_REPLY_SIZE);
+        } while (ret == -EAGAIN);
+        if (ret != NBD_CHUNK_SIZE - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return ret < 0 ? ret : -EINVAL;
+        }
+
+        reply->structured = true;
+        reply->error  = 0;
+        reply->flags  = be16_to_cpup((uint16_t *)(buf + 4));
+        reply->type   = be16_to_cpup((uint16_t *)(buf + 6));
+        reply->handle = be64_to_cpup((uint64_t *)(buf + 8));
+        reply->length = be32_to_cpup((uint32_t *)(buf + 16));
+
+        TRACE("Got reply chunk: "
+              "{ .flags = 0x%x, .type = %d, handle = %" PRIu64
+              ", length = %u }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
      */
 
-    magic = be32_to_cpup((uint32_t*)buf);
+    reply->structured = false;
     reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
     reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
 
@@ -922,11 +1295,8 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
+static void nbd_encode_reply(uint8_t *buf, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
-    ssize_t ret;
-
     reply->error = system_errno_to_nbd_errno(reply->error);
 
     /* Reply
@@ -937,19 +1307,6 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     cpu_to_be32w((uint32_t*)buf, NBD_REPLY_MAGIC);
     cpu_to_be32w((uint32_t*)(buf + 4), reply->error);
     cpu_to_be64w((uint64_t*)(buf + 8), reply->handle);
-
-    TRACE("Sending response to client");
-
-    ret = write_sync(csock, buf, sizeof(buf));
-    if (ret < 0) {
-        return ret;
-    }
-
-    if (ret != sizeof(buf)) {
-        LOG("writing to socket failed");
-        return -EINVAL;
-    }
-    return 0;
 }
 
 #define MAX_NBD_REQUESTS 16
@@ -1088,6 +1445,22 @@ fail:
     return NULL;
 }
 
+/* Export the dirty bitmap @bitmap of the device as the meta context
+ * "qemu:dirty-bitmap:@bitmap" */
+void nbd_export_set_bitmap(NBDExport *exp, const char *bitmap, Error **errp)
+{
+    if (!bdrv_find_dirty_bitmap(blk_bs(exp->blk), bitmap)) {
+        error_setg(errp, "Bitmap '%s' not found", bitmap);
+        return;
+    }
+
+    g_free(exp->bitmap);
+    g_free(exp->bitmap_context);
+    exp->bitmap = g_strdup(bitmap);
+    exp->bitmap_context = g_strdup_printf(NBD_META_QEMU_DIRTY_BITMAP "%s",
+                                          bitmap);
+}
+
 NBDExport *nbd_export_find(const char *name)
 {
     NBDExport *exp;
@@ -1160,6 +1533,8 @@ void nbd_export_put(NBDExport *exp)
             exp->blk = NULL;
         }
 
+        g_free(exp->bitmap);
+        g_free(exp->bitmap_context);
         g_free(exp);
     }
 }
@@ -1178,29 +1553,34 @@ void nbd_export_close_all(void)
     }
 }
 
+/* The reply header and the data go out with a single sendmsg() when the
+ * socket has room, instead of one write each between two setsockopt()
+ * calls to cork the socket.
+ */
 static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
                                  int len)
 {
     NBDClient *client = req->client;
     int csock = client->sock;
-    ssize_t rc, ret;
+    uint8_t buf[NBD_REPLY_SIZE];
+    struct iovec iov[] = {
+        { .iov_base = buf,       .iov_len = sizeof(buf) },
+        { .iov_base = req->data, .iov_len = len },
+    };
+    size_t size = sizeof(buf) + len;
+    ssize_t rc;
+
+    nbd_encode_reply(buf, reply);
+    TRACE("Sending response to client");
 
     qemu_co_mutex_lock(&client->send_lock);
     client->send_coroutine = qemu_coroutine_self();
     nbd_set_handlers(client);
 
-    if (!len) {
-        rc = nbd_send_reply(csock, reply);
-    } else {
-        socket_set_cork(csock, 1);
-        rc = nbd_send_reply(csock, reply);
-        if (rc >= 0) {
-            ret = qemu_co_send(csock, req->data, len);
-            if (ret != len) {
-                rc = -EIO;
-            }
-        }
-        socket_set_cork(csock, 0);
+    rc = 0;
+    if (qemu_co_sendv(csock, iov, len ? 2 : 1, 0, size) != size) {
+        LOG("writing to socket failed");
+        rc = -EIO;
     }
 
     client->send_coroutine = NULL;
@@ -1209,6 +1589,239 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+/* Send a structured reply chunk, with a @payload_len bytes header of its
+ * own type and then @data_len bytes of data.
+ */
+static ssize_t nbd_co_send_chunk(NBDRequest *req, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 void *payload, size_t payload_len,
+                                 void *data, size_t data_len)
+{
+    NBDClient *client = req->client;
+    int csock = client->sock;
+    uint8_t buf[NBD_CHUNK_SIZE];
+    struct iovec iov[] = {
+        { .iov_base = buf,     .iov_len = sizeof(buf) },
+        { .iov_base = payload, .iov_len = payload_len },
+        { .iov_base = data,    .iov_len = data_len },
+    };
+    size_t size = sizeof(buf) + payload_len + data_len;
+    ssize_t rc;
+
+    cpu_to_be32w((uint32_t *)buf, NBD_STRUCTURED_REPLY_MAGIC);
+    cpu_to_be16w((uint16_t *)(buf + 4), flags);
+    cpu_to_be16w((uint16_t *)(buf + 6), type);
+    cpu_to_be64w((uint64_t *)(buf + 8), handle);
+    cpu_to_be32w((uint32_t *)(buf + 16), payload_len + data_len);
+
+    TRACE("Sending reply chunk: { .flags = 0x%x, .type = %d, .length = %zu }",
+          flags, type, payload_len + data_len);
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    rc = 0;
+    if (qemu_co_sendv(csock, iov, data_len ? 3 : 2, 0, size) != size) {
+        LOG("writing to socket failed");
+        rc = -EIO;
+    }
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc;
+}
+
+/* Send the last chunk of a reply that failed with @reply->error */
+static ssize_t nbd_co_send_error_chunk(NBDRequest *req,
+                                       struct nbd_reply *reply)
+{
+    uint8_t payload[4 + 2];
+
+    /* error, then the length of a message that we do not send */
+    cpu_to_be32w((uint32_t *)payload, system_errno_to_nbd_errno(reply->error));
+    cpu_to_be16w((uint16_t *)(payload + 4), 0);
+    return nbd_co_send_chunk(req, reply->handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, payload, sizeof(payload),
+                             NULL, 0);
+}
+
+/* Send the result of a read as chunks, describing the extents that read
+ * as zeroes instead of sending them.  I/O errors go to @reply->error; a
+ * negative return value means that the client could not be told.
+ */
+static ssize_t nbd_co_send_sparse_read(NBDRequest *req,
+                                       struct nbd_request *request,
+                                       struct nbd_reply *reply)
+{
+    NBDExport *exp = req->client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    int64_t sector_num = (request->from + exp->dev_offset) / BDRV_SECTOR_SIZE;
+    int nb_sectors = request->len / BDRV_SECTOR_SIZE;
+    uint32_t offset = 0, len;
+    uint8_t payload[8 + 4];
+    uint16_t flags;
+    int64_t status;
+    int pnum;
+    ssize_t ret;
+
+    while (nb_sectors > 0) {
+        status = bdrv_get_block_status_above(bs, NULL, sector_num, nb_sectors,
+                                             &pnum);
+        if (status < 0) {
+            reply->error = -status;
+            return 0;
+        }
+        if (pnum <= 0) {
+            pnum = nb_sectors;
+            status = BDRV_BLOCK_DATA;
+        }
+
+        len = pnum * BDRV_SECTOR_SIZE;
+        flags = pnum == nb_sectors ? NBD_REPLY_FLAG_DONE : 0;
+        cpu_to_be64w((uint64_t *)payload, request->from + offset);
+        if (status & BDRV_BLOCK_ZERO) {
+            cpu_to_be32w((uint32_t *)(payload + 8), len);
+            ret = nbd_co_send_chunk(req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_HOLE,
+                                    payload, 8 + 4, NULL, 0);
+        } else {
+            ret = blk_read(exp->blk, sector_num, req->data + offset, pnum);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                reply->error = -ret;
+                return 0;
+            }
+            ret = nbd_co_send_chunk(req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_DATA,
+                                    payload, 8, req->data + offset, len);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += pnum;
+        nb_sectors -= pnum;
+        offset += len;
+    }
+    return 0;
+}
+
+/* Answer NBD_CMD_BLOCK_STATUS for "base:allocation", with at most
+ * NBD_MAX_EXTENTS extents.  Errors are handled like for
+ * nbd_co_send_sparse_read().  @last is false if another context's chunk
+ * follows.
+ */
+static ssize_t nbd_co_send_block_status(NBDRequest *req,
+                                        struct nbd_request *request,
+                                        struct nbd_reply *reply, bool last)
+{
+    NBDExport *exp = req->client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    int64_t sector_num = (request->from + exp->dev_offset) / BDRV_SECTOR_SIZE;
+    int nb_sectors = request->len / BDRV_SECTOR_SIZE;
+    uint32_t *payload, *extent, flags;
+    int64_t status;
+    int pnum, n = 0;
+    ssize_t ret;
+
+    /* context id, then length and flags of each extent */
+    payload = g_new(uint32_t, 1 + 2 * NBD_MAX_EXTENTS);
+    payload[0] = cpu_to_be32(NBD_META_ID_BASE_ALLOCATION);
+    extent = payload + 1;
+
+    while (nb_sectors > 0) {
+        status = bdrv_get_block_status_above(bs, NULL, sector_num, nb_sectors,
+                                             &pnum);
+        if (status < 0) {
+            reply->error = -status;
+            g_free(payload);
+            return 0;
+        }
+        if (pnum <= 0) {
+            pnum = nb_sectors;
+            status = BDRV_BLOCK_DATA;
+        }
+
+        flags = (status & BDRV_BLOCK_DATA ? 0 : NBD_STATE_HOLE) |
+                (status & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+        if (n && extent[-1] == cpu_to_be32(flags)) {
+            /* the same as the previous extent, just longer */
+            extent[-2] = cpu_to_be32(be32_to_cpu(extent[-2]) +
+                                     pnum * BDRV_SECTOR_SIZE);
+        } else if (n == NBD_MAX_EXTENTS) {
+            break;
+        } else {
+            extent[0] = cpu_to_be32(pnum * BDRV_SECTOR_SIZE);
+            extent[1] = cpu_to_be32(flags);
+            extent += 2;
+            n++;
+        }
+
+        sector_num += pnum;
+        nb_sectors -= pnum;
+    }
+
+    ret = nbd_co_send_chunk(req, request->handle,
+                            last ? NBD_REPLY_FLAG_DONE : 0,
+                            NBD_REPLY_TYPE_BLOCK_STATUS, payload,
+                            (1 + 2 * n) * sizeof(uint32_t), NULL, 0);
+    g_free(payload);
+    return ret;
+}
+
+/* Answer NBD_CMD_BLOCK_STATUS for the exported dirty bitmap; dirty and
+ * clean extents alternate, in units of the bitmap's granularity.
+ */
+static ssize_t nbd_co_send_dirty_status(NBDRequest *req,
+                                        struct nbd_request *request,
+                                        struct nbd_reply *reply)
+{
+    NBDExport *exp = req->client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    int64_t sector_num = (request->from + exp->dev_offset) / BDRV_SECTOR_SIZE;
+    int64_t end = sector_num + request->len / BDRV_SECTOR_SIZE;
+    BdrvDirtyBitmap *bitmap;
+    int64_t granularity, next;
+    uint32_t *payload, *extent;
+    bool dirty;
+    int n = 0;
+    ssize_t ret;
+
+    bitmap = bdrv_find_dirty_bitmap(bs, exp->bitmap);
+    if (!bitmap) {
+        reply->error = EINVAL;
+        return 0;
+    }
+    granularity = bdrv_dirty_bitmap_granularity(bitmap) >> BDRV_SECTOR_BITS;
+
+    payload = g_new(uint32_t, 1 + 2 * NBD_MAX_EXTENTS);
+    payload[0] = cpu_to_be32(NBD_META_ID_DIRTY_BITMAP);
+    extent = payload + 1;
+
+    while (sector_num < end && n < NBD_MAX_EXTENTS) {
+        dirty = bdrv_get_dirty(bs, bitmap, sector_num);
+        next = QEMU_ALIGN_DOWN(sector_num, granularity) + granularity;
+        while (next < end && bdrv_get_dirty(bs, bitmap, next) == dirty) {
+            next += granularity;
+        }
+        next = MIN(next, end);
+
+        extent[0] = cpu_to_be32((next - sector_num) * BDRV_SECTOR_SIZE);
+        extent[1] = cpu_to_be32(dirty ? NBD_STATE_DIRTY : 0);
+        extent += 2;
+        n++;
+        sector_num = next;
+    }
+
+    ret = nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                            NBD_REPLY_TYPE_BLOCK_STATUS, payload,
+                            (1 + 2 * n) * sizeof(uint32_t), NULL, 0);
+    g_free(payload);
+    return ret;
+}
+
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
     NBDClient *client = req->client;
@@ -1227,7 +1840,9 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
         goto out;
     }
 
-    if (request->len > NBD_MAX_BUFFER_SIZE) {
+    command = request->type & NBD_CMD_MASK_COMMAND;
+    if (command != NBD_CMD_BLOCK_STATUS &&
+        request->len > NBD_MAX_BUFFER_SIZE) {
         LOG("len (%u) is larger than max len (%u)",
             request->len, NBD_MAX_BUFFER_SIZE);
         rc = -EINVAL;
@@ -1243,7 +1858,6 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
     TRACE("Decoding type");
 
-    command = request->type & NBD_CMD_MASK_COMMAND;
     if (command == NBD_CMD_READ || command == NBD_CMD_WRITE) {
         req->data = blk_blockalign(client->exp->blk, request->len);
     }
@@ -1274,6 +1888,7 @@ static void nbd_trip(void *opaque)
     struct nbd_reply reply;
     ssize_t ret;
     uint32_t command;
+    bool send_bitmap;
 
     TRACE("Reading request.");
     if (client->closing) {
@@ -1292,11 +1907,11 @@ static void nbd_trip(void *opaque)
     reply.handle = request.handle;
     reply.error = 0;
 
+    command = request.type & NBD_CMD_MASK_COMMAND;
     if (ret < 0) {
         reply.error = -ret;
         goto error_reply;
     }
-    command = request.type & NBD_CMD_MASK_COMMAND;
     if (command != NBD_CMD_DISC && (request.from + request.len) > exp->size) {
             LOG("From: %" PRIu64 ", Len: %u, Size: %" PRIu64
             ", Offset: %" PRIu64 "\n",
@@ -1327,6 +1942,16 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_send_sparse_read(req, &request, &reply) < 0) {
+                goto out;
+            }
+            if (reply.error) {
+                goto error_reply;
+            }
+            break;
+        }
+
         ret = blk_read(exp->blk,
                        (request.from + exp->dev_offset) / BDRV_SECTOR_SIZE,
                        req->data, request.len / BDRV_SECTOR_SIZE);
@@ -1402,11 +2027,44 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+        send_bitmap = client->export_bitmap && exp->bitmap;
+        if ((!client->base_allocation && !send_bitmap) || !request.len) {
+            goto invalid_request;
+        }
+        /* One chunk for each selected context */
+        if (client->base_allocation) {
+            if (nbd_co_send_block_status(req, &request, &reply,
+                                         !send_bitmap) < 0) {
+                goto out;
+            }
+            if (reply.error) {
+                goto error_reply;
+            }
+        }
+        if (send_bitmap) {
+            if (nbd_co_send_dirty_status(req, &request, &reply) < 0) {
+                goto out;
+            }
+            if (reply.error) {
+                goto error_reply;
+            }
+        }
+        break;
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
         reply.error = EINVAL;
     error_reply:
+        /* These two only have structured replies, once negotiated */
+        if (client->structured_reply &&
+            (command == NBD_CMD_READ || command == NBD_CMD_BLOCK_STATUS)) {
+            if (nbd_co_send_error_chunk(req, &reply) < 0) {
+                goto out;
+            }
+            break;
+        }
         if (nbd_co_send_reply(req, &reply, 0) < 0) {
             goto out;
         }
@@ -21,19 +21,109 @@
 #define PROTO_TCP  6
 #define PROTO_UDP 17
 
-uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+/* Adds @w to the 64-bit ones' complement sum @sum */
+static inline uint64_t net_checksum_add64(uint64_t sum, uint64_t w)
 {
-    uint32_t sum = 0;
-    int i;
+    sum += w;
+    return sum + (sum < w);
+}
+
+/*
+ * Folds a 64-bit ones' complement sum of host-endian words into the 16-bit
+ * sum of the big-endian words.  The ones' complement sum does not depend on
+ * the word size, and is only byte swapped by the host byte order.
+ */
+static inline uint32_t net_checksum_fold64(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+#ifndef HOST_WORDS_BIGENDIAN
+    sum = bswap16(sum);
+#endif
+    return sum;
+}
 
-    for (i = seq; i < seq + len; i++) {
-        if (i & 1) {
-            sum += (uint32_t)buf[i - seq];
-        } else {
-            sum += (uint32_t)buf[i - seq] << 8;
+#ifdef __SSE2__
+/*
+ * Sums 32 bytes per iteration, widening the 16-bit words into 32-bit lanes.
+ * A lane grows by at most 4 * 0xffff per iteration, so a batch of 8192
+ * iterations cannot overflow it.
+ */
+static int net_checksum_add_sse2(uint64_t *psum, const uint8_t *buf, int len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t sum = *psum;
+    int done = 0;
+
+    while (len - done >= 32) {
+        __m128i acc = zero;
+        uint32_t lanes[4];
+        int n = MIN((len - done) / 32, 8192);
+
+        for (; n; n--, done += 32) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(buf + done));
+            __m128i b = _mm_loadu_si128((const __m128i *)(buf + done + 16));
+
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(a, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(a, zero));
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(b, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(b, zero));
         }
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
     }
-    return sum;
+
+    *psum = sum;
+    return done;
+}
+#endif
+
+uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+{
+    uint64_t sum = 0;
+    uint64_t tail = 0;
+    uint32_t res;
+
+#ifdef __SSE2__
+    if (len >= 64) {
+        int done = net_checksum_add_sse2(&sum, buf, len);
+
+        buf += done;
+        len -= done;
+    }
+#endif
+    for (; len >= 8; buf += 8, len -= 8) {
+        sum = net_checksum_add64(sum, ldq_he_p(buf));
+    }
+    /* the padding is zero, like the missing low byte of an odd length */
+    memcpy(&tail, buf, len);
+    sum = net_checksum_add64(sum, tail);
+
+    res = net_checksum_fold64(sum);
+    /* an odd starting offset puts each byte in the other half of a word */
+    return seq & 1 ? bswap16(res) : res;
+}
+
+uint32_t net_checksum_add_copy(void *dest, const void *src, int len)
+{
+    const uint8_t *s = src;
+    uint8_t *d = dest;
+    uint64_t sum = 0;
+    uint64_t tail = 0;
+
+    for (; len >= 8; s += 8, d += 8, len -= 8) {
+        uint64_t w = ldq_he_p(s);
+
+        stq_he_p(d, w);
+        sum = net_checksum_add64(sum, w);
+    }
+    memcpy(&tail, s, len);
+    memcpy(d, &tail, len);
+    sum = net_checksum_add64(sum, tail);
+
+    return net_checksum_fold64(sum);
 }
 
 uint16_t net_checksum_finish(uint32_t sum)
@@ -113,3 +203,21 @@ net_checksum_add_iov(const struct iovec *iov, const unsigned int iov_cnt,
     }
     return res;
 }
+
+uint32_t net_toeplitz_hash(const uint8_t *key, const uint8_t *input, int len)
+{
+    /* the 32 key bits that line up with the current input bit */
+    uint32_t window = ldl_be_p(key);
+    uint32_t hash = 0;
+    int i, bit;
+
+    for (i = 0; i < len; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            if (input[i] & (1 << bit)) {
+                hash ^= window;
+            }
+            window = (window << 1) | ((key[i + 4] >> bit) & 1);
+        }
+    }
+    return hash;
+}
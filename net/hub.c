@@ -22,8 +22,16 @@
  * A hub broadcasts incoming packets to all its ports except the source port.
  * Hubs can be used to provide independent network segments, also confusingly
  * named the QEMU 'vlan' feature.
+ *
+ * The hub also remembers on which port each source MAC address was last
+ * seen.  Ports created with mac-learning=on only get the unicast frames
+ * whose destination was learned on them, or is not known yet; the other
+ * ports still see all the traffic, e.g. for -net dump.
  */
 
+/* Number of entries of the MAC table, a power of two */
+#define NET_HUB_MAC_TABLE_SIZE 256
+
 typedef struct NetHub NetHub;
 
 typedef struct NetHubPort {
@@ -31,24 +39,76 @@ typedef struct NetHubPort {
     QLIST_ENTRY(NetHubPort) next;
     NetHub *hub;
     int id;
+    bool mac_learning;
 } NetHubPort;
 
+typedef struct NetHubMacEntry {
+    uint8_t mac[6];
+    NetHubPort *port;
+} NetHubMacEntry;
+
 struct NetHub {
     int id;
     QLIST_ENTRY(NetHub) next;
     int num_ports;
     QLIST_HEAD(, NetHubPort) ports;
+    NetHubMacEntry mac_table[NET_HUB_MAC_TABLE_SIZE];
 };
 
 static QLIST_HEAD(, NetHub) hubs = QLIST_HEAD_INITIALIZER(&hubs);
 
+static NetHubMacEntry *net_hub_mac_entry(NetHub *hub, const uint8_t *mac)
+{
+    /* the low bytes of a MAC address vary the most */
+    unsigned h = mac[5] ^ (mac[4] << 3) ^ (mac[3] << 5) ^ mac[2] ^ mac[1];
+
+    return &hub->mac_table[h & (NET_HUB_MAC_TABLE_SIZE - 1)];
+}
+
+/*
+ * Learns the source address of an Ethernet frame entering the hub at
+ * @source_port, and returns the port that its destination address was
+ * learned on, or NULL for multicast and unknown destinations.
+ */
+static NetHubPort *net_hub_learn(NetHub *hub, NetHubPort *source_port,
+                                 const uint8_t *hdr, size_t len)
+{
+    const uint8_t *dst = hdr, *src = hdr + 6;
+    NetHubMacEntry *e;
+
+    if (len < 12) {
+        return NULL;
+    }
+
+    if (!(src[0] & 1)) {
+        e = net_hub_mac_entry(hub, src);
+        memcpy(e->mac, src, sizeof(e->mac));
+        e->port = source_port;
+    }
+
+    if (dst[0] & 1) {
+        return NULL;
+    }
+    e = net_hub_mac_entry(hub, dst);
+    if (e->port && !memcmp(e->mac, dst, sizeof(e->mac))) {
+        return e->port;
+    }
+    return NULL;
+}
+
+static bool net_hub_port_filtered(NetHubPort *port, NetHubPort *dest_port)
+{
+    return port->mac_learning && dest_port && dest_port != port;
+}
+
 static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
                                const uint8_t *buf, size_t len)
 {
     NetHubPort *port;
+    NetHubPort *dest_port = net_hub_learn(hub, source_port, buf, len);
 
     QLIST_FOREACH(port, &hub->ports, next) {
-        if (port == source_port) {
+        if (port == source_port || net_hub_port_filtered(port, dest_port)) {
             continue;
         }
 
@@ -60,11 +120,16 @@ static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
 static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
                                    const struct iovec *iov, int iovcnt)
 {
-    NetHubPort *port;
+    NetHubPort *port, *dest_port;
     ssize_t len = iov_size(iov, iovcnt);
+    uint8_t hdr[12];
+    size_t hdr_len;
+
+    hdr_len = iov_to_buf(iov, iovcnt, 0, hdr, sizeof(hdr));
+    dest_port = net_hub_learn(hub, source_port, hdr, hdr_len);
 
     QLIST_FOREACH(port, &hub->ports, next) {
-        if (port == source_port) {
+        if (port == source_port || net_hub_port_filtered(port, dest_port)) {
             continue;
         }
 
@@ -77,7 +142,7 @@ static NetHub *net_hub_new(int id)
 {
     NetHub *hub;
 
-    hub = g_malloc(sizeof(*hub));
+    hub = g_malloc0(sizeof(*hub));
     hub->id = id;
     hub->num_ports = 0;
     QLIST_INIT(&hub->ports);
@@ -125,7 +190,13 @@ static ssize_t net_hub_port_receive_iov(NetClientState *nc,
 static void net_hub_port_cleanup(NetClientState *nc)
 {
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
+    int i;
 
+    for (i = 0; i < NET_HUB_MAC_TABLE_SIZE; i++) {
+        if (port->hub->mac_table[i].port == port) {
+            port->hub->mac_table[i].port = NULL;
+        }
+    }
     QLIST_REMOVE(port, next);
 }
 
@@ -284,12 +355,16 @@ int net_init_hubport(const NetClientOptions *opts, const char *name,
                      NetClientState *peer, Error **errp)
 {
     const NetdevHubPortOptions *hubport;
+    NetClientState *nc;
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_HUBPORT);
     assert(!peer);
     hubport = opts->hubport;
 
-    net_hub_add_port(hubport->hubid, name);
+    nc = net_hub_add_port(hubport->hubid, name);
+    if (hubport->has_mac_learning) {
+        DO_UPCAST(NetHubPort, nc, nc)->mac_learning = hubport->mac_learning;
+    }
     return 0;
 }
 
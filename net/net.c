@@ -515,6 +515,21 @@ void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
     nc->info->set_vnet_hdr_len(nc, len);
 }
 
+/*
+ * Asks @nc to only pass on frames for the @count addresses at @macs, plus
+ * all multicast frames if @allmulti; @count == 0 turns the filter off.
+ * The filter may be inexact: it only spares the receiver unwanted frames.
+ */
+int qemu_set_rx_filter(NetClientState *nc, const uint8_t *macs, int count,
+                       bool allmulti)
+{
+    if (!nc || !nc->info->set_rx_filter) {
+        return -ENOSYS;
+    }
+
+    return nc->info->set_rx_filter(nc, macs, count, allmulti);
+}
+
 int qemu_set_vnet_le(NetClientState *nc, bool is_le)
 {
 #ifdef HOST_WORDS_BIGENDIAN
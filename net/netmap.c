@@ -58,6 +58,8 @@ typedef struct NetmapState {
     bool                write_poll;
     struct iovec        iov[IOV_MAX];
     int                 vnet_hdr_len;  /* Current virtio-net header length. */
+    unsigned int        tx_pending;    /* TX slots filled but not synced. */
+    QEMUBH              *tx_bh;
 } NetmapState;
 
 #ifndef __FreeBSD__
@@ -186,6 +188,57 @@ static void netmap_writable(void *opaque)
     qemu_flush_queued_packets(&s->nc);
 }
 
+/*
+ * Hand the TX slots filled so far over to the kernel, and reclaim
+ * the ones that have been transmitted.
+ */
+static void netmap_tx_sync(NetmapState *s)
+{
+    s->tx_pending = 0;
+    ioctl(s->me.fd, NIOCTXSYNC, NULL);
+}
+
+static void netmap_tx_bh(void *opaque)
+{
+    NetmapState *s = opaque;
+
+    if (s->tx_pending) {
+        netmap_tx_sync(s);
+    }
+}
+
+/*
+ * Account for @slots newly filled TX slots. The NIOCTXSYNC is deferred to a
+ * bottom half, so that a burst of packets from the peer costs one system
+ * call; with half of the ring pending, sync right away to keep the port busy.
+ */
+static void netmap_tx_commit(NetmapState *s, unsigned int slots)
+{
+    s->tx_pending += slots;
+    if (s->tx_pending >= s->me.tx->num_slots / 2) {
+        qemu_bh_cancel(s->tx_bh);
+        netmap_tx_sync(s);
+    } else {
+        qemu_bh_schedule(s->tx_bh);
+    }
+}
+
+/*
+ * Check that there are @slots free TX slots, syncing first to reclaim
+ * the ones already transmitted if needed.
+ */
+static bool netmap_tx_space(NetmapState *s, unsigned int slots)
+{
+    struct netmap_ring *ring = s->me.tx;
+
+    if (nm_ring_space(ring) >= slots) {
+        return true;
+    }
+    qemu_bh_cancel(s->tx_bh);
+    netmap_tx_sync(s);
+    return nm_ring_space(ring) >= slots;
+}
+
 static ssize_t netmap_receive(NetClientState *nc,
       const uint8_t *buf, size_t size)
 {
@@ -206,7 +259,7 @@ static ssize_t netmap_receive(NetClientState *nc,
         return size;
     }
 
-    if (nm_ring_empty(ring)) {
+    if (!netmap_tx_space(s, 1)) {
         /* No available slots in the netmap TX ring. */
         netmap_write_poll(s, true);
         return 0;
@@ -220,7 +273,7 @@ static ssize_t netmap_receive(NetClientState *nc,
     ring->slot[i].flags = 0;
     pkt_copy(buf, dst, size);
     ring->cur = ring->head = nm_ring_next(ring, i);
-    ioctl(s->me.fd, NIOCTXSYNC, NULL);
+    netmap_tx_commit(s, 1);
 
     return size;
 }
@@ -235,20 +288,20 @@ static ssize_t netmap_receive_iov(NetClientState *nc,
     uint8_t *dst;
     int j;
     uint32_t i;
+    unsigned int slots = 0;
 
     if (unlikely(!ring)) {
         /* Drop the packet. */
         return iov_size(iov, iovcnt);
     }
 
-    last = i = ring->cur;
-
-    if (nm_ring_space(ring) < iovcnt) {
+    if (!netmap_tx_space(s, iovcnt)) {
         /* Not enough netmap slots. */
         netmap_write_poll(s, true);
         return 0;
     }
 
+    last = i = ring->cur;
     for (j = 0; j < iovcnt; j++) {
         int iov_frag_size = iov[j].iov_len;
         int offset = 0;
@@ -259,7 +312,7 @@ static ssize_t netmap_receive_iov(NetClientState *nc,
         while (iov_frag_size) {
             nm_frag_size = MIN(iov_frag_size, ring->nr_buf_size);
 
-            if (unlikely(nm_ring_empty(ring))) {
+            if (unlikely(i == ring->tail)) {
                 /* We run out of netmap slots while splitting the
                    iovec fragments. */
                 netmap_write_poll(s, true);
@@ -275,6 +328,7 @@ static ssize_t netmap_receive_iov(NetClientState *nc,
 
             last = i;
             i = nm_ring_next(ring, i);
+            slots++;
 
             offset += nm_frag_size;
             iov_frag_size -= nm_frag_size;
@@ -285,8 +339,7 @@ static ssize_t netmap_receive_iov(NetClientState *nc,
 
     /* Now update ring->cur and ring->head. */
     ring->cur = ring->head = i;
-
-    ioctl(s->me.fd, NIOCTXSYNC, NULL);
+    netmap_tx_commit(s, slots);
 
     return iov_size(iov, iovcnt);
 }
@@ -322,7 +375,7 @@ static void netmap_send(void *opaque)
             s->iov[iovcnt].iov_len = ring->slot[i].len;
             iovcnt++;
 
-            ring->cur = ring->head = nm_ring_next(ring, i);
+            ring->cur = nm_ring_next(ring, i);
         } while (!nm_ring_empty(ring) && morefrag);
 
         if (unlikely(nm_ring_empty(ring) && morefrag)) {
@@ -341,6 +394,10 @@ static void netmap_send(void *opaque)
             break;
         }
     }
+
+    /* Release all the slots consumed in this round at once; the peer has
+     * either copied the packets or queued a copy of them by now. */
+    ring->head = ring->cur;
 }
 
 /* Flush and close. */
@@ -350,6 +407,11 @@ static void netmap_cleanup(NetClientState *nc)
 
     qemu_purge_queued_packets(nc);
 
+    qemu_bh_delete(s->tx_bh);
+    if (s->tx_pending) {
+        netmap_tx_sync(s);
+    }
+
     netmap_poll(nc, false);
     munmap(s->me.mem, s->me.memsize);
     close(s->me.fd);
@@ -456,6 +518,8 @@ int net_init_netmap(const NetClientOptions *opts,
     s = DO_UPCAST(NetmapState, nc, nc);
     s->me = me;
     s->vnet_hdr_len = 0;
+    s->tx_pending = 0;
+    s->tx_bh = qemu_bh_new(netmap_tx_bh, s);
     netmap_read_poll(s, true); /* Initially only poll for reads. */
 
     return 0;
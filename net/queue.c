@@ -39,6 +39,12 @@
  * unbounded queueing.
  */
 
+/* Packets up to this size are recycled rather than freed; that covers the
+ * usual MTU with a vnet header in front.  Larger ones come from g_malloc.
+ */
+#define NET_PACKET_CACHED_SIZE  2048
+#define NET_QUEUE_CACHE_MAX     256
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
@@ -55,6 +61,10 @@ struct NetQueue {
 
     QTAILQ_HEAD(packets, NetPacket) packets;
 
+    /* buffers of NET_PACKET_CACHED_SIZE bytes, ready for reuse */
+    QTAILQ_HEAD(, NetPacket) free_packets;
+    uint32_t nq_free_count;
+
     unsigned delivering : 1;
 };
 
@@ -69,6 +79,8 @@ NetQueue *qemu_new_net_queue(void *opaque)
     queue->nq_count = 0;
 
     QTAILQ_INIT(&queue->packets);
+    QTAILQ_INIT(&queue->free_packets);
+    queue->nq_free_count = 0;
 
     queue->delivering = 0;
 
@@ -84,9 +96,45 @@ void qemu_del_net_queue(NetQueue *queue)
         g_free(packet);
     }
 
+    QTAILQ_FOREACH_SAFE(packet, &queue->free_packets, entry, next) {
+        QTAILQ_REMOVE(&queue->free_packets, packet, entry);
+        g_free(packet);
+    }
+
     g_free(queue);
 }
 
+static NetPacket *qemu_net_queue_alloc_packet(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+
+    if (size > NET_PACKET_CACHED_SIZE) {
+        return g_malloc(sizeof(NetPacket) + size);
+    }
+
+    packet = QTAILQ_FIRST(&queue->free_packets);
+    if (packet) {
+        QTAILQ_REMOVE(&queue->free_packets, packet, entry);
+        queue->nq_free_count--;
+        return packet;
+    }
+
+    return g_malloc(sizeof(NetPacket) + NET_PACKET_CACHED_SIZE);
+}
+
+static void qemu_net_queue_free_packet(NetQueue *queue, NetPacket *packet)
+{
+    /* packet->size tells which kind of buffer the packet was put in */
+    if (packet->size > NET_PACKET_CACHED_SIZE ||
+        queue->nq_free_count >= NET_QUEUE_CACHE_MAX) {
+        g_free(packet);
+        return;
+    }
+
+    queue->nq_free_count++;
+    QTAILQ_INSERT_HEAD(&queue->free_packets, packet, entry);
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -99,7 +147,7 @@ static void qemu_net_queue_append(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = qemu_net_queue_alloc_packet(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
@@ -128,7 +176,7 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_queue_alloc_packet(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -236,7 +284,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            qemu_net_queue_free_packet(queue, packet);
         }
     }
 }
@@ -266,7 +314,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_queue_free_packet(queue, packet);
     }
     return true;
 }
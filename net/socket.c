@@ -33,6 +33,19 @@
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 
+#ifdef CONFIG_SENDMMSG
+/* Number of datagrams moved by one recvmmsg()/sendmmsg() call */
+#define NET_SOCKET_MSGCNT 32
+
+typedef struct NetSocketBatch {
+    struct mmsghdr msgvec[NET_SOCKET_MSGCNT];
+    struct iovec iov[NET_SOCKET_MSGCNT];
+    uint8_t (*bufs)[NET_BUFSIZE];
+    unsigned int head;            /* first message not handled yet */
+    unsigned int count;           /* number of messages in the batch */
+} NetSocketBatch;
+#endif
+
 typedef struct NetSocketState {
     NetClientState nc;
     int listen_fd;
@@ -46,10 +59,16 @@ typedef struct NetSocketState {
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+#ifdef CONFIG_SENDMMSG
+    NetSocketBatch *rx;           /* received datagrams (only SOCK_DGRAM) */
+    NetSocketBatch *tx;           /* datagrams to send (only SOCK_DGRAM) */
+    QEMUBH *tx_bh;
+#endif
 } NetSocketState;
 
 static void net_socket_accept(void *opaque);
 static void net_socket_writable(void *opaque);
+static void net_socket_send_completed(NetClientState *nc, ssize_t len);
 
 static void net_socket_update_fd_handler(NetSocketState *s)
 {
@@ -71,12 +90,84 @@ static void net_socket_write_poll(NetSocketState *s, bool enable)
     net_socket_update_fd_handler(s);
 }
 
+#ifdef CONFIG_SENDMMSG
+static NetSocketBatch *net_socket_batch_new(struct sockaddr_in *dst)
+{
+    NetSocketBatch *b = g_new0(NetSocketBatch, 1);
+    int i;
+
+    b->bufs = g_malloc(NET_SOCKET_MSGCNT * sizeof(*b->bufs));
+    for (i = 0; i < NET_SOCKET_MSGCNT; i++) {
+        b->iov[i].iov_base = b->bufs[i];
+        b->iov[i].iov_len = sizeof(b->bufs[i]);
+        b->msgvec[i].msg_hdr.msg_iov = &b->iov[i];
+        b->msgvec[i].msg_hdr.msg_iovlen = 1;
+        if (dst) {
+            b->msgvec[i].msg_hdr.msg_name = dst;
+            b->msgvec[i].msg_hdr.msg_namelen = sizeof(*dst);
+        }
+    }
+    return b;
+}
+
+static void net_socket_batch_free(NetSocketBatch *b)
+{
+    if (b) {
+        g_free(b->bufs);
+        g_free(b);
+    }
+}
+
+/* Sends the datagrams of the tx batch; returns false if the socket is full */
+static bool net_socket_tx_send(NetSocketState *s)
+{
+    NetSocketBatch *tx = s->tx;
+    int ret;
+
+    while (tx->head < tx->count) {
+        do {
+            ret = sendmmsg(s->fd, tx->msgvec + tx->head, tx->count - tx->head,
+                           MSG_DONTWAIT);
+        } while (ret == -1 && errno == EINTR);
+
+        if (ret == -1 && errno == EAGAIN) {
+            net_socket_write_poll(s, true);
+            return false;
+        }
+        if (ret <= 0) {
+            /* sendmmsg() failed on the first message; drop it, just like
+             * a sendto() error drops the packet */
+            ret = 1;
+        }
+        tx->head += ret;
+    }
+    tx->head = tx->count = 0;
+    return true;
+}
+
+static void net_socket_tx_flush(void *opaque)
+{
+    NetSocketState *s = opaque;
+
+    if (net_socket_tx_send(s)) {
+        /* pick up the packets that were refused while the batch was full */
+        qemu_flush_queued_packets(&s->nc);
+    }
+}
+#endif
+
 static void net_socket_writable(void *opaque)
 {
     NetSocketState *s = opaque;
 
     net_socket_write_poll(s, false);
 
+#ifdef CONFIG_SENDMMSG
+    if (s->tx) {
+        net_socket_tx_flush(s);
+        return;
+    }
+#endif
     qemu_flush_queued_packets(&s->nc);
 }
 
@@ -120,6 +211,24 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
     ssize_t ret;
 
+#ifdef CONFIG_SENDMMSG
+    /* Collect the packets that the peer hands over in one go, and send them
+     * with a single sendmmsg() from a bottom half */
+    if (size <= sizeof(s->tx->bufs[0])) {
+        NetSocketBatch *tx = s->tx;
+        unsigned int i;
+
+        if (tx->count == NET_SOCKET_MSGCNT && !net_socket_tx_send(s)) {
+            return 0;
+        }
+        i = tx->count++;
+        memcpy(tx->bufs[i], buf, size);
+        tx->iov[i].iov_len = size;
+        qemu_bh_schedule(s->tx_bh);
+        return size;
+    }
+#endif
+
     do {
         ret = qemu_sendto(s->fd, buf, size, 0,
                           (struct sockaddr *)&s->dgram_dst,
@@ -133,10 +242,38 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
     return ret;
 }
 
+#ifdef CONFIG_SENDMMSG
+/* Hands the received datagrams to the peer; returns false if the peer
+ * cannot take more and the rest must wait for net_socket_send_completed() */
+static bool net_socket_rx_flush(NetSocketState *s)
+{
+    NetSocketBatch *rx = s->rx;
+
+    while (rx->head < rx->count) {
+        unsigned int i = rx->head++;
+        unsigned int size = rx->msgvec[i].msg_len;
+
+        if (size == 0) {
+            continue;
+        }
+        if (qemu_send_packet_async(&s->nc, rx->bufs[i], size,
+                                   net_socket_send_completed) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
 static void net_socket_send_completed(NetClientState *nc, ssize_t len)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
 
+#ifdef CONFIG_SENDMMSG
+    if (s->rx && !net_socket_rx_flush(s)) {
+        return;
+    }
+#endif
     if (!s->read_poll) {
         net_socket_read_poll(s, true);
     }
@@ -224,6 +361,31 @@ static void net_socket_send(void *opaque)
     }
 }
 
+#ifdef CONFIG_SENDMMSG
+static void net_socket_send_dgram(void *opaque)
+{
+    NetSocketState *s = opaque;
+    NetSocketBatch *rx = s->rx;
+    int count;
+
+    /* read polling is off until the previous batch is delivered */
+    assert(rx->head == rx->count);
+
+    do {
+        count = recvmmsg(s->fd, rx->msgvec, NET_SOCKET_MSGCNT, MSG_DONTWAIT,
+                         NULL);
+    } while (count == -1 && errno == EINTR);
+    if (count <= 0) {
+        return;
+    }
+
+    rx->head = 0;
+    rx->count = count;
+    if (!net_socket_rx_flush(s)) {
+        net_socket_read_poll(s, false);
+    }
+}
+#else
 static void net_socket_send_dgram(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -243,6 +405,7 @@ static void net_socket_send_dgram(void *opaque)
         net_socket_read_poll(s, false);
     }
 }
+#endif
 
 static int net_socket_mcast_create(struct sockaddr_in *mcastaddr, struct in_addr *localaddr)
 {
@@ -343,6 +506,15 @@ static void net_socket_cleanup(NetClientState *nc)
         closesocket(s->listen_fd);
         s->listen_fd = -1;
     }
+#ifdef CONFIG_SENDMMSG
+    if (s->tx_bh) {
+        qemu_bh_delete(s->tx_bh);
+        s->tx_bh = NULL;
+    }
+    net_socket_batch_free(s->rx);
+    net_socket_batch_free(s->tx);
+    s->rx = s->tx = NULL;
+#endif
 }
 
 static NetClientInfo net_dgram_socket_info = {
@@ -401,6 +573,11 @@ static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
     s->fd = fd;
     s->listen_fd = -1;
     s->send_fn = net_socket_send_dgram;
+#ifdef CONFIG_SENDMMSG
+    s->rx = net_socket_batch_new(NULL);
+    s->tx = net_socket_batch_new(&s->dgram_dst);
+    s->tx_bh = qemu_bh_new(net_socket_tx_flush, s);
+#endif
     net_socket_read_poll(s, true);
 
     /* mcast: save bound address as dst */
@@ -206,6 +206,11 @@ int tap_fd_set_vnet_be(int fd, int is_be)
     return -EINVAL;
 }
 
+int tap_fd_set_filter(int fd, const uint8_t *macs, int count, bool allmulti)
+{
+    return -EINVAL;
+}
+
 void tap_fd_set_offload(int fd, int csum, int tso4,
                         int tso6, int ecn, int ufo)
 {
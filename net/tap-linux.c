@@ -232,6 +232,21 @@ int tap_fd_set_vnet_be(int fd, int is_be)
     abort();
 }
 
+int tap_fd_set_filter(int fd, const uint8_t *macs, int count, bool allmulti)
+{
+    struct tun_filter *filter;
+    int ret;
+
+    filter = g_malloc(sizeof(*filter) + count * sizeof(filter->addr[0]));
+    filter->flags = allmulti ? TUN_FLT_ALLMULTI : 0;
+    filter->count = count;
+    memcpy(filter->addr, macs, count * sizeof(filter->addr[0]));
+
+    ret = ioctl(fd, TUNSETTXFILTER, filter);
+    g_free(filter);
+    return ret ? -errno : 0;
+}
+
 void tap_fd_set_offload(int fd, int csum, int tso4,
                         int tso6, int ecn, int ufo)
 {
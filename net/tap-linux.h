@@ -25,6 +25,7 @@
 #define TUNSETIFF     _IOW('T', 202, int)
 #define TUNGETFEATURES _IOR('T', 207, unsigned int)
 #define TUNSETOFFLOAD  _IOW('T', 208, unsigned int)
+#define TUNSETTXFILTER _IOW('T', 209, unsigned int)
 #define TUNGETIFF      _IOR('T', 210, unsigned int)
 #define TUNSETSNDBUF   _IOW('T', 212, int)
 #define TUNGETVNETHDRSZ _IOR('T', 215, int)
@@ -51,4 +52,14 @@
 #define TUN_F_TSO_ECN	0x08	/* I can handle TSO with ECN bits. */
 #define TUN_F_UFO	0x10	/* I can handle UFO packets */
 
+/* Destination filter (TUNSETTXFILTER).  The first addresses are matched
+ * exactly, further multicast addresses through a hash. */
+#define TUN_FLT_ALLMULTI 0x0001
+
+struct tun_filter {
+    uint16_t flags;
+    uint16_t count;
+    uint8_t addr[0][6];
+};
+
 #endif /* QEMU_TAP_H */
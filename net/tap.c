@@ -43,6 +43,7 @@
 #include "net/tap.h"
 
 #include "net/vhost_net.h"
+#include "sysemu/iothread.h"
 
 typedef struct TAPState {
     NetClientState nc;
@@ -67,10 +68,29 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+    IOHandler *fd_read = s->read_poll && s->enabled ? tap_send : NULL;
+    IOHandler *fd_write = s->write_poll && s->enabled ? tap_writable : NULL;
+
+    if (s->nc.ctx) {
+        aio_context_acquire(s->nc.ctx);
+        aio_set_fd_handler(s->nc.ctx, s->fd, fd_read, fd_write, s);
+        aio_context_release(s->nc.ctx);
+    } else {
+        qemu_set_fd_handler(s->fd, fd_read, fd_write, s);
+    }
+}
+
+/* Moves the fd handlers, and with them the packet path, to @ctx */
+static void tap_set_aio_context(TAPState *s, AioContext *ctx)
+{
+    bool read_poll = s->read_poll, write_poll = s->write_poll;
+
+    s->read_poll = s->write_poll = false;
+    tap_update_fd_handler(s);
+    s->nc.ctx = ctx;
+    s->read_poll = read_poll;
+    s->write_poll = write_poll;
+    tap_update_fd_handler(s);
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -280,6 +300,18 @@ static int tap_set_vnet_be(NetClientState *nc, bool is_be)
     return tap_fd_set_vnet_be(s->fd, is_be);
 }
 
+static int tap_set_rx_filter(NetClientState *nc, const uint8_t *macs,
+                             int count, bool allmulti)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    if (s->fd < 0) {
+        return -EINVAL;
+    }
+
+    return tap_fd_set_filter(s->fd, macs, count, allmulti);
+}
+
 static void tap_set_offload(NetClientState *nc, int csum, int tso4,
                      int tso6, int ecn, int ufo)
 {
@@ -348,6 +380,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
+    .set_rx_filter = tap_set_rx_filter,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -656,6 +689,25 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
         }
     }
 
+    if (tap->has_iothread) {
+        IOThread *iothread = iothread_by_id(tap->iothread);
+
+        if (peer) {
+            error_setg(errp, "iothread= is only valid with -netdev");
+            return;
+        }
+        if (!iothread) {
+            error_setg(errp, "iothread '%s' not found", tap->iothread);
+            return;
+        }
+        if (tap->has_vhost ? tap->vhost :
+            vhostfdname || (tap->has_vhostforce && tap->vhostforce)) {
+            error_setg(errp, "iothread= is not valid with vhost");
+            return;
+        }
+        tap_set_aio_context(s, iothread_get_aio_context(iothread));
+    }
+
     if (tap->has_vhost ? tap->vhost :
         vhostfdname || (tap->has_vhostforce && tap->vhostforce)) {
         VhostNetOptions options;
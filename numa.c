@@ -37,6 +37,7 @@
 #include "hw/mem/pc-dimm.h"
 #include "qemu/option.h"
 #include "qemu/config-file.h"
+#include "sysemu/iothread.h"
 
 QemuOptsList qemu_numa_opts = {
     .name = "numa",
@@ -395,6 +396,146 @@ void parse_numa_opts(MachineClass *mc)
     }
 }
 
+/* Add the CPUs of host node @host_node to @host_cpus */
+static bool numa_get_host_node_cpus(unsigned long host_node,
+                                    unsigned long *host_cpus)
+{
+#ifdef __linux__
+    char *path, *list, *p, *end;
+    bool found = false;
+
+    path = g_strdup_printf("/sys/devices/system/node/node%lu/cpulist",
+                           host_node);
+    if (!g_file_get_contents(path, &list, NULL, NULL)) {
+        g_free(path);
+        return false;
+    }
+
+    p = list;
+    while (*p) {
+        unsigned long first, last;
+
+        first = last = strtoul(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if (end == p) {
+                break;
+            }
+        }
+        last = MIN(last, NUMA_MAX_HOST_CPUS - 1);
+        if (first <= last) {
+            bitmap_set(host_cpus, first, last - first + 1);
+            found = true;
+        }
+        p = end;
+        if (*p != ',') {
+            break;
+        }
+        p++;
+    }
+
+    g_free(list);
+    g_free(path);
+    return found;
+#else
+    return false;
+#endif
+}
+
+/*
+ * The host CPUs of the host nodes that the memory of guest node @node is
+ * bound to.  Returns false if its memory backend does not name any.
+ */
+static bool numa_get_host_cpus(int node, unsigned long *host_cpus)
+{
+    HostMemoryBackend *backend = numa_info[node].node_memdev;
+    unsigned long host_node;
+    bool found = false;
+
+    bitmap_zero(host_cpus, NUMA_MAX_HOST_CPUS);
+    if (!backend) {
+        return false;
+    }
+
+    host_node = find_first_bit(backend->host_nodes, MAX_NODES);
+    while (host_node < MAX_NODES) {
+        found |= numa_get_host_node_cpus(host_node, host_cpus);
+        host_node = find_next_bit(backend->host_nodes, MAX_NODES,
+                                  host_node + 1);
+    }
+    return found;
+}
+
+static int numa_get_cpu_node(int cpu_index)
+{
+    int i;
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        if (test_bit(cpu_index, numa_info[i].node_cpu)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void numa_pin_vcpu(CPUState *cpu)
+{
+    DECLARE_BITMAP(host_cpus, NUMA_MAX_HOST_CPUS);
+    int node, ret;
+
+    if (!current_machine || !machine_numa_pin(current_machine)) {
+        return;
+    }
+
+    node = numa_get_cpu_node(cpu->cpu_index);
+    if (node < 0 || !numa_get_host_cpus(node, host_cpus)) {
+        return;
+    }
+
+    ret = qemu_thread_set_affinity(cpu->thread, host_cpus,
+                                   NUMA_MAX_HOST_CPUS);
+    if (ret < 0) {
+        error_report("warning: cannot bind the thread of CPU %d to the host "
+                     "CPUs of node %d: %s", cpu->cpu_index, node,
+                     strerror(-ret));
+    }
+}
+
+static int numa_pin_iothread(Object *obj, void *opaque)
+{
+    DECLARE_BITMAP(host_cpus, NUMA_MAX_HOST_CPUS);
+    IOThread *iothread;
+    char *id;
+    int ret;
+
+    iothread = (IOThread *)object_dynamic_cast(obj, TYPE_IOTHREAD);
+    if (!iothread || iothread->node < 0) {
+        return 0;
+    }
+
+    id = iothread_get_id(iothread);
+    if (iothread->node >= nb_numa_nodes) {
+        error_report("warning: iothread %s is assigned to node %" PRId64
+                     ", which does not exist", id, iothread->node);
+    } else if (bitmap_empty(iothread->host_cpus, IOTHREAD_MAX_HOST_CPUS) &&
+               numa_get_host_cpus(iothread->node, host_cpus)) {
+        /* An explicit host-cpus takes precedence */
+        ret = qemu_thread_set_affinity(&iothread->thread, host_cpus,
+                                       NUMA_MAX_HOST_CPUS);
+        if (ret < 0) {
+            error_report("warning: cannot bind iothread %s to the host CPUs "
+                         "of node %" PRId64 ": %s", id, iothread->node,
+                         strerror(-ret));
+        }
+    }
+    g_free(id);
+    return 0;
+}
+
 void numa_post_machine_init(void)
 {
     CPUState *cpu;
@@ -407,6 +548,13 @@ void numa_post_machine_init(void)
             }
         }
     }
+
+    /* The vCPU threads were bound when they were created, but the iothreads
+     * exist before the -numa options are parsed */
+    if (machine_numa_pin(current_machine)) {
+        object_child_foreach(object_get_objects_root(), numa_pin_iothread,
+                             NULL);
+    }
 }
 
 static void allocate_system_memory_nonnuma(MemoryRegion *mr, Object *owner,
@@ -574,6 +722,83 @@ error:
     return -1;
 }
 
+static int query_numa_placement_iothread(Object *obj, void *opaque)
+{
+    NumaPlacementInfo *info = opaque;
+    IOThread *iothread;
+    strList *entry;
+
+    iothread = (IOThread *)object_dynamic_cast(obj, TYPE_IOTHREAD);
+    if (iothread && iothread->node == info->node) {
+        entry = g_new0(strList, 1);
+        entry->value = iothread_get_id(iothread);
+        entry->next = info->iothreads;
+        info->iothreads = entry;
+    }
+    return 0;
+}
+
+NumaPlacementInfoList *qmp_query_numa_placement(Error **errp)
+{
+    NumaPlacementInfoList *head = NULL, **prev = &head;
+    DECLARE_BITMAP(host_cpus, NUMA_MAX_HOST_CPUS);
+    int i;
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        NumaPlacementInfoList *elem = g_new0(NumaPlacementInfoList, 1);
+        NumaPlacementInfo *info = g_new0(NumaPlacementInfo, 1);
+        HostMemoryBackend *backend = numa_info[i].node_memdev;
+        uint16List **host_node = &info->host_nodes;
+        uint16List **host_cpu = &info->host_cpus;
+        intList **vcpu = &info->vcpus;
+        CPUState *cpu;
+        unsigned long value;
+
+        info->node = i;
+        info->pinned = machine_numa_pin(current_machine) &&
+                       numa_get_host_cpus(i, host_cpus);
+
+        if (backend) {
+            value = find_first_bit(backend->host_nodes, MAX_NODES);
+            while (value < MAX_NODES) {
+                *host_node = g_new0(uint16List, 1);
+                (*host_node)->value = value;
+                host_node = &(*host_node)->next;
+                value = find_next_bit(backend->host_nodes, MAX_NODES,
+                                      value + 1);
+            }
+        }
+
+        if (info->pinned) {
+            value = find_first_bit(host_cpus, NUMA_MAX_HOST_CPUS);
+            while (value < NUMA_MAX_HOST_CPUS) {
+                *host_cpu = g_new0(uint16List, 1);
+                (*host_cpu)->value = value;
+                host_cpu = &(*host_cpu)->next;
+                value = find_next_bit(host_cpus, NUMA_MAX_HOST_CPUS,
+                                      value + 1);
+            }
+        }
+
+        CPU_FOREACH(cpu) {
+            if (numa_get_cpu_node(cpu->cpu_index) == i) {
+                *vcpu = g_new0(intList, 1);
+                (*vcpu)->value = cpu->cpu_index;
+                vcpu = &(*vcpu)->next;
+            }
+        }
+
+        object_child_foreach(object_get_objects_root(),
+                             query_numa_placement_iothread, info);
+
+        elem->value = info;
+        *prev = elem;
+        prev = &elem->next;
+    }
+
+    return head;
+}
+
 MemdevList *qmp_query_memdev(Error **errp)
 {
     Object *obj;
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is base on a hash of the page address, and set associative
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -24,6 +24,7 @@
 
 #include "qemu-common.h"
 #include "migration/page_cache.h"
+#include "qemu/mem-usage.h"
 
 #ifdef DEBUG_CACHE
 #define DPRINTF(fmt, ...) \
@@ -36,12 +37,22 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/*
+ * Pages that map to the same set can be cached together, so that a few
+ * hot pages whose addresses collide do not keep evicting each other.
+ */
+#define CACHE_WAYS 4
+
+/* The page array and the cached pages are accounted in query-memory-usage */
+#define PAGE_CACHE_MEM MEMORY_USAGE_SUBSYSTEM_XBZRLE_CACHE
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
     uint8_t *it_data;
+    bool it_overflowed;     /* XBZRLE gave up on the page since cached */
 };
 
 struct PageCache {
@@ -50,6 +61,8 @@ struct PageCache {
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    int64_t num_sets;       /* max_num_items / ways */
+    int ways;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
@@ -78,8 +91,11 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " in sets of %d\n",
+            cache->max_num_items, cache->ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
@@ -89,11 +105,14 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         g_free(cache);
         return NULL;
     }
+    qemu_mem_usage_alloc(PAGE_CACHE_MEM, cache->max_num_items *
+                         sizeof(*cache->page_cache));
 
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
+        cache->page_cache[i].it_overflowed = false;
     }
 
     return cache;
@@ -107,39 +126,75 @@ void cache_fini(PageCache *cache)
     g_assert(cache->page_cache);
 
     for (i = 0; i < cache->max_num_items; i++) {
+        if (cache->page_cache[i].it_data) {
+            qemu_mem_usage_free(PAGE_CACHE_MEM, cache->page_size);
+        }
         g_free(cache->page_cache[i].it_data);
     }
 
+    qemu_mem_usage_free(PAGE_CACHE_MEM, cache->max_num_items *
+                        sizeof(*cache->page_cache));
     g_free(cache->page_cache);
     cache->page_cache = NULL;
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Returns the first item of the set that addr maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
     size_t pos;
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(cache);
+    g_assert(cache->page_cache);
+    g_assert(cache->num_sets);
+
+    pos = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[pos * cache->ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set = cache_get_set(cache, addr);
+    int i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_data && set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+/*
+ * Returns the item of the set to replace: a free one, else the least
+ * recently used, where pages that overflowed count as older than
+ * those that did not, as XBZRLE does not help them anyway.
+ */
+static CacheItem *cache_get_victim(const PageCache *cache, CacheItem *set)
+{
+    CacheItem *victim = &set[0];
+    int i;
 
-    return &cache->page_cache[pos];
+    for (i = 0; i < cache->ways; i++) {
+        if (!set[i].it_data) {
+            return &set[i];
+        }
+        if (set[i].it_overflowed != victim->it_overflowed) {
+            if (set[i].it_overflowed) {
+                victim = &set[i];
+            }
+        } else if (set[i].it_age < victim->it_age) {
+            victim = &set[i];
+        }
+    }
+    return victim;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -149,7 +204,7 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
         return true;
@@ -165,11 +220,14 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        it = cache_get_victim(cache, cache_get_set(cache, addr));
+        if (it->it_data && !it->it_overflowed &&
+            it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            /* the cache page is fresh, don't replace it */
+            return -1;
+        }
+        it->it_overflowed = false;
     }
     /* allocate page */
     if (!it->it_data) {
@@ -178,6 +236,7 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
             DPRINTF("Error allocating page\n");
             return -1;
         }
+        qemu_mem_usage_alloc(PAGE_CACHE_MEM, cache->page_size);
         cache->num_items++;
     }
 
@@ -189,6 +248,17 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     return 0;
 }
 
+bool cache_mark_overflow(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (!it || it->it_overflowed) {
+        return false;
+    }
+    it->it_overflowed = true;
+    return true;
+}
+
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
@@ -217,28 +287,35 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     /* move all data from old cache */
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
+        if (old_it->it_data) {
             /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
+            new_it = cache_get_victim(new_cache,
+                                      cache_get_set(new_cache,
+                                                    old_it->it_addr));
             if (new_it->it_data && new_it->it_age >= old_it->it_age) {
                 /* keep the MRU page */
+                qemu_mem_usage_free(PAGE_CACHE_MEM, cache->page_size);
                 g_free(old_it->it_data);
             } else {
                 if (!new_it->it_data) {
                     new_cache->num_items++;
+                } else {
+                    qemu_mem_usage_free(PAGE_CACHE_MEM, cache->page_size);
                 }
                 g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
+                *new_it = *old_it;
             }
         }
     }
 
+    qemu_mem_usage_free(PAGE_CACHE_MEM, cache->max_num_items *
+                        sizeof(*cache->page_cache));
     g_free(cache->page_cache);
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
+    cache->num_sets = new_cache->num_sets;
+    cache->ways = new_cache->ways;
 
     g_free(new_cache);
 
@@ -26,6 +26,7 @@
 #include "sysemu/sysemu.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
+#include "qemu/iov.h"
 #include "sysemu/char.h"
 #include "hw/usb.h"
 #include "qmp-commands.h"
@@ -87,6 +88,8 @@
 #include "ui/qemu-spice.h"
 
 #define READ_BUF_LEN 4096
+/* stream backends can get a lot of data at once from the other end */
+#define STREAM_READ_BUF_LEN (64 * 1024)
 #define READ_RETRIES 10
 #define CHR_MAX_FILENAME_SIZE 256
 #define TCP_MAX_FDS 16
@@ -223,6 +226,34 @@ int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
     return ret;
 }
 
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov,
+                       int iovcnt)
+{
+    int ret = 0, total = 0;
+    int i;
+
+    qemu_mutex_lock(&s->chr_write_lock);
+    if (s->chr_writev) {
+        total = s->chr_writev(s, iov, iovcnt);
+    } else {
+        for (i = 0; i < iovcnt; i++) {
+            ret = s->chr_write(s, iov[i].iov_base, iov[i].iov_len);
+            if (ret < 0) {
+                break;
+            }
+            total += ret;
+            if (ret < iov[i].iov_len) {
+                break;
+            }
+        }
+        if (ret < 0 && total == 0) {
+            total = ret;
+        }
+    }
+    qemu_mutex_unlock(&s->chr_write_lock);
+    return total;
+}
+
 int qemu_chr_fe_write_all(CharDriverState *s, const uint8_t *buf, int len)
 {
     int offset = 0;
@@ -347,11 +378,12 @@ void qemu_chr_fe_printf(CharDriverState *s, const char *fmt, ...)
 
 static void remove_fd_in_watch(CharDriverState *chr);
 
-void qemu_chr_add_handlers(CharDriverState *s,
-                           IOCanReadHandler *fd_can_read,
-                           IOReadHandler *fd_read,
-                           IOEventHandler *fd_event,
-                           void *opaque)
+void qemu_chr_add_handlers_full(CharDriverState *s,
+                                IOCanReadHandler *fd_can_read,
+                                IOReadHandler *fd_read,
+                                IOEventHandler *fd_event,
+                                void *opaque,
+                                GMainContext *context)
 {
     int fe_open;
 
@@ -360,6 +392,11 @@ void qemu_chr_add_handlers(CharDriverState *s,
         remove_fd_in_watch(s);
     } else {
         fe_open = 1;
+        if (s->context != context) {
+            /* chr_update_read_handler adds it back in the new context */
+            remove_fd_in_watch(s);
+            s->context = context;
+        }
     }
     s->chr_can_read = fd_can_read;
     s->chr_read = fd_read;
@@ -379,6 +416,16 @@ void qemu_chr_add_handlers(CharDriverState *s,
     }
 }
 
+void qemu_chr_add_handlers(CharDriverState *s,
+                           IOCanReadHandler *fd_can_read,
+                           IOReadHandler *fd_read,
+                           IOEventHandler *fd_event,
+                           void *opaque)
+{
+    qemu_chr_add_handlers_full(s, fd_can_read, fd_read, fd_event, opaque,
+                               NULL);
+}
+
 static int null_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
 {
     return len;
@@ -810,7 +857,7 @@ static gboolean io_watch_poll_prepare(GSource *source, gint *timeout_)
         iwp->src = g_io_create_watch(iwp->channel,
                                      G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL);
         g_source_set_callback(iwp->src, iwp->fd_read, iwp->opaque, NULL);
-        g_source_attach(iwp->src, NULL);
+        g_source_attach(iwp->src, g_source_get_context(source));
     } else {
         g_source_destroy(iwp->src);
         g_source_unref(iwp->src);
@@ -857,7 +904,8 @@ static GSourceFuncs io_watch_poll_funcs = {
 static guint io_add_watch_poll(GIOChannel *channel,
                                IOCanReadHandler *fd_can_read,
                                GIOFunc fd_read,
-                               gpointer user_data)
+                               gpointer user_data,
+                               GMainContext *context)
 {
     IOWatchPoll *iwp;
     int tag;
@@ -869,19 +917,19 @@ static guint io_add_watch_poll(GIOChannel *channel,
     iwp->fd_read = (GSourceFunc) fd_read;
     iwp->src = NULL;
 
-    tag = g_source_attach(&iwp->parent, NULL);
+    tag = g_source_attach(&iwp->parent, context);
     g_source_unref(&iwp->parent);
     return tag;
 }
 
-static void io_remove_watch_poll(guint tag)
+static void io_remove_watch_poll(guint tag, GMainContext *context)
 {
     GSource *source;
     IOWatchPoll *iwp;
 
     g_return_if_fail (tag > 0);
 
-    source = g_main_context_find_source_by_id(NULL, tag);
+    source = g_main_context_find_source_by_id(context, tag);
     g_return_if_fail (source != NULL);
 
     iwp = io_watch_poll_from_source(source);
@@ -896,7 +944,7 @@ static void io_remove_watch_poll(guint tag)
 static void remove_fd_in_watch(CharDriverState *chr)
 {
     if (chr->fd_in_tag) {
-        io_remove_watch_poll(chr->fd_in_tag);
+        io_remove_watch_poll(chr->fd_in_tag, chr->context);
         chr->fd_in_tag = 0;
     }
 }
@@ -971,6 +1019,23 @@ static int io_channel_send(GIOChannel *fd, const void *buf, size_t len)
 
 #ifndef _WIN32
 
+/* The channels are unbuffered, so the descriptor can be written directly.
+ * Unlike io_channel_send() this does a single system call; a short count
+ * means that the descriptor is full, and the caller should wait for G_IO_OUT
+ * rather than try again right away. */
+static int io_channel_sendv(GIOChannel *chan, const struct iovec *iov,
+                            int iovcnt)
+{
+    int fd = g_io_channel_unix_get_fd(chan);
+    ssize_t ret;
+
+    do {
+        ret = writev(fd, iov, MIN(iovcnt, IOV_MAX));
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
 typedef struct FDCharDriver {
     CharDriverState *chr;
     GIOChannel *fd_in, *fd_out;
@@ -985,12 +1050,21 @@ static int fd_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     return io_channel_send(s->fd_out, buf, len);
 }
 
+/* Called with chr_write_lock held.  */
+static int fd_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                         int iovcnt)
+{
+    FDCharDriver *s = chr->opaque;
+
+    return io_channel_sendv(s->fd_out, iov, iovcnt);
+}
+
 static gboolean fd_chr_read(GIOChannel *chan, GIOCondition cond, void *opaque)
 {
     CharDriverState *chr = opaque;
     FDCharDriver *s = chr->opaque;
     int len;
-    uint8_t buf[READ_BUF_LEN];
+    uint8_t buf[STREAM_READ_BUF_LEN];
     GIOStatus status;
     gsize bytes_read;
 
@@ -1038,7 +1112,7 @@ static void fd_chr_update_read_handler(CharDriverState *chr)
     remove_fd_in_watch(chr);
     if (s->fd_in) {
         chr->fd_in_tag = io_add_watch_poll(s->fd_in, fd_chr_read_poll,
-                                           fd_chr_read, chr);
+                                           fd_chr_read, chr, chr->context);
     }
 }
 
@@ -1073,6 +1147,7 @@ static CharDriverState *qemu_chr_open_fd(int fd_in, int fd_out)
     chr->opaque = s;
     chr->chr_add_watch = fd_chr_add_watch;
     chr->chr_write = fd_chr_write;
+    chr->chr_writev = fd_chr_writev;
     chr->chr_update_read_handler = fd_chr_update_read_handler;
     chr->chr_close = fd_chr_close;
 
@@ -1284,6 +1359,21 @@ static int pty_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     return io_channel_send(s->fd, buf, len);
 }
 
+/* Called with chr_write_lock held.  */
+static int pty_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    PtyCharDriver *s = chr->opaque;
+
+    if (!s->connected) {
+        pty_chr_update_read_handler_locked(chr);
+        if (!s->connected) {
+            return 0;
+        }
+    }
+    return io_channel_sendv(s->fd, iov, iovcnt);
+}
+
 static GSource *pty_chr_add_watch(CharDriverState *chr, GIOCondition cond)
 {
     PtyCharDriver *s = chr->opaque;
@@ -1307,7 +1397,7 @@ static gboolean pty_chr_read(GIOChannel *chan, GIOCondition cond, void *opaque)
     CharDriverState *chr = opaque;
     PtyCharDriver *s = chr->opaque;
     gsize size, len;
-    uint8_t buf[READ_BUF_LEN];
+    uint8_t buf[STREAM_READ_BUF_LEN];
     GIOStatus status;
 
     len = sizeof(buf);
@@ -1365,7 +1455,7 @@ static void pty_chr_state(CharDriverState *chr, int connected)
         }
         if (!chr->fd_in_tag) {
             chr->fd_in_tag = io_add_watch_poll(s->fd, pty_chr_read_poll,
-                                               pty_chr_read, chr);
+                                               pty_chr_read, chr, chr->context);
         }
     }
 }
@@ -1417,6 +1507,7 @@ static CharDriverState *qemu_chr_open_pty(const char *id,
     s = g_malloc0(sizeof(PtyCharDriver));
     chr->opaque = s;
     chr->chr_write = pty_chr_write;
+    chr->chr_writev = pty_chr_writev;
     chr->chr_update_read_handler = pty_chr_update_read_handler;
     chr->chr_close = pty_chr_close;
     chr->chr_add_watch = pty_chr_add_watch;
@@ -2465,7 +2556,7 @@ static void udp_chr_update_read_handler(CharDriverState *chr)
     remove_fd_in_watch(chr);
     if (s->chan) {
         chr->fd_in_tag = io_add_watch_poll(s->chan, udp_chr_read_poll,
-                                           udp_chr_read, chr);
+                                           udp_chr_read, chr, chr->context);
     }
 }
 
@@ -2621,6 +2712,24 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     }
 }
 
+#ifndef _WIN32
+/* Called with chr_write_lock held.  */
+static int tcp_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    TCPCharDriver *s = chr->opaque;
+
+    if (!s->connected) {
+        return iov_size(iov, iovcnt);
+    }
+    if (s->is_unix && s->write_msgfds_num) {
+        /* the descriptors go with the first chunk only */
+        return unix_send_msgfds(chr, iov[0].iov_base, iov[0].iov_len);
+    }
+    return io_channel_sendv(s->chan, iov, iovcnt);
+}
+#endif
+
 static int tcp_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -2854,7 +2963,7 @@ static gboolean tcp_chr_read(GIOChannel *chan, GIOCondition cond, void *opaque)
 {
     CharDriverState *chr = opaque;
     TCPCharDriver *s = chr->opaque;
-    uint8_t buf[READ_BUF_LEN];
+    uint8_t buf[STREAM_READ_BUF_LEN];
     int len, size;
 
     if (!s->connected || s->max_size <= 0) {
@@ -2933,7 +3042,7 @@ static void tcp_chr_connect(void *opaque)
     s->connected = 1;
     if (s->chan) {
         chr->fd_in_tag = io_add_watch_poll(s->chan, tcp_chr_read_poll,
-                                           tcp_chr_read, chr);
+                                           tcp_chr_read, chr, chr->context);
     }
     qemu_chr_be_generic_open(chr);
 }
@@ -2945,7 +3054,7 @@ static void tcp_chr_update_read_handler(CharDriverState *chr)
     remove_fd_in_watch(chr);
     if (s->chan) {
         chr->fd_in_tag = io_add_watch_poll(s->chan, tcp_chr_read_poll,
-                                           tcp_chr_read, chr);
+                                           tcp_chr_read, chr, chr->context);
     }
 }
 
@@ -4159,6 +4268,9 @@ static CharDriverState *qmp_chardev_open_socket(ChardevSocket *sock,
 
     chr->opaque = s;
     chr->chr_write = tcp_chr_write;
+#ifndef _WIN32
+    chr->chr_writev = tcp_chr_writev;
+#endif
     chr->chr_sync_read = tcp_chr_sync_read;
     chr->chr_close = tcp_chr_close;
     chr->get_msgfds = tcp_get_msgfds;
@@ -47,6 +47,10 @@ typedef struct img_cmd_t {
 enum {
     OPTION_OUTPUT = 256,
     OPTION_BACKING_CHAIN = 257,
+    OPTION_TARGET_IS_ZERO = 258,
+    OPTION_PATTERN = 259,
+    OPTION_FLUSH_INTERVAL = 260,
+    OPTION_NO_DRAIN = 261,
 };
 
 typedef enum OutputFormat {
@@ -129,6 +133,10 @@ static void QEMU_NORETURN help(void)
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
+           "  '--target-is-zero' indicates that the target volume created with '-n'\n"
+           "       reads as all zeroes already, so that zeroes need not be written\n"
+           "  '-m' number of parallel coroutines for the convert process (defaults to 8)\n"
+           "  '-W' allow to write to the target out of order rather than sequentially\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -146,7 +154,21 @@ static void QEMU_NORETURN help(void)
            "Parameters to compare subcommand:\n"
            "  '-f' first image format\n"
            "  '-F' second image format\n"
-           "  '-s' run in Strict mode - fail on different image size or sector allocation\n";
+           "  '-s' run in Strict mode - fail on different image size or sector allocation\n"
+           "  '-m' number of coroutines comparing in parallel (defaults to 8)\n"
+           "\n"
+           "Parameters to bench subcommand:\n"
+           "  '-c' number of requests to issue (defaults to 75000)\n"
+           "  '-d' number of requests kept in flight in parallel (defaults to 64)\n"
+           "  '-n' uses native AIO (Linux only)\n"
+           "  '-o' offset of the first request in bytes (defaults to 0)\n"
+           "  '-s' size of each request in bytes (defaults to 4k)\n"
+           "  '-S' distance between the offsets of two consecutive requests in bytes\n"
+           "       (defaults to the request size; 0 hits the same offset every time)\n"
+           "  '-w' issues write requests instead of read requests\n"
+           "  '--pattern' byte that write requests fill the buffer with (defaults to 0)\n"
+           "  '--flush-interval' sends a flush after every 'flush_interval' requests\n"
+           "  '--no-drain' does not wait for the requests in flight before sending a flush\n";
 
     printf("%s\nSupported formats:", help_msg);
     bdrv_iterate_format(format_print, NULL);
@@ -822,6 +844,10 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
         *pnum = 0;
         return 0;
     }
+    if (buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)) {
+        *pnum = n;
+        return 0;
+    }
     is_zero = buffer_is_zero(buf, 512);
     for(i = 1; i < n; i++) {
         buf += 512;
@@ -892,6 +918,12 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
         *pnum = 0;
         return 0;
     }
+    /* Usually the buffers are the same, and the whole of them is compared
+     * much faster than one sector at a time */
+    if (!memcmp(buf1, buf2, n * BDRV_SECTOR_SIZE)) {
+        *pnum = n;
+        return 0;
+    }
 
     res = !!memcmp(buf1, buf2, 512);
     for(i = 1; i < n; i++) {
@@ -953,6 +985,167 @@ static int check_empty_sectors(BlockBackend *blk, int64_t sect_num,
     return 0;
 }
 
+#define MAX_COROUTINES 16
+
+typedef struct ImgCompareState {
+    BlockBackend *blk[2];
+    const char *filename[2];
+    bool strict;
+    int64_t total_sectors;
+    int64_t progress_base;
+    int64_t sector_num;
+    int running_coroutines;
+    CoMutex lock;
+    /* The first difference found so far, or -1; it is an allocation mismatch
+     * in Strict mode if mismatch_alloc is true */
+    int64_t mismatch;
+    bool mismatch_alloc;
+    /* The exit code of the first error, or 0 */
+    int ret;
+} ImgCompareState;
+
+static int coroutine_fn compare_co_read(ImgCompareState *s, int i,
+                                        int64_t sector_num, int nb_sectors,
+                                        uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    iov.iov_base = buf;
+    iov.iov_len = nb_sectors << BDRV_SECTOR_BITS;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = blk_co_readv(s->blk[i], sector_num, nb_sectors, &qiov);
+    if (ret < 0) {
+        error_report("Error while reading offset %" PRId64 " of %s: %s",
+                     sectors_to_bytes(sector_num), s->filename[i],
+                     strerror(-ret));
+    }
+    return ret;
+}
+
+static void compare_set_mismatch(ImgCompareState *s, int64_t sector_num,
+                                 bool alloc)
+{
+    if (s->mismatch < 0 || sector_num < s->mismatch) {
+        s->mismatch = sector_num;
+        s->mismatch_alloc = alloc;
+    }
+}
+
+/*
+ * Compares an extent with the same block status @status[i] throughout each
+ * image.  Ranges that read as zeroes in both images are not read at all, and
+ * if only one of them does, only the other image is read.
+ *
+ * Returns 0 if the extent is the same, 1 if it differs and an exit code
+ * greater than 1 on errors.
+ */
+static int coroutine_fn compare_co_extent(ImgCompareState *s,
+                                          int64_t sector_num, int n,
+                                          int64_t *status, uint8_t **buf)
+{
+    bool zero[2];
+    int i, pnum, ret;
+
+    for (i = 0; i < 2; i++) {
+        zero[i] = !(status[i] & BDRV_BLOCK_ALLOCATED) ||
+                  (status[i] & BDRV_BLOCK_ZERO);
+    }
+
+    if (s->strict && !(status[0] & BDRV_BLOCK_ALLOCATED) !=
+                     !(status[1] & BDRV_BLOCK_ALLOCATED)) {
+        compare_set_mismatch(s, sector_num, true);
+        return 1;
+    }
+
+    if (zero[0] && zero[1]) {
+        return 0;
+    }
+
+    if (zero[0] || zero[1]) {
+        i = zero[0] ? 1 : 0;
+        if (compare_co_read(s, i, sector_num, n, buf[i]) < 0) {
+            return 4;
+        }
+        ret = is_allocated_sectors(buf[i], n, &pnum);
+    } else {
+        for (i = 0; i < 2; i++) {
+            if (compare_co_read(s, i, sector_num, n, buf[i]) < 0) {
+                return 4;
+            }
+        }
+        ret = compare_sectors(buf[0], buf[1], n, &pnum);
+    }
+
+    if (ret || pnum != n) {
+        compare_set_mismatch(s, ret ? sector_num : sector_num + pnum, false);
+        return 1;
+    }
+    return 0;
+}
+
+/* Each coroutine takes the next extent under s->lock, which covers the block
+ * status lookups, and then reads and compares it on its own.  Extents after
+ * a difference that was already found are not looked at any more. */
+static void coroutine_fn compare_co_do_compare(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    uint8_t *buf[2];
+    int64_t status[2];
+    int64_t sector_num;
+    int i, n, pnum, ret;
+
+    s->running_coroutines++;
+    for (i = 0; i < 2; i++) {
+        buf[i] = blk_blockalign(s->blk[i], IO_BUF_SIZE);
+    }
+
+    for (;;) {
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret || s->sector_num >= s->total_sectors ||
+            (s->mismatch >= 0 && s->sector_num >= s->mismatch)) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+
+        sector_num = s->sector_num;
+        n = sectors_to_process(s->total_sectors, sector_num);
+        for (i = 0; i < 2; i++) {
+            status[i] = bdrv_get_block_status_above(blk_bs(s->blk[i]), NULL,
+                                                    sector_num, n, &pnum);
+            if (status[i] < 0) {
+                error_report("Sector allocation test failed for %s",
+                             s->filename[i]);
+                s->ret = 3;
+                break;
+            }
+            n = MIN(n, pnum);
+        }
+        if (s->ret) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        ret = compare_co_extent(s, sector_num, n, status, buf);
+        if (ret > 1) {
+            if (!s->ret) {
+                s->ret = ret;
+            }
+            break;
+        }
+        qemu_progress_print(((float) n / s->progress_base) * 100, 100);
+    }
+
+    for (i = 0; i < 2; i++) {
+        qemu_vfree(buf[i]);
+    }
+    s->running_coroutines--;
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -964,23 +1157,22 @@ static int img_compare(int argc, char **argv)
 {
     const char *fmt1 = NULL, *fmt2 = NULL, *cache, *filename1, *filename2;
     BlockBackend *blk1, *blk2;
-    BlockDriverState *bs1, *bs2;
+    ImgCompareState s;
     int64_t total_sectors1, total_sectors2;
-    uint8_t *buf1 = NULL, *buf2 = NULL;
-    int pnum1, pnum2;
-    int allocated1, allocated2;
+    uint8_t *buf1 = NULL;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int flags;
     int64_t total_sectors;
     int64_t sector_num = 0;
     int64_t nb_sectors;
-    int c, pnum;
+    int c, i, pnum;
     uint64_t progress_base;
+    long num_coroutines = 8;
 
     cache = BDRV_DEFAULT_CACHE;
     for (;;) {
-        c = getopt(argc, argv, "hf:F:T:pqs");
+        c = getopt(argc, argv, "hf:F:T:pqsm:");
         if (c == -1) {
             break;
         }
@@ -1007,6 +1199,20 @@ static int img_compare(int argc, char **argv)
         case 's':
             strict = true;
             break;
+        case 'm':
+        {
+            char *end;
+
+            errno = 0;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (errno || *end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                return 2;
+            }
+            break;
+        }
         }
     }
 
@@ -1038,17 +1244,14 @@ static int img_compare(int argc, char **argv)
         ret = 2;
         goto out3;
     }
-    bs1 = blk_bs(blk1);
 
     blk2 = img_open("image_2", filename2, fmt2, flags, true, quiet);
     if (!blk2) {
         ret = 2;
         goto out2;
     }
-    bs2 = blk_bs(blk2);
 
     buf1 = blk_blockalign(blk1, IO_BUF_SIZE);
-    buf2 = blk_blockalign(blk2, IO_BUF_SIZE);
     total_sectors1 = blk_nb_sectors(blk1);
     if (total_sectors1 < 0) {
         error_report("Can't get size of %s: %s",
@@ -1074,83 +1277,38 @@ static int img_compare(int argc, char **argv)
         goto out;
     }
 
-    for (;;) {
-        nb_sectors = sectors_to_process(total_sectors, sector_num);
-        if (nb_sectors <= 0) {
-            break;
-        }
-        allocated1 = bdrv_is_allocated_above(bs1, NULL, sector_num, nb_sectors,
-                                             &pnum1);
-        if (allocated1 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename1);
-            goto out;
-        }
-
-        allocated2 = bdrv_is_allocated_above(bs2, NULL, sector_num, nb_sectors,
-                                             &pnum2);
-        if (allocated2 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename2);
-            goto out;
-        }
-        nb_sectors = MIN(pnum1, pnum2);
+    s = (ImgCompareState) {
+        .blk            = { blk1, blk2 },
+        .filename       = { filename1, filename2 },
+        .strict         = strict,
+        .total_sectors  = total_sectors,
+        .progress_base  = progress_base,
+        .mismatch       = -1,
+    };
+    qemu_co_mutex_init(&s.lock);
+    for (i = 0; i < num_coroutines; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(compare_co_do_compare), &s);
+    }
+    while (s.running_coroutines) {
+        aio_poll(blk_get_aio_context(blk1), true);
+    }
 
-        if (allocated1 == allocated2) {
-            if (allocated1) {
-                ret = blk_read(blk1, sector_num, buf1, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64 " of %s:"
-                                 " %s", sectors_to_bytes(sector_num), filename1,
-                                 strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = blk_read(blk2, sector_num, buf2, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s", sectors_to_bytes(sector_num),
-                                 filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
-                if (ret || pnum != nb_sectors) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            sectors_to_bytes(
-                                ret ? sector_num : sector_num + pnum));
-                    ret = 1;
-                    goto out;
-                }
-            }
+    if (s.ret) {
+        ret = s.ret;
+        goto out;
+    }
+    if (s.mismatch >= 0) {
+        if (s.mismatch_alloc) {
+            qprintf(quiet, "Strict mode: Offset %" PRId64
+                    " allocation mismatch!\n", sectors_to_bytes(s.mismatch));
         } else {
-            if (strict) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " allocation mismatch!\n",
-                        sectors_to_bytes(sector_num));
-                goto out;
-            }
-
-            if (allocated1) {
-                ret = check_empty_sectors(blk1, sector_num, nb_sectors,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(blk2, sector_num, nb_sectors,
-                                          filename2, buf1, quiet);
-            }
-            if (ret) {
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64 ": %s",
-                                 sectors_to_bytes(sector_num), strerror(-ret));
-                    ret = 4;
-                }
-                goto out;
-            }
+            qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
+                    sectors_to_bytes(s.mismatch));
         }
-        sector_num += nb_sectors;
-        qemu_progress_print(((float) nb_sectors / progress_base)*100, 100);
+        ret = 1;
+        goto out;
     }
+    sector_num = total_sectors;
 
     if (total_sectors1 != total_sectors2) {
         BlockBackend *blk_over;
@@ -1206,7 +1364,6 @@ static int img_compare(int argc, char **argv)
 
 out:
     qemu_vfree(buf1);
-    qemu_vfree(buf2);
     blk_unref(blk2);
 out2:
     blk_unref(blk1);
@@ -1224,45 +1381,67 @@ enum ImgConvertBlockStatus {
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
-    int src_cur, src_num;
-    int64_t src_cur_offset;
+    int src_num;
     int64_t total_sectors;
     int64_t allocated_sectors;
+    int64_t allocated_done;
+    int64_t sector_num;
+    int64_t wr_offs;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
     BlockBackend *target;
     bool has_zero_init;
+    bool target_is_zero;
     bool compressed;
     bool target_has_backing;
+    bool wr_in_order;
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
 } ImgConvertState;
 
-static void convert_select_part(ImgConvertState *s, int64_t sector_num)
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
 {
-    assert(sector_num >= s->src_cur_offset);
-    while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
-        s->src_cur_offset += s->src_sectors[s->src_cur];
-        s->src_cur++;
-        assert(s->src_cur < s->src_num);
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
     }
 }
 
 static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
 {
-    int64_t ret;
-    int n;
+    int64_t ret, src_cur_offset;
+    int n, src_cur;
 
-    convert_select_part(s, sector_num);
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
 
     assert(s->total_sectors > sector_num);
     n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
 
     if (s->sector_next_status <= sector_num) {
-        ret = bdrv_get_block_status(blk_bs(s->src[s->src_cur]),
-                                    sector_num - s->src_cur_offset,
-                                    n, &n);
+        BlockDriverState *src_bs = blk_bs(s->src[src_cur]);
+
+        /* Without a target backing file the contents of the source backing
+         * chain are copied as well, so that is where to look for zeroes,
+         * unless -S 0 asked not to look at all. */
+        if (s->target_has_backing || !s->min_sparse) {
+            ret = bdrv_get_block_status(src_bs, sector_num - src_cur_offset,
+                                        n, &n);
+        } else {
+            ret = bdrv_get_block_status_above(src_bs, NULL,
+                                              sector_num - src_cur_offset,
+                                              n, &n);
+        }
         if (ret < 0) {
             return ret;
         }
@@ -1274,9 +1453,6 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         } else if (!s->target_has_backing) {
             /* Without a target backing file we must copy over the contents of
              * the backing file as well. */
-            /* TODO Check block status of the backing file chain to avoid
-             * needlessly reading zeroes and limiting the iteration to the
-             * buffer size */
             s->status = BLK_DATA;
         } else {
             s->status = BLK_BACKING_FILE;
@@ -1305,30 +1481,33 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     return n;
 }
 
-static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                        uint8_t *buf)
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
 {
+    QEMUIOVector qiov;
+    struct iovec iov;
     int n;
     int ret;
 
-    if (s->status == BLK_ZERO || s->status == BLK_BACKING_FILE) {
-        return 0;
-    }
-
     assert(nb_sectors <= s->buf_sectors);
     while (nb_sectors > 0) {
         BlockBackend *blk;
-        int64_t bs_sectors;
+        int src_cur;
+        int64_t bs_sectors, src_cur_offset;
 
         /* In the case of compression with multiple source files, we can get a
          * nb_sectors that spreads into the next part. So we must be able to
          * read across multiple BDSes for one convert_read() call. */
-        convert_select_part(s, sector_num);
-        blk = s->src[s->src_cur];
-        bs_sectors = s->src_sectors[s->src_cur];
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
 
-        n = MIN(nb_sectors, bs_sectors - (sector_num - s->src_cur_offset));
-        ret = blk_read(blk, sector_num - s->src_cur_offset, buf, n);
+        ret = blk_co_readv(blk, sector_num - src_cur_offset, n, &qiov);
         if (ret < 0) {
             return ret;
         }
@@ -1341,15 +1520,19 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                         const uint8_t *buf)
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
 {
+    QEMUIOVector qiov;
+    struct iovec iov;
     int ret;
 
     while (nb_sectors > 0) {
         int n = nb_sectors;
 
-        switch (s->status) {
+        switch (status) {
         case BLK_BACKING_FILE:
             /* If we have a backing file, leave clusters unallocated that are
              * unallocated in the source image, so that the backing file is
@@ -1383,7 +1566,11 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (!s->min_sparse ||
                 is_allocated_sectors_min(buf, n, &n, s->min_sparse))
             {
-                ret = blk_write(s->target, sector_num, buf, n);
+                iov.iov_base = buf;
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = blk_co_writev(s->target, sector_num, n, &qiov);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1395,7 +1582,7 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (s->has_zero_init) {
                 break;
             }
-            ret = blk_write_zeroes(s->target, sector_num, n, 0);
+            ret = blk_co_write_zeroes(s->target, sector_num, n, 0);
             if (ret < 0) {
                 return ret;
             }
@@ -1410,16 +1597,127 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
+/* Lets the coroutine whose write comes next go ahead, or all the waiting
+ * ones once the conversion has failed. */
+static void convert_co_wake_writers(ImgConvertState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] != -1 &&
+            (s->ret != -EINPROGRESS || s->wait_sector_num[i] == s->wr_offs)) {
+            /* A coroutine that waits does not wake others, so it cannot be
+             * entered again while it is already running. */
+            s->wait_sector_num[i] = -1;
+            qemu_coroutine_enter(s->co[i], NULL);
+            if (s->ret == -EINPROGRESS) {
+                break;
+            }
+        }
+    }
+}
+
+/* Each coroutine takes the next extent of the source under s->lock, which
+ * covers the block status lookups, and then reads and writes it on its own.
+ * Writes are issued in the order of the sectors unless -W was given. */
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    for (;;) {
+        int n;
+        int64_t sector_num;
+        enum ImgConvertBlockStatus status;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            s->ret = n;
+            break;
+        }
+        sector_num = s->sector_num;
+        status = s->status;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                s->allocated_sectors, 0);
+
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+                break;
+            }
+        }
+
+        if (s->wr_in_order) {
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            if (s->ret != -EINPROGRESS) {
+                break;
+            }
+        }
+
+        ret = convert_co_write(s, sector_num, n, buf, status);
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64
+                         ": %s", sector_num, strerror(-ret));
+            s->ret = ret;
+            break;
+        }
+
+        if (s->wr_in_order) {
+            s->wr_offs = sector_num + n;
+            convert_co_wake_writers(s);
+        }
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (s->ret != -EINPROGRESS) {
+        convert_co_wake_writers(s);
+    } else if (!s->running_coroutines) {
+        /* the conversion is complete */
+        s->ret = 0;
+    }
+}
+
 static int convert_do_copy(ImgConvertState *s)
 {
-    uint8_t *buf = NULL;
-    int64_t sector_num, allocated_done;
-    int ret;
+    int64_t sector_num;
+    int ret, i;
     int n;
 
     /* Check whether we have zero initialisation or can get it efficiently */
     s->has_zero_init = s->min_sparse && !s->target_has_backing
-                     ? bdrv_has_zero_init(blk_bs(s->target))
+                     ? s->target_is_zero ||
+                       bdrv_has_zero_init(blk_bs(s->target))
                      : false;
 
     if (!s->has_zero_init && !s->target_has_backing &&
@@ -1436,12 +1734,10 @@ static int convert_do_copy(ImgConvertState *s)
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
-            ret = -EINVAL;
-            goto fail;
+            return -EINVAL;
         }
         s->buf_sectors = s->cluster_sectors;
     }
-    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
     /* Calculate allocated sectors for progress */
     s->allocated_sectors = 0;
@@ -1449,8 +1745,7 @@ static int convert_do_copy(ImgConvertState *s)
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
-            ret = n;
-            goto fail;
+            return n;
         }
         if (s->status == BLK_DATA) {
             s->allocated_sectors += n;
@@ -1459,54 +1754,32 @@ static int convert_do_copy(ImgConvertState *s)
     }
 
     /* Do the copy */
-    s->src_cur = 0;
-    s->src_cur_offset = 0;
     s->sector_next_status = 0;
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    s->allocated_done = 0;
+    s->ret = -EINPROGRESS;
 
-    sector_num = 0;
-    allocated_done = 0;
-
-    while (sector_num < s->total_sectors) {
-        n = convert_iteration_sectors(s, sector_num);
-        if (n < 0) {
-            ret = n;
-            goto fail;
-        }
-        if (s->status == BLK_DATA) {
-            allocated_done += n;
-            qemu_progress_print(100.0 * allocated_done / s->allocated_sectors,
-                                0);
-        }
-
-        ret = convert_read(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while reading sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
-
-        ret = convert_write(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while writing sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
+    qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(s->co[i], s);
+    }
 
-        sector_num += n;
+    while (s->running_coroutines) {
+        aio_poll(blk_get_aio_context(s->target), true);
     }
 
-    if (s->compressed) {
+    if (s->ret == 0 && s->compressed) {
         /* signal EOF to align */
         ret = blk_write_compressed(s->target, 0, NULL, 0);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
     }
 
-    ret = 0;
-fail:
-    qemu_vfree(buf);
-    return ret;
+    return s->ret;
 }
 
 static int img_convert(int argc, char **argv)
@@ -1532,6 +1805,8 @@ static int img_convert(int argc, char **argv)
     Error *local_err = NULL;
     QemuOpts *sn_opts = NULL;
     ImgConvertState state;
+    bool wr_in_order = true, target_is_zero = false;
+    long num_coroutines = 8;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1541,7 +1816,14 @@ static int img_convert(int argc, char **argv)
     compress = 0;
     skip_create = 0;
     for(;;) {
-        c = getopt(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn");
+        int option_index = 0;
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qnm:W",
+                        long_options, &option_index);
         if (c == -1) {
             break;
         }
@@ -1632,9 +1914,36 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+        {
+            char *end;
+
+            errno = 0;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (errno || *end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
+        case OPTION_TARGET_IS_ZERO:
+            target_is_zero = true;
+            break;
         }
     }
 
+    if (target_is_zero && !skip_create) {
+        error_report("--target-is-zero requires use of -n flag");
+        ret = -1;
+        goto fail_getopt;
+    }
+
     /* Initialize before goto out */
     if (quiet) {
         progress = 0;
@@ -1776,6 +2085,12 @@ static int img_convert(int argc, char **argv)
         out_baseimg = out_baseimg_param;
     }
 
+    if (target_is_zero && out_baseimg) {
+        error_report("--target-is-zero cannot be used with a backing file");
+        ret = -1;
+        goto out;
+    }
+
     /* Check if compression is supported */
     if (compress) {
         bool encryption =
@@ -1865,6 +2180,12 @@ static int img_convert(int argc, char **argv)
         cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
+    if (compress && !wr_in_order) {
+        error_report("Out of order write and compress are mutually exclusive");
+        ret = -1;
+        goto out;
+    }
+
     state = (ImgConvertState) {
         .src                = blk,
         .src_sectors        = bs_sectors,
@@ -1876,6 +2197,9 @@ static int img_convert(int argc, char **argv)
         .min_sparse         = min_sparse,
         .cluster_sectors    = cluster_sectors,
         .buf_sectors        = bufsectors,
+        .target_is_zero     = target_is_zero,
+        .wr_in_order        = wr_in_order,
+        .num_coroutines     = num_coroutines,
     };
     ret = convert_do_copy(&state);
 
@@ -2185,24 +2509,46 @@ static void dump_map_entry(OutputFormat output_format, MapEntry *e,
     }
 }
 
+/* The range most recently found unallocated in one file of the chain */
+typedef struct MapUnallocated {
+    int64_t start;
+    int64_t end;
+} MapUnallocated;
+
+/*
+ * @unalloc holds a MapUnallocated for each depth in the chain.  While the
+ * backing files are walked through a range that is unallocated in the
+ * overlays, the overlays are not queried for it again.
+ */
 static int get_block_status(BlockDriverState *bs, int64_t sector_num,
-                            int nb_sectors, MapEntry *e)
+                            int nb_sectors, MapEntry *e, GArray *unalloc)
 {
+    MapUnallocated *u;
     int64_t ret;
     int depth;
 
-    /* As an optimization, we could cache the current range of unallocated
-     * clusters in each file of the chain, and avoid querying the same
-     * range repeatedly.
-     */
-
     depth = 0;
     for (;;) {
-        ret = bdrv_get_block_status(bs, sector_num, nb_sectors, &nb_sectors);
-        if (ret < 0) {
-            return ret;
+        if (depth >= unalloc->len) {
+            g_array_set_size(unalloc, depth + 1);
+        }
+        u = &g_array_index(unalloc, MapUnallocated, depth);
+
+        if (sector_num >= u->start && sector_num < u->end) {
+            nb_sectors = MIN(nb_sectors, u->end - sector_num);
+            ret = 0;
+        } else {
+            ret = bdrv_get_block_status(bs, sector_num, nb_sectors,
+                                        &nb_sectors);
+            if (ret < 0) {
+                return ret;
+            }
+            assert(nb_sectors);
+            if (!(ret & (BDRV_BLOCK_ZERO|BDRV_BLOCK_DATA))) {
+                u->start = sector_num;
+                u->end = sector_num + nb_sectors;
+            }
         }
-        assert(nb_sectors);
         if (ret & (BDRV_BLOCK_ZERO|BDRV_BLOCK_DATA)) {
             break;
         }
@@ -2233,6 +2579,7 @@ static int img_map(int argc, char **argv)
     const char *filename, *fmt, *output;
     int64_t length;
     MapEntry curr = { .length = 0 }, next;
+    GArray *unalloc = NULL;
     int ret = 0;
 
     fmt = NULL;
@@ -2287,6 +2634,7 @@ static int img_map(int argc, char **argv)
         printf("%-16s%-16s%-16s%s\n", "Offset", "Length", "Mapped to", "File");
     }
 
+    unalloc = g_array_new(false, true, sizeof(MapUnallocated));
     length = blk_getlength(blk);
     while (curr.start + curr.length < length) {
         int64_t nsectors_left;
@@ -2298,7 +2646,7 @@ static int img_map(int argc, char **argv)
         /* Probe up to 1 GiB at a time.  */
         nsectors_left = DIV_ROUND_UP(length, BDRV_SECTOR_SIZE) - sector_num;
         n = MIN(1 << (30 - BDRV_SECTOR_BITS), nsectors_left);
-        ret = get_block_status(bs, sector_num, n, &next);
+        ret = get_block_status(bs, sector_num, n, &next, unalloc);
 
         if (ret < 0) {
             error_report("Could not read file metadata: %s", strerror(-ret));
@@ -2322,6 +2670,9 @@ static int img_map(int argc, char **argv)
     dump_map_entry(output_format, &curr, NULL);
 
 out:
+    if (unalloc) {
+        g_array_free(unalloc, true);
+    }
     blk_unref(blk);
     return ret < 0;
 }
@@ -3043,6 +3394,406 @@ out_no_progress:
     return 0;
 }
 
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    int64_t start_ns;
+} BenchRequest;
+
+struct BenchData {
+    BlockBackend *blk;
+    uint64_t image_size;
+    bool write;
+    int bufsize;
+    int step;
+    int nrreq;
+    int n;
+    int flush_interval;
+    bool drain_on_flush;
+    uint8_t *buf;
+    BenchRequest *reqs;
+    BenchRequest **free_reqs;
+    int nr_free;
+
+    int in_flight;
+    int completed;
+    bool flush_pending;
+    bool in_flush;
+    uint64_t offset;
+
+    int64_t latency_total_ns;
+    int64_t latency_min_ns;
+    int64_t latency_max_ns;
+};
+
+static void bench_cb(void *opaque, int ret);
+
+static void bench_submit(BenchData *b)
+{
+    while (b->n > b->in_flight && b->in_flight < b->nrreq) {
+        BenchRequest *req = b->free_reqs[--b->nr_free];
+        int64_t sector_num = b->offset >> BDRV_SECTOR_BITS;
+        int nb_sectors = b->bufsize >> BDRV_SECTOR_BITS;
+        BlockAIOCB *acb;
+
+        /* blk_aio_* might look for completed I/Os and kick bench_cb
+         * again, so make sure this operation is counted by in_flight
+         * and b->offset is ready for the next submission.
+         */
+        b->in_flight++;
+        b->offset += b->step;
+        if (b->offset > b->image_size - b->bufsize) {
+            b->offset = 0;
+        }
+
+        req->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (b->write) {
+            acb = blk_aio_writev(b->blk, sector_num, &req->qiov, nb_sectors,
+                                 bench_cb, req);
+        } else {
+            acb = blk_aio_readv(b->blk, sector_num, &req->qiov, nb_sectors,
+                                bench_cb, req);
+        }
+        if (!acb) {
+            error_report("Failed to issue request");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void bench_undrained_flush_cb(void *opaque, int ret)
+{
+    if (ret < 0) {
+        error_report("Failed flush request: %s", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void bench_drained_flush_cb(void *opaque, int ret)
+{
+    BenchData *b = opaque;
+
+    bench_undrained_flush_cb(opaque, ret);
+
+    /* Just finished a flush with drained queue: Start next requests */
+    assert(b->in_flight == 0);
+    b->in_flush = false;
+    bench_submit(b);
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+    int64_t latency_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                         req->start_ns;
+
+    if (ret < 0) {
+        error_report("Failed request: %s", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    b->latency_total_ns += latency_ns;
+    b->latency_min_ns = MIN(b->latency_min_ns, latency_ns);
+    b->latency_max_ns = MAX(b->latency_max_ns, latency_ns);
+
+    b->free_reqs[b->nr_free++] = req;
+    b->n--;
+    b->in_flight--;
+    b->completed++;
+
+    /* Time for flush? Drain queue if requested, then flush */
+    if (b->flush_interval && b->completed % b->flush_interval == 0) {
+        if (b->drain_on_flush) {
+            b->flush_pending = true;
+        } else if (!blk_aio_flush(b->blk, bench_undrained_flush_cb, b)) {
+            error_report("Failed to issue flush request");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (b->flush_pending) {
+        if (b->in_flight == 0) {
+            b->flush_pending = false;
+            b->in_flush = true;
+            if (!blk_aio_flush(b->blk, bench_drained_flush_cb, b)) {
+                error_report("Failed to issue flush request");
+                exit(EXIT_FAILURE);
+            }
+        }
+        return;
+    }
+
+    bench_submit(b);
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret = 0;
+    const char *fmt = NULL, *filename;
+    bool quiet = false;
+    bool is_write = false;
+    int count = 75000;
+    int depth = 64;
+    int64_t offset = 0;
+    size_t bufsize = 4096;
+    int pattern = 0;
+    size_t step = 0;
+    int flush_interval = 0;
+    bool drain_on_flush = true;
+    int64_t image_size;
+    BlockBackend *blk = NULL;
+    BenchData data = {};
+    int flags = BDRV_O_FLAGS;
+    const char *cache = BDRV_DEFAULT_CACHE;
+    int64_t start_ns, time_ns;
+    int i;
+
+    for (;;) {
+        int option_index = 0;
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"flush-interval", required_argument, 0, OPTION_FLUSH_INTERVAL},
+            {"pattern", required_argument, 0, OPTION_PATTERN},
+            {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, "hc:d:f:no:qs:S:t:w",
+                        long_options, &option_index);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+        case '?':
+            help();
+            break;
+        case 'c':
+        {
+            char *end;
+
+            errno = 0;
+            count = strtol(optarg, &end, 0);
+            if (errno || *end || count < 1) {
+                error_report("Invalid request count specified");
+                return 1;
+            }
+            break;
+        }
+        case 'd':
+        {
+            char *end;
+
+            errno = 0;
+            depth = strtol(optarg, &end, 0);
+            if (errno || *end || depth < 1 || depth > 65536) {
+                error_report("Invalid queue depth specified");
+                return 1;
+            }
+            break;
+        }
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'n':
+            flags |= BDRV_O_NATIVE_AIO;
+            break;
+        case 'o':
+        {
+            char *end;
+
+            offset = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (offset < 0 || *end) {
+                error_report("Invalid offset specified");
+                return 1;
+            }
+            break;
+        }
+        case 'q':
+            quiet = true;
+            break;
+        case 's':
+        {
+            int64_t sval;
+            char *end;
+
+            sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval <= 0 || sval > INT_MAX || *end) {
+                error_report("Invalid buffer size specified");
+                return 1;
+            }
+
+            bufsize = sval;
+            break;
+        }
+        case 'S':
+        {
+            int64_t sval;
+            char *end;
+
+            sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval < 0 || sval > INT_MAX || *end) {
+                error_report("Invalid step size specified");
+                return 1;
+            }
+
+            step = sval;
+            break;
+        }
+        case 't':
+            cache = optarg;
+            break;
+        case 'w':
+            flags |= BDRV_O_RDWR;
+            is_write = true;
+            break;
+        case OPTION_PATTERN:
+        {
+            char *end;
+
+            errno = 0;
+            pattern = strtol(optarg, &end, 0);
+            if (errno || *end || pattern < 0 || pattern > 0xff) {
+                error_report("Invalid pattern byte specified");
+                return 1;
+            }
+            break;
+        }
+        case OPTION_FLUSH_INTERVAL:
+        {
+            char *end;
+
+            errno = 0;
+            flush_interval = strtol(optarg, &end, 0);
+            if (errno || *end || flush_interval < 1) {
+                error_report("Invalid flush interval specified");
+                return 1;
+            }
+            break;
+        }
+        case OPTION_NO_DRAIN:
+            drain_on_flush = false;
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        error_exit("Expecting one image file name");
+    }
+    filename = argv[argc - 1];
+
+    if (!is_write && flush_interval) {
+        error_report("--flush-interval is only available in write tests");
+        ret = -1;
+        goto out;
+    }
+    if (flush_interval && flush_interval < depth) {
+        error_report("Flush interval can't be smaller than depth");
+        ret = -1;
+        goto out;
+    }
+    if ((offset | bufsize | step) & (BDRV_SECTOR_SIZE - 1)) {
+        error_report("Offset, buffer size and step size must be multiples "
+                     "of %d bytes", BDRV_SECTOR_SIZE);
+        ret = -1;
+        goto out;
+    }
+
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache mode");
+        ret = -1;
+        goto out;
+    }
+
+    blk = img_open("image", filename, fmt, flags, true, quiet);
+    if (!blk) {
+        ret = -1;
+        goto out;
+    }
+
+    image_size = blk_getlength(blk);
+    if (image_size < 0) {
+        error_report("Could not get image size: %s", strerror(-image_size));
+        ret = -1;
+        goto out;
+    }
+    if (offset + bufsize > image_size) {
+        error_report("Requests do not fit in the image");
+        ret = -1;
+        goto out;
+    }
+
+    data = (BenchData) {
+        .blk            = blk,
+        .image_size     = image_size,
+        .bufsize        = bufsize,
+        .step           = step ?: bufsize,
+        .nrreq          = MIN(depth, count),
+        .n              = count,
+        .offset         = offset,
+        .write          = is_write,
+        .flush_interval = flush_interval,
+        .drain_on_flush = drain_on_flush,
+        .latency_min_ns = INT64_MAX,
+    };
+    qprintf(quiet, "Sending %d %s requests, %d bytes each, %d in parallel "
+           "(starting at offset %" PRId64 ", step size %d)\n",
+           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
+           offset, data.step);
+    if (flush_interval) {
+        qprintf(quiet, "Sending flush every %d requests\n", flush_interval);
+    }
+
+    data.buf = blk_blockalign(blk, (size_t)data.nrreq * data.bufsize);
+    memset(data.buf, pattern, (size_t)data.nrreq * data.bufsize);
+
+    data.reqs = g_new(BenchRequest, data.nrreq);
+    data.free_reqs = g_new(BenchRequest *, data.nrreq);
+    for (i = 0; i < data.nrreq; i++) {
+        data.reqs[i].b = &data;
+        qemu_iovec_init(&data.reqs[i].qiov, 1);
+        qemu_iovec_add(&data.reqs[i].qiov, data.buf + (size_t)i * data.bufsize,
+                       data.bufsize);
+        data.free_reqs[data.nr_free++] = &data.reqs[i];
+    }
+
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    bench_submit(&data);
+
+    while (data.n > 0 || data.in_flush) {
+        aio_poll(blk_get_aio_context(blk), true);
+    }
+    time_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns;
+
+    printf("Run completed in %3.3f seconds.\n", time_ns / 1e9);
+    printf("%.0f requests/s, %.1f MiB/s\n",
+           count / (time_ns / 1e9),
+           (double)count * data.bufsize / (1 << 20) / (time_ns / 1e9));
+    printf("Latency: %.1f us average, %.1f us min, %.1f us max\n",
+           data.latency_total_ns / 1e3 / count,
+           data.latency_min_ns / 1e3, data.latency_max_ns / 1e3);
+
+out:
+    if (data.reqs) {
+        for (i = 0; i < data.nrreq; i++) {
+            qemu_iovec_destroy(&data.reqs[i].qiov);
+        }
+    }
+    g_free(data.reqs);
+    g_free(data.free_reqs);
+    qemu_vfree(data.buf);
+    blk_unref(blk);
+
+    if (ret) {
+        return 1;
+    }
+    return 0;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
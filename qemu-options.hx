@@ -37,6 +37,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
+    "                numa-pin=on|off binds NUMA nodes' threads to their host nodes (default=off)\n"
     "                iommu=on|off controls emulated Intel IOMMU (VT-d) support (default=off)\n"
     "                aes-key-wrap=on|off controls support for AES key wrapping (default=on)\n"
     "                dea-key-wrap=on|off controls support for DEA key wrapping (default=on)\n"
@@ -67,6 +68,12 @@ Include guest memory in a core dump. The default is on.
 Enables or disables memory merge support. This feature, when supported by
 the host, de-duplicates identical memory pages among VMs instances
 (enabled by default).
+@item numa-pin=on|off
+Binds the vCPU threads of each guest NUMA node, and the iothreads assigned
+to it with their @option{node} property, to the host CPUs of the host nodes
+that its memory backend is bound to with @option{host-nodes}. Nodes
+without such a backend are left alone. @code{query-numa-placement} shows
+the result. The default is off.
 @item iommu=on|off
 Enables or disables emulated Intel IOMMU (VT-d) support. The default is off.
 @item aes-key-wrap=on|off
@@ -461,9 +468,10 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
+    "       [,stats-intervals=t1[:t2...]]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
     "       [[,iops=i]|[[,iops_rd=r][,iops_wr=w]]]\n"
     "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
@@ -504,7 +512,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring. Unlike "native", "io_uring" does not need @option{cache.direct=on}.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -531,6 +539,11 @@ file sectors into the image file.
 conversion of plain zero writes by the OS to driver specific optimized
 zero write commands. You may even choose "unmap" if @var{discard} is set
 to "unmap" to allow a zero write to be converted to an UNMAP operation.
+@item stats-intervals=@var{t1}[:@var{t2}...]
+Collect the minimum, maximum and average latency and the average queue depth
+of the requests over sliding windows of @var{t1}, @var{t2}, ... seconds (for
+instance, "stats-intervals=60:3600"), and report them in
+@code{query-blockstats}.
 @end table
 
 By default, the @option{cache=writeback} mode is used. It will report data
@@ -1475,6 +1488,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev tap,id=str[,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile]\n"
     "         [,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off]\n"
     "         [,vhostfd=h][,vhostfds=x:y:...:z][,vhostforce=on|off][,queues=n]\n"
+    "         [,iothread=id]\n"
     "                configure a host TAP network backend with ID 'str'\n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                to configure it and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1494,6 +1508,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
     "                use 'vhostfds=x:y:...:z to connect to multiple already opened vhost net devices\n"
     "                use 'queues=n' to specify the number of queues to be created for multiqueue TAP\n"
+    "                use 'iothread=id' to move the packet path to the I/O thread 'id'\n"
     "-netdev bridge,id=str[,br=bridge][,helper=helper]\n"
     "                configure a host TAP network backend with ID 'str' that is\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
@@ -1548,10 +1563,13 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
 #endif
-    "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
+    "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off][,queues=n]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
-    "-netdev hubport,id=str,hubid=n\n"
-    "                configure a hub port on QEMU VLAN 'n'\n", QEMU_ARCH_ALL)
+    "                use 'queues=n' to specify the number of queue pairs (default: 1)\n"
+    "-netdev hubport,id=str,hubid=n[,mac-learning=on|off]\n"
+    "                configure a hub port on QEMU VLAN 'n'\n"
+    "                use 'mac-learning=on' to only forward the unicast frames\n"
+    "                that are addressed to the port's peer\n", QEMU_ARCH_ALL)
 DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net nic[,vlan=n][,macaddr=mac][,model=type][,name=str][,addr=str][,vectors=v]\n"
     "                old way to create a new NIC and connect it to VLAN 'n'\n"
@@ -1760,6 +1778,12 @@ helper executable is @file{/path/to/qemu-bridge-helper}.
 @option{fd}=@var{h} can be used to specify the handle of an already
 opened host TAP interface.
 
+@option{iothread}=@var{id} runs the packet path of the backend in the I/O
+thread @var{id} (created with @option{-object iothread}) instead of the main
+loop. The guest device must be able to run there too: currently only
+virtio-net with the same @option{iothread} property, and not together with
+vhost.
+
 Examples:
 
 @example
@@ -1955,21 +1979,32 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -net nic -net vde,sock=/tmp/myswitch
 @end example
 
-@item -netdev hubport,id=@var{id},hubid=@var{hubid}
+@item -netdev hubport,id=@var{id},hubid=@var{hubid}[,mac-learning=on|off]
 
 Create a hub port on QEMU "vlan" @var{hubid}.
 
+The hub remembers on which port each MAC address was last seen as a source.
+With @option{mac-learning=on}, unicast frames addressed to a MAC address that
+is known to be behind another port are not forwarded to this port; broadcast,
+multicast and frames to unknown addresses still are.  Ports without the option
+keep receiving all the traffic of the hub.
+
 The hubport netdev lets you connect a NIC to a QEMU "vlan" instead of a single
 netdev.  @code{-net} and @code{-device} with parameter @option{vlan} create the
 required hub automatically.
 
-@item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off]
+@item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off][,queues=n]
 
 Establish a vhost-user netdev, backed by a chardev @var{id}. The chardev should
 be a unix domain socket backed one. The vhost-user uses a specifically defined
 protocol to pass vhost ioctl replacement messages to an application on the other
 end of the socket. On non-MSIX guests, the feature can be forced with
-@var{vhostforce}.
+@var{vhostforce}. Use 'queues=@var{n}' to specify the number of queue pairs to
+be created for multiqueue vhost-user; the backend must support at least as many.
+
+If the backend disconnects, the link of the device goes down and the positions
+in the rings are kept, so a backend that connects again (for example through
+a chardev with @option{reconnect}) continues where the old one left off.
 
 Example:
 @example
@@ -2298,6 +2333,12 @@ stalled requests and force a reestablishment of the session. The timeout
 is specified in seconds. The default is 0 which means no timeout. Libiscsi
 1.15.0 or greater is required for this feature.
 
+Since version Qemu 2.5 a LUN can be accessed through several sessions, each
+with a TCP connection of its own, with @option{sessions=n} (at most 16, the
+default is 1).  Reads, writes, flushes and discards are spread over all of
+them; SCSI passthrough commands only use the first session, so that SCSI
+reservations keep working.
+
 Example (without authentication):
 @example
 qemu-system-i386 -iscsi initiator-name=iqn.2001-04.com.example:my-initiator \
@@ -2324,7 +2365,7 @@ DEF("iscsi", HAS_ARG, QEMU_OPTION_iscsi,
     "-iscsi [user=user][,password=password]\n"
     "       [,header-digest=CRC32C|CR32C-NONE|NONE-CRC32C|NONE\n"
     "       [,initiator-name=initiator-iqn][,id=target-iqn]\n"
-    "       [,timeout=timeout]\n"
+    "       [,timeout=timeout][,sessions=n]\n"
     "                iSCSI session parameters\n", QEMU_ARCH_ALL)
 STEXI
 
@@ -2352,6 +2393,18 @@ Example for Unix Domain Sockets
 qemu-system-i386 --drive file=nbd:unix:/tmp/nbd-socket
 @end example
 
+The option @option{connections} opens up to 16 connections to the same
+export and spreads the requests over them, each with its own requests in
+flight.  The server must let the export be shared by several clients,
+e.g. with @option{qemu-nbd --shared=4}.  Reads and writes are split into
+requests of at most @option{max-request-size} bytes, slightly less than
+1 MB by default; servers such as qemu-nbd accept up to 32 MB.
+
+Example for four connections with 32 MB requests
+@example
+qemu-system-i386 --drive driver=nbd,host=192.0.2.1,port=30000,connections=4,max-request-size=32M
+@end example
+
 @item SSH
 QEMU supports SSH (Secure Shell) access to remote disks.
 
@@ -2566,9 +2619,20 @@ DEF("tpmdev", HAS_ARG, QEMU_OPTION_tpmdev, \
     "                use path to provide path to a character device; default is /dev/tpm0\n"
     "                use cancel-path to provide path to TPM's cancel sysfs entry; if\n"
     "                not provided it will be searched for in /sys/class/misc/tpm?/device\n"
-    "-tpmdev cuse-tpm,id=id,path=path\n"
+    "-tpmdev cuse-tpm,id=id,path=path|fd=h[,live-migration=on|off]\n"
+    "                [,response-cache=on|off] [,batch-extend=on|off]\n"
     "                use path to provide path to a character device to talk to the\n"
-    "                TPM emulator providing a CUSE interface\n",
+    "                TPM emulator providing a CUSE interface\n"
+    "                use fd to provide an already opened and initialized CUSE TPM\n"
+    "                use response-cache=on to answer repeated PCR and capability\n"
+    "                reads without sending them to the TPM\n"
+    "                use batch-extend=on to accept batches of TPM2_PCR_Extend\n"
+    "                commands from the guest\n"
+    "                use live-migration=on to send the TPM's permanent state\n"
+    "                while the VM is still running\n"
+    "-tpmdev mux,id=id,path=path,vm-id=name\n"
+    "                use path to provide the UNIX socket of a TPM service that\n"
+    "                provides the TPMs of many VMs; vm-id names the VM's TPM\n",
     QEMU_ARCH_ALL)
 STEXI
 
@@ -2578,7 +2642,7 @@ The general form of a TPM device option is:
 @item -tpmdev @var{backend} ,id=@var{id} [,@var{options}]
 @findex -tpmdev
 Backend type must be either one of the following:
-@option{passthrough}, @option{cuse-tpm}.
+@option{passthrough}, @option{cuse-tpm}, @option{mux}.
 
 The specific backend type will determine the applicable options.
 The @code{-tpmdev} option creates the TPM backend and requires a
@@ -2628,18 +2692,73 @@ To create a passthrough TPM use the following two options:
 Note that the @code{-tpmdev} id is @code{tpm0} and is referenced by
 @code{tpmdev=tpm0} in the device option.
 
-@item -tpmdev cuse-tpm, id=@var{id}, path=@var{path}
+@item -tpmdev cuse-tpm, id=@var{id}, path=@var{path}|fd=@var{h} [,live-migration=on|off] [,response-cache=on|off] [,batch-extend=on|off]
 
 (Linux-host only) Enable access to a TPM emulator with a CUSE interface.
 
 @option{path} specifies the path to the CUSE TPM character device.
 
+@option{fd} specifies the file descriptor of an already opened CUSE TPM
+character device, e.g. of an instance that was spawned ahead of time. The
+TPM must have been initialized already, since it is not initialized again
+for probing.
+
+In either case the TPM is only initialized (powered on) once it is first
+used after a machine reset rather than during the reset itself.
+
+@option{live-migration=on} sends the permanent state of the TPM during the
+live phase of migration, so that only its volatile state, and the permanent
+state if a TPM command may have modified it since, is transferred while the
+VM is stopped. Both the source and the destination need to use the same
+setting. The default is off.
+
+@option{response-cache=on} answers a PCR read or capability query that is
+repeated without any other TPM command in between from a cache rather
+than sending it to the TPM again. Only commands without authorization
+sessions are cached. The default is off.
+
+@option{batch-extend=on} lets a TPM 2 guest submit many TPM2_PCR_Extend
+commands at once with the QEMU vendor command described in
+@file{docs/specs/tpm-batch.txt}. The default is off.
+
 To create a backend device accessing the CUSE TPM emulator using /dev/vtpm
 use the following two options:
 @example
 -tpmdev cuse-tpm,id=tpm0,path=/dev/vtpm -device tpm-tis,tpmdev=tpm0
 @end example
 
+A TPM 2 may also be attached through the CRB (Command Response Buffer)
+interface, which exposes the command and response buffer as guest memory
+and starts a command with a single register write:
+@example
+-tpmdev cuse-tpm,id=tpm0,path=/dev/vtpm -device tpm-crb,tpmdev=tpm0
+@end example
+
+The commands of a @code{tpm-tis} device can be processed in an IOThread
+instead of the main loop. With KVM, the guest's TPM_GO doorbell and the
+completion interrupt then bypass the global mutex as well:
+@example
+-object iothread,id=iothread0
+-tpmdev cuse-tpm,id=tpm0,path=/dev/vtpm
+-device tpm-tis,tpmdev=tpm0,iothread=iothread0
+@end example
+
+@item -tpmdev mux, id=@var{id}, path=@var{path}, vm-id=@var{name}
+
+Use a TPM provided by a service on the host that provides the TPMs of
+many VMs, so that no TPM emulator process needs to run per VM.
+
+@option{path} specifies the UNIX socket the service listens on.
+
+@option{vm-id} identifies the VM towards the service, which keeps the
+state of the TPM of each VM separately. The state is migrated along with
+the VM. The protocol is described in @file{docs/specs/tpm-mux.txt}.
+
+@example
+-tpmdev mux,id=tpm0,path=/run/tpm-mux.sock,vm-id=guest1
+-device tpm-tis,tpmdev=tpm0
+@end example
+
 @end table
 
 ETEXI
@@ -2901,11 +3020,21 @@ Like -qmp but uses pretty JSON formatting.
 ETEXI
 
 DEF("mon", HAS_ARG, QEMU_OPTION_mon, \
-    "-mon [chardev=]name[,mode=readline|control][,default]\n", QEMU_ARCH_ALL)
+    "-mon [chardev=]name[,mode=readline|control][,default][,oob=on|off]\n",
+    QEMU_ARCH_ALL)
 STEXI
-@item -mon [chardev=]name[,mode=readline|control][,default]
+@item -mon [chardev=]name[,mode=readline|control][,default][,oob=on|off]
 @findex -mon
 Setup monitor on chardev @var{name}.
+
+@option{oob=on} makes a QMP monitor read and parse its commands in a
+thread of its own.  The commands that allow out-of-band execution, such as
+@code{query-version} and @code{qmp_capabilities}, are answered there right
+away, even while the main loop is busy; all other commands are queued and
+run in order by the main loop.  As a result responses may come back out of
+order, and clients must tell them apart by their @code{id}.  The greeting
+lists the @code{oob} capability.  Only the fd, pty, udp and socket
+chardevs have reads handled by the thread.
 ETEXI
 
 DEF("debugcon", HAS_ARG, QEMU_OPTION_debugcon, \
@@ -3284,6 +3413,28 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("perfmap", 0, QEMU_OPTION_perfmap, \
+    "-perfmap        write a symbol map of the translated code for perf\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -perfmap
+@findex -perfmap
+Write the address and size of each translation block to
+@file{/tmp/perf-@var{pid}.map}, so that @command{perf report} can attribute
+the time spent in generated code to the guest code it was translated from.
+ETEXI
+
+DEF("tb-stats", 0, QEMU_OPTION_tb_stats, \
+    "-tb-stats       count how often each translation block is executed\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-stats
+@findex -tb-stats
+Count the executions of each translation block and measure how long it took
+to translate it, for the @code{info tbs} monitor command.  This makes the
+generated code slower.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming tcp:[host]:port[,to=maxport][,ipv4][,ipv6]\n" \
     "-incoming rdma:host:port[,ipv4][,ipv6]\n" \
@@ -3292,8 +3443,9 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "                specified protocol and socket address\n" \
     "-incoming fd:fd\n" \
     "-incoming exec:cmdline\n" \
-    "                accept incoming migration on given file descriptor\n" \
-    "                or from given external command\n" \
+    "-incoming file:filename\n" \
+    "                accept incoming migration on given file descriptor,\n" \
+    "                from given external command or from given file\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -3312,6 +3464,10 @@ Accept incoming migration from a given filedescriptor.
 @item -incoming exec:@var{cmdline}
 Accept incoming migration as an output from specified external command.
 
+@item -incoming file:@var{filename}
+Accept incoming migration from a given file, as written by migrating to
+the same file: URI.
+
 @item -incoming defer
 Wait for the URI to be specified via migrate_incoming.  The monitor can
 be used to change settings (such as migration parameters) prior to issuing
@@ -3565,6 +3721,9 @@ the path to either a shared memory or huge page filesystem mount.
 The @option{share} boolean option determines whether the memory
 region is marked as private to QEMU, or shared. The latter allows
 a co-operating external process to access the QEMU memory region.
+With @option{prealloc=on} all of the memory is allocated when the
+object is created; @option{prealloc-threads} sets how many threads
+share that work, and defaults to the number of guest CPUs.
 
 @item -object rng-random,id=@var{id},filename=@var{/dev/random}
 
@@ -3583,6 +3742,58 @@ the @option{virtio-rng} device. The @option{chardev} parameter is
 the unique ID of a character device backend that provides the connection
 to the RNG daemon.
 
+@item -object rng-tpm,id=@var{id},tpmdev=@var{tpmdevid}
+
+Creates a random number generator backend which obtains entropy from
+the TPM backend with the ID @option{tpmdev}. The backend keeps a buffer
+of random bytes, which it fills with TPM GetRandom commands that are
+queued behind the commands of the guest. The TPM backend must support
+this; currently only the passthrough and CUSE TPM backends do.
+
+@item -object iothread,id=@var{id}[,poll-max-ns=@var{ns}][,poll-grow=@var{factor}][,poll-shrink=@var{divisor}][,thread-pool-min=@var{min}][,thread-pool-max=@var{max}][,host-cpus=@var{cpus}][,sched-policy=@var{policy}][,sched-priority=@var{prio}][,node=@var{node}]
+
+Creates an event loop thread that devices can be attached to with their
+@option{iothread} property.
+
+Before it sleeps, the thread busy-waits for up to @option{poll-max-ns}
+nanoseconds (default 32768, 0 disables polling) for requests and
+completions of the devices and images that support it, which saves the
+wakeup latency. The actual polling time adapts itself: it is multiplied
+by @option{poll-grow} while events arrive shortly after it, and divided
+by @option{poll-shrink} when there were none for longer than
+@option{poll-max-ns}; both default to 2.
+
+The blocking I/O of the images used there is
+done by a pool of worker threads of its own, which keeps at least
+@option{thread-pool-min} threads (default 0) and grows to at most
+@option{thread-pool-max} threads (default 64, at most 256).
+
+@option{host-cpus} binds the thread to the given host CPUs; like the
+@option{cpus} of @option{-numa}, it takes a range such as @code{2-3} and
+can be repeated. @option{sched-policy=fifo} runs the thread under the
+SCHED_FIFO real-time policy at priority @option{sched-priority}, which
+usually needs CAP_SYS_NICE. Both can also be changed with @code{qom-set}
+while the thread runs. @code{query-iothreads} reports how much time each
+thread spent sleeping and working, how often it was woken up and how
+many handlers it ran.
+
+@option{node} assigns the thread to a guest NUMA node. With
+@option{-machine numa-pin=on}, an iothread without @option{host-cpus}
+is then bound to the host CPUs of that node's memory at startup; the
+worker threads it starts afterwards inherit the binding.
+
+A virtio-scsi controller can use several of them: besides the first one,
+given with @option{iothread}, more can be listed with the
+@option{iothreads} array property. The command queues are spread over
+them in turn, and so are the LUNs, unless a SCSI disk picks one with its
+own @option{iothread} property:
+
+@example
+-object iothread,id=io0 -object iothread,id=io1
+-device virtio-scsi-pci,id=scsi0,num_queues=4,iothread=io0,len-iothreads=1,iothreads[0]=io1
+-device scsi-hd,bus=scsi0.0,drive=disk0,iothread=io1
+@end example
+
 @end table
 
 ETEXI
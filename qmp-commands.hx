@@ -659,6 +659,28 @@ Example:
 -> { "execute": "migrate_cancel" }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch the current migration to postcopy mode; the x-postcopy-ram
+capability must have been set before starting it.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -816,8 +838,8 @@ EQMP
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:b,protocol:s,begin:i?,end:i?,format:s?",
-        .params     = "-p protocol [begin] [length] [format]",
+        .args_type  = "paging:b,protocol:s,detach:b?,begin:i?,end:i?,format:s?",
+        .params     = "-p protocol [-d] [begin] [length] [format]",
         .help       = "dump guest memory to file",
         .mhandler.cmd_new = qmp_marshal_input_dump_guest_memory,
     },
@@ -833,6 +855,9 @@ Arguments:
 - "paging": do paging to get guest's memory mapping (json-bool)
 - "protocol": destination file(started with "file:") or destination file
               descriptor (started with "fd:") (json-string)
+- "detach": if specified, the dump runs in the background and the command
+            returns at once; the guest stays stopped until the DUMP_COMPLETED
+            event (json-bool)
 - "begin": the starting physical address. It's optional, and should be specified
            with length together (json-int)
 - "length": the memory size, in bytes. It's optional, and should be specified
@@ -850,6 +875,30 @@ Notes:
 
 (1) All boolean arguments default to false
 
+EQMP
+
+    {
+        .name       = "query-dump",
+        .args_type  = "",
+        .params     = "",
+        .help       = "query background dump status",
+        .mhandler.cmd_new = qmp_marshal_input_query_dump,
+    },
+
+SQMP
+query-dump
+----------
+
+Query background dump status.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "query-dump" }
+<- { "return": { "status": "active", "completed": 1024000,
+                 "total": 2048000 } }
+
 EQMP
 
     {
@@ -1003,7 +1052,8 @@ EQMP
 
     {
         .name       = "block-stream",
-        .args_type  = "device:B,base:s?,speed:o?,backing-file:s?,on-error:s?",
+        .args_type  = "device:B,base:s?,speed:o?,backing-file:s?,on-error:s?,"
+                      "max-workers:i?",
         .mhandler.cmd_new = qmp_marshal_input_block_stream,
     },
 
@@ -1035,6 +1085,8 @@ Arguments:
 - "on-error": the action to take on an error (default 'report').  'stop' and
               'enospc' can only be used if the block device supports io-status.
               (json-string, optional) (Since 2.1)
+- "max-workers": the number of copies kept in flight, between 1 and 64
+                 (json-int, optional, default 1)
 
 Example:
 
@@ -1046,7 +1098,8 @@ EQMP
 
     {
         .name       = "block-commit",
-        .args_type  = "device:B,base:s?,top:s?,backing-file:s?,speed:o?",
+        .args_type  = "device:B,base:s?,top:s?,backing-file:s?,speed:o?,"
+                      "max-workers:i?",
         .mhandler.cmd_new = qmp_marshal_input_block_commit,
     },
 
@@ -1097,7 +1150,9 @@ Arguments:
           yourself once the commit operation successfully completes.
           (json-string)
 - "speed":  the maximum speed, in bytes per second (json-int, optional)
-
+- "max-workers": the number of copies kept in flight, between 1 and 64; not
+                 allowed if 'top' is the active layer (json-int, optional,
+                 default 1)
 
 Example:
 
@@ -1110,7 +1165,8 @@ EQMP
     {
         .name       = "drive-backup",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
-                      "bitmap:s?,on-source-error:s?,on-target-error:s?",
+                      "bitmap:s?,on-source-error:s?,on-target-error:s?,"
+                      "max-workers:i?",
         .mhandler.cmd_new = qmp_marshal_input_drive_backup,
     },
 
@@ -1152,6 +1208,9 @@ Arguments:
                      'report' (no limitations, since this applies to
                      a different block device than device).
                      (BlockdevOnError, optional)
+- "max-workers": the number of background copies kept in flight, between 1
+                 and 64; copies for guest writes go first (json-int,
+                 optional, default 1)
 
 Example:
 -> { "execute": "drive-backup", "arguments": { "device": "drive0",
@@ -1164,7 +1223,7 @@ EQMP
     {
         .name       = "blockdev-backup",
         .args_type  = "sync:s,device:B,target:B,speed:i?,"
-                      "on-source-error:s?,on-target-error:s?",
+                      "on-source-error:s?,on-target-error:s?,max-workers:i?",
         .mhandler.cmd_new = qmp_marshal_input_blockdev_backup,
     },
 
@@ -1193,6 +1252,9 @@ Arguments:
                      'report' (no limitations, since this applies to
                      a different block device than device).
                      (BlockdevOnError, optional)
+- "max-workers": the number of background copies kept in flight, between 1
+                 and 64; copies for guest writes go first (json-int,
+                 optional, default 1)
 
 Example:
 -> { "execute": "blockdev-backup", "arguments": { "device": "src-id",
@@ -1309,7 +1371,7 @@ EQMP
 
     {
         .name       = "block-dirty-bitmap-add",
-        .args_type  = "node:B,name:s,granularity:i?",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
         .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
     },
 
@@ -1326,6 +1388,9 @@ Arguments:
 - "node": device/node on which to create dirty bitmap (json-string)
 - "name": name of the new dirty bitmap (json-string)
 - "granularity": granularity to track writes with (int, optional)
+- "persistent": store the bitmap in the image when it is closed, and load it
+                again when it is opened (json-bool, optional, default false;
+                qcow2 version 3 only)
 
 Example:
 
@@ -1503,7 +1568,7 @@ EQMP
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
                       "node-name:s?,replaces:s?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "unmap:b?,"
+                      "unmap:b?,copy-mode:s?,"
                       "granularity:i?,buf-size:i?",
         .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
     },
@@ -1545,12 +1610,19 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "unmap": whether the target sectors should be discarded where source has only
   zeroes. (json-bool, optional, default true)
+- "copy-mode": "write-blocking" to copy guest writes to the target before
+  they complete, or "background" to leave them to the background copy
+  (MirrorCopyMode, optional, default 'background')
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
 does not define a cluster size, the default value of the granularity
 is 65536.
 
+The number of requests in flight is adjusted to the latency of the copy,
+within the limits of buf_size.  Zeroes and unallocated areas of the source
+neither take buffer space nor are read.
+
 
 Example:
 
@@ -1902,6 +1974,47 @@ Example:
                                                "iops_size": 0 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:q?,boundaries-read:q?,"
+                      "boundaries-write:q?,boundaries-flush:q?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Set up, reset or remove the latency histograms of a block device. The
+histograms are reported by query-blockstats.
+
+Arguments:
+
+- "device": device name or node name (json-string)
+- "boundaries": interval boundaries in nanoseconds for all the histograms
+                whose boundaries are not given separately (json-array of
+                json-int, optional)
+- "boundaries-read": interval boundaries of the read histogram
+                     (json-array of json-int, optional)
+- "boundaries-write": interval boundaries of the write histogram
+                      (json-array of json-int, optional)
+- "boundaries-flush": interval boundaries of the flush histogram
+                      (json-array of json-int, optional)
+
+The boundaries must be greater than zero and in ascending order; the
+boundaries [10, 50, 100] give the intervals [0, 10), [10, 50), [50, 100) and
+[100, +inf). Each histogram that is set starts from zero. Without any
+boundaries, all the histograms of the device are removed.
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "drive0",
+                    "boundaries": [ 100000, 1000000, 10000000 ] } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1987,6 +2100,7 @@ EQMP
         .params     = "",
         .help       = "enable QMP capabilities",
         .mhandler.cmd_new = qmp_capabilities,
+        .allow_oob  = true,
     },
 
 SQMP
@@ -2089,6 +2203,7 @@ EQMP
         .name       = "query-version",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_version,
+        .allow_oob  = true,
     },
 
 SQMP
@@ -2126,6 +2241,7 @@ EQMP
         .name       = "query-commands",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_commands,
+        .allow_oob  = true,
     },
 
 SQMP
@@ -2462,10 +2578,66 @@ Each json-object contain the following:
                    another request (json-int)
     - "wr_merged": number of write requests that have been merged into
                    another request (json-int)
+    - "idle_time_ns": time since the last I/O operation completed, in
+                      nanoseconds; absent if there haven't been any operations
+                      yet (json-int, optional)
+    - "timed_stats": A json-array containing statistics collected in
+                     specific intervals, as set up with the stats-intervals
+                     drive option, with the following members:
+        - "interval_length": interval used for calculating the
+                             statistics, in seconds (json-int)
+        - "min_rd_latency_ns": minimum latency of read operations in
+                               the defined interval, in nanoseconds
+                               (json-int)
+        - "min_wr_latency_ns": minimum latency of write operations in
+                               the defined interval, in nanoseconds
+                               (json-int)
+        - "min_flush_latency_ns": minimum latency of flush operations
+                                  in the defined interval, in
+                                  nanoseconds (json-int)
+        - "max_rd_latency_ns": maximum latency of read operations in
+                               the defined interval, in nanoseconds
+                               (json-int)
+        - "max_wr_latency_ns": maximum latency of write operations in
+                               the defined interval, in nanoseconds
+                               (json-int)
+        - "max_flush_latency_ns": maximum latency of flush operations
+                                  in the defined interval, in
+                                  nanoseconds (json-int)
+        - "avg_rd_latency_ns": average latency of read operations in
+                               the defined interval, in nanoseconds
+                               (json-int)
+        - "avg_wr_latency_ns": average latency of write operations in
+                               the defined interval, in nanoseconds
+                               (json-int)
+        - "avg_flush_latency_ns": average latency of flush operations
+                                  in the defined interval, in
+                                  nanoseconds (json-int)
+        - "avg_rd_queue_depth": average number of pending read
+                                operations in the defined interval
+                                (json-number)
+        - "avg_wr_queue_depth": average number of pending write
+                                operations in the defined interval
+                                (json-number)
+        - "avg_flush_queue_depth": average number of pending flush
+                                   operations in the defined interval
+                                   (json-number)
+    - "rd_latency_histogram", "wr_latency_histogram",
+      "flush_latency_histogram": latency histograms set up with
+                                 block-latency-histogram-set, each with
+                                 the "boundaries" of its intervals and
+                                 the request counts of its "bins"
+                                 (json-object, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
             (json-object, optional)
+- "driver-specific": Statistics specific to the format driver, in a
+                     json-object with a "type" key that names the driver.
+                     For qcow2, "data" holds "l2-cache" and "refcount-cache",
+                     each with the "hits", "misses", "entries" and
+                     "entry-size" of the metadata cache (json-object,
+                     optional)
 
 Example:
 
@@ -2500,7 +2672,9 @@ Example:
                "rd_total_times_ns":3465673657
                "flush_total_times_ns":49653,
                "rd_merged":0,
-               "wr_merged":0
+               "wr_merged":0,
+               "idle_time_ns":2953431879,
+               "timed_stats":[]
             }
          },
          {
@@ -2627,6 +2801,16 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum polling time in ns, 0 if polling is disabled (json-int)
+- "poll-grow": polling time growth factor, 0 for the default (json-int)
+- "poll-shrink": polling time shrink divisor, 0 for the default (json-int)
+- "poll-attempts": number of times the thread polled before sleeping (json-int)
+- "poll-successes": number of those polls that found an event (json-int)
+- "idle-ns": time in ns that the thread spent sleeping (json-int)
+- "busy-ns": time in ns that the thread spent polling and running handlers
+             (json-int)
+- "wakeups": number of times the thread was woken up by an event (json-int)
+- "dispatched": number of fd handlers that the thread called (json-int)
 
 Example:
 
@@ -2635,11 +2819,29 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-attempts":1520,
+            "poll-successes":1306,
+            "idle-ns":2403712800,
+            "busy-ns":97012540,
+            "wakeups":214,
+            "dispatched":1733
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":0,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-attempts":0,
+            "poll-successes":0,
+            "idle-ns":2500118413,
+            "busy-ns":1317921,
+            "wakeups":3,
+            "dispatched":3
          }
       ]
    }
@@ -3144,6 +3346,7 @@ EQMP
         .name       = "query-name",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_name,
+        .allow_oob  = true,
     },
 
 SQMP
@@ -3167,6 +3370,7 @@ EQMP
         .name       = "query-uuid",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_uuid,
+        .allow_oob  = true,
     },
 
 SQMP
@@ -3231,7 +3435,8 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "setup", "active", "completed", "failed", "cancelled"
+     - Possible values: "setup", "active", "postcopy-active", "completed",
+       "failed", "cancelled"
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
                 time (json-int)
@@ -3246,6 +3451,9 @@ The main json-object contains the following:
 - "expected-downtime": only present while migration is active
                 total amount in ms for downtime that was calculated on
                 the last bitmap round (json-int)
+- "cpu-throttle-percentage": only present while auto-converge throttles
+                the vCPUs, the percentage of time they are kept from
+                running (json-int)
 - "ram": only present if "status" is "active", it is a json-object with the
   following RAM information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3262,6 +3470,15 @@ The main json-object contains the following:
             but this way upper levels don't need to care about page
             size (json-int)
          - "dirty-sync-count": times that dirty ram was synchronized (json-int)
+         - "dirty-sync-log-time": microseconds that the last synchronization
+            took to fetch the dirty logs (json-int)
+         - "dirty-sync-merge-time": microseconds that the last synchronization
+            took to merge them into the migration bitmap (json-int)
+         - "redirtied-pages": pages that had to be sent again because the
+            guest wrote them after they were sent (json-int)
+         - "hot-pages": pages that the last synchronization found written
+            again after they were sent; they go after the other dirty
+            pages of each round (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3278,6 +3495,7 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+         - "overflow-pages": number of cached pages that overflowed
 
 Examples:
 
@@ -3301,7 +3519,11 @@ Examples:
           "duplicate":123,
           "normal":123,
           "normal-bytes":123456,
-          "dirty-sync-count":15
+          "dirty-sync-count":15,
+          "dirty-sync-log-time":1250,
+          "dirty-sync-merge-time":830,
+          "redirtied-pages":1024,
+          "hot-pages":96
         }
      }
    }
@@ -3327,7 +3549,11 @@ Examples:
             "duplicate":123,
             "normal":123,
             "normal-bytes":123456,
-            "dirty-sync-count":15
+            "dirty-sync-count":15,
+            "dirty-sync-log-time":1250,
+            "dirty-sync-merge-time":830,
+            "redirtied-pages":1024,
+            "hot-pages":96
          }
       }
    }
@@ -3348,7 +3574,11 @@ Examples:
             "duplicate":123,
             "normal":123,
             "normal-bytes":123456,
-            "dirty-sync-count":15
+            "dirty-sync-count":15,
+            "dirty-sync-log-time":1250,
+            "dirty-sync-merge-time":830,
+            "redirtied-pages":1024,
+            "hot-pages":96
          },
          "disk":{
             "total":20971520,
@@ -3375,7 +3605,11 @@ Examples:
             "duplicate":10,
             "normal":3333,
             "normal-bytes":3412992,
-            "dirty-sync-count":15
+            "dirty-sync-count":15,
+            "dirty-sync-log-time":1250,
+            "dirty-sync-merge-time":830,
+            "redirtied-pages":1024,
+            "hot-pages":96
          },
          "xbzrle-cache":{
             "cache-size":67108864,
@@ -3383,7 +3617,8 @@ Examples:
             "pages":2444343,
             "cache-miss":2244,
             "cache-miss-rate":0.123,
-            "overflow":34434
+            "overflow":34434,
+            "overflow-pages":1290
          }
       }
    }
@@ -3407,6 +3642,12 @@ Enable/Disable migration capabilities
 - "auto-converge": throttle down guest to help convergence of migration
 - "zero-blocks": compress zero blocks during block migration
 - "events": generate events for each migration state change
+- "multifd": send RAM pages over several connections
+- "x-postcopy-ram": run the VM on the destination before all of RAM has
+  been migrated
+- "zero-copy-send": send RAM pages without copying them (tcp only)
+- "mapped-ram": write RAM pages at fixed offsets of the file (file only)
+- "live-vmstate": send large device state buffers before the VM stops
 
 Arguments:
 
@@ -3459,6 +3700,13 @@ Set migration parameters
 - "compress-level": set compression level during migration (json-int)
 - "compress-threads": set compression thread count for migration (json-int)
 - "decompress-threads": set decompression thread count for migration (json-int)
+- "multifd-channels": set the number of multifd connections (json-int)
+- "compress-method": set the compression method, one of "zlib", "lz4" or
+                     "zstd" (json-string)
+- "cpu-throttle-initial": set the most the vCPUs are throttled by when
+                          auto-converge starts, in percent (json-int)
+- "cpu-throttle-increment": set the most the throttling grows by each
+                            round, in percentage points (json-int)
 
 Arguments:
 
@@ -3472,7 +3720,9 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,"
+            "multifd-channels:i?,compress-method:s?,"
+            "cpu-throttle-initial:i?,cpu-throttle-increment:i?",
 	.mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
     },
 SQMP
@@ -3485,6 +3735,10 @@ Query current migration parameters
          - "compress-level" : compression level value (json-int)
          - "compress-threads" : compression thread count value (json-int)
          - "decompress-threads" : decompression thread count value (json-int)
+         - "multifd-channels" : number of multifd connections (json-int)
+         - "compress-method" : compression method (json-string)
+         - "cpu-throttle-initial" : initial throttling percentage (json-int)
+         - "cpu-throttle-increment" : throttling increment (json-int)
 
 Arguments:
 
@@ -3493,6 +3747,10 @@ Example:
 -> { "execute": "query-migrate-parameters" }
 <- {
       "return": {
+         "cpu-throttle-increment", 10,
+         "cpu-throttle-initial", 20,
+         "compress-method", "zlib",
+         "multifd-channels", 2,
          "decompress-threads", 2,
          "compress-threads", 8,
          "compress-level", 1
@@ -3566,7 +3824,7 @@ EQMP
     },
     {
         .name       = "nbd-server-add",
-        .args_type  = "device:B,writable:b?",
+        .args_type  = "device:B,writable:b?,bitmap:s?",
         .mhandler.cmd_new = qmp_marshal_input_nbd_server_add,
     },
     {
@@ -3637,6 +3895,17 @@ Example:
                  "path": "/dev/tpm0"
                }
            },
+         "queue-depth": [0, 0, 0, 0, 0],
+         "commands": [
+           { "ordinal": 101, "count": 2, "bytes-in": 44, "bytes-out": 60,
+             "queue-histogram": [2, 0, 0, 0, 0, 0, 0, 0,
+                                 0, 0, 0, 0, 0, 0, 0, 0],
+             "exec-histogram": [0, 0, 0, 0, 0, 0, 0, 0,
+                                2, 0, 0, 0, 0, 0, 0, 0],
+             "fetch-histogram": [0, 0, 0, 0, 0, 2, 0, 0,
+                                 0, 0, 0, 0, 0, 0, 0, 0]
+           }
+         ],
          "id": "tpm0"
        }
      ]
@@ -3969,6 +4238,95 @@ Example (1):
      ]
    }
 
+EQMP
+
+    {
+        .name       = "query-numa-placement",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_numa_placement,
+    },
+
+SQMP
+query-numa-placement
+--------------------
+
+Show where the threads of each guest NUMA node run on the host.
+
+Each node is a json-object with the following:
+
+- "node": guest NUMA node (json-int)
+- "host-nodes": host nodes of the node's memory backend (json-array of
+                json-int)
+- "host-cpus": host CPUs of those nodes, if "pinned" (json-array of json-int)
+- "pinned": whether the node's vCPU threads and iothreads are bound to
+            "host-cpus", which needs -machine numa-pin=on (json-bool)
+- "vcpus": indexes of the node's vCPUs (json-array of json-int)
+- "iothreads": ids of the iothreads assigned to the node (json-array of
+               json-string)
+
+Example:
+
+-> { "execute": "query-numa-placement" }
+<- { "return": [
+       {
+         "node": 0,
+         "host-nodes": [0],
+         "host-cpus": [0, 1, 2, 3],
+         "pinned": true,
+         "vcpus": [0, 1],
+         "iothreads": ["iothread0"]
+       },
+       {
+         "node": 1,
+         "host-nodes": [1],
+         "host-cpus": [4, 5, 6, 7],
+         "pinned": true,
+         "vcpus": [2, 3],
+         "iothreads": []
+       }
+     ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-memory-usage",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_memory_usage,
+    },
+
+SQMP
+query-memory-usage
+------------------
+
+Show the memory allocated by the subsystems that account for it.  Guest RAM
+is not included.
+
+Each subsystem is a json-object with the following:
+
+- "subsystem": one of "qcow2-cache", "coroutine-stack", "virtio-request",
+               "bounce-buffer", "tcg-code-buffer", "xbzrle-cache", "vnc" or
+               "tpm" (json-string)
+- "bytes": size of its allocations (json-int)
+- "allocations": number of its allocations (json-int)
+
+Example:
+
+-> { "execute": "query-memory-usage" }
+<- { "return": [
+       { "subsystem": "qcow2-cache", "bytes": 1179648, "allocations": 2 },
+       { "subsystem": "coroutine-stack", "bytes": 67108864,
+         "allocations": 64 },
+       { "subsystem": "virtio-request", "bytes": 3194880,
+         "allocations": 65 },
+       { "subsystem": "bounce-buffer", "bytes": 0, "allocations": 0 },
+       { "subsystem": "tcg-code-buffer", "bytes": 0, "allocations": 0 },
+       { "subsystem": "xbzrle-cache", "bytes": 0, "allocations": 0 },
+       { "subsystem": "vnc", "bytes": 36864, "allocations": 4 },
+       { "subsystem": "tpm", "bytes": 0, "allocations": 0 }
+     ]
+   }
+
 EQMP
 
     {
@@ -4076,6 +4434,114 @@ Example:
 
 -> { "execute": "trace-event-set-state", "arguments": { "name": "qemu_memalign", "enable": "true" } }
 <- { "return": {} }
+EQMP
+
+    {
+        .name       = "query-flight-recorder",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_flight_recorder,
+    },
+
+SQMP
+query-flight-recorder
+---------------------
+
+Dump the flight recorder.  Each thread keeps its last 256 events at the
+points where QEMU can hold up the guest: "main_loop_busy",
+"qemu_mutex_lock_iothread_wait", "bdrv_drain_all", "tb_flush" and
+"tpm_passthrough_exec".  The value of these events is a duration in
+nanoseconds.
+
+Return a json-object with the following:
+
+- "frozen": whether a trigger froze the recorder (json-bool)
+- "trigger": what froze it, if "frozen" (json-object, optional)
+  - "trigger": "main-loop" or "bql-wait" (json-string)
+  - "thread-id": host thread ID that exceeded the threshold (json-int)
+  - "duration": duration in nanoseconds that exceeded it (json-int)
+  - "timestamp": when the recorder was frozen (json-int)
+- "main-loop-threshold": threshold of the main-loop trigger in nanoseconds,
+                         0 if disabled (json-int)
+- "bql-wait-threshold": threshold of the bql-wait trigger in nanoseconds,
+                        0 if disabled (json-int)
+- "threads": json-array of json-objects with the following:
+  - "thread-id": host thread ID (json-int)
+  - "events": json-array of the thread's events, oldest first, each with
+              "timestamp" (json-int), "event" (json-string) and "value"
+              (json-int)
+
+Timestamps are in nanoseconds of the host's monotonic clock.
+
+Example:
+
+-> { "execute": "query-flight-recorder" }
+<- { "return": {
+       "frozen": true,
+       "trigger": { "trigger": "bql-wait", "thread-id": 3135,
+                    "duration": 212003611, "timestamp": 91420377024066 },
+       "main-loop-threshold": 0,
+       "bql-wait-threshold": 100000000,
+       "threads": [
+         { "thread-id": 3135,
+           "events": [
+             { "timestamp": 91420164982130,
+               "event": "qemu_mutex_lock_iothread_wait", "value": 1706 },
+             { "timestamp": 91420377023652,
+               "event": "qemu_mutex_lock_iothread_wait",
+               "value": 212003611 } ] },
+         { "thread-id": 3130,
+           "events": [
+             { "timestamp": 91420376998735,
+               "event": "bdrv_drain_all", "value": 211975344 },
+             { "timestamp": 91420377017460,
+               "event": "main_loop_busy", "value": 212035005 } ] } ] } }
+
+EQMP
+
+    {
+        .name       = "flight-recorder-reset",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_flight_recorder_reset,
+    },
+
+SQMP
+flight-recorder-reset
+---------------------
+
+Clear the flight recorder and unfreeze it.
+
+Example:
+
+-> { "execute": "flight-recorder-reset" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "flight-recorder-set-threshold",
+        .args_type  = "trigger:s,threshold:l",
+        .mhandler.cmd_new = qmp_marshal_input_flight_recorder_set_threshold,
+    },
+
+SQMP
+flight-recorder-set-threshold
+-----------------------------
+
+Set the threshold above which a trigger freezes the flight recorder.  All
+triggers are disabled by default.
+
+Arguments:
+
+- "trigger": "main-loop" for main loop iterations, "bql-wait" for vCPU
+             threads waiting for the global mutex (json-string)
+- "threshold": threshold in nanoseconds, 0 to disable the trigger (json-int)
+
+Example:
+
+-> { "execute": "flight-recorder-set-threshold",
+     "arguments": { "trigger": "bql-wait", "threshold": 100000000 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -32,6 +32,8 @@
 #include "qom/object_interfaces.h"
 #include "hw/mem/pc-dimm.h"
 #include "hw/acpi/acpi_dev_interface.h"
+#include "sysemu/dump-arch.h"
+#include "qemu/mem-usage.h"
 
 NameInfo *qmp_query_name(Error **errp)
 {
@@ -171,6 +173,10 @@ void qmp_cont(Error **errp)
         return;
     } else if (runstate_check(RUN_STATE_SUSPENDED)) {
         return;
+    } else if (dump_in_progress()) {
+        /* the dump would no longer be a consistent image of the guest */
+        error_setg(errp, "There is a dump in process, please wait");
+        return;
     }
 
     for (bs = bdrv_next(NULL); bs; bs = bdrv_next(bs)) {
@@ -734,3 +740,8 @@ ACPIOSTInfoList *qmp_query_acpi_ospm_status(Error **errp)
 
     return head;
 }
+
+MemoryUsageInfoList *qmp_query_memory_usage(Error **errp)
+{
+    return qemu_mem_usage_query();
+}
@@ -341,6 +341,7 @@ void object_initialize_with_type(void *data, size_t size, TypeImpl *type)
     obj->class = type->class;
     object_ref(obj);
     QTAILQ_INIT(&obj->properties);
+    obj->property_table = g_hash_table_new(g_str_hash, g_str_equal);
     object_init_with_type(obj, type);
     object_post_init_with_type(obj, type);
 }
@@ -363,6 +364,7 @@ static void object_property_del_all(Object *obj)
         ObjectProperty *prop = QTAILQ_FIRST(&obj->properties);
 
         QTAILQ_REMOVE(&obj->properties, prop, node);
+        g_hash_table_remove(obj->property_table, prop->name);
 
         if (prop->release) {
             prop->release(obj, prop->name, prop->opaque);
@@ -412,6 +414,8 @@ static void object_finalize(void *data)
 
     object_property_del_all(obj);
     object_deinit(obj, ti);
+    g_hash_table_destroy(obj->property_table);
+    obj->property_table = NULL;
 
     g_assert(obj->ref == 0);
     if (obj->free) {
@@ -860,13 +864,11 @@ object_property_add(Object *obj, const char *name, const char *type,
         return ret;
     }
 
-    QTAILQ_FOREACH(prop, &obj->properties, node) {
-        if (strcmp(prop->name, name) == 0) {
-            error_setg(errp, "attempt to add duplicate property '%s'"
-                       " to object (type '%s')", name,
-                       object_get_typename(obj));
-            return NULL;
-        }
+    if (g_hash_table_lookup(obj->property_table, name)) {
+        error_setg(errp, "attempt to add duplicate property '%s'"
+                   " to object (type '%s')", name,
+                   object_get_typename(obj));
+        return NULL;
     }
 
     prop = g_malloc0(sizeof(*prop));
@@ -880,6 +882,7 @@ object_property_add(Object *obj, const char *name, const char *type,
     prop->opaque = opaque;
 
     QTAILQ_INSERT_TAIL(&obj->properties, prop, node);
+    g_hash_table_insert(obj->property_table, prop->name, prop);
     return prop;
 }
 
@@ -888,10 +891,9 @@ ObjectProperty *object_property_find(Object *obj, const char *name,
 {
     ObjectProperty *prop;
 
-    QTAILQ_FOREACH(prop, &obj->properties, node) {
-        if (strcmp(prop->name, name) == 0) {
-            return prop;
-        }
+    prop = g_hash_table_lookup(obj->property_table, name);
+    if (prop) {
+        return prop;
     }
 
     error_setg(errp, "Property '.%s' not found", name);
@@ -910,6 +912,7 @@ void object_property_del(Object *obj, const char *name, Error **errp)
     }
 
     QTAILQ_REMOVE(&obj->properties, prop, node);
+    g_hash_table_remove(obj->property_table, prop->name);
 
     g_free(prop->name);
     g_free(prop->type);
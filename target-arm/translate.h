@@ -112,6 +112,10 @@ static inline int default_exception_el(DisasContext *s)
 #define DISAS_HVC 8
 #define DISAS_SMC 9
 #define DISAS_YIELD 10
+/* Like DISAS_JUMP, but the CPU state may have changed as well (e.g. an
+ * exception return), so the A64 decoder must go back to the main loop
+ */
+#define DISAS_EXIT 11
 
 #ifdef TARGET_AARCH64
 void a64_translate_init(void);
@@ -2545,8 +2545,8 @@ static void gen_debug(DisasContext *s, target_ulong cur_eip)
 }
 
 /* generate a generic end of block. Trace exception is also generated
-   if needed */
-static void gen_eob(DisasContext *s)
+   if needed.  If 'jr', the next TB is looked up from generated code. */
+static void gen_eob_worker(DisasContext *s, bool jr)
 {
     gen_update_cc_op(s);
     if (s->tb->flags & HF_INHIBIT_IRQ_MASK) {
@@ -2559,12 +2559,28 @@ static void gen_eob(DisasContext *s)
         gen_helper_debug(cpu_env);
     } else if (s->tf) {
         gen_helper_single_step(cpu_env);
+    } else if (jr && !(s->tb->flags & HF_INHIBIT_IRQ_MASK)) {
+        /* with the interrupt shadow just over, interrupts must be
+           checked in the main loop */
+        tcg_gen_lookup_and_goto_ptr(cpu_env);
     } else {
         tcg_gen_exit_tb(0);
     }
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+static void gen_eob(DisasContext *s)
+{
+    gen_eob_worker(s, false);
+}
+
+/* End of block after an indirect jump, call or return; only EIP has
+   changed, so there is no need to go back to the main loop. */
+static void gen_jr(DisasContext *s)
+{
+    gen_eob_worker(s, true);
+}
+
 /* generate a jump to eip. No segment change must happen before as a
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
@@ -4388,6 +4404,39 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt = (SSEFunc_0_eppt)sse_fn_epp;
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
+        /* Simple logic and arithmetic is expanded inline.  */
+        case 0x54: /* andps, andpd */
+        case 0xdb: /* pand */
+            tcg_gen_gvec_and(cpu_env, op1_offset, op1_offset, op2_offset,
+                             is_xmm ? 16 : 8);
+            break;
+        case 0x55: /* andnps, andnpd */
+        case 0xdf: /* pandn */
+            tcg_gen_gvec_andc(cpu_env, op1_offset, op2_offset, op1_offset,
+                              is_xmm ? 16 : 8);
+            break;
+        case 0x56: /* orps, orpd */
+        case 0xeb: /* por */
+            tcg_gen_gvec_or(cpu_env, op1_offset, op1_offset, op2_offset,
+                            is_xmm ? 16 : 8);
+            break;
+        case 0x57: /* xorps, xorpd */
+        case 0xef: /* pxor */
+            tcg_gen_gvec_xor(cpu_env, op1_offset, op1_offset, op2_offset,
+                             is_xmm ? 16 : 8);
+            break;
+        case 0xfc ... 0xfe: /* paddb, paddw, paddl */
+            tcg_gen_gvec_add(b - 0xfc, cpu_env, op1_offset, op1_offset,
+                             op2_offset, is_xmm ? 16 : 8);
+            break;
+        case 0xd4: /* paddq */
+            tcg_gen_gvec_add(MO_64, cpu_env, op1_offset, op1_offset,
+                             op2_offset, is_xmm ? 16 : 8);
+            break;
+        case 0xf8 ... 0xfb: /* psubb, psubw, psubl, psubq */
+            tcg_gen_gvec_sub(b - 0xf8, cpu_env, op1_offset, op1_offset,
+                             op2_offset, is_xmm ? 16 : 8);
+            break;
         default:
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
@@ -4944,7 +4993,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tcg_gen_movi_tl(cpu_T[1], next_eip);
             gen_push_v(s, cpu_T[1]);
             gen_op_jmp_v(cpu_T[0]);
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 3: /* lcall Ev */
             gen_op_ld_v(s, ot, cpu_T[1], cpu_A0);
@@ -4971,7 +5020,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 tcg_gen_ext16u_tl(cpu_T[0], cpu_T[0]);
             }
             gen_op_jmp_v(cpu_T[0]);
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 5: /* ljmp Ev */
             gen_op_ld_v(s, ot, cpu_T[1], cpu_A0);
@@ -6390,14 +6439,14 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         gen_stack_update(s, val + (1 << ot));
         /* Note that gen_pop_T0 uses a zero-extending load.  */
         gen_op_jmp_v(cpu_T[0]);
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xc3: /* ret */
         ot = gen_pop_T0(s);
         gen_pop_update(s, ot);
         /* Note that gen_pop_T0 uses a zero-extending load.  */
         gen_op_jmp_v(cpu_T[0]);
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xca: /* lret im */
         val = cpu_ldsw_code(env, s->pc);
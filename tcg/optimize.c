@@ -29,6 +29,7 @@
 #include <stdio.h>
 
 #include "qemu-common.h"
+#include "qemu/log.h"
 #include "tcg-op.h"
 
 #define CASE_OP_32_64(x)                        \
@@ -46,7 +47,8 @@ struct tcg_temp_info {
     uint16_t prev_copy;
     uint16_t next_copy;
     tcg_target_ulong val;
-    tcg_target_ulong mask;
+    tcg_target_ulong mask;      /* bits that may be set */
+    tcg_target_ulong ones;      /* bits that are known to be set */
 };
 
 static struct tcg_temp_info temps[TCG_MAX_TEMPS];
@@ -65,6 +67,7 @@ static void reset_temp(TCGArg temp)
     }
     temps[temp].state = TCG_TEMP_UNDEF;
     temps[temp].mask = -1;
+    temps[temp].ones = 0;
 }
 
 static TCGOp *insert_op_before(TCGContext *s, TCGOp *old_op,
@@ -105,6 +108,7 @@ static void reset_all_temps(int nb_temps)
     for (i = 0; i < nb_temps; i++) {
         temps[i].state = TCG_TEMP_UNDEF;
         temps[i].mask = -1;
+        temps[i].ones = 0;
     }
 }
 
@@ -197,7 +201,7 @@ static void tcg_opt_gen_movi(TCGContext *s, TCGOp *op, TCGArg *args,
                              TCGArg dst, TCGArg val)
 {
     TCGOpcode new_op = op_to_movi(op->opc);
-    tcg_target_ulong mask;
+    tcg_target_ulong mask, ones;
 
     op->opc = new_op;
 
@@ -205,11 +209,14 @@ static void tcg_opt_gen_movi(TCGContext *s, TCGOp *op, TCGArg *args,
     temps[dst].state = TCG_TEMP_CONST;
     temps[dst].val = val;
     mask = val;
+    ones = val;
     if (TCG_TARGET_REG_BITS > 32 && new_op == INDEX_op_movi_i32) {
         /* High bits of the destination are now garbage.  */
         mask |= ~0xffffffffull;
+        ones &= 0xffffffffull;
     }
     temps[dst].mask = mask;
+    temps[dst].ones = ones;
 
     args[0] = dst;
     args[1] = val;
@@ -229,17 +236,20 @@ static void tcg_opt_gen_mov(TCGContext *s, TCGOp *op, TCGArg *args,
     }
 
     TCGOpcode new_op = op_to_mov(op->opc);
-    tcg_target_ulong mask;
+    tcg_target_ulong mask, ones;
 
     op->opc = new_op;
 
     reset_temp(dst);
     mask = temps[src].mask;
+    ones = temps[src].ones;
     if (TCG_TARGET_REG_BITS > 32 && new_op == INDEX_op_mov_i32) {
         /* High bits of the destination are now garbage.  */
         mask |= ~0xffffffffull;
+        ones &= 0xffffffffull;
     }
     temps[dst].mask = mask;
+    temps[dst].ones = ones;
 
     assert(temps[src].state != TCG_TEMP_CONST);
 
@@ -492,12 +502,24 @@ static TCGArg do_constant_folding_cond(TCGOpcode op, TCGArg x,
         }
     } else if (temps_are_copies(x, y)) {
         return do_constant_folding_cond_eq(c);
-    } else if (temps[y].state == TCG_TEMP_CONST && temps[y].val == 0) {
+    } else if (temps[y].state == TCG_TEMP_CONST) {
+        tcg_target_ulong yv = temps[y].val;
+        tcg_target_ulong differ;
+
+        /* Known-one bits of X clear in Y, or known-zero bits set in Y */
+        differ = (temps[x].ones & ~yv) | (~temps[x].mask & yv);
+        if (op_bits(op) == 32) {
+            differ &= 0xffffffffu;
+        }
         switch (c) {
+        case TCG_COND_EQ:
+            return differ ? 0 : 2;
+        case TCG_COND_NE:
+            return differ ? 1 : 2;
         case TCG_COND_LTU:
-            return 0;
+            return yv == 0 ? 0 : 2;
         case TCG_COND_GEU:
-            return 1;
+            return yv == 0 ? 1 : 2;
         default:
             return 2;
         }
@@ -573,10 +595,259 @@ static bool swap_commutative2(TCGArg *p1, TCGArg *p2)
     return false;
 }
 
-/* Propagate constants and copies, fold constant expressions. */
+/* What the optimizer did to the current TB, for -d op_opt */
+static struct {
+    int known_bits;
+    int loads_forwarded;
+    int stores_removed;
+} opt_stats;
+
+/* Tracking of the CPU state, i.e. of memory accessed with ld/st at a
+   constant offset from env, within a basic block.
+
+   MEM_VALS lists the temps that hold the contents of some CPU state field:
+   a load from the field can be replaced by a move from the temp, and a
+   store of the temp to the field is a no-op.  MEM_STORES lists the stores
+   to the CPU state that nothing has looked at yet: if they are
+   overwritten before anything looks, they are dead.
+
+   Anything that may read or write the CPU state behind our back (helpers,
+   guest memory accesses, which may fault or go to a device, and ld/st with
+   any other base) ends tracking, as does the end of the basic block.  */
+#define MAX_MEM_INFO 16
+
+typedef struct {
+    tcg_target_long ofs;
+    int size;
+    TCGOpcode ld_opc;           /* load that reads back TEMP as is */
+    TCGArg temp;
+} MemVal;
+
+typedef struct {
+    tcg_target_long ofs;
+    int size;
+    TCGOp *op;
+} MemStore;
+
+static MemVal mem_vals[MAX_MEM_INFO];
+static MemStore mem_stores[MAX_MEM_INFO];
+static int nb_mem_vals, nb_mem_stores;
+static TCGArg env_temp;
+
+static int ldst_size(TCGOpcode opc)
+{
+    switch (opc) {
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld8s):
+    CASE_OP_32_64(st8):
+        return 1;
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(ld16s):
+    CASE_OP_32_64(st16):
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static bool is_ld(TCGOpcode opc)
+{
+    switch (opc) {
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld8s):
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(ld16s):
+    case INDEX_op_ld_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_ld_i64:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* The load that reads back the value of a store whole, if any */
+static TCGOpcode st_to_ld(TCGOpcode opc)
+{
+    switch (opc) {
+    case INDEX_op_st_i32:
+        return INDEX_op_ld_i32;
+    case INDEX_op_st_i64:
+        return INDEX_op_ld_i64;
+    default:
+        return INDEX_op_discard;
+    }
+}
+
+static bool mem_overlap(tcg_target_long ofs1, int size1,
+                        tcg_target_long ofs2, int size2)
+{
+    return ofs1 < ofs2 + size2 && ofs2 < ofs1 + size1;
+}
+
+static void mem_reset(void)
+{
+    nb_mem_vals = 0;
+    nb_mem_stores = 0;
+}
+
+/* TEMP is being overwritten */
+static void mem_forget_temp(TCGArg temp)
+{
+    int i;
+
+    for (i = 0; i < nb_mem_vals; ) {
+        if (mem_vals[i].temp == temp) {
+            mem_vals[i] = mem_vals[--nb_mem_vals];
+        } else {
+            i++;
+        }
+    }
+}
+
+static void mem_forget_vals(tcg_target_long ofs, int size)
+{
+    int i;
+
+    for (i = 0; i < nb_mem_vals; ) {
+        if (mem_overlap(mem_vals[i].ofs, mem_vals[i].size, ofs, size)) {
+            mem_vals[i] = mem_vals[--nb_mem_vals];
+        } else {
+            i++;
+        }
+    }
+}
+
+/* The CPU state at [OFS, OFS + SIZE) is being read */
+static void mem_observe(tcg_target_long ofs, int size)
+{
+    int i;
+
+    for (i = 0; i < nb_mem_stores; ) {
+        if (mem_overlap(mem_stores[i].ofs, mem_stores[i].size, ofs, size)) {
+            mem_stores[i] = mem_stores[--nb_mem_stores];
+        } else {
+            i++;
+        }
+    }
+}
+
+static void mem_add_val(tcg_target_long ofs, int size, TCGOpcode ld_opc,
+                        TCGArg temp)
+{
+    if (nb_mem_vals < MAX_MEM_INFO) {
+        mem_vals[nb_mem_vals++] = (MemVal){ ofs, size, ld_opc, temp };
+    }
+}
+
+static void mem_add_store(tcg_target_long ofs, int size, TCGOp *op)
+{
+    if (nb_mem_stores < MAX_MEM_INFO) {
+        mem_stores[nb_mem_stores++] = (MemStore){ ofs, size, op };
+    }
+}
+
+/* Track OP's effect on the CPU state.  Returns true if OP was turned into
+   a move or removed, in which case it needs no further processing.  */
+static bool tcg_opt_mem(TCGContext *s, TCGOp *op, TCGArg *args,
+                        const TCGOpDef *def, int nb_oargs)
+{
+    TCGOpcode opc = op->opc;
+    tcg_target_long ofs;
+    int i, size;
+
+    if (def->flags & (TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS)
+        || opc == INDEX_op_call) {
+        mem_reset();
+        return false;
+    }
+
+    size = ldst_size(opc);
+    if (size == 0) {
+        for (i = 0; i < nb_oargs; i++) {
+            mem_forget_temp(args[i]);
+        }
+        return false;
+    }
+
+    ofs = args[2];
+    if (is_ld(opc)) {
+        if (args[1] != env_temp) {
+            /* May read any part of the CPU state */
+            nb_mem_stores = 0;
+            mem_forget_temp(args[0]);
+            return false;
+        }
+        mem_observe(ofs, size);
+        for (i = 0; i < nb_mem_vals; i++) {
+            if (mem_vals[i].ofs == ofs && mem_vals[i].ld_opc == opc) {
+                TCGArg src = mem_vals[i].temp;
+
+                if (src != args[0]) {
+                    mem_forget_temp(args[0]);
+                }
+                tcg_opt_gen_mov(s, op, args, args[0], src);
+                opt_stats.loads_forwarded++;
+                return true;
+            }
+        }
+        mem_forget_temp(args[0]);
+        mem_add_val(ofs, size, opc, args[0]);
+        return false;
+    }
+
+    if (args[1] != env_temp) {
+        /* May write any part of the CPU state */
+        nb_mem_vals = 0;
+        return false;
+    }
+
+    for (i = 0; i < nb_mem_vals; i++) {
+        if (mem_vals[i].ofs == ofs && mem_vals[i].ld_opc == st_to_ld(opc)
+            && temps_are_copies(mem_vals[i].temp, args[0])) {
+            /* The field holds this value already */
+            tcg_op_remove(s, op);
+            opt_stats.stores_removed++;
+            return true;
+        }
+    }
+
+    for (i = 0; i < nb_mem_stores; ) {
+        if (mem_stores[i].ofs >= ofs
+            && mem_stores[i].ofs + mem_stores[i].size <= ofs + size) {
+            /* Overwritten before anything looked at it */
+            tcg_op_remove(s, mem_stores[i].op);
+            opt_stats.stores_removed++;
+            mem_stores[i] = mem_stores[--nb_mem_stores];
+        } else {
+            i++;
+        }
+    }
+
+    mem_forget_vals(ofs, size);
+    if (st_to_ld(opc) != INDEX_op_discard) {
+        mem_add_val(ofs, size, st_to_ld(opc), args[0]);
+    }
+    mem_add_store(ofs, size, op);
+    return false;
+}
+
+/* Propagate constants and copies, fold constant expressions, simplify
+   using known bits, forward CPU state loads and stores.  */
 void tcg_optimize(TCGContext *s)
 {
     int oi, oi_next, nb_temps, nb_globals;
+    int nb_ops = 0;
 
     /* Array VALS has an element for each temp.
        If this temp holds a constant then its value is kept in VALS' element.
@@ -587,8 +858,23 @@ void tcg_optimize(TCGContext *s)
     nb_globals = s->nb_globals;
     reset_all_temps(nb_temps);
 
+    env_temp = -1;
+    for (oi = 0; oi < nb_globals; oi++) {
+        if (s->temps[oi].fixed_reg && s->temps[oi].reg == TCG_AREG0) {
+            env_temp = oi;
+            break;
+        }
+    }
+    mem_reset();
+    memset(&opt_stats, 0, sizeof(opt_stats));
+    if (qemu_loglevel_mask(CPU_LOG_TB_OP_OPT)) {
+        for (oi = s->gen_first_op_idx; oi >= 0; oi = s->gen_op_buf[oi].next) {
+            nb_ops++;
+        }
+    }
+
     for (oi = s->gen_first_op_idx; oi >= 0; oi = oi_next) {
-        tcg_target_ulong mask, partmask, affected;
+        tcg_target_ulong mask, partmask, affected, ones;
         int nb_oargs, nb_iargs, i;
         TCGArg tmp;
 
@@ -613,6 +899,10 @@ void tcg_optimize(TCGContext *s)
             }
         }
 
+        if (tcg_opt_mem(s, op, args, def, nb_oargs)) {
+            continue;
+        }
+
         /* For commutative operations make constant second argument */
         switch (opc) {
         CASE_OP_32_64(add):
@@ -806,6 +1096,7 @@ void tcg_optimize(TCGContext *s)
         /* Simplify using known-zero bits. Currently only ops with a single
            output argument is supported. */
         mask = -1;
+        ones = 0;
         affected = -1;
         switch (opc) {
         CASE_OP_32_64(ext8s):
@@ -813,53 +1104,60 @@ void tcg_optimize(TCGContext *s)
                 break;
             }
         CASE_OP_32_64(ext8u):
-            mask = 0xff;
+            mask = ones = 0xff;
             goto and_const;
         CASE_OP_32_64(ext16s):
             if ((temps[args[1]].mask & 0x8000) != 0) {
                 break;
             }
         CASE_OP_32_64(ext16u):
-            mask = 0xffff;
+            mask = ones = 0xffff;
             goto and_const;
         case INDEX_op_ext32s_i64:
             if ((temps[args[1]].mask & 0x80000000) != 0) {
                 break;
             }
         case INDEX_op_ext32u_i64:
-            mask = 0xffffffffU;
+            mask = ones = 0xffffffffU;
             goto and_const;
 
         CASE_OP_32_64(and):
             mask = temps[args[2]].mask;
+            ones = temps[args[2]].ones;
             if (temps[args[2]].state == TCG_TEMP_CONST) {
         and_const:
                 affected = temps[args[1]].mask & ~mask;
             }
             mask = temps[args[1]].mask & mask;
+            ones = temps[args[1]].ones & ones;
             break;
 
         CASE_OP_32_64(andc):
             /* Known-zeros does not imply known-ones.  Therefore unless
                args[2] is constant, we can't infer anything from it.  */
             if (temps[args[2]].state == TCG_TEMP_CONST) {
-                mask = ~temps[args[2]].mask;
+                mask = ones = ~temps[args[2]].mask;
                 goto and_const;
             }
-            /* But we certainly know nothing outside args[1] may be set. */
+            /* But we certainly know nothing outside args[1] may be set,
+               and the known-one bits of args[1] survive where args[2] is
+               known to be zero.  */
             mask = temps[args[1]].mask;
+            ones = temps[args[1]].ones & ~temps[args[2]].mask;
             break;
 
         case INDEX_op_sar_i32:
             if (temps[args[2]].state == TCG_TEMP_CONST) {
                 tmp = temps[args[2]].val & 31;
                 mask = (int32_t)temps[args[1]].mask >> tmp;
+                ones = (int32_t)temps[args[1]].ones >> tmp;
             }
             break;
         case INDEX_op_sar_i64:
             if (temps[args[2]].state == TCG_TEMP_CONST) {
                 tmp = temps[args[2]].val & 63;
                 mask = (int64_t)temps[args[1]].mask >> tmp;
+                ones = (int64_t)temps[args[1]].ones >> tmp;
             }
             break;
 
@@ -867,23 +1165,27 @@ void tcg_optimize(TCGContext *s)
             if (temps[args[2]].state == TCG_TEMP_CONST) {
                 tmp = temps[args[2]].val & 31;
                 mask = (uint32_t)temps[args[1]].mask >> tmp;
+                ones = (uint32_t)temps[args[1]].ones >> tmp;
             }
             break;
         case INDEX_op_shr_i64:
             if (temps[args[2]].state == TCG_TEMP_CONST) {
                 tmp = temps[args[2]].val & 63;
                 mask = (uint64_t)temps[args[1]].mask >> tmp;
+                ones = (uint64_t)temps[args[1]].ones >> tmp;
             }
             break;
 
         case INDEX_op_trunc_shr_i32:
             mask = (uint64_t)temps[args[1]].mask >> args[2];
+            ones = (uint64_t)temps[args[1]].ones >> args[2];
             break;
 
         CASE_OP_32_64(shl):
             if (temps[args[2]].state == TCG_TEMP_CONST) {
                 tmp = temps[args[2]].val & (TCG_TARGET_REG_BITS - 1);
                 mask = temps[args[1]].mask << tmp;
+                ones = temps[args[1]].ones << tmp;
             }
             break;
 
@@ -892,14 +1194,29 @@ void tcg_optimize(TCGContext *s)
             mask = -(temps[args[1]].mask & -temps[args[1]].mask);
             break;
 
+        CASE_OP_32_64(not):
+            mask = ~temps[args[1]].ones;
+            ones = ~temps[args[1]].mask;
+            break;
+
         CASE_OP_32_64(deposit):
             mask = deposit64(temps[args[1]].mask, args[3], args[4],
                              temps[args[2]].mask);
+            ones = deposit64(temps[args[1]].ones, args[3], args[4],
+                             temps[args[2]].ones);
             break;
 
         CASE_OP_32_64(or):
-        CASE_OP_32_64(xor):
             mask = temps[args[1]].mask | temps[args[2]].mask;
+            ones = temps[args[1]].ones | temps[args[2]].ones;
+            break;
+
+        CASE_OP_32_64(xor):
+            /* Bits that are known to be set on both sides cancel out.  */
+            mask = (temps[args[1]].mask | temps[args[2]].mask)
+                   & ~(temps[args[1]].ones & temps[args[2]].ones);
+            ones = (temps[args[1]].ones & ~temps[args[2]].mask)
+                   | (temps[args[2]].ones & ~temps[args[1]].mask);
             break;
 
         CASE_OP_32_64(setcond):
@@ -909,6 +1226,7 @@ void tcg_optimize(TCGContext *s)
 
         CASE_OP_32_64(movcond):
             mask = temps[args[3]].mask | temps[args[4]].mask;
+            ones = temps[args[3]].ones & temps[args[4]].ones;
             break;
 
         CASE_OP_32_64(ld8u):
@@ -943,19 +1261,43 @@ void tcg_optimize(TCGContext *s)
             mask |= ~(tcg_target_ulong)0xffffffffu;
             partmask &= 0xffffffffu;
             affected &= 0xffffffffu;
+            ones &= 0xffffffffu;
         }
 
-        if (partmask == 0) {
+        if ((partmask & ~ones) == 0) {
+            /* All bits are known: the result is a constant.  */
             assert(nb_oargs == 1);
-            tcg_opt_gen_movi(s, op, args, args[0], 0);
+            tcg_opt_gen_movi(s, op, args, args[0], ones);
+            opt_stats.known_bits++;
             continue;
         }
         if (affected == 0) {
             assert(nb_oargs == 1);
             tcg_opt_gen_mov(s, op, args, args[0], args[1]);
+            opt_stats.known_bits++;
             continue;
         }
 
+        /* Simplify "or r, a, const => mov r, a" when all the bits of the
+           constant are known to be set in a already.  */
+        switch (opc) {
+        CASE_OP_32_64(or):
+            if (temps[args[2]].state == TCG_TEMP_CONST) {
+                tmp = temps[args[2]].val & ~temps[args[1]].ones;
+                if (!(def->flags & TCG_OPF_64BIT)) {
+                    tmp &= 0xffffffffu;
+                }
+                if (tmp == 0) {
+                    tcg_opt_gen_mov(s, op, args, args[0], args[1]);
+                    opt_stats.known_bits++;
+                    continue;
+                }
+            }
+            break;
+        default:
+            break;
+        }
+
         /* Simplify expression for "op r, a, 0 => movi r, 0" cases */
         switch (opc) {
         CASE_OP_32_64(and):
@@ -1317,14 +1659,28 @@ void tcg_optimize(TCGContext *s)
         do_reset_output:
                 for (i = 0; i < nb_oargs; i++) {
                     reset_temp(args[i]);
-                    /* Save the corresponding known-zero bits mask for the
-                       first output argument (only one supported so far). */
+                    /* Save the corresponding known-zero and known-one bits
+                       for the first output argument (only one supported so
+                       far). */
                     if (i == 0) {
                         temps[args[i]].mask = mask;
+                        temps[args[i]].ones = ones;
                     }
                 }
             }
             break;
         }
     }
+
+    if (qemu_loglevel_mask(CPU_LOG_TB_OP_OPT)) {
+        int nb_ops_left = 0;
+
+        for (oi = s->gen_first_op_idx; oi >= 0; oi = s->gen_op_buf[oi].next) {
+            nb_ops_left++;
+        }
+        qemu_log("OPT: %d ops -> %d: %d known bits, %d loads forwarded, "
+                 "%d stores removed\n", nb_ops, nb_ops_left,
+                 opt_stats.known_bits, opt_stats.loads_forwarded,
+                 opt_stats.stores_removed);
+    }
 }
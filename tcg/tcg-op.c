@@ -24,6 +24,7 @@
 
 #include "tcg.h"
 #include "tcg-op.h"
+#include "qemu/log.h"
 
 /* Reduce the number of ifdefs below.  This assumes that all uses of
    TCGV_HIGH and TCGV_LOW are properly protected by a conditional that
@@ -1845,6 +1846,182 @@ void tcg_gen_goto_tb(unsigned idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+/*
+ * End the TB by jumping straight to the TB that matches the current CPU
+ * state, if there is one in the jump cache, instead of returning to the
+ * main loop.  Like exit_tb(0), the TB just ended is not chained to it.
+ */
+void tcg_gen_lookup_and_goto_ptr(TCGv_ptr env)
+{
+    if (TCG_TARGET_HAS_goto_ptr && !qemu_loglevel_mask(CPU_LOG_EXEC)) {
+        TCGv_ptr ptr = tcg_temp_new_ptr();
+
+        gen_helper_lookup_tb_ptr(ptr, env);
+        tcg_gen_op1i(INDEX_op_goto_ptr, GET_TCGV_PTR(ptr));
+        tcg_temp_free_ptr(ptr);
+    } else {
+        tcg_gen_exit_tb(0);
+    }
+}
+
+/*
+ * Vector operations.  They are expanded into 64-bit integer operations
+ * inline, which is already much cheaper than calling a helper per
+ * instruction; add and sub on smaller elements work on all the lanes of
+ * a 64-bit word at once, with the top bit of each lane handled apart so
+ * that carries do not cross lanes.
+ */
+typedef void GVecGenFn(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m);
+
+static void gen_gvec_3(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                       uint32_t bofs, uint32_t oprsz, uint64_t mask,
+                       GVecGenFn *fn)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 m;
+    uint32_t i;
+
+    tcg_debug_assert(oprsz % 8 == 0);
+    if (mask) {
+        m = tcg_const_i64(mask);
+    } else {
+        TCGV_UNUSED_I64(m);
+    }
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, base, aofs + i);
+        tcg_gen_ld_i64(t1, base, bofs + i);
+        fn(t0, t0, t1, m);
+        tcg_gen_st_i64(t0, base, dofs + i);
+    }
+
+    if (mask) {
+        tcg_temp_free_i64(m);
+    }
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t0);
+}
+
+static void gen_and_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static void gen_or_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static void gen_xor_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static void gen_andc_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    tcg_gen_andc_i64(d, a, b);
+}
+
+static void gen_add_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    tcg_gen_add_i64(d, a, b);
+}
+
+static void gen_sub_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    tcg_gen_sub_i64(d, a, b);
+}
+
+/* m has the top bit of each lane set */
+static void gen_addv_mask(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_andc_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gen_subv_mask(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_or_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static const uint64_t gvec_lane_msb[] = {
+    [MO_8]  = 0x8080808080808080ull,
+    [MO_16] = 0x8000800080008000ull,
+    [MO_32] = 0x8000000080000000ull,
+};
+
+void tcg_gen_gvec_and(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    gen_gvec_3(base, dofs, aofs, bofs, oprsz, 0, gen_and_i64);
+}
+
+void tcg_gen_gvec_or(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                     uint32_t bofs, uint32_t oprsz)
+{
+    gen_gvec_3(base, dofs, aofs, bofs, oprsz, 0, gen_or_i64);
+}
+
+void tcg_gen_gvec_xor(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    gen_gvec_3(base, dofs, aofs, bofs, oprsz, 0, gen_xor_i64);
+}
+
+void tcg_gen_gvec_andc(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                       uint32_t bofs, uint32_t oprsz)
+{
+    gen_gvec_3(base, dofs, aofs, bofs, oprsz, 0, gen_andc_i64);
+}
+
+void tcg_gen_gvec_add(TCGMemOp vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz)
+{
+    if (vece == MO_64) {
+        gen_gvec_3(base, dofs, aofs, bofs, oprsz, 0, gen_add_i64);
+    } else {
+        gen_gvec_3(base, dofs, aofs, bofs, oprsz, gvec_lane_msb[vece],
+                   gen_addv_mask);
+    }
+}
+
+void tcg_gen_gvec_sub(TCGMemOp vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz)
+{
+    if (vece == MO_64) {
+        gen_gvec_3(base, dofs, aofs, bofs, oprsz, 0, gen_sub_i64);
+    } else {
+        gen_gvec_3(base, dofs, aofs, bofs, oprsz, gvec_lane_msb[vece],
+                   gen_subv_mask);
+    }
+}
+
 static inline TCGMemOp tcg_canonicalize_memop(TCGMemOp op, bool is64, bool st)
 {
     switch (op & MO_SIZE) {
@@ -722,6 +722,23 @@ static inline void tcg_gen_exit_tb(uintptr_t val)
 }
 
 void tcg_gen_goto_tb(unsigned idx);
+void tcg_gen_lookup_and_goto_ptr(TCGv_ptr env);
+
+/* Operations on vectors of oprsz bytes (a multiple of 8) at offsets dofs,
+   aofs and bofs from base, e.g. guest SIMD registers in the CPU state.
+   vece is the element size, MO_8 to MO_64.  */
+void tcg_gen_gvec_and(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_or(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                     uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_xor(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_andc(TCGv_ptr base, uint32_t dofs, uint32_t aofs,
+                       uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_add(TCGMemOp vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_sub(TCGMemOp vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz);
 
 #if TARGET_LONG_BITS == 32
 #define TCGv TCGv_i32
@@ -465,9 +465,185 @@ static bool tci_compare64(uint64_t u0, uint64_t u1, TCGCond condition)
 # define qemu_st_beq(X)  stq_be_p(g2h(taddr), X)
 #endif
 
+/* With GCC, each opcode is dispatched through a table of label addresses
+   rather than the switch.  The indirect jump at the top of the loop is
+   then copied to the end of every case, so that the host predicts the
+   next opcode from the current one, as in direct-threaded code.  The
+   switch stays for compilers without computed gotos.  */
+#if defined(__GNUC__)
+# define TCI_COMPUTED_GOTO
+# define TCI_CASE(op)    case op: tci_label_##op
+#else
+# define TCI_CASE(op)    case op
+#endif
+
 /* Interpret pseudo code in tb. */
 uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 {
+#ifdef TCI_COMPUTED_GOTO
+    static const void *const tci_dispatch[NB_OPS] = {
+        [0 ... NB_OPS - 1] = &&tci_label_default,
+        [INDEX_op_call] = &&tci_label_INDEX_op_call,
+        [INDEX_op_br] = &&tci_label_INDEX_op_br,
+        [INDEX_op_setcond_i32] = &&tci_label_INDEX_op_setcond_i32,
+#if TCG_TARGET_REG_BITS == 32
+        [INDEX_op_setcond2_i32] = &&tci_label_INDEX_op_setcond2_i32,
+#elif TCG_TARGET_REG_BITS == 64
+        [INDEX_op_setcond_i64] = &&tci_label_INDEX_op_setcond_i64,
+#endif
+        [INDEX_op_mov_i32] = &&tci_label_INDEX_op_mov_i32,
+        [INDEX_op_movi_i32] = &&tci_label_INDEX_op_movi_i32,
+        [INDEX_op_ld8u_i32] = &&tci_label_INDEX_op_ld8u_i32,
+        [INDEX_op_ld8s_i32] = &&tci_label_INDEX_op_ld8s_i32,
+        [INDEX_op_ld16u_i32] = &&tci_label_INDEX_op_ld16u_i32,
+        [INDEX_op_ld16s_i32] = &&tci_label_INDEX_op_ld16s_i32,
+        [INDEX_op_ld_i32] = &&tci_label_INDEX_op_ld_i32,
+        [INDEX_op_st8_i32] = &&tci_label_INDEX_op_st8_i32,
+        [INDEX_op_st16_i32] = &&tci_label_INDEX_op_st16_i32,
+        [INDEX_op_st_i32] = &&tci_label_INDEX_op_st_i32,
+        [INDEX_op_add_i32] = &&tci_label_INDEX_op_add_i32,
+        [INDEX_op_sub_i32] = &&tci_label_INDEX_op_sub_i32,
+        [INDEX_op_mul_i32] = &&tci_label_INDEX_op_mul_i32,
+#if TCG_TARGET_HAS_div_i32
+        [INDEX_op_div_i32] = &&tci_label_INDEX_op_div_i32,
+        [INDEX_op_divu_i32] = &&tci_label_INDEX_op_divu_i32,
+        [INDEX_op_rem_i32] = &&tci_label_INDEX_op_rem_i32,
+        [INDEX_op_remu_i32] = &&tci_label_INDEX_op_remu_i32,
+#elif TCG_TARGET_HAS_div2_i32
+        [INDEX_op_div2_i32] = &&tci_label_INDEX_op_div2_i32,
+        [INDEX_op_divu2_i32] = &&tci_label_INDEX_op_divu2_i32,
+#endif
+        [INDEX_op_and_i32] = &&tci_label_INDEX_op_and_i32,
+        [INDEX_op_or_i32] = &&tci_label_INDEX_op_or_i32,
+        [INDEX_op_xor_i32] = &&tci_label_INDEX_op_xor_i32,
+        [INDEX_op_shl_i32] = &&tci_label_INDEX_op_shl_i32,
+        [INDEX_op_shr_i32] = &&tci_label_INDEX_op_shr_i32,
+        [INDEX_op_sar_i32] = &&tci_label_INDEX_op_sar_i32,
+#if TCG_TARGET_HAS_rot_i32
+        [INDEX_op_rotl_i32] = &&tci_label_INDEX_op_rotl_i32,
+        [INDEX_op_rotr_i32] = &&tci_label_INDEX_op_rotr_i32,
+#endif
+#if TCG_TARGET_HAS_deposit_i32
+        [INDEX_op_deposit_i32] = &&tci_label_INDEX_op_deposit_i32,
+#endif
+        [INDEX_op_brcond_i32] = &&tci_label_INDEX_op_brcond_i32,
+#if TCG_TARGET_REG_BITS == 32
+        [INDEX_op_add2_i32] = &&tci_label_INDEX_op_add2_i32,
+        [INDEX_op_sub2_i32] = &&tci_label_INDEX_op_sub2_i32,
+        [INDEX_op_brcond2_i32] = &&tci_label_INDEX_op_brcond2_i32,
+        [INDEX_op_mulu2_i32] = &&tci_label_INDEX_op_mulu2_i32,
+#endif /* TCG_TARGET_REG_BITS == 32 */
+#if TCG_TARGET_HAS_ext8s_i32
+        [INDEX_op_ext8s_i32] = &&tci_label_INDEX_op_ext8s_i32,
+#endif
+#if TCG_TARGET_HAS_ext16s_i32
+        [INDEX_op_ext16s_i32] = &&tci_label_INDEX_op_ext16s_i32,
+#endif
+#if TCG_TARGET_HAS_ext8u_i32
+        [INDEX_op_ext8u_i32] = &&tci_label_INDEX_op_ext8u_i32,
+#endif
+#if TCG_TARGET_HAS_ext16u_i32
+        [INDEX_op_ext16u_i32] = &&tci_label_INDEX_op_ext16u_i32,
+#endif
+#if TCG_TARGET_HAS_bswap16_i32
+        [INDEX_op_bswap16_i32] = &&tci_label_INDEX_op_bswap16_i32,
+#endif
+#if TCG_TARGET_HAS_bswap32_i32
+        [INDEX_op_bswap32_i32] = &&tci_label_INDEX_op_bswap32_i32,
+#endif
+#if TCG_TARGET_HAS_not_i32
+        [INDEX_op_not_i32] = &&tci_label_INDEX_op_not_i32,
+#endif
+#if TCG_TARGET_HAS_neg_i32
+        [INDEX_op_neg_i32] = &&tci_label_INDEX_op_neg_i32,
+#endif
+#if TCG_TARGET_REG_BITS == 64
+        [INDEX_op_mov_i64] = &&tci_label_INDEX_op_mov_i64,
+        [INDEX_op_movi_i64] = &&tci_label_INDEX_op_movi_i64,
+        [INDEX_op_ld8u_i64] = &&tci_label_INDEX_op_ld8u_i64,
+        [INDEX_op_ld8s_i64] = &&tci_label_INDEX_op_ld8s_i64,
+        [INDEX_op_ld16u_i64] = &&tci_label_INDEX_op_ld16u_i64,
+        [INDEX_op_ld16s_i64] = &&tci_label_INDEX_op_ld16s_i64,
+        [INDEX_op_ld32u_i64] = &&tci_label_INDEX_op_ld32u_i64,
+        [INDEX_op_ld32s_i64] = &&tci_label_INDEX_op_ld32s_i64,
+        [INDEX_op_ld_i64] = &&tci_label_INDEX_op_ld_i64,
+        [INDEX_op_st8_i64] = &&tci_label_INDEX_op_st8_i64,
+        [INDEX_op_st16_i64] = &&tci_label_INDEX_op_st16_i64,
+        [INDEX_op_st32_i64] = &&tci_label_INDEX_op_st32_i64,
+        [INDEX_op_st_i64] = &&tci_label_INDEX_op_st_i64,
+        [INDEX_op_add_i64] = &&tci_label_INDEX_op_add_i64,
+        [INDEX_op_sub_i64] = &&tci_label_INDEX_op_sub_i64,
+        [INDEX_op_mul_i64] = &&tci_label_INDEX_op_mul_i64,
+#if TCG_TARGET_HAS_div_i64
+        [INDEX_op_div_i64] = &&tci_label_INDEX_op_div_i64,
+        [INDEX_op_divu_i64] = &&tci_label_INDEX_op_divu_i64,
+        [INDEX_op_rem_i64] = &&tci_label_INDEX_op_rem_i64,
+        [INDEX_op_remu_i64] = &&tci_label_INDEX_op_remu_i64,
+#elif TCG_TARGET_HAS_div2_i64
+        [INDEX_op_div2_i64] = &&tci_label_INDEX_op_div2_i64,
+        [INDEX_op_divu2_i64] = &&tci_label_INDEX_op_divu2_i64,
+#endif
+        [INDEX_op_and_i64] = &&tci_label_INDEX_op_and_i64,
+        [INDEX_op_or_i64] = &&tci_label_INDEX_op_or_i64,
+        [INDEX_op_xor_i64] = &&tci_label_INDEX_op_xor_i64,
+        [INDEX_op_shl_i64] = &&tci_label_INDEX_op_shl_i64,
+        [INDEX_op_shr_i64] = &&tci_label_INDEX_op_shr_i64,
+        [INDEX_op_sar_i64] = &&tci_label_INDEX_op_sar_i64,
+#if TCG_TARGET_HAS_rot_i64
+        [INDEX_op_rotl_i64] = &&tci_label_INDEX_op_rotl_i64,
+        [INDEX_op_rotr_i64] = &&tci_label_INDEX_op_rotr_i64,
+#endif
+#if TCG_TARGET_HAS_deposit_i64
+        [INDEX_op_deposit_i64] = &&tci_label_INDEX_op_deposit_i64,
+#endif
+        [INDEX_op_brcond_i64] = &&tci_label_INDEX_op_brcond_i64,
+#if TCG_TARGET_HAS_ext8u_i64
+        [INDEX_op_ext8u_i64] = &&tci_label_INDEX_op_ext8u_i64,
+#endif
+#if TCG_TARGET_HAS_ext8s_i64
+        [INDEX_op_ext8s_i64] = &&tci_label_INDEX_op_ext8s_i64,
+#endif
+#if TCG_TARGET_HAS_ext16s_i64
+        [INDEX_op_ext16s_i64] = &&tci_label_INDEX_op_ext16s_i64,
+#endif
+#if TCG_TARGET_HAS_ext16u_i64
+        [INDEX_op_ext16u_i64] = &&tci_label_INDEX_op_ext16u_i64,
+#endif
+#if TCG_TARGET_HAS_ext32s_i64
+        [INDEX_op_ext32s_i64] = &&tci_label_INDEX_op_ext32s_i64,
+#endif
+#if TCG_TARGET_HAS_ext32u_i64
+        [INDEX_op_ext32u_i64] = &&tci_label_INDEX_op_ext32u_i64,
+#endif
+#if TCG_TARGET_HAS_bswap16_i64
+        [INDEX_op_bswap16_i64] = &&tci_label_INDEX_op_bswap16_i64,
+#endif
+#if TCG_TARGET_HAS_bswap32_i64
+        [INDEX_op_bswap32_i64] = &&tci_label_INDEX_op_bswap32_i64,
+#endif
+#if TCG_TARGET_HAS_bswap64_i64
+        [INDEX_op_bswap64_i64] = &&tci_label_INDEX_op_bswap64_i64,
+#endif
+#if TCG_TARGET_HAS_not_i64
+        [INDEX_op_not_i64] = &&tci_label_INDEX_op_not_i64,
+#endif
+#if TCG_TARGET_HAS_neg_i64
+        [INDEX_op_neg_i64] = &&tci_label_INDEX_op_neg_i64,
+#endif
+#endif /* TCG_TARGET_REG_BITS == 64 */
+#if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
+        [INDEX_op_debug_insn_start] = &&tci_label_INDEX_op_debug_insn_start,
+#else
+        [INDEX_op_debug_insn_start] = &&tci_label_INDEX_op_debug_insn_start,
+#endif
+        [INDEX_op_exit_tb] = &&tci_label_INDEX_op_exit_tb,
+        [INDEX_op_goto_tb] = &&tci_label_INDEX_op_goto_tb,
+        [INDEX_op_qemu_ld_i32] = &&tci_label_INDEX_op_qemu_ld_i32,
+        [INDEX_op_qemu_ld_i64] = &&tci_label_INDEX_op_qemu_ld_i64,
+        [INDEX_op_qemu_st_i32] = &&tci_label_INDEX_op_qemu_st_i32,
+        [INDEX_op_qemu_st_i64] = &&tci_label_INDEX_op_qemu_st_i64,
+    };
+#endif
     long tcg_temps[CPU_TEMP_BUF_NLONGS];
     uintptr_t sp_value = (uintptr_t)(tcg_temps + CPU_TEMP_BUF_NLONGS);
     uintptr_t next_tb = 0;
@@ -504,8 +680,11 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
         /* Skip opcode and size entry. */
         tb_ptr += 2;
 
+#ifdef TCI_COMPUTED_GOTO
+        goto *tci_dispatch[opc];
+#endif
         switch (opc) {
-        case INDEX_op_call:
+        TCI_CASE(INDEX_op_call):
             t0 = tci_read_ri(&tb_ptr);
 #if TCG_TARGET_REG_BITS == 32
             tmp64 = ((helper_function)t0)(tci_read_reg(TCG_REG_R0),
@@ -529,12 +708,12 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tci_write_reg(TCG_REG_R0, tmp64);
 #endif
             break;
-        case INDEX_op_br:
+        TCI_CASE(INDEX_op_br):
             label = tci_read_label(&tb_ptr);
             assert(tb_ptr == old_code_ptr + op_size);
             tb_ptr = (uint8_t *)label;
             continue;
-        case INDEX_op_setcond_i32:
+        TCI_CASE(INDEX_op_setcond_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
@@ -542,7 +721,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tci_write_reg32(t0, tci_compare32(t1, t2, condition));
             break;
 #if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_setcond2_i32:
+        TCI_CASE(INDEX_op_setcond2_i32):
             t0 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             v64 = tci_read_ri64(&tb_ptr);
@@ -550,7 +729,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tci_write_reg32(t0, tci_compare64(tmp64, v64, condition));
             break;
 #elif TCG_TARGET_REG_BITS == 64
-        case INDEX_op_setcond_i64:
+        TCI_CASE(INDEX_op_setcond_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
@@ -558,12 +737,12 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tci_write_reg64(t0, tci_compare64(t1, t2, condition));
             break;
 #endif
-        case INDEX_op_mov_i32:
+        TCI_CASE(INDEX_op_mov_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, t1);
             break;
-        case INDEX_op_movi_i32:
+        TCI_CASE(INDEX_op_movi_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_i32(&tb_ptr);
             tci_write_reg32(t0, t1);
@@ -571,38 +750,38 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 
             /* Load/store operations (32 bit). */
 
-        case INDEX_op_ld8u_i32:
+        TCI_CASE(INDEX_op_ld8u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
             break;
-        case INDEX_op_ld8s_i32:
-        case INDEX_op_ld16u_i32:
+        TCI_CASE(INDEX_op_ld8s_i32):
+        TCI_CASE(INDEX_op_ld16u_i32):
             TODO();
             break;
-        case INDEX_op_ld16s_i32:
+        TCI_CASE(INDEX_op_ld16s_i32):
             TODO();
             break;
-        case INDEX_op_ld_i32:
+        TCI_CASE(INDEX_op_ld_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
             break;
-        case INDEX_op_st8_i32:
+        TCI_CASE(INDEX_op_st8_i32):
             t0 = tci_read_r8(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint8_t *)(t1 + t2) = t0;
             break;
-        case INDEX_op_st16_i32:
+        TCI_CASE(INDEX_op_st16_i32):
             t0 = tci_read_r16(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint16_t *)(t1 + t2) = t0;
             break;
-        case INDEX_op_st_i32:
+        TCI_CASE(INDEX_op_st_i32):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
@@ -612,68 +791,68 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 
             /* Arithmetic operations (32 bit). */
 
-        case INDEX_op_add_i32:
+        TCI_CASE(INDEX_op_add_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 + t2);
             break;
-        case INDEX_op_sub_i32:
+        TCI_CASE(INDEX_op_sub_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 - t2);
             break;
-        case INDEX_op_mul_i32:
+        TCI_CASE(INDEX_op_mul_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 * t2);
             break;
 #if TCG_TARGET_HAS_div_i32
-        case INDEX_op_div_i32:
+        TCI_CASE(INDEX_op_div_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, (int32_t)t1 / (int32_t)t2);
             break;
-        case INDEX_op_divu_i32:
+        TCI_CASE(INDEX_op_divu_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 / t2);
             break;
-        case INDEX_op_rem_i32:
+        TCI_CASE(INDEX_op_rem_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, (int32_t)t1 % (int32_t)t2);
             break;
-        case INDEX_op_remu_i32:
+        TCI_CASE(INDEX_op_remu_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 % t2);
             break;
 #elif TCG_TARGET_HAS_div2_i32
-        case INDEX_op_div2_i32:
-        case INDEX_op_divu2_i32:
+        TCI_CASE(INDEX_op_div2_i32):
+        TCI_CASE(INDEX_op_divu2_i32):
             TODO();
             break;
 #endif
-        case INDEX_op_and_i32:
+        TCI_CASE(INDEX_op_and_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 & t2);
             break;
-        case INDEX_op_or_i32:
+        TCI_CASE(INDEX_op_or_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 | t2);
             break;
-        case INDEX_op_xor_i32:
+        TCI_CASE(INDEX_op_xor_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
@@ -682,32 +861,32 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 
             /* Shift/rotate operations (32 bit). */
 
-        case INDEX_op_shl_i32:
+        TCI_CASE(INDEX_op_shl_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 << (t2 & 31));
             break;
-        case INDEX_op_shr_i32:
+        TCI_CASE(INDEX_op_shr_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 >> (t2 & 31));
             break;
-        case INDEX_op_sar_i32:
+        TCI_CASE(INDEX_op_sar_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, ((int32_t)t1 >> (t2 & 31)));
             break;
 #if TCG_TARGET_HAS_rot_i32
-        case INDEX_op_rotl_i32:
+        TCI_CASE(INDEX_op_rotl_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, rol32(t1, t2 & 31));
             break;
-        case INDEX_op_rotr_i32:
+        TCI_CASE(INDEX_op_rotr_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
@@ -715,7 +894,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             break;
 #endif
 #if TCG_TARGET_HAS_deposit_i32
-        case INDEX_op_deposit_i32:
+        TCI_CASE(INDEX_op_deposit_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             t2 = tci_read_r32(&tb_ptr);
@@ -725,7 +904,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tci_write_reg32(t0, (t1 & ~tmp32) | ((t2 << tmp16) & tmp32));
             break;
 #endif
-        case INDEX_op_brcond_i32:
+        TCI_CASE(INDEX_op_brcond_i32):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_ri32(&tb_ptr);
             condition = *tb_ptr++;
@@ -737,21 +916,21 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             }
             break;
 #if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_add2_i32:
+        TCI_CASE(INDEX_op_add2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             tmp64 += tci_read_r64(&tb_ptr);
             tci_write_reg64(t1, t0, tmp64);
             break;
-        case INDEX_op_sub2_i32:
+        TCI_CASE(INDEX_op_sub2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             tmp64 -= tci_read_r64(&tb_ptr);
             tci_write_reg64(t1, t0, tmp64);
             break;
-        case INDEX_op_brcond2_i32:
+        TCI_CASE(INDEX_op_brcond2_i32):
             tmp64 = tci_read_r64(&tb_ptr);
             v64 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
@@ -762,7 +941,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
                 continue;
             }
             break;
-        case INDEX_op_mulu2_i32:
+        TCI_CASE(INDEX_op_mulu2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             t2 = tci_read_r32(&tb_ptr);
@@ -771,68 +950,68 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             break;
 #endif /* TCG_TARGET_REG_BITS == 32 */
 #if TCG_TARGET_HAS_ext8s_i32
-        case INDEX_op_ext8s_i32:
+        TCI_CASE(INDEX_op_ext8s_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r8s(&tb_ptr);
             tci_write_reg32(t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_ext16s_i32
-        case INDEX_op_ext16s_i32:
+        TCI_CASE(INDEX_op_ext16s_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16s(&tb_ptr);
             tci_write_reg32(t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_ext8u_i32
-        case INDEX_op_ext8u_i32:
+        TCI_CASE(INDEX_op_ext8u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r8(&tb_ptr);
             tci_write_reg32(t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_ext16u_i32
-        case INDEX_op_ext16u_i32:
+        TCI_CASE(INDEX_op_ext16u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg32(t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_bswap16_i32
-        case INDEX_op_bswap16_i32:
+        TCI_CASE(INDEX_op_bswap16_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg32(t0, bswap16(t1));
             break;
 #endif
 #if TCG_TARGET_HAS_bswap32_i32
-        case INDEX_op_bswap32_i32:
+        TCI_CASE(INDEX_op_bswap32_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, bswap32(t1));
             break;
 #endif
 #if TCG_TARGET_HAS_not_i32
-        case INDEX_op_not_i32:
+        TCI_CASE(INDEX_op_not_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, ~t1);
             break;
 #endif
 #if TCG_TARGET_HAS_neg_i32
-        case INDEX_op_neg_i32:
+        TCI_CASE(INDEX_op_neg_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, -t1);
             break;
 #endif
 #if TCG_TARGET_REG_BITS == 64
-        case INDEX_op_mov_i64:
+        TCI_CASE(INDEX_op_mov_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, t1);
             break;
-        case INDEX_op_movi_i64:
+        TCI_CASE(INDEX_op_movi_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_i64(&tb_ptr);
             tci_write_reg64(t0, t1);
@@ -840,54 +1019,54 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 
             /* Load/store operations (64 bit). */
 
-        case INDEX_op_ld8u_i64:
+        TCI_CASE(INDEX_op_ld8u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
             break;
-        case INDEX_op_ld8s_i64:
-        case INDEX_op_ld16u_i64:
-        case INDEX_op_ld16s_i64:
+        TCI_CASE(INDEX_op_ld8s_i64):
+        TCI_CASE(INDEX_op_ld16u_i64):
+        TCI_CASE(INDEX_op_ld16s_i64):
             TODO();
             break;
-        case INDEX_op_ld32u_i64:
+        TCI_CASE(INDEX_op_ld32u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
             break;
-        case INDEX_op_ld32s_i64:
+        TCI_CASE(INDEX_op_ld32s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg32s(t0, *(int32_t *)(t1 + t2));
             break;
-        case INDEX_op_ld_i64:
+        TCI_CASE(INDEX_op_ld_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg64(t0, *(uint64_t *)(t1 + t2));
             break;
-        case INDEX_op_st8_i64:
+        TCI_CASE(INDEX_op_st8_i64):
             t0 = tci_read_r8(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint8_t *)(t1 + t2) = t0;
             break;
-        case INDEX_op_st16_i64:
+        TCI_CASE(INDEX_op_st16_i64):
             t0 = tci_read_r16(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint16_t *)(t1 + t2) = t0;
             break;
-        case INDEX_op_st32_i64:
+        TCI_CASE(INDEX_op_st32_i64):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint32_t *)(t1 + t2) = t0;
             break;
-        case INDEX_op_st_i64:
+        TCI_CASE(INDEX_op_st_i64):
             t0 = tci_read_r64(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
@@ -897,50 +1076,50 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 
             /* Arithmetic operations (64 bit). */
 
-        case INDEX_op_add_i64:
+        TCI_CASE(INDEX_op_add_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 + t2);
             break;
-        case INDEX_op_sub_i64:
+        TCI_CASE(INDEX_op_sub_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 - t2);
             break;
-        case INDEX_op_mul_i64:
+        TCI_CASE(INDEX_op_mul_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 * t2);
             break;
 #if TCG_TARGET_HAS_div_i64
-        case INDEX_op_div_i64:
-        case INDEX_op_divu_i64:
-        case INDEX_op_rem_i64:
-        case INDEX_op_remu_i64:
+        TCI_CASE(INDEX_op_div_i64):
+        TCI_CASE(INDEX_op_divu_i64):
+        TCI_CASE(INDEX_op_rem_i64):
+        TCI_CASE(INDEX_op_remu_i64):
             TODO();
             break;
 #elif TCG_TARGET_HAS_div2_i64
-        case INDEX_op_div2_i64:
-        case INDEX_op_divu2_i64:
+        TCI_CASE(INDEX_op_div2_i64):
+        TCI_CASE(INDEX_op_divu2_i64):
             TODO();
             break;
 #endif
-        case INDEX_op_and_i64:
+        TCI_CASE(INDEX_op_and_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 & t2);
             break;
-        case INDEX_op_or_i64:
+        TCI_CASE(INDEX_op_or_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 | t2);
             break;
-        case INDEX_op_xor_i64:
+        TCI_CASE(INDEX_op_xor_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
@@ -949,32 +1128,32 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 
             /* Shift/rotate operations (64 bit). */
 
-        case INDEX_op_shl_i64:
+        TCI_CASE(INDEX_op_shl_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 << (t2 & 63));
             break;
-        case INDEX_op_shr_i64:
+        TCI_CASE(INDEX_op_shr_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 >> (t2 & 63));
             break;
-        case INDEX_op_sar_i64:
+        TCI_CASE(INDEX_op_sar_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, ((int64_t)t1 >> (t2 & 63)));
             break;
 #if TCG_TARGET_HAS_rot_i64
-        case INDEX_op_rotl_i64:
+        TCI_CASE(INDEX_op_rotl_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, rol64(t1, t2 & 63));
             break;
-        case INDEX_op_rotr_i64:
+        TCI_CASE(INDEX_op_rotr_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
@@ -982,7 +1161,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             break;
 #endif
 #if TCG_TARGET_HAS_deposit_i64
-        case INDEX_op_deposit_i64:
+        TCI_CASE(INDEX_op_deposit_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             t2 = tci_read_r64(&tb_ptr);
@@ -992,7 +1171,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tci_write_reg64(t0, (t1 & ~tmp64) | ((t2 << tmp16) & tmp64));
             break;
 #endif
-        case INDEX_op_brcond_i64:
+        TCI_CASE(INDEX_op_brcond_i64):
             t0 = tci_read_r64(&tb_ptr);
             t1 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
@@ -1004,49 +1183,49 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             }
             break;
 #if TCG_TARGET_HAS_ext8u_i64
-        case INDEX_op_ext8u_i64:
+        TCI_CASE(INDEX_op_ext8u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r8(&tb_ptr);
             tci_write_reg64(t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_ext8s_i64
-        case INDEX_op_ext8s_i64:
+        TCI_CASE(INDEX_op_ext8s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r8s(&tb_ptr);
             tci_write_reg64(t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_ext16s_i64
-        case INDEX_op_ext16s_i64:
+        TCI_CASE(INDEX_op_ext16s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r16s(&tb_ptr);
             tci_write_reg64(t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_ext16u_i64
-        case INDEX_op_ext16u_i64:
+        TCI_CASE(INDEX_op_ext16u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg64(t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_ext32s_i64
-        case INDEX_op_ext32s_i64:
+        TCI_CASE(INDEX_op_ext32s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32s(&tb_ptr);
             tci_write_reg64(t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_ext32u_i64
-        case INDEX_op_ext32u_i64:
+        TCI_CASE(INDEX_op_ext32u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg64(t0, t1);
             break;
 #endif
 #if TCG_TARGET_HAS_bswap16_i64
-        case INDEX_op_bswap16_i64:
+        TCI_CASE(INDEX_op_bswap16_i64):
             TODO();
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
@@ -1054,28 +1233,28 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             break;
 #endif
 #if TCG_TARGET_HAS_bswap32_i64
-        case INDEX_op_bswap32_i64:
+        TCI_CASE(INDEX_op_bswap32_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg64(t0, bswap32(t1));
             break;
 #endif
 #if TCG_TARGET_HAS_bswap64_i64
-        case INDEX_op_bswap64_i64:
+        TCI_CASE(INDEX_op_bswap64_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, bswap64(t1));
             break;
 #endif
 #if TCG_TARGET_HAS_not_i64
-        case INDEX_op_not_i64:
+        TCI_CASE(INDEX_op_not_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, ~t1);
             break;
 #endif
 #if TCG_TARGET_HAS_neg_i64
-        case INDEX_op_neg_i64:
+        TCI_CASE(INDEX_op_neg_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, -t1);
@@ -1086,24 +1265,24 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             /* QEMU specific operations. */
 
 #if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
-        case INDEX_op_debug_insn_start:
+        TCI_CASE(INDEX_op_debug_insn_start):
             TODO();
             break;
 #else
-        case INDEX_op_debug_insn_start:
+        TCI_CASE(INDEX_op_debug_insn_start):
             TODO();
             break;
 #endif
-        case INDEX_op_exit_tb:
+        TCI_CASE(INDEX_op_exit_tb):
             next_tb = *(uint64_t *)tb_ptr;
             goto exit;
             break;
-        case INDEX_op_goto_tb:
+        TCI_CASE(INDEX_op_goto_tb):
             t0 = tci_read_i32(&tb_ptr);
             assert(tb_ptr == old_code_ptr + op_size);
             tb_ptr += (int32_t)t0;
             continue;
-        case INDEX_op_qemu_ld_i32:
+        TCI_CASE(INDEX_op_qemu_ld_i32):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
             oi = tci_read_i(&tb_ptr);
@@ -1137,7 +1316,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             }
             tci_write_reg(t0, tmp32);
             break;
-        case INDEX_op_qemu_ld_i64:
+        TCI_CASE(INDEX_op_qemu_ld_i64):
             t0 = *tb_ptr++;
             if (TCG_TARGET_REG_BITS == 32) {
                 t1 = *tb_ptr++;
@@ -1189,7 +1368,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
                 tci_write_reg(t1, tmp64 >> 32);
             }
             break;
-        case INDEX_op_qemu_st_i32:
+        TCI_CASE(INDEX_op_qemu_st_i32):
             t0 = tci_read_r(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
             oi = tci_read_i(&tb_ptr);
@@ -1213,7 +1392,7 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
                 tcg_abort();
             }
             break;
-        case INDEX_op_qemu_st_i64:
+        TCI_CASE(INDEX_op_qemu_st_i64):
             tmp64 = tci_read_r64(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
             oi = tci_read_i(&tb_ptr);
@@ -1244,6 +1423,9 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             }
             break;
         default:
+#ifdef TCI_COMPUTED_GOTO
+        tci_label_default:
+#endif
             TODO();
             break;
         }
@@ -1484,6 +1484,42 @@ static void unterminated_literal(void)
     g_assert(obj == NULL);
 }
 
+/*
+ * A reply in the style of a query-block for many devices: a list of dicts
+ * with long string values, which is where the lexer spends its time.
+ */
+static void perf_large_reply(void)
+{
+    GString *gstr = g_string_new("{'return': [");
+    QObject *obj;
+    unsigned int i, max;
+    double duration;
+
+    for (i = 0; i < 512; i++) {
+        g_string_append_printf(gstr,
+            "%s{'device': 'drive-virtio-disk%u', 'locked': false, "
+            "'removable': false, 'io-status': 'ok', 'inserted': "
+            "{'file': '/var/lib/libvirt/images/guest-disk-%u.qcow2', "
+            "'backing_file_depth': 0, 'encrypted': false, "
+            "'bps': 0, 'iops': 0, 'drv': 'qcow2'}}",
+            i ? ", " : "", i, i);
+    }
+    g_string_append(gstr, "]}");
+
+    max = 100;
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        obj = qobject_from_json(gstr->str);
+        g_assert(obj != NULL);
+        qobject_decref(obj);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Parsed %u replies of %zu bytes: %f s\n",
+                   max, gstr->len, duration);
+    g_string_free(gstr, true);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1520,5 +1556,9 @@ int main(int argc, char **argv)
     g_test_add_func("/errors/invalid_dict_comma", invalid_dict_comma);
     g_test_add_func("/errors/unterminated/literal", unterminated_literal);
 
+    if (g_test_perf()) {
+        g_test_add_func("/perf/large_reply", perf_large_reply);
+    }
+
     return g_test_run();
 }
@@ -37,7 +37,9 @@ static void test_fw_cfg_signature(void)
 
 static void test_fw_cfg_id(void)
 {
-    g_assert_cmpint(qfw_cfg_get_u32(fw_cfg, FW_CFG_ID), ==, 1);
+    /* the default machine type has the DMA interface */
+    g_assert_cmpint(qfw_cfg_get_u32(fw_cfg, FW_CFG_ID), ==,
+                    FW_CFG_VERSION | FW_CFG_VERSION_DMA);
 }
 
 static void test_fw_cfg_uuid(void)
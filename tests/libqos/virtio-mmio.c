@@ -134,6 +134,7 @@ static QVirtQueue *qvirtio_mmio_virtqueue_setup(QVirtioDevice *d,
     vq->index = index;
     vq->size = qvirtio_mmio_get_queue_size(d);
     vq->free_head = 0;
+    vq->last_used_idx = 0;
     vq->num_free = vq->size;
     vq->align = dev->page_size;
     vq->indirect = (dev->features & QVIRTIO_F_RING_INDIRECT_DESC) != 0;
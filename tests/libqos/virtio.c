@@ -226,6 +226,40 @@ uint32_t qvirtqueue_add(QVirtQueue *vq, uint64_t data, uint32_t len, bool write,
     return vq->free_head++; /* Return and increase, in this order */
 }
 
+/* Take the next element off the used ring, if the device has returned one.
+ * @desc_idx is set to the head of the descriptor chain, which can be kicked
+ * again as it is, because the device does not touch the descriptors.
+ */
+bool qvirtqueue_get_buf(QVirtQueue *vq, uint32_t *desc_idx)
+{
+    /* vq->used->idx */
+    uint16_t idx = readw(vq->used + 2);
+
+    if (idx == vq->last_used_idx) {
+        return false;
+    }
+
+    /* vq->used->ring[vq->last_used_idx % vq->size].id */
+    *desc_idx = readl(vq->used + 4 + (sizeof(struct QVRingUsedElem) *
+                                      (vq->last_used_idx % vq->size)));
+    vq->last_used_idx++;
+    return true;
+}
+
+/* Wait for the device to return a buffer.  Unlike qvirtio_wait_queue_isr(),
+ * this works with several requests in flight.
+ */
+uint32_t qvirtqueue_wait_buf(QVirtQueue *vq, gint64 timeout_us)
+{
+    gint64 start_time = g_get_monotonic_time();
+    uint32_t desc_idx;
+
+    while (!qvirtqueue_get_buf(vq, &desc_idx)) {
+        g_assert(g_get_monotonic_time() - start_time <= timeout_us);
+    }
+    return desc_idx;
+}
+
 uint32_t qvirtqueue_add_indirect(QVirtQueue *vq, QVRingIndirectDesc *indirect)
 {
     g_assert(vq->indirect);
@@ -88,6 +88,7 @@ typedef struct QVirtQueue {
     uint32_t free_head;
     uint32_t num_free;
     uint32_t align;
+    uint16_t last_used_idx;
     bool indirect;
     bool event;
 } QVirtQueue;
@@ -189,5 +190,8 @@ uint32_t qvirtqueue_add_indirect(QVirtQueue *vq, QVRingIndirectDesc *indirect);
 void qvirtqueue_kick(const QVirtioBus *bus, QVirtioDevice *d, QVirtQueue *vq,
                                                             uint32_t free_head);
 
+bool qvirtqueue_get_buf(QVirtQueue *vq, uint32_t *desc_idx);
+uint32_t qvirtqueue_wait_buf(QVirtQueue *vq, gint64 timeout_us);
+
 void qvirtqueue_set_used_event(QVirtQueue *vq, uint16_t idx);
 #endif
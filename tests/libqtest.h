@@ -407,6 +407,15 @@ int64_t qtest_clock_set(QTestState *s, int64_t val);
  */
 const char *qtest_get_arch(void);
 
+/**
+ * qtest_child_cpu_time:
+ *
+ * Returns: The user and system CPU time, in seconds, used by the QEMU
+ * processes that have been shut down with qtest_quit() so far.  Benchmarks
+ * take the difference across one QEMU run, which includes its startup.
+ */
+double qtest_child_cpu_time(void);
+
 /**
  * qtest_add_func:
  * @str: Test case path.
@@ -417,6 +417,93 @@ static void test_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+static void test_wait_event_notifier_many(void)
+{
+    /* More than enough to switch to epoll, where it is available */
+    EventNotifierTestData data[100];
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(data); i++) {
+        data[i] = (EventNotifierTestData) { .n = 0, .active = 1 };
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_cb);
+    }
+    while (aio_poll(ctx, false));
+
+    event_notifier_set(&data[42].e);
+    g_assert(aio_poll(ctx, false));
+    for (i = 0; i < ARRAY_SIZE(data); i++) {
+        g_assert_cmpint(data[i].n, ==, i == 42);
+    }
+
+    /* Removed handlers are not waited for any more */
+    aio_set_event_notifier(ctx, &data[7].e, NULL);
+    event_notifier_set(&data[7].e);
+    event_notifier_set(&data[99].e);
+    wait_until_inactive(&data[99]);
+    g_assert_cmpint(data[7].n, ==, 0);
+    g_assert_cmpint(data[99].n, ==, 1);
+
+    for (i = 0; i < ARRAY_SIZE(data); i++) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+        event_notifier_cleanup(&data[i].e);
+    }
+    g_assert(!aio_poll(ctx, false));
+}
+
+typedef struct {
+    EventNotifier e;
+    int n;
+    bool ready;
+} PollTestData;
+
+static void poll_test_read_cb(EventNotifier *e)
+{
+    PollTestData *data = container_of(e, PollTestData, e);
+
+    event_notifier_test_and_clear(e);
+    data->ready = false;
+    data->n++;
+}
+
+static bool poll_test_poll_cb(void *opaque)
+{
+    PollTestData *data = container_of(opaque, PollTestData, e);
+
+    return data->ready;
+}
+
+static void test_poll_event_notifier(void)
+{
+    PollTestData data = { .n = 0, .ready = false };
+    uint64_t successes = ctx->poll_successes;
+
+    aio_context_set_poll_params(ctx, 100 * SCALE_MS, 0, 0, &error_abort);
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, poll_test_read_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, poll_test_poll_cb);
+    while (aio_poll(ctx, false));
+
+    /* A quick wakeup opens the polling window... */
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(ctx->poll_ns, >, 0);
+
+    /* ...so that the handler then runs without the notifier being set */
+    data.ready = true;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 2);
+    g_assert_cmpint(ctx->poll_successes, ==, successes + 1);
+
+    aio_set_event_notifier(ctx, &data.e, NULL);
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 2);
+
+    event_notifier_cleanup(&data.e);
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+}
+
 static void test_timer_schedule(void)
 {
     TimerTestData data = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 750LL,
@@ -790,6 +877,84 @@ static void test_source_timer_schedule(void)
     timer_del(&data.timer);
 }
 
+/* Benchmarks, run with -m perf.  */
+
+static void perf_bh_dispatch(void)
+{
+    BHTestData data = { .n = 0, .max = 10000000 };
+    double duration;
+
+    data.bh = aio_bh_new(ctx, bh_test_cb, &data);
+
+    g_test_timer_start();
+    qemu_bh_schedule(data.bh);
+    while (data.n < data.max) {
+        aio_poll(ctx, true);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%d bottom halves scheduled and dispatched: %f s, "
+                   "%.1f ns per bottom half",
+                   data.max, duration, duration * 1e9 / data.max);
+    qemu_bh_delete(data.bh);
+}
+
+typedef struct {
+    EventNotifier e;
+    QemuEvent ack;
+    int n;
+    int max;
+} PingPongTestData;
+
+static void pingpong_cb(EventNotifier *e)
+{
+    PingPongTestData *data = container_of(e, PingPongTestData, e);
+
+    g_assert(event_notifier_test_and_clear(e));
+    data->n++;
+    qemu_event_set(&data->ack);
+}
+
+static void *pingpong_thread(void *opaque)
+{
+    PingPongTestData *data = opaque;
+    int i;
+
+    for (i = 0; i < data->max; i++) {
+        event_notifier_set(&data->e);
+        qemu_event_wait(&data->ack);
+        qemu_event_reset(&data->ack);
+    }
+    return NULL;
+}
+
+/* Wakeup of aio_poll() by an EventNotifier set from another thread */
+static void perf_event_wakeup(void)
+{
+    PingPongTestData data = { .n = 0, .max = 200000 };
+    QemuThread thread;
+    double duration;
+
+    event_notifier_init(&data.e, false);
+    qemu_event_init(&data.ack, false);
+    aio_set_event_notifier(ctx, &data.e, pingpong_cb);
+
+    g_test_timer_start();
+    qemu_thread_create(&thread, "pingpong", pingpong_thread, &data,
+                       QEMU_THREAD_JOINABLE);
+    while (data.n < data.max) {
+        aio_poll(ctx, true);
+    }
+    qemu_thread_join(&thread);
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%d cross-thread wakeups: %f s, %.1f us per round trip",
+                   data.max, duration, duration * 1e6 / data.max);
+
+    aio_set_event_notifier(ctx, &data.e, NULL);
+    qemu_event_destroy(&data.ack);
+    event_notifier_cleanup(&data.e);
+}
 
 /* End of tests.  */
 
@@ -826,6 +991,8 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
+    g_test_add_func("/aio/event/wait/many",         test_wait_event_notifier_many);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
@@ -841,5 +1008,9 @@ int main(int argc, char **argv)
     g_test_add_func("/aio-gsource/event/wait/no-flush-cb",  test_source_wait_event_notifier_noflush);
     g_test_add_func("/aio-gsource/event/flush",             test_source_flush_event_notifier);
     g_test_add_func("/aio-gsource/timer/schedule",          test_source_timer_schedule);
+    if (g_test_perf()) {
+        g_test_add_func("/aio/perf/bh-dispatch",            perf_bh_dispatch);
+        g_test_add_func("/aio/perf/event-wakeup",           perf_event_wakeup);
+    }
     return g_test_run();
 }
@@ -67,10 +67,113 @@ static void test_sextract64(void)
     }
 }
 
+/* The plain word by word search, to check find_next_bit against */
+static unsigned long ref_find_next_bit(const unsigned long *addr,
+                                       unsigned long size,
+                                       unsigned long offset)
+{
+    for (; offset < size; offset++) {
+        if (addr[offset / BITS_PER_LONG] & (1UL << (offset % BITS_PER_LONG))) {
+            break;
+        }
+        if (!(offset % BITS_PER_LONG) && !addr[offset / BITS_PER_LONG]) {
+            offset += BITS_PER_LONG - 1;
+        }
+    }
+    return MIN(offset, size);
+}
+
+/* A bitmap of @nbits with about one bit set in @sparseness */
+static unsigned long *new_sparse_bitmap(unsigned long nbits,
+                                        unsigned long sparseness)
+{
+    unsigned long *bitmap = g_new0(unsigned long, BITS_TO_LONGS(nbits));
+    unsigned long i;
+
+    for (i = 0; i < nbits / sparseness; i++) {
+        unsigned long nr = g_test_rand_int_range(0, nbits);
+
+        bitmap[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+    }
+    return bitmap;
+}
+
+static void test_find_next_bit(void)
+{
+    /* long enough for the zero runs to be skipped */
+    const unsigned long nbits = 1 << 20;
+    unsigned long sparseness[] = { 3, 100, 10000, 1 << 30 };
+    unsigned long *bitmap;
+    unsigned long nr, size;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(sparseness); i++) {
+        bitmap = new_sparse_bitmap(nbits, sparseness[i]);
+        for (size = nbits - 131; size <= nbits; size += 131) {
+            for (nr = 0; nr < size; nr = ref_find_next_bit(bitmap, size,
+                                                           nr + 1)) {
+                g_assert_cmpint(find_next_bit(bitmap, size, nr), ==,
+                                ref_find_next_bit(bitmap, size, nr));
+                /* an unaligned start in a zero run */
+                g_assert_cmpint(find_next_bit(bitmap, size, nr + 7), ==,
+                                ref_find_next_bit(bitmap, size, nr + 7));
+            }
+            g_assert_cmpint(find_next_bit(bitmap, size, nr), ==, size);
+        }
+        g_free(bitmap);
+    }
+}
+
+/*
+ * Walk a dirty bitmap as the migration of the RAM of a big guest does
+ * after its first pass, when few pages are dirty.
+ */
+static void perf_find_next_bit(void)
+{
+    /* 256 GiB in 4 KiB pages */
+    const unsigned long nbits = 1UL << 26;
+    unsigned long sparseness[] = { 64, 4096, 1 << 20 };
+    unsigned long *bitmap;
+    unsigned long nr, found, ref_found;
+    double duration, ref_duration;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(sparseness); i++) {
+        bitmap = new_sparse_bitmap(nbits, sparseness[i]);
+
+        g_test_timer_start();
+        ref_found = 0;
+        for (nr = ref_find_next_bit(bitmap, nbits, 0); nr < nbits;
+             nr = ref_find_next_bit(bitmap, nbits, nr + 1)) {
+            ref_found++;
+        }
+        ref_duration = g_test_timer_elapsed();
+
+        g_test_timer_start();
+        found = 0;
+        for (nr = find_next_bit(bitmap, nbits, 0); nr < nbits;
+             nr = find_next_bit(bitmap, nbits, nr + 1)) {
+            found++;
+        }
+        duration = g_test_timer_elapsed();
+
+        g_assert_cmpint(found, ==, ref_found);
+        g_test_message("%lu MiB bitmap, %lu bits set: %f s, word by word "
+                       "%f s (x%.1f)",
+                       nbits / BITS_PER_BYTE >> 20, found, duration,
+                       ref_duration, ref_duration / duration);
+        g_free(bitmap);
+    }
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/bitops/sextract32", test_sextract32);
     g_test_add_func("/bitops/sextract64", test_sextract64);
+    g_test_add_func("/bitops/find_next_bit", test_find_next_bit);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/bitops/find_next_bit", perf_find_next_bit);
+    }
     return g_test_run();
 }
@@ -0,0 +1,92 @@
+/*
+ * Buffer pool unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "block/buffer-pool.h"
+
+static void test_reuse(void)
+{
+    BufferPool *pool = buffer_pool_new();
+    uint8_t *buf, *buf2;
+    size_t i;
+
+    buf = buffer_pool_try_get(pool, 512, 3000);
+    g_assert(buf != NULL);
+    g_assert_cmpint((uintptr_t)buf % BUFFER_POOL_MIN_SIZE, ==, 0);
+    /* new buffers come zeroed, and the whole size class is usable */
+    for (i = 0; i < BUFFER_POOL_MIN_SIZE; i++) {
+        g_assert_cmpint(buf[i], ==, 0);
+    }
+    memset(buf, 0xa5, BUFFER_POOL_MIN_SIZE);
+    buffer_pool_put(pool, buf, 3000);
+
+    /* same size class */
+    buf2 = buffer_pool_try_get(pool, 4096, 4096);
+    g_assert(buf2 == buf);
+    buffer_pool_put(pool, buf2, 4096);
+
+    /* a different one */
+    buf2 = buffer_pool_try_get(pool, 4096, 4097);
+    g_assert(buf2 != buf);
+    g_assert_cmpint((uintptr_t)buf2 % 4096, ==, 0);
+    buffer_pool_put(pool, buf2, 4097);
+
+    /* no pooled buffer has this alignment */
+    buf2 = buffer_pool_try_get(pool, 65536, 4096);
+    g_assert(buf2 != buf);
+    g_assert_cmpint((uintptr_t)buf2 % 65536, ==, 0);
+    buffer_pool_put(pool, buf2, 4096);
+
+    buffer_pool_put(pool, NULL, 4096);
+    buffer_pool_free(pool);
+}
+
+static void test_limits(void)
+{
+    BufferPool *pool = buffer_pool_new();
+    const size_t size = BUFFER_POOL_MAX_SIZE;
+    const int max_free = BUFFER_POOL_MAX_FREE_BYTES / size;
+    void *bufs[max_free + 1], *got[max_free];
+    void *buf;
+    int i, j;
+
+    for (i = 0; i < max_free + 1; i++) {
+        bufs[i] = buffer_pool_try_get(pool, 4096, size);
+        g_assert(bufs[i] != NULL);
+    }
+    for (i = 0; i < max_free + 1; i++) {
+        buffer_pool_put(pool, bufs[i], size);
+    }
+
+    /* the last one was freed, the others are handed out again */
+    for (i = 0; i < max_free; i++) {
+        got[i] = buffer_pool_try_get(pool, 4096, size);
+        for (j = 0; j < max_free && got[i] != bufs[j]; j++) {
+            /* nothing */
+        }
+        g_assert_cmpint(j, <, max_free);
+    }
+    for (i = 0; i < max_free; i++) {
+        buffer_pool_put(pool, got[i], size);
+    }
+
+    /* larger buffers are not pooled */
+    buf = buffer_pool_try_get(pool, 4096, size + 1);
+    g_assert(buf != NULL);
+    buffer_pool_put(pool, buf, size + 1);
+
+    buffer_pool_free(pool);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/buffer-pool/reuse", test_reuse);
+    g_test_add_func("/buffer-pool/limits", test_limits);
+    return g_test_run();
+}
@@ -365,6 +365,72 @@ static void perf_cost(void)
                    (unsigned long)(1000000000.0 * duration / maxcycles));
 }
 
+static CoMutex perf_mutex;
+
+static void coroutine_fn perf_mutex_uncontended_entry(void *opaque)
+{
+    unsigned int i, *maxcycles = opaque;
+
+    for (i = 0; i < *maxcycles; i++) {
+        qemu_co_mutex_lock(&perf_mutex);
+        qemu_co_mutex_unlock(&perf_mutex);
+    }
+}
+
+static void perf_mutex_uncontended(void)
+{
+    unsigned int maxcycles = 100000000;
+    Coroutine *co;
+    double duration;
+
+    qemu_co_mutex_init(&perf_mutex);
+    co = qemu_coroutine_create(perf_mutex_uncontended_entry);
+
+    g_test_timer_start();
+    qemu_coroutine_enter(co, &maxcycles);
+    duration = g_test_timer_elapsed();
+
+    g_test_message("CoMutex lock/unlock %u iterations: %f s, %.1f ns each",
+                   maxcycles, duration, duration * 1e9 / maxcycles);
+}
+
+static void coroutine_fn perf_mutex_holder_entry(void *opaque)
+{
+    qemu_co_mutex_lock(&perf_mutex);
+    qemu_coroutine_yield();
+    qemu_co_mutex_unlock(&perf_mutex);
+}
+
+static void coroutine_fn perf_mutex_waiter_entry(void *opaque)
+{
+    qemu_co_mutex_lock(&perf_mutex);
+    qemu_co_mutex_unlock(&perf_mutex);
+}
+
+/* One coroutine waits for the mutex, and gets it when the holder drops it */
+static void perf_mutex_handoff(void)
+{
+    const unsigned int maxcycles = 10000000;
+    Coroutine *holder, *waiter;
+    unsigned int i;
+    double duration;
+
+    qemu_co_mutex_init(&perf_mutex);
+
+    g_test_timer_start();
+    for (i = 0; i < maxcycles; i++) {
+        holder = qemu_coroutine_create(perf_mutex_holder_entry);
+        waiter = qemu_coroutine_create(perf_mutex_waiter_entry);
+        qemu_coroutine_enter(holder, NULL);
+        qemu_coroutine_enter(waiter, NULL);
+        qemu_coroutine_enter(holder, NULL);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("CoMutex handoff %u iterations: %f s, %.1f ns each",
+                   maxcycles, duration, duration * 1e9 / maxcycles);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -381,6 +447,8 @@ int main(int argc, char **argv)
         g_test_add_func("/perf/yield", perf_yield);
         g_test_add_func("/perf/function-call", perf_baseline);
         g_test_add_func("/perf/cost", perf_cost);
+        g_test_add_func("/perf/mutex/uncontended", perf_mutex_uncontended);
+        g_test_add_func("/perf/mutex/handoff", perf_mutex_handoff);
     }
     return g_test_run();
 }
@@ -0,0 +1,111 @@
+/*
+ * crc32c() unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/crc32c.h"
+
+#define BUF_SIZE (64 * 1024)
+
+/* Bit by bit, as the specification has it */
+static uint32_t crc32c_ref(uint32_t crc, const uint8_t *data, size_t length)
+{
+    int i;
+
+    while (length--) {
+        crc ^= *data++;
+        for (i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+        }
+    }
+    return crc ^ 0xffffffff;
+}
+
+/* From RFC 3720, appendix B.4 */
+static void test_crc32c_vectors(void)
+{
+    uint8_t buf[48];
+    int i;
+
+    g_assert_cmphex(crc32c(0xffffffff, (const uint8_t *)"123456789", 9),
+                    ==, 0xe3069283);
+
+    memset(buf, 0, 32);
+    g_assert_cmphex(crc32c(0xffffffff, buf, 32), ==, 0x8a9136aa);
+
+    memset(buf, 0xff, 32);
+    g_assert_cmphex(crc32c(0xffffffff, buf, 32), ==, 0x62a8ab43);
+
+    for (i = 0; i < 32; i++) {
+        buf[i] = i;
+    }
+    g_assert_cmphex(crc32c(0xffffffff, buf, 32), ==, 0x46dd794e);
+
+    for (i = 0; i < 32; i++) {
+        buf[i] = 31 - i;
+    }
+    g_assert_cmphex(crc32c(0xffffffff, buf, 32), ==, 0x113fdb5c);
+}
+
+/* Big buffers take other paths than small ones, and so may misalignment */
+static void test_crc32c_lengths(void)
+{
+    uint8_t *buf = g_malloc(BUF_SIZE + 8);
+    size_t length, offset;
+
+    for (length = 0; length < BUF_SIZE + 8; length++) {
+        buf[length] = g_test_rand_int();
+    }
+
+    for (offset = 0; offset < 8; offset++) {
+        for (length = 0; length < 1024; length++) {
+            g_assert_cmphex(crc32c(0xffffffff, buf + offset, length), ==,
+                            crc32c_ref(0xffffffff, buf + offset, length));
+        }
+        for (length = 1024; length <= BUF_SIZE; length += 1021) {
+            g_assert_cmphex(crc32c(0xffffffff, buf + offset, length), ==,
+                            crc32c_ref(0xffffffff, buf + offset, length));
+        }
+    }
+    g_free(buf);
+}
+
+static void perf_crc32c(void)
+{
+    uint8_t *buf = g_malloc0(BUF_SIZE);
+    unsigned int i, max;
+    uint32_t crc = 0;
+    double duration;
+
+    max = 16384;
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        crc += crc32c(0xffffffff, buf, BUF_SIZE);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%u buffers of %u bytes: %f MB/s (%08x)\n",
+                   max, BUF_SIZE, max * (BUF_SIZE / 1048576.0) / duration,
+                   crc);
+    g_free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/crc32c/vectors", test_crc32c_vectors);
+    g_test_add_func("/crc32c/lengths", test_crc32c_lengths);
+
+    if (g_test_perf()) {
+        g_test_add_func("/perf/crc32c", perf_crc32c);
+    }
+
+    return g_test_run();
+}
@@ -226,6 +226,196 @@ static void test_parse_uint_full_correct(void)
     g_assert_cmpint(i, ==, 123);
 }
 
+/* the largest block that buffer_find_nonzero_offset() rounds down to */
+#define NONZERO_BLOCK   256
+
+static uint8_t *alloc_aligned_zero(size_t len, void **mem)
+{
+    *mem = g_malloc0(len + NONZERO_BLOCK);
+    return (uint8_t *)QEMU_ALIGN_UP((uintptr_t)*mem, NONZERO_BLOCK);
+}
+
+static void test_buffer_find_nonzero_offset(void)
+{
+    const size_t len = 64 * 1024;
+    size_t pos, r;
+    uint8_t *buf;
+    void *mem;
+
+    buf = alloc_aligned_zero(len, &mem);
+    g_assert(can_use_buffer_find_nonzero_offset(buf, len));
+
+    g_assert_cmpint(buffer_find_nonzero_offset(buf, 0), ==, 0);
+    g_assert_cmpint(buffer_find_nonzero_offset(buf, len), ==, len);
+
+    for (pos = 0; pos < len; pos += 37) {
+        buf[pos] = 1;
+        r = buffer_find_nonzero_offset(buf, len);
+        g_assert_cmpint(r, <=, pos);
+        g_assert_cmpint(pos - r, <, NONZERO_BLOCK);
+        /* not past the end of a shorter buffer */
+        r = buffer_find_nonzero_offset(buf, pos & ~(NONZERO_BLOCK - 1));
+        g_assert_cmpint(r, ==, pos & ~(NONZERO_BLOCK - 1));
+        buf[pos] = 0;
+    }
+
+    g_free(mem);
+}
+
+static void test_buffer_is_zero(void)
+{
+    const size_t len = 4096;
+    size_t start, size, pos;
+    uint8_t *buf;
+    void *mem;
+
+    buf = alloc_aligned_zero(len, &mem);
+
+    /* any alignment and length, with the non-zero byte anywhere */
+    for (start = 0; start < 80; start += 7) {
+        for (size = 0; size + start <= len; size += size < 64 ? 1 : 251) {
+            g_assert(buffer_is_zero(buf + start, size));
+            for (pos = 0; pos < size; pos += size < 64 ? 1 : 61) {
+                buf[start + pos] = 0x80;
+                g_assert(!buffer_is_zero(buf + start, size));
+                buf[start + pos] = 0;
+            }
+            if (size) {
+                buf[start + size - 1] = 1;
+                g_assert(!buffer_is_zero(buf + start, size));
+                buf[start + size - 1] = 0;
+            }
+            /* bytes just outside of the buffer are ignored */
+            if (start) {
+                buf[start - 1] = 1;
+            }
+            buf[start + size] = 1;
+            g_assert(buffer_is_zero(buf + start, size));
+            if (start) {
+                buf[start - 1] = 0;
+            }
+            buf[start + size] = 0;
+        }
+    }
+
+    g_free(mem);
+}
+
+/* Scan guest pages as is_zero_range() in the RAM migration does. */
+static void perf_buffer_find_nonzero_offset(void)
+{
+    const size_t page_size = 4096;
+    const size_t len = 64 * 1024 * 1024;
+    const int passes = 16;
+    size_t pos, zero_pages, ref_zero_pages;
+    double duration, ref_duration;
+    uint8_t *buf;
+    void *mem;
+    int i;
+
+    buf = alloc_aligned_zero(len, &mem);
+    /* every other page has one byte set at its end */
+    for (pos = page_size - 1; pos < len; pos += 2 * page_size) {
+        buf[pos] = 1;
+    }
+
+    g_test_timer_start();
+    ref_zero_pages = 0;
+    for (i = 0; i < passes; i++) {
+        for (pos = 0; pos < len; pos += page_size) {
+            const unsigned long *p = (const unsigned long *)(buf + pos);
+            size_t j;
+
+            for (j = 0; j < page_size / sizeof(*p) && !p[j]; j++) {
+                /* nothing */
+            }
+            ref_zero_pages += j == page_size / sizeof(*p);
+        }
+    }
+    ref_duration = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    zero_pages = 0;
+    for (i = 0; i < passes; i++) {
+        for (pos = 0; pos < len; pos += page_size) {
+            zero_pages += buffer_find_nonzero_offset(buf + pos, page_size) ==
+                          page_size;
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    g_assert_cmpint(zero_pages, ==, ref_zero_pages);
+    g_test_message("%d MiB of pages in %f s (%f GiB/s), word by word "
+                   "%f s (x%.1f)",
+                   (int)(passes * len >> 20), duration,
+                   passes * len / duration / (1 << 30), ref_duration,
+                   ref_duration / duration);
+
+    g_free(mem);
+}
+
+/*
+ * Check write requests as detect-zeroes does, most of which are not zero;
+ * the data usually differs from zero right at the start of the buffer.
+ */
+static void perf_buffer_is_zero(void)
+{
+    static const size_t sizes[] = { 4096, 65536 };
+    const size_t len = 64 * 1024 * 1024;
+    const int passes = 16;
+    size_t pos, zero_bufs, ref_zero_bufs;
+    double duration, ref_duration;
+    uint8_t *buf;
+    void *mem;
+    int i, j;
+
+    buf = alloc_aligned_zero(len, &mem);
+    for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+        const size_t size = sizes[j];
+
+        /* one buffer in four is zero, the others have some data */
+        memset(buf, 0, len);
+        for (pos = 0; pos < len; pos += size) {
+            if ((pos / size) % 4) {
+                buf[pos + (pos / size) % size] = 1;
+            }
+        }
+
+        g_test_timer_start();
+        ref_zero_bufs = 0;
+        for (i = 0; i < passes; i++) {
+            for (pos = 0; pos < len; pos += size) {
+                const unsigned long *p = (const unsigned long *)(buf + pos);
+                size_t k;
+
+                for (k = 0; k < size / sizeof(*p) && !p[k]; k++) {
+                    /* nothing */
+                }
+                ref_zero_bufs += k == size / sizeof(*p);
+            }
+        }
+        ref_duration = g_test_timer_elapsed();
+
+        g_test_timer_start();
+        zero_bufs = 0;
+        for (i = 0; i < passes; i++) {
+            for (pos = 0; pos < len; pos += size) {
+                zero_bufs += buffer_is_zero(buf + pos, size);
+            }
+        }
+        duration = g_test_timer_elapsed();
+
+        g_assert_cmpint(zero_bufs, ==, ref_zero_bufs);
+        g_test_message("%d MiB in %zu byte requests in %f s (%f GiB/s), "
+                       "word by word %f s (x%.1f)",
+                       (int)(passes * len >> 20), size, duration,
+                       passes * len / duration / (1 << 30), ref_duration,
+                       ref_duration / duration);
+    }
+
+    g_free(mem);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -246,6 +436,14 @@ int main(int argc, char **argv)
                     test_parse_uint_full_trailing);
     g_test_add_func("/cutils/parse_uint_full/correct",
                     test_parse_uint_full_correct);
+    g_test_add_func("/cutils/buffer_find_nonzero_offset",
+                    test_buffer_find_nonzero_offset);
+    g_test_add_func("/cutils/buffer_is_zero", test_buffer_is_zero);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/cutils/buffer_find_nonzero_offset",
+                        perf_buffer_find_nonzero_offset);
+        g_test_add_func("/perf/cutils/buffer_is_zero", perf_buffer_is_zero);
+    }
 
     return g_test_run();
 }
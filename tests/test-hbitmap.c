@@ -639,6 +639,99 @@ static void test_hbitmap_truncate_shrink_large(TestHBitmapData *data,
     hbitmap_test_truncate(data, size, -diff, 0);
 }
 
+/* Set a range in the shadow bitmap only.  */
+static void hbitmap_test_set_shadow(TestHBitmapData *data,
+                                    uint64_t first, uint64_t count)
+{
+    while (count-- != 0) {
+        data->bits[first >> LOG_BITS_PER_LONG] |=
+            1UL << (first & (BITS_PER_LONG - 1));
+        first++;
+    }
+}
+
+static void test_hbitmap_merge(TestHBitmapData *data,
+                               const void *unused)
+{
+    /* Large enough for the last level to be merged by several jobs */
+    size_t size = 24 * L3 + 7;
+    HBitmap *b = hbitmap_alloc(size, 0);
+    uint64_t count;
+
+    hbitmap_test_init(data, size, 0);
+    hbitmap_test_set(data, 0, 100);
+    hbitmap_test_set(data, 20 * L3, L2);
+
+    hbitmap_set(b, 50, 100);
+    hbitmap_set(b, 20 * L3 + L1, 2 * L2);
+    hbitmap_set(b, size - 10, 10);
+    g_assert(hbitmap_merge(data->hb, b));
+    count = hbitmap_count(data->hb);
+    g_assert_cmpint(count, ==, 150 + L1 + 2 * L2 + 10);
+
+    hbitmap_test_set_shadow(data, 50, 100);
+    hbitmap_test_set_shadow(data, 20 * L3 + L1, 2 * L2);
+    hbitmap_test_set_shadow(data, size - 10, 10);
+    hbitmap_test_check(data, 0);
+
+    hbitmap_free(b);
+}
+
+static void test_hbitmap_merge_mismatch(TestHBitmapData *data,
+                                        const void *unused)
+{
+    HBitmap *b = hbitmap_alloc(L2, 1);
+
+    hbitmap_test_init(data, L2, 0);
+    hbitmap_set(b, 0, L2);
+    g_assert(!hbitmap_merge(data->hb, b));
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 0);
+    hbitmap_free(b);
+}
+
+static void test_hbitmap_serialize(TestHBitmapData *data,
+                                   const void *unused)
+{
+    size_t size = 2 * L3 + 37;
+    uint64_t gran, half, buf_size, i;
+    HBitmap *hb;
+    uint8_t *buf;
+
+    hbitmap_test_init(data, size, 0);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, 70, 200);
+    hbitmap_test_set(data, L3 - 5, L2);
+    hbitmap_test_set(data, size - 3, 3);
+
+    gran = hbitmap_serialization_granularity(data->hb);
+    g_assert_cmpint(gran, ==, 64);
+    buf_size = hbitmap_serialization_size(data->hb, 0, size);
+    g_assert_cmpint(buf_size, ==, (size + 63) / 64 * 8);
+
+    buf = g_malloc(buf_size);
+    hbitmap_serialize_part(data->hb, buf, 0, size);
+
+    /* Little-endian, bit 0 first */
+    g_assert_cmpint(buf[0], ==, 0x01);
+    g_assert_cmpint(buf[8], ==, 0xc0);
+
+    /* Load it back in two parts, after some stale data */
+    hb = hbitmap_alloc(size, 0);
+    hbitmap_set(hb, 0, size);
+    half = (size / 2) & ~(gran - 1);
+    hbitmap_deserialize_zeroes(hb, 0, size, false);
+    hbitmap_deserialize_part(hb, buf, 0, half, false);
+    hbitmap_deserialize_part(hb, buf + half / 8, half, size - half, true);
+
+    g_assert_cmpint(hbitmap_count(hb), ==, hbitmap_count(data->hb));
+    for (i = 0; i < size; i++) {
+        g_assert_cmpint(hbitmap_get(hb, i), ==, hbitmap_get(data->hb, i));
+    }
+
+    hbitmap_free(hb);
+    g_free(buf);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -666,6 +759,9 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/reset/all", test_hbitmap_reset_all);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/merge/general", test_hbitmap_merge);
+    hbitmap_test_add("/hbitmap/merge/mismatch", test_hbitmap_merge_mismatch);
+    hbitmap_test_add("/hbitmap/serialize", test_hbitmap_serialize);
 
     hbitmap_test_add("/hbitmap/truncate/nop", test_hbitmap_truncate_nop);
     hbitmap_test_add("/hbitmap/truncate/grow/negligible",
@@ -0,0 +1,146 @@
+/*
+ * Interval tree unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu/interval-tree.h"
+
+#define N 1000
+
+typedef struct {
+    IntervalTreeNode nodes[N];
+    bool inserted[N];
+    IntervalTreeRoot root;
+} TestData;
+
+typedef struct {
+    TestData *data;
+    int skip;
+} MatchData;
+
+/* Reject one node, to check that the search goes on past it */
+static bool match_cb(IntervalTreeNode *node, void *opaque)
+{
+    MatchData *m = opaque;
+
+    return node != &m->data->nodes[m->skip];
+}
+
+static int check_subtree(IntervalTreeNode *n, uint64_t *max_last)
+{
+    uint64_t l = 0, r = 0;
+    int hl, hr;
+
+    if (!n) {
+        *max_last = 0;
+        return 0;
+    }
+    hl = check_subtree(n->left, &l);
+    hr = check_subtree(n->right, &r);
+    g_assert_cmpint(ABS(hl - hr), <=, 1);
+    if (n->left) {
+        g_assert_cmpuint(n->left->start, <=, n->start);
+    }
+    if (n->right) {
+        g_assert_cmpuint(n->right->start, >=, n->start);
+    }
+    *max_last = MAX(n->last, MAX(l, r));
+    g_assert_cmpuint(n->subtree_last, ==, *max_last);
+    return 1 + MAX(hl, hr);
+}
+
+static IntervalTreeNode *linear_find(TestData *data, uint64_t start,
+                                     uint64_t last, int skip)
+{
+    IntervalTreeNode *best = NULL;
+    int i;
+
+    for (i = 0; i < N; i++) {
+        IntervalTreeNode *n = &data->nodes[i];
+
+        if (!data->inserted[i] || i == skip ||
+            n->last < start || n->start > last) {
+            continue;
+        }
+        if (!best || n->start < best->start) {
+            best = n;
+        }
+    }
+    return best;
+}
+
+static void test_empty(void)
+{
+    IntervalTreeRoot root = { NULL };
+    IntervalTreeNode node = { .start = 0, .last = 0 };
+
+    g_assert(interval_tree_empty(&root));
+    g_assert(!interval_tree_find(&root, 0, UINT64_MAX, NULL, NULL));
+
+    interval_tree_insert(&root, &node);
+    g_assert(!interval_tree_empty(&root));
+    g_assert(interval_tree_find(&root, 0, 0, NULL, NULL) == &node);
+    g_assert(!interval_tree_find(&root, 1, UINT64_MAX, NULL, NULL));
+
+    interval_tree_remove(&root, &node);
+    g_assert(interval_tree_empty(&root));
+}
+
+static void test_random(void)
+{
+    TestData *data = g_new0(TestData, 1);
+    GRand *rand = g_rand_new_with_seed(42);
+    uint64_t max_last;
+    int i;
+
+    for (i = 0; i < 20 * N; i++) {
+        int j = g_rand_int_range(rand, 0, N);
+        IntervalTreeNode *n = &data->nodes[j];
+
+        if (data->inserted[j]) {
+            interval_tree_remove(&data->root, n);
+            data->inserted[j] = false;
+        } else {
+            /* Few distinct starts, so that there are ties */
+            n->start = g_rand_int_range(rand, 0, 256) * 512;
+            n->last = n->start + g_rand_int_range(rand, 0, 8192);
+            interval_tree_insert(&data->root, n);
+            data->inserted[j] = true;
+        }
+
+        if (i % 10 == 0) {
+            uint64_t start = g_rand_int_range(rand, 0, 256 * 512);
+            uint64_t last = start + g_rand_int_range(rand, 0, 4096);
+            MatchData m = { .data = data, .skip = g_rand_int_range(rand, 0, N) };
+            IntervalTreeNode *found, *expected;
+
+            check_subtree(data->root.node, &max_last);
+
+            found = interval_tree_find(&data->root, start, last,
+                                       match_cb, &m);
+            expected = linear_find(data, start, last, m.skip);
+            if (expected) {
+                g_assert(found);
+                g_assert_cmpuint(found->start, ==, expected->start);
+                g_assert(found != &data->nodes[m.skip]);
+                g_assert(found->last >= start && found->start <= last);
+            } else {
+                g_assert(!found);
+            }
+        }
+    }
+
+    g_rand_free(rand);
+    g_free(data);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/empty", test_empty);
+    g_test_add_func("/interval-tree/random", test_random);
+    return g_test_run();
+}
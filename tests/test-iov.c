@@ -398,6 +398,38 @@ static void test_discard_back(void)
     iov_free(iov, iov_cnt);
 }
 
+static void test_qiov_inline(void)
+{
+    char buf[QEMU_IOVEC_INLINE * 2];
+    QEMUIOVector qiov;
+    int i;
+
+    /* Small vectors live in the QEMUIOVector... */
+    qemu_iovec_init(&qiov, 1);
+    g_assert(qiov.iov == qiov.inline_iov);
+    for (i = 0; i < QEMU_IOVEC_INLINE; i++) {
+        qemu_iovec_add(&qiov, &buf[i], 1);
+    }
+    g_assert(qiov.iov == qiov.inline_iov);
+
+    /* ...and move to the heap, keeping their elements, once they grow */
+    for (; i < ARRAY_SIZE(buf); i++) {
+        qemu_iovec_add(&qiov, &buf[i], 1);
+    }
+    g_assert(qiov.iov != qiov.inline_iov);
+    g_assert_cmpint(qiov.niov, ==, ARRAY_SIZE(buf));
+    g_assert_cmpint(qiov.size, ==, ARRAY_SIZE(buf));
+    for (i = 0; i < ARRAY_SIZE(buf); i++) {
+        g_assert(qiov.iov[i].iov_base == &buf[i]);
+    }
+    qemu_iovec_destroy(&qiov);
+
+    qemu_iovec_init_buf(&qiov, buf, sizeof(buf));
+    g_assert_cmpint(qiov.niov, ==, 1);
+    g_assert_cmpint(qiov.size, ==, sizeof(buf));
+    g_assert(qiov.iov[0].iov_base == buf);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -406,5 +438,6 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/iov/io", test_io);
     g_test_add_func("/basic/iov/discard-front", test_discard_front);
     g_test_add_func("/basic/iov/discard-back", test_discard_back);
+    g_test_add_func("/basic/iov/qiov-inline", test_qiov_inline);
     return g_test_run();
 }
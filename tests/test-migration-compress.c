@@ -0,0 +1,175 @@
+/*
+ * Migration page compression unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <zlib.h>
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "include/migration/migration.h"
+
+#define PAGE_SIZE 4096
+
+/* A page that compresses somewhat, like most guest memory */
+static void fill_page(uint8_t *page)
+{
+    int i;
+
+    memset(page, 0, PAGE_SIZE);
+    for (i = 0; i < PAGE_SIZE / 2; i++) {
+        page[i] = g_test_rand_int_range(0, 16);
+    }
+}
+
+static void test_roundtrip(gconstpointer opaque)
+{
+    MigrationCompressMethod method = GPOINTER_TO_INT(opaque);
+    CompressContext *ctx = compress_context_new();
+    size_t bound = compress_bound(method, PAGE_SIZE);
+    uint8_t *page = g_malloc(PAGE_SIZE);
+    uint8_t *out = g_malloc(PAGE_SIZE);
+    uint8_t *buf = g_malloc(bound);
+    ssize_t len, ret;
+    int i, level;
+
+    g_assert_cmpint(bound, >=, PAGE_SIZE);
+    g_assert_cmpint(bound, <=, compress_bound_max(PAGE_SIZE));
+
+    /* the context is reused across pages and levels */
+    for (i = 0; i < 20; i++) {
+        level = i % 10;
+        fill_page(page);
+        len = compress_buffer(ctx, method, level, buf, bound, page, PAGE_SIZE);
+        g_assert_cmpint(len, >, 0);
+        g_assert_cmpint(len, <=, bound);
+
+        memset(out, 0xff, PAGE_SIZE);
+        ret = decompress_buffer(ctx, method, out, PAGE_SIZE, buf, len);
+        g_assert_cmpint(ret, ==, PAGE_SIZE);
+        g_assert(memcmp(page, out, PAGE_SIZE) == 0);
+    }
+
+    /* no room for the compressed data */
+    len = compress_buffer(ctx, method, 1, buf, 8, page, PAGE_SIZE);
+    g_assert_cmpint(len, ==, -1);
+
+    /* truncated data must not be taken for a page */
+    len = compress_buffer(ctx, method, 1, buf, bound, page, PAGE_SIZE);
+    ret = decompress_buffer(ctx, method, out, PAGE_SIZE, buf, len / 2);
+    g_assert_cmpint(ret, !=, PAGE_SIZE);
+
+    /* and the context is still usable afterwards */
+    ret = decompress_buffer(ctx, method, out, PAGE_SIZE, buf, len);
+    g_assert_cmpint(ret, ==, PAGE_SIZE);
+    g_assert(memcmp(page, out, PAGE_SIZE) == 0);
+
+    g_free(buf);
+    g_free(out);
+    g_free(page);
+    compress_context_free(ctx);
+}
+
+/* Older QEMU decompress the pages with uncompress() */
+static void test_zlib_compat(void)
+{
+    CompressContext *ctx = compress_context_new();
+    uint8_t *page = g_malloc(PAGE_SIZE);
+    uint8_t *out = g_malloc(PAGE_SIZE);
+    uint8_t *buf = g_malloc(compressBound(PAGE_SIZE));
+    unsigned long out_len = PAGE_SIZE;
+    ssize_t len;
+
+    fill_page(page);
+    len = compress_buffer(ctx, MIGRATION_COMPRESS_METHOD_ZLIB, 1, buf,
+                          compressBound(PAGE_SIZE), page, PAGE_SIZE);
+    g_assert_cmpint(len, >, 0);
+    g_assert_cmpint(uncompress(out, &out_len, buf, len), ==, Z_OK);
+    g_assert_cmpint(out_len, ==, PAGE_SIZE);
+    g_assert(memcmp(page, out, PAGE_SIZE) == 0);
+
+    g_free(buf);
+    g_free(out);
+    g_free(page);
+    compress_context_free(ctx);
+}
+
+static void perf_compress(gconstpointer opaque)
+{
+    MigrationCompressMethod method = GPOINTER_TO_INT(opaque);
+    CompressContext *ctx = compress_context_new();
+    size_t bound = compress_bound(method, PAGE_SIZE);
+    const int pages = 256, passes = 64;
+    uint8_t *mem = g_malloc(pages * PAGE_SIZE);
+    uint8_t *buf = g_malloc(bound);
+    uint8_t *out = g_malloc(PAGE_SIZE);
+    double comp_time, decomp_time = 0;
+    uint64_t total = 0;
+    ssize_t len;
+    int i, j;
+
+    for (i = 0; i < pages; i++) {
+        fill_page(mem + i * PAGE_SIZE);
+    }
+
+    g_test_timer_start();
+    for (j = 0; j < passes; j++) {
+        for (i = 0; i < pages; i++) {
+            len = compress_buffer(ctx, method, 1, buf, bound,
+                                  mem + i * PAGE_SIZE, PAGE_SIZE);
+            g_assert_cmpint(len, >, 0);
+            total += len;
+        }
+    }
+    comp_time = g_test_timer_elapsed();
+
+    for (i = 0; i < pages; i++) {
+        len = compress_buffer(ctx, method, 1, buf, bound,
+                              mem + i * PAGE_SIZE, PAGE_SIZE);
+        g_test_timer_start();
+        for (j = 0; j < passes; j++) {
+            decompress_buffer(ctx, method, out, PAGE_SIZE, buf, len);
+        }
+        decomp_time += g_test_timer_elapsed();
+    }
+
+    g_test_message("%s: compress %.0f MB/s, decompress %.0f MB/s, ratio %.2f",
+                   MigrationCompressMethod_lookup[method],
+                   pages * passes * (double)PAGE_SIZE / comp_time / 1e6,
+                   pages * passes * (double)PAGE_SIZE / decomp_time / 1e6,
+                   (double)pages * passes * PAGE_SIZE / total);
+
+    g_free(out);
+    g_free(buf);
+    g_free(mem);
+    compress_context_free(ctx);
+}
+
+int main(int argc, char **argv)
+{
+    char *path;
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < MIGRATION_COMPRESS_METHOD_MAX; i++) {
+        if (!compress_method_supported(i)) {
+            continue;
+        }
+        path = g_strdup_printf("/migration/compress/%s/roundtrip",
+                               MigrationCompressMethod_lookup[i]);
+        g_test_add_data_func(path, GINT_TO_POINTER(i), test_roundtrip);
+        g_free(path);
+        if (g_test_perf()) {
+            path = g_strdup_printf("/perf/migration/compress/%s",
+                                   MigrationCompressMethod_lookup[i]);
+            g_test_add_data_func(path, GINT_TO_POINTER(i), perf_compress);
+            g_free(path);
+        }
+    }
+    g_test_add_func("/migration/compress/zlib/compat", test_zlib_compat);
+
+    return g_test_run();
+}
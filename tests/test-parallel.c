@@ -0,0 +1,100 @@
+/*
+ * parallel_for() unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/parallel.h"
+
+#define N 10000
+
+typedef struct {
+    int calls[N];
+    int total;
+    int nested;
+} TestState;
+
+static void count(void *opaque, int index)
+{
+    TestState *ts = opaque;
+
+    g_assert_cmpint(index, >=, 0);
+    g_assert_cmpint(index, <, N);
+    atomic_inc(&ts->calls[index]);
+    atomic_inc(&ts->total);
+}
+
+static void test_all_once(void)
+{
+    TestState *ts = g_new0(TestState, 1);
+    int threads, i;
+
+    for (threads = 0; threads <= PARALLEL_MAX_THREADS + 1; threads++) {
+        memset(ts, 0, sizeof(*ts));
+        parallel_for(N, threads, count, ts);
+        g_assert_cmpint(ts->total, ==, N);
+        for (i = 0; i < N; i++) {
+            g_assert_cmpint(ts->calls[i], ==, 1);
+        }
+    }
+
+    /* nothing to do */
+    memset(ts, 0, sizeof(*ts));
+    parallel_for(0, 4, count, ts);
+    g_assert_cmpint(ts->total, ==, 0);
+
+    g_free(ts);
+}
+
+static void nest(void *opaque, int index)
+{
+    TestState *ts = opaque;
+
+    if (index == 0) {
+        /* the workers are ours, so this one runs serially */
+        parallel_for(N, 4, count, ts);
+        ts->nested = 1;
+    }
+}
+
+static void test_nested(void)
+{
+    TestState *ts = g_new0(TestState, 1);
+
+    parallel_for(16, 4, nest, ts);
+    g_assert_cmpint(ts->nested, ==, 1);
+    g_assert_cmpint(ts->total, ==, N);
+
+    g_free(ts);
+}
+
+/* many short loops in a row, to catch workers waking up late */
+static void test_repeat(void)
+{
+    TestState *ts = g_new0(TestState, 1);
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        parallel_for(8, 4, count, ts);
+    }
+    g_assert_cmpint(ts->total, ==, 8000);
+    for (i = 0; i < 8; i++) {
+        g_assert_cmpint(ts->calls[i], ==, 1000);
+    }
+
+    g_free(ts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/parallel/all_once", test_all_once);
+    g_test_add_func("/parallel/nested", test_nested);
+    g_test_add_func("/parallel/repeat", test_repeat);
+    return g_test_run();
+}
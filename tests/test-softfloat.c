@@ -0,0 +1,198 @@
+/*
+ * Check the host FPU fast path of softfloat against the soft code
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+
+#define SOFTFLOAT_NO_TARGET
+#include "../fpu/softfloat.c"
+
+#define N_RANDOM 200000
+
+typedef float32 Float32Op(float32, float32, float_status *);
+typedef float64 Float64Op(float64, float64, float_status *);
+
+static uint64_t rng_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/* Mostly values whose results land near the edges of the normal range,
+ * where the fast path has to give up; plus zeros, denormals and specials */
+static uint64_t random_float64(void)
+{
+    uint64_t sign = rng() & (1ULL << 63);
+    uint64_t frac = rng() & ((1ULL << 52) - 1);
+    uint64_t exp;
+
+    switch (rng() % 8) {
+    case 0:
+        exp = rng() % 0x800;
+        break;
+    case 1:
+        exp = rng() % 64;               /* tiny and denormal */
+        break;
+    case 2:
+        exp = 0x7ff - rng() % 64;       /* huge, infinities and NaNs */
+        break;
+    case 3:
+        exp = 0;
+        frac = rng() % 4 ? 0 : frac;    /* zeros */
+        break;
+    default:
+        exp = 0x3ff - 32 + rng() % 64;
+        break;
+    }
+    return sign | exp << 52 | frac;
+}
+
+static uint32_t random_float32(void)
+{
+    uint32_t sign = rng() & (1U << 31);
+    uint32_t frac = rng() & ((1U << 23) - 1);
+    uint32_t exp;
+
+    switch (rng() % 8) {
+    case 0:
+        exp = rng() % 0x100;
+        break;
+    case 1:
+        exp = rng() % 32;
+        break;
+    case 2:
+        exp = 0xff - rng() % 32;
+        break;
+    case 3:
+        exp = 0;
+        frac = rng() % 4 ? 0 : frac;
+        break;
+    default:
+        exp = 0x7f - 16 + rng() % 32;
+        break;
+    }
+    return sign | exp << 23 | frac;
+}
+
+static void init_status(float_status *s, int variant)
+{
+    memset(s, 0, sizeof(*s));
+    s->float_rounding_mode = float_round_nearest_even;
+    s->float_exception_flags = float_flag_inexact;
+    s->float_detect_tininess = variant & 1 ? float_tininess_before_rounding
+                                           : float_tininess_after_rounding;
+    s->flush_to_zero = !!(variant & 2);
+    s->flush_inputs_to_zero = !!(variant & 4);
+}
+
+static void check_float64(Float64Op *fast, Float64Op *soft)
+{
+    float_status s1, s2;
+    int i;
+
+    for (i = 0; i < N_RANDOM; i++) {
+        float64 a = make_float64(random_float64());
+        float64 b = make_float64(random_float64());
+        float64 r1, r2;
+
+        init_status(&s1, i);
+        init_status(&s2, i);
+        r1 = fast(a, b, &s1);
+        r2 = soft(a, b, &s2);
+        if (float64_val(r1) != float64_val(r2) ||
+            s1.float_exception_flags != s2.float_exception_flags) {
+            g_test_message("a=%016" PRIx64 " b=%016" PRIx64 " fast=%016"
+                           PRIx64 "/%x soft=%016" PRIx64 "/%x",
+                           float64_val(a), float64_val(b),
+                           float64_val(r1), s1.float_exception_flags,
+                           float64_val(r2), s2.float_exception_flags);
+            g_assert_not_reached();
+        }
+    }
+}
+
+static void check_float32(Float32Op *fast, Float32Op *soft)
+{
+    float_status s1, s2;
+    int i;
+
+    for (i = 0; i < N_RANDOM; i++) {
+        float32 a = make_float32(random_float32());
+        float32 b = make_float32(random_float32());
+        float32 r1, r2;
+
+        init_status(&s1, i);
+        init_status(&s2, i);
+        r1 = fast(a, b, &s1);
+        r2 = soft(a, b, &s2);
+        if (float32_val(r1) != float32_val(r2) ||
+            s1.float_exception_flags != s2.float_exception_flags) {
+            g_test_message("a=%08x b=%08x fast=%08x/%x soft=%08x/%x",
+                           float32_val(a), float32_val(b),
+                           float32_val(r1), s1.float_exception_flags,
+                           float32_val(r2), s2.float_exception_flags);
+            g_assert_not_reached();
+        }
+    }
+}
+
+static void test_float64_add(void)
+{
+    check_float64(float64_add, soft_float64_add);
+}
+
+static void test_float64_sub(void)
+{
+    check_float64(float64_sub, soft_float64_sub);
+}
+
+static void test_float64_mul(void)
+{
+    check_float64(float64_mul, soft_float64_mul);
+}
+
+static void test_float64_div(void)
+{
+    check_float64(float64_div, soft_float64_div);
+}
+
+static void test_float32_add(void)
+{
+    check_float32(float32_add, soft_float32_add);
+}
+
+static void test_float32_sub(void)
+{
+    check_float32(float32_sub, soft_float32_sub);
+}
+
+static void test_float32_mul(void)
+{
+    check_float32(float32_mul, soft_float32_mul);
+}
+
+static void test_float32_div(void)
+{
+    check_float32(float32_div, soft_float32_div);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/softfloat/float64/add", test_float64_add);
+    g_test_add_func("/softfloat/float64/sub", test_float64_sub);
+    g_test_add_func("/softfloat/float64/mul", test_float64_mul);
+    g_test_add_func("/softfloat/float64/div", test_float64_div);
+    g_test_add_func("/softfloat/float32/add", test_float32_add);
+    g_test_add_func("/softfloat/float32/sub", test_float32_sub);
+    g_test_add_func("/softfloat/float32/mul", test_float32_mul);
+    g_test_add_func("/softfloat/float32/div", test_float32_div);
+    return g_test_run();
+}
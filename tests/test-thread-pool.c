@@ -220,6 +220,112 @@ static void test_cancel_async(void)
     do_test_cancel(false);
 }
 
+static int running;
+static int max_running;
+
+static int limit_cb(void *opaque)
+{
+    int n = atomic_fetch_inc(&running) + 1;
+    int max;
+
+    while ((max = atomic_read(&max_running)) < n) {
+        atomic_cmpxchg(&max_running, max, n);
+    }
+    g_usleep(10000);
+    atomic_dec(&running);
+    return 0;
+}
+
+static void test_limits(void)
+{
+    WorkerTestData data[10];
+    Error *local_error = NULL;
+    int i;
+
+    aio_context_set_thread_pool_params(ctx, 3, 2, &local_error);
+    g_assert(local_error);
+    error_free(local_error);
+    local_error = NULL;
+
+    aio_context_set_thread_pool_params(ctx, 0, 2, &local_error);
+    g_assert(!local_error);
+
+    /* Let the workers that are now too many go away */
+    g_usleep(100000);
+
+    max_running = 0;
+    for (i = 0; i < 10; i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        thread_pool_submit_aio(pool, limit_cb, &data[i], done_cb, &data[i]);
+    }
+
+    active = 10;
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+    for (i = 0; i < 10; i++) {
+        g_assert_cmpint(data[i].ret, ==, 0);
+    }
+    g_assert_cmpint(max_running, >=, 1);
+    g_assert_cmpint(max_running, <=, 2);
+
+    aio_context_set_thread_pool_params(ctx, THREAD_POOL_DEFAULT_MIN_THREADS,
+                                       THREAD_POOL_DEFAULT_MAX_THREADS,
+                                       &error_abort);
+}
+
+/* One request at a time: submission, wakeup of a worker and completion */
+static void perf_submit_aio(void)
+{
+    WorkerTestData data = { .n = 0 };
+    const int max = 100000;
+    double duration;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        data.ret = -EINPROGRESS;
+        thread_pool_submit_aio(pool, worker_cb, &data, done_cb, &data);
+        active = 1;
+        while (data.ret == -EINPROGRESS) {
+            aio_poll(ctx, true);
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%d requests one by one: %f s, %.1f us per request",
+                   max, duration, duration * 1e6 / max);
+}
+
+/* Many requests in flight, as with a deep I/O queue */
+static void perf_submit_many(void)
+{
+    WorkerTestData data[100];
+    const int rounds = 10000;
+    double duration;
+    int i, j;
+
+    g_test_timer_start();
+    for (j = 0; j < rounds; j++) {
+        for (i = 0; i < ARRAY_SIZE(data); i++) {
+            data[i].n = 0;
+            data[i].ret = -EINPROGRESS;
+            thread_pool_submit_aio(pool, worker_cb, &data[i],
+                                   done_cb, &data[i]);
+        }
+        active = ARRAY_SIZE(data);
+        while (active > 0) {
+            aio_poll(ctx, true);
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%d requests, %zu in flight: %f s, %.1f ns per request",
+                   rounds * (int)ARRAY_SIZE(data), ARRAY_SIZE(data),
+                   duration, duration * 1e9 / (rounds * ARRAY_SIZE(data)));
+}
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -243,6 +349,11 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
+    g_test_add_func("/thread-pool/limits", test_limits);
+    if (g_test_perf()) {
+        g_test_add_func("/thread-pool/perf/submit-aio", perf_submit_aio);
+        g_test_add_func("/thread-pool/perf/submit-many", perf_submit_many);
+    }
 
     ret = g_test_run();
 
@@ -503,6 +503,45 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_credit(void)
+{
+    ThrottleCredit credit = { 0 };
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 1000;
+    cfg.buckets[THROTTLE_BPS_TOTAL].max = 100;
+
+    throttle_init(&ts);
+    throttle_timers_init(&tt, ctx, QEMU_CLOCK_VIRTUAL,
+                         read_timer_cb, write_timer_cb, &ts);
+    throttle_config(&ts, &tt, &cfg);
+
+    /* half of the room is accounted in advance, ops are not limited */
+    throttle_take_credit(&ts, false, 0.5, &credit);
+    g_assert(double_cmp(credit.bytes, 50));
+    g_assert(credit.ops == HUGE_VAL);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 50));
+
+    /* spending the credit does not touch the buckets */
+    g_assert(throttle_use_credit(&credit, 40));
+    g_assert(!throttle_use_credit(&credit, 20));
+    g_assert(double_cmp(credit.bytes, 10));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 50));
+
+    /* the next credit only gets a share of what is left */
+    throttle_take_credit(&ts, true, 0.5, &credit);
+    g_assert(double_cmp(credit.bytes, 35));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 75));
+
+    /* a full bucket gives no credit */
+    ts.cfg.buckets[THROTTLE_BPS_TOTAL].level = 150;
+    throttle_take_credit(&ts, false, 0.5, &credit);
+    g_assert(double_cmp(credit.bytes, 35));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 150));
+
+    throttle_timers_destroy(&tt);
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -593,6 +632,7 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config/is_valid",    test_is_valid);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/credit",             test_credit);
     g_test_add_func("/throttle/groups",             test_groups);
     return g_test_run();
 }
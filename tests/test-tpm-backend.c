@@ -0,0 +1,115 @@
+/*
+ * TPM backend worker unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/thread.h"
+#include "qemu/error-report.h"
+#include "sysemu/tpm_backend_int.h"
+
+static AioContext *ctx;
+
+/* A backend's request queue, drained one request per PROCESS_CMD */
+typedef struct TestBackend {
+    QemuMutex lock;
+    int queued;
+    int processed;
+} TestBackend;
+
+static void test_worker(gpointer data, gpointer user_data)
+{
+    TestBackend *tb = user_data;
+
+    if ((TPMBackendCmd)data != TPM_BACKEND_CMD_PROCESS_CMD) {
+        return;
+    }
+
+    qemu_mutex_lock(&tb->lock);
+    if (tb->queued > 0) {
+        tb->queued--;
+        tb->processed++;
+    }
+    qemu_mutex_unlock(&tb->lock);
+}
+
+static void test_queue(TestBackend *tb, TPMBackendThread *tbt, int n)
+{
+    int i;
+
+    qemu_mutex_lock(&tb->lock);
+    tb->queued += n;
+    qemu_mutex_unlock(&tb->lock);
+
+    for (i = 0; i < n; i++) {
+        tpm_backend_thread_deliver_request(tbt);
+    }
+}
+
+static void test_pool(void)
+{
+    TPMBackendThread tbt = {};
+    TestBackend tb = {};
+
+    qemu_mutex_init(&tb.lock);
+    tpm_backend_thread_create(&tbt, test_worker, &tb, NULL);
+
+    test_queue(&tb, &tbt, 2);
+
+    /* waits for the pool to finish */
+    tpm_backend_thread_end(&tbt);
+    g_assert_cmpint(tb.processed, ==, 2);
+    g_assert_cmpint(tb.queued, ==, 0);
+    qemu_mutex_destroy(&tb.lock);
+}
+
+static void test_aio_context(void)
+{
+    TPMBackendThread tbt = {};
+    TestBackend tb = {};
+
+    qemu_mutex_init(&tb.lock);
+    tpm_backend_thread_create(&tbt, test_worker, &tb, ctx);
+
+    /* both requests are queued before the bottom half runs */
+    test_queue(&tb, &tbt, 2);
+    while (aio_poll(ctx, false)) {
+        /* nothing */
+    }
+    g_assert_cmpint(tb.processed, ==, 2);
+    g_assert_cmpint(tb.queued, ==, 0);
+
+    test_queue(&tb, &tbt, 1);
+    while (aio_poll(ctx, false)) {
+        /* nothing */
+    }
+    g_assert_cmpint(tb.processed, ==, 3);
+
+    tpm_backend_thread_end(&tbt);
+    qemu_mutex_destroy(&tb.lock);
+}
+
+int main(int argc, char **argv)
+{
+    Error *local_error = NULL;
+
+    init_clocks();
+
+    ctx = aio_context_new(&local_error);
+    if (!ctx) {
+        error_report("Failed to create AIO Context: '%s'",
+                     error_get_pretty(local_error));
+        error_free(local_error);
+        exit(1);
+    }
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/tpm-backend/thread/pool", test_pool);
+    g_test_add_func("/tpm-backend/thread/aio-context", test_aio_context);
+
+    return g_test_run();
+}
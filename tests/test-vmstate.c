@@ -482,6 +482,123 @@ static void test_load_skip(void)
     qsb_free(qsb);
 }
 
+typedef struct TestLiveInner {
+    uint8_t buf[4];
+} TestLiveInner;
+
+typedef struct TestLive {
+    uint32_t a;
+    TestLiveInner inner;
+    uint32_t b;
+} TestLive;
+
+static const VMStateDescription vmstate_live_inner = {
+    .name = "test/live/inner",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BUFFER_LIVE(buf, TestLiveInner),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_live = {
+    .name = "test/live",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(a, TestLive),
+        VMSTATE_STRUCT(inner, TestLive, 1, vmstate_live_inner, TestLiveInner),
+        VMSTATE_UINT32(b, TestLive),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void test_live_field(const char *name, void *ptr, size_t size,
+                            void *opaque)
+{
+    TestLive *obj = opaque;
+
+    g_assert_cmpstr(name, ==, "inner/buf");
+    g_assert(ptr == obj->inner.buf);
+    g_assert_cmpint(size, ==, sizeof(obj->inner.buf));
+    vmstate_live_mark(ptr, true);
+}
+
+/* Live buffers are left out of the device state once they are marked */
+static void test_live(void)
+{
+    QEMUFile *fsave = qemu_bufopen("w", NULL);
+    TestLive obj = { .a = 1, .inner.buf = { 2, 3, 4, 5 }, .b = 6 };
+    uint8_t full[] = {
+        0, 0, 0, 1,             /* a */
+        2, 3, 4, 5,             /* inner.buf */
+        0, 0, 0, 6,             /* b */
+    };
+    uint8_t live[] = {
+        0, 0, 0, 10,            /* a */
+        0, 0, 0, 60,            /* b */
+        QEMU_VM_EOF,
+    };
+    QEMUSizedBuffer *qsb;
+    QEMUFile *loading;
+
+    vmstate_save_state(fsave, &vmstate_live, &obj, NULL);
+    check_mem_file(fsave, full, sizeof(full));
+    qemu_fclose(fsave);
+
+    vmstate_foreach_live_field(&vmstate_live, &obj, test_live_field, &obj);
+
+    fsave = qemu_bufopen("w", NULL);
+    vmstate_save_state(fsave, &vmstate_live, &obj, NULL);
+    check_mem_file(fsave, live, 8);
+    qemu_fclose(fsave);
+
+    qsb = qsb_create(live, sizeof(live));
+    loading = qemu_bufopen("r", qsb);
+    SUCCESS(vmstate_load_state(loading, &vmstate_live, &obj, 1));
+    g_assert_cmpint(obj.a, ==, 10);
+    g_assert_cmpint(obj.inner.buf[0], ==, 2);
+    g_assert_cmpint(obj.b, ==, 60);
+    qemu_fclose(loading);
+    qsb_free(qsb);
+
+    vmstate_live_reset();
+    fsave = qemu_bufopen("w", NULL);
+    obj.a = 1;
+    obj.b = 6;
+    vmstate_save_state(fsave, &vmstate_live, &obj, NULL);
+    check_mem_file(fsave, full, sizeof(full));
+    qemu_fclose(fsave);
+}
+
+/* The offset in the file stays right across skips and reading ahead */
+static void test_file_offset(void)
+{
+    QEMUFile *f = open_test_file(true);
+
+    qemu_put_be32(f, 1);
+    g_assert_cmpint(qemu_file_get_offset(f), ==, 4);
+    SUCCESS(qemu_file_set_offset(f, 100000));
+    qemu_put_be32(f, 2);
+    g_assert_cmpint(qemu_file_get_offset(f), ==, 100004);
+    g_assert(!qemu_file_get_error(f));
+    qemu_fclose(f);
+
+    f = open_test_file(false);
+    g_assert_cmpint(qemu_get_be32(f), ==, 1);
+    g_assert_cmpint(qemu_file_get_offset(f), ==, 4);
+    SUCCESS(qemu_file_set_offset(f, 100000));
+    g_assert_cmpint(qemu_get_be32(f), ==, 2);
+    g_assert_cmpint(qemu_file_get_offset(f), ==, 100004);
+    g_assert(!qemu_file_get_error(f));
+    qemu_fclose(f);
+
+    f = qemu_bufopen("w", NULL);
+    g_assert_cmpint(qemu_file_get_offset(f), ==, -ENOTSUP);
+    qemu_fclose(f);
+}
+
 int main(int argc, char **argv)
 {
     temp_fd = mkstemp(temp_file);
@@ -494,6 +611,8 @@ int main(int argc, char **argv)
     g_test_add_func("/vmstate/field_exists/load/skip", test_load_skip);
     g_test_add_func("/vmstate/field_exists/save/noskip", test_save_noskip);
     g_test_add_func("/vmstate/field_exists/save/skip", test_save_skip);
+    g_test_add_func("/vmstate/live", test_live);
+    g_test_add_func("/vmstate/qemu_file/offset", test_file_offset);
     g_test_run();
 
     close(temp_fd);
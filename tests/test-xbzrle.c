@@ -19,6 +19,7 @@
 #include <assert.h>
 #include "qemu-common.h"
 #include "include/migration/migration.h"
+#include "include/migration/page_cache.h"
 
 #define PAGE_SIZE 4096
 
@@ -179,6 +180,128 @@ static void test_encode_decode(void)
     }
 }
 
+/* Changes of random length at random places, across vector boundaries */
+static void fill_runs(uint8_t *old, uint8_t *new, int runs, int max_len)
+{
+    int i, j, pos, len;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old[i] = new[i] = g_test_rand_int_range(0, 3);
+    }
+    for (i = 0; i < runs; i++) {
+        pos = g_test_rand_int_range(0, PAGE_SIZE);
+        len = g_test_rand_int_range(1, max_len + 1);
+        for (j = pos; j < pos + len && j < PAGE_SIZE; j++) {
+            new[j] = old[j] + g_test_rand_int_range(0, 2);
+        }
+    }
+}
+
+static void test_encode_decode_runs(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int i, dlen, rc;
+
+    for (i = 0; i < 10000; i++) {
+        fill_runs(old, new, g_test_rand_int_range(0, 40),
+                  g_test_rand_int_range(1, 300));
+        dlen = xbzrle_encode_buffer(old, new, PAGE_SIZE, compressed,
+                                    PAGE_SIZE);
+        if (dlen == -1) {
+            continue;
+        }
+        rc = xbzrle_decode_buffer(compressed, dlen, old, PAGE_SIZE);
+        g_assert(rc >= 0);
+        g_assert(memcmp(old, new, PAGE_SIZE) == 0);
+    }
+
+    g_free(compressed);
+    g_free(new);
+    g_free(old);
+}
+
+/* Pages whose addresses collide are cached together. */
+static void test_cache_collision(void)
+{
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    /* four sets of four pages */
+    PageCache *cache = cache_init(16, PAGE_SIZE);
+    uint64_t set_stride = 4 * PAGE_SIZE;
+    uint64_t i;
+
+    for (i = 0; i < 4; i++) {
+        g_assert(cache_insert(cache, i * set_stride, page, 1) == 0);
+    }
+    for (i = 0; i < 4; i++) {
+        g_assert(cache_is_cached(cache, i * set_stride, 2));
+    }
+
+    /* the set is full of fresh pages */
+    g_assert(cache_insert(cache, 4 * set_stride, page, 2) == -1);
+    g_assert(!cache_is_cached(cache, 4 * set_stride, 2));
+
+    /* unless one of them overflowed */
+    g_assert(cache_mark_overflow(cache, 2 * set_stride));
+    g_assert(!cache_mark_overflow(cache, 2 * set_stride));
+    g_assert(cache_insert(cache, 4 * set_stride, page, 2) == 0);
+    g_assert(!cache_is_cached(cache, 2 * set_stride, 2));
+
+    /* once they all aged, the least recently used one goes */
+    g_assert(cache_is_cached(cache, 0, 3));
+    g_assert(cache_is_cached(cache, 3 * set_stride, 3));
+    g_assert(cache_is_cached(cache, 4 * set_stride, 3));
+    g_assert(cache_insert(cache, 5 * set_stride, page, 4) == 0);
+    g_assert(!cache_is_cached(cache, set_stride, 4));
+    g_assert(cache_is_cached(cache, 0, 4));
+    g_assert(cache_is_cached(cache, 5 * set_stride, 4));
+
+    /* other sets are not affected */
+    g_assert(cache_insert(cache, PAGE_SIZE, page, 4) == 0);
+
+    /* and the pages survive a resize */
+    g_assert(cache_resize(cache, 64) == 64);
+    g_assert(cache_is_cached(cache, 0, 5));
+    g_assert(cache_is_cached(cache, 5 * set_stride, 5));
+    g_assert(cache_is_cached(cache, PAGE_SIZE, 5));
+    g_assert(get_cached_data(cache, 3 * PAGE_SIZE) == NULL);
+
+    cache_fini(cache);
+    g_free(page);
+}
+
+static void perf_encode(void)
+{
+    const int pages = 256, passes = 100;
+    uint8_t *old = g_malloc(pages * PAGE_SIZE);
+    uint8_t *new = g_malloc(pages * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    double duration;
+    int i, j;
+
+    for (i = 0; i < pages; i++) {
+        /* a few small writes, as XBZRLE works best with */
+        fill_runs(old + i * PAGE_SIZE, new + i * PAGE_SIZE, 8, 64);
+    }
+
+    g_test_timer_start();
+    for (j = 0; j < passes; j++) {
+        for (i = 0; i < pages; i++) {
+            xbzrle_encode_buffer(old + i * PAGE_SIZE, new + i * PAGE_SIZE,
+                                 PAGE_SIZE, compressed, PAGE_SIZE);
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("encode: %.0f MB/s",
+                   (double)pages * passes * PAGE_SIZE / duration / 1e6);
+
+    g_free(compressed);
+    g_free(new);
+    g_free(old);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +314,11 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_runs", test_encode_decode_runs);
+    g_test_add_func("/xbzrle/cache_collision", test_cache_collision);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/xbzrle/encode", perf_encode);
+    }
 
     return g_test_run();
 }
@@ -0,0 +1,453 @@
+/*
+ * QTest testcase for TPM TIS
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The passthrough backend is pointed at a named pipe, which echoes every
+ * command back as its response. This is enough to drive complete TIS
+ * transactions and count the MMIO accesses the guest side needs for them.
+ *
+ * The benchmark runs a mix of TPM 1.2 and TPM 2 commands against a mock
+ * TPM service behind the mux backend and reports the throughput, the
+ * latency and the MMIO accesses per command. Run it with --verbose to see
+ * the numbers, e.g. to compare them across releases.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "libqtest.h"
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "hw/acpi/tpm.h"
+
+#define TIS_REG(locty, reg) \
+    (TPM_TIS_ADDR_BASE + ((locty) << 12) + (reg))
+
+#define TPM_TIS_REG_ACCESS                0x00
+#define TPM_TIS_REG_STS                   0x18
+#define TPM_TIS_REG_DATA_FIFO             0x24
+
+#define TPM_TIS_ACCESS_ACTIVE_LOCALITY    (1 << 5)
+#define TPM_TIS_ACCESS_REQUEST_USE        (1 << 1)
+
+#define TPM_TIS_STS_VALID                 (1 << 7)
+#define TPM_TIS_STS_COMMAND_READY         (1 << 6)
+#define TPM_TIS_STS_TPM_GO                (1 << 5)
+#define TPM_TIS_STS_DATA_AVAILABLE        (1 << 4)
+#define TPM_TIS_STS_EXPECT                (1 << 3)
+
+#define TPM_CMD_SIZE                      4096
+
+static char *tpm_fifo;
+static char *tpm_sock;
+
+static uint8_t tis_readb(uint64_t addr, unsigned *exits)
+{
+    (*exits)++;
+    return readb(addr);
+}
+
+static uint32_t tis_readl(uint64_t addr, unsigned *exits)
+{
+    (*exits)++;
+    return readl(addr);
+}
+
+static void tis_writeb(uint64_t addr, uint8_t val, unsigned *exits)
+{
+    (*exits)++;
+    writeb(addr, val);
+}
+
+static void tis_writel(uint64_t addr, uint32_t val, unsigned *exits)
+{
+    (*exits)++;
+    writel(addr, val);
+}
+
+/* read the burst count byte-wise like the Linux tpm_tis driver does */
+static uint16_t tis_get_burstcount(unsigned *exits)
+{
+    return tis_readb(TIS_REG(0, TPM_TIS_REG_STS + 1), exits) |
+           (tis_readb(TIS_REG(0, TPM_TIS_REG_STS + 2), exits) << 8);
+}
+
+/*
+ * Transfer one command to the TPM and read back its response, of which at
+ * most rsp_size bytes are stored. Return the number of MMIO accesses
+ * needed to do so, not counting the polling for command completion.
+ */
+static unsigned tis_transfer(const uint8_t *cmd, size_t len,
+                             uint8_t *rsp, size_t rsp_size)
+{
+    unsigned exits = 0, dummy = 0;
+    size_t off, chunk, rsp_len;
+    uint16_t burst;
+    uint32_t val;
+    gint64 deadline;
+
+    tis_writeb(TIS_REG(0, TPM_TIS_REG_ACCESS), TPM_TIS_ACCESS_REQUEST_USE,
+               &exits);
+    g_assert(tis_readb(TIS_REG(0, TPM_TIS_REG_ACCESS), &exits) &
+             TPM_TIS_ACCESS_ACTIVE_LOCALITY);
+
+    tis_writeb(TIS_REG(0, TPM_TIS_REG_STS), TPM_TIS_STS_COMMAND_READY,
+               &exits);
+
+    for (off = 0; off < len; ) {
+        burst = tis_get_burstcount(&exits);
+        g_assert_cmpint(burst, >, 0);
+        chunk = MIN(burst, len - off);
+        while (chunk >= 4) {
+            memcpy(&val, &cmd[off], 4);
+            tis_writel(TIS_REG(0, TPM_TIS_REG_DATA_FIFO), le32_to_cpu(val),
+                       &exits);
+            off += 4;
+            chunk -= 4;
+        }
+        while (chunk > 0) {
+            tis_writeb(TIS_REG(0, TPM_TIS_REG_DATA_FIFO), cmd[off], &exits);
+            off++;
+            chunk--;
+        }
+    }
+
+    val = tis_readl(TIS_REG(0, TPM_TIS_REG_STS), &exits);
+    g_assert_cmpint(val & (TPM_TIS_STS_VALID | TPM_TIS_STS_EXPECT), ==,
+                    TPM_TIS_STS_VALID);
+
+    tis_writeb(TIS_REG(0, TPM_TIS_REG_STS), TPM_TIS_STS_TPM_GO, &exits);
+
+    /* wait for the response; 5s timeout */
+    deadline = g_get_monotonic_time() + 5 * G_USEC_PER_SEC;
+    do {
+        val = tis_readl(TIS_REG(0, TPM_TIS_REG_STS), &dummy);
+    } while (!(val & TPM_TIS_STS_DATA_AVAILABLE) &&
+             g_get_monotonic_time() < deadline);
+    g_assert(val & TPM_TIS_STS_DATA_AVAILABLE);
+
+    /* read the tag and size first, then the rest of the response */
+    g_assert_cmpuint(rsp_size, >=, 6);
+    rsp_len = 6;
+    for (off = 0; off < rsp_len; ) {
+        burst = tis_get_burstcount(&exits);
+        g_assert_cmpint(burst, >, 0);
+        chunk = MIN(burst, rsp_len - off);
+        while (chunk >= 4) {
+            val = cpu_to_le32(tis_readl(TIS_REG(0, TPM_TIS_REG_DATA_FIFO),
+                                        &exits));
+            memcpy(&rsp[off], &val, 4);
+            off += 4;
+            chunk -= 4;
+        }
+        while (chunk > 0) {
+            rsp[off] = tis_readb(TIS_REG(0, TPM_TIS_REG_DATA_FIFO), &exits);
+            off++;
+            chunk--;
+        }
+        if (off == 6) {
+            rsp_len = MIN(ldl_be_p(&rsp[2]), rsp_size);
+        }
+    }
+
+    /* release the locality */
+    tis_writeb(TIS_REG(0, TPM_TIS_REG_ACCESS), TPM_TIS_ACCESS_ACTIVE_LOCALITY,
+               &exits);
+
+    return exits;
+}
+
+static unsigned count_exits(const char *machine)
+{
+    uint8_t cmd[TPM_CMD_SIZE], rsp[TPM_CMD_SIZE];
+    unsigned exits;
+    char *args;
+    int i;
+
+    /* TPM 2 header: TPM2_ST_NO_SESSIONS, length, TPM2_CC_ReadClock */
+    memset(cmd, 0, sizeof(cmd));
+    cmd[0] = 0x80;
+    cmd[1] = 0x01;
+    stl_be_p(&cmd[2], sizeof(cmd));
+    stl_be_p(&cmd[6], 0x181);
+    for (i = 10; i < sizeof(cmd); i++) {
+        cmd[i] = i;
+    }
+
+    args = g_strdup_printf("-machine %s "
+                           "-tpmdev passthrough,id=tpm0,path=%s,"
+                           "cancel-path=/dev/null "
+                           "-device tpm-tis,tpmdev=tpm0",
+                           machine, tpm_fifo);
+    qtest_start(args);
+
+    exits = tis_transfer(cmd, sizeof(cmd), rsp, sizeof(rsp));
+    /* the FIFO echoes the command */
+    g_assert(memcmp(cmd, rsp, sizeof(cmd)) == 0);
+
+    qtest_end();
+    g_free(args);
+
+    return exits;
+}
+
+static void test_tis_burst_count(void)
+{
+    unsigned legacy, large;
+
+    legacy = count_exits("pc-i440fx-2.4");
+    large = count_exits("pc-i440fx-2.5");
+
+    g_test_message("MMIO exits per %u byte command: %u (legacy), %u (large)",
+                   TPM_CMD_SIZE, legacy, large);
+
+    g_assert_cmpuint(large, <, legacy);
+}
+
+/*
+ * A mock of the TPM service used by the mux backend (docs/specs/tpm-mux.txt)
+ * with a mock TPM that answers every command of the benchmark mix with a
+ * successful response of a plausible size.
+ */
+#define TPM_MUX_MSG_HELLO               1
+#define TPM_MUX_MSG_COMMAND             2
+#define TPM_MUX_MSG_CANCEL              3
+#define TPM_MUX_MSG_GET_ESTABLISHED     6
+#define TPM_MUX_MSG_GET_STATE           8
+#define TPM_MUX_MSG_RESPONSE            0x80000000
+
+typedef struct BenchCmd {
+    const char *name;
+    uint16_t tag;
+    uint32_t ordinal;
+    uint32_t param_len;     /* parameters of the command */
+    uint16_t rsp_tag;
+    uint32_t rsp_param_len; /* parameters of the response */
+} BenchCmd;
+
+static const BenchCmd bench_cmds[] = {
+    /* TPM 1.2 */
+    { "TPM_GetRandom",      0xc1, 0x46, 4, 0xc4, 4 + 32 },
+    { "TPM_Extend",         0xc1, 0x14, 4 + 20, 0xc4, 20 },
+    { "TPM_Quote",          0xc2, 0x16, 4 + 20 + 6 + 45, 0xc5, 300 + 41 },
+    { "TPM_NV_ReadValue",   0xc2, 0xcf, 12 + 45, 0xc5, 4 + 256 + 41 },
+    { "TPM_NV_WriteValue",  0xc2, 0xcd, 12 + 256 + 45, 0xc5, 41 },
+    /* TPM 2 */
+    { "TPM2_GetRandom",     0x8001, 0x17b, 2, 0x8001, 2 + 32 },
+    { "TPM2_PCR_Extend",    0x8002, 0x182, 4 + 13 + 4 + 2 + 32, 0x8002, 9 },
+    { "TPM2_Quote",         0x8002, 0x158, 4 + 13 + 16, 0x8002, 4 + 300 + 5 },
+    { "TPM2_NV_Read",       0x8002, 0x14e, 8 + 13 + 4, 0x8002,
+                                                        4 + 2 + 256 + 5 },
+    { "TPM2_NV_Write",      0x8002, 0x137, 8 + 13 + 2 + 256 + 2, 0x8002, 9 },
+};
+
+#define BENCH_ITERATIONS    50
+
+static int tpm_sock_listen;
+
+static bool mock_read(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = read(fd, p, len);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void mock_respond(int fd, uint32_t type, uint32_t tag,
+                         const uint8_t *payload, uint32_t len)
+{
+    uint32_t hdr[3] = {
+        cpu_to_be32(type | TPM_MUX_MSG_RESPONSE),
+        cpu_to_be32(tag),
+        cpu_to_be32(len),
+    };
+
+    g_assert(write(fd, hdr, sizeof(hdr)) == sizeof(hdr));
+    g_assert(write(fd, payload, len) == len);
+}
+
+/* Build the response of the mock TPM to a command; returns its size */
+static uint32_t mock_tpm_execute(const uint8_t *cmd, uint32_t len,
+                                 uint8_t *rsp)
+{
+    uint32_t ordinal = len >= 10 ? ldl_be_p(&cmd[6]) : 0;
+    uint32_t rsp_len = 10;
+    uint16_t rsp_tag = 0xc4;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(bench_cmds); i++) {
+        if (bench_cmds[i].ordinal == ordinal) {
+            rsp_tag = bench_cmds[i].rsp_tag;
+            rsp_len += bench_cmds[i].rsp_param_len;
+            break;
+        }
+    }
+
+    memset(rsp, 0xa5, rsp_len);
+    stw_be_p(&rsp[0], rsp_tag);
+    stl_be_p(&rsp[2], rsp_len);
+    stl_be_p(&rsp[6], 0);
+
+    return rsp_len;
+}
+
+static gpointer mock_service_thread(gpointer opaque)
+{
+    uint8_t payload[TPM_CMD_SIZE + 1], rsp[TPM_CMD_SIZE];
+    uint32_t hdr[3], type, tag, len, words[3];
+    int fd;
+
+    fd = accept(tpm_sock_listen, NULL, NULL);
+    g_assert(fd >= 0);
+
+    while (mock_read(fd, hdr, sizeof(hdr))) {
+        type = be32_to_cpu(hdr[0]);
+        tag = be32_to_cpu(hdr[1]);
+        len = be32_to_cpu(hdr[2]);
+        g_assert_cmpuint(len, <=, sizeof(payload));
+        g_assert(mock_read(fd, payload, len));
+
+        memset(words, 0, sizeof(words));
+        switch (type) {
+        case TPM_MUX_MSG_HELLO:
+            /* result, TPM 2 */
+            words[1] = cpu_to_be32(2);
+            mock_respond(fd, type, tag, (uint8_t *)words, 8);
+            break;
+        case TPM_MUX_MSG_COMMAND:
+            /* skip the locality */
+            len = mock_tpm_execute(&payload[1], len - 1, rsp);
+            mock_respond(fd, type, tag, rsp, len);
+            break;
+        case TPM_MUX_MSG_CANCEL:
+            break;
+        case TPM_MUX_MSG_GET_ESTABLISHED:
+            /* result, flag */
+            mock_respond(fd, type, tag, (uint8_t *)words, 8);
+            break;
+        case TPM_MUX_MSG_GET_STATE:
+            /* result, flags, empty blob */
+            mock_respond(fd, type, tag, (uint8_t *)words, 8);
+            break;
+        default:
+            /* result */
+            mock_respond(fd, type, tag, (uint8_t *)words, 4);
+            break;
+        }
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
+static int compare_gint64(const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void test_tis_bench(void)
+{
+    uint8_t cmd[TPM_CMD_SIZE], rsp[TPM_CMD_SIZE];
+    gint64 lat[BENCH_ITERATIONS * ARRAY_SIZE(bench_cmds)];
+    gint64 start, t, total;
+    unsigned exits = 0;
+    const BenchCmd *bc;
+    GThread *thread;
+    uint32_t len;
+    char *args;
+    int i, n = 0;
+
+    thread = g_thread_new("tpm-mux-mock", mock_service_thread, NULL);
+
+    args = g_strdup_printf("-machine pc "
+                           "-tpmdev mux,id=tpm0,path=%s,vm-id=bench "
+                           "-device tpm-tis,tpmdev=tpm0", tpm_sock);
+    qtest_start(args);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        for (bc = bench_cmds; bc < &bench_cmds[ARRAY_SIZE(bench_cmds)];
+             bc++) {
+            len = 10 + bc->param_len;
+            memset(cmd, 0x5a, len);
+            stw_be_p(&cmd[0], bc->tag);
+            stl_be_p(&cmd[2], len);
+            stl_be_p(&cmd[6], bc->ordinal);
+
+            t = g_get_monotonic_time();
+            exits += tis_transfer(cmd, len, rsp, sizeof(rsp));
+            lat[n++] = g_get_monotonic_time() - t;
+
+            g_assert_cmpuint(lduw_be_p(&rsp[0]), ==, bc->rsp_tag);
+            g_assert_cmpuint(ldl_be_p(&rsp[2]), ==, 10 + bc->rsp_param_len);
+            g_assert_cmpuint(ldl_be_p(&rsp[6]), ==, 0);
+        }
+    }
+    total = g_get_monotonic_time() - start;
+
+    qtest_end();
+    g_free(args);
+    g_thread_join(thread);
+
+    qsort(lat, n, sizeof(lat[0]), compare_gint64);
+    g_test_message("%d commands: %.0f commands/s, latency p50 %" PRId64
+                   " us, p99 %" PRId64 " us, %.1f MMIO exits per command",
+                   n, n * (double)G_USEC_PER_SEC / total,
+                   lat[n / 2], lat[n * 99 / 100], (double)exits / n);
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    char *tmpdir;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    tmpdir = g_strdup("/tmp/qtest-tpm-tis-XXXXXX");
+    g_assert(mkdtemp(tmpdir));
+    tpm_fifo = g_strdup_printf("%s/tpm", tmpdir);
+    g_assert(mkfifo(tpm_fifo, 0600) == 0);
+
+    tpm_sock = g_strdup_printf("%s/tpm-mux.sock", tmpdir);
+    tpm_sock_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+    g_assert(tpm_sock_listen >= 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    g_strlcpy(addr.sun_path, tpm_sock, sizeof(addr.sun_path));
+    g_assert(bind(tpm_sock_listen, (struct sockaddr *)&addr,
+                  sizeof(addr)) == 0);
+    g_assert(listen(tpm_sock_listen, 1) == 0);
+
+    qtest_add_func("/tpm-tis/burst-count", test_tis_burst_count);
+    qtest_add_func("/tpm-tis/bench", test_tis_bench);
+
+    ret = g_test_run();
+
+    close(tpm_sock_listen);
+    unlink(tpm_sock);
+    g_free(tpm_sock);
+    unlink(tpm_fifo);
+    rmdir(tmpdir);
+    g_free(tpm_fifo);
+    g_free(tmpdir);
+
+    return ret;
+}
@@ -14,6 +14,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include "libqtest.h"
+#include "qemu/osdep.h"
 #include "libqos/virtio.h"
 #include "libqos/virtio-pci.h"
 #include "libqos/virtio-mmio.h"
@@ -33,6 +34,12 @@
 #define QVIRTIO_BLK_F_WCE           0x00000200
 #define QVIRTIO_BLK_F_TOPOLOGY      0x00000400
 #define QVIRTIO_BLK_F_CONFIG_WCE    0x00000800
+#define QVIRTIO_BLK_F_MQ            0x00001000
+#define QVIRTIO_BLK_F_DISCARD       0x00002000
+#define QVIRTIO_BLK_F_WRITE_ZEROES  0x00004000
+
+/* offset of num_queues in struct virtio_blk_config */
+#define QVIRTIO_BLK_CONFIG_NUM_QUEUES   34
 
 #define QVIRTIO_BLK_T_IN            0
 #define QVIRTIO_BLK_T_OUT           1
@@ -41,6 +48,8 @@
 #define QVIRTIO_BLK_T_FLUSH         4
 #define QVIRTIO_BLK_T_FLUSH_OUT     5
 #define QVIRTIO_BLK_T_GET_ID        8
+#define QVIRTIO_BLK_T_DISCARD       11
+#define QVIRTIO_BLK_T_WRITE_ZEROES  13
 
 #define TEST_IMAGE_SIZE         (64 * 1024 * 1024)
 #define QVIRTIO_BLK_TIMEOUT_US  (30 * 1000 * 1000)
@@ -53,6 +62,8 @@
 #define MMIO_RAM_ADDR           0x40000000
 #define MMIO_RAM_SIZE           0x20000000
 
+#define PERF_REQUESTS           20000
+
 typedef struct QVirtioBlkReq {
     uint32_t type;
     uint32_t ioprio;
@@ -61,6 +72,25 @@ typedef struct QVirtioBlkReq {
     uint8_t status;
 } QVirtioBlkReq;
 
+/* always little endian */
+typedef struct QVirtioBlkDwzSeg {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+} QVirtioBlkDwzSeg;
+
+typedef struct VirtioBlkPerfParams {
+    unsigned int queue_depth;
+    unsigned int block_size;
+} VirtioBlkPerfParams;
+
+static const VirtioBlkPerfParams perf_params[] = {
+    { 1, 4096 },
+    { 8, 4096 },
+    { 32, 4096 },
+    { 32, 65536 },
+};
+
 static char *drive_create(void)
 {
     int fd, ret;
@@ -76,7 +106,7 @@ static char *drive_create(void)
     return tmp_path;
 }
 
-static QPCIBus *pci_test_start(void)
+static QPCIBus *pci_test_start_opts(const char *opts)
 {
     char *cmdline;
     char *tmp_path;
@@ -86,8 +116,8 @@ static QPCIBus *pci_test_start(void)
     cmdline = g_strdup_printf("-drive if=none,id=drive0,file=%s,format=raw "
                         "-drive if=none,id=drive1,file=/dev/null,format=raw "
                         "-device virtio-blk-pci,id=drv0,drive=drive0,"
-                        "addr=%x.%x",
-                        tmp_path, PCI_SLOT, PCI_FN);
+                        "addr=%x.%x%s",
+                        tmp_path, PCI_SLOT, PCI_FN, opts);
     qtest_start(cmdline);
     unlink(tmp_path);
     g_free(tmp_path);
@@ -96,6 +126,11 @@ static QPCIBus *pci_test_start(void)
     return qpci_init_pc();
 }
 
+static QPCIBus *pci_test_start(void)
+{
+    return pci_test_start_opts("");
+}
+
 static void arm_test_start(void)
 {
     char *cmdline;
@@ -168,6 +203,39 @@ static uint64_t virtio_blk_request(QGuestAllocator *alloc, QVirtioBlkReq *req,
     return addr;
 }
 
+/* Sends a discard or write zeroes request with one range */
+static uint8_t virtio_blk_dwz(const QVirtioBus *bus, QVirtioDevice *dev,
+                              QGuestAllocator *alloc, QVirtQueue *vq,
+                              uint32_t type, uint64_t sector,
+                              uint32_t num_sectors)
+{
+    QVirtioBlkReq req = { .type = type, .ioprio = 1 };
+    QVirtioBlkDwzSeg seg;
+    uint64_t req_addr;
+    uint32_t free_head;
+    uint8_t status = 0xFF;
+
+    seg.sector = cpu_to_le64(sector);
+    seg.num_sectors = cpu_to_le32(num_sectors);
+    seg.flags = 0;
+
+    req_addr = guest_alloc(alloc, 16 + sizeof(seg) + 1);
+    virtio_blk_fix_request(&req);
+    memwrite(req_addr, &req, 16);
+    memwrite(req_addr + 16, &seg, sizeof(seg));
+    memwrite(req_addr + 16 + sizeof(seg), &status, sizeof(status));
+
+    free_head = qvirtqueue_add(vq, req_addr, 16, false, true);
+    qvirtqueue_add(vq, req_addr + 16, sizeof(seg), false, true);
+    qvirtqueue_add(vq, req_addr + 16 + sizeof(seg), 1, true, false);
+    qvirtqueue_kick(bus, dev, vq, free_head);
+
+    qvirtio_wait_queue_isr(bus, dev, vq, QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 16 + sizeof(seg));
+    guest_free(alloc, req_addr);
+    return status;
+}
+
 static void test_basic(const QVirtioBus *bus, QVirtioDevice *dev,
             QGuestAllocator *alloc, QVirtQueue *vq, uint64_t device_specific)
 {
@@ -242,6 +310,51 @@ static void test_basic(const QVirtioBus *bus, QVirtioDevice *dev,
 
     guest_free(alloc, req_addr);
 
+    if (features & QVIRTIO_BLK_F_WRITE_ZEROES) {
+        /* Zero the sector written above and read it back */
+        status = virtio_blk_dwz(bus, dev, alloc, vq,
+                                QVIRTIO_BLK_T_WRITE_ZEROES, 0, 1);
+        g_assert_cmpint(status, ==, 0);
+
+        req.type = QVIRTIO_BLK_T_IN;
+        req.ioprio = 1;
+        req.sector = 0;
+        req.data = g_malloc0(512);
+
+        req_addr = virtio_blk_request(alloc, &req, 512);
+
+        g_free(req.data);
+
+        free_head = qvirtqueue_add(vq, req_addr, 16, false, true);
+        qvirtqueue_add(vq, req_addr + 16, 512, true, true);
+        qvirtqueue_add(vq, req_addr + 528, 1, true, false);
+
+        qvirtqueue_kick(bus, dev, vq, free_head);
+
+        qvirtio_wait_queue_isr(bus, dev, vq, QVIRTIO_BLK_TIMEOUT_US);
+        status = readb(req_addr + 528);
+        g_assert_cmpint(status, ==, 0);
+
+        data = g_malloc(512);
+        memread(req_addr + 16, data, 512);
+        g_assert_cmpint(data[0], ==, 0);
+        g_assert(!memcmp(data, data + 1, 511));
+        g_free(data);
+
+        guest_free(alloc, req_addr);
+    }
+
+    if (features & QVIRTIO_BLK_F_DISCARD) {
+        status = virtio_blk_dwz(bus, dev, alloc, vq,
+                                QVIRTIO_BLK_T_DISCARD, 0, 1);
+        g_assert_cmpint(status, ==, 0);
+
+        /* past the end of the disk */
+        status = virtio_blk_dwz(bus, dev, alloc, vq, QVIRTIO_BLK_T_DISCARD,
+                                TEST_IMAGE_SIZE / 512, 1);
+        g_assert_cmpint(status, ==, 1);
+    }
+
     if (features & QVIRTIO_F_ANY_LAYOUT) {
         /* Write and read with 2 descriptor layout */
         /* Write request */
@@ -460,6 +573,34 @@ static void pci_config(void)
     test_end();
 }
 
+static void pci_mq(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    uint32_t features;
+    uint16_t num_queues;
+    void *addr;
+
+    bus = pci_test_start_opts(",num-queues=4");
+
+    dev = virtio_blk_pci_init(bus, PCI_SLOT);
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    g_assert_cmphex(features & QVIRTIO_BLK_F_MQ, !=, 0);
+
+    /* MSI-X is not enabled */
+    addr = dev->addr + QVIRTIO_PCI_DEVICE_SPECIFIC_NO_MSIX +
+           QVIRTIO_BLK_CONFIG_NUM_QUEUES;
+    num_queues = qvirtio_config_readw(&qvirtio_pci, &dev->vdev,
+                                      (uint64_t)(uintptr_t)addr);
+    g_assert_cmpint(num_queues, ==, 4);
+
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
 static void pci_msix(void)
 {
     QVirtioPCIDevice *dev;
@@ -724,6 +865,100 @@ static void pci_hotplug(void)
     test_end();
 }
 
+/*
+ * Keeps queue_depth reads in flight against null-co, so that the time goes
+ * into virtio-blk and the block layer rather than the disk.  Each request is
+ * a fixed descriptor chain that is put back on the avail ring as soon as it
+ * completes.  Both figures include the qtest protocol round trips that stand
+ * in for the guest driver, so they are only useful for comparing QEMU builds.
+ */
+static void pci_perf(const void *data)
+{
+    const VirtioBlkPerfParams *p = data;
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci;
+    QGuestAllocator *alloc;
+    QVirtioBlkReq req;
+    uint64_t *req_addr;
+    uint32_t features;
+    uint32_t free_head;
+    unsigned int i, submitted, completed;
+    double duration, cpu;
+    char *cmdline;
+
+    cpu = qtest_child_cpu_time();
+    cmdline = g_strdup_printf("-drive if=none,id=drive0,file=null-co://,"
+                              "format=raw "
+                              "-device virtio-blk-pci,drive=drive0,"
+                              "addr=%x.%x", PCI_SLOT, PCI_FN);
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    bus = qpci_init_pc();
+    dev = virtio_blk_pci_init(bus, PCI_SLOT);
+    alloc = pc_alloc_init();
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                              alloc, 0);
+    g_assert_cmpint(p->queue_depth * 3, <=, vqpci->vq.size);
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    QVIRTIO_F_RING_INDIRECT_DESC | QVIRTIO_F_RING_EVENT_IDX |
+                            QVIRTIO_BLK_F_SCSI);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* Request i uses descriptors 3 * i to 3 * i + 2 */
+    req_addr = g_new(uint64_t, p->queue_depth);
+    req.data = g_malloc0(p->block_size);
+    for (i = 0; i < p->queue_depth; i++) {
+        req.type = QVIRTIO_BLK_T_IN;
+        req.ioprio = 1;
+        req.sector = i * (p->block_size / 512);
+        req_addr[i] = virtio_blk_request(alloc, &req, p->block_size);
+
+        qvirtqueue_add(&vqpci->vq, req_addr[i], 16, false, true);
+        qvirtqueue_add(&vqpci->vq, req_addr[i] + 16, p->block_size,
+                       true, true);
+        qvirtqueue_add(&vqpci->vq, req_addr[i] + 16 + p->block_size, 1,
+                       true, false);
+    }
+    g_free(req.data);
+
+    g_test_timer_start();
+    for (submitted = 0; submitted < p->queue_depth; submitted++) {
+        qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci->vq, submitted * 3);
+    }
+    for (completed = 0; completed < PERF_REQUESTS; completed++) {
+        free_head = qvirtqueue_wait_buf(&vqpci->vq, QVIRTIO_BLK_TIMEOUT_US);
+        if (submitted < PERF_REQUESTS) {
+            qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci->vq, free_head);
+            submitted++;
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    for (i = 0; i < p->queue_depth; i++) {
+        g_assert_cmpint(readb(req_addr[i] + 16 + p->block_size), ==, 0);
+        guest_free(alloc, req_addr[i]);
+    }
+    g_free(req_addr);
+
+    guest_free(alloc, vqpci->vq.desc);
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+    cpu = qtest_child_cpu_time() - cpu;
+
+    g_test_message("queue depth %u, %u bytes: %.0f requests/s, "
+                   "%.1f us QEMU CPU per request\n",
+                   p->queue_depth, p->block_size, PERF_REQUESTS / duration,
+                   cpu * 1000000.0 / PERF_REQUESTS);
+}
+
 static void mmio_basic(void)
 {
     QVirtioMMIODevice *dev;
@@ -768,6 +1003,7 @@ static void mmio_basic(void)
 int main(int argc, char **argv)
 {
     int ret;
+    int i;
     const char *arch = qtest_get_arch();
 
     g_test_init(&argc, &argv, NULL);
@@ -776,9 +1012,20 @@ int main(int argc, char **argv)
         qtest_add_func("/virtio/blk/pci/basic", pci_basic);
         qtest_add_func("/virtio/blk/pci/indirect", pci_indirect);
         qtest_add_func("/virtio/blk/pci/config", pci_config);
+        qtest_add_func("/virtio/blk/pci/mq", pci_mq);
         qtest_add_func("/virtio/blk/pci/msix", pci_msix);
         qtest_add_func("/virtio/blk/pci/idx", pci_idx);
         qtest_add_func("/virtio/blk/pci/hotplug", pci_hotplug);
+
+        if (g_test_perf()) {
+            for (i = 0; i < ARRAY_SIZE(perf_params); i++) {
+                char *path = g_strdup_printf("/virtio/blk/pci/perf/qd%u-bs%u",
+                                             perf_params[i].queue_depth,
+                                             perf_params[i].block_size);
+                qtest_add_data_func(path, &perf_params[i], pci_perf);
+                g_free(path);
+            }
+        }
     } else if (strcmp(arch, "arm") == 0) {
         qtest_add_func("/virtio/blk/mmio/basic", mmio_basic);
     }
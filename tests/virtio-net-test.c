@@ -9,12 +9,41 @@
 
 #include <glib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include "libqtest.h"
 #include "qemu/osdep.h"
 #include "libqos/pci.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc.h"
+#include "libqos/malloc-pc.h"
 
+#define QVIRTIO_NET_F_MRG_RXBUF     0x00008000
+
+/* struct virtio_net_hdr, without mergeable receive buffers */
+#define VNET_HDR_SIZE           10
+
+#define QVIRTIO_NET_TIMEOUT_US  (30 * 1000 * 1000)
+#define PCI_SLOT                0x04
+#define PCI_FN                  0x00
 #define PCI_SLOT_HP             0x06
 
+#define PERF_REQUESTS           20000
+
+typedef struct VirtioNetPerfParams {
+    unsigned int queue_depth;
+    unsigned int packet_size;
+} VirtioNetPerfParams;
+
+static const VirtioNetPerfParams perf_params[] = {
+    { 1, 64 },
+    { 32, 64 },
+    { 32, 1514 },
+};
+
 /* Tests only initialization so far. TODO: Replace with functional tests */
 static void pci_nop(void)
 {
@@ -26,14 +55,143 @@ static void hotplug(void)
     qpci_unplug_acpi_device_test("net1", PCI_SLOT_HP);
 }
 
+/*
+ * Transmits packets to a UDP socket of the test through the socket backend,
+ * keeping queue_depth of them on the TX queue.  As in virtio-blk-test, the
+ * figures include the qtest round trips that replace the guest driver.  The
+ * benchmark runs its own QEMU, next to the one that main() starts.
+ */
+static void pci_perf_tx(const void *data)
+{
+    const VirtioNetPerfParams *p = data;
+    QTestState *saved_qtest = global_qtest;
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueue *vq;
+    QGuestAllocator *alloc;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    uint64_t *pkt_addr;
+    uint8_t *pkt;
+    uint32_t features;
+    uint32_t free_head;
+    unsigned int i, submitted, completed;
+    double duration, cpu;
+    char *cmdline;
+    int sock, ret;
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    g_assert_cmpint(sock, >=, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ret = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    g_assert_cmpint(ret, ==, 0);
+    ret = getsockname(sock, (struct sockaddr *)&addr, &addrlen);
+    g_assert_cmpint(ret, ==, 0);
+
+    cpu = qtest_child_cpu_time();
+    cmdline = g_strdup_printf("-netdev socket,id=hs0,udp=127.0.0.1:%d,"
+                              "localaddr=127.0.0.1:0 "
+                              "-device virtio-net-pci,netdev=hs0,"
+                              "addr=%x.%x",
+                              ntohs(addr.sin_port), PCI_SLOT, PCI_FN);
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    bus = qpci_init_pc();
+    dev = qvirtio_pci_device_find(bus, QVIRTIO_NET_DEVICE_ID);
+    g_assert(dev != NULL);
+    qvirtio_pci_device_enable(dev);
+    qvirtio_reset(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_acknowledge(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_driver(&qvirtio_pci, &dev->vdev);
+
+    alloc = pc_alloc_init();
+    vq = qvirtqueue_setup(&qvirtio_pci, &dev->vdev, alloc, 1);
+    g_assert_cmpint(p->queue_depth * 2, <=, vq->size);
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    QVIRTIO_F_RING_INDIRECT_DESC | QVIRTIO_F_RING_EVENT_IDX |
+                            QVIRTIO_NET_F_MRG_RXBUF);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* A zero header and a broadcast frame; packet i uses descriptors 2 * i
+     * and 2 * i + 1 */
+    pkt = g_malloc0(VNET_HDR_SIZE + p->packet_size);
+    memset(pkt + VNET_HDR_SIZE, 0xff, 6);
+    pkt[VNET_HDR_SIZE + 12] = 0x88;
+    pkt[VNET_HDR_SIZE + 13] = 0xb5;
+    pkt_addr = g_new(uint64_t, p->queue_depth);
+    for (i = 0; i < p->queue_depth; i++) {
+        pkt_addr[i] = guest_alloc(alloc, VNET_HDR_SIZE + p->packet_size);
+        memwrite(pkt_addr[i], pkt, VNET_HDR_SIZE + p->packet_size);
+
+        qvirtqueue_add(vq, pkt_addr[i], VNET_HDR_SIZE, false, true);
+        qvirtqueue_add(vq, pkt_addr[i] + VNET_HDR_SIZE, p->packet_size,
+                       false, false);
+    }
+
+    g_test_timer_start();
+    for (submitted = 0; submitted < p->queue_depth; submitted++) {
+        qvirtqueue_kick(&qvirtio_pci, &dev->vdev, vq, submitted * 2);
+    }
+    for (completed = 0; completed < PERF_REQUESTS; completed++) {
+        free_head = qvirtqueue_wait_buf(vq, QVIRTIO_NET_TIMEOUT_US);
+        if (submitted < PERF_REQUESTS) {
+            qvirtqueue_kick(&qvirtio_pci, &dev->vdev, vq, free_head);
+            submitted++;
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    /* The socket buffer overflows, but the first packets must be there */
+    ret = recv(sock, pkt, p->packet_size, MSG_DONTWAIT);
+    g_assert_cmpint(ret, ==, p->packet_size);
+    close(sock);
+    g_free(pkt);
+
+    for (i = 0; i < p->queue_depth; i++) {
+        guest_free(alloc, pkt_addr[i]);
+    }
+    g_free(pkt_addr);
+
+    guest_free(alloc, vq->desc);
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_end();
+    global_qtest = saved_qtest;
+    cpu = qtest_child_cpu_time() - cpu;
+
+    g_test_message("queue depth %u, %u bytes: %.0f packets/s, "
+                   "%.1f us QEMU CPU per packet\n",
+                   p->queue_depth, p->packet_size, PERF_REQUESTS / duration,
+                   cpu * 1000000.0 / PERF_REQUESTS);
+}
+
 int main(int argc, char **argv)
 {
     int ret;
+    int i;
 
     g_test_init(&argc, &argv, NULL);
     qtest_add_func("/virtio/net/pci/nop", pci_nop);
     qtest_add_func("/virtio/net/pci/hotplug", hotplug);
 
+    if (g_test_perf()) {
+        for (i = 0; i < ARRAY_SIZE(perf_params); i++) {
+            char *path = g_strdup_printf("/virtio/net/pci/perf/tx-qd%u-%u",
+                                         perf_params[i].queue_depth,
+                                         perf_params[i].packet_size);
+            qtest_add_data_func(path, &perf_params[i], pci_perf_tx);
+            g_free(path);
+        }
+    }
+
     qtest_start("-device virtio-net-pci");
     ret = g_test_run();
 
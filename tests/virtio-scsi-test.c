@@ -19,6 +19,7 @@
 #include "libqos/malloc.h"
 #include "libqos/malloc-pc.h"
 #include "libqos/malloc-generic.h"
+#include "qemu/bswap.h"
 
 #define PCI_SLOT                0x02
 #define PCI_FN                  0x00
@@ -27,6 +28,8 @@
 
 #define MAX_NUM_QUEUES 64
 
+#define PERF_REQUESTS 20000
+
 typedef struct {
     QVirtioDevice *dev;
     QGuestAllocator *alloc;
@@ -53,6 +56,17 @@ typedef struct {
     uint8_t sense[96];
 } QEMU_PACKED QVirtIOSCSICmdResp;
 
+typedef struct VirtIOSCSIPerfParams {
+    unsigned int queue_depth;
+    unsigned int block_size;
+} VirtIOSCSIPerfParams;
+
+static const VirtIOSCSIPerfParams perf_params[] = {
+    { 1, 4096 },
+    { 32, 4096 },
+    { 32, 65536 },
+};
+
 static void qvirtio_scsi_start(const char *extra_opts)
 {
     char *cmdline;
@@ -237,9 +251,91 @@ static void test_unaligned_write_same(void)
     qvirtio_scsi_stop();
 }
 
+/*
+ * READ(10) commands to a scsi-hd on null-co, with queue_depth of them in
+ * flight on the first request queue; the counterpart of the virtio-blk
+ * benchmark, so the two can be compared.  The figures include the qtest
+ * round trips that replace the guest driver.
+ */
+static void pci_perf(const void *data)
+{
+    const VirtIOSCSIPerfParams *p = data;
+    QVirtIOSCSI *vs;
+    QVirtQueue *vq;
+    QVirtIOSCSICmdReq req = { { 0 } };
+    QVirtIOSCSICmdResp resp = { .response = 0xff, .status = 0xff };
+    uint64_t *req_addr, *resp_addr, *data_addr;
+    uint32_t blocks = p->block_size / 512;
+    uint32_t free_head;
+    unsigned int i, submitted, completed;
+    double duration, cpu;
+
+    cpu = qtest_child_cpu_time();
+    qvirtio_scsi_start("-drive file=null-co://,if=none,id=dr1,format=raw "
+                       "-device scsi-hd,drive=dr1,lun=0,scsi-id=1");
+    vs = qvirtio_scsi_pci_init(PCI_SLOT);
+    vq = vs->vq[2];
+    g_assert_cmpint(p->queue_depth * 3, <=, vq->size);
+
+    req.lun[0] = 1; /* Select LUN */
+    req.lun[1] = 1; /* Select target 1 */
+    req.cdb[0] = 0x28; /* READ(10) */
+    req.cdb[7] = blocks >> 8;
+    req.cdb[8] = blocks;
+
+    /* Request i uses descriptors 3 * i to 3 * i + 2 */
+    req_addr = g_new(uint64_t, p->queue_depth);
+    resp_addr = g_new(uint64_t, p->queue_depth);
+    data_addr = g_new(uint64_t, p->queue_depth);
+    for (i = 0; i < p->queue_depth; i++) {
+        stl_be_p(&req.cdb[2], i * blocks);
+        req_addr[i] = qvirtio_scsi_alloc(vs, sizeof(req), &req);
+        resp_addr[i] = qvirtio_scsi_alloc(vs, sizeof(resp), &resp);
+        data_addr[i] = qvirtio_scsi_alloc(vs, p->block_size, NULL);
+
+        qvirtqueue_add(vq, req_addr[i], sizeof(req), false, true);
+        qvirtqueue_add(vq, resp_addr[i], sizeof(resp), true, true);
+        qvirtqueue_add(vq, data_addr[i], p->block_size, true, false);
+    }
+
+    g_test_timer_start();
+    for (submitted = 0; submitted < p->queue_depth; submitted++) {
+        qvirtqueue_kick(&qvirtio_pci, vs->dev, vq, submitted * 3);
+    }
+    for (completed = 0; completed < PERF_REQUESTS; completed++) {
+        free_head = qvirtqueue_wait_buf(vq, QVIRTIO_SCSI_TIMEOUT_US);
+        if (submitted < PERF_REQUESTS) {
+            qvirtqueue_kick(&qvirtio_pci, vs->dev, vq, free_head);
+            submitted++;
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    for (i = 0; i < p->queue_depth; i++) {
+        g_assert_cmphex(readb(resp_addr[i] +
+                              offsetof(QVirtIOSCSICmdResp, response)), ==, 0);
+        guest_free(vs->alloc, req_addr[i]);
+        guest_free(vs->alloc, resp_addr[i]);
+        guest_free(vs->alloc, data_addr[i]);
+    }
+    g_free(req_addr);
+    g_free(resp_addr);
+    g_free(data_addr);
+
+    qvirtio_scsi_pci_free(vs);
+    qvirtio_scsi_stop();
+    cpu = qtest_child_cpu_time() - cpu;
+
+    g_test_message("queue depth %u, %u bytes: %.0f requests/s, "
+                   "%.1f us QEMU CPU per request\n",
+                   p->queue_depth, p->block_size, PERF_REQUESTS / duration,
+                   cpu * 1000000.0 / PERF_REQUESTS);
+}
+
 int main(int argc, char **argv)
 {
     int ret;
+    int i;
 
     g_test_init(&argc, &argv, NULL);
     qtest_add_func("/virtio/scsi/pci/nop", pci_nop);
@@ -247,6 +343,16 @@ int main(int argc, char **argv)
     qtest_add_func("/virtio/scsi/pci/scsi-disk/unaligned-write-same",
                    test_unaligned_write_same);
 
+    if (g_test_perf()) {
+        for (i = 0; i < ARRAY_SIZE(perf_params); i++) {
+            char *path = g_strdup_printf("/virtio/scsi/pci/perf/qd%u-bs%u",
+                                         perf_params[i].queue_depth,
+                                         perf_params[i].block_size);
+            qtest_add_data_func(path, &perf_params[i], pci_perf);
+            g_free(path);
+        }
+    }
+
     ret = g_test_run();
 
     return ret;
@@ -23,9 +23,14 @@
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
 
+#ifdef CONFIG_LINUX
+#include <sched.h>
+#endif
+
 static void do_spawn_thread(ThreadPool *pool);
 
 typedef struct ThreadPoolElement ThreadPoolElement;
+typedef struct ThreadPoolWorker ThreadPoolWorker;
 
 enum ThreadState {
     THREAD_QUEUED,
@@ -39,68 +44,292 @@ struct ThreadPoolElement {
     ThreadPoolFunc *func;
     void *arg;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+    /* The worker whose queue the request was put on */
+    ThreadPoolWorker *worker;
+
+    /* Moving state out of THREAD_QUEUED is protected by worker->lock.
+     * After that, only the thread that took the request can write to it.
+     * Reads and writes of state and ret are ordered with memory barriers.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* Access to this list is protected by worker->lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
 
+/*
+ * Every worker thread has a queue of its own.  It takes requests from its
+ * head and, when it is empty, steals from the tail of the others, first
+ * from those that run on the same NUMA node.
+ */
+struct ThreadPoolWorker {
+    ThreadPool *pool;
+    int index;
+    int node;            /* NUMA node the thread last ran on, or -1 */
+    QemuSemaphore sem;   /* posted for each request put on the queue */
+
+    QemuMutex lock;
+    /* The following variables are protected by lock.  */
+    QTAILQ_HEAD(ThreadPoolElementQueue, ThreadPoolElement) request_list;
+    int depth;
+    bool idle;
+
+    /* The following variables are protected by pool->lock.  */
+    bool running;        /* the slot belongs to a thread... */
+    bool started;        /* ...that was created already */
+};
+
 struct ThreadPool {
     AioContext *ctx;
     QEMUBH *completion_bh;
     QemuMutex lock;
     QemuCond worker_stopped;
-    QemuSemaphore sem;
-    int max_threads;
     QEMUBH *new_thread_bh;
 
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
 
+    /* Slots are only ever added, under lock, so that the other workers can
+     * walk them without it.
+     */
+    ThreadPoolWorker *workers[THREAD_POOL_MAX_WORKERS];
+    int nr_workers;
+
     /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    int min_threads;
+    int max_threads;
     int cur_threads;
-    int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     bool stopping;
 };
 
+#ifdef CONFIG_LINUX
+#define THREAD_POOL_MAX_CPUS 4096
+
+/* NUMA node + 1 of each host CPU, 0 if unknown */
+static uint8_t cpu_node[THREAD_POOL_MAX_CPUS];
+
+static void thread_pool_parse_cpulist(int node, const char *list)
+{
+    char *end;
+
+    while (*list) {
+        long first, last;
+
+        first = last = strtol(list, &end, 10);
+        if (end == list) {
+            return;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list) {
+                return;
+            }
+        }
+        for (; first <= last && first < THREAD_POOL_MAX_CPUS; first++) {
+            if (first >= 0) {
+                cpu_node[first] = node + 1;
+            }
+        }
+        list = end;
+        if (*list == ',') {
+            list++;
+        } else {
+            return;
+        }
+    }
+}
+
+static void thread_pool_init_numa(void)
+{
+    static gsize initialized;
+    int node;
+
+    if (!g_once_init_enter(&initialized)) {
+        return;
+    }
+    for (node = 0; node < UINT8_MAX - 1; node++) {
+        char *path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist",
+                                     node);
+        char *list;
+
+        if (g_file_get_contents(path, &list, NULL, NULL)) {
+            thread_pool_parse_cpulist(node, list);
+            g_free(list);
+        }
+        g_free(path);
+    }
+    g_once_init_leave(&initialized, 1);
+}
+
+static int thread_pool_cpu_node(void)
+{
+    int cpu = sched_getcpu();
+
+    if (cpu < 0 || cpu >= THREAD_POOL_MAX_CPUS) {
+        return -1;
+    }
+    return cpu_node[cpu] - 1;
+}
+#else
+static void thread_pool_init_numa(void)
+{
+}
+
+static int thread_pool_cpu_node(void)
+{
+    return -1;
+}
+#endif
+
+/* Take the request at the head of the worker's own queue.  */
+static ThreadPoolElement *worker_pop(ThreadPoolWorker *w)
+{
+    ThreadPoolElement *req;
+
+    qemu_mutex_lock(&w->lock);
+    req = QTAILQ_FIRST(&w->request_list);
+    if (req) {
+        QTAILQ_REMOVE(&w->request_list, req, reqs);
+        req->state = THREAD_ACTIVE;
+        w->depth--;
+        trace_thread_pool_queue_depth(w->pool, w, w->depth);
+    }
+    qemu_mutex_unlock(&w->lock);
+    return req;
+}
+
+/* Take the request at the tail of another worker's queue, preferring
+ * the workers on the same NUMA node.  The queues are only peeked at
+ * without their lock, so a request queued meanwhile may be missed; its
+ * own worker was woken up for it anyway.
+ */
+static ThreadPoolElement *worker_steal(ThreadPoolWorker *w)
+{
+    ThreadPool *pool = w->pool;
+    int nr_workers = atomic_read(&pool->nr_workers);
+    int pass, i;
+
+    smp_rmb();
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 1; i < nr_workers; i++) {
+            ThreadPoolWorker *victim = pool->workers[(w->index + i) %
+                                                    nr_workers];
+            ThreadPoolElement *req;
+
+            if ((atomic_read(&victim->node) == w->node) == pass ||
+                !atomic_read(&victim->depth)) {
+                continue;
+            }
+
+            qemu_mutex_lock(&victim->lock);
+            req = QTAILQ_LAST(&victim->request_list, ThreadPoolElementQueue);
+            if (req) {
+                QTAILQ_REMOVE(&victim->request_list, req, reqs);
+                req->state = THREAD_ACTIVE;
+                victim->depth--;
+            }
+            qemu_mutex_unlock(&victim->lock);
+
+            if (req) {
+                trace_thread_pool_steal(pool, w, victim);
+                return req;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Give up the slot, unless the worker got requests in the meantime or
+ * the pool is down to its minimum size.  Returns true if the thread must
+ * exit.
+ */
+static bool worker_retire(ThreadPoolWorker *w)
+{
+    ThreadPool *pool = w->pool;
+    bool retire;
+
+    qemu_mutex_lock(&pool->lock);
+    qemu_mutex_lock(&w->lock);
+    retire = QTAILQ_EMPTY(&w->request_list) &&
+             (pool->stopping || pool->cur_threads > pool->min_threads);
+    if (retire) {
+        w->running = false;
+        w->started = false;
+    }
+    qemu_mutex_unlock(&w->lock);
+
+    if (retire) {
+        pool->cur_threads--;
+        qemu_cond_signal(&pool->worker_stopped);
+    }
+    qemu_mutex_unlock(&pool->lock);
+    return retire;
+}
+
+/* Wait for requests.  Returns true if the thread must exit.  */
+static bool worker_wait(ThreadPoolWorker *w)
+{
+    ThreadPool *pool = w->pool;
+    int ret = -1;
+
+    w->node = thread_pool_cpu_node();
+
+    qemu_mutex_lock(&w->lock);
+    if (!QTAILQ_EMPTY(&w->request_list)) {
+        qemu_mutex_unlock(&w->lock);
+        return false;
+    }
+    w->idle = true;
+    qemu_mutex_unlock(&w->lock);
+
+    /* Leave at once if the pool has since been made smaller */
+    if (atomic_read(&pool->cur_threads) <= atomic_read(&pool->max_threads)) {
+        ret = qemu_sem_timedwait(&w->sem, 10000);
+    }
+
+    qemu_mutex_lock(&w->lock);
+    w->idle = false;
+    qemu_mutex_unlock(&w->lock);
+
+    if (ret == -1 || atomic_read(&pool->stopping)) {
+        return worker_retire(w);
+    }
+    return false;
+}
+
 static void *worker_thread(void *opaque)
 {
-    ThreadPool *pool = opaque;
+    ThreadPoolWorker *w = opaque;
+    ThreadPool *pool = w->pool;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
     do_spawn_thread(pool);
+    qemu_mutex_unlock(&pool->lock);
+
+    w->node = thread_pool_cpu_node();
 
-    while (!pool->stopping) {
+    for (;;) {
         ThreadPoolElement *req;
         int ret;
 
-        do {
-            pool->idle_threads++;
-            qemu_mutex_unlock(&pool->lock);
-            ret = qemu_sem_timedwait(&pool->sem, 10000);
-            qemu_mutex_lock(&pool->lock);
-            pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
-            break;
+        req = worker_pop(w);
+        if (!req) {
+            req = worker_steal(w);
+        }
+        if (!req) {
+            if (worker_wait(w)) {
+                break;
+            }
+            continue;
         }
-
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
 
         ret = req->func(req->arg);
 
@@ -109,30 +338,35 @@ static void *worker_thread(void *opaque)
         smp_wmb();
         req->state = THREAD_DONE;
 
-        qemu_mutex_lock(&pool->lock);
-
         qemu_bh_schedule(pool->completion_bh);
     }
 
-    pool->cur_threads--;
-    qemu_cond_signal(&pool->worker_stopped);
-    qemu_mutex_unlock(&pool->lock);
     return NULL;
 }
 
 static void do_spawn_thread(ThreadPool *pool)
 {
     QemuThread t;
+    int i;
 
     /* Runs with lock taken.  */
     if (!pool->new_threads) {
         return;
     }
 
-    pool->new_threads--;
-    pool->pending_threads++;
+    for (i = 0; i < pool->nr_workers; i++) {
+        ThreadPoolWorker *w = pool->workers[i];
 
-    qemu_thread_create(&t, "worker", worker_thread, pool, QEMU_THREAD_DETACHED);
+        if (w->running && !w->started) {
+            pool->new_threads--;
+            pool->pending_threads++;
+            w->started = true;
+            qemu_thread_create(&t, "worker", worker_thread, w,
+                               QEMU_THREAD_DETACHED);
+            return;
+        }
+    }
+    abort();
 }
 
 static void spawn_thread_bh_fn(void *opaque)
@@ -144,8 +378,37 @@ static void spawn_thread_bh_fn(void *opaque)
     qemu_mutex_unlock(&pool->lock);
 }
 
-static void spawn_thread(ThreadPool *pool)
+/* Reserve a slot for a new worker thread.  Requests can be queued on it
+ * right away, the thread picks them up once it runs.
+ */
+static ThreadPoolWorker *spawn_thread(ThreadPool *pool)
 {
+    ThreadPoolWorker *w = NULL;
+    int i;
+
+    /* Runs with lock taken.  */
+    for (i = 0; i < pool->nr_workers; i++) {
+        if (!pool->workers[i]->running) {
+            w = pool->workers[i];
+            break;
+        }
+    }
+    if (!w) {
+        assert(pool->nr_workers < THREAD_POOL_MAX_WORKERS);
+        w = g_new0(ThreadPoolWorker, 1);
+        w->pool = pool;
+        w->index = pool->nr_workers;
+        w->node = -1;
+        qemu_sem_init(&w->sem, 0);
+        qemu_mutex_init(&w->lock);
+        QTAILQ_INIT(&w->request_list);
+        pool->workers[pool->nr_workers] = w;
+        /* Write the slot before the count, see worker_steal().  */
+        smp_wmb();
+        atomic_set(&pool->nr_workers, pool->nr_workers + 1);
+    }
+    w->running = true;
+
     pool->cur_threads++;
     pool->new_threads++;
     /* If there are threads being created, they will spawn new workers, so
@@ -158,6 +421,46 @@ static void spawn_thread(ThreadPool *pool)
     if (!pool->pending_threads) {
         qemu_bh_schedule(pool->new_thread_bh);
     }
+    return w;
+}
+
+/* Choose the queue for a new request: an idle worker on the caller's NUMA
+ * node, else any idle worker, else a new one if the pool may still grow,
+ * else the worker with the fewest queued requests.
+ */
+static ThreadPoolWorker *thread_pool_pick_worker(ThreadPool *pool)
+{
+    ThreadPoolWorker *idle = NULL, *best = NULL;
+    int node = thread_pool_cpu_node();
+    int i;
+
+    /* Runs with lock taken.  */
+    for (i = 0; i < pool->nr_workers; i++) {
+        ThreadPoolWorker *w = pool->workers[i];
+
+        if (!w->running) {
+            continue;
+        }
+        if (atomic_read(&w->idle)) {
+            if (w->node == node) {
+                return w;
+            }
+            if (!idle) {
+                idle = w;
+            }
+        } else if (!best || atomic_read(&w->depth) < atomic_read(&best->depth)) {
+            best = w;
+        }
+    }
+
+    if (idle) {
+        return idle;
+    }
+    if (pool->cur_threads < pool->max_threads) {
+        return spawn_thread(pool);
+    }
+    assert(best);
+    return best;
 }
 
 static void thread_pool_completion_bh(void *opaque)
@@ -196,26 +499,24 @@ restart:
 static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
-    ThreadPool *pool = elem->pool;
+    ThreadPoolWorker *w = elem->worker;
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    qemu_mutex_lock(&pool->lock);
-    if (elem->state == THREAD_QUEUED &&
-        /* No thread has yet started working on elem. we can try to "steal"
-         * the item from the worker if we can get a signal from the
-         * semaphore.  Because this is non-blocking, we can do it with
-         * the lock taken and ensure that elem will remain THREAD_QUEUED.
-         */
-        qemu_sem_timedwait(&pool->sem, 0) == 0) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
+    /* No thread has yet started working on elem as long as it is queued,
+     * and it cannot be taken while we hold the lock of its queue.  The
+     * worker may find one wakeup too many, but that is harmless.
+     */
+    qemu_mutex_lock(&w->lock);
+    if (elem->state == THREAD_QUEUED) {
+        QTAILQ_REMOVE(&w->request_list, elem, reqs);
+        w->depth--;
+        qemu_bh_schedule(elem->pool->completion_bh);
 
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
     }
-
-    qemu_mutex_unlock(&pool->lock);
+    qemu_mutex_unlock(&w->lock);
 }
 
 static AioContext *thread_pool_get_aio_context(BlockAIOCB *acb)
@@ -236,6 +537,7 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         BlockCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
+    ThreadPoolWorker *w;
 
     req = qemu_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
     req->func = func;
@@ -248,13 +550,42 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
     trace_thread_pool_submit(pool, req, arg);
 
     qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
+    w = thread_pool_pick_worker(pool);
+    req->worker = w;
+    qemu_mutex_lock(&w->lock);
+    QTAILQ_INSERT_TAIL(&w->request_list, req, reqs);
+    w->depth++;
+    w->idle = false;
+    trace_thread_pool_queue_depth(pool, w, w->depth);
+    qemu_mutex_unlock(&w->lock);
+    qemu_mutex_unlock(&pool->lock);
+    qemu_sem_post(&w->sem);
+    return &req->common;
+}
+
+void thread_pool_set_limits(ThreadPool *pool, int min_threads, int max_threads)
+{
+    int i;
+
+    assert(0 <= min_threads && min_threads <= max_threads);
+    assert(max_threads > 0 && max_threads <= THREAD_POOL_MAX_WORKERS);
+
+    qemu_mutex_lock(&pool->lock);
+    pool->min_threads = min_threads;
+    pool->max_threads = max_threads;
+    while (pool->cur_threads < pool->min_threads) {
         spawn_thread(pool);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+
+    /* Wake up idle workers so that the extra ones go away */
+    for (i = 0; i < pool->nr_workers; i++) {
+        ThreadPoolWorker *w = pool->workers[i];
+
+        if (w->started && atomic_read(&w->idle)) {
+            qemu_sem_post(&w->sem);
+        }
+    }
     qemu_mutex_unlock(&pool->lock);
-    qemu_sem_post(&pool->sem);
-    return &req->common;
 }
 
 typedef struct ThreadPoolCo {
@@ -291,17 +622,18 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
         ctx = qemu_get_aio_context();
     }
 
+    thread_pool_init_numa();
+
     memset(pool, 0, sizeof(*pool));
     pool->ctx = ctx;
     pool->completion_bh = aio_bh_new(ctx, thread_pool_completion_bh, pool);
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
-    qemu_sem_init(&pool->sem, 0);
-    pool->max_threads = 64;
+    pool->min_threads = THREAD_POOL_DEFAULT_MIN_THREADS;
+    pool->max_threads = THREAD_POOL_DEFAULT_MAX_THREADS;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -313,6 +645,8 @@ ThreadPool *thread_pool_new(AioContext *ctx)
 
 void thread_pool_free(ThreadPool *pool)
 {
+    int i;
+
     if (!pool) {
         return;
     }
@@ -325,18 +659,35 @@ void thread_pool_free(ThreadPool *pool)
     qemu_bh_delete(pool->new_thread_bh);
     pool->cur_threads -= pool->new_threads;
     pool->new_threads = 0;
+    for (i = 0; i < pool->nr_workers; i++) {
+        if (!pool->workers[i]->started) {
+            pool->workers[i]->running = false;
+        }
+    }
 
     /* Wait for worker threads to terminate */
     pool->stopping = true;
     while (pool->cur_threads > 0) {
-        qemu_sem_post(&pool->sem);
+        for (i = 0; i < pool->nr_workers; i++) {
+            if (pool->workers[i]->running) {
+                qemu_sem_post(&pool->workers[i]->sem);
+            }
+        }
         qemu_cond_wait(&pool->worker_stopped, &pool->lock);
     }
 
     qemu_mutex_unlock(&pool->lock);
 
+    for (i = 0; i < pool->nr_workers; i++) {
+        ThreadPoolWorker *w = pool->workers[i];
+
+        assert(QTAILQ_EMPTY(&w->request_list));
+        qemu_mutex_destroy(&w->lock);
+        qemu_sem_destroy(&w->sem);
+        g_free(w);
+    }
+
     qemu_bh_delete(pool->completion_bh);
-    qemu_sem_destroy(&pool->sem);
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
     g_free(pool);
@@ -24,15 +24,15 @@ static QLIST_HEAD(, TPMBackend) tpm_backends =
     QLIST_HEAD_INITIALIZER(tpm_backends);
 
 
-#define TPM_MAX_MODELS      1
-#define TPM_MAX_DRIVERS     2
+#define TPM_MAX_MODELS      2
+#define TPM_MAX_DRIVERS     3
 
 static TPMDriverOps const *be_drivers[TPM_MAX_DRIVERS] = {
     NULL,
 };
 
 static enum TpmModel tpm_models[TPM_MAX_MODELS] = {
-    TPM_MODEL_MAX,
+    TPM_MODEL_MAX, TPM_MODEL_MAX,
 };
 
 int tpm_register_model(enum TpmModel model)
@@ -253,6 +253,10 @@ static TPMInfo *qmp_query_tpm_inst(TPMBackend *drv)
 {
     TPMInfo *res = g_new0(TPMInfo, 1);
     TPMPassthroughOptions *tpo;
+    TPMMuxOptions *tmo;
+    intList *depth;
+    uint8_t locty;
+    uint64_t hits, misses;
 
     res->id = g_strdup(drv->id);
     res->model = drv->fe_model;
@@ -281,10 +285,36 @@ static TPMInfo *qmp_query_tpm_inst(TPMBackend *drv)
             tpo->has_path = true;
         }
         break;
+    case TPM_TYPE_MUX:
+        res->options->kind = TPM_TYPE_OPTIONS_KIND_MUX;
+        tmo = g_new0(TPMMuxOptions, 1);
+        res->options->mux = tmo;
+        tmo->path = g_strdup(drv->path);
+        tmo->vm_id = object_property_get_str(OBJECT(drv), "vm-id", NULL);
+        break;
     case TPM_TYPE_MAX:
         break;
     }
 
+    if (drv->ops->get_queue_depth) {
+        res->has_queue_depth = true;
+        for (locty = TPM_BACKEND_NUM_LOCALITIES; locty > 0; locty--) {
+            depth = g_new0(intList, 1);
+            depth->value = tpm_backend_get_queue_depth(drv, locty - 1);
+            depth->next = res->queue_depth;
+            res->queue_depth = depth;
+        }
+    }
+
+    res->commands = tpm_backend_query_stats(drv);
+
+    if (tpm_backend_get_cache_stats(drv, &hits, &misses)) {
+        res->has_cache_hits = true;
+        res->cache_hits = hits;
+        res->has_cache_misses = true;
+        res->cache_misses = misses;
+    }
+
     return res;
 }
 
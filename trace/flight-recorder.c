@@ -0,0 +1,202 @@
+/*
+ * Flight recorder of latency-sensitive trace events
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/notify.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "trace.h"
+#include "trace/control.h"
+#include "trace/flight-recorder.h"
+
+typedef struct FlightRecorderEntry {
+    int64_t timestamp;
+    int64_t value;
+    TraceEventID id;
+} FlightRecorderEntry;
+
+/*
+ * Only the owning thread writes to its ring; @next is published after the
+ * entry that it covers has been written.
+ */
+typedef struct FlightRecorderRing {
+    int thread_id;
+    unsigned int next;
+    FlightRecorderEntry entries[FLIGHT_RECORDER_EVENTS];
+    Notifier exit_notifier;
+    QLIST_ENTRY(FlightRecorderRing) node;
+} FlightRecorderRing;
+
+static bool fr_frozen;
+static int64_t fr_threshold_ns[FLIGHT_RECORDER_TRIGGER_MAX];
+
+/* fr_lock protects the list of rings and the trigger of the freeze */
+static QemuMutex fr_lock;
+static QLIST_HEAD(, FlightRecorderRing) fr_rings =
+    QLIST_HEAD_INITIALIZER(fr_rings);
+static __thread FlightRecorderRing *fr_ring;
+
+static FlightRecorderTrigger fr_trigger;
+static int fr_trigger_thread_id;
+static int64_t fr_trigger_ns;
+static int64_t fr_trigger_timestamp;
+
+static void __attribute__((constructor)) flight_recorder_init(void)
+{
+    qemu_mutex_init(&fr_lock);
+}
+
+static void flight_recorder_thread_exit(Notifier *n, void *unused)
+{
+    FlightRecorderRing *ring = container_of(n, FlightRecorderRing,
+                                            exit_notifier);
+
+    qemu_mutex_lock(&fr_lock);
+    QLIST_REMOVE(ring, node);
+    qemu_mutex_unlock(&fr_lock);
+    g_free(ring);
+    fr_ring = NULL;
+}
+
+static FlightRecorderRing *flight_recorder_ring_new(void)
+{
+    FlightRecorderRing *ring = g_new0(FlightRecorderRing, 1);
+
+    ring->thread_id = qemu_get_thread_id();
+    ring->exit_notifier.notify = flight_recorder_thread_exit;
+    qemu_thread_atexit_add(&ring->exit_notifier);
+
+    qemu_mutex_lock(&fr_lock);
+    QLIST_INSERT_HEAD(&fr_rings, ring, node);
+    qemu_mutex_unlock(&fr_lock);
+
+    fr_ring = ring;
+    return ring;
+}
+
+void flight_recorder_record(TraceEventID id, int64_t value)
+{
+    FlightRecorderRing *ring = fr_ring;
+    FlightRecorderEntry *e;
+
+    if (atomic_read(&fr_frozen)) {
+        return;
+    }
+    if (!ring) {
+        ring = flight_recorder_ring_new();
+    }
+
+    e = &ring->entries[ring->next % FLIGHT_RECORDER_EVENTS];
+    e->timestamp = get_clock();
+    e->value = value;
+    e->id = id;
+    smp_wmb();
+    atomic_set(&ring->next, ring->next + 1);
+}
+
+void flight_recorder_check(FlightRecorderTrigger trigger, int64_t ns)
+{
+    int64_t threshold = atomic_read(&fr_threshold_ns[trigger]);
+
+    if (!threshold || ns < threshold) {
+        return;
+    }
+
+    qemu_mutex_lock(&fr_lock);
+    if (!fr_frozen) {
+        fr_trigger = trigger;
+        fr_trigger_thread_id = qemu_get_thread_id();
+        fr_trigger_ns = ns;
+        fr_trigger_timestamp = get_clock();
+        atomic_mb_set(&fr_frozen, true);
+        trace_flight_recorder_freeze(trigger, ns);
+    }
+    qemu_mutex_unlock(&fr_lock);
+}
+
+static FlightRecorderThreadList *flight_recorder_query_ring(
+    FlightRecorderRing *ring)
+{
+    FlightRecorderThreadList *entry = g_new0(FlightRecorderThreadList, 1);
+    FlightRecorderEventList **tail;
+    unsigned int next, i;
+
+    entry->value = g_new0(FlightRecorderThread, 1);
+    entry->value->thread_id = ring->thread_id;
+    tail = &entry->value->events;
+
+    /* oldest first */
+    next = atomic_read(&ring->next);
+    smp_rmb();
+    i = next > FLIGHT_RECORDER_EVENTS ? next - FLIGHT_RECORDER_EVENTS : 0;
+    for (; i != next; i++) {
+        FlightRecorderEntry *e = &ring->entries[i % FLIGHT_RECORDER_EVENTS];
+        FlightRecorderEventList *ev = g_new0(FlightRecorderEventList, 1);
+
+        ev->value = g_new0(FlightRecorderEvent, 1);
+        ev->value->timestamp = e->timestamp;
+        ev->value->event = g_strdup(trace_event_get_name(
+                                        trace_event_id(e->id)));
+        ev->value->value = e->value;
+        *tail = ev;
+        tail = &ev->next;
+    }
+    return entry;
+}
+
+/*
+ * The threads that have not frozen yet may still be writing to their ring,
+ * in which case the oldest event reported for them can be torn.
+ */
+FlightRecorderInfo *flight_recorder_query(void)
+{
+    FlightRecorderInfo *info = g_new0(FlightRecorderInfo, 1);
+    FlightRecorderThreadList **tail = &info->threads;
+    FlightRecorderRing *ring;
+
+    qemu_mutex_lock(&fr_lock);
+    info->frozen = fr_frozen;
+    if (fr_frozen) {
+        info->has_trigger = true;
+        info->trigger = g_new0(FlightRecorderTriggerInfo, 1);
+        info->trigger->trigger = fr_trigger;
+        info->trigger->thread_id = fr_trigger_thread_id;
+        info->trigger->duration = fr_trigger_ns;
+        info->trigger->timestamp = fr_trigger_timestamp;
+    }
+    info->main_loop_threshold =
+        fr_threshold_ns[FLIGHT_RECORDER_TRIGGER_MAIN_LOOP];
+    info->bql_wait_threshold =
+        fr_threshold_ns[FLIGHT_RECORDER_TRIGGER_BQL_WAIT];
+
+    QLIST_FOREACH(ring, &fr_rings, node) {
+        *tail = flight_recorder_query_ring(ring);
+        tail = &(*tail)->next;
+    }
+    qemu_mutex_unlock(&fr_lock);
+    return info;
+}
+
+/* Clears the rings and records again until the next trigger */
+void flight_recorder_reset(void)
+{
+    FlightRecorderRing *ring;
+
+    qemu_mutex_lock(&fr_lock);
+    QLIST_FOREACH(ring, &fr_rings, node) {
+        atomic_set(&ring->next, 0);
+    }
+    atomic_mb_set(&fr_frozen, false);
+    qemu_mutex_unlock(&fr_lock);
+}
+
+void flight_recorder_set_threshold(FlightRecorderTrigger trigger, int64_t ns)
+{
+    atomic_set(&fr_threshold_ns[trigger], ns);
+}
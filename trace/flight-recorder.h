@@ -0,0 +1,35 @@
+/*
+ * Flight recorder of latency-sensitive trace events
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef TRACE_FLIGHT_RECORDER_H
+#define TRACE_FLIGHT_RECORDER_H
+
+#include <stdint.h>
+#include "qapi-types.h"
+#include "trace/generated-events.h"
+
+/*
+ * Each thread keeps the last FLIGHT_RECORDER_EVENTS events that it recorded
+ * in a ring of its own.  Events are identified by their trace-events entry
+ * and carry one value, usually a duration in nanoseconds; they are recorded
+ * whatever the trace backend and whether or not the event is enabled.
+ *
+ * When flight_recorder_check() finds a duration above the threshold of its
+ * trigger, all rings are frozen so that query-flight-recorder can return
+ * what led up to it.  Recording costs a clock read and a few stores into
+ * the thread's ring.
+ */
+#define FLIGHT_RECORDER_EVENTS 256
+
+void flight_recorder_record(TraceEventID id, int64_t value);
+void flight_recorder_check(FlightRecorderTrigger trigger, int64_t ns);
+
+FlightRecorderInfo *flight_recorder_query(void);
+void flight_recorder_reset(void);
+void flight_recorder_set_threshold(FlightRecorderTrigger trigger, int64_t ns);
+
+#endif
@@ -10,6 +10,7 @@
 #include "qemu/typedefs.h"
 #include "qmp-commands.h"
 #include "trace/control.h"
+#include "trace/flight-recorder.h"
 
 
 TraceEventInfoList *qmp_trace_event_get_state(const char *name, Error **errp)
@@ -73,3 +74,23 @@ void qmp_trace_event_set_state(const char *name, bool enable,
         }
     }
 }
+
+FlightRecorderInfo *qmp_query_flight_recorder(Error **errp)
+{
+    return flight_recorder_query();
+}
+
+void qmp_flight_recorder_reset(Error **errp)
+{
+    flight_recorder_reset();
+}
+
+void qmp_flight_recorder_set_threshold(FlightRecorderTrigger trigger,
+                                       int64_t threshold, Error **errp)
+{
+    if (threshold < 0) {
+        error_setg(errp, "threshold must not be negative");
+        return;
+    }
+    flight_recorder_set_threshold(trigger, threshold);
+}
@@ -17,6 +17,7 @@
 #include <pthread.h>
 #endif
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
 #include "trace.h"
 #include "trace/control.h"
 #include "trace/simple.h"
@@ -33,12 +34,12 @@
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
 
-/** Trace record is valid */
-#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
-
 /*
- * Trace records are written out by a dedicated thread.  The thread waits for
- * records to become available, writes them out, and then waits again.
+ * Each thread that traces gets a ring buffer of its own, so that recording
+ * an event needs neither a lock nor an atomic operation shared with the
+ * other threads.  Trace records are written out by a dedicated thread.  The
+ * thread waits for records to become available, merges the buffers by
+ * timestamp, writes the records out, and then waits again.
  */
 static CompatGMutex trace_lock;
 static CompatGCond trace_available_cond;
@@ -52,10 +53,31 @@ enum {
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
-static volatile gint dropped_events;
+/*
+ * A single-producer, single-consumer ring.  @head and @tail only grow and
+ * are reduced modulo TRACE_BUF_LEN when the buffer is accessed.  The owning
+ * thread advances @head once a record is complete, and the writeout thread
+ * advances @tail once it has written the record out.
+ */
+typedef struct TraceThreadBuffer {
+    struct TraceThreadBuffer *next;
+    unsigned int head;
+    unsigned int tail;
+    int dropped_events;
+    int in_use;
+    uint8_t buf[TRACE_BUF_LEN];
+} TraceThreadBuffer;
+
+/* Buffers are never freed; a thread that exits hands its buffer over to
+ * the next thread that starts tracing.
+ */
+static TraceThreadBuffer *trace_buffers;
+static __thread TraceThreadBuffer *trace_thread_buf;
+#ifndef _WIN32
+static pthread_key_t trace_thread_key;
+static pthread_once_t trace_thread_key_once = PTHREAD_ONCE_INIT;
+#endif
+
 static uint32_t trace_pid;
 static FILE *trace_fp;
 static char *trace_file_name;
@@ -76,53 +98,93 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+static void read_from_buffer(TraceThreadBuffer *tbuf, unsigned int idx,
+                             void *dataptr, size_t size);
+static unsigned int write_to_buffer(TraceThreadBuffer *tbuf, unsigned int idx,
+                                    void *dataptr, size_t size);
+
+#ifndef _WIN32
+static void trace_thread_buf_release(void *opaque)
+{
+    TraceThreadBuffer *tbuf = opaque;
+
+    /* the records that are left are still written out */
+    atomic_mb_set(&tbuf->in_use, 0);
+}
+
+static void trace_thread_key_init(void)
+{
+    pthread_key_create(&trace_thread_key, trace_thread_buf_release);
+}
+#endif
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+/**
+ * Get the calling thread's trace buffer, setting one up on first use
+ *
+ * Returns NULL if no memory is available.
+ */
+static TraceThreadBuffer *get_thread_buffer(void)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
+    TraceThreadBuffer *tbuf = trace_thread_buf;
+    TraceThreadBuffer *first;
+
+    if (likely(tbuf)) {
+        return tbuf;
+    }
+
+    /* Reuse the buffer of a thread that has exited... */
+    for (tbuf = atomic_rcu_read(&trace_buffers); tbuf; tbuf = tbuf->next) {
+        if (!atomic_read(&tbuf->in_use) &&
+            atomic_cmpxchg(&tbuf->in_use, 0, 1) == 0) {
+            break;
         }
-        trace_buf[idx++] = 0;
-        num++;
     }
+
+    /* ... or add a new one */
+    if (!tbuf) {
+        /* dont use g_malloc, can deadlock when traced */
+        tbuf = calloc(1, sizeof(*tbuf));
+        if (!tbuf) {
+            return NULL;
+        }
+        tbuf->in_use = 1;
+        do {
+            first = atomic_read(&trace_buffers);
+            tbuf->next = first;
+        } while (atomic_cmpxchg(&trace_buffers, first, tbuf) != first);
+    }
+
+#ifndef _WIN32
+    pthread_once(&trace_thread_key_once, trace_thread_key_init);
+    pthread_setspecific(trace_thread_key, tbuf);
+#endif
+    trace_thread_buf = tbuf;
+    return tbuf;
 }
+
 /**
- * Read a trace record from the trace buffer
- *
- * @idx         Trace buffer index
- * @record      Trace record to fill
+ * Find the buffer whose oldest record has the smallest timestamp
  *
- * Returns false if the record is not valid.
+ * Returns NULL if all buffers are empty.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static TraceThreadBuffer *get_oldest_buffer(void)
 {
-    uint64_t event_flag = 0;
-    TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
+    TraceThreadBuffer *tbuf, *oldest = NULL;
+    uint64_t timestamp_ns, oldest_ns = 0;
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
+    for (tbuf = atomic_rcu_read(&trace_buffers); tbuf; tbuf = tbuf->next) {
+        if (atomic_read(&tbuf->head) == tbuf->tail) {
+            continue;
+        }
+        smp_rmb(); /* read the record after its head update */
+        read_from_buffer(tbuf, tbuf->tail + offsetof(TraceRecord, timestamp_ns),
+                         &timestamp_ns, sizeof(timestamp_ns));
+        if (!oldest || timestamp_ns < oldest_ns) {
+            oldest = tbuf;
+            oldest_ns = timestamp_ns;
+        }
     }
-
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* dont use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
-    return true;
+    return oldest;
 }
 
 /**
@@ -156,36 +218,46 @@ static void wait_for_trace_records_available(void)
 
 static gpointer writeout_thread(gpointer opaque)
 {
-    TraceRecord *recordptr;
+    TraceThreadBuffer *tbuf;
+    TraceRecord *recordptr = NULL;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
+    uint32_t length, max_length = 0;
     int dropped_count;
     size_t unused __attribute__ ((unused));
 
     for (;;) {
         wait_for_trace_records_available();
 
-        if (g_atomic_int_get(&dropped_events)) {
+        dropped_count = 0;
+        for (tbuf = atomic_rcu_read(&trace_buffers); tbuf; tbuf = tbuf->next) {
+            dropped_count += atomic_xchg(&tbuf->dropped_events, 0);
+        }
+        if (dropped_count) {
             dropped.rec.event = DROPPED_EVENT_ID,
             dropped.rec.timestamp_ns = get_clock();
             dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t),
             dropped.rec.pid = trace_pid;
-            do {
-                dropped_count = g_atomic_int_get(&dropped_events);
-            } while (!g_atomic_int_compare_and_exchange(&dropped_events,
-                                                        dropped_count, 0));
             dropped.rec.arguments[0] = dropped_count;
             unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
         }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* dont use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
+        while ((tbuf = get_oldest_buffer()) != NULL) {
+            read_from_buffer(tbuf, tbuf->tail + offsetof(TraceRecord, length),
+                             &length, sizeof(length));
+            if (length > max_length) {
+                /* dont use g_realloc, can deadlock when traced */
+                free(recordptr);
+                recordptr = malloc(length);
+                max_length = length;
+            }
+            read_from_buffer(tbuf, tbuf->tail, recordptr, length);
+            unused = fwrite(recordptr, length, 1, trace_fp);
+
+            smp_mb(); /* finish reading before the space can be reused */
+            atomic_set(&tbuf->tail, tbuf->tail + length);
         }
 
         fflush(trace_fp);
@@ -195,84 +267,81 @@ static gpointer writeout_thread(gpointer opaque)
 
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &val, sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, (void*)s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
+    TraceThreadBuffer *tbuf = get_thread_buffer();
+    unsigned int idx, rec_off;
     uint32_t rec_len = sizeof(TraceRecord) + datasize;
     uint64_t event_u64 = event;
     uint64_t timestamp_ns = get_clock();
 
-    do {
-        old_idx = g_atomic_int_get(&trace_idx);
-        smp_rmb();
-        new_idx = old_idx + rec_len;
-
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
-            /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
-            return -ENOSPC;
-        }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
+    if (!tbuf) {
+        return -ENOMEM;
+    }
 
-    idx = old_idx % TRACE_BUF_LEN;
+    idx = tbuf->head;
+    if (idx + rec_len - atomic_read(&tbuf->tail) > TRACE_BUF_LEN) {
+        /* Trace Buffer Full, Event dropped ! */
+        atomic_inc(&tbuf->dropped_events);
+        return -ENOSPC;
+    }
+    smp_mb(); /* read the tail before overwriting the space it freed */
 
     rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
-    rec_off = write_to_buffer(rec_off, &trace_pid, sizeof(trace_pid));
+    rec_off = write_to_buffer(tbuf, rec_off, &event_u64, sizeof(event_u64));
+    rec_off = write_to_buffer(tbuf, rec_off,
+                              &timestamp_ns, sizeof(timestamp_ns));
+    rec_off = write_to_buffer(tbuf, rec_off, &rec_len, sizeof(rec_len));
+    rec_off = write_to_buffer(tbuf, rec_off, &trace_pid, sizeof(trace_pid));
 
+    rec->tbuf = tbuf;
     rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
+    rec->rec_off  = rec_off;
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
+static void read_from_buffer(TraceThreadBuffer *tbuf, unsigned int idx,
+                             void *dataptr, size_t size)
 {
     uint8_t *data_ptr = dataptr;
     uint32_t x = 0;
     while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
+        data_ptr[x++] = tbuf->buf[idx++ % TRACE_BUF_LEN];
     }
 }
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
+static unsigned int write_to_buffer(TraceThreadBuffer *tbuf, unsigned int idx,
+                                    void *dataptr, size_t size)
 {
     uint8_t *data_ptr = dataptr;
     uint32_t x = 0;
     while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
+        tbuf->buf[idx++ % TRACE_BUF_LEN] = data_ptr[x++];
     }
     return idx; /* most callers wants to know where to write next */
 }
 
 void trace_record_finish(TraceBufferRecord *rec)
 {
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-    smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    TraceThreadBuffer *tbuf = rec->tbuf;
+
+    smp_wmb(); /* write barrier before publishing the record */
+    atomic_set(&tbuf->head, rec->rec_off);
+
+    if (rec->rec_off - atomic_read(&tbuf->tail) > TRACE_BUF_FLUSH_THRESHOLD) {
         flush_trace_file(false);
     }
 }
@@ -62,6 +62,10 @@
 #include "translate-all.h"
 #include "qemu/bitmap.h"
 #include "qemu/timer.h"
+#include "qemu/error-report.h"
+#include "qemu/interval-tree.h"
+#include "qemu/mem-usage.h"
+#include "trace/flight-recorder.h"
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -73,18 +77,14 @@
 #undef DEBUG_TB_CHECK
 #endif
 
-#define SMC_BITMAP_USE_THRESHOLD 10
-
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
     TranslationBlock *first_tb;
-    /* in order to optimize self modifying code, we count the number
-       of lookups we do to a given page to use a bitmap */
-    unsigned int code_write_count;
+    /* in order to optimize self modifying code, the bytes of the page
+       that are covered by TBs; built on the first write to the page and
+       kept up to date as TBs are added.  Bits of TBs that went away may
+       stay set, which only costs a walk of first_tb on the next write */
     unsigned long *code_bitmap;
-#if defined(CONFIG_USER_ONLY)
-    unsigned long flags;
-#endif
 } PageDesc;
 
 /* In system mode we want L1_MAP to be based on ram offsets,
@@ -123,12 +123,36 @@ uintptr_t qemu_host_page_size;
 uintptr_t qemu_host_page_mask;
 
 /* This is a multi-level map on the virtual address space.
-   The bottom level has pointers to PageDesc.  */
+   The bottom level has pointers to PageDesc.  In user mode only the
+   pages that hold translated code have one; the protection of the
+   guest pages is in pageflags_root.  */
 static void *l1_map[V_L1_SIZE];
 
 /* code generation context */
 TCGContext tcg_ctx;
 
+/* The code buffer is split into regions that are filled one after the
+   other.  Once the last one is full, the oldest region is emptied by
+   invalidating its TBs, rather than flushing all of the translated code.
+   Each region has its own slice of tb_ctx.tbs, so that the TBs of a
+   region are sorted by tc_ptr for tb_find_pc().  */
+#define TB_MAX_REGIONS 8
+
+typedef struct TBRegion {
+    void *start;
+    void *end;          /* end of the code, except in the current region */
+    int nb_tbs;
+} TBRegion;
+
+static struct {
+    int n;
+    int cur;            /* the region whose code ends at code_gen_ptr */
+    size_t size;
+    size_t max_size;    /* TBs are started below start + max_size */
+    int max_tbs;
+    TBRegion r[TB_MAX_REGIONS];
+} tb_regions;
+
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
@@ -428,6 +452,116 @@ static inline PageDesc *page_find(tb_page_addr_t index)
     return page_find_alloc(index, 0);
 }
 
+#if defined(CONFIG_USER_ONLY)
+/* The PAGE_* flags of the guest address space, as ranges of pages.
+   Neighbouring ranges never have the same flags, and pages without
+   flags are not in the tree, so that mmap and mprotect of a large
+   area cost O(log n) rather than a walk of all of its pages.
+   Protected by mmap_lock.  */
+typedef struct PageFlagsNode {
+    IntervalTreeNode itree;
+    int flags;
+} PageFlagsNode;
+
+static IntervalTreeRoot pageflags_root;
+
+static PageFlagsNode *pageflags_find(target_ulong start, target_ulong last)
+{
+    IntervalTreeNode *n;
+
+    n = interval_tree_find(&pageflags_root, start, last, NULL, NULL);
+    return n ? container_of(n, PageFlagsNode, itree) : NULL;
+}
+
+static void pageflags_create(target_ulong start, target_ulong last, int flags)
+{
+    PageFlagsNode *p = g_new(PageFlagsNode, 1);
+
+    p->itree.start = start;
+    p->itree.last = last;
+    p->flags = flags;
+    interval_tree_insert(&pageflags_root, &p->itree);
+}
+
+/* Drop the flags of [start, last], cutting the ranges that stick out */
+static void pageflags_unset(target_ulong start, target_ulong last)
+{
+    PageFlagsNode *p;
+
+    while ((p = pageflags_find(start, last)) != NULL) {
+        target_ulong p_start = p->itree.start;
+        target_ulong p_last = p->itree.last;
+
+        interval_tree_remove(&pageflags_root, &p->itree);
+        if (p_start < start) {
+            p->itree.last = start - 1;
+            interval_tree_insert(&pageflags_root, &p->itree);
+            if (p_last > last) {
+                pageflags_create(last + 1, p_last, p->flags);
+            }
+        } else if (p_last > last) {
+            p->itree.start = last + 1;
+            interval_tree_insert(&pageflags_root, &p->itree);
+        } else {
+            g_free(p);
+        }
+    }
+}
+
+/* Give [start, last], which must have no flags, the nonzero @flags */
+static void pageflags_insert(target_ulong start, target_ulong last, int flags)
+{
+    PageFlagsNode *prev = NULL, *next = NULL;
+
+    if (start != 0) {
+        prev = pageflags_find(start - 1, start - 1);
+    }
+    if (last != (target_ulong)-1) {
+        next = pageflags_find(last + 1, last + 1);
+    }
+
+    if (prev && prev->flags == flags) {
+        interval_tree_remove(&pageflags_root, &prev->itree);
+        start = prev->itree.start;
+        g_free(prev);
+    }
+    if (next && next->flags == flags) {
+        interval_tree_remove(&pageflags_root, &next->itree);
+        last = next->itree.last;
+        g_free(next);
+    }
+    pageflags_create(start, last, flags);
+}
+
+/* Set and clear flags of the mapped pages in [start, last]; returns the
+   new flags of all of them ORed together */
+static int pageflags_set_clear(target_ulong start, target_ulong last,
+                               int set, int clear)
+{
+    PageFlagsNode *p;
+    int all = 0;
+
+    while ((p = pageflags_find(start, last)) != NULL) {
+        target_ulong p_start = MAX(p->itree.start, start);
+        target_ulong p_last = MIN(p->itree.last, last);
+        int flags = (p->flags | set) & ~clear;
+
+        /* a neighbour that pageflags_insert() merges in already has
+           @flags, and applying @set and @clear to it again is a no-op */
+        if (flags != p->flags) {
+            pageflags_unset(p_start, p_last);
+            pageflags_insert(p_start, p_last, flags);
+        }
+        all |= flags;
+        if (p_last == last) {
+            break;
+        }
+        start = p_last + 1;
+    }
+    return all;
+}
+#endif
+
 #if !defined(CONFIG_USER_ONLY)
 #define mmap_lock() do { } while (0)
 #define mmap_unlock() do { } while (0)
@@ -675,6 +809,65 @@ static inline void code_gen_alloc(size_t tb_size)
             CODE_GEN_AVG_BLOCK_SIZE;
     tcg_ctx.tb_ctx.tbs =
             g_malloc(tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock));
+
+    /* the prologue is part of the buffer */
+    qemu_mem_usage_alloc(MEMORY_USAGE_SUBSYSTEM_TCG_CODE_BUFFER,
+                         tcg_ctx.code_gen_buffer_size + 1024);
+    qemu_mem_usage_alloc(MEMORY_USAGE_SUBSYSTEM_TCG_CODE_BUFFER,
+                         tcg_ctx.code_gen_max_blocks *
+                         sizeof(TranslationBlock));
+}
+
+static void tb_regions_init(void)
+{
+    size_t headroom = TCG_MAX_OP_SIZE * OPC_BUF_SIZE;
+    size_t n;
+    int i;
+
+    /* keep the regions much larger than the largest TB */
+    n = tcg_ctx.code_gen_buffer_size / (headroom * 8);
+    tb_regions.n = MAX(MIN(n, TB_MAX_REGIONS), 1);
+    tb_regions.size = (tcg_ctx.code_gen_buffer_size / tb_regions.n) &
+                      ~(size_t)(CODE_GEN_ALIGN - 1);
+    tb_regions.max_size = tb_regions.size - headroom;
+    tb_regions.max_tbs = tcg_ctx.code_gen_max_blocks / tb_regions.n;
+    for (i = 0; i < tb_regions.n; i++) {
+        tb_regions.r[i].start = tcg_ctx.code_gen_buffer + i * tb_regions.size;
+        tb_regions.r[i].end = tb_regions.r[i].start;
+        tb_regions.r[i].nb_tbs = 0;
+    }
+    tb_regions.cur = 0;
+}
+
+static inline TranslationBlock *tb_region_tbs(int i)
+{
+    return &tcg_ctx.tb_ctx.tbs[i * tb_regions.max_tbs];
+}
+
+static inline void *tb_region_end(int i)
+{
+    return i == tb_regions.cur ? tcg_ctx.code_gen_ptr : tb_regions.r[i].end;
+}
+
+static size_t tb_code_size(void)
+{
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < tb_regions.n; i++) {
+        size += tb_region_end(i) - tb_regions.r[i].start;
+    }
+    return size;
+}
+
+static TBHashTable *tb_phys_hash_new(unsigned int bits, int chain)
+{
+    TBHashTable *ht;
+
+    ht = g_malloc0(sizeof(*ht) + (sizeof(ht->buckets[0]) << bits));
+    ht->bits = bits;
+    ht->chain = chain;
+    return ht;
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -684,7 +877,9 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
+    tcg_ctx.tb_ctx.tb_phys_hash = tb_phys_hash_new(CODE_GEN_PHYS_HASH_BITS, 0);
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+    tb_regions_init();
     tcg_register_jit(tcg_ctx.code_gen_buffer, tcg_ctx.code_gen_buffer_size);
     page_init();
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
@@ -699,31 +894,37 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
+/* Allocate a new translation block. Fails if the current region has
    too many translation blocks or too much generated code. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBRegion *r = &tb_regions.r[tb_regions.cur];
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks ||
-        (tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer) >=
-         tcg_ctx.code_gen_buffer_max_size) {
+    if (r->nb_tbs >= tb_regions.max_tbs ||
+        tcg_ctx.code_gen_ptr - r->start >= tb_regions.max_size) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &tb_region_tbs(tb_regions.cur)[r->nb_tbs++];
+    tcg_ctx.tb_ctx.nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->exec_count = 0;
+    tb->gen_time_ns = 0;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    TBRegion *r = &tb_regions.r[tb_regions.cur];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    if (r->nb_tbs > 0 &&
+            tb == &tb_region_tbs(tb_regions.cur)[r->nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
+        r->nb_tbs--;
         tcg_ctx.tb_ctx.nb_tbs--;
     }
 }
@@ -734,7 +935,6 @@ static inline void invalidate_page_bitmap(PageDesc *p)
         g_free(p->code_bitmap);
         p->code_bitmap = NULL;
     }
-    p->code_write_count = 0;
 }
 
 /* Set to NULL all the 'first_tb' fields in all PageDescs. */
@@ -774,42 +974,85 @@ static void page_flush_tb(void)
 /* XXX: tb_flush is currently not thread safe */
 void tb_flush(CPUState *cpu)
 {
+    TBHashTable *ht;
+    int nb_tbs = tcg_ctx.tb_ctx.nb_tbs;
+    int64_t start = get_clock();
+    int64_t ns;
+    int i;
+
 #if defined(DEBUG_FLUSH)
-    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer),
-           tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.tb_ctx.nb_tbs > 0 ?
-           ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)) /
-           tcg_ctx.tb_ctx.nb_tbs : 0);
+    printf("qemu: flush code_size=%zd nb_tbs=%d avg_tb_size=%zd\n",
+           tb_code_size(), tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.tb_ctx.nb_tbs > 0 ?
+           tb_code_size() / tcg_ctx.tb_ctx.nb_tbs : 0);
 #endif
-    if ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)
-        > tcg_ctx.code_gen_buffer_size) {
+    if (tcg_ctx.code_gen_ptr - tb_regions.r[tb_regions.cur].start
+        > tb_regions.size) {
         cpu_abort(cpu, "Internal error: code buffer overflow\n");
     }
     tcg_ctx.tb_ctx.nb_tbs = 0;
+    for (i = 0; i < tb_regions.n; i++) {
+        tb_regions.r[i].end = tb_regions.r[i].start;
+        tb_regions.r[i].nb_tbs = 0;
+    }
+    tb_regions.cur = 0;
 
     CPU_FOREACH(cpu) {
         memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
     }
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0, sizeof(tcg_ctx.tb_ctx.tb_phys_hash));
+    ht = tcg_ctx.tb_ctx.tb_phys_hash;
+    memset(ht->buckets, 0, sizeof(ht->buckets[0]) << ht->bits);
+    tcg_ctx.tb_ctx.nb_phys_hash = 0;
     page_flush_tb();
 
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tcg_ctx.tb_ctx.tb_flush_count++;
+
+    ns = get_clock() - start;
+    trace_tb_flush(nb_tbs, ns);
+    flight_recorder_record(TRACE_TB_FLUSH, ns);
+}
+
+/* Move on to the next region of the code buffer, and make room in it by
+   invalidating the TBs it still has.  The other regions, which hold the
+   code translated most recently, are left alone.  */
+static void tb_region_recycle(void)
+{
+    TBRegion *r = &tb_regions.r[tb_regions.cur];
+    TranslationBlock *tbs;
+    int i;
+
+    r->end = tcg_ctx.code_gen_ptr;
+    tb_regions.cur = (tb_regions.cur + 1) % tb_regions.n;
+
+    r = &tb_regions.r[tb_regions.cur];
+    tbs = tb_region_tbs(tb_regions.cur);
+    for (i = 0; i < r->nb_tbs; i++) {
+        if (!(tbs[i].cflags & CF_INVALID)) {
+            tb_phys_invalidate(&tbs[i], -1);
+        }
+    }
+    tcg_ctx.tb_ctx.nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    r->end = r->start;
+    tcg_ctx.code_gen_ptr = r->start;
+    tcg_ctx.tb_ctx.tb_region_evict_count++;
 }
 
 #ifdef DEBUG_TB_CHECK
 
 static void tb_invalidate_check(target_ulong address)
 {
+    TBHashTable *ht = tcg_ctx.tb_ctx.tb_phys_hash;
     TranslationBlock *tb;
     int i;
 
     address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+    for (i = 0; i < (1 << ht->bits); i++) {
+        for (tb = ht->buckets[i]; tb != NULL;
+                tb = tb->phys_hash_next[ht->chain]) {
             if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
                   address >= tb->pc + tb->size)) {
                 printf("ERROR invalidate: address=" TARGET_FMT_lx
@@ -823,12 +1066,13 @@ static void tb_invalidate_check(target_ulong address)
 /* verify that all the pages have correct rights for code */
 static void tb_page_check(void)
 {
+    TBHashTable *ht = tcg_ctx.tb_ctx.tb_phys_hash;
     TranslationBlock *tb;
     int i, flags1, flags2;
 
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
+    for (i = 0; i < (1 << ht->bits); i++) {
+        for (tb = ht->buckets[i]; tb != NULL;
+                tb = tb->phys_hash_next[ht->chain]) {
             flags1 = page_get_flags(tb->pc);
             flags2 = page_get_flags(tb->pc + tb->size - 1);
             if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
@@ -841,18 +1085,71 @@ static void tb_page_check(void)
 
 #endif
 
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+static inline TranslationBlock **tb_hash_bucket(TBHashTable *ht,
+                                                tb_page_addr_t phys_pc,
+                                                TranslationBlock *tb)
 {
+    uint32_t h = tb_phys_hash_func(phys_pc, tb->pc, tb->flags);
+
+    return &ht->buckets[h & ((1 << ht->bits) - 1)];
+}
+
+/* Unlinking leaves tb's own link alone, so readers that are looking at
+   tb can still walk on to the rest of the bucket. */
+static inline void tb_hash_remove(TBHashTable *ht, tb_page_addr_t phys_pc,
+                                  TranslationBlock *tb)
+{
+    TranslationBlock **ptb = tb_hash_bucket(ht, phys_pc, tb);
     TranslationBlock *tb1;
 
     for (;;) {
         tb1 = *ptb;
         if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
+            atomic_rcu_set(ptb, tb1->phys_hash_next[ht->chain]);
             break;
         }
-        ptb = &tb1->phys_hash_next;
+        ptb = &tb1->phys_hash_next[ht->chain];
+    }
+}
+
+static void tb_phys_hash_reclaim(TBHashTable *old)
+{
+    g_free(old);
+    atomic_mb_set(&tcg_ctx.tb_ctx.tb_phys_hash_resizing, false);
+}
+
+/*
+ * Double the size of the hash table.  The new table is chained through the
+ * other phys_hash_next[] link, so the old one stays intact for concurrent
+ * lookups until it is freed after an RCU grace period; no new resize can
+ * start before that, since it would reuse the links of the old table.
+ */
+static void tb_phys_hash_grow(void)
+{
+    TBHashTable *old = tcg_ctx.tb_ctx.tb_phys_hash;
+    TBHashTable *ht;
+    TranslationBlock *tb, **ptb;
+    int i;
+
+    if (old->bits >= CODE_GEN_PHYS_HASH_MAX_BITS ||
+        atomic_mb_read(&tcg_ctx.tb_ctx.tb_phys_hash_resizing)) {
+        return;
+    }
+    atomic_mb_set(&tcg_ctx.tb_ctx.tb_phys_hash_resizing, true);
+
+    ht = tb_phys_hash_new(old->bits + 1, !old->chain);
+    for (i = 0; i < (1 << old->bits); i++) {
+        for (tb = old->buckets[i]; tb != NULL;
+                tb = tb->phys_hash_next[old->chain]) {
+            ptb = tb_hash_bucket(ht, tb->page_addr[0] +
+                                 (tb->pc & ~TARGET_PAGE_MASK), tb);
+            tb->phys_hash_next[ht->chain] = *ptb;
+            *ptb = tb;
+        }
     }
+
+    atomic_rcu_set(&tcg_ctx.tb_ctx.tb_phys_hash, ht);
+    call_rcu(old, tb_phys_hash_reclaim, rcu);
 }
 
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
@@ -919,19 +1216,18 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    tb_hash_remove(tcg_ctx.tb_ctx.tb_phys_hash, phys_pc, tb);
+    tcg_ctx.tb_ctx.nb_phys_hash--;
 
-    /* remove the TB from the page list */
+    /* remove the TB from the page list; the code bitmaps keep its bits,
+       which is safe */
     if (tb->page_addr[0] != page_addr) {
         p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
     }
     if (tb->page_addr[1] != -1 && tb->page_addr[1] != page_addr) {
         p = page_find(tb->page_addr[1] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
     }
 
     tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
@@ -962,13 +1258,35 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
         tb1 = tb2;
     }
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
+    tb->cflags |= CF_INVALID;
 
     tcg_ctx.tb_ctx.tb_phys_invalidate_count++;
 }
 
+/* Marks the bytes that @tb covers in its physical page @n */
+static void tb_set_page_bitmap(PageDesc *p, TranslationBlock *tb, int n)
+{
+    int tb_start, tb_end;
+
+    /* NOTE: this is subtle as a TB may span two physical pages */
+    if (n == 0) {
+        /* NOTE: tb_end may be after the end of the page, but
+           it is not a problem */
+        tb_start = tb->pc & ~TARGET_PAGE_MASK;
+        tb_end = tb_start + tb->size;
+        if (tb_end > TARGET_PAGE_SIZE) {
+            tb_end = TARGET_PAGE_SIZE;
+        }
+    } else {
+        tb_start = 0;
+        tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
+    }
+    bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
+}
+
 static void build_page_bitmap(PageDesc *p)
 {
-    int n, tb_start, tb_end;
+    int n;
     TranslationBlock *tb;
 
     p->code_bitmap = bitmap_new(TARGET_PAGE_SIZE);
@@ -977,24 +1295,33 @@ static void build_page_bitmap(PageDesc *p)
     while (tb != NULL) {
         n = (uintptr_t)tb & 3;
         tb = (TranslationBlock *)((uintptr_t)tb & ~3);
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE) {
-                tb_end = TARGET_PAGE_SIZE;
-            }
-        } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
-        bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
+        tb_set_page_bitmap(p, tb, n);
         tb = tb->page_next[n];
     }
 }
 
+/* With -perfmap, tell perf(1) where the code of each TB is, in the format
+   of /tmp/perf-<pid>.map, so that profiles name the guest code that the
+   host code was translated from */
+static FILE *perfmap_file;
+
+static void perfmap_record(TranslationBlock *tb, int code_gen_size)
+{
+    if (!perfmap_file) {
+        char name[64];
+
+        snprintf(name, sizeof(name), "/tmp/perf-%d.map", getpid());
+        perfmap_file = fopen(name, "a");
+        if (!perfmap_file) {
+            error_report("could not open %s: %s", name, strerror(errno));
+            tcg_perfmap = 0;
+            return;
+        }
+    }
+    fprintf(perfmap_file, "%" PRIxPTR " %x guest_" TARGET_FMT_lx "\n",
+            (uintptr_t)tb->tc_ptr, code_gen_size, tb->pc);
+}
+
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
@@ -1004,6 +1331,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
     int code_gen_size;
+    int64_t gen_time = 0;
 
     phys_pc = get_page_addr_code(env, pc);
     if (use_icount) {
@@ -1011,8 +1339,12 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     }
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(cpu);
+        /* the region is full: recycle the oldest one */
+        if (tb_regions.n > 1) {
+            tb_region_recycle();
+        } else {
+            tb_flush(cpu);
+        }
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
@@ -1022,7 +1354,18 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    if (tcg_tb_stats) {
+        gen_time = get_clock();
+    }
     cpu_gen_code(env, tb, &code_gen_size);
+    if (tcg_tb_stats) {
+        gen_time = get_clock() - gen_time;
+        tb->gen_time_ns = MIN(gen_time, UINT32_MAX);
+        tcg_ctx.tb_ctx.tb_gen_time_ns += gen_time;
+    }
+    if (tcg_perfmap) {
+        perfmap_record(tb, code_gen_size);
+    }
     tcg_ctx.code_gen_ptr = (void *)(((uintptr_t)tcg_ctx.code_gen_ptr +
             code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
@@ -1171,6 +1514,8 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
 void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
 {
     PageDesc *p;
+    unsigned int nr;
+    unsigned long b;
 
 #if 0
     if (1) {
@@ -1185,23 +1530,20 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     if (!p) {
         return;
     }
-    if (!p->code_bitmap &&
-        ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD) {
+    if (!p->code_bitmap) {
         /* build code bitmap */
         build_page_bitmap(p);
     }
-    if (p->code_bitmap) {
-        unsigned int nr;
-        unsigned long b;
 
-        nr = start & ~TARGET_PAGE_MASK;
-        b = p->code_bitmap[BIT_WORD(nr)] >> (nr & (BITS_PER_LONG - 1));
-        if (b & ((1 << len) - 1)) {
-            goto do_invalidate;
-        }
-    } else {
-    do_invalidate:
+    nr = start & ~TARGET_PAGE_MASK;
+    b = p->code_bitmap[BIT_WORD(nr)] >> (nr & (BITS_PER_LONG - 1));
+    if (b & ((1 << len) - 1)) {
         tb_invalidate_phys_page_range(start, start + len, 1);
+        /* no TB covers these bytes any more; the bitmap is gone if the
+           page has no TBs left */
+        if (p->code_bitmap) {
+            bitmap_clear(p->code_bitmap, nr, len);
+        }
     }
 }
 
@@ -1291,28 +1633,20 @@ static inline void tb_alloc_page(TranslationBlock *tb,
     page_already_protected = p->first_tb != NULL;
 #endif
     p->first_tb = (TranslationBlock *)((uintptr_t)tb | n);
-    invalidate_page_bitmap(p);
+    if (p->code_bitmap) {
+        tb_set_page_bitmap(p, tb, n);
+    }
 
 #if defined(CONFIG_USER_ONLY)
-    if (p->flags & PAGE_WRITE) {
-        target_ulong addr;
-        PageDesc *p2;
+    if (page_get_flags(page_addr) & PAGE_WRITE) {
         int prot;
 
         /* force the host page as non writable (writes will have a
            page fault + mprotect overhead) */
         page_addr &= qemu_host_page_mask;
-        prot = 0;
-        for (addr = page_addr; addr < page_addr + qemu_host_page_size;
-            addr += TARGET_PAGE_SIZE) {
-
-            p2 = page_find(addr >> TARGET_PAGE_BITS);
-            if (!p2) {
-                continue;
-            }
-            prot |= p2->flags;
-            p2->flags &= ~PAGE_WRITE;
-          }
+        prot = pageflags_set_clear(page_addr,
+                                   page_addr + qemu_host_page_size - 1,
+                                   0, PAGE_WRITE);
         mprotect(g2h(page_addr), qemu_host_page_size,
                  (prot & PAGE_BITS) & ~PAGE_WRITE);
 #ifdef DEBUG_TB_INVALIDATE
@@ -1335,17 +1669,22 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
+    TBHashTable *ht;
     TranslationBlock **ptb;
 
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
+    /* add in the physical hash table, growing it once the average chain
+       holds more than one TB */
+    ht = tcg_ctx.tb_ctx.tb_phys_hash;
+    if (++tcg_ctx.tb_ctx.nb_phys_hash > (1 << ht->bits)) {
+        tb_phys_hash_grow();
+        ht = tcg_ctx.tb_ctx.tb_phys_hash;
+    }
+    ptb = tb_hash_bucket(ht, phys_pc, tb);
+    tb->phys_hash_next[ht->chain] = *ptb;
+    atomic_rcu_set(ptb, tb);
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1379,21 +1718,24 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
     int m_min, m_max, m;
     uintptr_t v;
-    TranslationBlock *tb;
+    TranslationBlock *tb, *tbs;
+    size_t i;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    i = (tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) / tb_regions.size;
+    if (i >= tb_regions.n || tb_regions.r[i].nb_tbs <= 0 ||
+        tc_ptr >= (uintptr_t)tb_region_end(i)) {
         return NULL;
     }
     /* binary search (cf Knuth) */
+    tbs = tb_region_tbs(i);
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = tb_regions.r[i].nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1403,7 +1745,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &tbs[m_max];
 }
 
 #if !defined(CONFIG_USER_ONLY)
@@ -1561,8 +1903,9 @@ void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    size_t code_size = tb_code_size();
     TranslationBlock *tb;
 
     target_code_size = 0;
@@ -1570,40 +1913,46 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    for (j = 0; j < tb_regions.n; j++) {
+        for (i = 0; i < tb_regions.r[j].nb_tbs; i++) {
+            tb = &tb_region_tbs(j)[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n",
+                code_size, tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "code regions        %d of %zd KB, "
+                "filling %d (%zd%% used)\n",
+                tb_regions.n, tb_regions.size / 1024, tb_regions.cur,
+                (size_t)(tcg_ctx.code_gen_ptr -
+                         tb_regions.r[tb_regions.cur].start) * 100 /
+                tb_regions.max_size);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
             tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+            tcg_ctx.tb_ctx.nb_tbs ? code_size / tcg_ctx.tb_ctx.nb_tbs : 0,
+            target_code_size ? (double) code_size / target_code_size : 0);
+    cpu_fprintf(f, "TB hash buckets     %d (%d TBs)\n",
+                1 << tcg_ctx.tb_ctx.tb_phys_hash->bits,
+                tcg_ctx.tb_ctx.nb_phys_hash);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1616,9 +1965,11 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                         tcg_ctx.tb_ctx.nb_tbs : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB region evictions %d\n",
+            tcg_ctx.tb_ctx.tb_region_evict_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
-    cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    tlb_dump_info(f, cpu_fprintf);
     tcg_dump_info(f, cpu_fprintf);
 }
 
@@ -1627,100 +1978,93 @@ void dump_opcount_info(FILE *f, fprintf_function cpu_fprintf)
     tcg_dump_op_count(f, cpu_fprintf);
 }
 
-#else /* CONFIG_USER_ONLY */
-
-void cpu_interrupt(CPUState *cpu, int mask)
-{
-    cpu->interrupt_request |= mask;
-    cpu->tcg_exit_req = 1;
-}
-
-/*
- * Walks guest process memory "regions" one by one
- * and calls callback function 'fn' for each region.
- */
-struct walk_memory_regions_data {
-    walk_memory_regions_fn fn;
-    void *priv;
-    target_ulong start;
-    int prot;
-};
-
-static int walk_memory_regions_end(struct walk_memory_regions_data *data,
-                                   target_ulong end, int new_prot)
-{
-    if (data->start != -1u) {
-        int rc = data->fn(data->priv, data->start, end, data->prot);
-        if (rc != 0) {
-            return rc;
-        }
-    }
-
-    data->start = (new_prot ? end : -1u);
-    data->prot = new_prot;
-
-    return 0;
-}
-
-static int walk_memory_regions_1(struct walk_memory_regions_data *data,
-                                 target_ulong base, int level, void **lp)
+/* List the COUNT TBs that were entered most often since the last flush */
+void dump_tb_stats(FILE *f, fprintf_function cpu_fprintf, int count)
 {
-    target_ulong pa;
-    int i, rc;
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TranslationBlock **top;
+    uint64_t total = 0;
+    int i, j, r, n = 0;
 
-    if (*lp == NULL) {
-        return walk_memory_regions_end(data, base, 0);
+    if (!tcg_tb_stats) {
+        cpu_fprintf(f, "TB statistics are disabled, use -tb-stats\n");
+        return;
     }
 
-    if (level == 0) {
-        PageDesc *pd = *lp;
-
-        for (i = 0; i < V_L2_SIZE; ++i) {
-            int prot = pd[i].flags;
+    count = MAX(MIN(count, ctx->nb_tbs), 0);
+    top = g_new(TranslationBlock *, count + 1);
+    for (r = 0; r < tb_regions.n; r++) {
+        for (i = 0; i < tb_regions.r[r].nb_tbs; i++) {
+            TranslationBlock *tb = &tb_region_tbs(r)[i];
 
-            pa = base | (i << TARGET_PAGE_BITS);
-            if (prot != data->prot) {
-                rc = walk_memory_regions_end(data, pa, prot);
-                if (rc != 0) {
-                    return rc;
-                }
+            total += tb->exec_count;
+            if (tb->cflags & CF_INVALID) {
+                continue;
             }
-        }
-    } else {
-        void **pp = *lp;
-
-        for (i = 0; i < V_L2_SIZE; ++i) {
-            pa = base | ((target_ulong)i <<
-                (TARGET_PAGE_BITS + V_L2_BITS * level));
-            rc = walk_memory_regions_1(data, pa, level - 1, pp + i);
-            if (rc != 0) {
-                return rc;
+            if (n < count) {
+                n++;
+            } else if (n == 0 || tb->exec_count <= top[n - 1]->exec_count) {
+                continue;
             }
+            for (j = n - 1;
+                 j > 0 && top[j - 1]->exec_count < tb->exec_count; j--) {
+                top[j] = top[j - 1];
+            }
+            top[j] = tb;
         }
     }
 
-    return 0;
+    cpu_fprintf(f, "TB count            %d\n", ctx->nb_tbs);
+    cpu_fprintf(f, "TB executions       %" PRIu64 "\n", total);
+    cpu_fprintf(f, "translation time    %" PRId64 " us\n",
+                ctx->tb_gen_time_ns / 1000);
+    cpu_fprintf(f, "\n%-18s %-18s %5s %5s %12s %6s %8s\n", "guest pc",
+                "host pc", "bytes", "insns", "executions", "share",
+                "gen (ns)");
+    for (i = 0; i < n; i++) {
+        TranslationBlock *tb = top[i];
+
+        cpu_fprintf(f, "0x" TARGET_FMT_lx " %18p %5d %5d %12" PRIu64
+                    " %5.1f%% %8u\n", tb->pc, tb->tc_ptr, tb->size,
+                    tb->icount, tb->exec_count,
+                    total ? tb->exec_count * 100.0 / total : 0.0,
+                    tb->gen_time_ns);
+    }
+    g_free(top);
 }
 
+#else /* CONFIG_USER_ONLY */
+
+void cpu_interrupt(CPUState *cpu, int mask)
+{
+    cpu->interrupt_request |= mask;
+    cpu->tcg_exit_req = 1;
+}
+
+/*
+ * Walks guest process memory "regions" one by one
+ * and calls callback function 'fn' for each region.
+ */
 int walk_memory_regions(void *priv, walk_memory_regions_fn fn)
 {
-    struct walk_memory_regions_data data;
-    uintptr_t i;
+    PageFlagsNode *p;
+    int rc = 0;
 
-    data.fn = fn;
-    data.priv = priv;
-    data.start = -1u;
-    data.prot = 0;
+    mmap_lock();
+    p = pageflags_find(0, -1);
+    while (p) {
+        target_ulong start = p->itree.start;
+        target_ulong last = p->itree.last;
 
-    for (i = 0; i < V_L1_SIZE; i++) {
-        int rc = walk_memory_regions_1(&data, (target_ulong)i << (V_L1_SHIFT + TARGET_PAGE_BITS),
-                                       V_L1_SHIFT / V_L2_BITS - 1, l1_map + i);
-        if (rc != 0) {
-            return rc;
+        rc = fn(priv, start, last + 1, p->flags);
+        if (rc != 0 || last == (target_ulong)-1) {
+            break;
         }
+        p = pageflags_find(last + 1, -1);
     }
+    mmap_unlock();
 
-    return walk_memory_regions_end(&data, 0, 0);
+    return rc;
 }
 
 static int dump_region(void *priv, target_ulong start,
@@ -1749,13 +2093,67 @@ void page_dump(FILE *f)
 
 int page_get_flags(target_ulong address)
 {
-    PageDesc *p;
+    PageFlagsNode *p;
+    int flags;
 
-    p = page_find(address >> TARGET_PAGE_BITS);
-    if (!p) {
-        return 0;
+    mmap_lock();
+    p = pageflags_find(address, address);
+    flags = p ? p->flags : 0;
+    mmap_unlock();
+
+    return flags;
+}
+
+/* Invalidate the code in the pages from @first to @last, looking only at
+   the parts of l1_map that exist.  @table is at @level, where level 0 is
+   an array of PageDesc, and starts at page @base.  */
+static void page_invalidate_code_1(void *table, int level, tb_page_addr_t base,
+                                   tb_page_addr_t first, tb_page_addr_t last)
+{
+    int i;
+
+    if (level == 0) {
+        PageDesc *pd = table;
+
+        for (i = 0; i < V_L2_SIZE; i++) {
+            tb_page_addr_t index = base + i;
+
+            if (index >= first && index <= last && pd[i].first_tb) {
+                tb_invalidate_phys_page(index << TARGET_PAGE_BITS,
+                                        0, NULL, false);
+            }
+        }
+    } else {
+        void **pp = table;
+        tb_page_addr_t span = (tb_page_addr_t)1 << (V_L2_BITS * level);
+
+        for (i = 0; i < V_L2_SIZE; i++) {
+            tb_page_addr_t b = base + i * span;
+
+            if (b > last) {
+                break;
+            }
+            if (pp[i] && b + span - 1 >= first) {
+                page_invalidate_code_1(pp[i], level - 1, b, first, last);
+            }
+        }
+    }
+}
+
+static void page_invalidate_code(target_ulong start, target_ulong last)
+{
+    tb_page_addr_t first = start >> TARGET_PAGE_BITS;
+    tb_page_addr_t final = last >> TARGET_PAGE_BITS;
+    tb_page_addr_t i;
+
+    for (i = first >> V_L1_SHIFT; i <= final >> V_L1_SHIFT; i++) {
+        void *table = l1_map[i & (V_L1_SIZE - 1)];
+
+        if (table) {
+            page_invalidate_code_1(table, V_L1_SHIFT / V_L2_BITS - 1,
+                                   i << V_L1_SHIFT, first, final);
+        }
     }
-    return p->flags;
 }
 
 /* Modify the flags of a page and invalidate the code if necessary.
@@ -1763,7 +2161,7 @@ int page_get_flags(target_ulong address)
    on PAGE_WRITE.  The mmap_lock should already be held.  */
 void page_set_flags(target_ulong start, target_ulong end, int flags)
 {
-    target_ulong addr, len;
+    target_ulong last;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -1774,33 +2172,27 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
     assert(start < end);
 
     start = start & TARGET_PAGE_MASK;
-    end = TARGET_PAGE_ALIGN(end);
+    last = TARGET_PAGE_ALIGN(end) - 1;
 
     if (flags & PAGE_WRITE) {
         flags |= PAGE_WRITE_ORG;
+        /* If the write protection bit is set, then we invalidate
+           the code inside.  Pages with code are always write
+           protected, so this need not look at the old flags.  */
+        page_invalidate_code(start, last);
     }
 
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        PageDesc *p = page_find_alloc(addr >> TARGET_PAGE_BITS, 1);
-
-        /* If the write protection bit is set, then we invalidate
-           the code inside.  */
-        if (!(p->flags & PAGE_WRITE) &&
-            (flags & PAGE_WRITE) &&
-            p->first_tb) {
-            tb_invalidate_phys_page(addr, 0, NULL, false);
-        }
-        p->flags = flags;
+    pageflags_unset(start, last);
+    if (flags) {
+        pageflags_insert(start, last, flags);
     }
 }
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
 {
-    PageDesc *p;
-    target_ulong end;
-    target_ulong addr;
+    PageFlagsNode *p;
+    target_ulong last, addr;
+    int ret = 0;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -1818,37 +2210,59 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
     }
 
     /* must do before we loose bits in the next step */
-    end = TARGET_PAGE_ALIGN(start + len);
+    last = TARGET_PAGE_ALIGN(start + len) - 1;
     start = start & TARGET_PAGE_MASK;
 
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        p = page_find(addr >> TARGET_PAGE_BITS);
-        if (!p) {
-            return -1;
-        }
-        if (!(p->flags & PAGE_VALID)) {
-            return -1;
+    mmap_lock();
+    for (;;) {
+        target_ulong p_last;
+        int p_flags;
+
+        p = pageflags_find(start, last);
+        if (!p || p->itree.start > start) {
+            ret = -1;
+            break;
         }
+        p_flags = p->flags;
+        p_last = MIN(p->itree.last, last);
 
-        if ((flags & PAGE_READ) && !(p->flags & PAGE_READ)) {
-            return -1;
+        if (!(p_flags & PAGE_VALID)) {
+            ret = -1;
+            break;
+        }
+        if ((flags & PAGE_READ) && !(p_flags & PAGE_READ)) {
+            ret = -1;
+            break;
         }
         if (flags & PAGE_WRITE) {
-            if (!(p->flags & PAGE_WRITE_ORG)) {
-                return -1;
+            if (!(p_flags & PAGE_WRITE_ORG)) {
+                ret = -1;
+                break;
             }
-            /* unprotect the page if it was put read-only because it
-               contains translated code */
-            if (!(p->flags & PAGE_WRITE)) {
-                if (!page_unprotect(addr, 0, NULL)) {
-                    return -1;
+            /* unprotect the pages that were put read-only because they
+               contain translated code; this splits the range, so look
+               at each page */
+            if (!(p_flags & PAGE_WRITE)) {
+                for (addr = start; addr - 1 != p_last;
+                     addr += TARGET_PAGE_SIZE) {
+                    if (!(page_get_flags(addr) & PAGE_WRITE) &&
+                        !page_unprotect(addr, 0, NULL)) {
+                        ret = -1;
+                        break;
+                    }
+                }
+                if (ret) {
+                    break;
                 }
             }
         }
+        if (p_last == last) {
+            break;
+        }
+        start = p_last + 1;
     }
-    return 0;
+    mmap_unlock();
+    return ret;
 }
 
 /* called from signal handler: invalidate the code and unprotect the
@@ -1856,7 +2270,7 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
 int page_unprotect(target_ulong address, uintptr_t pc, void *puc)
 {
     unsigned int prot;
-    PageDesc *p;
+    int flags;
     target_ulong host_start, host_end, addr;
 
     /* Technically this isn't safe inside a signal handler.  However we
@@ -1864,23 +2278,18 @@ int page_unprotect(target_ulong address, uintptr_t pc, void *puc)
        practice it seems to be ok.  */
     mmap_lock();
 
-    p = page_find(address >> TARGET_PAGE_BITS);
-    if (!p) {
-        mmap_unlock();
-        return 0;
-    }
+    flags = page_get_flags(address);
 
     /* if the page was really writable, then we change its
        protection back to writable */
-    if ((p->flags & PAGE_WRITE_ORG) && !(p->flags & PAGE_WRITE)) {
+    if ((flags & PAGE_WRITE_ORG) && !(flags & PAGE_WRITE)) {
         host_start = address & qemu_host_page_mask;
         host_end = host_start + qemu_host_page_size;
 
         prot = 0;
         for (addr = host_start ; addr < host_end ; addr += TARGET_PAGE_SIZE) {
-            p = page_find(addr >> TARGET_PAGE_BITS);
-            p->flags |= PAGE_WRITE;
-            prot |= p->flags;
+            prot |= pageflags_set_clear(addr, addr + TARGET_PAGE_SIZE - 1,
+                                        PAGE_WRITE, 0);
 
             /* and since the content will be modified, we must invalidate
                the corresponding translated code. */
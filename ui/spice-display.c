@@ -125,6 +125,39 @@ void qemu_spice_wakeup(SimpleSpiceDisplay *ssd)
     spice_qxl_wakeup(&ssd->qxl);
 }
 
+/* Most updates are about the same size, so the released ones are reused */
+#define SPICE_UPDATE_POOL_MAX 32
+
+static SimpleSpiceUpdate *qemu_spice_alloc_update(SimpleSpiceDisplay *ssd,
+                                                  size_t bitmap_size)
+{
+    SimpleSpiceUpdate *update;
+    uint8_t *bitmap = NULL;
+    size_t size = 0;
+
+    qemu_mutex_lock(&ssd->pool_lock);
+    update = QTAILQ_FIRST(&ssd->pool);
+    if (update) {
+        QTAILQ_REMOVE(&ssd->pool, update, next);
+        ssd->pool_size--;
+    }
+    qemu_mutex_unlock(&ssd->pool_lock);
+
+    if (!update) {
+        return g_malloc0(sizeof(*update));
+    }
+    if (update->bitmap_size >= bitmap_size) {
+        bitmap = update->bitmap;
+        size = update->bitmap_size;
+    } else {
+        g_free(update->bitmap);
+    }
+    memset(update, 0, sizeof(*update));
+    update->bitmap = bitmap;
+    update->bitmap_size = size;
+    return update;
+}
+
 static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
                                          QXLRect *rect)
 {
@@ -140,14 +173,18 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
            rect->left, rect->right,
            rect->top, rect->bottom);
 
-    update   = g_malloc0(sizeof(*update));
+    bw       = rect->right - rect->left;
+    bh       = rect->bottom - rect->top;
+
+    update   = qemu_spice_alloc_update(ssd, bw * bh * 4);
     drawable = &update->drawable;
     image    = &update->image;
     cmd      = &update->ext.cmd;
 
-    bw       = rect->right - rect->left;
-    bh       = rect->bottom - rect->top;
-    update->bitmap = g_malloc(bw * bh * 4);
+    if (!update->bitmap) {
+        update->bitmap = g_malloc(bw * bh * 4);
+        update->bitmap_size = bw * bh * 4;
+    }
 
     drawable->bbox            = *rect;
     drawable->clip.type       = SPICE_CLIP_TYPE_NONE;
@@ -193,6 +230,33 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
     QTAILQ_INSERT_TAIL(&ssd->updates, update, next);
 }
 
+/*
+ * Blocks that stop being dirty on the same line usually started on the same
+ * line too; send side by side ones as one rectangle rather than one per
+ * block.
+ */
+static void qemu_spice_queue_rect(SimpleSpiceDisplay *ssd, QXLRect *pending,
+                                  const QXLRect *rect)
+{
+    if (!qemu_spice_rect_is_empty(pending)) {
+        if (pending->right == rect->left &&
+            pending->top == rect->top && pending->bottom == rect->bottom) {
+            pending->right = rect->right;
+            return;
+        }
+        qemu_spice_create_one_update(ssd, pending);
+    }
+    *pending = *rect;
+}
+
+static void qemu_spice_flush_rect(SimpleSpiceDisplay *ssd, QXLRect *pending)
+{
+    if (!qemu_spice_rect_is_empty(pending)) {
+        qemu_spice_create_one_update(ssd, pending);
+        memset(pending, 0, sizeof(*pending));
+    }
+}
+
 static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
 {
     static const int blksize = 32;
@@ -200,6 +264,9 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
     int dirty_top[blocks];
     int y, yoff1, yoff2, x, xoff, blk, bw;
     int bpp = surface_bytes_per_pixel(ssd->ds);
+    int line_bytes = (ssd->dirty.right - ssd->dirty.left) * bpp;
+    bool any_dirty = false;
+    QXLRect pending = { 0 };
     uint8_t *guest, *mirror;
 
     if (qemu_spice_rect_is_empty(&ssd->dirty)) {
@@ -215,6 +282,15 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
     for (y = ssd->dirty.top; y < ssd->dirty.bottom; y++) {
         yoff1 = y * surface_stride(ssd->ds);
         yoff2 = y * pixman_image_get_stride(ssd->mirror);
+        xoff = ssd->dirty.left * bpp;
+        /* unchanged lines that end no block are common, and one big
+         * memcmp() goes faster than many small ones */
+        if (!any_dirty &&
+            memcmp(guest + yoff1 + xoff, mirror + yoff2 + xoff,
+                   line_bytes) == 0) {
+            continue;
+        }
+        any_dirty = false;
         for (x = ssd->dirty.left; x < ssd->dirty.right; x += blksize) {
             xoff = x * bpp;
             blk = x / blksize;
@@ -229,15 +305,17 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
                         .left   = x,
                         .right  = x + bw,
                     };
-                    qemu_spice_create_one_update(ssd, &update);
+                    qemu_spice_queue_rect(ssd, &pending, &update);
                     dirty_top[blk] = -1;
                 }
             } else {
                 if (dirty_top[blk] == -1) {
                     dirty_top[blk] = y;
                 }
+                any_dirty = true;
             }
         }
+        qemu_spice_flush_rect(ssd, &pending);
     }
 
     for (x = ssd->dirty.left; x < ssd->dirty.right; x += blksize) {
@@ -250,10 +328,11 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
                 .left   = x,
                 .right  = x + bw,
             };
-            qemu_spice_create_one_update(ssd, &update);
+            qemu_spice_queue_rect(ssd, &pending, &update);
             dirty_top[blk] = -1;
         }
     }
+    qemu_spice_flush_rect(ssd, &pending);
 
     memset(&ssd->dirty, 0, sizeof(ssd->dirty));
 }
@@ -309,11 +388,22 @@ qemu_spice_create_cursor_update(SimpleSpiceDisplay *ssd,
  * We do *not* hold the global qemu mutex here, so extra care is needed
  * when calling qemu functions.  QEMU interfaces used:
  *    - g_free (underlying glibc free is re-entrant).
+ *    - qemu_mutex_lock/unlock, for the pool lock only.
  */
 void qemu_spice_destroy_update(SimpleSpiceDisplay *sdpy, SimpleSpiceUpdate *update)
 {
-    g_free(update->bitmap);
-    g_free(update);
+    qemu_mutex_lock(&sdpy->pool_lock);
+    if (sdpy->pool_size < SPICE_UPDATE_POOL_MAX) {
+        QTAILQ_INSERT_HEAD(&sdpy->pool, update, next);
+        sdpy->pool_size++;
+        update = NULL;
+    }
+    qemu_mutex_unlock(&sdpy->pool_lock);
+
+    if (update) {
+        g_free(update->bitmap);
+        g_free(update);
+    }
 }
 
 void qemu_spice_create_host_memslot(SimpleSpiceDisplay *ssd)
@@ -373,6 +463,8 @@ void qemu_spice_display_init_common(SimpleSpiceDisplay *ssd)
 {
     qemu_mutex_init(&ssd->lock);
     QTAILQ_INIT(&ssd->updates);
+    qemu_mutex_init(&ssd->pool_lock);
+    QTAILQ_INIT(&ssd->pool);
     ssd->mouse_x = -1;
     ssd->mouse_y = -1;
     if (ssd->num_surfaces == 0) {
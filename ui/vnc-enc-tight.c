@@ -1176,14 +1176,31 @@ static void jpeg_term_destination(j_compress_ptr cinfo)
     buffer->offset = buffer->capacity - cinfo->dest->free_in_buffer;
 }
 
+/*
+ * libjpeg-turbo can take x8r8g8b8 input as is, and converts it with its
+ * SIMD colour converter; plain libjpeg needs each row converted to RGB
+ * first.
+ */
+#ifdef JCS_EXTENSIONS
+#ifdef HOST_WORDS_BIGENDIAN
+#define VNC_JPEG_SERVER_COLOR_SPACE JCS_EXT_XRGB
+#else
+#define VNC_JPEG_SERVER_COLOR_SPACE JCS_EXT_BGRX
+#endif
+#endif
+
 static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
 {
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
     struct jpeg_destination_mgr manager;
+#ifdef VNC_JPEG_SERVER_COLOR_SPACE
+    JSAMPROW *rows;
+#else
     pixman_image_t *linebuf;
     JSAMPROW row[1];
     uint8_t *buf;
+#endif
     int dy;
 
     if (surface_bytes_per_pixel(vs->vd->ds) == 1) {
@@ -1198,8 +1215,13 @@ static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
     cinfo.client_data = vs;
     cinfo.image_width = w;
     cinfo.image_height = h;
+#ifdef VNC_JPEG_SERVER_COLOR_SPACE
+    cinfo.input_components = VNC_SERVER_FB_BYTES;
+    cinfo.in_color_space = VNC_JPEG_SERVER_COLOR_SPACE;
+#else
     cinfo.input_components = 3;
     cinfo.in_color_space = JCS_RGB;
+#endif
 
     jpeg_set_defaults(&cinfo);
     jpeg_set_quality(&cinfo, quality, true);
@@ -1211,6 +1233,17 @@ static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
 
     jpeg_start_compress(&cinfo, true);
 
+#ifdef VNC_JPEG_SERVER_COLOR_SPACE
+    rows = g_new(JSAMPROW, h);
+    for (dy = 0; dy < h; dy++) {
+        rows[dy] = vnc_server_fb_ptr(vs->vd, x, y + dy);
+    }
+    while (cinfo.next_scanline < cinfo.image_height) {
+        jpeg_write_scanlines(&cinfo, rows + cinfo.next_scanline,
+                             cinfo.image_height - cinfo.next_scanline);
+    }
+    g_free(rows);
+#else
     linebuf = qemu_pixman_linebuf_create(PIXMAN_BE_r8g8b8, w);
     buf = (uint8_t *)pixman_image_get_data(linebuf);
     row[0] = buf;
@@ -1219,6 +1252,7 @@ static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
         jpeg_write_scanlines(&cinfo, row, 1);
     }
     qemu_pixman_image_unref(linebuf);
+#endif
 
     jpeg_finish_compress(&cinfo);
     jpeg_destroy_compress(&cinfo);
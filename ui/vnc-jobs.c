@@ -42,29 +42,42 @@
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  *                          if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is held
+ * While a VNC worker thread is working, the VncDisplay global lock is held
  * to avoid screen corruption (this does not block vnc_refresh() because it
  * uses trylock()) but the output lock is not held because the thread works on
  * its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
+ *
+ * There are several worker threads, which take jobs from the queue as they
+ * become idle.  The jobs of one client are still encoded one at a time and
+ * in order: the zlib streams in its encoder state (VncTight, VncZlib,
+ * VncZrle) carry over from one update to the next, so the state is
+ * confined to the one worker that encodes the client's oldest job.  Clients
+ * of different displays are thus encoded in parallel, while those of one
+ * display are serialized by its VncDisplay lock.
  */
 
+#define VNC_MAX_WORKERS 4
+
+typedef struct VncJobQueue VncJobQueue;
+
+typedef struct VncWorker {
+    QemuThread thread;
+    VncJobQueue *queue;
+    Buffer buffer;      /* output buffer, reused from job to job */
+} VncWorker;
+
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
-    Buffer buffer;
     bool exit;
     QTAILQ_HEAD(, VncJob) jobs;
+    int nr_workers;     /* still running */
+    VncWorker workers[VNC_MAX_WORKERS];
 };
 
-typedef struct VncJobQueue VncJobQueue;
-
-/*
- * We use a single global queue, but most of the functions are
- * already reentrant, so we can easily add more than one encoding thread
- */
+/* A single global queue is shared by the displays and the workers */
 static VncJobQueue *queue;
 
 static void vnc_lock_queue(VncJobQueue *queue)
@@ -143,7 +156,8 @@ void vnc_jobs_clear(VncState *vs)
 
     vnc_lock_queue(queue);
     QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
+        /* a worker removes the jobs it has taken itself */
+        if ((job->vs == vs || !vs) && !job->encoding) {
             QTAILQ_REMOVE(&queue->jobs, job, next);
         }
     }
@@ -180,7 +194,8 @@ void vnc_jobs_consume_buffer(VncState *vs)
 /*
  * Copy data for local use
  */
-static void vnc_async_encoding_start(VncState *orig, VncState *local)
+static void vnc_async_encoding_start(VncWorker *worker, VncState *orig,
+                                     VncState *local)
 {
     local->vnc_encoding = orig->vnc_encoding;
     local->features = orig->features;
@@ -193,13 +208,14 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
     local->zrle = orig->zrle;
-    local->output =  queue->buffer;
+    local->output = worker->buffer;
     local->csock = -1; /* Don't do any network work on this thread */
 
     buffer_reset(&local->output);
 }
 
-static void vnc_async_encoding_end(VncState *orig, VncState *local)
+static void vnc_async_encoding_end(VncWorker *worker, VncState *orig,
+                                   VncState *local)
 {
     orig->tight = local->tight;
     orig->zlib = local->zlib;
@@ -207,11 +223,37 @@ static void vnc_async_encoding_end(VncState *orig, VncState *local)
     orig->zrle = local->zrle;
     orig->lossy_rect = local->lossy_rect;
 
-    queue->buffer = local->output;
+    worker->buffer = local->output;
 }
 
-static int vnc_worker_thread_loop(VncJobQueue *queue)
+/*
+ * Returns the oldest job whose client has no older job, i.e. none that
+ * another worker is encoding, or NULL.
+ */
+static VncJob *vnc_next_job_locked(VncJobQueue *queue)
 {
+    VncJob *job, *older;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        if (job->encoding) {
+            continue;
+        }
+        for (older = QTAILQ_FIRST(&queue->jobs); older != job;
+             older = QTAILQ_NEXT(older, next)) {
+            if (older->vs == job->vs) {
+                break;
+            }
+        }
+        if (older == job) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static int vnc_worker_thread_loop(VncWorker *worker)
+{
+    VncJobQueue *queue = worker->queue;
     VncJob *job;
     VncRectEntry *entry, *tmp;
     VncState vs;
@@ -219,16 +261,15 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     int saved_offset;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    while (!(job = vnc_next_job_locked(queue)) && !queue->exit) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
-    /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
-    vnc_unlock_queue(queue);
-
     if (queue->exit) {
+        vnc_unlock_queue(queue);
         return -1;
     }
+    job->encoding = true;
+    vnc_unlock_queue(queue);
 
     vnc_lock_output(job->vs);
     if (job->vs->csock == -1 || job->vs->abort == true) {
@@ -238,7 +279,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     vnc_unlock_output(job->vs);
 
     /* Make a local copy of vs and switch output buffers */
-    vnc_async_encoding_start(job->vs, &vs);
+    vnc_async_encoding_start(worker, job->vs, &vs);
 
     /* Start sending rectangles */
     n_rectangles = 0;
@@ -254,7 +295,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         if (job->vs->csock == -1) {
             vnc_unlock_display(job->vs->vd);
             /* Copy persistent encoding data */
-            vnc_async_encoding_end(job->vs, &vs);
+            vnc_async_encoding_end(worker, job->vs, &vs);
             goto disconnected;
         }
 
@@ -278,12 +319,12 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         buffer_append(&job->vs->jobs_buffer, vs.output.buffer,
                       vs.output.offset);
         /* Copy persistent encoding data */
-        vnc_async_encoding_end(job->vs, &vs);
+        vnc_async_encoding_end(worker, job->vs, &vs);
 
 	qemu_bh_schedule(job->vs->bh);
     }  else {
         /* Copy persistent encoding data */
-        vnc_async_encoding_end(job->vs, &vs);
+        vnc_async_encoding_end(worker, job->vs, &vs);
     }
     vnc_unlock_output(job->vs);
 
@@ -310,19 +351,27 @@ static void vnc_queue_clear(VncJobQueue *q)
 {
     qemu_cond_destroy(&queue->cond);
     qemu_mutex_destroy(&queue->mutex);
-    buffer_free(&queue->buffer);
     g_free(q);
     queue = NULL; /* Unset global queue */
 }
 
 static void *vnc_worker_thread(void *arg)
 {
-    VncJobQueue *queue = arg;
+    VncWorker *worker = arg;
+    VncJobQueue *queue = worker->queue;
+    bool last;
 
-    qemu_thread_get_self(&queue->thread);
+    qemu_thread_get_self(&worker->thread);
 
-    while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+    while (!vnc_worker_thread_loop(worker)) ;
+    buffer_free(&worker->buffer);
+
+    vnc_lock_queue(queue);
+    last = --queue->nr_workers == 0;
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
@@ -334,12 +383,23 @@ static bool vnc_worker_thread_running(void)
 void vnc_start_worker_thread(void)
 {
     VncJobQueue *q;
+    long nr_workers = 1;
+    int i;
 
     if (vnc_worker_thread_running())
         return ;
 
+#ifdef _SC_NPROCESSORS_ONLN
+    nr_workers = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), VNC_MAX_WORKERS);
+#endif
+
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, "vnc_worker", vnc_worker_thread, q,
-                       QEMU_THREAD_DETACHED);
+    q->nr_workers = nr_workers;
+    for (i = 0; i < nr_workers; i++) {
+        q->workers[i].queue = q;
+        qemu_thread_create(&q->workers[i].thread, "vnc_worker",
+                           vnc_worker_thread, &q->workers[i],
+                           QEMU_THREAD_DETACHED);
+    }
     queue = q; /* Set global queue */
 }
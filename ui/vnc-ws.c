@@ -20,6 +20,7 @@
 
 #include "vnc.h"
 #include "qemu/main-loop.h"
+#include "qemu/iov.h"
 #include "crypto/hash.h"
 
 #ifdef CONFIG_VNC_TLS
@@ -162,11 +163,54 @@ long vnc_client_read_ws(VncState *vs)
     return ret;
 }
 
+/*
+ * Sends the pending output as one frame, with the header and the payload in
+ * a single sendmsg() and without copying the payload.  Whatever the socket
+ * does not take is copied to vs->ws_output, to go out with the next write.
+ */
+static long vnc_client_write_ws_iov(VncState *vs)
+{
+    uint8_t header[WS_HEAD_MAX_LEN];
+    size_t header_size = vncws_encode_frame_header(header, vs->output.offset);
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = header_size },
+        { .iov_base = vs->output.buffer, .iov_len = vs->output.offset },
+    };
+    size_t total = header_size + vs->output.offset;
+    long ret;
+
+    ret = iov_send(vs->csock, iov, 2, 0, total);
+    ret = vnc_client_io_error(vs, ret, socket_error());
+    if ((size_t)ret < header_size) {
+        buffer_reserve(&vs->ws_output, total - ret);
+        buffer_append(&vs->ws_output, header + ret, header_size - ret);
+        buffer_append(&vs->ws_output, vs->output.buffer, vs->output.offset);
+    } else if ((size_t)ret < total) {
+        buffer_reserve(&vs->ws_output, total - ret);
+        buffer_append(&vs->ws_output, vs->output.buffer + ret - header_size,
+                      total - ret);
+    }
+    buffer_reset(&vs->output);
+
+    if ((size_t)ret == total) {
+        qemu_set_fd_handler(vs->csock, vnc_client_read, NULL, vs);
+    }
+    return ret;
+}
+
 long vnc_client_write_ws(VncState *vs)
 {
     long ret;
     VNC_DEBUG("Write WS: Pending output %p size %zd offset %zd\n",
               vs->output.buffer, vs->output.capacity, vs->output.offset);
+    /* gnutls_record_send() takes a single buffer */
+    if (vs->ws_output.offset == 0 && vs->output.offset != 0
+#ifdef CONFIG_VNC_TLS
+        && !vs->tls.session
+#endif
+        ) {
+        return vnc_client_write_ws_iov(vs);
+    }
     vncws_encode_frame(&vs->ws_output, vs->output.buffer, vs->output.offset);
     buffer_reset(&vs->output);
     ret = vnc_client_write_buf(vs, vs->ws_output.buffer, vs->ws_output.offset);
@@ -257,8 +301,7 @@ void vncws_process_handshake(VncState *vs, uint8_t *line, size_t size)
     g_free(key);
 }
 
-void vncws_encode_frame(Buffer *output, const void *payload,
-        const size_t payload_size)
+size_t vncws_encode_frame_header(uint8_t *buf, size_t payload_size)
 {
     size_t header_size = 0;
     unsigned char opcode = WS_OPCODE_BINARY_FRAME;
@@ -267,10 +310,6 @@ void vncws_encode_frame(Buffer *output, const void *payload,
         WsHeader ws;
     } header;
 
-    if (!payload_size) {
-        return;
-    }
-
     header.ws.b0 = 0x80 | (opcode & 0x0f);
     if (payload_size <= 125) {
         header.ws.b1 = (uint8_t)payload_size;
@@ -285,8 +324,23 @@ void vncws_encode_frame(Buffer *output, const void *payload,
         header_size = 10;
     }
 
+    memcpy(buf, header.buf, header_size);
+    return header_size;
+}
+
+void vncws_encode_frame(Buffer *output, const void *payload,
+        const size_t payload_size)
+{
+    uint8_t header[WS_HEAD_MAX_LEN];
+    size_t header_size;
+
+    if (!payload_size) {
+        return;
+    }
+
+    header_size = vncws_encode_frame_header(header, payload_size);
     buffer_reserve(output, header_size + payload_size);
-    buffer_append(output, header.buf, header_size);
+    buffer_append(output, header, header_size);
     buffer_append(output, payload, payload_size);
 }
 
@@ -348,8 +402,9 @@ int vncws_decode_frame_payload(Buffer *input,
                                size_t *payload_remain, WsMask *payload_mask,
                                uint8_t **payload, size_t *payload_size)
 {
-    size_t i;
-    uint32_t *payload32;
+    size_t i = 0;
+    uint64_t *payload64;
+    uint64_t mask64;
 
     *payload = input->buffer;
     /* If we aren't at the end of the payload, then drop
@@ -366,14 +421,27 @@ int vncws_decode_frame_payload(Buffer *input,
     }
     *payload_remain -= *payload_size;
 
-    /* unmask frame */
-    /* process 1 frame (32 bit op) */
-    payload32 = (uint32_t *)(*payload);
-    for (i = 0; i < *payload_size / 4; i++) {
-        payload32[i] ^= payload_mask->u;
+    /* unmask frame; the payload starts at the beginning of the buffer, so
+     * every chunk below starts at a multiple of 4 and sees the mask in order
+     */
+#ifdef __SSE2__
+    {
+        __m128i mask128 = _mm_set1_epi32(payload_mask->u);
+
+        for (; i + 16 <= *payload_size; i += 16) {
+            __m128i *p = (__m128i *)(*payload + i);
+            _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), mask128));
+        }
+    }
+#endif
+    /* process 2 frames at once (64 bit op) */
+    mask64 = ((uint64_t)payload_mask->u << 32) | payload_mask->u;
+    payload64 = (uint64_t *)(*payload + i);
+    for (; i + 8 <= *payload_size; i += 8) {
+        *payload64++ ^= mask64;
     }
     /* process the remaining bytes (if any) */
-    for (i *= 4; i < *payload_size; i++) {
+    for (; i < *payload_size; i++) {
         (*payload)[i] ^= payload_mask->c[i % 4];
     }
 
@@ -33,6 +33,7 @@
 #include "qemu/sockets.h"
 #include "qemu/timer.h"
 #include "qemu/acl.h"
+#include "qemu/mem-usage.h"
 #include "qemu/config-file.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/types.h"
@@ -656,6 +657,13 @@ void vnc_framebuffer_update(VncState *vs, int x, int y, int w, int h,
 void buffer_reserve(Buffer *buffer, size_t len)
 {
     if ((buffer->capacity - buffer->offset) < len) {
+        if (buffer->capacity) {
+            qemu_mem_usage_resize(MEMORY_USAGE_SUBSYSTEM_VNC,
+                                  buffer->capacity,
+                                  buffer->capacity + len + 1024);
+        } else {
+            qemu_mem_usage_alloc(MEMORY_USAGE_SUBSYSTEM_VNC, len + 1024);
+        }
         buffer->capacity += (len + 1024);
         buffer->buffer = g_realloc(buffer->buffer, buffer->capacity);
     }
@@ -678,6 +686,9 @@ void buffer_reset(Buffer *buffer)
 
 void buffer_free(Buffer *buffer)
 {
+    if (buffer->capacity) {
+        qemu_mem_usage_free(MEMORY_USAGE_SUBSYSTEM_VNC, buffer->capacity);
+    }
     g_free(buffer->buffer);
     buffer->offset = 0;
     buffer->capacity = 0;
@@ -2866,6 +2877,27 @@ static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
     rect->updated = true;
 }
 
+/*
+ * Compares one chunk of the guest surface against the server surface a
+ * vector at a time; unlike memcmp() it need not find the first difference,
+ * only that there is one.  Neither surface is necessarily vector-aligned.
+ */
+static inline bool vnc_chunk_equal(const uint8_t *a, const uint8_t *b,
+                                   int len)
+{
+    VECTYPE va, vb;
+    int i;
+
+    for (i = 0; i + (int)sizeof(VECTYPE) <= len; i += sizeof(VECTYPE)) {
+        memcpy(&va, a + i, sizeof(va));
+        memcpy(&vb, b + i, sizeof(vb));
+        if (!ALL_EQ(va, vb)) {
+            return false;
+        }
+    }
+    return memcmp(a + i, b + i, len - i) == 0;
+}
+
 static int vnc_refresh_server_surface(VncDisplay *vd)
 {
     int width = MIN(pixman_image_get_width(vd->guest.fb),
@@ -2873,6 +2905,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     int height = MIN(pixman_image_get_height(vd->guest.fb),
                      pixman_image_get_height(vd->server));
     int cmp_bytes, server_stride, line_bytes, guest_ll, guest_stride, y = 0;
+    int nr_chunks = DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
     uint8_t *guest_row0 = NULL, *server_row0;
     VncState *vs;
     int has_dirty = 0;
@@ -2889,6 +2922,12 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
      * Walk through the guest dirty map.
      * Check and copy modified bits from guest to server surface.
      * Update server dirty map.
+     *
+     * The guest dirty map only has the bits that the display device found
+     * dirty in the memory dirty log, so find_next_bit() skips the clean
+     * stripes of the screen a word at a time.  Within a row, the map is
+     * handled BITS_PER_LONG chunks at a time, and the chunks that really
+     * changed are or-ed into the client maps as a whole word.
      */
     server_row0 = (uint8_t *)pixman_image_get_data(vd->server);
     server_stride = guest_stride = guest_ll =
@@ -2908,7 +2947,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     line_bytes = MIN(server_stride, guest_ll);
 
     for (;;) {
-        int x;
+        int x, w;
         uint8_t *guest_ptr, *server_ptr;
         unsigned long offset = find_next_bit((unsigned long *) &vd->guest.dirty,
                                              height * VNC_DIRTY_BPL(&vd->guest),
@@ -2919,8 +2958,10 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         }
         y = offset / VNC_DIRTY_BPL(&vd->guest);
         x = offset % VNC_DIRTY_BPL(&vd->guest);
+        w = BIT_WORD(x);
+        x = w * BITS_PER_LONG;
 
-        server_ptr = server_row0 + y * server_stride + x * cmp_bytes;
+        server_ptr = server_row0 + y * server_stride;
 
         if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
             qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width, 0, y);
@@ -2928,30 +2969,46 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         } else {
             guest_ptr = guest_row0 + y * guest_stride;
         }
-        guest_ptr += x * cmp_bytes;
 
-        for (; x < DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
-             x++, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-            int _cmp_bytes = cmp_bytes;
-            if (!test_and_clear_bit(x, vd->guest.dirty[y])) {
-                continue;
-            }
-            if ((x + 1) * cmp_bytes > line_bytes) {
-                _cmp_bytes = line_bytes - x * cmp_bytes;
+        for (; x < nr_chunks; w++, x += BITS_PER_LONG) {
+            unsigned long bits = vd->guest.dirty[y][w];
+            unsigned long changed = 0;
+
+            /* the bits past the right edge stay set, as they always did */
+            if (nr_chunks - x < BITS_PER_LONG) {
+                bits &= BITMAP_LAST_WORD_MASK(nr_chunks - x);
             }
-            assert(_cmp_bytes >= 0);
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
+            if (!bits) {
                 continue;
             }
-            memcpy(server_ptr, guest_ptr, _cmp_bytes);
-            if (!vd->non_adaptive) {
-                vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
-                                 y, &tv);
+            vd->guest.dirty[y][w] &= ~bits;
+
+            while (bits) {
+                int i = ctzl(bits);
+                int chunk_off = (x + i) * cmp_bytes;
+                int _cmp_bytes = MIN(cmp_bytes, line_bytes - chunk_off);
+
+                bits &= bits - 1;
+                assert(_cmp_bytes >= 0);
+                if (vnc_chunk_equal(server_ptr + chunk_off,
+                                    guest_ptr + chunk_off, _cmp_bytes)) {
+                    continue;
+                }
+                memcpy(server_ptr + chunk_off, guest_ptr + chunk_off,
+                       _cmp_bytes);
+                if (!vd->non_adaptive) {
+                    vnc_rect_updated(vd, (x + i) * VNC_DIRTY_PIXELS_PER_BIT,
+                                     y, &tv);
+                }
+                changed |= 1UL << i;
             }
-            QTAILQ_FOREACH(vs, &vd->clients, next) {
-                set_bit(x, vs->dirty[y]);
+
+            if (changed) {
+                QTAILQ_FOREACH(vs, &vd->clients, next) {
+                    vs->dirty[y][w] |= changed;
+                }
+                has_dirty += ctpopl(changed);
             }
-            has_dirty++;
         }
 
         y++;
@@ -250,6 +250,7 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    bool encoding;      /* a worker thread has taken it */
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
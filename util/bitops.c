@@ -11,10 +11,20 @@
  * 2 of the License, or (at your option) any later version.
  */
 
+#include "qemu-common.h"
 #include "qemu/bitops.h"
 
 #define BITOP_WORD(nr)		((nr) / BITS_PER_LONG)
 
+/*
+ * Long runs of zero words are skipped with the vector code of
+ * buffer_find_nonzero_offset, in chunks of this many bytes; aligned
+ * and sized for the widest vectors it uses.
+ */
+#define BITOP_SKIP_BYTES	256
+#define BITOP_SKIP_BITS		(BITOP_SKIP_BYTES * BITS_PER_BYTE)
+#define BITOP_SKIP_ALIGN	64
+
 /*
  * Find the next set bit in a memory region.
  */
@@ -42,6 +52,24 @@ unsigned long find_next_bit(const unsigned long *addr, unsigned long size,
         size -= BITS_PER_LONG;
         result += BITS_PER_LONG;
     }
+    if (size >= 2 * BITOP_SKIP_BITS) {
+        /* e.g. the clean pages in the dirty bitmap of a big guest */
+        size_t len, skip;
+
+        while ((uintptr_t)p % BITOP_SKIP_ALIGN) {
+            if ((tmp = *(p++))) {
+                goto found_middle;
+            }
+            result += BITS_PER_LONG;
+            size -= BITS_PER_LONG;
+        }
+
+        len = (size / BITOP_SKIP_BITS) * BITOP_SKIP_BYTES;
+        skip = buffer_find_nonzero_offset(p, len) / sizeof(unsigned long);
+        p += skip;
+        result += skip * BITS_PER_LONG;
+        size -= skip * BITS_PER_LONG;
+    }
     while (size >= 4*BITS_PER_LONG) {
         unsigned long d1, d2, d3;
         tmp = *p;
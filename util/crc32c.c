@@ -105,11 +105,208 @@ static const uint32_t crc32c_table[256] = {
 };
 
 
-uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *data,
+                          unsigned int length)
 {
     while (length--) {
         crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
     }
-    return crc^0xffffffff;
+    return crc;
+}
+
+#if defined(CONFIG_SSE42_OPT)
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#include <cpuid.h>
+#include <nmmintrin.h>
+
+#define CRC32C_HW_BYTE(crc, p)  _mm_crc32_u8(crc, *(const uint8_t *)(p))
+#define CRC32C_HW_WORD(crc, p)  _mm_crc32_u64(crc, *(const uint64_t *)(p))
+
+static bool crc32c_hw_supported(void)
+{
+    unsigned int a, b, c, d;
+
+    return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_2);
+}
+#define CRC32C_HW
+
+#elif defined(CONFIG_ARM_CRC_OPT)
+#pragma GCC push_options
+#pragma GCC target("+crc")
+#include <arm_acle.h>
+#include "elf.h"
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+
+#define CRC32C_HW_BYTE(crc, p)  __crc32cb(crc, *(const uint8_t *)(p))
+#define CRC32C_HW_WORD(crc, p)  __crc32cd(crc, *(const uint64_t *)(p))
+
+static bool crc32c_hw_supported(void)
+{
+    return (qemu_getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#define CRC32C_HW
+#endif
+
+#ifdef CRC32C_HW
+/*
+ * The CRC instructions have a latency of three cycles but can start one
+ * every cycle, so big buffers are split in three streams whose CRCs are
+ * computed at the same time.  The three are then combined by shifting the
+ * first two over the bytes that follow them, which is a linear operation
+ * on the CRC and can be done with a table.  This is the method of Mark
+ * Adler's crc32c.c.
+ */
+#define CRC32C_LONG  8192
+#define CRC32C_SHORT 256
+
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+
+static uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static uint32_t crc32c_hw_streams(uint32_t crc0, const uint8_t **data,
+                                  size_t *length, size_t stream,
+                                  uint32_t zeros[][256])
+{
+    const uint8_t *p = *data;
+
+    while (*length >= stream * 3) {
+        const uint8_t *end = p + stream;
+        uint32_t crc1 = 0, crc2 = 0;
+
+        do {
+            crc0 = CRC32C_HW_WORD(crc0, p);
+            crc1 = CRC32C_HW_WORD(crc1, p + stream);
+            crc2 = CRC32C_HW_WORD(crc2, p + stream * 2);
+            p += 8;
+        } while (p < end);
+        crc0 = crc32c_shift(zeros, crc0) ^ crc1;
+        crc0 = crc32c_shift(zeros, crc0) ^ crc2;
+        p += stream * 2;
+        *length -= stream * 3;
+    }
+    *data = p;
+    return crc0;
+}
+
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *data, size_t length)
+{
+    while (length && ((uintptr_t)data & 7)) {
+        crc = CRC32C_HW_BYTE(crc, data);
+        data++;
+        length--;
+    }
+
+    crc = crc32c_hw_streams(crc, &data, &length, CRC32C_LONG, crc32c_long);
+    crc = crc32c_hw_streams(crc, &data, &length, CRC32C_SHORT, crc32c_short);
+
+    while (length >= 8) {
+        crc = CRC32C_HW_WORD(crc, data);
+        data += 8;
+        length -= 8;
+    }
+    while (length) {
+        crc = CRC32C_HW_BYTE(crc, data);
+        data++;
+        length--;
+    }
+    return crc;
+}
+#pragma GCC pop_options
+
+/* Returns the product of the 32x32 GF(2) matrix @mat and @vec */
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+
+    while (vec) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+    int n;
+
+    for (n = 0; n < 32; n++) {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+/*
+ * Fills @zeros with the tables that apply @length zero bytes to a CRC.
+ * @length must be a power of two.
+ */
+static void crc32c_zeros(uint32_t zeros[][256], size_t length)
+{
+    uint32_t even[32], odd[32];
+    uint32_t row = 1;
+    int n;
+
+    /* the operator for one zero bit... */
+    odd[0] = 0x82f63b78;
+    for (n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    /* ... two and four zero bits */
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+
+    /* then square up from one zero byte; the result ends up in even */
+    do {
+        gf2_matrix_square(even, odd);
+        length >>= 1;
+        if (length == 0) {
+            break;
+        }
+        gf2_matrix_square(odd, even);
+        length >>= 1;
+        if (length == 0) {
+            memcpy(even, odd, sizeof(even));
+        }
+    } while (length);
+
+    for (n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_matrix_times(even, n);
+        zeros[1][n] = gf2_matrix_times(even, n << 8);
+        zeros[2][n] = gf2_matrix_times(even, n << 16);
+        zeros[3][n] = gf2_matrix_times(even, n << 24);
+    }
+}
+
+static bool crc32c_hw_enabled;
+
+static void __attribute__((constructor)) init_crc32c(void)
+{
+    if (crc32c_hw_supported()) {
+        crc32c_zeros(crc32c_long, CRC32C_LONG);
+        crc32c_zeros(crc32c_short, CRC32C_SHORT);
+        crc32c_hw_enabled = true;
+    }
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+#ifdef CRC32C_HW
+    if (crc32c_hw_enabled) {
+        return crc32c_hw(crc, data, length) ^ 0xffffffff;
+    }
+#endif
+    return crc32c_sw(crc, data, length) ^ 0xffffffff;
 }
 
@@ -181,19 +181,18 @@ int qemu_fdatasync(int fd)
  * down to a multiple of sizeof(VECTYPE) for the first
  * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR chunks and down to
  * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
- * afterwards.
+ * afterwards.  With AVX2, the vectors are twice as wide; with AVX-512
+ * they are four times as wide, but only half as many are unrolled.
  *
  * If the buffer is all zero the return value is equal to len.
  */
 
-size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+static size_t buffer_find_nonzero_offset_inner(const void *buf, size_t len)
 {
     const VECTYPE *p = buf;
     const VECTYPE zero = (VECTYPE){0};
     size_t i;
 
-    assert(can_use_buffer_find_nonzero_offset(buf, len));
-
     if (!len) {
         return 0;
     }
@@ -221,46 +220,207 @@ size_t buffer_find_nonzero_offset(const void *buf, size_t len)
     return i * sizeof(VECTYPE);
 }
 
-/*
- * Checks if a buffer is all zeroes
- *
- * Attention! The len must be a multiple of 4 * sizeof(long) due to
- * restriction of optimizations in this function.
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define AVX2_VECTYPE        __m256i
+#define AVX2_ALL_ZERO(v)    _mm256_testz_si256(v, v)
+#define AVX2_VEC_OR(v1, v2) (_mm256_or_si256(v1, v2))
+
+static bool
+can_use_buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
+{
+    return (len % (BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR
+                   * sizeof(AVX2_VECTYPE)) == 0
+            && ((uintptr_t) buf) % sizeof(AVX2_VECTYPE) == 0);
+}
+
+static size_t buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
+{
+    const AVX2_VECTYPE *p = buf;
+    size_t i;
+
+    if (!len) {
+        return 0;
+    }
+
+    for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
+        if (!AVX2_ALL_ZERO(p[i])) {
+            return i * sizeof(AVX2_VECTYPE);
+        }
+    }
+
+    for (i = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR;
+         i < len / sizeof(AVX2_VECTYPE);
+         i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
+        AVX2_VECTYPE tmp0 = AVX2_VEC_OR(p[i + 0], p[i + 1]);
+        AVX2_VECTYPE tmp1 = AVX2_VEC_OR(p[i + 2], p[i + 3]);
+        AVX2_VECTYPE tmp2 = AVX2_VEC_OR(p[i + 4], p[i + 5]);
+        AVX2_VECTYPE tmp3 = AVX2_VEC_OR(p[i + 6], p[i + 7]);
+        AVX2_VECTYPE tmp01 = AVX2_VEC_OR(tmp0, tmp1);
+        AVX2_VECTYPE tmp23 = AVX2_VEC_OR(tmp2, tmp3);
+        if (!AVX2_ALL_ZERO(AVX2_VEC_OR(tmp01, tmp23))) {
+            break;
+        }
+    }
+
+    return i * sizeof(AVX2_VECTYPE);
+}
+#pragma GCC pop_options
+
+#ifdef CONFIG_AVX512F_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+
+/* Only half as many 64-byte vectors are unrolled, so that the granularity
+ * stays the same as with SSE2 and AVX2 (256 bytes).
  */
-bool buffer_is_zero(const void *buf, size_t len)
+#define AVX512_VECTYPE          __m512i
+#define AVX512_ALL_ZERO(v)      (_mm512_test_epi64_mask(v, v) == 0)
+#define AVX512_VEC_OR(v1, v2)   (_mm512_or_si512(v1, v2))
+#define AVX512_UNROLL_FACTOR    (BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR / 2)
+
+static bool
+can_use_buffer_find_nonzero_offset_avx512(const void *buf, size_t len)
 {
-    /*
-     * Use long as the biggest available internal data type that fits into the
-     * CPU register and unroll the loop to smooth out the effect of memory
-     * latency.
-     */
+    return (len % (AVX512_UNROLL_FACTOR * sizeof(AVX512_VECTYPE)) == 0
+            && ((uintptr_t) buf) % sizeof(AVX512_VECTYPE) == 0);
+}
 
+static size_t buffer_find_nonzero_offset_avx512(const void *buf, size_t len)
+{
+    const AVX512_VECTYPE *p = buf;
     size_t i;
-    long d0, d1, d2, d3;
-    const long * const data = buf;
 
-    /* use vector optimized zero check if possible */
-    if (can_use_buffer_find_nonzero_offset(buf, len)) {
-        return buffer_find_nonzero_offset(buf, len) == len;
+    if (!len) {
+        return 0;
+    }
+
+    for (i = 0; i < AVX512_UNROLL_FACTOR; i++) {
+        if (!AVX512_ALL_ZERO(p[i])) {
+            return i * sizeof(AVX512_VECTYPE);
+        }
+    }
+
+    for (i = AVX512_UNROLL_FACTOR;
+         i < len / sizeof(AVX512_VECTYPE);
+         i += AVX512_UNROLL_FACTOR) {
+        AVX512_VECTYPE tmp0 = AVX512_VEC_OR(p[i + 0], p[i + 1]);
+        AVX512_VECTYPE tmp1 = AVX512_VEC_OR(p[i + 2], p[i + 3]);
+        if (!AVX512_ALL_ZERO(AVX512_VEC_OR(tmp0, tmp1))) {
+            break;
+        }
+    }
+
+    return i * sizeof(AVX512_VECTYPE);
+}
+#pragma GCC pop_options
+
+static bool avx512f_enabled;
+#endif
+
+static bool avx2_enabled;
+
+/* The YMM and ZMM registers are only usable if the OS saves them */
+static void __attribute__((constructor)) init_buffer_find_nonzero_offset(void)
+{
+    unsigned int max, a, b, c, d;
+    uint32_t xcr0_lo, xcr0_hi;
+
+    max = __get_cpuid_max(0, NULL);
+    if (max < 7) {
+        return;
+    }
+
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return;
+    }
+
+    asm("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & 6) != 6) {
+        return;
+    }
+
+    __cpuid_count(7, 0, a, b, c, d);
+    avx2_enabled = (b & bit_AVX2) != 0;
+#ifdef CONFIG_AVX512F_OPT
+    /* opmask, upper halves of ZMM0-15 and ZMM16-31 on top of SSE and AVX */
+    avx512f_enabled = (b & bit_AVX512F) != 0 && (xcr0_lo & 0xe6) == 0xe6;
+#endif
+}
+#endif
+
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    assert(can_use_buffer_find_nonzero_offset(buf, len));
+
+#ifdef CONFIG_AVX512F_OPT
+    if (avx512f_enabled &&
+        can_use_buffer_find_nonzero_offset_avx512(buf, len)) {
+        return buffer_find_nonzero_offset_avx512(buf, len);
+    }
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (avx2_enabled && can_use_buffer_find_nonzero_offset_avx2(buf, len)) {
+        return buffer_find_nonzero_offset_avx2(buf, len);
     }
+#endif
 
-    assert(len % (4 * sizeof(long)) == 0);
-    len /= sizeof(long);
+    return buffer_find_nonzero_offset_inner(buf, len);
+}
 
-    for (i = 0; i < len; i += 4) {
-        d0 = data[i + 0];
-        d1 = data[i + 1];
-        d2 = data[i + 2];
-        d3 = data[i + 3];
+/* Suits buffer_find_nonzero_offset() for all vector sizes it uses */
+#define BUFFER_IS_ZERO_CHUNK 256
 
-        if (d0 || d1 || d2 || d3) {
+static bool buffer_is_zero_bytes(const unsigned char *p, size_t len)
+{
+    while (len--) {
+        if (*p++) {
             return false;
         }
     }
-
     return true;
 }
 
+/*
+ * Checks if a buffer is all zeroes
+ *
+ * Any length and alignment is fine.  The vector optimized search is used for
+ * the aligned part in the middle of the buffer; data is usually non-zero
+ * right at the start or the end if at all, so these bytes are looked at
+ * first.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    size_t head, body;
+    uint64_t first, last;
+
+    if (len < 2 * sizeof(uint64_t)) {
+        return buffer_is_zero_bytes(p, len);
+    }
+
+    memcpy(&first, p, sizeof(first));
+    memcpy(&last, p + len - sizeof(last), sizeof(last));
+    if (first | last) {
+        return false;
+    }
+
+    head = -(uintptr_t)p % BUFFER_IS_ZERO_CHUNK;
+    if (head >= len) {
+        return buffer_is_zero_bytes(p, len);
+    }
+    body = QEMU_ALIGN_DOWN(len - head, BUFFER_IS_ZERO_CHUNK);
+
+    return buffer_is_zero_bytes(p, head) &&
+           buffer_find_nonzero_offset(p + head, body) == body &&
+           buffer_is_zero_bytes(p + head + body, len - head - body);
+}
+
 #ifndef _WIN32
 /* Sets a specific flag */
 int fcntl_setfl(int fd, int flag)
@@ -15,6 +15,8 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/bswap.h"
+#include "qemu/parallel.h"
 #include "trace.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
@@ -95,6 +97,87 @@ struct HBitmap {
     uint64_t sizes[HBITMAP_LEVELS];
 };
 
+/* Whole-bitmap operations on the last level are split in jobs of this many
+ * words (512 KiB on 64-bit hosts) and spread over a few threads.
+ */
+#define HBITMAP_JOB_WORDS      (1 << 16)
+#define HBITMAP_JOB_THREADS    4
+
+/* Count the set bits in n words.  Four independent sums let the CPU
+ * overlap the popcounts instead of waiting for each addition.
+ */
+static uint64_t hb_count_words(const unsigned long *p, size_t n)
+{
+    uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        c0 += ctpopl(p[i]);
+        c1 += ctpopl(p[i + 1]);
+        c2 += ctpopl(p[i + 2]);
+        c3 += ctpopl(p[i + 3]);
+    }
+    for (; i < n; i++) {
+        c0 += ctpopl(p[i]);
+    }
+    return c0 + c1 + c2 + c3;
+}
+
+/* dst |= src over n words.  The loop has no dependency between words,
+ * so the compiler turns it into vector operations.
+ */
+static void hb_or_words(unsigned long *dst, const unsigned long *src,
+                        size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        dst[i] |= src[i];
+    }
+}
+
+typedef struct HBitmapJobs {
+    HBitmap *a;
+    const HBitmap *b;           /* ORed into a, unless NULL */
+    uint64_t *counts;           /* bits set in a by job */
+} HBitmapJobs;
+
+static void hb_last_level_job(void *opaque, int index)
+{
+    HBitmapJobs *jobs = opaque;
+    uint64_t first = (uint64_t)index * HBITMAP_JOB_WORDS;
+    uint64_t n = MIN(HBITMAP_JOB_WORDS,
+                     jobs->a->sizes[HBITMAP_LEVELS - 1] - first);
+    unsigned long *dst = &jobs->a->levels[HBITMAP_LEVELS - 1][first];
+
+    if (jobs->b) {
+        hb_or_words(dst, &jobs->b->levels[HBITMAP_LEVELS - 1][first], n);
+    }
+    jobs->counts[index] = hb_count_words(dst, n);
+}
+
+/* ORs b into the last level of a, if b is not NULL, and returns the number
+ * of bits set in the last level of a.
+ */
+static uint64_t hb_last_level_or_count(HBitmap *a, const HBitmap *b)
+{
+    int njobs = DIV_ROUND_UP(a->sizes[HBITMAP_LEVELS - 1], HBITMAP_JOB_WORDS);
+    HBitmapJobs jobs = {
+        .a = a,
+        .b = b,
+        .counts = g_new(uint64_t, njobs),
+    };
+    uint64_t count = 0;
+    int i;
+
+    parallel_for(njobs, HBITMAP_JOB_THREADS, hb_last_level_job, &jobs);
+    for (i = 0; i < njobs; i++) {
+        count += jobs.counts[i];
+    }
+    g_free(jobs.counts);
+    return count;
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -181,34 +264,32 @@ uint64_t hbitmap_count(const HBitmap *hb)
     return hb->count << hb->granularity;
 }
 
-/* Count the number of set bits between start and end, not accounting for
- * the granularity.  Also an example of how to use hbitmap_iter_next_word.
+/* Count the number of set bits between start and last, not accounting for
+ * the granularity.  The words of the last level are counted directly, which
+ * is cheaper than iterating unless the range is large and almost empty.
  */
 static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
 {
-    HBitmapIter hbi;
-    uint64_t count = 0;
-    uint64_t end = last + 1;
-    unsigned long cur;
-    size_t pos;
+    const unsigned long *level = hb->levels[HBITMAP_LEVELS - 1];
+    size_t pos = start >> BITS_PER_LEVEL;
+    size_t lastpos = last >> BITS_PER_LEVEL;
+    unsigned long first_mask = ~0UL << (start & (BITS_PER_LONG - 1));
+    unsigned long last_mask =
+        ~0UL >> (BITS_PER_LONG - 1 - (last & (BITS_PER_LONG - 1)));
 
-    hbitmap_iter_init(&hbi, hb, start << hb->granularity);
-    for (;;) {
-        pos = hbitmap_iter_next_word(&hbi, &cur);
-        if (pos >= (end >> BITS_PER_LEVEL)) {
-            break;
-        }
-        count += ctpopl(cur);
+    if (hb->count == 0) {
+        return 0;
     }
-
-    if (pos == (end >> BITS_PER_LEVEL)) {
-        /* Drop bits representing the END-th and subsequent items.  */
-        int bit = end & (BITS_PER_LONG - 1);
-        cur &= (1UL << bit) - 1;
-        count += ctpopl(cur);
+    if (start == 0 && last >= hb->size - 1) {
+        return hb->count;
     }
 
-    return count;
+    if (pos == lastpos) {
+        return ctpopl(level[pos] & first_mask & last_mask);
+    }
+    return ctpopl(level[pos] & first_mask) +
+           hb_count_words(&level[pos + 1], lastpos - pos - 1) +
+           ctpopl(level[lastpos] & last_mask);
 }
 
 /* Setting starts at the last layer and propagates up if an element
@@ -471,7 +552,6 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
 bool hbitmap_merge(HBitmap *a, const HBitmap *b)
 {
     int i;
-    uint64_t j;
 
     if ((a->size != b->size) || (a->granularity != b->granularity)) {
         return false;
@@ -484,12 +564,144 @@ bool hbitmap_merge(HBitmap *a, const HBitmap *b)
     /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
      * It may be possible to improve running times for sparsely populated maps
      * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+     * The last level, which is almost all of the work, is done in parallel
+     * and also yields the new count.
      */
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
-        for (j = 0; j < a->sizes[i]; j++) {
-            a->levels[i][j] |= b->levels[i][j];
-        }
+    a->count = hb_last_level_or_count(a, b);
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
+        hb_or_words(a->levels[i], b->levels[i], a->sizes[i]);
     }
 
     return true;
 }
+
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb)
+{
+    /* Chunks are whole 64-bit words, so that 32-bit and 64-bit hosts
+     * produce the same data.
+     */
+    return 64ULL << hb->granularity;
+}
+
+/* Start and count are in bitmap elements; return the words of the last
+ * level that hold them.
+ */
+static void serialization_chunk(const HBitmap *hb,
+                                uint64_t start, uint64_t count,
+                                unsigned long **first_el, size_t *el_count)
+{
+    uint64_t last = start + count - 1;
+    uint64_t gran = hbitmap_serialization_granularity(hb);
+
+    assert((start & (gran - 1)) == 0);
+    assert((last >> hb->granularity) < hb->size);
+    if ((last >> hb->granularity) != hb->size - 1) {
+        assert((count & (gran - 1)) == 0);
+    }
+
+    start = (start >> hb->granularity) >> BITS_PER_LEVEL;
+    last = (last >> hb->granularity) >> BITS_PER_LEVEL;
+
+    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *el_count = last - start + 1;
+}
+
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count)
+{
+    unsigned long *cur;
+    size_t el_count;
+
+    if (!count) {
+        return 0;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+
+    return el_count * sizeof(unsigned long);
+}
+
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count)
+{
+    unsigned long *cur, el;
+    size_t el_count, i;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+
+    for (i = 0; i < el_count; i++) {
+        el = BITS_PER_LONG == 64 ? cpu_to_le64(cur[i]) : cpu_to_le32(cur[i]);
+        memcpy(buf + i * sizeof(el), &el, sizeof(el));
+    }
+}
+
+void hbitmap_deserialize_part(HBitmap *hb, const uint8_t *buf,
+                              uint64_t start, uint64_t count, bool finish)
+{
+    unsigned long *cur;
+    size_t el_count, i;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+
+    memcpy(cur, buf, el_count * sizeof(unsigned long));
+    for (i = 0; i < el_count; i++) {
+        cur[i] = BITS_PER_LONG == 64 ? le64_to_cpu(cur[i]) : le32_to_cpu(cur[i]);
+    }
+
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
+                                bool finish)
+{
+    unsigned long *first;
+    size_t el_count;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &first, &el_count);
+
+    memset(first, 0, el_count * sizeof(unsigned long));
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+void hbitmap_deserialize_finish(HBitmap *hb)
+{
+    uint64_t i, size, prev_size;
+    unsigned long *last = hb->levels[HBITMAP_LEVELS - 1];
+    int lev;
+
+    /* Drop bits past the end, which the data may have had set */
+    if (hb->size & (BITS_PER_LONG - 1)) {
+        last[hb->size >> BITS_PER_LEVEL] &=
+            (1UL << (hb->size & (BITS_PER_LONG - 1))) - 1;
+    }
+
+    /* The last level is complete; rebuild the others from it */
+    size = hb->sizes[HBITMAP_LEVELS - 1];
+    for (lev = HBITMAP_LEVELS - 1; lev-- > 0; ) {
+        prev_size = size;
+        size = hb->sizes[lev];
+        memset(hb->levels[lev], 0, size * sizeof(unsigned long));
+
+        for (i = 0; i < prev_size; i++) {
+            if (hb->levels[lev + 1][i]) {
+                hb->levels[lev][i >> BITS_PER_LEVEL] |=
+                    1UL << (i & (BITS_PER_LONG - 1));
+            }
+        }
+    }
+    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+
+    hb->count = hb_last_level_or_count(hb, NULL);
+}
@@ -0,0 +1,180 @@
+/*
+ * Interval tree of byte ranges
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <assert.h>
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+/* This is an AVL tree sorted by start, where each node also knows the
+ * highest last byte in its subtree.  A search can therefore skip every
+ * subtree that ends before the range it looks for, as well as everything
+ * right of a node that starts after it.  Nodes with the same start are
+ * ordered by address, so that every node has a place of its own.
+ */
+
+static inline int node_height(IntervalTreeNode *n)
+{
+    return n ? n->height : 0;
+}
+
+static inline bool node_less(IntervalTreeNode *a, IntervalTreeNode *b)
+{
+    return a->start < b->start ||
+           (a->start == b->start && (uintptr_t)a < (uintptr_t)b);
+}
+
+static void node_update(IntervalTreeNode *n)
+{
+    n->height = 1 + MAX(node_height(n->left), node_height(n->right));
+    n->subtree_last = n->last;
+    if (n->left) {
+        n->subtree_last = MAX(n->subtree_last, n->left->subtree_last);
+    }
+    if (n->right) {
+        n->subtree_last = MAX(n->subtree_last, n->right->subtree_last);
+    }
+}
+
+static IntervalTreeNode *rotate_right(IntervalTreeNode *n)
+{
+    IntervalTreeNode *l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    node_update(n);
+    node_update(l);
+    return l;
+}
+
+static IntervalTreeNode *rotate_left(IntervalTreeNode *n)
+{
+    IntervalTreeNode *r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    node_update(n);
+    node_update(r);
+    return r;
+}
+
+static IntervalTreeNode *node_balance(IntervalTreeNode *n)
+{
+    int diff = node_height(n->left) - node_height(n->right);
+
+    if (diff > 1) {
+        if (node_height(n->left->left) < node_height(n->left->right)) {
+            n->left = rotate_left(n->left);
+        }
+        return rotate_right(n);
+    }
+    if (diff < -1) {
+        if (node_height(n->right->right) < node_height(n->right->left)) {
+            n->right = rotate_right(n->right);
+        }
+        return rotate_left(n);
+    }
+    node_update(n);
+    return n;
+}
+
+static IntervalTreeNode *node_insert(IntervalTreeNode *n,
+                                     IntervalTreeNode *node)
+{
+    if (!n) {
+        node->left = node->right = NULL;
+        node_update(node);
+        return node;
+    }
+    if (node_less(node, n)) {
+        n->left = node_insert(n->left, node);
+    } else {
+        n->right = node_insert(n->right, node);
+    }
+    return node_balance(n);
+}
+
+static IntervalTreeNode *node_remove_min(IntervalTreeNode *n,
+                                         IntervalTreeNode **min)
+{
+    if (!n->left) {
+        *min = n;
+        return n->right;
+    }
+    n->left = node_remove_min(n->left, min);
+    return node_balance(n);
+}
+
+static IntervalTreeNode *node_remove(IntervalTreeNode *n,
+                                     IntervalTreeNode *node)
+{
+    IntervalTreeNode *min, *right;
+
+    assert(n);
+    if (n != node) {
+        if (node_less(node, n)) {
+            n->left = node_remove(n->left, node);
+        } else {
+            n->right = node_remove(n->right, node);
+        }
+        return node_balance(n);
+    }
+
+    if (!n->left) {
+        return n->right;
+    }
+    if (!n->right) {
+        return n->left;
+    }
+    right = node_remove_min(n->right, &min);
+    min->left = n->left;
+    min->right = right;
+    return node_balance(min);
+}
+
+void interval_tree_insert(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    assert(node->start <= node->last);
+    root->node = node_insert(root->node, node);
+}
+
+void interval_tree_remove(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    root->node = node_remove(root->node, node);
+}
+
+static IntervalTreeNode *node_find(IntervalTreeNode *n,
+                                   uint64_t start, uint64_t last,
+                                   IntervalTreeMatchFunc *match,
+                                   void *opaque)
+{
+    IntervalTreeNode *found;
+
+    if (!n || n->subtree_last < start) {
+        return NULL;
+    }
+    found = node_find(n->left, start, last, match, opaque);
+    if (found) {
+        return found;
+    }
+    if (n->start > last) {
+        /* and so does everything to the right */
+        return NULL;
+    }
+    if (n->last >= start && (!match || match(n, opaque))) {
+        return n;
+    }
+    return node_find(n->right, start, last, match, opaque);
+}
+
+IntervalTreeNode *interval_tree_find(IntervalTreeRoot *root,
+                                     uint64_t start, uint64_t last,
+                                     IntervalTreeMatchFunc *match,
+                                     void *opaque)
+{
+    return node_find(root->node, start, last, match, opaque);
+}
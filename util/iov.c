@@ -265,9 +265,14 @@ unsigned iov_copy(struct iovec *dst_iov, unsigned int dst_iov_cnt,
 
 void qemu_iovec_init(QEMUIOVector *qiov, int alloc_hint)
 {
-    qiov->iov = g_new(struct iovec, alloc_hint);
+    if (alloc_hint <= QEMU_IOVEC_INLINE) {
+        qiov->iov = qiov->inline_iov;
+        qiov->nalloc = QEMU_IOVEC_INLINE;
+    } else {
+        qiov->iov = g_new(struct iovec, alloc_hint);
+        qiov->nalloc = alloc_hint;
+    }
     qiov->niov = 0;
-    qiov->nalloc = alloc_hint;
     qiov->size = 0;
 }
 
@@ -283,13 +288,30 @@ void qemu_iovec_init_external(QEMUIOVector *qiov, struct iovec *iov, int niov)
         qiov->size += iov[i].iov_len;
 }
 
+/*
+ * A vector of the single buffer @buf, which (like qemu_iovec_init_external)
+ * cannot grow and needs no qemu_iovec_destroy().
+ */
+void qemu_iovec_init_buf(QEMUIOVector *qiov, void *buf, size_t len)
+{
+    qiov->inline_iov[0].iov_base = buf;
+    qiov->inline_iov[0].iov_len = len;
+    qemu_iovec_init_external(qiov, qiov->inline_iov, 1);
+}
+
 void qemu_iovec_add(QEMUIOVector *qiov, void *base, size_t len)
 {
     assert(qiov->nalloc != -1);
 
     if (qiov->niov == qiov->nalloc) {
         qiov->nalloc = 2 * qiov->nalloc + 1;
-        qiov->iov = g_renew(struct iovec, qiov->iov, qiov->nalloc);
+        if (qiov->iov == qiov->inline_iov) {
+            qiov->iov = g_new(struct iovec, qiov->nalloc);
+            memcpy(qiov->iov, qiov->inline_iov,
+                   qiov->niov * sizeof(struct iovec));
+        } else {
+            qiov->iov = g_renew(struct iovec, qiov->iov, qiov->nalloc);
+        }
     }
     qiov->iov[qiov->niov].iov_base = base;
     qiov->iov[qiov->niov].iov_len = len;
@@ -356,16 +378,9 @@ bool qemu_iovec_is_zero(QEMUIOVector *qiov)
 {
     int i;
     for (i = 0; i < qiov->niov; i++) {
-        size_t offs = QEMU_ALIGN_DOWN(qiov->iov[i].iov_len, 4 * sizeof(long));
-        uint8_t *ptr = qiov->iov[i].iov_base;
-        if (offs && !buffer_is_zero(qiov->iov[i].iov_base, offs)) {
+        if (!buffer_is_zero(qiov->iov[i].iov_base, qiov->iov[i].iov_len)) {
             return false;
         }
-        for (; offs < qiov->iov[i].iov_len; offs++) {
-            if (ptr[offs]) {
-                return false;
-            }
-        }
     }
     return true;
 }
@@ -375,7 +390,9 @@ void qemu_iovec_destroy(QEMUIOVector *qiov)
     assert(qiov->nalloc != -1);
 
     qemu_iovec_reset(qiov);
-    g_free(qiov->iov);
+    if (qiov->iov != qiov->inline_iov) {
+        g_free(qiov->iov);
+    }
     qiov->nalloc = 0;
     qiov->iov = NULL;
 }
@@ -0,0 +1,30 @@
+/*
+ * Memory accounting per subsystem
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/mem-usage.h"
+
+QemuMemUsage qemu_mem_usage[MEMORY_USAGE_SUBSYSTEM_MAX];
+
+MemoryUsageInfoList *qemu_mem_usage_query(void)
+{
+    MemoryUsageInfoList *head = NULL, **tail = &head;
+    int i;
+
+    for (i = 0; i < MEMORY_USAGE_SUBSYSTEM_MAX; i++) {
+        MemoryUsageInfoList *entry = g_new0(MemoryUsageInfoList, 1);
+
+        entry->value = g_new0(MemoryUsageInfo, 1);
+        entry->value->subsystem = i;
+        entry->value->bytes = atomic_read(&qemu_mem_usage[i].bytes);
+        entry->value->allocations =
+            atomic_read(&qemu_mem_usage[i].allocations);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
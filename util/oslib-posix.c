@@ -58,6 +58,8 @@ extern int daemon(int, int);
 #include "sysemu/sysemu.h"
 #include "trace.h"
 #include "qemu/sockets.h"
+#include "qemu/atomic.h"
+#include "qemu/parallel.h"
 #include <sys/mman.h>
 #include <libgen.h>
 #include <setjmp.h>
@@ -345,7 +347,8 @@ char *qemu_get_exec_dir(void)
     return g_strdup(exec_dir);
 }
 
-static sigjmp_buf sigjump;
+/* per thread, as os_mem_prealloc() touches the pages from several */
+static __thread sigjmp_buf sigjump;
 
 static void sigbus_handler(int signal)
 {
@@ -372,11 +375,54 @@ static size_t fd_getpagesize(int fd)
     return getpagesize();
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory)
+typedef struct MemPrealloc {
+    char *area;
+    size_t hpagesize;
+    size_t numpages;
+    size_t slice_pages;
+    bool failed;
+} MemPrealloc;
+
+/* Touches pages [@index * slice_pages, (@index + 1) * slice_pages) */
+static void do_touch_pages(void *opaque, int index)
+{
+    MemPrealloc *p = opaque;
+    size_t first = index * p->slice_pages;
+    size_t last = MIN(first + p->slice_pages, p->numpages);
+    sigset_t set, oldset;
+    size_t i;
+
+    /* the worker threads start with all signals blocked */
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
+
+    if (sigsetjmp(sigjump, 1)) {
+        atomic_set(&p->failed, true);
+    } else {
+        /* MAP_POPULATE silently ignores failures */
+        for (i = first; i < last && !atomic_read(&p->failed); i++) {
+            memset(p->area + p->hpagesize * i, 0, 1);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+
+/*
+ * Touches every page of @area, with up to @threads threads that each take
+ * a contiguous slice.  The NUMA policy of the range is set beforehand, so
+ * the pages land on the right host nodes whichever thread faults them in.
+ */
+void os_mem_prealloc(int fd, char *area, size_t memory, int threads)
 {
     int ret;
     struct sigaction act, oldact;
-    sigset_t set, oldset;
+    MemPrealloc p = {
+        .area = area,
+        .hpagesize = fd_getpagesize(fd),
+    };
+    int slices;
 
     memset(&act, 0, sizeof(act));
     act.sa_handler = &sigbus_handler;
@@ -388,32 +434,21 @@ void os_mem_prealloc(int fd, char *area, size_t memory)
         exit(1);
     }
 
-    /* unblock SIGBUS */
-    sigemptyset(&set);
-    sigaddset(&set, SIGBUS);
-    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
+    p.numpages = DIV_ROUND_UP(memory, p.hpagesize);
+    slices = MAX(MIN(threads, p.numpages), 1);
+    p.slice_pages = DIV_ROUND_UP(p.numpages, slices);
+    parallel_for(slices, threads, do_touch_pages, &p);
 
-    if (sigsetjmp(sigjump, 1)) {
+    if (p.failed) {
         fprintf(stderr, "os_mem_prealloc: Insufficient free host memory "
                         "pages available to allocate guest RAM\n");
         exit(1);
-    } else {
-        int i;
-        size_t hpagesize = fd_getpagesize(fd);
-        size_t numpages = DIV_ROUND_UP(memory, hpagesize);
-
-        /* MAP_POPULATE silently ignores failures */
-        for (i = 0; i < numpages; i++) {
-            memset(area + (hpagesize * i), 0, 1);
-        }
-
-        ret = sigaction(SIGBUS, &oldact, NULL);
-        if (ret) {
-            perror("os_mem_prealloc: failed to reinstall signal handler");
-            exit(1);
-        }
+    }
 
-        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    ret = sigaction(SIGBUS, &oldact, NULL);
+    if (ret) {
+        perror("os_mem_prealloc: failed to reinstall signal handler");
+        exit(1);
     }
 }
 
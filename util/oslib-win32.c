@@ -460,7 +460,7 @@ size_t getpagesize(void)
     return system_info.dwPageSize;
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory)
+void os_mem_prealloc(int fd, char *area, size_t memory, int threads)
 {
     int i;
     size_t pagesize = getpagesize();
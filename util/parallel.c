@@ -0,0 +1,128 @@
+/*
+ * Spreading a loop over worker threads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/parallel.h"
+
+/*
+ * The workers sleep on @wake until @generation changes. Each new loop
+ * lets @slots of them in; those count themselves in @active and take
+ * indexes from @next until there are none left, as does the caller.
+ */
+static struct {
+    QemuMutex run_lock;         /* held by the caller of the current loop */
+
+    QemuMutex lock;             /* protects the fields below */
+    QemuCond wake;
+    QemuCond done;
+    unsigned generation;
+    int nthreads;               /* workers started */
+    int slots;                  /* workers that may still join the loop */
+    int active;                 /* workers that joined and are not done */
+
+    ParallelFunc *func;
+    void *opaque;
+    int n;
+    int next;                   /* next index, taken with atomic_fetch_inc */
+} pool;
+
+static int ncpus;
+
+static void parallel_work(void)
+{
+    int i;
+
+    while ((i = atomic_fetch_inc(&pool.next)) < pool.n) {
+        pool.func(pool.opaque, i);
+    }
+}
+
+static void *parallel_worker(void *opaque)
+{
+    unsigned generation = 0;
+
+    qemu_mutex_lock(&pool.lock);
+    for (;;) {
+        if (pool.generation != generation) {
+            generation = pool.generation;
+            if (pool.slots) {
+                pool.slots--;
+                pool.active++;
+                qemu_mutex_unlock(&pool.lock);
+
+                parallel_work();
+
+                qemu_mutex_lock(&pool.lock);
+                if (--pool.active == 0) {
+                    qemu_cond_signal(&pool.done);
+                }
+                continue;
+            }
+        }
+        qemu_cond_wait(&pool.wake, &pool.lock);
+    }
+
+    return NULL;
+}
+
+void parallel_for(int n, int threads, ParallelFunc *func, void *opaque)
+{
+    QemuThread thread;
+    int i;
+
+    threads = MIN(threads, MIN(n, MIN(ncpus, PARALLEL_MAX_THREADS)));
+    if (threads <= 1 || qemu_mutex_trylock(&pool.run_lock)) {
+        for (i = 0; i < n; i++) {
+            func(opaque, i);
+        }
+        return;
+    }
+
+    qemu_mutex_lock(&pool.lock);
+    while (pool.nthreads < threads - 1) {
+        qemu_thread_create(&thread, "parallel", parallel_worker, NULL,
+                           QEMU_THREAD_DETACHED);
+        pool.nthreads++;
+    }
+    pool.func = func;
+    pool.opaque = opaque;
+    pool.n = n;
+    pool.next = 0;
+    pool.slots = threads - 1;
+    pool.generation++;
+    qemu_cond_broadcast(&pool.wake);
+    qemu_mutex_unlock(&pool.lock);
+
+    parallel_work();
+
+    /* workers that did not wake up in time have nothing left to do */
+    qemu_mutex_lock(&pool.lock);
+    pool.slots = 0;
+    while (pool.active) {
+        qemu_cond_wait(&pool.done, &pool.lock);
+    }
+    qemu_mutex_unlock(&pool.lock);
+
+    qemu_mutex_unlock(&pool.run_lock);
+}
+
+static void __attribute__((constructor)) parallel_init(void)
+{
+    qemu_mutex_init(&pool.run_lock);
+    qemu_mutex_init(&pool.lock);
+    qemu_cond_init(&pool.wake);
+    qemu_cond_init(&pool.done);
+
+#ifdef _SC_NPROCESSORS_ONLN
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    ncpus = PARALLEL_MAX_THREADS;
+#endif
+}
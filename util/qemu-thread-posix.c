@@ -24,9 +24,12 @@
 #include <sys/syscall.h>
 #include <linux/futex.h>
 #endif
+#include <sched.h>
 #include "qemu/thread.h"
 #include "qemu/atomic.h"
+#include "qemu/bitops.h"
 #include "qemu/notify.h"
+#include "qemu/qsp.h"
 
 static bool name_threads;
 
@@ -55,6 +58,7 @@ void qemu_mutex_init(QemuMutex *mutex)
     err = pthread_mutex_init(&mutex->lock, NULL);
     if (err)
         error_exit(err, __func__);
+    mutex->qsp_entry = NULL;
 }
 
 void qemu_mutex_destroy(QemuMutex *mutex)
@@ -66,24 +70,42 @@ void qemu_mutex_destroy(QemuMutex *mutex)
         error_exit(err, __func__);
 }
 
-void qemu_mutex_lock(QemuMutex *mutex)
+void qemu_mutex_lock_impl(QemuMutex *mutex, const char *name,
+                          const char *file, int line)
 {
+    int64_t start = 0;
     int err;
 
+    if (unlikely(atomic_read(&qsp_enabled))) {
+        start = qsp_clock();
+    }
     err = pthread_mutex_lock(&mutex->lock);
     if (err)
         error_exit(err, __func__);
+    if (unlikely(start)) {
+        qsp_mutex_acquired(mutex, name, file, line, start);
+    }
 }
 
-int qemu_mutex_trylock(QemuMutex *mutex)
+int qemu_mutex_trylock_impl(QemuMutex *mutex, const char *name,
+                            const char *file, int line)
 {
-    return pthread_mutex_trylock(&mutex->lock);
+    int err;
+
+    err = pthread_mutex_trylock(&mutex->lock);
+    if (!err && unlikely(atomic_read(&qsp_enabled))) {
+        qsp_mutex_acquired(mutex, name, file, line, qsp_clock());
+    }
+    return err;
 }
 
 void qemu_mutex_unlock(QemuMutex *mutex)
 {
     int err;
 
+    if (unlikely(mutex->qsp_entry)) {
+        qsp_mutex_released(mutex);
+    }
     err = pthread_mutex_unlock(&mutex->lock);
     if (err)
         error_exit(err, __func__);
@@ -127,11 +149,19 @@ void qemu_cond_broadcast(QemuCond *cond)
 
 void qemu_cond_wait(QemuCond *cond, QemuMutex *mutex)
 {
+    void *qsp_entry = mutex->qsp_entry;
     int err;
 
+    /* the mutex is not held while waiting */
+    if (unlikely(qsp_entry)) {
+        qsp_mutex_released(mutex);
+    }
     err = pthread_cond_wait(&cond->cond, &mutex->lock);
     if (err)
         error_exit(err, __func__);
+    if (unlikely(qsp_entry)) {
+        qsp_mutex_reacquired(mutex, qsp_entry);
+    }
 }
 
 void qemu_sem_init(QemuSemaphore *sem, int init)
@@ -491,6 +521,43 @@ bool qemu_thread_is_self(QemuThread *thread)
    return pthread_equal(pthread_self(), thread->thread);
 }
 
+int qemu_thread_set_affinity(QemuThread *thread,
+                             const unsigned long *host_cpus,
+                             unsigned long nbits)
+{
+#if defined(__linux__) && defined(CPU_ALLOC)
+    size_t setsize = CPU_ALLOC_SIZE(nbits);
+    cpu_set_t *cpuset;
+    unsigned long cpu;
+    int err;
+
+    cpuset = CPU_ALLOC(nbits);
+    if (!cpuset) {
+        return -ENOMEM;
+    }
+    CPU_ZERO_S(setsize, cpuset);
+    for (cpu = 0; cpu < nbits; cpu++) {
+        if (test_bit(cpu, host_cpus)) {
+            CPU_SET_S(cpu, setsize, cpuset);
+        }
+    }
+    err = pthread_setaffinity_np(thread->thread, setsize, cpuset);
+    CPU_FREE(cpuset);
+    return -err;
+#else
+    return -ENOSYS;
+#endif
+}
+
+int qemu_thread_set_realtime(QemuThread *thread, int priority)
+{
+    struct sched_param param = { .sched_priority = priority };
+
+    return -pthread_setschedparam(thread->thread,
+                                  priority ? SCHED_FIFO : SCHED_OTHER,
+                                  &param);
+}
+
 void qemu_thread_exit(void *retval)
 {
     pthread_exit(retval);
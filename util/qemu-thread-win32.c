@@ -12,7 +12,9 @@
  */
 #include "qemu-common.h"
 #include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include "qemu/notify.h"
+#include "qemu/qsp.h"
 #include <process.h>
 #include <assert.h>
 #include <limits.h>
@@ -41,6 +43,7 @@ static void error_exit(int err, const char *msg)
 void qemu_mutex_init(QemuMutex *mutex)
 {
     mutex->owner = 0;
+    mutex->qsp_entry = NULL;
     InitializeCriticalSection(&mutex->lock);
 }
 
@@ -50,8 +53,14 @@ void qemu_mutex_destroy(QemuMutex *mutex)
     DeleteCriticalSection(&mutex->lock);
 }
 
-void qemu_mutex_lock(QemuMutex *mutex)
+void qemu_mutex_lock_impl(QemuMutex *mutex, const char *name,
+                          const char *file, int line)
 {
+    int64_t start = 0;
+
+    if (unlikely(atomic_read(&qsp_enabled))) {
+        start = qsp_clock();
+    }
     EnterCriticalSection(&mutex->lock);
 
     /* Win32 CRITICAL_SECTIONs are recursive.  Assert that we're not
@@ -59,9 +68,13 @@ void qemu_mutex_lock(QemuMutex *mutex)
      */
     assert(mutex->owner == 0);
     mutex->owner = GetCurrentThreadId();
+    if (unlikely(start)) {
+        qsp_mutex_acquired(mutex, name, file, line, start);
+    }
 }
 
-int qemu_mutex_trylock(QemuMutex *mutex)
+int qemu_mutex_trylock_impl(QemuMutex *mutex, const char *name,
+                            const char *file, int line)
 {
     int owned;
 
@@ -69,6 +82,9 @@ int qemu_mutex_trylock(QemuMutex *mutex)
     if (owned) {
         assert(mutex->owner == 0);
         mutex->owner = GetCurrentThreadId();
+        if (unlikely(atomic_read(&qsp_enabled))) {
+            qsp_mutex_acquired(mutex, name, file, line, qsp_clock());
+        }
     }
     return !owned;
 }
@@ -76,6 +92,9 @@ int qemu_mutex_trylock(QemuMutex *mutex)
 void qemu_mutex_unlock(QemuMutex *mutex)
 {
     assert(mutex->owner == GetCurrentThreadId());
+    if (unlikely(mutex->qsp_entry)) {
+        qsp_mutex_released(mutex);
+    }
     mutex->owner = 0;
     LeaveCriticalSection(&mutex->lock);
 }
@@ -419,3 +438,15 @@ bool qemu_thread_is_self(QemuThread *thread)
 {
     return GetCurrentThreadId() == thread->tid;
 }
+
+int qemu_thread_set_affinity(QemuThread *thread,
+                             const unsigned long *host_cpus,
+                             unsigned long nbits)
+{
+    return -ENOSYS;
+}
+
+int qemu_thread_set_realtime(QemuThread *thread, int priority)
+{
+    return -ENOSYS;
+}
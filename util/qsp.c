@@ -0,0 +1,246 @@
+/*
+ * QEMU synchronization profiler
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/queue.h"
+#include "qemu/timer.h"
+#include "qemu/qsp.h"
+
+typedef struct QSPTable QSPTable;
+
+typedef struct QSPEntry {
+    const char *name;
+    const char *file;
+    int line;
+    uint64_t n_acqs;
+    uint64_t ns_wait;
+    uint64_t ns_hold;
+    QSPTable *table;
+} QSPEntry;
+
+/*
+ * Each thread accounts its acquisitions in a table of its own, so that the
+ * profiler does not add contention of its own.  The lock only synchronizes
+ * with qsp_report() and qsp_reset().  Tables are never freed, because a
+ * mutex that is held may point to one of their entries.
+ *
+ * The profiler uses glib mutexes rather than QemuMutex, which it would
+ * otherwise profile itself.
+ */
+struct QSPTable {
+    CompatGMutex lock;
+    GHashTable *entries;
+    QSLIST_ENTRY(QSPTable) next;
+};
+
+bool qsp_enabled;
+
+static CompatGMutex qsp_tables_lock;
+static QSLIST_HEAD(, QSPTable) qsp_tables = QSLIST_HEAD_INITIALIZER(qsp_tables);
+static __thread QSPTable *qsp_thread_table;
+
+static guint qsp_entry_hash(gconstpointer p)
+{
+    const QSPEntry *e = p;
+
+    return (uintptr_t)e->name * 31 + (uintptr_t)e->file * 17 + e->line;
+}
+
+static gboolean qsp_entry_equal(gconstpointer a, gconstpointer b)
+{
+    const QSPEntry *ea = a;
+    const QSPEntry *eb = b;
+
+    return ea->name == eb->name && ea->file == eb->file &&
+           ea->line == eb->line;
+}
+
+static QSPTable *qsp_get_thread_table(void)
+{
+    QSPTable *table = qsp_thread_table;
+
+    if (!table) {
+        table = g_new0(QSPTable, 1);
+        table->entries = g_hash_table_new(qsp_entry_hash, qsp_entry_equal);
+        g_mutex_lock(&qsp_tables_lock);
+        QSLIST_INSERT_HEAD(&qsp_tables, table, next);
+        g_mutex_unlock(&qsp_tables_lock);
+        qsp_thread_table = table;
+    }
+    return table;
+}
+
+/* The caller holds table->lock */
+static QSPEntry *qsp_entry_get(QSPTable *table, const char *name,
+                               const char *file, int line)
+{
+    QSPEntry key = { .name = name, .file = file, .line = line };
+    QSPEntry *e;
+
+    e = g_hash_table_lookup(table->entries, &key);
+    if (!e) {
+        e = g_new(QSPEntry, 1);
+        *e = key;
+        e->table = table;
+        g_hash_table_insert(table->entries, e, e);
+    }
+    return e;
+}
+
+int64_t qsp_clock(void)
+{
+    return get_clock();
+}
+
+void qsp_mutex_acquired(QemuMutex *mutex, const char *name,
+                        const char *file, int line, int64_t start)
+{
+    QSPTable *table = qsp_get_thread_table();
+    int64_t now = get_clock();
+    QSPEntry *e;
+
+    g_mutex_lock(&table->lock);
+    e = qsp_entry_get(table, name, file, line);
+    e->n_acqs++;
+    e->ns_wait += now - start;
+    g_mutex_unlock(&table->lock);
+
+    mutex->qsp_entry = e;
+    mutex->qsp_locked_at = now;
+}
+
+void qsp_mutex_reacquired(QemuMutex *mutex, void *entry)
+{
+    mutex->qsp_entry = entry;
+    mutex->qsp_locked_at = get_clock();
+}
+
+void qsp_mutex_released(QemuMutex *mutex)
+{
+    QSPEntry *e = mutex->qsp_entry;
+    int64_t now = get_clock();
+
+    mutex->qsp_entry = NULL;
+    g_mutex_lock(&e->table->lock);
+    e->ns_hold += now - mutex->qsp_locked_at;
+    g_mutex_unlock(&e->table->lock);
+}
+
+void qsp_enable(void)
+{
+    atomic_set(&qsp_enabled, true);
+}
+
+void qsp_disable(void)
+{
+    atomic_set(&qsp_enabled, false);
+}
+
+static void qsp_entry_reset(gpointer key, gpointer value, gpointer opaque)
+{
+    QSPEntry *e = value;
+
+    e->n_acqs = 0;
+    e->ns_wait = 0;
+    e->ns_hold = 0;
+}
+
+void qsp_reset(void)
+{
+    QSPTable *table;
+
+    g_mutex_lock(&qsp_tables_lock);
+    QSLIST_FOREACH(table, &qsp_tables, next) {
+        g_mutex_lock(&table->lock);
+        g_hash_table_foreach(table->entries, qsp_entry_reset, NULL);
+        g_mutex_unlock(&table->lock);
+    }
+    g_mutex_unlock(&qsp_tables_lock);
+}
+
+/* Sums up the entries of all threads, keyed by "name file:line" */
+static void qsp_entry_merge(gpointer key, gpointer value, gpointer opaque)
+{
+    GHashTable *merged = opaque;
+    QSPEntry *e = value;
+    QSPEntry *m;
+    char *id;
+
+    if (!e->n_acqs) {
+        return;
+    }
+    id = g_strdup_printf("%s %s:%d", e->name, e->file, e->line);
+    m = g_hash_table_lookup(merged, id);
+    if (!m) {
+        m = g_new0(QSPEntry, 1);
+        m->name = e->name;
+        m->file = e->file;
+        m->line = e->line;
+        g_hash_table_insert(merged, id, m);
+    } else {
+        g_free(id);
+    }
+    m->n_acqs += e->n_acqs;
+    m->ns_wait += e->ns_wait;
+    m->ns_hold += e->ns_hold;
+}
+
+static gint qsp_entry_cmp(gconstpointer a, gconstpointer b)
+{
+    const QSPEntry *ea = *(QSPEntry * const *)a;
+    const QSPEntry *eb = *(QSPEntry * const *)b;
+
+    if (ea->ns_wait != eb->ns_wait) {
+        return ea->ns_wait > eb->ns_wait ? -1 : 1;
+    }
+    return ea->n_acqs > eb->n_acqs ? -1 : ea->n_acqs < eb->n_acqs;
+}
+
+void qsp_report(FILE *f, fprintf_function cpu_fprintf, size_t max)
+{
+    GHashTable *merged = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, g_free);
+    GPtrArray *sorted = g_ptr_array_new();
+    GHashTableIter iter;
+    QSPTable *table;
+    gpointer value;
+    size_t i;
+
+    g_mutex_lock(&qsp_tables_lock);
+    QSLIST_FOREACH(table, &qsp_tables, next) {
+        g_mutex_lock(&table->lock);
+        g_hash_table_foreach(table->entries, qsp_entry_merge, merged);
+        g_mutex_unlock(&table->lock);
+    }
+    g_mutex_unlock(&qsp_tables_lock);
+
+    g_hash_table_iter_init(&iter, merged);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_ptr_array_add(sorted, value);
+    }
+    g_ptr_array_sort(sorted, qsp_entry_cmp);
+
+    cpu_fprintf(f, "Sync profiling is %s\n", qsp_enabled ? "on" : "off");
+    cpu_fprintf(f, "%-24s %-28s %12s %10s %12s %12s\n", "Object", "Call site",
+                "Wait (s)", "Count", "Avg wait", "Hold (s)");
+    for (i = 0; i < sorted->len && i < max; i++) {
+        QSPEntry *e = g_ptr_array_index(sorted, i);
+        const char *name = e->name[0] == '&' ? e->name + 1 : e->name;
+        const char *file = strrchr(e->file, '/');
+        char *site;
+
+        site = g_strdup_printf("%s:%d", file ? file + 1 : e->file, e->line);
+        cpu_fprintf(f, "%-24s %-28s %12.6f %10" PRIu64 " %9.2f us %12.6f\n",
+                    name, site, e->ns_wait / 1e9, e->n_acqs,
+                    e->ns_wait / 1e3 / e->n_acqs, e->ns_hold / 1e9);
+        g_free(site);
+    }
+
+    g_ptr_array_free(sorted, TRUE);
+    g_hash_table_destroy(merged);
+}
@@ -49,6 +49,9 @@ unsigned long rcu_gp_ctr = RCU_GP_LOCKED;
 QemuEvent rcu_gp_event;
 static QemuMutex rcu_gp_lock;
 
+/* Grace periods completed so far; written under rcu_gp_lock */
+static unsigned long rcu_gp_completed;
+
 /*
  * Check whether a quiescent state was crossed between the beginning of
  * update_counter_and_wait and now.
@@ -92,8 +95,10 @@ static void wait_for_readers(void)
             atomic_set(&index->waiting, true);
         }
 
-        /* ... and a smp_mb after.  */
-        smp_mb();
+        /* ... and a full barrier after, on every thread, so that the
+         * readers only need a compiler barrier if membarrier(2) is there.
+         */
+        smp_mb_global();
 
         QLIST_FOREACH_SAFE(index, &registry, node, tmp) {
             if (!rcu_gp_ongoing(&index->ctr)) {
@@ -126,7 +131,22 @@ static void wait_for_readers(void)
 
 void synchronize_rcu(void)
 {
+    unsigned long snap;
+
+    /* A grace period that starts after this point also covers the caller.
+     * The one with number rcu_gp_completed + 1 may already be running, but
+     * once the one after it is done the caller can go.  This way callers
+     * that queue up on rcu_gp_lock share one grace period instead of
+     * running one each.
+     */
+    smp_mb();
+    snap = atomic_read(&rcu_gp_completed) + 2;
+
     qemu_mutex_lock(&rcu_gp_lock);
+    if ((long)(rcu_gp_completed - snap) >= 0) {
+        qemu_mutex_unlock(&rcu_gp_lock);
+        return;
+    }
 
     if (!QLIST_EMPTY(&registry)) {
         /* In either case, the atomic_mb_set below blocks stores that free
@@ -149,6 +169,7 @@ void synchronize_rcu(void)
         wait_for_readers();
     }
 
+    atomic_mb_set(&rcu_gp_completed, rcu_gp_completed + 1);
     qemu_mutex_unlock(&rcu_gp_lock);
 }
 
@@ -163,6 +184,9 @@ static struct rcu_head *head = &dummy, **tail = &dummy.next;
 static int rcu_call_count;
 static QemuEvent rcu_call_ready_event;
 
+/* Callers of drain_call_rcu() that are waiting */
+static int rcu_call_expedited;
+
 static void enqueue(struct rcu_head *node)
 {
     struct rcu_head **old_tail;
@@ -226,7 +250,9 @@ static void *call_rcu_thread(void *opaque)
          * Fetch rcu_call_count now, we only must process elements that were
          * added before synchronize_rcu() starts.
          */
-        while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5)) {
+        while (n == 0 ||
+               (n < RCU_CALL_MIN_SIZE && ++tries <= 5 &&
+                !atomic_read(&rcu_call_expedited))) {
             g_usleep(10000);
             if (n == 0) {
                 qemu_event_reset(&rcu_call_ready_event);
@@ -270,6 +296,43 @@ void call_rcu1(struct rcu_head *node, void (*func)(struct rcu_head *node))
     qemu_event_set(&rcu_call_ready_event);
 }
 
+struct rcu_drain {
+    struct rcu_head rcu;
+    QemuEvent drain_complete_event;
+};
+
+static void drain_rcu_callback(struct rcu_head *node)
+{
+    struct rcu_drain *event = (struct rcu_drain *)node;
+
+    qemu_event_set(&event->drain_complete_event);
+}
+
+void drain_call_rcu(void)
+{
+    struct rcu_drain rcu_drain;
+    bool locked = qemu_mutex_iothread_locked();
+
+    memset(&rcu_drain, 0, sizeof(struct rcu_drain));
+    qemu_event_init(&rcu_drain.drain_complete_event, false);
+
+    /* The callbacks run under the iothread lock */
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+
+    /* The queue is FIFO, so this one runs after all those before it */
+    atomic_inc(&rcu_call_expedited);
+    call_rcu1(&rcu_drain.rcu, drain_rcu_callback);
+    qemu_event_wait(&rcu_drain.drain_complete_event);
+    atomic_dec(&rcu_call_expedited);
+
+    if (locked) {
+        qemu_mutex_lock_iothread();
+    }
+    qemu_event_destroy(&rcu_drain.drain_complete_event);
+}
+
 void rcu_register_thread(void)
 {
     assert(rcu_reader.ctr == 0);
@@ -323,6 +386,7 @@ void rcu_after_fork(void)
 
 static void __attribute__((__constructor__)) rcu_init(void)
 {
+    smp_mb_global_init();
 #ifdef CONFIG_POSIX
     pthread_atfork(rcu_init_lock, rcu_init_unlock, rcu_init_unlock);
 #endif
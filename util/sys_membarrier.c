@@ -0,0 +1,48 @@
+/*
+ * Process-wide memory barriers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/sys_membarrier.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/* From <linux/membarrier.h>, which older hosts do not have.  Only the
+ * expedited command is used; the older MEMBARRIER_CMD_SHARED waits for an
+ * RCU grace period of the kernel, which would make synchronize_rcu() take
+ * milliseconds.
+ */
+#define QEMU_MEMBARRIER_CMD_QUERY                       0
+#define QEMU_MEMBARRIER_CMD_PRIVATE_EXPEDITED           (1 << 3)
+#define QEMU_MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED  (1 << 4)
+
+bool have_sys_membarrier;
+
+void smp_mb_global(void)
+{
+#ifdef __NR_membarrier
+    if (likely(have_sys_membarrier)) {
+        syscall(__NR_membarrier, QEMU_MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+        return;
+    }
+#endif
+    smp_mb();
+}
+
+void smp_mb_global_init(void)
+{
+#ifdef __NR_membarrier
+    int ret = syscall(__NR_membarrier, QEMU_MEMBARRIER_CMD_QUERY, 0);
+
+    if (ret > 0 && (ret & QEMU_MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+        syscall(__NR_membarrier,
+                QEMU_MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0) {
+        have_sys_membarrier = true;
+    }
+#endif
+}
@@ -22,6 +22,7 @@
  * along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <math.h>
 #include "qemu/throttle.h"
 #include "qemu/timer.h"
 #include "block/aio.h"
@@ -402,6 +403,16 @@ bool throttle_schedule_timer(ThrottleState *ts,
     return true;
 }
 
+/* compute how many operations an I/O of @size bytes counts for */
+static double throttle_units(uint64_t op_size, uint64_t size)
+{
+    /* if cfg.op_size is defined and smaller than size we compute unit count */
+    if (op_size && size > op_size) {
+        return (double) size / op_size;
+    }
+    return 1.0;
+}
+
 /* do the accounting for this operation
  *
  * @is_write: the type of operation (read/write)
@@ -409,12 +420,7 @@ bool throttle_schedule_timer(ThrottleState *ts,
  */
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
 {
-    double units = 1.0;
-
-    /* if cfg.op_size is defined and smaller than size we compute unit count */
-    if (ts->cfg.op_size && size > ts->cfg.op_size) {
-        units = (double) size / ts->cfg.op_size;
-    }
+    double units = throttle_units(ts->cfg.op_size, size);
 
     ts->cfg.buckets[THROTTLE_BPS_TOTAL].level += size;
     ts->cfg.buckets[THROTTLE_OPS_TOTAL].level += units;
@@ -428,3 +434,80 @@ void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
     }
 }
 
+
+/* account in advance for a part of the room left in two buckets
+ *
+ * @total, @rw: the total bucket and the one for this type of operation
+ * @share:      the part of the room to take
+ * @ret:        the credit, or HUGE_VAL if neither bucket is limited
+ */
+static double throttle_take_room(LeakyBucket *total, LeakyBucket *rw,
+                                 double share)
+{
+    double room = HUGE_VAL;
+
+    if (total->avg) {
+        room = MIN(room, total->max - total->level);
+    }
+    if (rw->avg) {
+        room = MIN(room, rw->max - rw->level);
+    }
+    if (room == HUGE_VAL) {
+        return room;
+    }
+
+    room = MAX(room, 0) * share;
+    total->level += room;
+    rw->level += room;
+    return room;
+}
+
+/* Account @share of the room that is left in the buckets limiting @is_write
+ * operations, and add it to @credit. While the credit lasts, the caller can
+ * do I/O without looking at @ts again, and so without taking the lock that
+ * protects it. The group limits hold since the credit was accounted as if
+ * the I/O had been done already.
+ *
+ * No credit is given once the buckets are full, so throttled I/O keeps
+ * going through @ts.
+ *
+ * @is_write: the type of operation (read/write)
+ * @share:    the part of the room to take, between 0 and 1
+ * @credit:   the credit of the caller
+ */
+void throttle_take_credit(ThrottleState *ts, bool is_write, double share,
+                          ThrottleCredit *credit)
+{
+    LeakyBucket *b = ts->cfg.buckets;
+
+    if (credit->op_size != ts->cfg.op_size) {
+        credit->ops = 0;
+        credit->op_size = ts->cfg.op_size;
+    }
+
+    credit->bytes += throttle_take_room(&b[THROTTLE_BPS_TOTAL],
+                                        &b[is_write ? THROTTLE_BPS_WRITE :
+                                                      THROTTLE_BPS_READ],
+                                        share);
+    credit->ops += throttle_take_room(&b[THROTTLE_OPS_TOTAL],
+                                      &b[is_write ? THROTTLE_OPS_WRITE :
+                                                    THROTTLE_OPS_READ],
+                                      share);
+}
+
+/* Use the credit for an I/O of @size bytes, if it is large enough
+ *
+ * @ret: true if the I/O may go through without further accounting
+ */
+bool throttle_use_credit(ThrottleCredit *credit, uint64_t size)
+{
+    double units = throttle_units(credit->op_size, size);
+
+    if (credit->bytes < size || credit->ops < units) {
+        return false;
+    }
+
+    credit->bytes -= size;
+    credit->ops -= units;
+    return true;
+}
@@ -158,6 +158,8 @@ CharDriverState *virtcon_hds[MAX_VIRTIO_CONSOLES];
 CharDriverState *sclp_hds[MAX_SCLP_CONSOLES];
 int win2k_install_hack = 0;
 int singlestep = 0;
+int tcg_perfmap;
+int tcg_tb_stats;
 int smp_cpus = 1;
 int max_cpus = 0;
 int smp_cores = 1;
@@ -2351,6 +2353,14 @@ static int mon_init_func(void *opaque, QemuOpts *opts, Error **errp)
     if (qemu_opt_get_bool(opts, "pretty", 0))
         flags |= MONITOR_USE_PRETTY;
 
+    if (qemu_opt_get_bool(opts, "oob", 0)) {
+        if (!(flags & MONITOR_USE_CONTROL)) {
+            fprintf(stderr, "oob is only supported with mode=control\n");
+            exit(1);
+        }
+        flags |= MONITOR_USE_OOB;
+    }
+
     if (qemu_opt_get_bool(opts, "default", 0))
         flags |= MONITOR_IS_DEFAULT;
 
@@ -3827,6 +3837,12 @@ int main(int argc, char **argv, char **envp)
                     tcg_tb_size = 0;
                 }
                 break;
+            case QEMU_OPTION_perfmap:
+                tcg_perfmap = 1;
+                break;
+            case QEMU_OPTION_tb_stats:
+                tcg_tb_stats = 1;
+                break;
             case QEMU_OPTION_icount:
                 icount_opts = qemu_opts_parse_noisily(qemu_find_opts("icount"),
                                                       optarg, true);
@@ -4404,6 +4420,7 @@ int main(int argc, char **argv, char **envp)
         }
     }
 
+    live_vmstate_mig_init();
     blk_mig_init();
     ram_mig_init();
 
@@ -58,10 +58,14 @@ typedef struct MapCacheEntry {
     struct MapCacheEntry *next;
 } MapCacheEntry;
 
+/* One per distinct locked address; @count is the number of times it is
+ * currently locked.
+ */
 typedef struct MapCacheRev {
     uint8_t *vaddr_req;
     hwaddr paddr_index;
     hwaddr size;
+    unsigned int count;
     QTAILQ_ENTRY(MapCacheRev) next;
 } MapCacheRev;
 
@@ -69,6 +73,8 @@ typedef struct MapCache {
     MapCacheEntry *entry;
     unsigned long nr_buckets;
     QTAILQ_HEAD(map_cache_head, MapCacheRev) locked_entries;
+    /* locked_entries indexed by vaddr_req */
+    GHashTable *locked_index;
 
     /* For most cases (>99.9%), the page address is the same. */
     MapCacheEntry *last_entry;
@@ -113,6 +119,7 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
     qemu_mutex_init(&mapcache->lock);
 
     QTAILQ_INIT(&mapcache->locked_entries);
+    mapcache->locked_index = g_hash_table_new(NULL, NULL);
 
     if (geteuid() == 0) {
         rlimit_as.rlim_cur = RLIM_INFINITY;
@@ -288,12 +295,22 @@ tryagain:
 
     mapcache->last_entry = entry;
     if (lock) {
-        MapCacheRev *reventry = g_malloc0(sizeof(MapCacheRev));
+        uint8_t *vaddr_req = entry->vaddr_base + address_offset;
+        MapCacheRev *reventry = g_hash_table_lookup(mapcache->locked_index,
+                                                    vaddr_req);
         entry->lock++;
-        reventry->vaddr_req = mapcache->last_entry->vaddr_base + address_offset;
-        reventry->paddr_index = mapcache->last_entry->paddr_index;
-        reventry->size = entry->size;
-        QTAILQ_INSERT_HEAD(&mapcache->locked_entries, reventry, next);
+        if (reventry) {
+            /* a locked entry is never remapped, so this is still @entry */
+            reventry->count++;
+        } else {
+            reventry = g_malloc0(sizeof(MapCacheRev));
+            reventry->vaddr_req = vaddr_req;
+            reventry->paddr_index = entry->paddr_index;
+            reventry->size = entry->size;
+            reventry->count = 1;
+            QTAILQ_INSERT_HEAD(&mapcache->locked_entries, reventry, next);
+            g_hash_table_insert(mapcache->locked_index, vaddr_req, reventry);
+        }
     }
 
     trace_xen_map_cache_return(mapcache->last_entry->vaddr_base + address_offset);
@@ -318,18 +335,10 @@ ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
     hwaddr paddr_index;
     hwaddr size;
     ram_addr_t raddr;
-    int found = 0;
 
     mapcache_lock();
-    QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
-        if (reventry->vaddr_req == ptr) {
-            paddr_index = reventry->paddr_index;
-            size = reventry->size;
-            found = 1;
-            break;
-        }
-    }
-    if (!found) {
+    reventry = g_hash_table_lookup(mapcache->locked_index, ptr);
+    if (!reventry) {
         fprintf(stderr, "%s, could not find %p\n", __func__, ptr);
         QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
             DPRINTF("   "TARGET_FMT_plx" -> %p is present\n", reventry->paddr_index,
@@ -338,6 +347,8 @@ ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
         abort();
         return 0;
     }
+    paddr_index = reventry->paddr_index;
+    size = reventry->size;
 
     entry = &mapcache->entry[paddr_index % mapcache->nr_buckets];
     while (entry && (entry->paddr_index != paddr_index || entry->size != size)) {
@@ -360,29 +371,21 @@ static void xen_invalidate_map_cache_entry_unlocked(uint8_t *buffer)
     MapCacheRev *reventry;
     hwaddr paddr_index;
     hwaddr size;
-    int found = 0;
 
-    QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
-        if (reventry->vaddr_req == buffer) {
-            paddr_index = reventry->paddr_index;
-            size = reventry->size;
-            found = 1;
-            break;
-        }
-    }
-    if (!found) {
+    reventry = g_hash_table_lookup(mapcache->locked_index, buffer);
+    if (!reventry) {
         DPRINTF("%s, could not find %p\n", __func__, buffer);
         QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
             DPRINTF("   "TARGET_FMT_plx" -> %p is present\n", reventry->paddr_index, reventry->vaddr_req);
         }
         return;
     }
-    QTAILQ_REMOVE(&mapcache->locked_entries, reventry, next);
-    g_free(reventry);
-
-    if (mapcache->last_entry != NULL &&
-        mapcache->last_entry->paddr_index == paddr_index) {
-        mapcache->last_entry = NULL;
+    paddr_index = reventry->paddr_index;
+    size = reventry->size;
+    if (--reventry->count == 0) {
+        QTAILQ_REMOVE(&mapcache->locked_entries, reventry, next);
+        g_hash_table_remove(mapcache->locked_index, buffer);
+        g_free(reventry);
     }
 
     entry = &mapcache->entry[paddr_index % mapcache->nr_buckets];
@@ -399,6 +402,13 @@ static void xen_invalidate_map_cache_entry_unlocked(uint8_t *buffer)
         return;
     }
 
+    /* Only chained entries are freed; the bucket heads stay mapped, so
+     * last_entry can keep pointing to them and xen_map_cache() does not
+     * have to walk the bucket again after every unlock.
+     */
+    if (mapcache->last_entry == entry) {
+        mapcache->last_entry = NULL;
+    }
     pentry->next = entry->next;
     if (munmap(entry->vaddr_base, entry->size) != 0) {
         perror("unmap fails");